@@ -0,0 +1,58 @@
+/* fpconv - Floating point conversion routines
+ *
+ * Copyright (c) 2011-2012  Mark Pulford <mark@kyne.com.au>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Instead of dtoa, numbers are printed with the formatter the Lua core
+ * uses for tostring(): integers and short decimals are written out
+ * directly, only the rest goes through snprintf(). It gives exactly what
+ * "%.14g" (or "%.7g" with float numbers) would, so encoded JSON matches
+ * what Lua prints. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+#include "lobject.h"
+
+#include "fpconv.h"
+
+double fpconv_strtod(const char *nptr, char **endptr)
+{
+    return strtod(nptr, endptr);
+}
+
+/* Assumes there is always at least 32 characters available in the target buffer */
+int fpconv_g_fmt(char *str, double num, int precision)
+{
+    if (precision == FPCONV_LUA_PRECISION)
+        return luaO_num2str(str, (lua_Number)num);
+
+    if (precision < 1 || precision > 14)
+        precision = FPCONV_LUA_PRECISION;
+
+    return snprintf(str, FPCONV_G_FMT_BUFSIZE, "%.*g", precision, num);
+}
+
+/* vi:ai et sw=4 ts=4:
+ */
@@ -0,0 +1,33 @@
+/* Lua CJSON floating point conversion routines */
+
+#ifndef _FPCONV_H_
+#define _FPCONV_H_
+
+/* Buffer required to store the largest string representation of a double.
+ *
+ * Longest double printed with %.14g is 21 characters long:
+ * -1.7976931348623e+308 */
+# define FPCONV_G_FMT_BUFSIZE   32
+
+/* Significant digits Lua itself prints numbers with (LUA_NUMBER_FMT).
+ * fpconv_g_fmt() is fastest at this precision. */
+#if defined(LUA_NUMBER_FLOAT)
+# define FPCONV_LUA_PRECISION   7
+#else
+# define FPCONV_LUA_PRECISION   14
+#endif
+
+/* The C library always uses a '.' decimal point here, there is no
+ * locale to pick up. */
+static inline void fpconv_init()
+{
+    /* Do nothing - not required */
+}
+
+extern int fpconv_g_fmt(char*, double, int);
+extern double fpconv_strtod(const char*, char**);
+
+#endif
+
+/* vi:ai et sw=4 ts=4:
+ */
@@ -0,0 +1,255 @@
+// ADC1 single readings, and continuous sampling through I2S0 and its DMA
+
+#include "adc_hw.h"
+#include "esp_intr.h"
+#include "esp_attr.h"
+#include "heap_alloc_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/xtensa_api.h"
+#include "rom/lldesc.h"
+#include "soc/soc.h"
+#include "soc/saradc_reg.h"
+#include "soc/rtc_io_reg.h"
+#include "soc/i2s_reg.h"
+#include "soc/i2s_struct.h"
+#include "driver/periph_ctrl.h"
+
+#define ADC_HW_INUM         19      // level 2 CPU interrupt, the level 1 ones are all taken
+#define ADC_HW_BUFS         4       // DMA ring, one interrupt per buffer
+#define ADC_HW_I2S_CLK      160000000
+#define ADC_HW_BCK_DIV      60      // bit clock from the I2S clock
+#define ADC_HW_CLKM_A       63      // denominator of the clock divider fraction
+
+// The digital controller is in APB_CTRL, which this SDK has no header for
+#define APB_CTRL_BASE                   0x3ff66000
+#define APB_SARADC_CTRL_REG             (APB_CTRL_BASE + 0x10)
+#define APB_SARADC_DATA_TO_I2S          BIT(26)
+#define APB_SARADC_DATA_SAR_SEL         BIT(25)
+#define APB_SARADC_SAR1_PATT_P_CLEAR    BIT(23)
+#define APB_SARADC_SAR1_PATT_LEN        0xf
+#define APB_SARADC_SAR1_PATT_LEN_S      15
+#define APB_SARADC_SAR_CLK_DIV          0xff
+#define APB_SARADC_SAR_CLK_DIV_S        7
+#define APB_SARADC_SAR_SEL              BIT(5)
+#define APB_SARADC_WORK_MODE            0x3
+#define APB_SARADC_WORK_MODE_S          3
+#define APB_SARADC_CTRL2_REG            (APB_CTRL_BASE + 0x14)
+#define APB_SARADC_SAR1_INV             BIT(9)
+#define APB_SARADC_MAX_MEAS_NUM         0xff
+#define APB_SARADC_MAX_MEAS_NUM_S       1
+#define APB_SARADC_MEAS_NUM_LIMIT       BIT(0)
+#define APB_SARADC_FSM_REG              (APB_CTRL_BASE + 0x18)
+#define APB_SARADC_SAR1_PATT_TAB1_REG   (APB_CTRL_BASE + 0x1c)
+
+static const adc_hw_pad_t adc_hw_pads[ADC_HW_CHANNELS] = {
+    { 36, RTC_IO_SENSOR_PADS_REG,  RTC_IO_SENSE1_MUX_SEL, RTC_IO_SENSE1_FUN_IE, RTC_IO_SENSE1_FUN_SEL_S },
+    { 37, RTC_IO_SENSOR_PADS_REG,  RTC_IO_SENSE2_MUX_SEL, RTC_IO_SENSE2_FUN_IE, RTC_IO_SENSE2_FUN_SEL_S },
+    { 38, RTC_IO_SENSOR_PADS_REG,  RTC_IO_SENSE3_MUX_SEL, RTC_IO_SENSE3_FUN_IE, RTC_IO_SENSE3_FUN_SEL_S },
+    { 39, RTC_IO_SENSOR_PADS_REG,  RTC_IO_SENSE4_MUX_SEL, RTC_IO_SENSE4_FUN_IE, RTC_IO_SENSE4_FUN_SEL_S },
+    { 32, RTC_IO_XTAL_32K_PAD_REG, RTC_IO_X32P_MUX_SEL,   RTC_IO_X32P_FUN_IE,   RTC_IO_X32P_FUN_SEL_S },
+    { 33, RTC_IO_XTAL_32K_PAD_REG, RTC_IO_X32N_MUX_SEL,   RTC_IO_X32N_FUN_IE,   RTC_IO_X32N_FUN_SEL_S },
+    { 34, RTC_IO_ADC_PAD_REG,      RTC_IO_ADC1_MUX_SEL,   RTC_IO_ADC1_FUN_IE,   RTC_IO_ADC1_FUN_SEL_S },
+    { 35, RTC_IO_ADC_PAD_REG,      RTC_IO_ADC2_MUX_SEL,   RTC_IO_ADC2_FUN_IE,   RTC_IO_ADC2_FUN_SEL_S },
+};
+
+static portMUX_TYPE adc_hw_mux = portMUX_INITIALIZER_UNLOCKED;
+static lldesc_t adc_hw_desc[ADC_HW_BUFS];
+static uint16_t *adc_hw_bufs[ADC_HW_BUFS];
+static adc_hw_samples_fn adc_hw_fn;
+static void *adc_hw_arg;
+static volatile bool adc_hw_on;
+static bool adc_hw_intr_inited;
+
+int adc_hw_gpio(unsigned chan)
+{
+    return chan < ADC_HW_CHANNELS ? adc_hw_pads[chan].gpio : -1;
+}
+
+const adc_hw_pad_t *adc_hw_pad(unsigned chan)
+{
+    return chan < ADC_HW_CHANNELS ? &adc_hw_pads[chan] : NULL;
+}
+
+// Hand the pad to the RTC mux with its digital input off, then set the
+// channel's attenuation and 12 bits for both controllers
+static void adc_hw_setup(unsigned chan, unsigned atten)
+{
+    const adc_hw_pad_t *p = &adc_hw_pads[chan];
+    SET_PERI_REG_MASK(p->reg, p->mux_sel);
+    CLEAR_PERI_REG_MASK(p->reg, p->fun_ie);
+    SET_PERI_REG_BITS(p->reg, 3, 0, p->fun_sel_s);
+
+    SET_PERI_REG_BITS(SARADC_SAR_ATTEN1_REG, 3, atten, chan * 2);
+    SET_PERI_REG_BITS(SARADC_SAR_START_FORCE_REG, SARADC_SAR1_BIT_WIDTH, 3, SARADC_SAR1_BIT_WIDTH_S);
+    SET_PERI_REG_BITS(SARADC_SAR_READ_CTRL_REG, SARADC_SAR1_SAMPLE_BIT, 3, SARADC_SAR1_SAMPLE_BIT_S);
+    // powered up for good, and the hall sensor kept off the pads
+    SET_PERI_REG_BITS(SARADC_SAR_MEAS_WAIT2_REG, SARADC_FORCE_XPD_SAR, 3, SARADC_FORCE_XPD_SAR_S);
+    SET_PERI_REG_MASK(SARADC_SAR_TOUCH_CTRL1_REG, SARADC_XPD_HALL_FORCE | SARADC_HALL_PHASE_FORCE);
+    CLEAR_PERI_REG_MASK(RTC_IO_HALL_SENS_REG, RTC_IO_XPD_HALL);
+}
+
+int adc_hw_read(unsigned chan, unsigned atten)
+{
+    if (chan >= ADC_HW_CHANNELS || atten > ADC_HW_ATTEN_11DB)
+        return -1;
+    if (adc_hw_on)
+        return -2;
+
+    adc_hw_setup(chan, atten);
+    // software starts the RTC controller, on one pad
+    SET_PERI_REG_MASK(SARADC_SAR_READ_CTRL_REG, SARADC_SAR1_DATA_INV);
+    CLEAR_PERI_REG_MASK(SARADC_SAR_READ_CTRL_REG, SARADC_SAR1_DIG_FORCE);
+    SET_PERI_REG_MASK(SARADC_SAR_MEAS_START1_REG, SARADC_MEAS1_START_FORCE | SARADC_SAR1_EN_PAD_FORCE);
+    SET_PERI_REG_BITS(SARADC_SAR_MEAS_START1_REG, SARADC_SAR1_EN_PAD, 1 << chan, SARADC_SAR1_EN_PAD_S);
+    CLEAR_PERI_REG_MASK(SARADC_SAR_MEAS_START1_REG, SARADC_MEAS1_START_SAR);
+    SET_PERI_REG_MASK(SARADC_SAR_MEAS_START1_REG, SARADC_MEAS1_START_SAR);
+    while (!GET_PERI_REG_MASK(SARADC_SAR_MEAS_START1_REG, SARADC_MEAS1_DONE_SAR))
+        ;
+    return GET_PERI_REG_BITS2(SARADC_SAR_MEAS_START1_REG, SARADC_MEAS1_DATA_SAR, SARADC_MEAS1_DATA_SAR_S);
+}
+
+static void IRAM_ATTR adc_hw_isr(void *arg)
+{
+    uint32_t st = I2S0.int_st.val;
+    I2S0.int_clr.val = st;
+    if (!(st & I2S_IN_SUC_EOF_INT_ST))
+        return;
+
+    lldesc_t *d = (lldesc_t *)I2S0.in_eof_des_addr;
+    uint16_t *s = (uint16_t *)d->buf;
+    // The channel number is in the top 4 bits, and the FIFO hands the
+    // samples over in swapped pairs
+    for (unsigned i = 0; i < ADC_HW_BUF_SAMPLES; i += 2) {
+        uint16_t t = s[i];
+        s[i] = s[i + 1] & 0xfff;
+        s[i + 1] = t & 0xfff;
+    }
+    portENTER_CRITICAL_ISR(&adc_hw_mux);
+    adc_hw_samples_fn fn = adc_hw_on ? adc_hw_fn : NULL;
+    void *fn_arg = adc_hw_arg;
+    portEXIT_CRITICAL_ISR(&adc_hw_mux);
+    if (fn)
+        fn(s, ADC_HW_BUF_SAMPLES, fn_arg);
+}
+
+// Set the I2S clock for rate samples a second; returns the rate it gives
+static uint32_t adc_hw_clock(uint32_t rate)
+{
+    // a sample per word select, which takes two bit clocks
+    uint64_t div = (uint64_t)ADC_HW_I2S_CLK * ADC_HW_CLKM_A / ((uint64_t)rate * 2 * ADC_HW_BCK_DIV);
+    uint32_t n = div / ADC_HW_CLKM_A, b = div % ADC_HW_CLKM_A;
+    I2S0.clkm_conf.clka_en = 0;
+    I2S0.clkm_conf.clkm_div_a = ADC_HW_CLKM_A;
+    I2S0.clkm_conf.clkm_div_b = b;
+    I2S0.clkm_conf.clkm_div_num = n;
+    I2S0.sample_rate_conf.rx_bck_div_num = ADC_HW_BCK_DIV;
+    I2S0.sample_rate_conf.rx_bits_mod = 16;
+    return (uint64_t)ADC_HW_I2S_CLK * ADC_HW_CLKM_A / (div * 2 * ADC_HW_BCK_DIV);
+}
+
+int adc_hw_start(unsigned chan, unsigned atten, uint32_t rate, adc_hw_samples_fn fn, void *arg)
+{
+    if (chan >= ADC_HW_CHANNELS || atten > ADC_HW_ATTEN_11DB || !fn ||
+        rate < ADC_HW_MIN_RATE || rate > ADC_HW_MAX_RATE)
+        return -1;
+    if (adc_hw_on)
+        return -2;
+
+    for (int i = 0; i < ADC_HW_BUFS; i++) {
+        if (!adc_hw_bufs[i]) {
+            adc_hw_bufs[i] = (uint16_t *)pvPortMallocCaps(ADC_HW_BUF_SAMPLES * 2, MALLOC_CAP_DMA);
+            if (!adc_hw_bufs[i])
+                return -3;
+        }
+        lldesc_t *d = &adc_hw_desc[i];
+        d->size = d->length = ADC_HW_BUF_SAMPLES * 2;
+        d->buf = (uint8_t *)adc_hw_bufs[i];
+        d->offset = 0;
+        d->sosf = d->eof = 0;
+        d->owner = 1;
+        d->qe.stqe_next = &adc_hw_desc[(i + 1) % ADC_HW_BUFS];
+    }
+
+    adc_hw_setup(chan, atten);
+    // The digital controller runs ADC1, one pattern entry for the one
+    // channel, and passes each result to I2S
+    SET_PERI_REG_MASK(SARADC_SAR_READ_CTRL_REG, SARADC_SAR1_DIG_FORCE);
+    SET_PERI_REG_MASK(SARADC_SAR_MEAS_START1_REG, SARADC_MEAS1_START_FORCE | SARADC_SAR1_EN_PAD_FORCE);
+    WRITE_PERI_REG(APB_SARADC_SAR1_PATT_TAB1_REG, ((chan << 4) | (3 << 2) | atten) << 24);
+    SET_PERI_REG_BITS(APB_SARADC_CTRL_REG, APB_SARADC_SAR1_PATT_LEN, 0, APB_SARADC_SAR1_PATT_LEN_S);
+    SET_PERI_REG_BITS(APB_SARADC_CTRL_REG, APB_SARADC_SAR_CLK_DIV, 2, APB_SARADC_SAR_CLK_DIV_S);
+    SET_PERI_REG_BITS(APB_SARADC_CTRL_REG, APB_SARADC_WORK_MODE, 0, APB_SARADC_WORK_MODE_S);
+    CLEAR_PERI_REG_MASK(APB_SARADC_CTRL_REG, APB_SARADC_SAR_SEL | APB_SARADC_DATA_SAR_SEL);
+    SET_PERI_REG_MASK(APB_SARADC_CTRL_REG, APB_SARADC_DATA_TO_I2S);
+    // reset, start and standby waits of the controller's state machine
+    WRITE_PERI_REG(APB_SARADC_FSM_REG, (2 << 24) | (5 << 16) | (100 << 8) | 8);
+    SET_PERI_REG_BITS(APB_SARADC_CTRL2_REG, APB_SARADC_MAX_MEAS_NUM, 255, APB_SARADC_MAX_MEAS_NUM_S);
+    SET_PERI_REG_MASK(APB_SARADC_CTRL2_REG, APB_SARADC_MEAS_NUM_LIMIT | APB_SARADC_SAR1_INV);
+    SET_PERI_REG_MASK(APB_SARADC_CTRL_REG, APB_SARADC_SAR1_PATT_P_CLEAR);
+    CLEAR_PERI_REG_MASK(APB_SARADC_CTRL_REG, APB_SARADC_SAR1_PATT_P_CLEAR);
+
+    if (!adc_hw_intr_inited) {
+        periph_module_enable(PERIPH_I2S0_MODULE);
+        ESP_INTR_DISABLE(ADC_HW_INUM);
+        intr_matrix_set(xPortGetCoreID(), ETS_I2S0_INTR_SOURCE, ADC_HW_INUM);
+        xt_set_interrupt_handler(ADC_HW_INUM, adc_hw_isr, NULL);
+        ESP_INTR_ENABLE(ADC_HW_INUM);
+        adc_hw_intr_inited = true;
+    }
+
+    // I2S0 as a master receiver in LCD mode, taking 16 bit mono samples
+    I2S0.conf.rx_reset = 1;
+    I2S0.conf.rx_reset = 0;
+    I2S0.conf.rx_fifo_reset = 1;
+    I2S0.conf.rx_fifo_reset = 0;
+    I2S0.lc_conf.in_rst = 1;
+    I2S0.lc_conf.in_rst = 0;
+    I2S0.lc_conf.ahbm_rst = 1;
+    I2S0.lc_conf.ahbm_rst = 0;
+    I2S0.lc_conf.check_owner = 0;
+    I2S0.conf.rx_slave_mod = 0;
+    I2S0.conf.rx_msb_right = 1;
+    I2S0.conf.rx_right_first = 1;
+    I2S0.conf2.val = 0;
+    I2S0.conf2.lcd_en = 1;
+    I2S0.fifo_conf.dscr_en = 1;
+    I2S0.fifo_conf.rx_fifo_mod = 1;
+    I2S0.fifo_conf.rx_fifo_mod_force_en = 1;
+    I2S0.conf_chan.rx_chan_mod = 1;
+    I2S0.rx_eof_num = ADC_HW_BUF_SAMPLES / 2;   // in words
+    int actual = adc_hw_clock(rate);
+
+    portENTER_CRITICAL(&adc_hw_mux);
+    adc_hw_fn = fn;
+    adc_hw_arg = arg;
+    adc_hw_on = true;
+    portEXIT_CRITICAL(&adc_hw_mux);
+
+    I2S0.int_clr.val = 0xffffffff;
+    I2S0.int_ena.val = 0;
+    I2S0.int_ena.in_suc_eof = 1;
+    I2S0.in_link.addr = (uint32_t)adc_hw_desc & 0xfffff;
+    I2S0.in_link.start = 1;
+    I2S0.conf.rx_start = 1;
+    return actual;
+}
+
+void adc_hw_stop(void)
+{
+    if (!adc_hw_on)
+        return;
+    I2S0.conf.rx_start = 0;
+    I2S0.in_link.stop = 1;
+    I2S0.int_ena.val = 0;
+    I2S0.int_clr.val = 0xffffffff;
+    CLEAR_PERI_REG_MASK(APB_SARADC_CTRL_REG, APB_SARADC_DATA_TO_I2S);
+    portENTER_CRITICAL(&adc_hw_mux);
+    adc_hw_on = false;
+    adc_hw_fn = NULL;
+    portEXIT_CRITICAL(&adc_hw_mux);
+}
+
+bool adc_hw_running(void)
+{
+    return adc_hw_on;
+}
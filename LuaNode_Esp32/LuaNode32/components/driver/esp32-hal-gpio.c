@@ -70,6 +70,8 @@ const uint8_t esp32_gpioToFn[40] = {
 
 typedef void (*voidFuncPtr)(void);
 static voidFuncPtr __pinInterruptHandlers[GPIO_PIN_COUNT] = {0,};
+static voidFuncPtrArg __pinInterruptArgHandlers[GPIO_PIN_COUNT] = {0,};
+static void *__pinInterruptArgs[GPIO_PIN_COUNT] = {0,};
 
 extern void IRAM_ATTR __pinMode(uint8_t pin, uint8_t mode)
 {
@@ -168,6 +170,8 @@ static void IRAM_ATTR __onPinInterrupt(void *arg)
             if(gpio_intr_status_l & ((uint32_t)1 << pin)) {
                 if(__pinInterruptHandlers[pin]) {
                     __pinInterruptHandlers[pin]();
+                } else if(__pinInterruptArgHandlers[pin]) {
+                    __pinInterruptArgHandlers[pin](__pinInterruptArgs[pin]);
                 }
             }
         } while(++pin<32);
@@ -178,26 +182,30 @@ static void IRAM_ATTR __onPinInterrupt(void *arg)
             if(gpio_intr_status_h & ((uint32_t)1 << (pin - 32))) {
                 if(__pinInterruptHandlers[pin]) {
                     __pinInterruptHandlers[pin]();
+                } else if(__pinInterruptArgHandlers[pin]) {
+                    __pinInterruptArgHandlers[pin](__pinInterruptArgs[pin]);
                 }
             }
         } while(++pin<GPIO_PIN_COUNT);
     }
 }
 
-extern void __attachInterrupt(uint8_t pin, voidFuncPtr userFunc, int intr_type)
+static int __interruptCore = 0;
+
+static void __enableInterrupt(uint8_t pin, int intr_type)
 {
     static bool interrupt_initialized = false;
-    static int core_id = 0;
+    int core_id;
     
     if(!interrupt_initialized) {
         interrupt_initialized = true;
-        core_id = xPortGetCoreID();
+        __interruptCore = xPortGetCoreID();
         ESP_INTR_DISABLE(ETS_GPIO_INUM);
-        intr_matrix_set(core_id, ETS_GPIO_INTR_SOURCE, ETS_GPIO_INUM);
+        intr_matrix_set(__interruptCore, ETS_GPIO_INTR_SOURCE, ETS_GPIO_INUM);
         xt_set_interrupt_handler(ETS_GPIO_INUM, &__onPinInterrupt, NULL);
         ESP_INTR_ENABLE(ETS_GPIO_INUM);
     }
-    __pinInterruptHandlers[pin] = userFunc;
+    core_id = __interruptCore;
     ESP_INTR_DISABLE(ETS_GPIO_INUM);
     if(core_id) { //APP_CPU
         GPIO.pin[pin].int_ena = 1;
@@ -208,9 +216,32 @@ extern void __attachInterrupt(uint8_t pin, voidFuncPtr userFunc, int intr_type)
     ESP_INTR_ENABLE(ETS_GPIO_INUM);
 }
 
+extern void __attachInterrupt(uint8_t pin, voidFuncPtr userFunc, int intr_type)
+{
+    __pinInterruptArgHandlers[pin] = NULL;
+    __pinInterruptHandlers[pin] = userFunc;
+    __enableInterrupt(pin, intr_type);
+}
+
+extern void __attachInterruptArg(uint8_t pin, voidFuncPtrArg userFunc, void *arg, int intr_type)
+{
+    __pinInterruptHandlers[pin] = NULL;
+    __pinInterruptArgs[pin] = arg;
+    __pinInterruptArgHandlers[pin] = userFunc;
+    __enableInterrupt(pin, intr_type);
+}
+
+// Change the trigger of an attached pin; DISABLED masks it. Safe from the
+// interrupt handler.
+extern void IRAM_ATTR __setInterruptType(uint8_t pin, int intr_type)
+{
+    GPIO.pin[pin].int_type = intr_type;
+}
+
 extern void __detachInterrupt(uint8_t pin)
 {
     __pinInterruptHandlers[pin] = NULL;
+    __pinInterruptArgHandlers[pin] = NULL;
     ESP_INTR_DISABLE(ETS_GPIO_INUM);
     GPIO.pin[pin].int_ena = 0;
     GPIO.pin[pin].int_type = 0;
@@ -223,4 +254,6 @@ extern void digitalWrite(uint8_t pin, uint8_t val) __attribute__ ((weak, alias("
 extern int digitalRead(uint8_t pin) __attribute__ ((weak, alias("__digitalRead")));
 extern void attachInterrupt(uint8_t pin, voidFuncPtr handler, int mode) __attribute__ ((weak, alias("__attachInterrupt")));
 extern void detachInterrupt(uint8_t pin) __attribute__ ((weak, alias("__detachInterrupt")));
+extern void attachInterruptArg(uint8_t pin, voidFuncPtrArg handler, void *arg, int mode) __attribute__ ((weak, alias("__attachInterruptArg")));
+extern void setInterruptType(uint8_t pin, int mode) __attribute__ ((weak, alias("__setInterruptType")));
 
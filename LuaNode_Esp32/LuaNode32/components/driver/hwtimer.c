@@ -0,0 +1,117 @@
+// Microsecond alarms on the timer group 0 hardware timers
+
+#include "hwtimer.h"
+#include "esp_intr.h"
+#include "esp_attr.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/xtensa_api.h"
+#include "soc/soc.h"
+#include "soc/timer_group_struct.h"
+#include "driver/periph_ctrl.h"
+
+#define HWTIMER_INUM        18      // level 1 CPU interrupt, unused by the SDK
+#define HWTIMER_DIVIDER     80      // 1 us ticks from the 80 MHz APB clock
+
+typedef struct {
+    hwtimer_fn fn;
+    void *arg;
+    bool repeat;
+    volatile bool running;
+} hwtimer_t;
+
+static portMUX_TYPE hwtimer_mux = portMUX_INITIALIZER_UNLOCKED;
+static hwtimer_t hwtimers[HWTIMER_NUM];
+static bool hwtimer_inited;
+
+static void IRAM_ATTR hwtimer_isr(void *arg)
+{
+    uint32_t status = TIMERG0.int_st_timers.val;
+    TIMERG0.int_clr_timers.val = status & ((1 << HWTIMER_NUM) - 1);
+    for (unsigned id = 0; id < HWTIMER_NUM; id++) {
+        if (!(status & (1 << id)))
+            continue;
+        hwtimer_t *t = &hwtimers[id];
+        hwtimer_fn fn = NULL;
+        void *fn_arg = NULL;
+        portENTER_CRITICAL_ISR(&hwtimer_mux);
+        if (t->running) {
+            // The counter has been reloaded, only the alarm needs rearming
+            if (t->repeat) {
+                TIMERG0.hw_timer[id].config.alarm_en = 1;
+            } else {
+                TIMERG0.hw_timer[id].config.enable = 0;
+                t->running = false;
+            }
+            fn = t->fn;
+            fn_arg = t->arg;
+        }
+        portEXIT_CRITICAL_ISR(&hwtimer_mux);
+        if (fn)
+            fn(id, fn_arg);
+    }
+}
+
+static void hwtimer_init(void)
+{
+    periph_module_enable(PERIPH_TIMG0_MODULE);
+    ESP_INTR_DISABLE(HWTIMER_INUM);
+    intr_matrix_set(xPortGetCoreID(), ETS_TG0_T0_LEVEL_INTR_SOURCE, HWTIMER_INUM);
+    intr_matrix_set(xPortGetCoreID(), ETS_TG0_T1_LEVEL_INTR_SOURCE, HWTIMER_INUM);
+    xt_set_interrupt_handler(HWTIMER_INUM, hwtimer_isr, NULL);
+    ESP_INTR_ENABLE(HWTIMER_INUM);
+    hwtimer_inited = true;
+}
+
+int hwtimer_start(unsigned id, uint32_t period_us, bool repeat, hwtimer_fn fn, void *arg)
+{
+    if (id >= HWTIMER_NUM || period_us < HWTIMER_MIN_US)
+        return -1;
+    if (hwtimers[id].running)
+        return -2;
+    if (!hwtimer_inited)
+        hwtimer_init();
+
+    portENTER_CRITICAL(&hwtimer_mux);
+    hwtimer_t *t = &hwtimers[id];
+    t->fn = fn;
+    t->arg = arg;
+    t->repeat = repeat;
+    t->running = true;
+
+    TIMERG0.hw_timer[id].config.enable = 0;
+    TIMERG0.hw_timer[id].config.divider = HWTIMER_DIVIDER;
+    TIMERG0.hw_timer[id].config.increase = 1;
+    TIMERG0.hw_timer[id].config.autoreload = 1;
+    TIMERG0.hw_timer[id].config.edge_int_en = 0;
+    TIMERG0.hw_timer[id].config.level_int_en = 1;
+    // Count up from 0, going off and starting over at period_us
+    TIMERG0.hw_timer[id].load_high = 0;
+    TIMERG0.hw_timer[id].load_low = 0;
+    TIMERG0.hw_timer[id].reload = 1;
+    TIMERG0.hw_timer[id].alarm_high = 0;
+    TIMERG0.hw_timer[id].alarm_low = period_us;
+    TIMERG0.int_clr_timers.val = 1 << id;
+    TIMERG0.int_ena.val |= 1 << id;
+    TIMERG0.hw_timer[id].config.alarm_en = 1;
+    TIMERG0.hw_timer[id].config.enable = 1;
+    portEXIT_CRITICAL(&hwtimer_mux);
+    return 0;
+}
+
+void hwtimer_stop(unsigned id)
+{
+    if (id >= HWTIMER_NUM || !hwtimer_inited)
+        return;
+    portENTER_CRITICAL(&hwtimer_mux);
+    TIMERG0.hw_timer[id].config.enable = 0;
+    TIMERG0.hw_timer[id].config.alarm_en = 0;
+    TIMERG0.int_ena.val &= ~(1 << id);
+    TIMERG0.int_clr_timers.val = 1 << id;
+    hwtimers[id].running = false;
+    portEXIT_CRITICAL(&hwtimer_mux);
+}
+
+bool hwtimer_busy(unsigned id)
+{
+    return id < HWTIMER_NUM && hwtimers[id].running;
+}
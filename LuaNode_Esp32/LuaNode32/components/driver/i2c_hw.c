@@ -0,0 +1,303 @@
+// I2C master transactions run by the I2C controllers' command lists
+
+#include "i2c_hw.h"
+#include "esp_intr.h"
+#include "esp_attr.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/xtensa_api.h"
+#include "soc/soc.h"
+#include "soc/dport_reg.h"
+#include "soc/i2c_reg.h"
+#include "soc/i2c_struct.h"
+#include "soc/gpio_sig_map.h"
+#include "driver/periph_ctrl.h"
+#include "driver/gpio.h"
+#include "esp32-hal-gpio.h"
+#include "esp32-hal-matrix.h"
+
+#define I2C_HW_INUM         9       // level 1 CPU interrupt, unused by the SDK
+#define I2C_HW_FIFO         32      // bytes in each of the TX and RX FIFOs
+#define I2C_HW_TOUT         0xfffff // APB cycles SCL may be stretched, ~13 ms
+#define I2C_HW_INTS         (I2C_END_DETECT_INT_ENA | I2C_TRANS_COMPLETE_INT_ENA | \
+                             I2C_ACK_ERR_INT_ENA | I2C_TIME_OUT_INT_ENA | \
+                             I2C_ARBITRATION_LOST_INT_ENA)
+
+enum { CMD_RSTART, CMD_WRITE, CMD_READ, CMD_STOP, CMD_END };
+
+// Where the running transaction has got to
+enum { STAGE_START, STAGE_TX, STAGE_RESTART, STAGE_RX, STAGE_STOP, STAGE_DONE };
+
+typedef struct {
+    i2c_dev_t *hw;
+    periph_module_t module;
+    uint32_t rst;
+    int intr_source;
+    uint8_t scl_sig, sda_sig;
+    bool inited;
+    uint16_t half;          // APB cycles per SCL half period
+    uint8_t stage;
+    uint8_t rx_chunk;       // bytes the running command list reads
+    size_t tx_pos, rx_pos;
+    uint8_t head, tail, count;
+    i2c_hw_trans_t q[I2C_HW_QUEUE_LEN];
+} i2c_hw_port_t;
+
+static i2c_hw_port_t i2c_hw_ports[I2C_HW_PORTS] = {
+    { &I2C0, PERIPH_I2C0_MODULE, DPORT_I2C_EXT0_RST, ETS_I2C_EXT0_INTR_SOURCE,
+      I2CEXT0_SCL_OUT_IDX, I2CEXT0_SDA_OUT_IDX },
+    { &I2C1, PERIPH_I2C1_MODULE, DPORT_I2C_EXT1_RST, ETS_I2C_EXT1_INTR_SOURCE,
+      I2CEXT1_SCL_OUT_IDX, I2CEXT1_SDA_OUT_IDX },
+};
+
+static portMUX_TYPE i2c_hw_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool i2c_hw_intr_inited;
+
+static i2c_hw_port_t *i2c_hw_port(int id)
+{
+    return id >= 0 && id < I2C_HW_PORTS ? &i2c_hw_ports[id] : NULL;
+}
+
+// Reset the controller and program it as a master at the port's clock;
+// also how a bus error is got out of
+static void IRAM_ATTR i2c_hw_config(i2c_hw_port_t *p)
+{
+    i2c_dev_t *hw = p->hw;
+    uint32_t t = p->half / 2 > 1023 ? 1023 : p->half / 2;
+    uint32_t edge = p->half > 1023 ? 1023 : p->half;
+
+    SET_PERI_REG_MASK(DPORT_PERIP_RST_EN_REG, p->rst);
+    CLEAR_PERI_REG_MASK(DPORT_PERIP_RST_EN_REG, p->rst);
+
+    hw->ctr.val = 0;
+    hw->ctr.ms_mode = 1;
+    hw->ctr.sda_force_out = 1;
+    hw->ctr.scl_force_out = 1;
+    hw->ctr.clk_en = 1;
+    hw->timeout.tout = I2C_HW_TOUT;
+    hw->fifo_conf.val = 0;
+    hw->fifo_conf.tx_fifo_rst = 1;
+    hw->fifo_conf.rx_fifo_rst = 1;
+    hw->fifo_conf.tx_fifo_rst = 0;
+    hw->fifo_conf.rx_fifo_rst = 0;
+
+    hw->scl_low_period.scl_low_period = p->half;
+    hw->scl_high_period.period = p->half;
+    hw->scl_start_hold.time = edge;
+    hw->scl_rstart_setup.time = edge;
+    hw->scl_stop_hold.time = edge;
+    hw->scl_stop_setup.time = edge;
+    hw->sda_hold.time = t;
+    hw->sda_sample.time = t;
+
+    hw->int_clr.val = 0xffffffff;
+    hw->int_ena.val = I2C_HW_INTS;
+}
+
+static inline void IRAM_ATTR i2c_hw_cmd(i2c_dev_t *hw, int idx, int op, int bytes, bool nack, bool check)
+{
+    hw->command[idx].val = bytes | check << 8 | nack << 10 | op << 11;
+}
+
+// The stage after everything to write has gone
+static inline uint8_t i2c_hw_after_tx(const i2c_hw_trans_t *t)
+{
+    return t->rx_len ? STAGE_RESTART : STAGE_STOP;
+}
+
+// Fill the command list and TX FIFO with as much of the running transaction
+// as they take, ending in END to be called back for more, and start it
+static void IRAM_ATTR i2c_hw_run(i2c_hw_port_t *p)
+{
+    i2c_dev_t *hw = p->hw;
+    const i2c_hw_trans_t *t = &p->q[p->tail];
+    size_t room = I2C_HW_FIFO, n;
+    int c = 0;
+    bool more = true;
+
+    hw->fifo_conf.tx_fifo_rst = 1;
+    hw->fifo_conf.tx_fifo_rst = 0;
+    p->rx_chunk = 0;
+    while (more) {
+        switch (p->stage) {
+        case STAGE_START:       // address for writing and what of tx fits
+        case STAGE_TX:
+            if (room == 0) {
+                more = false;
+                break;
+            }
+            if (p->stage == STAGE_START) {
+                i2c_hw_cmd(hw, c++, CMD_RSTART, 0, false, false);
+                hw->fifo_data.val = t->addr << 1;
+                room--;
+            }
+            n = t->tx_len - p->tx_pos;
+            if (n > room)
+                n = room;
+            for (size_t i = 0; i < n; i++)
+                hw->fifo_data.val = t->tx[p->tx_pos + i];
+            i2c_hw_cmd(hw, c++, CMD_WRITE, n + (p->stage == STAGE_START), false, true);
+            room -= n;
+            p->tx_pos += n;
+            p->stage = p->tx_pos < t->tx_len ? STAGE_TX : i2c_hw_after_tx(t);
+            break;
+        case STAGE_RESTART:     // address for reading
+            if (room == 0) {
+                more = false;
+                break;
+            }
+            i2c_hw_cmd(hw, c++, CMD_RSTART, 0, false, false);
+            hw->fifo_data.val = t->addr << 1 | 1;
+            i2c_hw_cmd(hw, c++, CMD_WRITE, 1, false, true);
+            room--;
+            p->stage = STAGE_RX;
+            break;
+        case STAGE_RX:          // one FIFO full, the last byte NACKed
+            n = t->rx_len - p->rx_pos;
+            if (n > I2C_HW_FIFO) {
+                n = I2C_HW_FIFO;
+                i2c_hw_cmd(hw, c++, CMD_READ, n, false, false);
+                more = false;
+            } else {
+                if (n > 1)
+                    i2c_hw_cmd(hw, c++, CMD_READ, n - 1, false, false);
+                i2c_hw_cmd(hw, c++, CMD_READ, 1, true, false);
+                p->stage = STAGE_STOP;
+            }
+            p->rx_chunk = n;
+            break;
+        case STAGE_STOP:
+            i2c_hw_cmd(hw, c++, CMD_STOP, 0, false, false);
+            p->stage = STAGE_DONE;
+            more = false;
+            break;
+        }
+    }
+    if (p->stage != STAGE_DONE)
+        i2c_hw_cmd(hw, c, CMD_END, 0, false, false);
+    hw->int_clr.val = 0xffffffff;
+    hw->ctr.trans_start = 1;
+}
+
+// Begin the transaction at the tail of the queue
+static void IRAM_ATTR i2c_hw_start(i2c_hw_port_t *p)
+{
+    const i2c_hw_trans_t *t = &p->q[p->tail];
+    p->tx_pos = p->rx_pos = 0;
+    p->stage = t->tx_len || !t->rx_len ? STAGE_START : STAGE_RESTART;
+    p->hw->fifo_conf.rx_fifo_rst = 1;
+    p->hw->fifo_conf.rx_fifo_rst = 0;
+    i2c_hw_run(p);
+}
+
+static void IRAM_ATTR i2c_hw_isr(void *arg)
+{
+    for (int i = 0; i < I2C_HW_PORTS; i++) {
+        i2c_hw_port_t *p = &i2c_hw_ports[i];
+        if (!p->inited)
+            continue;
+        uint32_t st = p->hw->int_status.val;
+        if (!st)
+            continue;
+        p->hw->int_clr.val = st;
+
+        i2c_hw_done_fn done = NULL;
+        void *done_arg = NULL;
+        int err = I2C_HW_OK;
+        bool finished = false;
+        portENTER_CRITICAL_ISR(&i2c_hw_mux);
+        if (p->count) {
+            i2c_hw_trans_t *t = &p->q[p->tail];
+            if (st & I2C_ACK_ERR_INT_ST)
+                err = I2C_HW_NACK;
+            else if (st & I2C_TIME_OUT_INT_ST)
+                err = I2C_HW_TIMEOUT;
+            else if (st & I2C_ARBITRATION_LOST_INT_ST)
+                err = I2C_HW_ARB_LOST;
+            if (err) {
+                // drop whatever is left of the command list
+                i2c_hw_config(p);
+                finished = true;
+            } else if (st & (I2C_END_DETECT_INT_ST | I2C_TRANS_COMPLETE_INT_ST)) {
+                for (int n = 0; n < p->rx_chunk; n++)
+                    t->rx[p->rx_pos++] = p->hw->fifo_data.data;
+                if (p->stage == STAGE_DONE)
+                    finished = true;
+                else
+                    i2c_hw_run(p);
+            }
+            if (finished) {
+                done = t->done;
+                done_arg = t->arg;
+                p->tail = (p->tail + 1) % I2C_HW_QUEUE_LEN;
+                if (--p->count)
+                    i2c_hw_start(p);
+            }
+        }
+        portEXIT_CRITICAL_ISR(&i2c_hw_mux);
+        if (done)
+            done(err, done_arg);
+    }
+}
+
+uint32_t i2c_hw_setup(int id, int sda, int scl, uint32_t hz)
+{
+    i2c_hw_port_t *p = i2c_hw_port(id);
+    if (!p || p->count || hz == 0)
+        return 0;
+
+    uint32_t half = APB_CLK_FREQ / hz / 2;
+    if (half < 8)
+        half = 8;
+    if (half > 16383)
+        half = 16383;
+
+    if (!p->inited)
+        periph_module_enable(p->module);
+
+    pinMode(sda, OUTPUT_OPEN_DRAIN);
+    gpio_set_pull_mode(sda, GPIO_PULLUP_ONLY);
+    pinMatrixOutAttach(sda, p->sda_sig, false, false);
+    pinMatrixInAttach(sda, p->sda_sig, false);
+    pinMode(scl, OUTPUT_OPEN_DRAIN);
+    gpio_set_pull_mode(scl, GPIO_PULLUP_ONLY);
+    pinMatrixOutAttach(scl, p->scl_sig, false, false);
+    pinMatrixInAttach(scl, p->scl_sig, false);
+
+    ESP_INTR_DISABLE(I2C_HW_INUM);
+    p->half = half;
+    i2c_hw_config(p);
+    intr_matrix_set(xPortGetCoreID(), p->intr_source, I2C_HW_INUM);
+    if (!i2c_hw_intr_inited) {
+        xt_set_interrupt_handler(I2C_HW_INUM, i2c_hw_isr, NULL);
+        i2c_hw_intr_inited = true;
+    }
+    p->inited = true;
+    ESP_INTR_ENABLE(I2C_HW_INUM);
+    return APB_CLK_FREQ / (2 * half);
+}
+
+int i2c_hw_queue(int id, const i2c_hw_trans_t *t)
+{
+    i2c_hw_port_t *p = i2c_hw_port(id);
+    if (!p || !p->inited || t->addr > 0x7f)
+        return -1;
+
+    int res = 0;
+    portENTER_CRITICAL(&i2c_hw_mux);
+    if (p->count == I2C_HW_QUEUE_LEN) {
+        res = -2;
+    } else {
+        p->q[p->head] = *t;
+        p->head = (p->head + 1) % I2C_HW_QUEUE_LEN;
+        if (p->count++ == 0)
+            i2c_hw_start(p);
+    }
+    portEXIT_CRITICAL(&i2c_hw_mux);
+    return res;
+}
+
+bool i2c_hw_busy(int id)
+{
+    i2c_hw_port_t *p = i2c_hw_port(id);
+    return p && p->count;
+}
@@ -0,0 +1,172 @@
+// I2S1 transmitting 16 bit stereo from a DMA ring
+
+#include "i2s_hw.h"
+#include "esp_intr.h"
+#include "esp_attr.h"
+#include "heap_alloc_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/xtensa_api.h"
+#include "rom/lldesc.h"
+#include "soc/soc.h"
+#include "soc/i2s_reg.h"
+#include "soc/i2s_struct.h"
+#include "soc/gpio_sig_map.h"
+#include "driver/periph_ctrl.h"
+#include "esp32-hal-gpio.h"
+#include "esp32-hal-matrix.h"
+#include <string.h>
+
+#define I2S_HW_INUM         21      // level 2 CPU interrupt, the level 1 ones are all taken
+#define I2S_HW_I2S_CLK      160000000
+#define I2S_HW_BCK_DIV      4       // bit clock from the I2S clock
+#define I2S_HW_CLKM_A       63      // denominator of the clock divider fraction
+#define I2S_HW_BUF_BYTES    (I2S_HW_BUF_FRAMES * 4)
+
+static portMUX_TYPE i2s_hw_mux = portMUX_INITIALIZER_UNLOCKED;
+static lldesc_t i2s_hw_desc[I2S_HW_BUFS];
+static uint32_t *i2s_hw_bufs[I2S_HW_BUFS];
+static i2s_hw_pins_t i2s_hw_pins;
+static i2s_hw_done_fn i2s_hw_fn;
+static void *i2s_hw_arg;
+static volatile bool i2s_hw_on;
+static bool i2s_hw_intr_inited;
+
+static void IRAM_ATTR i2s_hw_isr(void *arg)
+{
+    uint32_t st = I2S1.int_st.val;
+    I2S1.int_clr.val = st;
+    if (!(st & I2S_OUT_EOF_INT_ST))
+        return;
+
+    lldesc_t *d = (lldesc_t *)I2S1.out_eof_des_addr;
+    uint32_t *frames = (uint32_t *)d->buf;
+    memset(frames, 0, I2S_HW_BUF_BYTES);
+    portENTER_CRITICAL_ISR(&i2s_hw_mux);
+    i2s_hw_done_fn fn = i2s_hw_on ? i2s_hw_fn : NULL;
+    void *fn_arg = i2s_hw_arg;
+    portEXIT_CRITICAL_ISR(&i2s_hw_mux);
+    if (fn)
+        fn(frames, fn_arg);
+}
+
+// Set the I2S clock for rate frames a second; returns the rate it gives
+static uint32_t i2s_hw_clock(uint32_t rate)
+{
+    // 32 bit clocks a frame, 16 each side
+    uint64_t div = (uint64_t)I2S_HW_I2S_CLK * I2S_HW_CLKM_A / ((uint64_t)rate * 32 * I2S_HW_BCK_DIV);
+    uint32_t n = div / I2S_HW_CLKM_A, b = div % I2S_HW_CLKM_A;
+    I2S1.clkm_conf.clka_en = 0;
+    I2S1.clkm_conf.clkm_div_a = I2S_HW_CLKM_A;
+    I2S1.clkm_conf.clkm_div_b = b;
+    I2S1.clkm_conf.clkm_div_num = n;
+    I2S1.sample_rate_conf.tx_bck_div_num = I2S_HW_BCK_DIV;
+    I2S1.sample_rate_conf.tx_bits_mod = 16;
+    return (uint64_t)I2S_HW_I2S_CLK * I2S_HW_CLKM_A / (div * 32 * I2S_HW_BCK_DIV);
+}
+
+int i2s_hw_start(const i2s_hw_pins_t *pins, uint32_t rate, i2s_hw_done_fn fn, void *arg)
+{
+    if (!fn || rate < I2S_HW_MIN_RATE || rate > I2S_HW_MAX_RATE ||
+        pins->bck_pin < 0 || pins->ws_pin < 0 || pins->data_pin < 0)
+        return -1;
+    if (i2s_hw_on)
+        return -2;
+
+    for (int i = 0; i < I2S_HW_BUFS; i++) {
+        if (!i2s_hw_bufs[i]) {
+            i2s_hw_bufs[i] = (uint32_t *)pvPortMallocCaps(I2S_HW_BUF_BYTES, MALLOC_CAP_DMA);
+            if (!i2s_hw_bufs[i])
+                return -3;
+        }
+        memset(i2s_hw_bufs[i], 0, I2S_HW_BUF_BYTES);
+        lldesc_t *d = &i2s_hw_desc[i];
+        d->size = d->length = I2S_HW_BUF_BYTES;
+        d->buf = (uint8_t *)i2s_hw_bufs[i];
+        d->offset = 0;
+        d->sosf = 0;
+        d->eof = 1;             // an interrupt at the end of each
+        d->owner = 1;
+        d->qe.stqe_next = &i2s_hw_desc[(i + 1) % I2S_HW_BUFS];
+    }
+
+    if (!i2s_hw_intr_inited) {
+        periph_module_enable(PERIPH_I2S1_MODULE);
+        ESP_INTR_DISABLE(I2S_HW_INUM);
+        intr_matrix_set(xPortGetCoreID(), ETS_I2S1_INTR_SOURCE, I2S_HW_INUM);
+        xt_set_interrupt_handler(I2S_HW_INUM, i2s_hw_isr, NULL);
+        ESP_INTR_ENABLE(I2S_HW_INUM);
+        i2s_hw_intr_inited = true;
+    }
+
+    i2s_hw_pins = *pins;
+    pinMode(pins->bck_pin, OUTPUT);
+    pinMode(pins->ws_pin, OUTPUT);
+    pinMode(pins->data_pin, OUTPUT);
+    pinMatrixOutAttach(pins->bck_pin, I2S1O_BCK_OUT_IDX, false, false);
+    pinMatrixOutAttach(pins->ws_pin, I2S1O_WS_OUT_IDX, false, false);
+    pinMatrixOutAttach(pins->data_pin, I2S1O_DATA_OUT23_IDX, false, false);
+
+    // I2S1 as a master transmitter of Philips format frames, 16 bit
+    // samples in both halves of a word
+    I2S1.conf.tx_reset = 1;
+    I2S1.conf.tx_reset = 0;
+    I2S1.conf.tx_fifo_reset = 1;
+    I2S1.conf.tx_fifo_reset = 0;
+    I2S1.lc_conf.out_rst = 1;
+    I2S1.lc_conf.out_rst = 0;
+    I2S1.lc_conf.ahbm_rst = 1;
+    I2S1.lc_conf.ahbm_rst = 0;
+    I2S1.lc_conf.check_owner = 0;
+    I2S1.lc_conf.out_eof_mode = 1;
+    I2S1.conf.tx_slave_mod = 0;
+    I2S1.conf.tx_msb_shift = 1;
+    I2S1.conf.tx_short_sync = 0;
+    I2S1.conf.tx_mono = 0;
+    I2S1.conf.tx_msb_right = 0;
+    I2S1.conf.tx_right_first = 0;
+    I2S1.conf1.tx_pcm_bypass = 1;
+    I2S1.conf2.val = 0;
+    I2S1.pdm_conf.tx_pdm_en = 0;
+    I2S1.pdm_conf.pcm2pdm_conv_en = 0;
+    I2S1.fifo_conf.dscr_en = 1;
+    I2S1.fifo_conf.tx_fifo_mod = 0;
+    I2S1.fifo_conf.tx_fifo_mod_force_en = 1;
+    I2S1.conf_chan.tx_chan_mod = 0;
+    int actual = i2s_hw_clock(rate);
+
+    portENTER_CRITICAL(&i2s_hw_mux);
+    i2s_hw_fn = fn;
+    i2s_hw_arg = arg;
+    i2s_hw_on = true;
+    portEXIT_CRITICAL(&i2s_hw_mux);
+
+    I2S1.int_clr.val = 0xffffffff;
+    I2S1.int_ena.val = 0;
+    I2S1.int_ena.out_eof = 1;
+    I2S1.out_link.addr = (uint32_t)i2s_hw_desc & 0xfffff;
+    I2S1.out_link.start = 1;
+    I2S1.conf.tx_start = 1;
+    return actual;
+}
+
+void i2s_hw_stop(void)
+{
+    if (!i2s_hw_on)
+        return;
+    I2S1.conf.tx_start = 0;
+    I2S1.out_link.stop = 1;
+    I2S1.int_ena.val = 0;
+    I2S1.int_clr.val = 0xffffffff;
+    portENTER_CRITICAL(&i2s_hw_mux);
+    i2s_hw_on = false;
+    i2s_hw_fn = NULL;
+    portEXIT_CRITICAL(&i2s_hw_mux);
+    pinMatrixOutDetach(i2s_hw_pins.bck_pin, false, false);
+    pinMatrixOutDetach(i2s_hw_pins.ws_pin, false, false);
+    pinMatrixOutDetach(i2s_hw_pins.data_pin, false, false);
+}
+
+bool i2s_hw_running(void)
+{
+    return i2s_hw_on;
+}
@@ -0,0 +1,74 @@
+#ifndef _ADC_HW_H_
+#define _ADC_HW_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * ADC1, 12 bits. Single readings go through the RTC controller and wait
+ * for the conversion; continuous sampling has the digital controller feed
+ * I2S0, whose DMA fills a ring of buffers and takes an interrupt per
+ * buffer. ADC2 is left alone, the WiFi driver uses it.
+ */
+
+#define ADC_HW_CHANNELS     8       /* GPIO36-39, 32-35 */
+
+enum {
+    ADC_HW_ATTEN_0DB,               /* full scale about 1.1 V */
+    ADC_HW_ATTEN_2_5DB,             /* 1.5 V */
+    ADC_HW_ATTEN_6DB,               /* 2.2 V */
+    ADC_HW_ATTEN_11DB,              /* 3.9 V, clipped at the supply */
+};
+
+/* Sample rates continuous mode can run at; slower ones need decimating */
+#define ADC_HW_MIN_RATE     6000
+#define ADC_HW_MAX_RATE     200000
+
+/* Samples handed over per interrupt */
+#define ADC_HW_BUF_SAMPLES  256
+
+/*
+ * Called from the I2S interrupt with the samples of one buffer, in order
+ * and masked to 12 bits. They are overwritten once the DMA comes round
+ * again, a few buffers later.
+ */
+typedef void (*adc_hw_samples_fn)(const uint16_t *samples, size_t n, void *arg);
+
+/* GPIO of chan, or -1 */
+int adc_hw_gpio(unsigned chan);
+
+/* Analog function of a channel's pad */
+typedef struct {
+    uint8_t gpio;
+    uint32_t reg;
+    uint32_t mux_sel;
+    uint32_t fun_ie;
+    uint8_t fun_sel_s;
+} adc_hw_pad_t;
+
+/*
+ * The pad of chan, or NULL. For code that does its own readings where it
+ * can't call in here, such as a deep sleep wake stub.
+ */
+const adc_hw_pad_t *adc_hw_pad(unsigned chan);
+
+/*
+ * One reading of chan. Returns 0-4095, -1 for a bad channel or attenuation,
+ * or -2 while continuous sampling runs.
+ */
+int adc_hw_read(unsigned chan, unsigned atten);
+
+/*
+ * Sample chan continuously at about rate per second. Returns the rate the
+ * clock dividers give, -1 for bad arguments, -2 if already running or -3
+ * if the DMA buffers can't be had.
+ */
+int adc_hw_start(unsigned chan, unsigned atten, uint32_t rate, adc_hw_samples_fn fn, void *arg);
+
+/* No buffers are handed to fn after this */
+void adc_hw_stop(void);
+
+bool adc_hw_running(void);
+
+#endif
@@ -39,6 +39,11 @@ typedef enum {
     PERIPH_PWM3_MODULE,
     PERIPH_UHCI0_MODULE,
     PERIPH_UHCI1_MODULE,
+    PERIPH_RMT_MODULE,
+    PERIPH_HSPI_MODULE,
+    PERIPH_VSPI_MODULE,
+    PERIPH_SPI_DMA_MODULE,
+    PERIPH_PCNT_MODULE,
 } periph_module_t;
 
 /**
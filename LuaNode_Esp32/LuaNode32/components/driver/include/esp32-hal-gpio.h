@@ -59,7 +59,11 @@ void pinMode(uint8_t pin, uint8_t mode);
 void digitalWrite(uint8_t pin, uint8_t val);
 int digitalRead(uint8_t pin);
 
+typedef void (*voidFuncPtrArg)(void *);
+
 void attachInterrupt(uint8_t pin, void (*)(void), int mode);
+void attachInterruptArg(uint8_t pin, voidFuncPtrArg handler, void *arg, int mode);
+void setInterruptType(uint8_t pin, int mode);
 void detachInterrupt(uint8_t pin);
 
 #ifdef __cplusplus
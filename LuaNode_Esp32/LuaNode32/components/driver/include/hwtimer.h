@@ -0,0 +1,35 @@
+#ifndef _HWTIMER_H_
+#define _HWTIMER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Microsecond alarms on the two timers of timer group 0. They count the
+ * 80 MHz APB clock divided down to 1 MHz, so they don't care about the CPU
+ * frequency or the FreeRTOS tick.
+ */
+
+#define HWTIMER_NUM 2
+
+/* Shortest period, the interrupt can't keep up with much less */
+#define HWTIMER_MIN_US 10
+
+/* Called from the timer interrupt, so it must be in IRAM and brief */
+typedef void (*hwtimer_fn)(unsigned id, void *arg);
+
+/*
+ * Go off period_us from now, and every period_us after that if repeat.
+ * The alarm is reloaded by the hardware, so a periodic timer doesn't drift
+ * however late its interrupt is served. Returns 0, -1 for a bad id or
+ * period, or -2 if the timer is already running.
+ */
+int hwtimer_start(unsigned id, uint32_t period_us, bool repeat, hwtimer_fn fn, void *arg);
+
+/* Stop the timer. An interrupt already being served on the other core
+ * may still call its callback once. */
+void hwtimer_stop(unsigned id);
+
+bool hwtimer_busy(unsigned id);
+
+#endif
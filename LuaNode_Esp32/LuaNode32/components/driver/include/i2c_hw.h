@@ -0,0 +1,54 @@
+#ifndef _I2C_HW_H_
+#define _I2C_HW_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * I2C master on the two I2C controllers. A transaction writes, reads, or
+ * writes then reads after a repeated start, and runs from the controller's
+ * interrupt 32 bytes at a time; transactions are queued per bus and run
+ * back to back, so the caller never waits on the bus.
+ */
+
+#define I2C_HW_PORTS        2
+
+/* Transactions that can wait per bus, including the running one */
+#define I2C_HW_QUEUE_LEN    8
+
+/* Results passed to done */
+#define I2C_HW_OK           0
+#define I2C_HW_NACK         -1      /* address or data byte not acknowledged */
+#define I2C_HW_TIMEOUT      -3      /* SCL held low too long */
+#define I2C_HW_ARB_LOST     -4      /* another master, or a stuck SDA */
+
+/* Called from the I2C interrupt once a transaction has finished */
+typedef void (*i2c_hw_done_fn)(int err, void *arg);
+
+typedef struct {
+    uint8_t addr;           /* 7 bit */
+    const uint8_t *tx;      /* sent first, tx_len bytes */
+    size_t tx_len;
+    uint8_t *rx;            /* then rx_len bytes read into it */
+    size_t rx_len;          /* with neither, only the address is sent */
+    i2c_hw_done_fn done;
+    void *arg;
+} i2c_hw_trans_t;
+
+/*
+ * Route the bus to the given pins, open drain with the internal pull-ups,
+ * and set the SCL clock. Returns the clock actually used, or 0 for a bad
+ * bus or one that is busy.
+ */
+uint32_t i2c_hw_setup(int id, int sda, int scl, uint32_t hz);
+
+/*
+ * Queue a transaction; the buffers must stay valid until done is called.
+ * Returns 0, -1 if the bus is not set up, or -2 if the queue is full.
+ */
+int i2c_hw_queue(int id, const i2c_hw_trans_t *t);
+
+bool i2c_hw_busy(int id);
+
+#endif
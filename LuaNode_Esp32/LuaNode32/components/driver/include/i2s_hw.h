@@ -0,0 +1,47 @@
+#ifndef _I2S_HW_H_
+#define _I2S_HW_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * I2S1 as a master transmitter of 16 bit stereo frames, for an external
+ * DAC or amplifier with an I2S input. DMA plays a ring of buffers and
+ * takes an interrupt per buffer, handing the one just played back to be
+ * refilled. I2S0 is left to the ADC's continuous sampling, so the
+ * built-in DAC, which only I2S0 can feed, isn't driven from here.
+ */
+
+#define I2S_HW_BUFS         4       /* DMA ring */
+#define I2S_HW_BUF_FRAMES   256     /* left and right 16 bit samples each */
+
+/* Sample rates the clock dividers reach */
+#define I2S_HW_MIN_RATE     8000
+#define I2S_HW_MAX_RATE     96000
+
+typedef struct {
+    int bck_pin, ws_pin, data_pin;
+} i2s_hw_pins_t;
+
+/*
+ * Called from the interrupt with a buffer that has been played, as
+ * I2S_HW_BUF_FRAMES words, left sample in the high half. It has been
+ * zeroed, so silence plays unless it's refilled before the DMA comes
+ * round to it again, I2S_HW_BUFS - 1 buffers later.
+ */
+typedef void (*i2s_hw_done_fn)(uint32_t *frames, void *arg);
+
+/*
+ * Start playing, silence at first, at about rate frames a second. Returns
+ * the rate the clock dividers give, -1 for bad arguments, -2 if already
+ * playing or -3 if the DMA buffers can't be had.
+ */
+int i2s_hw_start(const i2s_hw_pins_t *pins, uint32_t rate, i2s_hw_done_fn fn, void *arg);
+
+/* Stop and let go of the pins; fn isn't called after this */
+void i2s_hw_stop(void);
+
+bool i2s_hw_running(void);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef _LEDC_FADE_H_
+#define _LEDC_FADE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Duty fades on the eight high speed LEDC channels. A fade is a list of
+ * keyframes, each ramping the duty to a target over some milliseconds; the
+ * LEDC steps the duty by itself and only the end of a keyframe takes an
+ * interrupt, to load the next one.
+ */
+
+#define LEDC_FADE_CHANNELS  8
+
+/* Keyframes per fade */
+#define LEDC_FADE_MAX_KEYS  16
+
+typedef struct {
+    uint32_t duty;          /* in counter ticks, up to 2^bit_num of the channel's timer */
+    uint32_t ms;            /* 0 jumps straight to duty */
+} ledc_fade_key_t;
+
+/* Called from the LEDC interrupt once the last keyframe has been reached */
+typedef void (*ledc_fade_done_fn)(unsigned chan, void *arg);
+
+/*
+ * Start fading chan from its current duty through the keyframes, which are
+ * copied. The channel must be set up with its timer running. With repeat
+ * the keyframes start over after the last one and done is never called.
+ * Returns 0, -1 for a bad channel or keyframe count, or -2 if the channel
+ * is already fading.
+ */
+int ledc_fade_start(unsigned chan, const ledc_fade_key_t *keys, unsigned num,
+                    bool repeat, ledc_fade_done_fn done, void *arg);
+
+/*
+ * Stop a fade where it is, leaving the duty it had reached. Returns the arg
+ * it was started with, or NULL if the channel wasn't fading; done won't be
+ * called for it any more.
+ */
+void *ledc_fade_stop(unsigned chan);
+
+bool ledc_fade_busy(unsigned chan);
+
+/* Duty of chan right now, in counter ticks */
+uint32_t ledc_fade_get_duty(unsigned chan);
+
+/* Resolution of chan's timer; duties go from 0 to 2^bits */
+unsigned ledc_fade_bits(unsigned chan);
+
+#endif
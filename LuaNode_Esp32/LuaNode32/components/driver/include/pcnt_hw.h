@@ -0,0 +1,72 @@
+#ifndef _PCNT_HW_H_
+#define _PCNT_HW_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * The pulse counter: eight units, each counting the edges of a pulse input
+ * up or down in hardware, optionally steered by a control input, with a
+ * glitch filter in front. The 16 bit hardware count runs between -limit
+ * and limit; each time it gets there it starts again from 0 and the
+ * interrupt carries the limit over into a 64 bit total.
+ */
+
+#define PCNT_HW_UNITS       8
+#define PCNT_HW_MAX_LIMIT   32767
+/* The filter counts APB cycles, 12.5 ns each, up to 1023 of them */
+#define PCNT_HW_MAX_FILTER  1023
+
+/* What an edge of the pulse input does */
+enum {
+    PCNT_HW_KEEP,
+    PCNT_HW_INC,
+    PCNT_HW_DEC,
+};
+
+/* What a level of the control input does to the edge modes */
+enum {
+    PCNT_HW_CTRL_KEEP,              /* as set */
+    PCNT_HW_CTRL_REVERSE,           /* up counts down and the other way */
+    PCNT_HW_CTRL_HOLD,              /* edges are ignored */
+};
+
+typedef struct {
+    int pulse_pin;
+    int ctrl_pin;                   /* -1 for none */
+    uint8_t pos_mode, neg_mode;     /* PCNT_HW_KEEP, _INC or _DEC */
+    uint8_t ctrl_high, ctrl_low;    /* PCNT_HW_CTRL_ */
+    uint16_t filter;                /* APB cycles a level must last, 0 off */
+    uint16_t limit;                 /* 1 to PCNT_HW_MAX_LIMIT */
+} pcnt_hw_config_t;
+
+/*
+ * Called from the interrupt each time unit's count reaches the limit one
+ * way or the other, with the total as it now is
+ */
+typedef void (*pcnt_hw_limit_fn)(unsigned unit, int64_t total, void *arg);
+
+/*
+ * Set unit up from c and start it counting from 0. fn may be NULL.
+ * Returns 0, or -1 for a bad unit or configuration.
+ */
+int pcnt_hw_setup(unsigned unit, const pcnt_hw_config_t *c, pcnt_hw_limit_fn fn, void *arg);
+
+/* Stop unit and let go of its pins; fn isn't called after this */
+void pcnt_hw_release(unsigned unit);
+
+/* Pulses counted since setup or the last clear, up ones less down ones */
+int64_t pcnt_hw_count(unsigned unit);
+
+void pcnt_hw_clear(unsigned unit);
+
+/* A paused unit ignores its inputs and keeps its count */
+void pcnt_hw_pause(unsigned unit, bool pause);
+
+/*
+ * Move unit's limit, which has the hardware count fold into the total and
+ * start again from 0. An edge in the instant that takes may be missed.
+ */
+void pcnt_hw_set_limit(unsigned unit, uint16_t limit);
+
+#endif
@@ -170,6 +170,7 @@ void pwm_start(void);
   */
 
 bool pwm_exist(uint8 channel);
+int8 pwm_get_channel(uint8 channel);
 uint16 pwm_get_freq(uint8 channel);
 void pwm_set_freq(uint16 freq, uint8 channel);
 bool pwm_add(uint8 channel);
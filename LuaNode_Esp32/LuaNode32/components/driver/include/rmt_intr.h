@@ -0,0 +1,30 @@
+#ifndef _RMT_INTR_H_
+#define _RMT_INTR_H_
+
+#include <stdint.h>
+
+/*
+ * The RMT has a single interrupt for its eight channels. Drivers that each
+ * own a channel register a handler here and are called with the status
+ * bits of that channel only.
+ */
+
+#define RMT_INTR_CHANNELS   8
+
+#define RMT_INTR_TX_END(ch) (1 << ((ch) * 3))
+#define RMT_INTR_ERR(ch)    (1 << ((ch) * 3 + 2))
+#define RMT_INTR_TX_THR(ch) (1 << (24 + (ch)))
+
+/* Called from the RMT interrupt; the bits have already been cleared */
+typedef void (*rmt_intr_fn)(uint32_t status, void *arg);
+
+/*
+ * Handle the interrupts of channel ch; the driver still enables the ones it
+ * wants in RMT.int_ena. The first call powers up the RMT, with the channel
+ * memory addressed directly and wrapping round for transmissions longer
+ * than it. A channel that puts an end marker in its memory is unaffected
+ * by the wrapping.
+ */
+void rmt_intr_attach(unsigned ch, rmt_intr_fn fn, void *arg);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef _SPI_DMA_H_
+#define _SPI_DMA_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Full duplex SPI master on HSPI or VSPI, moving data with the SPI DMA
+ * engine. Transfers are queued per bus and run back to back from the
+ * transfer-done interrupt, so the caller never waits on the busy bit.
+ */
+
+#define SPI_DMA_HSPI        2
+#define SPI_DMA_VSPI        3
+
+/* Longest single transfer, 16 DMA descriptors of 4092 bytes */
+#define SPI_DMA_MAX_LEN     (16 * 4092)
+
+/* Transfers that can wait per bus, including the running one */
+#define SPI_DMA_QUEUE_LEN   8
+
+/* Called from the SPI interrupt once a transfer has finished */
+typedef void (*spi_dma_done_fn)(void *arg);
+
+typedef struct {
+    const uint8_t *tx;      /* DRAM, or NULL for a read-only transfer */
+    uint8_t *rx;            /* word aligned DRAM with len rounded up to 4
+                               bytes of room, or NULL to discard */
+    size_t len;             /* bytes */
+    spi_dma_done_fn done;
+    void *arg;
+} spi_dma_trans_t;
+
+/*
+ * Route the bus to the given pins (-1 leaves one out) and set SPI mode
+ * 0-3 and the clock. Returns the clock actually used, or 0 for a bad bus.
+ */
+uint32_t spi_dma_setup(int host, int sclk, int mosi, int miso, int cs,
+                       int mode, uint32_t hz);
+
+/*
+ * Queue a transfer; the buffers must stay valid until done is called.
+ * Returns 0, -1 if the bus is not set up or the length is out of range,
+ * or -2 if the queue is full.
+ */
+int spi_dma_queue(int host, const spi_dma_trans_t *t);
+
+bool spi_dma_busy(int host);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef _WAVEFORM_H_
+#define _WAVEFORM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Pulse train output on one pin, timed by the RMT peripheral instead of
+ * the CPU. Every entry of a delay table holds the pin at one level for
+ * that many microseconds, starting at first_level and toggling between
+ * entries, like gpio.serout().
+ */
+
+/* Level slots of RMT memory; an entry takes one slot per started 32767 us.
+ * Channels 6 and 7 of the memory are left to ws2812. */
+#define WAVEFORM_MAX_SLOTS 767
+
+/* Called from the RMT interrupt once the waveform has finished */
+typedef void (*waveform_done_fn)(void *arg);
+
+/*
+ * Start playing delays_us on pin, loops times (0 repeats until
+ * waveform_stop()). Returns 0, -1 if the table doesn't fit into the RMT
+ * memory, or -2 if a waveform is already playing.
+ */
+int waveform_start(uint8_t pin, uint8_t first_level, const uint32_t *delays_us,
+                   size_t n, uint32_t loops, waveform_done_fn done, void *arg);
+
+/* Stop playback early. The done callback is not called. */
+void waveform_stop(void);
+
+bool waveform_busy(void);
+
+#endif
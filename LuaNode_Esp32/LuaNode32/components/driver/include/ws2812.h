@@ -0,0 +1,30 @@
+#ifndef _WS2812_H_
+#define _WS2812_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * WS2812 style LED strips on RMT channel 6. The bytes of a frame are turned
+ * into RMT items half a memory block ahead of the transmitter, from the RMT
+ * interrupt, so a frame can be any length. One frame can wait behind the
+ * one being sent and goes out right after it.
+ */
+
+/* Called from the RMT interrupt once a frame has gone out, latch included */
+typedef void (*ws2812_done_fn)(void *arg);
+
+/* Send frames on pin from now on */
+void ws2812_init(uint8_t pin);
+
+/*
+ * Send len bytes, in the order the strip wants them. data must stay valid
+ * until done is called. Returns 0, -1 before ws2812_init() or for an empty
+ * frame, or -2 if a frame is being sent and another one is waiting.
+ */
+int ws2812_write(const uint8_t *data, size_t len, ws2812_done_fn done, void *arg);
+
+bool ws2812_busy(void);
+
+#endif
@@ -0,0 +1,213 @@
+// Keyframed duty fades run by the LEDC high speed channels
+
+#include "ledc_fade.h"
+#include "esp_intr.h"
+#include "esp_attr.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/xtensa_api.h"
+#include "soc/soc.h"
+#include "driver/ledc.h"
+
+#define LEDC_FADE_INUM      8       // level 1 CPU interrupt, unused by the SDK
+#define LEDC_FADE_FIELD_MAX 1023    // duty_num, duty_cycle and duty_scale are 10 bits
+
+// A keyframe as the channel registers want it
+typedef struct {
+    uint32_t duty;          // starting duty, 4 fraction bits
+    uint32_t conf1;         // direction, steps, cycles per step and step size
+} ledc_fade_reg_t;
+
+typedef struct {
+    ledc_fade_reg_t first;  // keyframe 0 from the duty the fade started at
+    ledc_fade_reg_t regs[LEDC_FADE_MAX_KEYS];   // keyframe 0 from the last one
+    uint32_t target;        // duty of the last keyframe
+    unsigned num;
+    unsigned key;
+    bool repeat;
+    volatile bool running;
+    ledc_fade_done_fn done;
+    void *arg;
+} ledc_fade_t;
+
+static portMUX_TYPE ledc_fade_mux = portMUX_INITIALIZER_UNLOCKED;
+static ledc_fade_t fades[LEDC_FADE_CHANNELS];
+static bool ledc_fade_inited;
+
+#define CHAN(c) (LEDC.channel_group[LEDC_HIGH_SPEED_MODE].channel[c])
+
+static inline void IRAM_ATTR ledc_fade_load(unsigned chan, const ledc_fade_reg_t *reg)
+{
+    CHAN(chan).duty.duty = reg->duty;
+    CHAN(chan).conf1.val = reg->conf1 | LEDC_DUTY_START_HSCH0;
+    CHAN(chan).conf0.sig_out_en = 1;
+}
+
+// Sets the duty with no ramp and no interrupt
+static inline void IRAM_ATTR ledc_fade_settle(unsigned chan, uint32_t duty)
+{
+    LEDC.int_ena.val &= ~BIT(LEDC_DUTY_CHNG_END_HSCH0_INT_ENA_S + chan);
+    ledc_fade_reg_t reg = {
+        .duty = duty << 4,
+        .conf1 = (1 << LEDC_DUTY_INC_HSCH0_S) | (1 << LEDC_DUTY_NUM_HSCH0_S) | (1 << LEDC_DUTY_CYCLE_HSCH0_S),
+    };
+    ledc_fade_load(chan, &reg);
+}
+
+static void IRAM_ATTR ledc_fade_isr(void *arg)
+{
+    uint32_t status = LEDC.int_st.val >> LEDC_DUTY_CHNG_END_HSCH0_INT_ST_S;
+    status &= (1 << LEDC_FADE_CHANNELS) - 1;
+    LEDC.int_clr.val = status << LEDC_DUTY_CHNG_END_HSCH0_INT_CLR_S;
+    for (unsigned chan = 0; chan < LEDC_FADE_CHANNELS; chan++) {
+        if (!(status & (1 << chan)))
+            continue;
+        ledc_fade_t *f = &fades[chan];
+        ledc_fade_done_fn done = NULL;
+        void *done_arg = NULL;
+        portENTER_CRITICAL_ISR(&ledc_fade_mux);
+        if (f->running) {
+            if (++f->key < f->num) {
+                ledc_fade_load(chan, &f->regs[f->key]);
+            } else if (f->repeat) {
+                f->key = 0;
+                ledc_fade_load(chan, &f->regs[0]);
+            } else {
+                // The ramp may stop short of the target by less than a step
+                ledc_fade_settle(chan, f->target);
+                f->running = false;
+                done = f->done;
+                done_arg = f->arg;
+            }
+        }
+        portEXIT_CRITICAL_ISR(&ledc_fade_mux);
+        if (done)
+            done(chan, done_arg);
+    }
+}
+
+static void ledc_fade_init(void)
+{
+    periph_module_enable(PERIPH_LEDC_MODULE);
+    ESP_INTR_DISABLE(LEDC_FADE_INUM);
+    intr_matrix_set(xPortGetCoreID(), ETS_LEDC_INTR_SOURCE, LEDC_FADE_INUM);
+    xt_set_interrupt_handler(LEDC_FADE_INUM, ledc_fade_isr, NULL);
+    ESP_INTR_ENABLE(LEDC_FADE_INUM);
+    ledc_fade_inited = true;
+}
+
+static uint32_t ledc_fade_min(uint32_t a, uint32_t b)
+{
+    return a < b ? a : b;
+}
+
+// Registers for ramping from from to to over cycles PWM periods. The
+// hardware adds scale every cycle periods, num times, so the step size is
+// chosen to fit the fade into the 10 bit fields.
+static void ledc_fade_calc(ledc_fade_reg_t *reg, uint32_t from, uint32_t to, uint32_t cycles)
+{
+    uint32_t inc = to >= from;
+    uint32_t delta = inc ? to - from : from - to;
+    uint32_t num, cycle, scale;
+
+    if (cycles == 0) {
+        // jump
+        from = to;
+        num = cycle = 1;
+        scale = 0;
+    } else if (delta == 0) {
+        // hold, the steps only count the time
+        cycle = ledc_fade_min(cycles, LEDC_FADE_FIELD_MAX);
+        num = ledc_fade_min((cycles + cycle - 1) / cycle, LEDC_FADE_FIELD_MAX);
+        scale = 0;
+    } else {
+        num = ledc_fade_min(ledc_fade_min(delta, cycles), LEDC_FADE_FIELD_MAX);
+        scale = ledc_fade_min((delta + num - 1) / num, LEDC_FADE_FIELD_MAX);
+        num = ledc_fade_min(delta / scale, LEDC_FADE_FIELD_MAX);
+        cycle = cycles / num;
+        if (cycle < 1)
+            cycle = 1;
+        else if (cycle > LEDC_FADE_FIELD_MAX)
+            cycle = LEDC_FADE_FIELD_MAX;
+    }
+    reg->duty = from << 4;
+    reg->conf1 = (inc << LEDC_DUTY_INC_HSCH0_S) | (num << LEDC_DUTY_NUM_HSCH0_S) |
+                 (cycle << LEDC_DUTY_CYCLE_HSCH0_S) | (scale << LEDC_DUTY_SCALE_HSCH0_S);
+}
+
+int ledc_fade_start(unsigned chan, const ledc_fade_key_t *keys, unsigned num,
+                    bool repeat, ledc_fade_done_fn done, void *arg)
+{
+    if (chan >= LEDC_FADE_CHANNELS || num == 0 || num > LEDC_FADE_MAX_KEYS)
+        return -1;
+    if (fades[chan].running)
+        return -2;
+    if (!ledc_fade_inited)
+        ledc_fade_init();
+
+    uint32_t freq = ledc_get_freq(LEDC_HIGH_SPEED_MODE, CHAN(chan).conf0.timer_sel);
+    uint32_t max = 1 << ledc_fade_bits(chan);
+    ledc_fade_t *f = &fades[chan];
+    uint32_t from = ledc_fade_get_duty(chan);
+    for (unsigned i = 0; i < num; i++) {
+        uint32_t to = ledc_fade_min(keys[i].duty, max);
+        uint32_t cycles = (uint64_t)keys[i].ms * freq / 1000;
+        if (keys[i].ms && !cycles)
+            cycles = 1;
+        ledc_fade_calc(&f->regs[i], from, to, cycles);
+        if (i == 0)
+            f->first = f->regs[0];
+        from = to;
+    }
+    if (repeat) {
+        // Going round again starts from the last keyframe's duty
+        uint32_t cycles = (uint64_t)keys[0].ms * freq / 1000;
+        if (keys[0].ms && !cycles)
+            cycles = 1;
+        ledc_fade_calc(&f->regs[0], from, ledc_fade_min(keys[0].duty, max), cycles);
+    }
+
+    portENTER_CRITICAL(&ledc_fade_mux);
+    f->target = from;
+    f->num = num;
+    f->key = 0;
+    f->repeat = repeat;
+    f->done = done;
+    f->arg = arg;
+    f->running = true;
+    LEDC.int_clr.val = BIT(LEDC_DUTY_CHNG_END_HSCH0_INT_CLR_S + chan);
+    LEDC.int_ena.val |= BIT(LEDC_DUTY_CHNG_END_HSCH0_INT_ENA_S + chan);
+    ledc_fade_load(chan, &f->first);
+    portEXIT_CRITICAL(&ledc_fade_mux);
+    return 0;
+}
+
+void *ledc_fade_stop(unsigned chan)
+{
+    if (chan >= LEDC_FADE_CHANNELS)
+        return NULL;
+    void *arg = NULL;
+    portENTER_CRITICAL(&ledc_fade_mux);
+    ledc_fade_t *f = &fades[chan];
+    if (f->running) {
+        ledc_fade_settle(chan, ledc_fade_get_duty(chan));
+        f->running = false;
+        arg = f->arg;
+    }
+    portEXIT_CRITICAL(&ledc_fade_mux);
+    return arg;
+}
+
+bool ledc_fade_busy(unsigned chan)
+{
+    return chan < LEDC_FADE_CHANNELS && fades[chan].running;
+}
+
+uint32_t ledc_fade_get_duty(unsigned chan)
+{
+    return CHAN(chan).duty_rd.duty_read >> 4;
+}
+
+unsigned ledc_fade_bits(unsigned chan)
+{
+    return LEDC.timer_group[LEDC_HIGH_SPEED_MODE].timer[CHAN(chan).conf0.timer_sel].conf.bit_num;
+}
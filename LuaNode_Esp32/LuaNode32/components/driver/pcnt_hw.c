@@ -0,0 +1,212 @@
+// Pulse counter units, with the 16 bit counts carried over into 64 bit totals
+
+#include "pcnt_hw.h"
+#include "esp_intr.h"
+#include "esp_attr.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/xtensa_api.h"
+#include "soc/soc.h"
+#include "soc/pcnt_struct.h"
+#include "soc/gpio_sig_map.h"
+#include "driver/periph_ctrl.h"
+#include "esp32-hal-gpio.h"
+#include "esp32-hal-matrix.h"
+
+#define PCNT_HW_INUM        20      // level 2 CPU interrupt, the level 1 ones are all taken
+
+// Latched in status_unit[] by the event that raised the interrupt
+#define PCNT_STATUS_L_LIM   BIT(4)
+#define PCNT_STATUS_H_LIM   BIT(5)
+
+typedef struct {
+    bool used;
+    uint16_t limit;
+    volatile int64_t carried;       // counts the hardware has started over from
+    pcnt_hw_limit_fn fn;
+    void *arg;
+} pcnt_hw_unit_t;
+
+static portMUX_TYPE pcnt_hw_mux = portMUX_INITIALIZER_UNLOCKED;
+static pcnt_hw_unit_t units[PCNT_HW_UNITS];
+static bool pcnt_hw_inited;
+
+// Units 0-4 have their matrix signals in one run, 5-7 in another
+static uint8_t pulse_sig(unsigned unit)
+{
+    return unit < 5 ? PCNT_SIG_CH0_IN0_IDX + unit * 4 : PCNT_SIG_CH0_IN5_IDX + (unit - 5) * 4;
+}
+
+static uint8_t ctrl_sig(unsigned unit)
+{
+    return unit < 5 ? PCNT_CTRL_CH0_IN0_IDX + unit * 4 : PCNT_CTRL_CH0_IN5_IDX + (unit - 5) * 4;
+}
+
+static void IRAM_ATTR pcnt_hw_isr(void *arg)
+{
+    uint32_t st = PCNT.int_st.val;
+    PCNT.int_clr.val = st;
+    for (unsigned unit = 0; unit < PCNT_HW_UNITS; unit++) {
+        if (!(st & (1 << unit)))
+            continue;
+        pcnt_hw_unit_t *u = &units[unit];
+        uint32_t status = PCNT.status_unit[unit];
+        portENTER_CRITICAL_ISR(&pcnt_hw_mux);
+        if (status & PCNT_STATUS_H_LIM)
+            u->carried += u->limit;
+        else if (status & PCNT_STATUS_L_LIM)
+            u->carried -= u->limit;
+        int64_t total = u->carried + (int16_t)PCNT.cnt_unit[unit].cnt_val;
+        pcnt_hw_limit_fn fn = u->used ? u->fn : NULL;
+        void *fn_arg = u->arg;
+        portEXIT_CRITICAL_ISR(&pcnt_hw_mux);
+        if (fn)
+            fn(unit, total, fn_arg);
+    }
+}
+
+static void pcnt_hw_init(void)
+{
+    periph_module_enable(PERIPH_PCNT_MODULE);
+    PCNT.int_ena.val = 0;
+    PCNT.int_clr.val = 0xff;
+    ESP_INTR_DISABLE(PCNT_HW_INUM);
+    intr_matrix_set(xPortGetCoreID(), ETS_PCNT_INTR_SOURCE, PCNT_HW_INUM);
+    xt_set_interrupt_handler(PCNT_HW_INUM, pcnt_hw_isr, NULL);
+    ESP_INTR_ENABLE(PCNT_HW_INUM);
+    pcnt_hw_inited = true;
+}
+
+// A limit reached whose interrupt is still to come leaves the count started
+// over without the total knowing yet
+static inline bool carry_pending(unsigned unit)
+{
+    return PCNT.int_raw.val & PCNT.int_ena.val & BIT(unit);
+}
+
+static void pcnt_hw_reset(unsigned unit)
+{
+    PCNT.ctrl.val |= BIT(unit * 2);
+    PCNT.ctrl.val &= ~BIT(unit * 2);
+}
+
+int pcnt_hw_setup(unsigned unit, const pcnt_hw_config_t *c, pcnt_hw_limit_fn fn, void *arg)
+{
+    if (unit >= PCNT_HW_UNITS || c->pulse_pin < 0 || c->limit == 0 ||
+        c->limit > PCNT_HW_MAX_LIMIT || c->filter > PCNT_HW_MAX_FILTER ||
+        c->pos_mode > PCNT_HW_DEC || c->neg_mode > PCNT_HW_DEC ||
+        c->ctrl_high > PCNT_HW_CTRL_HOLD || c->ctrl_low > PCNT_HW_CTRL_HOLD)
+        return -1;
+    if (!pcnt_hw_inited)
+        pcnt_hw_init();
+    pcnt_hw_release(unit);
+
+    pinMode(c->pulse_pin, INPUT);
+    pinMatrixInAttach(c->pulse_pin, pulse_sig(unit), false);
+    if (c->ctrl_pin >= 0) {
+        pinMode(c->ctrl_pin, INPUT);
+        pinMatrixInAttach(c->ctrl_pin, ctrl_sig(unit), false);
+    } else {
+        pinMatrixInDetach(ctrl_sig(unit), false, false);   // held low
+    }
+
+    // Channel 1 is left counting nothing
+    PCNT.conf_unit[unit].conf0.val = 0;
+    PCNT.conf_unit[unit].conf0.filter_thres = c->filter;
+    PCNT.conf_unit[unit].conf0.filter_en = c->filter != 0;
+    PCNT.conf_unit[unit].conf0.thr_h_lim_en = 1;
+    PCNT.conf_unit[unit].conf0.thr_l_lim_en = 1;
+    PCNT.conf_unit[unit].conf0.ch0_pos_mode = c->pos_mode;
+    PCNT.conf_unit[unit].conf0.ch0_neg_mode = c->neg_mode;
+    PCNT.conf_unit[unit].conf0.ch0_hctrl_mode = c->ctrl_high;
+    PCNT.conf_unit[unit].conf0.ch0_lctrl_mode = c->ctrl_low;
+    PCNT.conf_unit[unit].conf2.cnt_h_lim = c->limit;
+    PCNT.conf_unit[unit].conf2.cnt_l_lim = (uint16_t)-(int16_t)c->limit;
+
+    portENTER_CRITICAL(&pcnt_hw_mux);
+    pcnt_hw_unit_t *u = &units[unit];
+    u->used = true;
+    u->limit = c->limit;
+    u->carried = 0;
+    u->fn = fn;
+    u->arg = arg;
+    pcnt_hw_reset(unit);
+    PCNT.ctrl.val &= ~BIT(unit * 2 + 1);
+    PCNT.int_clr.val = BIT(unit);
+    PCNT.int_ena.val |= BIT(unit);
+    portEXIT_CRITICAL(&pcnt_hw_mux);
+    return 0;
+}
+
+void pcnt_hw_release(unsigned unit)
+{
+    if (unit >= PCNT_HW_UNITS || !units[unit].used)
+        return;
+    pcnt_hw_unit_t *u = &units[unit];
+    portENTER_CRITICAL(&pcnt_hw_mux);
+    PCNT.int_ena.val &= ~BIT(unit);
+    PCNT.ctrl.val |= BIT(unit * 2 + 1);
+    u->used = false;
+    u->fn = NULL;
+    portEXIT_CRITICAL(&pcnt_hw_mux);
+    pinMatrixInDetach(pulse_sig(unit), false, false);
+    pinMatrixInDetach(ctrl_sig(unit), false, false);
+}
+
+int64_t pcnt_hw_count(unsigned unit)
+{
+    if (unit >= PCNT_HW_UNITS)
+        return 0;
+    pcnt_hw_unit_t *u = &units[unit];
+    int64_t total;
+    for (;;) {
+        portENTER_CRITICAL(&pcnt_hw_mux);
+        int16_t cnt = PCNT.cnt_unit[unit].cnt_val;
+        bool pending = carry_pending(unit);
+        total = u->carried + cnt;
+        portEXIT_CRITICAL(&pcnt_hw_mux);
+        if (!pending)
+            return total;
+    }
+}
+
+void pcnt_hw_clear(unsigned unit)
+{
+    if (unit >= PCNT_HW_UNITS)
+        return;
+    portENTER_CRITICAL(&pcnt_hw_mux);
+    pcnt_hw_reset(unit);
+    units[unit].carried = 0;
+    portEXIT_CRITICAL(&pcnt_hw_mux);
+}
+
+void pcnt_hw_pause(unsigned unit, bool pause)
+{
+    if (unit >= PCNT_HW_UNITS)
+        return;
+    portENTER_CRITICAL(&pcnt_hw_mux);
+    if (pause)
+        PCNT.ctrl.val |= BIT(unit * 2 + 1);
+    else
+        PCNT.ctrl.val &= ~BIT(unit * 2 + 1);
+    portEXIT_CRITICAL(&pcnt_hw_mux);
+}
+
+void pcnt_hw_set_limit(unsigned unit, uint16_t limit)
+{
+    if (unit >= PCNT_HW_UNITS || limit == 0 || limit > PCNT_HW_MAX_LIMIT)
+        return;
+    pcnt_hw_unit_t *u = &units[unit];
+    for (;;) {
+        portENTER_CRITICAL(&pcnt_hw_mux);
+        if (!carry_pending(unit))
+            break;
+        portEXIT_CRITICAL(&pcnt_hw_mux);
+    }
+    // The limits only take effect from a reset, so the count folds into the total
+    PCNT.conf_unit[unit].conf2.cnt_h_lim = limit;
+    PCNT.conf_unit[unit].conf2.cnt_l_lim = (uint16_t)-(int16_t)limit;
+    u->carried += (int16_t)PCNT.cnt_unit[unit].cnt_val;
+    pcnt_hw_reset(unit);
+    u->limit = limit;
+    portEXIT_CRITICAL(&pcnt_hw_mux);
+}
@@ -1142,6 +1142,16 @@ pwm_exist(uint8 channel){
     return false;
 }
 
+/* LEDC channel driving the pin, or -1 */
+int8
+pwm_get_channel(uint8 channel){
+    uint8 i;
+    for(i=0;i<PWM_CHANNEL_NUM_MAX;i++){
+        if(pwm_out_io_num[i]==channel)
+            return i;
+    }
+    return -1;
+}
 
 uint16 
 pwm_get_freq(uint8 channel)
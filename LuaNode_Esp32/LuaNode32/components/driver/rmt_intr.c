@@ -0,0 +1,53 @@
+// Shared RMT interrupt, dispatched to the driver of each channel
+
+#include "rmt_intr.h"
+#include "esp_intr.h"
+#include "esp_attr.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/xtensa_api.h"
+#include "soc/soc.h"
+#include "soc/rmt_struct.h"
+#include "driver/periph_ctrl.h"
+
+#define RMT_INTR_INUM       13      // level 1 CPU interrupt, unused by the SDK
+
+#define RMT_INTR_BITS(ch)   (RMT_INTR_TX_END(ch) | (RMT_INTR_TX_END(ch) << 1) | \
+                             RMT_INTR_ERR(ch) | RMT_INTR_TX_THR(ch))
+
+typedef struct {
+    rmt_intr_fn fn;
+    void *arg;
+} rmt_intr_handler_t;
+
+static rmt_intr_handler_t handlers[RMT_INTR_CHANNELS];
+static bool rmt_intr_inited;
+
+static void IRAM_ATTR rmt_intr_isr(void *arg)
+{
+    uint32_t status = RMT.int_st.val;
+    RMT.int_clr.val = status;
+    for (unsigned ch = 0; ch < RMT_INTR_CHANNELS; ch++) {
+        uint32_t bits = status & RMT_INTR_BITS(ch);
+        if (bits && handlers[ch].fn)
+            handlers[ch].fn(bits, handlers[ch].arg);
+    }
+}
+
+void rmt_intr_attach(unsigned ch, rmt_intr_fn fn, void *arg)
+{
+    if (ch >= RMT_INTR_CHANNELS)
+        return;
+    handlers[ch].arg = arg;
+    handlers[ch].fn = fn;
+    if (rmt_intr_inited)
+        return;
+
+    periph_module_enable(PERIPH_RMT_MODULE);
+    RMT.apb_conf.fifo_mask = 1;
+    RMT.apb_conf.mem_tx_wrap_en = 1;
+    ESP_INTR_DISABLE(RMT_INTR_INUM);
+    intr_matrix_set(xPortGetCoreID(), ETS_RMT_INTR_SOURCE, RMT_INTR_INUM);
+    xt_set_interrupt_handler(RMT_INTR_INUM, rmt_intr_isr, NULL);
+    ESP_INTR_ENABLE(RMT_INTR_INUM);
+    rmt_intr_inited = true;
+}
@@ -0,0 +1,253 @@
+// SPI master transfers moved by the SPI DMA engine
+
+#include "spi_dma.h"
+#include "esp_intr.h"
+#include "esp_attr.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/xtensa_api.h"
+#include "rom/lldesc.h"
+#include "soc/soc.h"
+#include "soc/dport_reg.h"
+#include "soc/spi_struct.h"
+#include "soc/gpio_sig_map.h"
+#include "driver/periph_ctrl.h"
+#include "esp32-hal-gpio.h"
+#include "esp32-hal-matrix.h"
+
+#define SPI_DMA_INUM        17      // level 1 CPU interrupt, unused by the SDK
+#define SPI_DMA_DESC_MAX    4092    // bytes per descriptor, a multiple of 4
+#define SPI_DMA_DESCS       (SPI_DMA_MAX_LEN / SPI_DMA_DESC_MAX)
+#define SPI_DMA_APB_HZ      (APB_CLK_FREQ)
+
+typedef struct {
+    spi_dev_t *hw;
+    periph_module_t module;
+    int intr_source;
+    uint8_t dma_chan;
+    uint8_t clk_out, mosi_out, miso_in, cs_out;
+    bool inited;
+    uint8_t head, tail, count;
+    spi_dma_trans_t q[SPI_DMA_QUEUE_LEN];
+    lldesc_t tx_desc[SPI_DMA_DESCS];
+    lldesc_t rx_desc[SPI_DMA_DESCS];
+} spi_dma_host_t;
+
+static spi_dma_host_t spi_dma_hosts[2] = {
+    { &SPI2, PERIPH_HSPI_MODULE, ETS_SPI2_INTR_SOURCE, 1,
+      HSPICLK_OUT_IDX, HSPID_OUT_IDX, HSPIQ_IN_IDX, HSPICS0_OUT_IDX },
+    { &SPI3, PERIPH_VSPI_MODULE, ETS_SPI3_INTR_SOURCE, 2,
+      VSPICLK_OUT_MUX_IDX, VSPID_OUT_IDX, VSPIQ_IN_IDX, VSPICS0_OUT_IDX },
+};
+
+static portMUX_TYPE spi_dma_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool spi_dma_intr_inited;
+
+static spi_dma_host_t *spi_dma_host(int host)
+{
+    if (host == SPI_DMA_HSPI)
+        return &spi_dma_hosts[0];
+    if (host == SPI_DMA_VSPI)
+        return &spi_dma_hosts[1];
+    return NULL;
+}
+
+static void IRAM_ATTR spi_dma_link(lldesc_t *d, const uint8_t *buf, size_t len)
+{
+    while (len) {
+        size_t n = len > SPI_DMA_DESC_MAX ? SPI_DMA_DESC_MAX : len;
+        len -= n;
+        d->size = (n + 3) & ~3;
+        d->length = n;
+        d->offset = 0;
+        d->sosf = 0;
+        d->eof = len == 0;
+        d->owner = 1;
+        d->buf = (volatile uint8_t *)buf;
+        d->qe.stqe_next = len ? d + 1 : NULL;
+        buf += n;
+        d++;
+    }
+}
+
+// Program and start the transfer at the tail of the queue
+static void IRAM_ATTR spi_dma_start(spi_dma_host_t *h)
+{
+    spi_dev_t *hw = h->hw;
+    const spi_dma_trans_t *t = &h->q[h->tail];
+    uint32_t bits = t->len * 8 - 1;
+
+    hw->dma_conf.out_rst = 1;
+    hw->dma_conf.in_rst = 1;
+    hw->dma_conf.ahbm_rst = 1;
+    hw->dma_conf.ahbm_fifo_rst = 1;
+    hw->dma_conf.out_rst = 0;
+    hw->dma_conf.in_rst = 0;
+    hw->dma_conf.ahbm_rst = 0;
+    hw->dma_conf.ahbm_fifo_rst = 0;
+
+    hw->user.usr_mosi = t->tx != NULL;
+    hw->user.usr_miso = t->rx != NULL;
+    hw->mosi_dlen.usr_mosi_dbitlen = bits;
+    hw->miso_dlen.usr_miso_dbitlen = bits;
+    if (t->tx) {
+        spi_dma_link(h->tx_desc, t->tx, t->len);
+        hw->dma_out_link.addr = (uint32_t)h->tx_desc & 0xfffff;
+        hw->dma_out_link.start = 1;
+    }
+    if (t->rx) {
+        spi_dma_link(h->rx_desc, t->rx, t->len);
+        hw->dma_in_link.addr = (uint32_t)h->rx_desc & 0xfffff;
+        hw->dma_in_link.start = 1;
+    }
+    hw->cmd.usr = 1;
+}
+
+static void IRAM_ATTR spi_dma_isr(void *arg)
+{
+    for (int i = 0; i < 2; i++) {
+        spi_dma_host_t *h = &spi_dma_hosts[i];
+        if (!h->inited || !h->hw->slave.trans_done)
+            continue;
+        h->hw->slave.trans_done = 0;
+
+        spi_dma_done_fn done = NULL;
+        void *done_arg = NULL;
+        portENTER_CRITICAL_ISR(&spi_dma_mux);
+        if (h->count) {
+            done = h->q[h->tail].done;
+            done_arg = h->q[h->tail].arg;
+            h->tail = (h->tail + 1) % SPI_DMA_QUEUE_LEN;
+            if (--h->count)
+                spi_dma_start(h);
+        }
+        portEXIT_CRITICAL_ISR(&spi_dma_mux);
+        if (done)
+            done(done_arg);
+    }
+}
+
+// Fastest clock of APB / pre / n that does not exceed hz
+static uint32_t spi_dma_set_clock(spi_dev_t *hw, uint32_t hz)
+{
+    if (hz >= SPI_DMA_APB_HZ) {
+        hw->clock.val = 0;
+        hw->clock.clk_equ_sysclk = 1;
+        return SPI_DMA_APB_HZ;
+    }
+    uint32_t best = 0, best_pre = 8192, best_n = 64;
+    for (uint32_t n = 2; n <= 64; n++) {
+        uint32_t pre = (SPI_DMA_APB_HZ / n + hz - 1) / hz;
+        if (pre == 0)
+            pre = 1;
+        if (pre > 8192)
+            continue;
+        uint32_t f = SPI_DMA_APB_HZ / (pre * n);
+        if (f > best) {
+            best = f;
+            best_pre = pre;
+            best_n = n;
+        }
+    }
+    hw->clock.val = 0;
+    hw->clock.clkdiv_pre = best_pre - 1;
+    hw->clock.clkcnt_n = best_n - 1;
+    hw->clock.clkcnt_h = best_n / 2 - 1;
+    hw->clock.clkcnt_l = best_n - 1;
+    return SPI_DMA_APB_HZ / (best_pre * best_n);
+}
+
+uint32_t spi_dma_setup(int host, int sclk, int mosi, int miso, int cs,
+                       int mode, uint32_t hz)
+{
+    spi_dma_host_t *h = spi_dma_host(host);
+    if (!h || h->count || mode < 0 || mode > 3 || hz == 0)
+        return 0;
+    spi_dev_t *hw = h->hw;
+
+    if (!h->inited) {
+        periph_module_enable(h->module);
+        periph_module_enable(PERIPH_SPI_DMA_MODULE);
+        uint32_t shift = host == SPI_DMA_HSPI ? DPORT_SPI2_DMA_CHAN_SEL_S
+                                              : DPORT_SPI3_DMA_CHAN_SEL_S;
+        uint32_t sel = READ_PERI_REG(DPORT_SPI_DMA_CHAN_SEL_REG);
+        sel &= ~(DPORT_SPI2_DMA_CHAN_SEL_V << shift);
+        sel |= (uint32_t)h->dma_chan << shift;
+        WRITE_PERI_REG(DPORT_SPI_DMA_CHAN_SEL_REG, sel);
+    }
+
+    if (sclk >= 0) {
+        pinMode(sclk, OUTPUT);
+        pinMatrixOutAttach(sclk, h->clk_out, false, false);
+    }
+    if (mosi >= 0) {
+        pinMode(mosi, OUTPUT);
+        pinMatrixOutAttach(mosi, h->mosi_out, false, false);
+    }
+    if (miso >= 0) {
+        pinMode(miso, INPUT);
+        pinMatrixInAttach(miso, h->miso_in, false);
+    }
+    if (cs >= 0) {
+        pinMode(cs, OUTPUT);
+        pinMatrixOutAttach(cs, h->cs_out, false, false);
+    }
+
+    hw->slave.val = 0;                  // master
+    hw->pin.val = 0;
+    hw->pin.cs1_dis = 1;
+    hw->pin.cs2_dis = 1;
+    hw->pin.cs0_dis = cs < 0;
+    hw->pin.ck_idle_edge = mode >= 2;
+    hw->user.val = 0;
+    hw->user.doutdin = 1;               // full duplex
+    hw->user.cs_setup = 1;
+    hw->user.cs_hold = 1;
+    hw->user.ck_out_edge = mode == 1 || mode == 2;
+    hw->user1.val = 0;
+    hw->ctrl.val = 0;                   // MSB first
+    hw->ctrl2.val = 0;
+    hw->dma_conf.val = 0;
+    hw->dma_conf.out_data_burst_en = 1;
+    hw->dma_conf.indscr_burst_en = 1;
+    hw->dma_conf.outdscr_burst_en = 1;
+    uint32_t actual = spi_dma_set_clock(hw, hz);
+
+    ESP_INTR_DISABLE(SPI_DMA_INUM);
+    intr_matrix_set(xPortGetCoreID(), h->intr_source, SPI_DMA_INUM);
+    if (!spi_dma_intr_inited) {
+        xt_set_interrupt_handler(SPI_DMA_INUM, spi_dma_isr, NULL);
+        spi_dma_intr_inited = true;
+    }
+    hw->slave.trans_done = 0;
+    hw->slave.int_en = 1 << 4;          // trans_done
+    h->inited = true;
+    ESP_INTR_ENABLE(SPI_DMA_INUM);
+    return actual;
+}
+
+int spi_dma_queue(int host, const spi_dma_trans_t *t)
+{
+    spi_dma_host_t *h = spi_dma_host(host);
+    if (!h || !h->inited || t->len == 0 || t->len > SPI_DMA_MAX_LEN ||
+        (!t->tx && !t->rx))
+        return -1;
+
+    int res = 0;
+    portENTER_CRITICAL(&spi_dma_mux);
+    if (h->count == SPI_DMA_QUEUE_LEN) {
+        res = -2;
+    } else {
+        h->q[h->head] = *t;
+        h->head = (h->head + 1) % SPI_DMA_QUEUE_LEN;
+        if (h->count++ == 0)
+            spi_dma_start(h);
+    }
+    portEXIT_CRITICAL(&spi_dma_mux);
+    return res;
+}
+
+bool spi_dma_busy(int host)
+{
+    spi_dma_host_t *h = spi_dma_host(host);
+    return h && h->count;
+}
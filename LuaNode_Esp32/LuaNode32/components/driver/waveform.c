@@ -0,0 +1,153 @@
+// Pulse train output timed by the RMT peripheral
+
+#include "waveform.h"
+#include "rmt_intr.h"
+#include "esp_attr.h"
+#include "freertos/FreeRTOS.h"
+#include "soc/soc.h"
+#include "soc/rmt_struct.h"
+#include "soc/gpio_sig_map.h"
+#include "esp32-hal-gpio.h"
+#include "esp32-hal-matrix.h"
+
+#define WAVEFORM_CH         0
+#define WAVEFORM_MEM_BLOCKS 6       // channels 0-5 of the RMT memory, 64 words each
+#define WAVEFORM_MAX_TICKS  0x7fff  // 15 bit duration field
+
+static portMUX_TYPE waveform_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool waveform_inited;
+static volatile bool waveform_playing;
+static uint8_t waveform_pin;
+static uint8_t waveform_idle_level;
+static uint32_t waveform_loops_left;
+static waveform_done_fn waveform_done;
+static void *waveform_done_arg;
+
+static void IRAM_ATTR waveform_restart(void)
+{
+    RMT.conf_ch[WAVEFORM_CH].conf1.mem_rd_rst = 1;
+    RMT.conf_ch[WAVEFORM_CH].conf1.mem_rd_rst = 0;
+    RMT.conf_ch[WAVEFORM_CH].conf1.tx_start = 1;
+}
+
+// Back to plain GPIO output, left at the level the waveform ended on
+static void IRAM_ATTR waveform_release_pin(void)
+{
+    digitalWrite(waveform_pin, waveform_idle_level);
+    pinMatrixOutDetach(waveform_pin, false, false);
+}
+
+static void IRAM_ATTR waveform_isr(uint32_t status, void *arg)
+{
+    if (!(status & RMT_INTR_TX_END(WAVEFORM_CH)))
+        return;
+
+    waveform_done_fn done = NULL;
+    void *done_arg = NULL;
+    portENTER_CRITICAL_ISR(&waveform_mux);
+    if (waveform_playing) {
+        if (waveform_loops_left > 1) {
+            waveform_loops_left--;
+            waveform_restart();
+        } else {
+            waveform_playing = false;
+            waveform_release_pin();
+            done = waveform_done;
+            done_arg = waveform_done_arg;
+        }
+    }
+    portEXIT_CRITICAL_ISR(&waveform_mux);
+    if (done)
+        done(done_arg);
+}
+
+static void waveform_init(void)
+{
+    rmt_intr_attach(WAVEFORM_CH, waveform_isr, NULL);
+
+    // 1 us ticks from the 80 MHz APB clock
+    RMT.conf_ch[WAVEFORM_CH].conf0.div_cnt = 80;
+    RMT.conf_ch[WAVEFORM_CH].conf0.mem_size = WAVEFORM_MEM_BLOCKS;
+    RMT.conf_ch[WAVEFORM_CH].conf0.carrier_en = 0;
+    RMT.conf_ch[WAVEFORM_CH].conf0.mem_pd = 0;
+    RMT.conf_ch[WAVEFORM_CH].conf1.ref_always_on = 1;
+    RMT.conf_ch[WAVEFORM_CH].conf1.mem_owner = 0;
+    RMT.conf_ch[WAVEFORM_CH].conf1.idle_out_en = 1;
+
+    RMT.int_ena.val |= RMT_INTR_TX_END(WAVEFORM_CH);
+    waveform_inited = true;
+}
+
+int waveform_start(uint8_t pin, uint8_t first_level, const uint32_t *delays_us,
+                   size_t n, uint32_t loops, waveform_done_fn done, void *arg)
+{
+    if (waveform_playing)
+        return -2;
+
+    // Count the slots first so nothing is touched if the table won't fit.
+    // A zero duration would end the transmission, so it becomes 1 us.
+    size_t slots = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t d = delays_us[i] ? delays_us[i] : 1;
+        slots += (d + WAVEFORM_MAX_TICKS - 1) / WAVEFORM_MAX_TICKS;
+    }
+    if (slots == 0 || slots > WAVEFORM_MAX_SLOTS)
+        return -1;
+
+    if (!waveform_inited)
+        waveform_init();
+
+    // Each memory word holds two slots: duration:15, level:1, twice
+    volatile uint32_t *mem = &RMTMEM.chan[WAVEFORM_CH].data[0].val;
+    uint32_t word = 0;
+    size_t slot = 0;
+    uint8_t level = first_level ? 1 : 0;
+    RMT.conf_ch[WAVEFORM_CH].conf1.tx_start = 0;
+    for (size_t i = 0; i < n; i++, level ^= 1) {
+        uint32_t d = delays_us[i] ? delays_us[i] : 1;
+        while (d) {
+            uint32_t t = d > WAVEFORM_MAX_TICKS ? WAVEFORM_MAX_TICKS : d;
+            d -= t;
+            t |= (uint32_t)level << 15;
+            if (slot & 1)
+                mem[slot / 2] = word | (t << 16);
+            else
+                word = t;
+            slot++;
+        }
+    }
+    // A zero-length slot ends the transmission
+    mem[slot / 2] = (slot & 1) ? word : 0;
+
+    pinMode(pin, OUTPUT);
+    portENTER_CRITICAL(&waveform_mux);
+    waveform_pin = pin;
+    waveform_idle_level = level ^ 1;    // level of the last entry
+    waveform_loops_left = loops;
+    waveform_done = done;
+    waveform_done_arg = arg;
+    waveform_playing = true;
+    RMT.conf_ch[WAVEFORM_CH].conf1.idle_out_lv = waveform_idle_level;
+    RMT.conf_ch[WAVEFORM_CH].conf1.tx_conti_mode = loops == 0;
+    pinMatrixOutAttach(pin, RMT_SIG_OUT0_IDX + WAVEFORM_CH, false, false);
+    waveform_restart();
+    portEXIT_CRITICAL(&waveform_mux);
+    return 0;
+}
+
+void waveform_stop(void)
+{
+    portENTER_CRITICAL(&waveform_mux);
+    if (waveform_playing) {
+        waveform_playing = false;
+        RMT.conf_ch[WAVEFORM_CH].conf1.tx_conti_mode = 0;
+        RMT.conf_ch[WAVEFORM_CH].conf1.tx_start = 0;
+        waveform_release_pin();
+    }
+    portEXIT_CRITICAL(&waveform_mux);
+}
+
+bool waveform_busy(void)
+{
+    return waveform_playing;
+}
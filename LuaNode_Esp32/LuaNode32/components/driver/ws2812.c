@@ -0,0 +1,144 @@
+// WS2812 LED strip frames, encoded on the fly into RMT items
+
+#include "ws2812.h"
+#include "rmt_intr.h"
+#include "esp_attr.h"
+#include "freertos/FreeRTOS.h"
+#include "soc/soc.h"
+#include "soc/rmt_struct.h"
+#include "soc/gpio_sig_map.h"
+#include "esp32-hal-gpio.h"
+#include "esp32-hal-matrix.h"
+
+#define WS2812_CH           6
+#define WS2812_MEM_BLOCKS   2       // channels 6 and 7 of the RMT memory
+#define WS2812_HALF         (WS2812_MEM_BLOCKS * 64 / 2)    // items, 8 bytes worth
+#define WS2812_DIV          2       // 25 ns ticks from the 80 MHz APB clock
+
+// An item is duration:15, level:1 twice; each bit is high then low
+#define WS2812_ITEM(high, low)  ((high) | (1 << 15) | ((low) << 16))
+#define WS2812_BIT0         WS2812_ITEM(16, 34)     // 0.40 us, 0.85 us
+#define WS2812_BIT1         WS2812_ITEM(32, 18)     // 0.80 us, 0.45 us
+#define WS2812_LATCH        (1200 | (1200 << 16))   // 60 us low
+
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+    ws2812_done_fn done;
+    void *arg;
+} ws2812_frame_t;
+
+static portMUX_TYPE ws2812_mux = portMUX_INITIALIZER_UNLOCKED;
+static ws2812_frame_t frames[2];    // the one being sent, then the one waiting
+static volatile unsigned ws2812_queued;
+static size_t ws2812_pos;           // next byte of frames[0] to encode
+static unsigned ws2812_half;        // half of the memory to refill next
+static bool ws2812_ended;           // the end marker is in the memory
+static bool ws2812_inited;
+static int ws2812_pin = -1;
+
+// Encodes the next 8 bytes of the frame into one half of the channel's
+// memory, or the latch and the end marker once the bytes have run out
+static void IRAM_ATTR ws2812_fill(unsigned half)
+{
+    volatile uint32_t *mem = &RMTMEM.chan[WS2812_CH].data[0].val + half * WS2812_HALF;
+    const ws2812_frame_t *f = &frames[0];
+    unsigned w = 0;
+    while (w < WS2812_HALF && ws2812_pos < f->len) {
+        uint8_t b = f->data[ws2812_pos++];
+        for (int i = 7; i >= 0; i--)
+            mem[w++] = (b >> i) & 1 ? WS2812_BIT1 : WS2812_BIT0;
+    }
+    // w is a multiple of 8, so both words fit
+    if (w < WS2812_HALF && !ws2812_ended) {
+        mem[w++] = WS2812_LATCH;
+        mem[w] = 0;
+        ws2812_ended = true;
+    }
+}
+
+static void IRAM_ATTR ws2812_start(void)
+{
+    ws2812_pos = 0;
+    ws2812_ended = false;
+    ws2812_fill(0);
+    ws2812_fill(1);
+    ws2812_half = 0;
+    RMT.conf_ch[WS2812_CH].conf1.mem_rd_rst = 1;
+    RMT.conf_ch[WS2812_CH].conf1.mem_rd_rst = 0;
+    RMT.conf_ch[WS2812_CH].conf1.tx_start = 1;
+}
+
+static void IRAM_ATTR ws2812_isr(uint32_t status, void *arg)
+{
+    ws2812_done_fn done = NULL;
+    void *done_arg = NULL;
+    portENTER_CRITICAL_ISR(&ws2812_mux);
+    if (status & RMT_INTR_TX_THR(WS2812_CH)) {
+        // The transmitter has moved on to the other half
+        if (ws2812_queued && !ws2812_ended)
+            ws2812_fill(ws2812_half);
+        ws2812_half ^= 1;
+    }
+    if ((status & RMT_INTR_TX_END(WS2812_CH)) && ws2812_queued) {
+        done = frames[0].done;
+        done_arg = frames[0].arg;
+        frames[0] = frames[1];
+        if (--ws2812_queued)
+            ws2812_start();
+    }
+    portEXIT_CRITICAL_ISR(&ws2812_mux);
+    if (done)
+        done(done_arg);
+}
+
+void ws2812_init(uint8_t pin)
+{
+    if (!ws2812_inited) {
+        rmt_intr_attach(WS2812_CH, ws2812_isr, NULL);
+        RMT.conf_ch[WS2812_CH].conf0.div_cnt = WS2812_DIV;
+        RMT.conf_ch[WS2812_CH].conf0.mem_size = WS2812_MEM_BLOCKS;
+        RMT.conf_ch[WS2812_CH].conf0.carrier_en = 0;
+        RMT.conf_ch[WS2812_CH].conf0.mem_pd = 0;
+        RMT.conf_ch[WS2812_CH].conf1.ref_always_on = 1;
+        RMT.conf_ch[WS2812_CH].conf1.mem_owner = 0;
+        RMT.conf_ch[WS2812_CH].conf1.tx_conti_mode = 0;
+        RMT.conf_ch[WS2812_CH].conf1.idle_out_lv = 0;
+        RMT.conf_ch[WS2812_CH].conf1.idle_out_en = 1;
+        RMT.tx_lim_ch[WS2812_CH].limit = WS2812_HALF;
+        RMT.int_ena.val |= RMT_INTR_TX_END(WS2812_CH) | RMT_INTR_TX_THR(WS2812_CH);
+        ws2812_inited = true;
+    }
+    if (ws2812_pin >= 0 && ws2812_pin != pin)
+        pinMatrixOutDetach(ws2812_pin, false, false);
+    pinMode(pin, OUTPUT);
+    pinMatrixOutAttach(pin, RMT_SIG_OUT0_IDX + WS2812_CH, false, false);
+    ws2812_pin = pin;
+}
+
+int ws2812_write(const uint8_t *data, size_t len, ws2812_done_fn done, void *arg)
+{
+    if (!ws2812_inited || len == 0)
+        return -1;
+
+    int res = 0;
+    portENTER_CRITICAL(&ws2812_mux);
+    if (ws2812_queued == 2) {
+        res = -2;
+    } else {
+        ws2812_frame_t *f = &frames[ws2812_queued];
+        f->data = data;
+        f->len = len;
+        f->done = done;
+        f->arg = arg;
+        if (ws2812_queued++ == 0)
+            ws2812_start();
+    }
+    portEXIT_CRITICAL(&ws2812_mux);
+    return res;
+}
+
+bool ws2812_busy(void)
+{
+    return ws2812_queued != 0;
+}
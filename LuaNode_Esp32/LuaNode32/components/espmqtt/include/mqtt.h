@@ -2,6 +2,9 @@
 #define _MQTT_H_
 #include <stdint.h>
 #include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "mqtt_config.h"
 #include "mqtt_msg.h"
 #include "ringbuf.h"
@@ -29,6 +32,8 @@ typedef struct {
     uint32_t lwt_retain;
     uint32_t clean_session;
     uint32_t keepalive;
+    uint32_t secure;          /* TLS, with CONFIG_MQTT_SECURITY_ON */
+    const char *ca_cert;      /* PEM the broker is checked against, NULL not to */
 } mqtt_settings;
 
 typedef struct mqtt_event_data_t
@@ -38,8 +43,8 @@ typedef struct mqtt_event_data_t
   const char* data;
   uint16_t topic_length;
   uint16_t data_length;
-  uint16_t data_offset;
-  uint16_t data_total_length;
+  uint32_t data_offset;
+  uint32_t data_total_length;
 } mqtt_event_data_t;
 
 typedef struct mqtt_state_t
@@ -60,19 +65,38 @@ typedef struct mqtt_state_t
   int pending_publish_qos;
 } mqtt_state_t;
 
+/* A QoS 1 or 2 publish waiting for its acknowledgement */
+typedef struct {
+  uint8_t *msg;         /* PUBLISH, or PUBREL after PUBREC; NULL if free */
+  uint16_t length;
+  uint16_t msg_id;
+  TickType_t sent;
+} mqtt_inflight_t;
+
 typedef struct  {
   int socket;
+#if CONFIG_MQTT_SECURITY_ON
+  struct mqtt_tls *tls;             /* while connected over TLS */
+#endif
   mqtt_settings *settings;
   mqtt_state_t  mqtt_state;
   mqtt_connect_info_t connect_info;
   QueueHandle_t xSendingQueue;
+  SemaphoreHandle_t xOutboxLock;  /* building messages and writing send_rb */
   RINGBUF send_rb;
-  uint32_t keepalive_tick;
+  TickType_t last_sent;             /* for keepalive */
+  TaskHandle_t xTask;               /* connecting and receiving */
+  TaskHandle_t xSendingTask;
+  mqtt_inflight_t inflight[CONFIG_MQTT_INFLIGHT_MAX];
+  SemaphoreHandle_t xInflightFree;  /* counts free inflight slots */
 } mqtt_client;
 
+/* Every call starts one more client, with tasks of its own */
 mqtt_client *mqtt_start(mqtt_settings *mqtt_info);
 void mqtt_task(void *pvParameters);
 void mqtt_subscribe(mqtt_client *client, char *topic, uint8_t qos);
-void mqtt_publish(mqtt_client* client, char *topic, char *data, int len, int qos, int retain);
+void mqtt_unsubscribe(mqtt_client *client, char *topic);
+/* false if the outbox or, for QoS 1 and 2, the in-flight window stayed full */
+bool mqtt_publish(mqtt_client* client, char *topic, char *data, int len, int qos, int retain);
 void mqtt_detroy();
 #endif
@@ -19,6 +19,14 @@
 #define mqtt_info(format, ... )
 #endif
 
+#ifndef CONFIG_MQTT_INFLIGHT_MAX
+#define CONFIG_MQTT_INFLIGHT_MAX 8
+#endif
+
+#ifndef CONFIG_MQTT_RETRANSMIT_MS
+#define CONFIG_MQTT_RETRANSMIT_MS 10000
+#endif
+
 #ifndef CONFIG_MQTT_QUEUE_BUFFER_SIZE_WORD
 #define CONFIG_MQTT_QUEUE_BUFFER_SIZE_WORD 1024
 #endif
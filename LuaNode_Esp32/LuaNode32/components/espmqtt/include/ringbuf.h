@@ -2,22 +2,53 @@
 #define _RING_BUF_H_
 
 #include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
-
+/*
+ * Byte ring for one writer and one reader, which may be different tasks.
+ * Each side only ever moves its own index, so neither needs a lock, and
+ * data is moved with at most two memcpy()s. A side that has to wait
+ * blocks on its task notification until the other side has made room or
+ * added data. One byte stays unused to tell a full ring from an empty one.
+ */
 typedef struct{
   uint8_t* p_o;        /**< Original pointer */
-  uint8_t* volatile p_r;   /**< Read pointer */
-  uint8_t* volatile p_w;   /**< Write pointer */
-  volatile int32_t fill_cnt;  /**< Number of filled slots */
   int32_t size;       /**< Buffer size */
-  int32_t block_size;
+  volatile int32_t head;   /**< Write index, moved by the writer only */
+  volatile int32_t tail;   /**< Read index, moved by the reader only */
+  TaskHandle_t volatile writer;  /**< Writer waiting for room */
+  TaskHandle_t volatile reader;  /**< Reader waiting for data */
 }RINGBUF;
 
-int32_t rb_init(RINGBUF *r, uint8_t* buf, int32_t size, int32_t block_size);
-int32_t rb_put(RINGBUF *r, uint8_t* c);
-int32_t rb_get(RINGBUF *r, uint8_t* c);
+int32_t rb_init(RINGBUF *r, uint8_t* buf, int32_t size);
+/* Bytes that can be written / read right now */
 int32_t rb_available(RINGBUF *r);
-uint32_t rb_read(RINGBUF *r, uint8_t *buf, int len);
-uint32_t rb_write(RINGBUF *r, uint8_t *buf, int len);
+int32_t rb_filled(RINGBUF *r);
+
+/*
+ * Write all of len bytes, waiting up to wait ticks for the room. Returns
+ * len, or -1 if it timed out or len is more than the ring can ever hold.
+ */
+int32_t rb_write(RINGBUF *r, const uint8_t *buf, int32_t len, TickType_t wait);
+
+/* The same for n pieces, which the reader sees all at once or not at all */
+typedef struct {
+  const void *p;
+  int32_t len;
+} rb_part_t;
+int32_t rb_writev(RINGBUF *r, const rb_part_t *parts, int n, TickType_t wait);
+
+/* Read up to len bytes, waiting up to wait ticks for any. Returns how many */
+int32_t rb_read(RINGBUF *r, uint8_t *buf, int32_t len, TickType_t wait);
+
+/*
+ * Zero-copy read: point *p at the data at the read index and return how
+ * much of it is contiguous, waiting up to wait ticks for any. It stays
+ * there until the reader gives it back with rb_consume().
+ */
+int32_t rb_peek(RINGBUF *r, uint8_t **p, TickType_t wait);
+void rb_consume(RINGBUF *r, int32_t len);
 
 #endif
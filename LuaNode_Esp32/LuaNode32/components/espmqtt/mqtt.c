@@ -15,9 +15,28 @@
 #include "lwip/netdb.h"
 #include "ringbuf.h"
 #include "mqtt.h"
+#include "trace.h"
+#if CONFIG_MQTT_SECURITY_ON
+#include "mbedtls/net.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "tls_session.h"
+#endif
 
-static TaskHandle_t xMqttTask = NULL;
-static TaskHandle_t xMqttSendingTask = NULL;
+/* How long connecting waits for the broker, TLS handshake and CONNACK alike */
+#define MQTT_CONNECT_TIMEOUT_MS 10000
+
+/* How long a message waits for room in the outbox before it's dropped */
+#define MQTT_QUEUE_WAIT_MS 1000
+
+/* Unacknowledged QoS 1 and 2 messages are sent again after this long */
+#define MQTT_RETRANSMIT_TICKS (CONFIG_MQTT_RETRANSMIT_MS / portTICK_RATE_MS)
+
+/* Messages are built in the shared out_buffer and then copied to the
+ * outbox, by the Lua task and the receiving task alike */
+#define OUTBOX_LOCK(client)   xSemaphoreTake((client)->xOutboxLock, portMAX_DELAY)
+#define OUTBOX_UNLOCK(client) xSemaphoreGive((client)->xOutboxLock)
 
 
 static int resolve_dns(const char *host, struct sockaddr_in *ip) {
@@ -31,13 +50,93 @@ static int resolve_dns(const char *host, struct sockaddr_in *ip) {
     memcpy(&ip->sin_addr, addr_list[0], sizeof(ip->sin_addr));
     return 1;
 }
-static void mqtt_queue(mqtt_client *client)
+/* Copy a message to the outbox, with the outbox lock held */
+static bool mqtt_queue_data(mqtt_client *client, const uint8_t *data, uint32_t len, TickType_t wait)
 {
-// TODO: detect buffer full (ringbuf and queue)
-    rb_write(&client->send_rb,
-             client->mqtt_state.outbound_message->data,
-             client->mqtt_state.outbound_message->length);
-    xQueueSend(client->xSendingQueue, &client->mqtt_state.outbound_message->length, 0);
+    // the length goes in the queue after the data, so there must be room
+    // for it first or the data would be sent as part of another message
+    if (len == 0 || uxQueueSpacesAvailable(client->xSendingQueue) == 0 ||
+            rb_write(&client->send_rb, data, len, wait) < 0)
+        return false;
+    xQueueSend(client->xSendingQueue, &len, 0);
+    return true;
+}
+
+/* Copy outbound_message to the outbox, with the outbox lock held */
+static bool mqtt_queue(mqtt_client *client)
+{
+    mqtt_message_t *msg = client->mqtt_state.outbound_message;
+    if (!mqtt_queue_data(client, msg->data, msg->length, MQTT_QUEUE_WAIT_MS / portTICK_RATE_MS)) {
+        mqtt_error("Outbox full, message dropped");
+        return false;
+    }
+    client->mqtt_state.pending_msg_type = mqtt_get_type(msg->data);
+    client->mqtt_state.pending_msg_id = mqtt_get_id(msg->data, msg->length);
+    return true;
+}
+
+/*
+ * QoS 1 and 2 publishes stay in the in-flight window until they are
+ * acknowledged, so any number up to its size can be on the way at once.
+ * A slot holds a copy of the PUBLISH, or of the PUBREL once PUBREC has
+ * come for a QoS 2 one. Slots are only touched with the outbox lock held;
+ * xInflightFree counts the free ones for publishers to wait on.
+ */
+static mqtt_inflight_t *inflight_find(mqtt_client *client, uint16_t msg_id, int type)
+{
+    for (int i = 0; i < CONFIG_MQTT_INFLIGHT_MAX; i++) {
+        mqtt_inflight_t *f = &client->inflight[i];
+        if (f->msg && f->msg_id == msg_id && mqtt_get_type(f->msg) == type)
+            return f;
+    }
+    return NULL;
+}
+
+static void inflight_free(mqtt_inflight_t *f)
+{
+    free(f->msg);
+    f->msg = NULL;
+}
+
+/*
+ * Ticks until the oldest unacknowledged message is due again, 0 if one is
+ * already, portMAX_DELAY if there are none. Looked at without the lock, so
+ * a slot changing meanwhile only moves the sending task's next wakeup.
+ */
+static TickType_t inflight_due(mqtt_client *client, TickType_t now)
+{
+    TickType_t wait = portMAX_DELAY;
+    for (int i = 0; i < CONFIG_MQTT_INFLIGHT_MAX; i++) {
+        mqtt_inflight_t *f = &client->inflight[i];
+        if (!f->msg)
+            continue;
+        if (now - f->sent >= MQTT_RETRANSMIT_TICKS)
+            return 0;
+        if (MQTT_RETRANSMIT_TICKS - (now - f->sent) < wait)
+            wait = MQTT_RETRANSMIT_TICKS - (now - f->sent);
+    }
+    return wait;
+}
+
+/* Send again whatever has waited too long for its acknowledgement */
+static void inflight_retransmit(mqtt_client *client, TickType_t now)
+{
+    // the sending task drains the outbox, so it can't wait for room
+    // or the lock here
+    if (inflight_due(client, now) != 0 || !xSemaphoreTake(client->xOutboxLock, 0))
+        return;
+    for (int i = 0; i < CONFIG_MQTT_INFLIGHT_MAX; i++) {
+        mqtt_inflight_t *f = &client->inflight[i];
+        if (!f->msg || now - f->sent < MQTT_RETRANSMIT_TICKS)
+            continue;
+        if (mqtt_get_type(f->msg) == MQTT_MSG_TYPE_PUBLISH)
+            f->msg[0] |= 0x08;      // DUP
+        if (!mqtt_queue_data(client, f->msg, f->length, 0))
+            break;
+        mqtt_info("Resend type: %d, id: %d", mqtt_get_type(f->msg), f->msg_id);
+        f->sent = now;
+    }
+    OUTBOX_UNLOCK(client);
 }
 static int client_connect(const char *stream_host, int stream_port)
 {
@@ -73,6 +172,179 @@ static int client_connect(const char *stream_host, int stream_port)
         return sock;
     }
 }
+/*
+ * The connection, plain or TLS. The receiving task reads while the sending
+ * task writes, so over TLS the two take turns on the one mbedtls context:
+ * a reader waits for the socket first and only holds the lock while it
+ * decrypts what came in.
+ */
+#if CONFIG_MQTT_SECURITY_ON
+struct mqtt_tls {
+    mbedtls_net_context net;
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_config conf;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    mbedtls_x509_crt ca;
+    SemaphoreHandle_t lock;
+    int timeout_ms;                 /* for reads, 0 waits forever */
+};
+
+static void tls_free(struct mqtt_tls *tls)
+{
+    mbedtls_ssl_free(&tls->ssl);
+    mbedtls_ssl_config_free(&tls->conf);
+    mbedtls_ctr_drbg_free(&tls->drbg);
+    mbedtls_entropy_free(&tls->entropy);
+    mbedtls_x509_crt_free(&tls->ca);
+    if (tls->lock)
+        vSemaphoreDelete(tls->lock);
+    free(tls);
+}
+
+/*
+ * Handshake over client->socket. A session kept from the last connection
+ * to this broker is offered first, so a reconnect costs a round trip and
+ * no public key operations if the broker still has it.
+ */
+static bool tls_connect(mqtt_client *client)
+{
+    mqtt_settings *settings = client->settings;
+    struct mqtt_tls *tls = calloc(1, sizeof(struct mqtt_tls));
+    bool resuming;
+    int res;
+
+    if (tls == NULL) {
+        mqtt_error("Memory not enough");
+        return false;
+    }
+    tls->net.fd = client->socket;
+    tls->timeout_ms = MQTT_CONNECT_TIMEOUT_MS;
+    mbedtls_ssl_init(&tls->ssl);
+    mbedtls_ssl_config_init(&tls->conf);
+    mbedtls_ctr_drbg_init(&tls->drbg);
+    mbedtls_entropy_init(&tls->entropy);
+    mbedtls_x509_crt_init(&tls->ca);
+    tls->lock = xSemaphoreCreateMutex();
+    if (tls->lock == NULL ||
+            mbedtls_ctr_drbg_seed(&tls->drbg, mbedtls_entropy_func, &tls->entropy, NULL, 0) != 0 ||
+            mbedtls_ssl_config_defaults(&tls->conf, MBEDTLS_SSL_IS_CLIENT,
+                                        MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0)
+        goto fail;
+    if (settings->ca_cert) {
+        if (mbedtls_x509_crt_parse(&tls->ca, (const unsigned char *)settings->ca_cert,
+                                   strlen(settings->ca_cert) + 1) != 0) {
+            mqtt_error("Bad CA certificate");
+            goto fail;
+        }
+        mbedtls_ssl_conf_ca_chain(&tls->conf, &tls->ca, NULL);
+        mbedtls_ssl_conf_authmode(&tls->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    } else {
+        mbedtls_ssl_conf_authmode(&tls->conf, MBEDTLS_SSL_VERIFY_NONE);
+    }
+    mbedtls_ssl_conf_rng(&tls->conf, mbedtls_ctr_drbg_random, &tls->drbg);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_conf_session_tickets(&tls->conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+    if (mbedtls_ssl_setup(&tls->ssl, &tls->conf) != 0 ||
+            mbedtls_ssl_set_hostname(&tls->ssl, settings->host) != 0)
+        goto fail;
+    mbedtls_ssl_set_bio(&tls->ssl, &tls->net, mbedtls_net_send, mbedtls_net_recv, NULL);
+
+    resuming = tls_session_load(&tls->ssl, settings->host, settings->port);
+    while ((res = mbedtls_ssl_handshake(&tls->ssl)) != 0) {
+        if (res != MBEDTLS_ERR_SSL_WANT_READ && res != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            mqtt_error("TLS handshake failed: -0x%x", -res);
+            // the next try starts afresh, in case the session was the trouble
+            if (resuming)
+                tls_session_forget(settings->host, settings->port);
+            goto fail;
+        }
+    }
+    // tickets are renewed as they are used, so it is kept again every time
+    tls_session_save(&tls->ssl, settings->host, settings->port);
+    mqtt_info("TLS connected, %s", resuming ? "session offered" : "full handshake");
+    client->tls = tls;
+    return true;
+
+fail:
+    tls_free(tls);
+    return false;
+}
+#endif
+
+/* Up to len bytes, waiting for them as set by net_timeout */
+static int net_read(mqtt_client *client, void *buf, int len)
+{
+#if CONFIG_MQTT_SECURITY_ON
+    struct mqtt_tls *tls = client->tls;
+    if (tls) {
+        int res;
+        do {
+            if (mbedtls_ssl_get_bytes_avail(&tls->ssl) == 0) {
+                fd_set rfds;
+                struct timeval tv = { tls->timeout_ms / 1000, tls->timeout_ms % 1000 * 1000 };
+                FD_ZERO(&rfds);
+                FD_SET(client->socket, &rfds);
+                if (select(client->socket + 1, &rfds, NULL, NULL, tls->timeout_ms ? &tv : NULL) <= 0)
+                    return -1;
+            }
+            xSemaphoreTake(tls->lock, portMAX_DELAY);
+            res = mbedtls_ssl_read(&tls->ssl, buf, len);
+            xSemaphoreGive(tls->lock);
+        } while (res == MBEDTLS_ERR_SSL_WANT_READ || res == MBEDTLS_ERR_SSL_WANT_WRITE);
+        return res;
+    }
+#endif
+    return read(client->socket, buf, len);
+}
+
+static int net_write(mqtt_client *client, const void *buf, int len)
+{
+#if CONFIG_MQTT_SECURITY_ON
+    struct mqtt_tls *tls = client->tls;
+    if (tls) {
+        int done = 0, res = 0;
+        xSemaphoreTake(tls->lock, portMAX_DELAY);
+        while (done < len) {
+            res = mbedtls_ssl_write(&tls->ssl, (const unsigned char *)buf + done, len - done);
+            if (res > 0)
+                done += res;
+            else if (res != MBEDTLS_ERR_SSL_WANT_READ && res != MBEDTLS_ERR_SSL_WANT_WRITE)
+                break;
+        }
+        xSemaphoreGive(tls->lock);
+        return done < len ? res : done;
+    }
+#endif
+    return write(client->socket, buf, len);
+}
+
+/* How long reads wait, 0 for ever */
+static void net_timeout(mqtt_client *client, int ms)
+{
+    struct timeval tv;
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = ms % 1000 * 1000;  // Not init'ing this can cause strange errors
+    setsockopt(client->socket, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(struct timeval));
+#if CONFIG_MQTT_SECURITY_ON
+    if (client->tls)
+        client->tls->timeout_ms = ms;
+#endif
+}
+
+static void net_close(mqtt_client *client)
+{
+#if CONFIG_MQTT_SECURITY_ON
+    if (client->tls) {
+        mbedtls_ssl_close_notify(&client->tls->ssl);
+        tls_free(client->tls);
+        client->tls = NULL;
+    }
+#endif
+    close(client->socket);
+}
+
 /*
  * mqtt_connect
  * input - client
@@ -80,14 +352,15 @@ static int client_connect(const char *stream_host, int stream_port)
  */
 static bool mqtt_connect(mqtt_client *client)
 {
-    int write_len, read_len, connect_rsp_code;
-    struct timeval tv;
-
-    tv.tv_sec = 10;  /* 30 Secs Timeout */
-    tv.tv_usec = 0;  // Not init'ing this can cause strange errors
+    int read_len, connect_rsp_code;
 
-    setsockopt(client->socket, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(struct timeval));
+    net_timeout(client, MQTT_CONNECT_TIMEOUT_MS);
+#if CONFIG_MQTT_SECURITY_ON
+    if (client->settings->secure && !tls_connect(client))
+        return false;
+#endif
 
+    OUTBOX_LOCK(client);
     mqtt_msg_init(&client->mqtt_state.mqtt_connection,
                   client->mqtt_state.out_buffer,
                   client->mqtt_state.out_buffer_length);
@@ -99,14 +372,14 @@ static bool mqtt_connect(mqtt_client *client)
     mqtt_info("Sending MQTT CONNECT message, type: %d, id: %04X",
               client->mqtt_state.pending_msg_type,
               client->mqtt_state.pending_msg_id);
-    write_len = write(client->socket,
-                      client->mqtt_state.outbound_message->data,
-                      client->mqtt_state.outbound_message->length);
+    net_write(client,
+              client->mqtt_state.outbound_message->data,
+              client->mqtt_state.outbound_message->length);
+    OUTBOX_UNLOCK(client);
     mqtt_info("Reading MQTT CONNECT response message");
-    read_len = read(client->socket, client->mqtt_state.in_buffer, CONFIG_MQTT_BUFFER_SIZE_BYTE);
+    read_len = net_read(client, client->mqtt_state.in_buffer, CONFIG_MQTT_BUFFER_SIZE_BYTE);
 
-    tv.tv_sec = 0;  /* No timeout */
-    setsockopt(client->socket, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(struct timeval));
+    net_timeout(client, 0);
 
     if (read_len < 0) {
         mqtt_error("Error network response");
@@ -134,164 +407,271 @@ static bool mqtt_connect(mqtt_client *client)
     return false;
 }
 
+/* Ticks from now until a PINGREQ is due, 0 if it is, portMAX_DELAY without keepalive */
+static TickType_t ping_due(mqtt_client *client, TickType_t now)
+{
+    TickType_t every = client->settings->keepalive * 1000 / 2 / portTICK_RATE_MS;
+    if (every == 0)
+        return portMAX_DELAY;
+    return now - client->last_sent >= every ? 0 : every - (now - client->last_sent);
+}
+
+/*
+ * Writes the outbox to the socket. Between messages it sleeps until the
+ * next ping or retransmission is due, rather than waking every so often
+ * to find out whether one is.
+ */
 void mqtt_sending_task(void *pvParameters)
 {
     mqtt_client *client = (mqtt_client *)pvParameters;
-    uint32_t msg_len, send_len;
+    uint32_t msg_len;
+    int32_t send_len;
+    uint8_t *data;
+    TickType_t now, wait;
     mqtt_info("mqtt_sending_task");
 
+    client->last_sent = xTaskGetTickCount();
     while (1) {
-        if (xQueueReceive(client->xSendingQueue, &msg_len, 1000 / portTICK_RATE_MS)) {
-            //queue available
+        now = xTaskGetTickCount();
+        // checked on every round, or a busy outbox would hold them off
+        inflight_retransmit(client, now);
+        //queued like the rest, it's sent on the next round. the lock
+        //is only busy while a message waits for room, no ping needed
+        if (ping_due(client, now) == 0) {
+            if (xSemaphoreTake(client->xOutboxLock, 0)) {
+                client->mqtt_state.outbound_message = mqtt_msg_pingreq(&client->mqtt_state.mqtt_connection);
+                mqtt_info("Queue pingreq");
+                mqtt_queue(client);
+                OUTBOX_UNLOCK(client);
+            }
+            client->last_sent = now;
+        }
+        wait = inflight_due(client, now);
+        if (ping_due(client, now) < wait)
+            wait = ping_due(client, now);
+        // due but not queued for want of room, which sending makes
+        if (wait == 0)
+            wait = 1;
+        if (xQueueReceive(client->xSendingQueue, &msg_len, wait)) {
+            //queue available, the data is in the outbox already
+            //and goes to the socket straight from there
             while (msg_len > 0) {
-                send_len = msg_len;
-                if (send_len > CONFIG_MQTT_BUFFER_SIZE_BYTE)
-                    send_len = CONFIG_MQTT_BUFFER_SIZE_BYTE;
+                send_len = rb_peek(&client->send_rb, &data, 0);
+                if ((uint32_t)send_len > msg_len)
+                    send_len = msg_len;
                 mqtt_info("Sending...%d bytes", send_len);
-
-                rb_read(&client->send_rb, client->mqtt_state.out_buffer, send_len);
-                client->mqtt_state.pending_msg_type = mqtt_get_type(client->mqtt_state.out_buffer);
-                client->mqtt_state.pending_msg_id = mqtt_get_id(client->mqtt_state.out_buffer, send_len);
-                write(client->socket, client->mqtt_state.out_buffer, send_len);
+                int res = net_write(client, data, send_len);
+                TRACE(TRACE_MQTT_SEND, send_len, res);
+                rb_consume(&client->send_rb, send_len);
                 //TODO: Check sending type, to callback publish message
                 msg_len -= send_len;
             }
             //invalidate keepalive timer
-            client->keepalive_tick = client->settings->keepalive / 2;
-        }
-        else {
-            if (client->keepalive_tick > 0) client->keepalive_tick --;
-            else {
-                client->keepalive_tick = client->settings->keepalive / 2;
-                client->mqtt_state.outbound_message = mqtt_msg_pingreq(&client->mqtt_state.mqtt_connection);
-                client->mqtt_state.pending_msg_type = mqtt_get_type(client->mqtt_state.outbound_message->data);
-                client->mqtt_state.pending_msg_id = mqtt_get_id(client->mqtt_state.outbound_message->data,
-                                                    client->mqtt_state.outbound_message->length);
-                mqtt_info("Sending pingreq");
-                write(client->socket,
-                      client->mqtt_state.outbound_message->data,
-                      client->mqtt_state.outbound_message->length);
-            }
+            client->last_sent = xTaskGetTickCount();
         }
     }
     vTaskDelete(NULL);
 }
 
-void deliver_publish(mqtt_client *client, uint8_t *message, int length)
+/*
+ * Hand a PUBLISH to data_cb, length bytes of it being in message already.
+ * The rest is read straight after, a buffer at a time, never past the end
+ * of the message.
+ */
+static void deliver_publish(mqtt_client *client, uint8_t *message, int length, int total)
 {
     mqtt_event_data_t event_data;
-    int len_read, total_mqtt_len = 0, mqtt_len = 0, mqtt_offset = 0;
+    int left = total - length;
 
-    do
-    {
-        event_data.topic_length = length;
-        event_data.topic = mqtt_get_publish_topic(message, &event_data.topic_length);
-        event_data.data_length = length;
-        event_data.data = mqtt_get_publish_data(message, &event_data.data_length);
+    event_data.topic_length = length;
+    event_data.topic = mqtt_get_publish_topic(message, &event_data.topic_length);
+    event_data.data_length = length;
+    event_data.data = mqtt_get_publish_data(message, &event_data.data_length);
+    event_data.data_offset = 0;
+    event_data.data_total_length = event_data.data_length + left;
 
-        if(total_mqtt_len == 0){
-            total_mqtt_len = client->mqtt_state.message_length - client->mqtt_state.message_length_read + event_data.data_length;
-            mqtt_len = event_data.data_length;
-        } else {
-            mqtt_len = len_read;
+    while (1) {
+        mqtt_info("Data received: %d/%d bytes ", event_data.data_offset + event_data.data_length,
+                  event_data.data_total_length);
+        if (client->settings->data_cb) {
+            client->settings->data_cb(client, &event_data);
         }
+        event_data.data_offset += event_data.data_length;
+        if (left <= 0)
+            break;
+        // a broken connection shows up again at the next read
+        length = net_read(client, client->mqtt_state.in_buffer,
+                      left < client->mqtt_state.in_buffer_length ? left : client->mqtt_state.in_buffer_length);
+        if (length <= 0)
+            break;
+        left -= length;
+        event_data.topic = NULL;
+        event_data.topic_length = 0;
+        event_data.data = (const char *)client->mqtt_state.in_buffer;
+        event_data.data_length = length;
+    }
+}
 
-        event_data.data_total_length = total_mqtt_len;
-        event_data.data_offset = mqtt_offset;
-        event_data.data_length = mqtt_len;
+/* Answer the QoS of an incoming PUBLISH, taking the outbox lock */
+static void ack_publish(mqtt_client *client, uint8_t *message, int length)
+{
+    int msg_qos = mqtt_get_qos(message);
+    uint16_t msg_id = mqtt_get_id(message, length);
+
+    if (msg_qos == 0)
+        return;
+    OUTBOX_LOCK(client);
+    if (msg_qos == 1)
+        client->mqtt_state.outbound_message = mqtt_msg_puback(&client->mqtt_state.mqtt_connection, msg_id);
+    else
+        client->mqtt_state.outbound_message = mqtt_msg_pubrec(&client->mqtt_state.mqtt_connection, msg_id);
+    mqtt_info("Queue response QoS: %d", msg_qos);
+    mqtt_queue(client);
+    OUTBOX_UNLOCK(client);
+}
 
-        mqtt_info("Data received: %d/%d bytes ", mqtt_len, total_mqtt_len);
-        if(client->settings->data_cb) {
-            client->settings->data_cb(client, &event_data);
-        }
-        mqtt_offset += mqtt_len;
-        if (client->mqtt_state.message_length_read >= client->mqtt_state.message_length)
+/*
+ * Deal with any other complete message, with the outbox lock held.
+ * Returns the number of in-flight slots it freed.
+ */
+static int handle_message(mqtt_client *client, uint8_t *message, int length)
+{
+    uint16_t msg_id = mqtt_get_id(message, length);
+    mqtt_inflight_t *f;
+
+    switch (mqtt_get_type(message))
+    {
+        case MQTT_MSG_TYPE_UNSUBACK:
+            if (client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_UNSUBSCRIBE && client->mqtt_state.pending_msg_id == msg_id)
+                mqtt_info("UnSubscribe successful");
+            break;
+        case MQTT_MSG_TYPE_PUBACK:
+            f = inflight_find(client, msg_id, MQTT_MSG_TYPE_PUBLISH);
+            if (f && mqtt_get_qos(f->msg) == 1) {
+                mqtt_info("received MQTT_MSG_TYPE_PUBACK, finish QoS1 publish");
+                inflight_free(f);
+                return 1;
+            }
+            break;
+        case MQTT_MSG_TYPE_PUBREC:
+            client->mqtt_state.outbound_message = mqtt_msg_pubrel(&client->mqtt_state.mqtt_connection, msg_id);
+            f = inflight_find(client, msg_id, MQTT_MSG_TYPE_PUBLISH);
+            if (f && mqtt_get_qos(f->msg) == 2) {
+                // from now on it's the PUBREL that waits, in the same
+                // slot, the PUBLISH being larger than it
+                f->length = client->mqtt_state.outbound_message->length;
+                memcpy(f->msg, client->mqtt_state.outbound_message->data, f->length);
+                f->sent = xTaskGetTickCount();
+            }
+            mqtt_queue(client);
             break;
-        len_read = read(client->socket,  client->mqtt_state.in_buffer, CONFIG_MQTT_BUFFER_SIZE_BYTE);
-        client->mqtt_state.message_length_read += len_read;
-    } while (1);
+        case MQTT_MSG_TYPE_PUBREL:
+            client->mqtt_state.outbound_message = mqtt_msg_pubcomp(&client->mqtt_state.mqtt_connection, msg_id);
+            mqtt_queue(client);
+            break;
+        case MQTT_MSG_TYPE_PUBCOMP:
+            f = inflight_find(client, msg_id, MQTT_MSG_TYPE_PUBREL);
+            if (f) {
+                mqtt_info("Receive MQTT_MSG_TYPE_PUBCOMP, finish QoS2 publish");
+                inflight_free(f);
+                return 1;
+            }
+            break;
+        case MQTT_MSG_TYPE_PINGREQ:
+            client->mqtt_state.outbound_message = mqtt_msg_pingresp(&client->mqtt_state.mqtt_connection);
+            mqtt_queue(client);
+            break;
+        case MQTT_MSG_TYPE_PINGRESP:
+            mqtt_info("MQTT_MSG_TYPE_PINGRESP");
+            // Ignore
+            break;
+    }
+    return 0;
+}
 
+/* Bytes the message at p takes, or 0 if its length isn't all in yet */
+static int message_length(uint8_t *p, int have)
+{
+    for (int i = 1; i < have && i < 5; i++)
+        if ((p[i] & 0x80) == 0)
+            return mqtt_get_total_length(p, have);
+    return 0;
 }
+
 void mqtt_start_receive_schedule(mqtt_client *client)
 {
-    int read_len;
-    uint8_t msg_type;
-    uint8_t msg_qos;
-    uint16_t msg_id;
+    uint8_t *buf = client->mqtt_state.in_buffer;
+    int size = client->mqtt_state.in_buffer_length;
+    int have = 0, read_len, len, freed;
+    bool locked;
+    uint8_t *p;
 
     while (1) {
-        read_len = read(client->socket, client->mqtt_state.in_buffer, CONFIG_MQTT_BUFFER_SIZE_BYTE);
+        read_len = net_read(client, buf + have, size - have);
         mqtt_info("Read len %d", read_len);
-        if (read_len == 0)
+        if (read_len <= 0)
             break;
-
-        msg_type = mqtt_get_type(client->mqtt_state.in_buffer);
-        msg_qos = mqtt_get_qos(client->mqtt_state.in_buffer);
-        msg_id = mqtt_get_id(client->mqtt_state.in_buffer, client->mqtt_state.in_buffer_length);
-        // mqtt_info("msg_type %d, msg_id: %d, pending_id: %d", msg_type, msg_id, client->mqtt_state.pending_msg_type);
-        switch (msg_type)
-        {
-            case MQTT_MSG_TYPE_SUBACK:
-                if (client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_SUBSCRIBE && client->mqtt_state.pending_msg_id == msg_id) {
+        TRACE(TRACE_MQTT_RECV, read_len, 0);
+        have += read_len;
+
+        // Everything a read brings in is worked off together: the acks of
+        // a burst under one hold of the lock, and publishers waiting for
+        // the window woken once it's through
+        p = buf;
+        locked = false;
+        freed = 0;
+        while (have > 0 && (len = message_length(p, have)) > 0) {
+            int type = mqtt_get_type(p);
+            if (type == MQTT_MSG_TYPE_PUBLISH) {
+                uint16_t head = have;
+                // the rest may follow, but the topic and id must be here
+                if (len > have && mqtt_get_publish_data(p, &head) == NULL)
+                    break;
+                // data_cb may wait for whoever is after the lock
+                if (locked) {
+                    OUTBOX_UNLOCK(client);
+                    locked = false;
+                }
+                ack_publish(client, p, len < have ? len : have);
+                mqtt_info("deliver_publish");
+                TRACE(TRACE_MQTT_DELIVER_B, type, len);
+                deliver_publish(client, p, len < have ? len : have, len);
+                TRACE(TRACE_MQTT_DELIVER_E, type, len);
+                if (len > have)
+                    len = have;
+            } else if (len > have) {
+                break;
+            } else if (type == MQTT_MSG_TYPE_SUBACK) {
+                if (locked) {
+                    OUTBOX_UNLOCK(client);
+                    locked = false;
+                }
+                if (client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_SUBSCRIBE &&
+                        client->mqtt_state.pending_msg_id == mqtt_get_id(p, len)) {
                     mqtt_info("Subscribe successful");
                     if (client->settings->subscribe_cb) {
                         client->settings->subscribe_cb(client, NULL);
                     }
                 }
-                break;
-            case MQTT_MSG_TYPE_UNSUBACK:
-                if (client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_UNSUBSCRIBE && client->mqtt_state.pending_msg_id == msg_id)
-                    mqtt_info("UnSubscribe successful");
-                break;
-            case MQTT_MSG_TYPE_PUBLISH:
-                if (msg_qos == 1)
-                    client->mqtt_state.outbound_message = mqtt_msg_puback(&client->mqtt_state.mqtt_connection, msg_id);
-                else if (msg_qos == 2)
-                    client->mqtt_state.outbound_message = mqtt_msg_pubrec(&client->mqtt_state.mqtt_connection, msg_id);
-
-                if (msg_qos == 1 || msg_qos == 2) {
-                    mqtt_info("Queue response QoS: %d", msg_qos);
-                    mqtt_queue(client);
-                    // if (QUEUE_Puts(&client->msgQueue, client->mqtt_state.outbound_message->data, client->mqtt_state.outbound_message->length) == -1) {
-                    //     mqtt_info("MQTT: Queue full");
-                    // }
+            } else {
+                if (!locked) {
+                    OUTBOX_LOCK(client);
+                    locked = true;
                 }
-                client->mqtt_state.message_length_read = read_len;
-                client->mqtt_state.message_length = mqtt_get_total_length(client->mqtt_state.in_buffer, client->mqtt_state.message_length_read);
-                mqtt_info("deliver_publish");
-
-                deliver_publish(client, client->mqtt_state.in_buffer, client->mqtt_state.message_length_read);
-                // deliver_publish(client, client->mqtt_state.in_buffer, client->mqtt_state.message_length_read);
-                break;
-            case MQTT_MSG_TYPE_PUBACK:
-                if (client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_PUBLISH && client->mqtt_state.pending_msg_id == msg_id) {
-                    mqtt_info("received MQTT_MSG_TYPE_PUBACK, finish QoS1 publish");
-                }
-
-                break;
-            case MQTT_MSG_TYPE_PUBREC:
-                client->mqtt_state.outbound_message = mqtt_msg_pubrel(&client->mqtt_state.mqtt_connection, msg_id);
-                mqtt_queue(client);
-                break;
-            case MQTT_MSG_TYPE_PUBREL:
-                client->mqtt_state.outbound_message = mqtt_msg_pubcomp(&client->mqtt_state.mqtt_connection, msg_id);
-                mqtt_queue(client);
-
-                break;
-            case MQTT_MSG_TYPE_PUBCOMP:
-                if (client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_PUBLISH && client->mqtt_state.pending_msg_id == msg_id) {
-                    mqtt_info("Receive MQTT_MSG_TYPE_PUBCOMP, finish QoS2 publish");
-                }
-                break;
-            case MQTT_MSG_TYPE_PINGREQ:
-                client->mqtt_state.outbound_message = mqtt_msg_pingresp(&client->mqtt_state.mqtt_connection);
-                mqtt_queue(client);
-                break;
-            case MQTT_MSG_TYPE_PINGRESP:
-                mqtt_info("MQTT_MSG_TYPE_PINGRESP");
-                // Ignore
-                break;
+                freed += handle_message(client, p, len);
+            }
+            p += len;
+            have -= len;
         }
+        if (locked)
+            OUTBOX_UNLOCK(client);
+        while (freed-- > 0)
+            xSemaphoreGive(client->xInflightFree);
+        if (p == buf && have == size) {
+            mqtt_error("Message head larger than the network buffer");
+            break;
+        }
+        memmove(buf, p, have);
     }
     mqtt_info("network disconnected");
 }
@@ -301,9 +681,17 @@ void mqtt_destroy(mqtt_client *client)
     free(client->mqtt_state.in_buffer);
     free(client->mqtt_state.out_buffer);
     free(client);
-    vTaskDelete(xMqttTask);
+    vTaskDelete(NULL);
 }
 
+// Kconfig hides the setting on single core builds, a hand edited sdkconfig
+// may still carry it
+#if defined(CONFIG_MQTT_TASK_CORE) && CONFIG_MQTT_TASK_CORE >= 0 && !defined(CONFIG_FREERTOS_UNICORE)
+#define MQTT_TASK_CORE CONFIG_MQTT_TASK_CORE
+#else
+#define MQTT_TASK_CORE tskNO_AFFINITY
+#endif
+
 void mqtt_task(void *pvParameters)
 {
     mqtt_client *client = (mqtt_client *)pvParameters;
@@ -312,11 +700,17 @@ void mqtt_task(void *pvParameters)
         client->socket = client_connect(client->settings->host, client->settings->port);
         mqtt_info("Connected to server %s:%d", client->settings->host, client->settings->port);
         if (!mqtt_connect(client)) {
+            net_close(client);
+            vTaskDelay(1000 / portTICK_RATE_MS);
             continue;
-            //return;
         }
+        // whatever was in flight goes again as soon as the sending task runs
+        OUTBOX_LOCK(client);
+        for (int i = 0; i < CONFIG_MQTT_INFLIGHT_MAX; i++)
+            client->inflight[i].sent = xTaskGetTickCount() - MQTT_RETRANSMIT_TICKS;
+        OUTBOX_UNLOCK(client);
         mqtt_info("Connected to MQTT broker, create sending thread before call connected callback");
-        xTaskCreate(&mqtt_sending_task, "mqtt_sending_task", 2048, client, CONFIG_MQTT_PRIORITY + 1, &xMqttSendingTask);
+        xTaskCreatePinnedToCore(&mqtt_sending_task, "mqtt_sending_task", 2048, client, CONFIG_MQTT_PRIORITY + 1, &client->xSendingTask, MQTT_TASK_CORE);
         if (client->settings->connected_cb) {
             client->settings->connected_cb(client, NULL);
         }
@@ -324,8 +718,12 @@ void mqtt_task(void *pvParameters)
         mqtt_info("mqtt_start_receive_schedule");
         mqtt_start_receive_schedule(client);
 
-        close(client->socket);
-        vTaskDelete(xMqttSendingTask);
+        // the sending task may be writing, and goes before the context does
+        vTaskDelete(client->xSendingTask);
+        net_close(client);
+        if (client->settings->disconnected_cb) {
+            client->settings->disconnected_cb(client, NULL);
+        }
         vTaskDelay(1000 / portTICK_RATE_MS);
 
     }
@@ -337,8 +735,6 @@ void mqtt_task(void *pvParameters)
 mqtt_client *mqtt_start(mqtt_settings *settings)
 {
     uint8_t *rb_buf;
-    if (xMqttTask != NULL)
-        return NULL;
     mqtt_client *client = malloc(sizeof(mqtt_client));
 
     if (client == NULL) {
@@ -357,8 +753,6 @@ mqtt_client *mqtt_start(mqtt_settings *settings)
     client->connect_info.will_retain = settings->lwt_retain;
 
 
-    client->keepalive_tick = settings->keepalive / 2;
-
     client->connect_info.keepalive = settings->keepalive;
     client->connect_info.clean_session = settings->clean_session;
 
@@ -372,44 +766,87 @@ mqtt_client *mqtt_start(mqtt_settings *settings)
 
     /* Create a queue capable of containing 64 unsigned long values. */
     client->xSendingQueue = xQueueCreate(64, sizeof( uint32_t ));
+    client->xOutboxLock = xSemaphoreCreateMutex();
+    client->xInflightFree = xSemaphoreCreateCounting(CONFIG_MQTT_INFLIGHT_MAX, CONFIG_MQTT_INFLIGHT_MAX);
     rb_buf = (uint8_t*) malloc(CONFIG_MQTT_QUEUE_BUFFER_SIZE_WORD * 4);
 
-    if (rb_buf == NULL) {
+    if (rb_buf == NULL || client->xOutboxLock == NULL || client->xInflightFree == NULL) {
         mqtt_error("Memory not enough");
         return NULL;
     }
 
-    rb_init(&client->send_rb, rb_buf, CONFIG_MQTT_QUEUE_BUFFER_SIZE_WORD * 4, 1);
+    rb_init(&client->send_rb, rb_buf, CONFIG_MQTT_QUEUE_BUFFER_SIZE_WORD * 4);
 
     mqtt_msg_init(&client->mqtt_state.mqtt_connection,
                   client->mqtt_state.out_buffer,
                   client->mqtt_state.out_buffer_length);
 
-    xTaskCreate(&mqtt_task, "mqtt_task", 2048, client, CONFIG_MQTT_PRIORITY, &xMqttTask);
+    xTaskCreatePinnedToCore(&mqtt_task, "mqtt_task", 2048, client, CONFIG_MQTT_PRIORITY, &client->xTask, MQTT_TASK_CORE);
     return client;
 }
 
 void mqtt_subscribe(mqtt_client *client, char *topic, uint8_t qos)
 {
+    OUTBOX_LOCK(client);
     client->mqtt_state.outbound_message = mqtt_msg_subscribe(&client->mqtt_state.mqtt_connection,
                                           topic, qos,
                                           &client->mqtt_state.pending_msg_id);
     mqtt_info("Queue subscribe, topic\"%s\", id: %d", topic, client->mqtt_state.pending_msg_id);
     mqtt_queue(client);
+    OUTBOX_UNLOCK(client);
 }
 
-void mqtt_publish(mqtt_client* client, char *topic, char *data, int len, int qos, int retain)
+void mqtt_unsubscribe(mqtt_client *client, char *topic)
 {
-
-    client->mqtt_state.outbound_message = mqtt_msg_publish(&client->mqtt_state.mqtt_connection,
-                                          topic, data, len,
-                                          qos, retain,
+    OUTBOX_LOCK(client);
+    client->mqtt_state.outbound_message = mqtt_msg_unsubscribe(&client->mqtt_state.mqtt_connection,
+                                          topic,
                                           &client->mqtt_state.pending_msg_id);
+    mqtt_info("Queue unsubscribe, topic\"%s\", id: %d", topic, client->mqtt_state.pending_msg_id);
     mqtt_queue(client);
+    OUTBOX_UNLOCK(client);
+}
+
+bool mqtt_publish(mqtt_client* client, char *topic, char *data, int len, int qos, int retain)
+{
+    mqtt_inflight_t *f = NULL;
+    mqtt_message_t *msg;
+    bool ok;
+
+    if (qos > 0 && !xSemaphoreTake(client->xInflightFree, MQTT_QUEUE_WAIT_MS / portTICK_RATE_MS)) {
+        mqtt_error("In-flight window full, message dropped");
+        return false;
+    }
+    OUTBOX_LOCK(client);
+    msg = mqtt_msg_publish(&client->mqtt_state.mqtt_connection,
+                           topic, data, len,
+                           qos, retain,
+                           &client->mqtt_state.pending_msg_id);
+    client->mqtt_state.outbound_message = msg;
+    if (qos > 0) {
+        // there is a free slot, the semaphore says so
+        for (int i = 0; !f; i++)
+            if (!client->inflight[i].msg)
+                f = &client->inflight[i];
+        f->msg = (uint8_t *)malloc(msg->length);
+        if (f->msg) {
+            memcpy(f->msg, msg->data, msg->length);
+            f->length = msg->length;
+            f->msg_id = client->mqtt_state.pending_msg_id;
+            f->sent = xTaskGetTickCount();
+        }
+    }
+    ok = (f == NULL || f->msg != NULL) && mqtt_queue(client);
+    if (!ok && f) {
+        inflight_free(f);
+        xSemaphoreGive(client->xInflightFree);
+    }
     mqtt_info("Queuing publish, length: %d, queue size(%d/%d)\r\n",
-              client->mqtt_state.outbound_message->length,
-              client->send_rb.fill_cnt,
+              msg->length,
+              rb_filled(&client->send_rb),
               client->send_rb.size);
+    OUTBOX_UNLOCK(client);
+    return ok;
 }
 void mqtt_stop()
 {
@@ -11,96 +11,141 @@
 * \param r pointer to a RINGBUF object
 * \param buf pointer to a byte array
 * \param size size of buf
-* \param block_size is size of data as block
 * \return 0 if successfull, otherwise failed
 */
-int32_t rb_init(RINGBUF *r, uint8_t* buf, int32_t size, int32_t block_size)
+int32_t rb_init(RINGBUF *r, uint8_t* buf, int32_t size)
 {
     if (r == 0 || buf == 0 || size < 2) return -1;
 
-    if (size % block_size != 0) return -1;
-
-    r->p_o = r->p_r = r->p_w = buf;
-    r->fill_cnt = 0;
+    r->p_o = buf;
     r->size = size;
-    r->block_size = block_size;
+    r->head = r->tail = 0;
+    r->writer = r->reader = NULL;
     return 0;
 }
-/**
-* \brief put a character into ring buffer
-* \param r pointer to a ringbuf object
-* \param c character to be put
-* \return 0 if successfull, otherwise failed
-*/
-int32_t rb_put(RINGBUF *r, uint8_t *c)
-{
-    int32_t i;
-    uint8_t *data = c;
-    if (r->fill_cnt >= r->size)
-        return -1; // ring buffer is full, this should be atomic operation
 
+static inline int32_t rb_fill(RINGBUF *r, int32_t head, int32_t tail)
+{
+    return head >= tail ? head - tail : head + r->size - tail;
+}
 
-    r->fill_cnt += r->block_size;             // increase filled slots count, this should be atomic operation
+int32_t rb_filled(RINGBUF *r)
+{
+    return rb_fill(r, r->head, r->tail);
+}
 
-    for (i = 0; i < r->block_size; i++) {
-        *r->p_w = *data;              // put character into buffer
+int32_t rb_available(RINGBUF *r)
+{
+    return r->size - 1 - rb_filled(r);
+}
 
-        r->p_w ++;
-        data ++;
+/*
+ * Block until cond() holds or wait runs out. The waiter is published
+ * before cond() is checked again, so a wakeup given in between is kept as
+ * a pending notification rather than lost.
+ */
+static bool rb_wait(TaskHandle_t volatile *waiter, RINGBUF *r,
+                    bool (*cond)(RINGBUF *, int32_t), int32_t arg, TickType_t wait)
+{
+    TickType_t start = xTaskGetTickCount();
+    while (!cond(r, arg)) {
+        TickType_t spent = xTaskGetTickCount() - start;
+        if (spent >= wait)
+            return false;
+        *waiter = xTaskGetCurrentTaskHandle();
+        __sync_synchronize();
+        if (!cond(r, arg))
+            ulTaskNotifyTake(pdTRUE, wait == portMAX_DELAY ? portMAX_DELAY : wait - spent);
+        *waiter = NULL;
     }
-
-    if (r->p_w >= r->p_o + r->size)     // rollback if write pointer go pass
-        r->p_w = r->p_o;          // the physical boundary
-
-    return 0;
+    return true;
 }
-/**
-* \brief get a character from ring buffer
-* \param r pointer to a ringbuf object
-* \param c read character
-* \return 0 if successfull, otherwise failed
-*/
-int32_t rb_get(RINGBUF *r, uint8_t *c)
-{
-    int32_t i;
-    uint8_t *data = c;
-    if (r->fill_cnt <= 0)return -1;     // ring buffer is empty, this should be atomic operation
 
-    r->fill_cnt -= r->block_size;              // decrease filled slots count
+static void rb_wake(TaskHandle_t volatile *waiter)
+{
+    __sync_synchronize();
+    TaskHandle_t t = *waiter;
+    if (t)
+        xTaskNotifyGive(t);
+}
 
-    for (i = 0; i < r->block_size; i++)
-        *data++ = *r->p_r++;               // get the character out
+static bool rb_has_room(RINGBUF *r, int32_t len)
+{
+    return rb_available(r) >= len;
+}
 
-    if (r->p_r >= r->p_o + r->size)       // rollback if write pointer go pass
-        r->p_r = r->p_o;            // the physical boundary
+static bool rb_has_data(RINGBUF *r, int32_t len)
+{
+    (void)len;
+    return r->head != r->tail;
+}
 
-    return 0;
+int32_t rb_writev(RINGBUF *r, const rb_part_t *parts, int n, TickType_t wait)
+{
+    int32_t len = 0;
+    for (int i = 0; i < n; i++)
+        len += parts[i].len;
+    if (len > r->size - 1 || !rb_wait(&r->writer, r, rb_has_room, len, wait))
+        return -1;
+
+    int32_t head = r->head;
+    for (int i = 0; i < n; i++) {
+        const uint8_t *buf = parts[i].p;
+        int32_t first = r->size - head;
+        if (first > parts[i].len)
+            first = parts[i].len;
+        memcpy(r->p_o + head, buf, first);
+        memcpy(r->p_o, buf + first, parts[i].len - first);
+        head += parts[i].len;
+        if (head >= r->size)
+            head -= r->size;
+    }
+    __sync_synchronize();   // the data before the index that publishes it
+    r->head = head;
+    rb_wake(&r->reader);
+    return len;
 }
 
-int32_t rb_available(RINGBUF *r)
+int32_t rb_write(RINGBUF *r, const uint8_t *buf, int32_t len, TickType_t wait)
 {
-    return (r->size - r->fill_cnt);
+    rb_part_t part = { buf, len };
+    return rb_writev(r, &part, 1, wait);
 }
 
-uint32_t rb_read(RINGBUF *r, uint8_t *buf, int len)
+int32_t rb_peek(RINGBUF *r, uint8_t **p, TickType_t wait)
 {
-    int n = 0;
-    uint8_t data;
-    while (len > 0) {
-        while (rb_get(r, &data) != 0);
-        *buf++ = data;
-        n ++;
-        len --;
-    }
+    if (!rb_wait(&r->reader, r, rb_has_data, 0, wait))
+        return 0;
+    int32_t head = r->head, tail = r->tail;
+    __sync_synchronize();   // the index before the data it covers
+    *p = r->p_o + tail;
+    return head >= tail ? head - tail : r->size - tail;
+}
 
-    return n;
+void rb_consume(RINGBUF *r, int32_t len)
+{
+    int32_t tail = r->tail + len;
+    if (tail >= r->size)
+        tail -= r->size;
+    __sync_synchronize();
+    r->tail = tail;
+    rb_wake(&r->writer);
 }
 
-uint32_t rb_write(RINGBUF *r, uint8_t *buf, int len)
+int32_t rb_read(RINGBUF *r, uint8_t *buf, int32_t len, TickType_t wait)
 {
-    uint32_t wi;
-    for (wi = 0; wi < len; wi++) {
-        while (rb_put(r, &buf[wi]) != 0);
+    int32_t n = 0;
+    uint8_t *p;
+    // at most two contiguous pieces, the second one is there already
+    while (n < len) {
+        int32_t got = rb_peek(r, &p, n ? 0 : wait);
+        if (got == 0)
+            break;
+        if (got > len - n)
+            got = len - n;
+        memcpy(buf + n, p, got);
+        rb_consume(r, got);
+        n += got;
     }
-    return 0;
+    return n;
 }
@@ -52,7 +52,8 @@ typedef struct TTree {
 
 /*
 ** A complete pattern has its tree plus, if already compiled,
-** its corresponding code
+** its corresponding code. A negative 'codesize' means the code is not
+** the pattern's own but runs in place from a loaded image.
 */
 typedef struct Pattern {
   union Instruction *code;
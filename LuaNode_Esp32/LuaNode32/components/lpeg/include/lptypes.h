@@ -24,6 +24,9 @@
 
 #define PATTERN_T	"lpeg-pattern"
 #define MAXSTACKIDX	"lpeg-maxstack"
+#define CACHEIDX	"lpeg-cache"
+#define MAXCAPIDX	"lpeg-maxcaptures"
+#define STREAM_T	"lpeg-stream"
 
 
 /*
@@ -65,6 +68,11 @@
 /* initial size for capture's list */
 #define INITCAPSIZE	32
 
+/* default maximum size for capture's list */
+#if !defined(MAXCAPTURES)
+#define MAXCAPTURES	4096
+#endif
+
 
 /* index, on Lua stack, for subject */
 #define SUBJIDX		2
@@ -51,7 +51,7 @@ typedef union Instruction {
 
 void printpatt (Instruction *p, int n);
 const char *match (lua_State *L, const char *o, const char *s, const char *e,
-                   Instruction *op, Capture *capture, int ptop);
+                   Instruction *op, Capture *capture, int ptop, int *atend);
 
 
 #endif
@@ -5,6 +5,7 @@
 
 #include <ctype.h>
 #include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 
 
@@ -1119,11 +1120,210 @@ static int lp_printcode (lua_State *L) {
   printktable(L, 1);
   if (p->code == NULL)  /* not compiled yet? */
     prepcompile(L, p, 1);
-  printpatt(p->code, p->codesize);
+  printpatt(p->code, abs(p->codesize));
   return 0;
 }
 
 
+/*
+** {======================================================
+** Dumping and loading compiled patterns
+** An image holds the code, the tree (so that a loaded pattern can
+** still be combined with others) and the ktable, which may only hold
+** strings, numbers and booleans. Images are only good for the firmware
+** that made them. A loaded pattern runs its code straight from the
+** image, so an image kept in the asset partition costs no RAM for code.
+** =======================================================
+*/
+
+#define IMAGEMAGIC	"LPG1"
+
+typedef struct ImageHeader {
+  char magic[4];
+  unsigned short ntree;  /* number of TTree's */
+  unsigned short nktable;  /* number of ktable values */
+  int ncode;  /* number of Instruction's; code follows the header */
+} ImageHeader;
+
+
+static void dumpvalue (lua_State *L, luaL_Buffer *b) {
+  int t = lua_type(L, -1);
+  luaL_addchar(b, t);
+  switch (t) {
+    case LUA_TSTRING: {
+      size_t len;
+      const char *s = lua_tolstring(L, -1, &len);
+      unsigned int n = len;
+      luaL_addlstring(b, (const char *)&n, sizeof(n));
+      luaL_addlstring(b, s, len);
+      break;
+    }
+    case LUA_TNUMBER: {
+      lua_Number n = lua_tonumber(L, -1);
+      luaL_addlstring(b, (const char *)&n, sizeof(n));
+      break;
+    }
+    case LUA_TBOOLEAN:
+      luaL_addchar(b, lua_toboolean(L, -1));
+      break;
+    default:
+      luaL_error(L, "pattern holds a %s, cannot dump it", lua_typename(L, t));
+  }
+  lua_pop(L, 1);
+}
+
+
+static int lp_dump (lua_State *L) {
+  Pattern *p;
+  int ntree, nk, i;
+  ImageHeader h;
+  luaL_Buffer b;
+  lua_settop(L, 1);
+  p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  ntree = getsize(L, 1);
+  if (p->code == NULL)
+    prepcompile(L, p, 1);
+  lua_getuservalue(L, 1);
+  nk = ktablelen(L, -1);
+  if (ntree > USHRT_MAX)
+    luaL_error(L, "pattern too big to dump");
+  memcpy(h.magic, IMAGEMAGIC, sizeof(h.magic));
+  h.ntree = ntree;
+  h.nktable = nk;
+  h.ncode = abs(p->codesize);
+  luaL_buffinit(L, &b);
+  luaL_addlstring(&b, (const char *)&h, sizeof(h));
+  luaL_addlstring(&b, (const char *)p->code, h.ncode * sizeof(Instruction));
+  luaL_addlstring(&b, (const char *)p->tree, ntree * sizeof(TTree));
+  for (i = 1; i <= nk; i++) {
+    lua_rawgeti(L, 2, i);
+    dumpvalue(L, &b);
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+
+/*
+** Read one ktable value from 's' (with 'e' its end) and push it;
+** return where the next one starts, or NULL if the image is short
+*/
+static const char *loadvalue (lua_State *L, const char *s, const char *e) {
+  if (s >= e) return NULL;
+  switch (*s++) {
+    case LUA_TSTRING: {
+      unsigned int n;
+      if ((size_t)(e - s) < sizeof(n)) return NULL;
+      memcpy(&n, s, sizeof(n));
+      s += sizeof(n);
+      if ((size_t)(e - s) < n) return NULL;
+      lua_pushlstring(L, s, n);
+      return s + n;
+    }
+    case LUA_TNUMBER: {
+      lua_Number n;
+      if ((size_t)(e - s) < sizeof(n)) return NULL;
+      memcpy(&n, s, sizeof(n));
+      lua_pushnumber(L, n);
+      return s + sizeof(n);
+    }
+    case LUA_TBOOLEAN:
+      if (s >= e) return NULL;
+      lua_pushboolean(L, *s);
+      return s + 1;
+    default:
+      return NULL;
+  }
+}
+
+
+/* push the cache of loaded and built patterns */
+static void getcache (lua_State *L) {
+  lua_getfield(L, LUA_REGISTRYINDEX, CACHEIDX);
+}
+
+
+static int lp_load (lua_State *L) {
+  size_t len;
+  const char *s = luaL_checklstring(L, 1, &len);
+  const char *e = s + len;
+  const char *code, *t;
+  ImageHeader h;
+  Pattern *p;
+  int i;
+  getcache(L);
+  lua_pushvalue(L, 1);
+  lua_rawget(L, -2);
+  if (!lua_isnil(L, -1))  /* loaded before? */
+    return 1;
+  lua_pop(L, 1);
+  if (len < sizeof(h))
+    luaL_argerror(L, 1, "not a pattern image");
+  memcpy(&h, s, sizeof(h));
+  code = s + sizeof(h);
+  t = code + h.ncode * sizeof(Instruction);
+  if (memcmp(h.magic, IMAGEMAGIC, sizeof(h.magic)) != 0 || h.ncode <= 0 ||
+      h.ntree == 0 || (size_t)h.ncode > len / sizeof(Instruction) ||
+      (size_t)(e - t) < h.ntree * sizeof(TTree))
+    luaL_argerror(L, 1, "not a pattern image");
+  memcpy(newtree(L, h.ntree), t, h.ntree * sizeof(TTree));
+  p = getpattern(L, -1);
+  t += h.ntree * sizeof(TTree);
+  newktable(L, h.nktable);
+  lua_getuservalue(L, -1);
+  for (i = 1; i <= h.nktable; i++) {
+    if ((t = loadvalue(L, t, e)) == NULL)
+      luaL_argerror(L, 1, "not a pattern image");
+    lua_rawseti(L, -2, i);
+  }
+  lua_pushvalue(L, 1);  /* keep the image alive as long as the code is used */
+  lua_setfield(L, -2, "image");
+  lua_pop(L, 1);  /* remove 'ktable' */
+  if (((size_t)code & (sizeof(Instruction) - 1)) == 0) {
+    p->code = (Instruction *)code;  /* run it in place */
+    p->codesize = -h.ncode;
+  }
+  else {  /* misaligned: needs a copy */
+    realloccode(L, p, h.ncode);
+    memcpy(p->code, code, h.ncode * sizeof(Instruction));
+  }
+  lua_pushvalue(L, 1);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, -4);  /* cache[image] = pattern */
+  return 1;
+}
+
+
+/*
+** lpeg.cache(key, build): the pattern cached under 'key', or, the
+** first time, what build(key) returns, compiled at once. Patterns stay
+** in the cache for as long as something else refers to them.
+*/
+static int lp_cache (lua_State *L) {
+  luaL_checkany(L, 1);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_settop(L, 2);
+  getcache(L);
+  lua_pushvalue(L, 1);
+  lua_rawget(L, 3);
+  if (!lua_isnil(L, -1))
+    return 1;
+  lua_pop(L, 1);
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, 1);
+  lua_call(L, 1, 1);
+  getpatt(L, 4, NULL);
+  if (getpattern(L, 4)->code == NULL)
+    prepcompile(L, getpattern(L, 4), 4);
+  lua_pushvalue(L, 1);
+  lua_pushvalue(L, 4);
+  lua_rawset(L, 3);
+  return 1;
+}
+
+/* }====================================================== */
+
+
 /*
 ** Get the initial position for the match, interpreting negative
 ** values from the end of the subject
@@ -1150,6 +1350,7 @@ static int lp_match (lua_State *L) {
   Capture capture[INITCAPSIZE];
   const char *r;
   size_t l;
+  int atend;
   Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
   Instruction *code = (p->code != NULL) ? p->code : prepcompile(L, p, 1);
   const char *s = luaL_checklstring(L, SUBJIDX, &l);
@@ -1158,7 +1359,7 @@ static int lp_match (lua_State *L) {
   lua_pushnil(L);  /* initialize subscache */
   lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
   lua_getuservalue(L, 1);  /* initialize penvidx */
-  r = match(L, s, s + i, s + l, code, capture, ptop);
+  r = match(L, s, s + i, s + l, code, capture, ptop, &atend);
   if (r == NULL) {
     lua_pushnil(L);
     return 1;
@@ -1167,6 +1368,157 @@ static int lp_match (lua_State *L) {
 }
 
 
+/*
+** {======================================================
+** Streaming match
+** A stream holds the input fed to it that no match has consumed yet,
+** up to a fixed size. A match that looked past the end of that input
+** could come out differently with more, so it isn't taken until more
+** input comes or the stream is finished. Captures and positions are
+** relative to where each match starts; 'B' can't look back past it,
+** and match-time captures only see the input held.
+** =======================================================
+*/
+
+typedef struct Stream {
+  size_t size;  /* most input held at a time */
+  size_t start;  /* first byte not consumed */
+  size_t len;  /* bytes held from 'start' */
+  int finished;  /* no more input coming */
+  char buff[1];  /* 'size' + 1 bytes, for the guard byte 'match' reads */
+} Stream;
+
+
+static Stream *getstream (lua_State *L) {
+  return (Stream *)luaL_checkudata(L, 1, STREAM_T);
+}
+
+
+/*
+** lpeg.stream(p [, size]): a stream matching 'p' that holds at most
+** 'size' bytes (4096 by default)
+*/
+static int lp_stream (lua_State *L) {
+  lua_Integer size = luaL_optinteger(L, 2, 4096);
+  Stream *st;
+  Pattern *p;
+  luaL_argcheck(L, 0 < size && size <= INT_MAX / 2, 2, "out of range");
+  lua_settop(L, 1);
+  p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  if (p->code == NULL)
+    prepcompile(L, p, 1);
+  st = (Stream *)lua_newuserdata(L, sizeof(Stream) + size);
+  st->size = size;
+  st->start = st->len = 0;
+  st->finished = 0;
+  lua_createtable(L, 1, 0);  /* the stream keeps its pattern, in a table */
+  lua_pushvalue(L, 1);      /* as 5.1 environments must be tables */
+  lua_rawseti(L, -2, 1);
+  lua_setuservalue(L, -2);
+  luaL_getmetatable(L, STREAM_T);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+
+/*
+** stream:feed(data): true, or nil and "full" if 'data' doesn't fit in
+** what is left of the stream's size; nothing is taken then
+*/
+static int lp_streamfeed (lua_State *L) {
+  Stream *st = getstream(L);
+  size_t l;
+  const char *s = luaL_checklstring(L, 2, &l);
+  luaL_argcheck(L, !st->finished, 1, "stream is finished");
+  if (l > st->size - st->len) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "full");
+    return 2;
+  }
+  if (l > st->size - st->start - st->len) {  /* no room at the end? */
+    memmove(st->buff, st->buff + st->start, st->len);
+    st->start = 0;
+  }
+  memcpy(st->buff + st->start + st->len, s, l);
+  st->len += l;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/* stream:finish(): no more input; what is held is matched as it is */
+static int lp_streamfinish (lua_State *L) {
+  getstream(L)->finished = 1;
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/* stream:reset(): drop what is held and take input again */
+static int lp_streamreset (lua_State *L) {
+  Stream *st = getstream(L);
+  st->start = st->len = 0;
+  st->finished = 0;
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/*
+** stream:match(): the captures of the next match, which consumes the
+** input it matched; or nil and "more" if it needs more input, "fail"
+** if the input held doesn't match, or "end" once a finished stream has
+** nothing left
+*/
+static int lp_streammatch (lua_State *L) {
+  Capture capture[INITCAPSIZE];
+  Stream *st = getstream(L);
+  const char *s = st->buff + st->start;
+  const char *r;
+  Pattern *p;
+  int ptop, atend;
+  if (st->finished && st->len == 0) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "end");
+    return 2;
+  }
+  lua_settop(L, 1);
+  lua_getuservalue(L, 1);
+  lua_rawgeti(L, 2, 1);  /* pattern */
+  lua_replace(L, 2);
+  p = getpattern(L, 2);
+  st->buff[st->start + st->len] = '\0';  /* guard byte */
+  ptop = lua_gettop(L);
+  lua_pushnil(L);  /* initialize subscache */
+  lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
+  lua_getuservalue(L, 2);  /* initialize penvidx */
+  r = match(L, s, s, s + st->len, p->code, capture, ptop, &atend);
+  if (atend && !st->finished) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "more");
+    return 2;
+  }
+  if (r == NULL) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "fail");
+    return 2;
+  }
+  st->start += r - s;
+  st->len -= r - s;
+  return getcaptures(L, s, r, ptop);
+}
+
+
+/* stream:held(): the input held and not consumed yet */
+static int lp_streamheld (lua_State *L) {
+  Stream *st = getstream(L);
+  lua_pushlstring(L, st->buff + st->start, st->len);
+  return 1;
+}
+
+/* }====================================================== */
+
+
 
 /*
 ** {======================================================
@@ -1186,6 +1538,15 @@ static int lp_setmax (lua_State *L) {
 }
 
 
+static int lp_setmaxcaptures (lua_State *L) {
+  lua_Integer lim = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, INITCAPSIZE <= lim && lim <= MAXLIM, 1, "out of range");
+  lua_settop(L, 1);
+  lua_setfield(L, LUA_REGISTRYINDEX, MAXCAPIDX);
+  return 0;
+}
+
+
 static int lp_version (lua_State *L) {
   lua_pushstring(L, VERSION);
   return 1;
@@ -1203,7 +1564,8 @@ static int lp_type (lua_State *L) {
 
 int lp_gc (lua_State *L) {
   Pattern *p = getpattern(L, 1);
-  realloccode(L, p, 0);  /* delete code block */
+  if (p->codesize >= 0)  /* not running from an image? */
+    realloccode(L, p, 0);  /* delete code block */
   return 0;
 }
 
@@ -1263,7 +1625,12 @@ static struct luaL_Reg pattreg[] = {
   {"locale", lp_locale},
   {"version", lp_version},
   {"setmaxstack", lp_setmax},
+  {"setmaxcaptures", lp_setmaxcaptures},
   {"type", lp_type},
+  {"dump", lp_dump},
+  {"load", lp_load},
+  {"cache", lp_cache},
+  {"stream", lp_stream},
   {NULL, NULL}
 };
 
@@ -1281,10 +1648,33 @@ static struct luaL_Reg metareg[] = {
 };
 
 
+static struct luaL_Reg streamreg[] = {
+  {"feed", lp_streamfeed},
+  {"match", lp_streammatch},
+  {"finish", lp_streamfinish},
+  {"reset", lp_streamreset},
+  {"held", lp_streamheld},
+  {NULL, NULL}
+};
+
+
 int luaopen_lpeg (lua_State *L) {
+  luaL_newmetatable(L, STREAM_T);
+  lua_newtable(L);
+  luaL_setfuncs(L, streamreg, 0);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
   luaL_newmetatable(L, PATTERN_T);
   lua_pushnumber(L, MAXBACK);  /* initialize maximum backtracking */
   lua_setfield(L, LUA_REGISTRYINDEX, MAXSTACKIDX);
+  lua_pushnumber(L, MAXCAPTURES);  /* initialize maximum captures */
+  lua_setfield(L, LUA_REGISTRYINDEX, MAXCAPIDX);
+  lua_newtable(L);  /* cache, with weak values */
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, "v");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_setfield(L, LUA_REGISTRYINDEX, CACHEIDX);
   luaL_setfuncs(L, metareg, 0);
   luaL_newlib(L, pattreg);
   lua_pushvalue(L, -1);
@@ -45,15 +45,24 @@ typedef struct Stack {
 
 
 /*
-** Double the size of the array of captures
+** Double the size of the array of captures, up to the limit set with
+** 'setmaxcaptures'; it must end up bigger than 'captop'
 */
-static Capture *doublecap (lua_State *L, Capture *cap, int captop, int ptop) {
+static Capture *doublecap (lua_State *L, Capture *cap, int *capsize,
+                           int captop, int ptop) {
   Capture *newc;
-  if (captop >= INT_MAX/((int)sizeof(Capture) * 2))
-    luaL_error(L, "too many captures");
-  newc = (Capture *)lua_newuserdata(L, captop * 2 * sizeof(Capture));
-  memcpy(newc, cap, captop * sizeof(Capture));
+  int max, newn;
+  lua_getfield(L, LUA_REGISTRYINDEX, MAXCAPIDX);
+  max = lua_tointeger(L, -1);  /* maximum allowed size */
+  lua_pop(L, 1);
+  if (captop >= max || captop >= INT_MAX/((int)sizeof(Capture) * 2))
+    luaL_error(L, "too many captures (current limit is %d)", max);
+  newn = 2 * captop;  /* new size */
+  if (newn > max) newn = max;
+  newc = (Capture *)lua_newuserdata(L, newn * sizeof(Capture));
+  memcpy(newc, cap, *capsize * sizeof(Capture));
   lua_replace(L, caplistidx(ptop));
+  *capsize = newn;
   return newc;
 }
 
@@ -142,10 +151,11 @@ static int removedyncap (lua_State *L, Capture *capture,
 
 
 /*
-** Opcode interpreter
+** Opcode interpreter. '*atend' is set if the match looked for input
+** past 'e', that is if more input could change its result.
 */
 const char *match (lua_State *L, const char *o, const char *s, const char *e,
-                   Instruction *op, Capture *capture, int ptop) {
+                   Instruction *op, Capture *capture, int ptop, int *atend) {
   Stack stackbase[INITBACK];
   Stack *stacklimit = stackbase + INITBACK;
   Stack *stack = stackbase;  /* point to first empty slot in stack */
@@ -153,6 +163,7 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
   int captop = 0;  /* point to first empty slot in captures */
   int ndyncap = 0;  /* number of dynamic captures (in Lua stack) */
   const Instruction *p = op;  /* current instruction */
+  *atend = 0;
   stack->p = &giveup; stack->s = s; stack->caplevel = 0; stack++;
   lua_pushlightuserdata(L, stackbase);
   for (;;) {
@@ -181,36 +192,36 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
       }
       case IAny: {
         if (s < e) { p++; s++; }
-        else goto fail;
+        else { *atend = 1; goto fail; }
         continue;
       }
       case ITestAny: {
         if (s < e) p += 2;
-        else p += getoffset(p);
+        else { *atend = 1; p += getoffset(p); }
         continue;
       }
       case IChar: {
         if ((byte)*s == p->i.aux && s < e) { p++; s++; }
-        else goto fail;
+        else { *atend |= s >= e; goto fail; }
         continue;
       }
       case ITestChar: {
         if ((byte)*s == p->i.aux && s < e) p += 2;
-        else p += getoffset(p);
+        else { *atend |= s >= e; p += getoffset(p); }
         continue;
       }
       case ISet: {
         int c = (byte)*s;
         if (testchar((p+1)->buff, c) && s < e)
           { p += CHARSETINSTSIZE; s++; }
-        else goto fail;
+        else { *atend |= s >= e; goto fail; }
         continue;
       }
       case ITestSet: {
         int c = (byte)*s;
         if (testchar((p + 2)->buff, c) && s < e)
           p += 1 + CHARSETINSTSIZE;
-        else p += getoffset(p);
+        else { *atend |= s >= e; p += getoffset(p); }
         continue;
       }
       case IBehind: {
@@ -224,6 +235,7 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
           int c = (byte)*s;
           if (!testchar((p+1)->buff, c)) break;
         }
+        *atend |= s >= e;
         p += CHARSETINSTSIZE;
         continue;
       }
@@ -301,10 +313,8 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         n = lua_gettop(L) - fr + 1;  /* number of new captures */
         ndyncap += n - rem;  /* update number of dynamic captures */
         if (n > 0) {  /* any new capture? */
-          if ((captop += n + 2) >= capsize) {
-            capture = doublecap(L, capture, captop, ptop);
-            capsize = 2 * captop;
-          }
+          if ((captop += n + 2) >= capsize)
+            capture = doublecap(L, capture, &capsize, captop, ptop);
           /* add new captures to 'capture' list */
           adddyncaptures(s, capture + captop - n - 2, n, fr); 
         }
@@ -338,10 +348,8 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
       pushcapture: {
         capture[captop].idx = p->i.key;
         capture[captop].kind = getkind(p);
-        if (++captop >= capsize) {
-          capture = doublecap(L, capture, captop, ptop);
-          capsize = 2 * captop;
-        }
+        if (++captop >= capsize)
+          capture = doublecap(L, capture, &capsize, captop, ptop);
         p++;
         continue;
       }
@@ -6,7 +6,15 @@
 #define __COMPILER_H__
 
 #define __ESP32__
-#if defined(__ESP8266__)
+#if defined(LUANODE_HOST)
+
+// host/: constants are linked between the start of the program and its data
+extern char __executable_start;
+extern char __data_start;
+#define RODATA_START_ADDRESS        (&__executable_start)
+#define RODATA_END_ADDRESS          (&__data_start)
+
+#elif defined(__ESP8266__)
 
 extern char _irom0_text_start;
 extern char _irom0_text_end;
@@ -82,12 +82,33 @@ LUALIB_API void (luaL_unref) (lua_State *L, int t, int ref);
 LUALIB_API int (luaL_loadfile) (lua_State *L, const char *filename);
 #else
 LUALIB_API int (luaL_loadfsfile) (lua_State *L, const char *filename);
+LUALIB_API int (luaL_loadfscached) (lua_State *L, const char *filename);
+LUALIB_API int (luaL_fscachestamp) (const char *filename, int f);
+
+/* A lua_Writer to file `f' through the caller's buffer, as luaU_dump hands
+   out each header, constant and short string on its own and every file
+   system write has its cost; call luaL_fswriterflush before closing. */
+typedef struct luaL_FsWriter {
+  int f;
+  int failed;
+  char *buff;
+  size_t size, n;
+} luaL_FsWriter;
+
+LUALIB_API void (luaL_fswriterinit) (luaL_FsWriter *w, int f, char *buff,
+                                     size_t size);
+LUALIB_API int (luaL_fswrite) (lua_State *L, const void *p, size_t size,
+                               void *w);
+LUALIB_API int (luaL_fswriterflush) (luaL_FsWriter *w);
 #endif
 LUALIB_API int (luaL_loadbuffer) (lua_State *L, const char *buff, size_t sz,
                                   const char *name);
+LUALIB_API int (luaL_loadmapped) (lua_State *L, const char *buff, size_t sz,
+                                  const char *name);
 LUALIB_API int (luaL_loadstring) (lua_State *L, const char *s);
 
 LUALIB_API lua_State *(luaL_newstate) (void);
+LUALIB_API lua_State *(luaL_newheapstate) (void);
 
 
 LUALIB_API const char *(luaL_gsub) (lua_State *L, const char *s, const char *p,
@@ -141,13 +162,15 @@ LUALIB_API void luaL_assertfail(const char *file, int line, const char *message)
 
 typedef struct luaL_Buffer {
   char *p;			/* current position in buffer */
-  int lvl;  /* number of strings in the stack (level) */
+  char *end;			/* end of the space at b */
+  char *b;			/* 'buffer', or a heap block once that is full */
+  int lvl;  /* number of values in the stack (level) */
   lua_State *L;
   char buffer[LUAL_BUFFERSIZE];
 } luaL_Buffer;
 
 #define luaL_addchar(B,c) \
-  ((void)((B)->p < ((B)->buffer+LUAL_BUFFERSIZE) || luaL_prepbuffer(B)), \
+  ((void)((B)->p < (B)->end || luaL_prepbuffer(B)), \
    (*(B)->p++ = (char)(c)))
 
 /* compatibility only */
@@ -157,11 +180,31 @@ typedef struct luaL_Buffer {
 
 LUALIB_API void (luaL_buffinit) (lua_State *L, luaL_Buffer *B);
 LUALIB_API char *(luaL_prepbuffer) (luaL_Buffer *B);
+LUALIB_API char *(luaL_prepbuffsize) (luaL_Buffer *B, size_t sz);
 LUALIB_API void (luaL_addlstring) (luaL_Buffer *B, const char *s, size_t l);
 LUALIB_API void (luaL_addstring) (luaL_Buffer *B, const char *s);
 LUALIB_API void (luaL_addvalue) (luaL_Buffer *B);
 LUALIB_API void (luaL_pushresult) (luaL_Buffer *B);
 
+/*
+** A string builder (string.builder()) is a userdata holding its text in
+** one heap block that grows geometrically, for building long strings a
+** piece at a time without interning every intermediate result.
+*/
+#define LUAL_STRBUILDER	"_STRBUILDER"
+
+typedef struct luaL_StrBuilder {
+  char *b;
+  size_t n;			/* bytes in use */
+  size_t size;			/* bytes allocated at b */
+} luaL_StrBuilder;
+
+LUALIB_API luaL_StrBuilder *(luaL_testbuilder) (lua_State *L, int idx);
+LUALIB_API char *(luaL_builderprep) (lua_State *L, luaL_StrBuilder *sb,
+                                     size_t sz);
+LUALIB_API void (luaL_builderadd) (lua_State *L, luaL_StrBuilder *sb,
+                                   const char *s, size_t l);
+
 
 /* }====================================================== */
 
@@ -41,6 +41,7 @@ LUAI_FUNC void luaG_runerror (lua_State *L, const char *fmt, ...);
 LUAI_FUNC void luaG_errormsg (lua_State *L);
 LUAI_FUNC int luaG_checkcode (const Proto *pt);
 LUAI_FUNC int luaG_checkopenop (Instruction i);
+LUAI_FUNC int luaG_currentline (lua_State *L, CallInfo *ci);
 #ifdef LUA_OPTIMIZE_DEBUG
 LUAI_FUNC int luaG_getline (const Proto *f, int pc);
 LUAI_FUNC int luaG_stripdebug (lua_State *L, Proto *f, int level, int recv);
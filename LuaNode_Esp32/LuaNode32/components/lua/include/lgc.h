@@ -124,6 +124,7 @@ LUAI_FUNC size_t luaC_separateudata (lua_State *L, int all);
 LUAI_FUNC void luaC_callGCTM (lua_State *L);
 LUAI_FUNC void luaC_freeall (lua_State *L);
 LUAI_FUNC void luaC_step (lua_State *L);
+LUAI_FUNC int luaC_idlestep (lua_State *L, lu_mem work);
 LUAI_FUNC void luaC_fullgc (lua_State *L);
 LUAI_FUNC int luaC_sweepstrgc (lua_State *L);
 LUAI_FUNC void luaC_marknew (lua_State *L, GCObject *o);
@@ -131,6 +132,9 @@ LUAI_FUNC void luaC_link (lua_State *L, GCObject *o, lu_byte tt);
 LUAI_FUNC void luaC_linkupval (lua_State *L, UpVal *uv);
 LUAI_FUNC void luaC_barrierf (lua_State *L, GCObject *o, GCObject *v);
 LUAI_FUNC void luaC_barrierback (lua_State *L, Table *t);
+#if LUAI_MEMTRACE
+LUAI_FUNC void luaC_census (lua_State *L, lu_mem *count, lu_mem *bytes);
+#endif
 
 
 #endif
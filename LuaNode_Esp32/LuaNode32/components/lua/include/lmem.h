@@ -41,10 +41,42 @@
 #define luaM_reallocvector(L, v,oldn,n,t) \
    ((v)=cast(t *, luaM_reallocv(L, v, oldn, n, sizeof(t))))
 
+/* same, telling the allocator the block is big and rarely touched */
+#define luaM_coldvector(L, v,oldn,n,t) \
+   ((v)=cast(t *, (cast(size_t, (n)+1) <= MAX_SIZET/sizeof(t)) ? \
+		luaM_realloccold_(L, (v), (oldn)*sizeof(t), (n)*sizeof(t)) : \
+		luaM_toobig(L)))
+
+#define luaM_malloccold(L,t)	luaM_realloccold_(L, NULL, 0, (t))
+
 
 LUAI_FUNC void *luaM_realloc_ (lua_State *L, void *block, size_t oldsize,
                                                           size_t size);
+LUAI_FUNC void *luaM_tryrealloc_ (lua_State *L, void *block, size_t oldsize,
+                                                             size_t size);
+LUAI_FUNC void *luaM_realloccold_ (lua_State *L, void *block, size_t oldsize,
+                                                              size_t size);
 LUAI_FUNC void *luaM_toobig (lua_State *L);
+
+#if LUAI_MEMTRACE
+/* heap use of one Lua function and line, see node.memtrace */
+typedef struct MemSite {
+  const struct Proto *p;  /* NULL when no Lua function was running */
+  int line;
+  lu_int32 allocs;
+  lu_int32 bytes;  /* allocated */
+  lu_int32 freed;
+  char src[LUAI_MEMTRACESRC];
+} MemSite;
+
+typedef struct MemTrace {
+  lu_int32 lost;  /* bytes of sites that found no room in the table */
+  MemSite site[LUAI_MEMTRACE];
+} MemTrace;
+
+LUAI_FUNC void luaM_tracestart (lua_State *L);
+LUAI_FUNC void luaM_tracestop (lua_State *L);
+#endif
 LUAI_FUNC void *luaM_growaux_ (lua_State *L, void *block, int *size,
                                size_t size_elem, int limit,
                                const char *errormsg);
@@ -31,6 +31,18 @@
 #define LUA_TDEADKEY	(LAST_TAG+3)
 
 
+/*
+** With LUA_NUMBER_DUAL a number holding an int is tagged LUA_TNUMINT:
+** LUA_TNUMBER plus a subtype bit that ttype() masks off, so that every
+** type test and switch sees both kinds as numbers. Packed, an int is
+** boxed like the other non-double types, in the low word.
+*/
+#ifdef LUA_NUMBER_DUAL
+#define LUA_TNUMINT	(LUA_TNUMBER | 0x10)
+#define LUA_TTAGMASK	0x0f
+#endif
+
+
 /*
 ** Union of all collectable objects
 */
@@ -78,6 +90,9 @@ typedef union {
   GCObject *gc;
   void *p;
   lua_Number n;
+#ifdef LUA_NUMBER_DUAL
+  int i;
+#endif
   int b;
 } Value;
 #endif // #if defined( LUA_PACK_VALUE ) && defined( ELUA_ENDIAN_BIG )
@@ -144,7 +159,11 @@ typedef TValuefields TValue;
 #define ttislightfunction(o)  (ttype(o) == LUA_TLIGHTFUNCTION)
 #else // #ifndef LUA_PACK_VALUE
 #define ttisnil(o) (ttype_sig(o) == add_sig(LUA_TNIL))
+#ifdef LUA_NUMBER_DUAL
+#define ttisnumber(o)  ((o)->_t.sig != LUA_NOTNUMBER_SIG || (o)->_t.tt == LUA_TNUMINT)
+#else
 #define ttisnumber(o)  ((o)->_t.sig != LUA_NOTNUMBER_SIG)
+#endif
 #define ttisstring(o)  (ttype_sig(o) == add_sig(LUA_TSTRING))
 #define ttistable(o) (ttype_sig(o) == add_sig(LUA_TTABLE))
 #define ttisfunction(o)  (ttype_sig(o) == add_sig(LUA_TFUNCTION))
@@ -158,16 +177,37 @@ typedef TValuefields TValue;
 
 /* Macros to access values */
 #ifndef LUA_PACK_VALUE
+#ifdef LUA_NUMBER_DUAL
+#define ttype(o)	((o)->tt & LUA_TTAGMASK)
+#else
 #define ttype(o)	((o)->tt)
+#endif
 #else // #ifndef LUA_PACK_VALUE
+#ifdef LUA_NUMBER_DUAL
+#define ttype(o)	((o)->_t.sig == LUA_NOTNUMBER_SIG ? (o)->_t.tt & LUA_TTAGMASK : LUA_TNUMBER)
+#else
 #define ttype(o)	((o)->_t.sig == LUA_NOTNUMBER_SIG ? (o)->_t.tt : LUA_TNUMBER)
+#endif
 #define ttype_sig(o)	((o)->_ts.tt_sig)
 #endif // #ifndef LUA_PACK_VALUE
 #define gcvalue(o)	check_exp(iscollectable(o), (o)->value.gc)
 #define pvalue(o)	check_exp(ttislightuserdata(o), (o)->value.p)
 #define rvalue(o)	check_exp(ttisrotable(o), (o)->value.p)
 #define fvalue(o) check_exp(ttislightfunction(o), (o)->value.p)
+#ifdef LUA_NUMBER_DUAL
+#ifndef LUA_PACK_VALUE
+#define ttisint(o)	((o)->tt == LUA_TNUMINT)
+#else
+#define ttisint(o)	(ttype_sig(o) == add_sig(LUA_TNUMINT))
+#endif
+#define ivalue(o)	check_exp(ttisint(o), (o)->value.i)
+#define nvalue(o)	(ttisint(o) ? cast_num((o)->value.i) : \
+			 check_exp(ttisnumber(o), (o)->value.n))
+#else
+#define ttisint(o)	0
+#define ivalue(o)	cast_int(nvalue(o))
 #define nvalue(o)	check_exp(ttisnumber(o), (o)->value.n)
+#endif
 #define rawtsvalue(o)	check_exp(ttisstring(o), &(o)->value.gc->ts)
 #define tsvalue(o)	(&rawtsvalue(o)->tsv)
 #define rawuvalue(o)	check_exp(ttisuserdata(o), &(o)->value.gc->u)
@@ -205,6 +245,13 @@ typedef TValuefields TValue;
 #define setnvalue(obj,x) \
   { lua_Number i_x = (x); TValue *i_o=(obj); i_o->value.n=i_x; i_o->tt=LUA_TNUMBER; }
 
+#ifdef LUA_NUMBER_DUAL
+#define setivalue(obj,x) \
+  { int i_x = (x); TValue *i_o=(obj); i_o->value.i=i_x; i_o->tt=LUA_TNUMINT; }
+#else
+#define setivalue(obj,x)	setnvalue(obj, cast_num(x))
+#endif
+
 #define setpvalue(obj,x) \
   { void *i_x = (x); TValue *i_o=(obj); i_o->value.p=i_x; i_o->tt=LUA_TLIGHTUSERDATA; }
 
@@ -266,6 +313,13 @@ typedef TValuefields TValue;
 #define setnvalue(obj,x) \
   { TValue *i_o=(obj); i_o->value.n=(x); }
 
+#ifdef LUA_NUMBER_DUAL
+#define setivalue(obj,x) \
+  { TValue *i_o=(obj); i_o->value.i=(x); i_o->_ts.tt_sig=add_sig(LUA_TNUMINT);}
+#else
+#define setivalue(obj,x)	setnvalue(obj, cast_num(x))
+#endif
+
 #define setpvalue(obj,x) \
   { TValue *i_o=(obj); i_o->value.p=(x); i_o->_ts.tt_sig=add_sig(LUA_TLIGHTUSERDATA);}
 
@@ -337,7 +391,7 @@ typedef TValuefields TValue;
 #define setsvalue2n	setsvalue
 
 #ifndef LUA_PACK_VALUE
-#define setttype(obj, tt) (ttype(obj) = (tt))
+#define setttype(obj, _tt) ((obj)->tt = (_tt))
 #else // #ifndef LUA_PACK_VALUE
 /* considering it used only in lgc to set LUA_TDEADKEY */
 /* we could define it this way */
@@ -544,7 +598,15 @@ LUAI_FUNC int luaO_log2 (unsigned int x);
 LUAI_FUNC int luaO_int2fb (unsigned int x);
 LUAI_FUNC int luaO_fb2int (int x);
 LUAI_FUNC int luaO_rawequalObj (const TValue *t1, const TValue *t2);
+LUAI_FUNC void luaO_setnumber (TValue *o, lua_Number n);
 LUAI_FUNC int luaO_str2d (const char *s, lua_Number *result);
+LUAI_FUNC int luaO_int2str (char *s, LUA_INTFRM_T v);
+#if defined(LUA_NUMBER_INTEGRAL)
+#define luaO_num2str(s,n)	luaO_int2str((s), (n))
+#else
+LUAI_FUNC int luaO_num2str (char *s, lua_Number n);
+LUAI_FUNC int luaO_fixed2str (char *s, double n, int prec);
+#endif
 LUAI_FUNC const char *luaO_pushvfstring (lua_State *L, const char *fmt,
                                                        va_list argp);
 LUAI_FUNC const char *luaO_pushfstring (lua_State *L, const char *fmt, ...);
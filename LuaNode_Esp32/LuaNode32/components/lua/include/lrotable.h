@@ -37,6 +37,9 @@
 /* Maximum length of a rotable name and of a string key*/
 #define LUA_MAX_ROTABLE_NAME      32
 
+/* Entries lua_rotable may have; luaR_getglobal keeps a bit for each */
+#define LUA_MAX_ROTABLES          64
+
 /* Type of a numeric key in a rotable */
 typedef int luaR_numkey;
 
@@ -65,9 +68,13 @@ typedef struct
   const luaR_entry *pentries;
 } luaR_table;
 
+extern volatile int luaR_workers;
+
 void* luaR_findglobal(const char *key, unsigned len);
+void* luaR_getglobal(lua_State *L, const char *key, unsigned len);
 int luaR_findfunction(lua_State *L, const luaR_entry *ptable);
 const TValue* luaR_findentry(void *data, const char *strkey, luaR_numkey numkey, unsigned *ppos);
+const TValue* luaR_findstr(void *data, const TString *key);
 void luaR_getcstr(char *dest, const TString *src, size_t maxsize);
 void luaR_next(lua_State *L, void *data, TValue *key, TValue *val);
 void* luaR_getmeta(void *data);
@@ -0,0 +1,32 @@
+// Size-class slab allocator for the small objects of the Lua state
+
+#ifndef __LSLAB_H__
+#define __LSLAB_H__
+
+#include <stddef.h>
+#include "luaconf.h"
+
+// Blocks up to LUAI_SLABMAX bytes come from LUAI_SLABPAGE byte pages, one
+// size class per page, in steps of LSLAB_STEP bytes. Slot sizes are not
+// stored; a block is found to be a slab slot by its address alone.
+#define LSLAB_STEP      8
+#define LSLAB_CLASSES   (LUAI_SLABMAX / LSLAB_STEP)
+
+typedef struct {
+  unsigned size;    // slot size of the class
+  unsigned pages;
+  unsigned slots;   // slots on those pages
+  unsigned used;
+} lslab_info_t;
+
+void *lslab_alloc(size_t size);
+
+// Slot size if p is a slab slot, else 0
+size_t lslab_owns(void *p);
+
+void lslab_free(void *p);
+
+// Statistics of class cls, 0 if there is no such class
+int lslab_info(int cls, lslab_info_t *info);
+
+#endif
@@ -10,6 +10,7 @@
 #include "lua.h"
 
 #include "lobject.h"
+#include "lrotable.h"
 #include "ltm.h"
 #include "lzio.h"
 
@@ -39,6 +40,9 @@ typedef struct stringtable {
   GCObject **hash;
   lu_int32 nuse;  /* number of elements */
   int size;
+  GCObject **old;  /* previous array while growing, else NULL */
+  int oldsize;
+  int moved;  /* buckets of `old' already moved to `hash' */
 } stringtable;
 
 
@@ -88,12 +92,27 @@ typedef struct global_State {
   int gcpause;  /* size of pause between successive GCs */
   int gcstepmul;  /* GC `granularity' */
   int egcmode;    /* emergency garbage collection operation mode */
+  lu_int32 gcstepus;  /* time cap of a GC step, 0 = none */
+  lu_int32 gcsteps;  /* GC steps timed in gcpausehist */
+  lu_int32 gcpausemax;
+  lu_int32 gcpausehist[LUAI_GCHIST];  /* log2 microsecond buckets */
+  lu_byte coldalloc;  /* next block is rarely touched, see luaM_coldvector */
+  lu_mem psramcold;  /* SPI RAM placement limits, see LUAI_PSRAM */
+  lu_mem psrambig;
   lua_CFunction panic;  /* to be called in unprotected errors */
+  struct CompileSink *compilesink;  /* for the next chunk parsed, see lundump.h */
+#if LUAI_MEMTRACE
+  struct MemTrace *memtrace;  /* allocation tracking, or NULL */
+#endif
   TValue l_registry;
   struct lua_State *mainthread;
+  struct lua_State *freethreads;  /* dead threads kept for reuse */
+  int nfreethreads;
   UpVal uvhead;  /* head of double-linked list of all open upvalues */
   struct Table *mt[NUM_TAGS];  /* metatables for basic types */
   TString *tmname[TM_N];  /* array with tag-method names */
+  lu_int32 ropened[LUA_MAX_ROTABLES / 32];  /* lua_rotable entries opened, see luaR_getglobal */
+  lu_byte rsealed;  /* no further lua_rotable entries open, see luaR_getglobal */
 } global_State;
 
 
@@ -116,6 +135,8 @@ struct lua_State {
   int size_ci;  /* size of array `base_ci' */
   unsigned short nCcalls;  /* number of nested C calls */
   unsigned short baseCcalls;  /* nested C calls when resuming coroutine */
+  lu_byte stackidle;  /* GC traversals that found the stack oversized */
+  lu_byte ciidle;  /* same for `base_ci' */
   lu_byte hookmask;
   lu_byte allowhook;
   int basehookcount;
@@ -164,8 +185,9 @@ union GCObject {
 /* macro to convert any Lua object into a GCObject */
 #define obj2gco(v)	(cast(GCObject *, (v)))
 
-LUAI_FUNC lua_State *luaE_newthread (lua_State *L);
+LUAI_FUNC lua_State *luaE_newthread (lua_State *L, int nstack, int nci);
 LUAI_FUNC void luaE_freethread (lua_State *L, lua_State *L1);
+LUAI_FUNC void luaE_dropthreads (lua_State *L);
 
 #endif
 
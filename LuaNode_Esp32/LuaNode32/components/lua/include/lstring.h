@@ -26,7 +26,11 @@
 #define luaS_readonly(s) l_setbit((s)->tsv.marked, READONLYBIT)
 #define luaS_isreadonly(s) testbit((s)->marked, READONLYBIT)
 
+LUAI_FUNC unsigned int luaS_hash (const char *str, size_t l);
 LUAI_FUNC void luaS_resize (lua_State *L, int newsize);
+LUAI_FUNC void luaS_rehashstep (lua_State *L, int n);
+LUAI_FUNC void luaS_rehashfinish (lua_State *L);
+LUAI_FUNC void luaS_chainstats (lua_State *L, int *empty, int *maxchain);
 LUAI_FUNC Udata *luaS_newudata (lua_State *L, size_t s, Table *e);
 LUAI_FUNC TString *luaS_newlstr (lua_State *L, const char *str, size_t l);
 LUAI_FUNC TString *luaS_newrolstr (lua_State *L, const char *str, size_t l);
@@ -39,16 +39,20 @@ typedef enum {
 
 
 #define gfasttm(g,et,e) ((et) == NULL ? NULL : \
-  !luaR_isrotable(et) && ((et)->flags & (1u<<(e))) ? NULL : luaT_gettm(et, e, (g)->tmname[e]))
+  ((luaR_isrotable(et) ? luaT_rotmabsent(g, et) : (et)->flags) & (1u<<(e))) ? \
+  NULL : luaT_gettm(et, e, (g)->tmname[e]))
 
 #define fasttm(l,et,e)	gfasttm(G(l), et, e)
 
 LUAI_DATA const char *const luaT_typenames[];
 
+struct global_State;
+
 
 LUAI_FUNC const TValue *luaT_gettm (Table *events, TMS event, TString *ename);
 LUAI_FUNC const TValue *luaT_gettmbyobj (lua_State *L, const TValue *o,
                                                        TMS event);
+LUAI_FUNC lu_int32 luaT_rotmabsent (struct global_State *g, void *mt);
 LUAI_FUNC void luaT_init (lua_State *L);
 
 #endif
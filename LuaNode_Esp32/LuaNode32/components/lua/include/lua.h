@@ -115,6 +115,8 @@ typedef LUA_INTEGER lua_Integer;
 LUA_API lua_State *(lua_newstate) (lua_Alloc f, void *ud);
 LUA_API void       (lua_close) (lua_State *L);
 LUA_API lua_State *(lua_newthread) (lua_State *L);
+LUA_API lua_State *(lua_newthreadsize) (lua_State *L, int stacksize,
+                                        int cisize);
 
 LUA_API lua_CFunction (lua_atpanic) (lua_State *L, lua_CFunction panicf);
 
@@ -187,6 +189,9 @@ LUA_API void  (lua_getfield) (lua_State *L, int idx, const char *k);
 LUA_API void  (lua_rawget) (lua_State *L, int idx);
 LUA_API void  (lua_rawgeti) (lua_State *L, int idx, int n);
 LUA_API void  (lua_createtable) (lua_State *L, int narr, int nrec);
+LUA_API void  (lua_presizetable) (lua_State *L, int idx, int narr, int nrec);
+LUA_API void  (lua_cleartable) (lua_State *L, int idx);
+LUA_API int   (lua_sortarray) (lua_State *L, int idx, int n, int keyidx);
 LUA_API void *(lua_newuserdata) (lua_State *L, size_t sz);
 LUA_API int   (lua_getmetatable) (lua_State *L, int objindex);
 LUA_API void  (lua_getfenv) (lua_State *L, int idx);
@@ -236,6 +241,7 @@ LUA_API int  (lua_status) (lua_State *L);
 #define LUA_GCSETSTEPMUL	7
 #define LUA_GCSETMEMLIMIT	8
 #define LUA_GCGETMEMLIMIT	9
+#define LUA_GCIDLE		10
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
@@ -389,6 +395,19 @@ int lua_main( int argc, char **argv );
 
 #ifndef LUA_CROSS_COMPILER
 void lua_handle_input (bool force);
+void lua_input_ready (void);
+/* Task priority UART0 input is handed to the Lua task at */
+void lua_input_priority (int prio);
+
+/* A second console next to UART0, such as the console module's TCP
+   client. read takes what has come in without waiting, write gets the
+   REPL's echo, prompts and upload replies. */
+typedef struct {
+  size_t (*read) (char *buf, size_t len);
+  void (*write) (const char *buf, size_t len);
+} lua_Console;
+
+void lua_set_remote_console (const lua_Console *con);
 #endif
 
 /******************************************************************************
@@ -368,6 +368,124 @@ extern int readline4lua(const char *prompt, char *buffer, int length);
 #define LUAI_GCMUL	200 /* GC runs 'twice the speed' of memory allocation */
 
 
+/*
+@@ LUAI_GCSTEPUS caps the time of one incremental GC step in microseconds.
+** 0 leaves steps sized by LUAI_GCMUL alone. A step that runs out of time
+** stops early and its unfinished work is carried over as GC debt, to be
+** paid by the following steps or while the task pump is idle. It can be
+** changed at run time with node.gcbudget().
+@@ LUAI_GCHIST is the number of log2 microsecond buckets of the GC pause
+@* histogram (node.gcstats()).
+@@ luai_gcclock reads the microsecond clock GC steps are timed with.
+*/
+#define LUAI_GCSTEPUS	0
+#define LUAI_GCHIST	16
+
+#if defined(LUA_CROSS_COMPILER)
+#define luai_gcclock()	0
+#else
+#define luai_gcclock()	((lu_int32)system_get_time())
+#endif
+
+
+/*
+@@ LUAI_STRHASH selects the hash used to intern strings.
+** 0 is the stock Lua 5.1 hash, which samples at most 32 characters and
+** so lets long keys with a common prefix collide. 1 mixes in whole 32-bit
+** words, which are cheap to load on the ESP32.
+@@ LUAI_STRHASHWORDS is how many words the word hash reads before it
+@* starts sampling longer strings.
+*/
+#define LUAI_STRHASH		1
+#define LUAI_STRHASHWORDS	32
+
+
+/*
+@@ LUAI_STRREHASH is how many buckets of the old string table are moved
+@* per new string (and per GC step) while the table grows. The table is
+** rehashed a few buckets at a time instead of all at once.
+*/
+#define LUAI_STRREHASH		4
+
+
+/*
+@@ LUAI_THREADCACHE is how many dead coroutines keep their stack and
+@* CallInfo array for the next coroutine to be created. 0 frees them.
+@@ LUAI_THREADCACHESTACK and LUAI_THREADCACHECI are the largest arrays
+@* kept; a coroutine whose stack grew past them is freed anyway.
+** The cache is emptied by every full collection.
+*/
+#define LUAI_THREADCACHE	8
+#define LUAI_THREADCACHESTACK	128
+#define LUAI_THREADCACHECI	32
+
+
+/*
+@@ LUAI_SLAB enables the slab allocator (lslab.c) behind the allocator
+@* of luaL_newstate, for blocks of up to LUAI_SLABMAX bytes.
+@@ LUAI_SLABPAGE is the size of one slab page.
+@@ LUAI_SLABPSRAM places slab pages in SPI RAM when there is any, and
+@* falls back to internal RAM otherwise.
+*/
+#define LUAI_SLAB		1
+#define LUAI_SLABMAX		64
+#define LUAI_SLABPAGE		1024
+#define LUAI_SLABPSRAM		0
+
+
+/*
+@@ LUAI_PSRAM lets the allocator of luaL_newstate place heap blocks in
+@* SPI RAM: blocks of LUAI_PSRAMBIG bytes and more, and blocks of
+@* LUAI_PSRAMCOLD bytes and more that the core marks as rarely touched
+@* (long strings, table array parts, function code and line info).
+** Both limits can be changed at run time with node.psram().
+*/
+#define LUAI_PSRAM		0
+#define LUAI_PSRAMCOLD		256
+#define LUAI_PSRAMBIG		4096
+
+
+/*
+@@ LUAI_THREADED makes luaV_execute dispatch with computed gotos (a GCC
+@* extension): each instruction handler jumps straight to the handler of
+@* the next one through a table of labels instead of going back to the
+@* top of a switch. Build with -DLUAI_THREADED=0 to keep the switch.
+*/
+#if !defined(LUAI_THREADED)
+#if defined(__GNUC__)
+#define LUAI_THREADED		1
+#else
+#define LUAI_THREADED		0
+#endif
+#endif
+
+
+/*
+@@ LUAI_LCCACHE makes loadfile, dofile and require keep a compiled copy
+@* of each .lua file in a .lc file next to it, and load that one for as
+@* long as the source is unchanged (see luaL_loadfscached).
+*/
+#define LUAI_LCCACHE		1
+
+
+/*
+@@ LUAI_LOADBUF is the most of a precompiled chunk that loadfile, dofile
+@* and require read at once; one that fits is read in a single go.
+*/
+#define LUAI_LOADBUF		16384
+
+
+/*
+@@ LUAI_MEMTRACE builds in allocation tracking (node.memtrace): while it
+@* is on, every allocation and free of the Lua heap is counted against the
+** Lua function and line running at the time, in a table of LUAI_MEMTRACE
+** sites (a power of 2). 0 leaves it out.
+@@ LUAI_MEMTRACESRC is the room kept for the source name of a site.
+*/
+#define LUAI_MEMTRACE		64
+#define LUAI_MEMTRACESRC	24
+
+
 
 /*
 @@ LUA_COMPAT_GETN controls compatibility with old getn behavior.
@@ -507,6 +625,19 @@ extern int readline4lua(const char *prompt, char *buffer, int length);
 #define LUAI_MAXCSTACK	8000
 
 
+/*
+@@ LUAI_MAXSTACK limits the size of the Lua stack of a thread, in slots.
+** Past it a script gets a "stack overflow" error instead of the stack
+** growing until the heap runs out.
+@@ LUAI_STACKIDLE is how many times in a row (about twice per GC cycle)
+@* the collector must find a stack, or CallInfo array, under a quarter
+** used before it cuts it down, so that code going in and out of deep
+** recursion does not shrink and regrow it on every cycle.
+*/
+#define LUAI_MAXSTACK	16000
+#define LUAI_STACKIDLE	8
+
+
 
 /*
 ** {==================================================================
@@ -578,8 +709,17 @@ extern int readline4lua(const char *prompt, char *buffer, int length);
    no longer handles the floating point directives %e, %E, %f, %g, and
    %G. */
 
+/* Define LUA_NUMBER_FLOAT to make Lua numbers single precision floats.
+   The ESP32 FPU only does single precision, so arithmetic, comparisons
+   and the math library run in hardware instead of going through the
+   soft-float double routines. Numbers keep about 7 significant digits
+   and integers are exact up to 2^24 only. Precompiled chunks must come
+   from a luac.cross built with the same option. */
+
 #if defined LUA_NUMBER_INTEGRAL
 #define LUA_NUMBER	LUA_INTEGER
+#elif defined LUA_NUMBER_FLOAT
+#define LUA_NUMBER	float
 #else
 #define LUA_NUMBER_DOUBLE
 #define LUA_NUMBER	double
@@ -589,7 +729,11 @@ extern int readline4lua(const char *prompt, char *buffer, int length);
 @@ LUAI_UACNUMBER is the result of an 'usual argument conversion'
 @* over a number.
 */
+#if defined LUA_NUMBER_FLOAT
+#define LUAI_UACNUMBER	double
+#else
 #define LUAI_UACNUMBER	LUA_NUMBER
+#endif
 
 
 /*
@@ -607,6 +751,9 @@ extern int readline4lua(const char *prompt, char *buffer, int length);
   #define LUA_NUMBER_SCAN   "%lld"
   #define LUA_NUMBER_FMT    "%lld"
   #endif // #if !defined LUA_INTEGRAL_LONGLONG
+#elif defined LUA_NUMBER_FLOAT
+#define LUA_NUMBER_SCAN		"%f"
+#define LUA_NUMBER_FMT		"%.7g"
 #else
 #define LUA_NUMBER_SCAN		"%lf"
 #define LUA_NUMBER_FMT		"%.14g"
@@ -619,10 +766,21 @@ extern int readline4lua(const char *prompt, char *buffer, int length);
   #else
   #define lua_str2number(s,p) strtoll((s), (p), 10)
   #endif // #if !defined LUA_INTEGRAL_LONGLONG
+#elif defined LUA_NUMBER_FLOAT
+#define lua_str2number(s,p)	strtof((s), (p))
 #else
 #define lua_str2number(s,p)	strtod((s), (p))
 #endif // #if defined LUA_NUMBER_INTEGRAL
 
+/*
+@@ l_mathop gives the variant of a <math.h> function for lua_Number.
+*/
+#if defined LUA_NUMBER_FLOAT
+#define l_mathop(op)		op##f
+#else
+#define l_mathop(op)		op
+#endif
+
 /*
 @@ The luai_num* macros define the primitive operations over numbers.
 */
@@ -656,10 +814,10 @@ LUA_NUMBER luai_ipow(LUA_NUMBER, LUA_NUMBER);
 #define luai_numpow(a,b)	(luai_ipow(a,b))
 #else
 #define luai_numdiv(a,b)	((a)/(b))
-#define luai_nummod(a,b)	((a) - floor((a)/(b))*(b))
+#define luai_nummod(a,b)	((a) - l_mathop(floor)((a)/(b))*(b))
 #define luai_lnumdiv(a,b)	(luai_numdiv(a,b))
 #define luai_lnummod(a,b)	(luai_nummod(a,b))
-#define luai_numpow(a,b)	(pow(a,b))
+#define luai_numpow(a,b)	(l_mathop(pow)(a,b))
 #endif
 #define luai_numunm(a)		(-(a))
 #define luai_numeq(a,b)		((a)==(b))
@@ -707,6 +865,40 @@ union luai_Cast { double l_d; long l_l; };
 
 #endif
 
+
+/*
+@@ LUA_NUMBER_DUAL keeps numbers that hold small integers as C ints.
+** The ESP32 has no double precision FPU, so every operation on a double
+** is a library call. With this option the VM adds, subtracts, multiplies,
+** compares, indexes and runs `for' loops with integer instructions while
+** the operands are ints, and falls back to doubles on overflow and for
+** anything else. Integer constants, lua_pushinteger, `#' and loop
+** counters give ints. Scripts cannot tell the difference: both kinds are
+** of type "number" and every result is the one doubles would give.
+*/
+#if defined(LUA_NUMBER_DOUBLE)
+#define LUA_NUMBER_DUAL
+#endif
+
+
+/*
+@@ LUA_PACK_VALUE makes a TValue 8 bytes instead of 16: a double is kept
+@* as it is, and every other value, ints included, in the payload of a
+@* NaN with the type in its upper half (NaN boxing). Table slots, stack
+@* slots and upvalues all take half the memory. It needs 32 bit pointers,
+@* so it is for the device build, and every component must see it, as
+@* the rotables of the modules are laid out by it: add -DLUA_PACK_VALUE
+@* to the project's CFLAGS.
+*/
+#if defined(LUA_PACK_VALUE)
+#if defined(__SIZEOF_POINTER__) && __SIZEOF_POINTER__ > 4
+#error "LUA_PACK_VALUE needs 32 bit pointers"
+#endif
+#if !defined(ELUA_ENDIAN_BIG)
+#define ELUA_ENDIAN_LITTLE
+#endif
+#endif
+
 /* }================================================================== */
 
 
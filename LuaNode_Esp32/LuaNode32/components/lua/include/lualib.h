@@ -42,6 +42,7 @@ LUALIB_API int (luaopen_package) (lua_State *L);
 
 /* open all previous libraries */
 LUALIB_API void (luaL_openlibs) (lua_State *L); 
+LUALIB_API int (luaL_openlazy) (lua_State *L, const char *name);
 
 
 #define LUA_MQTTLIBNAME	"mqtt"
@@ -83,9 +84,111 @@ LUALIB_API int (luaopen_wifi) (lua_State *L);
 #define LUA_NETLIBNAME	"net"
 LUALIB_API int (luaopen_net) ( lua_State *L );
 
+#define LUA_HTTPLIBNAME	"http"
+LUALIB_API int (luaopen_http) ( lua_State *L );
+
 #define LUA_THREADLIBNAME	"thread"
 LUALIB_API int (luaopen_thread) ( lua_State *L );
 
+#define LUA_SPILIBNAME	"spi"
+LUALIB_API int (luaopen_spi) ( lua_State *L );
+
+#define LUA_PROFILERLIBNAME	"profiler"
+LUALIB_API int (luaopen_profiler) ( lua_State *L );
+
+#define LUA_BUFFERLIBNAME	"buffer"
+LUALIB_API int (luaopen_buffer) ( lua_State *L );
+
+#define LUA_ASSETLIBNAME	"asset"
+LUALIB_API int (luaopen_asset) ( lua_State *L );
+
+#define LUA_FLASHLIBNAME	"flash"
+LUALIB_API int (luaopen_flash) ( lua_State *L );
+
+#define LUA_FLASHLOGLIBNAME	"flashlog"
+LUALIB_API int (luaopen_flashlog) ( lua_State *L );
+
+#define LUA_SCHEDLIBNAME	"sched"
+LUALIB_API int (luaopen_sched) ( lua_State *L );
+
+#define LUA_COAPLIBNAME	"coap"
+LUALIB_API int (luaopen_coap) ( lua_State *L );
+
+#define LUA_SAMPLERLIBNAME	"sampler"
+LUALIB_API int (luaopen_sampler) ( lua_State *L );
+
+#define LUA_WS2812LIBNAME	"ws2812"
+LUALIB_API int (luaopen_ws2812) ( lua_State *L );
+
+#define LUA_ADCLIBNAME	"adc"
+LUALIB_API int (luaopen_adc) ( lua_State *L );
+
+#define LUA_CJSONLIBNAME	"cjson"
+LUALIB_API int (luaopen_cjson) ( lua_State *L );
+
+#define LUA_MSGPACKLIBNAME	"msgpack"
+LUALIB_API int (luaopen_msgpack) ( lua_State *L );
+
+#define LUA_CRYPTOLIBNAME	"crypto"
+LUALIB_API int (luaopen_crypto) ( lua_State *L );
+
+#define LUA_CRCLIBNAME	"crc"
+LUALIB_API int (luaopen_crc) ( lua_State *L );
+
+#define LUA_DSPLIBNAME	"dsp"
+LUALIB_API int (luaopen_dsp) ( lua_State *L );
+
+#define LUA_ZLIBLIBNAME	"zlib"
+LUALIB_API int (luaopen_zlib) ( lua_State *L );
+
+#define LUA_COMPRESSLIBNAME	"compress"
+LUALIB_API int (luaopen_compress) ( lua_State *L );
+
+#define LUA_KVLIBNAME	"kv"
+LUALIB_API int (luaopen_kv) ( lua_State *L );
+
+#define LUA_CACHELIBNAME	"cache"
+LUALIB_API int (luaopen_cache) ( lua_State *L );
+
+#define LUA_TSERIESLIBNAME	"tseries"
+LUALIB_API int (luaopen_tseries) ( lua_State *L );
+
+#define LUA_BENCHLIBNAME	"bench"
+LUALIB_API int (luaopen_bench) ( lua_State *L );
+
+#define LUA_RTCTIMELIBNAME	"rtctime"
+LUALIB_API int (luaopen_rtctime) ( lua_State *L );
+
+#define LUA_WEBSOCKETLIBNAME	"websocket"
+LUALIB_API int (luaopen_websocket) ( lua_State *L );
+
+#define LUA_RTCMEMLIBNAME	"rtcmem"
+LUALIB_API int (luaopen_rtcmem) ( lua_State *L );
+
+#define LUA_TRACELIBNAME	"trace"
+LUALIB_API int (luaopen_trace) ( lua_State *L );
+
+#define LUA_BRIDGELIBNAME	"bridge"
+LUALIB_API int (luaopen_bridge) ( lua_State *L );
+
+#define LUA_MODBUSLIBNAME	"modbus"
+LUALIB_API int (luaopen_modbus) ( lua_State *L );
+
+#define LUA_PCNTLIBNAME	"pcnt"
+LUALIB_API int (luaopen_pcnt) ( lua_State *L );
+
+#define LUA_I2SLIBNAME	"i2s"
+LUALIB_API int (luaopen_i2s) ( lua_State *L );
+
+#define LUA_BLELIBNAME	"ble"
+LUALIB_API int (luaopen_ble) ( lua_State *L );
+
+#define LUA_MDNSLIBNAME	"mdns"
+LUALIB_API int (luaopen_mdns) ( lua_State *L );
+
+#define LUA_CONSOLELIBNAME	"console"
+LUALIB_API int (luaopen_console) ( lua_State *L );
+
 #ifndef lua_assert
 #define lua_assert(x)	((void)0)
 #endif
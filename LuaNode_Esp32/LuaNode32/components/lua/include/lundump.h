@@ -36,6 +36,25 @@ int luaU_dump_crosscompile (lua_State* L, const Proto* f, lua_Writer w, void* da
 /* dump one chunk; from ldump.c */
 LUAI_FUNC int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data, int strip);
 
+/* low-memory compilation into a spool; from ldump.c */
+typedef struct CompileSink {
+ lua_Writer writer;	/* appends to the spool */
+ int (*reader) (void* data, uint32_t off, void* b, size_t size); /* 0 if ok */
+ void* data;
+ uint32_t wrote;	/* size of the spool */
+ int status;
+ struct SinkFunc* f;	/* spooled functions, nested ones first */
+ int nf, sizef;
+ int* pending;		/* spooled functions not yet claimed by a parent */
+ int npending, sizepending;
+} CompileSink;
+
+LUAI_FUNC void luaU_sinkinit (CompileSink* s, lua_Writer w,
+                              int (*r) (void*, uint32_t, void*, size_t), void* data);
+LUAI_FUNC void luaU_sinkclose (lua_State* L, CompileSink* s, Proto* f);
+LUAI_FUNC int luaU_sinkdump (lua_State* L, CompileSink* s, lua_Writer w, void* data);
+LUAI_FUNC void luaU_sinkfree (lua_State* L, CompileSink* s);
+
 #ifdef luac_c
 /* print one chunk; from print.c */
 LUAI_FUNC void luaU_print (const Proto* f, int full);
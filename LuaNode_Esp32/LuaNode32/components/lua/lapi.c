@@ -96,6 +96,8 @@ LUA_API int lua_checkstack (lua_State *L, int size) {
   lua_lock(L);
   if (size > LUAI_MAXCSTACK || (L->top - L->base + size) > LUAI_MAXCSTACK)
     res = 0;  /* stack overflow */
+  else if ((L->top - L->stack) + size + EXTRA_STACK + 2 > LUAI_MAXSTACK)
+    res = 0;  /* would pass the limit of the whole stack */
   else if (size > 0) {
     luaD_checkstack(L, size);
     if (L->ci->top < L->top + size)
@@ -137,10 +139,22 @@ LUA_API lua_CFunction lua_atpanic (lua_State *L, lua_CFunction panicf) {
 
 
 LUA_API lua_State *lua_newthread (lua_State *L) {
+  return lua_newthreadsize(L, 0, 0);
+}
+
+
+LUA_API lua_State *lua_newthreadsize (lua_State *L, int stacksize,
+                                      int cisize) {
   lua_State *L1;
+  if (stacksize <= 0) stacksize = BASIC_STACK_SIZE;
+  else if (stacksize <= LUA_MINSTACK) stacksize = LUA_MINSTACK + 1;
+  else if (stacksize > LUAI_MAXCSTACK) stacksize = LUAI_MAXCSTACK;
+  if (cisize <= 0) cisize = BASIC_CI_SIZE;
+  else if (cisize < 2) cisize = 2;
+  else if (cisize > LUAI_MAXCALLS) cisize = LUAI_MAXCALLS;
   lua_lock(L);
   luaC_checkGC(L);
-  L1 = luaE_newthread(L);
+  L1 = luaE_newthread(L, stacksize, cisize);
   setthvalue(L, L->top, L1);
   api_incr_top(L);
   lua_unlock(L);
@@ -326,6 +340,8 @@ LUA_API lua_Number lua_tonumber (lua_State *L, int idx) {
 LUA_API lua_Integer lua_tointeger (lua_State *L, int idx) {
   TValue n;
   const TValue *o = index2adr(L, idx);
+  if (ttisint(o))
+    return ivalue(o);
   if (tonumber(o, &n)) {
     lua_Integer res;
     lua_Number num = nvalue(o);
@@ -443,7 +459,10 @@ LUA_API void lua_pushnumber (lua_State *L, lua_Number n) {
 
 LUA_API void lua_pushinteger (lua_State *L, lua_Integer n) {
   lua_lock(L);
-  setnvalue(L->top, cast_num(n));
+  if (n == cast_int(n))
+    setivalue(L->top, cast_int(n))
+  else
+    setnvalue(L->top, cast_num(n));
   api_incr_top(L);
   lua_unlock(L);
 }
@@ -618,6 +637,44 @@ LUA_API void lua_createtable (lua_State *L, int narray, int nrec) {
 }
 
 
+/* Make room for narray array and nrec hash entries in an existing table */
+LUA_API void lua_presizetable (lua_State *L, int idx, int narray, int nrec) {
+  StkId t;
+  lua_lock(L);
+  t = index2adr(L, idx);
+  api_check(L, ttistable(t));
+  luaH_presize(L, hvalue(t), narray, nrec);
+  lua_unlock(L);
+}
+
+
+/* Remove all entries of a table, keeping its memory for reuse */
+LUA_API void lua_cleartable (lua_State *L, int idx) {
+  StkId t;
+  lua_lock(L);
+  t = index2adr(L, idx);
+  api_check(L, ttistable(t));
+  luaH_clear(hvalue(t));
+  lua_unlock(L);
+}
+
+
+/*
+** Sort t[1..n] by `<', or records t[i] by their field at keyidx (0 for
+** none), in C; 0 if the values aren't all numbers or all strings.
+*/
+LUA_API int lua_sortarray (lua_State *L, int idx, int n, int keyidx) {
+  StkId t;
+  int res;
+  lua_lock(L);
+  t = index2adr(L, idx);
+  api_check(L, ttistable(t));
+  res = luaH_sortarray(L, hvalue(t), n, keyidx ? index2adr(L, keyidx) : NULL);
+  lua_unlock(L);
+  return res;
+}
+
+
 LUA_API int lua_getmetatable (lua_State *L, int objindex) {
   const TValue *obj;
   Table *mt = NULL;
@@ -1020,6 +1077,11 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
       res = cast_int(g->memlimit >> 10);
       break;
     }
+    case LUA_GCIDLE: {
+      /* idle-time work of `data' Kbytes; 1 while a cycle is in progress */
+      res = luaC_idlestep(L, cast(lu_mem, data) << 10);
+      break;
+    }
     default: res = -1;  /* invalid option */
   }
   lua_unlock(L);
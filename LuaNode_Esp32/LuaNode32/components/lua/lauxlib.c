@@ -14,6 +14,8 @@
 #include C_HEADER_STRING
 #ifndef LUA_CROSS_COMPILER
 #include "vfs.h"
+#include "flash_fs.h"
+#include "crc16.h"
 #else
 #endif
 
@@ -32,6 +34,11 @@
 #include "lobject.h"
 #include "lstate.h"
 #include "legc.h"
+#include "lslab.h"
+#include "lundump.h"
+#if LUAI_PSRAM && !defined(LUA_CROSS_COMPILER)
+#include "esp_heap_alloc_caps.h"
+#endif
 
 #define FREELIST_REF	0	/* free list of references */
 
@@ -413,7 +420,7 @@ LUALIB_API const char *luaL_findtable (lua_State *L, int idx,
     lua_rawget(L, -2);
     if (lua_isnil(L, -1)) {
       /* If looking for a global variable, check the rotables too */
-      void *ptable = luaR_findglobal(fname, e - fname);
+      void *ptable = luaR_getglobal(L, fname, e - fname);
       if (ptable) {
         lua_pop(L, 1);
         lua_pushrotable(L, ptable);
@@ -445,53 +452,93 @@ LUALIB_API const char *luaL_findtable (lua_State *L, int idx,
 */
 
 
-#define bufflen(B)	((B)->p - (B)->buffer)
-#define bufffree(B)	((size_t)(LUAL_BUFFERSIZE - bufflen(B)))
+#define bufflen(B)	((size_t)((B)->p - (B)->b))
+#define bufffree(B)	((size_t)((B)->end - (B)->p))
 
-#define LIMIT	(LUA_MINSTACK/2)
+/*
+** Once B->buffer is full the contents move to a heap block that grows
+** geometrically, so a long result is copied once more in total instead
+** of being concatenated on the stack chunk by chunk. The block is owned
+** by a userdata box in B's stack slot, whose __gc frees it should an
+** error unwind past the buffer.
+*/
+#define BUFFERBOX	"_BUFFERBOX"
+
+typedef struct BufferBox {
+  char *b;
+  size_t size;
+} BufferBox;
+
+
+static void *boxrealloc (lua_State *L, BufferBox *box, size_t nsize) {
+  void *ud;
+  lua_Alloc allocf = lua_getallocf(L, &ud);
+  void *nb = allocf(ud, box->b, box->size, nsize);
+  if (nb == NULL && nsize > 0)
+    luaL_error(L, "not enough memory");
+  box->b = (char *)nb;
+  box->size = nsize;
+  return nb;
+}
+
+
+static int boxgc (lua_State *L) {
+  boxrealloc(L, (BufferBox *)lua_touserdata(L, 1), 0);
+  return 0;
+}
 
 
-static int emptybuffer (luaL_Buffer *B) {
-  size_t l = bufflen(B);
-  if (l == 0) return 0;  /* put nothing on stack */
+/* make room for sz more bytes; idx is where the box is (or goes) */
+static char *growbuffer (luaL_Buffer *B, size_t sz, int idx) {
+  lua_State *L = B->L;
+  size_t len = bufflen(B);
+  size_t nsize = (size_t)(B->end - B->b) * 2;
+  BufferBox *box;
+  if (sz > ~(size_t)0 - len)
+    luaL_error(L, "buffer too large");
+  if (nsize < len + sz)
+    nsize = len + sz;
+  if (B->lvl == 0) {  /* first growth: move out of B->buffer */
+    box = (BufferBox *)lua_newuserdata(L, sizeof(BufferBox));
+    box->b = NULL;
+    box->size = 0;
+    if (luaL_newmetatable(L, BUFFERBOX)) {
+      lua_pushcfunction(L, boxgc);
+      lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    if (idx != -1)
+      lua_insert(L, idx);
+    B->lvl = 1;
+    boxrealloc(L, box, nsize);
+    memcpy(box->b, B->buffer, len);
+  }
   else {
-    lua_pushlstring(B->L, B->buffer, l);
-    B->p = B->buffer;
-    B->lvl++;
-    return 1;
+    box = (BufferBox *)lua_touserdata(L, idx);
+    boxrealloc(L, box, nsize);
   }
+  B->b = box->b;
+  B->p = B->b + len;
+  B->end = B->b + nsize;
+  return B->p;
 }
 
 
-static void adjuststack (luaL_Buffer *B) {
-  if (B->lvl > 1) {
-    lua_State *L = B->L;
-    int toget = 1;  /* number of levels to concat */
-    size_t toplen = lua_strlen(L, -1);
-    do {
-      size_t l = lua_strlen(L, -(toget+1));
-      if (B->lvl - toget + 1 >= LIMIT || toplen > l) {
-        toplen += l;
-        toget++;
-      }
-      else break;
-    } while (toget < B->lvl);
-    lua_concat(L, toget);
-    B->lvl = B->lvl - toget + 1;
-  }
+LUALIB_API char *luaL_prepbuffsize (luaL_Buffer *B, size_t sz) {
+  if (bufffree(B) >= sz)
+    return B->p;
+  return growbuffer(B, sz, -1);
 }
 
 
 LUALIB_API char *luaL_prepbuffer (luaL_Buffer *B) {
-  if (emptybuffer(B))
-    adjuststack(B);
-  return B->buffer;
+  return luaL_prepbuffsize(B, LUAL_BUFFERSIZE);
 }
 
 
 LUALIB_API void luaL_addlstring (luaL_Buffer *B, const char *s, size_t l) {
-  while (l--)
-    luaL_addchar(B, *s++);
+  memcpy(luaL_prepbuffsize(B, l), s, l);
+  B->p += l;
 }
 
 
@@ -501,9 +548,15 @@ LUALIB_API void luaL_addstring (luaL_Buffer *B, const char *s) {
 
 
 LUALIB_API void luaL_pushresult (luaL_Buffer *B) {
-  emptybuffer(B);
-  lua_concat(B->L, B->lvl);
-  B->lvl = 1;
+  lua_State *L = B->L;
+  lua_pushlstring(L, B->b, bufflen(B));
+  if (B->lvl > 0) {  /* free the block now, not at the next collection */
+    boxrealloc(L, (BufferBox *)lua_touserdata(L, -2), 0);
+    lua_remove(L, -2);
+  }
+  B->b = B->p = B->buffer;
+  B->end = B->buffer + LUAL_BUFFERSIZE;
+  B->lvl = 0;
 }
 
 
@@ -511,26 +564,78 @@ LUALIB_API void luaL_addvalue (luaL_Buffer *B) {
   lua_State *L = B->L;
   size_t vl;
   const char *s = lua_tolstring(L, -1, &vl);
-  if (vl <= bufffree(B)) {  /* fit into buffer? */
-    memcpy(B->p, s, vl);  /* put it there */
-    B->p += vl;
-    lua_pop(L, 1);  /* remove from stack */
-  }
-  else {
-    if (emptybuffer(B))
-      lua_insert(L, -2);  /* put buffer before new value */
-    B->lvl++;  /* add new value into B stack */
-    adjuststack(B);
+  char *p = B->p;
+  if (s == NULL) {  /* a string builder's text goes in as it is */
+    luaL_StrBuilder *sb = luaL_testbuilder(L, -1);
+    s = sb ? sb->b : NULL;
+    vl = sb ? sb->n : 0;
   }
+  if (vl > bufffree(B))
+    p = growbuffer(B, vl, -2);  /* the box goes below the value */
+  memcpy(p, s, vl);
+  B->p += vl;
+  lua_pop(L, 1);  /* remove from stack */
 }
 
 
 LUALIB_API void luaL_buffinit (lua_State *L, luaL_Buffer *B) {
   B->L = L;
-  B->p = B->buffer;
+  B->b = B->p = B->buffer;
+  B->end = B->buffer + LUAL_BUFFERSIZE;
   B->lvl = 0;
 }
 
+
+LUALIB_API luaL_StrBuilder *luaL_testbuilder (lua_State *L, int idx) {
+  luaL_StrBuilder *sb = (luaL_StrBuilder *)lua_touserdata(L, idx);
+  int same;
+  if (sb == NULL || !lua_getmetatable(L, idx))
+    return NULL;
+  lua_getfield(L, LUA_REGISTRYINDEX, LUAL_STRBUILDER);
+  same = lua_rawequal(L, -1, -2);
+  lua_pop(L, 2);
+  return same ? sb : NULL;
+}
+
+
+/* make room for sz more bytes at the end of sb */
+LUALIB_API char *luaL_builderprep (lua_State *L, luaL_StrBuilder *sb,
+                                   size_t sz) {
+  if (sb->size - sb->n < sz) {
+    size_t nsize = sb->size * 2;
+    void *ud;
+    lua_Alloc allocf = lua_getallocf(L, &ud);
+    void *nb;
+    if (sz > ~(size_t)0 - sb->n)
+      luaL_error(L, "builder too large");
+    if (nsize < sb->n + sz)
+      nsize = sb->n + sz;
+    if (nsize < LUAL_BUFFERSIZE)
+      nsize = LUAL_BUFFERSIZE;
+    nb = allocf(ud, sb->b, sb->size, nsize);
+    if (nb == NULL)
+      luaL_error(L, "not enough memory");
+    sb->b = (char *)nb;
+    sb->size = nsize;
+  }
+  return sb->b + sb->n;
+}
+
+
+LUALIB_API void luaL_builderadd (lua_State *L, luaL_StrBuilder *sb,
+                                 const char *s, size_t l) {
+  char *p;
+  if (sb->b != NULL && s >= sb->b && s < sb->b + sb->n) {  /* its own text? */
+    size_t off = s - sb->b;
+    p = luaL_builderprep(L, sb, l);
+    s = sb->b + off;
+  }
+  else
+    p = luaL_builderprep(L, sb, l);
+  memcpy(p, s, l);
+  sb->n += l;
+}
+
 /* }====================================================== */
 
 
@@ -651,15 +756,33 @@ LUALIB_API int luaL_loadfile (lua_State *L, const char *filename) {
 
 #include C_HEADER_FCNTL
 
+/*
+** A precompiled chunk is read into one buffer from the heap, the whole of
+** it if it takes no more than LUAI_LOADBUF, so lundump finds it there
+** rather than a LUAL_BUFFERSIZE piece at a time. Without the memory the
+** readers make do with their own buffer.
+*/
+static char *loadbuf (size_t len, size_t *size) {
+  char *b = NULL;
+  if (len > LUAI_LOADBUF) len = LUAI_LOADBUF;
+  if (len > LUAL_BUFFERSIZE && (b = (char *)malloc(len)) != NULL)
+    *size = len;
+  return b;
+}
+
+
 typedef struct LoadFSF {
   int extraline;
   int f;
+  char *big;  /* from loadbuf, or NULL */
+  size_t bigsize;
   char buff[LUAL_BUFFERSIZE];
 } LoadFSF;
 
 
 static const char *getFSF (lua_State *L, void *ud, size_t *size) {
   LoadFSF *lf = (LoadFSF *)ud;
+  char *b = lf->big ? lf->big : lf->buff;
   (void)L;
 
   if (L == NULL && size == NULL) // Direct mode check
@@ -672,9 +795,9 @@ static const char *getFSF (lua_State *L, void *ud, size_t *size) {
   }
 
   if (vfs_eof(lf->f)) return NULL;
-  *size = vfs_read(lf->f, lf->buff, sizeof(lf->buff));
+  *size = vfs_read(lf->f, b, lf->big ? lf->bigsize : sizeof(lf->buff));
 
-  return (*size > 0) ? lf->buff : NULL;
+  return (*size > 0) ? b : NULL;
 }
 
 
@@ -692,6 +815,7 @@ LUALIB_API int luaL_loadfsfile (lua_State *L, const char *filename) {
   int c;
   int fnameindex = lua_gettop(L) + 1;  /* index of filename on the stack */
   lf.extraline = 0;
+  lf.big = NULL;
   if (filename == NULL) {
     return luaL_error(L, "filename is NULL");
   }
@@ -717,13 +841,196 @@ LUALIB_API int luaL_loadfsfile (lua_State *L, const char *filename) {
     lf.extraline = 0;
   }
   vfs_ungetc(c, lf.f);
+  if (c == LUA_SIGNATURE[0])
+    lf.big = loadbuf(vfs_size(lf.f) - vfs_tell(lf.f), &lf.bigsize);
   status = lua_load(L, getFSF, &lf, lua_tostring(L, -1));
+  free(lf.big);
 
   if (filename) vfs_close(lf.f);  /* close file (even in case of errors) */
   lua_remove(L, fnameindex);
   return status;
 }
 
+
+/*
+** Bytecode cache: `x.lua' is compiled once into `x.lc', which ends with a
+** stamp of the source it came from. SPIFFS keeps no modification times,
+** so the stamp is the size and CRC16 of the source. It is written last: a
+** cache cut short by a reset has no valid stamp and is simply rebuilt. An
+** .lc without a stamp was not made by the cache and is left alone.
+*/
+#define LCSTAMP_MAGIC	0x1b4c4343	/* "\033LCC" */
+
+typedef struct LCStamp {
+  uint32_t magic;
+  uint32_t size;  /* of the source */
+  uint32_t crc;   /* CRC16 of the source */
+} LCStamp;
+
+typedef struct LoadLC {
+  int f;
+  size_t left;  /* bytecode before the stamp */
+  char *big;  /* from loadbuf, or NULL */
+  size_t bigsize;
+  char buff[LUAL_BUFFERSIZE];
+} LoadLC;
+
+
+static const char *getLC (lua_State *L, void *ud, size_t *size) {
+  LoadLC *lc = (LoadLC *)ud;
+  char *b = lc->big ? lc->big : lc->buff;
+  size_t bsize = lc->big ? lc->bigsize : sizeof(lc->buff);
+  int32_t n;
+  if (L == NULL && size == NULL) // Direct mode check
+    return NULL;
+  if (lc->left == 0) return NULL;
+  n = vfs_read(lc->f, b, lc->left < bsize ? lc->left : bsize);
+  if (n <= 0) return NULL;
+  lc->left -= n;
+  *size = n;
+  return b;
+}
+
+
+LUALIB_API void luaL_fswriterinit (luaL_FsWriter *w, int f, char *buff,
+                                   size_t size) {
+  w->f = f;
+  w->failed = 0;
+  w->buff = buff;
+  w->size = size;
+  w->n = 0;
+}
+
+
+/* 0 if everything buffered so far is in the file */
+LUALIB_API int luaL_fswriterflush (luaL_FsWriter *w) {
+  if (w->n > 0 && !w->failed)
+    w->failed = vfs_write(w->f, w->buff, w->n) != (int32_t)w->n;
+  w->n = 0;
+  return w->failed;
+}
+
+
+LUALIB_API int luaL_fswrite (lua_State *L, const void *p, size_t size,
+                             void *u) {
+  luaL_FsWriter *w = (luaL_FsWriter *)u;
+  UNUSED(L);
+  if (w->n + size > w->size && luaL_fswriterflush(w))
+    return 1;
+  if (size >= w->size)  /* too big to buffer: straight through */
+    w->failed = vfs_write(w->f, p, size) != (int32_t)size;
+  else {
+    memcpy(w->buff + w->n, p, size);
+    w->n += size;
+  }
+  return w->failed;
+}
+
+
+/* stamp of source file `name', using `buff' to read it */
+static int lcstamp (const char *name, LCStamp *st, char *buff, size_t len) {
+  int32_t n;
+  uint32_t size;
+  int f = vfs_open(name, "r");
+  if (!f) return 0;
+  size = vfs_size(f);
+  st->magic = LCSTAMP_MAGIC;
+  st->size = 0;
+  st->crc = CRC16_INITIAL_CRC;
+  /* SPIFFS answers a read at the end with an error, so stop short of it */
+  while (st->size < size && (n = vfs_read(f, buff, len)) > 0) {
+    st->size += n;
+    st->crc = crc16_ccitt(st->crc, buff, n);
+  }
+  vfs_close(f);
+  return st->size == size;
+}
+
+
+/* name of the cache of `filename' in `lcname', 0 if it has none */
+static int lcname (const char *filename, char *lcname) {
+  size_t len = strlen(filename);
+  if (len < 4 || len >= FS_NAME_MAX_LENGTH || strcmp(filename + len - 4, ".lua"))
+    return 0;
+  memcpy(lcname, filename, len - 2);
+  strcpy(lcname + len - 2, "c");
+  return 1;
+}
+
+
+/*
+** Append the stamp of source `filename' to the bytecode just written to
+** `f', making it the cache of that source (as node.compile does).
+*/
+LUALIB_API int luaL_fscachestamp (const char *filename, int f) {
+  char buff[LUAL_BUFFERSIZE];
+  LCStamp st;
+  if (!lcstamp(filename, &st, buff, sizeof(buff)))
+    return 0;
+  return vfs_write(f, &st, sizeof(st)) == sizeof(st);
+}
+
+
+/*
+** luaL_loadfsfile with the bytecode cache: a .lua file loads from its .lc
+** while the stamp matches, otherwise it is parsed and the .lc rewritten.
+** Any trouble with the cache just falls back to the source.
+*/
+LUALIB_API int luaL_loadfscached (lua_State *L, const char *filename) {
+#if LUAI_LCCACHE
+  char lcfile[FS_NAME_MAX_LENGTH];
+  LoadLC lc;
+  LCStamp st, cst;
+  int status;
+  if (filename == NULL || !lcname(filename, lcfile) ||
+      !lcstamp(filename, &st, lc.buff, sizeof(lc.buff)))
+    return luaL_loadfsfile(L, filename);
+  lc.f = vfs_open(lcfile, "r");
+  if (lc.f) {
+    uint32_t size = vfs_size(lc.f);
+    int stamped = size > sizeof(cst) &&
+        vfs_lseek(lc.f, size - sizeof(cst), VFS_SEEK_SET) >= 0 &&
+        vfs_read(lc.f, &cst, sizeof(cst)) == sizeof(cst) &&
+        cst.magic == LCSTAMP_MAGIC;
+    if (stamped && cst.size == st.size && cst.crc == st.crc &&
+        vfs_lseek(lc.f, 0, VFS_SEEK_SET) >= 0) {
+      lc.left = size - sizeof(cst);
+      lc.big = loadbuf(lc.left, &lc.bigsize);
+      lua_pushfstring(L, "@%s", filename);
+      status = lua_load(L, getLC, &lc, lua_tostring(L, -1));
+      free(lc.big);
+      vfs_close(lc.f);
+      lua_remove(L, -2);
+      if (status == 0)
+        return 0;
+      lua_pop(L, 1);  /* stale format, e.g. from another build */
+    }
+    else {
+      vfs_close(lc.f);
+      if (!stamped)
+        return luaL_loadfsfile(L, filename);  /* not ours */
+    }
+  }
+  status = luaL_loadfsfile(L, filename);
+  if (status == 0 && (lc.f = vfs_open(lcfile, "w")) != 0) {
+    luaL_FsWriter w;
+    int bad;
+    luaL_fswriterinit(&w, lc.f, lc.buff, sizeof(lc.buff));
+    lua_lock(L);
+    bad = luaU_dump(L, clvalue(L->top - 1)->l.p, luaL_fswrite, &w, 0);
+    lua_unlock(L);
+    bad = bad || luaL_fswrite(L, &st, sizeof(st), &w) ||
+          luaL_fswriterflush(&w) || vfs_flush(lc.f) < 0;
+    vfs_close(lc.f);
+    if (bad)
+      vfs_remove(lcfile);  /* e.g. file system full */
+  }
+  return status;
+#else
+  return luaL_loadfsfile(L, filename);
+#endif
+}
+
 #endif
 
 typedef struct LoadS {
@@ -753,6 +1060,31 @@ LUALIB_API int luaL_loadbuffer (lua_State *L, const char *buff, size_t size,
 }
 
 
+/* Like getS, but reports the buffer as the base address for direct mode */
+static const char *getM (lua_State *L, void *ud, size_t *size) {
+  LoadS *ls = (LoadS *)ud;
+  if (L == NULL && size == NULL) // direct mode check
+    return ls->s;
+  return getS(L, ud, size);
+}
+
+
+/*
+** Load a precompiled chunk in direct mode: code, constant strings and line
+** info keep pointing into buff, which must be 4-byte aligned and stay
+** mapped and unchanged for as long as the state lives (e.g. flash).
+*/
+LUALIB_API int luaL_loadmapped (lua_State *L, const char *buff, size_t size,
+                                const char *name) {
+  LoadS ls;
+  if (((size_t)buff & 3) || size == 0 || *buff != LUA_SIGNATURE[0])
+    return luaL_loadbuffer(L, buff, size, name);
+  ls.s = buff;
+  ls.size = size;
+  return lua_load(L, getM, &ls, name);
+}
+
+
 LUALIB_API int (luaL_loadstring) (lua_State *L, const char *s) {
   return luaL_loadbuffer(L, s, strlen(s), s);
 }
@@ -780,13 +1112,91 @@ static int l_check_memlimit(lua_State *L, size_t needbytes) {
 }
 
 
-static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
+#if LUAI_PSRAM && !defined(LUA_CROSS_COMPILER)
+#define l_inpsram(p)  ((size_t)(p) >= 0x3F800000 && (size_t)(p) < 0x3FC00000)
+
+/*
+** Heap blocks of at least psrambig bytes, or psramcold bytes when the core
+** marked them as rarely touched (luaM_coldvector), go to SPI RAM; the rest
+** stay in internal RAM. Either falls back to the other when it runs out.
+*/
+static void *l_heaprealloc (lua_State *L, void *ptr, size_t osize,
+                            size_t nsize, int cold) {
+  global_State *g = L ? G(L) : NULL;
+  int want = g != NULL && (nsize >= g->psrambig ||
+                           (cold && nsize >= g->psramcold));
+  void *nptr = NULL;
+  if (ptr != NULL && want == l_inpsram(ptr))
+    return realloc(ptr, nsize);  /* already in the right memory */
+  if (want)
+    nptr = pvPortMallocCaps(nsize, MALLOC_CAP_SPISRAM);
+  if (nptr == NULL)
+    nptr = malloc(nsize);
+  if (nptr == NULL)
+    return (ptr != NULL && nsize < osize) ? ptr : NULL;  /* shrinking must not fail */
+  if (ptr != NULL) {
+    memcpy(nptr, ptr, osize < nsize ? osize : nsize);
+    free(ptr);
+  }
+  return nptr;
+}
+#else
+#define l_heaprealloc(L, ptr, osize, nsize, cold)  realloc(ptr, nsize)
+#endif
+
+#if LUAI_SLAB
+/* small blocks come from slab slots; which kind ptr is goes by its address */
+static void l_free (void *ptr) {
+  if (ptr && lslab_owns(ptr))
+    lslab_free(ptr);
+  else
+    free(ptr);
+}
+
+static void *l_realloc (lua_State *L, void *ptr, size_t osize, size_t nsize,
+                        int cold) {
+  size_t slot = ptr ? lslab_owns(ptr) : 0;
+  void *nptr;
+  if (slot == 0) {  /* new or heap block; heap blocks stay on the heap */
+    if (ptr == NULL && (nptr = lslab_alloc(nsize)) != NULL)
+      return nptr;
+    return l_heaprealloc(L, ptr, osize, nsize, cold);
+  }
+  if (nsize <= slot && nsize > slot - LSLAB_STEP)
+    return ptr;  /* same class */
+  nptr = lslab_alloc(nsize);
+  if (nptr == NULL)
+    nptr = l_heaprealloc(L, NULL, 0, nsize, cold);
+  if (nptr == NULL)
+    return (nsize < osize) ? ptr : NULL;  /* shrinking must not fail */
+  memcpy(nptr, ptr, osize < nsize ? osize : nsize);
+  lslab_free(ptr);
+  return nptr;
+}
+#else
+#define l_free(ptr)  free(ptr)
+#define l_realloc(L, ptr, osize, nsize, cold) \
+  l_heaprealloc(L, ptr, osize, nsize, cold)
+#endif
+
+/* `heap' keeps clear of the slab allocator, which only one task may use */
+static void *l_allocx (void *ud, void *ptr, size_t osize, size_t nsize,
+                       int heap) {
   lua_State *L = (lua_State *)ud;
   int mode = L == NULL ? 0 : G(L)->egcmode;
+  int cold = 0;
   void *nptr;
 
+  if (L != NULL) {  /* the hint only covers this one block */
+    cold = G(L)->coldalloc;
+    G(L)->coldalloc = 0;
+  }
+
   if (nsize == 0) {
-    free(ptr);
+    if (heap)
+      free(ptr);
+    else
+      l_free(ptr);
     return NULL;
   }
   if (L != NULL && (mode & EGC_ALWAYS)) /* always collect memory if requested */
@@ -798,14 +1208,24 @@ static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
     if(G(L)->memlimit > 0 && (mode & EGC_ON_MEM_LIMIT) && l_check_memlimit(L, nsize - osize))
       return NULL;
   }
-  nptr = (void *)realloc(ptr, nsize);
+  nptr = heap ? l_heaprealloc(L, ptr, osize, nsize, cold)
+              : l_realloc(L, ptr, osize, nsize, cold);
   if (nptr == NULL && L != NULL && (mode & EGC_ON_ALLOC_FAILURE)) {
     luaC_fullgc(L); /* emergency full collection. */
-    nptr = (void *)realloc(ptr, nsize); /* try allocation again */
+    nptr = heap ? l_heaprealloc(L, ptr, osize, nsize, cold)  /* try again */
+                : l_realloc(L, ptr, osize, nsize, cold);
   }
   return nptr;
 }
 
+static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
+  return l_allocx(ud, ptr, osize, nsize, 0);
+}
+
+static void *l_heapalloc (void *ud, void *ptr, size_t osize, size_t nsize) {
+  return l_allocx(ud, ptr, osize, nsize, 1);
+}
+
 LUALIB_API void luaL_assertfail(const char *file, int line, const char *message) {
   printf("ASSERT@%s(%d): %s\n", file, line, message); 
 }
@@ -831,3 +1251,14 @@ LUALIB_API lua_State *luaL_newstate (void) {
   return L;
 }
 
+
+/* A state for another task: its memory only ever comes from the heap */
+LUALIB_API lua_State *luaL_newheapstate (void) {
+  lua_State *L = lua_newstate(l_heapalloc, NULL);
+  if (L) {
+    lua_setallocf(L, l_heapalloc, L);
+    lua_atpanic(L, &panic);
+  }
+  return L;
+}
+
@@ -296,7 +296,7 @@ static int luaB_loadfile (lua_State *L) {
 #ifdef LUA_CROSS_COMPILER
   return load_aux(L, luaL_loadfile(L, fname));
 #else
-  return load_aux(L, luaL_loadfsfile(L, fname));
+  return load_aux(L, luaL_loadfscached(L, fname));
 #endif
 }
 
@@ -343,7 +343,7 @@ static int luaB_dofile (lua_State *L) {
 #ifdef LUA_CROSS_COMPILER
   if (luaL_loadfile(L, fname) != 0) lua_error(L);
 #else
-  if (luaL_loadfsfile(L, fname) != 0) lua_error(L);
+  if (luaL_loadfscached(L, fname) != 0) lua_error(L);
 #endif
   lua_call(L, 0, LUA_MULTRET);
   return lua_gettop(L) - n;
@@ -510,7 +510,7 @@ static int luaB_index(lua_State *L) {
     lua_pushliteral(L, LUA_VERSION);
     return 1;
   }
-  void *res = luaR_findglobal(keyname, strlen(keyname));
+  void *res = luaR_getglobal(L, keyname, strlen(keyname));
   if (!res)
     return 0;
   else {
@@ -631,8 +631,10 @@ static int luaB_auxwrap (lua_State *L) {
 }
 
 
+/* coroutine.create(f [, stacksize [, cisize]]) */
 static int luaB_cocreate (lua_State *L) {
-  lua_State *NL = lua_newthread(L);
+  lua_State *NL = lua_newthreadsize(L, luaL_optint(L, 2, 0),
+                                       luaL_optint(L, 3, 0));
   luaL_argcheck(L, lua_isfunction(L, 1) && !lua_iscfunction(L, 1), 1,
     "Lua function expected");
   lua_pushvalue(L, 1);  /* move function to top */
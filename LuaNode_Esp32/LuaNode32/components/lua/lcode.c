@@ -256,7 +256,7 @@ int luaK_stringK (FuncState *fs, TString *s) {
 
 int luaK_numberK (FuncState *fs, lua_Number r) {
   TValue o;
-  setnvalue(&o, r);
+  luaO_setnumber(&o, r);
   return addk(fs, &o, &o);
 }
 
@@ -864,6 +864,7 @@ void luaK_fixline (FuncState *fs, int line) {
     generateInfoDeltaLine(fs, line);
   }
 #else
+   if (fs->ls->sink) return;  /* no line information kept */
    fs->f->lineinfo[fs->pc - 1] = line;
 #endif
 }
@@ -892,6 +893,7 @@ static int luaK_code (FuncState *fs, Instruction i, int line) {
   }
   fs->lineinfoLastPC = fs->pc;
 #else
+  if (fs->ls->sink) return fs->pc++;  /* no line information kept */
   luaM_growvector(fs->L, f->lineinfo, fs->pc, f->sizelineinfo, int,
                   MAX_INT, "code size overflow");
   f->lineinfo[fs->pc] = line;
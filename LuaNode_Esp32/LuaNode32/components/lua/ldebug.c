@@ -47,6 +47,11 @@ static int currentline (lua_State *L, CallInfo *ci) {
 }
 
 
+int luaG_currentline (lua_State *L, CallInfo *ci) {
+  return currentline(L, ci);
+}
+
+
 /*
 ** this function can be called asynchronous (e.g. during a signal)
 */
@@ -76,6 +76,11 @@ static void restore_stack_limit (lua_State *L) {
     if (inuse + 1 < LUAI_MAXCALLS)  /* can `undo' overflow? */
       luaD_reallocCI(L, LUAI_MAXCALLS);
   }
+  if (L->stacksize > LUAI_MAXSTACK) {  /* stack overflow? */
+    int inuse = cast_int(L->top - L->stack) + EXTRA_STACK;
+    if (inuse < LUAI_MAXSTACK)  /* give back the room for the handler */
+      luaD_reallocstack(L, LUAI_MAXSTACK - EXTRA_STACK - 1);
+  }
 }
 
 
@@ -141,19 +146,43 @@ static void correctstack (lua_State *L, TValue *oldstack) {
 }
 
 
-void luaD_reallocstack (lua_State *L, int newsize) {
+/*
+** Resize the stack to 'newsize' usable slots. With 'try' set, a stack
+** that cannot be had is not an error: 0 is returned and the stack left
+** as it was.
+*/
+static int reallocstack (lua_State *L, int newsize, int try) {
   TValue *oldstack = L->stack;
+  TValue *newstack;
   int realsize = newsize + 1 + EXTRA_STACK;
   lua_assert(L->stack_last - L->stack == L->stacksize - EXTRA_STACK - 1);
-  luaM_reallocvector(L, L->stack, L->stacksize, realsize, TValue);
+  if (try)
+    newstack = cast(TValue *, luaM_tryrealloc_(L, oldstack,
+                   L->stacksize * sizeof(TValue), realsize * sizeof(TValue)));
+  else
+    newstack = cast(TValue *, luaM_reallocv(L, oldstack, L->stacksize,
+                                            realsize, sizeof(TValue)));
+  if (newstack == NULL)
+    return 0;
+  if (realsize > L->stacksize)
+    L->stackidle = 0;  /* it is needed after all */
+  L->stack = newstack;
   L->stacksize = realsize;
   L->stack_last = L->stack+newsize;
   correctstack(L, oldstack);
+  return 1;
+}
+
+
+void luaD_reallocstack (lua_State *L, int newsize) {
+  reallocstack(L, newsize, 0);
 }
 
 
 void luaD_reallocCI (lua_State *L, int newsize) {
   CallInfo *oldci = L->base_ci;
+  if (newsize > L->size_ci)
+    L->ciidle = 0;
   luaM_reallocvector(L, L->base_ci, L->size_ci, newsize, CallInfo);
   L->size_ci = newsize;
   L->ci = (L->ci - oldci) + L->base_ci;
@@ -161,11 +190,27 @@ void luaD_reallocCI (lua_State *L, int newsize) {
 }
 
 
+/*
+** Make room for 'n' more slots. The stack doubles, up to LUAI_MAXSTACK;
+** when the heap has no block that big, it grows by just what is needed,
+** which a fragmented heap is likelier to have.
+*/
 void luaD_growstack (lua_State *L, int n) {
-  if (n <= L->stacksize)  /* double size is enough? */
-    luaD_reallocstack(L, 2*L->stacksize);
-  else
-    luaD_reallocstack(L, L->stacksize + n);
+  int needed = cast_int(L->top - L->stack) + n + 1;  /* usable slots */
+  if (L->stacksize > LUAI_MAXSTACK)  /* overflow while handling overflow? */
+    luaD_throw(L, LUA_ERRERR);
+  if (needed + EXTRA_STACK + 1 > LUAI_MAXSTACK) {
+    /* room for the error handler, taken back by restore_stack_limit */
+    luaD_reallocstack(L, LUAI_MAXSTACK + 2*LUA_MINSTACK);
+    luaG_runerror(L, "stack overflow");
+  }
+  else {
+    int size = (n <= L->stacksize) ? 2*L->stacksize : L->stacksize + n;
+    if (size > LUAI_MAXSTACK - EXTRA_STACK - 1)
+      size = LUAI_MAXSTACK - EXTRA_STACK - 1;
+    if (!reallocstack(L, size, 1))
+      luaD_reallocstack(L, needed);  /* raises the memory error if need be */
+  }
 }
 
 
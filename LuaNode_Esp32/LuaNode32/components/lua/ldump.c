@@ -11,6 +11,7 @@
 #include "lua.h"
 #include C_HEADER_STRING
 
+#include "lmem.h"
 #include "lobject.h"
 #include "lstate.h"
 #include "lundump.h"
@@ -194,7 +195,7 @@ static void DumpString(const TString* s, DumpState* D)
 
 static void DumpFunction(const Proto* f, const TString* p, DumpState* D);
 
-static void DumpConstants(const Proto* f, DumpState* D)
+static void DumpK(const Proto* f, DumpState* D)
 {
  int i,n=f->sizek;
  DumpInt(n,D);
@@ -220,6 +221,12 @@ static void DumpConstants(const Proto* f, DumpState* D)
 	break;
   }
  }
+}
+
+static void DumpConstants(const Proto* f, DumpState* D)
+{
+ int i,n;
+ DumpK(f,D);
  n=f->sizep;
  DumpInt(n,D);
  for (i=0; i<n; i++) DumpFunction(f->p[i],f->source,D);
@@ -313,18 +320,157 @@ int luaU_dump_crosscompile (lua_State* L, const Proto* f, lua_Writer w, void* da
  return D.status;
 }
 
+static void LocalTarget(DumpTargetInfo* target)
+{
+ int test=1;
+ target->little_endian=*(char*)&test;
+ target->sizeof_int=sizeof(int);
+ target->sizeof_strsize_t=sizeof(strsize_t);
+ target->sizeof_lua_Number=sizeof(lua_Number);
+ target->lua_Number_integral=(((lua_Number)0.5)==0);
+ target->is_arm_fpa=0;
+}
+
 /*
  ** dump Lua function as precompiled chunk with local machine as target
  */
 int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data, int strip)
 {
  DumpTargetInfo target;
- int test=1;
- target.little_endian=*(char*)&test;
- target.sizeof_int=sizeof(int);
- target.sizeof_strsize_t=sizeof(strsize_t);
- target.sizeof_lua_Number=sizeof(lua_Number);
- target.lua_Number_integral=(((lua_Number)0.5)==0);
- target.is_arm_fpa=0;
+ LocalTarget(&target);
  return luaU_dump_crosscompile(L,f,w,data,strip,target);
 }
+
+/*
+** Low-memory compilation. The parser hands every function to the sink as
+** soon as it has been closed. Its stripped dump is spooled in two parts,
+** split where the code is aligned, and the function is emptied, so only
+** the functions still being parsed stay in memory. luaU_sinkdump then
+** copies the parts back in order, aligning the code where it finally
+** lands: the chunk is the same as luaU_dump with strip gives.
+*/
+typedef struct SinkFunc {
+ uint32_t off;		/* in the spool */
+ uint32_t head;		/* size up to the code */
+ uint32_t size;		/* size of code, constants and number of functions */
+ int first;		/* first nested function */
+ int next;		/* next function with the same parent */
+} SinkFunc;
+
+void luaU_sinkinit (CompileSink* s, lua_Writer w,
+                    int (*r) (void*, uint32_t, void*, size_t), void* data)
+{
+ memset(s,0,sizeof(*s));
+ s->writer=w;
+ s->reader=r;
+ s->data=data;
+}
+
+void luaU_sinkclose (lua_State* L, CompileSink* s, Proto* f)
+{
+ DumpState D;
+ SinkFunc* sf;
+ int i;
+ luaM_growvector(L,s->f,s->nf,s->sizef,SinkFunc,MAX_INT,"too many functions");
+ luaM_growvector(L,s->pending,s->npending,s->sizepending,int,MAX_INT,"too many functions");
+ sf=&s->f[s->nf];
+ D.L=L;
+ D.writer=s->writer;
+ D.data=s->data;
+ D.strip=1;
+ D.status=0;
+ LocalTarget(&D.target);
+ D.wrote=0;
+ DumpString(NULL,&D);
+ DumpInt(f->linedefined,&D);
+ DumpInt(f->lastlinedefined,&D);
+ DumpChar(f->nups,&D);
+ DumpChar(f->numparams,&D);
+ DumpChar(f->is_vararg,&D);
+ DumpChar(f->maxstacksize,&D);
+ DumpInt(f->sizecode,&D);
+ sf->head=D.wrote;
+ DumpMem(f->code,f->sizecode,sizeof(Instruction),&D);
+ DumpK(f,&D);
+ DumpInt(f->sizep,&D);
+ sf->off=s->wrote;
+ sf->size=D.wrote-sf->head;
+ s->wrote+=D.wrote;
+ if (s->status==0) s->status=D.status;
+ /* the last sizep pending functions are the nested ones of f, in order */
+ lua_assert(s->npending>=f->sizep);
+ sf->first=sf->next=-1;
+ for (i=0; i<f->sizep; i++)
+ {
+  int c=s->pending[--s->npending];
+  s->f[c].next=sf->first;
+  sf->first=c;
+ }
+ s->pending[s->npending++]=s->nf++;
+ /* the parser still needs nups of f, and nothing else */
+ luaM_freearray(L,f->code,f->sizecode,Instruction);
+ luaM_freearray(L,f->k,f->sizek,TValue);
+ luaM_freearray(L,f->p,f->sizep,Proto*);
+ luaM_freearray(L,f->locvars,f->sizelocvars,LocVar);
+ luaM_freearray(L,f->upvalues,f->sizeupvalues,TString*);
+ f->code=NULL; f->sizecode=0;
+ f->k=NULL; f->sizek=0;
+ f->p=NULL; f->sizep=0;
+ f->locvars=NULL; f->sizelocvars=0;
+ f->upvalues=NULL; f->sizeupvalues=0;
+}
+
+static void SinkCopy(CompileSink* s, uint32_t off, uint32_t size, DumpState* D)
+{
+ char buf[64];
+ while (size>0 && D->status==0)
+ {
+  size_t n=size<sizeof(buf) ? size : sizeof(buf);
+  if ((*s->reader)(s->data,off,buf,n)!=0)
+   D->status=1;
+  else
+   DumpBlock(buf,n,D);
+  off+=n;
+  size-=n;
+ }
+}
+
+static void SinkFunction(CompileSink* s, int i, DumpState* D)
+{
+ int c;
+ SinkCopy(s,s->f[i].off,s->f[i].head,D);
+ Align4(D);
+ SinkCopy(s,s->f[i].off+s->f[i].head,s->f[i].size,D);
+ for (c=s->f[i].first; c>=0; c=s->f[c].next)
+  SinkFunction(s,c,D);
+ /* stripped debug information */
+ DumpInt(0,D);
+ Align4(D);
+ DumpInt(0,D);
+ DumpInt(0,D);
+}
+
+int luaU_sinkdump (lua_State* L, CompileSink* s, lua_Writer w, void* data)
+{
+ DumpState D;
+ if (s->status!=0) return s->status;
+ if (s->npending!=1) return 1;		/* not exactly one main function */
+ D.L=L;
+ D.writer=w;
+ D.data=data;
+ D.strip=1;
+ D.status=0;
+ LocalTarget(&D.target);
+ D.wrote=0;
+ DumpHeader(&D);
+ SinkFunction(s,s->pending[0],&D);
+ return D.status;
+}
+
+void luaU_sinkfree (lua_State* L, CompileSink* s)
+{
+ luaM_freearray(L,s->f,s->sizef,SinkFunc);
+ luaM_freearray(L,s->pending,s->sizepending,int);
+ s->f=NULL; s->nf=s->sizef=0;
+ s->pending=NULL; s->npending=s->sizepending=0;
+}
@@ -22,6 +22,11 @@
 #include "ltable.h"
 #include "ltm.h"
 #include "lrotable.h"
+#include "trace.h"
+
+#ifndef LUA_CROSS_COMPILER
+#include "esp_system.h"
+#endif
 
 #define GCSTEPSIZE	1024u
 #define GCSWEEPMAX	40
@@ -245,12 +250,28 @@ static void checkstacksizes (lua_State *L, StkId max) {
   int s_used = cast_int(max - L->stack);  /* part of stack in use */
   if (L->size_ci > LUAI_MAXCALLS)  /* handling overflow? */
     return;  /* do not touch the stacks */
-  if (4*ci_used < L->size_ci && 2*BASIC_CI_SIZE < L->size_ci)
-    luaD_reallocCI(L, L->size_ci/2);  /* still big enough... */
+  /* shrink only what has been oversized LUAI_STACKIDLE times in a row,
+     then down to twice what is in use */
+  if (4*ci_used < L->size_ci && 2*BASIC_CI_SIZE < L->size_ci) {
+    if (++L->ciidle >= LUAI_STACKIDLE) {
+      luaD_reallocCI(L, (2*ci_used > BASIC_CI_SIZE) ? 2*ci_used
+                                                    : BASIC_CI_SIZE);
+      L->ciidle = 0;
+    }
+  }
+  else
+    L->ciidle = 0;
   condhardstacktests(luaD_reallocCI(L, ci_used + 1));
   if (4*s_used < L->stacksize &&
-      2*(BASIC_STACK_SIZE+EXTRA_STACK) < L->stacksize)
-    luaD_reallocstack(L, L->stacksize/2);  /* still big enough... */
+      2*(BASIC_STACK_SIZE+EXTRA_STACK) < L->stacksize) {
+    if (++L->stackidle >= LUAI_STACKIDLE) {
+      luaD_reallocstack(L, (2*s_used > BASIC_STACK_SIZE) ? 2*s_used
+                                                         : BASIC_STACK_SIZE);
+      L->stackidle = 0;
+    }
+  }
+  else
+    L->stackidle = 0;
   condhardstacktests(luaD_reallocstack(L, s_used));
 }
 
@@ -496,6 +517,7 @@ void luaC_freeall (lua_State *L) {
   int i;
   g->currentwhite = WHITEBITS | bitmask(SFIXEDBIT);  /* mask to collect all elements */
   sweepwholelist(L, &g->rootgc);
+  luaS_rehashfinish(L);
   for (i = 0; i < g->strt.size; i++)  /* free all string lists */
     sweepwholelist(L, &g->strt.hash[i]);
 }
@@ -555,6 +577,7 @@ static void atomic (lua_State *L) {
   marktmu(g);  /* mark `preserved' userdata */
   udsize += propagateall(g);  /* remark, to propagate `preserveness' */
   cleartable(g->weak);  /* remove collected objects from weak tables */
+  luaS_rehashfinish(L);  /* strings are swept from `strt.hash' only */
   /* flip current white */
   g->currentwhite = cast_byte(otherwhite(g));
   g->sweepstrgc = 0;
@@ -622,6 +645,20 @@ static l_mem singlestep (lua_State *L) {
 }
 
 
+/* Bucket i counts pauses in [2^(i-1), 2^i) us, the last one the rest */
+static void steptime (global_State *g, lu_int32 us) {
+  int b = 0;
+  if (us > g->gcpausemax)
+    g->gcpausemax = us;
+  while (us && b < LUAI_GCHIST - 1) {
+    us >>= 1;
+    b++;
+  }
+  g->gcpausehist[b]++;
+  g->gcsteps++;
+}
+
+
 void luaC_step (lua_State *L) {
   global_State *g = G(L);
   if(is_block_gc(L)) return;
@@ -632,11 +669,22 @@ void luaC_step (lua_State *L) {
   g->gcdept += g->totalbytes - g->GCthreshold;
   if (g->estimate > g->totalbytes)
     g->estimate = g->totalbytes;
+  luaS_rehashstep(L, LUAI_STRREHASH);  /* spread string table growth */
+  TRACE(TRACE_GC_STEP_B, g->gcstate, g->totalbytes);
+  lu_int32 start = luai_gcclock();
   do {
     lim -= singlestep(L);
     if (g->gcstate == GCSpause)
       break;
+    if (g->gcstepus && luai_gcclock() - start >= g->gcstepus) {
+      /* out of time: owe the rest of this step */
+      if (lim > 0 && g->gcstepmul)
+        g->gcdept += (lim / g->gcstepmul) * 100;
+      break;
+    }
   } while (lim > 0);
+  steptime(g, luai_gcclock() - start);
+  TRACE(TRACE_GC_STEP_E, g->gcstate, g->totalbytes);
   if (g->gcstate != GCSpause) {
     if (g->gcdept < GCSTEPSIZE)
       g->GCthreshold = g->totalbytes + GCSTEPSIZE;  /* - lim/g->gcstepmul;*/
@@ -652,6 +700,29 @@ void luaC_step (lua_State *L) {
   unset_block_gc(L);
 }
 
+/*
+** Collection while the task pump is idle: does `work' bytes worth of
+** steps (at least one) of a cycle in progress, and starts the next cycle
+** early once half the pause to it has gone by, so that less is left for
+** the steps taken by allocations. Returns whether the cycle goes on.
+*/
+int luaC_idlestep (lua_State *L, lu_mem work) {
+  global_State *g = G(L);
+  if (is_block_gc(L))
+    return 0;
+  if (g->gcstate == GCSpause &&
+      (g->GCthreshold <= g->estimate ||
+       g->totalbytes < g->estimate + (g->GCthreshold - g->estimate) / 2))
+    return 0;
+  g->GCthreshold = (work <= g->totalbytes) ? g->totalbytes - work : 0;
+  while (g->GCthreshold <= g->totalbytes) {
+    luaC_step(L);
+    if (g->gcstate == GCSpause)
+      break;
+  }
+  return g->gcstate != GCSpause;
+}
+
 int luaC_sweepstrgc (lua_State *L) {
   global_State *g = G(L);
   if (g->gcstate == GCSsweepstring) {
@@ -665,8 +736,10 @@ void luaC_fullgc (lua_State *L) {
   global_State *g = G(L);
   if(is_block_gc(L)) return;
   set_block_gc(L);
+  TRACE(TRACE_GC_FULL_B, g->gcstate, g->totalbytes);
   if (g->gcstate <= GCSpropagate) {
     /* reset sweep marks to sweep all elements (returning them to white) */
+    luaS_rehashfinish(L);
     g->sweepstrgc = 0;
     g->sweepgc = &g->rootgc;
     /* reset other collector lists */
@@ -685,7 +758,9 @@ void luaC_fullgc (lua_State *L) {
   while (g->gcstate != GCSpause) {
     singlestep(L);
   }
+  luaE_dropthreads(L);  /* give back what the coroutine cache holds */
   setthreshold(g);
+  TRACE(TRACE_GC_FULL_E, g->gcstate, g->totalbytes);
   unset_block_gc(L);
 }
 
@@ -722,6 +797,80 @@ void luaC_marknew (lua_State *L, GCObject *o) {
 }
 
 
+#if LUAI_MEMTRACE
+/* heap bytes held by one object, as freeobj would give back */
+static lu_mem objsize (GCObject *o) {
+  switch (o->gch.tt) {
+    case LUA_TSTRING: return sizestring(gco2ts(o));
+    case LUA_TUSERDATA: return sizeudata(gco2u(o));
+    case LUA_TUPVAL: return sizeof(UpVal);
+    case LUA_TFUNCTION: {
+      Closure *cl = gco2cl(o);
+      return (cl->c.isC) ? sizeCclosure(cl->c.nupvalues) :
+                           sizeLclosure(cl->l.nupvalues);
+    }
+    case LUA_TTABLE: {
+      Table *h = gco2h(o);
+      return sizeof(Table) + sizeof(TValue) * h->sizearray +
+             (luaH_isdummy(h->node) ? 0 : sizeof(Node) * sizenode(h));
+    }
+    case LUA_TTHREAD: {
+      lua_State *th = gco2th(o);
+      return sizeof(lua_State) + sizeof(TValue) * th->stacksize +
+                                 sizeof(CallInfo) * th->size_ci;
+    }
+    case LUA_TPROTO: {
+      Proto *f = gco2p(o);
+      lu_mem n = sizeof(Proto) + sizeof(Proto *) * f->sizep +
+                 sizeof(TValue) * f->sizek +
+                 sizeof(LocVar) * f->sizelocvars +
+                 sizeof(TString *) * f->sizeupvalues;
+      if (!proto_is_readonly(f)) {
+        n += sizeof(Instruction) * f->sizecode;
+#ifndef LUA_OPTIMIZE_DEBUG
+        n += sizeof(int) * f->sizelineinfo;
+#endif
+      }
+      return n;
+    }
+    default: return 0;
+  }
+}
+
+
+static void censuslist (GCObject *o, GCObject *end, lu_mem *count,
+                        lu_mem *bytes) {
+  for (; o != end; o = o->gch.next) {
+    count[o->gch.tt]++;
+    bytes[o->gch.tt] += objsize(o);
+  }
+}
+
+
+/*
+** count the live objects and their heap bytes by type, into arrays of
+** LUA_TUPVAL+1 entries
+*/
+void luaC_census (lua_State *L, lu_mem *count, lu_mem *bytes) {
+  global_State *g = G(L);
+  int i;
+  memset(count, 0, (LUA_TUPVAL+1) * sizeof(lu_mem));
+  memset(bytes, 0, (LUA_TUPVAL+1) * sizeof(lu_mem));
+  censuslist(g->rootgc, NULL, count, bytes);
+  if (g->tmudata) {  /* circular list of udata waiting for __gc */
+    GCObject *first = g->tmudata->gch.next;
+    count[first->gch.tt]++;
+    bytes[first->gch.tt] += objsize(first);
+    censuslist(first->gch.next, first, count, bytes);
+  }
+  for (i = 0; i < g->strt.size; i++)
+    censuslist(g->strt.hash[i], NULL, count, bytes);
+  for (i = 0; i < g->strt.oldsize; i++)  /* while the table grows */
+    censuslist(g->strt.old[i], NULL, count, bytes);
+}
+#endif
+
+
 void luaC_link (lua_State *L, GCObject *o, lu_byte tt) {
   global_State *g = G(L);
   o->gch.next = g->rootgc;
@@ -61,6 +61,18 @@ static void save (LexState *ls, int c) {
 }
 
 
+/*
+** in low-memory compilation, give back what a long string or comment
+** made the buffer grow to, once the token is interned
+*/
+static void shrinkbuffer (LexState *ls) {
+  if (ls->sink && luaZ_sizebuffer(ls->buff) > LUA_MINBUFFER) {
+    luaZ_resetbuffer(ls->buff);
+    luaZ_resizebuffer(ls->L, ls->buff, LUA_MINBUFFER);
+  }
+}
+
+
 void luaX_init (lua_State *L) {
 }
 
@@ -265,6 +277,7 @@ static void read_long_string (LexState *ls, SemInfo *seminfo, int sep) {
   if (seminfo)
     seminfo->ts = luaX_newstring(ls, luaZ_buffer(ls->buff) + (2 + sep),
                                      luaZ_bufflen(ls->buff) - 2*(2 + sep));
+  shrinkbuffer(ls);
 }
 
 
@@ -321,6 +334,7 @@ static void read_string (LexState *ls, int del, SemInfo *seminfo) {
   save_and_next(ls);  /* skip delimiter */
   seminfo->ts = luaX_newstring(ls, luaZ_buffer(ls->buff) + 1,
                                    luaZ_bufflen(ls->buff) - 2);
+  shrinkbuffer(ls);
 }
 
 
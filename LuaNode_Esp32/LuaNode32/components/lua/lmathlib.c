@@ -29,7 +29,7 @@ static int math_abs (lua_State *L) {
   if (x < 0) x = -x;	//fails for -2^31
   lua_pushnumber(L, x);
 #else
-  lua_pushnumber(L, fabs(luaL_checknumber(L, 1)));
+  lua_pushnumber(L, l_mathop(fabs)(luaL_checknumber(L, 1)));
 #endif
   return 1;
 }
@@ -88,12 +88,12 @@ static int math_atan2 (lua_State *L) {
 #endif
 
 static int math_ceil (lua_State *L) {
-  lua_pushnumber(L, ceil(luaL_checknumber(L, 1)));
+  lua_pushnumber(L, l_mathop(ceil)(luaL_checknumber(L, 1)));
   return 1;
 }
 
 static int math_floor (lua_State *L) {
-  lua_pushnumber(L, floor(luaL_checknumber(L, 1)));
+  lua_pushnumber(L, l_mathop(floor)(luaL_checknumber(L, 1)));
   return 1;
 }
 #if 0
@@ -155,13 +155,15 @@ static int math_sqrt (lua_State *L) {
   luaL_argcheck(L, 0<=x, 1, "negative");
   lua_pushnumber(L, isqrt(x));
 #else
-  lua_pushnumber(L, sqrt(luaL_checknumber(L, 1)));
+  lua_pushnumber(L, l_mathop(sqrt)(luaL_checknumber(L, 1)));
 #endif
   return 1;
 }
 
 #ifdef LUA_NUMBER_INTEGRAL
 # define pow(a,b) luai_ipow(a,b)
+#else
+# define pow(a,b) l_mathop(pow)(a,b)
 #endif
 
 static int math_pow (lua_State *L) {
@@ -169,9 +171,7 @@ static int math_pow (lua_State *L) {
   return 1;
 }
 
-#ifdef LUA_NUMBER_INTEGRAL
-# undef pow
-#endif
+#undef pow
 
 
 #ifndef LUA_NUMBER_INTEGRAL
@@ -275,9 +275,14 @@ static int math_random (lua_State *L) {
 #else
 
 static int math_random (lua_State *L) {
+#if defined LUA_NUMBER_FLOAT
+  /* keep the 24 bits a float holds: more of them could round r up to 1 */
+  lua_Number r = (lua_Number)(rand()&0xffffff) / (lua_Number)0x1000000;
+#else
   /* the `%' avoids the (rare) case of r==1, and is needed also because on
      some systems (SunOS!) `rand()' may return a value larger than RAND_MAX */
   lua_Number r = (lua_Number)(rand()%RAND_MAX) / (lua_Number)RAND_MAX;
+#endif
   switch (lua_gettop(L)) {  /* check number of arguments */
     case 0: {  /* no arguments */
       lua_pushnumber(L, r);  /* Number between 0 and 1 */
@@ -286,14 +291,14 @@ static int math_random (lua_State *L) {
     case 1: {  /* only upper limit */
       int u = luaL_checkint(L, 1);
       luaL_argcheck(L, 1<=u, 1, "interval is empty");
-      lua_pushnumber(L, floor(r*u)+1);  /* int between 1 and `u' */
+      lua_pushnumber(L, l_mathop(floor)(r*u)+1);  /* int between 1 and `u' */
       break;
     }
     case 2: {  /* lower and upper limits */
       int l = luaL_checkint(L, 1);
       int u = luaL_checkint(L, 2);
       luaL_argcheck(L, l<=u, 2, "interval is empty");
-      lua_pushnumber(L, floor(r*(u-l+1))+l);  /* int between `l' and `u' */
+      lua_pushnumber(L, l_mathop(floor)(r*(u-l+1))+l);  /* int between `l' and `u' */
       break;
     }
     default: return luaL_error(L, "wrong number of arguments");
@@ -10,6 +10,7 @@
 #define LUAC_CROSS_FILE
 
 #include "lua.h"
+#include C_HEADER_STRING
 
 #include "ldebug.h"
 #include "ldo.h"
@@ -69,17 +70,110 @@ void *luaM_toobig (lua_State *L) {
 
 
 
+#if LUAI_MEMTRACE
+/*
+** count a change of the heap against the innermost running Lua function
+** (C functions are charged to their Lua caller)
+*/
+static void luaM_trace (lua_State *L, size_t osize, size_t nsize) {
+  MemTrace *t = G(L)->memtrace;
+  const Proto *p = NULL;
+  int line = 0;
+  unsigned int h, n;
+  CallInfo *ci;
+  if (L->ci != NULL) {
+    for (ci = L->ci; ci > L->base_ci; ci--) {
+      if (isLua(ci)) {
+        p = ci_func(ci)->l.p;
+        line = luaG_currentline(L, ci);
+        break;
+      }
+    }
+  }
+  h = (cast(unsigned int, cast(size_t, p) >> 3) ^ cast(unsigned int, line) * 31);
+  for (n = 0; n < 8; n++, h++) {
+    MemSite *s = &t->site[h & (LUAI_MEMTRACE - 1)];
+    if (s->allocs == 0 && s->freed == 0) {  /* new site */
+      s->p = p;
+      s->line = line;
+      if (p == NULL || p->source == NULL)
+        strcpy(s->src, "?");
+      else
+        luaO_chunkid(s->src, getstr(p->source), LUAI_MEMTRACESRC);
+    }
+    else if (s->p != p || s->line != line)
+      continue;
+    if (nsize > osize) {
+      s->allocs++;
+      s->bytes += nsize - osize;
+    }
+    else
+      s->freed += osize - nsize;
+    return;
+  }
+  if (nsize > osize) t->lost += nsize - osize;
+}
+
+
+void luaM_tracestart (lua_State *L) {
+  global_State *g = G(L);
+  if (g->memtrace == NULL) {
+    MemTrace *t = luaM_new(L, MemTrace);
+    memset(t, 0, sizeof(MemTrace));
+    g->memtrace = t;
+  }
+}
+
+
+void luaM_tracestop (lua_State *L) {
+  global_State *g = G(L);
+  MemTrace *t = g->memtrace;
+  g->memtrace = NULL;  /* before this free would be counted */
+  if (t != NULL)
+    luaM_free(L, t);
+}
+#endif
+
+
 /*
 ** generic allocation routine.
 */
 void *luaM_realloc_ (lua_State *L, void *block, size_t osize, size_t nsize) {
+  void *newblock = luaM_tryrealloc_(L, block, osize, nsize);
+  if (newblock == NULL && nsize > 0)
+    luaD_throw(L, LUA_ERRMEM);
+  return newblock;
+}
+
+
+/*
+** like luaM_realloc_, but returns NULL, with 'block' untouched, when
+** the memory cannot be had; for callers that can make do with less
+*/
+void *luaM_tryrealloc_ (lua_State *L, void *block, size_t osize, size_t nsize) {
   global_State *g = G(L);
   lua_assert((osize == 0) == (block == NULL));
   block = (*g->frealloc)(g->ud, block, osize, nsize);
   if (block == NULL && nsize > 0)
-    luaD_throw(L, LUA_ERRMEM);
+    return NULL;
   lua_assert((nsize == 0) == (block == NULL));
   g->totalbytes = (g->totalbytes - osize) + nsize;
+#if LUAI_MEMTRACE
+  if (g->memtrace != NULL && osize != nsize)
+    luaM_trace(L, osize, nsize);
+#endif
+  return block;
+}
+
+
+/*
+** like luaM_realloc_, with a hint for the allocator (l_alloc) to place
+** the block where big, rarely touched data goes
+*/
+void *luaM_realloccold_ (lua_State *L, void *block, size_t osize, size_t nsize) {
+  G(L)->coldalloc = 1;
+  block = luaM_realloc_(L, block, osize, nsize);
+  G(L)->coldalloc = 0;
   return block;
 }
 
@@ -20,6 +20,7 @@
 
 #ifndef LUA_CROSS_COMPILER
 #include "vfs.h"
+#include "lc_store.h"
 #include "c_stdlib.h" // for c_getenv
 #endif
 
@@ -339,6 +340,7 @@ static int readable (const char *filename) {
   c_fclose(f);
   return 1;
 }
+#define isfile(L, filename)  readable(filename)
 #else
 static int readable (const char *filename) {
   int f = vfs_open(filename, "r");  /* try to open file */
@@ -346,6 +348,66 @@ static int readable (const char *filename) {
   vfs_close(f);
   return 1;
 }
+
+/*
+** The names of the files at the root of the current drive, listed once
+** and kept until vfs_generation says a file may have been created, removed
+** or renamed. The templates of package.path mostly name a file there; one
+** listing is one pass over SPIFFS, where each vfs_open() of a file that
+** isn't there is another. Only SPIFFS is indexed, as its names match
+** exactly; index[1] is the generation and index[2] says whether it is.
+*/
+#define FSINDEX   "_FSINDEX"
+
+static void fsindex_build (lua_State *L) {
+  uint32_t gen = vfs_generation;
+  vfs_dir *dir = vfs_opendir("");
+  lua_newtable(L);
+  if (dir != NULL) {
+    if (dir->fs_type == VFS_FS_SPIFFS) {
+      vfs_item *item;
+      while ((item = vfs_readdir(dir)) != NULL) {
+        lua_pushboolean(L, 1);
+        lua_setfield(L, -2, vfs_item_name(item));
+        vfs_closeitem(item);
+      }
+      lua_pushboolean(L, 1);
+      lua_rawseti(L, -2, 2);
+    }
+    vfs_closedir(dir);
+  }
+  lua_pushinteger(L, gen);
+  lua_rawseti(L, -2, 1);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, LUA_REGISTRYINDEX, FSINDEX);
+}
+
+static int isfile (lua_State *L, const char *filename) {
+  int found = -1;
+  if (strchr(filename, '/') == NULL) {  /* at the root of the current drive? */
+    lua_getfield(L, LUA_REGISTRYINDEX, FSINDEX);
+    if (lua_istable(L, -1)) {
+      lua_rawgeti(L, -1, 1);
+      if ((uint32_t)lua_tointeger(L, -1) != vfs_generation) {
+        lua_pop(L, 2);
+        fsindex_build(L);
+      }
+      else lua_pop(L, 1);
+    }
+    else {
+      lua_pop(L, 1);
+      fsindex_build(L);
+    }
+    lua_rawgeti(L, -1, 2);
+    if (lua_toboolean(L, -1)) {
+      lua_getfield(L, -2, filename);
+      found = lua_toboolean(L, -1);
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 2);
+  }
+  return found >= 0 ? found : readable(filename);
+}
 #endif
 
 static const char * pushnexttemplate (lua_State *L, const char *path) {
@@ -372,7 +434,7 @@ static const char * findfile (lua_State *L, const char *name,
     const char *filename;
     filename = luaL_gsub(L, lua_tostring(L, -1), LUA_PATH_MARK, name);
     lua_remove(L, -2);  /* remove path template */
-    if (readable(filename))  /* does file exist and is readable? */
+    if (isfile(L, filename))  /* does file exist and is readable? */
       return filename;  /* return that file name */
     lua_pushfstring(L, "\n\tno file " LUA_QS, filename);
     lua_remove(L, -2);  /* remove file name */
@@ -396,13 +458,31 @@ static int loader_Lua (lua_State *L) {
 #ifdef LUA_CROSS_COMPILER
   if (luaL_loadfile(L, filename) != 0)
 #else
-  if (luaL_loadfsfile(L, filename) != 0)
+  if (luaL_loadfscached(L, filename) != 0)
 #endif
     loaderror(L, filename);
   return 1;  /* library loaded successfully */
 }
 
 
+#ifndef LUA_CROSS_COMPILER
+/* modules in the Lua Flash Store run in place, see lc_store.h */
+static int loader_lfs (lua_State *L) {
+  const char *name = luaL_checkstring(L, 1);
+  uint32_t size;
+  const char *image = (const char *)lc_store_get(LC_STORE_LFS, name, &size);
+  if (image == NULL) {
+    lua_pushfstring(L, "\n\tno module " LUA_QS " in the flash store", name);
+    return 1;
+  }
+  const char *chunkname = lua_pushfstring(L, "@lfs:%s", name);
+  if (luaL_loadmapped(L, image, size, chunkname) != 0)
+    loaderror(L, chunkname);
+  return 1;  /* library loaded successfully */
+}
+#endif
+
+
 static const char *mkfuncname (lua_State *L, const char *modname) {
   const char *funcname;
   const char *mark = strchr(modname, *LUA_IGMARK);
@@ -475,7 +555,7 @@ static int ll_require (lua_State *L) {
     return 1;  /* package is already loaded */
   }
   /* Is this a readonly table? */
-  void *res = luaR_findglobal(name, strlen(name));
+  void *res = luaR_getglobal(L, name, strlen(name));
   if (res) {
     lua_pushrotable(L, res);
     return 1;
@@ -644,7 +724,11 @@ static const luaL_Reg ll_funcs[] = {
 
 
 static const lua_CFunction loaders[] =
+#ifdef LUA_CROSS_COMPILER
   {loader_preload, loader_Lua, loader_C, loader_Croot, NULL};
+#else
+  {loader_preload, loader_lfs, loader_Lua, loader_C, loader_Croot, NULL};
+#endif
 
 #if LUA_OPTIMIZE_MEMORY > 0
 #undef MIN_OPT_LEVEL
@@ -13,6 +13,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
 
 #include "ldo.h"
 #include "lmem.h"
@@ -76,6 +77,8 @@ int luaO_rawequalObj (const TValue *t1, const TValue *t2) {
     case LUA_TNIL:
       return 1;
     case LUA_TNUMBER:
+      if (ttisint(t1) && ttisint(t2))
+        return ivalue(t1) == ivalue(t2);
       return luai_numeq(nvalue(t1), nvalue(t2));
     case LUA_TBOOLEAN:
       return bvalue(t1) == bvalue(t2);  /* boolean true must be 1 !! */
@@ -92,6 +95,20 @@ int luaO_rawequalObj (const TValue *t1, const TValue *t2) {
 }
 
 
+/* Set a number, as an int if it holds one (minus zero is no int) */
+void luaO_setnumber (TValue *o, lua_Number n) {
+#ifdef LUA_NUMBER_DUAL
+  int i;
+  lua_number2int(i, n);
+  if (luai_numeq(cast_num(i), n) && (i != 0 || luai_numlt(0, 1/n))) {
+    setivalue(o, i);
+    return;
+  }
+#endif
+  setnvalue(o, n);
+}
+
+
 int luaO_str2d (const char *s, lua_Number *result) {
   char *endptr;
   *result = lua_str2number(s, &endptr);
@@ -120,6 +137,137 @@ int luaO_str2d (const char *s, lua_Number *result) {
 
 
 
+/*
+** Number to string conversion without going through sprintf. The
+** results are exactly what LUA_NUMBER_FMT and "%d" / "%.Nf" give; cases
+** that cannot be decided cheaply fall back to sprintf.
+*/
+
+static char *udec (char *end, unsigned long long u) {
+  while (u > 0xffffffffULL) {  /* 64-bit divisions only while needed */
+    *--end = cast(char, '0' + u % 10);
+    u /= 10;
+  }
+  {
+    lu_int32 w = cast(lu_int32, u);
+    do {
+      *--end = cast(char, '0' + w % 10);
+      w /= 10;
+    } while (w != 0);
+  }
+  return end;
+}
+
+
+static int putdec (char *s, int neg, unsigned long long u) {
+  char buff[24];
+  char *end = buff + sizeof(buff);
+  char *p = udec(end, u);
+  int len;
+  if (neg) *--p = '-';
+  len = cast_int(end - p);
+  memcpy(s, p, len);
+  s[len] = '\0';
+  return len;
+}
+
+
+int luaO_int2str (char *s, LUA_INTFRM_T v) {
+  unsigned long long u = cast(unsigned long long, v);
+  return putdec(s, v < 0, v < 0 ? 0 - u : u);
+}
+
+
+#if !defined(LUA_NUMBER_INTEGRAL)
+
+static const unsigned long long pow10u[] = {
+  1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+  10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+  100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+  100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+  100000000000000000ULL, 1000000000000000000ULL
+};
+
+
+/* write m / 10^k with k decimals; returns the length */
+static int putfixed (char *s, int neg, unsigned long long m, int k) {
+  char buff[48];
+  char *end = buff + sizeof(buff);
+  char *p = end;
+  int len;
+  if (k > 0) {
+    unsigned long long f = m % pow10u[k];
+    int i;
+    m /= pow10u[k];
+    for (i = 0; i < k; i++) {
+      *--p = cast(char, '0' + f % 10);
+      f /= 10;
+    }
+    *--p = '.';
+  }
+  p = udec(p, m);
+  if (neg) *--p = '-';
+  len = cast_int(end - p);
+  memcpy(s, p, len);
+  s[len] = '\0';
+  return len;
+}
+
+
+#if defined(LUA_NUMBER_FLOAT)
+#define NUMDIGITS	7	/* significant digits of LUA_NUMBER_FMT */
+#else
+#define NUMDIGITS	14
+#define MAXSCALE	18
+#endif
+
+int luaO_num2str (char *s, lua_Number n) {
+  double a = n < 0 ? -n : n;
+  int neg = n < 0;
+  if (a == floor(a) && a < cast(double, pow10u[NUMDIGITS])) {
+    /* integral: what %g prints for it is its plain decimal form */
+    if (a == 0 && 1/n < 0) neg = 1;  /* minus zero */
+    return putdec(s, neg, cast(unsigned long long, a));
+  }
+#if !defined(LUA_NUMBER_FLOAT)
+  if (a >= 1e-4 && a < 1e14) {
+    /* The shortest decimal m/10^k (at most NUMDIGITS digits) that reads
+       back as n is also what %g rounds n to: n is within half an ulp of
+       it, far from the midpoints between decimals of that precision.
+       (A float's half ulp is not, so floats always use sprintf.) */
+    int k;
+    for (k = 1; k <= MAXSCALE; k++) {
+      double p = cast(double, pow10u[k]);
+      double x = floor(a * p + 0.5);
+      if (x >= 1e14) break;  /* needs more digits */
+      if (x / p == a)
+        return putfixed(s, neg, cast(unsigned long long, x), k);
+    }
+  }
+#endif
+  return lua_number2str(s, n);
+}
+
+
+/* "%.<prec>f" of n, or -1 when sprintf has to decide the rounding */
+int luaO_fixed2str (char *s, double n, int prec) {
+  double a = n < 0 ? -n : n;
+  double x, f;
+  if (prec > 9 || !(a < 1e15))  /* also rules out NaN and inf */
+    return -1;
+  x = a * cast(double, pow10u[prec]);
+  if (x >= 1e15) return -1;
+  f = floor(x);
+  /* x is within half an ulp of the exact a*10^prec; unless a rounding
+     midpoint lies in between, both round to the same integer */
+  if (fabs((x - f) - 0.5) <= x * 4e-16 + 1e-300) return -1;
+  if (x - f > 0.5) f += 1;
+  return putfixed(s, n < 0 || (n == 0 && 1/n < 0),
+                  cast(unsigned long long, f), prec);
+}
+
+#endif
+
 static void pushstr (lua_State *L, const char *str) {
   setsvalue2s(L, L->top, luaS_new(L, str));
   incr_top(L);
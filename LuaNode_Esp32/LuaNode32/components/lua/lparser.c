@@ -24,6 +24,7 @@
 #include "lstate.h"
 #include "lstring.h"
 #include "ltable.h"
+#include "lundump.h"
 
 
 
@@ -365,15 +366,17 @@ static void close_func (LexState *ls) {
   Proto *f = fs->f;
   removevars(ls, 0);
   luaK_ret(fs, 0, 0);  /* final return */
-  luaM_reallocvector(L, f->code, f->sizecode, fs->pc, Instruction);
+  luaM_coldvector(L, f->code, f->sizecode, fs->pc, Instruction);
   f->sizecode = fs->pc;
 #ifdef LUA_OPTIMIZE_DEBUG
   f->packedlineinfo[fs->lastlineOffset+1]=0;
-  luaM_reallocvector(L, f->packedlineinfo, fs->packedlineinfoSize,
-                     fs->lastlineOffset+2, unsigned char);
+  luaM_coldvector(L, f->packedlineinfo, fs->packedlineinfoSize,
+                  fs->lastlineOffset+2, unsigned char);
 #else
-  luaM_reallocvector(L, f->lineinfo, f->sizelineinfo, fs->pc, int);
-  f->sizelineinfo = fs->pc;
+  if (!ls->sink) {
+    luaM_coldvector(L, f->lineinfo, f->sizelineinfo, fs->pc, int);
+    f->sizelineinfo = fs->pc;
+  }
 #endif
 
   luaM_reallocvector(L, f->k, f->sizek, fs->nk, TValue);
@@ -386,6 +389,7 @@ static void close_func (LexState *ls) {
   f->sizeupvalues = f->nups;
   lua_assert(luaG_checkcode(f));
   lua_assert(fs->bl == NULL);
+  if (ls->sink) luaU_sinkclose(L, ls->sink, f);
   ls->fs = fs->prev;
   /* last token read was anchored in defunct function; must reanchor it */
   if (fs) anchor_token(ls);
@@ -415,6 +419,8 @@ Proto *luaY_parser (lua_State *L, ZIO *z, Mbuffer *buff, const char *name) {
   setsvalue2s(L, L->top, tname);  /* protect name */
   incr_top(L);
   lexstate.buff = buff;
+  lexstate.sink = G(L)->compilesink;  /* claimed by this chunk only */
+  G(L)->compilesink = NULL;
   luaX_setinput(L, &lexstate, z, tname);
   open_func(&lexstate, &funcstate);
   funcstate.f->is_vararg = VARARG_ISVARARG;  /* main func. is always vararg */
@@ -423,7 +429,7 @@ Proto *luaY_parser (lua_State *L, ZIO *z, Mbuffer *buff, const char *name) {
   check(&lexstate, TK_EOS);
   close_func(&lexstate);
 #ifdef LUA_OPTIMIZE_DEBUG
-  compile_stripdebug(L, funcstate.f);
+  if (!lexstate.sink) compile_stripdebug(L, funcstate.f);
 #endif
   L->top--; /* remove 'name' from stack */
   lua_assert(funcstate.prev == NULL);
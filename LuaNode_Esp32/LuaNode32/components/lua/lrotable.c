@@ -8,6 +8,8 @@
 #include "lstring.h"
 #include "lobject.h"
 #include "lapi.h"
+#include "lstate.h"
+#include "lualib.h"
 
 /* Local defines */
 #define LUAR_FINDFUNCTION     0
@@ -16,19 +18,84 @@
 /* Externally defined read-only table array */
 extern const luaR_table lua_rotable[];
 
+/* Lookup caches in front of the linear scans below. Lines are indexed by
+   table address and key hash and hold a pointer to a previously found
+   entry; a hit is confirmed by one compare against that entry, so a line
+   overwritten by another key only costs a miss, never a wrong value. */
+#define LUAR_CACHE_LINES      64    /* power of 2 */
+#define LUAR_GLOBAL_LINES     16    /* power of 2 */
+
+typedef struct {
+  const luaR_entry *table;
+  const luaR_entry *entry;
+} luaR_cacheline;
+
+static luaR_cacheline luaR_cache[LUAR_CACHE_LINES];
+static const luaR_table *luaR_globalcache[LUAR_GLOBAL_LINES];
+
+/* States running besides the main one, in other tasks. A cache line takes
+   more than one store, so luaR_cache and the VM's cache of rotable lookups
+   are left alone while there are any; luaR_globalcache lines are a single
+   pointer and stay in use. */
+volatile int luaR_workers;
+
+#define luaR_cacheidx(t, h, n)  ((((size_t)(t) >> 3) ^ (h)) & ((n) - 1))
+
 /* Find a global "read only table" in the constant lua_rotable array */
-void* luaR_findglobal(const char *name, unsigned len) {
+static const luaR_table* luaR_auxfindglobal(const char *name, unsigned len) {
   unsigned i;
+  const luaR_table **line;
 
   if (strlen(name) > LUA_MAX_ROTABLE_NAME)
     return NULL;
+  line = &luaR_globalcache[luaR_cacheidx(0, luaS_hash(name, len), LUAR_GLOBAL_LINES)];
+  if (*line && !strncmp((*line)->name, name, len) && (*line)->name[len] == '\0')
+    return *line;
   for (i=0; lua_rotable[i].name; i ++)
     if (*lua_rotable[i].name != '\0' && strlen(lua_rotable[i].name) == len && !strncmp(lua_rotable[i].name, name, len)) {
-      return (void*)(lua_rotable[i].pentries);
+      *line = &lua_rotable[i];
+      return *line;
     }
   return NULL;
 }
 
+void* luaR_findglobal(const char *name, unsigned len) {
+  const luaR_table *t = luaR_auxfindglobal(name, len);
+  return t ? (void*)t->pentries : NULL;
+}
+
+/* As luaR_findglobal, for a lookup from Lua: a module's luaopen_ function
+   runs the first time the state looks it up, not at boot. The bit is set
+   first, so the module can use itself while it opens; an error clears it
+   again and is raised, and the next lookup tries again. Once a state is
+   sealed, a module it has not opened is not found. */
+void* luaR_getglobal(lua_State *L, const char *name, unsigned len) {
+  const luaR_table *t = luaR_auxfindglobal(name, len);
+  global_State *g = G(L);
+  unsigned i;
+
+  if (!t)
+    return NULL;
+  i = t - lua_rotable;
+  if (!(g->ropened[i >> 5] & (1u << (i & 31)))) {
+    if (g->rsealed)
+      return NULL;
+    g->ropened[i >> 5] |= 1u << (i & 31);
+    if (luaL_openlazy(L, t->name)) {
+      g->ropened[i >> 5] &= ~(1u << (i & 31));
+      lua_error(L);
+    }
+  }
+  return (void*)t->pentries;
+}
+
+/* Rotable keys are C strings in flash, not interned Lua strings. Lua
+   strings made from them (luaR_next, and luaS_newlstr for anything in the
+   read only area) are read only ones whose body is the key itself, and
+   since strings are interned, every equal Lua string is that one while it
+   lives; so a pointer compare settles most lookups before any strcmp. */
+#define luaR_keyeq(k, s)  ((k) == (s) || (*(k) == *(s) && !strcmp((k), (s))))
+
 /* Find an entry in a rotable and return it */
 static const TValue* luaR_auxfind(const luaR_entry *pentry, const char *strkey, luaR_numkey numkey, unsigned *ppos) {
   const TValue *res = NULL;
@@ -37,7 +104,7 @@ static const TValue* luaR_auxfind(const luaR_entry *pentry, const char *strkey,
   if (pentry == NULL)
     return NULL;  
   while(pentry->key.type != LUA_TNIL) {
-    if ((strkey && (pentry->key.type == LUA_TSTRING) && (!strcmp(pentry->key.id.strkey, strkey))) || 
+    if ((strkey && (pentry->key.type == LUA_TSTRING) && luaR_keyeq(pentry->key.id.strkey, strkey)) || 
         (!strkey && (pentry->key.type == LUA_TNUMBER) && ((luaR_numkey)pentry->key.id.numkey == numkey))) {
       res = &pentry->value;
       break;
@@ -49,11 +116,39 @@ static const TValue* luaR_auxfind(const luaR_entry *pentry, const char *strkey,
   return res;
 }
 
+/* String key lookup through the cache; h is the key's string hash */
+static const TValue* luaR_auxfindstr(const luaR_entry *pentry, const char *strkey, unsigned h, unsigned *ppos) {
+  luaR_cacheline *line;
+  const TValue *res;
+  unsigned pos;
+
+  if (pentry == NULL)
+    return NULL;
+  if (luaR_workers)
+    return luaR_auxfind(pentry, strkey, 0, ppos);
+  line = &luaR_cache[luaR_cacheidx(pentry, h, LUAR_CACHE_LINES)];
+  if (line->table == pentry && luaR_keyeq(line->entry->key.id.strkey, strkey)) {
+    if (ppos)
+      *ppos = line->entry - pentry;
+    return &line->entry->value;
+  }
+  res = luaR_auxfind(pentry, strkey, 0, &pos);
+  if (res) {
+    line->table = NULL;
+    line->entry = pentry + pos;
+    line->table = pentry;
+    if (ppos)
+      *ppos = pos;
+  }
+  return res;
+}
+
 int luaR_findfunction(lua_State *L, const luaR_entry *ptable) {
   const TValue *res = NULL;
-  const char *key = luaL_checkstring(L, 2);
+  size_t len;
+  const char *key = luaL_checklstring(L, 2, &len);
     
-  res = luaR_auxfind(ptable, key, 0, NULL);  
+  res = luaR_auxfindstr(ptable, key, luaS_hash(key, len), NULL);  
   if (res && ttislightfunction(res)) {
     luaA_pushobject(L, res);
     return 1;
@@ -66,9 +161,18 @@ int luaR_findfunction(lua_State *L, const luaR_entry *ptable) {
    If "strkey" is not NULL, the function will look for a string key,
    otherwise it will look for a number key */
 const TValue* luaR_findentry(void *data, const char *strkey, luaR_numkey numkey, unsigned *ppos) {
+  if (strkey)
+    return luaR_auxfindstr((const luaR_entry*)data, strkey, luaS_hash(strkey, strlen(strkey)), ppos);
   return luaR_auxfind((const luaR_entry*)data, strkey, numkey, ppos);
 }
 
+/* Same for an interned Lua string, without copying or rehashing it */
+const TValue* luaR_findstr(void *data, const TString *key) {
+  if (key->tsv.len > LUA_MAX_ROTABLE_NAME)
+    return NULL;
+  return luaR_auxfindstr((const luaR_entry*)data, getstr(key), key->tsv.hash, NULL);
+}
+
 /* Find the metatable of a given table */
 void* luaR_getmeta(void *data) {
 #ifdef LUA_META_ROTABLES
@@ -87,28 +191,33 @@ static void luaR_next_helper(lua_State *L, const luaR_entry *pentries, int pos,
     if (pentries[pos].key.type == LUA_TSTRING)
       setsvalue(L, key, luaS_newro(L, pentries[pos].key.id.strkey))
     else
-      setnvalue(key, (lua_Number)pentries[pos].key.id.numkey)
+      setivalue(key, (int)pentries[pos].key.id.numkey)
    setobj2s(L, val, &pentries[pos].value);
   }
 }
 /* next (used for iteration) */
 void luaR_next(lua_State *L, void *data, TValue *key, TValue *val) {
   const luaR_entry* pentries = (const luaR_entry*)data;
-  char strkey[LUA_MAX_ROTABLE_NAME + 1], *pstrkey = NULL;
-  luaR_numkey numkey = 0;
+  const TValue *res = NULL;
   unsigned keypos;
   
   /* Special case: if key is nil, return the first element of the rotable */
   if (ttisnil(key)) 
     luaR_next_helper(L, pentries, 0, key, val);
   else if (ttisstring(key) || ttisnumber(key)) {
-    /* Find the previoud key again */  
+    /* Find the previous key again; it is the read only string of the
+       entry, so this is a pointer compare per entry */
     if (ttisstring(key)) {
-      luaR_getcstr(strkey, rawtsvalue(key), LUA_MAX_ROTABLE_NAME);          
-      pstrkey = strkey;
-    } else   
-      numkey = (luaR_numkey)nvalue(key);
-    luaR_findentry(data, pstrkey, numkey, &keypos);
+      const TString *ts = rawtsvalue(key);
+      if (ts->tsv.len <= LUA_MAX_ROTABLE_NAME)
+        res = luaR_auxfindstr(pentries, getstr(ts), ts->tsv.hash, &keypos);
+    } else
+      res = luaR_auxfind(pentries, NULL, (luaR_numkey)nvalue(key), &keypos);
+    if (res == NULL) {  /* not a key of this rotable */
+      setnilvalue(key);
+      setnilvalue(val);
+      return;
+    }
     /* Advance to next key */
     keypos ++;    
     luaR_next_helper(L, pentries, keypos, key, val);
@@ -0,0 +1,176 @@
+// Size-class slab allocator for the small objects of the Lua state
+//
+// TString, Table, Closure and UpVal headers are 16-64 bytes and make up
+// most allocations. Serving them from pages of equal slots avoids the
+// heap's per-block overhead and search, and keeps them from scattering
+// holes through the heap. Pages live in a sorted index so a free finds its
+// page with a binary search; a page that empties is handed back to the
+// heap unless it is the last one of its class with free slots.
+
+#define LUAC_CROSS_FILE
+
+#include "lua.h"
+#include "lslab.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if LUAI_SLABPSRAM && !defined(LUA_CROSS_COMPILER)
+#include "esp_heap_alloc_caps.h"
+#endif
+
+typedef struct lslab_page {
+  struct lslab_page *prev, *next;   // pages of the class with free slots
+  void *free;                       // free slots of this page
+  unsigned short used;
+  unsigned char cls;
+  unsigned char partial;            // on the class list
+} lslab_page_t;
+
+#define LSLAB_HDR         ((sizeof(lslab_page_t) + LSLAB_STEP - 1) & ~(LSLAB_STEP - 1))
+#define lslab_class(n)    (((n) - 1) / LSLAB_STEP)
+#define lslab_size(c)     (((c) + 1) * LSLAB_STEP)
+#define lslab_slots(c)    ((LUAI_SLABPAGE - LSLAB_HDR) / lslab_size(c))
+
+static lslab_page_t *lslab_partial[LSLAB_CLASSES];
+static unsigned lslab_pages[LSLAB_CLASSES];
+static unsigned lslab_used[LSLAB_CLASSES];
+
+static lslab_page_t **lslab_index;  // every page, by address
+static int lslab_npages, lslab_cap;
+
+// Position of the last page starting at or below p
+static int lslab_find(const void *p)
+{
+  int lo = 0, hi = lslab_npages - 1, at = -1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if ((const char *)lslab_index[mid] <= (const char *)p) {
+      at = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return at;
+}
+
+static void lslab_link(lslab_page_t *pg)
+{
+  pg->prev = NULL;
+  pg->next = lslab_partial[pg->cls];
+  if (pg->next)
+    pg->next->prev = pg;
+  lslab_partial[pg->cls] = pg;
+  pg->partial = 1;
+}
+
+static void lslab_unlink(lslab_page_t *pg)
+{
+  if (pg->prev)
+    pg->prev->next = pg->next;
+  else
+    lslab_partial[pg->cls] = pg->next;
+  if (pg->next)
+    pg->next->prev = pg->prev;
+  pg->partial = 0;
+}
+
+static lslab_page_t *lslab_newpage(int cls)
+{
+  if (lslab_npages == lslab_cap) {
+    int cap = lslab_cap ? lslab_cap * 2 : 16;
+    lslab_page_t **index = (lslab_page_t **)realloc(lslab_index, cap * sizeof(*index));
+    if (!index)
+      return NULL;
+    lslab_index = index;
+    lslab_cap = cap;
+  }
+
+  lslab_page_t *pg = NULL;
+#if LUAI_SLABPSRAM && !defined(LUA_CROSS_COMPILER)
+  pg = (lslab_page_t *)pvPortMallocCaps(LUAI_SLABPAGE, MALLOC_CAP_SPISRAM);
+#endif
+  if (!pg)
+    pg = (lslab_page_t *)malloc(LUAI_SLABPAGE);
+  if (!pg)
+    return NULL;
+
+  int at = lslab_find(pg) + 1;
+  memmove(&lslab_index[at + 1], &lslab_index[at],
+          (lslab_npages - at) * sizeof(*lslab_index));
+  lslab_index[at] = pg;
+  lslab_npages++;
+
+  // chain the slots, first slot at the head
+  size_t size = lslab_size(cls);
+  char *slot = (char *)pg + LSLAB_HDR;
+  pg->free = NULL;
+  for (int i = lslab_slots(cls) - 1; i >= 0; i--) {
+    void **s = (void **)(slot + i * size);
+    *s = pg->free;
+    pg->free = s;
+  }
+  pg->used = 0;
+  pg->cls = cls;
+  lslab_link(pg);
+  lslab_pages[cls]++;
+  return pg;
+}
+
+void *lslab_alloc(size_t size)
+{
+  if (size == 0 || size > LUAI_SLABMAX)
+    return NULL;
+  int cls = lslab_class(size);
+  lslab_page_t *pg = lslab_partial[cls];
+  if (!pg && !(pg = lslab_newpage(cls)))
+    return NULL;
+  void **s = (void **)pg->free;
+  pg->free = *s;
+  pg->used++;
+  if (!pg->free)
+    lslab_unlink(pg);
+  lslab_used[cls]++;
+  return s;
+}
+
+size_t lslab_owns(void *p)
+{
+  int at = lslab_find(p);
+  if (at < 0 || (char *)p >= (char *)lslab_index[at] + LUAI_SLABPAGE)
+    return 0;
+  return lslab_size(lslab_index[at]->cls);
+}
+
+void lslab_free(void *p)
+{
+  int at = lslab_find(p);
+  lslab_page_t *pg = lslab_index[at];
+  int cls = pg->cls;
+  *(void **)p = pg->free;
+  pg->free = p;
+  pg->used--;
+  lslab_used[cls]--;
+  if (!pg->partial)
+    lslab_link(pg);
+  else if (pg->used == 0 && (pg->prev || pg->next)) {
+    // empty and not the only page with room: give it back
+    lslab_unlink(pg);
+    lslab_npages--;
+    memmove(&lslab_index[at], &lslab_index[at + 1],
+            (lslab_npages - at) * sizeof(*lslab_index));
+    lslab_pages[cls]--;
+    free(pg);
+  }
+}
+
+int lslab_info(int cls, lslab_info_t *info)
+{
+  if (cls < 0 || cls >= LSLAB_CLASSES)
+    return 0;
+  info->size = lslab_size(cls);
+  info->pages = lslab_pages[cls];
+  info->slots = lslab_pages[cls] * lslab_slots(cls);
+  info->used = lslab_used[cls];
+  return 1;
+}
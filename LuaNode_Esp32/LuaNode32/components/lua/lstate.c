@@ -10,6 +10,7 @@
 #define LUAC_CROSS_FILE
 
 #include "lua.h"
+#include C_HEADER_STRING
 
 #include "ldebug.h"
 #include "ldo.h"
@@ -37,15 +38,27 @@ typedef struct LG {
   
 
 
-static void stack_init (lua_State *L1, lua_State *L) {
+/*
+** Arrays of at least 'nci' CallInfo's and 'nstack' stack slots. A
+** recycled thread comes with its old ones, which are grown if need be.
+*/
+static void stack_init (lua_State *L1, lua_State *L, int nstack, int nci) {
+  StkId o;
   /* initialize CallInfo array */
-  L1->base_ci = luaM_newvector(L, BASIC_CI_SIZE, CallInfo);
+  if (L1->size_ci < nci) {
+    luaM_reallocvector(L, L1->base_ci, L1->size_ci, nci, CallInfo);
+    L1->size_ci = nci;
+  }
   L1->ci = L1->base_ci;
-  L1->size_ci = BASIC_CI_SIZE;
   L1->end_ci = L1->base_ci + L1->size_ci - 1;
   /* initialize stack array */
-  L1->stack = luaM_newvector(L, BASIC_STACK_SIZE + EXTRA_STACK, TValue);
-  L1->stacksize = BASIC_STACK_SIZE + EXTRA_STACK;
+  if (L1->stacksize < nstack + EXTRA_STACK) {
+    luaM_reallocvector(L, L1->stack, L1->stacksize, nstack + EXTRA_STACK,
+                       TValue);
+    L1->stacksize = nstack + EXTRA_STACK;
+  }
+  for (o = L1->stack; o < L1->stack + L1->stacksize; o++)
+    setnilvalue(o);  /* no stale values from a previous owner */
   L1->top = L1->stack;
   L1->stack_last = L1->stack+(L1->stacksize - EXTRA_STACK)-1;
   /* initialize first ci */
@@ -68,7 +81,7 @@ static void freestack (lua_State *L, lua_State *L1) {
 static void f_luaopen (lua_State *L, void *ud) {
   global_State *g = G(L);
   UNUSED(ud);
-  stack_init(L, L);  /* init stack */
+  stack_init(L, L, BASIC_STACK_SIZE, BASIC_CI_SIZE);  /* init stack */
   sethvalue(L, gt(L), luaH_new(L, 0, 2));  /* table of globals */
   sethvalue(L, registry(L), luaH_new(L, 0, 2));  /* registry */
   luaS_resize(L, MINSTRTABSIZE);  /* initial size of string table */
@@ -91,6 +104,7 @@ static void preinit_state (lua_State *L, global_State *g) {
   resethookcount(L);
   L->openupval = NULL;
   L->size_ci = 0;
+  L->stackidle = L->ciidle = 0;
   L->nCcalls = L->baseCcalls = 0;
   L->status = 0;
   L->base_ci = L->ci = NULL;
@@ -104,6 +118,7 @@ static void close_state (lua_State *L) {
   global_State *g = G(L);
   luaF_close(L, L->stack);  /* close all upvalues for this thread */
   luaC_freeall(L);  /* collect all objects */
+  luaE_dropthreads(L);
   lua_assert(g->rootgc == obj2gco(L));
   lua_assert(g->strt.nuse == 0);
   luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size, TString *);
@@ -114,13 +129,31 @@ static void close_state (lua_State *L) {
 }
 
 
-lua_State *luaE_newthread (lua_State *L) {
-  lua_State *L1 = tostate(luaM_malloc(L, state_size(lua_State)));
+lua_State *luaE_newthread (lua_State *L, int nstack, int nci) {
+  global_State *g = G(L);
+  lua_State *L1 = g->freethreads;
+  StkId stack = NULL;
+  CallInfo *base_ci = NULL;
+  int stacksize = 0, size_ci = 0;
+  if (L1 != NULL) {  /* reuse a dead thread and its arrays */
+    g->freethreads = cast(lua_State *, L1->next);
+    g->nfreethreads--;
+    stack = L1->stack;
+    stacksize = L1->stacksize;
+    base_ci = L1->base_ci;
+    size_ci = L1->size_ci;
+  }
+  else
+    L1 = tostate(luaM_malloc(L, state_size(lua_State)));
   luaC_link(L, obj2gco(L1), LUA_TTHREAD);
   setthvalue(L, L->top, L1); /* put thread on stack */
   incr_top(L);
-  preinit_state(L1, G(L));
-  stack_init(L1, L);  /* init stack */
+  preinit_state(L1, g);
+  L1->stack = stack;
+  L1->stacksize = stacksize;
+  L1->base_ci = base_ci;
+  L1->size_ci = size_ci;
+  stack_init(L1, L, nstack, nci);  /* init stack */
   setobj2n(L, gt(L1), gt(L));  /* share table of globals */
   L1->hookmask = L->hookmask;
   L1->basehookcount = L->basehookcount;
@@ -136,11 +169,32 @@ void luaE_freethread (lua_State *L, lua_State *L1) {
   luaF_close(L1, L1->stack);  /* close all upvalues for this thread */
   lua_assert(L1->openupval == NULL);
   luai_userstatefree(L1);
+  if (G(L)->nfreethreads < LUAI_THREADCACHE &&
+      L1->stacksize <= LUAI_THREADCACHESTACK + EXTRA_STACK &&
+      L1->size_ci <= LUAI_THREADCACHECI) {
+    /* keep it, arrays and all, for the next luaE_newthread */
+    L1->next = obj2gco(G(L)->freethreads);
+    G(L)->freethreads = L1;
+    G(L)->nfreethreads++;
+    return;
+  }
   freestack(L, L1);
   luaM_freemem(L, fromstate(L1), state_size(lua_State));
 }
 
 
+void luaE_dropthreads (lua_State *L) {
+  global_State *g = G(L);
+  while (g->freethreads != NULL) {
+    lua_State *L1 = g->freethreads;
+    g->freethreads = cast(lua_State *, L1->next);
+    freestack(L, L1);
+    luaM_freemem(L, fromstate(L1), state_size(lua_State));
+  }
+  g->nfreethreads = 0;
+}
+
+
 LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   int i;
   lua_State *L;
@@ -158,6 +212,8 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->frealloc = f;
   g->ud = ud;
   g->mainthread = L;
+  g->freethreads = NULL;
+  g->nfreethreads = 0;
   g->uvhead.u.l.prev = &g->uvhead;
   g->uvhead.u.l.next = &g->uvhead;
   g->GCthreshold = 0;  /* mark it as unfinished state */
@@ -165,9 +221,16 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->strt.size = 0;
   g->strt.nuse = 0;
   g->strt.hash = NULL;
+  g->strt.old = NULL;
+  g->strt.oldsize = 0;
+  g->strt.moved = 0;
   setnilvalue(registry(L));
   luaZ_initbuffer(L, &g->buff);
   g->panic = NULL;
+  g->compilesink = NULL;
+#if LUAI_MEMTRACE
+  g->memtrace = NULL;
+#endif
   g->gcstate = GCSpause;
   g->gcflags = GCFlagsNone;
   g->rootgc = obj2gco(L);
@@ -182,6 +245,13 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->gcpause = LUAI_GCPAUSE;
   g->gcstepmul = LUAI_GCMUL;
   g->gcdept = 0;
+  g->gcstepus = LUAI_GCSTEPUS;
+  g->gcsteps = 0;
+  g->gcpausemax = 0;
+  memset(g->gcpausehist, 0, sizeof(g->gcpausehist));
+  g->coldalloc = 0;
+  g->psramcold = LUAI_PSRAMCOLD;
+  g->psrambig = LUAI_PSRAMBIG;
 #ifdef EGC_INITIAL_MODE
   g->egcmode = EGC_INITIAL_MODE;
 #else
@@ -193,6 +263,8 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->memlimit = 0;
 #endif
   for (i=0; i<NUM_TAGS; i++) g->mt[i] = NULL;
+  memset(g->ropened, 0, sizeof(g->ropened));
+  g->rsealed = 0;
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != 0) {
     /* memory allocation error: free partial state */
     close_state(L);
@@ -224,7 +296,8 @@ lua_State *lua_getstate(void) {
 LUA_API void lua_close (lua_State *L) {
 #ifndef LUA_CROSS_COMPILER  
   lua_sethook( L, NULL, 0, 0 );
-  lua_crtstate = NULL;
+  if (lua_crtstate && G(lua_crtstate) == G(L))  /* not for thread workers */
+    lua_crtstate = NULL;
   lua_pushnil( L );
 //  lua_rawseti( L, LUA_REGISTRYINDEX, LUA_INT_HANDLER_KEY );
 #endif  
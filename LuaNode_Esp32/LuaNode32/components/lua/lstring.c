@@ -21,6 +21,76 @@
 #define LUAS_READONLY_STRING      1
 #define LUAS_REGULAR_STRING       0
 
+unsigned int luaS_hash (const char *str, size_t l) {
+#if LUAI_STRHASH == 1
+  const unsigned char *p = (const unsigned char *)str;
+  unsigned int h = cast(unsigned int, l) ^ 0x9e3779b9;
+  size_t n = l >> 2;  /* whole words */
+  size_t step = n / LUAI_STRHASHWORDS + 1;  /* sample very long strings */
+  size_t i;
+  for (i = 0; i < n; i += step) {
+    const unsigned char *w = p + (i << 2);
+    lu_int32 k;
+#if defined(__XTENSA__)
+    if (((size_t)w & 3) == 0)  /* little endian, same value as below */
+      k = *(const lu_int32 *)w;
+    else
+#endif
+    k = w[0] | (w[1] << 8) | (w[2] << 16) | ((lu_int32)w[3] << 24);
+    k *= 0x5bd1e995;  /* MurmurHash2 mixing */
+    k ^= k >> 24;
+    k *= 0x5bd1e995;
+    h = (h * 0x5bd1e995) ^ k;
+  }
+  for (i = n << 2; i < l; i++)  /* trailing bytes */
+    h = (h ^ p[i]) * 0x01000193;
+  h ^= h >> 13;
+  h *= 0x5bd1e995;
+  return h ^ (h >> 15);
+#else
+  unsigned int h = cast(unsigned int, l);  /* seed */
+  size_t step = (l>>5)+1;  /* if string is too long, don't hash all its chars */
+  size_t l1;
+  for (l1=l; l1>=step; l1-=step)  /* compute hash */
+    h = h ^ ((h<<5)+(h>>2)+cast(unsigned char, str[l1-1]));
+  return h;
+#endif
+}
+
+
+/* move up to n buckets of the old array over while the table grows */
+void luaS_rehashstep (lua_State *L, int n) {
+  stringtable *tb = &G(L)->strt;
+  if (tb->old == NULL)
+    return;
+  while (n-- > 0 && tb->moved < tb->oldsize) {
+    GCObject *p = tb->old[tb->moved];
+    tb->old[tb->moved++] = NULL;
+    while (p) {  /* for each node in the list */
+      GCObject *next = p->gch.next;  /* save next */
+      int h1 = lmod(gco2ts(p)->hash, tb->size);  /* new position */
+      p->gch.next = tb->hash[h1];  /* chain it */
+      tb->hash[h1] = p;
+      p = next;
+    }
+  }
+  if (tb->moved >= tb->oldsize) {
+    luaM_freearray(L, tb->old, tb->oldsize, GCObject *);
+    tb->old = NULL;
+    tb->oldsize = 0;
+    tb->moved = 0;
+  }
+}
+
+
+/* the collector sweeps `hash' only, so it calls this before sweeping */
+void luaS_rehashfinish (lua_State *L) {
+  stringtable *tb = &G(L)->strt;
+  if (tb->old)
+    luaS_rehashstep(L, tb->oldsize - tb->moved);
+}
+
+
 void luaS_resize (lua_State *L, int newsize) {
   stringtable *tb;
   int i;
@@ -28,6 +98,19 @@ void luaS_resize (lua_State *L, int newsize) {
   if (luaC_sweepstrgc(L) || newsize == tb->size || is_resizing_strings_gc(L))
     return;  /* cannot resize during GC traverse or doesn't need to be resized */
   set_resizing_strings_gc(L);
+  luaS_rehashfinish(L);
+  if (newsize > tb->size && tb->size > 0) {
+    /* grow: chains move over a few at a time from newlstr and luaC_step */
+    GCObject **newhash = luaM_newvector(L, newsize, GCObject *);
+    for (i=0; i<newsize; i++) newhash[i] = NULL;
+    tb->old = tb->hash;
+    tb->oldsize = tb->size;
+    tb->moved = 0;
+    tb->hash = newhash;
+    tb->size = newsize;
+    unset_resizing_strings_gc(L);
+    return;
+  }
   if (newsize > tb->size) {
     luaM_reallocvector(L, tb->hash, tb->size, newsize, GCObject *);
     for (i=tb->size; i<newsize; i++) tb->hash[i] = NULL;
@@ -52,6 +135,25 @@ void luaS_resize (lua_State *L, int newsize) {
   unset_resizing_strings_gc(L);
 }
 
+
+void luaS_chainstats (lua_State *L, int *empty, int *maxchain) {
+  stringtable *tb = &G(L)->strt;
+  int i;
+  luaS_rehashfinish(L);
+  *empty = 0;
+  *maxchain = 0;
+  for (i=0; i<tb->size; i++) {
+    int n = 0;
+    GCObject *p;
+    for (p = tb->hash[i]; p != NULL; p = p->gch.next)
+      n++;
+    if (n == 0)
+      (*empty)++;
+    else if (n > *maxchain)
+      *maxchain = n;
+  }
+}
+
 static TString *newlstr (lua_State *L, const char *str, size_t l,
                                        unsigned int h, int readonly) {
   TString *ts;
@@ -61,7 +163,11 @@ static TString *newlstr (lua_State *L, const char *str, size_t l,
   tb = &G(L)->strt;
   if ((tb->nuse + 1) > cast(lu_int32, tb->size) && tb->size <= MAX_INT/2)
     luaS_resize(L, tb->size*2);  /* too crowded */
-  ts = cast(TString *, luaM_malloc(L, readonly ? sizeof(char**)+sizeof(TString) : (l+1)*sizeof(char)+sizeof(TString)));
+  luaS_rehashstep(L, LUAI_STRREHASH);
+  if (readonly)
+    ts = cast(TString *, luaM_malloc(L, sizeof(char**)+sizeof(TString)));
+  else  /* long string bodies are rarely touched once interned */
+    ts = cast(TString *, luaM_malloccold(L, (l+1)*sizeof(char)+sizeof(TString)));
   ts->tsv.len = l;
   ts->tsv.hash = h;
   ts->tsv.marked = luaC_white(G(L));
@@ -81,24 +187,28 @@ static TString *newlstr (lua_State *L, const char *str, size_t l,
 }
 
 
-static TString *luaS_newlstr_helper (lua_State *L, const char *str, size_t l, int readonly) {
-  GCObject *o;
-  unsigned int h = cast(unsigned int, l);  /* seed */
-  size_t step = (l>>5)+1;  /* if string is too long, don't hash all its chars */
-  size_t l1;
-  for (l1=l; l1>=step; l1-=step)  /* compute hash */
-    h = h ^ ((h<<5)+(h>>2)+cast(unsigned char, str[l1-1]));
-  for (o = G(L)->strt.hash[lmod(h, G(L)->strt.size)];
-       o != NULL;
-       o = o->gch.next) {
+static TString *findchain (global_State *g, GCObject *o,
+                           const char *str, size_t l) {
+  for (; o != NULL; o = o->gch.next) {
     TString *ts = rawgco2ts(o);
     if (ts->tsv.len == l && (memcmp(str, getstr(ts), l) == 0)) {
       /* string may be dead */
-      if (isdead(G(L), o)) changewhite(o);
+      if (isdead(g, o)) changewhite(o);
       return ts;
     }
   }
-  return newlstr(L, str, l, h, readonly);  /* not found */
+  return NULL;
+}
+
+
+static TString *luaS_newlstr_helper (lua_State *L, const char *str, size_t l, int readonly) {
+  stringtable *tb = &G(L)->strt;
+  unsigned int h = luaS_hash(str, l);
+  TString *ts = findchain(G(L), tb->hash[lmod(h, tb->size)], str, l);
+  /* while growing, the chain may still sit in the old array */
+  if (ts == NULL && tb->old != NULL && lmod(h, tb->oldsize) >= tb->moved)
+    ts = findchain(G(L), tb->old[lmod(h, tb->oldsize)], str, l);
+  return ts ? ts : newlstr(L, str, l, h, readonly);  /* not found? */
 }
 
 static int lua_is_ptr_in_ro_area(const char *p) {
@@ -122,8 +232,10 @@ TString *luaS_newlstr (lua_State *L, const char *str, size_t l) {
 }
 
 
+// str[l] must be readable. Only the terminator is checked, so binary data
+// with embedded zeros, such as assets mapped from flash, stays in place too.
 LUAI_FUNC TString *luaS_newrolstr (lua_State *L, const char *str, size_t l) {
-  if(l+1 > sizeof(char**) && l == strlen(str))
+  if(l+1 > sizeof(char**) && str[l] == '\0')
     return luaS_newlstr_helper(L, str, l, LUAS_READONLY_STRING);
   else // no point in creating a RO string, as it would actually be larger
     return luaS_newlstr_helper(L, str, l, LUAS_REGULAR_STRING);
@@ -16,6 +16,7 @@
 #include "lauxlib.h"
 #include "lualib.h"
 #include "lrotable.h"
+#include "lobject.h"
 
 /* macro to `unsign' a character */
 #define uchar(c)        ((unsigned char)(c))
@@ -93,8 +94,17 @@ static int str_rep (lua_State *L) {
   const char *s = luaL_checklstring(L, 1, &l);
   int n = luaL_checkint(L, 2);
   luaL_buffinit(L, &b);
-  while (n-- > 0)
-    luaL_addlstring(&b, s, l);
+  if (n > 0 && l > 0) {
+    char *p;
+    if (l > ((size_t)~0) / (size_t)n)
+      return luaL_error(L, "resulting string too large");
+    p = luaL_prepbuffsize(&b, l * n);  /* one block of the final size */
+    luaL_addsize(&b, l * n);
+    while (n-- > 0) {
+      memcpy(p, s, l);
+      p += l;
+    }
+  }
   luaL_pushresult(&b);
   return 1;
 }
@@ -169,6 +179,7 @@ typedef struct MatchState {
   const char *src_end;  /* end (`\0') of source string */
   lua_State *L;
   int level;  /* total number of captures (finished or unfinished) */
+  int matchdepth;  /* control for recursive depth (to avoid C stack overflow) */
   struct {
     const char *init;
     ptrdiff_t len;
@@ -179,6 +190,19 @@ typedef struct MatchState {
 #define L_ESC		'%'
 #define SPECIALS	"^$*+?.([%-"
 
+/* what cannot be taken as plain text: SPECIALS and the end of a capture */
+#define MAGIC		SPECIALS ")"
+
+/* maximum recursion depth for 'match' */
+#define MAXCCALLS	200
+
+/* longest pattern of escaped punctuation turned back into plain text */
+#define MAXLITERAL	64
+
+/* needles at least this long, in a long enough subject, use Horspool */
+#define HORSPOOL_MIN	8
+#define HORSPOOL_SUBJECT	256
+
 
 static int check_capture (MatchState *ms, int l) {
   l -= '1';
@@ -295,15 +319,32 @@ static const char *matchbalance (MatchState *ms, const char *s,
 }
 
 
+/*
+** The character the rest of a pattern must start with, or -1 if it can
+** start with more than one; lets the repetitions below skip calling
+** 'match' where it is bound to fail, as in ".-\r\n".
+*/
+static int next_literal (const char *p) {
+  if (*p == '\0' || strchr(MAGIC, *p) != NULL)
+    return -1;
+  if (*(p+1) == '*' || *(p+1) == '?' || *(p+1) == '-')
+    return -1;
+  return uchar(*p);
+}
+
+
 static const char *max_expand (MatchState *ms, const char *s,
                                  const char *p, const char *ep) {
   ptrdiff_t i = 0;  /* counts maximum expand for item */
+  int c = next_literal(ep+1);
   while ((s+i)<ms->src_end && singlematch(uchar(*(s+i)), p, ep))
     i++;
   /* keeps trying to match with the maximum repetitions */
   while (i>=0) {
-    const char *res = match(ms, (s+i), ep+1);
-    if (res) return res;
+    if (c < 0 || ((s+i) < ms->src_end && uchar(*(s+i)) == c)) {
+      const char *res = match(ms, (s+i), ep+1);
+      if (res) return res;
+    }
     i--;  /* else didn't match; reduce 1 repetition to try again */
   }
   return NULL;
@@ -312,8 +353,11 @@ static const char *max_expand (MatchState *ms, const char *s,
 
 static const char *min_expand (MatchState *ms, const char *s,
                                  const char *p, const char *ep) {
+  int c = next_literal(ep+1);
   for (;;) {
-    const char *res = match(ms, s, ep+1);
+    const char *res = NULL;
+    if (c < 0 || (s < ms->src_end && uchar(*s) == c))
+      res = match(ms, s, ep+1);
     if (res != NULL)
       return res;
     else if (s<ms->src_end && singlematch(uchar(*s), p, ep))
@@ -360,22 +404,26 @@ static const char *match_capture (MatchState *ms, const char *s, int l) {
 
 
 static const char *match (MatchState *ms, const char *s, const char *p) {
+  if (ms->matchdepth-- == 0)
+    luaL_error(ms->L, "pattern too complex");
   init: /* using goto's to optimize tail recursion */
   switch (*p) {
     case '(': {  /* start capture */
       if (*(p+1) == ')')  /* position capture? */
-        return start_capture(ms, s, p+2, CAP_POSITION);
+        s = start_capture(ms, s, p+2, CAP_POSITION);
       else
-        return start_capture(ms, s, p+1, CAP_UNFINISHED);
+        s = start_capture(ms, s, p+1, CAP_UNFINISHED);
+      break;
     }
     case ')': {  /* end capture */
-      return end_capture(ms, s, p+1);
+      s = end_capture(ms, s, p+1);
+      break;
     }
     case L_ESC: {
       switch (*(p+1)) {
         case 'b': {  /* balanced string? */
           s = matchbalance(ms, s, p+2);
-          if (s == NULL) return NULL;
+          if (s == NULL) break;
           p+=4; goto init;  /* else return match(ms, s, p+4); */
         }
         case 'f': {  /* frontier? */
@@ -387,25 +435,31 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
           ep = classend(ms, p);  /* points to what is next */
           previous = (s == ms->src_init) ? '\0' : *(s-1);
           if (matchbracketclass(uchar(previous), p, ep-1) ||
-             !matchbracketclass(uchar(*s), p, ep-1)) return NULL;
+             !matchbracketclass(uchar(*s), p, ep-1)) {
+            s = NULL;
+            break;
+          }
           p=ep; goto init;  /* else return match(ms, s, ep); */
         }
         default: {
           if (isdigit(uchar(*(p+1)))) {  /* capture results (%0-%9)? */
             s = match_capture(ms, s, uchar(*(p+1)));
-            if (s == NULL) return NULL;
+            if (s == NULL) break;
             p+=2; goto init;  /* else return match(ms, s, p+2) */
           }
           goto dflt;  /* case default */
         }
       }
+      break;
     }
     case '\0': {  /* end of pattern */
-      return s;  /* match succeeded */
+      break;  /* match succeeded */
     }
     case '$': {
-      if (*(p+1) == '\0')  /* is the `$' the last char in pattern? */
-        return (s == ms->src_end) ? s : NULL;  /* check end of string */
+      if (*(p+1) == '\0') {  /* is the `$' the last char in pattern? */
+        if (s != ms->src_end) s = NULL;  /* check end of string */
+        break;
+      }
       else goto dflt;
     }
     default: dflt: {  /* it is a pattern item */
@@ -414,34 +468,68 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
       switch (*ep) {
         case '?': {  /* optional */
           const char *res;
-          if (m && ((res=match(ms, s+1, ep+1)) != NULL))
-            return res;
+          if (m && ((res=match(ms, s+1, ep+1)) != NULL)) {
+            s = res;
+            break;
+          }
           p=ep+1; goto init;  /* else return match(ms, s, ep+1); */
         }
         case '*': {  /* 0 or more repetitions */
-          return max_expand(ms, s, p, ep);
+          s = max_expand(ms, s, p, ep);
+          break;
         }
         case '+': {  /* 1 or more repetitions */
-          return (m ? max_expand(ms, s+1, p, ep) : NULL);
+          s = (m ? max_expand(ms, s+1, p, ep) : NULL);
+          break;
         }
         case '-': {  /* 0 or more repetitions (minimum) */
-          return min_expand(ms, s, p, ep);
+          s = min_expand(ms, s, p, ep);
+          break;
         }
         default: {
-          if (!m) return NULL;
+          if (!m) {
+            s = NULL;
+            break;
+          }
           s++; p=ep; goto init;  /* else return match(ms, s+1, ep); */
         }
       }
+      break;
     }
   }
+  ms->matchdepth++;
+  return s;
 }
 
 
 
+/*
+** Boyer-Moore-Horspool: compare the last character of the window first
+** and, on a mismatch, shift by how far that character is from the end
+** of the needle. Long needles then skip most of the subject.
+*/
+static const char *horspool (const char *s1, size_t l1,
+                               const char *s2, size_t l2) {
+  unsigned short shift[256];
+  size_t i, last = l2 - 1;
+  for (i = 0; i < 256; i++)
+    shift[i] = (unsigned short)l2;
+  for (i = 0; i < last; i++)
+    shift[uchar(s2[i])] = (unsigned short)(last - i);
+  for (i = 0; i <= l1 - l2; i += shift[uchar(s1[i + last])]) {
+    if (s1[i + last] == s2[last] && memcmp(s1 + i, s2, last) == 0)
+      return s1 + i;
+  }
+  return NULL;
+}
+
+
 static const char *lmemfind (const char *s1, size_t l1,
                                const char *s2, size_t l2) {
   if (l2 == 0) return s1;  /* empty strings are everywhere */
   else if (l2 > l1) return NULL;  /* avoids a negative `l1' */
+  else if (l2 >= HORSPOOL_MIN && l2 <= 0xffff && l1 - l2 >= HORSPOOL_SUBJECT)
+    return horspool(s1, l1, s2, l2);
   else {
     const char *init;  /* to search for a `*s2' inside `s1' */
     l2--;  /* 1st char will be checked by `memchr' */
@@ -460,6 +548,50 @@ static const char *lmemfind (const char *s1, size_t l1,
 }
 
 
+/*
+** A pattern that only escapes punctuation, like "%-%-" or "%.lua", is
+** plain text and is searched for as such. Returns the text, in 'buf'
+** unless 'p' already is plain, and its length in 'll'; NULL if 'p' has
+** to go through the matcher.
+*/
+static const char *pattern_literal (const char *p, size_t lp,
+                                    char *buf, size_t *ll) {
+  size_t i, n = 0;
+  if (strpbrk(p, MAGIC) == NULL && strlen(p) == lp) {
+    *ll = lp;
+    return p;
+  }
+  for (i = 0; i < lp; i++) {
+    char c = p[i];
+    if (c == L_ESC) {
+      c = p[++i];  /* 'p' is '\0' terminated */
+      if (c == '\0' || isalnum(uchar(c)))
+        return NULL;  /* a class, %b, %f or a back reference */
+    }
+    else if (c == '\0' || strchr(MAGIC, c) != NULL)
+      return NULL;
+    if (n == MAXLITERAL)
+      return NULL;
+    buf[n++] = c;
+  }
+  *ll = n;
+  return buf;
+}
+
+
+/*
+** Length of the plain text that starts every match of 'p': 5 for
+** "HTTP/%d", 1 for "ab*" as the b is optional. Where a match can start
+** is then found with lmemfind instead of trying each position.
+*/
+static size_t literal_prefix (const char *p) {
+  size_t n = strcspn(p, MAGIC);
+  if (n > 0 && (p[n] == '*' || p[n] == '?' || p[n] == '-'))
+    n--;
+  return n;
+}
+
+
 static void push_onecapture (MatchState *ms, int i, const char *s,
                                                     const char *e) {
   if (i >= ms->level) {
@@ -494,6 +626,9 @@ static int str_find_aux (lua_State *L, int find) {
   const char *s = luaL_checklstring(L, 1, &l1);
   const char *p = luaL_checklstring(L, 2, &l2);
   ptrdiff_t init = posrelat(luaL_optinteger(L, 3, 1), l1) - 1;
+  char buf[MAXLITERAL];
+  const char *lit;
+  size_t ll;
   if (init < 0) init = 0;
   else if ((size_t)(init) > l1) init = (ptrdiff_t)l1;
   if (find && (lua_toboolean(L, 4) ||  /* explicit request? */
@@ -506,16 +641,34 @@ static int str_find_aux (lua_State *L, int find) {
       return 2;
     }
   }
+  else if ((lit = pattern_literal(p, l2, buf, &ll)) != NULL) {
+    /* escaped punctuation only: a plain search, too */
+    const char *s2 = lmemfind(s+init, l1-init, lit, ll);
+    if (s2) {
+      if (!find) {
+        lua_pushlstring(L, s2, ll);  /* the whole match */
+        return 1;
+      }
+      lua_pushinteger(L, s2-s+1);
+      lua_pushinteger(L, s2-s+ll);
+      return 2;
+    }
+  }
   else {
     MatchState ms;
     int anchor = (*p == '^') ? (p++, 1) : 0;
+    size_t pl = anchor ? 0 : literal_prefix(p);
     const char *s1=s+init;
     ms.L = L;
     ms.src_init = s;
     ms.src_end = s+l1;
     do {
       const char *res;
+      if (pl > 0 &&  /* skip to where the plain prefix is */
+          (s1 = lmemfind(s1, ms.src_end-s1, p, pl)) == NULL)
+        break;
       ms.level = 0;
+      ms.matchdepth = MAXCCALLS;
       if ((res=match(&ms, s1, p)) != NULL) {
         if (find) {
           lua_pushinteger(L, s1-s+1);  /* start */
@@ -548,6 +701,7 @@ static int gmatch_aux (lua_State *L) {
   const char *s = lua_tolstring(L, lua_upvalueindex(1), &ls);
   const char *p = lua_tostring(L, lua_upvalueindex(2));
   const char *src;
+  size_t pl = literal_prefix(p);
   ms.L = L;
   ms.src_init = s;
   ms.src_end = s+ls;
@@ -555,7 +709,10 @@ static int gmatch_aux (lua_State *L) {
        src <= ms.src_end;
        src++) {
     const char *e;
+    if (pl > 0 && (src = lmemfind(src, ms.src_end-src, p, pl)) == NULL)
+      break;
     ms.level = 0;
+    ms.matchdepth = MAXCCALLS;
     if ((e = match(&ms, src, p)) != NULL) {
       lua_Integer newstart = e-s;
       if (e == src) newstart++;  /* empty match? go at least one position */
@@ -640,13 +797,16 @@ static void add_value (MatchState *ms, luaL_Buffer *b, const char *s,
 
 
 static int str_gsub (lua_State *L) {
-  size_t srcl;
+  size_t srcl, lp;
   const char *src = luaL_checklstring(L, 1, &srcl);
-  const char *p = luaL_checkstring(L, 2);
+  const char *p = luaL_checklstring(L, 2, &lp);
   int  tr = lua_type(L, 3);
   int max_s = luaL_optint(L, 4, srcl+1);
-  int anchor = (*p == '^') ? (p++, 1) : 0;
+  int anchor = (*p == '^') ? (p++, lp--, 1) : 0;
   int n = 0;
+  char buf[MAXLITERAL];
+  const char *lit;
+  size_t ll;
   MatchState ms;
   luaL_Buffer b;
   luaL_argcheck(L, tr == LUA_TNUMBER || tr == LUA_TSTRING ||
@@ -657,20 +817,42 @@ static int str_gsub (lua_State *L) {
   ms.L = L;
   ms.src_init = src;
   ms.src_end = src+srcl;
-  while (n < max_s) {
-    const char *e;
-    ms.level = 0;
-    e = match(&ms, src, p);
-    if (e) {
+  ms.level = 0;
+  if (!anchor && (lit = pattern_literal(p, lp, buf, &ll)) != NULL && ll > 0) {
+    /* plain text: no matcher and no empty matches */
+    while (n < max_s) {
+      const char *e = lmemfind(src, ms.src_end-src, lit, ll);
+      if (e == NULL) break;
+      luaL_addlstring(&b, src, e-src);
       n++;
-      add_value(&ms, &b, src, e);
+      add_value(&ms, &b, e, e+ll);
+      src = e+ll;
+    }
+  }
+  else {
+    size_t pl = anchor ? 0 : literal_prefix(p);
+    while (n < max_s) {
+      const char *e;
+      if (pl > 0) {  /* copy up to where the plain prefix is */
+        e = lmemfind(src, ms.src_end-src, p, pl);
+        if (e == NULL) break;
+        luaL_addlstring(&b, src, e-src);
+        src = e;
+      }
+      ms.level = 0;
+      ms.matchdepth = MAXCCALLS;
+      e = match(&ms, src, p);
+      if (e) {
+        n++;
+        add_value(&ms, &b, src, e);
+      }
+      if (e && e>src) /* non empty match? */
+        src = e;  /* skip it */
+      else if (src < ms.src_end)
+        luaL_addchar(&b, *src++);
+      else break;
+      if (anchor) break;
     }
-    if (e && e>src) /* non empty match? */
-      src = e;  /* skip it */
-    else if (src < ms.src_end)
-      luaL_addchar(&b, *src++);
-    else break;
-    if (anchor) break;
   }
   luaL_addlstring(&b, src, ms.src_end-src);
   luaL_pushresult(&b);
@@ -681,6 +863,101 @@ static int str_gsub (lua_State *L) {
 /* }====================================================== */
 
 
+/*
+** {======================================================
+** PLAIN TEXT HELPERS
+** Common jobs done without the pattern matcher: one string is made
+** per field or result and none in between.
+** =======================================================
+*/
+
+
+static int str_split (lua_State *L) {
+  size_t l, ls;
+  const char *s = luaL_checklstring(L, 1, &l);
+  const char *sep = luaL_optlstring(L, 2, ",", &ls);
+  int max = luaL_optint(L, 3, 0);  /* 0: no limit */
+  const char *e = s+l;
+  const char *p;
+  int n, i;
+  luaL_argcheck(L, ls > 0, 2, "empty separator");
+  luaL_argcheck(L, max >= 0, 3, "negative limit");
+  /* count the fields first, so the table is made at its final size */
+  for (n = 1, p = s; max == 0 || n < max; n++) {
+    p = lmemfind(p, e-p, sep, ls);
+    if (p == NULL) break;
+    p += ls;
+  }
+  lua_createtable(L, n, 0);
+  for (i = 1; i < n; i++) {
+    p = lmemfind(s, e-s, sep, ls);
+    lua_pushlstring(L, s, p-s);
+    lua_rawseti(L, -2, i);
+    s = p+ls;
+  }
+  lua_pushlstring(L, s, e-s);  /* the last field takes the rest */
+  lua_rawseti(L, -2, n);
+  return 1;
+}
+
+
+static int str_join (lua_State *L) {
+  size_t ls;
+  const char *sep = luaL_checklstring(L, 1, &ls);
+  int i, n;
+  luaL_Buffer b;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  n = (int)lua_objlen(L, 2);
+  luaL_buffinit(L, &b);
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, 2, i);
+    if (!lua_isstring(L, -1) && !luaL_testbuilder(L, -1))
+      return luaL_error(L, "invalid value (at index %d) in table for "
+                           LUA_QL("join"), i);
+    luaL_addvalue(&b);
+    if (i < n)
+      luaL_addlstring(&b, sep, ls);
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+
+static int str_startswith (lua_State *L) {
+  size_t l, lp;
+  const char *s = luaL_checklstring(L, 1, &l);
+  const char *p = luaL_checklstring(L, 2, &lp);
+  lua_pushboolean(L, lp <= l && memcmp(s, p, lp) == 0);
+  return 1;
+}
+
+
+static int str_endswith (lua_State *L) {
+  size_t l, lp;
+  const char *s = luaL_checklstring(L, 1, &l);
+  const char *p = luaL_checklstring(L, 2, &lp);
+  lua_pushboolean(L, lp <= l && memcmp(s+l-lp, p, lp) == 0);
+  return 1;
+}
+
+
+static int str_trim (lua_State *L) {
+  size_t l;
+  const char *s = luaL_checklstring(L, 1, &l);
+  const char *e = s+l;
+  const char *b = s;
+  while (b < e && isspace(uchar(*b))) b++;
+  while (e > b && isspace(uchar(*(e-1)))) e--;
+  if (b == s && e == s+l)
+    lua_settop(L, 1);  /* nothing to strip: the same string */
+  else
+    lua_pushlstring(L, b, e-b);
+  return 1;
+}
+
+/* }====================================================== */
+
+
 /* maximum size of each formatted item (> len(format('%99.99f', -1e308))) */
 /* was 512, modified to 128 for eLua */
 #define MAX_ITEM	128
@@ -753,6 +1030,19 @@ static void addintlen (char *form) {
 }
 
 
+#if !defined LUA_NUMBER_INTEGRAL
+/* precision of a "%f" or "%.Nf" without flags or width, else -1 */
+static int fixedprec (const char *form) {
+  int prec = 0;
+  if (form[1] == 'f') return 6;
+  if (form[1] != '.') return -1;
+  for (form += 2; isdigit(uchar(*form)); form++)
+    prec = prec * 10 + (*form - '0');
+  return *form == 'f' ? prec : -1;
+}
+#endif
+
+
 static int str_format (lua_State *L) {
   int top = lua_gettop(L);
   int arg = 1;
@@ -778,8 +1068,13 @@ static int str_format (lua_State *L) {
           break;
         }
         case 'd':  case 'i': {
+          LUA_INTFRM_T n = (LUA_INTFRM_T)luaL_checknumber(L, arg);
+          if (form[2] == '\0') {  /* plain %d, skip sprintf */
+            luaO_int2str(buff, n);
+            break;
+          }
           addintlen(form);
-          sprintf(buff, form, (LUA_INTFRM_T)luaL_checknumber(L, arg));
+          sprintf(buff, form, n);
           break;
         }
         case 'o':  case 'u':  case 'x':  case 'X': {
@@ -790,7 +1085,11 @@ static int str_format (lua_State *L) {
 #if !defined LUA_NUMBER_INTEGRAL        
         case 'e':  case 'E': case 'f':
         case 'g': case 'G': {
-          sprintf(buff, form, (double)luaL_checknumber(L, arg));
+          double n = (double)luaL_checknumber(L, arg);
+          if (*(strfrmt - 1) == 'f' && fixedprec(form) >= 0 &&
+              luaO_fixed2str(buff, n, fixedprec(form)) >= 0)
+            break;
+          sprintf(buff, form, n);
           break;
         }
 #endif
@@ -825,13 +1124,142 @@ static int str_format (lua_State *L) {
   return 1;
 }
 
+
+/*
+** {======================================================
+** String builders
+**
+** s = s .. x copies and interns all of s every time, so building a long
+** string that way is quadratic and leaves a trail of garbage strings. A
+** builder appends in place, with .. as well as add(), and makes a string
+** only when asked with tostring(). table.concat, string.join and the
+** modules that take a buffer take a builder as it is.
+** =======================================================
+*/
+
+#define checkbuilder(L, i) \
+  ((luaL_StrBuilder *)luaL_checkudata(L, i, LUAL_STRBUILDER))
+
+
+/* append the value at i: a string, a number or a builder */
+static void sb_addvalue (lua_State *L, luaL_StrBuilder *sb, int i) {
+  luaL_StrBuilder *other = luaL_testbuilder(L, i);
+  if (other != NULL)
+    luaL_builderadd(L, sb, other->b, other->n);
+  else {
+    size_t l;
+    const char *s = luaL_checklstring(L, i, &l);
+    luaL_builderadd(L, sb, s, l);
+  }
+}
+
+
+static int sb_add (lua_State *L) {
+  luaL_StrBuilder *sb = checkbuilder(L, 1);
+  int i, n = lua_gettop(L);
+  for (i = 2; i <= n; i++)
+    sb_addvalue(L, sb, i);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/* string.builder( [s...] ) */
+static int str_builder (lua_State *L) {
+  luaL_StrBuilder *sb;
+  int n = lua_gettop(L);
+  sb = (luaL_StrBuilder *)lua_newuserdata(L, sizeof(luaL_StrBuilder));
+  sb->b = NULL;
+  sb->n = sb->size = 0;
+  luaL_getmetatable(L, LUAL_STRBUILDER);
+  lua_setmetatable(L, -2);
+  lua_insert(L, 1);
+  lua_pushcfunction(L, sb_add);
+  lua_insert(L, 1);
+  lua_call(L, n + 1, 1);
+  return 1;
+}
+
+
+/*
+** a .. b with a builder on the left appends b to it and gives the same
+** builder back; with only the right one a builder, a goes in front.
+*/
+static int sb_concat (lua_State *L) {
+  luaL_StrBuilder *sb = luaL_testbuilder(L, 1);
+  if (sb != NULL) {
+    sb_addvalue(L, sb, 2);
+    lua_settop(L, 1);
+  }
+  else {
+    size_t l;
+    const char *s = luaL_checklstring(L, 1, &l);
+    sb = checkbuilder(L, 2);
+    luaL_builderprep(L, sb, l);
+    memmove(sb->b + l, sb->b, sb->n);
+    memcpy(sb->b, s, l);
+    sb->n += l;
+  }
+  return 1;
+}
+
+
+static int sb_tostring (lua_State *L) {
+  luaL_StrBuilder *sb = checkbuilder(L, 1);
+  lua_pushlstring(L, sb->b, sb->n);
+  return 1;
+}
+
+
+static int sb_len (lua_State *L) {
+  lua_pushinteger(L, checkbuilder(L, 1)->n);
+  return 1;
+}
+
+
+/* empty it, keeping the space for the next string */
+static int sb_reset (lua_State *L) {
+  checkbuilder(L, 1)->n = 0;
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int sb_gc (lua_State *L) {
+  luaL_StrBuilder *sb = checkbuilder(L, 1);
+  void *ud;
+  lua_Alloc allocf = lua_getallocf(L, &ud);
+  allocf(ud, sb->b, sb->size, 0);
+  sb->b = NULL;
+  sb->n = sb->size = 0;
+  return 0;
+}
+
+/* }====================================================== */
+
 #undef MIN_OPT_LEVEL
 #define MIN_OPT_LEVEL 1
 #include "lrodefs.h"
+const LUA_REG_TYPE sblib[] = {
+  {LSTRKEY("add"), LFUNCVAL(sb_add)},
+  {LSTRKEY("reset"), LFUNCVAL(sb_reset)},
+  {LSTRKEY("tostring"), LFUNCVAL(sb_tostring)},
+  {LSTRKEY("__concat"), LFUNCVAL(sb_concat)},
+  {LSTRKEY("__gc"), LFUNCVAL(sb_gc)},
+  {LSTRKEY("__len"), LFUNCVAL(sb_len)},
+  {LSTRKEY("__tostring"), LFUNCVAL(sb_tostring)},
+#if LUA_OPTIMIZE_MEMORY > 0
+  {LSTRKEY("__index"), LROVAL(sblib)},
+#endif
+  {LNILKEY, LNILVAL}
+};
+
 const LUA_REG_TYPE strlib[] = {
+  {LSTRKEY("builder"), LFUNCVAL(str_builder)},
   {LSTRKEY("byte"), LFUNCVAL(str_byte)},
   {LSTRKEY("char"), LFUNCVAL(str_char)},
   {LSTRKEY("dump"), LFUNCVAL(str_dump)},
+  {LSTRKEY("endswith"), LFUNCVAL(str_endswith)},
   {LSTRKEY("find"), LFUNCVAL(str_find)},
   {LSTRKEY("format"), LFUNCVAL(str_format)},
 #if LUA_OPTIMIZE_MEMORY > 0 && defined(LUA_COMPAT_GFIND)
@@ -841,12 +1269,16 @@ const LUA_REG_TYPE strlib[] = {
 #endif
   {LSTRKEY("gmatch"), LFUNCVAL(gmatch)},
   {LSTRKEY("gsub"), LFUNCVAL(str_gsub)},
+  {LSTRKEY("join"), LFUNCVAL(str_join)},
   {LSTRKEY("len"), LFUNCVAL(str_len)},
   {LSTRKEY("lower"), LFUNCVAL(str_lower)},
   {LSTRKEY("match"), LFUNCVAL(str_match)},
   {LSTRKEY("rep"), LFUNCVAL(str_rep)},
   {LSTRKEY("reverse"), LFUNCVAL(str_reverse)},
+  {LSTRKEY("split"), LFUNCVAL(str_split)},
+  {LSTRKEY("startswith"), LFUNCVAL(str_startswith)},
   {LSTRKEY("sub"), LFUNCVAL(str_sub)},
+  {LSTRKEY("trim"), LFUNCVAL(str_trim)},
   {LSTRKEY("upper"), LFUNCVAL(str_upper)},
 #if LUA_OPTIMIZE_MEMORY > 0
   {LSTRKEY("__index"), LROVAL(strlib)},
@@ -868,10 +1300,24 @@ static void createmetatable (lua_State *L) {
 }
 #endif
 
+
+static void createbuildermeta (lua_State *L) {
+#if LUA_OPTIMIZE_MEMORY == 0
+  luaL_newmetatable(L, LUAL_STRBUILDER);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_register(L, NULL, sblib);
+#else
+  luaL_rometatable(L, LUAL_STRBUILDER, (void*)sblib);
+#endif
+  lua_pop(L, 1);
+}
+
 /*
 ** Open string library
 */
 LUALIB_API int luaopen_string (lua_State *L) {
+  createbuildermeta(L);
 #if LUA_OPTIMIZE_MEMORY == 0
   luaL_register(L, LUA_STRLIBNAME, strlib);
 #if defined(LUA_COMPAT_GFIND)
@@ -34,6 +34,7 @@
 #include "lstate.h"
 #include "ltable.h"
 #include "lrotable.h"
+#include "lvm.h"
 
 /*
 ** max size of array part is 2^MAXBITS
@@ -120,6 +121,8 @@ static Node *mainposition (const Table *t, const TValue *key) {
 ** the array part of the table, -1 otherwise.
 */
 static int arrayindex (const TValue *key) {
+  if (ttisint(key))
+    return ivalue(key);
   if (ttisnumber(key)) {
     lua_Number n = nvalue(key);
     int k;
@@ -165,7 +168,7 @@ int luaH_next (lua_State *L, Table *t, StkId key) {
   int i = findindex(L, t, key);  /* find original element */
   for (i++; i < t->sizearray; i++) {  /* try first array part */
     if (!ttisnil(&t->array[i])) {  /* a non-nil value? */
-      setnvalue(key, cast_num(i+1));
+      setivalue(key, i+1);
       setobj2s(L, key+1, &t->array[i]);
       return 1;
     }
@@ -270,7 +273,7 @@ static int numusehash (const Table *t, int *nums, int *pnasize) {
 
 static void setarrayvector (lua_State *L, Table *t, int size) {
   int i;
-  luaM_reallocvector(L, t->array, t->sizearray, size, TValue);
+  luaM_coldvector(L, t->array, t->sizearray, size, TValue);
   for (i=t->sizearray; i<size; i++)
      setnilvalue(&t->array[i]);
   t->sizearray = size;
@@ -370,10 +373,8 @@ static int move_node (lua_State *L, Table *t, Node *node) {
 
 
 static int move_number (lua_State *L, Table *t, Node *node) {
-  int key;
-  lua_Number n = nvalue(key2tval(node));
-  lua_number2int(key, n);
-  if (luai_numeq(cast_num(key), nvalue(key2tval(node)))) {/* index is int? */
+  int key = arrayindex(key2tval(node));
+  if (key > 0) {
     /* (1 <= key && key <= t->sizearray) */
     if (cast(unsigned int, key-1) < cast(unsigned int, t->sizearray)) {
       setobjt2t(L, &t->array[key-1], gval(node));
@@ -464,6 +465,167 @@ void luaH_resizearray (lua_State *L, Table *t, int nasize) {
 }
 
 
+/*
+** Grow `t' so that it has room for `nasize' array and `nhsize' hash
+** entries; parts that are already big enough are left alone.
+*/
+void luaH_presize (lua_State *L, Table *t, int nasize, int nhsize) {
+  int nsize = (t->node == dummynode) ? 0 : sizenode(t);
+  if (nasize < t->sizearray)
+    nasize = t->sizearray;
+  if (nhsize < nsize)
+    nhsize = nsize;
+  if (nasize != t->sizearray || nhsize != nsize)
+    resize(L, t, nasize, nhsize);
+}
+
+
+/* Remove every entry of `t' but keep both parts allocated */
+void luaH_clear (Table *t) {
+  int i;
+  for (i = 0; i < t->sizearray; i++)
+    setnilvalue(&t->array[i]);
+  if (t->node != dummynode) {
+    int size = sizenode(t);
+    for (i = 0; i < size; i++) {
+      Node *n = gnode(t, i);
+      gnext(n) = NULL;
+      setnilvalue(gkey(n));
+      setnilvalue(gval(n));
+    }
+    t->lastfree = gnode(t, size);
+  }
+}
+
+
+/*
+** {=============================================================
+** Sorting t[1..n] in place when they are all numbers or all strings,
+** or (with `key') all tables whose t[key] are: an introsort straight on
+** the array part, with no stack traffic or calls per comparison.
+** ==============================================================
+*/
+
+#define SORT_SHORT	12  /* ranges this short are insertion sorted */
+
+typedef struct SortState {
+  const TValue *key;  /* field the records are sorted by, or NULL */
+  int strings;  /* the values are strings, else numbers */
+} SortState;
+
+
+static const TValue *sortvalue (const SortState *s, const TValue *o) {
+  return s->key ? luaH_get(hvalue(o), s->key) : o;
+}
+
+
+static int sortlt (const SortState *s, const TValue *a, const TValue *b) {
+  a = sortvalue(s, a);
+  b = sortvalue(s, b);
+  if (s->strings)
+    return luaV_strcmp(rawtsvalue(a), rawtsvalue(b)) < 0;
+  if (ttisint(a) && ttisint(b))
+    return ivalue(a) < ivalue(b);
+  return luai_numlt(nvalue(a), nvalue(b));
+}
+
+
+static void sortswap (TValue *a, TValue *b) {
+  TValue t = *a;
+  *a = *b;
+  *b = t;
+}
+
+
+static void siftdown (const SortState *s, TValue *a, int i, int n) {
+  for (;;) {
+    int c = 2*i + 1;
+    if (c >= n) break;
+    if (c + 1 < n && sortlt(s, &a[c], &a[c+1])) c++;
+    if (!sortlt(s, &a[i], &a[c])) break;
+    sortswap(&a[i], &a[c]);
+    i = c;
+  }
+}
+
+
+static void introsort (const SortState *s, TValue *a, int n, int depth) {
+  int i, j;
+  while (n > SORT_SHORT) {
+    int m = n/2;
+    if (depth-- == 0) {  /* quicksort going quadratic; heapsort the rest */
+      for (i = n/2 - 1; i >= 0; i--)
+        siftdown(s, a, i, n);
+      for (i = n - 1; i > 0; i--) {
+        sortswap(&a[0], &a[i]);
+        siftdown(s, a, 0, i);
+      }
+      return;
+    }
+    /* median of three: a[0] <= a[m] <= a[n-1], pivot goes to a[n-2] */
+    if (sortlt(s, &a[m], &a[0])) sortswap(&a[m], &a[0]);
+    if (sortlt(s, &a[n-1], &a[m])) {
+      sortswap(&a[n-1], &a[m]);
+      if (sortlt(s, &a[m], &a[0])) sortswap(&a[m], &a[0]);
+    }
+    sortswap(&a[m], &a[n-2]);
+    i = 0; j = n - 2;
+    for (;;) {  /* bounded, so that NaNs can't run off the ends */
+      while (++i < n - 2 && sortlt(s, &a[i], &a[n-2])) ;
+      while (--j > 0 && sortlt(s, &a[n-2], &a[j])) ;
+      if (j <= i) break;
+      sortswap(&a[i], &a[j]);
+    }
+    sortswap(&a[i], &a[n-2]);
+    /* a[0..i-1] <= a[i] <= a[i+1..n-1]; recurse into the smaller side */
+    if (i < n - i - 1) {
+      introsort(s, a, i, depth);
+      a += i + 1;
+      n -= i + 1;
+    }
+    else {
+      introsort(s, a + i + 1, n - i - 1, depth);
+      n = i;
+    }
+  }
+  for (i = 1; i < n; i++)
+    for (j = i; j > 0 && sortlt(s, &a[j], &a[j-1]); j--)
+      sortswap(&a[j], &a[j-1]);
+}
+
+
+/*
+** Returns 0, leaving t alone, when t[1..n] aren't of one kind the
+** default order compares without metamethods.
+*/
+int luaH_sortarray (lua_State *L, Table *t, int n, const TValue *key) {
+  SortState s;
+  int i, depth = 0;
+  s.key = key;
+  s.strings = -1;
+  for (i = 1; i <= n; i++) {
+    const TValue *o = luaH_getnum(t, i);
+    int kind;
+    if (key) {
+      if (!ttistable(o)) return 0;
+      o = luaH_get(hvalue(o), key);
+    }
+    kind = ttisstring(o) ? 1 : ttisnumber(o) ? 0 : -1;
+    if (kind < 0 || (s.strings >= 0 && kind != s.strings)) return 0;
+    s.strings = kind;
+  }
+  if (n < 2) return 1;
+  if (t->sizearray < n)  /* bring them all into the array part */
+    luaH_resizearray(L, t, n);
+  for (i = n; i > 1; i >>= 1)
+    depth += 2;
+  introsort(&s, t->array, n, depth);
+  return 1;
+}
+
+/* }============================================================= */
+
+
 static void rehash (lua_State *L, Table *t, const TValue *ek) {
   int nasize, na;
   int nums[MAXBITS+1];  /* nums[i] = number of keys between 2^(i-1) and 2^i */
@@ -568,7 +730,8 @@ const TValue *luaH_getnum (Table *t, int key) {
     lua_Number nk = cast_num(key);
     Node *n = hashnum(t, nk);
     do {  /* check whether `key' is somewhere in the chain */
-      if (ttisnumber(gkey(n)) && luai_numeq(nvalue(gkey(n)), nk))
+      if (ttisint(gkey(n)) ? ivalue(gkey(n)) == key :
+          ttisnumber(gkey(n)) && luai_numeq(nvalue(gkey(n)), nk))
         return gval(n);  /* that's it */
       else n = gnext(n);
     } while (n);
@@ -598,12 +761,10 @@ const TValue *luaH_getstr (Table *t, TString *key) {
 
 /* same thing for rotables */
 const TValue *luaH_getstr_ro (void *t, TString *key) {
-  char keyname[LUA_MAX_ROTABLE_NAME + 1];
   const TValue *res;  
   if (!t)
     return luaO_nilobject;
-  luaR_getcstr(keyname, key, LUA_MAX_ROTABLE_NAME);   
-  res = luaR_findentry(t, keyname, 0, NULL);
+  res = luaR_findstr(t, key);
   return res ? res : luaO_nilobject;
 }
 
@@ -617,7 +778,10 @@ const TValue *luaH_get (Table *t, const TValue *key) {
     case LUA_TSTRING: return luaH_getstr(t, rawtsvalue(key));
     case LUA_TNUMBER: {
       int k;
-      lua_Number n = nvalue(key);
+      lua_Number n;
+      if (ttisint(key))
+        return luaH_getnum(t, ivalue(key));
+      n = nvalue(key);
       lua_number2int(k, n);
       if (luai_numeq(cast_num(k), nvalue(key))) /* index is int? */
         return luaH_getnum(t, k);  /* use specialized version */
@@ -642,7 +806,10 @@ const TValue *luaH_get_ro (void *t, const TValue *key) {
     case LUA_TSTRING: return luaH_getstr_ro(t, rawtsvalue(key));
     case LUA_TNUMBER: {
       int k;
-      lua_Number n = nvalue(key);
+      lua_Number n;
+      if (ttisint(key))
+        return luaH_getnum_ro(t, ivalue(key));
+      n = nvalue(key);
       lua_number2int(k, n);
       if (luai_numeq(cast_num(k), nvalue(key))) /* index is int? */
         return luaH_getnum_ro(t, k);  /* use specialized version */
@@ -675,7 +842,7 @@ TValue *luaH_setnum (lua_State *L, Table *t, int key) {
     return cast(TValue *, p);
   else {
     TValue k;
-    setnvalue(&k, cast_num(key));
+    setivalue(&k, key);
     return newkey(L, t, &k);
   }
 }
@@ -748,12 +915,13 @@ int luaH_getn_ro (void *t) {
   return len;
 }
 
+int luaH_isdummy (Node *n) { return n == dummynode; }
+
+
 #if defined(LUA_DEBUG)
 
 Node *luaH_mainposition (const Table *t, const TValue *key) {
   return mainposition(t, key);
 }
 
-int luaH_isdummy (Node *n) { return n == dummynode; }
-
 #endif
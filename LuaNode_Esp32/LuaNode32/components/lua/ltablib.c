@@ -87,6 +87,25 @@ static int setn (lua_State *L) {
 }
 
 
+/* table.new(narray, nhash): empty table with room for that many entries */
+static int tnew (lua_State *L) {
+  int narray = luaL_optint(L, 1, 0);
+  int nhash = luaL_optint(L, 2, 0);
+  luaL_argcheck(L, narray >= 0, 1, "must not be negative");
+  luaL_argcheck(L, nhash >= 0, 2, "must not be negative");
+  lua_createtable(L, narray, nhash);
+  return 1;
+}
+
+
+/* table.clear(t): remove all entries, keeping the memory for reuse */
+static int tclear (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_cleartable(L, 1);
+  return 0;
+}
+
+
 static int tinsert (lua_State *L) {
   int e = aux_getn(L, 1) + 1;  /* first empty element */
   int pos;  /* where to insert new element */
@@ -134,7 +153,7 @@ static int tremove (lua_State *L) {
 
 static void addfield (lua_State *L, luaL_Buffer *b, int i) {
   lua_rawgeti(L, 1, i);
-  if (!lua_isstring(L, -1))
+  if (!lua_isstring(L, -1) && !luaL_testbuilder(L, -1))
     luaL_error(L, "invalid value (%s) at index %d in table for "
                   LUA_QL("concat"), luaL_typename(L, -1), i);
     luaL_addvalue(b);
@@ -176,7 +195,17 @@ static void set2 (lua_State *L, int i, int j) {
 }
 
 static int sort_comp (lua_State *L, int a, int b) {
-  if (!lua_isnil(L, 2)) {  /* function? */
+  if (!lua_isnil(L, 3)) {  /* sortby: a[key] < b[key]? */
+    int res;
+    lua_pushvalue(L, 3);
+    lua_gettable(L, a-1);
+    lua_pushvalue(L, 3);
+    lua_gettable(L, b-2);
+    res = lua_lessthan(L, -2, -1);
+    lua_pop(L, 2);
+    return res;
+  }
+  else if (!lua_isnil(L, 2)) {  /* function? */
     int res;
     lua_pushvalue(L, 2);
     lua_pushvalue(L, a-1);  /* -1 to compensate function */
@@ -259,7 +288,25 @@ static int sort (lua_State *L) {
   if (!lua_isnoneornil(L, 2))  /* is there a 2nd argument? */
     luaL_checktype(L, 2, LUA_TFUNCTION);
   lua_settop(L, 2);  /* make sure there is two arguments */
-  auxsort(L, 1, n);
+  if (!lua_isnil(L, 2) || !lua_sortarray(L, 1, n, 0)) {
+    lua_pushnil(L);  /* no key for sort_comp */
+    auxsort(L, 1, n);
+  }
+  return 0;
+}
+
+
+/* table.sortby(t, key): sort records by their field key, by `<' */
+static int sortby (lua_State *L) {
+  int n = aux_getn(L, 1);
+  luaL_checkstack(L, 40, "");  /* assume array is smaller than 2^40 */
+  luaL_argcheck(L, !lua_isnoneornil(L, 2), 2, "key expected");
+  lua_settop(L, 2);
+  if (!lua_sortarray(L, 1, n, 2)) {
+    lua_pushnil(L);  /* no function; the key goes to 3 for sort_comp */
+    lua_insert(L, 2);
+    auxsort(L, 1, n);
+  }
   return 0;
 }
 
@@ -270,15 +317,18 @@ static int sort (lua_State *L) {
 #define MIN_OPT_LEVEL 1
 #include "lrodefs.h"
 const LUA_REG_TYPE tab_funcs[] = {
+  {LSTRKEY("clear"), LFUNCVAL(tclear)},
   {LSTRKEY("concat"), LFUNCVAL(tconcat)},
   {LSTRKEY("foreach"), LFUNCVAL(foreach)},
   {LSTRKEY("foreachi"), LFUNCVAL(foreachi)},
   {LSTRKEY("getn"), LFUNCVAL(getn)},
   {LSTRKEY("maxn"), LFUNCVAL(maxn)},
+  {LSTRKEY("new"), LFUNCVAL(tnew)},
   {LSTRKEY("insert"), LFUNCVAL(tinsert)},
   {LSTRKEY("remove"), LFUNCVAL(tremove)},
   {LSTRKEY("setn"), LFUNCVAL(setn)},
   {LSTRKEY("sort"), LFUNCVAL(sort)},
+  {LSTRKEY("sortby"), LFUNCVAL(sortby)},
   {LNILKEY, LNILVAL}
 };
 
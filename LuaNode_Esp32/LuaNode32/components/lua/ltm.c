@@ -44,6 +44,51 @@ void luaT_init (lua_State *L) {
 }
 
 
+/*
+** The tag methods a rotable used as a metatable lacks, a bit each as in
+** Table.flags but for every event. Rotables live in flash and can't keep
+** the flags themselves, so they are worked out with one pass over the
+** rotable the first time it is asked about and kept in a small cache;
+** userdata with a rotable metatable then skip the scan of it that an
+** absent __gc, __eq or __mode used to cost on every access and every GC
+** cycle. A line takes two stores, so the cache is left alone while other
+** states run (see luaR_workers) and nothing counts as absent.
+*/
+#define ROTM_LINES  32  /* power of 2 */
+
+typedef struct {
+  const luaR_entry *mt;
+  lu_int32 absent;
+} RoTMLine;
+
+static RoTMLine rotm_cache[ROTM_LINES];
+
+lu_int32 luaT_rotmabsent (global_State *g, void *mt) {
+  RoTMLine *line;
+  const luaR_entry *e;
+  lu_int32 absent;
+  int i;
+  if (luaR_workers)
+    return 0;
+  line = &rotm_cache[((size_t)mt >> 3) & (ROTM_LINES - 1)];
+  if (line->mt == mt)
+    return line->absent;
+  absent = (1u << TM_N) - 1;
+  for (e = (const luaR_entry *)mt; e->key.type != LUA_TNIL; e++) {
+    const char *key = e->key.id.strkey;
+    if (e->key.type != LUA_TSTRING || key[0] != '_' || key[1] != '_')
+      continue;
+    for (i = 0; i < TM_N; i++)
+      if (strcmp(key, getstr(g->tmname[i])) == 0)
+        absent &= ~(1u << i);
+  }
+  line->mt = NULL;
+  line->absent = absent;
+  line->mt = (const luaR_entry *)mt;
+  return absent;
+}
+
+
 /*
 ** function to be used with macro "fasttm": optimized for absence of
 ** tag methods
@@ -78,7 +123,8 @@ const TValue *luaT_gettmbyobj (lua_State *L, const TValue *o, TMS event) {
   if (!mt)
     return luaO_nilobject;
   else if (luaR_isrotable(mt))
-    return luaH_getstr_ro(mt, G(L)->tmname[event]);
+    return luaT_rotmabsent(G(L), mt) & (1u << event) ?
+           luaO_nilobject : luaH_getstr_ro(mt, G(L)->tmname[event]);
   else
     return luaH_getstr(mt, G(L)->tmname[event]);
 }
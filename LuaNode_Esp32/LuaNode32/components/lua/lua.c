@@ -20,6 +20,11 @@
 #include "my_uart.h"
 #include "rom/uart.h"
 #include "rom/ets_sys.h"
+#include "rom/crc.h"
+#include "vfs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "task/task.h"
 
 char line_buffer[LUA_MAXINPUT];
 
@@ -27,7 +32,7 @@ static lua_State *globalL = NULL;
 
 lua_Load gLoad;
 
-extern RcvMsgBuff rcvMsgBuff;
+extern bool uart_on_data_cb(const char *buf, size_t len);
 
 static const char *progname = LUA_PROGNAME;
 
@@ -364,7 +369,7 @@ static int runargs (lua_State *L, char **argv, int n) {
 }
 
 static int dofsfile (lua_State *L, const char *name) {
-  int status = luaL_loadfsfile(L, name) || docall(L, 0, 1);
+  int status = luaL_loadfscached(L, name) || docall(L, 0, 1);
   return report(L, status);
 }
 
@@ -446,20 +451,44 @@ void lua_handle_input (bool force)
   }
 }
 
-bool uart_getc(char *c){
-    RcvMsgBuff *pRxBuff = &rcvMsgBuff;
-    if(pRxBuff->pWritePos == pRxBuff->pReadPos){   // empty
-        return false;
-    }
-    ets_intr_lock();
-    *c = (char)*(pRxBuff->pReadPos);
-    if (pRxBuff->pReadPos == (pRxBuff->pRcvMsgBuff + RX_BUFF_SIZE)) {
-        pRxBuff->pReadPos = pRxBuff->pRcvMsgBuff ; 
-    } else {
-        pRxBuff->pReadPos++;
-    }
-    ets_intr_unlock();
-    return true;
+/*
+** Input is handled on the Lua task, like everything else that runs Lua;
+** uart_task and the console module only say there is some.
+*/
+static task_handle_t input_task;
+static task_prio_t input_prio = TASK_PRIORITY_MEDIUM;
+
+static void input_cb(task_param_t param, task_prio_t prio) {
+  lua_handle_input(false);
+}
+
+void lua_input_ready (void)
+{
+  if (input_task)
+    task_post_coalesced(input_prio, input_task, 0);
+}
+
+void lua_input_priority (int prio)
+{
+  input_prio = (task_prio_t)prio;
+}
+
+/*
+** The REPL's own output goes to UART0 and, while there is one, the remote
+** console. What Lua prints the console module takes from stdout.
+*/
+static const lua_Console *remote;
+
+static void con_putc(char c) {
+  uart_tx_one_char(c);
+  if (remote)
+    remote->write(&c, 1);
+}
+
+static void con_puts(const char *s) {
+  uart_sendStr(s);
+  if (remote)
+    remote->write(s, strlen(s));
 }
 
 static void dojob(lua_Load *load) {
@@ -521,14 +550,250 @@ static void dojob(lua_Load *load) {
   load->done = 0;
   load->line_position = 0;
   memset(load->line, 0, load->len);
-  uart_sendStr(load->prmt);
+  con_puts(load->prmt);
+}
+
+/*
+** Besides typing line by line, the console takes two bulk modes that are
+** entered with a control character at the start of an empty line:
+**
+** ^E  paste: everything up to ^D is compiled and run as one chunk, with
+**     no echo. ^C drops it.
+** ^A  upload: frames of uint16 length (little endian), that many bytes and
+**     their uint32 CRC-32 (little endian, as zlib computes it). The first
+**     frame is the file name, the next ones its content, an empty one
+**     ends it. Each frame is answered with ACK, NAK to have it sent again,
+**     or CAN when the file can't be written, which ends the upload.
+**     Silence for LUA_UPLOAD_TIMEOUT ms in between gives up on it too.
+**
+** tools/upload.py speaks both. A mode belongs to the console it was
+** entered from; the other one isn't read until it's over.
+*/
+#define KEY_UPLOAD  0x01
+#define KEY_CANCEL  0x03
+#define KEY_RUN     0x04
+#define KEY_PASTE   0x05
+#define ACK         0x06
+#define NAK         0x15
+#define CAN         0x18
+
+#define LUA_UPLOAD_TIMEOUT 2000
+
+enum { INPUT_LINE, INPUT_PASTE, INPUT_UPLOAD };
+static int input_mode = INPUT_LINE;
+static bool mode_remote;        /* the mode came from the remote console */
+
+static char *paste_buf = NULL;
+static size_t paste_len, paste_size;
+static bool paste_over;
+
+static void paste_add(const char *p, size_t n) {
+  if (paste_over)
+    return;
+  if (paste_len + n > paste_size) {
+    size_t size = paste_size ? paste_size : 512;
+    while (size < paste_len + n)
+      size *= 2;
+    if (size > CONFIG_LUA_PASTE_MAX)
+      size = CONFIG_LUA_PASTE_MAX;
+    char *b = size >= paste_len + n ? realloc(paste_buf, size) : NULL;
+    if (b == NULL) {
+      paste_over = true;
+      return;
+    }
+    paste_buf = b;
+    paste_size = size;
+  }
+  memcpy(paste_buf + paste_len, p, n);
+  paste_len += n;
+}
+
+static void paste_end(lua_Load *load, bool run) {
+  lua_State *L = load->L;
+  con_puts("\r\n");
+  if (run && paste_over) {
+    l_message(NULL, "paste too large");
+  } else if (run) {
+    int status = luaL_loadbuffer(L, paste_buf, paste_len, "=paste");
+    free(paste_buf);            /* the chunk may well want the memory */
+    paste_buf = NULL;
+    if (status == 0)
+      status = docall(L, 0, 1);
+    report(L, status);
+    lua_settop(L, 0);
+  }
+  free(paste_buf);
+  paste_buf = NULL;
+  input_mode = INPUT_LINE;
+  con_puts(load->prmt);
+}
+
+static struct {
+  enum { UP_LEN, UP_DATA, UP_CRC } stage;
+  uint8_t head[4];
+  uint8_t *buf;                 /* LUA_UPLOAD_FRAME bytes */
+  size_t len, got;
+  int fd;                       /* 0 until the name has come */
+  TickType_t last;
+} up;
+
+static void upload_reply(uint8_t c) {
+  if (!mode_remote)
+    uart_tx_one_char(c);
+  else if (remote)
+    remote->write((const char *)&c, 1);
+}
+
+static void upload_end(lua_Load *load, uint8_t reply) {
+  if (up.fd)
+    vfs_close(up.fd);
+  up.fd = 0;
+  free(up.buf);
+  up.buf = NULL;
+  upload_reply(reply);
+  input_mode = INPUT_LINE;
+  con_puts(load->prmt);
+}
+
+static void upload_start(void) {
+  up.buf = malloc(CONFIG_LUA_UPLOAD_FRAME);
+  if (up.buf == NULL) {
+    upload_reply(CAN);
+    return;
+  }
+  up.stage = UP_LEN;
+  up.got = 0;
+  up.fd = 0;
+  up.last = xTaskGetTickCount();
+  input_mode = INPUT_UPLOAD;
+}
+
+static void upload_frame(lua_Load *load) {
+  uint32_t crc = up.head[0] | up.head[1] << 8 | up.head[2] << 16 | (uint32_t)up.head[3] << 24;
+  if (crc32_le(0, up.buf, up.len) != crc) {
+    upload_reply(NAK);
+  } else if (up.fd == 0) {
+    up.buf[up.len] = '\0';     /* the buffer has a byte to spare */
+    if (up.len == 0 || up.len > 32 || strlen((char *)up.buf) != up.len ||
+        (up.fd = vfs_open((char *)up.buf, "w")) == 0)
+      upload_end(load, CAN);
+    else
+      upload_reply(ACK);
+  } else if (up.len == 0) {
+    upload_end(load, ACK);
+  } else if (vfs_write(up.fd, up.buf, up.len) != (int32_t)up.len) {
+    upload_end(load, CAN);
+  } else {
+    upload_reply(ACK);
+  }
+}
+
+/* How much of p the upload takes, all of it unless it ends in there */
+static size_t upload_feed(lua_Load *load, const char *p, size_t n) {
+  size_t i = 0;
+  TickType_t now = xTaskGetTickCount();
+  if ((now - up.last) * portTICK_PERIOD_MS > LUA_UPLOAD_TIMEOUT) {
+    upload_end(load, CAN);
+    return 0;
+  }
+  up.last = now;
+  while (i < n && input_mode == INPUT_UPLOAD) {
+    if (up.stage == UP_DATA) {
+      size_t take = up.len - up.got;
+      if (take > n - i)
+        take = n - i;
+      memcpy(up.buf + up.got, p + i, take);
+      up.got += take;
+      i += take;
+    } else {
+      up.head[up.got++] = p[i++];
+    }
+    if (up.stage == UP_LEN && up.got == 2) {
+      up.len = up.head[0] | up.head[1] << 8;
+      if (up.len >= CONFIG_LUA_UPLOAD_FRAME) {
+        upload_end(load, CAN);
+        break;
+      }
+      up.stage = up.len ? UP_DATA : UP_CRC;
+      up.got = 0;
+    } else if (up.stage == UP_DATA && up.got == up.len) {
+      up.stage = UP_CRC;
+      up.got = 0;
+    } else if (up.stage == UP_CRC && up.got == 4) {
+      up.stage = UP_LEN;
+      up.got = 0;
+      upload_frame(load);
+    }
+  }
+  return i;
+}
+
+/* Input from UART0 or the remote console, whichever has some */
+static size_t con_read(char *buf, size_t len, bool *from_remote) {
+  size_t n = 0;
+  if (input_mode == INPUT_LINE || !mode_remote)
+    n = uart_rx_read(0, (uint8_t *)buf, len);
+  *from_remote = n == 0 && remote && (input_mode == INPUT_LINE || mode_remote);
+  if (*from_remote)
+    n = remote->read(buf, len);
+  return n;
+}
+
+void lua_set_remote_console (const lua_Console *con)
+{
+  /* A mode the remote console was in can't be finished without it */
+  if (!con && remote && mode_remote) {
+    if (input_mode == INPUT_PASTE)
+      paste_end(&gLoad, false);
+    else if (input_mode == INPUT_UPLOAD)
+      upload_end(&gLoad, CAN);
+  }
+  remote = con;
+  if (con && gLoad.prmt)
+    con->write(gLoad.prmt, strlen(gLoad.prmt));
 }
 
 static char last_nl_char = '\0';
 static bool readline(lua_Load *load){
   int need_dojob = false;
-  char ch;
-  while (uart_getc(&ch)) {
+  char block[64];
+  size_t n, i;
+  bool from_remote;
+  while ((n = con_read(block, sizeof(block), &from_remote)) > 0) {
+   i = 0;
+   if (input_mode == INPUT_UPLOAD)
+     i = upload_feed(load, block, n);
+   else if (input_mode == INPUT_LINE && !from_remote && uart_on_data_cb(block, n))
+     continue;  /* uart.on("data") took it instead of the interpreter */
+   for (; i < n; i++) {
+    char ch = block[i];
+
+    if (input_mode == INPUT_PASTE) {
+      size_t run = i;
+      while (i < n && block[i] != KEY_RUN && block[i] != KEY_CANCEL)
+        i++;
+      paste_add(block + run, i - run);
+      if (i < n)
+        paste_end(load, block[i] == KEY_RUN);
+      continue;
+    }
+    if (load->line_position == 0 && load->firstline) {
+      if (ch == KEY_PASTE) {
+        paste_len = paste_size = 0;
+        paste_over = false;
+        input_mode = INPUT_PASTE;
+        mode_remote = from_remote;
+        con_puts("\r\npaste mode; ^D to run, ^C to cancel\r\n");
+        continue;
+      }
+      if (ch == KEY_UPLOAD) {
+        mode_remote = from_remote;
+        upload_start();
+        if (input_mode == INPUT_UPLOAD)
+          i += upload_feed(load, block + i + 1, n - i - 1);
+        continue;
+      }
+    }
     char tmp_last_nl_char = last_nl_char;
     // reset marker, will be finally set below when newline is processed
     last_nl_char = '\0';
@@ -540,12 +805,14 @@ static bool readline(lua_Load *load){
     {
       continue;
     }
+
+    /* telnet sends CR NUL for a bare return */
+    if (ch == '\0')
+      continue;
       
     if (ch == 0x7f || ch == 0x08) {
       if (load->line_position > 0) {
-        uart_tx_one_char(0x08);
-        uart_tx_one_char(' ');
-        uart_tx_one_char(0x08);
+        con_puts("\x08 \x08");
         load->line_position--;
       }
       line_buffer[load->line_position] = 0;
@@ -556,10 +823,10 @@ static bool readline(lua_Load *load){
     if (ch == '\r' || ch == '\n') {
       last_nl_char = ch;
       line_buffer[load->line_position] = 0;
-	  printf("\r\n");
+	  con_puts("\r\n");
       if (load->line_position == 0){
         /* Get a empty line, then go to get a new line */
-		uart_sendStr(load->prmt);
+		con_puts(load->prmt);
       } else {
 		load->done = 1;
         need_dojob = true;
@@ -567,7 +834,7 @@ static bool readline(lua_Load *load){
       continue;
     }
     
-	uart_tx_one_char(ch);
+	con_putc(ch);
 
     /* it's a large line, discard it */
     if ( load->line_position + 1 >= LUA_MAXINPUT ){
@@ -576,6 +843,7 @@ static bool readline(lua_Load *load){
     
     line_buffer[load->line_position] = ch;
     load->line_position++;
+   }
   }
   return need_dojob;
 }
@@ -606,6 +874,8 @@ int lua_main (int argc, char **argv) {
   gLoad.prmt = get_prompt(L, 1); 
 
   dojob(&gLoad);
+  input_task = task_get_id(input_cb);
+  lua_input_ready();  /* whatever was typed during boot */
 
   return 0;
 }
@@ -28,6 +28,8 @@ typedef struct {
  int swap;
  int numsize;
  int toflt;
+ int native;		/* laid out as in memory here: no swapping or conversion */
+ const char* base;	/* of a chunk loaded in direct mode, else NULL */
  size_t total;
 } LoadState;
 
@@ -44,15 +46,43 @@ static void error(LoadState* S, const char* why)
 }
 #endif
 
+/* asking the reader each time costs a call per string and function */
+#define CrtAddress(S)		((S)->base+(S)->Z->i)
+
 #define	LoadByte(S)		(lu_byte)LoadChar(S)
 #define LoadVar(S,x)		LoadMem(S,&x,1,sizeof(x))
 #define LoadVector(S,b,n,size)	LoadMem(S,b,n,size)
 
-static void LoadBlock(LoadState* S, void* b, size_t size)
+/*
+** A native chunk is read straight out of the reader's buffer for as long
+** as what is wanted lies in there, which with luaL_loadfsfile is usually
+** all of it; only reads across the end of a buffer go through luaZ_read.
+*/
+static const char* LoadDirect(LoadState* S, size_t size)
 {
- size_t r=luaZ_read(S->Z,b,size);
- IF (r!=0, "unexpected end");
+ ZIO* z=S->Z;
+ const char* p=z->p;
+ if (!S->native || z->n<size) return NULL;
+ z->p+=size;
+ z->n-=size;
+ z->i+=size;
  S->total+=size;
+ return p;
+}
+
+static void LoadBlock(LoadState* S, void* b, size_t size)
+{
+ const char* p=LoadDirect(S,size);
+ if (p!=NULL)
+ {
+  if (b) memcpy(b,p,size);
+ }
+ else
+ {
+  size_t r=luaZ_read(S->Z,b,size);
+  IF (r!=0, "unexpected end");
+  S->total+=size;
+ }
 }
 
 static void LoadMem (LoadState* S, void* b, int n, size_t size)
@@ -165,12 +195,15 @@ static TString* LoadString(LoadState* S)
  else
  {
   char* s;
-  if (!luaZ_direct_mode(S->Z)) {
+  if (S->base==NULL) {
+   const char* p=LoadDirect(S,size);
+   if (p!=NULL)	/* interned from the buffer, no copy on the way */
+    return luaS_newlstr(S->L,p,size-1);
    s = luaZ_openspace(S->L,S->b,size);
    LoadBlock(S,s,size);
    return luaS_newlstr(S->L,s,size-1); /* remove trailing zero */
   } else {
-   s = (char*)luaZ_get_crt_address(S->Z);
+   s = (char*)CrtAddress(S);
    LoadBlock(S,NULL,size);
    return luaS_newrolstr(S->L,s,size-1);
   }
@@ -181,11 +214,11 @@ static void LoadCode(LoadState* S, Proto* f)
 {
  int n=LoadInt(S);
  Align4(S);
- if (!luaZ_direct_mode(S->Z)) {
-  f->code=luaM_newvector(S->L,n,Instruction);
+ if (S->base==NULL) {
+  luaM_coldvector(S->L,f->code,0,n,Instruction);
   LoadVector(S,f->code,n,sizeof(Instruction));
  } else {
-  f->code=(Instruction*)luaZ_get_crt_address(S->Z);
+  f->code=(Instruction*)CrtAddress(S);
   LoadVector(S,NULL,n,sizeof(Instruction));
  }
  f->sizecode=n;
@@ -213,7 +246,7 @@ static void LoadConstants(LoadState* S, Proto* f)
    	setbvalue(o,LoadChar(S)!=0);
 	break;
    case LUA_TNUMBER:
-	setnvalue(o,LoadNumber(S));
+	luaO_setnumber(o,LoadNumber(S));
 	break;
    case LUA_TSTRING:
 	setsvalue2n(S->L,o,LoadString(S));
@@ -238,22 +271,22 @@ static void LoadDebug(LoadState* S, Proto* f)
 
 #ifdef LUA_OPTIMIZE_DEBUG
  if(n) {
-   if (!luaZ_direct_mode(S->Z)) {
-     f->packedlineinfo=luaM_newvector(S->L,n,unsigned char);
+   if (S->base==NULL) {
+     luaM_coldvector(S->L,f->packedlineinfo,0,n,unsigned char);
      LoadBlock(S,f->packedlineinfo,n);
    } else {
-     f->packedlineinfo=(unsigned char*)luaZ_get_crt_address(S->Z);
+     f->packedlineinfo=(unsigned char*)CrtAddress(S);
      LoadBlock(S,NULL,n);
    }
  } else {
    f->packedlineinfo=NULL;
  }
 #else
- if (!luaZ_direct_mode(S->Z)) {
-   f->lineinfo=luaM_newvector(S->L,n,int);
+ if (S->base==NULL) {
+   luaM_coldvector(S->L,f->lineinfo,0,n,int);
    LoadVector(S,f->lineinfo,n,sizeof(int));
  } else {
-   f->lineinfo=(int*)luaZ_get_crt_address(S->Z);
+   f->lineinfo=(int*)CrtAddress(S);
    LoadVector(S,NULL,n,sizeof(int));
  }
  f->sizelineinfo=n;
@@ -280,7 +313,7 @@ static Proto* LoadFunction(LoadState* S, TString* p)
  Proto* f;
  if (++S->L->nCcalls > LUAI_MAXCCALLS) error(S,"code too deep");
  f=luaF_newproto(S->L);
- if (luaZ_direct_mode(S->Z)) proto_readonly(f);
+ if (S->base!=NULL) proto_readonly(f);
  setptvalue2s(S->L,S->L->top,f); incr_top(S->L);
  f->source=LoadString(S); if (f->source==NULL) f->source=p;
  f->linedefined=LoadInt(S);
@@ -310,6 +343,7 @@ static void LoadHeader(LoadState* S)
  S->toflt=(s[11]>intck); /* check if conversion from int lua_Number to flt is needed */
  if(S->toflt) s[11]=h[11];
  IF (memcmp(h,s,LUAC_HEADERSIZE)!=0, "bad header");
+ S->native=!S->swap && !S->toflt && S->numsize==sizeof(lua_Number);
 }
 
 /*
@@ -327,6 +361,8 @@ Proto* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name)
  S.L=L;
  S.Z=Z;
  S.b=buff;
+ S.native=0;
+ S.base=luaZ_get_base_address(Z);
  LoadHeader(&S);
  S.total=0;
  return LoadFunction(&S,luaS_newliteral(L,"=?"));
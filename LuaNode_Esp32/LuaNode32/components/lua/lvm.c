@@ -69,9 +69,12 @@ int luaV_tostring (lua_State *L, StkId obj) {
   else {
     char s[LUAI_MAXNUMBER2STR];
     ptrdiff_t objr = savestack(L, obj);
-    lua_Number n = nvalue(obj);
-    lua_number2str(s, n);
-    setsvalue2s(L, restorestack(L, objr), luaS_new(L, s));
+    size_t l;
+    if (ttisint(obj))
+      l = luaO_int2str(s, ivalue(obj));  /* what LUA_NUMBER_FMT gives */
+    else
+      l = luaO_num2str(s, nvalue(obj));
+    setsvalue2s(L, restorestack(L, objr), luaS_newlstr(L, s, l));
     return 1;
   }
 }
@@ -154,6 +157,108 @@ void luaV_gettable (lua_State *L, const TValue *t, TValue *key, StkId val) {
 }
 
 
+/*
+** Inline cache for constant string keys looked up through rotables, as in
+** `gpio.write' or `sock:send'. Lines are indexed by instruction and hold
+** where the lookup started (a rotable, or the rotable metatable of a
+** userdata) and the entry it resolved to. Every step of such a chain is
+** read-only, so a line stays right for as long as it matches.
+*/
+#define ICACHE_LINES	64	/* power of 2 */
+
+typedef struct {
+  const Instruction *pc;
+  const void *start;
+  const TValue *res;
+} ICacheLine;
+
+static ICacheLine icache[ICACHE_LINES];
+
+#define icacheline(pc)	(&icache[((size_t)(pc) >> 2) & (ICACHE_LINES - 1)])
+
+static const void *icache_start (const TValue *t) {
+  if (ttisrotable(t))
+    return rvalue(t);
+  if (ttisuserdata(t) && uvalue(t)->metatable &&
+      luaR_isrotable(uvalue(t)->metatable))
+    return uvalue(t)->metatable;
+  return NULL;
+}
+
+/* follow the same steps as luaV_gettable, giving up at anything mutable */
+static const TValue *icache_resolve (lua_State *L, const TValue *t,
+                                     TString *key) {
+  TString *ename = G(L)->tmname[TM_INDEX];
+  const TValue *tm;
+  void *h;
+  int loop;
+  if (ttisrotable(t))
+    h = rvalue(t);
+  else {
+    tm = luaH_getstr_ro(uvalue(t)->metatable, ename);
+    if (!ttisrotable(tm)) return NULL;
+    h = rvalue(tm);
+  }
+  for (loop = 0; loop < MAXTAGLOOP; loop++) {
+    const TValue *res = luaH_getstr_ro(h, key);
+    void *mt;
+    if (!ttisnil(res)) return res;
+    mt = luaR_getmeta(h);
+    if (mt == NULL) return NULL;
+    tm = luaH_getstr_ro(mt, ename);
+    if (!ttisrotable(tm)) return NULL;
+    h = rvalue(tm);
+  }
+  return NULL;
+}
+
+/* lookup of constant key `k' in `t' for the instruction at `pc'; returns
+   0 when the VM has to do it the long way */
+static int icache_get (lua_State *L, const Instruction *pc, const TValue *t,
+                       const TValue *k, StkId val) {
+  ICacheLine *line;
+  const void *start;
+  const TValue *res;
+  if (!ttisstring(k) || luaR_workers || (start = icache_start(t)) == NULL)
+    return 0;
+  line = icacheline(pc);
+  if (line->pc == pc && line->start == start) {
+    /* a freed Proto's pc may be reused, so check the key really matches */
+    const luaR_entry *e = (const luaR_entry *)
+        ((const char *)line->res - offsetof(luaR_entry, value));
+    if (!strcmp(e->key.id.strkey, svalue(k))) {
+      setobj2s(L, val, line->res);
+      return 1;
+    }
+  }
+  res = icache_resolve(L, t, rawtsvalue(k));
+  if (res == NULL)
+    return 0;
+  line->pc = NULL;
+  line->start = start;
+  line->res = res;
+  line->pc = pc;
+  setobj2s(L, val, res);
+  return 1;
+}
+
+/* `t.name' and `t:name()': constant string keys go straight to the hash
+   part of a table, or through the inline cache for rotables; returns 0
+   when the VM has to do it the long way */
+static int fastget_k (lua_State *L, const Instruction *pc, const TValue *t,
+                      const TValue *k, StkId val) {
+  if (ttistable(t) && ttisstring(k)) {
+    Table *h = hvalue(t);
+    const TValue *res = luaH_getstr(h, rawtsvalue(k));
+    if (ttisnil(res) && fasttm(L, h->metatable, TM_INDEX) != NULL)
+      return 0;
+    setobj2s(L, val, res);
+    return 1;
+  }
+  return icache_get(L, pc, t, k, val);
+}
+
+
 void luaV_settable (lua_State *L, const TValue *t, TValue *key, StkId val) {
   int loop;
   TValue temp;
@@ -233,7 +338,7 @@ static int call_orderTM (lua_State *L, const TValue *p1, const TValue *p2,
 }
 
 
-static int l_strcmp (const TString *ls, const TString *rs) {
+int luaV_strcmp (const TString *ls, const TString *rs) {
   const char *l = getstr(ls);
   size_t ll = ls->tsv.len;
   const char *r = getstr(rs);
@@ -257,12 +362,14 @@ static int l_strcmp (const TString *ls, const TString *rs) {
 
 int luaV_lessthan (lua_State *L, const TValue *l, const TValue *r) {
   int res;
+  if (ttisint(l) && ttisint(r))
+    return ivalue(l) < ivalue(r);
   if (ttype(l) != ttype(r))
     return luaG_ordererror(L, l, r);
   else if (ttisnumber(l))
     return luai_numlt(nvalue(l), nvalue(r));
   else if (ttisstring(l))
-    return l_strcmp(rawtsvalue(l), rawtsvalue(r)) < 0;
+    return luaV_strcmp(rawtsvalue(l), rawtsvalue(r)) < 0;
   else if ((res = call_orderTM(L, l, r, TM_LT)) != -1)
     return res;
   return luaG_ordererror(L, l, r);
@@ -271,12 +378,14 @@ int luaV_lessthan (lua_State *L, const TValue *l, const TValue *r) {
 
 static int lessequal (lua_State *L, const TValue *l, const TValue *r) {
   int res;
+  if (ttisint(l) && ttisint(r))
+    return ivalue(l) <= ivalue(r);
   if (ttype(l) != ttype(r))
     return luaG_ordererror(L, l, r);
   else if (ttisnumber(l))
     return luai_numle(nvalue(l), nvalue(r));
   else if (ttisstring(l))
-    return l_strcmp(rawtsvalue(l), rawtsvalue(r)) <= 0;
+    return luaV_strcmp(rawtsvalue(l), rawtsvalue(r)) <= 0;
   else if ((res = call_orderTM(L, l, r, TM_LE)) != -1)  /* first try `le' */
     return res;
   else if ((res = call_orderTM(L, r, l, TM_LT)) != -1)  /* else try `lt' */
@@ -290,7 +399,10 @@ int luaV_equalval (lua_State *L, const TValue *t1, const TValue *t2) {
   lua_assert(ttype(t1) == ttype(t2));
   switch (ttype(t1)) {
     case LUA_TNIL: return 1;
-    case LUA_TNUMBER: return luai_numeq(nvalue(t1), nvalue(t2));
+    case LUA_TNUMBER:
+      if (ttisint(t1) && ttisint(t2))
+        return ivalue(t1) == ivalue(t2);
+      return luai_numeq(nvalue(t1), nvalue(t2));
     case LUA_TBOOLEAN: return bvalue(t1) == bvalue(t2);  /* true must be 1 !! */
     case LUA_TLIGHTUSERDATA: 
     case LUA_TROTABLE:
@@ -395,7 +507,7 @@ static void Arith (lua_State *L, StkId ra, const TValue *rb,
 ** some macros for common tasks in `luaV_execute'
 */
 
-#define runtime_check(L, c)	{ if (!(c)) break; }
+#define runtime_check(L, c)	{ if (!(c)) vmbreak; }
 
 #define RA(i)	(base+GETARG_A(i))
 /* to be used after possible stack reallocation */
@@ -426,12 +538,108 @@ static void Arith (lua_State *L, StkId ra, const TValue *rb,
       }
 
 
+#ifdef LUA_NUMBER_DUAL
+/*
+** Integer forms of the arithmetic operators. They fail, and the opcode
+** goes the lua_Number way, whenever the exact result is no int: on
+** overflow, for minus zero and for a quotient with a remainder.
+*/
+#define intadd(a,b,r)	(!__builtin_add_overflow(a, b, r))
+#define intsub(a,b,r)	(!__builtin_sub_overflow(a, b, r))
+#define intmul(a,b,r)	(!__builtin_mul_overflow(a, b, r) && \
+			 (*(r) != 0 || ((a) >= 0 && (b) >= 0)))
+
+static int intdiv (int a, int b, int *r) {
+  if (b == 0 || (b == -1 && a == INT_MIN) || a % b != 0 || (a == 0 && b < 0))
+    return 0;
+  *r = a / b;
+  return 1;
+}
+
+static int intmod (int a, int b, int *r) {
+  if (b == 0)
+    return 0;
+  *r = (b == -1) ? 0 : a % b;
+  if (*r != 0 && (*r ^ b) < 0)  /* rounds toward minus infinity */
+    *r += b;
+  return 1;
+}
+
+#define arith_intop(iop,op,tm) { \
+        TValue *rb = RKB(i); \
+        TValue *rc = RKC(i); \
+        int ir; \
+        if (ttisint(rb) && ttisint(rc) && iop(ivalue(rb), ivalue(rc), &ir)) { \
+          setivalue(ra, ir); \
+        } \
+        else if (ttisnumber(rb) && ttisnumber(rc)) { \
+          lua_Number nb = nvalue(rb), nc = nvalue(rc); \
+          setnvalue(ra, op(nb, nc)); \
+        } \
+        else \
+          Protect(Arith(L, ra, rb, rc, tm)); \
+      }
+#else
+#define arith_intop(iop,op,tm)	arith_op(op, tm)
+#endif
+
+
+/* fetch the next instruction, running the line and count hooks */
+#define vmfetch()	{ \
+        i = *pc++; \
+        if ((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) && \
+            (--L->hookcount == 0 || L->hookmask & LUA_MASKLINE)) { \
+          traceexec(L, pc); \
+          if (L->status == LUA_YIELD) {  /* did hook yield? */ \
+            L->savedpc = pc - 1; \
+            return; \
+          } \
+          base = L->base; \
+        } \
+        /* warning!! several calls may realloc the stack and invalidate `ra' */ \
+        ra = RA(i); \
+        lua_assert(base == L->base && L->base == L->ci->base); \
+        lua_assert(base <= L->top && L->top <= L->stack + L->stacksize); \
+        lua_assert(L->top == L->ci->top || luaG_checkopenop(i)); \
+      }
+
+/*
+** With LUAI_THREADED every handler ends by fetching the next instruction
+** and jumping to its handler itself, so there is no bounds check and each
+** handler has an indirect jump of its own. Otherwise it goes back to the
+** switch at the top of the loop.
+*/
+#if LUAI_THREADED
+#define vmdispatch(o)	goto *disptab[o];
+#define vmcase(l)	L_##l:
+#define vmbreak		{ vmfetch(); vmdispatch(GET_OPCODE(i)); }
+#else
+#define vmdispatch(o)	switch (o)
+#define vmcase(l)	case l:
+#define vmbreak		continue
+#endif
+
+
 
 void luaV_execute (lua_State *L, int nexeccalls) {
   LClosure *cl;
   StkId base;
   TValue *k;
   const Instruction *pc;
+#if LUAI_THREADED
+  /* in the order of the OpCode enum of lopcodes.h */
+  static const void *const disptab[NUM_OPCODES] = {
+    &&L_OP_MOVE, &&L_OP_LOADK, &&L_OP_LOADBOOL, &&L_OP_LOADNIL,
+    &&L_OP_GETUPVAL, &&L_OP_GETGLOBAL, &&L_OP_GETTABLE, &&L_OP_SETGLOBAL,
+    &&L_OP_SETUPVAL, &&L_OP_SETTABLE, &&L_OP_NEWTABLE, &&L_OP_SELF,
+    &&L_OP_ADD, &&L_OP_SUB, &&L_OP_MUL, &&L_OP_DIV, &&L_OP_MOD, &&L_OP_POW,
+    &&L_OP_UNM, &&L_OP_NOT, &&L_OP_LEN, &&L_OP_CONCAT, &&L_OP_JMP,
+    &&L_OP_EQ, &&L_OP_LT, &&L_OP_LE, &&L_OP_TEST, &&L_OP_TESTSET,
+    &&L_OP_CALL, &&L_OP_TAILCALL, &&L_OP_RETURN, &&L_OP_FORLOOP,
+    &&L_OP_FORPREP, &&L_OP_TFORLOOP, &&L_OP_SETLIST, &&L_OP_CLOSE,
+    &&L_OP_CLOSURE, &&L_OP_VARARG
+  };
+#endif
  reentry:  /* entry point */
   lua_assert(isLua(L->ci));
   pc = L->savedpc;
@@ -440,142 +648,136 @@ void luaV_execute (lua_State *L, int nexeccalls) {
   k = cl->p->k;
   /* main loop of interpreter */
   for (;;) {
-    const Instruction i = *pc++;
+    Instruction i;
     StkId ra;
-    if ((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) &&
-        (--L->hookcount == 0 || L->hookmask & LUA_MASKLINE)) {
-      traceexec(L, pc);
-      if (L->status == LUA_YIELD) {  /* did hook yield? */
-        L->savedpc = pc - 1;
-        return;
-      }
-      base = L->base;
-    }
-    /* warning!! several calls may realloc the stack and invalidate `ra' */
-    ra = RA(i);
-    lua_assert(base == L->base && L->base == L->ci->base);
-    lua_assert(base <= L->top && L->top <= L->stack + L->stacksize);
-    lua_assert(L->top == L->ci->top || luaG_checkopenop(i));
-    switch (GET_OPCODE(i)) {
-      case OP_MOVE: {
+    vmfetch();
+    vmdispatch (GET_OPCODE(i)) {
+      vmcase(OP_MOVE) {
         setobjs2s(L, ra, RB(i));
-        continue;
+        vmbreak;
       }
-      case OP_LOADK: {
+      vmcase(OP_LOADK) {
         setobj2s(L, ra, KBx(i));
-        continue;
+        vmbreak;
       }
-      case OP_LOADBOOL: {
+      vmcase(OP_LOADBOOL) {
         setbvalue(ra, GETARG_B(i));
         if (GETARG_C(i)) pc++;  /* skip next instruction (if C) */
-        continue;
+        vmbreak;
       }
-      case OP_LOADNIL: {
+      vmcase(OP_LOADNIL) {
         TValue *rb = RB(i);
         do {
           setnilvalue(rb--);
         } while (rb >= ra);
-        continue;
+        vmbreak;
       }
-      case OP_GETUPVAL: {
+      vmcase(OP_GETUPVAL) {
         int b = GETARG_B(i);
         setobj2s(L, ra, cl->upvals[b]->v);
-        continue;
+        vmbreak;
       }
-      case OP_GETGLOBAL: {
+      vmcase(OP_GETGLOBAL) {
         TValue g;
         TValue *rb = KBx(i);
         sethvalue(L, &g, cl->env);
         lua_assert(ttisstring(rb));
         Protect(luaV_gettable(L, &g, rb, ra));
-        continue;
+        vmbreak;
       }
-      case OP_GETTABLE: {
+      vmcase(OP_GETTABLE) {
+        if (ISK(GETARG_C(i)) && fastget_k(L, pc, RB(i), RKC(i), ra))
+          vmbreak;
         Protect(luaV_gettable(L, RB(i), RKC(i), ra));
-        continue;
+        vmbreak;
       }
-      case OP_SETGLOBAL: {
+      vmcase(OP_SETGLOBAL) {
         TValue g;
         sethvalue(L, &g, cl->env);
         lua_assert(ttisstring(KBx(i)));
         Protect(luaV_settable(L, &g, KBx(i), ra));
-        continue;
+        vmbreak;
       }
-      case OP_SETUPVAL: {
+      vmcase(OP_SETUPVAL) {
         UpVal *uv = cl->upvals[GETARG_B(i)];
         setobj(L, uv->v, ra);
         luaC_barrier(L, uv, ra);
-        continue;
+        vmbreak;
       }
-      case OP_SETTABLE: {
+      vmcase(OP_SETTABLE) {
         Protect(luaV_settable(L, ra, RKB(i), RKC(i)));
-        continue;
+        vmbreak;
       }
-      case OP_NEWTABLE: {
+      vmcase(OP_NEWTABLE) {
         int b = GETARG_B(i);
         int c = GETARG_C(i);
         Table *h;
         Protect(h = luaH_new(L, luaO_fb2int(b), luaO_fb2int(c)));
         sethvalue(L, RA(i), h);
         Protect(luaC_checkGC(L));
-        continue;
+        vmbreak;
       }
-      case OP_SELF: {
+      vmcase(OP_SELF) {
         StkId rb = RB(i);
         setobjs2s(L, ra+1, rb);
+        if (ISK(GETARG_C(i)) && fastget_k(L, pc, rb, RKC(i), ra))
+          vmbreak;
         Protect(luaV_gettable(L, rb, RKC(i), ra));
-        continue;
+        vmbreak;
       }
-      case OP_ADD: {
-        arith_op(luai_numadd, TM_ADD);
-        continue;
+      vmcase(OP_ADD) {
+        arith_intop(intadd, luai_numadd, TM_ADD);
+        vmbreak;
       }
-      case OP_SUB: {
-        arith_op(luai_numsub, TM_SUB);
-        continue;
+      vmcase(OP_SUB) {
+        arith_intop(intsub, luai_numsub, TM_SUB);
+        vmbreak;
       }
-      case OP_MUL: {
-        arith_op(luai_nummul, TM_MUL);
-        continue;
+      vmcase(OP_MUL) {
+        arith_intop(intmul, luai_nummul, TM_MUL);
+        vmbreak;
       }
-      case OP_DIV: {
-        arith_op(luai_lnumdiv, TM_DIV);
-        continue;
+      vmcase(OP_DIV) {
+        arith_intop(intdiv, luai_lnumdiv, TM_DIV);
+        vmbreak;
       }
-      case OP_MOD: {
-        arith_op(luai_lnummod, TM_MOD);
-        continue;
+      vmcase(OP_MOD) {
+        arith_intop(intmod, luai_lnummod, TM_MOD);
+        vmbreak;
       }
-      case OP_POW: {
+      vmcase(OP_POW) {
         arith_op(luai_numpow, TM_POW);
-        continue;
+        vmbreak;
       }
-      case OP_UNM: {
+      vmcase(OP_UNM) {
         TValue *rb = RB(i);
-        if (ttisnumber(rb)) {
+        if (ttisint(rb) && ivalue(rb) != 0 && ivalue(rb) != INT_MIN) {
+          setivalue(ra, -ivalue(rb));
+        }
+        else if (ttisnumber(rb)) {
           lua_Number nb = nvalue(rb);
           setnvalue(ra, luai_numunm(nb));
         }
         else {
           Protect(Arith(L, ra, rb, rb, TM_UNM));
         }
-        continue;
+        vmbreak;
       }
-      case OP_NOT: {
+      vmcase(OP_NOT) {
         int res = l_isfalse(RB(i));  /* next assignment may change this value */
         setbvalue(ra, res);
-        continue;
+        vmbreak;
       }
-      case OP_LEN: {
+      vmcase(OP_LEN) {
         const TValue *rb = RB(i);
         switch (ttype(rb)) {
           case LUA_TTABLE: 
           case LUA_TROTABLE: {
-            setnvalue(ra, ttistable(rb) ? cast_num(luaH_getn(hvalue(rb))) : cast_num(luaH_getn_ro(rvalue(rb))));
+            setivalue(ra, ttistable(rb) ? luaH_getn(hvalue(rb)) : luaH_getn_ro(rvalue(rb)));
             break;
           }
           case LUA_TSTRING: {
-            setnvalue(ra, cast_num(tsvalue(rb)->len));
+            setivalue(ra, cast_int(tsvalue(rb)->len));
             break;
           }
           default: {  /* try metamethod */
@@ -586,61 +788,82 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             )
           }
         }
-        continue;
+        vmbreak;
       }
-      case OP_CONCAT: {
+      vmcase(OP_CONCAT) {
         int b = GETARG_B(i);
         int c = GETARG_C(i);
         Protect(luaV_concat(L, c-b+1, c); luaC_checkGC(L));
         setobjs2s(L, RA(i), base+b);
-        continue;
+        vmbreak;
       }
-      case OP_JMP: {
+      vmcase(OP_JMP) {
         dojump(L, pc, GETARG_sBx(i));
-        continue;
+        vmbreak;
       }
-      case OP_EQ: {
+      vmcase(OP_EQ) {
         TValue *rb = RKB(i);
         TValue *rc = RKC(i);
-        Protect(
+        if (ttisint(rb) && ttisint(rc)) {
+          if ((ivalue(rb) == ivalue(rc)) == GETARG_A(i))
+            dojump(L, pc, GETARG_sBx(*pc));
+        }
+        else if (ISK(GETARG_B(i)) || ISK(GETARG_C(i))) {
+          /* a constant has no __eq, so raw equality is the answer */
+          if (luaO_rawequalObj(rb, rc) == GETARG_A(i))
+            dojump(L, pc, GETARG_sBx(*pc));
+        }
+        else Protect(
           if (equalobj(L, rb, rc) == GETARG_A(i))
             dojump(L, pc, GETARG_sBx(*pc));
         )
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_LT: {
-        Protect(
-          if (luaV_lessthan(L, RKB(i), RKC(i)) == GETARG_A(i))
+      vmcase(OP_LT) {
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        if (ttisint(rb) && ttisint(rc)) {
+          if ((ivalue(rb) < ivalue(rc)) == GETARG_A(i))
+            dojump(L, pc, GETARG_sBx(*pc));
+        }
+        else Protect(
+          if (luaV_lessthan(L, rb, rc) == GETARG_A(i))
             dojump(L, pc, GETARG_sBx(*pc));
         )
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_LE: {
-        Protect(
-          if (lessequal(L, RKB(i), RKC(i)) == GETARG_A(i))
+      vmcase(OP_LE) {
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        if (ttisint(rb) && ttisint(rc)) {
+          if ((ivalue(rb) <= ivalue(rc)) == GETARG_A(i))
+            dojump(L, pc, GETARG_sBx(*pc));
+        }
+        else Protect(
+          if (lessequal(L, rb, rc) == GETARG_A(i))
             dojump(L, pc, GETARG_sBx(*pc));
         )
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_TEST: {
+      vmcase(OP_TEST) {
         if (l_isfalse(ra) != GETARG_C(i))
           dojump(L, pc, GETARG_sBx(*pc));
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_TESTSET: {
+      vmcase(OP_TESTSET) {
         TValue *rb = RB(i);
         if (l_isfalse(rb) != GETARG_C(i)) {
           setobjs2s(L, ra, rb);
           dojump(L, pc, GETARG_sBx(*pc));
         }
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_CALL: {
+      vmcase(OP_CALL) {
         int b = GETARG_B(i);
         int nresults = GETARG_C(i) - 1;
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
@@ -654,14 +877,14 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             /* it was a C function (`precall' called it); adjust results */
             if (nresults >= 0) L->top = L->ci->top;
             base = L->base;
-            continue;
+            vmbreak;
           }
           default: {
             return;  /* yield */
           }
         }
       }
-      case OP_TAILCALL: {
+      vmcase(OP_TAILCALL) {
         int b = GETARG_B(i);
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
         L->savedpc = pc;
@@ -686,14 +909,14 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           }
           case PCRC: {  /* it was a C function (`precall' called it) */
             base = L->base;
-            continue;
+            vmbreak;
           }
           default: {
             return;  /* yield */
           }
         }
       }
-      case OP_RETURN: {
+      vmcase(OP_RETURN) {
         int b = GETARG_B(i);
         if (b != 0) L->top = ra+b-1;
         if (L->openupval) luaF_close(L, base);
@@ -708,7 +931,20 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           goto reentry;
         }
       }
-      case OP_FORLOOP: {
+      vmcase(OP_FORLOOP) {
+#ifdef LUA_NUMBER_DUAL
+        if (ttisint(ra)) {  /* OP_FORPREP made all three ints */
+          int istep = ivalue(ra+2), ilimit = ivalue(ra+1), iidx;
+          /* an overflowing index is past any int limit */
+          if (intadd(ivalue(ra), istep, &iidx) &&
+              (0 < istep ? iidx <= ilimit : ilimit <= iidx)) {
+            dojump(L, pc, GETARG_sBx(i));  /* jump back */
+            setivalue(ra, iidx);  /* update internal index... */
+            setivalue(ra+3, iidx);  /* ...and external index */
+          }
+          vmbreak;
+        }
+#endif
         lua_Number step = nvalue(ra+2);
         lua_Number idx = luai_numadd(nvalue(ra), step); /* increment index */
         lua_Number limit = nvalue(ra+1);
@@ -718,9 +954,9 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           setnvalue(ra, idx);  /* update internal index... */
           setnvalue(ra+3, idx);  /* ...and external index */
         }
-        continue;
+        vmbreak;
       }
-      case OP_FORPREP: {
+      vmcase(OP_FORPREP) {
         const TValue *init = ra;
         const TValue *plimit = ra+1;
         const TValue *pstep = ra+2;
@@ -731,11 +967,21 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           luaG_runerror(L, LUA_QL("for") " limit must be a number");
         else if (!tonumber(pstep, ra+2))
           luaG_runerror(L, LUA_QL("for") " step must be a number");
+#ifdef LUA_NUMBER_DUAL
+        if (ttisint(ra) && ttisint(ra+1) && ttisint(ra+2)) {
+          int iidx;
+          if (intsub(ivalue(ra), ivalue(ra+2), &iidx)) {
+            setivalue(ra, iidx);
+            dojump(L, pc, GETARG_sBx(i));
+            vmbreak;
+          }
+        }
+#endif
         setnvalue(ra, luai_numsub(nvalue(ra), nvalue(pstep)));
         dojump(L, pc, GETARG_sBx(i));
-        continue;
+        vmbreak;
       }
-      case OP_TFORLOOP: {
+      vmcase(OP_TFORLOOP) {
         StkId cb = ra + 3;  /* call base */
         setobjs2s(L, cb+2, ra+2);
         setobjs2s(L, cb+1, ra+1);
@@ -749,9 +995,9 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           dojump(L, pc, GETARG_sBx(*pc));  /* jump back */
         }
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_SETLIST: {
+      vmcase(OP_SETLIST) {
         int n = GETARG_B(i);
         int c = GETARG_C(i);
         int last;
@@ -773,13 +1019,13 @@ void luaV_execute (lua_State *L, int nexeccalls) {
         }
         L->top = L->ci->top;
         unfixedstack(L);
-        continue;
+        vmbreak;
       }
-      case OP_CLOSE: {
+      vmcase(OP_CLOSE) {
         luaF_close(L, ra);
-        continue;
+        vmbreak;
       }
-      case OP_CLOSURE: {
+      vmcase(OP_CLOSURE) {
         Proto *p;
         Closure *ncl;
         int nup, j;
@@ -799,9 +1045,9 @@ void luaV_execute (lua_State *L, int nexeccalls) {
         }
         unfixedstack(L);
         Protect(luaC_checkGC(L));
-        continue;
+        vmbreak;
       }
-      case OP_VARARG: {
+      vmcase(OP_VARARG) {
         int b = GETARG_B(i) - 1;
         int j;
         CallInfo *ci = L->ci;
@@ -820,7 +1066,7 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             setnilvalue(ra + j);
           }
         }
-        continue;
+        vmbreak;
       }
     }
   }
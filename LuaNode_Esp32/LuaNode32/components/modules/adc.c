@@ -0,0 +1,322 @@
+// Module for ADC1: single readings, and continuous sampling through I2S DMA
+//
+// Continuous samples are averaged down in the I2S interrupt and collected
+// into blocks, which are handed to the Lua task once full, so Lua only
+// sees a few calls a second however fast the ADC runs. Threshold
+// crossings are spotted in the interrupt too.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "adc_hw.h"
+#include "freertos/FreeRTOS.h"
+#include "task/task.h"
+#include <stdlib.h>
+
+#define ADC_BLOCKS        4     // one filling, the rest with Lua
+#define ADC_MAX_BLOCK     2048  // values per block
+#define ADC_MAX_DECIMATE  4096
+#define ADC_MAX_BLOCK_RATE 100  // blocks a second Lua can be asked to take
+
+enum { POST_BLOCK, POST_CROSS };
+
+typedef struct {
+  uint16_t *data;
+  uint16_t n;
+  volatile bool full;     // posted to Lua, left alone until delivered
+} adc_block_t;
+
+static struct {
+  bool on;
+  uint8_t gen;            // tells a delivery for a stopped run from a live one
+  uint16_t decimate, block;
+  uint32_t acc;           // sum of the samples of the value being averaged
+  uint16_t acc_n;
+  uint8_t fill;           // block being filled
+  uint32_t lost;          // values Lua was too far behind to take
+  adc_block_t b[ADC_BLOCKS];
+  int cb_ref;
+} run = { .cb_ref = LUA_NOREF };
+
+static struct {
+  bool on;
+  uint8_t gen;
+  uint16_t low, high;
+  bool above;
+  volatile bool posted;   // one crossing at a time, noise can't flood Lua
+  int cb_ref;
+} cross = { .cb_ref = LUA_NOREF };
+
+static portMUX_TYPE adc_mux = portMUX_INITIALIZER_UNLOCKED;
+static task_handle_t adc_task;
+
+#define ADC_POST(kind, gen, n)  ((task_param_t)((n) | (gen) << 16 | (kind) << 24))
+
+// The rest run in the I2S interrupt
+static void adc_cross( uint16_t v )
+{
+  bool above = cross.above ? v > cross.low : v >= cross.high;
+  if (above == cross.above)
+    return;
+  cross.above = above;
+  if (!cross.posted) {
+    cross.posted = true;
+    if (!task_post_low( adc_task, ADC_POST( POST_CROSS, cross.gen, v ) ))
+      cross.posted = false;
+  }
+}
+
+static void adc_value( uint16_t v )
+{
+  if (cross.on)
+    adc_cross( v );
+  if (run.cb_ref == LUA_NOREF)
+    return;
+
+  adc_block_t *b = &run.b[run.fill];
+  if (b->full) {
+    portENTER_CRITICAL_ISR( &adc_mux );
+    run.lost++;
+    portEXIT_CRITICAL_ISR( &adc_mux );
+    return;
+  }
+  b->data[b->n] = v;
+  if (++b->n < run.block)
+    return;
+  unsigned bi = run.fill;
+  b->full = true;
+  run.fill = (bi + 1) % ADC_BLOCKS;
+  if (!task_post_low( adc_task, ADC_POST( POST_BLOCK, run.gen, bi ) )) {
+    portENTER_CRITICAL_ISR( &adc_mux );
+    run.lost += b->n;
+    portEXIT_CRITICAL_ISR( &adc_mux );
+    b->n = 0;
+    b->full = false;
+  }
+}
+
+static void adc_samples( const uint16_t *s, size_t n, void *arg )
+{
+  for (size_t i = 0; i < n; i++) {
+    run.acc += s[i];
+    if (++run.acc_n < run.decimate)
+      continue;
+    uint16_t v = run.acc / run.decimate;
+    run.acc = 0;
+    run.acc_n = 0;
+    adc_value( v );
+  }
+}
+
+// Lua task: hand a full block or a crossing to its function
+static void adc_deliver( task_param_t param, task_prio_t prio )
+{
+  (void)prio;
+  unsigned kind = (param >> 24) & 0xff;
+  unsigned gen = (param >> 16) & 0xff;
+  lua_State *L = lua_getstate();
+
+  if (kind == POST_CROSS) {
+    cross.posted = false;
+    if (!cross.on || cross.gen != gen)
+      return;
+    uint16_t v = param & 0xffff;
+    lua_rawgeti( L, LUA_REGISTRYINDEX, cross.cb_ref );
+    lua_pushinteger( L, v );
+    lua_pushboolean( L, v >= cross.high );
+    lua_call( L, 2, 0 );
+    return;
+  }
+
+  if (!run.on || run.gen != gen)
+    return;               // stopped since
+  adc_block_t *b = &run.b[param & 0xffff];
+  lua_rawgeti( L, LUA_REGISTRYINDEX, run.cb_ref );
+  // the ESP32 is little endian, as the data string is documented to be
+  lua_pushlstring( L, (const char *)b->data, b->n * sizeof(uint16_t) );
+  portENTER_CRITICAL( &adc_mux );
+  uint32_t lost = run.lost;
+  run.lost = 0;
+  portEXIT_CRITICAL( &adc_mux );
+  lua_pushinteger( L, lost );
+  b->n = 0;
+  b->full = false;
+  lua_call( L, 2, 0 );
+}
+
+static void adc_free_blocks( void )
+{
+  for (int i = 0; i < ADC_BLOCKS; i++) {
+    free( run.b[i].data );
+    run.b[i].data = NULL;
+  }
+}
+
+static int opt_field( lua_State *L, const char *name, int dflt )
+{
+  lua_getfield( L, 1, name );
+  int v = luaL_optinteger( L, -1, dflt );
+  lua_pop( L, 1 );
+  return v;
+}
+
+static bool adc_isfunction( lua_State *L, int idx )
+{
+  return lua_type( L, idx ) == LUA_TFUNCTION || lua_type( L, idx ) == LUA_TLIGHTFUNCTION;
+}
+
+// Lua: value = adc.read( chan[, atten] )
+// One 12 bit reading of ADC1 channel chan, 0-7 for GPIO36-39 and 32-35.
+// atten defaults to adc.ATTEN_11DB.
+static int adc_read( lua_State *L )
+{
+  int chan = luaL_checkinteger( L, 1 );
+  int atten = luaL_optinteger( L, 2, ADC_HW_ATTEN_11DB );
+  luaL_argcheck( L, chan >= 0 && chan < ADC_HW_CHANNELS, 1, "wrong channel" );
+  luaL_argcheck( L, atten >= ADC_HW_ATTEN_0DB && atten <= ADC_HW_ATTEN_11DB, 2, "wrong atten" );
+  int v = adc_hw_read( chan, atten );
+  if (v < 0)
+    return luaL_error( L, "adc busy sampling" );
+  lua_pushinteger( L, v );
+  return 1;
+}
+
+// Lua: rate = adc.start( { chan=, rate=, decimate=1, block=256, atten=adc.ATTEN_11DB }[, function(data, lost)] )
+// Samples chan rate times a second, 6000 to 200000, and averages every
+// decimate samples into one value. Once block values are in, the function
+// gets them in data, as little endian 16 bit numbers, and the number of
+// values lost since the last call because Lua fell behind. Without a
+// function only adc.threshold() sees the values. Returns the rate the ADC
+// actually runs at.
+static int adc_start( lua_State *L )
+{
+  luaL_checktype( L, 1, LUA_TTABLE );
+  bool cb = adc_isfunction( L, 2 );
+  luaL_argcheck( L, cb || lua_isnoneornil( L, 2 ), 2, "function expected" );
+  if (run.on)
+    return luaL_error( L, "adc already sampling" );
+
+  int chan = opt_field( L, "chan", -1 );
+  int rate = opt_field( L, "rate", 0 );
+  int decimate = opt_field( L, "decimate", 1 );
+  int block = opt_field( L, "block", 256 );
+  int atten = opt_field( L, "atten", ADC_HW_ATTEN_11DB );
+  luaL_argcheck( L, chan >= 0 && chan < ADC_HW_CHANNELS, 1, "wrong chan" );
+  luaL_argcheck( L, rate >= ADC_HW_MIN_RATE && rate <= ADC_HW_MAX_RATE, 1, "wrong rate" );
+  luaL_argcheck( L, decimate > 0 && decimate <= ADC_MAX_DECIMATE, 1, "wrong decimate" );
+  luaL_argcheck( L, block > 0 && block <= ADC_MAX_BLOCK, 1, "wrong block" );
+  luaL_argcheck( L, atten >= ADC_HW_ATTEN_0DB && atten <= ADC_HW_ATTEN_11DB, 1, "wrong atten" );
+  if (cb)
+    luaL_argcheck( L, rate / decimate / block <= ADC_MAX_BLOCK_RATE, 1, "block too small for the rate" );
+
+  if (!adc_task)
+    adc_task = task_get_id( adc_deliver );
+
+  if (cb) {
+    bool oom = false;
+    for (int i = 0; i < ADC_BLOCKS; i++) {
+      run.b[i].data = (uint16_t *)malloc( block * sizeof(uint16_t) );
+      run.b[i].n = 0;
+      run.b[i].full = false;
+      oom |= !run.b[i].data;
+    }
+    if (oom) {
+      adc_free_blocks();
+      return luaL_error( L, "out of memory" );
+    }
+    lua_pushvalue( L, 2 );
+    run.cb_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  run.decimate = decimate;
+  run.block = block;
+  run.acc = 0;
+  run.acc_n = 0;
+  run.fill = 0;
+  run.lost = 0;
+  cross.above = false;
+  run.on = true;
+
+  int actual = adc_hw_start( chan, atten, rate, adc_samples, NULL );
+  if (actual < 0) {
+    run.on = false;
+    luaL_unref( L, LUA_REGISTRYINDEX, run.cb_ref );
+    run.cb_ref = LUA_NOREF;
+    adc_free_blocks();
+    return luaL_error( L, actual == -3 ? "out of memory" : "adc busy" );
+  }
+  lua_pushinteger( L, actual );
+  return 1;
+}
+
+// Lua: adc.stop()
+// Values not yet delivered are dropped.
+static int adc_stop( lua_State *L )
+{
+  if (!run.on)
+    return 0;
+  adc_hw_stop();
+  run.on = false;
+  run.gen++;
+  luaL_unref( L, LUA_REGISTRYINDEX, run.cb_ref );
+  run.cb_ref = LUA_NOREF;
+  adc_free_blocks();
+  return 0;
+}
+
+// Lua: adc.threshold( low, high, function(value, above) ) or adc.threshold()
+// While sampling, calls the function with the value that went up to high
+// or more, with above true, or back down to low or less, with above
+// false. Values in between don't count, so noise near one edge doesn't
+// make a call per sample; neither does a crossing while Lua has yet to
+// take the last one. With no arguments, stops looking.
+static int adc_threshold( lua_State *L )
+{
+  cross.on = false;
+  cross.gen++;
+  luaL_unref( L, LUA_REGISTRYINDEX, cross.cb_ref );
+  cross.cb_ref = LUA_NOREF;
+  if (lua_isnoneornil( L, 1 ))
+    return 0;
+
+  int low = luaL_checkinteger( L, 1 );
+  int high = luaL_checkinteger( L, 2 );
+  luaL_argcheck( L, low >= 0 && low < 4096, 1, "wrong low" );
+  luaL_argcheck( L, high > low && high < 4096, 2, "wrong high" );
+  luaL_argcheck( L, adc_isfunction( L, 3 ), 3, "function expected" );
+  if (!adc_task)
+    adc_task = task_get_id( adc_deliver );
+
+  lua_pushvalue( L, 3 );
+  cross.cb_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  cross.low = low;
+  cross.high = high;
+  cross.above = false;
+  cross.on = true;
+  return 0;
+}
+
+// Module function map
+const LUA_REG_TYPE adc_map[] = {
+  { LSTRKEY( "read" ),        LFUNCVAL( adc_read ) },
+  { LSTRKEY( "start" ),       LFUNCVAL( adc_start ) },
+  { LSTRKEY( "stop" ),        LFUNCVAL( adc_stop ) },
+  { LSTRKEY( "threshold" ),   LFUNCVAL( adc_threshold ) },
+  { LSTRKEY( "ATTEN_0DB" ),   LNUMVAL( ADC_HW_ATTEN_0DB ) },
+  { LSTRKEY( "ATTEN_2_5DB" ), LNUMVAL( ADC_HW_ATTEN_2_5DB ) },
+  { LSTRKEY( "ATTEN_6DB" ),   LNUMVAL( ADC_HW_ATTEN_6DB ) },
+  { LSTRKEY( "ATTEN_11DB" ),  LNUMVAL( ADC_HW_ATTEN_11DB ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_adc(lua_State *L)
+{
+#if LUA_OPTIMIZE_MEMORY > 0
+    return 0;
+#else
+	luaL_register( L, LUA_ADCLIBNAME, adc_map );
+	return 1;
+#endif
+}
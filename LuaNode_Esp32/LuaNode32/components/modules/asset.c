@@ -0,0 +1,71 @@
+// Module for the read-only asset partition
+//
+// Assets are packed into an image on the host with tools/mkassets.py and
+// flashed to the "assets" partition. asset.get() returns a read-only
+// string that points straight into mapped flash, so even large web pages
+// or lookup tables cost only a string header in RAM.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "asset_store.h"
+
+// Lua: data = asset.get(name)
+// nil if there is no such asset
+static int asset_get( lua_State *L )
+{
+  const char *name = luaL_checkstring( L, 1 );
+  uint32_t size;
+  const char *data = (const char *)asset_store_get( name, &size );
+  if (!data)
+    return 0;
+  lua_pushrolstring( L, data, size );
+  return 1;
+}
+
+// Lua: t = asset.list()
+// Table of asset sizes by name
+static int asset_list( lua_State *L )
+{
+  const char *name;
+  uint32_t size;
+  lua_newtable( L );
+  for (uint32_t i = 0; asset_store_entry( i, &name, &size ); i++) {
+    lua_pushinteger( L, size );
+    lua_setfield( L, -2, name );
+  }
+  return 1;
+}
+
+// Lua: count, used, total = asset.info()
+// Raises an error if there is no asset partition
+static int asset_info( lua_State *L )
+{
+  uint32_t count, used, total;
+  if (!asset_store_info( &count, &used, &total ))
+    return luaL_error( L, "no asset partition" );
+  lua_pushinteger( L, count );
+  lua_pushinteger( L, used );
+  lua_pushinteger( L, total );
+  return 3;
+}
+
+// Module function map
+const LUA_REG_TYPE asset_map[] = {
+  { LSTRKEY( "get" ),  LFUNCVAL( asset_get ) },
+  { LSTRKEY( "list" ), LFUNCVAL( asset_list ) },
+  { LSTRKEY( "info" ), LFUNCVAL( asset_info ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_asset( lua_State *L )
+{
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_ASSETLIBNAME, asset_map );
+  return 1;
+#endif
+}
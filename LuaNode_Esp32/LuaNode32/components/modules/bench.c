@@ -0,0 +1,173 @@
+// Module for the on-device benchmarks of lua_samples/bench
+//
+// Most of the suite is plain Lua timed with tmr.now(). What Lua can't see
+// is how long an event waits in the task queues, so post() measures that,
+// and info() describes the build a report comes from, so reports of two
+// firmware images on the same board can be told apart and compared.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "task/task.h"
+#include "user_version.h"
+#include "esp_system.h"
+#include "rom/ets_sys.h"
+#include <string.h>
+
+// what perf baselines are kept apart by
+#if defined(LUANODE_HOST)
+#define BENCH_TARGET "host"
+#else
+#define BENCH_TARGET "esp32"
+#endif
+
+#define BENCH_HIST  8   // latency buckets: <2us, <4us, ... <128us, the rest
+
+static struct {
+  bool on;
+  task_prio_t prio;
+  uint32_t left, n;
+  uint32_t posted_at;
+  uint32_t min, max;
+  uint64_t sum;
+  uint32_t hist[BENCH_HIST];
+  int cb_ref;
+} run;
+
+static task_handle_t bench_task;
+
+static void bench_done( lua_State *L )
+{
+  run.on = false;
+  lua_rawgeti( L, LUA_REGISTRYINDEX, run.cb_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, run.cb_ref );
+  run.cb_ref = LUA_NOREF;
+  if (!run.n) {
+    lua_pushnil( L );
+    lua_call( L, 1, 0 );
+    return;
+  }
+  lua_createtable( L, 0, 5 );
+  lua_pushinteger( L, run.n );
+  lua_setfield( L, -2, "n" );
+  lua_pushinteger( L, run.min );
+  lua_setfield( L, -2, "min_us" );
+  lua_pushinteger( L, (lua_Integer)(run.sum / run.n) );
+  lua_setfield( L, -2, "avg_us" );
+  lua_pushinteger( L, run.max );
+  lua_setfield( L, -2, "max_us" );
+  lua_createtable( L, BENCH_HIST, 0 );
+  for (int i = 0; i < BENCH_HIST; i++) {
+    lua_pushinteger( L, run.hist[i] );
+    lua_rawseti( L, -2, i + 1 );
+  }
+  lua_setfield( L, -2, "hist" );
+  lua_call( L, 1, 0 );
+}
+
+static bool bench_post_next( void )
+{
+  run.posted_at = system_get_time();
+  return task_post( run.prio, bench_task, 0 );
+}
+
+static void bench_deliver( task_param_t param, task_prio_t prio )
+{
+  (void)param;
+  (void)prio;
+  uint32_t us = system_get_time() - run.posted_at;
+  if (!run.on)
+    return;
+
+  if (us < run.min)
+    run.min = us;
+  if (us > run.max)
+    run.max = us;
+  run.sum += us;
+  int b = 0;
+  while (b < BENCH_HIST - 1 && us >= (2u << b))
+    b++;
+  run.hist[b]++;
+  run.n++;
+
+  if (--run.left == 0 || !bench_post_next())
+    bench_done( lua_getstate() );
+}
+
+// Lua: bench.post( n[, prio], function(stats) )
+// Posts an event to the Lua task n times, each once the one before has
+// been handled, and times how long it waited to be. Once done the function
+// gets { n=, min_us=, avg_us=, max_us=, hist= }, hist counting waits below
+// 2, 4, ... 128us and over, or nil if not one post got through. prio is
+// one of the task priorities, 0 to 2, medium by default.
+static int bench_post( lua_State *L )
+{
+  int n = luaL_checkinteger( L, 1 );
+  int cb = 2;
+  int prio = TASK_PRIORITY_MEDIUM;
+  if (lua_isnumber( L, 2 )) {
+    prio = lua_tointeger( L, 2 );
+    cb = 3;
+  }
+  luaL_argcheck( L, n > 0, 1, "wrong arg range" );
+  luaL_argcheck( L, prio >= TASK_PRIORITY_LOW && prio < TASK_PRIORITY_COUNT, 2, "wrong priority" );
+  luaL_argcheck( L, lua_type( L, cb ) == LUA_TFUNCTION || lua_type( L, cb ) == LUA_TLIGHTFUNCTION,
+                 cb, "function expected" );
+  if (run.on)
+    return luaL_error( L, "bench already posting" );
+
+  if (!bench_task)
+    bench_task = task_get_id( bench_deliver );
+
+  memset( &run, 0, sizeof(run) );
+  run.prio = (task_prio_t)prio;
+  run.left = n;
+  run.min = UINT32_MAX;
+  lua_pushvalue( L, cb );
+  run.cb_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  run.on = true;
+  if (!bench_post_next())
+    bench_done( L );
+  return 0;
+}
+
+// Lua: t = bench.info()
+// { target=, version=, build_date=, cpu_mhz=, optimize_memory=, heap= }
+// of the running firmware
+static int bench_info( lua_State *L )
+{
+  lua_createtable( L, 0, 6 );
+  lua_pushstring( L, BENCH_TARGET );
+  lua_setfield( L, -2, "target" );
+  lua_pushstring( L, NODE_VERSION );
+  lua_setfield( L, -2, "version" );
+  lua_pushstring( L, BUILD_DATE );
+  lua_setfield( L, -2, "build_date" );
+  lua_pushinteger( L, ets_get_cpu_frequency() );
+  lua_setfield( L, -2, "cpu_mhz" );
+  lua_pushinteger( L, LUA_OPTIMIZE_MEMORY );
+  lua_setfield( L, -2, "optimize_memory" );
+  lua_pushinteger( L, system_get_free_heap_size() );
+  lua_setfield( L, -2, "heap" );
+  return 1;
+}
+
+// Module function map
+const LUA_REG_TYPE bench_map[] = {
+  { LSTRKEY( "post" ), LFUNCVAL( bench_post ) },
+  { LSTRKEY( "info" ), LFUNCVAL( bench_info ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_bench( lua_State *L )
+{
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_BENCHLIBNAME, bench_map );
+  return 1;
+#endif
+}
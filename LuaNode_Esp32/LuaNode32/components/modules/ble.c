@@ -0,0 +1,575 @@
+// Module for scanning for BLE advertisements
+//
+// The SDK has the Bluetooth controller but no host stack, so this speaks
+// HCI to the controller over VHCI itself, as much as scanning takes.
+// Adverts are filtered and de-duplicated in the controller's task as they
+// come in; only the ones kept are queued, and Lua gets them in batches.
+// The SDK runs either the WiFi or the BT stack, so this is only built
+// with CONFIG_BT_ENABLED.
+
+#include "sdkconfig.h"
+#if CONFIG_BT_ENABLED
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "bt.h"
+#include "task/task.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#define BLE_QUEUE       CONFIG_BLE_SCAN_QUEUE
+#define BLE_SEEN_SLOTS  CONFIG_BLE_SEEN_SLOTS
+#define BLE_MAX_UUIDS   8
+#define BLE_MAX_PREFIX  16
+#define BLE_ADV_MAX     31
+#define BLE_CMD_WAIT_MS 500
+
+// HCI
+#define H4_CMD                  0x01
+#define H4_EVT                  0x04
+#define EVT_CMD_COMPLETE        0x0e
+#define EVT_CMD_STATUS          0x0f
+#define EVT_LE_META             0x3e
+#define LE_ADV_REPORT           0x02
+#define OP_RESET                0x0c03
+#define OP_SET_EVENT_MASK       0x0c01
+#define OP_LE_SET_SCAN_PARAMS   0x200b
+#define OP_LE_SET_SCAN_ENABLE   0x200c
+
+// AD types
+#define AD_UUID16_SOME          0x02
+#define AD_UUID16_ALL           0x03
+#define AD_UUID128_SOME         0x06
+#define AD_UUID128_ALL          0x07
+#define AD_NAME_SHORT           0x08
+#define AD_NAME                 0x09
+#define AD_SERVICE_DATA16       0x16
+#define AD_SERVICE_DATA128      0x21
+#define AD_MFR_DATA             0xff
+
+typedef struct {
+  uint8_t addr[6];
+  uint8_t addr_type, type;
+  int8_t rssi;
+  uint8_t len;
+  uint8_t data[BLE_ADV_MAX];
+} ble_adv_t;
+
+typedef struct {
+  uint8_t addr[6];
+  bool rsp;                   // scan responses are kept apart from adverts
+  bool used;
+  TickType_t at;
+} ble_seen_t;
+
+typedef struct {
+  int8_t rssi;
+  uint8_t n16, n128, prefix_len;
+  uint16_t uuid16[BLE_MAX_UUIDS];
+  uint8_t uuid128[BLE_MAX_UUIDS][16];
+  uint8_t prefix[BLE_MAX_PREFIX];
+  TickType_t dedup;           // 0 for none
+  uint16_t batch;
+} ble_filter_t;
+
+static bool ble_inited;
+static volatile bool scanning;
+static ble_filter_t filt;
+static ble_seen_t *seen;
+static ble_adv_t *queue;
+static uint16_t q_head, q_count;
+static portMUX_TYPE q_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t n_seen, n_filtered, n_deduped, n_dropped, dropped_since;
+static int cb_ref = LUA_NOREF;
+static os_timer_t flush_timer;
+static task_handle_t deliver_task;
+
+// The command waited for, and how it went
+static SemaphoreHandle_t cmd_done;
+static volatile uint16_t cmd_op;
+static volatile int cmd_status;
+
+static bool uuid_wanted16( uint16_t u )
+{
+  for (int i = 0; i < filt.n16; i++)
+    if (filt.uuid16[i] == u)
+      return true;
+  return false;
+}
+
+static bool uuid_wanted128( const uint8_t *u )
+{
+  for (int i = 0; i < filt.n128; i++)
+    if (!memcmp( filt.uuid128[i], u, 16 ))
+      return true;
+  return false;
+}
+
+// Whether the advert's data gets past the UUID and manufacturer filters
+static bool ad_match( const uint8_t *d, uint8_t len )
+{
+  bool need_uuid = filt.n16 || filt.n128, uuid_ok = false;
+  bool mfr_ok = !filt.prefix_len;
+  for (unsigned i = 0; i + 1 < len; ) {
+    uint8_t l = d[i];
+    if (!l || i + 1 + l > len)
+      break;
+    uint8_t type = d[i + 1];
+    const uint8_t *p = d + i + 2;
+    unsigned n = l - 1;
+    switch (type) {
+    case AD_UUID16_SOME:
+    case AD_UUID16_ALL:
+      for (unsigned k = 0; k + 2 <= n; k += 2)
+        uuid_ok |= uuid_wanted16( p[k] | p[k + 1] << 8 );
+      break;
+    case AD_SERVICE_DATA16:
+      if (n >= 2)
+        uuid_ok |= uuid_wanted16( p[0] | p[1] << 8 );
+      break;
+    case AD_UUID128_SOME:
+    case AD_UUID128_ALL:
+      for (unsigned k = 0; k + 16 <= n; k += 16)
+        uuid_ok |= uuid_wanted128( p + k );
+      break;
+    case AD_SERVICE_DATA128:
+      if (n >= 16)
+        uuid_ok |= uuid_wanted128( p );
+      break;
+    case AD_MFR_DATA:
+      if (n >= filt.prefix_len && !memcmp( p, filt.prefix, filt.prefix_len ))
+        mfr_ok = true;
+      break;
+    }
+    i += 1 + l;
+  }
+  return (!need_uuid || uuid_ok) && mfr_ok;
+}
+
+// Whether addr was let through within the de-duplication window; if not,
+// it is now
+static bool ble_dedup( const uint8_t *addr, bool rsp, TickType_t now )
+{
+  if (!filt.dedup)
+    return false;
+  uint32_t h = 2166136261u;
+  for (int i = 0; i < 6; i++)
+    h = (h ^ addr[i]) * 16777619u;
+  h ^= rsp;
+  ble_seen_t *s = &seen[h % BLE_SEEN_SLOTS];
+  // A slot holds the last address hashed to it; a collision only costs
+  // a duplicate
+  if (s->used && s->rsp == rsp && !memcmp( s->addr, addr, 6 ) && now - s->at < filt.dedup)
+    return true;
+  memcpy( s->addr, addr, 6 );
+  s->rsp = rsp;
+  s->used = true;
+  s->at = now;
+  return false;
+}
+
+// Controller task: one advertising report
+static void ble_report( uint8_t type, uint8_t addr_type, const uint8_t *addr,
+                        const uint8_t *data, uint8_t len, int8_t rssi )
+{
+  n_seen++;
+  if (rssi < filt.rssi || len > BLE_ADV_MAX || !ad_match( data, len )) {
+    n_filtered++;
+    return;
+  }
+  if (ble_dedup( addr, type == 4, xTaskGetTickCount() )) {
+    n_deduped++;
+    return;
+  }
+
+  bool post = false;
+  portENTER_CRITICAL( &q_mux );
+  if (q_count == BLE_QUEUE) {
+    n_dropped++;
+    dropped_since++;
+  } else {
+    ble_adv_t *a = &queue[(q_head + q_count) % BLE_QUEUE];
+    q_count++;
+    // HCI gives addresses least significant byte first
+    for (int i = 0; i < 6; i++)
+      a->addr[i] = addr[5 - i];
+    a->addr_type = addr_type;
+    a->type = type;
+    a->rssi = rssi;
+    a->len = len;
+    memcpy( a->data, data, len );
+    post = q_count >= filt.batch;
+  }
+  portEXIT_CRITICAL( &q_mux );
+  if (post)
+    task_post_coalesced_low( deliver_task, 0 );
+}
+
+// Controller task: the LE advertising report event, whose fields come
+// one array after another for all the reports it holds
+static void ble_adv_reports( const uint8_t *p, unsigned len )
+{
+  if (len < 1)
+    return;
+  unsigned n = p[0];
+  const uint8_t *types = p + 1, *addr_types = types + n, *addrs = addr_types + n;
+  const uint8_t *lens = addrs + 6 * n, *data = lens + n;
+  if (data > p + len)
+    return;
+  unsigned total = 0;
+  for (unsigned i = 0; i < n; i++)
+    total += lens[i];
+  const uint8_t *rssis = data + total;
+  if (rssis + n > p + len)
+    return;
+  for (unsigned i = 0; i < n; i++) {
+    ble_report( types[i], addr_types[i], addrs + 6 * i, data, lens[i], (int8_t)rssis[i] );
+    data += lens[i];
+  }
+}
+
+// Controller task: an HCI packet for the host
+static int ble_hci_recv( uint8_t *data, uint16_t len )
+{
+  if (len < 3 || data[0] != H4_EVT || data[2] + 3 > len)
+    return 0;
+  const uint8_t *p = data + 3;
+  unsigned plen = data[2];
+  switch (data[1]) {
+  case EVT_CMD_COMPLETE:
+    if (plen >= 4 && (p[1] | p[2] << 8) == cmd_op) {
+      cmd_status = p[3];
+      xSemaphoreGive( cmd_done );
+    }
+    break;
+  case EVT_CMD_STATUS:
+    if (plen >= 4 && (p[2] | p[3] << 8) == cmd_op) {
+      cmd_status = p[0];
+      xSemaphoreGive( cmd_done );
+    }
+    break;
+  case EVT_LE_META:
+    if (plen >= 1 && p[0] == LE_ADV_REPORT && scanning)
+      ble_adv_reports( p + 1, plen - 1 );
+    break;
+  }
+  return 0;
+}
+
+// Commands are sent one at a time, polling for room, so this has nothing to do
+static void ble_hci_send_available( void )
+{
+}
+
+static const vhci_host_callback_t ble_vhci = {
+  ble_hci_send_available,
+  ble_hci_recv,
+};
+
+// Send a command and wait for it to complete. Returns its status, or -1
+// if the controller didn't take or answer it.
+static int ble_cmd( uint16_t op, const uint8_t *params, uint8_t plen )
+{
+  uint8_t pkt[4 + 16];
+  pkt[0] = H4_CMD;
+  pkt[1] = op & 0xff;
+  pkt[2] = op >> 8;
+  pkt[3] = plen;
+  memcpy( pkt + 4, params, plen );
+
+  TickType_t start = xTaskGetTickCount(), wait = BLE_CMD_WAIT_MS / portTICK_PERIOD_MS;
+  while (!API_vhci_host_check_send_available()) {
+    if (xTaskGetTickCount() - start > wait)
+      return -1;
+    vTaskDelay( 1 );
+  }
+  xSemaphoreTake( cmd_done, 0 );    // a late answer to an earlier one
+  cmd_op = op;
+  API_vhci_host_send_packet( pkt, 4 + plen );
+  int status = xSemaphoreTake( cmd_done, wait ) == pdTRUE ? cmd_status : -1;
+  cmd_op = 0;
+  return status;
+}
+
+static int ble_init( lua_State *L )
+{
+  static bool controller_up;
+  if (ble_inited)
+    return 0;
+  if (!cmd_done)
+    cmd_done = xSemaphoreCreateBinary();
+  if (!seen)
+    seen = (ble_seen_t *)calloc( BLE_SEEN_SLOTS, sizeof(ble_seen_t) );
+  if (!queue)
+    queue = (ble_adv_t *)malloc( BLE_QUEUE * sizeof(ble_adv_t) );
+  if (!cmd_done || !seen || !queue)
+    return luaL_error( L, "out of memory" );
+  if (!controller_up) {
+    bt_controller_init();
+    API_vhci_host_register_callback( &ble_vhci );
+    controller_up = true;
+  }
+  // Everything but the LE events off, and the LE meta event on
+  static const uint8_t mask[8] = { 0, 0, 0, 0, 0, 0, 0, 0x20 };
+  if (ble_cmd( OP_RESET, NULL, 0 ) != 0 || ble_cmd( OP_SET_EVENT_MASK, mask, 8 ) != 0)
+    return luaL_error( L, "controller not answering" );
+  ble_inited = true;
+  return 0;
+}
+
+static int ble_enable( bool on )
+{
+  uint8_t p[2] = { on, 0 };         // the controller's own duplicate filter off
+  return ble_cmd( OP_LE_SET_SCAN_ENABLE, p, 2 );
+}
+
+static void ble_flush_cb( void *arg )
+{
+  task_post_coalesced_low( deliver_task, 0 );
+}
+
+// Lua task: hand what the queue holds to fn(list, dropped)
+static void ble_deliver( task_param_t param, task_prio_t prio )
+{
+  (void)param; (void)prio;
+  if (cb_ref == LUA_NOREF)
+    return;
+  lua_State *L = lua_getstate();
+  portENTER_CRITICAL( &q_mux );
+  unsigned n = q_count;
+  uint32_t dropped = dropped_since;
+  dropped_since = 0;
+  portEXIT_CRITICAL( &q_mux );
+  if (!n && !dropped)
+    return;
+
+  lua_rawgeti( L, LUA_REGISTRYINDEX, cb_ref );
+  lua_createtable( L, n, 0 );
+  for (unsigned i = 0; i < n; i++) {
+    // Slots up to n are the reader's until q_head moves past them
+    ble_adv_t *a = &queue[(q_head + i) % BLE_QUEUE];
+    char mac[18];
+    snprintf( mac, sizeof(mac), "%02x:%02x:%02x:%02x:%02x:%02x",
+              a->addr[0], a->addr[1], a->addr[2], a->addr[3], a->addr[4], a->addr[5] );
+    lua_createtable( L, 0, 5 );
+    lua_pushstring( L, mac );
+    lua_setfield( L, -2, "addr" );
+    lua_pushinteger( L, a->addr_type );
+    lua_setfield( L, -2, "addr_type" );
+    lua_pushinteger( L, a->type );
+    lua_setfield( L, -2, "type" );
+    lua_pushinteger( L, a->rssi );
+    lua_setfield( L, -2, "rssi" );
+    lua_pushlstring( L, (const char *)a->data, a->len );
+    lua_setfield( L, -2, "data" );
+    lua_rawseti( L, -2, i + 1 );
+  }
+  portENTER_CRITICAL( &q_mux );
+  q_head = (q_head + n) % BLE_QUEUE;
+  q_count -= n;
+  portEXIT_CRITICAL( &q_mux );
+  lua_pushinteger( L, dropped );
+  lua_call( L, 2, 0 );
+}
+
+static int hexval( int c )
+{
+  return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+         c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+}
+
+// "180f", or the 128 bit form with or without dashes, into the filter
+static bool add_uuid( const char *s )
+{
+  uint8_t b[16];
+  int n = 0;
+  for (; *s && n < 32; s++) {
+    if (*s == '-')
+      continue;
+    int v = hexval( *s );
+    if (v < 0)
+      return false;
+    if (n & 1)
+      b[n / 2] |= v;
+    else
+      b[n / 2] = v << 4;
+    n++;
+  }
+  if (*s)
+    return false;
+  if (n == 4 && filt.n16 < BLE_MAX_UUIDS) {
+    filt.uuid16[filt.n16++] = b[0] << 8 | b[1];
+    return true;
+  }
+  if (n == 32 && filt.n128 < BLE_MAX_UUIDS) {
+    // Written most significant byte first, sent least first
+    for (int i = 0; i < 16; i++)
+      filt.uuid128[filt.n128][i] = b[15 - i];
+    filt.n128++;
+    return true;
+  }
+  return false;
+}
+
+static int opt_field( lua_State *L, const char *name, int dflt )
+{
+  lua_getfield( L, 1, name );
+  int v = luaL_optinteger( L, -1, dflt );
+  lua_pop( L, 1 );
+  return v;
+}
+
+static void ble_stop_scan( lua_State *L )
+{
+  if (!scanning)
+    return;
+  scanning = false;
+  os_timer_disarm( &flush_timer );
+  ble_enable( false );
+  // Once the controller has answered, no report is being looked at
+  luaL_unref( L, LUA_REGISTRYINDEX, cb_ref );
+  cb_ref = LUA_NOREF;
+}
+
+// Lua: ble.scan( { interval=100, window=50, active=false, rssi=-128, uuids={ "180f", ... }, mfr=prefix, dedup=ms, batch=16, flush=1000 }, function(list, dropped) )
+// Scan for adverts until ble.stop(), every interval ms for window ms,
+// asking for scan responses if active. Only adverts at least rssi dBm
+// strong, with one of the service UUIDs (16 or 128 bit, in their list or
+// their service data) if any are given, and manufacturer data starting
+// with the mfr bytes (the company ID first, least significant byte first)
+// if given, are kept, and each address only once every dedup ms. The
+// function gets them batch at a time, and what there is every flush ms,
+// as a list of { addr="aa:bb:cc:dd:ee:ff", addr_type=, type=, rssi=,
+// data= }, type being the HCI advertising event type (4 for a scan
+// response) and data the raw AD structures. dropped is the number lost
+// since the last call because Lua was behind.
+static int ble_scan( lua_State *L )
+{
+  luaL_checktype( L, 1, LUA_TTABLE );
+  luaL_argcheck( L, lua_type( L, 2 ) == LUA_TFUNCTION || lua_type( L, 2 ) == LUA_TLIGHTFUNCTION, 2, "function expected" );
+  int interval = opt_field( L, "interval", 100 );
+  int window = opt_field( L, "window", 50 );
+  int rssi = opt_field( L, "rssi", -128 );
+  int dedup = opt_field( L, "dedup", 0 );
+  int batch = opt_field( L, "batch", 16 );
+  int flush = opt_field( L, "flush", 1000 );
+  lua_getfield( L, 1, "active" );
+  bool active = lua_toboolean( L, -1 );
+  lua_pop( L, 1 );
+  luaL_argcheck( L, interval >= 3 && interval <= 10240, 1, "wrong interval" );
+  luaL_argcheck( L, window >= 3 && window <= interval, 1, "wrong window" );
+  luaL_argcheck( L, rssi >= -128 && rssi <= 20, 1, "wrong rssi" );
+  luaL_argcheck( L, dedup >= 0, 1, "wrong dedup" );
+  luaL_argcheck( L, batch >= 1 && batch <= BLE_QUEUE, 1, "wrong batch" );
+  luaL_argcheck( L, flush > 0, 1, "wrong flush" );
+
+  ble_init( L );
+  ble_stop_scan( L );
+
+  memset( &filt, 0, sizeof(filt) );
+  lua_getfield( L, 1, "uuids" );
+  if (!lua_isnil( L, -1 )) {
+    luaL_argcheck( L, lua_istable( L, -1 ), 1, "uuids should be a list" );
+    for (int i = 1; ; i++) {
+      lua_rawgeti( L, -1, i );
+      if (lua_isnil( L, -1 )) {
+        lua_pop( L, 1 );
+        break;
+      }
+      const char *u = lua_tostring( L, -1 );
+      luaL_argcheck( L, u && add_uuid( u ), 1, "wrong uuid" );
+      lua_pop( L, 1 );
+    }
+  }
+  lua_pop( L, 1 );
+  lua_getfield( L, 1, "mfr" );
+  if (!lua_isnil( L, -1 )) {
+    size_t len;
+    const char *m = luaL_checklstring( L, -1, &len );
+    luaL_argcheck( L, len <= BLE_MAX_PREFIX, 1, "mfr too long" );
+    memcpy( filt.prefix, m, len );
+    filt.prefix_len = len;
+  }
+  lua_pop( L, 1 );
+  filt.rssi = rssi;
+  filt.dedup = dedup / portTICK_PERIOD_MS;
+  if (dedup && !filt.dedup)
+    filt.dedup = 1;
+  filt.batch = batch;
+  memset( seen, 0, BLE_SEEN_SLOTS * sizeof(ble_seen_t) );
+  portENTER_CRITICAL( &q_mux );
+  q_head = q_count = 0;
+  dropped_since = 0;
+  portEXIT_CRITICAL( &q_mux );
+
+  // In units of 0.625 ms; own address public, no white list
+  unsigned iv = interval * 8 / 5, wn = window * 8 / 5;
+  uint8_t p[7] = { active, iv & 0xff, iv >> 8, wn & 0xff, wn >> 8, 0, 0 };
+  if (ble_cmd( OP_LE_SET_SCAN_PARAMS, p, 7 ) != 0)
+    return luaL_error( L, "can't set scan parameters" );
+  lua_pushvalue( L, 2 );
+  cb_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  scanning = true;
+  if (ble_enable( true ) != 0) {
+    ble_stop_scan( L );
+    return luaL_error( L, "can't start scanning" );
+  }
+  os_timer_disarm( &flush_timer );
+  os_timer_setfn( &flush_timer, ble_flush_cb, NULL );
+  os_timer_arm( &flush_timer, flush, 1 );
+  return 0;
+}
+
+// Lua: ble.stop()
+// Adverts still queued are dropped.
+static int ble_stop( lua_State *L )
+{
+  ble_stop_scan( L );
+  return 0;
+}
+
+// Lua: seen, filtered, deduped, dropped = ble.stats()
+// Adverts since boot: all of them, those the filters turned away, those
+// inside their address's de-duplication window, and those lost with the
+// queue full.
+static int ble_stats( lua_State *L )
+{
+  portENTER_CRITICAL( &q_mux );
+  uint32_t s = n_seen, f = n_filtered, d = n_deduped, x = n_dropped;
+  portEXIT_CRITICAL( &q_mux );
+  lua_pushnumber( L, s );
+  lua_pushnumber( L, f );
+  lua_pushnumber( L, d );
+  lua_pushnumber( L, x );
+  return 4;
+}
+
+// Module function map
+const LUA_REG_TYPE ble_map[] = {
+  { LSTRKEY( "scan" ),  LFUNCVAL( ble_scan ) },
+  { LSTRKEY( "stop" ),  LFUNCVAL( ble_stop ) },
+  { LSTRKEY( "stats" ), LFUNCVAL( ble_stats ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_ble( lua_State *L )
+{
+  deliver_task = task_get_id( ble_deliver );
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_BLELIBNAME, ble_map );
+  return 1;
+#endif
+}
+
+#endif
@@ -0,0 +1,561 @@
+// Module for transparent bridges between a UART and a TCP client
+//
+// bridge.uart_tcp() listens on a TCP port and, while a client is
+// connected, passes bytes between it and a UART in C: what the UART
+// receives is written to the connection as lwIP's send buffer takes it,
+// and what the connection receives goes into the UART's TX queue, with
+// the TCP window held shut while that queue is full. Lua is only told of
+// clients coming and going. The uart module's "data" and "sent" callbacks
+// don't run for a bridged port.
+//
+// lwIP's callbacks and the UART's hand their work to the Lua task as a
+// set of event bits, posted once however many arrive before it runs, the
+// way net and http do; the bytes themselves never reach Lua.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "platform.h"
+#include "my_uart.h"
+#include "uart_claim.h"
+#include "ip_fmt.h"
+#include "task/task.h"
+#include "freertos/FreeRTOS.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwip/err.h"
+#include "lwip/ip_addr.h"
+#include "lwip/tcp.h"
+
+// Some LWIP macros cause complaints with ptr NULL checks, so shut them off :(
+#pragma GCC diagnostic ignored "-Waddress"
+
+#define BRIDGE_TABLE    "bridge.uart_tcp"
+#define BRIDGE_CHUNK    512   // UART bytes handed to tcp_write at a time
+#define BRIDGE_RXQ      8     // received pbufs waiting for the Lua task
+#define BRIDGE_POLL     2     // in lwIP coarse timer ticks, i.e. 1 s
+
+enum {
+  EV_ACCEPT     = 1 << 0,
+  EV_UART_RX    = 1 << 1,  // the UART has bytes for the client
+  EV_UART_TX    = 1 << 2,  // its TX queue has room again
+  EV_TCP_RX     = 1 << 3,
+  EV_TCP_SENT   = 1 << 4,
+  EV_TCP_FIN    = 1 << 5,  // the client closed its side
+  EV_TCP_ERR    = 1 << 6,  // the pcb is gone
+  EV_TIMEOUT    = 1 << 7
+};
+
+typedef struct {
+  unsigned id;
+  bool open;
+  struct tcp_pcb *listen;
+  struct tcp_pcb *volatile pcb;  // the client, NULL while there is none
+  int self_ref;
+  int cb_connect_ref;
+  int cb_disconnect_ref;
+  uart_claim_t claim;
+  volatile uint32_t events;      // EV_ bits not yet handled
+  volatile uint32_t posted;      // a task event is on its way
+  // TCP -> UART: pbufs from the recv callback, single producer and consumer
+  struct pbuf *rxq[BRIDGE_RXQ];
+  volatile uint32_t rxq_head, rxq_tail;
+  struct pbuf *rx;               // being written to the UART
+  uint16_t rx_off;
+  // UART -> TCP: read from the UART and not yet taken by tcp_write
+  uint16_t carry_len;
+  char carry[BRIDGE_CHUNK];
+  uint16_t timeout;              // s a client may idle, 0 = for ever
+  volatile uint16_t idle;
+  bool nodelay;
+  uint32_t to_tcp, to_uart, dropped, rejected;
+} bridge_t;
+
+typedef struct {
+  bridge_t *b;
+} bridge_ud_t;
+
+static bridge_t *bridges[NUM_UART];
+static task_handle_t bridge_task;
+
+static inline bool bridge_cas( volatile uint32_t *addr, uint32_t expect, uint32_t set )
+{
+  uxPortCompareSet( addr, expect, &set );
+  return set == expect;
+}
+
+// From lwIP's thread, uart_task or the TX interrupt
+static void bridge_post( bridge_t *b, uint32_t ev )
+{
+  uint32_t v;
+  do {
+    v = b->events;
+  } while (!bridge_cas( &b->events, v, v | ev ));
+  if (bridge_cas( &b->posted, 0, 1 ) && !task_post_medium( bridge_task, b->id ))
+    b->posted = 0;  // the next event tries again
+}
+
+// --- UART callbacks
+
+static void bridge_uart_rx( unsigned id, void *arg )
+{
+  bridge_post( (bridge_t *)arg, EV_UART_RX );
+}
+
+static void bridge_uart_tx( unsigned id, void *arg )
+{
+  bridge_post( (bridge_t *)arg, EV_UART_TX );
+}
+
+// --- LWIP callbacks
+
+static void bridge_err_cb( void *arg, err_t err )
+{
+  bridge_t *b = (bridge_t *)arg;
+  if (!b)
+    return;
+  b->pcb = NULL;  // Will be freed at LWIP level
+  bridge_post( b, EV_TCP_ERR );
+}
+
+static err_t bridge_recv_cb( void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err )
+{
+  bridge_t *b = (bridge_t *)arg;
+  if (!b) {
+    if (p) {
+      tcp_recved( tpcb, p->tot_len );
+      pbuf_free( p );
+    }
+    return ERR_OK;
+  }
+  b->idle = 0;
+  if (!p) {
+    bridge_post( b, EV_TCP_FIN );
+    return ERR_OK;
+  }
+  if (b->rxq_head - b->rxq_tail == BRIDGE_RXQ)
+    return ERR_MEM;  // lwIP holds on to the data and offers it again later
+  b->rxq[b->rxq_head % BRIDGE_RXQ] = p;
+  b->rxq_head++;
+  bridge_post( b, EV_TCP_RX );
+  return ERR_OK;
+}
+
+static err_t bridge_sent_cb( void *arg, struct tcp_pcb *tpcb, u16_t len )
+{
+  bridge_t *b = (bridge_t *)arg;
+  if (!b)
+    return ERR_OK;
+  b->idle = 0;
+  bridge_post( b, EV_TCP_SENT );
+  return ERR_OK;
+}
+
+static err_t bridge_poll_cb( void *arg, struct tcp_pcb *tpcb )
+{
+  bridge_t *b = (bridge_t *)arg;
+  if (b && b->timeout && ++b->idle == b->timeout)
+    bridge_post( b, EV_TIMEOUT );
+  return ERR_OK;
+}
+
+static err_t bridge_accept_cb( void *arg, struct tcp_pcb *newpcb, err_t err )
+{
+  bridge_t *b = (bridge_t *)arg;
+  // Anything but ERR_OK has lwIP abort the new connection
+  if (!b || !b->open || err != ERR_OK)
+    return ERR_VAL;
+  tcp_accepted( b->listen );
+  if (b->pcb || (b->events & (EV_ACCEPT | EV_TCP_ERR))) {
+    b->rejected++;  // one client at a time
+    return ERR_MEM;
+  }
+  b->idle = 0;
+  tcp_arg( newpcb, b );
+  tcp_err( newpcb, bridge_err_cb );
+  tcp_recv( newpcb, bridge_recv_cb );
+  tcp_sent( newpcb, bridge_sent_cb );
+  if (b->timeout)
+    tcp_poll( newpcb, bridge_poll_cb, BRIDGE_POLL );
+  if (b->nodelay)
+    tcp_nagle_disable( newpcb );
+  b->pcb = newpcb;
+  bridge_post( b, EV_ACCEPT );
+  return ERR_OK;
+}
+
+// --- Data
+
+// Received data not yet written to the UART, all of it
+static void bridge_rx_free( bridge_t *b )
+{
+  if (b->rx)
+    pbuf_free( b->rx );
+  b->rx = NULL;
+  b->rx_off = 0;
+  while (b->rxq_tail != b->rxq_head) {
+    pbuf_free( b->rxq[b->rxq_tail % BRIDGE_RXQ] );
+    b->rxq_tail++;
+  }
+}
+
+// Client to UART, as far as the TX queue takes it
+static void bridge_to_uart( bridge_t *b )
+{
+  while (b->rxq_tail != b->rxq_head) {
+    struct pbuf *p = b->rxq[b->rxq_tail % BRIDGE_RXQ];
+    b->rxq_tail++;
+    if (b->rx)
+      pbuf_cat( b->rx, p );
+    else
+      b->rx = p;
+  }
+  uint32_t done = 0;
+  struct pbuf *q;
+  while ((q = b->rx)) {
+    size_t n = uart_tx_write( b->id, (const uint8_t *)q->payload + b->rx_off, q->len - b->rx_off );
+    b->rx_off += n;
+    done += n;
+    if (b->rx_off < q->len)
+      break;  // the queue is full, bridge_uart_tx gets us going again
+    // pbuf_dechain drops the chain's hold on the rest, so take our own
+    b->rx = q->next;
+    if (b->rx)
+      pbuf_ref( b->rx );
+    pbuf_dechain( q );
+    pbuf_free( q );
+    b->rx_off = 0;
+  }
+  b->to_uart += done;
+  // Opens the window again for what has gone to the UART
+  while (done && b->pcb) {
+    u16_t n = done > 0xffff ? 0xffff : done;
+    tcp_recved( b->pcb, n );
+    done -= n;
+  }
+}
+
+// UART to client, as far as lwIP's send buffer takes it. Without a client
+// the UART's input is thrown away, so a new one doesn't get stale bytes.
+static void bridge_to_tcp( bridge_t *b )
+{
+  struct tcp_pcb *pcb = b->pcb;
+  if (!pcb) {
+    size_t n;
+    while ((n = uart_rx_read( b->id, (uint8_t *)b->carry, sizeof(b->carry) )) > 0)
+      b->dropped += n;
+    b->carry_len = 0;
+    return;
+  }
+  bool wrote = false;
+  for (;;) {
+    if (!b->carry_len) {
+      u16_t room = tcp_sndbuf( pcb );
+      if (room == 0)
+        break;
+      b->carry_len = uart_rx_read( b->id, (uint8_t *)b->carry,
+                                   room < sizeof(b->carry) ? room : sizeof(b->carry) );
+      if (!b->carry_len)
+        break;
+    }
+    if (tcp_sndbuf( pcb ) < b->carry_len ||
+        tcp_write( pcb, b->carry, b->carry_len, TCP_WRITE_FLAG_COPY ) != ERR_OK)
+      break;  // kept in carry, the sent callback tries again
+    b->to_tcp += b->carry_len;
+    b->carry_len = 0;
+    wrote = true;
+  }
+  if (wrote)
+    tcp_output( pcb );
+}
+
+// --- Lua task
+
+static void bridge_drop_client( bridge_t *b, bool abort )
+{
+  struct tcp_pcb *pcb = b->pcb;
+  b->pcb = NULL;
+  if (pcb) {
+    tcp_arg( pcb, NULL );
+    tcp_err( pcb, NULL );
+    tcp_recv( pcb, NULL );
+    tcp_sent( pcb, NULL );
+    tcp_poll( pcb, NULL, 0 );
+    if (abort || tcp_close( pcb ) != ERR_OK)
+      tcp_abort( pcb );
+  }
+  bridge_rx_free( b );
+  b->carry_len = 0;
+}
+
+static void bridge_told( lua_State *L, bridge_t *b, int ref, int nargs )
+{
+  if (ref == LUA_NOREF) {
+    lua_pop( L, nargs );
+    return;
+  }
+  lua_rawgeti( L, LUA_REGISTRYINDEX, ref );
+  lua_insert( L, -1 - nargs );
+  lua_rawgeti( L, LUA_REGISTRYINDEX, b->self_ref );
+  lua_insert( L, -1 - nargs );
+  lua_call( L, 1 + nargs, 0 );
+}
+
+static void bridge_disconnected( lua_State *L, bridge_t *b, const char *why, bool abort )
+{
+  bridge_drop_client( b, abort );
+  lua_pushstring( L, why );
+  bridge_told( L, b, b->cb_disconnect_ref, 1 );
+}
+
+static void bridge_handle_event( task_param_t param, task_prio_t prio )
+{
+  bridge_t *b = bridges[param];
+  (void)prio;
+  if (!b)
+    return;
+  b->posted = 0;
+  uint32_t ev;
+  do {
+    ev = b->events;
+  } while (!bridge_cas( &b->events, ev, 0 ));
+  if (!b->open)
+    return;
+
+  lua_State *L = lua_getstate();
+  if (ev & EV_ACCEPT) {
+    struct tcp_pcb *pcb = b->pcb;
+    if (pcb) {
+      char ip[IP_STR_SZ];
+      ipstr( ip, &pcb->remote_ip );
+      lua_pushstring( L, ip );
+      lua_pushinteger( L, pcb->remote_port );
+      bridge_told( L, b, b->cb_connect_ref, 2 );
+    }
+    ev |= EV_UART_RX;  // whatever came in meanwhile
+  }
+  if (!b->open)
+    return;  // the callback closed the bridge
+  if (ev & EV_TCP_ERR) {
+    b->pcb = NULL;
+    bridge_disconnected( L, b, "reset", false );
+  } else if (ev & EV_TIMEOUT && b->pcb && b->idle >= b->timeout) {
+    bridge_disconnected( L, b, "timeout", true );
+  } else {
+    if (ev & (EV_TCP_RX | EV_UART_TX))
+      bridge_to_uart( b );
+    if (ev & EV_TCP_FIN && b->pcb) {
+      bridge_to_uart( b );
+      bridge_disconnected( L, b, "closed", false );
+    }
+  }
+  if (b->open && ev & (EV_UART_RX | EV_TCP_SENT | EV_ACCEPT | EV_TCP_ERR | EV_TIMEOUT))
+    bridge_to_tcp( b );
+}
+
+// --- Lua API
+
+static bridge_t *bridge_check( lua_State *L )
+{
+  bridge_ud_t *ud = (bridge_ud_t *)luaL_checkudata( L, 1, BRIDGE_TABLE );
+  if (!ud->b)
+    luaL_error( L, "bridge is closed" );
+  return ud->b;
+}
+
+static void bridge_free( lua_State *L, bridge_ud_t *ud )
+{
+  bridge_t *b = ud->b;
+  if (!b)
+    return;
+  ud->b = NULL;
+  b->open = false;
+  if (b->listen) {
+    tcp_arg( b->listen, NULL );
+    tcp_close( b->listen );
+    b->listen = NULL;
+  }
+  bridge_drop_client( b, true );
+  uart_claim( b->id, NULL );
+  bridges[b->id] = NULL;
+  luaL_unref( L, LUA_REGISTRYINDEX, b->cb_connect_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, b->cb_disconnect_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, b->self_ref );
+  // An event may still be queued for it; bridge_handle_event finds the
+  // slot empty. lwIP calls in flight see a NULL arg from here on.
+  free( b );
+}
+
+// Lua: b = bridge.uart_tcp( id, port[, { addr = ip, timeout = s, nodelay = b }] )
+// Listens on port for one client at a time and bridges it to UART id,
+// which uart.setup() has set up. More clients are refused while one is
+// connected. timeout drops a client after that many seconds without
+// traffic either way; nodelay, on by default, sends UART data without
+// waiting for the client's acknowledgements to gather it up. UART0 is the
+// console and can't be bridged.
+static int bridge_uart_tcp( lua_State *L )
+{
+  unsigned id = luaL_checkinteger( L, 1 );
+  MOD_CHECK_ID( uart, id );
+  if (id == 0)
+    return luaL_error( L, "uart 0 is the console" );
+  int port = luaL_checkinteger( L, 2 );
+  luaL_argcheck( L, port > 0 && port <= 0xffff, 2, "invalid port" );
+  const char *addr_s = "0.0.0.0";
+  int timeout = 0;
+  bool nodelay = true;
+  if (lua_istable( L, 3 )) {
+    lua_getfield( L, 3, "addr" );
+    addr_s = luaL_optstring( L, -1, addr_s );
+    lua_getfield( L, 3, "timeout" );
+    timeout = luaL_optinteger( L, -1, 0 );
+    lua_getfield( L, 3, "nodelay" );
+    nodelay = lua_isnil( L, -1 ) || lua_toboolean( L, -1 );
+    lua_pop( L, 3 );  // addr stays referenced by the table
+  }
+  luaL_argcheck( L, timeout >= 0 && timeout <= 0xffff, 3, "invalid timeout" );
+  ip_addr_t addr;
+  if (!ipaddr_aton( addr_s, &addr ))
+    return luaL_error( L, "invalid IP address" );
+  if (bridges[id])
+    return luaL_error( L, "uart %d is already bridged", id );
+
+  bridge_ud_t *ud = (bridge_ud_t *)lua_newuserdata( L, sizeof(bridge_ud_t) );
+  ud->b = NULL;
+  luaL_getmetatable( L, BRIDGE_TABLE );
+  lua_setmetatable( L, -2 );
+  bridge_t *b = (bridge_t *)calloc( 1, sizeof(bridge_t) );
+  if (!b)
+    return luaL_error( L, "out of memory" );
+  b->id = id;
+  b->timeout = timeout;
+  b->nodelay = nodelay;
+  b->self_ref = b->cb_connect_ref = b->cb_disconnect_ref = LUA_NOREF;
+  b->claim.rx_ready = bridge_uart_rx;
+  b->claim.tx_done = bridge_uart_tx;
+  b->claim.arg = b;
+  if (!uart_claim( id, &b->claim )) {
+    free( b );
+    return luaL_error( L, "uart %d is taken", id );
+  }
+  ud->b = b;
+  bridges[id] = b;
+
+  struct tcp_pcb *pcb = tcp_new();
+  if (!pcb) {
+    bridge_free( L, ud );
+    return luaL_error( L, "cannot allocate PCB" );
+  }
+  if (tcp_bind( pcb, &addr, port ) != ERR_OK) {
+    tcp_close( pcb );
+    bridge_free( L, ud );
+    return luaL_error( L, "cannot bind to port %d", port );
+  }
+  struct tcp_pcb *lpcb = tcp_listen_with_backlog( pcb, 1 );
+  if (!lpcb) {
+    tcp_close( pcb );
+    bridge_free( L, ud );
+    return luaL_error( L, "out of memory" );
+  }
+  b->listen = lpcb;
+  b->open = true;
+  lua_pushvalue( L, -1 );
+  b->self_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  tcp_arg( lpcb, b );
+  tcp_accept( lpcb, bridge_accept_cb );
+  bridge_to_tcp( b );  // clears out what the UART had before
+  return 1;
+}
+
+// Lua: b:on( "connection", function( b, ip, port ) )
+//      b:on( "disconnection", function( b, reason ) )
+// reason is "closed" by the client, "reset" or "timeout"
+static int bridge_on( lua_State *L )
+{
+  bridge_t *b = bridge_check( L );
+  static const char * const names[] = { "connection", "disconnection", NULL };
+  int which = luaL_checkoption( L, 2, NULL, names );
+  int *ref = which == 0 ? &b->cb_connect_ref : &b->cb_disconnect_ref;
+  luaL_unref( L, LUA_REGISTRYINDEX, *ref );
+  *ref = LUA_NOREF;
+  if (!lua_isnoneornil( L, 3 )) {
+    luaL_checkanyfunction( L, 3 );
+    lua_pushvalue( L, 3 );
+    *ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  return 0;
+}
+
+// Lua: stats = b:stats()
+// Bytes passed each way, UART bytes thrown away for lack of a client,
+// clients refused, and whether one is connected
+static int bridge_stats( lua_State *L )
+{
+  bridge_t *b = bridge_check( L );
+  lua_createtable( L, 0, 5 );
+  lua_pushinteger( L, b->to_tcp );
+  lua_setfield( L, -2, "to_tcp" );
+  lua_pushinteger( L, b->to_uart );
+  lua_setfield( L, -2, "to_uart" );
+  lua_pushinteger( L, b->dropped );
+  lua_setfield( L, -2, "dropped" );
+  lua_pushinteger( L, b->rejected );
+  lua_setfield( L, -2, "rejected" );
+  lua_pushboolean( L, b->pcb != NULL );
+  lua_setfield( L, -2, "connected" );
+  return 1;
+}
+
+// Lua: b:kick()
+// Drops the client, if there is one; the bridge goes on listening
+static int bridge_kick( lua_State *L )
+{
+  bridge_t *b = bridge_check( L );
+  if (b->pcb)
+    bridge_disconnected( L, b, "closed", false );
+  return 0;
+}
+
+// Lua: b:close()
+// Drops the client and stops listening; the UART goes back to the uart
+// module's callbacks
+static int bridge_close( lua_State *L )
+{
+  bridge_ud_t *ud = (bridge_ud_t *)luaL_checkudata( L, 1, BRIDGE_TABLE );
+  bridge_free( L, ud );
+  return 0;
+}
+
+static const LUA_REG_TYPE bridge_obj_map[] = {
+  { LSTRKEY( "on" ),      LFUNCVAL( bridge_on ) },
+  { LSTRKEY( "stats" ),   LFUNCVAL( bridge_stats ) },
+  { LSTRKEY( "kick" ),    LFUNCVAL( bridge_kick ) },
+  { LSTRKEY( "close" ),   LFUNCVAL( bridge_close ) },
+  { LSTRKEY( "__gc" ),    LFUNCVAL( bridge_close ) },
+  { LSTRKEY( "__index" ), LROVAL( bridge_obj_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+// Module function map
+const LUA_REG_TYPE bridge_map[] = {
+  { LSTRKEY( "uart_tcp" ), LFUNCVAL( bridge_uart_tcp ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_bridge( lua_State *L )
+{
+  luaL_rometatable( L, BRIDGE_TABLE, (void *)bridge_obj_map );
+  bridge_task = task_get_id( bridge_handle_event );
+  // The uart module hooks the driver's callbacks that claims go through
+  luaR_getglobal( L, LUA_UARTLIBNAME, strlen(LUA_UARTLIBNAME) );
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_BRIDGELIBNAME, bridge_map );
+  return 1;
+#endif
+}
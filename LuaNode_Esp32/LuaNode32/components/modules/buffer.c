@@ -0,0 +1,581 @@
+// Module for mutable byte buffers and binary packing
+//
+// Building a packet with string.char, string.byte and .. interns a new
+// string at every step. A buffer is one fixed-size userdata that is read
+// and written in place; net, file, uart, mqtt, i2c and spi take it wherever
+// they take a string, and net, uart and mqtt hand received data over in
+// one when asked to. buf:slice() cuts out a part that shares the bytes, so
+// data goes from one module to the next without being copied by Lua.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "buffer.h"
+#include <string.h>
+
+static lbuffer_t *buffer_test( lua_State *L, int idx )
+{
+  lbuffer_t *b = (lbuffer_t *)lua_touserdata( L, idx );
+  if (b == NULL || !lua_getmetatable( L, idx ))
+    return NULL;
+  luaL_getmetatable( L, BUFFER_TABLE );
+  int same = lua_rawequal( L, -1, -2 );
+  lua_pop( L, 2 );
+  return same ? b : NULL;
+}
+
+const char *buffer_tolstring( lua_State *L, int idx, size_t *len )
+{
+  lbuffer_t *b = buffer_test( L, idx );
+  luaL_StrBuilder *sb;
+  if (b) {
+    *len = b->len;
+    return (const char *)b->data;
+  }
+  if ((sb = luaL_testbuilder( L, idx )) != NULL) {
+    *len = sb->n;
+    return sb->b ? sb->b : "";
+  }
+  if (lua_type( L, idx ) == LUA_TSTRING || lua_type( L, idx ) == LUA_TNUMBER)
+    return lua_tolstring( L, idx, len );
+  return NULL;
+}
+
+const char *buffer_checklstring( lua_State *L, int idx, size_t *len )
+{
+  lbuffer_t *b = buffer_test( L, idx );
+  luaL_StrBuilder *sb;
+  if (b) {
+    *len = b->len;
+    return (const char *)b->data;
+  }
+  if ((sb = luaL_testbuilder( L, idx )) != NULL) {
+    *len = sb->n;
+    return sb->b ? sb->b : "";
+  }
+  return luaL_checklstring( L, idx, len );
+}
+
+lbuffer_t *buffer_check( lua_State *L, int idx )
+{
+  return (lbuffer_t *)luaL_checkudata( L, idx, BUFFER_TABLE );
+}
+
+lbuffer_t *buffer_push( lua_State *L, size_t len )
+{
+  lbuffer_t *b = (lbuffer_t *)lua_newuserdata( L, sizeof(lbuffer_t) + len );
+  b->len = len;
+  b->data = (uint8_t *)(b + 1);
+  luaL_getmetatable( L, BUFFER_TABLE );
+  lua_setmetatable( L, -2 );
+  return b;
+}
+
+lbuffer_t *buffer_push_slice( lua_State *L, int idx, size_t off, size_t len )
+{
+  lbuffer_t *src = buffer_check( L, idx );
+  if (idx < 0)
+    idx = lua_gettop( L ) + idx + 1;
+  lbuffer_t *b = (lbuffer_t *)lua_newuserdata( L, sizeof(lbuffer_t) );
+  b->len = len;
+  b->data = src->data + off;
+  luaL_getmetatable( L, BUFFER_TABLE );
+  lua_setmetatable( L, -2 );
+  // The environment holds the buffer owning the bytes; a slice of a slice
+  // shares its source's, so they don't chain
+  if (src->data != (uint8_t *)(src + 1)) {
+    lua_getfenv( L, idx );
+  } else {
+    lua_createtable( L, 1, 0 );
+    lua_pushvalue( L, idx );
+    lua_rawseti( L, -2, 1 );
+  }
+  lua_setfenv( L, -2 );
+  return b;
+}
+
+// 1-based position of n bytes at argument idx, as an offset
+static size_t buffer_pos( lua_State *L, lbuffer_t *b, int idx, size_t n )
+{
+  int pos = luaL_checkinteger( L, idx );
+  luaL_argcheck( L, pos >= 1 && (size_t)pos - 1 + n <= b->len, idx, "out of range" );
+  return pos - 1;
+}
+
+/*
+** Scalars. Values are encoded a byte at a time, so positions need no
+** alignment and the host byte order does not matter.
+*/
+static void put_uint( uint8_t *p, uint32_t v, int size, bool big )
+{
+  for (int i = 0; i < size; i++) {
+    int shift = 8 * (big ? size - 1 - i : i);
+    p[i] = (uint8_t)(v >> shift);
+  }
+}
+
+static uint32_t get_uint( const uint8_t *p, int size, bool big )
+{
+  uint32_t v = 0;
+  for (int i = 0; i < size; i++) {
+    int shift = 8 * (big ? size - 1 - i : i);
+    v |= (uint32_t)p[i] << shift;
+  }
+  return v;
+}
+
+static void put_float( uint8_t *p, float f, bool big )
+{
+  uint32_t v;
+  memcpy( &v, &f, 4 );
+  put_uint( p, v, 4, big );
+}
+
+static float get_float( const uint8_t *p, bool big )
+{
+  uint32_t v = get_uint( p, 4, big );
+  float f;
+  memcpy( &f, &v, 4 );
+  return f;
+}
+
+static void put_double( uint8_t *p, double d, bool big )
+{
+  uint32_t w[2];
+  memcpy( w, &d, 8 );   // little endian host: w[0] is the low word
+  put_uint( p + (big ? 4 : 0), w[0], 4, big );
+  put_uint( p + (big ? 0 : 4), w[1], 4, big );
+}
+
+static double get_double( const uint8_t *p, bool big )
+{
+  uint32_t w[2];
+  w[0] = get_uint( p + (big ? 4 : 0), 4, big );
+  w[1] = get_uint( p + (big ? 0 : 4), 4, big );
+  double d;
+  memcpy( &d, w, 8 );
+  return d;
+}
+
+static uint32_t checkuint( lua_State *L, int idx )
+{
+  lua_Number n = luaL_checknumber( L, idx );
+  return n < 0 ? (uint32_t)(int32_t)n : (uint32_t)n;
+}
+
+/*
+** Pack formats, as in struct.pack:
+**   < little endian (default)   > big endian   = native (little)
+**   b B  signed / unsigned byte     h H  16 bits     i I  32 bits
+**   f d  float / double             x    a zero byte, nothing unpacked
+**   cN   string of N bytes, zero padded when shorter
+**   sN   string after an N byte length (N is 1, 2 or 4, default 1)
+**   z    zero terminated string
+** Spaces are ignored.
+*/
+static int fmt_count( const char **fmt, int dflt )
+{
+  if (**fmt < '0' || **fmt > '9')
+    return dflt;
+  int n = 0;
+  while (**fmt >= '0' && **fmt <= '9')
+    n = n * 10 + *(*fmt)++ - '0';
+  return n;
+}
+
+static int fmt_size( lua_State *L, char c, const char **fmt, int *n )
+{
+  switch (c) {
+    case 'b': case 'B': case 'x': return 1;
+    case 'h': case 'H': return 2;
+    case 'i': case 'I': case 'f': return 4;
+    case 'd': return 8;
+    case 'c': *n = fmt_count( fmt, -1 );
+              if (*n < 0) luaL_error( L, "missing size for 'c'" );
+              return 0;
+    case 's': *n = fmt_count( fmt, 1 );
+              if (*n != 1 && *n != 2 && *n != 4) luaL_error( L, "invalid size for 's'" );
+              return 0;
+    case 'z': return 0;
+    default: return luaL_error( L, "invalid format option '%c'", c );
+  }
+}
+
+// Bytes fmt packs the values from argument arg into; validates them
+static size_t pack_size( lua_State *L, const char *fmt, int arg )
+{
+  size_t total = 0;
+  int n;
+  char c;
+  while ((c = *fmt++) != '\0') {
+    if (c == ' ' || c == '<' || c == '>' || c == '=')
+      continue;
+    int size = fmt_size( L, c, &fmt, &n );
+    size_t len;
+    if (c == 'x') {
+      total += 1;
+      continue;
+    }
+    if (size) {
+      luaL_checknumber( L, arg++ );
+      total += size;
+    } else if (c == 'c') {
+      buffer_checklstring( L, arg++, &len );
+      total += n;
+    } else if (c == 's') {
+      buffer_checklstring( L, arg++, &len );
+      luaL_argcheck( L, n == 4 || len < (1u << (8 * n)), arg - 1, "string too long" );
+      total += n + len;
+    } else {  // 'z'
+      const char *s = buffer_checklstring( L, arg++, &len );
+      luaL_argcheck( L, memchr( s, 0, len ) == NULL, arg - 1, "string contains zeros" );
+      total += len + 1;
+    }
+  }
+  return total;
+}
+
+static void pack_into( lua_State *L, uint8_t *p, const char *fmt, int arg )
+{
+  bool big = false;
+  int n;
+  char c;
+  while ((c = *fmt++) != '\0') {
+    switch (c) {
+      case ' ': break;
+      case '<': case '=': big = false; break;
+      case '>': big = true; break;
+      default: {
+        int size = fmt_size( L, c, &fmt, &n );
+        size_t len;
+        const char *s;
+        switch (c) {
+          case 'x': *p = 0; break;
+          case 'f': put_float( p, (float)luaL_checknumber( L, arg++ ), big ); break;
+          case 'd': put_double( p, (double)luaL_checknumber( L, arg++ ), big ); break;
+          case 'c':
+            s = buffer_checklstring( L, arg++, &len );
+            if (len > (size_t)n)
+              len = n;
+            memcpy( p, s, len );
+            memset( p + len, 0, n - len );
+            p += n;
+            break;
+          case 's':
+            s = buffer_checklstring( L, arg++, &len );
+            put_uint( p, len, n, big );
+            memcpy( p + n, s, len );
+            p += n + len;
+            break;
+          case 'z':
+            s = buffer_checklstring( L, arg++, &len );
+            memcpy( p, s, len );
+            p[len] = 0;
+            p += len + 1;
+            break;
+          default: put_uint( p, checkuint( L, arg++ ), size, big ); break;
+        }
+        p += size;
+      }
+    }
+  }
+}
+
+// Pushes the values fmt reads from data[pos..len); returns how many
+static int unpack_from( lua_State *L, const uint8_t *data, size_t len, size_t pos, const char *fmt )
+{
+  bool big = false;
+  int n, nres = 0;
+  char c;
+  while ((c = *fmt++) != '\0') {
+    switch (c) {
+      case ' ': continue;
+      case '<': case '=': big = false; continue;
+      case '>': big = true; continue;
+    }
+    int size = fmt_size( L, c, &fmt, &n );
+    size_t need = size ? size : (c == 'c' ? (size_t)n : (c == 's' ? (size_t)n : 0));
+    if (pos + need > len)
+      return luaL_error( L, "data too short" );
+    const uint8_t *p = data + pos;
+    luaL_checkstack( L, 2, "too many results" );
+    switch (c) {
+      case 'x': break;
+      case 'b': lua_pushinteger( L, (int8_t)*p ); break;
+      case 'B': lua_pushinteger( L, *p ); break;
+      case 'h': lua_pushinteger( L, (int16_t)get_uint( p, 2, big ) ); break;
+      case 'H': lua_pushinteger( L, get_uint( p, 2, big ) ); break;
+      case 'i': lua_pushnumber( L, (int32_t)get_uint( p, 4, big ) ); break;
+      case 'I': lua_pushnumber( L, get_uint( p, 4, big ) ); break;
+      case 'f': lua_pushnumber( L, get_float( p, big ) ); break;
+      case 'd': lua_pushnumber( L, get_double( p, big ) ); break;
+      case 'c': lua_pushlstring( L, (const char *)p, n ); break;
+      case 's': {
+        size_t l = get_uint( p, n, big );
+        if (pos + n + l > len)
+          return luaL_error( L, "data too short" );
+        lua_pushlstring( L, (const char *)p + n, l );
+        need += l;
+        break;
+      }
+      case 'z': {
+        const uint8_t *e = memchr( p, 0, len - pos );
+        if (e == NULL)
+          return luaL_error( L, "unfinished string for 'z'" );
+        lua_pushlstring( L, (const char *)p, e - p );
+        need = e - p + 1;
+        break;
+      }
+    }
+    if (c != 'x')
+      nres++;
+    pos += need;
+  }
+  lua_pushinteger( L, pos + 1 );
+  return nres + 1;
+}
+
+// Lua: buf = buffer.new( size[, fill] ) or buffer.new( string )
+static int buffer_new( lua_State *L )
+{
+  if (lua_type( L, 1 ) == LUA_TSTRING || buffer_test( L, 1 )) {
+    size_t len;
+    const char *s = buffer_checklstring( L, 1, &len );
+    lbuffer_t *b = buffer_push( L, len );
+    memcpy( b->data, s, len );
+    return 1;
+  }
+  int size = luaL_checkinteger( L, 1 );
+  int fill = luaL_optint( L, 2, 0 );
+  luaL_argcheck( L, size >= 0, 1, "negative size" );
+  lbuffer_t *b = buffer_push( L, size );
+  memset( b->data, fill, size );
+  return 1;
+}
+
+// Lua: buf = buffer.pack( fmt, ... )
+static int buffer_pack( lua_State *L )
+{
+  const char *fmt = luaL_checkstring( L, 1 );
+  lbuffer_t *b = buffer_push( L, pack_size( L, fmt, 2 ) );
+  pack_into( L, b->data, fmt, 2 );
+  return 1;
+}
+
+// Lua: ..., nextpos = buffer.unpack( fmt, data[, pos] )
+// data is a string or a buffer.
+static int buffer_unpack( lua_State *L )
+{
+  const char *fmt = luaL_checkstring( L, 1 );
+  size_t len;
+  const char *data = buffer_checklstring( L, 2, &len );
+  int pos = luaL_optint( L, 3, 1 );
+  luaL_argcheck( L, pos >= 1 && (size_t)pos <= len + 1, 3, "out of range" );
+  return unpack_from( L, (const uint8_t *)data, len, pos - 1, fmt );
+}
+
+// Lua: nextpos = buf:pack( pos, fmt, ... )
+static int buffer_packat( lua_State *L )
+{
+  lbuffer_t *b = buffer_check( L, 1 );
+  const char *fmt = luaL_checkstring( L, 3 );
+  size_t n = pack_size( L, fmt, 4 );
+  size_t off = buffer_pos( L, b, 2, n );
+  pack_into( L, b->data + off, fmt, 4 );
+  lua_pushinteger( L, off + n + 1 );
+  return 1;
+}
+
+// Lua: ..., nextpos = buf:unpack( fmt[, pos] )
+static int buffer_unpackat( lua_State *L )
+{
+  lbuffer_t *b = buffer_check( L, 1 );
+  const char *fmt = luaL_checkstring( L, 2 );
+  int pos = luaL_optint( L, 3, 1 );
+  luaL_argcheck( L, pos >= 1 && (size_t)pos <= b->len + 1, 3, "out of range" );
+  return unpack_from( L, b->data, b->len, pos - 1, fmt );
+}
+
+// Lua: v = buf:getu16( pos[, bigendian] ), buf:setu16( pos, v[, bigendian] )
+// and the same for u8, i8, i16, u32, i32, float and double
+#define BUFFER_INT(name, size, ctype) \
+static int buffer_get##name( lua_State *L ) \
+{ \
+  lbuffer_t *b = buffer_check( L, 1 ); \
+  size_t off = buffer_pos( L, b, 2, size ); \
+  lua_pushnumber( L, (ctype)get_uint( b->data + off, size, lua_toboolean( L, 3 ) ) ); \
+  return 1; \
+} \
+static int buffer_set##name( lua_State *L ) \
+{ \
+  lbuffer_t *b = buffer_check( L, 1 ); \
+  size_t off = buffer_pos( L, b, 2, size ); \
+  put_uint( b->data + off, checkuint( L, 3 ), size, lua_toboolean( L, 4 ) ); \
+  return 0; \
+}
+
+BUFFER_INT(u8, 1, uint8_t)
+BUFFER_INT(i8, 1, int8_t)
+BUFFER_INT(u16, 2, uint16_t)
+BUFFER_INT(i16, 2, int16_t)
+BUFFER_INT(u32, 4, uint32_t)
+BUFFER_INT(i32, 4, int32_t)
+
+static int buffer_getfloat( lua_State *L )
+{
+  lbuffer_t *b = buffer_check( L, 1 );
+  size_t off = buffer_pos( L, b, 2, 4 );
+  lua_pushnumber( L, get_float( b->data + off, lua_toboolean( L, 3 ) ) );
+  return 1;
+}
+
+static int buffer_setfloat( lua_State *L )
+{
+  lbuffer_t *b = buffer_check( L, 1 );
+  size_t off = buffer_pos( L, b, 2, 4 );
+  put_float( b->data + off, (float)luaL_checknumber( L, 3 ), lua_toboolean( L, 4 ) );
+  return 0;
+}
+
+static int buffer_getdouble( lua_State *L )
+{
+  lbuffer_t *b = buffer_check( L, 1 );
+  size_t off = buffer_pos( L, b, 2, 8 );
+  lua_pushnumber( L, get_double( b->data + off, lua_toboolean( L, 3 ) ) );
+  return 1;
+}
+
+static int buffer_setdouble( lua_State *L )
+{
+  lbuffer_t *b = buffer_check( L, 1 );
+  size_t off = buffer_pos( L, b, 2, 8 );
+  put_double( b->data + off, (double)luaL_checknumber( L, 3 ), lua_toboolean( L, 4 ) );
+  return 0;
+}
+
+// Lua: buf:write( pos, data ) -- copies a string or buffer in at pos
+static int buffer_write( lua_State *L )
+{
+  lbuffer_t *b = buffer_check( L, 1 );
+  size_t len;
+  const char *s = buffer_checklstring( L, 3, &len );
+  size_t off = buffer_pos( L, b, 2, len );
+  memmove( b->data + off, s, len );
+  return 0;
+}
+
+// 1-based, inclusive range i..j of the buffer; negative counts from the end
+static bool buffer_range( lua_State *L, lbuffer_t *b, int arg, size_t *off, size_t *n )
+{
+  int len = (int)b->len;
+  int i = luaL_optint( L, arg, 1 );
+  int j = luaL_optint( L, arg + 1, -1 );
+  if (i < 0) i += len + 1;
+  if (j < 0) j += len + 1;
+  if (i < 1) i = 1;
+  if (j > len) j = len;
+  if (i > j)
+    return false;
+  *off = i - 1;
+  *n = j - i + 1;
+  return true;
+}
+
+// Lua: s = buf:sub( [i[, j]] ) -- a string of bytes i..j, like string.sub
+static int buffer_sub( lua_State *L )
+{
+  lbuffer_t *b = buffer_check( L, 1 );
+  size_t off, n;
+  if (buffer_range( L, b, 2, &off, &n ))
+    lua_pushlstring( L, (const char *)b->data + off, n );
+  else
+    lua_pushliteral( L, "" );
+  return 1;
+}
+
+// Lua: s = buf:slice( [i[, j]] ) -- bytes i..j as a buffer sharing them;
+// writing to either changes both
+static int buffer_slice( lua_State *L )
+{
+  lbuffer_t *b = buffer_check( L, 1 );
+  size_t off, n;
+  if (!buffer_range( L, b, 2, &off, &n ))
+    off = n = 0;
+  buffer_push_slice( L, 1, off, n );
+  return 1;
+}
+
+// Lua: buf:fill( byte[, i[, j]] )
+static int buffer_fill( lua_State *L )
+{
+  lbuffer_t *b = buffer_check( L, 1 );
+  int v = luaL_checkinteger( L, 2 );
+  size_t off, n;
+  if (buffer_range( L, b, 3, &off, &n ))
+    memset( b->data + off, v, n );
+  return 0;
+}
+
+static int buffer_len( lua_State *L )
+{
+  lua_pushinteger( L, buffer_check( L, 1 )->len );
+  return 1;
+}
+
+static int buffer_tostring( lua_State *L )
+{
+  lbuffer_t *b = buffer_check( L, 1 );
+  lua_pushlstring( L, (const char *)b->data, b->len );
+  return 1;
+}
+
+static const LUA_REG_TYPE buffer_buf_map[] = {
+  { LSTRKEY( "pack" ),      LFUNCVAL( buffer_packat ) },
+  { LSTRKEY( "unpack" ),    LFUNCVAL( buffer_unpackat ) },
+  { LSTRKEY( "getu8" ),     LFUNCVAL( buffer_getu8 ) },
+  { LSTRKEY( "setu8" ),     LFUNCVAL( buffer_setu8 ) },
+  { LSTRKEY( "geti8" ),     LFUNCVAL( buffer_geti8 ) },
+  { LSTRKEY( "seti8" ),     LFUNCVAL( buffer_seti8 ) },
+  { LSTRKEY( "getu16" ),    LFUNCVAL( buffer_getu16 ) },
+  { LSTRKEY( "setu16" ),    LFUNCVAL( buffer_setu16 ) },
+  { LSTRKEY( "geti16" ),    LFUNCVAL( buffer_geti16 ) },
+  { LSTRKEY( "seti16" ),    LFUNCVAL( buffer_seti16 ) },
+  { LSTRKEY( "getu32" ),    LFUNCVAL( buffer_getu32 ) },
+  { LSTRKEY( "setu32" ),    LFUNCVAL( buffer_setu32 ) },
+  { LSTRKEY( "geti32" ),    LFUNCVAL( buffer_geti32 ) },
+  { LSTRKEY( "seti32" ),    LFUNCVAL( buffer_seti32 ) },
+  { LSTRKEY( "getfloat" ),  LFUNCVAL( buffer_getfloat ) },
+  { LSTRKEY( "setfloat" ),  LFUNCVAL( buffer_setfloat ) },
+  { LSTRKEY( "getdouble" ), LFUNCVAL( buffer_getdouble ) },
+  { LSTRKEY( "setdouble" ), LFUNCVAL( buffer_setdouble ) },
+  { LSTRKEY( "write" ),     LFUNCVAL( buffer_write ) },
+  { LSTRKEY( "sub" ),       LFUNCVAL( buffer_sub ) },
+  { LSTRKEY( "slice" ),     LFUNCVAL( buffer_slice ) },
+  { LSTRKEY( "fill" ),      LFUNCVAL( buffer_fill ) },
+  { LSTRKEY( "__len" ),     LFUNCVAL( buffer_len ) },
+  { LSTRKEY( "__tostring" ), LFUNCVAL( buffer_tostring ) },
+  { LSTRKEY( "__index" ),   LROVAL( buffer_buf_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+// Module function map
+const LUA_REG_TYPE buffer_map[] = {
+  { LSTRKEY( "new" ),    LFUNCVAL( buffer_new ) },
+  { LSTRKEY( "pack" ),   LFUNCVAL( buffer_pack ) },
+  { LSTRKEY( "unpack" ), LFUNCVAL( buffer_unpack ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_buffer( lua_State *L )
+{
+  luaL_rometatable( L, BUFFER_TABLE, (void *)buffer_buf_map );
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_BUFFERLIBNAME, buffer_map );
+  return 1;
+#endif
+}
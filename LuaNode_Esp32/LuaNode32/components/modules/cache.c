@@ -0,0 +1,359 @@
+// Module for LRU caches kept in C
+//
+// A cache holds up to a number of entries, or of bytes, and drops the
+// least recently used one to make room for a new one. Keys are strings,
+// kept in C in a hash table of nodes that are also on a recency list, so
+// get and put take the same time however full the cache is. Values may be
+// anything; each is held by a reference in a table of the cache's own.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_LRU_TABLE   "cache.lru"
+
+#define CACHE_MIN_BUCKETS 8
+#define CACHE_NODE_BYTES  ((uint32_t)sizeof(cache_node_t) + 16)   // with heap and ref overhead
+#define CACHE_VALUE_BYTES 16      // counted for a value that isn't a string
+
+typedef struct cache_node {
+  struct cache_node *hnext;       // in the bucket
+  struct cache_node *prev, *next; // newer and older
+  uint32_t hash;
+  uint32_t size;                  // counted against max_bytes
+  int ref;                        // of the value, in the values table
+  uint16_t klen;
+  char key[1];
+} cache_node_t;
+
+typedef struct {
+  cache_node_t **buckets;
+  uint32_t nbuckets;              // a power of 2
+  cache_node_t *newest, *oldest;
+  uint32_t count, bytes;
+  uint32_t max_entries, max_bytes;  // 0 for no limit
+  uint32_t hits, misses, evictions;
+  int values_ref;
+} cache_lru_t;
+
+static uint32_t cache_hash( const char *key, size_t len )
+{
+  uint32_t h = 2166136261u;
+  while (len--)
+    h = (h ^ (uint8_t)*key++) * 16777619u;
+  return h;
+}
+
+static cache_node_t **cache_slot( cache_lru_t *c, const char *key, size_t len, uint32_t h )
+{
+  cache_node_t **p = &c->buckets[h & (c->nbuckets - 1)];
+  while (*p && ((*p)->hash != h || (*p)->klen != len || memcmp( (*p)->key, key, len )))
+    p = &(*p)->hnext;
+  return p;
+}
+
+static void cache_unlink( cache_lru_t *c, cache_node_t *n )
+{
+  if (n->prev)
+    n->prev->next = n->next;
+  else
+    c->newest = n->next;
+  if (n->next)
+    n->next->prev = n->prev;
+  else
+    c->oldest = n->prev;
+}
+
+static void cache_push_newest( cache_lru_t *c, cache_node_t *n )
+{
+  n->prev = NULL;
+  n->next = c->newest;
+  if (c->newest)
+    c->newest->prev = n;
+  else
+    c->oldest = n;
+  c->newest = n;
+}
+
+// Doubles the buckets when there are more entries than buckets; keeps
+// the old ones if there is no memory for more
+static void cache_grow( cache_lru_t *c )
+{
+  uint32_t nb = c->nbuckets * 2;
+  cache_node_t **b = (cache_node_t **)calloc( nb, sizeof(cache_node_t *) );
+  if (!b)
+    return;
+  for (cache_node_t *n = c->newest; n; n = n->next) {
+    cache_node_t **p = &b[n->hash & (nb - 1)];
+    n->hnext = *p;
+    *p = n;
+  }
+  free( c->buckets );
+  c->buckets = b;
+  c->nbuckets = nb;
+}
+
+// Removes a node; the values table is at the top of the stack
+static void cache_drop( lua_State *L, cache_lru_t *c, cache_node_t **slot )
+{
+  cache_node_t *n = *slot;
+  *slot = n->hnext;
+  cache_unlink( c, n );
+  luaL_unref( L, -1, n->ref );
+  c->count--;
+  c->bytes -= n->size;
+  free( n );
+}
+
+static void cache_evict( lua_State *L, cache_lru_t *c )
+{
+  while (c->oldest && ((c->max_entries && c->count > c->max_entries) ||
+                       (c->max_bytes && c->bytes > c->max_bytes))) {
+    cache_node_t *n = c->oldest;
+    cache_drop( L, c, cache_slot( c, n->key, n->klen, n->hash ) );
+    c->evictions++;
+  }
+}
+
+static void cache_clear( lua_State *L, cache_lru_t *c )
+{
+  cache_node_t *n = c->newest;
+  while (n) {
+    cache_node_t *next = n->next;
+    free( n );
+    n = next;
+  }
+  memset( c->buckets, 0, c->nbuckets * sizeof(cache_node_t *) );
+  c->newest = c->oldest = NULL;
+  c->count = c->bytes = 0;
+  if (c->values_ref != LUA_NOREF) {
+    lua_newtable( L );
+    lua_rawseti( L, LUA_REGISTRYINDEX, c->values_ref );
+  }
+}
+
+static cache_lru_t *cache_check( lua_State *L )
+{
+  cache_lru_t *c = (cache_lru_t *)luaL_checkudata( L, 1, CACHE_LRU_TABLE );
+  if (!c->buckets)
+    luaL_error( L, "cache is freed" );
+  return c;
+}
+
+// Lua: c = cache.lru( max_entries[, max_bytes] )
+// Either limit may be 0 for none, but not both. max_bytes counts the
+// keys, string values and some bytes per entry; put() can give the size
+// of other values.
+static int cache_lru( lua_State *L )
+{
+  lua_Integer entries = luaL_checkinteger( L, 1 );
+  lua_Integer bytes = luaL_optinteger( L, 2, 0 );
+  luaL_argcheck( L, entries >= 0, 1, "out of range" );
+  luaL_argcheck( L, bytes >= 0 && (entries || bytes), 2, "no limit given" );
+  cache_lru_t *c = (cache_lru_t *)lua_newuserdata( L, sizeof(cache_lru_t) );
+  memset( c, 0, sizeof(*c) );
+  c->values_ref = LUA_NOREF;
+  luaL_getmetatable( L, CACHE_LRU_TABLE );
+  lua_setmetatable( L, -2 );
+  c->max_entries = entries;
+  c->max_bytes = bytes;
+  c->nbuckets = CACHE_MIN_BUCKETS;
+  if ((c->buckets = (cache_node_t **)calloc( c->nbuckets, sizeof(cache_node_t *) )) == NULL)
+    return luaL_error( L, "out of memory" );
+  lua_newtable( L );
+  c->values_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  return 1;
+}
+
+static int cache_lookup( lua_State *L, bool touch )
+{
+  cache_lru_t *c = cache_check( L );
+  size_t len;
+  const char *key = luaL_checklstring( L, 2, &len );
+  cache_node_t *n = *cache_slot( c, key, len, cache_hash( key, len ) );
+  if (!n) {
+    if (touch)
+      c->misses++;
+    return 0;
+  }
+  if (touch) {
+    c->hits++;
+    cache_unlink( c, n );
+    cache_push_newest( c, n );
+  }
+  lua_rawgeti( L, LUA_REGISTRYINDEX, c->values_ref );
+  lua_rawgeti( L, -1, n->ref );
+  return 1;
+}
+
+// Lua: value = c:get( key )
+// nil if key isn't there; otherwise key becomes the most recently used
+static int cache_get( lua_State *L )
+{
+  return cache_lookup( L, true );
+}
+
+// Lua: value = c:peek( key )
+// As get, but changes neither the order nor the statistics
+static int cache_peek( lua_State *L )
+{
+  return cache_lookup( L, false );
+}
+
+// Lua: c:put( key, value[, size] )
+// A nil value removes key. size is what the entry counts against
+// max_bytes besides its key; by default the length of a string value.
+static int cache_put( lua_State *L )
+{
+  cache_lru_t *c = cache_check( L );
+  size_t len, vlen = CACHE_VALUE_BYTES;
+  const char *key = luaL_checklstring( L, 2, &len );
+  luaL_argcheck( L, len <= 0xffff, 2, "key too long" );
+  if (lua_type( L, 3 ) == LUA_TSTRING)
+    lua_tolstring( L, 3, &vlen );
+  vlen = luaL_optinteger( L, 4, vlen );
+  lua_settop( L, 3 );
+
+  uint32_t h = cache_hash( key, len );
+  cache_node_t **slot = cache_slot( c, key, len, h );
+  lua_rawgeti( L, LUA_REGISTRYINDEX, c->values_ref );
+  if (lua_isnil( L, 3 )) {
+    if (*slot)
+      cache_drop( L, c, slot );
+    return 0;
+  }
+
+  cache_node_t *n = *slot;
+  if (n) {
+    // the same key: the value changes in place
+    lua_pushvalue( L, 3 );
+    lua_rawseti( L, -2, n->ref );
+    cache_unlink( c, n );
+    c->bytes -= n->size;
+  } else {
+    if ((n = (cache_node_t *)malloc( sizeof(cache_node_t) + len )) == NULL)
+      return luaL_error( L, "out of memory" );
+    memcpy( n->key, key, len );
+    n->key[len] = '\0';
+    n->klen = len;
+    n->hash = h;
+    lua_pushvalue( L, 3 );
+    n->ref = luaL_ref( L, -2 );
+    n->hnext = NULL;
+    *slot = n;
+    c->count++;
+  }
+  n->size = CACHE_NODE_BYTES + len + vlen;
+  c->bytes += n->size;
+  cache_push_newest( c, n );
+  cache_evict( L, c );
+  if (c->count > c->nbuckets)
+    cache_grow( c );
+  return 0;
+}
+
+// Lua: c:remove( key )
+static int cache_remove( lua_State *L )
+{
+  lua_settop( L, 2 );
+  lua_pushnil( L );
+  return cache_put( L );
+}
+
+// Lua: c:clear()
+static int cache_clear_l( lua_State *L )
+{
+  cache_clear( L, cache_check( L ) );
+  return 0;
+}
+
+// Lua: t = c:stats( [reset] )
+// { hits=, misses=, evictions=, entries=, bytes= }; reset clears the
+// first three
+static int cache_stats( lua_State *L )
+{
+  cache_lru_t *c = cache_check( L );
+  lua_createtable( L, 0, 5 );
+  lua_pushinteger( L, c->hits );
+  lua_setfield( L, -2, "hits" );
+  lua_pushinteger( L, c->misses );
+  lua_setfield( L, -2, "misses" );
+  lua_pushinteger( L, c->evictions );
+  lua_setfield( L, -2, "evictions" );
+  lua_pushinteger( L, c->count );
+  lua_setfield( L, -2, "entries" );
+  lua_pushinteger( L, c->bytes );
+  lua_setfield( L, -2, "bytes" );
+  if (lua_toboolean( L, 2 ))
+    c->hits = c->misses = c->evictions = 0;
+  return 1;
+}
+
+// Lua: keys = c:keys()
+// An array of the keys, newest first
+static int cache_keys( lua_State *L )
+{
+  cache_lru_t *c = cache_check( L );
+  int i = 0;
+  lua_createtable( L, c->count, 0 );
+  for (cache_node_t *n = c->newest; n; n = n->next) {
+    lua_pushlstring( L, n->key, n->klen );
+    lua_rawseti( L, -2, ++i );
+  }
+  return 1;
+}
+
+static int cache_len( lua_State *L )
+{
+  lua_pushinteger( L, cache_check( L )->count );
+  return 1;
+}
+
+static int cache_gc( lua_State *L )
+{
+  cache_lru_t *c = (cache_lru_t *)luaL_checkudata( L, 1, CACHE_LRU_TABLE );
+  if (c->buckets) {
+    luaL_unref( L, LUA_REGISTRYINDEX, c->values_ref );
+    c->values_ref = LUA_NOREF;
+    cache_clear( L, c );
+    free( c->buckets );
+    c->buckets = NULL;
+  }
+  return 0;
+}
+
+static const LUA_REG_TYPE cache_lru_map[] = {
+  { LSTRKEY( "get" ),     LFUNCVAL( cache_get ) },
+  { LSTRKEY( "peek" ),    LFUNCVAL( cache_peek ) },
+  { LSTRKEY( "put" ),     LFUNCVAL( cache_put ) },
+  { LSTRKEY( "remove" ),  LFUNCVAL( cache_remove ) },
+  { LSTRKEY( "clear" ),   LFUNCVAL( cache_clear_l ) },
+  { LSTRKEY( "stats" ),   LFUNCVAL( cache_stats ) },
+  { LSTRKEY( "keys" ),    LFUNCVAL( cache_keys ) },
+  { LSTRKEY( "__len" ),   LFUNCVAL( cache_len ) },
+  { LSTRKEY( "__gc" ),    LFUNCVAL( cache_gc ) },
+  { LSTRKEY( "__index" ), LROVAL( cache_lru_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+// Module function map
+const LUA_REG_TYPE cache_map[] = {
+  { LSTRKEY( "lru" ), LFUNCVAL( cache_lru ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_cache( lua_State *L )
+{
+  luaL_rometatable( L, CACHE_LRU_TABLE, (void *)cache_lru_map );
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_CACHELIBNAME, cache_map );
+  return 1;
+#endif
+}
@@ -0,0 +1,143 @@
+// Per module tables of callback references, see cbref.h
+//
+// Free slots hold the number of the next free one, as luaL_ref keeps its
+// free list, so taking and freeing a slot are a couple of rawgeti/rawseti.
+// Once a table has no live slot left it's dropped, and the next ref
+// starts a fresh one, so a burst of sockets doesn't leave a large table
+// behind for the collector to traverse.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "cbref.h"
+#include <stdio.h>
+
+static cbref_table_t *cbref_tables;
+
+// Push t's table, making it on first use
+static void cbref_push_table( lua_State *L, cbref_table_t *t )
+{
+  if (t->ref != LUA_NOREF) {
+    lua_rawgeti( L, LUA_REGISTRYINDEX, t->ref );
+    return;
+  }
+  lua_createtable( L, 8, 0 );
+  if (t->weak) {
+    lua_createtable( L, 0, 1 );
+    lua_pushliteral( L, "v" );
+    lua_setfield( L, -2, "__mode" );
+    lua_setmetatable( L, -2 );
+  }
+  lua_pushvalue( L, -1 );
+  t->ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  t->slots = t->free = 0;
+  if (!t->listed) {
+    t->listed = true;
+    t->next = cbref_tables;
+    cbref_tables = t;
+  }
+}
+
+int cbref_ref( lua_State *L, cbref_table_t *t )
+{
+  int ref;
+  if (lua_isnil( L, -1 )) {
+    lua_pop( L, 1 );
+    return LUA_REFNIL;
+  }
+  cbref_push_table( L, t );
+  if (t->free) {
+    ref = t->free;
+    lua_rawgeti( L, -1, ref );
+    t->free = lua_tointeger( L, -1 );
+    lua_pop( L, 1 );
+  } else {
+    ref = ++t->slots;
+  }
+  lua_pushvalue( L, -2 );
+  lua_rawseti( L, -2, ref );
+  lua_pop( L, 2 );
+  if (++t->live > t->hwm)
+    t->hwm = t->live;
+  return ref;
+}
+
+void cbref_unref( lua_State *L, cbref_table_t *t, int ref )
+{
+  if (ref <= 0 || t->ref == LUA_NOREF)
+    return;
+  if (--t->live == 0) {
+    luaL_unref( L, LUA_REGISTRYINDEX, t->ref );
+    t->ref = LUA_NOREF;
+    return;
+  }
+  cbref_push_table( L, t );
+  lua_pushinteger( L, t->free );
+  lua_rawseti( L, -2, ref );
+  lua_pop( L, 1 );
+  t->free = ref;
+}
+
+void cbref_get( lua_State *L, cbref_table_t *t, int ref )
+{
+  if (ref <= 0 || t->ref == LUA_NOREF) {
+    lua_pushnil( L );
+    return;
+  }
+  lua_rawgeti( L, LUA_REGISTRYINDEX, t->ref );
+  lua_rawgeti( L, -1, ref );
+  lua_remove( L, -2 );
+}
+
+cbref_table_t *cbref_next( cbref_table_t *t )
+{
+  return t ? t->next : cbref_tables;
+}
+
+void cbref_push_live( lua_State *L, cbref_table_t *t )
+{
+  lua_newtable( L );
+  if (t->ref == LUA_NOREF)
+    return;
+  int list = lua_gettop( L );
+  cbref_push_table( L, t );
+  int tab = lua_gettop( L );
+
+  // the free slots, walked along their chain, are the ones not listed
+  lua_createtable( L, 0, 0 );
+  int freeset = tab + 1;
+  for (uint32_t s = t->free; s; ) {
+    lua_pushboolean( L, 1 );
+    lua_rawseti( L, freeset, s );
+    lua_rawgeti( L, tab, s );
+    s = lua_tointeger( L, -1 );
+    lua_pop( L, 1 );
+  }
+
+  int n = 0;
+  for (uint32_t s = 1; s <= t->slots; s++) {
+    lua_rawgeti( L, freeset, s );
+    bool is_free = lua_toboolean( L, -1 );
+    lua_pop( L, 1 );
+    if (is_free)
+      continue;
+    lua_createtable( L, 0, 3 );
+    lua_pushinteger( L, s );
+    lua_setfield( L, -2, "ref" );
+    lua_rawgeti( L, tab, s );
+    // a weak value that was collected while still referenced shows as nil
+    lua_pushstring( L, lua_typename( L, lua_type( L, -1 ) ) );
+    lua_setfield( L, -3, "type" );
+    if (lua_type( L, -1 ) == LUA_TFUNCTION) {
+      lua_Debug ar;
+      char where[LUA_IDSIZE + 12];
+      lua_getinfo( L, ">S", &ar );   // pops the function
+      snprintf( where, sizeof( where ), "%s:%d", ar.short_src, ar.linedefined );
+      lua_pushstring( L, where );
+      lua_setfield( L, -2, "where" );
+    } else {
+      lua_pop( L, 1 );
+    }
+    lua_rawseti( L, list, ++n );
+  }
+  lua_settop( L, list );
+}
@@ -0,0 +1,1030 @@
+// Module for CoAP over UDP: requests with retransmission, block-wise
+// transfer both ways, and observation, as client and server
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "platform.h"
+#include "coap_pdu.h"
+#include "task/task.h"
+#include "esp_timer.h"
+#include "esp_misc.h"
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "lwip/ip_addr.h"
+#include "lwip/udp.h"
+
+#define COAP_OBJ "coap.endpoint"
+
+#define COAP_PORT             5683
+
+// RFC 7252 transmission parameters
+#define COAP_ACK_TIMEOUT_MS   2000
+#define COAP_MAX_RETRANSMIT   4
+// An answer that hasn't come by then won't; the request is given up
+#define COAP_RESPONSE_TIMEOUT_MS 30000
+
+#define COAP_TICK_MS          100     // retransmission timer, while needed
+#define COAP_PATH_MAX         128
+#define COAP_PDU_MAX          (CONFIG_COAP_BLOCK_SIZE + 64 + COAP_PATH_MAX)
+#define COAP_DEDUP            4       // answers kept for repeated requests
+#define COAP_MAX_OBSERVERS    4       // per resource
+
+#define COAP_TOKEN_LEN        4
+
+// A request of ours waiting for its answer. Retransmitting stops once it
+// is acknowledged, an observation stays until cancelled
+typedef struct coap_xchg {
+  struct coap_xchg *next;
+  uint8_t token[COAP_TOKEN_LEN];
+  uint16_t id;              // of the message last sent
+  uint8_t method;
+  bool con;
+  bool acked;
+  bool observe;
+  uint8_t tries;
+  uint32_t timeout;         // ms until the next retransmission
+  uint32_t due;
+  uint32_t expires;         // 0 never
+  int cb_ref;
+  char *path;
+  char *body;               // request payload, in blocks if it is long
+  size_t body_len;
+  uint32_t block1;          // next block of it
+  char *resp;               // response blocks so far
+  size_t resp_len;
+  uint16_t pdu_len;
+  uint8_t pdu[COAP_PDU_MAX];  // last message sent
+} coap_xchg_t;
+
+typedef struct {
+  ip_addr_t ip;
+  uint16_t port;
+  uint16_t last_id;         // of the last notification, for a RST to it
+  uint8_t token_len;
+  uint8_t token[COAP_MAX_TOKEN];
+} coap_observer_t;
+
+typedef struct coap_res {
+  struct coap_res *next;
+  int cb_ref;
+  bool observable;
+  uint32_t seq;
+  uint8_t nobs;
+  coap_observer_t obs[COAP_MAX_OBSERVERS];
+  char path[];
+} coap_res_t;
+
+// The answer to a confirmable request, sent again if the request is
+typedef struct {
+  ip_addr_t ip;
+  uint16_t port;
+  uint16_t id;
+  uint16_t len;
+  uint8_t *pdu;
+} coap_seen_t;
+
+typedef struct coap_ep {
+  struct coap_ep *next;     // in coap_eps while open
+  struct udp_pcb *pcb;
+  int self_ref;
+  ip_addr_t peer;
+  uint16_t peer_port;       // 0 for a server
+  uint16_t next_id;
+  uint32_t next_token;
+  coap_xchg_t *xchgs;
+  coap_res_t *res;
+  coap_seen_t seen[COAP_DEDUP];
+  uint8_t seen_next;
+  struct {                  // request coming in blocks, one at a time
+    ip_addr_t ip;
+    uint16_t port;
+    uint32_t next;
+    char *path;
+    char *data;
+    size_t len;
+  } up;
+  os_timer_t timer;
+  bool ticking;
+} coap_ep_t;
+
+// A datagram on its way from lwIP to the Lua task
+typedef struct {
+  coap_ep_t *ep;
+  struct pbuf *p;
+  ip_addr_t ip;
+  uint16_t port;
+} coap_rx_t;
+
+static coap_ep_t *coap_eps;
+static task_handle_t coap_rx_task;
+static task_handle_t coap_tick_task;
+static uint8_t coap_szx;    // of CONFIG_COAP_BLOCK_SIZE
+
+static uint32_t coap_now(void)
+{
+  return xTaskGetTickCount() * portTICK_PERIOD_MS;
+}
+
+static bool coap_due(uint32_t now, uint32_t t)
+{
+  return (int32_t)(now - t) >= 0;
+}
+
+// Events for an endpoint closed since they were posted find it gone
+static bool coap_live(coap_ep_t *ep)
+{
+  for (coap_ep_t *e = coap_eps; e; e = e->next)
+    if (e == ep)
+      return true;
+  return false;
+}
+
+static void coap_sendto(coap_ep_t *ep, const uint8_t *pdu, size_t len,
+                        const ip_addr_t *ip, uint16_t port)
+{
+  struct pbuf *pb = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+  if (!pb)
+    return;                 // as good as lost on the way, retransmission covers it
+  pbuf_take(pb, pdu, len);
+  udp_sendto(ep->pcb, pb, ip, port);
+  pbuf_free(pb);
+}
+
+static void coap_send_empty(coap_ep_t *ep, uint8_t type, uint16_t id,
+                            const ip_addr_t *ip, uint16_t port)
+{
+  uint8_t pdu[4];
+  coap_writer_t w;
+  coap_begin(&w, pdu, sizeof(pdu), type, COAP_EMPTY, id, NULL, 0);
+  coap_sendto(ep, pdu, coap_end(&w), ip, port);
+}
+
+// 205 for 2.05, as Lua sees codes
+static int coap_code_num(uint8_t code)
+{
+  return COAP_CODE_CLASS(code) * 100 + COAP_CODE_DETAIL(code);
+}
+
+static uint8_t coap_code_from(int n)
+{
+  return COAP_CODE((n / 100) & 7, (n % 100) & 31);
+}
+
+static bool coap_append(char **buf, size_t *len, const uint8_t *data, size_t n)
+{
+  if (*len + n > CONFIG_COAP_MAX_BODY)
+    return false;
+  char *grown = (char *)realloc(*buf, *len + n + 1);
+  if (grown == NULL)
+    return false;
+  memcpy(grown + *len, data, n);
+  *buf = grown;
+  *len += n;
+  return true;
+}
+
+// --- Timer
+
+static void coap_timer_cb(void *arg)
+{
+  task_post_low(coap_tick_task, (task_param_t)arg);
+}
+
+static void coap_tick_start(coap_ep_t *ep)
+{
+  if (ep->ticking)
+    return;
+  ep->ticking = true;
+  os_timer_arm(&ep->timer, COAP_TICK_MS, 1);
+}
+
+static void coap_tick_stop(coap_ep_t *ep)
+{
+  if (!ep->ticking)
+    return;
+  ep->ticking = false;
+  os_timer_disarm(&ep->timer);
+}
+
+// --- Client
+
+static void coap_xchg_free(lua_State *L, coap_xchg_t *x)
+{
+  if (x->cb_ref != LUA_NOREF)
+    luaL_unref(L, LUA_REGISTRYINDEX, x->cb_ref);
+  free(x->path);
+  free(x->body);
+  free(x->resp);
+  free(x);
+}
+
+static void coap_xchg_unlink(coap_ep_t *ep, coap_xchg_t *x)
+{
+  coap_xchg_t **p = &ep->xchgs;
+  while (*p && *p != x)
+    p = &(*p)->next;
+  if (*p)
+    *p = x->next;
+}
+
+// Send the next message of x: the request, its next block, or a request
+// for the next block of the response
+static bool coap_xchg_send(coap_ep_t *ep, coap_xchg_t *x, uint32_t block2)
+{
+  coap_writer_t w;
+  size_t bs = COAP_BLOCK_SIZE(coap_szx);
+
+  x->id = ep->next_id++;
+  coap_begin(&w, x->pdu, sizeof(x->pdu), x->con ? COAP_CON : COAP_NON,
+             x->method, x->id, x->token, COAP_TOKEN_LEN);
+  if (x->observe && block2 == 0)
+    coap_add_uint(&w, COAP_OPT_OBSERVE, 0);
+  coap_add_path(&w, x->path);
+  coap_add_query(&w, x->path);
+  if (block2)
+    coap_add_uint(&w, COAP_OPT_BLOCK2, block2);
+  if (x->body_len > bs) {
+    size_t off = x->block1 * bs;
+    size_t n = x->body_len - off < bs ? x->body_len - off : bs;
+    coap_add_uint(&w, COAP_OPT_BLOCK1, COAP_BLOCK(x->block1, off + n < x->body_len, coap_szx));
+    coap_add_payload(&w, x->body + off, n);
+  } else if (block2 == 0) {
+    coap_add_payload(&w, x->body, x->body_len);
+  }
+  int len = coap_end(&w);
+  if (len < 0)
+    return false;
+  x->pdu_len = len;
+  x->acked = !x->con;
+  x->tries = 0;
+  // spread out, so nodes that lost the same packet don't all try again at once
+  x->timeout = COAP_ACK_TIMEOUT_MS + os_random() % (COAP_ACK_TIMEOUT_MS / 2);
+  x->due = coap_now() + x->timeout;
+  if (!x->observe || x->expires)
+    x->expires = coap_now() + COAP_RESPONSE_TIMEOUT_MS;
+  coap_sendto(ep, x->pdu, x->pdu_len, &ep->peer, ep->peer_port);
+  coap_tick_start(ep);
+  return true;
+}
+
+// Take x off the list and call its callback with what is on the stack
+static void coap_xchg_finish(lua_State *L, coap_ep_t *ep, coap_xchg_t *x, int nargs)
+{
+  coap_xchg_unlink(ep, x);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, x->cb_ref);
+  lua_insert(L, -nargs - 1);
+  // freed first, the callback may raise an error
+  coap_xchg_free(L, x);
+  lua_call(L, nargs, 0);
+}
+
+static void coap_xchg_fail(lua_State *L, coap_ep_t *ep, coap_xchg_t *x, const char *why)
+{
+  lua_pushnil(L);
+  lua_pushstring(L, why);
+  coap_xchg_finish(L, ep, x, 2);
+}
+
+static coap_xchg_t *coap_xchg_by_id(coap_ep_t *ep, uint16_t id)
+{
+  coap_xchg_t *x;
+  for (x = ep->xchgs; x && x->id != id; x = x->next)
+    ;
+  return x;
+}
+
+static coap_xchg_t *coap_xchg_by_token(coap_ep_t *ep, const coap_msg_t *m)
+{
+  coap_xchg_t *x;
+  if (m->token_len != COAP_TOKEN_LEN)
+    return NULL;
+  for (x = ep->xchgs; x && memcmp(x->token, m->token, COAP_TOKEN_LEN); x = x->next)
+    ;
+  return x;
+}
+
+static void coap_response(lua_State *L, coap_ep_t *ep, coap_xchg_t *x, const coap_msg_t *m)
+{
+  uint32_t b1 = coap_opt_uint(m, COAP_OPT_BLOCK1, UINT32_MAX);
+  uint32_t b2 = coap_opt_uint(m, COAP_OPT_BLOCK2, UINT32_MAX);
+
+  // the server wants the next block of the request
+  if (m->code == COAP_CONTINUE && x->body && b1 != UINT32_MAX) {
+    x->block1 = COAP_BLOCK_NUM(b1) + 1;
+    if (x->block1 * COAP_BLOCK_SIZE(coap_szx) >= x->body_len ||
+        !coap_xchg_send(ep, x, 0))
+      coap_xchg_fail(L, ep, x, "bad block");
+    return;
+  }
+  if (b2 != UINT32_MAX && (COAP_BLOCK_MORE(b2) || x->resp)) {
+    if (!coap_append(&x->resp, &x->resp_len, m->payload, m->payload_len)) {
+      coap_xchg_fail(L, ep, x, "too large");
+      return;
+    }
+    if (COAP_BLOCK_MORE(b2)) {
+      // the rest by plain requests, the body was taken with the first
+      free(x->body);
+      x->body = NULL;
+      x->body_len = 0;
+      x->method = COAP_GET;
+      if (!coap_xchg_send(ep, x, COAP_BLOCK(COAP_BLOCK_NUM(b2) + 1, 0, COAP_BLOCK_SZX(b2))))
+        coap_xchg_fail(L, ep, x, "bad block");
+      return;
+    }
+  }
+
+  lua_pushinteger(L, coap_code_num(m->code));
+  if (x->resp) {
+    lua_pushlstring(L, x->resp, x->resp_len);
+    free(x->resp);
+    x->resp = NULL;
+    x->resp_len = 0;
+  } else {
+    lua_pushlstring(L, (const char *)m->payload, m->payload_len);
+  }
+  uint32_t seq = coap_opt_uint(m, COAP_OPT_OBSERVE, UINT32_MAX);
+  if (x->observe && seq != UINT32_MAX && COAP_CODE_CLASS(m->code) == 2) {
+    // stays for the notifications to come
+    x->expires = 0;
+    lua_pushinteger(L, seq);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, x->cb_ref);
+    lua_insert(L, -4);
+    lua_call(L, 3, 0);
+    return;
+  }
+  coap_xchg_finish(L, ep, x, 2);
+}
+
+// --- Server
+
+static coap_res_t *coap_res_find(coap_ep_t *ep, const char *path)
+{
+  coap_res_t *r;
+  for (r = ep->res; r && strcmp(r->path, path); r = r->next)
+    ;
+  return r;
+}
+
+static void coap_upload_reset(coap_ep_t *ep)
+{
+  free(ep->up.path);
+  free(ep->up.data);
+  ep->up.path = ep->up.data = NULL;
+  ep->up.len = 0;
+  ep->up.next = 0;
+}
+
+static void coap_seen_keep(coap_ep_t *ep, const ip_addr_t *ip, uint16_t port,
+                           uint16_t id, const uint8_t *pdu, size_t len)
+{
+  coap_seen_t *s = &ep->seen[ep->seen_next];
+  uint8_t *copy = (uint8_t *)malloc(len);
+  if (copy == NULL)
+    return;
+  free(s->pdu);
+  s->ip = *ip;
+  s->port = port;
+  s->id = id;
+  s->len = len;
+  s->pdu = copy;
+  memcpy(copy, pdu, len);
+  ep->seen_next = (ep->seen_next + 1) % COAP_DEDUP;
+}
+
+static coap_seen_t *coap_seen_find(coap_ep_t *ep, const ip_addr_t *ip, uint16_t port, uint16_t id)
+{
+  for (int i = 0; i < COAP_DEDUP; i++) {
+    coap_seen_t *s = &ep->seen[i];
+    if (s->pdu && s->id == id && s->port == port && ip_addr_cmp(&s->ip, ip))
+      return s;
+  }
+  return NULL;
+}
+
+// Answer a request of m with code and the block of data it asked for
+static void coap_reply(coap_ep_t *ep, const coap_msg_t *m, const ip_addr_t *ip, uint16_t port,
+                       uint8_t code, const char *data, size_t len, int format,
+                       uint32_t observe, uint32_t block1)
+{
+  uint8_t pdu[COAP_PDU_MAX];
+  coap_writer_t w;
+  uint16_t id = m->type == COAP_CON ? m->id : ep->next_id++;
+  uint32_t b2 = coap_opt_uint(m, COAP_OPT_BLOCK2, UINT32_MAX);
+  uint8_t szx = coap_szx;
+  uint32_t num = 0;
+
+  if (b2 != UINT32_MAX) {
+    num = COAP_BLOCK_NUM(b2);
+    if (COAP_BLOCK_SZX(b2) < szx)
+      szx = COAP_BLOCK_SZX(b2);
+  }
+  size_t bs = COAP_BLOCK_SIZE(szx), off = num * bs;
+  if (off > len || (off == len && len)) {
+    code = COAP_BAD_REQUEST;
+    data = NULL;
+    len = off = 0;
+    b2 = UINT32_MAX;
+  }
+  coap_begin(&w, pdu, sizeof(pdu), m->type == COAP_CON ? COAP_ACK : COAP_NON,
+             code, id, m->token, m->token_len);
+  if (observe != UINT32_MAX)
+    coap_add_uint(&w, COAP_OPT_OBSERVE, observe & 0xffffff);
+  if (format >= 0)
+    coap_add_uint(&w, COAP_OPT_CONTENT_FORMAT, format);
+  if (len > bs || b2 != UINT32_MAX) {
+    size_t n = len - off < bs ? len - off : bs;
+    coap_add_uint(&w, COAP_OPT_BLOCK2, COAP_BLOCK(num, off + n < len, szx));
+    len = n;
+  }
+  if (block1 != UINT32_MAX)
+    coap_add_uint(&w, COAP_OPT_BLOCK1, block1);
+  coap_add_payload(&w, data ? data + off : NULL, len);
+  int n = coap_end(&w);
+  if (n < 0)
+    return;
+  coap_sendto(ep, pdu, n, ip, port);
+  if (m->type == COAP_CON)
+    coap_seen_keep(ep, ip, port, m->id, pdu, n);
+}
+
+static void coap_reply_code(coap_ep_t *ep, const coap_msg_t *m, const ip_addr_t *ip,
+                            uint16_t port, uint8_t code, uint32_t block1)
+{
+  coap_reply(ep, m, ip, port, code, NULL, 0, -1, UINT32_MAX, block1);
+}
+
+// An observer of r for the GET m, or NULL if there is no room for one
+static coap_observer_t *coap_observe(coap_res_t *r, const coap_msg_t *m,
+                                     const ip_addr_t *ip, uint16_t port)
+{
+  coap_observer_t *o = NULL;
+  for (int i = 0; i < r->nobs; i++)
+    if (r->obs[i].port == port && ip_addr_cmp(&r->obs[i].ip, ip))
+      o = &r->obs[i];
+  if (o == NULL && r->nobs < COAP_MAX_OBSERVERS)
+    o = &r->obs[r->nobs++];
+  if (o) {
+    o->ip = *ip;
+    o->port = port;
+    o->token_len = m->token_len;
+    memcpy(o->token, m->token, m->token_len);
+  }
+  return o;
+}
+
+static void coap_unobserve(coap_res_t *r, coap_observer_t *o)
+{
+  *o = r->obs[--r->nobs];
+}
+
+static void coap_request(lua_State *L, coap_ep_t *ep, const coap_msg_t *m,
+                         const ip_addr_t *ip, uint16_t port)
+{
+  char path[COAP_PATH_MAX];
+  size_t plen = 0;
+  const coap_opt_t *o;
+
+  if (m->type == COAP_CON) {
+    coap_seen_t *s = coap_seen_find(ep, ip, port, m->id);
+    if (s) {
+      coap_sendto(ep, s->pdu, s->len, ip, port);
+      return;
+    }
+  }
+  for (int i = 0; (o = coap_opt(m, COAP_OPT_URI_PATH, i)) != NULL; i++) {
+    if (plen + o->len + 2 > sizeof(path)) {
+      coap_reply_code(ep, m, ip, port, COAP_NOT_FOUND, UINT32_MAX);
+      return;
+    }
+    if (i)
+      path[plen++] = '/';
+    memcpy(path + plen, o->val, o->len);
+    plen += o->len;
+  }
+  path[plen] = 0;
+  coap_res_t *r = coap_res_find(ep, path);
+  if (r == NULL || m->code > COAP_DELETE) {
+    coap_reply_code(ep, m, ip, port, r ? COAP_NOT_ALLOWED : COAP_NOT_FOUND, UINT32_MAX);
+    return;
+  }
+
+  // a long request comes in blocks, each acknowledged with 2.31 Continue
+  const char *payload = (const char *)m->payload;
+  size_t payload_len = m->payload_len;
+  uint32_t b1 = coap_opt_uint(m, COAP_OPT_BLOCK1, UINT32_MAX);
+  if (b1 != UINT32_MAX) {
+    if (COAP_BLOCK_NUM(b1) == 0) {
+      coap_upload_reset(ep);
+      ep->up.ip = *ip;
+      ep->up.port = port;
+      ep->up.path = strdup(path);
+    } else if (ep->up.path == NULL || ep->up.port != port || !ip_addr_cmp(&ep->up.ip, ip) ||
+               strcmp(ep->up.path, path) || ep->up.next != COAP_BLOCK_NUM(b1)) {
+      coap_reply_code(ep, m, ip, port, COAP_INCOMPLETE, UINT32_MAX);
+      return;
+    }
+    if (ep->up.path == NULL ||
+        !coap_append(&ep->up.data, &ep->up.len, m->payload, m->payload_len)) {
+      coap_upload_reset(ep);
+      coap_reply_code(ep, m, ip, port, COAP_TOO_LARGE, UINT32_MAX);
+      return;
+    }
+    ep->up.next = COAP_BLOCK_NUM(b1) + 1;
+    if (COAP_BLOCK_MORE(b1)) {
+      coap_reply_code(ep, m, ip, port, COAP_CONTINUE, b1);
+      return;
+    }
+    payload = ep->up.data;
+    payload_len = ep->up.len;
+  }
+
+  uint32_t observe = UINT32_MAX;
+  uint32_t reg = coap_opt_uint(m, COAP_OPT_OBSERVE, UINT32_MAX);
+  if (m->code == COAP_GET && r->observable && reg != UINT32_MAX) {
+    coap_observer_t *ob = NULL;
+    for (int i = 0; i < r->nobs; i++)
+      if (r->obs[i].port == port && ip_addr_cmp(&r->obs[i].ip, ip))
+        ob = &r->obs[i];
+    if (reg == 1 && ob)
+      coap_unobserve(r, ob);
+    else if (reg == 0 && coap_observe(r, m, ip, port))
+      observe = r->seq;
+  }
+
+  char ipstr[IPADDR_STRLEN_MAX];
+  ipaddr_ntoa_r(ip, ipstr, sizeof(ipstr));
+  lua_rawgeti(L, LUA_REGISTRYINDEX, r->cb_ref);
+  lua_pushinteger(L, m->code);
+  if (payload_len)
+    lua_pushlstring(L, payload, payload_len);
+  else
+    lua_pushnil(L);
+  lua_pushstring(L, ipstr);
+  lua_pushinteger(L, port);
+  if (b1 != UINT32_MAX)
+    coap_upload_reset(ep);    // on the stack now
+  lua_call(L, 4, 3);
+
+  size_t len = 0;
+  const char *data = lua_tolstring(L, -2, &len);
+  int format = lua_isnumber(L, -1) ? (int)lua_tointeger(L, -1) : -1;
+  uint8_t code = lua_isnumber(L, -3) ? coap_code_from(lua_tointeger(L, -3)) : COAP_CONTENT;
+  if (COAP_CODE_CLASS(code) != 2)
+    observe = UINT32_MAX;
+  coap_reply(ep, m, ip, port, code, data, len, format, observe,
+             b1 != UINT32_MAX ? COAP_BLOCK(COAP_BLOCK_NUM(b1), 0, COAP_BLOCK_SZX(b1)) : UINT32_MAX);
+  lua_pop(L, 3);
+}
+
+// An RST to a notification means its observer is gone
+static void coap_reset(coap_ep_t *ep, uint16_t id, const ip_addr_t *ip, uint16_t port)
+{
+  for (coap_res_t *r = ep->res; r; r = r->next)
+    for (int i = 0; i < r->nobs; i++)
+      if (r->obs[i].last_id == id && r->obs[i].port == port && ip_addr_cmp(&r->obs[i].ip, ip)) {
+        coap_unobserve(r, &r->obs[i]);
+        return;
+      }
+}
+
+// --- Lua task
+
+static void coap_message(lua_State *L, coap_ep_t *ep, const uint8_t *buf, size_t len,
+                         const ip_addr_t *ip, uint16_t port)
+{
+  coap_msg_t m;
+  coap_xchg_t *x;
+
+  if (coap_parse(&m, buf, len) < 0)
+    return;
+  if (m.code == COAP_EMPTY) {
+    if (m.type == COAP_CON) {
+      coap_send_empty(ep, COAP_RST, m.id, ip, port);    // a ping
+    } else if ((x = coap_xchg_by_id(ep, m.id)) != NULL) {
+      if (m.type == COAP_RST)
+        coap_xchg_fail(L, ep, x, "reset");
+      else if (m.type == COAP_ACK)
+        x->acked = true;        // the answer follows on its own
+    } else if (m.type == COAP_RST) {
+      coap_reset(ep, m.id, ip, port);
+    }
+    return;
+  }
+  if (COAP_CODE_CLASS(m.code) == 0) {
+    coap_request(L, ep, &m, ip, port);
+    return;
+  }
+  x = coap_xchg_by_token(ep, &m);
+  if (x == NULL || (m.type == COAP_ACK && m.id != x->id)) {
+    // a cancelled observation, or an answer we gave up on
+    if (m.type == COAP_CON || m.type == COAP_NON)
+      coap_send_empty(ep, COAP_RST, m.id, ip, port);
+    return;
+  }
+  if (m.type == COAP_CON)
+    coap_send_empty(ep, COAP_ACK, m.id, ip, port);
+  x->acked = true;
+  coap_response(L, ep, x, &m);
+}
+
+static void coap_rx(task_param_t param, task_prio_t prio)
+{
+  (void)prio;
+  coap_rx_t *rx = (coap_rx_t *)param;
+  struct pbuf *p = rx->p;
+
+  if (coap_live(rx->ep)) {
+    lua_State *L = lua_getstate();
+    if (p->next == NULL) {
+      coap_message(L, rx->ep, (const uint8_t *)p->payload, p->len, &rx->ip, rx->port);
+    } else {
+      size_t len = p->tot_len;
+      uint8_t *buf = (uint8_t *)malloc(len);
+      if (buf) {
+        pbuf_copy_partial(p, buf, len, 0);
+        // freed first, the message may raise an error in Lua
+        pbuf_free(p);
+        p = NULL;
+        coap_message(L, rx->ep, buf, len, &rx->ip, rx->port);
+        free(buf);
+      }
+    }
+  }
+  if (p)
+    pbuf_free(p);
+  free(rx);
+}
+
+static void coap_tick(task_param_t param, task_prio_t prio)
+{
+  (void)prio;
+  coap_ep_t *ep = (coap_ep_t *)param;
+  lua_State *L = lua_getstate();
+  uint32_t now = coap_now();
+  coap_xchg_t *x;
+
+  if (!coap_live(ep))
+    return;
+  for (x = ep->xchgs; x; x = x->next) {
+    if (x->acked || !coap_due(now, x->due))
+      continue;
+    if (x->tries == COAP_MAX_RETRANSMIT) {
+      x->expires = now;
+      continue;
+    }
+    x->tries++;
+    x->timeout *= 2;
+    x->due = now + x->timeout;
+    coap_sendto(ep, x->pdu, x->pdu_len, &ep->peer, ep->peer_port);
+  }
+  // one at a time, a callback may change the list
+  for (;;) {
+    for (x = ep->xchgs; x && !(x->expires && coap_due(now, x->expires)); x = x->next)
+      ;
+    if (x == NULL)
+      break;
+    coap_xchg_fail(L, ep, x, "timeout");
+  }
+  bool waiting = false;
+  for (x = ep->xchgs; x; x = x->next)
+    waiting |= !x->acked || x->expires;
+  if (!waiting)
+    coap_tick_stop(ep);
+}
+
+// lwIP's task
+static void coap_recv_cb(void *arg, struct udp_pcb *pcb, struct pbuf *p,
+                         const ip_addr_t *addr, u16_t port)
+{
+  coap_rx_t *rx = (coap_rx_t *)malloc(sizeof(coap_rx_t));
+  if (rx == NULL) {
+    pbuf_free(p);
+    return;
+  }
+  rx->ep = (coap_ep_t *)arg;
+  rx->p = p;
+  rx->ip = *addr;
+  rx->port = port;
+  if (!task_post_medium(coap_rx_task, (task_param_t)rx)) {
+    pbuf_free(p);
+    free(rx);
+  }
+}
+
+// --- Lua API
+
+static coap_ep_t *coap_get(lua_State *L)
+{
+  coap_ep_t *ep = (coap_ep_t *)luaL_checkudata(L, 1, COAP_OBJ);
+  if (ep->pcb == NULL)
+    luaL_error(L, "closed");
+  return ep;
+}
+
+static coap_ep_t *coap_new(lua_State *L, uint16_t port)
+{
+  coap_ep_t *ep = (coap_ep_t *)lua_newuserdata(L, sizeof(coap_ep_t));
+  memset(ep, 0, sizeof(*ep));
+  luaL_getmetatable(L, COAP_OBJ);
+  lua_setmetatable(L, -2);
+  ep->self_ref = LUA_NOREF;
+  ep->next_id = os_random();
+  ep->next_token = os_random();
+  ep->pcb = udp_new();
+  if (ep->pcb == NULL)
+    luaL_error(L, "out of memory");
+  if (udp_bind(ep->pcb, IP_ADDR_ANY, port) != ERR_OK) {
+    udp_remove(ep->pcb);
+    ep->pcb = NULL;
+    luaL_error(L, "can't bind port %d", port);
+  }
+  udp_recv(ep->pcb, coap_recv_cb, ep);
+  os_timer_setfn(&ep->timer, coap_timer_cb, ep);
+  // open until closed, whether Lua keeps hold of it or not
+  lua_pushvalue(L, -1);
+  ep->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  ep->next = coap_eps;
+  coap_eps = ep;
+  return ep;
+}
+
+// Lua: ep = coap.client(ip[, port])
+// Requests go to the server at ip, resolve a name with net.dns first
+static int coap_client(lua_State *L)
+{
+  const char *host = luaL_checkstring(L, 1);
+  ip_addr_t ip;
+  if (!ipaddr_aton(host, &ip))
+    return luaL_error(L, "invalid IP address");
+  int port = luaL_optinteger(L, 2, COAP_PORT);
+  coap_ep_t *ep = coap_new(L, 0);
+  ep->peer = ip;
+  ep->peer_port = port;
+  return 1;
+}
+
+// Lua: ep = coap.server([port])
+static int coap_server(lua_State *L)
+{
+  coap_new(L, luaL_optinteger(L, 1, COAP_PORT));
+  return 1;
+}
+
+// Lua: ep:get(path, cb), ep:post(path, payload, cb), ep:put(path, payload, cb),
+//      ep:delete(path, cb)
+// Confirmable, sent again until acknowledged. cb(code, payload) gets the
+// answer, 205 for 2.05, or cb(nil, "timeout"), "reset" or "too large".
+// Payloads longer than a block go in blocks, and long answers are fetched
+// block by block before cb sees them whole
+static int coap_start(lua_State *L, uint8_t method, bool con, bool observe, bool body)
+{
+  coap_ep_t *ep = coap_get(L);
+  const char *path = luaL_checkstring(L, 2);
+  size_t len = 0;
+  const char *payload = body ? luaL_checklstring(L, 3, &len) : NULL;
+  int cb = body ? 4 : 3;
+
+  if (ep->peer_port == 0)
+    return luaL_error(L, "not a client");
+  if (strlen(path) >= COAP_PATH_MAX)
+    return luaL_argerror(L, 2, "too long");
+  // in blocks only when each is acknowledged
+  if (len > (con ? CONFIG_COAP_MAX_BODY : COAP_BLOCK_SIZE(coap_szx)))
+    return luaL_argerror(L, 3, "too long");
+  if (con || observe)
+    luaL_checktype(L, cb, LUA_TFUNCTION);
+
+  coap_xchg_t *x = (coap_xchg_t *)calloc(1, sizeof(coap_xchg_t));
+  if (x == NULL)
+    return luaL_error(L, "out of memory");
+  uint32_t t = ep->next_token++;
+  memcpy(x->token, &t, COAP_TOKEN_LEN);
+  x->method = method;
+  x->con = con;
+  x->observe = observe;
+  x->expires = 1;           // set for real once sent
+  x->cb_ref = LUA_NOREF;
+  x->path = strdup(path);
+  if (len) {
+    x->body = (char *)malloc(len);
+    if (x->body)
+      memcpy(x->body, payload, len);
+    x->body_len = len;
+  }
+  if (x->path == NULL || (len && x->body == NULL)) {
+    coap_xchg_free(L, x);
+    return luaL_error(L, "out of memory");
+  }
+  if (!lua_isnoneornil(L, cb)) {
+    lua_pushvalue(L, cb);
+    x->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  if (!coap_xchg_send(ep, x, 0)) {
+    coap_xchg_free(L, x);
+    return luaL_error(L, "path too long");
+  }
+  if (!con && !observe) {
+    // nothing to wait for
+    coap_xchg_free(L, x);
+    return 0;
+  }
+  x->next = ep->xchgs;
+  ep->xchgs = x;
+  lua_pushinteger(L, t);
+  return 1;
+}
+
+static int coap_get_(lua_State *L)    { return coap_start(L, COAP_GET, true, false, false); }
+static int coap_post(lua_State *L)    { return coap_start(L, COAP_POST, true, false, true); }
+static int coap_put(lua_State *L)     { return coap_start(L, COAP_PUT, true, false, true); }
+static int coap_delete(lua_State *L)  { return coap_start(L, COAP_DELETE, true, false, false); }
+
+// Lua: ep:send(path, payload)
+// A non-confirmable POST with no answer waited for: one datagram, the
+// least radio time a reading can take
+static int coap_send(lua_State *L)    { return coap_start(L, COAP_POST, false, false, true); }
+
+// Lua: h = ep:observe(path, cb)
+// cb(code, payload, seq) with the current state and each change after it,
+// until ep:unobserve(h). A server that doesn't take observers answers
+// once, and that is the end of it
+static int coap_observe_(lua_State *L) { return coap_start(L, COAP_GET, true, true, false); }
+
+// Lua: ep:unobserve(h)
+// Notifications still coming are answered with RST, which ends them
+static int coap_unobserve_(lua_State *L)
+{
+  coap_ep_t *ep = coap_get(L);
+  uint32_t t = luaL_checkinteger(L, 2);
+  coap_msg_t m;
+  m.token_len = COAP_TOKEN_LEN;
+  memcpy(m.token, &t, COAP_TOKEN_LEN);
+  coap_xchg_t *x = coap_xchg_by_token(ep, &m);
+  if (x) {
+    coap_xchg_unlink(ep, x);
+    coap_xchg_free(L, x);
+  }
+  return 0;
+}
+
+// Lua: ep:on(path, function(method, payload, ip, port) return code, payload, format end[, observable])
+// Serve path, "a/b" for coap://host/a/b. code defaults to 205. Long
+// payloads go out in blocks. An observable resource is also called with
+// no peer for ep:notify(path). A nil function removes it
+static int coap_on(lua_State *L)
+{
+  coap_ep_t *ep = coap_get(L);
+  const char *path = luaL_checkstring(L, 2);
+  while (*path == '/')
+    path++;
+  coap_res_t **p = &ep->res;
+  while (*p && strcmp((*p)->path, path))
+    p = &(*p)->next;
+  if (*p) {
+    coap_res_t *r = *p;
+    *p = r->next;
+    luaL_unref(L, LUA_REGISTRYINDEX, r->cb_ref);
+    free(r);
+  }
+  if (lua_isnoneornil(L, 3))
+    return 0;
+  luaL_checktype(L, 3, LUA_TFUNCTION);
+  if (strlen(path) >= COAP_PATH_MAX)
+    return luaL_argerror(L, 2, "too long");
+  coap_res_t *r = (coap_res_t *)calloc(1, sizeof(coap_res_t) + strlen(path) + 1);
+  if (r == NULL)
+    return luaL_error(L, "out of memory");
+  strcpy(r->path, path);
+  r->observable = lua_toboolean(L, 4);
+  lua_pushvalue(L, 3);
+  r->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  r->next = ep->res;
+  ep->res = r;
+  return 0;
+}
+
+// Lua: n = ep:notify(path)
+// Send the observers of path its state now, returning how many there are
+static int coap_notify(lua_State *L)
+{
+  coap_ep_t *ep = coap_get(L);
+  const char *path = luaL_checkstring(L, 2);
+  while (*path == '/')
+    path++;
+  coap_res_t *r = coap_res_find(ep, path);
+  if (r == NULL || r->nobs == 0) {
+    lua_pushinteger(L, 0);
+    return 1;
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, r->cb_ref);
+  lua_pushinteger(L, COAP_GET);
+  lua_call(L, 1, 3);
+  // the handler may have removed it
+  if (coap_res_find(ep, path) != r) {
+    lua_pushinteger(L, 0);
+    return 1;
+  }
+  size_t len = 0;
+  const char *data = lua_tolstring(L, -2, &len);
+  int format = lua_isnumber(L, -1) ? (int)lua_tointeger(L, -1) : -1;
+  uint8_t code = lua_isnumber(L, -3) ? coap_code_from(lua_tointeger(L, -3)) : COAP_CONTENT;
+  r->seq++;
+  for (int i = 0; i < r->nobs; i++) {
+    coap_observer_t *o = &r->obs[i];
+    coap_msg_t m;
+    // answered like a non-confirmable GET for the first block
+    memset(&m, 0, sizeof(m));
+    m.type = COAP_NON;
+    m.token_len = o->token_len;
+    memcpy(m.token, o->token, o->token_len);
+    o->last_id = ep->next_id;
+    coap_reply(ep, &m, &o->ip, o->port, code, data, len, format,
+               COAP_CODE_CLASS(code) == 2 ? r->seq : UINT32_MAX, UINT32_MAX);
+  }
+  int n = r->nobs;
+  // an error ends the observation
+  if (COAP_CODE_CLASS(code) != 2)
+    r->nobs = 0;
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+// Lua: ep:close()
+// Requests still waiting are dropped without their callbacks
+static int coap_close(lua_State *L)
+{
+  coap_ep_t *ep = (coap_ep_t *)luaL_checkudata(L, 1, COAP_OBJ);
+  if (ep->pcb == NULL)
+    return 0;
+  udp_remove(ep->pcb);
+  ep->pcb = NULL;
+  coap_tick_stop(ep);
+  for (coap_ep_t **p = &coap_eps; *p; p = &(*p)->next)
+    if (*p == ep) {
+      *p = ep->next;
+      break;
+    }
+  while (ep->xchgs) {
+    coap_xchg_t *x = ep->xchgs;
+    ep->xchgs = x->next;
+    coap_xchg_free(L, x);
+  }
+  while (ep->res) {
+    coap_res_t *r = ep->res;
+    ep->res = r->next;
+    luaL_unref(L, LUA_REGISTRYINDEX, r->cb_ref);
+    free(r);
+  }
+  for (int i = 0; i < COAP_DEDUP; i++) {
+    free(ep->seen[i].pdu);
+    ep->seen[i].pdu = NULL;
+  }
+  coap_upload_reset(ep);
+  luaL_unref(L, LUA_REGISTRYINDEX, ep->self_ref);
+  ep->self_ref = LUA_NOREF;
+  return 0;
+}
+
+static const LUA_REG_TYPE coap_ep_map[] = {
+  { LSTRKEY( "get" ),       LFUNCVAL( coap_get_ ) },
+  { LSTRKEY( "post" ),      LFUNCVAL( coap_post ) },
+  { LSTRKEY( "put" ),       LFUNCVAL( coap_put ) },
+  { LSTRKEY( "delete" ),    LFUNCVAL( coap_delete ) },
+  { LSTRKEY( "send" ),      LFUNCVAL( coap_send ) },
+  { LSTRKEY( "observe" ),   LFUNCVAL( coap_observe_ ) },
+  { LSTRKEY( "unobserve" ), LFUNCVAL( coap_unobserve_ ) },
+  { LSTRKEY( "on" ),        LFUNCVAL( coap_on ) },
+  { LSTRKEY( "notify" ),    LFUNCVAL( coap_notify ) },
+  { LSTRKEY( "close" ),     LFUNCVAL( coap_close ) },
+  { LSTRKEY( "__gc" ),      LFUNCVAL( coap_close ) },
+  { LSTRKEY( "__index" ),   LROVAL( coap_ep_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+const LUA_REG_TYPE coap_map[] = {
+  { LSTRKEY( "client" ),    LFUNCVAL( coap_client ) },
+  { LSTRKEY( "server" ),    LFUNCVAL( coap_server ) },
+  { LSTRKEY( "GET" ),       LNUMVAL( COAP_GET ) },
+  { LSTRKEY( "POST" ),      LNUMVAL( COAP_POST ) },
+  { LSTRKEY( "PUT" ),       LNUMVAL( COAP_PUT ) },
+  { LSTRKEY( "DELETE" ),    LNUMVAL( COAP_DELETE ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_coap(lua_State *L)
+{
+  luaL_rometatable(L, COAP_OBJ, (void *)coap_ep_map);
+  coap_rx_task = task_get_id(coap_rx);
+  coap_tick_task = task_get_id(coap_tick);
+  while (coap_szx < 6 && COAP_BLOCK_SIZE(coap_szx + 1) <= CONFIG_COAP_BLOCK_SIZE)
+    coap_szx++;
+  return 0;
+}
@@ -0,0 +1,197 @@
+// Module for LZSS compression with little RAM
+//
+// Strings and streams in the format of utils/lzss.c, the one the file
+// module writes for files opened with "z" in their mode, so a file
+// compressed on the device can be decoded here or the other way round.
+// Where RAM allows and a standard format is wanted, see the zlib module.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "buffer.h"
+#include "lzss.h"
+#include <string.h>
+
+#define COMPRESS_ENCODER_TABLE "compress.encoder"
+#define COMPRESS_DECODER_TABLE "compress.decoder"
+
+typedef struct {
+  lzss_enc_t *e;
+} compress_encoder_t;
+
+typedef struct {
+  lzss_dec_t *d;
+} compress_decoder_t;
+
+static void out_buffer( void *arg, const uint8_t *data, size_t len )
+{
+  luaL_addlstring( (luaL_Buffer *)arg, (const char *)data, len );
+}
+
+static compress_encoder_t *encoder_push( lua_State *L, int arg )
+{
+  int wbits = luaL_optinteger( L, arg, LZSS_WINDOW_BITS );
+  int lbits = luaL_optinteger( L, arg + 1, LZSS_LOOKAHEAD_BITS );
+  luaL_argcheck( L, wbits >= LZSS_MIN_WINDOW_BITS && wbits <= LZSS_MAX_WINDOW_BITS, arg, "out of range" );
+  luaL_argcheck( L, lbits >= 2 && lbits <= wbits - 2, arg + 1, "out of range" );
+  compress_encoder_t *z = (compress_encoder_t *)lua_newuserdata( L, sizeof(compress_encoder_t) );
+  z->e = NULL;
+  luaL_getmetatable( L, COMPRESS_ENCODER_TABLE );
+  lua_setmetatable( L, -2 );
+  if ((z->e = lzss_enc_new( wbits, lbits )) == NULL)
+    luaL_error( L, "out of memory" );
+  return z;
+}
+
+static compress_decoder_t *decoder_push( lua_State *L )
+{
+  compress_decoder_t *z = (compress_decoder_t *)lua_newuserdata( L, sizeof(compress_decoder_t) );
+  z->d = NULL;
+  luaL_getmetatable( L, COMPRESS_DECODER_TABLE );
+  lua_setmetatable( L, -2 );
+  if ((z->d = lzss_dec_new()) == NULL)
+    luaL_error( L, "out of memory" );
+  return z;
+}
+
+// Decodes all of data onto the buffer; false if it is corrupt
+static bool decode( lzss_dec_t *d, const char *data, size_t len, luaL_Buffer *b )
+{
+  const uint8_t *p = (const uint8_t *)data;
+  int n;
+  do {
+    n = lzss_dec_read( d, &p, &len, (uint8_t *)luaL_prepbuffer( b ), LUAL_BUFFERSIZE );
+    if (n < 0)
+      return false;
+    luaL_addsize( b, n );
+  } while (len || n == LUAL_BUFFERSIZE);
+  return true;
+}
+
+// Lua: z = compress.encoder( [window_bits[, lookahead_bits]] )
+// The window is 2^window_bits bytes, 6 to 12, 8 by default; matches are
+// up to 2^lookahead_bits + 1 bytes long, 4 by default. The encoder takes
+// twice the window in RAM, the decoder once.
+static int compress_encoder( lua_State *L )
+{
+  encoder_push( L, 1 );
+  return 1;
+}
+
+// Lua: out = z:write( data[, finish] )
+// Gives back the output that is ready. finish ends the segment, putting
+// out all of it; later writes start a new one.
+static int compress_encoder_write( lua_State *L )
+{
+  compress_encoder_t *z = (compress_encoder_t *)luaL_checkudata( L, 1, COMPRESS_ENCODER_TABLE );
+  size_t len = 0;
+  const char *data = lua_isnoneornil( L, 2 ) ? "" : buffer_checklstring( L, 2, &len );
+  luaL_Buffer b;
+  luaL_buffinit( L, &b );
+  lzss_enc_write( z->e, data, len, lua_toboolean( L, 3 ), out_buffer, &b );
+  luaL_pushresult( &b );
+  return 1;
+}
+
+static int compress_encoder_gc( lua_State *L )
+{
+  compress_encoder_t *z = (compress_encoder_t *)luaL_checkudata( L, 1, COMPRESS_ENCODER_TABLE );
+  lzss_enc_free( z->e );
+  z->e = NULL;
+  return 0;
+}
+
+// Lua: z = compress.decoder()
+static int compress_decoder( lua_State *L )
+{
+  decoder_push( L );
+  return 1;
+}
+
+// Lua: out = z:write( data )
+// Gives back what data decodes to; corrupt data is an error.
+static int compress_decoder_write( lua_State *L )
+{
+  compress_decoder_t *z = (compress_decoder_t *)luaL_checkudata( L, 1, COMPRESS_DECODER_TABLE );
+  size_t len;
+  const char *data = buffer_checklstring( L, 2, &len );
+  luaL_Buffer b;
+  luaL_buffinit( L, &b );
+  if (!decode( z->d, data, len, &b ))
+    return luaL_error( L, "corrupt data" );
+  luaL_pushresult( &b );
+  return 1;
+}
+
+static int compress_decoder_gc( lua_State *L )
+{
+  compress_decoder_t *z = (compress_decoder_t *)luaL_checkudata( L, 1, COMPRESS_DECODER_TABLE );
+  lzss_dec_free( z->d );
+  z->d = NULL;
+  return 0;
+}
+
+// Lua: out = compress.encode( data[, window_bits[, lookahead_bits]] )
+static int compress_encode( lua_State *L )
+{
+  size_t len;
+  const char *data = buffer_checklstring( L, 1, &len );
+  compress_encoder_t *z = encoder_push( L, 2 );
+  luaL_Buffer b;
+  luaL_buffinit( L, &b );
+  lzss_enc_write( z->e, data, len, true, out_buffer, &b );
+  luaL_pushresult( &b );
+  return 1;
+}
+
+// Lua: out = compress.decode( data )
+static int compress_decode( lua_State *L )
+{
+  size_t len;
+  const char *data = buffer_checklstring( L, 1, &len );
+  compress_decoder_t *z = decoder_push( L );
+  luaL_Buffer b;
+  luaL_buffinit( L, &b );
+  if (!decode( z->d, data, len, &b ))
+    return luaL_error( L, "corrupt data" );
+  luaL_pushresult( &b );
+  return 1;
+}
+
+static const LUA_REG_TYPE compress_encoder_map[] = {
+  { LSTRKEY( "write" ),   LFUNCVAL( compress_encoder_write ) },
+  { LSTRKEY( "__gc" ),    LFUNCVAL( compress_encoder_gc ) },
+  { LSTRKEY( "__index" ), LROVAL( compress_encoder_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+static const LUA_REG_TYPE compress_decoder_map[] = {
+  { LSTRKEY( "write" ),   LFUNCVAL( compress_decoder_write ) },
+  { LSTRKEY( "__gc" ),    LFUNCVAL( compress_decoder_gc ) },
+  { LSTRKEY( "__index" ), LROVAL( compress_decoder_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+// Module function map
+const LUA_REG_TYPE compress_map[] = {
+  { LSTRKEY( "encode" ),  LFUNCVAL( compress_encode ) },
+  { LSTRKEY( "decode" ),  LFUNCVAL( compress_decode ) },
+  { LSTRKEY( "encoder" ), LFUNCVAL( compress_encoder ) },
+  { LSTRKEY( "decoder" ), LFUNCVAL( compress_decoder ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_compress( lua_State *L )
+{
+  luaL_rometatable( L, COMPRESS_ENCODER_TABLE, (void *)compress_encoder_map );
+  luaL_rometatable( L, COMPRESS_DECODER_TABLE, (void *)compress_decoder_map );
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_COMPRESSLIBNAME, compress_map );
+  return 1;
+#endif
+}
@@ -0,0 +1,674 @@
+// Module for the Lua prompt on a TCP port
+//
+// console.listen() serves the REPL to one telnet or raw TCP client at a
+// time, alongside the one on UART0: what the client types goes to the
+// interpreter as if it had been typed on the serial port, and the prompt,
+// the echo and what Lua prints go to both. The serial console's paste
+// (^E) and upload (^A) modes work over the connection as well, so
+// tools/upload.py -p host:port deploys files without a cable.
+//
+// Received pbufs wait in a queue that the REPL reads from on the Lua
+// task, with the TCP window held shut until they're read. Output goes
+// into a ring that is written to lwIP's send buffer straight away and
+// topped up as the client acknowledges it. lwIP's callbacks hand their
+// work to the Lua task as event bits, the way bridge does.
+//
+// Telnet: the server offers to echo and to suppress go-ahead, which puts
+// clients into character mode, and ignores any other negotiation. 0xff
+// in data is doubled both ways, so uploads have to escape it; upload.py
+// does.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "ip_fmt.h"
+#include "task/task.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwip/err.h"
+#include "lwip/ip_addr.h"
+#include "lwip/tcp.h"
+
+// Some LWIP macros cause complaints with ptr NULL checks, so shut them off :(
+#pragma GCC diagnostic ignored "-Waddress"
+
+#define CONSOLE_PORT      23
+#define CONSOLE_RXQ       8     // received pbufs waiting for the REPL
+#define CONSOLE_POLL      2     // in lwIP coarse timer ticks, i.e. 1 s
+#define CONSOLE_BLOCK_MS  500   // output waits this long for room in the ring
+#define CONSOLE_PW_MAX    32
+
+#define IAC   255
+#define DONT  254
+#define WILL  251
+#define SB    250
+#define SE    240
+#define OPT_ECHO  1
+#define OPT_SGA   3
+
+enum {
+  EV_ACCEPT     = 1 << 0,
+  EV_TCP_RX     = 1 << 1,
+  EV_TCP_SENT   = 1 << 2,
+  EV_TCP_FIN    = 1 << 3,  // the client closed its side
+  EV_TCP_ERR    = 1 << 4,  // the pcb is gone
+  EV_TIMEOUT    = 1 << 5
+};
+
+// Where the telnet command parser is
+enum { IAC_NONE, IAC_CMD, IAC_OPT, IAC_SB, IAC_SB_IAC };
+
+typedef struct {
+  bool open;
+  struct tcp_pcb *listen;
+  struct tcp_pcb *volatile pcb;  // the client, NULL while there is none
+  bool attached;                 // past the password, the REPL reads it
+  volatile uint32_t events;      // EV_ bits not yet handled
+  volatile uint32_t posted;      // a task event is on its way
+  // client -> REPL: pbufs from the recv callback, single producer and consumer
+  struct pbuf *rxq[CONSOLE_RXQ];
+  volatile uint32_t rxq_head, rxq_tail;
+  struct pbuf *rx;               // being read
+  uint16_t rx_off;
+  uint8_t iac;
+  bool skip_lf;                  // the LF or NUL after the password's CR
+  // REPL -> client, head == tail: empty
+  char *tx;
+  uint32_t tx_head, tx_tail;
+  bool tx_cr;                    // the last byte out was a CR
+  // stdout of the Lua task, while a client is attached
+  FILE *tee, *serial;
+  char *password;
+  char pw[CONSOLE_PW_MAX + 1];
+  uint8_t pw_len;
+  char ahead[16];                // typed after the password, for the REPL
+  uint8_t ahead_len;
+  uint16_t timeout;              // s a client may idle, 0 = for ever
+  volatile uint16_t idle;
+  uint32_t rx_bytes, tx_bytes, dropped, rejected;
+} console_t;
+
+static console_t con;
+static task_handle_t console_task;
+static int cb_connect_ref = LUA_NOREF;
+static int cb_disconnect_ref = LUA_NOREF;
+
+static inline bool console_cas( volatile uint32_t *addr, uint32_t expect, uint32_t set )
+{
+  uxPortCompareSet( addr, expect, &set );
+  return set == expect;
+}
+
+// From lwIP's thread
+static void console_post( uint32_t ev )
+{
+  uint32_t v;
+  do {
+    v = con.events;
+  } while (!console_cas( &con.events, v, v | ev ));
+  if (console_cas( &con.posted, 0, 1 ) && !task_post_medium( console_task, 0 ))
+    con.posted = 0;  // the next event tries again
+}
+
+// --- LWIP callbacks
+
+static void console_err_cb( void *arg, err_t err )
+{
+  if (!arg)
+    return;
+  con.pcb = NULL;  // Will be freed at LWIP level
+  console_post( EV_TCP_ERR );
+}
+
+static err_t console_recv_cb( void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err )
+{
+  if (!arg) {
+    if (p) {
+      tcp_recved( tpcb, p->tot_len );
+      pbuf_free( p );
+    }
+    return ERR_OK;
+  }
+  con.idle = 0;
+  if (!p) {
+    console_post( EV_TCP_FIN );
+    return ERR_OK;
+  }
+  if (con.rxq_head - con.rxq_tail == CONSOLE_RXQ)
+    return ERR_MEM;  // lwIP holds on to the data and offers it again later
+  con.rxq[con.rxq_head % CONSOLE_RXQ] = p;
+  con.rxq_head++;
+  console_post( EV_TCP_RX );
+  return ERR_OK;
+}
+
+static err_t console_sent_cb( void *arg, struct tcp_pcb *tpcb, u16_t len )
+{
+  if (!arg)
+    return ERR_OK;
+  con.idle = 0;
+  console_post( EV_TCP_SENT );
+  return ERR_OK;
+}
+
+static err_t console_poll_cb( void *arg, struct tcp_pcb *tpcb )
+{
+  if (arg && con.timeout && ++con.idle == con.timeout)
+    console_post( EV_TIMEOUT );
+  return ERR_OK;
+}
+
+static err_t console_accept_cb( void *arg, struct tcp_pcb *newpcb, err_t err )
+{
+  // Anything but ERR_OK has lwIP abort the new connection
+  if (!arg || !con.open || err != ERR_OK)
+    return ERR_VAL;
+  tcp_accepted( con.listen );
+  if (con.pcb || (con.events & (EV_ACCEPT | EV_TCP_ERR))) {
+    con.rejected++;  // one client at a time
+    return ERR_MEM;
+  }
+  con.idle = 0;
+  tcp_arg( newpcb, &con );
+  tcp_err( newpcb, console_err_cb );
+  tcp_recv( newpcb, console_recv_cb );
+  tcp_sent( newpcb, console_sent_cb );
+  if (con.timeout)
+    tcp_poll( newpcb, console_poll_cb, CONSOLE_POLL );
+  tcp_nagle_disable( newpcb );  // echo goes out as it's typed
+  con.pcb = newpcb;
+  console_post( EV_ACCEPT );
+  return ERR_OK;
+}
+
+// --- Data
+
+static void console_rx_free( void )
+{
+  if (con.rx)
+    pbuf_free( con.rx );
+  con.rx = NULL;
+  con.rx_off = 0;
+  while (con.rxq_tail != con.rxq_head) {
+    pbuf_free( con.rxq[con.rxq_tail % CONSOLE_RXQ] );
+    con.rxq_tail++;
+  }
+}
+
+// Up to len bytes from the client, telnet commands taken out
+static size_t console_rx( char *buf, size_t len )
+{
+  while (con.rxq_tail != con.rxq_head) {
+    struct pbuf *p = con.rxq[con.rxq_tail % CONSOLE_RXQ];
+    con.rxq_tail++;
+    if (con.rx)
+      pbuf_cat( con.rx, p );
+    else
+      con.rx = p;
+  }
+  size_t n = 0;
+  uint32_t used = 0;
+  struct pbuf *q;
+  while (n < len && (q = con.rx)) {
+    uint8_t c = ((const uint8_t *)q->payload)[con.rx_off++];
+    used++;
+    if (con.rx_off == q->len) {
+      // pbuf_dechain drops the chain's hold on the rest, so take our own
+      con.rx = q->next;
+      if (con.rx)
+        pbuf_ref( con.rx );
+      pbuf_dechain( q );
+      pbuf_free( q );
+      con.rx_off = 0;
+    }
+    bool skip_lf = con.skip_lf;
+    con.skip_lf = false;
+    switch (con.iac) {
+    case IAC_NONE:
+      if (c == IAC)
+        con.iac = IAC_CMD;
+      else if (!skip_lf || (c != '\n' && c != '\0'))
+        buf[n++] = c;
+      break;
+    case IAC_CMD:
+      con.iac = c == SB ? IAC_SB : c >= WILL && c <= DONT ? IAC_OPT : IAC_NONE;
+      if (c == IAC)
+        buf[n++] = c;  // a doubled one is data
+      break;
+    case IAC_OPT:
+      con.iac = IAC_NONE;
+      break;
+    case IAC_SB:
+      if (c == IAC)
+        con.iac = IAC_SB_IAC;
+      break;
+    case IAC_SB_IAC:
+      con.iac = c == SE ? IAC_NONE : IAC_SB;
+      break;
+    }
+  }
+  con.rx_bytes += n;
+  // Opens the window again for what has been read
+  while (used && con.pcb) {
+    u16_t k = used > 0xffff ? 0xffff : used;
+    tcp_recved( con.pcb, k );
+    used -= k;
+  }
+  return n;
+}
+
+static uint32_t console_tx_used( void )
+{
+  return (con.tx_head + CONFIG_CONSOLE_TX_BUF - con.tx_tail) % CONFIG_CONSOLE_TX_BUF;
+}
+
+// The ring to the client, as far as lwIP's send buffer takes it
+static void console_to_tcp( void )
+{
+  struct tcp_pcb *pcb = con.pcb;
+  if (!pcb) {
+    con.tx_head = con.tx_tail = 0;
+    return;
+  }
+  bool wrote = false;
+  while (con.tx_head != con.tx_tail) {
+    uint32_t len = (con.tx_head > con.tx_tail ? con.tx_head : CONFIG_CONSOLE_TX_BUF) - con.tx_tail;
+    u16_t room = tcp_sndbuf( pcb );
+    if (len > room)
+      len = room;
+    if (len == 0 || tcp_write( pcb, con.tx + con.tx_tail, len, TCP_WRITE_FLAG_COPY ) != ERR_OK)
+      break;  // the sent callback tries again
+    con.tx_tail = (con.tx_tail + len) % CONFIG_CONSOLE_TX_BUF;
+    con.tx_bytes += len;
+    wrote = true;
+  }
+  if (wrote)
+    tcp_output( pcb );
+}
+
+// One byte into the ring. When it's full, Lua waits a while for the client
+// to take some before the byte is dropped.
+static void console_put( char c )
+{
+  if (console_tx_used() == CONFIG_CONSOLE_TX_BUF - 1) {
+    TickType_t start = xTaskGetTickCount();
+    for (;;) {
+      console_to_tcp();
+      if (console_tx_used() < CONFIG_CONSOLE_TX_BUF - 1)
+        break;
+      if (!con.pcb || (xTaskGetTickCount() - start) * portTICK_PERIOD_MS > CONSOLE_BLOCK_MS) {
+        con.dropped++;
+        return;
+      }
+      vTaskDelay( 1 );
+    }
+  }
+  con.tx[con.tx_head] = c;
+  con.tx_head = (con.tx_head + 1) % CONFIG_CONSOLE_TX_BUF;
+}
+
+// Telnet commands and the password prompt, as they are
+static void console_raw( const char *s, size_t len )
+{
+  for (size_t i = 0; i < len; i++)
+    console_put( s[i] );
+  console_to_tcp();
+}
+
+// REPL output: 0xff doubled and bare LFs made CR LF for telnet
+static void console_write( const char *s, size_t len )
+{
+  if (!con.attached)
+    return;
+  for (size_t i = 0; i < len; i++) {
+    char c = s[i];
+    if (c == '\n' && !con.tx_cr)
+      console_put( '\r' );
+    else if ((uint8_t)c == IAC)
+      console_put( c );
+    console_put( c );
+    con.tx_cr = c == '\r';
+  }
+  console_to_tcp();
+}
+
+static size_t console_read( char *buf, size_t len )
+{
+  if (!con.attached)
+    return 0;
+  if (!con.ahead_len)
+    return console_rx( buf, len );
+  size_t n = con.ahead_len < len ? con.ahead_len : len;
+  memcpy( buf, con.ahead, n );
+  con.ahead_len -= n;
+  memmove( con.ahead, con.ahead + n, con.ahead_len );
+  return n;
+}
+
+static const lua_Console console_io = { console_read, console_write };
+
+// What Lua prints on its task goes through here to the serial port and
+// the client
+static int console_stdout_write( void *cookie, const char *buf, int len )
+{
+  fwrite( buf, 1, len, con.serial );
+  fflush( con.serial );
+  console_write( buf, len );
+  return len;
+}
+
+// --- Lua task
+
+// The client is let at the REPL; from the Lua task, whose stdout is teed
+static void console_attach( void )
+{
+  if (!con.tee) {
+    con.tee = funopen( NULL, NULL, console_stdout_write, NULL, NULL );
+    if (con.tee)
+      setvbuf( con.tee, NULL, _IONBF, 0 );
+  }
+  if (con.tee) {
+    fflush( stdout );
+    con.serial = stdout;
+    stdout = con.tee;
+  }
+  con.attached = true;
+  lua_set_remote_console( &console_io );
+  lua_input_ready();  // typed ahead
+}
+
+static void console_drop_client( bool abort )
+{
+  if (con.attached) {
+    lua_set_remote_console( NULL );
+    con.attached = false;
+    if (con.tee && stdout == con.tee)
+      stdout = con.serial;
+  }
+  struct tcp_pcb *pcb = con.pcb;
+  con.pcb = NULL;
+  if (pcb) {
+    tcp_arg( pcb, NULL );
+    tcp_err( pcb, NULL );
+    tcp_recv( pcb, NULL );
+    tcp_sent( pcb, NULL );
+    tcp_poll( pcb, NULL, 0 );
+    if (abort || tcp_close( pcb ) != ERR_OK)
+      tcp_abort( pcb );
+  }
+  console_rx_free();
+  con.tx_head = con.tx_tail = 0;
+  con.tx_cr = false;
+  con.iac = IAC_NONE;
+  con.skip_lf = false;
+  con.pw_len = 0;
+  con.ahead_len = 0;
+}
+
+static void console_told( lua_State *L, int ref, int nargs )
+{
+  if (ref == LUA_NOREF) {
+    lua_pop( L, nargs );
+    return;
+  }
+  lua_rawgeti( L, LUA_REGISTRYINDEX, ref );
+  lua_insert( L, -1 - nargs );
+  lua_call( L, nargs, 0 );
+}
+
+static void console_disconnected( lua_State *L, const char *why, bool abort )
+{
+  console_drop_client( abort );
+  lua_pushstring( L, why );
+  console_told( L, cb_disconnect_ref, 1 );
+}
+
+// The password, up to the end of the line; one try
+static void console_login( lua_State *L )
+{
+  char buf[16];
+  size_t n;
+  while (!con.attached && (n = console_rx( buf, sizeof(buf) )) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      char c = buf[i];
+      if (c != '\r' && c != '\n') {
+        if (con.pw_len <= CONSOLE_PW_MAX)
+          con.pw[con.pw_len++] = c;
+        continue;
+      }
+      bool ok = con.pw_len == strlen( con.password ) &&
+                memcmp( con.pw, con.password, con.pw_len ) == 0;
+      memset( con.pw, 0, sizeof(con.pw) );
+      con.pw_len = 0;
+      if (!ok) {
+        console_raw( "\r\ndenied\r\n", 10 );
+        console_disconnected( L, "denied", false );
+        return;
+      }
+      // The rest goes to the REPL, bar the other half of CR LF
+      i++;
+      if (i == n)
+        con.skip_lf = true;
+      else if (buf[i] == '\n' || buf[i] == '\0')
+        i++;
+      memcpy( con.ahead, buf + i, n - i );
+      con.ahead_len = n - i;
+      console_raw( "\r\n", 2 );
+      console_attach();
+      return;
+    }
+  }
+}
+
+static void console_handle_event( task_param_t param, task_prio_t prio )
+{
+  (void)param;
+  (void)prio;
+  con.posted = 0;
+  uint32_t ev;
+  do {
+    ev = con.events;
+  } while (!console_cas( &con.events, ev, 0 ));
+  if (!con.open)
+    return;
+
+  lua_State *L = lua_getstate();
+  if (ev & EV_ACCEPT) {
+    struct tcp_pcb *pcb = con.pcb;
+    if (pcb) {
+      static const char will[] = { IAC, WILL, OPT_ECHO, IAC, WILL, OPT_SGA };
+      console_raw( will, sizeof(will) );
+      if (con.password)
+        console_raw( "password: ", 10 );
+      else
+        console_attach();
+      char ip[IP_STR_SZ];
+      ipstr( ip, &pcb->remote_ip );
+      lua_pushstring( L, ip );
+      lua_pushinteger( L, pcb->remote_port );
+      console_told( L, cb_connect_ref, 2 );
+    }
+  }
+  if (!con.open)
+    return;  // the callback closed the console
+  if (ev & EV_TCP_ERR) {
+    con.pcb = NULL;
+    console_disconnected( L, "reset", false );
+  } else if (ev & EV_TIMEOUT && con.pcb && con.idle >= con.timeout) {
+    console_disconnected( L, "timeout", true );
+  } else if (con.pcb) {
+    if (ev & EV_TCP_RX && !con.attached)
+      console_login( L );
+    else if (ev & EV_TCP_RX)
+      lua_input_ready();
+    if (ev & EV_TCP_SENT && con.pcb)
+      console_to_tcp();
+    if (ev & EV_TCP_FIN && con.pcb) {
+      // What came before the FIN is run first, for "echo ... | nc"
+      if (con.attached)
+        lua_handle_input( false );
+      console_disconnected( L, "closed", false );
+    }
+  }
+}
+
+// --- Lua API
+
+static void console_free( void )
+{
+  con.open = false;
+  if (con.listen) {
+    tcp_arg( con.listen, NULL );
+    tcp_close( con.listen );
+    con.listen = NULL;
+  }
+  console_drop_client( true );
+  free( con.tx );
+  con.tx = NULL;
+  free( con.password );
+  con.password = NULL;
+  // An event may still be queued; console_handle_event finds it closed.
+  // lwIP calls in flight see a NULL arg from here on.
+}
+
+// Lua: console.listen( [port[, { password = s, timeout = s }]] )
+// Serves the REPL on port, 23 by default, to one client at a time; more
+// are refused while one is connected. With a password the client has to
+// send it, and a line end, before it gets the prompt, and is dropped on a
+// wrong one. timeout drops a client after that many seconds without
+// traffic either way. There is no encryption, so keep it to trusted
+// networks.
+static int console_listen( lua_State *L )
+{
+  int port = luaL_optinteger( L, 1, CONSOLE_PORT );
+  luaL_argcheck( L, port > 0 && port <= 0xffff, 1, "invalid port" );
+  const char *password = NULL;
+  int timeout = 0;
+  if (lua_istable( L, 2 )) {
+    lua_getfield( L, 2, "password" );
+    password = luaL_optstring( L, -1, NULL );
+    lua_getfield( L, 2, "timeout" );
+    timeout = luaL_optinteger( L, -1, 0 );
+    lua_pop( L, 2 );  // password stays referenced by the table
+  }
+  luaL_argcheck( L, !password || strlen( password ) <= CONSOLE_PW_MAX, 2, "password too long" );
+  luaL_argcheck( L, timeout >= 0 && timeout <= 0xffff, 2, "invalid timeout" );
+  if (con.open)
+    return luaL_error( L, "already listening" );
+
+  con.tx = (char *)malloc( CONFIG_CONSOLE_TX_BUF );
+  con.password = password ? strdup( password ) : NULL;
+  if (!con.tx || (password && !con.password)) {
+    console_free();
+    return luaL_error( L, "out of memory" );
+  }
+  con.timeout = timeout;
+  con.rx_bytes = con.tx_bytes = con.dropped = con.rejected = 0;
+
+  struct tcp_pcb *pcb = tcp_new();
+  if (!pcb) {
+    console_free();
+    return luaL_error( L, "cannot allocate PCB" );
+  }
+  if (tcp_bind( pcb, IP_ADDR_ANY, port ) != ERR_OK) {
+    tcp_close( pcb );
+    console_free();
+    return luaL_error( L, "cannot bind to port %d", port );
+  }
+  struct tcp_pcb *lpcb = tcp_listen_with_backlog( pcb, 1 );
+  if (!lpcb) {
+    tcp_close( pcb );
+    console_free();
+    return luaL_error( L, "out of memory" );
+  }
+  con.listen = lpcb;
+  con.open = true;
+  tcp_arg( lpcb, &con );
+  tcp_accept( lpcb, console_accept_cb );
+  return 0;
+}
+
+// Lua: console.on( "connection", function( ip, port ) )
+//      console.on( "disconnection", function( reason ) )
+// reason is "closed" by the client or console.kick(), "reset", "timeout"
+// or "denied" for a wrong password
+static int console_on( lua_State *L )
+{
+  static const char * const names[] = { "connection", "disconnection", NULL };
+  int which = luaL_checkoption( L, 1, NULL, names );
+  int *ref = which == 0 ? &cb_connect_ref : &cb_disconnect_ref;
+  luaL_unref( L, LUA_REGISTRYINDEX, *ref );
+  *ref = LUA_NOREF;
+  if (!lua_isnoneornil( L, 2 )) {
+    luaL_checkanyfunction( L, 2 );
+    lua_pushvalue( L, 2 );
+    *ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  return 0;
+}
+
+// Lua: stats = console.stats()
+// Bytes each way, output bytes dropped for a slow client, clients refused,
+// and whether one is connected
+static int console_stats( lua_State *L )
+{
+  lua_createtable( L, 0, 5 );
+  lua_pushinteger( L, con.rx_bytes );
+  lua_setfield( L, -2, "rx" );
+  lua_pushinteger( L, con.tx_bytes );
+  lua_setfield( L, -2, "tx" );
+  lua_pushinteger( L, con.dropped );
+  lua_setfield( L, -2, "dropped" );
+  lua_pushinteger( L, con.rejected );
+  lua_setfield( L, -2, "rejected" );
+  lua_pushboolean( L, con.pcb != NULL );
+  lua_setfield( L, -2, "connected" );
+  return 1;
+}
+
+// Lua: console.kick()
+// Drops the client, if there is one, and goes on listening
+static int console_kick( lua_State *L )
+{
+  if (con.open && con.pcb)
+    console_disconnected( L, "closed", false );
+  return 0;
+}
+
+// Lua: console.close()
+// Drops the client and stops listening
+static int console_close( lua_State *L )
+{
+  if (con.open)
+    console_free();
+  return 0;
+}
+
+// Module function map
+const LUA_REG_TYPE console_map[] = {
+  { LSTRKEY( "listen" ), LFUNCVAL( console_listen ) },
+  { LSTRKEY( "on" ),     LFUNCVAL( console_on ) },
+  { LSTRKEY( "stats" ),  LFUNCVAL( console_stats ) },
+  { LSTRKEY( "kick" ),   LFUNCVAL( console_kick ) },
+  { LSTRKEY( "close" ),  LFUNCVAL( console_close ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_console( lua_State *L )
+{
+  console_task = task_get_id( console_handle_event );
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_CONSOLELIBNAME, console_map );
+  return 1;
+#endif
+}
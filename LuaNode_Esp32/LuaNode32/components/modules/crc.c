@@ -0,0 +1,148 @@
+// Module for CRC-8, CRC-16 and CRC-32 checksums
+//
+// crc8 is the one utils/crc8.c computes (polynomial 0x07, starting from
+// 0xff), crc16 is CRC-16/CCITT as the log store and bytecode stamps use it
+// (0x1021, starting from 0), crc16modbus the one Modbus RTU frames end in
+// (0x8005 reflected, starting from 0xffff), crc32 the zlib/Ethernet one,
+// done by the ROM like the upload protocol does. Each takes the previous
+// result to go on from, so data can be checked a piece at a time.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "buffer.h"
+#include "vfs.h"
+#include "crc8.h"
+#include "crc16.h"
+#include "rom/crc.h"
+#include <stdlib.h>
+
+#define CRC_FILE_CHUNK  1024    // read from a file this much at a time
+
+enum { CRC_8, CRC_16, CRC_16_MODBUS, CRC_32 };
+
+static const char * const crc_names[] = { "crc8", "crc16", "crc16modbus", "crc32", NULL };
+
+static uint32_t crc_initial( int algo )
+{
+  switch (algo) {
+  case CRC_8:  return crc8_init();
+  case CRC_16: return CRC16_INITIAL_CRC;
+  case CRC_16_MODBUS: return CRC16_MODBUS_INITIAL_CRC;
+  default:     return 0;
+  }
+}
+
+static uint32_t crc_update( int algo, uint32_t crc, const void *data, size_t len )
+{
+  switch (algo) {
+  case CRC_8:  return crc8_calc( crc, (void *)data, len );
+  case CRC_16: return crc16_ccitt( crc, data, len );
+  case CRC_16_MODBUS: return crc16_modbus( crc, data, len );
+  default:     return crc32_le( crc, data, len );
+  }
+}
+
+static int crc_calc( lua_State *L, int algo )
+{
+  size_t len;
+  const char *data = buffer_checklstring( L, 1, &len );
+  uint32_t crc = lua_isnoneornil( L, 2 ) ? crc_initial( algo ) : (uint32_t)luaL_checknumber( L, 2 );
+  lua_pushnumber( L, crc_update( algo, crc, data, len ) );
+  return 1;
+}
+
+// Lua: crc = crc.crc8( data[, crc] )
+// data is a string or buffer. With crc, the result is that of the data
+// before followed by this.
+static int crc_crc8( lua_State *L )
+{
+  return crc_calc( L, CRC_8 );
+}
+
+// Lua: crc = crc.crc16( data[, crc] )
+static int crc_crc16( lua_State *L )
+{
+  return crc_calc( L, CRC_16 );
+}
+
+// Lua: crc = crc.crc16modbus( data[, crc] )
+static int crc_crc16modbus( lua_State *L )
+{
+  return crc_calc( L, CRC_16_MODBUS );
+}
+
+// Lua: crc = crc.crc32( data[, crc] )
+static int crc_crc32( lua_State *L )
+{
+  return crc_calc( L, CRC_32 );
+}
+
+// Lua: crc = crc.file( algo, filename[, offset[, len]] )
+// Checks len bytes of the file from offset on, the rest of it by default,
+// without any of it going through Lua. Returns nil if the file can't be
+// opened or ends before offset + len.
+static int crc_file( lua_State *L )
+{
+  int algo = luaL_checkoption( L, 1, NULL, crc_names );
+  const char *fname = luaL_checkstring( L, 2 );
+  int32_t off = luaL_optinteger( L, 3, 0 );
+  int32_t want = luaL_optinteger( L, 4, -1 );
+  luaL_argcheck( L, off >= 0, 3, "negative offset" );
+
+  int fd = vfs_open( fname, "r" );
+  if (!fd) {
+    lua_pushnil( L );
+    return 1;
+  }
+  uint8_t *buf = (uint8_t *)malloc( CRC_FILE_CHUNK );
+  if (!buf) {
+    vfs_close( fd );
+    return luaL_error( L, "out of memory" );
+  }
+
+  uint32_t crc = crc_initial( algo );
+  bool ok = vfs_lseek( fd, off, VFS_SEEK_SET ) >= 0;
+  while (ok && want != 0) {
+    size_t k = want < 0 || want > CRC_FILE_CHUNK ? CRC_FILE_CHUNK : (size_t)want;
+    int32_t n = vfs_read( fd, buf, k );
+    if (n <= 0) {
+      ok = want < 0 && n == 0;   // the end is only fine if no length was given
+      break;
+    }
+    crc = crc_update( algo, crc, buf, n );
+    if (want > 0)
+      want -= n;
+  }
+  free( buf );
+  vfs_close( fd );
+
+  if (ok)
+    lua_pushnumber( L, crc );
+  else
+    lua_pushnil( L );
+  return 1;
+}
+
+// Module function map
+const LUA_REG_TYPE crc_map[] = {
+  { LSTRKEY( "crc8" ),  LFUNCVAL( crc_crc8 ) },
+  { LSTRKEY( "crc16" ), LFUNCVAL( crc_crc16 ) },
+  { LSTRKEY( "crc16modbus" ), LFUNCVAL( crc_crc16modbus ) },
+  { LSTRKEY( "crc32" ), LFUNCVAL( crc_crc32 ) },
+  { LSTRKEY( "file" ),  LFUNCVAL( crc_file ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_crc( lua_State *L )
+{
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_CRCLIBNAME, crc_map );
+  return 1;
+#endif
+}
@@ -0,0 +1,437 @@
+// Module for hashes, HMAC and AES
+//
+// AES runs on the AES engine in every mode: mbedtls is built with
+// MBEDTLS_AES_ALT, so the block cipher under CBC, CTR and GCM is the
+// hardware one. One-shot SHA digests go to the SHA engine as well. The
+// engine keeps the state of the hash it is working on inside itself and
+// stays locked from the first byte to the last, so incremental hashes and
+// HMAC, which may stay open across any number of Lua calls, run in
+// software (mbedtls), as does MD5, which the engine doesn't do.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "buffer.h"
+#include <string.h>
+
+#include "hwcrypto/sha.h"
+#include "mbedtls/md.h"
+#include "mbedtls/aes.h"
+#include "mbedtls/gcm.h"
+
+#define HASH_OBJ            "crypto.hash"
+#define GCM_OBJ             "crypto.gcm"
+
+#define AES_BLOCK           16
+#define GCM_TAG_LEN         16
+
+// Output is produced this much at a time, straight into the luaL_Buffer
+#define CRYPTO_CHUNK        (LUAL_BUFFERSIZE & ~(AES_BLOCK - 1))
+
+typedef struct {
+  mbedtls_md_context_t ctx;
+  bool hmac;
+} crypto_hash_t;
+
+enum { AES_CBC, AES_CTR, AES_GCM };
+
+static const char * const crypto_cipher_names[] = { "aes-cbc", "aes-ctr", "aes-gcm", NULL };
+
+static const mbedtls_md_info_t *crypto_check_algo( lua_State *L, int idx )
+{
+  static const char * const names[] = { "md5", "sha1", "sha224", "sha256", "sha384", "sha512", NULL };
+  static const mbedtls_md_type_t types[] = {
+    MBEDTLS_MD_MD5, MBEDTLS_MD_SHA1, MBEDTLS_MD_SHA224,
+    MBEDTLS_MD_SHA256, MBEDTLS_MD_SHA384, MBEDTLS_MD_SHA512
+  };
+  int i = luaL_checkoption( L, idx, NULL, names );
+  const mbedtls_md_info_t *info = mbedtls_md_info_from_type( types[i] );
+  if (!info)
+    luaL_error( L, "%s not available", names[i] );
+  return info;
+}
+
+// Lua: digest = crypto.digest( algo, data )
+// algo is one of md5, sha1, sha224, sha256, sha384 or sha512 and data a
+// string or buffer. The digest comes back as binary, crypto.tohex() makes
+// it readable.
+static int crypto_digest( lua_State *L )
+{
+  const mbedtls_md_info_t *info = crypto_check_algo( L, 1 );
+  size_t len;
+  const uint8_t *data = (const uint8_t *)buffer_checklstring( L, 2, &len );
+  uint8_t out[MBEDTLS_MD_MAX_SIZE];
+
+  switch (mbedtls_md_get_type( info )) {
+  case MBEDTLS_MD_SHA1:
+    esp_sha1( data, len, out );
+    break;
+  case MBEDTLS_MD_SHA224:
+  case MBEDTLS_MD_SHA256:
+    esp_sha256( data, len, out, mbedtls_md_get_type( info ) == MBEDTLS_MD_SHA224 );
+    break;
+  case MBEDTLS_MD_SHA384:
+  case MBEDTLS_MD_SHA512:
+    esp_sha512( data, len, out, mbedtls_md_get_type( info ) == MBEDTLS_MD_SHA384 );
+    break;
+  default:
+    mbedtls_md( info, data, len, out );
+    break;
+  }
+  lua_pushlstring( L, (const char *)out, mbedtls_md_get_size( info ) );
+  return 1;
+}
+
+static int crypto_hash_new( lua_State *L, const mbedtls_md_info_t *info, const uint8_t *key, size_t keylen )
+{
+  crypto_hash_t *h = (crypto_hash_t *)lua_newuserdata( L, sizeof(crypto_hash_t) );
+  mbedtls_md_init( &h->ctx );
+  h->hmac = key != NULL;
+  luaL_getmetatable( L, HASH_OBJ );
+  lua_setmetatable( L, -2 );
+
+  if (mbedtls_md_setup( &h->ctx, info, h->hmac ) != 0)
+    return luaL_error( L, "out of memory" );
+  if (h->hmac)
+    mbedtls_md_hmac_starts( &h->ctx, key, keylen );
+  else
+    mbedtls_md_starts( &h->ctx );
+  return 1;
+}
+
+// Lua: h = crypto.hash( algo )
+// h:update(data) adds data and returns h, so calls can be chained;
+// h:finalize() returns the digest and starts h over.
+static int crypto_hash( lua_State *L )
+{
+  return crypto_hash_new( L, crypto_check_algo( L, 1 ), NULL, 0 );
+}
+
+// Lua: h = crypto.hmac( algo, key )
+// Lua: mac = crypto.hmac( algo, key, data )
+// Without data, an object like crypto.hash() gives, which returns the MAC
+// from finalize().
+static int crypto_hmac( lua_State *L )
+{
+  const mbedtls_md_info_t *info = crypto_check_algo( L, 1 );
+  size_t keylen;
+  const uint8_t *key = (const uint8_t *)buffer_checklstring( L, 2, &keylen );
+
+  if (lua_isnoneornil( L, 3 ))
+    return crypto_hash_new( L, info, key, keylen );
+
+  size_t len;
+  const uint8_t *data = (const uint8_t *)buffer_checklstring( L, 3, &len );
+  uint8_t out[MBEDTLS_MD_MAX_SIZE];
+  if (mbedtls_md_hmac( info, key, keylen, data, len, out ) != 0)
+    return luaL_error( L, "out of memory" );
+  lua_pushlstring( L, (const char *)out, mbedtls_md_get_size( info ) );
+  return 1;
+}
+
+static crypto_hash_t *crypto_check_hash( lua_State *L )
+{
+  crypto_hash_t *h = (crypto_hash_t *)luaL_checkudata( L, 1, HASH_OBJ );
+  luaL_argcheck( L, h->ctx.md_info != NULL, 1, "hash is closed" );
+  return h;
+}
+
+// Lua: h = h:update( data )
+static int crypto_hash_update( lua_State *L )
+{
+  crypto_hash_t *h = crypto_check_hash( L );
+  size_t len;
+  const uint8_t *data = (const uint8_t *)buffer_checklstring( L, 2, &len );
+  if (h->hmac)
+    mbedtls_md_hmac_update( &h->ctx, data, len );
+  else
+    mbedtls_md_update( &h->ctx, data, len );
+  lua_settop( L, 1 );
+  return 1;
+}
+
+// Lua: digest = h:finalize()
+static int crypto_hash_finalize( lua_State *L )
+{
+  crypto_hash_t *h = crypto_check_hash( L );
+  uint8_t out[MBEDTLS_MD_MAX_SIZE];
+  if (h->hmac) {
+    mbedtls_md_hmac_finish( &h->ctx, out );
+    mbedtls_md_hmac_reset( &h->ctx );
+  } else {
+    mbedtls_md_finish( &h->ctx, out );
+    mbedtls_md_starts( &h->ctx );
+  }
+  lua_pushlstring( L, (const char *)out, mbedtls_md_get_size( h->ctx.md_info ) );
+  return 1;
+}
+
+static int crypto_hash_gc( lua_State *L )
+{
+  crypto_hash_t *h = (crypto_hash_t *)luaL_checkudata( L, 1, HASH_OBJ );
+  mbedtls_md_free( &h->ctx );   // leaves md_info NULL
+  return 0;
+}
+
+// mbedtls_gcm_free() zeroes the context, so this is safe after it too
+static int crypto_gcm_gc( lua_State *L )
+{
+  mbedtls_gcm_free( (mbedtls_gcm_context *)luaL_checkudata( L, 1, GCM_OBJ ) );
+  return 0;
+}
+
+static void crypto_check_key( lua_State *L, int idx, const uint8_t **key, unsigned *bits )
+{
+  size_t len;
+  *key = (const uint8_t *)buffer_checklstring( L, idx, &len );
+  luaL_argcheck( L, len == 16 || len == 24 || len == 32, idx, "key must be 16, 24 or 32 bytes" );
+  *bits = len * 8;
+}
+
+// CBC and CTR. CBC pads with PKCS#7 on the way in and checks and strips it
+// on the way out; returns false if the padding is wrong.
+static bool crypto_aes( lua_State *L, int mode, bool encrypt, const uint8_t *key, unsigned bits,
+                        uint8_t iv[AES_BLOCK], const uint8_t *in, size_t len )
+{
+  mbedtls_aes_context aes;
+  uint8_t stream[AES_BLOCK], last[AES_BLOCK];
+  size_t off = 0;
+  luaL_Buffer b;
+
+  mbedtls_aes_init( &aes );
+  if (mode == AES_CBC && !encrypt)
+    mbedtls_aes_setkey_dec( &aes, key, bits );
+  else
+    mbedtls_aes_setkey_enc( &aes, key, bits );
+
+  luaL_buffinit( L, &b );
+  if (mode == AES_CTR) {
+    while (len) {
+      size_t k = len < CRYPTO_CHUNK ? len : CRYPTO_CHUNK;
+      uint8_t *out = (uint8_t *)luaL_prepbuffer( &b );
+      mbedtls_aes_crypt_ctr( &aes, k, &off, iv, stream, in, out );
+      luaL_addsize( &b, k );
+      in += k;
+      len -= k;
+    }
+  } else if (encrypt) {
+    size_t whole = len & ~(AES_BLOCK - 1);
+    while (whole) {
+      size_t k = whole < CRYPTO_CHUNK ? whole : CRYPTO_CHUNK;
+      uint8_t *out = (uint8_t *)luaL_prepbuffer( &b );
+      mbedtls_aes_crypt_cbc( &aes, MBEDTLS_AES_ENCRYPT, k, iv, in, out );
+      luaL_addsize( &b, k );
+      in += k;
+      whole -= k;
+    }
+    size_t rest = len & (AES_BLOCK - 1);
+    memcpy( last, in, rest );
+    memset( last + rest, AES_BLOCK - rest, AES_BLOCK - rest );
+    mbedtls_aes_crypt_cbc( &aes, MBEDTLS_AES_ENCRYPT, AES_BLOCK, iv, last, last );
+    luaL_addlstring( &b, (const char *)last, AES_BLOCK );
+  } else {
+    // everything but the last block, which holds the padding
+    size_t whole = len - AES_BLOCK;
+    while (whole) {
+      size_t k = whole < CRYPTO_CHUNK ? whole : CRYPTO_CHUNK;
+      uint8_t *out = (uint8_t *)luaL_prepbuffer( &b );
+      mbedtls_aes_crypt_cbc( &aes, MBEDTLS_AES_DECRYPT, k, iv, in, out );
+      luaL_addsize( &b, k );
+      in += k;
+      whole -= k;
+    }
+    mbedtls_aes_crypt_cbc( &aes, MBEDTLS_AES_DECRYPT, AES_BLOCK, iv, in, last );
+    unsigned pad = last[AES_BLOCK - 1];
+    bool ok = pad >= 1 && pad <= AES_BLOCK;
+    for (unsigned i = 0; ok && i < pad; i++)
+      ok = last[AES_BLOCK - 1 - i] == pad;
+    if (!ok) {
+      mbedtls_aes_free( &aes );
+      return false;
+    }
+    luaL_addlstring( &b, (const char *)last, AES_BLOCK - pad );
+  }
+  mbedtls_aes_free( &aes );
+  luaL_pushresult( &b );
+  return true;
+}
+
+// GCM; the context lives in a userdata so an error from the luaL_Buffer
+// can't leak it. Decrypting leaves the plaintext on the stack only if
+// the tag matches.
+static bool crypto_gcm( lua_State *L, bool encrypt, const uint8_t *key, unsigned bits,
+                        const uint8_t *iv, size_t ivlen, const uint8_t *aad, size_t aadlen,
+                        const uint8_t *in, size_t len, uint8_t tag[GCM_TAG_LEN] )
+{
+  mbedtls_gcm_context *gcm = (mbedtls_gcm_context *)lua_newuserdata( L, sizeof(mbedtls_gcm_context) );
+  mbedtls_gcm_init( gcm );
+  luaL_getmetatable( L, GCM_OBJ );
+  lua_setmetatable( L, -2 );
+  int ctx = lua_gettop( L );
+
+  if (mbedtls_gcm_setkey( gcm, MBEDTLS_CIPHER_ID_AES, key, bits ) != 0)
+    luaL_error( L, "out of memory" );
+  mbedtls_gcm_starts( gcm, encrypt ? MBEDTLS_GCM_ENCRYPT : MBEDTLS_GCM_DECRYPT, iv, ivlen, aad, aadlen );
+
+  luaL_Buffer b;
+  luaL_buffinit( L, &b );
+  while (len) {
+    size_t k = len < CRYPTO_CHUNK ? len : CRYPTO_CHUNK;
+    uint8_t *out = (uint8_t *)luaL_prepbuffer( &b );
+    mbedtls_gcm_update( gcm, k, in, out );
+    luaL_addsize( &b, k );
+    in += k;
+    len -= k;
+  }
+  luaL_pushresult( &b );
+
+  uint8_t check[GCM_TAG_LEN];
+  mbedtls_gcm_finish( gcm, encrypt ? tag : check, GCM_TAG_LEN );
+  mbedtls_gcm_free( gcm );
+  lua_remove( L, ctx );
+  if (encrypt)
+    return true;
+
+  uint8_t diff = 0;
+  for (int i = 0; i < GCM_TAG_LEN; i++)
+    diff |= check[i] ^ tag[i];
+  if (diff) {
+    lua_pop( L, 1 );
+    return false;
+  }
+  return true;
+}
+
+static void crypto_check_iv( lua_State *L, int idx, int mode, const uint8_t **iv, size_t *len )
+{
+  *iv = (const uint8_t *)buffer_checklstring( L, idx, len );
+  if (mode == AES_GCM)
+    luaL_argcheck( L, *len > 0, idx, "iv must not be empty" );
+  else
+    luaL_argcheck( L, *len == AES_BLOCK, idx, "iv must be 16 bytes" );
+}
+
+// Lua: data = crypto.encrypt( cipher, key, iv, data )
+// Lua: data, tag = crypto.encrypt( "aes-gcm", key, iv, data[, aad] )
+// cipher is aes-cbc, aes-ctr or aes-gcm, key 16, 24 or 32 bytes. For CBC
+// iv is 16 random bytes and the data is padded (PKCS#7); for CTR it is the
+// initial counter block. GCM takes any iv, 12 bytes being the usual, and
+// returns a 16 byte tag along with the data.
+static int crypto_encrypt( lua_State *L )
+{
+  int mode = luaL_checkoption( L, 1, NULL, crypto_cipher_names );
+  const uint8_t *key, *iv;
+  unsigned bits;
+  size_t ivlen, len;
+  crypto_check_key( L, 2, &key, &bits );
+  crypto_check_iv( L, 3, mode, &iv, &ivlen );
+  const uint8_t *in = (const uint8_t *)buffer_checklstring( L, 4, &len );
+
+  if (mode == AES_GCM) {
+    size_t aadlen = 0;
+    const uint8_t *aad = (const uint8_t *)luaL_optlstring( L, 5, "", &aadlen );
+    uint8_t tag[GCM_TAG_LEN];
+    crypto_gcm( L, true, key, bits, iv, ivlen, aad, aadlen, in, len, tag );
+    lua_pushlstring( L, (const char *)tag, GCM_TAG_LEN );
+    return 2;
+  }
+
+  uint8_t ivc[AES_BLOCK];
+  memcpy( ivc, iv, AES_BLOCK );
+  crypto_aes( L, mode, true, key, bits, ivc, in, len );
+  return 1;
+}
+
+// Lua: data = crypto.decrypt( cipher, key, iv, data )
+// Lua: data = crypto.decrypt( "aes-gcm", key, iv, data, tag[, aad] )
+// Returns nil and an error message if the CBC padding or the GCM tag is
+// wrong, which is what a wrong key or tampered data show up as.
+static int crypto_decrypt( lua_State *L )
+{
+  int mode = luaL_checkoption( L, 1, NULL, crypto_cipher_names );
+  const uint8_t *key, *iv;
+  unsigned bits;
+  size_t ivlen, len;
+  crypto_check_key( L, 2, &key, &bits );
+  crypto_check_iv( L, 3, mode, &iv, &ivlen );
+  const uint8_t *in = (const uint8_t *)buffer_checklstring( L, 4, &len );
+
+  if (mode == AES_GCM) {
+    size_t taglen, aadlen = 0;
+    const uint8_t *tag = (const uint8_t *)buffer_checklstring( L, 5, &taglen );
+    luaL_argcheck( L, taglen == GCM_TAG_LEN, 5, "tag must be 16 bytes" );
+    const uint8_t *aad = (const uint8_t *)luaL_optlstring( L, 6, "", &aadlen );
+    uint8_t tagc[GCM_TAG_LEN];
+    memcpy( tagc, tag, GCM_TAG_LEN );
+    if (crypto_gcm( L, false, key, bits, iv, ivlen, aad, aadlen, in, len, tagc ))
+      return 1;
+    lua_pushnil( L );
+    lua_pushliteral( L, "authentication failed" );
+    return 2;
+  }
+
+  if (mode == AES_CBC)
+    luaL_argcheck( L, len > 0 && len % AES_BLOCK == 0, 4, "not a multiple of 16 bytes" );
+  uint8_t ivc[AES_BLOCK];
+  memcpy( ivc, iv, AES_BLOCK );
+  if (crypto_aes( L, mode, false, key, bits, ivc, in, len ))
+    return 1;
+  lua_pushnil( L );
+  lua_pushliteral( L, "bad padding" );
+  return 2;
+}
+
+// Lua: hex = crypto.tohex( data )
+static int crypto_tohex( lua_State *L )
+{
+  static const char digits[] = "0123456789abcdef";
+  size_t len;
+  const uint8_t *data = (const uint8_t *)buffer_checklstring( L, 1, &len );
+  luaL_Buffer b;
+  luaL_buffinit( L, &b );
+  for (size_t i = 0; i < len; i++) {
+    luaL_addchar( &b, digits[data[i] >> 4] );
+    luaL_addchar( &b, digits[data[i] & 15] );
+  }
+  luaL_pushresult( &b );
+  return 1;
+}
+
+static const LUA_REG_TYPE crypto_hash_map[] = {
+  { LSTRKEY( "update" ),   LFUNCVAL( crypto_hash_update ) },
+  { LSTRKEY( "finalize" ), LFUNCVAL( crypto_hash_finalize ) },
+  { LSTRKEY( "__gc" ),     LFUNCVAL( crypto_hash_gc ) },
+  { LSTRKEY( "__index" ),  LROVAL( crypto_hash_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+static const LUA_REG_TYPE crypto_gcm_map[] = {
+  { LSTRKEY( "__gc" ),     LFUNCVAL( crypto_gcm_gc ) },
+  { LNILKEY, LNILVAL }
+};
+
+// Module function map
+const LUA_REG_TYPE crypto_map[] = {
+  { LSTRKEY( "digest" ),  LFUNCVAL( crypto_digest ) },
+  { LSTRKEY( "hash" ),    LFUNCVAL( crypto_hash ) },
+  { LSTRKEY( "hmac" ),    LFUNCVAL( crypto_hmac ) },
+  { LSTRKEY( "encrypt" ), LFUNCVAL( crypto_encrypt ) },
+  { LSTRKEY( "decrypt" ), LFUNCVAL( crypto_decrypt ) },
+  { LSTRKEY( "tohex" ),   LFUNCVAL( crypto_tohex ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_crypto( lua_State *L )
+{
+  luaL_rometatable( L, HASH_OBJ, (void *)crypto_hash_map );
+  luaL_rometatable( L, GCM_OBJ, (void *)crypto_gcm_map );
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_CRYPTOLIBNAME, crypto_map );
+  return 1;
+#endif
+}
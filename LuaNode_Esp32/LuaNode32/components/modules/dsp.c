@@ -0,0 +1,563 @@
+// Module for signal processing over buffers of float samples
+//
+// Filtering or summing a window of samples in Lua costs several bytecodes
+// and a double precision library call per sample. dsp works in C on
+// buffers (see buffer.c) holding float32 samples back to back, in single
+// precision, which the ESP32 does in its FPU. Vectors stay in buffers and
+// are worked on in place; only results that are single numbers come back
+// to Lua as such.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "buffer.h"
+#include <math.h>
+#include <string.h>
+
+#define DSP_FILTER "dsp.filter"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+enum { FILTER_FIR, FILTER_IIR, FILTER_MOVAVG };
+
+// A filter and its state, which carries over from one process() to the
+// next so that a signal can be fed through in blocks
+typedef struct {
+  uint8_t kind;
+  uint32_t n;           // taps, biquad sections or samples averaged
+  uint32_t pos;         // newest slot of the delay line
+  float sum;            // of the moving average's window
+  // FIR: n coefficients, last first, then a delay line of 2n
+  // IIR: 5n coefficients (b0 b1 b2 a1 a2 a section), then 2n states
+  // moving average: a delay line of n
+  float data[];
+} dsp_filter_t;
+
+// The float samples of the buffer at idx
+static float *dsp_check( lua_State *L, int idx, uint32_t *n )
+{
+  lbuffer_t *b = buffer_check( L, idx );
+  *n = b->len / sizeof(float);
+  return (float *)b->data;
+}
+
+static float *dsp_push( lua_State *L, uint32_t n )
+{
+  return (float *)buffer_push( L, n * sizeof(float) )->data;
+}
+
+// The samples of the optional buffer at idx, as many as the first
+// argument has, or those of the first argument
+static float *dsp_checkout( lua_State *L, int idx, uint32_t n )
+{
+  uint32_t m;
+  if (lua_isnoneornil( L, idx ))
+    idx = 1;
+  float *y = dsp_check( L, idx, &m );
+  luaL_argcheck( L, m == n, idx, "length differs" );
+  lua_settop( L, idx );
+  lua_pushvalue( L, idx );
+  return y;
+}
+
+/*
+** Inner loops. Four partial sums keep the FPU's multiply-add pipeline
+** busy instead of waiting on one accumulator.
+*/
+static float vec_dot( const float *a, const float *b, uint32_t n )
+{
+  float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  uint32_t i;
+  for (i = 0; i + 4 <= n; i += 4) {
+    s0 += a[i] * b[i];
+    s1 += a[i+1] * b[i+1];
+    s2 += a[i+2] * b[i+2];
+    s3 += a[i+3] * b[i+3];
+  }
+  for (; i < n; i++)
+    s0 += a[i] * b[i];
+  return (s0 + s1) + (s2 + s3);
+}
+
+static float vec_sum( const float *a, uint32_t n )
+{
+  float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  uint32_t i;
+  for (i = 0; i + 4 <= n; i += 4) {
+    s0 += a[i];
+    s1 += a[i+1];
+    s2 += a[i+2];
+    s3 += a[i+3];
+  }
+  for (; i < n; i++)
+    s0 += a[i];
+  return (s0 + s1) + (s2 + s3);
+}
+
+// Lua: buf = dsp.new( n[, value] )
+// A buffer of n float samples, all value or 0.
+static int dsp_new( lua_State *L )
+{
+  int n = luaL_checkinteger( L, 1 );
+  float v = luaL_optnumber( L, 2, 0 );
+  luaL_argcheck( L, n >= 0, 1, "negative size" );
+  float *x = dsp_push( L, n );
+  for (int i = 0; i < n; i++)
+    x[i] = v;
+  return 1;
+}
+
+static const char * const from_types[] = { "i8", "u8", "i16", "u16", "i32", NULL };
+static const uint8_t from_sizes[] = { 1, 1, 2, 2, 4 };
+
+// Lua: buf = dsp.from( data, type[, scale[, offset]] )
+// Float samples from the little endian integers of a string or buffer,
+// as raw * scale + offset. type is "i8", "u8", "i16", "u16" or "i32",
+// so the blocks of the sampler, the ADC or a UART convert in one go.
+static int dsp_from( lua_State *L )
+{
+  size_t len;
+  const uint8_t *p = (const uint8_t *)buffer_checklstring( L, 1, &len );
+  int type = luaL_checkoption( L, 2, NULL, from_types );
+  float scale = luaL_optnumber( L, 3, 1 );
+  float offset = luaL_optnumber( L, 4, 0 );
+  uint32_t n = len / from_sizes[type];
+  float *x = dsp_push( L, n );
+
+  for (uint32_t i = 0; i < n; i++) {
+    int32_t v;
+    switch (type) {
+    case 0:  v = (int8_t)p[i]; break;
+    case 1:  v = p[i]; break;
+    case 2:  v = (int16_t)(p[2*i] | p[2*i+1] << 8); break;
+    case 3:  v = p[2*i] | p[2*i+1] << 8; break;
+    default: v = (int32_t)(p[4*i] | p[4*i+1] << 8 | p[4*i+2] << 16 | (uint32_t)p[4*i+3] << 24); break;
+    }
+    x[i] = v * scale + offset;
+  }
+  return 1;
+}
+
+// Lua: s = dsp.sum( x )
+static int dsp_sum( lua_State *L )
+{
+  uint32_t n;
+  float *x = dsp_check( L, 1, &n );
+  lua_pushnumber( L, vec_sum( x, n ) );
+  return 1;
+}
+
+// Lua: m = dsp.mean( x )
+// nil for an empty buffer, like min, max and rms.
+static int dsp_mean( lua_State *L )
+{
+  uint32_t n;
+  float *x = dsp_check( L, 1, &n );
+  if (n == 0)
+    return 0;
+  lua_pushnumber( L, vec_sum( x, n ) / n );
+  return 1;
+}
+
+static int dsp_extreme( lua_State *L, bool max )
+{
+  uint32_t n, at = 0;
+  float *x = dsp_check( L, 1, &n );
+  if (n == 0)
+    return 0;
+  for (uint32_t i = 1; i < n; i++)
+    if (max ? x[i] > x[at] : x[i] < x[at])
+      at = i;
+  lua_pushnumber( L, x[at] );
+  lua_pushinteger( L, at + 1 );
+  return 2;
+}
+
+// Lua: v, i = dsp.min( x )
+// The smallest sample and its index, the first if there are several.
+static int dsp_min( lua_State *L )
+{
+  return dsp_extreme( L, false );
+}
+
+// Lua: v, i = dsp.max( x )
+static int dsp_max( lua_State *L )
+{
+  return dsp_extreme( L, true );
+}
+
+// Lua: r = dsp.rms( x )
+static int dsp_rms( lua_State *L )
+{
+  uint32_t n;
+  float *x = dsp_check( L, 1, &n );
+  if (n == 0)
+    return 0;
+  lua_pushnumber( L, sqrtf( vec_dot( x, x, n ) / n ) );
+  return 1;
+}
+
+// Lua: d = dsp.dot( a, b )
+static int dsp_ldot( lua_State *L )
+{
+  uint32_t n, m;
+  float *a = dsp_check( L, 1, &n );
+  float *b = dsp_check( L, 2, &m );
+  luaL_argcheck( L, m == n, 2, "length differs" );
+  lua_pushnumber( L, vec_dot( a, b, n ) );
+  return 1;
+}
+
+// Lua: x = dsp.scale( x, k[, c] )
+// x * k + c, in place.
+static int dsp_scale( lua_State *L )
+{
+  uint32_t n;
+  float *x = dsp_check( L, 1, &n );
+  float k = luaL_checknumber( L, 2 );
+  float c = luaL_optnumber( L, 3, 0 );
+  for (uint32_t i = 0; i < n; i++)
+    x[i] = x[i] * k + c;
+  lua_settop( L, 1 );
+  return 1;
+}
+
+static int dsp_elementwise( lua_State *L, bool mul )
+{
+  uint32_t n, m;
+  float *a = dsp_check( L, 1, &n );
+  float *b = dsp_check( L, 2, &m );
+  luaL_argcheck( L, m == n, 2, "length differs" );
+  float *y = dsp_checkout( L, 3, n );
+  if (mul)
+    for (uint32_t i = 0; i < n; i++)
+      y[i] = a[i] * b[i];
+  else
+    for (uint32_t i = 0; i < n; i++)
+      y[i] = a[i] + b[i];
+  return 1;
+}
+
+// Lua: out = dsp.add( a, b[, out] )
+// a + b sample by sample into out, a itself by default.
+static int dsp_add( lua_State *L )
+{
+  return dsp_elementwise( L, false );
+}
+
+// Lua: out = dsp.mul( a, b[, out] )
+static int dsp_mul( lua_State *L )
+{
+  return dsp_elementwise( L, true );
+}
+
+static const char * const window_names[] = { "hann", "hamming", "blackman", NULL };
+
+// Lua: x = dsp.window( x[, kind] )
+// Multiplies x in place by a "hann" (the default), "hamming" or
+// "blackman" window, as before an FFT of a piece of a longer signal.
+static int dsp_window( lua_State *L )
+{
+  uint32_t n;
+  float *x = dsp_check( L, 1, &n );
+  int kind = luaL_checkoption( L, 2, "hann", window_names );
+  float step = n > 1 ? 2 * (float)M_PI / (n - 1) : 0;
+  for (uint32_t i = 0; i < n; i++) {
+    float c = cosf( step * i ), w;
+    switch (kind) {
+    case 0:  w = 0.5f - 0.5f * c; break;
+    case 1:  w = 0.54f - 0.46f * c; break;
+    default: w = 0.42f - 0.5f * c + 0.08f * cosf( 2 * step * i ); break;
+    }
+    x[i] *= w;
+  }
+  lua_settop( L, 1 );
+  return 1;
+}
+
+// In place radix-2 FFT of n, a power of 2, complex samples. The twiddle
+// factors of each stage come from a rotation, not a table, so any n up to
+// what fits in RAM needs no more memory.
+static void fft_radix2( float *re, float *im, uint32_t n, bool inverse )
+{
+  uint32_t i, j, bit, len, k;
+
+  for (i = 1, j = 0; i < n; i++) {  // bit reversed order
+    for (bit = n >> 1; j & bit; bit >>= 1)
+      j ^= bit;
+    j ^= bit;
+    if (i < j) {
+      float t = re[i]; re[i] = re[j]; re[j] = t;
+      t = im[i]; im[i] = im[j]; im[j] = t;
+    }
+  }
+  for (len = 2; len <= n; len <<= 1) {
+    uint32_t half = len >> 1;
+    float ang = (inverse ? 2 : -2) * (float)M_PI / len;
+    float rr = cosf( ang ), ri = sinf( ang );
+    float wr = 1, wi = 0;
+    for (k = 0; k < half; k++) {
+      for (i = k; i < n; i += len) {
+        uint32_t m = i + half;
+        float tr = re[m] * wr - im[m] * wi;
+        float ti = re[m] * wi + im[m] * wr;
+        re[m] = re[i] - tr;
+        im[m] = im[i] - ti;
+        re[i] += tr;
+        im[i] += ti;
+      }
+      float t = wr * rr - wi * ri;
+      wi = wr * ri + wi * rr;
+      wr = t;
+    }
+  }
+  if (inverse) {
+    float s = 1.0f / n;
+    for (i = 0; i < n; i++) {
+      re[i] *= s;
+      im[i] *= s;
+    }
+  }
+}
+
+// Lua: dsp.fft( re, im[, inverse] )
+// Transforms the complex signal in re and im in place. Their length must
+// be the same power of 2; for a real signal im starts out all 0. The
+// inverse transform divides by the length.
+static int dsp_fft( lua_State *L )
+{
+  uint32_t n, m;
+  float *re = dsp_check( L, 1, &n );
+  float *im = dsp_check( L, 2, &m );
+  luaL_argcheck( L, m == n, 2, "length differs" );
+  luaL_argcheck( L, n >= 2 && (n & (n - 1)) == 0, 1, "length not a power of 2" );
+  fft_radix2( re, im, n, lua_toboolean( L, 3 ) );
+  return 0;
+}
+
+// Lua: out = dsp.mag( re, im[, out] )
+// The magnitude of each complex sample into out, re by default.
+static int dsp_mag( lua_State *L )
+{
+  uint32_t n, m;
+  float *re = dsp_check( L, 1, &n );
+  float *im = dsp_check( L, 2, &m );
+  luaL_argcheck( L, m == n, 2, "length differs" );
+  float *y = dsp_checkout( L, 3, n );
+  for (uint32_t i = 0; i < n; i++)
+    y[i] = sqrtf( re[i] * re[i] + im[i] * im[i] );
+  return 1;
+}
+
+/*
+** Filters
+*/
+
+// Number of coefficients in the table or buffer at idx
+static uint32_t coeff_count( lua_State *L, int idx )
+{
+  if (lua_istable( L, idx ))
+    return lua_objlen( L, idx );
+  uint32_t n;
+  dsp_check( L, idx, &n );
+  return n;
+}
+
+static void coeff_get( lua_State *L, int idx, float *c, uint32_t n )
+{
+  if (lua_istable( L, idx )) {
+    for (uint32_t i = 0; i < n; i++) {
+      lua_rawgeti( L, idx, i + 1 );
+      c[i] = luaL_checknumber( L, -1 );
+      lua_pop( L, 1 );
+    }
+  } else {
+    uint32_t m;
+    memcpy( c, dsp_check( L, idx, &m ), n * sizeof(float) );
+  }
+}
+
+static dsp_filter_t *filter_push( lua_State *L, int kind, uint32_t n, uint32_t floats )
+{
+  size_t size = sizeof(dsp_filter_t) + floats * sizeof(float);
+  dsp_filter_t *f = (dsp_filter_t *)lua_newuserdata( L, size );
+  memset( f, 0, size );
+  f->kind = kind;
+  f->n = n;
+  luaL_getmetatable( L, DSP_FILTER );
+  lua_setmetatable( L, -2 );
+  return f;
+}
+
+// Lua: f = dsp.fir( coeffs )
+// A FIR filter, y[t] = c[1] x[t] + c[2] x[t-1] + ..., with coefficients
+// from a table or a buffer.
+static int dsp_fir( lua_State *L )
+{
+  uint32_t n = coeff_count( L, 1 );
+  luaL_argcheck( L, n > 0, 1, "no coefficients" );
+  dsp_filter_t *f = filter_push( L, FILTER_FIR, n, 3 * n );
+  coeff_get( L, 1, f->data, n );
+  for (uint32_t i = 0; i < n / 2; i++) {  // last first, as the delay line runs
+    float t = f->data[i];
+    f->data[i] = f->data[n - 1 - i];
+    f->data[n - 1 - i] = t;
+  }
+  return 1;
+}
+
+// Lua: f = dsp.iir( coeffs )
+// An IIR filter of biquad sections in series, each b0, b1, b2, a1, a2
+// with a0 = 1, from a table or buffer of 5 coefficients a section.
+static int dsp_iir( lua_State *L )
+{
+  uint32_t n = coeff_count( L, 1 );
+  luaL_argcheck( L, n > 0 && n % 5 == 0, 1, "5 coefficients a section expected" );
+  dsp_filter_t *f = filter_push( L, FILTER_IIR, n / 5, n + 2 * (n / 5) );
+  coeff_get( L, 1, f->data, n );
+  return 1;
+}
+
+// Lua: f = dsp.movavg( n )
+// The mean of the last n samples.
+static int dsp_movavg( lua_State *L )
+{
+  int n = luaL_checkinteger( L, 1 );
+  luaL_argcheck( L, n > 0, 1, "must be positive" );
+  filter_push( L, FILTER_MOVAVG, n, n );
+  return 1;
+}
+
+static dsp_filter_t *filter_check( lua_State *L )
+{
+  return (dsp_filter_t *)luaL_checkudata( L, 1, DSP_FILTER );
+}
+
+static void filter_run( dsp_filter_t *f, const float *x, float *y, uint32_t len )
+{
+  uint32_t n = f->n, t, s;
+
+  switch (f->kind) {
+  case FILTER_FIR: {
+    const float *c = f->data;
+    float *d = f->data + n;
+    for (t = 0; t < len; t++) {
+      // each sample goes in twice, so the last n are always in one piece
+      f->pos = f->pos + 1 < n ? f->pos + 1 : 0;
+      d[f->pos] = d[f->pos + n] = x[t];
+      y[t] = vec_dot( c, d + f->pos + 1, n );
+    }
+    break;
+  }
+  case FILTER_IIR: {
+    float *z = f->data + 5 * n;
+    for (t = 0; t < len; t++) {
+      float v = x[t];
+      for (s = 0; s < n; s++) {  // transposed direct form II
+        const float *c = f->data + 5 * s;
+        float out = c[0] * v + z[2*s];
+        z[2*s] = c[1] * v - c[3] * out + z[2*s+1];
+        z[2*s+1] = c[2] * v - c[4] * out;
+        v = out;
+      }
+      y[t] = v;
+    }
+    break;
+  }
+  default: {
+    float *d = f->data;
+    for (t = 0; t < len; t++) {
+      float v = x[t];
+      f->pos = f->pos + 1 < n ? f->pos + 1 : 0;
+      f->sum += v - d[f->pos];
+      d[f->pos] = v;
+      if (f->pos == 0)  // sum afresh once a round, before rounding drifts
+        f->sum = vec_sum( d, n );
+      y[t] = f->sum / n;
+    }
+    break;
+  }
+  }
+}
+
+// Lua: out = f:process( x[, out] )
+// Filters x into out, x itself by default. The filter's state goes on
+// from where the last call left it.
+static int filter_process( lua_State *L )
+{
+  dsp_filter_t *f = filter_check( L );
+  uint32_t n, m;
+  float *x = dsp_check( L, 2, &n );
+  float *y = x;
+  if (!lua_isnoneornil( L, 3 )) {
+    y = dsp_check( L, 3, &m );
+    luaL_argcheck( L, m == n, 3, "length differs" );
+  } else {
+    lua_settop( L, 2 );
+  }
+  filter_run( f, x, y, n );
+  return 1;
+}
+
+// Lua: f:reset()
+// Forgets the samples seen so far.
+static int filter_reset( lua_State *L )
+{
+  dsp_filter_t *f = filter_check( L );
+  uint32_t n = f->n;
+  switch (f->kind) {
+  case FILTER_FIR:  memset( f->data + n, 0, 2 * n * sizeof(float) ); break;
+  case FILTER_IIR:  memset( f->data + 5 * n, 0, 2 * n * sizeof(float) ); break;
+  default:          memset( f->data, 0, n * sizeof(float) ); break;
+  }
+  f->pos = 0;
+  f->sum = 0;
+  return 0;
+}
+
+static const LUA_REG_TYPE dsp_filter_map[] = {
+  { LSTRKEY( "process" ), LFUNCVAL( filter_process ) },
+  { LSTRKEY( "reset" ),   LFUNCVAL( filter_reset ) },
+  { LSTRKEY( "__index" ), LROVAL( dsp_filter_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+// Module function map
+const LUA_REG_TYPE dsp_map[] = {
+  { LSTRKEY( "new" ),    LFUNCVAL( dsp_new ) },
+  { LSTRKEY( "from" ),   LFUNCVAL( dsp_from ) },
+  { LSTRKEY( "sum" ),    LFUNCVAL( dsp_sum ) },
+  { LSTRKEY( "mean" ),   LFUNCVAL( dsp_mean ) },
+  { LSTRKEY( "min" ),    LFUNCVAL( dsp_min ) },
+  { LSTRKEY( "max" ),    LFUNCVAL( dsp_max ) },
+  { LSTRKEY( "rms" ),    LFUNCVAL( dsp_rms ) },
+  { LSTRKEY( "dot" ),    LFUNCVAL( dsp_ldot ) },
+  { LSTRKEY( "scale" ),  LFUNCVAL( dsp_scale ) },
+  { LSTRKEY( "add" ),    LFUNCVAL( dsp_add ) },
+  { LSTRKEY( "mul" ),    LFUNCVAL( dsp_mul ) },
+  { LSTRKEY( "window" ), LFUNCVAL( dsp_window ) },
+  { LSTRKEY( "fft" ),    LFUNCVAL( dsp_fft ) },
+  { LSTRKEY( "mag" ),    LFUNCVAL( dsp_mag ) },
+  { LSTRKEY( "fir" ),    LFUNCVAL( dsp_fir ) },
+  { LSTRKEY( "iir" ),    LFUNCVAL( dsp_iir ) },
+  { LSTRKEY( "movavg" ), LFUNCVAL( dsp_movavg ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_dsp( lua_State *L )
+{
+  // the vectors are buffers, which need their metatable set up
+  luaR_getglobal( L, LUA_BUFFERLIBNAME, strlen(LUA_BUFFERLIBNAME) );
+  luaL_rometatable( L, DSP_FILTER, (void *)dsp_filter_map );
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_DSPLIBNAME, dsp_map );
+  return 1;
+#endif
+}
@@ -2,51 +2,347 @@
 
 #include "modules.h"
 #include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "buffer.h"
 #include "platform.h"
 
 #include "c_types.h"
 #include "flash_fs.h"
 #include "c_string.h"
 #include "vfs.h"
+#include "lzss.h"
+#include "esp_timer.h"
+#include "task/task.h"
+#include "sdkconfig.h"
+#include <stdlib.h>
+#include <limits.h>
+
+#define FILE_OBJ "file.obj"
+#define FILE_DIR "file.dir"
+
+#define FILE_READAHEAD    512     // bytes fetched at a time for line reads
+#define FILE_READ_CHUNK   4096    // bigger reads go straight to the result
+#define FILE_ZIN          64      // compressed bytes fetched at a time
+
+// A file opened with "z" in its mode goes through an LZSS encoder or
+// decoder, whichever its first letter asks for
+typedef struct {
+  lzss_enc_t *enc;
+  lzss_dec_t *dec;
+  bool failed;                // the file system took fewer bytes
+  uint8_t ipos, ilen;         // unused bytes of in
+  uint8_t in[FILE_ZIN];
+} lfile_z_t;
+
+// An open file. Every function is both a method, f:read(), and a module
+// function, file.read(), which works on the default file: the one most
+// recently opened.
+typedef struct lfile {
+  int fd;
+  char *rbuf;                 // read-ahead block, allocated by the first read
+  uint16_t rpos, rlen;        // its unread bytes are rbuf[rpos..rlen)
+  lfile_z_t *z;               // compression, for "z" modes
+#if CONFIG_FILE_WRITE_BUFFER > 0
+  char *wbuf;                 // write-behind block, allocated by the first write
+  uint16_t wlen;              // bytes in it not yet written
+  struct lfile *wnext;        // next in file_dirty, while wlen > 0
+#endif
+} lfile_t;
 
-static volatile int file_fd = FS_OPEN_OK - 1;
+static int file_ref = LUA_NOREF;    // the default file
+static int file_nopen;              // descriptors held by file objects
 
-// Lua: open(filename, mode)
-static int file_open( lua_State* L )
+#if CONFIG_FILE_WRITE_BUFFER > 0
+static lfile_t *file_dirty;         // files with buffered writes
+static os_timer_t file_wtimer;
+static volatile bool file_wtimer_armed;
+static task_handle_t file_wtask;
+#endif
+
+static lfile_t *file_test( lua_State *L, int idx )
 {
-  size_t len;
-  if(file_fd){
-    vfs_close(file_fd);
-    file_fd = 0;
+  lfile_t *f = (lfile_t *)lua_touserdata( L, idx );
+  if (f == NULL || !lua_getmetatable( L, idx ))
+    return NULL;
+  luaL_getmetatable( L, FILE_OBJ );
+  int same = lua_rawequal( L, -1, -2 );
+  lua_pop( L, 2 );
+  return same ? f : NULL;
+}
+
+// The file a function works on; *arg is set to its first argument after
+// the file. A file that is not open is an error unless opt is set.
+static lfile_t *file_get( lua_State *L, int *arg, bool opt )
+{
+  lfile_t *f = file_test( L, 1 );
+  *arg = 1;
+  if (f) {
+    *arg = 2;
+  } else if (file_ref != LUA_NOREF) {
+    lua_rawgeti( L, LUA_REGISTRYINDEX, file_ref );
+    f = (lfile_t *)lua_touserdata( L, -1 );
+    lua_pop( L, 1 );    // the registry keeps it alive
+  }
+  if (!opt && (f == NULL || !f->fd))
+    luaL_error( L, "open a file first" );
+  return f;
+}
+
+// Gives back read-ahead bytes, so the descriptor is where Lua thinks
+// the file is. Needed before writes and seeks.
+static void file_sync( lfile_t *f )
+{
+  if (f->rpos < f->rlen)
+    vfs_lseek( f->fd, -(int32_t)(f->rlen - f->rpos), VFS_SEEK_CUR );
+  f->rpos = f->rlen = 0;
+}
+
+// Writes out buffered bytes. False if the file system took fewer of them,
+// which the write that buffered them could not report.
+static bool file_wflush( lfile_t *f )
+{
+#if CONFIG_FILE_WRITE_BUFFER > 0
+  if (f->wlen == 0)
+    return true;
+  bool ok = vfs_write( f->fd, f->wbuf, f->wlen ) == f->wlen;
+  f->wlen = 0;
+  for (lfile_t **p = &file_dirty; *p; p = &(*p)->wnext) {
+    if (*p == f) {
+      *p = f->wnext;
+      break;
+    }
+  }
+  return ok;
+#else
+  (void)f;
+  return true;
+#endif
+}
+
+#if CONFIG_FILE_WRITE_BUFFER > 0
+// Runs in the timer task
+static void file_wtick( void *arg )
+{
+  (void)arg;
+  if (!task_post_low( file_wtask, 0 ))
+    file_wtimer_armed = false;    // the next buffered write tries again
+}
+
+static void file_wtimeout( task_param_t param, task_prio_t prio )
+{
+  (void)param; (void)prio;
+  file_wtimer_armed = false;
+  while (file_dirty)
+    file_wflush( file_dirty );
+}
+#endif
+
+// Writes s, or adds it to the write-behind block if it fits there.
+// False if the file system took fewer bytes.
+static bool file_rawwrite( lfile_t *f, const char *s, size_t l )
+{
+#if CONFIG_FILE_WRITE_BUFFER > 0
+  if (f->wlen + l > CONFIG_FILE_WRITE_BUFFER && !file_wflush( f ))
+    return false;
+  if (l < CONFIG_FILE_WRITE_BUFFER) {
+    if (!f->wbuf)
+      f->wbuf = (char *)malloc( CONFIG_FILE_WRITE_BUFFER );
+    if (f->wbuf) {
+      if (f->wlen == 0) {
+        f->wnext = file_dirty;
+        file_dirty = f;
+#if CONFIG_FILE_FLUSH_MS > 0
+        if (!file_wtimer_armed) {
+          file_wtimer_armed = true;
+          os_timer_arm( &file_wtimer, CONFIG_FILE_FLUSH_MS, 0 );
+        }
+#endif
+      }
+      memcpy( f->wbuf + f->wlen, s, l );
+      f->wlen += l;
+      return true;
+    }
+  }
+#endif
+  return vfs_write( f->fd, s, l ) == l;
+}
+
+static void file_zout( void *arg, const uint8_t *data, size_t len )
+{
+  lfile_t *f = (lfile_t *)arg;
+  if (!file_rawwrite( f, (const char *)data, len ))
+    f->z->failed = true;
+}
+
+// Writes s, compressed if the file was opened so
+static bool file_dowrite( lfile_t *f, const char *s, size_t l )
+{
+  if (!f->z)
+    return file_rawwrite( f, s, l );
+  lzss_enc_write( f->z->enc, s, l, false, file_zout, f );
+  return !f->z->failed;
+}
+
+// Ends the compressed segment, so everything written so far can be read
+// back. Later writes start a new one.
+static bool file_zfinish( lfile_t *f )
+{
+  if (!f->z || !f->z->enc || !lzss_enc_pending( f->z->enc ))
+    return true;
+  lzss_enc_write( f->z->enc, NULL, 0, true, file_zout, f );
+  return !f->z->failed;
+}
+
+// Reads up to n bytes, decompressed if the file was opened so
+static int file_rawread( lfile_t *f, char *buf, int n )
+{
+  lfile_z_t *z = f->z;
+  int got = 0;
+  if (!z)
+    return vfs_read( f->fd, buf, n );
+  while (got < n) {
+    const uint8_t *p = z->in + z->ipos;
+    size_t avail = z->ilen - z->ipos;
+    int r = lzss_dec_read( z->dec, &p, &avail, (uint8_t *)buf + got, n - got );
+    if (r < 0)        // not compressed, or corrupt: the end, as far as Lua knows
+      break;
+    z->ipos = z->ilen - avail;
+    got += r;
+    if (got < n) {
+      int m = vfs_read( f->fd, z->in, FILE_ZIN );
+      if (m <= 0)
+        break;
+      z->ipos = 0;
+      z->ilen = m;
+    }
+  }
+  return got;
+}
+
+static void file_zfree( lfile_t *f )
+{
+  if (f->z) {
+    lzss_enc_free( f->z->enc );
+    lzss_dec_free( f->z->dec );
+    free( f->z );
+    f->z = NULL;
+  }
+}
+
+// Raises an error if a compressed file is used the way it wasn't opened
+static void file_zcheck( lua_State *L, lfile_t *f, bool write )
+{
+  if (f->z && (write ? !f->z->enc : !f->z->dec))
+    luaL_error( L, "compressed file is open for %s only", write ? "reading" : "writing" );
+}
+
+static void file_doclose( lfile_t *f )
+{
+  if (f && f->fd) {
+    file_zfinish( f );
+    file_wflush( f );
+#if CONFIG_FILE_WRITE_BUFFER > 0
+    free( f->wbuf );
+    f->wbuf = NULL;
+#endif
+    vfs_close( f->fd );
+    f->fd = 0;
+    free( f->rbuf );
+    f->rbuf = NULL;
+    f->rpos = f->rlen = 0;
+    file_zfree( f );
+    file_nopen--;
+    NODE_DBG("file close successfully\n");
   }
+}
 
+// Lua: f = open(filename, mode)
+// f also becomes the default file. A previous default file stays open
+// until it is closed or collected.
+// A "z" in mode, as in "wz", "az" or "rz", compresses what is written and
+// decompresses what is read, in the format of the compress module. Such
+// a file is read or written as its first letter says, never both, and
+// can't be seeked in. Each open for writing, and each flush, starts a new
+// compressed segment; one cut short by a reset reads back as far as it
+// got.
+static int file_open( lua_State* L )
+{
+  size_t len;
   const char *fname = luaL_checklstring( L, 1, &len );
   const char *basename = vfs_basename( fname );
   luaL_argcheck(L, strlen(basename) <= 32 && strlen(fname) == len, 1, "filename invalid");
 
   const char *mode = luaL_optstring(L, 2, "r");
+  lfile_z_t *z = NULL;
+  char zmode[4];
+  if (strchr(mode, 'z')) {
+    size_t n = 0;
+    for (const char *m = mode; *m && n < sizeof(zmode) - 1; m++)
+      if (*m != 'z')
+        zmode[n++] = *m;
+    zmode[n] = '\0';
+    mode = zmode;
+    z = (lfile_z_t *)calloc(1, sizeof(lfile_z_t));
+    if (z && *mode == 'r')
+      z->dec = lzss_dec_new();
+    else if (z)
+      z->enc = lzss_enc_new(LZSS_WINDOW_BITS, LZSS_LOOKAHEAD_BITS);
+    if (!z || !(z->enc || z->dec)) {
+      free(z);
+      return luaL_error(L, "out of memory");
+    }
+  }
 
-  file_fd = vfs_open(fname, mode);
+  int fd = vfs_open(fname, mode);
+  if (!fd && file_nopen >= CONFIG_SPIFFS_MAX_OPEN_FILES) {
+    // out of descriptors: close the files nothing refers to any more
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    fd = vfs_open(fname, mode);
+  }
 
-  if(!file_fd){
+  if(!fd){
+    if (z) {
+      lzss_enc_free(z->enc);
+      lzss_dec_free(z->dec);
+      free(z);
+    }
     lua_pushnil(L);
   } else {
-    lua_pushboolean(L, 1);
+    lfile_t *f = (lfile_t *)lua_newuserdata(L, sizeof(lfile_t));
+    f->fd = fd;
+    f->rbuf = NULL;
+    f->rpos = f->rlen = 0;
+    f->z = z;
+#if CONFIG_FILE_WRITE_BUFFER > 0
+    f->wbuf = NULL;
+    f->wlen = 0;
+#endif
+    file_nopen++;
+    luaL_getmetatable(L, FILE_OBJ);
+    lua_setmetatable(L, -2);
+    luaL_unref(L, LUA_REGISTRYINDEX, file_ref);
+    lua_pushvalue(L, -1);
+    file_ref = luaL_ref(L, LUA_REGISTRYINDEX);
   }
   return 1; 
 }
 
-// Lua: close()
+// Lua: close(), f:close()
 static int file_close( lua_State* L )
 {
-  if(file_fd){
-    vfs_close(file_fd);
-    file_fd = 0;
-	NODE_DBG("file close successfully\n");
-  }
+  int arg;
+  file_doclose( file_get( L, &arg, true ) );
   return 0;  
 }
 
+static int file_gc( lua_State* L )
+{
+  file_doclose( file_test( L, 1 ) );
+  return 0;
+}
+
 // Lua: format()
 static int file_format( lua_State* L )
 {
@@ -64,13 +360,14 @@ static int file_format( lua_State* L )
 }
 
 
-// Lua: list()
+// Lua: list([dir])
+// The current directory unless dir is given, e.g. "/SD0/logs"
 static int file_list( lua_State* L )
 {
   vfs_dir  *dir;
   vfs_item *item;
 
-  if ((dir = vfs_opendir(""))) {
+  if ((dir = vfs_opendir(luaL_optstring(L, 1, "")))) {
     lua_newtable( L );
     while ((item = vfs_readdir(dir))) {
       lua_pushinteger(L, vfs_item_size(item));
@@ -83,19 +380,110 @@ static int file_list( lua_State* L )
   return 0;
 }
 
+// An open listing of file.dir(), closed when it runs out or is collected
+typedef struct {
+  vfs_dir *dir;
+} ldir_t;
+
+static void file_dirclose( ldir_t *d )
+{
+  if (d->dir) {
+    vfs_closedir(d->dir);
+    d->dir = NULL;
+  }
+}
+
+static int file_dir_gc( lua_State* L )
+{
+  file_dirclose((ldir_t *)luaL_checkudata(L, 1, FILE_DIR));
+  return 0;
+}
+
+static int file_dir_iter( lua_State* L )
+{
+  ldir_t *d = (ldir_t *)lua_touserdata(L, lua_upvalueindex(1));
+  size_t plen;
+  const char *prefix = lua_tolstring(L, lua_upvalueindex(2), &plen);
+  vfs_item *item;
+
+  while (d->dir && (item = vfs_readdir(d->dir))) {
+    const char *name = vfs_item_name(item);
+    if (strncmp(name, prefix, plen) == 0) {
+      lua_pushstring(L, name);
+      lua_pushinteger(L, vfs_item_size(item));
+      vfs_closeitem(item);
+      return 2;
+    }
+    vfs_closeitem(item);
+  }
+  file_dirclose(d);
+  return 0;
+}
+
+// Lua: for name, size in file.dir([prefix]) do ... end
+// Names in the current directory starting with prefix, one at a time
+// rather than all in a table as from list(). A prefix starting with "/"
+// names the directory too, e.g. "/SD0/logs/2017" or "/SD0/logs/".
+static int file_dir( lua_State* L )
+{
+  const char *prefix = luaL_optstring(L, 1, "");
+  const char *name = prefix;
+  const char *slash = strrchr(prefix, '/');
+  ldir_t *d;
+
+  if (prefix[0] == '/' && slash) {
+    name = slash + 1;
+    lua_pushlstring(L, prefix, slash - prefix);
+  } else {
+    lua_pushliteral(L, "");
+  }
+  d = (ldir_t *)lua_newuserdata(L, sizeof(ldir_t));
+  d->dir = vfs_opendir(lua_tostring(L, -2));
+  if (!d->dir)
+    return luaL_error(L, "cannot open directory");
+  luaL_getmetatable(L, FILE_DIR);
+  lua_setmetatable(L, -2);
+  lua_pushstring(L, name);
+  lua_pushcclosure(L, file_dir_iter, 2);
+  return 1;
+}
+
+// Lua: ok = mkdir(dirname)
+// Only FAT drives have directories
+static int file_mkdir( lua_State* L )
+{
+  const char *name = luaL_checkstring( L, 1 );
+  lua_pushboolean( L, vfs_mkdir( name ) == VFS_RES_OK );
+  return 1;
+}
+
+// Lua: ok = chdir(dir)
+// Names without a drive resolve in dir, e.g. "/FLASH" or "/SD0/logs"
+static int file_chdir( lua_State* L )
+{
+  const char *name = luaL_checkstring( L, 1 );
+  lua_pushboolean( L, vfs_chdir( name ) == VFS_RES_OK );
+  return 1;
+}
+
+// Lua: seek([whence[, offset]]), f:seek(...)
 static int file_seek (lua_State *L) 
 {
   static const int mode[] = {VFS_SEEK_SET, VFS_SEEK_CUR, VFS_SEEK_END};
   static const char *const modenames[] = {"set", "cur", "end", NULL};
-  if(!file_fd)
-    return luaL_error(L, "open a file first");
-  int op = luaL_checkoption(L, 1, "cur", modenames);
-  long offset = luaL_optlong(L, 2, 0);
-  op = vfs_lseek(file_fd, offset, mode[op]);
+  int arg;
+  lfile_t *f = file_get(L, &arg, false);
+  if (f->z)
+    return luaL_error(L, "can't seek in a compressed file");
+  int op = luaL_checkoption(L, arg, "cur", modenames);
+  long offset = luaL_optlong(L, arg + 1, 0);
+  file_wflush(f);
+  file_sync(f);
+  op = vfs_lseek(f->fd, offset, mode[op]);
   if (op < 0)
     lua_pushnil(L);  /* error */
   else
-    lua_pushinteger(L, vfs_tell(file_fd));
+    lua_pushinteger(L, vfs_tell(f->fd));
   return 1;
 }
 
@@ -106,17 +494,16 @@ static int file_remove( lua_State* L )
   const char *fname = luaL_checklstring( L, 1, &len );    
   const char *basename = vfs_basename( fname );
   luaL_argcheck(L, strlen(basename) <= 32 && strlen(fname) == len, 1, "filename invalid");
-  file_close(L);
   vfs_remove((char *)fname);
   return 0; 
 }
 
-// Lua: flush()
+// Lua: flush(), f:flush()
 static int file_flush( lua_State* L )
 {
-  if(!file_fd)
-    return luaL_error(L, "open a file first");
-  if(vfs_flush(file_fd) == 0)
+  int arg;
+  lfile_t *f = file_get(L, &arg, false);
+  if(file_zfinish(f) && file_wflush(f) && vfs_flush(f->fd) == 0)
     lua_pushboolean(L, 1);
   else
     lua_pushnil(L);
@@ -136,11 +523,6 @@ static int file_check( lua_State* L )
 static int file_rename( lua_State* L )
 {
   size_t len;
-  if(file_fd){
-    vfs_close(file_fd);
-    file_fd = 0;
-  }
-
   const char *oldname = luaL_checklstring( L, 1, &len );
   const char *basename = vfs_basename( oldname );
   luaL_argcheck(L, strlen(basename) <= 32 && strlen(oldname) == len, 1, "filename invalid");
@@ -175,43 +557,99 @@ static int file_fsinfo( lua_State* L )
   return 3;
 }
 
+// Lua: t = stats( [reset] )
+// { cache_pages=, cache_hits=, cache_misses=, cache_evictions=, gc_runs=,
+//   writes=, write_avg_us=, write_max_us=, erase={count per block} }
+// Counters run from mount; reset clears them. A block never erased since
+// formatting has an erase count of -1.
+static int file_stats( lua_State* L )
+{
+  myspiffs_stats_t st;
+  if (!myspiffs_stats(&st, lua_toboolean(L, 1)))
+    return luaL_error(L, "no statistics");
+  lua_createtable(L, 0, 9);
+  lua_pushinteger(L, st.cache_pages);
+  lua_setfield(L, -2, "cache_pages");
+  lua_pushinteger(L, st.cache_hits);
+  lua_setfield(L, -2, "cache_hits");
+  lua_pushinteger(L, st.cache_misses);
+  lua_setfield(L, -2, "cache_misses");
+  lua_pushinteger(L, st.cache_evictions);
+  lua_setfield(L, -2, "cache_evictions");
+  lua_pushinteger(L, st.gc_runs);
+  lua_setfield(L, -2, "gc_runs");
+  lua_pushinteger(L, st.writes);
+  lua_setfield(L, -2, "writes");
+  lua_pushinteger(L, st.write_avg_us);
+  lua_setfield(L, -2, "write_avg_us");
+  lua_pushinteger(L, st.write_max_us);
+  lua_setfield(L, -2, "write_max_us");
+  lua_createtable(L, st.blocks, 0);
+  for (uint32_t i = 0; i < st.blocks; i++) {
+    int32_t n = myspiffs_erase_count(i);
+    if (n < -1)
+      return luaL_error(L, "file system failed");
+    lua_pushinteger(L, n);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "erase");
+  return 1;
+}
+
 // g_read()
-static int file_g_read( lua_State* L, int n, int16_t end_char )
+// Reads up to n bytes, stopping after end_char. Line reads go through the
+// handle's read-ahead block, and what follows end_char stays there for
+// the next read. Other reads of a chunk or more skip the block.
+static int file_g_read( lua_State* L, lfile_t *f, int n, int16_t end_char )
 {
-  if(n <= 0 || n > LUAL_BUFFERSIZE)
+  if(n <= 0)
     n = LUAL_BUFFERSIZE;
   if(end_char < 0 || end_char >255)
     end_char = EOF;
   
+  file_zcheck(L, f, false);
+  file_wflush(f);
   luaL_Buffer b;
-  if(!file_fd)
-    return luaL_error(L, "open a file first");
-
   luaL_buffinit(L, &b);
-  char *p = luaL_prepbuffer(&b);
-  int i;
-
-  n = vfs_read(file_fd, p, n);
-  for (i = 0; i < n; ++i)
-    if (p[i] == end_char)
-    {
-      ++i;
-      break;
+  while (n > 0) {
+    if (f->rpos < f->rlen) {    // buffered bytes first
+      const char *p = f->rbuf + f->rpos;
+      const char *e = NULL;
+      int len = f->rlen - f->rpos;
+      if (len > n)
+        len = n;
+      if (end_char != EOF && (e = memchr(p, end_char, len)))
+        len = e - p + 1;
+      luaL_addlstring(&b, p, len);
+      f->rpos += len;
+      n -= len;
+      if (e)
+        break;
+    } else if (end_char == EOF && n >= FILE_READAHEAD) {
+      int want = n < FILE_READ_CHUNK ? n : FILE_READ_CHUNK;
+      int got = file_rawread(f, luaL_prepbuffsize(&b, want), want);
+      if (got <= 0)
+        break;
+      luaL_addsize(&b, got);
+      n -= got;
+      if (got < want)   // end of file
+        break;
+    } else {
+      if (!f->rbuf && !(f->rbuf = (char *)malloc(FILE_READAHEAD)))
+        return luaL_error(L, "out of memory");
+      int got = file_rawread(f, f->rbuf, FILE_READAHEAD);
+      if (got <= 0)
+        break;
+      f->rpos = 0;
+      f->rlen = got;
     }
-
-  if(i==0){
-    luaL_pushresult(&b);  /* close buffer */
-    return (lua_objlen(L, -1) > 0);  /* check whether read something */
   }
-
-  vfs_lseek(file_fd, -(n - i), VFS_SEEK_CUR);
-  luaL_addsize(&b, i);
   luaL_pushresult(&b);  /* close buffer */
-  return 1;  /* read at least an `eol' */ 
+  return (lua_objlen(L, -1) > 0);  /* check whether read something */
 }
 
-// Lua: read()
-// file.read() will read all byte in file
+// Lua: read(), f:read()
+// file.read() will read LUAL_BUFFERSIZE bytes from file
 // file.read(10) will read 10 byte from file, or EOF is reached.
 // file.read('q') will read until 'q' or EOF is reached. 
 static int file_read( lua_State* L )
@@ -219,77 +657,126 @@ static int file_read( lua_State* L )
   unsigned need_len = LUAL_BUFFERSIZE;
   int16_t end_char = EOF;
   size_t el;
-  if( lua_type( L, 1 ) == LUA_TNUMBER )
+  int arg;
+  lfile_t *f = file_get(L, &arg, false);
+  if( lua_type( L, arg ) == LUA_TNUMBER )
   {
-    need_len = ( unsigned )luaL_checkinteger( L, 1 );
-    if( need_len > LUAL_BUFFERSIZE ){
-      need_len = LUAL_BUFFERSIZE;
-    }
+    need_len = ( unsigned )luaL_checkinteger( L, arg );
   }
-  else if(lua_isstring(L, 1))
+  else if(lua_isstring(L, arg))
   {
-    const char *end = luaL_checklstring( L, 1, &el );
+    const char *end = luaL_checklstring( L, arg, &el );
     if(el!=1){
       return luaL_error( L, "wrong arg range" );
     }
     end_char = (int16_t)end[0];
   }
 
-  return file_g_read(L, need_len, end_char);
+  return file_g_read(L, f, need_len, end_char);
 }
 
-// Lua: readline()
+// Lua: readline(), f:readline()
 static int file_readline( lua_State* L )
 {
-  return file_g_read(L, LUAL_BUFFERSIZE, '\n');
+  int arg;
+  return file_g_read(L, file_get(L, &arg, false), LUAL_BUFFERSIZE, '\n');
 }
 
-// Lua: write("string")
+static int file_lines_iter( lua_State* L )
+{
+  lfile_t *f = (lfile_t *)lua_touserdata(L, lua_upvalueindex(1));
+  size_t l;
+  if (!f->fd)
+    return luaL_error(L, "file is already closed");
+  if (!file_g_read(L, f, INT_MAX, '\n'))
+    return 0;
+  const char *s = lua_tolstring(L, -1, &l);
+  if (s[l - 1] == '\n')
+    lua_pushlstring(L, s, l - 1);
+  return 1;
+}
+
+// Lua: for line in file.lines() do ... end, f:lines()
+// Lines come without their "\n" and may be of any length.
+static int file_lines( lua_State* L )
+{
+  int arg;
+  file_get(L, &arg, false);
+  if (arg == 1)
+    lua_rawgeti(L, LUA_REGISTRYINDEX, file_ref);
+  else
+    lua_pushvalue(L, 1);
+  lua_pushcclosure(L, file_lines_iter, 1);
+  return 1;
+}
+
+// Lua: write("string"), f:write("string")
 static int file_write( lua_State* L )
 {
-  if(!file_fd)
-    return luaL_error(L, "open a file first");
-  size_t l, rl;
-  const char *s = luaL_checklstring(L, 1, &l);
-  rl = vfs_write(file_fd, s, l);
-  if(rl==l)
+  int arg;
+  lfile_t *f = file_get(L, &arg, false);
+  file_zcheck(L, f, true);
+  file_sync(f);
+  size_t l;
+  const char *s = buffer_checklstring(L, arg, &l);
+  if(file_dowrite(f, s, l))
     lua_pushboolean(L, 1);
   else
     lua_pushnil(L);
   return 1;
 }
 
-// Lua: writeline("string")
+// Lua: writeline("string"), f:writeline("string")
 static int file_writeline( lua_State* L )
 {
-  if(!file_fd)
-    return luaL_error(L, "open a file first");
-  size_t l, rl;
-  const char *s = luaL_checklstring(L, 1, &l);
-  rl = vfs_write(file_fd, s, l);
-  if(rl==l){
-    rl = vfs_write(file_fd, "\n", 1);
-    if(rl==1)
-      lua_pushboolean(L, 1);
-    else
-      lua_pushnil(L);
-  }
-  else{
+  int arg;
+  lfile_t *f = file_get(L, &arg, false);
+  file_zcheck(L, f, true);
+  file_sync(f);
+  size_t l;
+  const char *s = buffer_checklstring(L, arg, &l);
+  if(file_dowrite(f, s, l) && file_dowrite(f, "\n", 1))
+    lua_pushboolean(L, 1);
+  else
     lua_pushnil(L);
-  }
   return 1;
 }
 
+static const LUA_REG_TYPE file_obj_map[] = {
+  { LSTRKEY( "close" ),     LFUNCVAL( file_close ) },
+  { LSTRKEY( "write" ),     LFUNCVAL( file_write ) },
+  { LSTRKEY( "writeline" ), LFUNCVAL( file_writeline ) },
+  { LSTRKEY( "read" ),      LFUNCVAL( file_read ) },
+  { LSTRKEY( "readline" ),  LFUNCVAL( file_readline ) },
+  { LSTRKEY( "lines" ),     LFUNCVAL( file_lines ) },
+#if defined(BUILD_SPIFFS) && !defined(BUILD_WOFS)
+  { LSTRKEY( "seek" ),      LFUNCVAL( file_seek ) },
+  { LSTRKEY( "flush" ),     LFUNCVAL( file_flush ) },
+#endif
+  { LSTRKEY( "__gc" ),      LFUNCVAL( file_gc ) },
+  { LSTRKEY( "__index" ),   LROVAL( file_obj_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+static const LUA_REG_TYPE file_dir_map[] = {
+  { LSTRKEY( "__gc" ),      LFUNCVAL( file_dir_gc ) },
+  { LNILKEY, LNILVAL }
+};
+
 // Module function map
 const LUA_REG_TYPE file_map[] = {
   { LSTRKEY( "list" ),      LFUNCVAL( file_list ) },
+  { LSTRKEY( "dir" ),       LFUNCVAL( file_dir ) },
   { LSTRKEY( "open" ),      LFUNCVAL( file_open ) },
   { LSTRKEY( "close" ),     LFUNCVAL( file_close ) },
   { LSTRKEY( "write" ),     LFUNCVAL( file_write ) },
   { LSTRKEY( "writeline" ), LFUNCVAL( file_writeline ) },
   { LSTRKEY( "read" ),      LFUNCVAL( file_read ) },
   { LSTRKEY( "readline" ),  LFUNCVAL( file_readline ) },
+  { LSTRKEY( "lines" ),     LFUNCVAL( file_lines ) },
   { LSTRKEY( "format" ),    LFUNCVAL( file_format ) },
+  { LSTRKEY( "mkdir" ),     LFUNCVAL( file_mkdir ) },
+  { LSTRKEY( "chdir" ),     LFUNCVAL( file_chdir ) },
 #if defined(BUILD_SPIFFS) && !defined(BUILD_WOFS)
   { LSTRKEY( "remove" ),    LFUNCVAL( file_remove ) },
   { LSTRKEY( "seek" ),      LFUNCVAL( file_seek ) },
@@ -297,12 +784,19 @@ const LUA_REG_TYPE file_map[] = {
 //{ LSTRKEY( "check" ),     LFUNCVAL( file_check ) },
   { LSTRKEY( "rename" ),    LFUNCVAL( file_rename ) },
   { LSTRKEY( "fsinfo" ),    LFUNCVAL( file_fsinfo ) },
+  { LSTRKEY( "stats" ),     LFUNCVAL( file_stats ) },
 #endif
   { LNILKEY, LNILVAL }
 };
 
 LUALIB_API int luaopen_file(lua_State *L)
 {
+  luaL_rometatable( L, FILE_OBJ, (void *)file_obj_map );
+  luaL_rometatable( L, FILE_DIR, (void *)file_dir_map );
+#if CONFIG_FILE_WRITE_BUFFER > 0
+  file_wtask = task_get_id( file_wtimeout );
+  os_timer_setfn( &file_wtimer, file_wtick, NULL );
+#endif
 #if LUA_OPTIMIZE_MEMORY > 0
     return 0;
 #else  
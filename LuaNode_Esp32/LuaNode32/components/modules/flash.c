@@ -0,0 +1,277 @@
+// Module for raw access to flash partitions
+//
+// Lets Lua store firmware images, downloads or logs in a partition of its
+// own instead of going through SPIFFS. A writer collects a whole sector in
+// RAM, then erases the sector and programs it in one go.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "platform.h"
+#include "platform_partition.h"
+#include "platform_ota.h"
+#include "buffer.h"
+#include <string.h>
+
+#define FLASH_SECTOR INTERNAL_FLASH_SECTOR_SIZE
+
+static const char FLASH_TABLE_PARTITION[] = "flash.partition";
+static const char FLASH_TABLE_WRITER[] = "flash.writer";
+
+typedef struct {
+  uint32_t offs;            // physical flash address
+  uint32_t size;
+  uint8_t type;
+  uint8_t subtype;
+  bool readonly;
+} flash_part_t;
+
+typedef struct {
+  uint32_t offs;            // of the partition
+  uint32_t size;
+  uint32_t pos;             // partition offset of buf[0], sector aligned
+  uint32_t fill;
+  uint32_t written;
+  bool closed;
+  uint8_t buf[FLASH_SECTOR] PLATFORM_ALIGNMENT;
+} flash_writer_t;
+
+static flash_part_t *flash_get_part( lua_State *L )
+{
+  return (flash_part_t *)luaL_checkudata( L, 1, FLASH_TABLE_PARTITION );
+}
+
+static flash_writer_t *flash_get_writer( lua_State *L )
+{
+  return (flash_writer_t *)luaL_checkudata( L, 1, FLASH_TABLE_WRITER );
+}
+
+// Check that len bytes at offset lie within the partition
+static void flash_check_range( lua_State *L, uint32_t size, lua_Integer offset,
+                               lua_Integer len )
+{
+  if (offset < 0 || len < 0 || offset > (lua_Integer)size ||
+      len > (lua_Integer)size - offset)
+    luaL_error( L, "range outside partition" );
+}
+
+static void flash_check_writable( lua_State *L, flash_part_t *p )
+{
+  if (p->readonly)
+    luaL_error( L, "partition is read-only" );
+}
+
+static bool flash_erase( uint32_t addr, uint32_t len )
+{
+  uint32_t first = platform_flash_get_sector_of_address( addr );
+  uint32_t n = len / FLASH_SECTOR;
+  for (uint32_t s = first; s < first + n; s++)
+    if (platform_flash_erase_sector( s ) != PLATFORM_OK)
+      return false;
+  return true;
+}
+
+// Lua: p = flash.partition(label)
+// nil if the partition table has no such entry
+static int flash_partition( lua_State *L )
+{
+  size_t len;
+  const char *label = luaL_checklstring( L, 1, &len );
+  platform_partition_t info;
+  if (len > sizeof(info.label) || !platform_partition_find( label, &info ))
+    return 0;
+  flash_part_t *p = (flash_part_t *)lua_newuserdata( L, sizeof(flash_part_t) );
+  p->offs = info.offs;
+  p->size = info.size;
+  p->type = info.type;
+  p->subtype = info.subtype;
+  // Keep clear of the app that is running, or the factory one without OTA slots
+  platform_partition_t run;
+  if (platform_ota_running( &run ))
+    p->readonly = info.offs == run.offs;
+  else
+    p->readonly = info.type == PLATFORM_PARTITION_TYPE_APP &&
+                  info.subtype == PLATFORM_PARTITION_SUBTYPE_APP_FACTORY;
+  luaL_getmetatable( L, FLASH_TABLE_PARTITION );
+  lua_setmetatable( L, -2 );
+  return 1;
+}
+
+// Lua: size, type, subtype = p:info()
+static int flash_part_info( lua_State *L )
+{
+  flash_part_t *p = flash_get_part( L );
+  lua_pushinteger( L, p->size );
+  lua_pushinteger( L, p->type );
+  lua_pushinteger( L, p->subtype );
+  return 3;
+}
+
+// Lua: data = p:read(offset, len)
+static int flash_part_read( lua_State *L )
+{
+  flash_part_t *p = flash_get_part( L );
+  lua_Integer offset = luaL_checkinteger( L, 2 );
+  lua_Integer len = luaL_checkinteger( L, 3 );
+  flash_check_range( L, p->size, offset, len );
+  luaL_Buffer b;
+  luaL_buffinit( L, &b );
+  while (len > 0) {
+    char *dst = luaL_prepbuffer( &b );
+    uint32_t n = len < LUAL_BUFFERSIZE ? len : LUAL_BUFFERSIZE;
+    if (platform_flash_read( dst, p->offs + offset, n ) != n)
+      return luaL_error( L, "flash read failed" );
+    luaL_addsize( &b, n );
+    offset += n;
+    len -= n;
+  }
+  luaL_pushresult( &b );
+  return 1;
+}
+
+// Lua: p:write(offset, data)
+// Programming only clears bits; erase the range first.
+static int flash_part_write( lua_State *L )
+{
+  flash_part_t *p = flash_get_part( L );
+  lua_Integer offset = luaL_checkinteger( L, 2 );
+  size_t len;
+  const char *data = buffer_checklstring( L, 3, &len );
+  flash_check_writable( L, p );
+  flash_check_range( L, p->size, offset, len );
+  if (len && platform_flash_write( data, p->offs + offset, len ) != len)
+    return luaL_error( L, "flash write failed" );
+  return 0;
+}
+
+// Lua: p:erase_range(offset, len)
+// Both must be multiples of the sector size
+static int flash_part_erase_range( lua_State *L )
+{
+  flash_part_t *p = flash_get_part( L );
+  lua_Integer offset = luaL_checkinteger( L, 2 );
+  lua_Integer len = luaL_checkinteger( L, 3 );
+  flash_check_writable( L, p );
+  flash_check_range( L, p->size, offset, len );
+  if ((offset | len) & (FLASH_SECTOR - 1))
+    return luaL_error( L, "range not sector aligned" );
+  if (!flash_erase( p->offs + offset, len ))
+    return luaL_error( L, "flash erase failed" );
+  return 0;
+}
+
+// Lua: w = p:writer([offset])
+// Streams data into the partition from a sector aligned offset on
+static int flash_part_writer( lua_State *L )
+{
+  flash_part_t *p = flash_get_part( L );
+  lua_Integer offset = luaL_optinteger( L, 2, 0 );
+  flash_check_writable( L, p );
+  flash_check_range( L, p->size, offset, 0 );
+  if (offset & (FLASH_SECTOR - 1))
+    return luaL_error( L, "offset not sector aligned" );
+  flash_writer_t *w = (flash_writer_t *)lua_newuserdata( L, sizeof(flash_writer_t) );
+  w->offs = p->offs;
+  w->size = p->size;
+  w->pos = offset;
+  w->fill = 0;
+  w->written = 0;
+  w->closed = false;
+  luaL_getmetatable( L, FLASH_TABLE_WRITER );
+  lua_setmetatable( L, -2 );
+  return 1;
+}
+
+// Erase the sector at the write position and program what's buffered
+static bool flash_writer_flush( flash_writer_t *w )
+{
+  if (w->fill == 0)
+    return true;
+  uint32_t addr = w->offs + w->pos;
+  uint32_t n = (w->fill + INTERNAL_FLASH_WRITE_UNIT_SIZE - 1) &
+               ~(INTERNAL_FLASH_WRITE_UNIT_SIZE - 1);
+  memset( w->buf + w->fill, 0xff, n - w->fill );
+  if (!flash_erase( addr, FLASH_SECTOR ) ||
+      platform_flash_write( w->buf, addr, n ) != n)
+    return false;
+  w->pos += FLASH_SECTOR;
+  w->fill = 0;
+  return true;
+}
+
+// Lua: w:write(data)
+static int flash_writer_write( lua_State *L )
+{
+  flash_writer_t *w = flash_get_writer( L );
+  size_t len;
+  const char *data = buffer_checklstring( L, 2, &len );
+  if (w->closed)
+    return luaL_error( L, "writer is closed" );
+  if (len > w->size - w->pos - w->fill)
+    return luaL_error( L, "partition full" );
+  while (len) {
+    uint32_t n = FLASH_SECTOR - w->fill;
+    if (n > len)
+      n = len;
+    memcpy( w->buf + w->fill, data, n );
+    w->fill += n;
+    w->written += n;
+    data += n;
+    len -= n;
+    if (w->fill == FLASH_SECTOR && !flash_writer_flush( w ))
+      return luaL_error( L, "flash write failed" );
+  }
+  return 0;
+}
+
+// Lua: written = w:close()
+// Programs the last partial sector. Data not closed is discarded.
+static int flash_writer_close( lua_State *L )
+{
+  flash_writer_t *w = flash_get_writer( L );
+  if (!w->closed) {
+    w->closed = true;
+    if (!flash_writer_flush( w ))
+      return luaL_error( L, "flash write failed" );
+  }
+  lua_pushinteger( L, w->written );
+  return 1;
+}
+
+static const LUA_REG_TYPE flash_part_map[] = {
+  { LSTRKEY( "info" ),        LFUNCVAL( flash_part_info ) },
+  { LSTRKEY( "read" ),        LFUNCVAL( flash_part_read ) },
+  { LSTRKEY( "write" ),       LFUNCVAL( flash_part_write ) },
+  { LSTRKEY( "erase_range" ), LFUNCVAL( flash_part_erase_range ) },
+  { LSTRKEY( "writer" ),      LFUNCVAL( flash_part_writer ) },
+  { LSTRKEY( "__index" ),     LROVAL( flash_part_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+static const LUA_REG_TYPE flash_writer_map[] = {
+  { LSTRKEY( "write" ),   LFUNCVAL( flash_writer_write ) },
+  { LSTRKEY( "close" ),   LFUNCVAL( flash_writer_close ) },
+  { LSTRKEY( "__index" ), LROVAL( flash_writer_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+// Module function map
+const LUA_REG_TYPE flash_map[] = {
+  { LSTRKEY( "partition" ),   LFUNCVAL( flash_partition ) },
+  { LSTRKEY( "SECTOR_SIZE" ), LNUMVAL( FLASH_SECTOR ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_flash( lua_State *L )
+{
+  luaL_rometatable( L, FLASH_TABLE_PARTITION, (void *)flash_part_map );
+  luaL_rometatable( L, FLASH_TABLE_WRITER, (void *)flash_writer_map );
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_FLASHLIBNAME, flash_map );
+  return 1;
+#endif
+}
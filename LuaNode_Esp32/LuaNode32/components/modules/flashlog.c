@@ -0,0 +1,119 @@
+// Module for the circular log partition
+//
+// Meant for logging at a high rate without going through SPIFFS: each
+// append is one flash write at the end of the ring, and once the
+// partition is full the oldest sector of records is dropped.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "buffer.h"
+#include "flashlog.h"
+#include "platform_partition.h"
+
+log_store_t flashlog_store = LOG_STORE_INIT(PLATFORM_PARTITION_SUBTYPE_NODEMCU_LOG);
+
+// Lua: flashlog.append(data)
+static int flashlog_append( lua_State *L )
+{
+  size_t len;
+  const char *data = buffer_checklstring( L, 1, &len );
+  if (len == 0 || len > LOG_STORE_MAX_RECORD)
+    return luaL_error( L, "record must be 1 to %d bytes", LOG_STORE_MAX_RECORD );
+  uint32_t used, total;
+  if (!log_store_info( &flashlog_store, &used, &total ))
+    return luaL_error( L, "no log partition" );
+  if (!log_store_append( &flashlog_store, data, len ))
+    return luaL_error( L, "log write failed" );
+  return 0;
+}
+
+// Lua: t = flashlog.tail([n])
+// The last n records (default 10), oldest first
+static int flashlog_tail( lua_State *L )
+{
+  lua_Integer n = luaL_optinteger( L, 1, 10 );
+  luaL_argcheck( L, n >= 0, 1, "negative count" );
+  log_store_pos_t pos;
+  if (!log_store_tail( &flashlog_store, n, &pos ))
+    return luaL_error( L, "no log partition" );
+  char buf[LOG_STORE_MAX_RECORD];
+  int32_t len;
+  lua_newtable( L );
+  for (int i = 1; (len = log_store_next( &flashlog_store, &pos, buf )) >= 0; i++) {
+    lua_pushlstring( L, buf, len );
+    lua_rawseti( L, -2, i );
+  }
+  return 1;
+}
+
+static int flashlog_iter( lua_State *L )
+{
+  log_store_pos_t *pos = (log_store_pos_t *)lua_touserdata( L, lua_upvalueindex( 1 ) );
+  char buf[LOG_STORE_MAX_RECORD];
+  int32_t len = log_store_next( &flashlog_store, pos, buf );
+  if (len < 0)
+    return 0;
+  lua_pushlstring( L, buf, len );
+  return 1;
+}
+
+// Lua: for rec in flashlog.iterate([n]) do ... end
+// Every record from the oldest one on, or only the last n
+static int flashlog_iterate( lua_State *L )
+{
+  log_store_pos_t *pos = (log_store_pos_t *)lua_newuserdata( L, sizeof(log_store_pos_t) );
+  bool ok;
+  if (lua_isnoneornil( L, 1 ))
+    ok = log_store_first( &flashlog_store, pos );
+  else {
+    lua_Integer n = luaL_checkinteger( L, 1 );
+    luaL_argcheck( L, n >= 0, 1, "negative count" );
+    ok = log_store_tail( &flashlog_store, n, pos );
+  }
+  if (!ok)
+    return luaL_error( L, "no log partition" );
+  lua_pushcclosure( L, flashlog_iter, 1 );
+  return 1;
+}
+
+// Lua: flashlog.clear()
+static int flashlog_clear( lua_State *L )
+{
+  if (!log_store_clear( &flashlog_store ))
+    return luaL_error( L, "no log partition" );
+  return 0;
+}
+
+// Lua: used, total = flashlog.info()
+static int flashlog_info( lua_State *L )
+{
+  uint32_t used, total;
+  if (!log_store_info( &flashlog_store, &used, &total ))
+    return luaL_error( L, "no log partition" );
+  lua_pushinteger( L, used );
+  lua_pushinteger( L, total );
+  return 2;
+}
+
+// Module function map
+const LUA_REG_TYPE flashlog_map[] = {
+  { LSTRKEY( "append" ),  LFUNCVAL( flashlog_append ) },
+  { LSTRKEY( "tail" ),    LFUNCVAL( flashlog_tail ) },
+  { LSTRKEY( "iterate" ), LFUNCVAL( flashlog_iterate ) },
+  { LSTRKEY( "clear" ),   LFUNCVAL( flashlog_clear ) },
+  { LSTRKEY( "info" ),    LFUNCVAL( flashlog_info ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_flashlog( lua_State *L )
+{
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_FLASHLOGLIBNAME, flashlog_map );
+  return 1;
+#endif
+}
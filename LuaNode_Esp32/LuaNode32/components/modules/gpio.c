@@ -11,6 +11,13 @@
 
 #include "c_types.h"
 #include "c_string.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "task/task.h"
+#include "waveform.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+#include <stdlib.h>
 
 #define PULLUP PLATFORM_GPIO_PULLUP
 #define FLOAT PLATFORM_GPIO_FLOAT
@@ -22,30 +29,145 @@
 
 
 #ifdef GPIO_INTERRUPT_ENABLE
-static int gpio_cb_ref[GPIO_PIN_NUM];
-static lua_State* gL = NULL;
+#define GPIO_TRIG_PINS 40
 
-void lua_gpio_unref(unsigned pin){
-  if(gpio_cb_ref[pin] != LUA_NOREF){
-    if(gL!=NULL)
-      luaL_unref(gL, LUA_REGISTRYINDEX, gpio_cb_ref[pin]);
-  }
-  gpio_cb_ref[pin] = LUA_NOREF;
-}
+typedef struct {
+  int cb_ref;
+  uint16_t batch;         // edges per callback, 0 calls once per edge
+  uint8_t type;
+  uint8_t count_only;
+  uint8_t prio;           // task priority its edges are posted at
+  uint32_t debounce_us;
+  uint32_t last_us;
+  uint8_t seen;
+  volatile uint32_t count;
+  volatile uint32_t dropped;  // edges lost to a full ring
+  uint32_t dropped_reported;
+} gpio_trig_t;
+
+typedef struct {
+  uint32_t us;
+  uint8_t pin;
+  uint8_t level;
+} gpio_edge_t;
+
+// Allocated on first use and kept, the interrupt may still look at it
+static gpio_trig_t *gpio_trig[GPIO_TRIG_PINS];
 
-void gpio_intr_callback( unsigned pin, unsigned level )
+// Written by the interrupt at head, drained by the Lua task from tail
+static gpio_edge_t gpio_ring[CONFIG_GPIO_TRIG_RING_SIZE];
+static volatile uint32_t gpio_ring_head, gpio_ring_tail;
+static task_handle_t gpio_trig_task;
+
+static void IRAM_ATTR gpio_intr_callback( unsigned pin, unsigned level )
 {
-  NODE_DBG("pin:%d, level:%d \n", pin, level);
-  if(gpio_cb_ref[pin] == LUA_NOREF)
+  gpio_trig_t *t = pin < GPIO_TRIG_PINS ? gpio_trig[pin] : NULL;
+  if (!t)
     return;
-  if(!gL)
+  uint32_t now = system_get_time();
+  if (t->debounce_us) {
+    if (t->seen && now - t->last_us < t->debounce_us)
+      return;
+    t->last_us = now;
+    t->seen = 1;
+  }
+  t->count++;
+  if (t->count_only)
     return;
-  lua_rawgeti(gL, LUA_REGISTRYINDEX, gpio_cb_ref[pin]);
-  lua_pushinteger(gL, level);
-  lua_call(gL, 1, 0);
+  // A level trigger keeps firing until Lua has seen it, so mask it meanwhile
+  if (t->type >= GPIO_PIN_INTR_LOLEVEL)
+    platform_gpio_intr_set( pin, GPIO_PIN_INTR_DISABLE );
+
+  uint32_t head = gpio_ring_head;
+  uint32_t next = head + 1 == CONFIG_GPIO_TRIG_RING_SIZE ? 0 : head + 1;
+  if (next == gpio_ring_tail) {
+    t->dropped++;
+  } else {
+    gpio_ring[head].us = now;
+    gpio_ring[head].pin = pin;
+    gpio_ring[head].level = level;
+    __sync_synchronize();
+    gpio_ring_head = next;
+  }
+  // Whichever post runs first delivers every edge in the ring, this pin's
+  // included
+  task_post_coalesced( t->prio, gpio_trig_task, 0 );
+}
+
+static void gpio_trig_call( lua_State* L, gpio_trig_t *t, int nargs )
+{
+  lua_rawgeti( L, LUA_REGISTRYINDEX, t->cb_ref );
+  lua_insert( L, -nargs - 1 );
+  lua_call( L, nargs, 0 );
 }
 
-// Lua: trig( pin, type, function )
+static void gpio_trig_handler( task_param_t param, task_prio_t prio )
+{
+  (void)param; (void)prio;
+  lua_State *L = lua_getstate();
+  uint32_t tail = gpio_ring_tail, head = gpio_ring_head;
+  __sync_synchronize();
+  uint64_t batched = 0;
+
+  for (uint32_t i = tail; i != head; i = i + 1 == CONFIG_GPIO_TRIG_RING_SIZE ? 0 : i + 1) {
+    gpio_trig_t *t = gpio_trig[gpio_ring[i].pin];
+    if (t->cb_ref == LUA_NOREF)
+      continue;
+    if (t->batch) {
+      batched |= 1ULL << gpio_ring[i].pin;
+      continue;
+    }
+    lua_pushinteger( L, gpio_ring[i].level );
+    lua_pushnumber( L, gpio_ring[i].us );
+    gpio_trig_call( L, t, 2 );
+  }
+
+  // Batched pins get fn(levels, times, dropped) with up to batch edges each
+  for (unsigned pin = 0; batched; pin++) {
+    if (!(batched & (1ULL << pin)))
+      continue;
+    batched &= ~(1ULL << pin);
+    gpio_trig_t *t = gpio_trig[pin];
+    int n = 0;
+    for (uint32_t i = tail; i != head; i = i + 1 == CONFIG_GPIO_TRIG_RING_SIZE ? 0 : i + 1) {
+      if (gpio_ring[i].pin != pin || t->cb_ref == LUA_NOREF || !t->batch)
+        continue;
+      if (n == 0) {
+        lua_newtable( L );
+        lua_newtable( L );
+      }
+      n++;
+      lua_pushinteger( L, gpio_ring[i].level );
+      lua_rawseti( L, -3, n );
+      lua_pushnumber( L, gpio_ring[i].us );
+      lua_rawseti( L, -2, n );
+      if (n == t->batch) {
+        uint32_t dropped = t->dropped;
+        lua_pushinteger( L, dropped - t->dropped_reported );
+        t->dropped_reported = dropped;
+        gpio_trig_call( L, t, 3 );
+        n = 0;
+      }
+    }
+    if (n) {
+      uint32_t dropped = t->dropped;
+      lua_pushinteger( L, dropped - t->dropped_reported );
+      t->dropped_reported = dropped;
+      gpio_trig_call( L, t, 3 );
+    }
+  }
+
+  gpio_ring_tail = head;
+  for (unsigned pin = 0; pin < GPIO_TRIG_PINS; pin++) {
+    gpio_trig_t *t = gpio_trig[pin];
+    if (t && !t->count_only && t->type >= GPIO_PIN_INTR_LOLEVEL)
+      platform_gpio_intr_set( pin, t->type );
+  }
+}
+
+// Lua: trig( pin, type[, function][, {batch=, debounce_us=, count=, prio=}] )
+// prio, node.PRIO_LOW by default, is the queue the pin's edges wake the Lua
+// task through
 static int lgpio_trig( lua_State* L )
 {
   unsigned type;
@@ -53,9 +175,8 @@ static int lgpio_trig( lua_State* L )
   size_t sl;
   
   pin = luaL_checkinteger( L, 1 );
-  //MOD_CHECK_ID( gpio, pin );
-  if(pin==0)
-    return luaL_error( L, "no interrupt for D0" );
+  if (pin >= GPIO_TRIG_PINS)
+    return luaL_error( L, "wrong pin num." );
 
   const char *str = luaL_checklstring( L, 2, &sl );
   if (str == NULL)
@@ -75,17 +196,84 @@ static int lgpio_trig( lua_State* L )
     type = GPIO_PIN_INTR_DISABLE;
   }
 
-  // luaL_checkanyfunction(L, 3);
+  int opts = lua_istable(L, 3) ? 3 : lua_istable(L, 4) ? 4 : 0;
+  lua_Integer batch = 0, debounce = 0;
+  bool count_only = false;
+  task_prio_t prio = TASK_PRIORITY_LOW;
+  if (opts) {
+    lua_getfield( L, opts, "batch" );
+    batch = luaL_optinteger( L, -1, 0 );
+    lua_getfield( L, opts, "debounce_us" );
+    debounce = luaL_optinteger( L, -1, 0 );
+    lua_getfield( L, opts, "count" );
+    count_only = lua_toboolean( L, -1 );
+    lua_getfield( L, opts, "prio" );
+    prio = mod_optprio( L, -1, TASK_PRIORITY_LOW );
+    lua_pop( L, 4 );
+    if (batch < 0 || batch > CONFIG_GPIO_TRIG_RING_SIZE)
+      return luaL_error( L, "batch out of range" );
+    if (debounce < 0)
+      return luaL_error( L, "wrong debounce" );
+    if (count_only && type >= GPIO_PIN_INTR_LOLEVEL)
+      return luaL_error( L, "count needs an edge trigger" );
+  }
+
+  gpio_trig_t *t = gpio_trig[pin];
+  if (!t) {
+    if (type == GPIO_PIN_INTR_DISABLE)
+      return 0;
+    t = (gpio_trig_t *)calloc( 1, sizeof(gpio_trig_t) );
+    if (!t)
+      return luaL_error( L, "out of memory" );
+    t->cb_ref = LUA_NOREF;
+    gpio_trig[pin] = t;
+  }
+  if (!gpio_trig_task) {
+    gpio_trig_task = task_get_id( gpio_trig_handler );
+    platform_gpio_init( gpio_intr_callback );
+  }
+
+  // Keep the interrupt off while the settings change under it
+  platform_gpio_intr_init( pin, GPIO_PIN_INTR_DISABLE );
   if (lua_type(L, 3) == LUA_TFUNCTION || lua_type(L, 3) == LUA_TLIGHTFUNCTION){
     lua_pushvalue(L, 3);  // copy argument (func) to the top of stack
-    if(gpio_cb_ref[pin] != LUA_NOREF)
-      luaL_unref(L, LUA_REGISTRYINDEX, gpio_cb_ref[pin]);
-    gpio_cb_ref[pin] = luaL_ref(L, LUA_REGISTRYINDEX);
+    if(t->cb_ref != LUA_NOREF)
+      luaL_unref(L, LUA_REGISTRYINDEX, t->cb_ref);
+    t->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  if (type == GPIO_PIN_INTR_DISABLE) {
+    luaL_unref(L, LUA_REGISTRYINDEX, t->cb_ref);
+    t->cb_ref = LUA_NOREF;
   }
+  t->type = type;
+  t->batch = batch;
+  t->count_only = count_only;
+  t->prio = prio;
+  t->debounce_us = debounce;
+  t->seen = 0;
 
-  platform_gpio_intr_init(pin, type);
+  if (type != GPIO_PIN_INTR_DISABLE)
+    platform_gpio_intr_init( pin, type );
   return 0;  
 }
+
+// Lua: count, dropped = count( pin[, reset] )
+static int lgpio_count( lua_State* L )
+{
+  unsigned pin = luaL_checkinteger( L, 1 );
+  if (pin >= GPIO_TRIG_PINS)
+    return luaL_error( L, "wrong pin num." );
+  gpio_trig_t *t = gpio_trig[pin];
+  uint32_t count = t ? t->count : 0, dropped = t ? t->dropped : 0;
+  if (t && lua_toboolean( L, 2 )) {
+    t->count -= count;
+    t->dropped -= dropped;
+    t->dropped_reported -= dropped;
+  }
+  lua_pushnumber( L, count );
+  lua_pushnumber( L, dropped );
+  return 2;
+}
 #endif
 
 // Lua: mode( pin, mode, pullup )
@@ -149,11 +337,96 @@ static int lgpio_write( lua_State* L )
   return 0;  
 }
 
+// GPIO6-11 drive the SPI flash; writing them takes the flash away from
+// under the running firmware
+#define GPIO_FLASH_PINS   ((uint64_t)0x3f << 6)
+#define GPIO_ALL_PINS     (((uint64_t)1 << 40) - 1)
+
+static uint64_t gpio_checkmask( lua_State* L, int idx )
+{
+  lua_Number n = luaL_checknumber( L, idx );
+  if ( n < 0 || n > (lua_Number)GPIO_ALL_PINS || n != (lua_Number)(uint64_t)n )
+    return luaL_argerror( L, idx, "not a 40 bit pin mask" );
+  return (uint64_t)n;
+}
+
+// Lua: write_mask( mask, values )
+// Bit n selects / sets GPIOn. All pins in mask change with one register
+// write per 32 pin bank.
+static int lgpio_write_mask( lua_State* L )
+{
+  uint64_t mask = gpio_checkmask( L, 1 );
+  uint64_t values = gpio_checkmask( L, 2 );
+  if ( mask & GPIO_FLASH_PINS )
+    return luaL_error( L, "mask includes flash pins" );
+  platform_gpio_write_mask( mask, values );
+  return 0;
+}
+
+// Lua: levels = read_all()
+// Input levels of GPIO0-39 as bits of one number
+static int lgpio_read_all( lua_State* L )
+{
+  lua_pushnumber( L, (lua_Number)platform_gpio_read_all() );
+  return 1;
+}
+
 #define DELAY_TABLE_MAX_LEN 256
-#define noInterrupts ets_intr_lock
-#define interrupts ets_intr_unlock
-#define delayMicroseconds os_delay_us
-#define DIRECT_WRITE(pin, level)    (GPIO_OUTPUT_SET(GPIO_ID_PIN(pin_num[pin]), level))
+
+static task_handle_t gpio_wave_task;
+static int gpio_wave_cb_ref = LUA_NOREF;
+
+// Runs in the RMT interrupt
+static void gpio_wave_done( void *arg )
+{
+  if (arg)
+    xSemaphoreGiveFromISR( (SemaphoreHandle_t)arg, NULL );
+  else
+    task_post_low( gpio_wave_task, 0 );
+}
+
+static void gpio_wave_handler( task_param_t param, task_prio_t prio )
+{
+  (void)param; (void)prio;
+  lua_State *L = lua_getstate();
+  int ref = gpio_wave_cb_ref;
+  gpio_wave_cb_ref = LUA_NOREF;
+  if (ref == LUA_NOREF)
+    return;
+  lua_rawgeti( L, LUA_REGISTRYINDEX, ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, ref );
+  lua_call( L, 0, 0 );
+}
+
+// Reads a table of microsecond delays; returns the number of entries
+static unsigned gpio_check_delays( lua_State* L, int idx, uint32_t *delays, uint64_t *total )
+{
+  if( !lua_istable( L, idx ) )
+    return luaL_error( L, "wrong arg range" );
+  unsigned table_len = lua_objlen( L, idx );
+  if (table_len <= 0 || table_len>DELAY_TABLE_MAX_LEN)
+    return luaL_error( L, "wrong arg range" );
+  *total = 0;
+  for( unsigned i = 0; i < table_len; i ++ )
+  {
+    lua_rawgeti( L, idx, i + 1 );
+    int d = ( int )luaL_checkinteger( L, -1 );
+    lua_pop( L, 1 );
+    if( d < 0 || d > 1000000 )    // can not delay more than 1000000 us
+      return luaL_error( L, "delay must < 1000000 us" );
+    delays[i] = d;
+    *total += d;
+  }
+  return table_len;
+}
+
+static int gpio_wave_error( lua_State* L, int res )
+{
+  if (res == -2)
+    return luaL_error( L, "waveform already playing" );
+  return luaL_error( L, "waveform too long" );
+}
+
 // Lua: serout( pin, firstLevel, delay_table, [repeatNum] )
 // -- serout( pin, firstLevel, delay_table, [repeatNum] )
 // gpio.mode(1,gpio.OUTPUT,gpio.PULLUP)
@@ -164,36 +437,24 @@ static int lgpio_write( lua_State* L )
 // gpio.mode(1,gpio.OUTPUT,gpio.PULLUP)
 // gpio.serout(1,0,{20,10,10,20,10,10,10,100}) -- sim uart one byte 0x5A at about 100kbps
 // gpio.serout(1,1,{8,18},8) -- serial 30% pwm 38k, lasts 8 cycles
+// The pulses are timed by the RMT peripheral; the calling task sleeps until
+// they are done, with interrupts left on.
 static int lgpio_serout( lua_State* L )
 {
   unsigned level;
   unsigned pin;
   unsigned table_len = 0;
   unsigned repeat = 0;
-  int delay_table[DELAY_TABLE_MAX_LEN];
+  uint32_t delay_table[DELAY_TABLE_MAX_LEN];
+  uint64_t total_us;
   
   pin = luaL_checkinteger( L, 1 );
-  //MOD_CHECK_ID( gpio, pin );
+  if ( pin >= GPIO_PIN_NUM )
+    return luaL_error( L, "wrong arg range" );
   level = luaL_checkinteger( L, 2 );
   if ( level!=HIGH && level!=LOW )
     return luaL_error( L, "wrong arg type" );
-  if( lua_istable( L, 3 ) )
-  {
-    table_len = lua_objlen( L, 3 );
-    if (table_len <= 0 || table_len>DELAY_TABLE_MAX_LEN)
-      return luaL_error( L, "wrong arg range" );
-    int i;
-    for( i = 0; i < table_len; i ++ )
-    {
-      lua_rawgeti( L, 3, i + 1 );
-      delay_table[i] = ( int )luaL_checkinteger( L, -1 );
-      lua_pop( L, 1 );
-      if( delay_table[i] < 0 || delay_table[i] > 1000000 )    // can not delay more than 1000000 us
-        return luaL_error( L, "delay must < 1000000 us" );
-    }
-  } else {
-    return luaL_error( L, "wrong arg range" );
-  } 
+  table_len = gpio_check_delays( L, 3, delay_table, &total_us );
 
   if(lua_isnumber(L, 4))
     repeat = lua_tointeger( L, 4 );
@@ -202,27 +463,71 @@ static int lgpio_serout( lua_State* L )
 
   if(repeat==0)
     repeat = 1;
-  int j;
-  bool skip_loop = true;
-  do
-  {
-    if(skip_loop){    // skip the first loop.
-      skip_loop = false;
-      continue;
-    }
-    for(j=0;j<table_len;j++){
-      noInterrupts();
-      // platform_gpio_write(pin, level);
-      DIRECT_WRITE(pin, level);
-      interrupts();
-      delayMicroseconds(delay_table[j]);
-      level=!level;
-    }
-    repeat--;
-  } while (repeat>0); 
 
+  SemaphoreHandle_t done = xSemaphoreCreateBinary();
+  if (!done)
+    return luaL_error( L, "out of memory" );
+  int res = waveform_start( pin_num[pin], level, delay_table, table_len, repeat,
+                            gpio_wave_done, done );
+  if (res) {
+    vSemaphoreDelete( done );
+    return gpio_wave_error( L, res );
+  }
+  // Zero delays are played as 1 us, so allow for those on top
+  TickType_t wait = (total_us + table_len) * repeat / 1000 / portTICK_PERIOD_MS + 2;
+  if (xSemaphoreTake( done, wait ) != pdTRUE)
+    waveform_stop();
+  vSemaphoreDelete( done );
   return 0;  
 }
+
+// Lua: waveform( pin, firstLevel, delay_table, [loops], [function] )
+// Plays delay_table like serout() but returns straight away. loops = 0
+// repeats until waveform_stop(). The function is called when it is done.
+static int lgpio_waveform( lua_State* L )
+{
+  unsigned level;
+  unsigned pin;
+  unsigned table_len;
+  uint32_t delay_table[DELAY_TABLE_MAX_LEN];
+  uint64_t total_us;
+  int stack = 4;
+  unsigned loops = 1;
+
+  pin = luaL_checkinteger( L, 1 );
+  level = luaL_checkinteger( L, 2 );
+  if ( level!=HIGH && level!=LOW )
+    return luaL_error( L, "wrong arg type" );
+  table_len = gpio_check_delays( L, 3, delay_table, &total_us );
+  if ( lua_isnumber( L, stack ) )
+    loops = lua_tointeger( L, stack++ );
+  bool has_cb = lua_isfunction( L, stack ) || lua_islightfunction( L, stack );
+
+  if (!gpio_wave_task)
+    gpio_wave_task = task_get_id( gpio_wave_handler );
+  if (waveform_busy())
+    return gpio_wave_error( L, -2 );
+  int res = waveform_start( pin, level, delay_table, table_len, loops,
+                            has_cb ? gpio_wave_done : NULL, NULL );
+  if (res)
+    return gpio_wave_error( L, res );
+  luaL_unref( L, LUA_REGISTRYINDEX, gpio_wave_cb_ref );
+  gpio_wave_cb_ref = LUA_NOREF;
+  if (has_cb) {
+    lua_pushvalue( L, stack );
+    gpio_wave_cb_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  return 0;
+}
+
+// Lua: waveform_stop()
+static int lgpio_waveform_stop( lua_State* L )
+{
+  waveform_stop();
+  luaL_unref( L, LUA_REGISTRYINDEX, gpio_wave_cb_ref );
+  gpio_wave_cb_ref = LUA_NOREF;
+  return 0;
+}
 #undef DELAY_TABLE_MAX_LEN
 
 // Module function map
@@ -230,9 +535,14 @@ const LUA_REG_TYPE gpio_map[] = {
   { LSTRKEY( "mode" ),   LFUNCVAL( lgpio_mode ) },
   { LSTRKEY( "read" ),   LFUNCVAL( lgpio_read ) },
   { LSTRKEY( "write" ),  LFUNCVAL( lgpio_write ) },
+  { LSTRKEY( "write_mask" ), LFUNCVAL( lgpio_write_mask ) },
+  { LSTRKEY( "read_all" ),   LFUNCVAL( lgpio_read_all ) },
   { LSTRKEY( "serout" ), LFUNCVAL( lgpio_serout ) },
+  { LSTRKEY( "waveform" ), LFUNCVAL( lgpio_waveform ) },
+  { LSTRKEY( "waveform_stop" ), LFUNCVAL( lgpio_waveform_stop ) },
 #ifdef GPIO_INTERRUPT_ENABLE
   { LSTRKEY( "trig" ),   LFUNCVAL( lgpio_trig ) },
+  { LSTRKEY( "count" ),  LFUNCVAL( lgpio_count ) },
   //{ LSTRKEY( "INT" ),    LNUMVAL( PLATFORM_INTERRUPT ) },
 #endif
   { LSTRKEY( "OUTPUT" ), LNUMVAL( OUTPUT ) },
@@ -0,0 +1,1274 @@
+// Module for HTTP/1.1 server and client
+//
+// Connections are accepted and parsed in C. Requests for paths under a
+// static route are answered straight from the file system; everything
+// else reaches Lua as a parsed request table plus a response object.
+// http.request() is in http_client.c.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "platform.h"
+#include "vfs.h"
+#include "asset_store.h"
+#include "http_client.h"
+#include "task/task.h"
+#include "user_config.h"
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <strings.h>
+
+#include "lwip/err.h"
+#include "lwip/ip_addr.h"
+#include "lwip/tcp.h"
+
+// Some LWIP macros cause complaints with ptr NULL checks, so shut them off :(
+#pragma GCC diagnostic ignored "-Waddress"
+
+#define HTTP_MAX_HEADERS    16
+#define HTTP_MAX_ROUTES     4
+#define HTTP_FILE_CHUNK     512
+#define HTTP_POLL_INTERVAL  2   // in lwIP coarse timer ticks, i.e. 1 s
+
+static const char HTTP_TABLE_SERVER[] = "http.server";
+static const char HTTP_TABLE_RESPONSE[] = "http.response";
+
+typedef struct http_chunk {
+  struct http_chunk *next;
+  uint32_t len;
+  uint32_t off;
+  char data[0];
+} http_chunk;
+
+typedef struct http_route {
+  char *prefix;
+  char *dir;
+} http_route;
+
+typedef struct http_server {
+  struct tcp_pcb *pcb;
+  int self_ref;
+  int cb_request_ref;
+  int closing;              // release self_ref once the last connection goes
+  volatile uint32_t nconn;  // counted up in the accept callback
+  struct http_conn *conns;
+  http_route routes[HTTP_MAX_ROUTES];
+} http_server;
+
+typedef struct {
+  uint16_t name, name_len;
+  uint16_t value, value_len;
+} http_header;
+
+enum {
+  ST_HEAD,     // reading the request line and headers
+  ST_BODY,     // reading a Content-Length body
+  ST_RESPOND,  // waiting for the response to be written
+  ST_CLOSED
+};
+
+typedef struct http_response {
+  struct http_conn *conn;
+} http_response;
+
+typedef struct http_conn {
+  struct http_conn *next;
+  struct tcp_pcb *pcb;
+  http_server *srv;
+  volatile uint32_t pending;  // events posted and not yet handled
+  volatile uint8_t idle;      // seconds without traffic
+  uint8_t state;
+  uint8_t linked;
+  uint8_t in_parse;
+  uint8_t keepalive;
+  uint8_t minor;       // HTTP/1.<minor>
+  uint8_t head_only;   // HEAD request, send no body
+  uint8_t crlf;        // progress through the blank line ending the head
+  uint8_t nhdr;
+  struct pbuf *rx;     // received and not parsed yet
+  uint16_t rx_off;     // bytes of rx->payload already parsed
+  char *buf;           // request head, followed by the body
+  uint32_t len;
+  uint32_t cap;
+  uint32_t head_len;
+  uint32_t body_len;
+  uint16_t method, method_len;
+  uint16_t path, path_len;
+  uint16_t query, query_len;
+  http_header hdr[HTTP_MAX_HEADERS];
+  // Response
+  http_response *res;
+  int res_ref;
+  uint16_t status;
+  uint8_t res_started;
+  uint8_t res_chunked;
+  uint8_t res_done;
+  char *res_hdr;
+  uint32_t res_hdr_len;
+  http_chunk *out_head;
+  http_chunk *out_tail;
+  int fd;
+  const char *map;     // or else the body comes from the mapped asset store
+  uint32_t file_left;
+} http_conn;
+
+typedef struct {
+  enum {
+    EV_ACCEPT,
+    EV_RECV,     // p == NULL when the peer has closed its side
+    EV_SENT,
+    EV_ERR,      // the pcb is gone
+    EV_TIMEOUT
+  } event;
+  http_conn *conn;
+  struct pbuf *p;
+} http_event;
+
+static task_handle_t http_event_task;
+static char http_file_buf[HTTP_FILE_CHUNK];
+
+static inline void http_atomic_add (volatile uint32_t *counter, int32_t n)
+{
+  uint32_t v, set;
+  do {
+    v = *counter;
+    set = v + n;
+    uxPortCompareSet (counter, v, &set);
+  } while (set != v);
+}
+
+static void http_parse (lua_State *L, http_conn *c);
+static void http_flush (lua_State *L, http_conn *c);
+
+// --- LWIP callbacks
+
+static bool post_http_event (http_conn *c, int event, struct pbuf *p)
+{
+  http_event *ev = (http_event *)malloc (sizeof (http_event));
+  if (!ev)
+    return false;
+  ev->event = event;
+  ev->conn = c;
+  ev->p = p;
+  // All events of a connection go through the same queue, so they are
+  // handled in the order they happened
+  http_atomic_add (&c->pending, 1);
+  if (!task_post_medium (http_event_task, (task_param_t)ev)) {
+    http_atomic_add (&c->pending, -1);
+    free (ev);
+    return false;
+  }
+  return true;
+}
+
+static void http_err_cb (void *arg, err_t err)
+{
+  http_conn *c = (http_conn *)arg;
+  if (!c)
+    return;
+  c->pcb = NULL; // Will be freed at LWIP level
+  post_http_event (c, EV_ERR, NULL);
+}
+
+static err_t http_recv_cb (void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err)
+{
+  http_conn *c = (http_conn *)arg;
+  if (!c) {
+    if (p) {
+      tcp_recved (tpcb, p->tot_len);
+      pbuf_free (p);
+    }
+    return ERR_OK;
+  }
+  c->idle = 0;
+  if (!post_http_event (c, EV_RECV, p))
+    return ERR_MEM; // lwIP holds on to the data and offers it again later
+  return ERR_OK;
+}
+
+static err_t http_sent_cb (void *arg, struct tcp_pcb *tpcb, u16_t len)
+{
+  http_conn *c = (http_conn *)arg;
+  if (!c)
+    return ERR_OK;
+  c->idle = 0;
+  post_http_event (c, EV_SENT, NULL);
+  return ERR_OK;
+}
+
+static err_t http_poll_cb (void *arg, struct tcp_pcb *tpcb)
+{
+  http_conn *c = (http_conn *)arg;
+  if (!c)
+    return ERR_OK;
+  if (++c->idle == CONFIG_HTTP_IDLE_TIMEOUT)
+    post_http_event (c, EV_TIMEOUT, NULL);
+  return ERR_OK;
+}
+
+static err_t http_accept_cb (void *arg, struct tcp_pcb *newpcb, err_t err)
+{
+  http_server *srv = (http_server *)arg;
+  // Anything but ERR_OK has lwIP abort the new connection
+  if (!srv || !srv->pcb || srv->closing || err != ERR_OK)
+    return ERR_VAL;
+  if (srv->nconn >= CONFIG_HTTP_MAX_CONNECTIONS)
+    return ERR_MEM;
+
+  http_conn *c = (http_conn *)calloc (1, sizeof (http_conn));
+  if (!c)
+    return ERR_MEM;
+  c->pcb = newpcb;
+  c->srv = srv;
+  c->state = ST_HEAD;
+  c->res_ref = LUA_NOREF;
+  http_atomic_add (&srv->nconn, 1);
+
+  tcp_arg (newpcb, c);
+  tcp_err (newpcb, http_err_cb);
+  tcp_recv (newpcb, http_recv_cb);
+  tcp_sent (newpcb, http_sent_cb);
+  tcp_poll (newpcb, http_poll_cb, HTTP_POLL_INTERVAL);
+  tcp_accepted (srv->pcb);
+
+  if (!post_http_event (c, EV_ACCEPT, NULL)) {
+    tcp_arg (newpcb, NULL);
+    http_atomic_add (&srv->nconn, -1);
+    free (c);
+    return ERR_MEM;  // lwIP aborts the connection
+  }
+  return ERR_OK;
+}
+
+// --- Connection state
+
+static void http_detach_response (lua_State *L, http_conn *c)
+{
+  if (c->res) {
+    c->res->conn = NULL;
+    c->res = NULL;
+  }
+  luaL_unref (L, LUA_REGISTRYINDEX, c->res_ref);
+  c->res_ref = LUA_NOREF;
+}
+
+static void http_out_free (http_conn *c)
+{
+  http_chunk *k = c->out_head;
+  while (k) {
+    http_chunk *next = k->next;
+    free (k);
+    k = next;
+  }
+  c->out_head = c->out_tail = NULL;
+  if (c->fd) {
+    vfs_close (c->fd);
+    c->fd = 0;
+  }
+  c->map = NULL;
+  c->file_left = 0;
+}
+
+static void http_conn_free (lua_State *L, http_conn *c)
+{
+  http_server *srv = c->srv;
+  free (c);
+  http_atomic_add (&srv->nconn, -1);
+  if (srv->closing && srv->nconn == 0) {
+    lua_gc (L, LUA_GCSTOP, 0);
+    luaL_unref (L, LUA_REGISTRYINDEX, srv->self_ref);
+    srv->self_ref = LUA_NOREF;
+    lua_gc (L, LUA_GCRESTART, 0);
+  }
+}
+
+static void http_conn_close (lua_State *L, http_conn *c, bool abort)
+{
+  if (c->state == ST_CLOSED)
+    return;
+  c->state = ST_CLOSED;
+  http_detach_response (L, c);
+  if (c->rx) {
+    pbuf_free (c->rx);
+    c->rx = NULL;
+  }
+  free (c->buf);
+  c->buf = NULL;
+  free (c->res_hdr);
+  c->res_hdr = NULL;
+  http_out_free (c);
+
+  if (c->pcb) {
+    struct tcp_pcb *pcb = c->pcb;
+    c->pcb = NULL;
+    tcp_arg (pcb, NULL);
+    tcp_err (pcb, NULL);
+    tcp_recv (pcb, NULL);
+    tcp_sent (pcb, NULL);
+    tcp_poll (pcb, NULL, 0);
+    if (abort || tcp_close (pcb) != ERR_OK)
+      tcp_abort (pcb);
+  }
+
+  if (c->linked) {
+    http_conn **pp = &c->srv->conns;
+    while (*pp && *pp != c)
+      pp = &(*pp)->next;
+    if (*pp)
+      *pp = c->next;
+    c->linked = 0;
+  }
+  // Events still queued for us are discarded by http_handle_event, which
+  // frees the connection once the last of them is through
+  if (c->pending == 0)
+    http_conn_free (L, c);
+}
+
+// Get ready for the next request on a kept-alive connection
+static void http_conn_reset (lua_State *L, http_conn *c)
+{
+  http_detach_response (L, c);
+  free (c->res_hdr);
+  c->res_hdr = NULL;
+  c->res_hdr_len = 0;
+  c->state = ST_HEAD;
+  c->len = c->head_len = c->body_len = 0;
+  c->crlf = 0;
+  c->nhdr = 0;
+  c->head_only = 0;
+  c->status = 200;
+  c->res_started = c->res_chunked = c->res_done = 0;
+}
+
+static inline bool http_drained (http_conn *c)
+{
+  return c->res_done && !c->out_head && !c->file_left;
+}
+
+// --- Response output
+
+static http_chunk *http_out_new (http_conn *c, uint32_t len)
+{
+  http_chunk *k = (http_chunk *)malloc (sizeof (http_chunk) + len);
+  if (!k)
+    return NULL;
+  k->next = NULL;
+  k->len = len;
+  k->off = 0;
+  if (c->out_tail)
+    c->out_tail->next = k;
+  else
+    c->out_head = k;
+  c->out_tail = k;
+  return k;
+}
+
+static bool http_out (http_conn *c, const char *data, uint32_t len)
+{
+  if (len == 0)
+    return true;
+  http_chunk *k = http_out_new (c, len);
+  if (!k)
+    return false;
+  memcpy (k->data, data, len);
+  return true;
+}
+
+static const char *http_reason (int status)
+{
+  switch (status) {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 204: return "No Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 413: return "Payload Too Large";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 503: return "Service Unavailable";
+    case 505: return "HTTP Version Not Supported";
+    default:  return "Unknown";
+  }
+}
+
+static bool http_add_header (http_conn *c, const char *name, const char *value)
+{
+  size_t nl = strlen (name), vl = strlen (value);
+  char *h = (char *)realloc (c->res_hdr, c->res_hdr_len + nl + vl + 4);
+  if (!h)
+    return false;
+  c->res_hdr = h;
+  h += c->res_hdr_len;
+  memcpy (h, name, nl);
+  memcpy (h + nl, ": ", 2);
+  memcpy (h + nl + 2, value, vl);
+  memcpy (h + nl + 2 + vl, "\r\n", 2);
+  c->res_hdr_len += nl + vl + 4;
+  return true;
+}
+
+// Queue the status line and headers. A negative content_length means the
+// body length isn't known yet: HTTP/1.1 responses are then sent chunked,
+// HTTP/1.0 ones end by closing the connection.
+static bool http_begin (http_conn *c, int32_t content_length)
+{
+  char line[80];
+  if (content_length < 0 && !c->head_only) {
+    if (c->minor >= 1)
+      c->res_chunked = 1;
+    else
+      c->keepalive = 0;
+  }
+  int n = snprintf (line, sizeof (line), "HTTP/1.1 %d %s\r\n",
+                    c->status, http_reason (c->status));
+  http_chunk *k = http_out_new (c, n + c->res_hdr_len + sizeof (line));
+  if (!k)
+    return false;
+  memcpy (k->data, line, n);
+  if (c->res_hdr_len)
+    memcpy (k->data + n, c->res_hdr, c->res_hdr_len);
+  k->len = n + c->res_hdr_len;
+  n = 0;
+  if (content_length >= 0)
+    n = snprintf (line, sizeof (line), "Content-Length: %u\r\n",
+                  (unsigned)content_length);
+  else if (c->res_chunked)
+    n = snprintf (line, sizeof (line), "Transfer-Encoding: chunked\r\n");
+  if (!c->keepalive)
+    n += snprintf (line + n, sizeof (line) - n, "Connection: close\r\n");
+  else if (c->minor == 0)
+    n += snprintf (line + n, sizeof (line) - n, "Connection: keep-alive\r\n");
+  n += snprintf (line + n, sizeof (line) - n, "\r\n");
+  memcpy (k->data + k->len, line, n);
+  k->len += n;
+  c->res_started = 1;
+  free (c->res_hdr);
+  c->res_hdr = NULL;
+  c->res_hdr_len = 0;
+  return true;
+}
+
+static bool http_body (http_conn *c, const char *data, uint32_t len)
+{
+  if (c->head_only || len == 0)
+    return true;
+  if (!c->res_chunked)
+    return http_out (c, data, len);
+  char size[12];
+  int n = snprintf (size, sizeof (size), "%x\r\n", (unsigned)len);
+  return http_out (c, size, n) && http_out (c, data, len) &&
+         http_out (c, "\r\n", 2);
+}
+
+static bool http_end (http_conn *c)
+{
+  c->res_done = 1;
+  if (c->res_chunked && !c->head_only)
+    return http_out (c, "0\r\n\r\n", 5);
+  return true;
+}
+
+// Write queued output and file data as far as lwIP's send buffer allows;
+// the sent callback brings us back for the rest.
+static void http_flush (lua_State *L, http_conn *c)
+{
+  struct tcp_pcb *pcb = c->pcb;
+  if (!pcb)
+    return;
+  bool wrote = false;
+  err_t err = ERR_OK;
+  http_chunk *k;
+  while ((k = c->out_head)) {
+    uint32_t n = k->len - k->off;
+    u16_t avail = tcp_sndbuf (pcb);
+    if (avail == 0)
+      break;
+    if (n > avail)
+      n = avail;
+    err = tcp_write (pcb, k->data + k->off, n,
+                     TCP_WRITE_FLAG_COPY | (k->next ? TCP_WRITE_FLAG_MORE : 0));
+    if (err != ERR_OK)
+      break;
+    wrote = true;
+    k->off += n;
+    if (k->off == k->len) {
+      c->out_head = k->next;
+      free (k);
+    }
+  }
+  if (!c->out_head)
+    c->out_tail = NULL;
+  while (err == ERR_OK && !c->out_head && c->file_left) {
+    uint32_t n = tcp_sndbuf (pcb);
+    if (n == 0)
+      break;
+    if (n > c->file_left)
+      n = c->file_left;
+    // Assets stay mapped for good, so lwIP can send from flash without a copy
+    const char *data = c->map;
+    u8_t flags = 0;
+    if (!data) {
+      if (n > HTTP_FILE_CHUNK)
+        n = HTTP_FILE_CHUNK;
+      int32_t got = vfs_read (c->fd, http_file_buf, n);
+      if (got <= 0) {
+        err = ERR_BUF;  // file shrank under us, Content-Length is wrong now
+        break;
+      }
+      n = got;
+      data = http_file_buf;
+      flags = TCP_WRITE_FLAG_COPY;
+    }
+    if (c->file_left > n)
+      flags |= TCP_WRITE_FLAG_MORE;
+    err = tcp_write (pcb, data, n, flags);
+    if (err != ERR_OK) {
+      if (!c->map)
+        vfs_lseek (c->fd, -(int32_t)n, VFS_SEEK_CUR);
+      break;
+    }
+    wrote = true;
+    c->file_left -= n;
+    if (c->map)
+      c->map += n;
+    if (!c->file_left) {
+      if (c->fd)
+        vfs_close (c->fd);
+      c->fd = 0;
+      c->map = NULL;
+    }
+  }
+  if (wrote)
+    tcp_output (pcb);
+  if (err != ERR_OK && err != ERR_MEM) {
+    http_conn_close (L, c, true);
+    return;
+  }
+  if (http_drained (c) && !c->in_parse) {
+    http_detach_response (L, c);
+    http_parse (L, c);
+  }
+}
+
+static void http_error (lua_State *L, http_conn *c, int status)
+{
+  const char *msg = http_reason (status);
+  c->state = ST_RESPOND;
+  c->status = status;
+  c->keepalive = 0;
+  http_add_header (c, "Content-Type", "text/plain");
+  if (!http_begin (c, strlen (msg)) || !http_body (c, msg, strlen (msg)) ||
+      !http_end (c)) {
+    http_conn_close (L, c, true);
+    return;
+  }
+  http_flush (L, c);
+}
+
+static const char *http_mime_type (const char *name)
+{
+  static const char *const types[][2] = {
+    { "html", "text/html" },
+    { "htm",  "text/html" },
+    { "css",  "text/css" },
+    { "js",   "application/javascript" },
+    { "json", "application/json" },
+    { "txt",  "text/plain" },
+    { "lua",  "text/plain" },
+    { "xml",  "text/xml" },
+    { "png",  "image/png" },
+    { "jpg",  "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "gif",  "image/gif" },
+    { "svg",  "image/svg+xml" },
+    { "ico",  "image/x-icon" },
+  };
+  const char *ext = strrchr (name, '.');
+  if (ext && !strchr (ext, '/')) {
+    ext++;
+    for (unsigned i = 0; i < sizeof (types) / sizeof (types[0]); i++)
+      if (strcasecmp (ext, types[i][0]) == 0)
+        return types[i][1];
+  }
+  return "application/octet-stream";
+}
+
+// Respond with an asset from the mapped partition
+static bool http_serve_asset (http_conn *c, const char *data, uint32_t size,
+                              const char *content_type)
+{
+  if (!http_add_header (c, "Content-Type", content_type) ||
+      !http_begin (c, size))
+    return false;
+  if (!c->head_only && size) {
+    c->map = data;
+    c->file_left = size;
+  }
+  c->res_done = 1;
+  return true;
+}
+
+// Respond with an open file; takes ownership of fd
+static bool http_serve_fd (http_conn *c, int fd, const char *content_type)
+{
+  int32_t size = vfs_lseek (fd, 0, VFS_SEEK_END);
+  if (size < 0 || vfs_lseek (fd, 0, VFS_SEEK_SET) < 0) {
+    vfs_close (fd);
+    return false;
+  }
+  if (!http_add_header (c, "Content-Type", content_type) ||
+      !http_begin (c, size)) {
+    vfs_close (fd);
+    return false;
+  }
+  if (c->head_only || size == 0) {
+    vfs_close (fd);
+  } else {
+    c->fd = fd;
+    c->file_left = size;
+  }
+  c->res_done = 1;
+  return true;
+}
+
+// --- Request parsing
+
+static inline bool http_token (http_conn *c, const http_header *h, const char *name)
+{
+  return h->name_len == strlen (name) &&
+         memcmp (c->buf + h->name, name, h->name_len) == 0;
+}
+
+// Parse the request line and headers in buf. Returns 0, or the status to
+// reject the request with.
+static int http_parse_head (http_conn *c)
+{
+  char *p = c->buf, *end = c->buf + c->head_len;
+  char *eol = memchr (p, '\r', end - p);
+  char *sp1 = memchr (p, ' ', eol - p);
+  char *sp2 = sp1 ? memchr (sp1 + 1, ' ', eol - sp1 - 1) : NULL;
+  if (!sp2 || sp1 == p || sp2 == sp1 + 1)
+    return 400;
+  if (eol - sp2 != 9 || memcmp (sp2 + 1, "HTTP/1.", 7) != 0)
+    return eol - sp2 > 5 && memcmp (sp2 + 1, "HTTP/", 5) == 0 ? 505 : 400;
+  c->method = 0;
+  c->method_len = sp1 - p;
+  c->path = sp1 + 1 - c->buf;
+  c->path_len = sp2 - sp1 - 1;
+  c->query = c->query_len = 0;
+  char *q = memchr (sp1 + 1, '?', c->path_len);
+  if (q) {
+    c->query = q + 1 - c->buf;
+    c->query_len = sp2 - q - 1;
+    c->path_len = q - sp1 - 1;
+  }
+  c->minor = sp2[8] == '0' ? 0 : 1;
+  c->keepalive = c->minor >= 1;
+  c->head_only = c->method_len == 4 && memcmp (p, "HEAD", 4) == 0;
+
+  c->nhdr = 0;
+  c->body_len = 0;
+  for (p = eol + 2; p < end - 2; p = eol + 2) {
+    eol = memchr (p, '\r', end - p);
+    char *colon = memchr (p, ':', eol - p);
+    if (!colon || colon == p)
+      return 400;
+    if (c->nhdr == HTTP_MAX_HEADERS)
+      return 431;
+    http_header *h = &c->hdr[c->nhdr++];
+    for (char *s = p; s < colon; s++)
+      if (*s >= 'A' && *s <= 'Z')
+        *s += 'a' - 'A';
+    char *v = colon + 1, *ve = eol;
+    while (v < ve && (*v == ' ' || *v == '\t'))
+      v++;
+    while (ve > v && (ve[-1] == ' ' || ve[-1] == '\t'))
+      ve--;
+    h->name = p - c->buf;
+    h->name_len = colon - p;
+    h->value = v - c->buf;
+    h->value_len = ve - v;
+
+    if (http_token (c, h, "content-length")) {
+      char *e;
+      unsigned long n = strtoul (v, &e, 10);
+      if (e != ve)
+        return 400;
+      if (n > CONFIG_HTTP_MAX_BODY_BYTES)
+        return 413;
+      c->body_len = n;
+    } else if (http_token (c, h, "transfer-encoding")) {
+      return 501;  // chunked request bodies aren't supported
+    } else if (http_token (c, h, "connection")) {
+      if (h->value_len == 5 && strncasecmp (v, "close", 5) == 0)
+        c->keepalive = 0;
+      else if (h->value_len == 10 && strncasecmp (v, "keep-alive", 10) == 0)
+        c->keepalive = 1;
+    }
+  }
+  return 0;
+}
+
+static bool http_buf_reserve (http_conn *c, uint32_t len)
+{
+  if (len <= c->cap)
+    return true;
+  uint32_t cap = c->cap ? c->cap : 256;
+  while (cap < len)
+    cap *= 2;
+  char *b = (char *)realloc (c->buf, cap);
+  if (!b)
+    return false;
+  c->buf = b;
+  c->cap = cap;
+  return true;
+}
+
+static void http_push_request (lua_State *L, http_conn *c)
+{
+  lua_createtable (L, 0, 6);
+  lua_pushlstring (L, c->buf + c->method, c->method_len);
+  lua_setfield (L, -2, "method");
+  lua_pushlstring (L, c->buf + c->path, c->path_len);
+  lua_setfield (L, -2, "path");
+  if (c->query) {
+    lua_pushlstring (L, c->buf + c->query, c->query_len);
+    lua_setfield (L, -2, "query");
+  }
+  lua_pushstring (L, c->minor ? "1.1" : "1.0");
+  lua_setfield (L, -2, "version");
+  lua_createtable (L, 0, c->nhdr);
+  for (int i = 0; i < c->nhdr; i++) {
+    const http_header *h = &c->hdr[i];
+    lua_pushlstring (L, c->buf + h->name, h->name_len);
+    lua_pushlstring (L, c->buf + h->value, h->value_len);
+    lua_rawset (L, -3);
+  }
+  lua_setfield (L, -2, "headers");
+  if (c->body_len) {
+    lua_pushlstring (L, c->buf + c->head_len, c->body_len);
+    lua_setfield (L, -2, "body");
+  }
+}
+
+// Try the static routes for GET and HEAD requests
+static bool http_serve_static (http_conn *c)
+{
+  if (!(c->method_len == 3 && memcmp (c->buf + c->method, "GET", 3) == 0) &&
+      !c->head_only)
+    return false;
+  const char *path = c->buf + c->path;
+  for (int i = 0; i < HTTP_MAX_ROUTES; i++) {
+    const http_route *r = &c->srv->routes[i];
+    if (!r->prefix)
+      break;
+    size_t pl = strlen (r->prefix), dl = strlen (r->dir);
+    if (c->path_len < pl || memcmp (path, r->prefix, pl) != 0)
+      continue;
+    size_t rest = c->path_len - pl;
+    char name[64];
+    if (dl + rest + sizeof ("index.html") > sizeof (name))
+      continue;
+    memcpy (name, r->dir, dl);
+    memcpy (name + dl, path + pl, rest);
+    name[dl + rest] = 0;
+    if (strstr (name, ".."))
+      continue;
+    if (rest == 0 || path[c->path_len - 1] == '/')
+      strcat (name, "index.html");
+    uint32_t size;
+    const char *asset = (const char *)asset_store_path (name, &size);
+    if (asset)
+      return http_serve_asset (c, asset, size, http_mime_type (name));
+    int fd = vfs_open (name, "r");
+    if (!fd)
+      continue;
+    return http_serve_fd (c, fd, http_mime_type (name));
+  }
+  return false;
+}
+
+static void http_dispatch (lua_State *L, http_conn *c)
+{
+  c->state = ST_RESPOND;
+  c->status = 200;
+  if (http_serve_static (c)) {
+    http_flush (L, c);
+    return;
+  }
+  // The headers of a failed static attempt mustn't leak into the reply
+  free (c->res_hdr);
+  c->res_hdr = NULL;
+  c->res_hdr_len = 0;
+  http_out_free (c);
+  c->res_started = c->res_done = 0;
+
+  if (c->srv->cb_request_ref == LUA_NOREF) {
+    http_error (L, c, 404);
+    return;
+  }
+  lua_rawgeti (L, LUA_REGISTRYINDEX, c->srv->cb_request_ref);
+  http_push_request (L, c);
+  http_response *res = (http_response *)lua_newuserdata (L, sizeof (http_response));
+  luaL_getmetatable (L, HTTP_TABLE_RESPONSE);
+  lua_setmetatable (L, -2);
+  res->conn = c;
+  c->res = res;
+  lua_pushvalue (L, -1);
+  c->res_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+  lua_call (L, 2, 0);
+}
+
+// Consume received data for as long as no response is outstanding. Data
+// behind the current request stays in its pbufs, unacknowledged, so a
+// client pipelining requests gets its window closed instead of us
+// buffering without bound.
+static void http_parse (lua_State *L, http_conn *c)
+{
+  c->in_parse = 1;
+  for (;;) {
+    if (c->state == ST_CLOSED)
+      return;
+    if (c->state == ST_RESPOND) {
+      if (!http_drained (c))
+        break;
+      if (!c->keepalive) {
+        http_conn_close (L, c, false);
+        return;
+      }
+      http_conn_reset (L, c);
+    }
+    struct pbuf *q = c->rx;
+    if (!q)
+      break;
+    const char *data = (const char *)q->payload + c->rx_off;
+    uint32_t avail = q->len - c->rx_off, used = 0;
+
+    if (c->state == ST_HEAD) {
+      while (used < avail && c->crlf < 4) {
+        char ch = data[used++];
+        if (ch == '\r' && (c->crlf == 0 || c->crlf == 2))
+          c->crlf++;
+        else if (ch == '\n' && (c->crlf == 1 || c->crlf == 3))
+          c->crlf++;
+        else
+          c->crlf = ch == '\r' ? 1 : 0;
+      }
+      if (c->len + used > CONFIG_HTTP_MAX_HEADER_BYTES) {
+        http_error (L, c, 431);
+        continue;
+      }
+      if (!http_buf_reserve (c, c->len + used)) {
+        http_conn_close (L, c, true);
+        return;
+      }
+      memcpy (c->buf + c->len, data, used);
+      c->len += used;
+    } else {
+      uint32_t want = c->head_len + c->body_len - c->len;
+      used = avail < want ? avail : want;
+      memcpy (c->buf + c->len, data, used);
+      c->len += used;
+    }
+
+    c->rx_off += used;
+    if (c->rx_off == q->len) {
+      // pbuf_dechain drops the chain's hold on the rest, so take our own
+      c->rx = q->next;
+      if (c->rx)
+        pbuf_ref (c->rx);
+      pbuf_dechain (q);
+      c->rx_off = 0;
+      if (c->pcb)
+        tcp_recved (c->pcb, q->len);
+      pbuf_free (q);
+    }
+
+    if (c->state == ST_HEAD && c->crlf == 4) {
+      c->head_len = c->len;
+      int status = http_parse_head (c);
+      if (status) {
+        http_error (L, c, status);
+        continue;
+      }
+      if (c->body_len) {
+        if (!http_buf_reserve (c, c->head_len + c->body_len)) {
+          http_conn_close (L, c, true);
+          return;
+        }
+        c->state = ST_BODY;
+      } else {
+        http_dispatch (L, c);
+      }
+    } else if (c->state == ST_BODY && c->len == c->head_len + c->body_len) {
+      http_dispatch (L, c);
+    }
+  }
+  c->in_parse = 0;
+}
+
+// --- Lua event dispatch
+
+static void http_handle_event (task_param_t param, task_prio_t prio)
+{
+  http_event *ev = (http_event *)param;
+  http_conn *c = ev->conn;
+  (void)prio;
+
+  lua_State *L = lua_getstate();
+  switch (ev->event) {
+    case EV_ACCEPT:
+      if (c->state == ST_CLOSED)
+        break;
+      c->next = c->srv->conns;
+      c->srv->conns = c;
+      c->linked = 1;
+      if (c->srv->closing)
+        http_conn_close (L, c, true);
+      break;
+    case EV_RECV:
+      if (c->state == ST_CLOSED) {
+        if (ev->p)
+          pbuf_free (ev->p);
+        break;
+      }
+      if (!ev->p) {
+        // Peer is done sending; answer what it asked for, then close
+        c->keepalive = 0;
+        http_parse (L, c);
+        if ((c->state == ST_HEAD || c->state == ST_BODY) && !c->rx)
+          http_conn_close (L, c, false);
+        break;
+      }
+      if (c->rx)
+        pbuf_cat (c->rx, ev->p);
+      else
+        c->rx = ev->p;
+      http_parse (L, c);
+      break;
+    case EV_SENT:
+      if (c->state == ST_RESPOND)
+        http_flush (L, c);
+      break;
+    case EV_ERR:
+      http_conn_close (L, c, false);
+      break;
+    case EV_TIMEOUT:
+      // Only idle connections time out, not ones waiting on a handler
+      if (c->state == ST_HEAD || c->state == ST_BODY) {
+        http_conn_close (L, c, false);
+      } else if (c->state == ST_RESPOND) {
+        c->idle = 0;
+        http_flush (L, c);  // in case lwIP was out of segments last time
+      }
+      break;
+  }
+  free (ev);
+
+  http_atomic_add (&c->pending, -1);
+  if (c->state == ST_CLOSED && c->pending == 0)
+    http_conn_free (L, c);
+}
+
+// --- Lua API - server
+
+static http_server *http_get_server (lua_State *L)
+{
+  return (http_server *)luaL_checkudata (L, 1, HTTP_TABLE_SERVER);
+}
+
+// Lua: server = http.createServer([function(req, res)])
+static int http_createServer (lua_State *L)
+{
+  http_server *srv = (http_server *)lua_newuserdata (L, sizeof (http_server));
+  memset (srv, 0, sizeof (http_server));
+  srv->self_ref = LUA_NOREF;
+  srv->cb_request_ref = LUA_NOREF;
+  luaL_getmetatable (L, HTTP_TABLE_SERVER);
+  lua_setmetatable (L, -2);
+  if (lua_isfunction (L, 1) || lua_islightfunction (L, 1)) {
+    lua_pushvalue (L, 1);
+    srv->cb_request_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+  }
+  return 1;
+}
+
+// Lua: server:listen(port[, addr])
+static int http_listen (lua_State *L)
+{
+  http_server *srv = http_get_server (L);
+  if (srv->pcb || srv->self_ref != LUA_NOREF)
+    return luaL_error (L, "already listening");
+  uint16_t port = luaL_checkinteger (L, 2);
+  const char *domain = luaL_optstring (L, 3, "0.0.0.0");
+  ip_addr_t addr;
+  if (!ipaddr_aton (domain, &addr))
+    return luaL_error (L, "invalid IP address");
+
+  struct tcp_pcb *pcb = tcp_new ();
+  if (!pcb)
+    return luaL_error (L, "cannot allocate PCB");
+  err_t err = tcp_bind (pcb, &addr, port);
+  if (err != ERR_OK) {
+    tcp_close (pcb);
+    return luaL_error (L, "cannot bind to port %d", port);
+  }
+  struct tcp_pcb *lpcb = tcp_listen (pcb);
+  if (!lpcb) {
+    tcp_close (pcb);
+    return luaL_error (L, "out of memory");
+  }
+  srv->closing = 0;
+  lua_pushvalue (L, 1);
+  srv->self_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+  srv->pcb = lpcb;
+  tcp_arg (lpcb, srv);
+  tcp_accept (lpcb, http_accept_cb);
+  return 0;
+}
+
+// Lua: server:on("request", function(req, res))
+static int http_on (lua_State *L)
+{
+  http_server *srv = http_get_server (L);
+  const char *name = luaL_checkstring (L, 2);
+  if (strcmp (name, "request") != 0)
+    return luaL_error (L, "invalid callback name");
+  luaL_unref (L, LUA_REGISTRYINDEX, srv->cb_request_ref);
+  srv->cb_request_ref = LUA_NOREF;
+  if (lua_isfunction (L, 3) || lua_islightfunction (L, 3)) {
+    lua_pushvalue (L, 3);
+    srv->cb_request_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+  } else if (!lua_isnil (L, 3)) {
+    return luaL_error (L, "invalid callback function");
+  }
+  return 0;
+}
+
+// Lua: server:static(prefix, dir)
+// GET and HEAD requests for prefix.."name" are answered with the file
+// dir.."name" without calling into Lua; a trailing "/" maps to index.html.
+static int http_static (lua_State *L)
+{
+  http_server *srv = http_get_server (L);
+  const char *prefix = luaL_checkstring (L, 2);
+  const char *dir = luaL_checkstring (L, 3);
+  if (prefix[0] != '/')
+    return luaL_error (L, "prefix must start with /");
+  int i;
+  for (i = 0; i < HTTP_MAX_ROUTES && srv->routes[i].prefix; i++)
+    ;
+  if (i == HTTP_MAX_ROUTES)
+    return luaL_error (L, "too many routes");
+  char *p = strdup (prefix), *d = strdup (dir);
+  if (!p || !d) {
+    free (p);
+    free (d);
+    return luaL_error (L, "out of memory");
+  }
+  srv->routes[i].prefix = p;
+  srv->routes[i].dir = d;
+  return 0;
+}
+
+// Lua: server:close()
+// Stops listening and drops all open connections.
+static int http_close (lua_State *L)
+{
+  http_server *srv = http_get_server (L);
+  if (srv->pcb) {
+    tcp_arg (srv->pcb, NULL);
+    tcp_close (srv->pcb);
+    srv->pcb = NULL;
+  }
+  if (srv->self_ref == LUA_NOREF)
+    return 0;
+  srv->closing = 1;
+  while (srv->conns)
+    http_conn_close (L, srv->conns, true);
+  if (srv->nconn == 0) {
+    lua_gc (L, LUA_GCSTOP, 0);
+    luaL_unref (L, LUA_REGISTRYINDEX, srv->self_ref);
+    srv->self_ref = LUA_NOREF;
+    lua_gc (L, LUA_GCRESTART, 0);
+  }
+  return 0;
+}
+
+static int http_server_delete (lua_State *L)
+{
+  http_server *srv = http_get_server (L);
+  if (srv->pcb) {
+    tcp_arg (srv->pcb, NULL);
+    tcp_close (srv->pcb);
+    srv->pcb = NULL;
+  }
+  for (int i = 0; i < HTTP_MAX_ROUTES; i++) {
+    free (srv->routes[i].prefix);
+    free (srv->routes[i].dir);
+    srv->routes[i].prefix = srv->routes[i].dir = NULL;
+  }
+  luaL_unref (L, LUA_REGISTRYINDEX, srv->cb_request_ref);
+  srv->cb_request_ref = LUA_NOREF;
+  return 0;
+}
+
+// --- Lua API - response
+//
+// Calls on a response whose connection has gone away are ignored, since
+// the peer may close at any time.
+
+static http_conn *http_get_conn (lua_State *L)
+{
+  http_response *res = (http_response *)luaL_checkudata (L, 1, HTTP_TABLE_RESPONSE);
+  return res->conn;
+}
+
+static int http_check_head (lua_State *L, http_conn *c)
+{
+  if (c->res_started)
+    return luaL_error (L, "headers already sent");
+  return 0;
+}
+
+// Lua: res:status(code)
+static int http_res_status (lua_State *L)
+{
+  http_conn *c = http_get_conn (L);
+  int status = luaL_checkinteger (L, 2);
+  if (status < 100 || status > 999)
+    return luaL_error (L, "invalid status");
+  if (!c)
+    return 0;
+  http_check_head (L, c);
+  c->status = status;
+  return 0;
+}
+
+// Lua: res:header(name, value)
+static int http_res_header (lua_State *L)
+{
+  http_conn *c = http_get_conn (L);
+  const char *name = luaL_checkstring (L, 2);
+  const char *value = luaL_checkstring (L, 3);
+  if (strpbrk (name, "\r\n:") || strpbrk (value, "\r\n"))
+    return luaL_error (L, "invalid header");
+  if (!c)
+    return 0;
+  http_check_head (L, c);
+  if (!http_add_header (c, name, value))
+    return luaL_error (L, "out of memory");
+  return 0;
+}
+
+// Lua: res:send(data)
+// The first call sends the headers; HTTP/1.1 responses then go out chunked.
+static int http_res_send (lua_State *L)
+{
+  http_conn *c = http_get_conn (L);
+  size_t len;
+  const char *data = luaL_checklstring (L, 2, &len);
+  if (!c)
+    return 0;
+  if ((!c->res_started && !http_begin (c, -1)) || !http_body (c, data, len))
+    return luaL_error (L, "out of memory");
+  http_flush (L, c);
+  return 0;
+}
+
+// Lua: res:finish([data])
+// Without a prior send(), the response is sent with a Content-Length.
+static int http_res_finish (lua_State *L)
+{
+  http_conn *c = http_get_conn (L);
+  size_t len = 0;
+  const char *data = luaL_optlstring (L, 2, NULL, &len);
+  if (!c)
+    return 0;
+  if ((!c->res_started && !http_begin (c, len)) ||
+      (data && !http_body (c, data, len)) || !http_end (c))
+    return luaL_error (L, "out of memory");
+  http_detach_response (L, c);
+  http_flush (L, c);
+  return 0;
+}
+
+// Lua: res:sendfile(path[, content_type])
+// Sends the whole file as the response body and finishes the response.
+// Paths under ASSET_STORE_PREFIX come from the asset partition.
+static int http_res_sendfile (lua_State *L)
+{
+  http_conn *c = http_get_conn (L);
+  const char *path = luaL_checkstring (L, 2);
+  const char *type = luaL_optstring (L, 3, http_mime_type (path));
+  if (!c)
+    return 0;
+  http_check_head (L, c);
+  uint32_t size;
+  const char *asset = (const char *)asset_store_path (path, &size);
+  if (asset) {
+    if (!http_serve_asset (c, asset, size, type))
+      return luaL_error (L, "out of memory");
+    http_detach_response (L, c);
+    http_flush (L, c);
+    return 0;
+  }
+  int fd = vfs_open (path, "r");
+  if (!fd)
+    return luaL_error (L, "cannot open %s", path);
+  if (!http_serve_fd (c, fd, type))
+    return luaL_error (L, "cannot read %s", path);
+  http_detach_response (L, c);
+  http_flush (L, c);
+  return 0;
+}
+
+// --- Tables
+
+static const LUA_REG_TYPE http_server_map[] = {
+  { LSTRKEY( "listen" ),  LFUNCVAL( http_listen ) },
+  { LSTRKEY( "on" ),      LFUNCVAL( http_on ) },
+  { LSTRKEY( "static" ),  LFUNCVAL( http_static ) },
+  { LSTRKEY( "close" ),   LFUNCVAL( http_close ) },
+  { LSTRKEY( "__gc" ),    LFUNCVAL( http_server_delete ) },
+  { LSTRKEY( "__index" ), LROVAL( http_server_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+static const LUA_REG_TYPE http_response_map[] = {
+  { LSTRKEY( "status" ),   LFUNCVAL( http_res_status ) },
+  { LSTRKEY( "header" ),   LFUNCVAL( http_res_header ) },
+  { LSTRKEY( "send" ),     LFUNCVAL( http_res_send ) },
+  { LSTRKEY( "finish" ),   LFUNCVAL( http_res_finish ) },
+  { LSTRKEY( "sendfile" ), LFUNCVAL( http_res_sendfile ) },
+  { LSTRKEY( "__index" ),  LROVAL( http_response_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+const LUA_REG_TYPE http_map[] = {
+  { LSTRKEY( "createServer" ), LFUNCVAL( http_createServer ) },
+  { LSTRKEY( "request" ),      LFUNCVAL( http_request ) },
+  { LSTRKEY( "__metatable" ),  LROVAL( http_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+int luaopen_http( lua_State *L ) {
+  luaL_rometatable(L, HTTP_TABLE_SERVER, (void *)http_server_map);
+  luaL_rometatable(L, HTTP_TABLE_RESPONSE, (void *)http_response_map);
+  http_client_open (L);
+
+  http_event_task = task_get_id (http_handle_event);
+  task_set_name (http_event_task, "http");
+
+  return 0;
+}
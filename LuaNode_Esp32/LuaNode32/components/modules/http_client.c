@@ -0,0 +1,783 @@
+// HTTP/1.1 client for the http module
+//
+// http.request() writes the request to a net TCP socket and parses the
+// response on the socket's receive path as it comes in, without it going
+// through Lua first. Plain connections are taken from net's connection
+// pool and handed back when the server keeps them open; host names go
+// through net's DNS cache. The body, chunked or not, is passed on piece by
+// piece to a Lua function, a file or anything with a write method such as
+// a node.ota update, or gathered up for the callback.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "c_types.h"
+#include "buffer.h"
+#include "net.h"
+#include "vfs.h"
+#include "http_client.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <strings.h>
+
+#define HTTPC_OBJ         "http.request"
+#define HTTPC_HOST_MAX    64
+#define HTTPC_LINE        256     // longest status or header line looked at
+#define HTTPC_MAX_BODY    16384   // default limit on a body gathered in RAM
+#define HTTPC_FILE_CHUNK  1024    // file uploads over TLS go this much at a time
+
+enum {
+  HC_CONNECTING,
+  HC_STATUS,      // reading the status line
+  HC_HEADERS,
+  HC_BODY,        // Content-Length body, or one that ends with the connection
+  HC_CHUNK_SIZE,
+  HC_CHUNK_DATA,
+  HC_CHUNK_END,   // the CRLF after a chunk
+  HC_TRAILER,
+  HC_DONE,
+  HC_FINISHED     // the callback has had the result
+};
+
+typedef struct {
+  void *sock;
+  int sock_ref;
+  int self_ref;            // held until finished
+  int cb_ref;              // function(status, body, headers)
+  int data_ref;            // on_data
+  int sink_ref;            // object with a write method
+  int head_ref;            // request line and headers, kept for a retry
+  int body_ref;
+  int hdrs_ref;            // response headers, names in lower case
+  int ca_ref;              // PEM to check an https server against
+  char host[HTTPC_HOST_MAX];
+  uint16_t port;
+  bool secure;
+  bool head_only;          // a HEAD request, whatever Content-Length says
+  bool keepalive;          // until either side says otherwise
+  bool reused;             // the socket came from the pool
+  bool retried;
+  bool got_data;
+  bool chunked;
+  uint8_t state;
+  int status;
+  int32_t length;          // Content-Length, -1 if none
+  int32_t remain;          // of the body or chunk, -1 until the connection closes
+  char *upload;            // file sent as the body
+  int up_fd;               // its descriptor while it goes out over TLS
+  int save_fd;             // file the body goes to
+  char *body;              // body gathered for the callback
+  uint32_t body_len, body_cap, body_max;
+  const char *err;
+  uint16_t line_len;
+  char line[HTTPC_LINE + 1];
+} httpc_t;
+
+static void httpc_connect (lua_State *L, httpc_t *r, bool pooled);
+
+// Calls method name of the registry value ref with no arguments but itself
+static void httpc_call_method (lua_State *L, int ref, const char *name)
+{
+  lua_rawgeti (L, LUA_REGISTRYINDEX, ref);
+  lua_getfield (L, -1, name);
+  lua_insert (L, -2);
+  lua_call (L, 1, 0);
+}
+
+static void httpc_free (lua_State *L, httpc_t *r)
+{
+  int *refs[] = {
+    &r->sock_ref, &r->cb_ref, &r->data_ref, &r->sink_ref,
+    &r->head_ref, &r->body_ref, &r->hdrs_ref, &r->ca_ref, &r->self_ref
+  };
+  for (int i = 0; i < sizeof(refs) / sizeof(refs[0]); i++) {
+    luaL_unref (L, LUA_REGISTRYINDEX, *refs[i]);
+    *refs[i] = LUA_NOREF;
+  }
+  if (r->up_fd)
+    vfs_close (r->up_fd);
+  if (r->save_fd)
+    vfs_close (r->save_fd);
+  r->up_fd = r->save_fd = 0;
+  free (r->upload);
+  free (r->body);
+  r->upload = r->body = NULL;
+}
+
+// Let go of the socket: back to the pool if the response ended cleanly
+// and the connection may stay, closed otherwise. gone is set when it has
+// already dropped.
+static void httpc_drop_sock (lua_State *L, httpc_t *r, bool gone)
+{
+  if (!r->sock)
+    return;
+  net_tcp_set_rx_hook (r->sock, NULL, NULL);
+  r->sock = NULL;
+  // The socket may outlive r; its callbacks point at it
+  static const char * const cbs[] = { "connection", "dns", "sent" };
+  for (int i = 0; i < sizeof(cbs) / sizeof(cbs[0]); i++) {
+    lua_rawgeti (L, LUA_REGISTRYINDEX, r->sock_ref);
+    lua_getfield (L, -1, "on");
+    lua_insert (L, -2);
+    lua_pushstring (L, cbs[i]);
+    lua_pushnil (L);
+    lua_call (L, 3, 0);
+  }
+  if (!gone) {
+    bool reuse = r->state == HC_DONE && !r->err && r->keepalive && !r->secure;
+    httpc_call_method (L, r->sock_ref, reuse ? "release" : "close");
+  }
+  luaL_unref (L, LUA_REGISTRYINDEX, r->sock_ref);
+  r->sock_ref = LUA_NOREF;
+}
+
+// Done, one way or another: tell Lua and let everything go
+static void httpc_finish (lua_State *L, httpc_t *r, const char *err, bool gone)
+{
+  if (r->state == HC_FINISHED)
+    return;
+  if (err && !r->err)
+    r->err = err;
+  httpc_drop_sock (L, r, gone);
+  r->state = HC_FINISHED;
+  bool streamed = r->data_ref != LUA_NOREF || r->sink_ref != LUA_NOREF || r->save_fd;
+  int cb_ref = r->cb_ref;
+  r->cb_ref = LUA_NOREF;
+  if (cb_ref != LUA_NOREF) {
+    lua_rawgeti (L, LUA_REGISTRYINDEX, cb_ref);
+    luaL_unref (L, LUA_REGISTRYINDEX, cb_ref);
+    if (r->err) {
+      lua_pushnil (L);
+      lua_pushstring (L, r->err);
+      lua_pushnil (L);
+    } else {
+      lua_pushinteger (L, r->status);
+      if (streamed)
+        lua_pushnil (L);
+      else
+        lua_pushlstring (L, r->body ? r->body : "", r->body_len);
+      lua_rawgeti (L, LUA_REGISTRYINDEX, r->hdrs_ref);
+    }
+    httpc_free (L, r);
+    lua_call (L, 3, 0);
+  } else {
+    httpc_free (L, r);
+  }
+}
+
+// A piece of the body
+static void httpc_body (lua_State *L, httpc_t *r, const char *data, size_t len)
+{
+  if (!len)
+    return;
+  if (r->data_ref != LUA_NOREF) {
+    lua_rawgeti (L, LUA_REGISTRYINDEX, r->data_ref);
+    lua_pushlstring (L, data, len);
+    lua_call (L, 1, 0);
+  } else if (r->sink_ref != LUA_NOREF) {
+    // An update that fails says so with an error; it ends the request
+    lua_rawgeti (L, LUA_REGISTRYINDEX, r->sink_ref);
+    lua_getfield (L, -1, "write");
+    lua_insert (L, -2);
+    lua_pushlstring (L, data, len);
+    if (lua_pcall (L, 2, 0, 0) != 0) {
+      r->err = "sink failed";
+      lua_pop (L, 1);
+    }
+  } else if (r->save_fd) {
+    if (vfs_write (r->save_fd, data, len) != (int32_t)len)
+      r->err = "cannot write file";
+  } else {
+    if (r->body_len + len > r->body_max) {
+      r->err = "body too big";
+      return;
+    }
+    if (r->body_len + len > r->body_cap) {
+      uint32_t cap = r->body_cap ? r->body_cap : 256;
+      while (cap < r->body_len + len)
+        cap *= 2;
+      if (cap > r->body_max)
+        cap = r->body_max;
+      char *b = (char *)realloc (r->body, cap);
+      if (!b) {
+        r->err = "out of memory";
+        return;
+      }
+      r->body = b;
+      r->body_cap = cap;
+    }
+    memcpy (r->body + r->body_len, data, len);
+    r->body_len += len;
+  }
+}
+
+static void httpc_status_line (lua_State *L, httpc_t *r)
+{
+  if (r->line_len == 0)
+    return;  // a stray CRLF, as some servers put after a 100 Continue
+  const char *sp = strchr (r->line, ' ');
+  if (strncmp (r->line, "HTTP/1.", 7) != 0 || !sp) {
+    r->err = "bad status line";
+    return;
+  }
+  r->status = atoi (sp + 1);
+  if (r->line[7] == '0')
+    r->keepalive = false;
+  r->length = -1;
+  r->chunked = false;
+  lua_newtable (L);
+  luaL_unref (L, LUA_REGISTRYINDEX, r->hdrs_ref);
+  r->hdrs_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+  r->state = HC_HEADERS;
+}
+
+// After the blank line: work out how the body is framed
+static void httpc_headers_done (httpc_t *r)
+{
+  if (r->status >= 100 && r->status < 200) {
+    r->state = HC_STATUS;  // an interim response, the real one follows
+    return;
+  }
+  if (r->head_only || r->status == 204 || r->status == 304) {
+    r->state = HC_DONE;
+  } else if (r->chunked) {
+    r->state = HC_CHUNK_SIZE;
+  } else if (r->length >= 0) {
+    r->remain = r->length;
+    r->state = r->length ? HC_BODY : HC_DONE;
+  } else {
+    r->remain = -1;
+    r->keepalive = false;  // the body ends with the connection
+    r->state = HC_BODY;
+  }
+}
+
+static void httpc_header (lua_State *L, httpc_t *r)
+{
+  char *colon = strchr (r->line, ':');
+  if (!colon)
+    return;
+  for (char *p = r->line; p < colon; p++)
+    if (*p >= 'A' && *p <= 'Z')
+      *p += 'a' - 'A';
+  const char *v = colon + 1;
+  while (*v == ' ' || *v == '\t')
+    v++;
+  const char *e = r->line + r->line_len;
+  while (e > v && (e[-1] == ' ' || e[-1] == '\t'))
+    e--;
+  size_t nlen = colon - r->line;
+
+  if (nlen == 14 && memcmp (r->line, "content-length", 14) == 0)
+    r->length = strtol (v, NULL, 10);
+  else if (nlen == 17 && memcmp (r->line, "transfer-encoding", 17) == 0)
+    r->chunked = e - v >= 7 && strncasecmp (e - 7, "chunked", 7) == 0;
+  else if (nlen == 10 && memcmp (r->line, "connection", 10) == 0 &&
+           e - v == 5 && strncasecmp (v, "close", 5) == 0)
+    r->keepalive = false;
+
+  lua_rawgeti (L, LUA_REGISTRYINDEX, r->hdrs_ref);
+  lua_pushlstring (L, r->line, nlen);
+  lua_pushlstring (L, v, e - v);
+  lua_rawset (L, -3);
+  lua_pop (L, 1);
+}
+
+static void httpc_line (lua_State *L, httpc_t *r)
+{
+  if (r->line_len && r->line[r->line_len - 1] == '\r')
+    r->line_len--;
+  r->line[r->line_len] = 0;
+  switch (r->state) {
+    case HC_STATUS:
+      httpc_status_line (L, r);
+      break;
+    case HC_HEADERS:
+      if (r->line_len == 0)
+        httpc_headers_done (r);
+      else
+        httpc_header (L, r);
+      break;
+    case HC_CHUNK_SIZE: {
+      char *end;
+      unsigned long n = strtoul (r->line, &end, 16);
+      if (end == r->line || n > INT32_MAX) {
+        r->err = "bad chunk";
+      } else if (n == 0) {
+        r->state = HC_TRAILER;
+      } else {
+        r->remain = n;
+        r->state = HC_CHUNK_DATA;
+      }
+      break;
+    }
+    case HC_CHUNK_END:
+      if (r->line_len)
+        r->err = "bad chunk";
+      r->state = HC_CHUNK_SIZE;
+      break;
+    case HC_TRAILER:
+      if (r->line_len == 0)
+        r->state = HC_DONE;
+      break;
+  }
+  r->line_len = 0;
+}
+
+static void httpc_input (lua_State *L, httpc_t *r, const char *data, size_t len)
+{
+  r->got_data = true;
+  while (len && !r->err && r->state < HC_DONE) {
+    if (r->state == HC_BODY || r->state == HC_CHUNK_DATA) {
+      size_t n = len;
+      if (r->remain >= 0 && n > (size_t)r->remain)
+        n = r->remain;
+      httpc_body (L, r, data, n);
+      data += n;
+      len -= n;
+      if (r->remain >= 0) {
+        r->remain -= n;
+        if (r->remain == 0)
+          r->state = r->state == HC_BODY ? HC_DONE : HC_CHUNK_END;
+      }
+      continue;
+    }
+    // Lines longer than we keep are cut short; only their start matters
+    const char *nl = (const char *)memchr (data, '\n', len);
+    size_t n = nl ? (size_t)(nl - data) : len;
+    size_t room = HTTPC_LINE - r->line_len;
+    memcpy (r->line + r->line_len, data, n < room ? n : room);
+    r->line_len += n < room ? n : room;
+    data += n;
+    len -= n;
+    if (nl) {
+      data++;
+      len--;
+      httpc_line (L, r);
+    }
+  }
+  if (len)
+    r->keepalive = false;  // more than the response; don't pool it
+  if (r->state == HC_CONNECTING)
+    r->err = "data before the request";
+}
+
+// The socket's receive path; data is NULL once the connection is gone
+static void httpc_rx (lua_State *L, void *arg, char *data, size_t len)
+{
+  httpc_t *r = (httpc_t *)arg;
+  lua_rawgeti (L, LUA_REGISTRYINDEX, r->self_ref);  // keeps r while callbacks run
+  if (data) {
+    httpc_input (L, r, data, len);
+    if (r->err || r->state == HC_DONE)
+      httpc_finish (L, r, NULL, false);
+  } else if (r->reused && !r->retried && !r->got_data) {
+    // The server had closed the pooled connection meanwhile; try afresh
+    r->retried = true;
+    httpc_drop_sock (L, r, true);
+    r->state = HC_CONNECTING;
+    httpc_connect (L, r, false);
+  } else if (r->state == HC_BODY && r->remain < 0) {
+    r->state = HC_DONE;
+    httpc_finish (L, r, NULL, true);
+  } else {
+    httpc_finish (L, r, r->state == HC_DONE ? NULL : "connection closed", true);
+  }
+  lua_pop (L, 1);
+}
+
+// "sent" callback while a file goes out over TLS: once what was written
+// is on its way, the next piece follows
+static int httpc_upload_next (lua_State *L)
+{
+  httpc_t *r = (httpc_t *)lua_touserdata (L, lua_upvalueindex (1));
+  if (!r->up_fd || !r->sock || !net_tcp_connected (r->sock))
+    return 0;
+  lua_getfield (L, 1, "queued");
+  lua_pushvalue (L, 1);
+  lua_call (L, 1, 1);
+  bool idle = lua_tointeger (L, -1) == 0;
+  lua_pop (L, 1);
+  if (!idle)
+    return 0;
+  char buf[HTTPC_FILE_CHUNK];
+  int32_t n = vfs_read (r->up_fd, buf, sizeof(buf));
+  if (n > 0)
+    net_tcp_write (L, r->sock, buf, n);
+  if (n < (int32_t)sizeof(buf)) {
+    vfs_close (r->up_fd);
+    r->up_fd = 0;
+  }
+  return 0;
+}
+
+// Writes the request out; in protected mode, so a full send queue fails
+// the request rather than the Lua task
+static int httpc_send_p (lua_State *L)
+{
+  httpc_t *r = (httpc_t *)lua_touserdata (L, 1);
+  size_t len;
+  lua_rawgeti (L, LUA_REGISTRYINDEX, r->head_ref);
+  const char *head = lua_tolstring (L, -1, &len);
+  net_tcp_write (L, r->sock, head, len);
+  if (r->body_ref != LUA_NOREF) {
+    lua_rawgeti (L, LUA_REGISTRYINDEX, r->body_ref);
+    const char *body = buffer_checklstring (L, -1, &len);
+    net_tcp_write (L, r->sock, body, len);
+  }
+  if (r->upload && !r->secure) {
+    lua_rawgeti (L, LUA_REGISTRYINDEX, r->sock_ref);
+    lua_getfield (L, -1, "sendfile");
+    lua_insert (L, -2);
+    lua_pushstring (L, r->upload);
+    lua_call (L, 2, 0);
+  } else if (r->upload) {
+    r->up_fd = vfs_open (r->upload, "r");
+    if (!r->up_fd)
+      return luaL_error (L, "cannot open %s", r->upload);
+    lua_rawgeti (L, LUA_REGISTRYINDEX, r->sock_ref);
+    lua_getfield (L, -1, "on");
+    lua_insert (L, -2);
+    lua_pushliteral (L, "sent");
+    lua_pushlightuserdata (L, r);
+    lua_pushcclosure (L, httpc_upload_next, 1);
+    lua_call (L, 3, 0);
+    lua_rawgeti (L, LUA_REGISTRYINDEX, r->sock_ref);
+    lua_pushlightuserdata (L, r);
+    lua_pushcclosure (L, httpc_upload_next, 1);
+    lua_insert (L, -2);
+    lua_call (L, 1, 0);
+  }
+  return 0;
+}
+
+static void httpc_send (lua_State *L, httpc_t *r)
+{
+  r->state = HC_STATUS;
+  lua_pushcfunction (L, httpc_send_p);
+  lua_pushlightuserdata (L, r);
+  if (lua_pcall (L, 1, 0, 0) != 0) {
+    lua_pop (L, 1);
+    httpc_finish (L, r, "cannot send request", false);
+  }
+}
+
+// "connection" callback of a new socket
+static int httpc_connected (lua_State *L)
+{
+  httpc_t *r = (httpc_t *)lua_touserdata (L, lua_upvalueindex (1));
+  if (r->state == HC_CONNECTING && r->sock) {
+    lua_rawgeti (L, LUA_REGISTRYINDEX, r->self_ref);
+    httpc_send (L, r);
+    lua_pop (L, 1);
+  }
+  return 0;
+}
+
+// "dns" callback of a new socket; the address is nil if the lookup failed
+static int httpc_dns (lua_State *L)
+{
+  httpc_t *r = (httpc_t *)lua_touserdata (L, lua_upvalueindex (1));
+  if (lua_isnil (L, 2) && r->state == HC_CONNECTING && r->sock) {
+    lua_rawgeti (L, LUA_REGISTRYINDEX, r->self_ref);
+    httpc_finish (L, r, "DNS lookup failed", false);
+    lua_pop (L, 1);
+  }
+  return 0;
+}
+
+// Sets callback name of the socket on top of the stack to f, with r as
+// its upvalue
+static void httpc_on (lua_State *L, httpc_t *r, const char *name, lua_CFunction f)
+{
+  lua_getfield (L, -1, "on");
+  lua_pushvalue (L, -2);
+  lua_pushstring (L, name);
+  lua_pushlightuserdata (L, r);
+  lua_pushcclosure (L, f, 1);
+  lua_call (L, 3, 0);
+}
+
+// Gets a socket to the server and sends the request once it is connected,
+// or right away for one from the pool
+static void httpc_connect (lua_State *L, httpc_t *r, bool pooled)
+{
+  lua_getglobal (L, LUA_NETLIBNAME);
+  if (r->secure || !pooled) {
+    lua_getfield (L, -1, "createConnection");
+    lua_getfield (L, -2, "TCP");
+    if (r->secure && r->ca_ref != LUA_NOREF) {
+      lua_createtable (L, 0, 2);
+      lua_pushboolean (L, 1);
+      lua_setfield (L, -2, "secure");
+      lua_rawgeti (L, LUA_REGISTRYINDEX, r->ca_ref);
+      lua_setfield (L, -2, "ca");
+    } else {
+      lua_pushboolean (L, r->secure);
+    }
+    lua_call (L, 2, 1);
+    r->reused = false;
+  } else {
+    lua_getfield (L, -1, "acquire");
+    lua_pushstring (L, r->host);
+    lua_pushinteger (L, r->port);
+    lua_call (L, 2, 2);
+    r->reused = lua_toboolean (L, -1);
+    lua_pop (L, 1);
+  }
+  lua_remove (L, -2);
+  r->sock = net_tcp_check (L, -1);
+  lua_pushvalue (L, -1);
+  r->sock_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+  r->got_data = false;
+  net_tcp_set_rx_hook (r->sock, httpc_rx, r);
+
+  if (r->reused) {
+    lua_pop (L, 1);
+    httpc_send (L, r);
+    return;
+  }
+  httpc_on (L, r, "connection", httpc_connected);
+  httpc_on (L, r, "dns", httpc_dns);
+  if (r->secure || !pooled) {
+    lua_getfield (L, -1, "connect");
+    lua_insert (L, -2);
+    lua_pushinteger (L, r->port);
+    lua_pushstring (L, r->host);
+    lua_call (L, 3, 0);
+  } else {
+    lua_pop (L, 1);  // net.acquire() started connecting it
+  }
+}
+
+// Splits url into its parts; false if it isn't an http or https URL
+static bool httpc_parse_url (httpc_t *r, const char *url, const char **path)
+{
+  if (strncasecmp (url, "http://", 7) == 0) {
+    r->secure = false;
+    r->port = 80;
+    url += 7;
+  } else if (strncasecmp (url, "https://", 8) == 0) {
+    r->secure = true;
+    r->port = 443;
+    url += 8;
+  } else {
+    return false;
+  }
+  size_t n = strcspn (url, ":/?");
+  if (n == 0 || n >= HTTPC_HOST_MAX)
+    return false;
+  memcpy (r->host, url, n);
+  r->host[n] = 0;
+  url += n;
+  if (*url == ':') {
+    char *end;
+    unsigned long port = strtoul (url + 1, &end, 10);
+    if (end == url + 1 || port == 0 || port > 0xffff)
+      return false;
+    r->port = port;
+    url = end;
+  }
+  *path = *url == '/' ? url : *url ? NULL : "/";
+  if (*url == '?')
+    *path = url;  // "?q" goes out as "/?q", see http_request
+  return true;
+}
+
+// Lua: req = http.request({ url = url, method = m, headers = { name = value },
+//                            body = data, file = path,
+//                            on_data = function(chunk), save = path, sink = obj,
+//                            maxbody = n, keepalive = b },
+//                          function(status, body, headers))
+// Sends the request and calls back with the response, or with nil and the
+// reason if there is none. The method is GET, or POST when there is a body
+// to send: body, or the contents of file, which is streamed from the file
+// system. The response body goes to on_data as it arrives, to the file
+// save, or to sink:write(chunk) (a node.ota update, say); otherwise it is
+// gathered up, to at most maxbody bytes, 16 KB by default, and passed to
+// the callback. headers in the callback has names in lower case. Plain
+// connections go back to net's pool afterwards unless keepalive is false
+// or the server closes them. An https URL verifies the server against ca
+// when given, see net.createConnection.
+int http_request (lua_State *L)
+{
+  luaL_checktype (L, 1, LUA_TTABLE);
+  lua_getfield (L, 1, "url");
+  const char *url = luaL_checkstring (L, -1);
+  lua_getfield (L, 1, "method");
+  const char *method = luaL_optstring (L, -1, NULL);
+  lua_getfield (L, 1, "file");
+  const char *upload = luaL_optstring (L, -1, NULL);
+  lua_getfield (L, 1, "save");
+  const char *save = luaL_optstring (L, -1, NULL);
+  lua_getfield (L, 1, "maxbody");
+  int maxbody = luaL_optinteger (L, -1, HTTPC_MAX_BODY);
+  lua_getfield (L, 1, "keepalive");
+  bool keepalive = lua_isnil (L, -1) || lua_toboolean (L, -1);
+  lua_pop (L, 6);  // the strings stay referenced by the table
+  if (!lua_isnoneornil (L, 2))
+    luaL_checkanyfunction (L, 2);
+  luaL_argcheck (L, maxbody > 0, 1, "maxbody must be positive");
+
+  httpc_t *r = (httpc_t *)lua_newuserdata (L, sizeof(httpc_t));
+  memset (r, 0, sizeof(httpc_t));
+  r->sock_ref = r->self_ref = r->cb_ref = r->data_ref = r->sink_ref = LUA_NOREF;
+  r->head_ref = r->body_ref = r->hdrs_ref = r->ca_ref = LUA_NOREF;
+  r->state = HC_FINISHED;  // until it is under way, for __gc
+  luaL_getmetatable (L, HTTPC_OBJ);
+  lua_setmetatable (L, -2);
+  int self = lua_gettop (L);
+
+  const char *path;
+  if (!httpc_parse_url (r, url, &path) || !path)
+    return luaL_error (L, "invalid URL");
+
+  int32_t length = -1;
+  lua_getfield (L, 1, "body");
+  if (!lua_isnil (L, -1)) {
+    size_t blen;
+    buffer_checklstring (L, -1, &blen);
+    if (upload)
+      return luaL_error (L, "body and file both given");
+    length = blen;
+    r->body_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+  } else {
+    lua_pop (L, 1);
+  }
+  if (upload) {
+    int fd = vfs_open (upload, "r");
+    if (!fd)
+      return luaL_error (L, "cannot open %s", upload);
+    length = vfs_size (fd);
+    vfs_close (fd);
+    r->upload = strdup (upload);
+  }
+  if (!method)
+    method = length >= 0 ? "POST" : "GET";
+  r->head_only = strcasecmp (method, "HEAD") == 0;
+  r->keepalive = keepalive;
+  r->body_max = maxbody;
+
+  lua_getfield (L, 1, "on_data");
+  if (!lua_isnil (L, -1)) {
+    luaL_checkanyfunction (L, -1);
+    r->data_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+  } else {
+    lua_pop (L, 1);
+  }
+  lua_getfield (L, 1, "sink");
+  if (!lua_isnil (L, -1))
+    r->sink_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+  else
+    lua_pop (L, 1);
+  lua_getfield (L, 1, "ca");
+  if (!lua_isnil (L, -1)) {
+    luaL_checkstring (L, -1);
+    r->ca_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+  } else {
+    lua_pop (L, 1);
+  }
+  if (save) {
+    r->save_fd = vfs_open (save, "w");
+    if (!r->save_fd)
+      return luaL_error (L, "cannot open %s", save);
+  }
+
+  // The caller's headers, as lines concatenated into one string
+  lua_getfield (L, 1, "headers");
+  int hidx = lua_gettop (L), lines = 0;
+  if (lua_istable (L, hidx)) {
+    lua_pushnil (L);
+    while (lua_next (L, hidx)) {
+      if (lua_type (L, -2) != LUA_TSTRING || !lua_isstring (L, -1))
+        return luaL_error (L, "header names and values must be strings");
+      lua_pushvalue (L, -2);
+      lua_pushliteral (L, ": ");
+      lua_pushvalue (L, -3);
+      lua_pushliteral (L, "\r\n");
+      lua_concat (L, 4);
+      lua_insert (L, hidx + 1 + lines++);
+      lua_pop (L, 1);
+    }
+  }
+  lua_pushliteral (L, "");
+  lua_concat (L, lines + 1);
+  lua_remove (L, hidx);
+  int extra = hidx;
+
+  // The request line and headers, kept for a retry on a fresh connection
+  luaL_Buffer b;
+  luaL_buffinit (L, &b);
+  luaL_addstring (&b, method);
+  luaL_addchar (&b, ' ');
+  if (*path == '?')
+    luaL_addchar (&b, '/');
+  luaL_addstring (&b, path);
+  luaL_addstring (&b, " HTTP/1.1\r\nHost: ");
+  luaL_addstring (&b, r->host);
+  if (r->port != (r->secure ? 443 : 80)) {
+    char port[8];
+    sprintf (port, ":%u", r->port);
+    luaL_addstring (&b, port);
+  }
+  luaL_addstring (&b, "\r\n");
+  if (length >= 0) {
+    char cl[32];
+    sprintf (cl, "Content-Length: %d\r\n", length);
+    luaL_addstring (&b, cl);
+  }
+  if (!keepalive || r->secure)
+    luaL_addstring (&b, "Connection: close\r\n");
+  lua_pushvalue (L, extra);
+  luaL_addvalue (&b);
+  luaL_addstring (&b, "\r\n");
+  luaL_pushresult (&b);
+  r->head_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+
+  if (!lua_isnoneornil (L, 2)) {
+    lua_pushvalue (L, 2);
+    r->cb_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+  }
+  lua_pushvalue (L, self);
+  r->self_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+  r->state = HC_CONNECTING;
+  httpc_connect (L, r, keepalive);
+  lua_settop (L, self);
+  return 1;
+}
+
+static httpc_t *httpc_check (lua_State *L)
+{
+  return (httpc_t *)luaL_checkudata (L, 1, HTTPC_OBJ);
+}
+
+// Lua: req:abort()
+// Drops the connection; the callback gets nil, "aborted"
+static int httpc_abort (lua_State *L)
+{
+  httpc_t *r = httpc_check (L);
+  if (r->state != HC_FINISHED)
+    httpc_finish (L, r, "aborted", false);
+  return 0;
+}
+
+static int httpc_gc (lua_State *L)
+{
+  httpc_t *r = httpc_check (L);
+  httpc_free (L, r);
+  return 0;
+}
+
+static const LUA_REG_TYPE httpc_map[] = {
+  { LSTRKEY( "abort" ),   LFUNCVAL( httpc_abort ) },
+  { LSTRKEY( "__gc" ),    LFUNCVAL( httpc_gc ) },
+  { LSTRKEY( "__index" ), LROVAL( httpc_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+void http_client_open (lua_State *L)
+{
+  luaL_rometatable (L, HTTPC_OBJ, (void *)httpc_map);
+}
@@ -1,146 +1,233 @@
-// Module for interfacing with the I2C interface
+// Module for I2C master transactions on the hardware controllers
 
 #include "modules.h"
 #include "lauxlib.h"
+#include "buffer.h"
 #include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
 #include "platform.h"
-#include "esp32-hal-i2c.h"
+#include "c_types.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "task/task.h"
+#include <stdlib.h>
+#include <string.h>
 
-// Lua: speed = i2c.setup( mode, slave_addr, addr_10bit_en )
-static int i2c_setup( lua_State *L )
-{
-  unsigned mode = luaL_checkinteger( L, 1 );
-  unsigned slave_addr = luaL_checkinteger( L, 2 );
-  unsigned addr_10bit_en = luaL_checkinteger( L, 3 );
+typedef struct {
+  int cb_ref;
+  int err;
+  uint8_t *tx;            // both point into the job's own allocation
+  size_t tx_len;
+  uint8_t *rx;
+  size_t rx_len;
+  SemaphoreHandle_t wait; // set for a blocking transaction
+} i2c_job_t;
 
-  lua_pushinteger( L, platform_i2c_setup(mode, slave_addr, addr_10bit_en) );
-  return 1;
-}
+static task_handle_t i2c_task;
 
-// Lua: i2c.start( id )
-static int i2c_start( lua_State *L )
+// Runs in the I2C interrupt
+static void i2c_done( int err, void *arg )
 {
-  unsigned id = luaL_checkinteger( L, 1 );
+  i2c_job_t *job = (i2c_job_t *)arg;
+  job->err = err;
+  if (job->wait)
+    xSemaphoreGiveFromISR( job->wait, NULL );
+  else
+    task_post_low( i2c_task, (task_param_t)job );
+}
 
-  //MOD_CHECK_ID( i2c, id );
-  //platform_i2c_send_start( id );
-  return 0;
+// data, true if there was nothing to read, or nil and what went wrong
+static int i2c_push_result( lua_State *L, i2c_job_t *job )
+{
+  switch (job->err) {
+  case PLATFORM_I2C_OK:
+    if (job->rx_len)
+      lua_pushlstring( L, (const char *)job->rx, job->rx_len );
+    else
+      lua_pushboolean( L, 1 );
+    return 1;
+  case PLATFORM_I2C_NACK:
+    lua_pushnil( L );
+    lua_pushliteral( L, "nack" );
+    return 2;
+  case PLATFORM_I2C_TIMEOUT:
+    lua_pushnil( L );
+    lua_pushliteral( L, "timeout" );
+    return 2;
+  default:
+    lua_pushnil( L );
+    lua_pushliteral( L, "arbitration lost" );
+    return 2;
+  }
 }
 
-// Lua: i2c.stop( id )
-static int i2c_stop( lua_State *L )
+static void i2c_task_handler( task_param_t param, task_prio_t prio )
 {
-  unsigned id = luaL_checkinteger( L, 1 );
+  (void)prio;
+  i2c_job_t *job = (i2c_job_t *)param;
+  lua_State *L = lua_getstate();
+  lua_rawgeti( L, LUA_REGISTRYINDEX, job->cb_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, job->cb_ref );
+  int nargs = i2c_push_result( L, job );
+  free( job );
+  lua_call( L, nargs, 0 );
+}
 
-  //MOD_CHECK_ID( i2c, id );
-  //platform_i2c_send_stop( id );
-  return 0;
+// Bytes to send at idx: nil, a string, a table of bytes or a single byte
+static size_t i2c_data_len( lua_State *L, int idx, const char **str )
+{
+  size_t len = 0;
+  *str = NULL;
+  switch (lua_type( L, idx )) {
+  case LUA_TNONE:
+  case LUA_TNIL:
+    return 0;
+  case LUA_TNUMBER:
+    return 1;
+  case LUA_TTABLE:
+    return lua_objlen( L, idx );
+  default:
+    *str = buffer_checklstring( L, idx, &len );
+    return len;
+  }
 }
 
-// Lua: status = i2c.address( id, address, direction )
-static int i2c_address( lua_State *L )
+// Copies the bytes to to, or with to NULL only checks them
+static void i2c_data_copy( lua_State *L, int idx, const char *str, uint8_t *to, size_t len )
 {
- /* unsigned id = luaL_checkinteger( L, 1 );
-  int address = luaL_checkinteger( L, 2 );
-  int direction = luaL_checkinteger( L, 3 );
-
-  //MOD_CHECK_ID( i2c, id );
-  if ( address < 0 || address > 127 )
-    return luaL_error( L, "wrong arg range" );
-  lua_pushboolean( L, platform_i2c_send_address( id, (u16)address, direction ) );*/
-  return 1;
+  if (str) {
+    if (to)
+      memcpy( to, str, len );
+    return;
+  }
+  for (size_t i = 0; i < len; i++) {
+    int b;
+    if (lua_type( L, idx ) == LUA_TNUMBER) {
+      b = luaL_checkinteger( L, idx );
+    } else {
+      lua_rawgeti( L, idx, i + 1 );
+      b = luaL_checkinteger( L, -1 );
+      lua_pop( L, 1 );
+    }
+    if (b < 0 || b > 255)
+      luaL_error( L, "wrong arg range" );
+    if (to)
+      to[i] = b;
+  }
 }
 
-// Lua: wrote = i2c.write( id, data1, [data2], ..., [datan] )
-// data can be either a string, a table or an 8-bit number
-static int i2c_write( lua_State *L )
+// Sends what is at data_idx, reads rx_len bytes after a repeated start,
+// and either calls back the function at cb_idx or waits for it.
+static int i2c_start( lua_State *L, int data_idx, size_t rx_len, int cb_idx )
 {
-#if 0
   unsigned id = luaL_checkinteger( L, 1 );
-  const char *pdata;
-  size_t datalen, i;
-  int numdata;
-  u32 wrote = 0;
-  unsigned argn;
-
-  //MOD_CHECK_ID( i2c, id );
-  if( lua_gettop( L ) < 2 )
-    return luaL_error( L, "wrong arg type" );
-  for( argn = 2; argn <= lua_gettop( L ); argn ++ )
-  {
-    // lua_isnumber() would silently convert a string of digits to an integer
-    // whereas here strings are handled separately.
-    if( lua_type( L, argn ) == LUA_TNUMBER )
-    {
-      numdata = ( int )luaL_checkinteger( L, argn );
-      if( numdata < 0 || numdata > 255 )
-        return luaL_error( L, "wrong arg range" );
-      if( platform_i2c_send_byte( id, numdata ) != 1 )
-        break;
-      wrote ++;
-    }
-    else if( lua_istable( L, argn ) )
-    {
-      datalen = lua_objlen( L, argn );
-      for( i = 0; i < datalen; i ++ )
-      {
-        lua_rawgeti( L, argn, i + 1 );
-        numdata = ( int )luaL_checkinteger( L, -1 );
-        lua_pop( L, 1 );
-        if( numdata < 0 || numdata > 255 )
-          return luaL_error( L, "wrong arg range" );
-        if( platform_i2c_send_byte( id, numdata ) == 0 )
-          break;
-      }
-      wrote += i;
-      if( i < datalen )
-        break;
-    }
-    else
-    {
-      pdata = luaL_checklstring( L, argn, &datalen );
-      for( i = 0; i < datalen; i ++ )
-        if( platform_i2c_send_byte( id, pdata[ i ] ) == 0 )
-          break;
-      wrote += i;
-      if( i < datalen )
-        break;
+  MOD_CHECK_ID( i2c, id );
+  int addr = luaL_checkinteger( L, 2 );
+  luaL_argcheck( L, addr >= 0 && addr <= 127, 2, "wrong address" );
+  const char *str = NULL;
+  size_t tx_len = data_idx ? i2c_data_len( L, data_idx, &str ) : 0;
+  bool async = lua_type( L, cb_idx ) == LUA_TFUNCTION || lua_type( L, cb_idx ) == LUA_TLIGHTFUNCTION;
+  if (tx_len)
+    i2c_data_copy( L, data_idx, str, NULL, tx_len );
+
+  i2c_job_t *job = (i2c_job_t *)calloc( 1, sizeof(i2c_job_t) + tx_len + rx_len );
+  if (!job)
+    return luaL_error( L, "out of memory" );
+  job->cb_ref = LUA_NOREF;
+  job->tx = (uint8_t *)(job + 1);
+  job->tx_len = tx_len;
+  job->rx = job->tx + tx_len;
+  job->rx_len = rx_len;
+  if (tx_len)
+    i2c_data_copy( L, data_idx, str, job->tx, tx_len );
+
+  if (async) {
+    lua_pushvalue( L, cb_idx );
+    job->cb_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+    if (!i2c_task)
+      i2c_task = task_get_id( i2c_task_handler );
+  } else {
+    job->wait = xSemaphoreCreateBinary();
+    if (!job->wait) {
+      free( job );
+      return luaL_error( L, "out of memory" );
     }
   }
-  lua_pushinteger( L, wrote );
-#endif
-  return 1;
+
+  int res = platform_i2c_transfer( id, addr, job->tx, tx_len, job->rx, rx_len, i2c_done, job );
+  if (res) {
+    if (job->wait)
+      vSemaphoreDelete( job->wait );
+    luaL_unref( L, LUA_REGISTRYINDEX, job->cb_ref );
+    free( job );
+    return luaL_error( L, res == -2 ? "i2c queue full" : "bus not set up" );
+  }
+  if (async)
+    return 0;
+
+  xSemaphoreTake( job->wait, portMAX_DELAY );
+  vSemaphoreDelete( job->wait );
+  int nres = i2c_push_result( L, job );
+  free( job );
+  return nres;
 }
 
-// Lua: read = i2c.read( id, size )
-static int i2c_read( lua_State *L )
+// Lua: speed = i2c.setup( id, sda, scl[, speed] )
+// Returns the SCL clock the bus actually runs at.
+static int i2c_setup( lua_State *L )
 {
   unsigned id = luaL_checkinteger( L, 1 );
-  u32 size = ( u32 )luaL_checkinteger( L, 2 ), i;
-  luaL_Buffer b;
-  int data;
+  MOD_CHECK_ID( i2c, id );
+  int sda = luaL_checkinteger( L, 2 );
+  int scl = luaL_checkinteger( L, 3 );
+  lua_Integer speed = luaL_optinteger( L, 4, PLATFORM_I2C_SPEED_SLOW );
+  luaL_argcheck( L, speed > 0 && speed <= PLATFORM_I2C_SPEED_FASTPLUS, 4, "wrong speed" );
 
-  //MOD_CHECK_ID( i2c, id );
-  if( size == 0 )
-    return 0;
-  luaL_buffinit( L, &b );
-  //platform_i2c_recv_byte( 0, 1, &b, 256, 1 );
-  luaL_pushresult( &b );
+  uint32_t actual = platform_i2c_setup( id, sda, scl, speed );
+  if (!actual)
+    return luaL_error( L, "bus busy" );
+  lua_pushinteger( L, actual );
   return 1;
 }
 
+// Lua: received = i2c.transfer( id, addr, data, size[, function(received[, err])] )
+// Writes data (nil, a string, a table of bytes or a byte), then reads size
+// bytes after a repeated start, all in one transaction. Returns the bytes
+// read (true for size 0), or nil and "nack", "timeout" or "arbitration
+// lost". With a function the transaction is queued and the call returns
+// at once.
+static int i2c_transfer( lua_State *L )
+{
+  lua_Integer size = luaL_checkinteger( L, 4 );
+  luaL_argcheck( L, size >= 0, 4, "wrong size" );
+  return i2c_start( L, 3, size, 5 );
+}
+
+// Lua: ok = i2c.write( id, addr, data[, function(ok[, err])] )
+static int i2c_write( lua_State *L )
+{
+  luaL_checkany( L, 3 );
+  return i2c_start( L, 3, 0, 4 );
+}
+
+// Lua: data = i2c.read( id, addr, size[, function(data[, err])] )
+static int i2c_read( lua_State *L )
+{
+  lua_Integer size = luaL_checkinteger( L, 3 );
+  luaL_argcheck( L, size > 0, 3, "wrong size" );
+  return i2c_start( L, 0, size, 4 );
+}
+
 // Module function map
 const LUA_REG_TYPE i2c_map[] = {
   { LSTRKEY( "setup" ),       LFUNCVAL( i2c_setup ) },
-  { LSTRKEY( "start" ),       LFUNCVAL( i2c_start ) },
-  { LSTRKEY( "stop" ),        LFUNCVAL( i2c_stop ) },
-  { LSTRKEY( "address" ),     LFUNCVAL( i2c_address ) },
+  { LSTRKEY( "transfer" ),    LFUNCVAL( i2c_transfer ) },
   { LSTRKEY( "write" ),       LFUNCVAL( i2c_write ) },
   { LSTRKEY( "read" ),        LFUNCVAL( i2c_read ) },
- //{ LSTRKEY( "FAST" ),       LNUMVAL( PLATFORM_I2C_SPEED_FAST ) },
-  //{ LSTRKEY( "SLOW" ),        LNUMVAL( PLATFORM_I2C_SPEED_SLOW ) },
-  //{ LSTRKEY( "TRANSMITTER" ), LNUMVAL( PLATFORM_I2C_DIRECTION_TRANSMITTER ) },
-  //{ LSTRKEY( "RECEIVER" ),    LNUMVAL( PLATFORM_I2C_DIRECTION_RECEIVER ) },
+  { LSTRKEY( "SLOW" ),        LNUMVAL( PLATFORM_I2C_SPEED_SLOW ) },
+  { LSTRKEY( "FAST" ),        LNUMVAL( PLATFORM_I2C_SPEED_FAST ) },
+  { LSTRKEY( "FASTPLUS" ),    LNUMVAL( PLATFORM_I2C_SPEED_FASTPLUS ) },
   { LNILKEY, LNILVAL }
 };
 
@@ -148,7 +235,7 @@ LUALIB_API int luaopen_i2c(lua_State *L)
 {
 #if LUA_OPTIMIZE_MEMORY > 0
     return 0;
-#else  
+#else
 	luaL_register( L, LUA_I2CLIBNAME, i2c_map );
 	return 1;
 #endif
@@ -0,0 +1,635 @@
+// Module for playing audio through an I2S DAC or amplifier
+//
+// One stream plays at a time, from a WAV or raw PCM file, string, buffer
+// or TCP socket. Its samples go through a ring of bytes: on the Lua task,
+// C code reads the file or takes the socket's data into it (SPIFFS isn't
+// safe to use from two tasks), and a task of its own converts them to 16
+// bit stereo as the DMA hands back buffers it has played. Lua only starts
+// and stops streams and hears when one has ended.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "platform.h"
+#include "buffer.h"
+#include "net.h"
+#include "vfs.h"
+#include "i2s_hw.h"
+#include "task/task.h"
+#include "esp_attr.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define I2S_RING        16384   // bytes of samples in hand, a power of 2
+#define I2S_CHUNK       512     // read from a file at a time
+#define I2S_STACK       2048
+#define I2S_PRIO        12      // above the Lua and uart tasks
+#define I2S_HDR_MAX     24      // WAV header bytes parsed at a time
+
+enum { SRC_FILE, SRC_DATA, SRC_SOCK };
+
+// Where the WAV parser is
+enum { W_RIFF, W_CHUNK, W_FMT, W_SKIP, W_DATA, W_END };
+
+typedef struct {
+  bool active;
+  uint8_t gen;                // tells an event for a stopped stream from a live one
+  uint8_t src;
+  int fd;                     // SRC_FILE
+  int data_ref;               // SRC_DATA, the string or buffer
+  size_t data_pos;
+  void *sock;                 // SRC_SOCK
+  int sock_ref;
+  int cb_ref;
+
+  // WAV parsing
+  uint8_t wstate;
+  uint8_t hdr[I2S_HDR_MAX];
+  uint8_t hdr_len, hdr_need;
+  uint32_t skip;              // W_SKIP, or what's left of the fmt chunk
+  uint32_t data_left;         // of the data chunk, 0xffffffff when streamed
+  bool have_fmt;
+  const char *err;
+
+  // Format, and the state the stream task keeps
+  uint32_t rate;
+  uint8_t channels, bits, frame;
+  volatile bool eos;          // no more is coming into the ring
+  volatile bool started;      // the hardware is playing it
+  uint8_t drained;            // empty buffers since eos
+  bool ended;
+  volatile uint32_t head, tail;
+
+  // Stats
+  uint32_t frames, underruns, dropped;
+} i2s_stream_t;
+
+static i2s_stream_t st = { .fd = 0, .data_ref = LUA_NOREF, .sock_ref = LUA_NOREF, .cb_ref = LUA_NOREF };
+static uint8_t *ring;
+static uint8_t chunk[I2S_CHUNK];
+static i2s_hw_pins_t pins = { -1, -1, -1 };
+static volatile uint16_t volume = 256;     // 8.8 fixed point
+static portMUX_TYPE ring_mux = portMUX_INITIALIZER_UNLOCKED;
+static QueueHandle_t played_q;
+static TaskHandle_t stream_handle;
+static task_handle_t feed_task, end_task;
+
+static uint32_t ring_used( void )
+{
+  return st.head - st.tail;
+}
+
+static uint32_t ring_put( const uint8_t *p, uint32_t n )
+{
+  uint32_t space = I2S_RING - ring_used();
+  if (n > space)
+    n = space;
+  uint32_t head = st.head;
+  for (uint32_t i = 0; i < n; i++)
+    ring[(head + i) & (I2S_RING - 1)] = p[i];
+  __sync_synchronize();
+  st.head = head + n;
+  return n;
+}
+
+static int16_t take_sample( uint32_t *pos )
+{
+  uint32_t at = *pos;
+  if (st.bits == 8) {
+    *pos = at + 1;
+    return (int16_t)((ring[at & (I2S_RING - 1)] - 128) << 8);
+  }
+  *pos = at + 2;
+  return (int16_t)(ring[at & (I2S_RING - 1)] | ring[(at + 1) & (I2S_RING - 1)] << 8);
+}
+
+// Stream task: convert what the ring has into a played buffer
+static void fill( uint32_t *frames )
+{
+  portENTER_CRITICAL( &ring_mux );
+  uint8_t gen = st.gen;
+  bool live = st.active && st.started && !st.ended;
+  uint32_t tail = st.tail, used = st.head - tail;
+  portEXIT_CRITICAL( &ring_mux );
+  if (!live)
+    return;
+  __sync_synchronize();
+
+  uint32_t n = used / st.frame;
+  if (n > I2S_HW_BUF_FRAMES)
+    n = I2S_HW_BUF_FRAMES;
+  int32_t vol = volume;
+  for (uint32_t i = 0; i < n; i++) {
+    int32_t l = take_sample( &tail ) * vol >> 8;
+    int32_t r = st.channels == 2 ? take_sample( &tail ) * vol >> 8 : l;
+    l = l > 32767 ? 32767 : l < -32768 ? -32768 : l;
+    r = r > 32767 ? 32767 : r < -32768 ? -32768 : r;
+    frames[i] = (uint32_t)(uint16_t)l << 16 | (uint16_t)r;
+  }
+
+  bool post_end = false, post_feed = false;
+  portENTER_CRITICAL( &ring_mux );
+  if (st.gen == gen) {
+    st.tail = tail;
+    st.frames += n;
+    if (n < I2S_HW_BUF_FRAMES) {
+      // Once the ring has come round empty and then some, the last of it
+      // has played
+      if (st.eos) {
+        if (++st.drained == I2S_HW_BUFS + 1) {
+          st.ended = true;
+          post_end = true;
+        }
+      } else {
+        st.underruns++;
+      }
+    }
+    post_feed = !st.eos && st.src != SRC_SOCK && st.head - st.tail <= I2S_RING / 2;
+  }
+  portEXIT_CRITICAL( &ring_mux );
+  if (post_end && !task_post_low( end_task, gen )) {
+    portENTER_CRITICAL( &ring_mux );
+    st.ended = false;         // try again with the next buffer
+    st.drained--;
+    portEXIT_CRITICAL( &ring_mux );
+  }
+  if (post_feed)
+    task_post_coalesced_low( feed_task, gen );
+}
+
+static void stream_task( void *arg )
+{
+  for (;;) {
+    uint32_t *frames;
+    if (xQueueReceive( played_q, &frames, portMAX_DELAY ) == pdTRUE)
+      fill( frames );
+  }
+}
+
+// Interrupt: a buffer has played
+static void IRAM_ATTR played( uint32_t *frames, void *arg )
+{
+  xQueueSendFromISR( played_q, &frames, NULL );
+}
+
+static uint32_t le32( const uint8_t *p )
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint16_t le16( const uint8_t *p )
+{
+  return p[0] | p[1] << 8;
+}
+
+static void stream_fail( const char *err )
+{
+  st.err = err;
+  st.wstate = W_END;
+  st.eos = true;
+}
+
+// The format is known: start the hardware on it
+static void stream_begin( void )
+{
+  if (st.channels < 1 || st.channels > 2 || (st.bits != 8 && st.bits != 16) ||
+      st.rate < I2S_HW_MIN_RATE || st.rate > I2S_HW_MAX_RATE) {
+    stream_fail( "unsupported format" );
+    return;
+  }
+  st.frame = st.channels * st.bits / 8;
+  if (i2s_hw_start( &pins, st.rate, played, NULL ) < 0) {
+    stream_fail( "can't start I2S" );
+    return;
+  }
+  st.started = true;
+}
+
+// Take n bytes of header into hdr; true once hdr_need are in
+static bool take_hdr( const uint8_t **p, size_t *len )
+{
+  size_t k = st.hdr_need - st.hdr_len;
+  if (k > *len)
+    k = *len;
+  memcpy( st.hdr + st.hdr_len, *p, k );
+  st.hdr_len += k;
+  *p += k;
+  *len -= k;
+  if (st.hdr_len < st.hdr_need)
+    return false;
+  st.hdr_len = 0;
+  return true;
+}
+
+static void want_hdr( uint8_t state, uint8_t n )
+{
+  st.wstate = state;
+  st.hdr_need = n;
+  st.hdr_len = 0;
+}
+
+// Lua task: the next bytes of the source. Returns how many of them
+// couldn't be kept for want of room in the ring.
+static size_t stream_input( const uint8_t *p, size_t len )
+{
+  while (len && st.wstate != W_END) {
+    switch (st.wstate) {
+    case W_RIFF:
+      if (!take_hdr( &p, &len ))
+        return 0;
+      if (memcmp( st.hdr, "RIFF", 4 ) || memcmp( st.hdr + 8, "WAVE", 4 )) {
+        stream_fail( "not a WAV file" );
+        return 0;
+      }
+      want_hdr( W_CHUNK, 8 );
+      break;
+    case W_CHUNK: {
+      if (!take_hdr( &p, &len ))
+        return 0;
+      uint32_t size = le32( st.hdr + 4 );
+      if (!memcmp( st.hdr, "fmt ", 4 ) && size >= 16) {
+        st.skip = size - 16 + (size & 1);
+        want_hdr( W_FMT, 16 );
+      } else if (!memcmp( st.hdr, "data", 4 )) {
+        if (!st.have_fmt) {
+          stream_fail( "no fmt chunk" );
+          return 0;
+        }
+        st.data_left = size ? size : 0xffffffff;
+        st.wstate = W_DATA;
+        stream_begin();
+      } else {
+        st.skip = size + (size & 1);
+        st.wstate = W_SKIP;
+      }
+      break;
+    }
+    case W_FMT: {
+      if (!take_hdr( &p, &len ))
+        return 0;
+      uint16_t tag = le16( st.hdr );
+      if (tag != 1 && tag != 0xfffe) {
+        stream_fail( "not PCM" );
+        return 0;
+      }
+      st.channels = le16( st.hdr + 2 );
+      st.rate = le32( st.hdr + 4 );
+      st.bits = le16( st.hdr + 14 );
+      st.have_fmt = true;
+      st.wstate = W_SKIP;
+      break;
+    }
+    case W_SKIP: {
+      size_t k = st.skip < len ? st.skip : len;
+      st.skip -= k;
+      p += k;
+      len -= k;
+      if (!st.skip)
+        want_hdr( W_CHUNK, 8 );
+      break;
+    }
+    case W_DATA: {
+      size_t k = st.data_left < len ? st.data_left : len;
+      size_t put = ring_put( p, k );
+      if (st.data_left != 0xffffffff)
+        st.data_left -= k;
+      if (!st.data_left)
+        st.wstate = W_END;
+      if (st.wstate == W_END)
+        st.eos = true;      // whatever follows the data chunk isn't sound
+      return k - put;
+    }
+    }
+  }
+  return 0;
+}
+
+// Lua task: top the ring up from a file or string
+static void stream_feed( lua_State *L )
+{
+  if (st.src == SRC_FILE) {
+    while (!st.eos && I2S_RING - ring_used() >= I2S_CHUNK) {
+      int32_t n = vfs_read( st.fd, chunk, I2S_CHUNK );
+      if (n <= 0) {
+        st.eos = true;
+        break;
+      }
+      stream_input( chunk, n );
+    }
+  } else if (st.src == SRC_DATA) {
+    lua_rawgeti( L, LUA_REGISTRYINDEX, st.data_ref );
+    size_t len;
+    const char *data = buffer_tolstring( L, -1, &len );
+    lua_pop( L, 1 );
+    while (!st.eos && st.data_pos < len) {
+      size_t k = len - st.data_pos, space = I2S_RING - ring_used();
+      if (k > space)
+        k = space;
+      if (!k)
+        break;
+      stream_input( (const uint8_t *)data + st.data_pos, k );
+      st.data_pos += k;
+    }
+    if (st.data_pos >= len)
+      st.eos = true;
+  }
+}
+
+static void stream_rx( lua_State *L, void *arg, char *data, size_t len );
+
+// Let go of the stream's source and hardware, then tell Lua why it ended
+static void stream_end( lua_State *L, const char *reason )
+{
+  if (!st.active)
+    return;
+  i2s_hw_stop();
+  portENTER_CRITICAL( &ring_mux );
+  st.active = false;
+  st.gen++;
+  portEXIT_CRITICAL( &ring_mux );
+  if (st.fd) {
+    vfs_close( st.fd );
+    st.fd = 0;
+  }
+  if (st.sock) {
+    net_tcp_set_rx_hook( st.sock, NULL, NULL );
+    st.sock = NULL;
+  }
+  luaL_unref( L, LUA_REGISTRYINDEX, st.data_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, st.sock_ref );
+  st.data_ref = st.sock_ref = LUA_NOREF;
+  int cb = st.cb_ref;
+  st.cb_ref = LUA_NOREF;
+  if (cb != LUA_NOREF) {
+    lua_rawgeti( L, LUA_REGISTRYINDEX, cb );
+    luaL_unref( L, LUA_REGISTRYINDEX, cb );
+    lua_pushstring( L, reason );
+    lua_call( L, 1, 0 );
+  }
+}
+
+// End a stream that didn't get going, without a call, and error out
+static void stream_abort( lua_State *L, const char *err )
+{
+  luaL_unref( L, LUA_REGISTRYINDEX, st.cb_ref );
+  st.cb_ref = LUA_NOREF;
+  stream_end( L, err );
+  luaL_error( L, "%s", err );
+}
+
+static void stream_check_fail( lua_State *L )
+{
+  if (st.err && st.active)
+    stream_end( L, st.err );
+}
+
+static void feed_handler( task_param_t param, task_prio_t prio )
+{
+  (void)prio;
+  if (!st.active || st.gen != (uint8_t)param)
+    return;
+  lua_State *L = lua_getstate();
+  stream_feed( L );
+  stream_check_fail( L );
+}
+
+static void end_handler( task_param_t param, task_prio_t prio )
+{
+  (void)prio;
+  if (!st.active || st.gen != (uint8_t)param)
+    return;
+  stream_end( lua_getstate(), "done" );
+}
+
+// Lua task: the socket's data, or NULL once it has gone
+static void stream_rx( lua_State *L, void *arg, char *data, size_t len )
+{
+  if (!st.active || st.src != SRC_SOCK)
+    return;
+  if (!data) {
+    st.sock = NULL;           // its hook is gone with it
+    st.eos = true;
+    if (!st.started)
+      stream_end( L, st.err ? st.err : "closed" );
+    return;
+  }
+  if (st.eos)
+    return;
+  size_t lost = stream_input( (const uint8_t *)data, len );
+  portENTER_CRITICAL( &ring_mux );
+  st.dropped += lost;
+  portEXIT_CRITICAL( &ring_mux );
+  stream_check_fail( L );
+}
+
+static int opt_field( lua_State *L, int idx, const char *name, int dflt )
+{
+  if (!lua_istable( L, idx ))
+    return dflt;
+  lua_getfield( L, idx, name );
+  int v = luaL_optinteger( L, -1, dflt );
+  lua_pop( L, 1 );
+  return v;
+}
+
+// Common to the ways of starting a stream: the source is set up by the
+// caller once this returns. Arguments are (src, [opts], [fn]).
+static void stream_start( lua_State *L, int src )
+{
+  if (pins.bck_pin < 0)
+    luaL_error( L, "i2s.setup() first" );
+  int fn = 0;
+  if (lua_type( L, 3 ) == LUA_TFUNCTION || lua_type( L, 3 ) == LUA_TLIGHTFUNCTION)
+    fn = 3;
+  else if (lua_type( L, 2 ) == LUA_TFUNCTION || lua_type( L, 2 ) == LUA_TLIGHTFUNCTION)
+    fn = 2;
+  bool raw = false;
+  if (lua_istable( L, 2 )) {
+    lua_getfield( L, 2, "raw" );
+    raw = lua_toboolean( L, -1 );
+    lua_pop( L, 1 );
+  }
+
+  if (!stream_handle) {
+    if (!ring)
+      ring = (uint8_t *)malloc( I2S_RING );
+    if (!played_q)
+      played_q = xQueueCreate( I2S_HW_BUFS, sizeof(uint32_t *) );
+    if (!ring || !played_q ||
+        xTaskCreate( stream_task, "i2s", I2S_STACK, NULL, I2S_PRIO, &stream_handle ) != pdPASS)
+      luaL_error( L, "out of memory" );
+  }
+  stream_end( L, "stopped" );
+
+  portENTER_CRITICAL( &ring_mux );
+  st.head = st.tail = 0;
+  st.frames = st.underruns = st.dropped = 0;
+  st.eos = st.started = st.ended = false;
+  st.drained = 0;
+  st.active = true;
+  portEXIT_CRITICAL( &ring_mux );
+  st.src = src;
+  st.err = NULL;
+  st.have_fmt = false;
+  st.data_pos = 0;
+  want_hdr( W_RIFF, 12 );
+  if (fn) {
+    lua_pushvalue( L, fn );
+    st.cb_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  if (raw) {
+    st.rate = opt_field( L, 2, "rate", 16000 );
+    st.bits = opt_field( L, 2, "bits", 16 );
+    st.channels = opt_field( L, 2, "channels", 1 );
+    st.data_left = 0xffffffff;
+    st.wstate = W_DATA;
+  }
+}
+
+// File and string streams are read as far as the ring takes before
+// play returns, so a bad header is an error there and then
+static void stream_first( lua_State *L )
+{
+  if (st.wstate == W_DATA && !st.started)
+    stream_begin();
+  stream_feed( L );
+  if (st.err || !st.started)
+    stream_abort( L, st.err ? st.err : "no data" );
+}
+
+// Lua: i2s.setup( { bck=pin, ws=pin, data=pin } )
+// The pins of the DAC or amplifier, which gets 16 bit stereo frames in
+// Philips format, with the I2S1 peripheral as master.
+static int i2s_setup( lua_State *L )
+{
+  luaL_checktype( L, 1, LUA_TTABLE );
+  i2s_hw_pins_t p;
+  p.bck_pin = opt_field( L, 1, "bck", -1 );
+  p.ws_pin = opt_field( L, 1, "ws", -1 );
+  p.data_pin = opt_field( L, 1, "data", -1 );
+  // GPIO34 and up are inputs only
+  luaL_argcheck( L, p.bck_pin >= 0 && p.bck_pin < 34, 1, "wrong bck" );
+  luaL_argcheck( L, p.ws_pin >= 0 && p.ws_pin < 34, 1, "wrong ws" );
+  luaL_argcheck( L, p.data_pin >= 0 && p.data_pin < 34, 1, "wrong data" );
+  if (st.active)
+    return luaL_error( L, "playing" );
+  pins = p;
+  return 0;
+}
+
+// Lua: i2s.playfile( filename[, { raw=false, rate=16000, bits=16, channels=1 }][, function(reason)] )
+// Play a WAV file, PCM at 8 or 16 bits, mono or stereo, at 8 to 96 kHz;
+// or with raw set, a file of just samples in the format given. Whatever
+// is playing is stopped first. The function is called with "done" once
+// the last sample has played, "stopped" if the stream is cut short, or
+// what went wrong.
+static int i2s_playfile( lua_State *L )
+{
+  const char *fname = luaL_checkstring( L, 1 );
+  stream_start( L, SRC_FILE );
+  st.fd = vfs_open( fname, "r" );
+  if (!st.fd)
+    stream_abort( L, "can't open file" );
+  stream_first( L );
+  return 0;
+}
+
+// Lua: i2s.play( data[, opts][, function(reason)] )
+// Like i2s.playfile(), from a string or buffer, which is read as it
+// plays rather than copied.
+static int i2s_play( lua_State *L )
+{
+  size_t len;
+  buffer_checklstring( L, 1, &len );
+  stream_start( L, SRC_DATA );
+  lua_pushvalue( L, 1 );
+  st.data_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  stream_first( L );
+  return 0;
+}
+
+// Lua: i2s.stream( socket[, opts][, function(reason)] )
+// Like i2s.playfile(), from what a connected TCP socket receives, which
+// the function is told of as "closed" if it goes before the format is
+// known. The sender must keep to the rate it plays at: data the ring has
+// no room for is dropped and counted.
+static int i2s_stream( lua_State *L )
+{
+  void *sock = net_tcp_check( L, 1 );
+  stream_start( L, SRC_SOCK );
+  st.sock = sock;
+  lua_pushvalue( L, 1 );
+  st.sock_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  if (st.wstate == W_DATA)
+    stream_begin();
+  net_tcp_set_rx_hook( sock, stream_rx, NULL );
+  stream_check_fail( L );
+  return 0;
+}
+
+// Lua: i2s.stop()
+static int i2s_stop( lua_State *L )
+{
+  stream_end( L, "stopped" );
+  return 0;
+}
+
+// Lua: i2s.volume( v )
+// Scale the samples by v, 0 to 4, 1 by default; the result is clipped.
+// Lua: v = i2s.volume()
+static int i2s_volume( lua_State *L )
+{
+  if (lua_isnoneornil( L, 1 )) {
+    lua_pushnumber( L, volume / 256.0 );
+    return 1;
+  }
+  lua_Number v = luaL_checknumber( L, 1 );
+  luaL_argcheck( L, v >= 0 && v <= 4, 1, "wrong volume" );
+  volume = v * 256;
+  return 0;
+}
+
+// Lua: playing, frames, underruns, dropped = i2s.stats()
+// Of the stream playing, or the last one: frames played, buffers the ring
+// was short for, and bytes of socket data there was no room for.
+static int i2s_stats( lua_State *L )
+{
+  portENTER_CRITICAL( &ring_mux );
+  uint32_t frames = st.frames, underruns = st.underruns, dropped = st.dropped;
+  portEXIT_CRITICAL( &ring_mux );
+  lua_pushboolean( L, st.active );
+  lua_pushnumber( L, frames );
+  lua_pushnumber( L, underruns );
+  lua_pushnumber( L, dropped );
+  return 4;
+}
+
+// Module function map
+const LUA_REG_TYPE i2s_map[] = {
+  { LSTRKEY( "setup" ),     LFUNCVAL( i2s_setup ) },
+  { LSTRKEY( "playfile" ),  LFUNCVAL( i2s_playfile ) },
+  { LSTRKEY( "play" ),      LFUNCVAL( i2s_play ) },
+  { LSTRKEY( "stream" ),    LFUNCVAL( i2s_stream ) },
+  { LSTRKEY( "stop" ),      LFUNCVAL( i2s_stop ) },
+  { LSTRKEY( "volume" ),    LFUNCVAL( i2s_volume ) },
+  { LSTRKEY( "stats" ),     LFUNCVAL( i2s_stats ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_i2s( lua_State *L )
+{
+  feed_task = task_get_id( feed_handler );
+  end_task = task_get_id( end_handler );
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_I2SLIBNAME, i2s_map );
+  return 1;
+#endif
+}
@@ -0,0 +1,36 @@
+#ifndef __BUFFER_H__
+#define __BUFFER_H__
+
+#include "lua.h"
+#include "c_types.h"
+
+#define BUFFER_TABLE "buffer.buf"
+
+// A fixed-size, mutable byte array. Its data never moves, so C code may
+// hold on to it for as long as the userdata is referenced. A slice shares
+// the bytes of the buffer it was cut from, and keeps that one referenced.
+typedef struct {
+  size_t len;
+  uint8_t *data;    // right after this struct, or in the buffer sliced
+} lbuffer_t;
+
+// The bytes of the string, buffer or string builder at idx, or NULL if
+// it is none of them
+const char *buffer_tolstring( lua_State *L, int idx, size_t *len );
+
+// Like luaL_checklstring, but a buffer or a string builder is accepted
+// as well
+const char *buffer_checklstring( lua_State *L, int idx, size_t *len );
+
+// The buffer at idx, or an argument error
+lbuffer_t *buffer_check( lua_State *L, int idx );
+
+// Push a new buffer of len bytes, left uninitialised. The buffer module
+// must have been opened for it to get its methods.
+lbuffer_t *buffer_push( lua_State *L, size_t len );
+
+// Push a slice of len bytes from offset off of the buffer at idx, which
+// must hold them, without copying
+lbuffer_t *buffer_push_slice( lua_State *L, int idx, size_t off, size_t len );
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef __CBREF_H__
+#define __CBREF_H__
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "c_types.h"
+
+// A module's own table of references to Lua values, used in place of
+// luaL_ref( L, LUA_REGISTRYINDEX ) for the callbacks it holds. Slots are
+// small integers handed out again as soon as they're freed, so the table
+// stays in its array part however many sockets or timers come and go,
+// and node.cbrefs() can tell which module holds how many. Refs are
+// LUA_NOREF or LUA_REFNIL as with luaL_ref, and only valid in their own
+// table. All of it runs on the Lua task.
+typedef struct cbref_table {
+  const char *name;           // as node.cbrefs() lists it
+  bool weak;                  // a value can be collected while referenced
+  bool listed;
+  int ref;                    // the table in the registry, while it has slots
+  uint32_t slots;             // live and free
+  uint32_t free;              // first free slot, 0 for none
+  uint32_t live;
+  uint32_t hwm;               // most live at once since boot
+  struct cbref_table *next;
+} cbref_table_t;
+
+#define CBREF_TABLE( n, w ) { .name = ( n ), .weak = ( w ), .ref = LUA_NOREF }
+
+// Pop the value on top of L and return its ref in t
+int cbref_ref( lua_State *L, cbref_table_t *t );
+
+// Free ref, which may be LUA_NOREF or LUA_REFNIL
+void cbref_unref( lua_State *L, cbref_table_t *t, int ref );
+
+// Push the value of ref, nil for LUA_NOREF, LUA_REFNIL or a weak value
+// that has been collected
+void cbref_get( lua_State *L, cbref_table_t *t, int ref );
+
+// Every table that has held a ref, NULL to start
+cbref_table_t *cbref_next( cbref_table_t *t );
+
+// Push an array of t's live refs, each { ref =, type =, where = }, with
+// where the source line of a Lua function
+void cbref_push_live( lua_State *L, cbref_table_t *t );
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef __CJSON_H__
+#define __CJSON_H__
+
+#include "lua.h"
+#include "strbuf.h"
+
+// What cjson shares with other serialisers, so they lay tables out the
+// way cjson.encode does, keep to its depth limits and take the same sinks.
+
+// Elements of the array the table on top of the stack is, or -1 when it
+// is to be encoded as an object (as an empty table is). -2 is returned for
+// an excessively sparse array while those aren't converted to objects.
+int cjson_array_length( lua_State *L );
+
+int cjson_encode_max_depth( void );
+int cjson_decode_max_depth( void );
+
+// A function, or a file or socket written through its write or send
+// method, fed the text a strbuf collects through its flush hook.
+typedef struct {
+  lua_State *l;
+  strbuf_t *buf;
+  int fn;               // stack index of the function to call
+  int self;             // stack index of the file or socket, or 0
+  lua_Integer written;
+} cjson_sink_t;
+
+// Resolves the sink at idx, pushing its method if it has one, and raises
+// an error if it is neither. buf is what cjson_sink_flush frees on errors.
+void cjson_sink_init( lua_State *L, int idx, cjson_sink_t *sink, strbuf_t *buf );
+
+// strbuf flush hook taking a cjson_sink_t
+void cjson_sink_flush( void *arg, const char *data, int len );
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef __FLASHLOG_H__
+#define __FLASHLOG_H__
+
+#include "log_store.h"
+
+// The log partition the flashlog module reads and appends to, for other
+// modules to keep records of their own in. Records are told apart by
+// their contents; see each module for its format.
+extern log_store_t flashlog_store;
+
+#endif
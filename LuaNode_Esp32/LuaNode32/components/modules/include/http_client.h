@@ -0,0 +1,12 @@
+#ifndef __HTTP_CLIENT_H__
+#define __HTTP_CLIENT_H__
+
+#include "lua.h"
+
+// http.request(), see http_client.c
+int http_request (lua_State *L);
+
+// Registers the metatable of requests in flight
+void http_client_open (lua_State *L);
+
+#endif
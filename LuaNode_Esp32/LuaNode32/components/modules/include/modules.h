@@ -3,5 +3,20 @@
 
 #include "user_modules.h"
 #include "lrodefs.h"
+#include "lauxlib.h"
+#include "task/task.h"
+
+// The priority class a callback's events are queued at, one of
+// node.PRIO_LOW, PRIO_MEDIUM or PRIO_HIGH, from the value at idx; def if
+// it is nil or missing
+static inline task_prio_t mod_optprio( lua_State *L, int idx, task_prio_t def )
+{
+  if( lua_isnoneornil( L, idx ) )
+    return def;
+  lua_Integer prio = luaL_checkinteger( L, idx );
+  if( prio < TASK_PRIORITY_LOW || prio >= TASK_PRIORITY_COUNT )
+    luaL_error( L, "wrong priority" );
+  return ( task_prio_t )prio;
+}
 
 #endif
@@ -0,0 +1,48 @@
+#ifndef __NET_H__
+#define __NET_H__
+
+#include "lua.h"
+#include "c_types.h"
+#include "lwip/ip_addr.h"
+#include "lwip/dns.h"
+
+// For modules that speak a protocol over a net TCP socket in C
+
+// Called on the Lua task with each piece of data the socket receives,
+// instead of its "receive" callback, and with data NULL when the
+// connection has gone (before the "disconnection" callback). data points
+// into lwIP's buffers: it may be changed in place, but is only valid
+// during the call.
+typedef void (*net_rx_hook_fn)( lua_State *L, void *arg, char *data, size_t len );
+
+// The TCP socket at idx, or an error
+void *net_tcp_check( lua_State *L, int idx );
+
+// Route the socket's incoming data to fn, or back to Lua with fn NULL
+void net_tcp_set_rx_hook( void *sock, net_rx_hook_fn fn, void *arg );
+
+// Send like socket:send(data); the data is copied. Errors out if the
+// socket isn't connected or its send queue is full.
+void net_tcp_write( lua_State *L, void *sock, const char *data, size_t len );
+
+// Whether net_tcp_write() can still succeed on the socket
+bool net_tcp_connected( void *sock );
+
+// The DNS cache in front of net's lookups, shared with modules that learn
+// addresses some other way
+
+// Cache name as addr for ttl_s seconds, 0 dropping it, or as a failed
+// lookup for the configured time with addr NULL. Safe from any task.
+void net_dns_cache_put( const char *name, const ip_addr_t *addr, uint32_t ttl_s );
+
+// 1 with addr set if name is cached, -1 if its lookup failed lately, 0 if
+// it isn't cached
+int net_dns_cache_get( const char *name, ip_addr_t *addr );
+
+// Takes over lookups of names ending in .local that the cache can't
+// answer, with dns_gethostbyname()'s contract. Called on the Lua task.
+typedef err_t (*net_local_resolver_fn)( const char *name, ip_addr_t *addr,
+                                        dns_found_callback found, void *arg );
+void net_dns_set_local_resolver( net_local_resolver_fn fn );
+
+#endif
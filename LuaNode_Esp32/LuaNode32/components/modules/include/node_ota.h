@@ -0,0 +1,13 @@
+#ifndef __NODE_OTA_H__
+#define __NODE_OTA_H__
+
+#include "lua.h"
+#include "lrodefs.h"
+
+// node.ota, see node_ota.c
+extern const LUA_REG_TYPE node_ota_map[];
+
+// Registers the metatable of update objects
+void node_ota_open( lua_State *L );
+
+#endif
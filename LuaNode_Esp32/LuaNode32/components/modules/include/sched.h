@@ -0,0 +1,26 @@
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+#include "lua.h"
+#include "c_types.h"
+
+// A coroutine run by the sched module
+struct sched_task;
+
+// Whether L is the sched task running right now, which C functions may
+// suspend with sched_wait() or sched_sleep()
+bool sched_can_wait( lua_State *L );
+
+// Suspend the running task L until sched_wake( L, waiter, n ); what was
+// passed to that is returned. Leave the C function through it:
+//   return sched_wait( L, &ud->waiter );
+int sched_wait( lua_State *L, struct sched_task **waiter );
+
+// Suspend the running task L for ms milliseconds, returning nothing
+int sched_sleep( lua_State *L, uint32_t ms );
+
+// Make the task waiting in *waiter ready, passing it the n values on top
+// of L's stack, and clear *waiter. Without a waiter the values are popped.
+void sched_wake( lua_State *L, struct sched_task **waiter, int n );
+
+#endif
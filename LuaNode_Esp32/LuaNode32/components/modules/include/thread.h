@@ -42,6 +42,9 @@ struct lthread {
     int status;
     int thid;
     pthread_t thread;
+    int nargs;     // Arguments waiting on L's stack
+    int isolated;  // L is a global state of its own, see thread.worker()
+    int stack;     // Stack size in bytes
 };
 
 #endif	/* LTHREAD_H */
@@ -0,0 +1,18 @@
+#ifndef __UART_CLAIM_H__
+#define __UART_CLAIM_H__
+
+#include "c_types.h"
+
+// For C code that takes a UART over from the uart module's Lua callbacks
+
+typedef struct {
+  void (*rx_ready)( unsigned id, void *arg );  // in uart_task, bytes to read
+  void (*tx_done)( unsigned id, void *arg );   // in the TX interrupt, queue empty
+  void *arg;
+} uart_claim_t;
+
+// Send port id's events to c instead of Lua until released with c NULL.
+// False if someone else has the port. c must stay valid meanwhile.
+bool uart_claim( unsigned id, const uart_claim_t *c );
+
+#endif
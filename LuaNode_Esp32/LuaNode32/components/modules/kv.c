@@ -0,0 +1,446 @@
+// Module for a key/value store in NVS
+//
+// Settings kept here survive resets and reflashing the file system, and
+// reading them costs a table lookup: a namespace is read into a RAM cache
+// once, when it is opened, and gets come from there. Sets go to the cache
+// and are written to NVS together, a set interval after the first one,
+// or at commit() or close().
+//
+// This NVS can't list what a namespace holds, so the store keeps its own
+// index of keys and their types, under KV_INDEX_KEY. Keys set by C code
+// with the nvs_* functions are only seen if they are in that index.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "nvs.h"
+#include "esp_timer.h"
+#include "task/task.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define KV_STORE_TABLE     "kv.store"
+#define KV_INDEX_KEY       "__kv_index"
+#define KV_NAME_MAX        15      // NVS's limit, for keys and namespaces
+#define KV_COMMIT_MS       2000
+
+// Value types, as the index records them
+#define KV_T_INT           'i'     // int32
+#define KV_T_NUMBER        'n'     // a lua_Number that isn't one, as a blob
+#define KV_T_STRING        's'     // a blob, so any bytes go
+#define KV_T_BOOLEAN       'b'     // uint8
+
+typedef struct kv_store {
+  nvs_handle h;
+  bool open;
+  bool index_dirty;               // keys were added or removed
+  bool armed;
+  uint32_t id;
+  uint32_t commit_ms;
+  int cache_ref;                  // key -> value
+  int dirty_ref;                  // key -> true, for keys not yet written
+  os_timer_t timer;
+  struct kv_store *next;
+} kv_store_t;
+
+static kv_store_t *kv_stores;     // all open stores
+static uint32_t kv_next_id;
+static task_handle_t kv_task;
+
+static int kv_error( lua_State *L, esp_err_t err )
+{
+  lua_pushnil( L );
+  lua_pushfstring( L, "nvs error 0x%x", (unsigned)err );
+  return 2;
+}
+
+static void kv_checkname( lua_State *L, int arg, const char *name )
+{
+  luaL_argcheck( L, *name && strlen( name ) <= KV_NAME_MAX, arg, "name too long or empty" );
+}
+
+// Reads one value into the cache table at the top of the stack
+static void kv_load( lua_State *L, kv_store_t *s, char type, const char *key )
+{
+  esp_err_t err = ESP_FAIL;
+  switch (type) {
+  case KV_T_INT: {
+    int32_t v;
+    if ((err = nvs_get_i32( s->h, key, &v )) == ESP_OK)
+      lua_pushinteger( L, v );
+    break;
+  }
+  case KV_T_BOOLEAN: {
+    uint8_t v;
+    if ((err = nvs_get_u8( s->h, key, &v )) == ESP_OK)
+      lua_pushboolean( L, v );
+    break;
+  }
+  case KV_T_NUMBER: {
+    lua_Number v;
+    size_t len = sizeof(v);
+    if ((err = nvs_get_blob( s->h, key, &v, &len )) == ESP_OK)
+      lua_pushnumber( L, v );
+    break;
+  }
+  case KV_T_STRING: {
+    size_t len = 0;
+    if ((err = nvs_get_blob( s->h, key, NULL, &len )) == ESP_OK) {
+      char *p = (char *)malloc( len ? len : 1 );
+      if (!p)
+        err = ESP_ERR_NO_MEM;
+      else if ((err = nvs_get_blob( s->h, key, p, &len )) == ESP_OK)
+        lua_pushlstring( L, p, len );
+      free( p );
+    }
+    break;
+  }
+  }
+  if (err == ESP_OK)
+    lua_setfield( L, -2, key );
+}
+
+// Fills the cache from the index
+static void kv_load_all( lua_State *L, kv_store_t *s )
+{
+  size_t len = 0;
+  lua_rawgeti( L, LUA_REGISTRYINDEX, s->cache_ref );
+  if (nvs_get_blob( s->h, KV_INDEX_KEY, NULL, &len ) == ESP_OK && len) {
+    char *index = (char *)malloc( len );
+    if (index && nvs_get_blob( s->h, KV_INDEX_KEY, index, &len ) == ESP_OK) {
+      // entries are a type byte and a key, each ending in a NUL
+      for (size_t i = 0; i + 2 < len; ) {
+        size_t n = strnlen( index + i + 1, len - i - 1 );
+        if (i + 1 + n >= len)
+          break;
+        kv_load( L, s, index[i], index + i + 1 );
+        i += n + 2;
+      }
+    }
+    free( index );
+  }
+  lua_pop( L, 1 );
+}
+
+static char kv_type( lua_State *L, int idx )
+{
+  switch (lua_type( L, idx )) {
+  case LUA_TNUMBER: {
+    lua_Number v = lua_tonumber( L, idx );
+    return v >= INT32_MIN && v <= INT32_MAX && (lua_Number)(int32_t)v == v ? KV_T_INT : KV_T_NUMBER;
+  }
+  case LUA_TBOOLEAN:
+    return KV_T_BOOLEAN;
+  default:
+    return KV_T_STRING;
+  }
+}
+
+// Writes the value at the top of the stack, or erases the key if it is nil
+static esp_err_t kv_store_value( lua_State *L, kv_store_t *s, const char *key )
+{
+  esp_err_t err;
+  size_t len;
+  if (lua_isnil( L, -1 )) {
+    err = nvs_erase_key( s->h, key );
+    return err == ESP_ERR_NVS_NOT_FOUND ? ESP_OK : err;
+  }
+  switch (kv_type( L, -1 )) {
+  case KV_T_INT:
+    return nvs_set_i32( s->h, key, (int32_t)lua_tonumber( L, -1 ) );
+  case KV_T_BOOLEAN:
+    return nvs_set_u8( s->h, key, lua_toboolean( L, -1 ) );
+  case KV_T_NUMBER: {
+    lua_Number v = lua_tonumber( L, -1 );
+    return nvs_set_blob( s->h, key, &v, sizeof(v) );
+  }
+  default: {
+    const char *p = lua_tolstring( L, -1, &len );
+    return nvs_set_blob( s->h, key, p, len );
+  }
+  }
+}
+
+static esp_err_t kv_store_index( lua_State *L, kv_store_t *s )
+{
+  size_t len = 0, n;
+  char *index = NULL;
+  esp_err_t err = ESP_OK;
+  lua_rawgeti( L, LUA_REGISTRYINDEX, s->cache_ref );
+  // one pass for the size, one to fill it in
+  for (int pass = 0; pass < 2 && err == ESP_OK; pass++) {
+    if (pass == 1 && len && (index = (char *)malloc( len )) == NULL)
+      err = ESP_ERR_NO_MEM;
+    n = 0;
+    lua_pushnil( L );
+    while (err == ESP_OK && lua_next( L, -2 )) {
+      size_t klen = lua_objlen( L, -2 ) + 1;
+      if (index) {
+        index[n] = kv_type( L, -1 );
+        memcpy( index + n + 1, lua_tostring( L, -2 ), klen );
+      }
+      n += 1 + klen;
+      lua_pop( L, 1 );
+    }
+    len = n;
+  }
+  lua_pop( L, 1 );
+  if (err == ESP_OK) {
+    err = len ? nvs_set_blob( s->h, KV_INDEX_KEY, index, len ) : nvs_erase_key( s->h, KV_INDEX_KEY );
+    if (err == ESP_ERR_NVS_NOT_FOUND)
+      err = ESP_OK;
+  }
+  free( index );
+  return err;
+}
+
+// Writes what has changed and commits it
+static esp_err_t kv_commit( lua_State *L, kv_store_t *s )
+{
+  esp_err_t err = ESP_OK;
+  if (s->armed) {
+    os_timer_disarm( &s->timer );
+    s->armed = false;
+  }
+  lua_rawgeti( L, LUA_REGISTRYINDEX, s->dirty_ref );
+  lua_rawgeti( L, LUA_REGISTRYINDEX, s->cache_ref );
+  lua_pushnil( L );
+  while (err == ESP_OK && lua_next( L, -3 )) {
+    lua_pop( L, 1 );
+    lua_pushvalue( L, -1 );
+    lua_rawget( L, -3 );
+    err = kv_store_value( L, s, lua_tostring( L, -2 ) );
+    lua_pop( L, 1 );
+  }
+  lua_pop( L, err == ESP_OK ? 2 : 3 );
+  if (err == ESP_OK && s->index_dirty)
+    err = kv_store_index( L, s );
+  if (err == ESP_OK)
+    err = nvs_commit( s->h );
+  if (err == ESP_OK) {
+    lua_newtable( L );
+    lua_rawseti( L, LUA_REGISTRYINDEX, s->dirty_ref );
+    s->index_dirty = false;
+  }
+  return err;
+}
+
+static void kv_tick( void *arg )
+{
+  task_post_low( kv_task, ((kv_store_t *)arg)->id );
+}
+
+static void kv_timeout( task_param_t param, task_prio_t prio )
+{
+  (void)prio;
+  for (kv_store_t *s = kv_stores; s; s = s->next) {
+    if (s->id == param) {
+      s->armed = false;
+      kv_commit( lua_getstate(), s );
+      break;
+    }
+  }
+}
+
+static kv_store_t *kv_check( lua_State *L )
+{
+  kv_store_t *s = (kv_store_t *)luaL_checkudata( L, 1, KV_STORE_TABLE );
+  if (!s->open)
+    luaL_error( L, "store is closed" );
+  return s;
+}
+
+static void kv_doclose( lua_State *L, kv_store_t *s )
+{
+  if (!s->open)
+    return;
+  kv_commit( L, s );
+  if (s->armed)
+    os_timer_disarm( &s->timer );
+  nvs_close( s->h );
+  s->open = false;
+  luaL_unref( L, LUA_REGISTRYINDEX, s->cache_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, s->dirty_ref );
+  for (kv_store_t **p = &kv_stores; *p; p = &(*p)->next) {
+    if (*p == s) {
+      *p = s->next;
+      break;
+    }
+  }
+}
+
+// Lua: store = kv.open( namespace[, commit_ms] )
+// Changes are written commit_ms after the first one, 2000 by default;
+// 0 writes each at once. Returns nil and an error if NVS fails.
+static int kv_open( lua_State *L )
+{
+  const char *ns = luaL_checkstring( L, 1 );
+  int commit_ms = luaL_optinteger( L, 2, KV_COMMIT_MS );
+  nvs_handle h;
+  kv_checkname( L, 1, ns );
+  luaL_argcheck( L, commit_ms >= 0, 2, "out of range" );
+  esp_err_t err = nvs_open( ns, NVS_READWRITE, &h );
+  if (err != ESP_OK)
+    return kv_error( L, err );
+
+  kv_store_t *s = (kv_store_t *)lua_newuserdata( L, sizeof(kv_store_t) );
+  memset( s, 0, sizeof(*s) );
+  s->h = h;
+  s->open = true;
+  s->id = ++kv_next_id;
+  s->commit_ms = commit_ms;
+  lua_newtable( L );
+  s->cache_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  lua_newtable( L );
+  s->dirty_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  os_timer_setfn( &s->timer, kv_tick, s );
+  s->next = kv_stores;
+  kv_stores = s;
+  luaL_getmetatable( L, KV_STORE_TABLE );
+  lua_setmetatable( L, -2 );
+  kv_load_all( L, s );
+  return 1;
+}
+
+// Lua: value = store:get( key[, default] )
+static int kv_get( lua_State *L )
+{
+  kv_store_t *s = kv_check( L );
+  luaL_checkstring( L, 2 );
+  lua_rawgeti( L, LUA_REGISTRYINDEX, s->cache_ref );
+  lua_pushvalue( L, 2 );
+  lua_rawget( L, -2 );
+  if (lua_isnil( L, -1 ))
+    lua_pushvalue( L, 3 );
+  return 1;
+}
+
+// Lua: store:set( key, value )
+// value is a number, string or boolean; nil removes the key. Integers
+// that fit in 32 bits are kept as NVS i32s, so C code can read them.
+static int kv_set( lua_State *L )
+{
+  kv_store_t *s = kv_check( L );
+  const char *key = luaL_checkstring( L, 2 );
+  int t = lua_type( L, 3 );
+  kv_checkname( L, 2, key );
+  luaL_argcheck( L, strcmp( key, KV_INDEX_KEY ), 2, "reserved" );
+  luaL_argcheck( L, t == LUA_TNIL || t == LUA_TNONE || t == LUA_TNUMBER ||
+                    t == LUA_TSTRING || t == LUA_TBOOLEAN, 3, "number, string or boolean expected" );
+  lua_settop( L, 3 );
+
+  lua_rawgeti( L, LUA_REGISTRYINDEX, s->cache_ref );
+  lua_pushvalue( L, 2 );
+  lua_rawget( L, -2 );
+  if (lua_equal( L, -1, 3 ) && lua_type( L, -1 ) == t)
+    return 0;
+  // a new key, a removed one or a change of type goes in the index
+  if (lua_isnil( L, -1 ) || lua_isnil( L, 3 ) || kv_type( L, -1 ) != kv_type( L, 3 ))
+    s->index_dirty = true;
+  lua_pop( L, 1 );
+  lua_pushvalue( L, 2 );
+  lua_pushvalue( L, 3 );
+  lua_rawset( L, -3 );
+
+  lua_rawgeti( L, LUA_REGISTRYINDEX, s->dirty_ref );
+  lua_pushvalue( L, 2 );
+  lua_pushboolean( L, 1 );
+  lua_rawset( L, -3 );
+
+  if (s->commit_ms == 0) {
+    esp_err_t err = kv_commit( L, s );
+    if (err != ESP_OK)
+      return luaL_error( L, "nvs error 0x%x", (unsigned)err );
+  } else if (!s->armed) {
+    s->armed = true;
+    os_timer_arm( &s->timer, s->commit_ms, 0 );
+  }
+  return 0;
+}
+
+// Lua: ok[, err] = store:commit()
+static int kv_commit_l( lua_State *L )
+{
+  esp_err_t err = kv_commit( L, kv_check( L ) );
+  if (err != ESP_OK)
+    return kv_error( L, err );
+  lua_pushboolean( L, 1 );
+  return 1;
+}
+
+static int kv_next( lua_State *L )
+{
+  luaL_checktype( L, 1, LUA_TTABLE );
+  lua_settop( L, 2 );
+  return lua_next( L, 1 ) ? 2 : 0;
+}
+
+// Lua: for key, value in store:pairs() do ... end
+static int kv_pairs( lua_State *L )
+{
+  kv_store_t *s = kv_check( L );
+  lua_pushcfunction( L, kv_next );
+  lua_rawgeti( L, LUA_REGISTRYINDEX, s->cache_ref );
+  lua_pushnil( L );
+  return 3;
+}
+
+// Lua: ok[, err] = store:erase()
+// Removes every key in the namespace, at once
+static int kv_erase( lua_State *L )
+{
+  kv_store_t *s = kv_check( L );
+  esp_err_t err = nvs_erase_all( s->h );
+  if (err == ESP_OK)
+    err = nvs_commit( s->h );
+  if (err != ESP_OK)
+    return kv_error( L, err );
+  lua_newtable( L );
+  lua_rawseti( L, LUA_REGISTRYINDEX, s->cache_ref );
+  lua_newtable( L );
+  lua_rawseti( L, LUA_REGISTRYINDEX, s->dirty_ref );
+  s->index_dirty = false;
+  lua_pushboolean( L, 1 );
+  return 1;
+}
+
+// Lua: store:close()
+// Writes what is pending first
+static int kv_close( lua_State *L )
+{
+  kv_doclose( L, (kv_store_t *)luaL_checkudata( L, 1, KV_STORE_TABLE ) );
+  return 0;
+}
+
+static const LUA_REG_TYPE kv_store_map[] = {
+  { LSTRKEY( "get" ),     LFUNCVAL( kv_get ) },
+  { LSTRKEY( "set" ),     LFUNCVAL( kv_set ) },
+  { LSTRKEY( "commit" ),  LFUNCVAL( kv_commit_l ) },
+  { LSTRKEY( "pairs" ),   LFUNCVAL( kv_pairs ) },
+  { LSTRKEY( "erase" ),   LFUNCVAL( kv_erase ) },
+  { LSTRKEY( "close" ),   LFUNCVAL( kv_close ) },
+  { LSTRKEY( "__gc" ),    LFUNCVAL( kv_close ) },
+  { LSTRKEY( "__index" ), LROVAL( kv_store_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+// Module function map
+const LUA_REG_TYPE kv_map[] = {
+  { LSTRKEY( "open" ), LFUNCVAL( kv_open ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_kv( lua_State *L )
+{
+  luaL_rometatable( L, KV_STORE_TABLE, (void *)kv_store_map );
+  kv_task = task_get_id( kv_timeout );
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_KVLIBNAME, kv_map );
+  return 1;
+#endif
+}
@@ -21,9 +21,43 @@ extern const LUA_REG_TYPE pwm_map[];
 extern const LUA_REG_TYPE node_map[];
 extern const LUA_REG_TYPE wifi_map[];
 extern const LUA_REG_TYPE net_map[];
+extern const LUA_REG_TYPE http_map[];
 extern const LUA_REG_TYPE file_map[];
 extern const LUA_REG_TYPE tmr_map[];
 extern const LUA_REG_TYPE i2c_map[];
+extern const LUA_REG_TYPE spi_map[];
+extern const LUA_REG_TYPE profiler_map[];
+extern const LUA_REG_TYPE buffer_map[];
+extern const LUA_REG_TYPE asset_map[];
+extern const LUA_REG_TYPE flash_map[];
+extern const LUA_REG_TYPE flashlog_map[];
+extern const LUA_REG_TYPE sched_map[];
+extern const LUA_REG_TYPE coap_map[];
+extern const LUA_REG_TYPE sampler_map[];
+extern const LUA_REG_TYPE ws2812_map[];
+extern const LUA_REG_TYPE adc_map[];
+extern const LUA_REG_TYPE cjson_map[];
+extern const LUA_REG_TYPE msgpack_map[];
+extern const LUA_REG_TYPE crypto_map[];
+extern const LUA_REG_TYPE crc_map[];
+extern const LUA_REG_TYPE dsp_map[];
+extern const LUA_REG_TYPE zlib_map[];
+extern const LUA_REG_TYPE compress_map[];
+extern const LUA_REG_TYPE kv_map[];
+extern const LUA_REG_TYPE cache_map[];
+extern const LUA_REG_TYPE tseries_map[];
+extern const LUA_REG_TYPE bench_map[];
+extern const LUA_REG_TYPE rtctime_map[];
+extern const LUA_REG_TYPE websocket_map[];
+extern const LUA_REG_TYPE rtcmem_map[];
+extern const LUA_REG_TYPE trace_map[];
+extern const LUA_REG_TYPE bridge_map[];
+extern const LUA_REG_TYPE modbus_map[];
+extern const LUA_REG_TYPE pcnt_map[];
+extern const LUA_REG_TYPE i2s_map[];
+extern const LUA_REG_TYPE ble_map[];
+extern const LUA_REG_TYPE mdns_map[];
+extern const LUA_REG_TYPE console_map[];
 extern const LUA_REG_TYPE uart_map[];
 extern const LUA_REG_TYPE utils_map[];
 extern const LUA_REG_TYPE strlib[];
@@ -32,11 +66,20 @@ extern const LUA_REG_TYPE co_funcs[];
 extern const LUA_REG_TYPE math_map[];
 
 
-const luaL_Reg lua_libs[] = {
+// Opened at boot: the core, and modules with no rotable to look them up by
+static const luaL_Reg lua_core_libs[] = {
 	{"base", luaopen_base},
 	{"package", luaopen_package},
 	{"table", luaopen_table},
 	{"string", luaopen_string},
+#ifdef USE_LPEG_MODULE
+	{LUA_LPEGLIBNAME, luaopen_lpeg},
+#endif
+	{NULL, NULL},
+};
+
+// Opened the first time a state looks them up, see luaR_getglobal()
+static const luaL_Reg lua_libs[] = {
 #ifdef USE_GPIO_MODULE
 	{LUA_GPIOLIBNAME, luaopen_gpio},
 #endif
@@ -64,17 +107,116 @@ const luaL_Reg lua_libs[] = {
 #ifdef USE_UTILS_MODULE
 	{LUA_UTILSLIBNAME, luaopen_utils},
 #endif
-#ifdef USE_LPEG_MODULE
-	{LUA_LPEGLIBNAME, luaopen_lpeg},
-#endif
 #ifdef USE_NET_MODULE
 	{LUA_NETLIBNAME, luaopen_net},
 #endif
+#ifdef USE_HTTP_MODULE
+	{LUA_HTTPLIBNAME, luaopen_http},
+#endif
 #ifdef USE_THREAD_MODULE
 	{LUA_THREADLIBNAME, luaopen_thread},
 #endif
 #ifdef USE_MQTT_MODULE
 	{LUA_MQTTLIBNAME, luaopen_mqtt},
+#endif
+#ifdef USE_SPI_MODULE
+	{LUA_SPILIBNAME, luaopen_spi},
+#endif
+#ifdef USE_PROFILER_MODULE
+	{LUA_PROFILERLIBNAME, luaopen_profiler},
+#endif
+#ifdef USE_BUFFER_MODULE
+	{LUA_BUFFERLIBNAME, luaopen_buffer},
+#endif
+#ifdef USE_ASSET_MODULE
+	{LUA_ASSETLIBNAME, luaopen_asset},
+#endif
+#ifdef USE_FLASH_MODULE
+	{LUA_FLASHLIBNAME, luaopen_flash},
+#endif
+#ifdef USE_FLASHLOG_MODULE
+	{LUA_FLASHLOGLIBNAME, luaopen_flashlog},
+#endif
+#ifdef USE_SCHED_MODULE
+	{LUA_SCHEDLIBNAME, luaopen_sched},
+#endif
+#ifdef USE_COAP_MODULE
+	{LUA_COAPLIBNAME, luaopen_coap},
+#endif
+#ifdef USE_SAMPLER_MODULE
+	{LUA_SAMPLERLIBNAME, luaopen_sampler},
+#endif
+#ifdef USE_WS2812_MODULE
+	{LUA_WS2812LIBNAME, luaopen_ws2812},
+#endif
+#ifdef USE_ADC_MODULE
+	{LUA_ADCLIBNAME, luaopen_adc},
+#endif
+#ifdef USE_CJSON_MODULE
+	{LUA_CJSONLIBNAME, luaopen_cjson},
+#endif
+#ifdef USE_MSGPACK_MODULE
+	{LUA_MSGPACKLIBNAME, luaopen_msgpack},
+#endif
+#ifdef USE_CRYPTO_MODULE
+	{LUA_CRYPTOLIBNAME, luaopen_crypto},
+#endif
+#ifdef USE_CRC_MODULE
+	{LUA_CRCLIBNAME, luaopen_crc},
+#endif
+#ifdef USE_DSP_MODULE
+	{LUA_DSPLIBNAME, luaopen_dsp},
+#endif
+#ifdef USE_ZLIB_MODULE
+	{LUA_ZLIBLIBNAME, luaopen_zlib},
+#endif
+#ifdef USE_COMPRESS_MODULE
+	{LUA_COMPRESSLIBNAME, luaopen_compress},
+#endif
+#ifdef USE_KV_MODULE
+	{LUA_KVLIBNAME, luaopen_kv},
+#endif
+#ifdef USE_CACHE_MODULE
+	{LUA_CACHELIBNAME, luaopen_cache},
+#endif
+#ifdef USE_TSERIES_MODULE
+	{LUA_TSERIESLIBNAME, luaopen_tseries},
+#endif
+#ifdef USE_BENCH_MODULE
+	{LUA_BENCHLIBNAME, luaopen_bench},
+#endif
+#ifdef USE_RTCTIME_MODULE
+	{LUA_RTCTIMELIBNAME, luaopen_rtctime},
+#endif
+#ifdef USE_WEBSOCKET_MODULE
+	{LUA_WEBSOCKETLIBNAME, luaopen_websocket},
+#endif
+#ifdef USE_RTCMEM_MODULE
+	{LUA_RTCMEMLIBNAME, luaopen_rtcmem},
+#endif
+#ifdef USE_TRACE_MODULE
+	{LUA_TRACELIBNAME, luaopen_trace},
+#endif
+#ifdef USE_BRIDGE_MODULE
+	{LUA_BRIDGELIBNAME, luaopen_bridge},
+#endif
+#ifdef USE_MODBUS_MODULE
+	{LUA_MODBUSLIBNAME, luaopen_modbus},
+#endif
+#ifdef USE_PCNT_MODULE
+	{LUA_PCNTLIBNAME, luaopen_pcnt},
+#endif
+#ifdef USE_I2S_MODULE
+	{LUA_I2SLIBNAME, luaopen_i2s},
+#endif
+#ifdef USE_BLE_MODULE
+	{LUA_BLELIBNAME, luaopen_ble},
+#endif
+#ifdef USE_MDNS_MODULE
+	{LUA_MDNSLIBNAME, luaopen_mdns},
+#endif
+#ifdef USE_CONSOLE_MODULE
+	{LUA_CONSOLELIBNAME, luaopen_console},
 #endif
 	{NULL, NULL},
 };
@@ -83,7 +225,7 @@ const luaR_table lua_rotable[] =
 {
 	{LUA_TABLIBNAME, tab_funcs},
     {LUA_STRLIBNAME, strlib},
-	//{LUA_COLIBNAME, co_funcs},
+	{LUA_COLIBNAME, co_funcs},
 	//{LUA_MATHLIBNAME, math_map},
 #ifdef USE_GPIO_MODULE
 	{LUA_GPIOLIBNAME, gpio_map},
@@ -115,27 +257,139 @@ const luaR_table lua_rotable[] =
 #ifdef USE_NET_MODULE
 	{LUA_NETLIBNAME, net_map},
 #endif
+#ifdef USE_HTTP_MODULE
+	{LUA_HTTPLIBNAME, http_map},
+#endif
 #ifdef USE_THREAD_MODULE
 	{LUA_THREADLIBNAME, thread_map},
 #endif
 #ifdef USE_MQTT_MODULE
 	{LUA_MQTTLIBNAME, mqtt_map},
+#endif
+#ifdef USE_SPI_MODULE
+	{LUA_SPILIBNAME, spi_map},
+#endif
+#ifdef USE_PROFILER_MODULE
+	{LUA_PROFILERLIBNAME, profiler_map},
+#endif
+#ifdef USE_BUFFER_MODULE
+	{LUA_BUFFERLIBNAME, buffer_map},
+#endif
+#ifdef USE_ASSET_MODULE
+	{LUA_ASSETLIBNAME, asset_map},
+#endif
+#ifdef USE_FLASH_MODULE
+	{LUA_FLASHLIBNAME, flash_map},
+#endif
+#ifdef USE_FLASHLOG_MODULE
+	{LUA_FLASHLOGLIBNAME, flashlog_map},
+#endif
+#ifdef USE_SCHED_MODULE
+	{LUA_SCHEDLIBNAME, sched_map},
+#endif
+#ifdef USE_COAP_MODULE
+	{LUA_COAPLIBNAME, coap_map},
+#endif
+#ifdef USE_SAMPLER_MODULE
+	{LUA_SAMPLERLIBNAME, sampler_map},
+#endif
+#ifdef USE_WS2812_MODULE
+	{LUA_WS2812LIBNAME, ws2812_map},
+#endif
+#ifdef USE_ADC_MODULE
+	{LUA_ADCLIBNAME, adc_map},
+#endif
+#ifdef USE_CJSON_MODULE
+	{LUA_CJSONLIBNAME, cjson_map},
+#endif
+#ifdef USE_MSGPACK_MODULE
+	{LUA_MSGPACKLIBNAME, msgpack_map},
+#endif
+#ifdef USE_CRYPTO_MODULE
+	{LUA_CRYPTOLIBNAME, crypto_map},
+#endif
+#ifdef USE_CRC_MODULE
+	{LUA_CRCLIBNAME, crc_map},
+#endif
+#ifdef USE_DSP_MODULE
+	{LUA_DSPLIBNAME, dsp_map},
+#endif
+#ifdef USE_ZLIB_MODULE
+	{LUA_ZLIBLIBNAME, zlib_map},
+#endif
+#ifdef USE_COMPRESS_MODULE
+	{LUA_COMPRESSLIBNAME, compress_map},
+#endif
+#ifdef USE_KV_MODULE
+	{LUA_KVLIBNAME, kv_map},
+#endif
+#ifdef USE_CACHE_MODULE
+	{LUA_CACHELIBNAME, cache_map},
+#endif
+#ifdef USE_TSERIES_MODULE
+	{LUA_TSERIESLIBNAME, tseries_map},
+#endif
+#ifdef USE_BENCH_MODULE
+	{LUA_BENCHLIBNAME, bench_map},
+#endif
+#ifdef USE_RTCTIME_MODULE
+	{LUA_RTCTIMELIBNAME, rtctime_map},
+#endif
+#ifdef USE_WEBSOCKET_MODULE
+	{LUA_WEBSOCKETLIBNAME, websocket_map},
+#endif
+#ifdef USE_RTCMEM_MODULE
+	{LUA_RTCMEMLIBNAME, rtcmem_map},
+#endif
+#ifdef USE_TRACE_MODULE
+	{LUA_TRACELIBNAME, trace_map},
+#endif
+#ifdef USE_BRIDGE_MODULE
+	{LUA_BRIDGELIBNAME, bridge_map},
+#endif
+#ifdef USE_MODBUS_MODULE
+	{LUA_MODBUSLIBNAME, modbus_map},
+#endif
+#ifdef USE_PCNT_MODULE
+	{LUA_PCNTLIBNAME, pcnt_map},
+#endif
+#ifdef USE_I2S_MODULE
+	{LUA_I2SLIBNAME, i2s_map},
+#endif
+#ifdef USE_BLE_MODULE
+	{LUA_BLELIBNAME, ble_map},
+#endif
+#ifdef USE_MDNS_MODULE
+	{LUA_MDNSLIBNAME, mdns_map},
+#endif
+#ifdef USE_CONSOLE_MODULE
+	{LUA_CONSOLELIBNAME, console_map},
 #endif
 	{NULL, NULL}
 };
 
+// luaR_getglobal() keeps a bit for each entry
+typedef char lua_rotable_fits[sizeof(lua_rotable) / sizeof(lua_rotable[0]) - 1 <= LUA_MAX_ROTABLES ? 1 : -1];
+
 void luaL_openlibs (lua_State *L) {
-  const luaL_Reg *lib = lua_libs;
+  const luaL_Reg *lib = lua_core_libs;
   for (; lib->name; lib++) {
 	os_printf("load lib: %s\n", lib->name);
-    if (lib->func)
-    {
+    lua_pushcfunction(L, lib->func);
+    lua_pushstring(L, lib->name);
+    lua_call(L, 1, 0);
+  }
+}
+
+// Runs the luaopen_ function of a module, if it has one, as lua_pcall() does
+int luaL_openlazy (lua_State *L, const char *name) {
+  const luaL_Reg *lib = lua_libs;
+  for (; lib->name; lib++) {
+    if (!c_strcmp(lib->name, name)) {
       lua_pushcfunction(L, lib->func);
       lua_pushstring(L, lib->name);
-      lua_call(L, 1, 0);
+      return lua_pcall(L, 1, 0, 0);
     }
   }
-  os_printf("other libs:\n");
-
-	//luaopen_pwm(L);
+  return 0;
 }
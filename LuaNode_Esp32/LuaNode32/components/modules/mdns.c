@@ -0,0 +1,1272 @@
+// Module for mDNS: answering for our .local name and services, and
+// resolving and browsing other devices' with a cache
+//
+// Every mDNS response heard is parsed in lwIP's task. Addresses go into
+// net's DNS cache with their record TTLs, so net lookups of .local names
+// find them, and service records go into a cache of our own. Browsing a
+// service type asks the network once; after that the answer comes from
+// the cache for as long as the records live, kept current by the
+// announcements and goodbyes devices multicast anyway. Queries carry the
+// answers already known, so devices that are cached stay quiet.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "platform.h"
+#include "net.h"
+#include "ip_fmt.h"
+#include "task/task.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "tcpip_adapter.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "lwip/ip_addr.h"
+#include "lwip/udp.h"
+#include "lwip/igmp.h"
+
+#define MDNS_PORT             5353
+#define MDNS_LABEL_MAX        63
+#define MDNS_TYPE_MAX         32      // "_http._tcp"
+#define MDNS_NAME_MAX         (MDNS_LABEL_MAX + MDNS_TYPE_MAX + 8)
+#define MDNS_TXT_MAX          96
+#define MDNS_MAX_SERVICES     4
+#define MDNS_PKT_MAX          512     // what we send
+#define MDNS_PKT_IN_MAX       1460
+
+#define MDNS_TTL_HOST         120     // for A and SRV records, RFC 6762 10
+#define MDNS_TTL_OTHER        4500
+#define MDNS_TTL_LEGACY       10      // answers to plain DNS resolvers
+
+#define MDNS_TICK_MS          250
+#define MDNS_RESOLVE_MS       1500
+#define MDNS_RETRY_MS         500
+#define MDNS_BROWSE_MS        1000
+#define MDNS_EMPTY_FRESH_MS   10000   // a browse that found nothing
+#define MDNS_ANNOUNCE         2       // times, a second apart
+#define MDNS_BROWSED          4       // service types remembered as asked
+
+#define DNS_TYPE_A            1
+#define DNS_TYPE_PTR          12
+#define DNS_TYPE_TXT          16
+#define DNS_TYPE_SRV          33
+#define DNS_TYPE_ANY          255
+#define DNS_CLASS_IN          1
+#define DNS_CLASS_FLUSH       0x8000  // in answers: the record replaces others
+#define DNS_QU                0x8000  // in questions: answer by unicast
+
+#define MDNS_ENUM             "_services._dns-sd._udp.local"
+
+typedef struct {
+  char type[MDNS_TYPE_MAX];       // empty when unused
+  char name[MDNS_LABEL_MAX + 1];
+  uint16_t port;
+  uint8_t txt_len;
+  uint8_t txt[MDNS_TXT_MAX];
+} mdns_service_t;
+
+// Another device's service instance, from whichever of its PTR, SRV and
+// TXT records have been heard
+typedef struct {
+  char type[MDNS_TYPE_MAX];       // empty when unused
+  char name[MDNS_LABEL_MAX + 1];
+  char host[MDNS_LABEL_MAX + 1];  // without .local, empty until the SRV
+  uint16_t port;
+  uint8_t txt_len;
+  uint8_t txt[MDNS_TXT_MAX];
+  TickType_t ttl;
+  TickType_t expires;
+} mdns_cached_t;
+
+typedef struct {
+  char type[MDNS_TYPE_MAX];
+  TickType_t until;               // answered from the cache till then
+} mdns_browsed_t;
+
+// A resolve or browse waiting on the network
+typedef struct mdns_pending {
+  struct mdns_pending *next;
+  bool browse;
+  bool answered;                  // set from lwIP's task
+  ip_addr_t addr;
+  char name[MDNS_NAME_MAX];       // host.local, or the service type
+  dns_found_callback found;       // for net's lookups, else cb_ref
+  void *arg;
+  int cb_ref;
+  TickType_t start;
+  uint32_t wait_ms;
+  uint8_t sent;
+} mdns_pending_t;
+
+// Our records a question asks for; bits are per service
+typedef struct {
+  bool a, enumerate;
+  uint8_t ptr, srv, txt;
+} mdns_want_t;
+
+typedef struct {
+  uint8_t *p;
+  int len, cap;
+  uint16_t an, ar;
+} mdns_w_t;
+
+static struct udp_pcb *mdns_pcb;
+static bool mdns_joined;
+static ip_addr_t mdns_group;
+
+// Responder state and the pending list, written on the Lua task and read
+// in lwIP's; the cache, written in lwIP's task and read on the Lua task
+static portMUX_TYPE mdns_mux = portMUX_INITIALIZER_UNLOCKED;
+static char mdns_host[MDNS_LABEL_MAX + 1];
+static mdns_service_t mdns_services[MDNS_MAX_SERVICES];
+static mdns_pending_t *mdns_pending;
+static mdns_cached_t mdns_cache[CONFIG_MDNS_CACHE_SIZE];
+
+// Lua task only
+static mdns_browsed_t mdns_browsed[MDNS_BROWSED];
+static uint8_t mdns_announce_left;
+static TickType_t mdns_announce_due;
+static uint8_t mdns_qbuf[MDNS_PKT_MAX];
+static os_timer_t mdns_timer;
+static bool mdns_ticking;
+static task_handle_t mdns_tick_task;
+
+// lwIP's task only
+static uint8_t mdns_in[MDNS_PKT_IN_MAX];
+static uint8_t mdns_out[MDNS_PKT_MAX];
+
+static struct {
+  uint32_t queries, answered, suppressed, hits, misses;
+} mdns_stats;
+
+static TickType_t ms_ticks( uint32_t ms )
+{
+  return ms / portTICK_PERIOD_MS;
+}
+
+// --- Names and records
+
+// The name at off as dotted labels into out; returns the offset past it
+// in the packet, or -1 if it is malformed or too long
+static int mdns_read_name( const uint8_t *pkt, int len, int off, char *out, int cap )
+{
+  int end = -1, n = 0, jumps = 0;
+  for (;;) {
+    if (off >= len)
+      return -1;
+    uint8_t l = pkt[off];
+    if ((l & 0xc0) == 0xc0) {
+      if (off + 1 >= len || ++jumps > 16)
+        return -1;
+      if (end < 0)
+        end = off + 2;
+      off = (l & 0x3f) << 8 | pkt[off + 1];
+      continue;
+    }
+    if (l & 0xc0)
+      return -1;
+    off++;
+    if (!l)
+      break;
+    if (off + l > len || n + l + 2 > cap)
+      return -1;
+    if (n)
+      out[n++] = '.';
+    memcpy( out + n, pkt + off, l );
+    n += l;
+    off += l;
+  }
+  out[n] = 0;
+  return end < 0 ? off : end;
+}
+
+static uint16_t get16( const uint8_t *p )
+{
+  return p[0] << 8 | p[1];
+}
+
+static uint32_t get32( const uint8_t *p )
+{
+  return (uint32_t)get16( p ) << 16 | get16( p + 2 );
+}
+
+// Writes past cap are counted but not made, so w->len > w->cap tells
+static void put( mdns_w_t *w, const void *d, int n )
+{
+  if (w->len + n <= w->cap)
+    memcpy( w->p + w->len, d, n );
+  w->len += n;
+}
+
+static void put16( mdns_w_t *w, uint16_t v )
+{
+  uint8_t b[2] = { v >> 8, v };
+  put( w, b, 2 );
+}
+
+static void put32( mdns_w_t *w, uint32_t v )
+{
+  put16( w, v >> 16 );
+  put16( w, v );
+}
+
+static void put_label( mdns_w_t *w, const char *s, int n )
+{
+  uint8_t l = n;
+  put( w, &l, 1 );
+  put( w, s, n );
+}
+
+// label, which may hold dots, then the dotted name
+static void put_name( mdns_w_t *w, const char *label, const char *dotted )
+{
+  if (label)
+    put_label( w, label, strlen( label ) );
+  while (*dotted) {
+    const char *dot = strchr( dotted, '.' );
+    int n = dot ? dot - dotted : (int)strlen( dotted );
+    put_label( w, dotted, n );
+    dotted += n + (dot != NULL);
+  }
+  put( w, "", 1 );
+}
+
+// Name, type, class and TTL; returns where the data length goes
+static int put_rr( mdns_w_t *w, const char *label, const char *dotted,
+                   uint16_t type, bool unique, uint32_t ttl )
+{
+  put_name( w, label, dotted );
+  put16( w, type );
+  put16( w, DNS_CLASS_IN | (unique ? DNS_CLASS_FLUSH : 0) );
+  put32( w, ttl );
+  put16( w, 0 );
+  return w->len - 2;
+}
+
+static void end_rr( mdns_w_t *w, int at )
+{
+  if (at + 2 <= w->cap) {
+    uint16_t n = w->len - at - 2;
+    w->p[at] = n >> 8;
+    w->p[at + 1] = n;
+  }
+}
+
+// Our address, the station's if it has one
+static uint32_t mdns_my_ip( void )
+{
+  tcpip_adapter_ip_info_t info;
+  if (tcpip_adapter_get_ip_info( TCPIP_ADAPTER_IF_STA, &info ) == ESP_OK && info.ip.addr)
+    return info.ip.addr;
+  if (tcpip_adapter_get_ip_info( TCPIP_ADAPTER_IF_AP, &info ) == ESP_OK)
+    return info.ip.addr;
+  return 0;
+}
+
+// Our records in want into w, answers first then those that go with
+// them. ttl_cap limits TTLs, 0 for goodbyes. Called with mdns_mux held.
+static void mdns_put_records( mdns_w_t *w, mdns_want_t want, uint32_t ip, uint32_t ttl_cap )
+{
+  char host[MDNS_LABEL_MAX + 8];
+  char type[MDNS_TYPE_MAX + 8];
+  uint32_t ttl_host = MDNS_TTL_HOST < ttl_cap ? MDNS_TTL_HOST : ttl_cap;
+  uint32_t ttl_other = MDNS_TTL_OTHER < ttl_cap ? MDNS_TTL_OTHER : ttl_cap;
+  snprintf( host, sizeof(host), "%s.local", mdns_host );
+
+  mdns_want_t extra = { 0 };
+  for (int pass = 0; pass < 2; pass++) {
+    mdns_want_t *r = pass ? &extra : &want;
+    uint16_t *count = pass ? &w->ar : &w->an;
+    for (int i = 0; i < MDNS_MAX_SERVICES; i++) {
+      mdns_service_t *s = &mdns_services[i];
+      uint8_t bit = 1 << i;
+      if (!s->type[0])
+        continue;
+      snprintf( type, sizeof(type), "%s.local", s->type );
+      if (want.enumerate && !pass) {
+        int at = put_rr( w, NULL, MDNS_ENUM, DNS_TYPE_PTR, false, ttl_other );
+        put_name( w, NULL, type );
+        end_rr( w, at );
+        (*count)++;
+      }
+      if (r->ptr & bit) {
+        int at = put_rr( w, NULL, type, DNS_TYPE_PTR, false, ttl_other );
+        put_name( w, s->name, type );
+        end_rr( w, at );
+        (*count)++;
+        extra.srv |= bit & ~want.srv;
+        extra.txt |= bit & ~want.txt;
+      }
+      if (r->srv & bit) {
+        int at = put_rr( w, s->name, type, DNS_TYPE_SRV, true, ttl_host );
+        put16( w, 0 );
+        put16( w, 0 );
+        put16( w, s->port );
+        put_name( w, NULL, host );
+        end_rr( w, at );
+        (*count)++;
+        extra.a |= !want.a;
+      }
+      if (r->txt & bit) {
+        int at = put_rr( w, s->name, type, DNS_TYPE_TXT, true, ttl_other );
+        if (s->txt_len)
+          put( w, s->txt, s->txt_len );
+        else
+          put( w, "", 1 );
+        end_rr( w, at );
+        (*count)++;
+      }
+    }
+    if (r->a && ip) {
+      int at = put_rr( w, NULL, host, DNS_TYPE_A, true, ttl_host );
+      put( w, &ip, 4 );
+      end_rr( w, at );
+      (*count)++;
+    }
+  }
+}
+
+static void mdns_header( mdns_w_t *w, uint8_t *buf, uint16_t id, uint16_t flags )
+{
+  w->p = buf;
+  w->cap = MDNS_PKT_MAX;
+  w->len = 0;
+  w->an = w->ar = 0;
+  put16( w, id );
+  put16( w, flags );
+  put32( w, 0 );
+  put32( w, 0 );
+}
+
+// Counts in; returns whether it all fit
+static bool mdns_finish( mdns_w_t *w, uint16_t qd, uint16_t an, uint16_t ar )
+{
+  if (w->len > w->cap)
+    return false;
+  uint8_t *p = w->p;
+  p[4] = qd >> 8; p[5] = qd;
+  p[6] = an >> 8; p[7] = an;
+  p[10] = ar >> 8; p[11] = ar;
+  return true;
+}
+
+static void mdns_send( const uint8_t *pkt, int len, const ip_addr_t *ip, uint16_t port )
+{
+  struct pbuf *pb = pbuf_alloc( PBUF_TRANSPORT, len, PBUF_RAM );
+  if (!pb)
+    return;         // as good as lost on the way
+  pbuf_take( pb, pkt, len );
+  udp_sendto( mdns_pcb, pb, ip ? ip : &mdns_group, port );
+  pbuf_free( pb );
+}
+
+// --- Answering, in lwIP's task
+
+static bool name_is( const char *name, const char *label, const char *dotted )
+{
+  if (label) {
+    size_t l = strlen( label );
+    if (strncasecmp( name, label, l ) || name[l] != '.')
+      return false;
+    name += l + 1;
+  }
+  return !strcasecmp( name, dotted );
+}
+
+// Which of our records the question name and type ask for
+static void mdns_wanted( mdns_want_t *want, const char *qname, uint16_t qtype )
+{
+  char type[MDNS_TYPE_MAX + 8];
+  bool any = qtype == DNS_TYPE_ANY;
+  if (name_is( qname, mdns_host, "local" ) && (any || qtype == DNS_TYPE_A))
+    want->a = true;
+  if (!strcasecmp( qname, MDNS_ENUM ) && (any || qtype == DNS_TYPE_PTR))
+    want->enumerate = true;
+  for (int i = 0; i < MDNS_MAX_SERVICES; i++) {
+    mdns_service_t *s = &mdns_services[i];
+    if (!s->type[0])
+      continue;
+    snprintf( type, sizeof(type), "%s.local", s->type );
+    if (!strcasecmp( qname, type ) && (any || qtype == DNS_TYPE_PTR))
+      want->ptr |= 1 << i;
+    if (name_is( qname, s->name, type )) {
+      if (any || qtype == DNS_TYPE_SRV)
+        want->srv |= 1 << i;
+      if (any || qtype == DNS_TYPE_TXT)
+        want->txt |= 1 << i;
+    }
+  }
+}
+
+// Known answer suppression: PTRs the asker already holds for at least half
+// their TTL aren't sent again
+static void mdns_known( mdns_want_t *want, const char *owner, const char *target, uint32_t ttl )
+{
+  char type[MDNS_TYPE_MAX + 8];
+  if (ttl < MDNS_TTL_OTHER / 2)
+    return;
+  for (int i = 0; i < MDNS_MAX_SERVICES; i++) {
+    mdns_service_t *s = &mdns_services[i];
+    if (!s->type[0] || !(want->ptr & 1 << i))
+      continue;
+    snprintf( type, sizeof(type), "%s.local", s->type );
+    if (!strcasecmp( owner, type ) && name_is( target, s->name, type )) {
+      want->ptr &= ~(1 << i);
+      mdns_stats.suppressed++;
+    }
+  }
+}
+
+static void mdns_query_in( const uint8_t *pkt, int len, const ip_addr_t *src, u16_t port )
+{
+  char qname[MDNS_NAME_MAX], target[MDNS_NAME_MAX];
+  mdns_want_t want = { 0 };
+  bool unicast = false;
+  int qd = get16( pkt + 4 ), an = get16( pkt + 6 ), off = 12;
+
+  if (!mdns_host[0])
+    return;
+  portENTER_CRITICAL( &mdns_mux );
+  for (int i = 0; i < qd && off >= 0; i++) {
+    off = mdns_read_name( pkt, len, off, qname, sizeof(qname) );
+    if (off < 0 || off + 4 > len) {
+      off = -1;
+      break;
+    }
+    unicast |= (get16( pkt + off + 2 ) & DNS_QU) != 0;
+    mdns_wanted( &want, qname, get16( pkt + off ) );
+    off += 4;
+  }
+  int qend = off;
+  for (int i = 0; i < an && off >= 0; i++) {
+    off = mdns_read_name( pkt, len, off, qname, sizeof(qname) );
+    if (off < 0 || off + 10 > len)
+      break;
+    uint16_t type = get16( pkt + off ), rdlen = get16( pkt + off + 8 );
+    uint32_t ttl = get32( pkt + off + 4 );
+    off += 10;
+    if (off + rdlen > len)
+      break;
+    if (type == DNS_TYPE_PTR &&
+        mdns_read_name( pkt, len, off, target, sizeof(target) ) >= 0)
+      mdns_known( &want, qname, target, ttl );
+    off += rdlen;
+  }
+  portEXIT_CRITICAL( &mdns_mux );
+  if (qend < 0 || !(want.a || want.enumerate || want.ptr || want.srv || want.txt))
+    return;
+
+  // Plain DNS resolvers asking port 5353 directly get a unicast DNS answer,
+  // with their ID and questions, and short TTLs
+  bool legacy = port != MDNS_PORT;
+  uint32_t ip = mdns_my_ip();
+  mdns_w_t w;
+  mdns_header( &w, mdns_out, legacy ? get16( pkt ) : 0, 0x8400 );
+  if (legacy)
+    put( &w, pkt + 12, qend - 12 );  // any names it points to are there too
+  portENTER_CRITICAL( &mdns_mux );
+  mdns_put_records( &w, want, ip, legacy ? MDNS_TTL_LEGACY : MDNS_TTL_OTHER );
+  portEXIT_CRITICAL( &mdns_mux );
+  if (!w.an || !mdns_finish( &w, legacy ? qd : 0, w.an, w.ar ))
+    return;
+  mdns_send( mdns_out, w.len, legacy || unicast ? src : NULL, port );
+  mdns_stats.answered++;
+}
+
+// --- Learning from responses, in lwIP's task
+
+static int mdns_local_strip( char *name )
+{
+  size_t l = strlen( name );
+  if (l > 6 && !strcasecmp( name + l - 6, ".local" )) {
+    name[l - 6] = 0;
+    return 1;
+  }
+  return 0;
+}
+
+// "Kitchen lamp._http._tcp.local" into its instance label and type; the
+// type is the last two labels before .local, the label may hold dots
+static bool mdns_split( char *full, char **label, char **type )
+{
+  if (!mdns_local_strip( full ))
+    return false;
+  char *t = strrchr( full, '.' );
+  if (!t || t == full)
+    return false;
+  *t = 0;
+  char *u = strrchr( full, '.' );
+  *t = '.';
+  if (!u || u - full > MDNS_LABEL_MAX || strlen( u + 1 ) >= MDNS_TYPE_MAX)
+    return false;
+  *u = 0;
+  *label = full;
+  *type = u + 1;
+  return true;
+}
+
+// The cache entry for the instance, made if need be. Called with mdns_mux
+// held.
+static mdns_cached_t *mdns_cache_entry( const char *type, const char *label, bool make )
+{
+  mdns_cached_t *free_slot = NULL, *soonest = NULL;
+  TickType_t now = xTaskGetTickCount();
+  for (int i = 0; i < CONFIG_MDNS_CACHE_SIZE; i++) {
+    mdns_cached_t *c = &mdns_cache[i];
+    if (c->type[0] && (int32_t)(c->expires - now) <= 0)
+      c->type[0] = 0;
+    if (!c->type[0]) {
+      if (!free_slot)
+        free_slot = c;
+      continue;
+    }
+    if (!strcasecmp( c->type, type ) && !strcasecmp( c->name, label ))
+      return c;
+    if (!soonest || (int32_t)(c->expires - soonest->expires) < 0)
+      soonest = c;
+  }
+  if (!make)
+    return NULL;
+  mdns_cached_t *c = free_slot ? free_slot : soonest;
+  memset( c, 0, sizeof(*c) );
+  strcpy( c->type, type );
+  strcpy( c->name, label );
+  return c;
+}
+
+static void mdns_cache_ttl( mdns_cached_t *c, uint32_t ttl )
+{
+  TickType_t t = ms_ticks( ttl * 1000 ), expires = xTaskGetTickCount() + t;
+  if (!c->ttl || (int32_t)(expires - c->expires) > 0) {
+    c->ttl = t;
+    c->expires = expires;
+  }
+}
+
+static void mdns_learn_a( const char *name, const uint8_t *rd, uint32_t ttl )
+{
+  ip_addr_t addr;
+  IP_ADDR4( &addr, rd[0], rd[1], rd[2], rd[3] );
+  net_dns_cache_put( name, &addr, ttl );
+  if (!ttl)
+    return;
+  bool hit = false;
+  portENTER_CRITICAL( &mdns_mux );
+  for (mdns_pending_t *p = mdns_pending; p; p = p->next)
+    if (!p->browse && !p->answered && !strcasecmp( p->name, name )) {
+      p->addr = addr;
+      p->answered = hit = true;
+    }
+  portEXIT_CRITICAL( &mdns_mux );
+  if (hit)
+    task_post_coalesced_low( mdns_tick_task, 0 );
+}
+
+static void mdns_learn( const uint8_t *pkt, int len, int off, uint16_t type,
+                        char *owner, uint32_t ttl, int rdlen )
+{
+  char target[MDNS_NAME_MAX];
+  const uint8_t *rd = pkt + off;
+  char *label, *stype;
+
+  if (type == DNS_TYPE_A && rdlen == 4) {
+    mdns_learn_a( owner, rd, ttl );
+    return;
+  }
+  if (type == DNS_TYPE_PTR) {
+    if (!strcasecmp( owner, MDNS_ENUM ) ||
+        mdns_read_name( pkt, len, off, target, sizeof(target) ) < 0)
+      return;
+    owner = target;
+  } else if (type != DNS_TYPE_SRV && type != DNS_TYPE_TXT) {
+    return;
+  }
+  if (!mdns_split( owner, &label, &stype ))
+    return;
+
+  portENTER_CRITICAL( &mdns_mux );
+  mdns_cached_t *c = mdns_cache_entry( stype, label, ttl != 0 );
+  if (c && !ttl) {
+    c->type[0] = 0;         // a goodbye
+  } else if (c) {
+    if (type == DNS_TYPE_PTR) {
+      mdns_cache_ttl( c, ttl );
+    } else if (type == DNS_TYPE_SRV && rdlen > 6) {
+      if (mdns_read_name( pkt, len, off + 6, target, sizeof(target) ) >= 0 &&
+          mdns_local_strip( target ) && strlen( target ) <= MDNS_LABEL_MAX) {
+        strcpy( c->host, target );
+        c->port = get16( rd + 4 );
+      }
+      mdns_cache_ttl( c, ttl );
+    } else if (type == DNS_TYPE_TXT) {
+      c->txt_len = rdlen <= MDNS_TXT_MAX ? rdlen : 0;
+      memcpy( c->txt, rd, c->txt_len );
+      mdns_cache_ttl( c, ttl );
+    }
+  }
+  portEXIT_CRITICAL( &mdns_mux );
+}
+
+static void mdns_response_in( const uint8_t *pkt, int len )
+{
+  char owner[MDNS_NAME_MAX];
+  int off = 12, qd = get16( pkt + 4 );
+  int rrs = get16( pkt + 6 ) + get16( pkt + 8 ) + get16( pkt + 10 );
+  for (int i = 0; i < qd && off >= 0; i++) {
+    off = mdns_read_name( pkt, len, off, owner, sizeof(owner) );
+    off = off < 0 ? -1 : off + 4;
+  }
+  for (int i = 0; i < rrs && off >= 0 && off < len; i++) {
+    off = mdns_read_name( pkt, len, off, owner, sizeof(owner) );
+    if (off < 0 || off + 10 > len)
+      return;
+    uint16_t type = get16( pkt + off ), rdlen = get16( pkt + off + 8 );
+    uint32_t ttl = get32( pkt + off + 4 );
+    off += 10;
+    if (off + rdlen > len)
+      return;
+    mdns_learn( pkt, len, off, type, owner, ttl, rdlen );
+    off += rdlen;
+  }
+}
+
+static void mdns_recv_cb( void *arg, struct udp_pcb *pcb, struct pbuf *p,
+                          const ip_addr_t *addr, u16_t port )
+{
+  int len = p->tot_len;
+  if (len >= 12 && len <= MDNS_PKT_IN_MAX) {
+    pbuf_copy_partial( p, mdns_in, len, 0 );
+    if (mdns_in[2] & 0x80)
+      mdns_response_in( mdns_in, len );
+    else if (!(mdns_in[2] & 0x78))     // a standard query
+      mdns_query_in( mdns_in, len, addr, port );
+  }
+  pbuf_free( p );
+}
+
+// --- Asking, on the Lua task
+
+// The port, opened on first use; joining the group is tried again each
+// time until WiFi lets it happen
+static bool mdns_open( void )
+{
+  if (!mdns_pcb) {
+    IP_ADDR4( &mdns_group, 224, 0, 0, 251 );
+    mdns_pcb = udp_new();
+    if (!mdns_pcb)
+      return false;
+    if (udp_bind( mdns_pcb, IP_ADDR_ANY, MDNS_PORT ) != ERR_OK) {
+      udp_remove( mdns_pcb );
+      mdns_pcb = NULL;
+      return false;
+    }
+    udp_set_multicast_ttl( mdns_pcb, 255 );
+    udp_recv( mdns_pcb, mdns_recv_cb, NULL );
+  }
+  if (!mdns_joined) {
+    ip4_addr_t any;
+    ip4_addr_set_any( &any );
+    mdns_joined = igmp_joingroup( &any, ip_2_ip4( &mdns_group ) ) == ERR_OK;
+  }
+  return true;
+}
+
+static void mdns_timer_cb( void *arg )
+{
+  task_post_coalesced_low( mdns_tick_task, 0 );
+}
+
+static void mdns_tick_start( void )
+{
+  if (!mdns_ticking) {
+    os_timer_arm( &mdns_timer, MDNS_TICK_MS, 1 );
+    mdns_ticking = true;
+  }
+}
+
+// A question for name, with the service instances already cached when it
+// asks for a type
+static void mdns_ask( const char *name, uint16_t type )
+{
+  char owner[MDNS_TYPE_MAX + 8];
+  mdns_w_t w;
+  uint16_t an = 0;
+  TickType_t now = xTaskGetTickCount();
+
+  mdns_header( &w, mdns_qbuf, 0, 0 );
+  put_name( &w, NULL, name );
+  put16( &w, type );
+  put16( &w, DNS_CLASS_IN );
+  if (type == DNS_TYPE_PTR) {
+    snprintf( owner, sizeof(owner), "%s", name );
+    mdns_local_strip( owner );
+    portENTER_CRITICAL( &mdns_mux );
+    for (int i = 0; i < CONFIG_MDNS_CACHE_SIZE; i++) {
+      mdns_cached_t *c = &mdns_cache[i];
+      int32_t left = c->expires - now;
+      // Only those good for over half their TTL, RFC 6762 7.1
+      if (!c->type[0] || strcasecmp( c->type, owner ) || left <= (int32_t)c->ttl / 2)
+        continue;
+      int at = put_rr( &w, NULL, name, DNS_TYPE_PTR, false, left * portTICK_PERIOD_MS / 1000 );
+      put_name( &w, c->name, name );
+      end_rr( &w, at );
+      if (w.len > w.cap)
+        break;
+      an++;
+    }
+    portEXIT_CRITICAL( &mdns_mux );
+  }
+  // Known answers that didn't fit are left out; the question goes anyway
+  if (w.len > w.cap) {
+    mdns_header( &w, mdns_qbuf, 0, 0 );
+    put_name( &w, NULL, name );
+    put16( &w, type );
+    put16( &w, DNS_CLASS_IN );
+    an = 0;
+  }
+  if (mdns_finish( &w, 1, an, 0 )) {
+    mdns_send( mdns_qbuf, w.len, NULL, MDNS_PORT );
+    mdns_stats.queries++;
+  }
+}
+
+static mdns_pending_t *mdns_pending_new( const char *name, bool browse )
+{
+  mdns_pending_t *p = (mdns_pending_t *)calloc( 1, sizeof(mdns_pending_t) );
+  if (!p)
+    return NULL;
+  strcpy( p->name, name );
+  p->browse = browse;
+  p->cb_ref = LUA_NOREF;
+  p->start = xTaskGetTickCount();
+  portENTER_CRITICAL( &mdns_mux );
+  p->next = mdns_pending;
+  mdns_pending = p;
+  portEXIT_CRITICAL( &mdns_mux );
+  mdns_tick_start();
+  return p;
+}
+
+static void mdns_pending_unlink( mdns_pending_t *p )
+{
+  portENTER_CRITICAL( &mdns_mux );
+  for (mdns_pending_t **pp = &mdns_pending; *pp; pp = &(*pp)->next)
+    if (*pp == p) {
+      *pp = p->next;
+      break;
+    }
+  portEXIT_CRITICAL( &mdns_mux );
+}
+
+// The TXT record as { key = value }, with true for keys without a value
+static void mdns_push_txt( lua_State *L, const uint8_t *txt, int len )
+{
+  lua_newtable( L );
+  for (int i = 0; i < len; ) {
+    int l = txt[i++];
+    if (!l || i + l > len)
+      break;
+    const char *s = (const char *)txt + i, *eq = memchr( s, '=', l );
+    if (eq != s) {
+      if (eq) {
+        lua_pushlstring( L, s, eq - s );
+        lua_pushlstring( L, eq + 1, l - (eq - s) - 1 );
+      } else {
+        lua_pushlstring( L, s, l );
+        lua_pushboolean( L, 1 );
+      }
+      lua_rawset( L, -3 );
+    }
+    i += l;
+  }
+}
+
+// The cached instances of type as a list; returns how many
+static int mdns_push_list( lua_State *L, const char *type )
+{
+  TickType_t now = xTaskGetTickCount();
+  int n = 0;
+  lua_newtable( L );
+  for (int i = 0; i < CONFIG_MDNS_CACHE_SIZE; i++) {
+    mdns_cached_t c;
+    portENTER_CRITICAL( &mdns_mux );
+    c = mdns_cache[i];
+    portEXIT_CRITICAL( &mdns_mux );
+    if (!c.type[0] || strcasecmp( c.type, type ) || (int32_t)(c.expires - now) <= 0)
+      continue;
+    lua_createtable( L, 0, 5 );
+    lua_pushstring( L, c.name );
+    lua_setfield( L, -2, "name" );
+    if (c.host[0]) {
+      char host[MDNS_LABEL_MAX + 8];
+      ip_addr_t addr;
+      snprintf( host, sizeof(host), "%s.local", c.host );
+      lua_pushstring( L, host );
+      lua_setfield( L, -2, "host" );
+      lua_pushinteger( L, c.port );
+      lua_setfield( L, -2, "port" );
+      if (net_dns_cache_get( host, &addr ) > 0) {
+        char ip[IP_STR_SZ];
+        ipstr( ip, &addr );
+        lua_pushstring( L, ip );
+        lua_setfield( L, -2, "ip" );
+      }
+    }
+    mdns_push_txt( L, c.txt, c.txt_len );
+    lua_setfield( L, -2, "txt" );
+    lua_rawseti( L, -2, ++n );
+  }
+  return n;
+}
+
+static mdns_browsed_t *mdns_browsed_find( const char *type, bool make )
+{
+  mdns_browsed_t *oldest = &mdns_browsed[0];
+  for (int i = 0; i < MDNS_BROWSED; i++) {
+    mdns_browsed_t *b = &mdns_browsed[i];
+    if (!strcasecmp( b->type, type ))
+      return b;
+    if ((int32_t)(b->until - oldest->until) < 0)
+      oldest = b;
+  }
+  if (!make)
+    return NULL;
+  strcpy( oldest->type, type );
+  return oldest;
+}
+
+// Until the first of the type's instances expires, or a while if there
+// are none
+static void mdns_browsed_mark( const char *type )
+{
+  TickType_t now = xTaskGetTickCount(), until = now + ms_ticks( MDNS_EMPTY_FRESH_MS );
+  bool any = false;
+  portENTER_CRITICAL( &mdns_mux );
+  for (int i = 0; i < CONFIG_MDNS_CACHE_SIZE; i++) {
+    mdns_cached_t *c = &mdns_cache[i];
+    if (!c->type[0] || strcasecmp( c->type, type ) || (int32_t)(c->expires - now) <= 0)
+      continue;
+    if (!any || (int32_t)(c->expires - until) < 0)
+      until = c->expires;
+    any = true;
+  }
+  portEXIT_CRITICAL( &mdns_mux );
+  mdns_browsed_find( type, true )->until = until;
+}
+
+static void mdns_finish_pending( lua_State *L, mdns_pending_t *p )
+{
+  mdns_pending_unlink( p );
+  if (p->browse)
+    mdns_browsed_mark( p->name );
+  else if (!p->answered && !p->found)
+    net_dns_cache_put( p->name, NULL, 0 );
+
+  if (p->found) {
+    p->found( p->name, p->answered ? &p->addr : NULL, p->arg );
+  } else if (p->cb_ref != LUA_NOREF) {
+    lua_rawgeti( L, LUA_REGISTRYINDEX, p->cb_ref );
+    if (p->browse) {
+      mdns_push_list( L, p->name );
+    } else if (p->answered) {
+      char ip[IP_STR_SZ];
+      ipstr( ip, &p->addr );
+      lua_pushstring( L, ip );
+    } else {
+      lua_pushnil( L );
+    }
+    luaL_unref( L, LUA_REGISTRYINDEX, p->cb_ref );
+    free( p );
+    lua_call( L, 1, 0 );
+    return;
+  }
+  free( p );
+}
+
+// Our records in want, all as answers; goodbyes say they are gone. The
+// host's address only goes in a goodbye if want has it.
+static void mdns_announce( mdns_want_t want, bool goodbye )
+{
+  mdns_w_t w;
+  uint32_t ip = mdns_my_ip();
+  if (!ip || !mdns_open())
+    return;
+  mdns_header( &w, mdns_qbuf, 0, 0x8400 );
+  portENTER_CRITICAL( &mdns_mux );
+  mdns_put_records( &w, want, goodbye && !want.a ? 0 : ip,
+                    goodbye ? 0 : MDNS_TTL_OTHER );
+  portEXIT_CRITICAL( &mdns_mux );
+  if (w.an && mdns_finish( &w, 0, w.an + w.ar, 0 ))
+    mdns_send( mdns_qbuf, w.len, NULL, MDNS_PORT );
+}
+
+static const mdns_want_t mdns_all = { .a = true, .ptr = 0xff, .srv = 0xff, .txt = 0xff };
+
+static void mdns_tick( task_param_t param, task_prio_t prio )
+{
+  (void)param; (void)prio;
+  lua_State *L = lua_getstate();
+  TickType_t now = xTaskGetTickCount();
+
+  if (mdns_announce_left && (int32_t)(now - mdns_announce_due) >= 0) {
+    mdns_announce( mdns_all, false );
+    mdns_announce_left--;
+    mdns_announce_due = now + ms_ticks( 1000 );
+  }
+  for (mdns_pending_t *p = mdns_pending; p; p = p->next) {
+    uint32_t ms = (now - p->start) * portTICK_PERIOD_MS;
+    if (!p->browse && !p->answered && ms < MDNS_RESOLVE_MS && ms >= p->sent * MDNS_RETRY_MS) {
+      mdns_ask( p->name, DNS_TYPE_A );
+      p->sent++;
+    }
+  }
+  // one at a time, a callback may change the list
+  for (;;) {
+    mdns_pending_t *p;
+    now = xTaskGetTickCount();
+    for (p = mdns_pending; p; p = p->next) {
+      uint32_t ms = (now - p->start) * portTICK_PERIOD_MS;
+      if (p->browse ? ms >= p->wait_ms : p->answered || ms >= MDNS_RESOLVE_MS)
+        break;
+    }
+    if (!p)
+      break;
+    mdns_finish_pending( L, p );
+  }
+  if (!mdns_pending && !mdns_announce_left && mdns_ticking) {
+    os_timer_disarm( &mdns_timer );
+    mdns_ticking = false;
+  }
+}
+
+// For net's lookups of .local names
+static err_t mdns_gethostbyname( const char *name, ip_addr_t *addr,
+                                 dns_found_callback found, void *arg )
+{
+  char full[MDNS_NAME_MAX];
+  size_t l = strlen( name );
+  if (l >= sizeof(full) || !mdns_open())
+    return ERR_MEM;
+  strcpy( full, name );
+  if (full[l - 1] == '.')
+    full[l - 1] = 0;
+  mdns_stats.misses++;
+  mdns_pending_t *p = mdns_pending_new( full, false );
+  if (!p)
+    return ERR_MEM;
+  p->found = found;
+  p->arg = arg;
+  task_post_coalesced_low( mdns_tick_task, 0 );
+  return ERR_INPROGRESS;
+}
+
+// --- Lua API
+
+static void check_label( lua_State *L, int idx, const char *s, bool host )
+{
+  size_t l = strlen( s );
+  luaL_argcheck( L, l > 0 && l <= MDNS_LABEL_MAX, idx, "wrong length" );
+  for (; host && *s; s++)
+    luaL_argcheck( L, isalnum( (unsigned char)*s ) || *s == '-', idx, "letters, digits and - only" );
+}
+
+// "_http._tcp" and the like
+static void check_type( lua_State *L, int idx, const char *t )
+{
+  size_t l = strlen( t );
+  const char *dot = strchr( t, '.' );
+  luaL_argcheck( L, l < MDNS_TYPE_MAX && t[0] == '_' && dot &&
+                 (!strcasecmp( dot, "._tcp" ) || !strcasecmp( dot, "._udp" )),
+                 idx, "service should be like _http._tcp" );
+}
+
+// Lua: mdns.start(hostname)
+// Answer for hostname.local with our address, and announce it. Doesn't
+// probe for a device already using the name.
+static int mdns_start( lua_State *L )
+{
+  const char *host = luaL_checkstring( L, 1 );
+  check_label( L, 1, host, true );
+  if (!mdns_open())
+    return luaL_error( L, "can't open port %d", MDNS_PORT );
+  portENTER_CRITICAL( &mdns_mux );
+  strcpy( mdns_host, host );
+  portEXIT_CRITICAL( &mdns_mux );
+  mdns_announce_left = MDNS_ANNOUNCE;
+  mdns_announce_due = xTaskGetTickCount();
+  mdns_tick_start();
+  return 0;
+}
+
+// Lua: mdns.advertise(service, port[, { name = instance, txt = { key = value, ... } }])
+// Answer browses for service, e.g. "_http._tcp", with an instance named
+// after the host unless name is given. Advertising the same service and
+// name again replaces it.
+static int mdns_advertise( lua_State *L )
+{
+  mdns_service_t s;
+  memset( &s, 0, sizeof(s) );
+  const char *type = luaL_checkstring( L, 1 );
+  check_type( L, 1, type );
+  strcpy( s.type, type );
+  int port = luaL_checkinteger( L, 2 );
+  luaL_argcheck( L, port > 0 && port < 65536, 2, "wrong port" );
+  s.port = port;
+  if (!mdns_host[0])
+    return luaL_error( L, "not started" );
+  strcpy( s.name, mdns_host );
+  if (lua_istable( L, 3 )) {
+    lua_getfield( L, 3, "name" );
+    if (!lua_isnil( L, -1 )) {
+      const char *name = luaL_checkstring( L, -1 );
+      check_label( L, 3, name, false );
+      strcpy( s.name, name );
+    }
+    lua_pop( L, 1 );
+    lua_getfield( L, 3, "txt" );
+    if (lua_istable( L, -1 )) {
+      lua_pushnil( L );
+      while (lua_next( L, -2 )) {
+        size_t kl, vl = 0;
+        lua_pushvalue( L, -2 );
+        const char *k = luaL_checklstring( L, -1, &kl );
+        bool flag = lua_isboolean( L, -2 );
+        const char *v = flag ? NULL : luaL_checklstring( L, -2, &vl );
+        int n = kl + (v ? 1 + vl : 0);
+        if (flag && !lua_toboolean( L, -2 ))
+          n = 0;
+        else if (n > 255 || s.txt_len + 1 + n > MDNS_TXT_MAX)
+          return luaL_error( L, "txt too long" );
+        if (n) {
+          uint8_t *t = s.txt + s.txt_len;
+          *t++ = n;
+          memcpy( t, k, kl );
+          if (v) {
+            t[kl] = '=';
+            memcpy( t + kl + 1, v, vl );
+          }
+          s.txt_len += 1 + n;
+        }
+        lua_pop( L, 2 );
+      }
+    }
+    lua_pop( L, 1 );
+  }
+
+  int slot = -1;
+  portENTER_CRITICAL( &mdns_mux );
+  for (int i = 0; i < MDNS_MAX_SERVICES; i++) {
+    mdns_service_t *o = &mdns_services[i];
+    if (o->type[0] && !strcasecmp( o->type, s.type ) && !strcasecmp( o->name, s.name )) {
+      slot = i;
+      break;
+    }
+    if (!o->type[0] && slot < 0)
+      slot = i;
+  }
+  if (slot >= 0)
+    mdns_services[slot] = s;
+  portEXIT_CRITICAL( &mdns_mux );
+  if (slot < 0)
+    return luaL_error( L, "at most %d services", MDNS_MAX_SERVICES );
+  mdns_announce_left = MDNS_ANNOUNCE;
+  mdns_announce_due = xTaskGetTickCount();
+  mdns_tick_start();
+  return 0;
+}
+
+// Says goodbye for the services matched, all of them with type NULL,
+// and for the host too with host set, then forgets them
+static void mdns_withdraw_( const char *type, const char *name, bool host )
+{
+  mdns_want_t gone = { .a = host };
+  portENTER_CRITICAL( &mdns_mux );
+  for (int i = 0; i < MDNS_MAX_SERVICES; i++) {
+    mdns_service_t *s = &mdns_services[i];
+    if (s->type[0] && (!type || (!strcasecmp( s->type, type ) &&
+                                 (!name || !strcasecmp( s->name, name )))))
+      gone.ptr |= 1 << i;
+  }
+  portEXIT_CRITICAL( &mdns_mux );
+  gone.srv = gone.txt = gone.ptr;
+  mdns_announce( gone, true );
+
+  portENTER_CRITICAL( &mdns_mux );
+  for (int i = 0; i < MDNS_MAX_SERVICES; i++)
+    if (gone.ptr & 1 << i)
+      mdns_services[i].type[0] = 0;
+  if (host)
+    mdns_host[0] = 0;
+  portEXIT_CRITICAL( &mdns_mux );
+}
+
+// Lua: mdns.withdraw(service[, name])
+// Stop advertising the service, the instances of it or the one named
+static int mdns_withdraw( lua_State *L )
+{
+  const char *type = luaL_checkstring( L, 1 );
+  const char *name = luaL_optstring( L, 2, NULL );
+  mdns_withdraw_( type, name, false );
+  return 0;
+}
+
+// Lua: mdns.stop()
+// Say goodbye for the host and its services and stop answering for them.
+// Resolving and browsing go on working.
+static int mdns_stop( lua_State *L )
+{
+  if (mdns_host[0])
+    mdns_withdraw_( NULL, NULL, true );
+  mdns_announce_left = 0;
+  return 0;
+}
+
+// Lua: mdns.resolve(host, function(ip))
+// ip is a string, or nil if nothing answers within 1.5 s. host may leave
+// out .local. Answers come from net's DNS cache while they last, and
+// net's own lookups of .local names come here.
+static int mdns_resolve( lua_State *L )
+{
+  char name[MDNS_NAME_MAX];
+  ip_addr_t addr;
+  const char *host = luaL_checkstring( L, 1 );
+  luaL_checkanyfunction( L, 2 );
+  size_t l = strlen( host );
+  if (l && host[l - 1] == '.')
+    l--;
+  luaL_argcheck( L, l > 0 && l + 7 < sizeof(name), 1, "wrong name" );
+  bool local = l > 6 && !strncasecmp( host + l - 6, ".local", 6 );
+  snprintf( name, sizeof(name), "%.*s%s", (int)l, host, local ? "" : ".local" );
+
+  if (!mdns_open())
+    return luaL_error( L, "can't open port %d", MDNS_PORT );
+  mdns_pending_t *p = mdns_pending_new( name, false );
+  if (!p)
+    return luaL_error( L, "out of memory" );
+  lua_pushvalue( L, 2 );
+  p->cb_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  // Answered on the next tick if cached, so the function is never called
+  // from in here
+  int hit = net_dns_cache_get( name, &addr );
+  if (hit > 0) {
+    p->addr = addr;
+    p->answered = true;
+    mdns_stats.hits++;
+  } else if (hit < 0) {
+    p->start -= ms_ticks( MDNS_RESOLVE_MS );
+    p->sent = 0xff;
+    mdns_stats.hits++;
+  } else {
+    mdns_stats.misses++;
+  }
+  task_post_coalesced_low( mdns_tick_task, 0 );
+  return 0;
+}
+
+// Lua: mdns.browse(service, function(list)[, wait_ms])
+// list has the instances of service, e.g. "_http._tcp", on the network, as
+// { name =, host =, ip =, port =, txt = { key = value } }; host, ip and
+// port are missing for those that haven't said yet. The network is asked
+// once, and the answers gathered for wait_ms, 1000 by default; until the
+// first of the answers expires, browsing again reads the cache.
+static int mdns_browse( lua_State *L )
+{
+  char name[MDNS_NAME_MAX];
+  const char *type = luaL_checkstring( L, 1 );
+  check_type( L, 1, type );
+  luaL_checkanyfunction( L, 2 );
+  int wait = luaL_optinteger( L, 3, MDNS_BROWSE_MS );
+  luaL_argcheck( L, wait >= MDNS_TICK_MS && wait <= 10000, 3, "wrong wait" );
+  if (!mdns_open())
+    return luaL_error( L, "can't open port %d", MDNS_PORT );
+
+  mdns_browsed_t *b = mdns_browsed_find( type, false );
+  bool fresh = b && (int32_t)(b->until - xTaskGetTickCount()) > 0;
+  mdns_pending_t *p = mdns_pending_new( type, true );
+  if (!p)
+    return luaL_error( L, "out of memory" );
+  lua_pushvalue( L, 2 );
+  p->cb_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  if (fresh) {
+    mdns_stats.hits++;
+    task_post_coalesced_low( mdns_tick_task, 0 );
+  } else {
+    mdns_stats.misses++;
+    p->wait_ms = wait;
+    snprintf( name, sizeof(name), "%s.local", type );
+    mdns_ask( name, DNS_TYPE_PTR );
+  }
+  return 0;
+}
+
+// Lua: stats = mdns.cache([flush])
+// The service cache's size and entries, with counters: hits and misses of
+// resolves and browses, queries sent, queries answered and answers left
+// out because the asker had them. flush = true empties the cache; net's
+// DNS cache has its own, net.dns.cache().
+static int mdns_cache_info( lua_State *L )
+{
+  int entries = 0;
+  bool flush = lua_toboolean( L, 1 );
+  TickType_t now = xTaskGetTickCount();
+  portENTER_CRITICAL( &mdns_mux );
+  for (int i = 0; i < CONFIG_MDNS_CACHE_SIZE; i++) {
+    mdns_cached_t *c = &mdns_cache[i];
+    if (c->type[0] && (int32_t)(c->expires - now) > 0)
+      entries++;
+    if (flush)
+      c->type[0] = 0;
+  }
+  portEXIT_CRITICAL( &mdns_mux );
+  if (flush)
+    memset( mdns_browsed, 0, sizeof(mdns_browsed) );
+  lua_createtable( L, 0, 7 );
+  lua_pushinteger( L, CONFIG_MDNS_CACHE_SIZE );
+  lua_setfield( L, -2, "size" );
+  lua_pushinteger( L, entries );
+  lua_setfield( L, -2, "entries" );
+  lua_pushinteger( L, mdns_stats.hits );
+  lua_setfield( L, -2, "hits" );
+  lua_pushinteger( L, mdns_stats.misses );
+  lua_setfield( L, -2, "misses" );
+  lua_pushinteger( L, mdns_stats.queries );
+  lua_setfield( L, -2, "queries" );
+  lua_pushinteger( L, mdns_stats.answered );
+  lua_setfield( L, -2, "answered" );
+  lua_pushinteger( L, mdns_stats.suppressed );
+  lua_setfield( L, -2, "suppressed" );
+  return 1;
+}
+
+// Module function map
+const LUA_REG_TYPE mdns_map[] = {
+  { LSTRKEY( "start" ),     LFUNCVAL( mdns_start ) },
+  { LSTRKEY( "advertise" ), LFUNCVAL( mdns_advertise ) },
+  { LSTRKEY( "withdraw" ),  LFUNCVAL( mdns_withdraw ) },
+  { LSTRKEY( "stop" ),      LFUNCVAL( mdns_stop ) },
+  { LSTRKEY( "resolve" ),   LFUNCVAL( mdns_resolve ) },
+  { LSTRKEY( "browse" ),    LFUNCVAL( mdns_browse ) },
+  { LSTRKEY( "cache" ),     LFUNCVAL( mdns_cache_info ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_mdns( lua_State *L )
+{
+  mdns_tick_task = task_get_id( mdns_tick );
+  os_timer_setfn( &mdns_timer, mdns_timer_cb, NULL );
+  net_dns_set_local_resolver( mdns_gethostbyname );
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_MDNSLIBNAME, mdns_map );
+  return 1;
+#endif
+}
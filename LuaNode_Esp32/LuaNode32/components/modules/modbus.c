@@ -0,0 +1,1361 @@
+// Module for Modbus, RTU over a UART and TCP over net sockets, as master
+// and as slave
+//
+// Frames are built, checked and taken apart in C; Lua deals in register
+// numbers and values. A master runs one request at a time from a queue,
+// and can poll a list of registers on an interval: neighbouring ones are
+// read together, and the values are kept for master:get() rather than
+// handed to Lua with each answer. A slave keeps its four tables in C and
+// answers from them without calling Lua, except to say what was written.
+//
+// RTU frames are told apart by their length, which the function code and
+// byte count give, and their CRC; a frame that doesn't check out is
+// searched for from the next byte on. RS-485 direction is the UART's, set
+// with uart.setup().
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "platform.h"
+#include "my_uart.h"
+#include "uart_claim.h"
+#include "net.h"
+#include "crc16.h"
+#include "task/task.h"
+#include "esp_timer.h"
+#include "esp_misc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#define MB_MASTER_OBJ   "modbus.master"
+#define MB_SLAVE_OBJ    "modbus.slave"
+
+#define MB_PDU_MAX      253
+#define MB_ADU_MAX      (7 + MB_PDU_MAX)   // with the MBAP header, RTU's are shorter
+#define MB_READ_REGS    125     // most registers one request reads
+#define MB_READ_BITS    2000
+#define MB_WRITE_REGS   123
+#define MB_WRITE_BITS   1968
+#define MB_MERGE_GAP    8       // registers not polled, read to save a round trip
+#define MB_TIMEOUT_MS   1000
+#define MB_GAP_MS       5       // quiet line between RTU frames
+
+// Exception codes
+#define MB_EX_FUNCTION  1
+#define MB_EX_ADDRESS   2
+#define MB_EX_VALUE     3
+
+enum { MB_COILS, MB_DISCRETE, MB_HOLDING, MB_INPUT, MB_KINDS };
+static const char * const mb_kinds[] = { "coils", "discrete", "holding", "input", NULL };
+#define MB_BITS(kind)   ((kind) < MB_HOLDING)
+
+// --- Links, what frames go over
+
+typedef struct mb_link mb_link_t;
+typedef void (*mb_adu_fn)(lua_State *L, mb_link_t *k, uint16_t tid, uint8_t unit,
+                          const uint8_t *pdu, size_t len);
+
+struct mb_link {
+  bool tcp;
+  bool requests;            // frames coming in are requests, we're a slave
+  bool closed;
+  unsigned uart;
+  void *sock;
+  int sock_ref;
+  uart_claim_t claim;
+  volatile uint32_t posted;
+  mb_adu_fn adu;
+  void (*gone)(lua_State *L, mb_link_t *k);   // the TCP connection has closed
+  uint32_t bad;             // frames that didn't check out
+  uint16_t rx_len;
+  uint8_t rx[MB_ADU_MAX];
+};
+
+static mb_link_t *mb_uarts[NUM_UART];
+static task_handle_t mb_uart_task;
+
+static inline bool mb_cas(volatile uint32_t *addr, uint32_t expect, uint32_t set)
+{
+  uxPortCompareSet(addr, expect, &set);
+  return set == expect;
+}
+
+// In uart_task
+static void mb_uart_rx(unsigned id, void *arg)
+{
+  mb_link_t *k = (mb_link_t *)arg;
+  if (mb_cas(&k->posted, 0, 1) && !task_post_medium(mb_uart_task, id))
+    k->posted = 0;
+}
+
+static void mb_uart_tx(unsigned id, void *arg)
+{
+}
+
+// Bytes in the RTU frame at b, 0 if there are too few yet to tell, -1 if
+// it can't be the start of one
+static int mb_rtu_len(const uint8_t *b, size_t n, bool request)
+{
+  if (n < 2)
+    return 0;
+  uint8_t fc = b[1];
+  if (request) {
+    switch (fc) {
+    case 1: case 2: case 3: case 4: case 5: case 6:
+      return 8;
+    case 15: case 16:
+      return n < 7 ? 0 : 9 + b[6];
+    }
+    return -1;
+  }
+  if (fc & 0x80)
+    return 5;
+  switch (fc) {
+  case 1: case 2: case 3: case 4:
+    return n < 3 ? 0 : 5 + b[2];
+  case 5: case 6: case 15: case 16:
+    return 8;
+  }
+  return -1;
+}
+
+// Hand each whole frame in k->rx to k->adu
+static void mb_link_input(lua_State *L, mb_link_t *k)
+{
+  size_t off = 0;
+  while (off < k->rx_len && !k->closed) {
+    const uint8_t *b = k->rx + off;
+    size_t n = k->rx_len - off;
+    if (k->tcp) {
+      if (n < 7)
+        break;
+      size_t len = (b[4] << 8) | b[5];
+      if (b[2] || b[3] || len < 2 || len > MB_PDU_MAX + 1) {
+        // Not Modbus; there's no finding the next frame in a stream
+        k->bad++;
+        off = k->rx_len;
+        break;
+      }
+      if (n < 6 + len)
+        break;
+      off += 6 + len;
+      k->adu(L, k, (b[0] << 8) | b[1], b[6], b + 7, len - 1);
+    } else {
+      int len = mb_rtu_len(b, n, k->requests);
+      if (len == 0 || (len > 0 && (size_t)len > n))
+        break;
+      if (len < 0 || crc16_modbus(CRC16_MODBUS_INITIAL_CRC, b, len - 2) != (b[len - 2] | b[len - 1] << 8)) {
+        k->bad++;
+        off++;              // look for one from the next byte
+        continue;
+      }
+      off += len;
+      k->adu(L, k, 0, b[0], b + 1, len - 3);
+    }
+  }
+  if (k->closed)
+    return;
+  memmove(k->rx, k->rx + off, k->rx_len - off);
+  k->rx_len -= off;
+}
+
+static void mb_link_feed(lua_State *L, mb_link_t *k, const char *data, size_t len)
+{
+  while (len && !k->closed) {
+    size_t n = sizeof(k->rx) - k->rx_len;
+    if (n > len)
+      n = len;
+    memcpy(k->rx + k->rx_len, data, n);
+    k->rx_len += n;
+    data += n;
+    len -= n;
+    mb_link_input(L, k);
+  }
+}
+
+static void mb_uart_event(task_param_t param, task_prio_t prio)
+{
+  mb_link_t *k = mb_uarts[param];
+  (void)prio;
+  if (!k)
+    return;
+  k->posted = 0;
+  lua_State *L = lua_getstate();
+  size_t n;
+  while (!k->closed &&
+         (n = uart_rx_read(k->uart, k->rx + k->rx_len, sizeof(k->rx) - k->rx_len)) > 0) {
+    k->rx_len += n;
+    mb_link_input(L, k);
+  }
+}
+
+// From the socket, NULL data once it has gone
+static void mb_sock_rx(lua_State *L, void *arg, char *data, size_t len)
+{
+  mb_link_t *k = (mb_link_t *)arg;
+  if (!data) {
+    k->sock = NULL;
+    if (k->gone)
+      k->gone(L, k);
+    return;
+  }
+  mb_link_feed(L, k, data, len);
+}
+
+// Send one frame, false if the link can't take it
+static bool mb_link_send(lua_State *L, mb_link_t *k, uint16_t tid, uint8_t unit,
+                         const uint8_t *pdu, size_t len)
+{
+  uint8_t adu[MB_ADU_MAX];
+  if (k->tcp) {
+    if (!k->sock || !net_tcp_connected(k->sock))
+      return false;
+    adu[0] = tid >> 8;
+    adu[1] = tid;
+    adu[2] = adu[3] = 0;
+    adu[4] = (len + 1) >> 8;
+    adu[5] = len + 1;
+    adu[6] = unit;
+    memcpy(adu + 7, pdu, len);
+    net_tcp_write(L, k->sock, (const char *)adu, len + 7);
+    return true;
+  }
+  adu[0] = unit;
+  memcpy(adu + 1, pdu, len);
+  uint16_t crc = crc16_modbus(CRC16_MODBUS_INITIAL_CRC, adu, len + 1);
+  adu[len + 1] = crc;
+  adu[len + 2] = crc >> 8;
+  // The port is ours and a frame is well short of its TX buffer
+  return uart_tx_write(k->uart, adu, len + 3) == len + 3;
+}
+
+// Take over UART id, or the net socket at idx, for k
+static void mb_link_open(lua_State *L, mb_link_t *k, int idx, bool requests, mb_adu_fn adu)
+{
+  k->requests = requests;
+  k->adu = adu;
+  k->sock_ref = LUA_NOREF;
+  if (lua_type(L, idx) == LUA_TNUMBER) {
+    unsigned id = luaL_checkinteger(L, idx);
+    if (!platform_uart_exists(id))
+      luaL_error(L, "uart %d does not exist", id);
+    if (id == 0)
+      luaL_error(L, "uart 0 is the console");
+    k->uart = id;
+    k->claim.rx_ready = mb_uart_rx;
+    k->claim.tx_done = mb_uart_tx;
+    k->claim.arg = k;
+    if (mb_uarts[id] || !uart_claim(id, &k->claim))
+      luaL_error(L, "uart %d is taken", id);
+    mb_uarts[id] = k;
+    return;
+  }
+  k->sock = net_tcp_check(L, idx);
+  k->tcp = true;
+  lua_pushvalue(L, idx);
+  k->sock_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  net_tcp_set_rx_hook(k->sock, mb_sock_rx, k);
+}
+
+static void mb_link_close(lua_State *L, mb_link_t *k)
+{
+  if (k->closed)
+    return;
+  k->closed = true;
+  if (k->tcp) {
+    if (k->sock)
+      net_tcp_set_rx_hook(k->sock, NULL, NULL);
+    k->sock = NULL;
+    luaL_unref(L, LUA_REGISTRYINDEX, k->sock_ref);
+    k->sock_ref = LUA_NOREF;
+  } else if (mb_uarts[k->uart] == k) {
+    uart_claim(k->uart, NULL);
+    mb_uarts[k->uart] = NULL;
+  }
+}
+
+// --- Master
+
+// Registers a poll reads with one request, and what it got last
+typedef struct {
+  uint8_t unit;
+  uint8_t kind;
+  uint16_t addr, count;
+  bool valid;
+  uint8_t err;              // of the last request, MB_ERR_ or an exception code
+  uint16_t *values;
+} mb_block_t;
+
+// Why a request failed, when not with an exception
+#define MB_ERR_NONE     0
+#define MB_ERR_TIMEOUT  0xff
+#define MB_ERR_BAD      0xfe    // an answer that doesn't fit the request
+#define MB_ERR_SEND     0xfd    // the link couldn't take it
+
+typedef struct mb_req {
+  struct mb_req *next;
+  uint8_t unit;
+  uint8_t kind;
+  uint16_t count;
+  int cb_ref;
+  mb_block_t *block;        // a poll's, which gets the values
+  uint8_t len;
+  uint8_t pdu[MB_PDU_MAX];
+} mb_req_t;
+
+typedef struct mb_master {
+  mb_link_t link;
+  struct mb_master *next;
+  int self_ref;
+  mb_req_t *queue, *tail;
+  mb_req_t *cur;            // sent and waiting for its answer
+  uint16_t tid;
+  uint32_t timeout_ms, gap_ms;
+  bool gap;                 // the timer ends the quiet time, not the wait
+  os_timer_t timer;
+  uint32_t armed;           // counts arming the timer, so a late event
+  volatile uint32_t fired;  // from one armed before can be told apart
+  mb_block_t *blocks;
+  uint16_t nblocks;
+  uint16_t poll_left;       // blocks of this round not answered yet
+  uint16_t poll_failed;
+  uint32_t poll_ms;
+  os_timer_t poll_timer;
+  int poll_cb_ref;
+  uint32_t requests, answers, timeouts, exceptions;
+} mb_master_t;
+
+static mb_master_t *mb_masters;
+static task_handle_t mb_timer_task;
+static task_handle_t mb_poll_task;
+
+// Timer events for a master closed since they were posted find it gone
+static bool mb_master_live(mb_master_t *m)
+{
+  for (mb_master_t *e = mb_masters; e; e = e->next)
+    if (e == m)
+      return true;
+  return false;
+}
+
+static void mb_timer_cb(void *arg)
+{
+  mb_master_t *m = (mb_master_t *)arg;
+  m->fired = m->armed;
+  task_post_low(mb_timer_task, (task_param_t)m);
+}
+
+static void mb_poll_timer_cb(void *arg)
+{
+  task_post_low(mb_poll_task, (task_param_t)arg);
+}
+
+static void mb_arm(mb_master_t *m, uint32_t ms)
+{
+  m->armed++;
+  os_timer_disarm(&m->timer);
+  os_timer_arm(&m->timer, ms ? ms : 1, 0);
+}
+
+static void mb_req_free(lua_State *L, mb_req_t *r)
+{
+  luaL_unref(L, LUA_REGISTRYINDEX, r->cb_ref);
+  free(r);
+}
+
+static void mb_push_err(lua_State *L, uint8_t err)
+{
+  switch (err) {
+  case MB_ERR_TIMEOUT: lua_pushliteral(L, "timeout"); break;
+  case MB_ERR_BAD:     lua_pushliteral(L, "bad answer"); break;
+  case MB_ERR_SEND:    lua_pushliteral(L, "not sent"); break;
+  default:             lua_pushfstring(L, "exception %d", err);
+  }
+}
+
+// Values of a read answer, false if it doesn't fit the request
+static bool mb_decode(const mb_req_t *r, const uint8_t *pdu, size_t len, uint16_t *out)
+{
+  size_t bytes = MB_BITS(r->kind) ? (r->count + 7) / 8 : r->count * 2;
+  if (len != 2 + bytes || pdu[1] != bytes)
+    return false;
+  const uint8_t *d = pdu + 2;
+  for (unsigned i = 0; i < r->count; i++)
+    out[i] = MB_BITS(r->kind) ? (d[i / 8] >> (i % 8)) & 1 : (d[2 * i] << 8) | d[2 * i + 1];
+  return true;
+}
+
+// Call the function under the n values on top of the stack, with m kept
+// alive on the stack meanwhile: the callback may close it
+static void mb_master_call(lua_State *L, mb_master_t *m, int n)
+{
+  lua_rawgeti(L, LUA_REGISTRYINDEX, m->self_ref);
+  lua_insert(L, -2 - n);
+  lua_call(L, n, 0);
+  lua_pop(L, 1);
+}
+
+static void mb_poll_round_done(lua_State *L, mb_master_t *m)
+{
+  if (m->poll_cb_ref == LUA_NOREF)
+    return;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, m->poll_cb_ref);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, m->self_ref);
+  lua_pushinteger(L, m->poll_failed);
+  mb_master_call(L, m, 2);
+}
+
+// The answer to r, or with pdu NULL its failure, err. Calls Lua.
+static void mb_finish(lua_State *L, mb_master_t *m, mb_req_t *r,
+                      const uint8_t *pdu, size_t len, uint8_t err)
+{
+  if (pdu && (pdu[0] & 0x80)) {
+    m->exceptions++;
+    err = len >= 2 ? pdu[1] : MB_ERR_BAD;
+    pdu = NULL;
+  }
+
+  if (r->block) {
+    mb_block_t *b = r->block;
+    if (pdu && mb_decode(r, pdu, len, b->values)) {
+      b->valid = true;
+      b->err = MB_ERR_NONE;
+    } else {
+      b->err = pdu ? MB_ERR_BAD : err;
+      m->poll_failed++;
+    }
+    mb_req_free(L, r);
+    if (--m->poll_left == 0)
+      mb_poll_round_done(L, m);
+    return;
+  }
+
+  int cb = r->cb_ref;
+  r->cb_ref = LUA_NOREF;
+  if (cb == LUA_NOREF) {
+    mb_req_free(L, r);
+    return;
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cb);
+  luaL_unref(L, LUA_REGISTRYINDEX, cb);
+  if (pdu && r->pdu[0] <= 4) {
+    // A read: the values, in a table straight from the frame
+    uint16_t *v = (uint16_t *)malloc(r->count * sizeof(uint16_t));
+    if (v && mb_decode(r, pdu, len, v)) {
+      lua_createtable(L, r->count, 0);
+      for (unsigned i = 0; i < r->count; i++) {
+        lua_pushinteger(L, v[i]);
+        lua_rawseti(L, -2, i + 1);
+      }
+      pdu = (const uint8_t *)v;
+    } else {
+      pdu = NULL;
+      err = MB_ERR_BAD;
+    }
+    free(v);
+  } else if (pdu) {
+    lua_pushboolean(L, 1);
+  }
+  int n = 1;
+  if (!pdu) {
+    lua_pushnil(L);
+    mb_push_err(L, err);
+    n = 2;
+  }
+  mb_req_free(L, r);
+  mb_master_call(L, m, n);
+}
+
+// Send the next request, unless one is out or the line has to stay quiet
+static void mb_kick(lua_State *L, mb_master_t *m)
+{
+  while (!m->link.closed && !m->cur && !m->gap && m->queue) {
+    mb_req_t *r = m->queue;
+    m->queue = r->next;
+    if (!m->queue)
+      m->tail = NULL;
+    r->next = NULL;
+    m->tid++;
+    m->requests++;
+    if (!mb_link_send(L, &m->link, m->tid, r->unit, r->pdu, r->len)) {
+      mb_finish(L, m, r, NULL, 0, MB_ERR_SEND);
+      continue;
+    }
+    if (r->unit == 0 && !m->link.tcp) {
+      // Broadcasts aren't answered; give the slaves time to act on it
+      m->gap = true;
+      mb_arm(m, m->timeout_ms / 4);
+      mb_finish(L, m, r, r->pdu, r->len, MB_ERR_NONE);
+      return;
+    }
+    m->cur = r;
+    mb_arm(m, m->timeout_ms);
+  }
+}
+
+// The request out is over. RTU wants the line quiet before the next, which
+// requests the callback makes wait for.
+static void mb_done(lua_State *L, mb_master_t *m, const uint8_t *pdu, size_t len, uint8_t err)
+{
+  mb_req_t *r = m->cur;
+  m->cur = NULL;
+  if (m->link.tcp) {
+    os_timer_disarm(&m->timer);
+  } else {
+    m->gap = true;
+    mb_arm(m, m->gap_ms);
+  }
+  mb_finish(L, m, r, pdu, len, err);
+  mb_kick(L, m);
+}
+
+static void mb_master_adu(lua_State *L, mb_link_t *k, uint16_t tid, uint8_t unit,
+                          const uint8_t *pdu, size_t len)
+{
+  mb_master_t *m = (mb_master_t *)k;
+  mb_req_t *r = m->cur;
+  if (!r || unit != r->unit || (pdu[0] & 0x7f) != r->pdu[0] || (k->tcp && tid != m->tid))
+    return;                 // not the answer we're waiting for
+  m->answers++;
+  mb_done(L, m, pdu, len, MB_ERR_NONE);
+}
+
+static void mb_master_gone(lua_State *L, mb_link_t *k)
+{
+  mb_master_t *m = (mb_master_t *)k;
+  // The rest fail as mb_kick tries them
+  if (m->cur)
+    mb_done(L, m, NULL, 0, MB_ERR_SEND);
+}
+
+static void mb_master_timer(task_param_t param, task_prio_t prio)
+{
+  mb_master_t *m = (mb_master_t *)param;
+  (void)prio;
+  if (!mb_master_live(m) || m->fired != m->armed)
+    return;                 // gone, or armed again since
+  lua_State *L = lua_getstate();
+  if (m->gap) {
+    m->gap = false;
+    mb_kick(L, m);
+  } else if (m->cur) {
+    m->timeouts++;
+    mb_done(L, m, NULL, 0, MB_ERR_TIMEOUT);
+  }
+}
+
+static void mb_enqueue(lua_State *L, mb_master_t *m, mb_req_t *r)
+{
+  if (m->tail)
+    m->tail->next = r;
+  else
+    m->queue = r;
+  m->tail = r;
+  mb_kick(L, m);
+}
+
+static mb_req_t *mb_req_new(lua_State *L, uint8_t unit, uint8_t kind, uint8_t fc,
+                            uint16_t addr, uint16_t count)
+{
+  mb_req_t *r = (mb_req_t *)calloc(1, sizeof(mb_req_t));
+  if (!r)
+    luaL_error(L, "out of memory");
+  r->cb_ref = LUA_NOREF;
+  r->unit = unit;
+  r->kind = kind;
+  r->count = count;
+  r->pdu[0] = fc;
+  r->pdu[1] = addr >> 8;
+  r->pdu[2] = addr;
+  r->pdu[3] = count >> 8;
+  r->pdu[4] = count;
+  r->len = 5;
+  return r;
+}
+
+static void mb_poll_start(lua_State *L, mb_master_t *m)
+{
+  if (m->poll_left)
+    return;                 // the last round isn't over, skip one
+  m->poll_failed = 0;
+  mb_block_t *blocks = m->blocks;
+  for (unsigned i = 0; i < m->nblocks; i++) {
+    mb_block_t *b = &blocks[i];
+    mb_req_t *r = mb_req_new(L, b->unit, b->kind, b->kind + 1, b->addr, b->count);
+    r->block = b;
+    m->poll_left++;
+    mb_enqueue(L, m, r);
+    if (m->link.closed || m->blocks != blocks)
+      return;               // a callback closed m or changed the polling
+  }
+}
+
+static void mb_master_poll(task_param_t param, task_prio_t prio)
+{
+  mb_master_t *m = (mb_master_t *)param;
+  (void)prio;
+  if (mb_master_live(m) && m->nblocks)
+    mb_poll_start(lua_getstate(), m);
+}
+
+static void mb_blocks_free(mb_master_t *m)
+{
+  for (unsigned i = 0; i < m->nblocks; i++)
+    free(m->blocks[i].values);
+  free(m->blocks);
+  m->blocks = NULL;
+  m->nblocks = 0;
+}
+
+static mb_master_t *mb_master_check(lua_State *L)
+{
+  mb_master_t *m = (mb_master_t *)luaL_checkudata(L, 1, MB_MASTER_OBJ);
+  if (m->link.closed)
+    luaL_error(L, "closed");
+  return m;
+}
+
+static int mb_check_unit(lua_State *L, int idx)
+{
+  int unit = luaL_checkinteger(L, idx);
+  luaL_argcheck(L, unit >= 0 && unit <= 255, idx, "invalid unit");
+  return unit;
+}
+
+static int mb_check_addr(lua_State *L, int idx)
+{
+  int addr = luaL_checkinteger(L, idx);
+  luaL_argcheck(L, addr >= 0 && addr <= 0xffff, idx, "invalid address");
+  return addr;
+}
+
+// Lua: m = modbus.master(uart_id | socket[, { timeout = ms, gap = ms }])
+// A master on UART id, which uart.setup() has set up, or over a connected
+// net TCP socket. timeout is how long an answer may take, 1000 ms by
+// default; gap the quiet time between RTU frames, 5 ms.
+static int mb_master_new(lua_State *L)
+{
+  uint32_t timeout = MB_TIMEOUT_MS, gap = MB_GAP_MS;
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "timeout");
+    timeout = luaL_optinteger(L, -1, timeout);
+    lua_getfield(L, 2, "gap");
+    gap = luaL_optinteger(L, -1, gap);
+    lua_pop(L, 2);
+  }
+  luaL_argcheck(L, timeout > 0, 2, "invalid timeout");
+
+  mb_master_t *m = (mb_master_t *)lua_newuserdata(L, sizeof(mb_master_t));
+  memset(m, 0, sizeof(*m));
+  m->link.closed = true;    // until it's open, for __gc
+  m->self_ref = m->poll_cb_ref = m->link.sock_ref = LUA_NOREF;
+  luaL_getmetatable(L, MB_MASTER_OBJ);
+  lua_setmetatable(L, -2);
+  m->link.gone = mb_master_gone;
+  mb_link_open(L, &m->link, 1, false, mb_master_adu);
+  m->link.closed = false;
+  m->timeout_ms = timeout;
+  m->gap_ms = gap;
+  os_timer_setfn(&m->timer, mb_timer_cb, m);
+  os_timer_setfn(&m->poll_timer, mb_poll_timer_cb, m);
+  m->next = mb_masters;
+  mb_masters = m;
+  lua_pushvalue(L, -1);
+  m->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+// Lua: m:read(unit, kind, addr, count, function(values | nil, err))
+// kind is "coils", "discrete", "holding" or "input"; values is a table of
+// count numbers, 0 or 1 for coils and discrete inputs. err is "timeout",
+// "closed" or "exception n" with the slave's exception code.
+static int mb_read(lua_State *L)
+{
+  mb_master_t *m = mb_master_check(L);
+  int unit = mb_check_unit(L, 2);
+  luaL_argcheck(L, unit > 0, 2, "reads can't be broadcast");
+  int kind = luaL_checkoption(L, 3, NULL, mb_kinds);
+  int addr = mb_check_addr(L, 4);
+  int count = luaL_checkinteger(L, 5);
+  luaL_argcheck(L, count > 0 && count <= (MB_BITS(kind) ? MB_READ_BITS : MB_READ_REGS)
+                && addr + count <= 0x10000, 5, "invalid count");
+  luaL_checkanyfunction(L, 6);
+  mb_req_t *r = mb_req_new(L, unit, kind, kind + 1, addr, count);
+  lua_pushvalue(L, 6);
+  r->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  mb_enqueue(L, m, r);
+  return 0;
+}
+
+// Lua: m:write(unit, kind, addr, value | { values }[, function(ok | nil, err)])
+// Writes coils or holding registers: one value goes as a single write,
+// a table as a multiple one. Unit 0 is a broadcast on RTU, which nothing
+// answers; the callback has it done once sent.
+static int mb_write(lua_State *L)
+{
+  mb_master_t *m = mb_master_check(L);
+  int unit = mb_check_unit(L, 2);
+  int kind = luaL_checkoption(L, 3, NULL, mb_kinds);
+  luaL_argcheck(L, kind == MB_COILS || kind == MB_HOLDING, 3, "read-only table");
+  int addr = mb_check_addr(L, 4);
+  bool bits = MB_BITS(kind);
+  mb_req_t *r;
+  if (lua_istable(L, 5)) {
+    int count = lua_objlen(L, 5);
+    luaL_argcheck(L, count > 0 && count <= (bits ? MB_WRITE_BITS : MB_WRITE_REGS)
+                  && addr + count <= 0x10000, 5, "invalid count");
+    r = mb_req_new(L, unit, kind, bits ? 15 : 16, addr, count);
+    size_t bytes = bits ? (count + 7) / 8 : count * 2;
+    r->pdu[5] = bytes;
+    memset(r->pdu + 6, 0, bytes);
+    for (int i = 0; i < count; i++) {
+      lua_rawgeti(L, 5, i + 1);
+      uint32_t v = lua_isboolean(L, -1) ? lua_toboolean(L, -1) : (uint32_t)lua_tointeger(L, -1);
+      lua_pop(L, 1);
+      if (bits) {
+        if (v)
+          r->pdu[6 + i / 8] |= 1 << (i % 8);
+      } else {
+        r->pdu[6 + 2 * i] = v >> 8;
+        r->pdu[7 + 2 * i] = v;
+      }
+    }
+    r->len = 6 + bytes;
+  } else {
+    uint32_t v = lua_isboolean(L, 5) ? lua_toboolean(L, 5) : (uint32_t)luaL_checkinteger(L, 5);
+    r = mb_req_new(L, unit, kind, bits ? 5 : 6, addr, 1);
+    if (bits)
+      v = v ? 0xff00 : 0;
+    r->pdu[3] = v >> 8;
+    r->pdu[4] = v;
+  }
+  if (!lua_isnoneornil(L, 6)) {
+    luaL_checkanyfunction(L, 6);
+    lua_pushvalue(L, 6);
+    r->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  mb_enqueue(L, m, r);
+  return 0;
+}
+
+static int mb_block_cmp(const void *a, const void *b)
+{
+  const mb_block_t *x = (const mb_block_t *)a, *y = (const mb_block_t *)b;
+  if (x->unit != y->unit)
+    return x->unit - y->unit;
+  if (x->kind != y->kind)
+    return x->kind - y->kind;
+  return x->addr - y->addr;
+}
+
+// Lua: m:poll({ { unit = n, kind = k, addr = a, count = c }, ... }, ms[, function(m, failed)])
+// m:poll()
+// Reads the registers listed every ms milliseconds, for master:get().
+// Ranges of the same unit and table that are close together are read
+// with one request, within what one request can read. The callback comes
+// after each round with the number of requests that failed. Without
+// arguments, polling stops. A round still going when the next is due
+// makes it skip one.
+static int mb_poll(lua_State *L)
+{
+  mb_master_t *m = mb_master_check(L);
+  os_timer_disarm(&m->poll_timer);
+  luaL_unref(L, LUA_REGISTRYINDEX, m->poll_cb_ref);
+  m->poll_cb_ref = LUA_NOREF;
+  // Requests of the old round still queued get their answers dropped
+  for (mb_req_t *r = m->queue; r; r = r->next)
+    r->block = NULL;
+  if (m->cur)
+    m->cur->block = NULL;
+  m->poll_left = 0;
+  mb_blocks_free(m);
+  if (lua_isnoneornil(L, 2))
+    return 0;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  int ms = luaL_checkinteger(L, 3);
+  luaL_argcheck(L, ms > 0, 3, "invalid interval");
+  int n = lua_objlen(L, 2);
+  luaL_argcheck(L, n > 0, 2, "nothing to poll");
+  mb_block_t *in = (mb_block_t *)calloc(n, sizeof(mb_block_t));
+  if (!in)
+    return luaL_error(L, "out of memory");
+  for (int i = 0; i < n; i++) {
+    lua_rawgeti(L, 2, i + 1);
+    if (!lua_istable(L, -1)) {
+      free(in);
+      return luaL_error(L, "poll entry %d isn't a table", i + 1);
+    }
+    lua_getfield(L, -1, "unit");
+    lua_getfield(L, -2, "kind");
+    lua_getfield(L, -3, "addr");
+    lua_getfield(L, -4, "count");
+    int unit = luaL_optinteger(L, -4, -1);
+    int kind = lua_isstring(L, -3) ? luaL_checkoption(L, -3, NULL, mb_kinds) : -1;
+    int addr = luaL_optinteger(L, -2, -1);
+    int count = luaL_optinteger(L, -1, 1);
+    lua_pop(L, 5);
+    if (unit < 1 || unit > 255 || kind < 0 || addr < 0 || count < 1 ||
+        count > (MB_BITS(kind) ? MB_READ_BITS : MB_READ_REGS) || addr + count > 0x10000) {
+      free(in);
+      return luaL_error(L, "invalid poll entry %d", i + 1);
+    }
+    in[i].unit = unit;
+    in[i].kind = kind;
+    in[i].addr = addr;
+    in[i].count = count;
+  }
+  qsort(in, n, sizeof(mb_block_t), mb_block_cmp);
+
+  // Merge in place: in[k] grows while the next range is near and fits
+  int k = 0;
+  for (int i = 1; i < n; i++) {
+    mb_block_t *b = &in[k], *e = &in[i];
+    uint32_t end = b->addr + b->count, e_end = e->addr + e->count;
+    uint32_t max = MB_BITS(b->kind) ? MB_READ_BITS : MB_READ_REGS;
+    uint32_t merged = (e_end > end ? e_end : end) - b->addr;
+    if (e->unit == b->unit && e->kind == b->kind &&
+        e->addr <= end + MB_MERGE_GAP && merged <= max)
+      b->count = merged;
+    else
+      in[++k] = *e;
+  }
+  n = k + 1;
+  for (int i = 0; i < n; i++) {
+    in[i].values = (uint16_t *)calloc(in[i].count, sizeof(uint16_t));
+    if (!in[i].values) {
+      m->blocks = in;
+      m->nblocks = i;
+      mb_blocks_free(m);
+      return luaL_error(L, "out of memory");
+    }
+  }
+  m->blocks = in;
+  m->nblocks = n;
+  m->poll_ms = ms;
+  if (!lua_isnoneornil(L, 4)) {
+    luaL_checkanyfunction(L, 4);
+    lua_pushvalue(L, 4);
+    m->poll_cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  os_timer_arm(&m->poll_timer, ms, 1);
+  mb_poll_start(L, m);
+  return 0;
+}
+
+// Lua: v1, v2, ... = m:get(unit, kind, addr[, count])
+// The values polling last read, or nil and why not: "not polled",
+// "no answer yet", or the error of the last request for them
+static int mb_get(lua_State *L)
+{
+  mb_master_t *m = mb_master_check(L);
+  int unit = mb_check_unit(L, 2);
+  int kind = luaL_checkoption(L, 3, NULL, mb_kinds);
+  int addr = mb_check_addr(L, 4);
+  int count = luaL_optinteger(L, 5, 1);
+  luaL_argcheck(L, count > 0 && count <= MB_READ_BITS, 5, "invalid count");
+  for (unsigned i = 0; i < m->nblocks; i++) {
+    mb_block_t *b = &m->blocks[i];
+    if (b->unit != unit || b->kind != kind || addr < b->addr || addr + count > b->addr + b->count)
+      continue;
+    if (!b->valid) {
+      lua_pushnil(L);
+      if (b->err == MB_ERR_NONE)
+        lua_pushliteral(L, "no answer yet");
+      else
+        mb_push_err(L, b->err);
+      return 2;
+    }
+    luaL_checkstack(L, count, "too many values");
+    for (int j = 0; j < count; j++)
+      lua_pushinteger(L, b->values[addr - b->addr + j]);
+    return count;
+  }
+  lua_pushnil(L);
+  lua_pushliteral(L, "not polled");
+  return 2;
+}
+
+// Lua: stats = m:stats()
+// requests sent, answers, timeouts, exceptions, bad frames, queued and the
+// requests each poll round takes
+static int mb_master_stats(lua_State *L)
+{
+  mb_master_t *m = mb_master_check(L);
+  unsigned queued = 0;
+  for (mb_req_t *r = m->queue; r; r = r->next)
+    queued++;
+  lua_createtable(L, 0, 7);
+  lua_pushinteger(L, m->requests);
+  lua_setfield(L, -2, "requests");
+  lua_pushinteger(L, m->answers);
+  lua_setfield(L, -2, "answers");
+  lua_pushinteger(L, m->timeouts);
+  lua_setfield(L, -2, "timeouts");
+  lua_pushinteger(L, m->exceptions);
+  lua_setfield(L, -2, "exceptions");
+  lua_pushinteger(L, m->link.bad);
+  lua_setfield(L, -2, "bad");
+  lua_pushinteger(L, queued);
+  lua_setfield(L, -2, "queued");
+  lua_pushinteger(L, m->nblocks);
+  lua_setfield(L, -2, "blocks");
+  return 1;
+}
+
+// Lua: m:close()
+// Requests not yet answered are dropped without their callbacks; the
+// UART goes back to the uart module, a socket stays open
+static int mb_master_close(lua_State *L)
+{
+  mb_master_t *m = (mb_master_t *)luaL_checkudata(L, 1, MB_MASTER_OBJ);
+  if (m->link.closed)
+    return 0;
+  mb_link_close(L, &m->link);
+  os_timer_disarm(&m->timer);
+  os_timer_disarm(&m->poll_timer);
+  for (mb_master_t **p = &mb_masters; *p; p = &(*p)->next)
+    if (*p == m) {
+      *p = m->next;
+      break;
+    }
+  if (m->cur)
+    mb_req_free(L, m->cur);
+  m->cur = NULL;
+  while (m->queue) {
+    mb_req_t *r = m->queue;
+    m->queue = r->next;
+    mb_req_free(L, r);
+  }
+  m->tail = NULL;
+  mb_blocks_free(m);
+  luaL_unref(L, LUA_REGISTRYINDEX, m->poll_cb_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, m->self_ref);
+  m->poll_cb_ref = m->self_ref = LUA_NOREF;
+  return 0;
+}
+
+// --- Slave
+
+typedef struct mb_port {
+  mb_link_t link;
+  struct mb_port *next;
+  struct mb_slave *slave;
+} mb_port_t;
+
+typedef struct mb_slave {
+  uint8_t unit;
+  bool closed;
+  int self_ref;
+  int write_ref;
+  uint16_t size[MB_KINDS];
+  uint8_t *bits[2];         // coils and discrete inputs, 8 to a byte
+  uint16_t *regs[2];        // holding and input registers
+  mb_port_t *ports;
+  uint32_t requests, exceptions;
+} mb_slave_t;
+
+static bool mb_bit(const uint8_t *bits, unsigned i)
+{
+  return (bits[i / 8] >> (i % 8)) & 1;
+}
+
+static void mb_set_bit(uint8_t *bits, unsigned i, bool v)
+{
+  if (v)
+    bits[i / 8] |= 1 << (i % 8);
+  else
+    bits[i / 8] &= ~(1 << (i % 8));
+}
+
+static void mb_slave_written(lua_State *L, mb_slave_t *s, int kind, unsigned addr, unsigned count)
+{
+  if (s->write_ref == LUA_NOREF)
+    return;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, s->write_ref);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, s->self_ref);
+  lua_pushstring(L, mb_kinds[kind]);
+  lua_pushinteger(L, addr);
+  lua_pushinteger(L, count);
+  // s stays on the stack under the call, which may close it
+  lua_rawgeti(L, LUA_REGISTRYINDEX, s->self_ref);
+  lua_insert(L, -6);
+  lua_call(L, 4, 0);
+  lua_pop(L, 1);
+}
+
+// The answer to the request in pdu, built in out. Returns its length, and
+// in *wkind, *waddr and *wcount what was written if anything was.
+static size_t mb_serve(mb_slave_t *s, const uint8_t *pdu, size_t len, uint8_t *out,
+                       int *wkind, unsigned *waddr, unsigned *wcount)
+{
+  uint8_t fc = pdu[0];
+  uint8_t ex = 0;
+  out[0] = fc;
+  *wkind = -1;
+  if (len < 5) {
+    ex = fc >= 1 && fc <= 16 ? MB_EX_VALUE : MB_EX_FUNCTION;
+    goto exception;
+  }
+  unsigned addr = (pdu[1] << 8) | pdu[2];
+  unsigned count = (pdu[3] << 8) | pdu[4];
+  switch (fc) {
+  case 1: case 2: case 3: case 4: {
+    int kind = fc - 1;
+    if (count < 1 || count > (MB_BITS(kind) ? MB_READ_BITS : MB_READ_REGS)) {
+      ex = MB_EX_VALUE;
+      break;
+    }
+    if (addr + count > s->size[kind]) {
+      ex = MB_EX_ADDRESS;
+      break;
+    }
+    if (MB_BITS(kind)) {
+      size_t bytes = (count + 7) / 8;
+      out[1] = bytes;
+      memset(out + 2, 0, bytes);
+      for (unsigned i = 0; i < count; i++)
+        if (mb_bit(s->bits[kind], addr + i))
+          out[2 + i / 8] |= 1 << (i % 8);
+      return 2 + bytes;
+    }
+    out[1] = count * 2;
+    for (unsigned i = 0; i < count; i++) {
+      uint16_t v = s->regs[kind - MB_HOLDING][addr + i];
+      out[2 + 2 * i] = v >> 8;
+      out[3 + 2 * i] = v;
+    }
+    return 2 + count * 2;
+  }
+  case 5:
+    if (count != 0xff00 && count != 0) {
+      ex = MB_EX_VALUE;
+      break;
+    }
+    if (addr >= s->size[MB_COILS]) {
+      ex = MB_EX_ADDRESS;
+      break;
+    }
+    mb_set_bit(s->bits[MB_COILS], addr, count != 0);
+    *wkind = MB_COILS;
+    *waddr = addr;
+    *wcount = 1;
+    memcpy(out, pdu, 5);
+    return 5;
+  case 6:
+    if (addr >= s->size[MB_HOLDING]) {
+      ex = MB_EX_ADDRESS;
+      break;
+    }
+    s->regs[0][addr] = count;
+    *wkind = MB_HOLDING;
+    *waddr = addr;
+    *wcount = 1;
+    memcpy(out, pdu, 5);
+    return 5;
+  case 15: case 16: {
+    bool bits = fc == 15;
+    int kind = bits ? MB_COILS : MB_HOLDING;
+    size_t bytes = bits ? (count + 7) / 8 : count * 2;
+    if (count < 1 || count > (bits ? MB_WRITE_BITS : MB_WRITE_REGS) ||
+        len < 6 || pdu[5] != bytes || len != 6 + bytes) {
+      ex = MB_EX_VALUE;
+      break;
+    }
+    if (addr + count > s->size[kind]) {
+      ex = MB_EX_ADDRESS;
+      break;
+    }
+    for (unsigned i = 0; i < count; i++) {
+      if (bits)
+        mb_set_bit(s->bits[MB_COILS], addr + i, mb_bit(pdu + 6, i));
+      else
+        s->regs[0][addr + i] = (pdu[6 + 2 * i] << 8) | pdu[7 + 2 * i];
+    }
+    *wkind = kind;
+    *waddr = addr;
+    *wcount = count;
+    memcpy(out, pdu, 5);
+    return 5;
+  }
+  default:
+    ex = MB_EX_FUNCTION;
+  }
+exception:
+  out[0] = fc | 0x80;
+  out[1] = ex;
+  s->exceptions++;
+  return 2;
+}
+
+static void mb_slave_adu(lua_State *L, mb_link_t *k, uint16_t tid, uint8_t unit,
+                         const uint8_t *pdu, size_t len)
+{
+  mb_port_t *p = (mb_port_t *)k;
+  mb_slave_t *s = p->slave;
+  // Over TCP the unit is mostly a gateway's business, 0 and 255 mean us
+  bool ours = unit == s->unit || (k->tcp && (unit == 0 || unit == 0xff));
+  if (!ours && unit != 0)
+    return;
+  s->requests++;
+  uint8_t out[MB_PDU_MAX];
+  int wkind;
+  unsigned waddr, wcount;
+  size_t n = mb_serve(s, pdu, len, out, &wkind, &waddr, &wcount);
+  if (ours)
+    mb_link_send(L, k, tid, unit, out, n);
+  if (wkind >= 0)
+    mb_slave_written(L, s, wkind, waddr, wcount);
+}
+
+static void mb_port_unlink(mb_slave_t *s, mb_port_t *p)
+{
+  for (mb_port_t **q = &s->ports; *q; q = &(*q)->next)
+    if (*q == p) {
+      *q = p->next;
+      break;
+    }
+}
+
+static void mb_slave_gone(lua_State *L, mb_link_t *k)
+{
+  mb_port_t *p = (mb_port_t *)k;
+  mb_link_close(L, k);
+  mb_port_unlink(p->slave, p);
+  free(p);
+}
+
+static mb_slave_t *mb_slave_check(lua_State *L)
+{
+  mb_slave_t *s = (mb_slave_t *)luaL_checkudata(L, 1, MB_SLAVE_OBJ);
+  if (s->closed)
+    luaL_error(L, "closed");
+  return s;
+}
+
+// Lua: s = modbus.slave(unit, { coils = n, discrete = n, holding = n, input = n })
+// A slave with tables of those sizes, all zero, not yet listening anywhere
+static int mb_slave_new(lua_State *L)
+{
+  int unit = mb_check_unit(L, 1);
+  luaL_argcheck(L, unit >= 1 && unit <= 247, 1, "invalid unit");
+  luaL_checktype(L, 2, LUA_TTABLE);
+  mb_slave_t *s = (mb_slave_t *)lua_newuserdata(L, sizeof(mb_slave_t));
+  memset(s, 0, sizeof(*s));
+  s->closed = true;
+  s->self_ref = s->write_ref = LUA_NOREF;
+  luaL_getmetatable(L, MB_SLAVE_OBJ);
+  lua_setmetatable(L, -2);
+  s->unit = unit;
+  for (int kind = 0; kind < MB_KINDS; kind++) {
+    lua_getfield(L, 2, mb_kinds[kind]);
+    int n = luaL_optinteger(L, -1, 0);
+    lua_pop(L, 1);
+    luaL_argcheck(L, n >= 0 && n <= 0x10000, 2, "invalid table size");
+    s->size[kind] = n == 0x10000 ? 0xffff : n;
+    if (!n)
+      continue;
+    void *t = MB_BITS(kind) ? calloc((n + 7) / 8, 1) : calloc(n, sizeof(uint16_t));
+    if (!t)
+      return luaL_error(L, "out of memory");
+    if (MB_BITS(kind))
+      s->bits[kind] = (uint8_t *)t;
+    else
+      s->regs[kind - MB_HOLDING] = (uint16_t *)t;
+  }
+  s->closed = false;
+  lua_pushvalue(L, -1);
+  s->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+// Lua: s:serve(uart_id | socket)
+// Answers requests on UART id, or on a connected net TCP socket, say one
+// a net server has accepted. It stops with the socket's connection.
+static int mb_slave_serve(lua_State *L)
+{
+  mb_slave_t *s = mb_slave_check(L);
+  mb_port_t *p = (mb_port_t *)calloc(1, sizeof(mb_port_t));
+  if (!p)
+    return luaL_error(L, "out of memory");
+  p->slave = s;
+  p->link.gone = mb_slave_gone;
+  // Listed closed until it's open, so an error leaves it for __gc to free
+  p->link.closed = true;
+  p->next = s->ports;
+  s->ports = p;
+  mb_link_open(L, &p->link, 2, true, mb_slave_adu);
+  p->link.closed = false;
+  return 0;
+}
+
+static void mb_check_range(lua_State *L, mb_slave_t *s, int kind, int addr, int count)
+{
+  if (count < 1 || addr + count > s->size[kind])
+    luaL_error(L, "past the end of the %s table", mb_kinds[kind]);
+}
+
+// Lua: s:set(kind, addr, value | { values })
+static int mb_slave_set(lua_State *L)
+{
+  mb_slave_t *s = mb_slave_check(L);
+  int kind = luaL_checkoption(L, 2, NULL, mb_kinds);
+  int addr = mb_check_addr(L, 3);
+  bool many = lua_istable(L, 4);
+  int count = many ? lua_objlen(L, 4) : 1;
+  mb_check_range(L, s, kind, addr, count);
+  for (int i = 0; i < count; i++) {
+    if (many)
+      lua_rawgeti(L, 4, i + 1);
+    else
+      lua_pushvalue(L, 4);
+    uint32_t v = lua_isboolean(L, -1) ? lua_toboolean(L, -1) : (uint32_t)luaL_checkinteger(L, -1);
+    lua_pop(L, 1);
+    if (MB_BITS(kind))
+      mb_set_bit(s->bits[kind], addr + i, v != 0);
+    else
+      s->regs[kind - MB_HOLDING][addr + i] = v;
+  }
+  return 0;
+}
+
+// Lua: v1, v2, ... = s:get(kind, addr[, count])
+static int mb_slave_get(lua_State *L)
+{
+  mb_slave_t *s = mb_slave_check(L);
+  int kind = luaL_checkoption(L, 2, NULL, mb_kinds);
+  int addr = mb_check_addr(L, 3);
+  int count = luaL_optinteger(L, 4, 1);
+  mb_check_range(L, s, kind, addr, count);
+  luaL_checkstack(L, count, "too many values");
+  for (int i = 0; i < count; i++)
+    lua_pushinteger(L, MB_BITS(kind) ? mb_bit(s->bits[kind], addr + i)
+                                     : s->regs[kind - MB_HOLDING][addr + i]);
+  return count;
+}
+
+// Lua: s:on("write", function(s, kind, addr, count))
+// Called after a master has written coils or holding registers, once the
+// answer has gone
+static int mb_slave_on(lua_State *L)
+{
+  mb_slave_t *s = mb_slave_check(L);
+  static const char * const events[] = { "write", NULL };
+  luaL_checkoption(L, 2, NULL, events);
+  luaL_unref(L, LUA_REGISTRYINDEX, s->write_ref);
+  s->write_ref = LUA_NOREF;
+  if (!lua_isnoneornil(L, 3)) {
+    luaL_checkanyfunction(L, 3);
+    lua_pushvalue(L, 3);
+    s->write_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  return 0;
+}
+
+// Lua: stats = s:stats()
+static int mb_slave_stats(lua_State *L)
+{
+  mb_slave_t *s = mb_slave_check(L);
+  uint32_t bad = 0;
+  unsigned ports = 0;
+  for (mb_port_t *p = s->ports; p; p = p->next) {
+    bad += p->link.bad;
+    ports += !p->link.closed;
+  }
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, s->requests);
+  lua_setfield(L, -2, "requests");
+  lua_pushinteger(L, s->exceptions);
+  lua_setfield(L, -2, "exceptions");
+  lua_pushinteger(L, bad);
+  lua_setfield(L, -2, "bad");
+  lua_pushinteger(L, ports);
+  lua_setfield(L, -2, "ports");
+  return 1;
+}
+
+// Lua: s:close()
+// Stops answering everywhere; sockets stay open
+static int mb_slave_close(lua_State *L)
+{
+  mb_slave_t *s = (mb_slave_t *)luaL_checkudata(L, 1, MB_SLAVE_OBJ);
+  s->closed = true;
+  // The ports are freed at __gc: this may run in the middle of one's input
+  for (mb_port_t *p = s->ports; p; p = p->next)
+    mb_link_close(L, &p->link);
+  luaL_unref(L, LUA_REGISTRYINDEX, s->write_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, s->self_ref);
+  s->write_ref = s->self_ref = LUA_NOREF;
+  return 0;
+}
+
+static int mb_slave_gc(lua_State *L)
+{
+  mb_slave_t *s = (mb_slave_t *)luaL_checkudata(L, 1, MB_SLAVE_OBJ);
+  mb_slave_close(L);
+  while (s->ports) {
+    mb_port_t *p = s->ports;
+    s->ports = p->next;
+    free(p);
+  }
+  for (int i = 0; i < 2; i++) {
+    free(s->bits[i]);
+    free(s->regs[i]);
+    s->bits[i] = NULL;
+    s->regs[i] = NULL;
+  }
+  return 0;
+}
+
+static const LUA_REG_TYPE mb_master_map[] = {
+  { LSTRKEY("read"),    LFUNCVAL(mb_read) },
+  { LSTRKEY("write"),   LFUNCVAL(mb_write) },
+  { LSTRKEY("poll"),    LFUNCVAL(mb_poll) },
+  { LSTRKEY("get"),     LFUNCVAL(mb_get) },
+  { LSTRKEY("stats"),   LFUNCVAL(mb_master_stats) },
+  { LSTRKEY("close"),   LFUNCVAL(mb_master_close) },
+  { LSTRKEY("__gc"),    LFUNCVAL(mb_master_close) },
+  { LSTRKEY("__index"), LROVAL(mb_master_map) },
+  { LNILKEY, LNILVAL }
+};
+
+static const LUA_REG_TYPE mb_slave_map[] = {
+  { LSTRKEY("serve"),   LFUNCVAL(mb_slave_serve) },
+  { LSTRKEY("set"),     LFUNCVAL(mb_slave_set) },
+  { LSTRKEY("get"),     LFUNCVAL(mb_slave_get) },
+  { LSTRKEY("on"),      LFUNCVAL(mb_slave_on) },
+  { LSTRKEY("stats"),   LFUNCVAL(mb_slave_stats) },
+  { LSTRKEY("close"),   LFUNCVAL(mb_slave_close) },
+  { LSTRKEY("__gc"),    LFUNCVAL(mb_slave_gc) },
+  { LSTRKEY("__index"), LROVAL(mb_slave_map) },
+  { LNILKEY, LNILVAL }
+};
+
+const LUA_REG_TYPE modbus_map[] = {
+  { LSTRKEY("master"),  LFUNCVAL(mb_master_new) },
+  { LSTRKEY("slave"),   LFUNCVAL(mb_slave_new) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_modbus(lua_State *L)
+{
+  luaL_rometatable(L, MB_MASTER_OBJ, (void *)mb_master_map);
+  luaL_rometatable(L, MB_SLAVE_OBJ, (void *)mb_slave_map);
+  mb_uart_task = task_get_id(mb_uart_event);
+  mb_timer_task = task_get_id(mb_master_timer);
+  mb_poll_task = task_get_id(mb_master_poll);
+  // Claims go through the driver callbacks the uart module hooks
+  luaR_getglobal(L, LUA_UARTLIBNAME, strlen(LUA_UARTLIBNAME));
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register(L, LUA_MODBUSLIBNAME, modbus_map);
+  return 1;
+#endif
+}
@@ -1,4 +1,3 @@
-
  /* mqtt.c
  */
 
@@ -8,490 +7,917 @@
 #include "lrotable.h"
 #include "lualib.h"
 #include "user_config.h"
-   
+
 #include "platform.h"
+#include "mqtt.h"
+#include "ringbuf.h"
+#include "topic_trie.h"
+#include "cbref.h"
+#include "buffer.h"
+#include "task/task.h"
+#include "log_store.h"
+#include "platform_partition.h"
+#include "esp_timer.h"
+#include "vfs.h"
+#include "sdkconfig.h"
+#include <string.h>
+#include <stdlib.h>
 
-#define MQTT_CMD_TIMEOUT        5000  // 5s
-#define MQTT_YIELD_TMIE         1000  // 1s
+// Clients are numbered by slot, which event records carry in a byte
+#define MQTT_MAX_CLIENTS 255
 
-#define MAX_MQTT_NUM 3
+// Records delivered per pass of the Lua task before it looks at other events
+#define MQTT_BATCH    8
+// Incremental collection after each batch, in KB
+#define MQTT_GC_STEP  4
+
+// Offline queue replay: a burst every tick making up CONFIG_MQTT_REPLAY_RATE a second
+#if CONFIG_MQTT_REPLAY_RATE >= 100
+#define MQTT_REPLAY_MS    10
+#define MQTT_REPLAY_BURST (CONFIG_MQTT_REPLAY_RATE / 100)
+#else
+#define MQTT_REPLAY_MS    (1000 / CONFIG_MQTT_REPLAY_RATE)
+#define MQTT_REPLAY_BURST 1
+#endif
 
 //#define mqtt_log(M, ...) printf(M, ##__VA_ARGS__)
 #define mqtt_log(M, ...)
-#if 0
+
+/*
+ * The espmqtt tasks never touch Lua. Their callbacks write a record for
+ * each event into one ring, the pooled buffer every payload travels in,
+ * and wake the Lua task, which delivers them in batches. A full ring makes
+ * the receiving task wait, and with it the broker, instead of losing
+ * messages or growing the heap.
+ */
+enum {
+  MQTT_EV_CONNECT,
+  MQTT_EV_OFFLINE,
+  MQTT_EV_SUBSCRIBED,
+  MQTT_EV_DATA
+};
+
+typedef struct {
+  uint8_t type;
+  uint8_t slot;         // client
+  uint16_t topic_len;   // only with the first piece of a message
+  uint16_t data_len;    // this piece
+  uint32_t data_offset;
+  uint32_t data_total;
+} mqtt_rec_t;
+
+// How the message coming in is being taken
+enum {
+  MQTT_RX_NONE,         // dropped
+  MQTT_RX_WHOLE,        // put back together for the message callbacks
+  MQTT_RX_STREAM,       // a piece at a time to 'data'
+  MQTT_RX_FILE          // into a sink file
+};
+
+/*
+ * Publishes made while offline wait in RAM, oldest first. Once
+ * CONFIG_MQTT_OFFLINE_RAM bytes of a client are waiting, later ones go to
+ * the "mqttq" flash partition, so they outlive a long outage or a reset;
+ * should that fill up too, its oldest records are lost. Without the
+ * partition (it is in partitions-LuaNode-stores.csv only) publishing
+ * fails once the RAM is used up. The partition
+ * serves one client at a time, the first to need it; what one leaves
+ * there, closed or reset, goes out with the next. After reconnecting
+ * they are sent in order at CONFIG_MQTT_REPLAY_RATE a second, and so is
+ * whatever is published until the queue has run dry. A record is
+ *
+ *   uint8 qos | retain << 2, topic, '\0', data
+ */
+typedef struct mqtt_queued {
+  struct mqtt_queued *next;
+  uint32_t len;
+  uint8_t rec[];
+} mqtt_queued_t;
+
 typedef struct {
-  Client c;
-  Network n;
-  ssl_opts ssl_settings;
-  MQTTPacket_connectData connectData;
-  char *pServer;//remote server
-  int port;     //remote port
-  bool reqStart;//need start
-  bool reqClose;//need close
-  bool reqSucrible;
-  bool requnSucrible;
-  bool reqPublish;
-  bool req_goto_disconect;
-  uint32_t keepaliveTick;
-  int qos;
-  char *pTopic;
-  char *pData;
-  size_t pDataLen;
+  mqtt_settings settings;   // first, espmqtt hands it back to the callbacks
+  mqtt_client *client;
+  bool closed;
+  bool online;          // as far as the Lua task has heard
+  uint8_t slot;
   int cb_ref_connect;
   int cb_ref_offline;
-  int cb_ref_message;
-}mqtt_t;
-mqtt_t *pmqtt[MAX_MQTT_NUM];
-bool mqtt_thread_is_started = false;
-
-static lua_State *gL = NULL;
-
-
-static void messageArrived(MessageData* md)
-{
-  mqtt_log("messageArrived Called\r\n");
-  MQTTMessage* message = md->message;
-  mqtt_log("messageArrived: [%.*s]\t [%d][%.*s]\r\n",
-                  md->topicName->lenstring.len, md->topicName->lenstring.data,
-                  (int)message->payloadlen,
-                  (int)message->payloadlen, (char*)message->payload);
-  for(int i=0;i<MAX_MQTT_NUM;i++)
-  {
-    if(pmqtt[i]==NULL || pmqtt[i]->cb_ref_message == LUA_NOREF) continue;
-      lua_rawgeti(gL, LUA_REGISTRYINDEX,  pmqtt[i]->cb_ref_message);
-      lua_pushlstring(gL,(char const*)md->topicName->lenstring.data,md->topicName->lenstring.len);
-      lua_pushlstring(gL,(char const*)message->payload,(int)message->payloadlen);
-      lua_call(gL, 2, 0);
+  int cb_ref_message;   // messages no subscription callback takes
+  int cb_ref_data;      // messages in pieces, instead of whole
+  int cb_ref_file;      // a sink file is complete
+  topic_trie_t subs;    // subscription callbacks by topic filter
+  topic_trie_t sinks;   // refs of file paths by topic filter
+  bool rx_buffer;       // 'message' and 'data' get buffers, not strings
+  uint8_t rx_mode;      // message coming in
+  char *rx_topic;
+  size_t rx_topic_len;
+  char *rx_data;        // MQTT_RX_WHOLE
+  char *rx_path;        // MQTT_RX_FILE
+  int rx_fd;
+  bool rx_failed;       // a write to the file didn't make it
+  mqtt_queued_t *q_head;  // offline queue
+  mqtt_queued_t **q_tail;
+  uint32_t q_bytes;
+  uint32_t q_count;
+  bool replaying;
+  os_timer_t replay_timer;
+} mqtt_t;
+
+// Grown as clients are made. A closed one keeps its slot, espmqtt can't
+// let go of its settings
+static mqtt_t **pmqtt;
+static unsigned mqtt_num;
+// the callbacks, subscription callbacks and sink paths of all of them
+static cbref_table_t mqtt_cbs = CBREF_TABLE("mqtt", false);
+static RINGBUF mqtt_rx;
+static SemaphoreHandle_t mqtt_rx_lock;  // every client's task writes mqtt_rx
+static uint8_t *mqtt_rx_buf;
+static task_handle_t mqtt_event;
+
+static struct {
+  mqtt_t *owner;
+  uint32_t count;             // records from pos on
+  log_store_pos_t pos;
+  bool checked;
+} mqf;
+
+static log_store_t mqtt_flash = LOG_STORE_INIT(PLATFORM_PARTITION_SUBTYPE_NODEMCU_MQTTQ);
+static task_handle_t mqtt_replay_task;
+
+// --- espmqtt task side
+
+static mqtt_t *mqtt_of(void *client)
+{
+  return (mqtt_t *)((mqtt_client *)client)->settings;
+}
+
+static void mqtt_post(const mqtt_rec_t *rec, const char *topic, const char *data)
+{
+  rb_part_t parts[3] = {
+    { rec, sizeof(*rec) },
+    { topic, rec->topic_len },
+    { data, rec->data_len }
+  };
+  // the ring has room for one writer, the others queue up here
+  xSemaphoreTake(mqtt_rx_lock, portMAX_DELAY);
+  int32_t res = rb_writev(&mqtt_rx, parts, 3, portMAX_DELAY);
+  xSemaphoreGive(mqtt_rx_lock);
+  if (res < 0) {
+    mqtt_log("mqtt event too big for the ring\r\n");
+    return;
   }
+  // wakes a drained pump; a partly drained one has re-posted itself
+  task_post_coalesced_low(mqtt_event, 0);
 }
 
-static void closeMqtt(int id)
-{
-  mqtt_log("[mqtt:%d]closeMqtt\r\n",id);
-  if(pmqtt[id]==NULL) return;
-  
-  pmqtt[id]->reqClose=false;
-  if(pmqtt[id]->c.isconnected) {MQTTDisconnect(&(pmqtt[id]->c));}
-  pmqtt[id]->n.disconnect(&(pmqtt[id]->n));
-  if(MQTT_SUCCESS != MQTTClientDeinit(&(pmqtt[id]->c)))
-        mqtt_log("[mqtt:%d]MQTTClientDeinit failed!",id);
-   if(pmqtt[id]->cb_ref_connect != LUA_NOREF)
-      luaL_unref(gL, LUA_REGISTRYINDEX, pmqtt[id]->cb_ref_connect); 
-   pmqtt[id]->cb_ref_connect = LUA_NOREF;
-   if(pmqtt[id]->cb_ref_offline != LUA_NOREF)
-      luaL_unref(gL, LUA_REGISTRYINDEX, pmqtt[id]->cb_ref_offline); 
-   pmqtt[id]->cb_ref_offline = LUA_NOREF;
-   if(pmqtt[id]->cb_ref_message != LUA_NOREF)
-      luaL_unref(gL, LUA_REGISTRYINDEX, pmqtt[id]->cb_ref_message); 
-   pmqtt[id]->cb_ref_message = LUA_NOREF;
-   free(pmqtt[id]);
-   pmqtt[id]=NULL;
-}
-static void _thread_mqtt(void*inContext)
-{
-  (void)inContext;
-
-  int rc = -1;
-  fd_set readfds;
-  struct timeval_t t = {0, MQTT_YIELD_TMIE*1000};
-  //bool req_goto_disconect[MAX_MQTT_NUM];
-  //uint32_t keepaliveTick[MAX_MQTT_NUM];
-  int i=0;
-  int maxSck=0;
-MQTT_start:
-  for(i=0;i<MAX_MQTT_NUM;i++)
-  {
-    if(pmqtt[i] !=NULL && pmqtt[i]->reqStart==true)
-    {
-      pmqtt[i]->reqStart=false;
-      rc = NewNetwork(&(pmqtt[i]->n), pmqtt[i]->pServer, pmqtt[i]->port,pmqtt[i]->ssl_settings);
-      if(rc < 0){
-        mqtt_log("[mqtt:%d]ERROR: Create network err=%d.\r\n",i, rc);
-         pmqtt[i]->req_goto_disconect=true;
-      }
-      else
-        mqtt_log("[mqtt:%d]Create network OK!\r\n",i);
-      rc = MQTTClientInit(&(pmqtt[i]->c), &(pmqtt[i]->n), MQTT_CMD_TIMEOUT);
-      if(MQTT_SUCCESS != rc){
-        mqtt_log("[mqtt:%d]ERROR: MQTT client init err=%d.\r\n",i, rc);
-         pmqtt[i]->req_goto_disconect=true;
-      }
-      else{
-        mqtt_log("[mqtt:%d]MQTT client init OK!\r\n",i);
-      }
-      mqtt_log("[mqtt:%d] client connecting...\r\n",i);
-      mqtt_log("user:[len:%d]%s\r\n",strlen(pmqtt[i]->connectData.username.cstring),pmqtt[i]->connectData.username.cstring);
-      mqtt_log("pass:[len:%d]%s\r\n",strlen(pmqtt[i]->connectData.password.cstring),pmqtt[i]->connectData.password.cstring);
-      rc = MQTTConnect(&(pmqtt[i]->c), &(pmqtt[i]->connectData));
-      if(MQTT_SUCCESS == rc){
-        mqtt_log("[mqtt:%d] MQTT client connect OK!\r\n",i);
-        if(pmqtt[i]->cb_ref_connect  == LUA_NOREF) continue;
-        lua_rawgeti(gL, LUA_REGISTRYINDEX, pmqtt[i]->cb_ref_connect);
-        lua_call(gL, 0, 0);
-        lua_gc(gL, LUA_GCCOLLECT, 0);
-      }
-      else{
-        mqtt_log("[mqtt:%d] ERROR: MQTT client connect err=%d\r\n",i, rc);
-         pmqtt[i]->req_goto_disconect=true;
-      }      
+static void mqtt_post_event(void *client, uint8_t type)
+{
+  mqtt_rec_t rec = { .type = type, .slot = mqtt_of(client)->slot };
+  mqtt_post(&rec, NULL, NULL);
+}
+
+static void mqtt_connected_cb(void *client, void *data)
+{
+  mqtt_post_event(client, MQTT_EV_CONNECT);
+}
+
+static void mqtt_disconnected_cb(void *client, void *data)
+{
+  mqtt_post_event(client, MQTT_EV_OFFLINE);
+}
+
+static void mqtt_subscribe_cb(void *client, void *data)
+{
+  mqtt_post_event(client, MQTT_EV_SUBSCRIBED);
+}
+
+static void mqtt_data_cb(void *client, void *data)
+{
+  mqtt_event_data_t *ev = (mqtt_event_data_t *)data;
+  mqtt_rec_t rec = {
+    .type = MQTT_EV_DATA,
+    .slot = mqtt_of(client)->slot,
+    .topic_len = ev->data_offset == 0 ? ev->topic_length : 0,
+    .data_len = ev->data_length,
+    .data_offset = ev->data_offset,
+    .data_total = ev->data_total_length
+  };
+  mqtt_post(&rec, ev->topic, ev->data);
+}
+
+// --- Lua task side
+
+static void mqtt_skip(size_t len)
+{
+  uint8_t *p;
+  while (len) {
+    size_t n = rb_peek(&mqtt_rx, &p, 0);
+    if (n == 0)
+      break;
+    if (n > len)
+      n = len;
+    rb_consume(&mqtt_rx, n);
+    len -= n;
+  }
+}
+
+// Take len bytes off the ring into a string allocated here
+static char *mqtt_take(size_t len)
+{
+  char *s = (char *)malloc(len + 1);
+  if (s == NULL) {
+    mqtt_log("mqtt out of memory, message dropped\r\n");
+    mqtt_skip(len);
+    return NULL;
+  }
+  rb_read(&mqtt_rx, (uint8_t *)s, len, 0);
+  s[len] = 0;
+  return s;
+}
+
+static void mqtt_drop_message(mqtt_t *m)
+{
+  // a message cut short leaves its sink file as far as it got
+  if (m->rx_fd)
+    vfs_close(m->rx_fd);
+  free(m->rx_topic);
+  free(m->rx_data);
+  free(m->rx_path);
+  m->rx_topic = m->rx_data = m->rx_path = NULL;
+  m->rx_fd = 0;
+  m->rx_mode = MQTT_RX_NONE;
+}
+
+static void mqtt_call(lua_State *L, int ref, int nargs)
+{
+  if (ref == LUA_NOREF) {
+    lua_pop(L, nargs);
+    return;
+  }
+  cbref_get(L, &mqtt_cbs, ref);
+  lua_insert(L, -nargs - 1);
+  lua_call(L, nargs, 0);
+}
+
+static void mqtt_push_ref(int ref, void *arg)
+{
+  lua_State *L = (lua_State *)arg;
+  if (lua_checkstack(L, 2))
+    cbref_get(L, &mqtt_cbs, ref);
+}
+
+static void mqtt_unref(int ref, void *arg)
+{
+  cbref_unref((lua_State *)arg, &mqtt_cbs, ref);
+}
+
+static void mqtt_first_ref(int ref, void *arg)
+{
+  int *first = (int *)arg;
+  if (*first == LUA_NOREF)
+    *first = ref;
+}
+
+// Start on a message with its first piece: into a sink file if one
+// matches, else in pieces to 'data' if it is set, else whole
+static void mqtt_rx_begin(lua_State *L, mqtt_t *m, const mqtt_rec_t *rec)
+{
+  mqtt_drop_message(m);
+  m->rx_topic = mqtt_take(rec->topic_len);
+  m->rx_topic_len = rec->topic_len;
+  if (m->rx_topic == NULL)
+    return;
+
+  int sink = LUA_NOREF;
+  topic_trie_match(&m->sinks, m->rx_topic, m->rx_topic_len, mqtt_first_ref, &sink);
+  if (sink != LUA_NOREF) {
+    cbref_get(L, &mqtt_cbs, sink);
+    // kept, the sink may be gone by the time the file is complete
+    m->rx_path = strdup(lua_tostring(L, -1));
+    lua_pop(L, 1);
+    if (m->rx_path)
+      m->rx_fd = vfs_open(m->rx_path, "w");
+    if (m->rx_fd) {
+      m->rx_failed = false;
+      m->rx_mode = MQTT_RX_FILE;
+    } else {
+      mqtt_log("mqtt can't open sink file, message dropped\r\n");
     }
+  } else if (m->cb_ref_data != LUA_NOREF) {
+    m->rx_mode = MQTT_RX_STREAM;
+  } else {
+    m->rx_data = (char *)malloc(rec->data_total ? rec->data_total : 1);
+    if (m->rx_data)
+      m->rx_mode = MQTT_RX_WHOLE;
+    else
+      mqtt_log("mqtt out of memory, message dropped\r\n");
   }
-  //check goto disconnect
-    for(i=0;i<MAX_MQTT_NUM;i++)
-    if( pmqtt[i] !=NULL && pmqtt[i]->req_goto_disconect==true) goto MQTT_disconnect;
-  mqtt_log("Go to while\r\n");
-  while(1)
-  {
-//check subscribe or unSubcribe
-    for(i=0;i<MAX_MQTT_NUM;i++)
-    {
-      if(pmqtt[i] ==NULL) continue;
-      if(pmqtt[i]->reqSucrible==true)
-      {
-        pmqtt[i]->reqSucrible = false;
-        rc = MQTTSubscribe(&(pmqtt[i]->c), pmqtt[i]->pTopic, (enum QoS)(pmqtt[i]->qos), messageArrived);
-        if(MQTT_SUCCESS == rc)
-          mqtt_log("MQTT client subscribe OK! topic=[%s]\r\n",pmqtt[i]->pTopic);
-        else
-          pmqtt[i]->req_goto_disconect=true;
-        mqtt_log("MQTT client subscribe OK! 2\r\n");
-      }
-      if(pmqtt[i]->requnSucrible==true)
-      {
-        pmqtt[i]->requnSucrible = false;
-        rc = MQTTUnsubscribe(&(pmqtt[i]->c), pmqtt[i]->pTopic);
-        if(MQTT_SUCCESS == rc)
-          mqtt_log("MQTT client unsubscribe OK! topic=[%s]\r\n",pmqtt[i]->pTopic);
-        else
-          pmqtt[i]->req_goto_disconect=true;
-      }   
+}
+
+// Write the next len bytes of the ring to the sink file straight from
+// where they lie
+static void mqtt_rx_file(mqtt_t *m, size_t len)
+{
+  uint8_t *p;
+  while (len) {
+    size_t n = rb_peek(&mqtt_rx, &p, 0);
+    if (n == 0)
+      break;
+    if (n > len)
+      n = len;
+    if (!m->rx_failed && vfs_write(m->rx_fd, p, n) != (int32_t)n)
+      m->rx_failed = true;
+    rb_consume(&mqtt_rx, n);
+    len -= n;
+  }
+}
+
+// Push the next len bytes of the ring as a string, or a buffer
+static void mqtt_push_piece(lua_State *L, mqtt_t *m, size_t len)
+{
+  luaL_Buffer b;
+  uint8_t *p;
+  if (m->rx_buffer) {
+    rb_read(&mqtt_rx, buffer_push(L, len)->data, len, 0);
+    return;
+  }
+  luaL_buffinit(L, &b);
+  while (len) {
+    size_t n = rb_peek(&mqtt_rx, &p, 0);
+    if (n == 0)
+      break;
+    if (n > len)
+      n = len;
+    luaL_addlstring(&b, (const char *)p, n);
+    rb_consume(&mqtt_rx, n);
+    len -= n;
+  }
+  luaL_pushresult(&b);
+}
+
+// A message comes in pieces of at most one network buffer, each taken
+// as it arrives. Only whole messages need all of it in memory at once
+static void mqtt_deliver_data(lua_State *L, mqtt_t *m, const mqtt_rec_t *rec)
+{
+  if (m == NULL || m->closed) {
+    mqtt_skip(rec->topic_len + rec->data_len);
+    return;
+  }
+  if (rec->data_offset == 0)
+    mqtt_rx_begin(L, m, rec);
+  if (m->rx_mode == MQTT_RX_NONE || rec->data_offset + rec->data_len > rec->data_total) {
+    mqtt_drop_message(m);
+    mqtt_skip(rec->data_len);
+    return;
+  }
+  bool last = rec->data_offset + rec->data_len == rec->data_total;
+
+  if (m->rx_mode == MQTT_RX_STREAM) {
+    lua_pushlstring(L, m->rx_topic, m->rx_topic_len);
+    mqtt_push_piece(L, m, rec->data_len);
+    lua_pushinteger(L, rec->data_offset);
+    lua_pushinteger(L, rec->data_total);
+    if (last)
+      mqtt_drop_message(m);
+    mqtt_call(L, m->cb_ref_data, 4);
+    return;
+  }
+  if (m->rx_mode == MQTT_RX_FILE) {
+    mqtt_rx_file(m, rec->data_len);
+    if (!last)
+      return;
+    lua_pushlstring(L, m->rx_topic, m->rx_topic_len);
+    lua_pushstring(L, m->rx_path);
+    if (m->rx_failed)
+      lua_pushnil(L);
+    else
+      lua_pushinteger(L, rec->data_total);
+    mqtt_drop_message(m);
+    mqtt_call(L, m->cb_ref_file, 3);
+    return;
+  }
+
+  rb_read(&mqtt_rx, (uint8_t *)m->rx_data + rec->data_offset, rec->data_len, 0);
+  if (!last)
+    return;
+
+  lua_pushlstring(L, m->rx_topic, m->rx_topic_len);
+  if (m->rx_buffer)
+    memcpy(buffer_push(L, rec->data_total)->data, m->rx_data, rec->data_total);
+  else
+    lua_pushlstring(L, m->rx_data, rec->data_total);
+  int base = lua_gettop(L);
+  topic_trie_match(&m->subs, m->rx_topic, m->rx_topic_len, mqtt_push_ref, L);
+  int n = lua_gettop(L) - base;
+  // freed before the calls, which may raise an error
+  mqtt_drop_message(m);
+  if (n == 0) {
+    mqtt_call(L, m->cb_ref_message, 2);
+    return;
+  }
+  // the callbacks are all on the stack before the first one runs, so one
+  // that subscribes or unsubscribes doesn't pull the trie from under us
+  for (int i = 1; i <= n; i++) {
+    lua_pushvalue(L, base + i);
+    lua_pushvalue(L, base - 1);
+    lua_pushvalue(L, base);
+    lua_call(L, 2, 0);
+  }
+  lua_settop(L, base - 2);
+}
+
+// --- Offline queue, on the Lua task too
+
+static uint32_t mqtt_flash_count(mqtt_t *m)
+{
+  return mqf.owner == m ? mqf.count : 0;
+}
+
+static bool mqtt_queue_empty(mqtt_t *m)
+{
+  return m->q_head == NULL && mqtt_flash_count(m) == 0;
+}
+
+// Count what an earlier run left in flash
+static void mqtt_queue_check(void)
+{
+  uint8_t buf[LOG_STORE_MAX_RECORD];
+  log_store_pos_t pos;
+  if (mqf.checked)
+    return;
+  mqf.checked = true;
+  if (!log_store_first(&mqtt_flash, &mqf.pos))
+    return;
+  for (pos = mqf.pos; log_store_next(&mqtt_flash, &pos, buf) >= 0; )
+    mqf.count++;
+}
+
+static bool mqtt_queue_push(mqtt_t *m, int qos, const char *topic, const char *data, size_t len)
+{
+  size_t tl = strlen(topic);
+  size_t size = 1 + tl + 1 + len;
+
+  // behind anything in flash, or the order would be lost
+  if (mqtt_flash_count(m) == 0 && m->q_bytes + size <= CONFIG_MQTT_OFFLINE_RAM) {
+    mqtt_queued_t *q = (mqtt_queued_t *)malloc(sizeof(*q) + size);
+    if (q) {
+      q->next = NULL;
+      q->len = size;
+      q->rec[0] = qos;
+      memcpy(q->rec + 1, topic, tl + 1);
+      memcpy(q->rec + 1 + tl + 1, data, len);
+      *m->q_tail = q;
+      m->q_tail = &q->next;
+      m->q_bytes += size;
+      m->q_count++;
+      return true;
     }
-//check publish
-    for(i=0;i<MAX_MQTT_NUM;i++)
-    {
-      if(pmqtt[i] ==NULL) continue;
-      if(pmqtt[i]->reqPublish==true)
-      {
-        pmqtt[i]->reqPublish = false;
-        if(pmqtt[i]->pTopic == NULL || pmqtt[i]->pDataLen <= 0) continue;
-        MQTTMessage publishData =  MQTTMessage_publishData_initializer;
-        publishData.qos = (enum QoS)(pmqtt[i]->qos);
-        publishData.payload = (void*)pmqtt[i]->pData;
-        publishData.payloadlen = pmqtt[i]->pDataLen;
-        rc = MQTTPublish(&(pmqtt[i]->c), pmqtt[i]->pTopic,&publishData);
-        if(MQTT_SUCCESS == rc)
-          mqtt_log("MQTT client publish OK!\r\n");
-        else
-          pmqtt[i]->req_goto_disconect=true;
+  }
+  if (size > LOG_STORE_MAX_RECORD || (mqf.owner != NULL && mqf.owner != m))
+    return false;
+  uint8_t buf[LOG_STORE_MAX_RECORD];
+  buf[0] = qos;
+  memcpy(buf + 1, topic, tl + 1);
+  memcpy(buf + 1 + tl + 1, data, len);
+  if (!log_store_append(&mqtt_flash, buf, size))
+    return false;
+  // taking on whatever an earlier client left there
+  mqf.owner = m;
+  mqf.count++;
+  return true;
+}
+
+static bool mqtt_queue_send(mqtt_t *m, uint8_t *rec, size_t len)
+{
+  uint8_t *end = len < 2 ? NULL : (uint8_t *)memchr(rec + 1, 0, len - 1);
+  if (end == NULL)
+    return true;              // not a record, drop it
+  return mqtt_publish(m->client, (char *)rec + 1, (char *)end + 1,
+                      rec + len - end - 1, rec[0] & 3, (rec[0] >> 2) & 1);
+}
+
+static void mqtt_queue_free(mqtt_t *m)
+{
+  while (m->q_head) {
+    mqtt_queued_t *q = m->q_head;
+    m->q_head = q->next;
+    free(q);
+  }
+  m->q_tail = &m->q_head;
+  m->q_bytes = m->q_count = 0;
+}
+
+static void mqtt_replay_tick(void *arg)
+{
+  task_post_low(mqtt_replay_task, ((mqtt_t *)arg)->slot);
+}
+
+static void mqtt_replay_start(mqtt_t *m)
+{
+  if (m->replaying || mqtt_queue_empty(m))
+    return;
+  m->replaying = true;
+  os_timer_arm(&m->replay_timer, MQTT_REPLAY_MS, 1);
+}
+
+static void mqtt_replay_stop(mqtt_t *m)
+{
+  if (!m->replaying)
+    return;
+  m->replaying = false;
+  os_timer_disarm(&m->replay_timer);
+}
+
+static void mqtt_replay(task_param_t param, task_prio_t prio)
+{
+  (void)prio;
+  mqtt_t *m = param < mqtt_num ? pmqtt[param] : NULL;
+  uint8_t buf[LOG_STORE_MAX_RECORD];
+
+  if (m == NULL)
+    return;
+  for (int n = 0; n < MQTT_REPLAY_BURST && m->online && !mqtt_queue_empty(m); n++) {
+    if (m->q_head) {
+      mqtt_queued_t *q = m->q_head;
+      // the window or outbox is full, the next tick tries the same one
+      if (!mqtt_queue_send(m, q->rec, q->len))
+        break;
+      m->q_head = q->next;
+      if (m->q_head == NULL)
+        m->q_tail = &m->q_head;
+      m->q_bytes -= q->len;
+      m->q_count--;
+      free(q);
+    } else {
+      log_store_pos_t next = mqf.pos;
+      int32_t len = log_store_next(&mqtt_flash, &next, buf);
+      if (len < 0) {
+        mqf.count = 0;        // overwritten when the partition filled
+        break;
       }
+      if (!mqtt_queue_send(m, buf, len))
+        break;
+      mqf.pos = next;
+      mqf.count--;
     }
-//check close
-    for(i=0;i<MAX_MQTT_NUM;i++)
-    {
-      if(pmqtt[i]==NULL|| !pmqtt[i]->reqClose) continue;
-      closeMqtt(i);
-    }
-//check recieve
-    for(i=0;i<MAX_MQTT_NUM;i++)
-      if(pmqtt[i]!=NULL) break;
-    if(i==MAX_MQTT_NUM) continue;
-    FD_ZERO(&readfds);
-    for(i=0;i<MAX_MQTT_NUM;i++)
-    {
-      if(pmqtt[i]==NULL) continue;
-      FD_SET(pmqtt[i]->c.ipstack->my_socket, &readfds);
-      if (pmqtt[i]->c.ipstack->my_socket > maxSck) 
-           maxSck = pmqtt[i]->c.ipstack->my_socket;
-    }
-    select(maxSck+1, &readfds, NULL, NULL, &t);
-    for(i=0;i<MAX_MQTT_NUM;i++)
-    {
-      if(pmqtt[i]==NULL) continue;
-      if (FD_ISSET(pmqtt[i]->c.ipstack->my_socket, &readfds )){
-        mqtt_log("MQTTYield 1\r\n");
-        rc = MQTTYield(&(pmqtt[i]->c), (int)MQTT_YIELD_TMIE);
-        mqtt_log("MQTTYield 2\r\n");
-        if (MQTT_SUCCESS != rc) {
-          pmqtt[i]->req_goto_disconect=true;
-        }
-      }
-      else{
-        if(mico_get_time() - pmqtt[i]->keepaliveTick> 60*1000)
-          {
-            pmqtt[i]->keepaliveTick = mico_get_time();
-            rc = keepalive(&(pmqtt[i]->c));
-            mqtt_log("keepaliveTick\r\n");
-            if (MQTT_SUCCESS != rc) {
-              pmqtt[i]->req_goto_disconect=true;
-              }
-          }
-        }
+  }
+  if (mqtt_queue_empty(m)) {
+    mqtt_replay_stop(m);
+    if (mqf.owner == m) {
+      // sent, so a reset mustn't send it again
+      mqf.owner = NULL;
+      log_store_clear(&mqtt_flash);
+      log_store_first(&mqtt_flash, &mqf.pos);
     }
-//check disconnect;
-    for(i=0;i<MAX_MQTT_NUM;i++)
-    if(pmqtt[i] !=NULL && pmqtt[i]->req_goto_disconect==true) goto MQTT_disconnect;    
   }
+}
+
+static void mqtt_dispatch(task_param_t param, task_prio_t prio)
+{
+  (void)param; (void)prio;
+  lua_State *L = lua_getstate();
+  int n;
 
-MQTT_disconnect:
-  for(i=0;i<MAX_MQTT_NUM;i++)
-  {
-    if(pmqtt[i] !=NULL && pmqtt[i]->req_goto_disconect==true)
-    {
-      pmqtt[i]->req_goto_disconect = false;
-      pmqtt[i]->reqStart=true;
-      mqtt_log("[mqtt:%d] client disconnected,reconnect...\r\n",i);
-      pmqtt[i]->n.disconnect(&(pmqtt[i]->n));
-      if(pmqtt[i]->cb_ref_offline  == LUA_NOREF) continue;
-      lua_rawgeti(gL, LUA_REGISTRYINDEX, pmqtt[i]->cb_ref_offline);
-      lua_call(gL, 0, 0);
-      lua_gc(gL, LUA_GCCOLLECT, 0);
+  for (n = 0; n < MQTT_BATCH && rb_filled(&mqtt_rx) >= (int32_t)sizeof(mqtt_rec_t); n++) {
+    mqtt_rec_t rec;
+    rb_read(&mqtt_rx, (uint8_t *)&rec, sizeof(rec), 0);
+    mqtt_t *m = rec.slot < mqtt_num ? pmqtt[rec.slot] : NULL;
+    if (rec.type == MQTT_EV_DATA) {
+      mqtt_deliver_data(L, m, &rec);
+      continue;
+    }
+    if (m == NULL || m->closed)
+      continue;
+    if (rec.type == MQTT_EV_CONNECT) {
+      m->online = true;
+      mqtt_replay_start(m);
+      mqtt_call(L, m->cb_ref_connect, 0);
+    } else if (rec.type == MQTT_EV_OFFLINE) {
+      m->online = false;
+      mqtt_replay_stop(m);
+      mqtt_drop_message(m);
+      mqtt_call(L, m->cb_ref_offline, 0);
     }
   }
-  mico_thread_sleep(3);
-  goto MQTT_start;
-    
-exit:
-  for(i=0;i<MAX_MQTT_NUM;i++)
-  {
-    if(pmqtt[i]==NULL) continue;
-    closeMqtt(i);
-  }
-  
-  mico_rtos_delete_thread( NULL );
-  mqtt_thread_is_started =  false;
+  // the rest comes after whatever else is waiting for the Lua task
+  if (rb_filled(&mqtt_rx) > 0)
+    task_post_coalesced_low(mqtt_event, 0);
+  // a step at a time, rather than a full collection holding everything up
+  if (n > 0)
+    lua_gc(L, LUA_GCSTEP, MQTT_GC_STEP);
 }
+
+static mqtt_t *lmqtt_get( lua_State* L )
+{
+  unsigned mqttClt = luaL_checkinteger( L, 1);
+  if(mqttClt>=mqtt_num)
+    luaL_error( L, "mqttClt arg is wrong!" );
+  return pmqtt[mqttClt];
+}
+
+static void lmqtt_setref( lua_State* L, int *ref, int idx )
+{
+  if(*ref != LUA_NOREF)
+    cbref_unref(L, &mqtt_cbs, *ref);
+  *ref = LUA_NOREF;
+  if (lua_isnil(L, idx))
+    return;
+  lua_pushvalue(L, idx);
+  *ref = cbref_ref(L, &mqtt_cbs);
+}
+
+static void lmqtt_copy( lua_State* L, char *dst, size_t size, int idx )
+{
+  size_t sl = 0;
+  const char *s = luaL_optlstring( L, idx, "", &sl );
+  if (sl >= size)
+    luaL_argerror( L, idx, "too long" );
+  memcpy(dst, s, sl + 1);
+}
+
 //mqttClt = mqtt.new(clientid,keepalive,user,pass)
+//  As many clients as memory allows, each with its own connection
 static int lmqtt_new( lua_State* L )
 {
-  size_t sl=0;
-  char const *clientid = luaL_checklstring( L, 1, &sl );
-  if (clientid == NULL) return luaL_error( L, "wrong arg type" );
-  
-  unsigned keepalive;
-  keepalive = luaL_checkinteger( L, 2 );
-    
-  char const *user = luaL_checklstring( L, 3, &sl );
-  char const *pass = luaL_checklstring( L, 4, &sl );
-  if(strlen(user)==0) user=NULL;
-  if(strlen(pass)==0) pass=NULL;
-  int k=0;
-  for(k=0;k<MAX_MQTT_NUM;k++){
-    if(pmqtt[k]==NULL) break;
-  }
-  if(k==MAX_MQTT_NUM) return luaL_error( L, "Max MQTT Number is reached" );
-  pmqtt[k] = (mqtt_t*)malloc(sizeof(mqtt_t));
-  if (pmqtt[k] ==NULL) return luaL_error( L, "memery allocated failed" );
-  MQTTPacket_connectData cd=MQTTPacket_connectData_initializer;
-  memcpy(&(pmqtt[k]->connectData),&cd,sizeof(MQTTPacket_connectData));
-  pmqtt[k]->connectData.willFlag = 0;
-  pmqtt[k]->connectData.MQTTVersion = 3;
-  pmqtt[k]->connectData.clientID.cstring = (char*)clientid;
-  pmqtt[k]->connectData.username.cstring = (char*)user;
-  pmqtt[k]->connectData.password.cstring = (char*)pass;
-  pmqtt[k]->connectData.keepAliveInterval = keepalive;
-  pmqtt[k]->connectData.cleansession = 1;
-  //pmqtt[k]->ssl_settings.ssl_enable = false;
-  pmqtt[k]->reqStart = false;
-  pmqtt[k]->reqClose = false;
-  pmqtt[k]->cb_ref_connect = LUA_NOREF;
-  pmqtt[k]->cb_ref_offline = LUA_NOREF;
-  pmqtt[k]->cb_ref_message = LUA_NOREF;
-  pmqtt[k]->qos = QOS0;
-  pmqtt[k]->pTopic = NULL;
-  pmqtt[k]->pData = NULL;
-  pmqtt[k]->reqSucrible = false;
-  pmqtt[k]->requnSucrible = false;
-  pmqtt[k]->reqPublish = false;
-  pmqtt[k]->req_goto_disconect=false;
-  pmqtt[k]->keepaliveTick = 0;
-    
-  memset(&(pmqtt[k]->c), 0, sizeof(pmqtt[k]->c));
-  memset(&(pmqtt[k]->n), 0, sizeof(pmqtt[k]->n));
-  gL = L;
-  
+  unsigned k = mqtt_num;
+  if(k==MQTT_MAX_CLIENTS) return luaL_error( L, "Max MQTT Number is reached" );
+
+  unsigned keepalive = luaL_checkinteger( L, 2 );
+  mqtt_t **grown = (mqtt_t**)realloc(pmqtt, (k + 1) * sizeof(mqtt_t*));
+  if (grown == NULL) return luaL_error( L, "memery allocated failed" );
+  pmqtt = grown;
+  mqtt_t *m = (mqtt_t*)calloc(1, sizeof(mqtt_t));
+  if (m == NULL) return luaL_error( L, "memery allocated failed" );
+  m->slot = k;
+  m->q_tail = &m->q_head;
+  os_timer_setfn(&m->replay_timer, mqtt_replay_tick, m);
+  lmqtt_copy(L, m->settings.client_id, sizeof(m->settings.client_id), 1);
+  lmqtt_copy(L, m->settings.username, sizeof(m->settings.username), 3);
+  lmqtt_copy(L, m->settings.password, sizeof(m->settings.password), 4);
+  m->settings.keepalive = keepalive;
+  m->settings.clean_session = 1;
+  m->settings.connected_cb = mqtt_connected_cb;
+  m->settings.disconnected_cb = mqtt_disconnected_cb;
+  m->settings.subscribe_cb = mqtt_subscribe_cb;
+  m->settings.data_cb = mqtt_data_cb;
+  m->cb_ref_connect = LUA_NOREF;
+  m->cb_ref_offline = LUA_NOREF;
+  m->cb_ref_message = LUA_NOREF;
+  m->cb_ref_data = LUA_NOREF;
+  m->cb_ref_file = LUA_NOREF;
+  topic_trie_init(&m->subs);
+  topic_trie_init(&m->sinks);
+  mqtt_queue_check();
+  pmqtt[k] = m;
+  mqtt_num++;
+
   lua_pushinteger(L,k);
   return 1;
 }
-//mqtt.start(mqttClt, server, port)
+
+//mqtt.start(mqttClt, server, port[, secure[, ca_cert]])
+//  secure connects over TLS, checking the broker against the PEM
+//  ca_cert if there is one. Reconnects resume the TLS session
 static int lmqtt_start( lua_State* L )
 {
-  unsigned mqttClt;
-  mqttClt = luaL_checkinteger( L, 1);
-  
-  if(pmqtt[mqttClt]==NULL|| mqttClt>=MAX_MQTT_NUM)
-    return luaL_error( L, "mqttClt arg is wrong!" );
-  
-  size_t sl=0;
-  char const *server = luaL_checklstring( L, 2, &sl );
-  if (server == NULL) return luaL_error( L, "wrong arg type" );
-
-  unsigned port = luaL_checkinteger( L, 3);
-  
-  pmqtt[mqttClt]->pServer = (char*)server;
-  pmqtt[mqttClt]->port = port;
-  pmqtt[mqttClt]->reqStart = true;
-  
-  mqtt_log("clientID:%s\r\n",pmqtt[mqttClt]->connectData.clientID.cstring);
-  mqtt_log("username:%s\r\n",pmqtt[mqttClt]->connectData.username.cstring);
-  mqtt_log("password:%s\r\n",pmqtt[mqttClt]->connectData.password.cstring);
-  mqtt_log("pServer:%s\r\n",pmqtt[mqttClt]->pServer);
-  mqtt_log("port:%d\r\n",pmqtt[mqttClt]->port);
-  
-  if( !mqtt_thread_is_started)
-  {
-    mqtt_thread_is_started = true;
-    mico_rtos_create_thread(NULL, MICO_APPLICATION_PRIORITY, "Mqtt_Thread", _thread_mqtt, 0x4000, NULL);
+  mqtt_t *m = lmqtt_get(L);
+  if (m->client != NULL)
+    return luaL_error( L, "already started" );
+  lmqtt_copy(L, m->settings.host, sizeof(m->settings.host), 2);
+  m->settings.port = luaL_checkinteger( L, 3);
+  m->settings.secure = lua_toboolean(L, 4);
+#if !CONFIG_MQTT_SECURITY_ON
+  if (m->settings.secure)
+    return luaL_error( L, "TLS not built in" );
+#endif
+  if (m->settings.secure && !lua_isnoneornil(L, 5)) {
+    // espmqtt parses it at every connect, so it stays
+    char *ca = strdup(luaL_checkstring( L, 5 ));
+    if (ca == NULL)
+      return luaL_error( L, "memery allocated failed" );
+    m->settings.ca_cert = ca;
   }
+
+  if (mqtt_rx_buf == NULL) {
+    mqtt_rx_buf = (uint8_t *)malloc(CONFIG_MQTT_EVENT_BUFFER);
+    if (mqtt_rx_buf == NULL)
+      return luaL_error( L, "memery allocated failed" );
+    rb_init(&mqtt_rx, mqtt_rx_buf, CONFIG_MQTT_EVENT_BUFFER);
+  }
+  mqtt_log("pServer:%s\r\n",m->settings.host);
+  mqtt_log("port:%d\r\n",m->settings.port);
+  m->client = mqtt_start(&m->settings);
+  if (m->client == NULL)
+    return luaL_error( L, "can't start the MQTT client" );
   return 0;
 }
 
 //mqtt.close(mqttClt)
+//espmqtt can't be stopped, so the connection stays up but Lua hears
+//nothing more from it
 static int lmqtt_close( lua_State* L )
 {
-  unsigned mqttClt = luaL_checkinteger( L, 1);
-  if(mqttClt>=MAX_MQTT_NUM)
-    return luaL_error( L, "mqttClt arg is wrong!" );
-  if(pmqtt[mqttClt]!=NULL) 
-  {
-    pmqtt[mqttClt]->reqClose=true;
+  mqtt_t *m = lmqtt_get(L);
+  m->closed = true;
+  m->online = false;
+  // what made it to flash is sent by the next client
+  mqtt_replay_stop(m);
+  mqtt_queue_free(m);
+  if (mqf.owner == m)
+    mqf.owner = NULL;
+  mqtt_drop_message(m);
+  int *refs[] = { &m->cb_ref_connect, &m->cb_ref_offline, &m->cb_ref_message,
+                  &m->cb_ref_data, &m->cb_ref_file };
+  for (size_t i = 0; i < sizeof(refs) / sizeof(refs[0]); i++) {
+    if (*refs[i] != LUA_NOREF)
+      cbref_unref(L, &mqtt_cbs, *refs[i]);
+    *refs[i] = LUA_NOREF;
   }
+  topic_trie_clear(&m->subs, mqtt_unref, L);
+  topic_trie_clear(&m->sinks, mqtt_unref, L);
   return 0;
 }
+
+static int lmqtt_check_qos( lua_State* L, int idx )
+{
+  int qos = luaL_checkinteger( L, idx );
+  if (qos < 0 || qos > 2)
+    luaL_error( L, "QoS wrong arg type" );
+  return qos;
+}
+
+static mqtt_t *lmqtt_get_started( lua_State* L )
+{
+  mqtt_t *m = lmqtt_get(L);
+  if (m->client == NULL || m->closed)
+    luaL_error( L, "not started" );
+  return m;
+}
+
 //mqtt.subscribe(mqttClt,topic,QoS,cb_messagearrived(topic,message))
+//  topic may have + and # wildcards. A message goes to the callback of
+//  every subscription it matches, or to 'message' if none has one
 static int lmqtt_subscribe( lua_State* L )
 {
-  unsigned mqttClt = luaL_checkinteger( L, 1);
-  if(pmqtt[mqttClt]==NULL|| mqttClt>=MAX_MQTT_NUM)
-    return luaL_error( L, "mqttClt arg is wrong!" );
-  size_t sl=0;
-  char const *topic = luaL_checklstring( L, 2, &sl );
-  if (topic == NULL) return luaL_error( L, "wrong arg type" );
-  
-  unsigned qos=luaL_checkinteger( L, 3);
-  if (!(qos == QOS0 || qos == QOS1 ||qos == QOS2))
-      return luaL_error( L, "QoS wrong arg type" );
-    
-  if (lua_type(L, 4) == LUA_TFUNCTION || lua_type(L, 4) == LUA_TLIGHTFUNCTION)
-      {
-        lua_pushvalue(L, 4);
-        if( pmqtt[mqttClt]->cb_ref_message!= LUA_NOREF)
-        {
-          luaL_unref(L, LUA_REGISTRYINDEX, pmqtt[mqttClt]->cb_ref_message);
-        }
-        pmqtt[mqttClt]->cb_ref_message = luaL_ref(L, LUA_REGISTRYINDEX);
-      }
-    //  else
-    //    return luaL_error( L, "callback function needed" );
-
-  pmqtt[mqttClt]->pTopic = (char*)topic;
-  pmqtt[mqttClt]->qos = qos;
-  pmqtt[mqttClt]->reqSucrible = true;
+  mqtt_t *m = lmqtt_get_started(L);
+  const char *topic = luaL_checkstring( L, 2 );
+  int qos = lmqtt_check_qos(L, 3);
+  int old;
+  if (!topic_trie_valid(topic))
+    return luaL_argerror( L, 2, "bad topic filter" );
+  if (lua_type(L, 4) == LUA_TFUNCTION || lua_type(L, 4) == LUA_TLIGHTFUNCTION) {
+    lua_pushvalue(L, 4);
+    int ref = cbref_ref(L, &mqtt_cbs);
+    int res = topic_trie_insert(&m->subs, topic, ref, &old);
+    if (res < 0) {
+      cbref_unref(L, &mqtt_cbs, ref);
+      return luaL_error( L, "memery allocated failed" );
+    }
+    if (res == 1)
+      cbref_unref(L, &mqtt_cbs, old);
+  } else if (topic_trie_remove(&m->subs, topic, &old)) {
+    cbref_unref(L, &mqtt_cbs, old);
+  }
+  mqtt_subscribe(m->client, (char *)topic, qos);
   return 0;
 }
+
 //mqtt.unsubscribe(mqttClt,topic)
 static int lmqtt_unsubscribe( lua_State* L )
 {
-  unsigned mqttClt = luaL_checkinteger( L, 1);
-  if(pmqtt[mqttClt]==NULL|| mqttClt>=MAX_MQTT_NUM)
-    return luaL_error( L, "mqttClt arg is wrong!" );
-  
-   size_t sl=0;
-  char const *topic = luaL_checklstring( L, 2, &sl );
-  if (topic == NULL) return luaL_error( L, "wrong arg type" );
-  
-  pmqtt[mqttClt]->pTopic = (char*)topic;
-  pmqtt[mqttClt]->requnSucrible = true;
+  mqtt_t *m = lmqtt_get_started(L);
+  const char *topic = luaL_checkstring( L, 2 );
+  int old;
+  if (topic_trie_remove(&m->subs, topic, &old))
+    cbref_unref(L, &mqtt_cbs, old);
+  mqtt_unsubscribe(m->client, (char *)topic);
   return 0;
 }
-//mqtt.publish(mqttClt,topic,QoS, data)
-static int lmqtt_publish( lua_State* L )
+
+//mqtt.sink(mqttClt,topic,path)
+//  Messages on topic, which may have + and # wildcards, are written to the
+//  file at path as they come in instead of being held in memory, and
+//  'file' is called once one is complete. Without path the sink goes
+static int lmqtt_sink( lua_State* L )
 {
-  unsigned mqttClt = luaL_checkinteger( L, 1);
-  if(pmqtt[mqttClt]==NULL|| mqttClt>=MAX_MQTT_NUM)
-    return luaL_error( L, "mqttClt arg is wrong!" );
-  size_t sl=0;
-  char const *topic = luaL_checklstring( L, 2, &sl );
-  if (topic == NULL) return luaL_error( L, "wrong arg type" );
-  
-  unsigned qos=luaL_checkinteger( L, 3);
-  if (!(qos == QOS0 || qos == QOS1 ||qos == QOS2))
-      return luaL_error( L, "QoS wrong arg type" );
-    
-  char const *data = luaL_checklstring( L, 4, &sl );
-  if (data == NULL) return luaL_error( L, "wrong arg type" );
-  
-  pmqtt[mqttClt]->pTopic = (char*)topic;
-  pmqtt[mqttClt]->qos = qos;
-  pmqtt[mqttClt]->pData = (char*)data;
-  pmqtt[mqttClt]->pDataLen = sl;
-  pmqtt[mqttClt]->reqPublish = true;
+  mqtt_t *m = lmqtt_get(L);
+  const char *topic = luaL_checkstring( L, 2 );
+  int old;
+  if (!topic_trie_valid(topic))
+    return luaL_argerror( L, 2, "bad topic filter" );
+  if (lua_isnoneornil(L, 3)) {
+    if (topic_trie_remove(&m->sinks, topic, &old))
+      cbref_unref(L, &mqtt_cbs, old);
+    return 0;
+  }
+  luaL_checkstring( L, 3 );
+  lua_pushvalue(L, 3);
+  int ref = cbref_ref(L, &mqtt_cbs);
+  int res = topic_trie_insert(&m->sinks, topic, ref, &old);
+  if (res < 0) {
+    cbref_unref(L, &mqtt_cbs, ref);
+    return luaL_error( L, "memery allocated failed" );
+  }
+  if (res == 1)
+    cbref_unref(L, &mqtt_cbs, old);
   return 0;
 }
+
+//ok = mqtt.publish(mqttClt,topic,QoS, data)
+//  data is a string or a buffer. QoS 1 and 2 messages are pipelined up to CONFIG_MQTT_INFLIGHT_MAX
+//  unacknowledged ones. false if they stayed that many for a second.
+//  Offline, and before mqtt.start(), messages are queued instead; false
+//  if there is no room left for them
+static int lmqtt_publish( lua_State* L )
+{
+  mqtt_t *m = lmqtt_get(L);
+  const char *topic = luaL_checkstring( L, 2 );
+  int qos = lmqtt_check_qos(L, 3);
+  size_t sl = 0;
+  const char *data = buffer_checklstring( L, 4, &sl );
+  if (m->closed)
+    return luaL_error( L, "closed" );
+  if (m->online && mqtt_queue_empty(m)) {
+    lua_pushboolean(L, mqtt_publish(m->client, (char *)topic, (char *)data, sl, qos, 0));
+    return 1;
+  }
+  lua_pushboolean(L, mqtt_queue_push(m, qos, topic, data, sl));
+  if (m->online)
+    mqtt_replay_start(m);
+  return 1;
+}
+
+//ram, flash = mqtt.queued(mqttClt)
+//  Messages waiting in the offline queue
+static int lmqtt_queued( lua_State* L )
+{
+  mqtt_t *m = lmqtt_get(L);
+  lua_pushinteger(L, m->q_count);
+  lua_pushinteger(L, mqtt_flash_count(m));
+  return 2;
+}
+
 //mqtt.on(mqttClt,'connect',function())
 //mqtt.on(mqttClt,'offline',function())
 //mqtt.on(mqttClt,'message',cb_messagearrived(topic,message))
 //  different topics with same callback
+//mqtt.on(mqttClt,'data',function(topic,chunk,offset,total))
+//  while set, messages come here a piece at a time instead of whole
+//mqtt.on(mqttClt,'file',function(topic,path,total))
+//  a sink file is complete, total is nil if writing it failed
+//  nil for the function removes a callback
+//mqtt.on(mqttClt,'message'|'data',fn,{buffer=true})
+//  messages and pieces come as buffers instead of strings, for every
+//  callback of the client, subscription callbacks included
 static int lmqtt_on( lua_State* L )
 {
-  unsigned mqttClt = luaL_checkinteger( L, 1);
-  if(pmqtt[mqttClt]==NULL|| mqttClt>=MAX_MQTT_NUM)
-    return luaL_error( L, "mqttClt arg is wrong!" );
-  size_t sl=0;
-  char const *method = luaL_checklstring( L, 2, &sl );
-  if (method == NULL) return luaL_error( L, "wrong arg type" );
-  
-  if (lua_type(L, 3) == LUA_TFUNCTION || lua_type(L, 3) == LUA_TLIGHTFUNCTION)
-      lua_pushvalue(L, 3);
-  else
-      return luaL_error( L, "callback function needed" );
-  
-  if(strcmp(method,"connect")==0&&sl==strlen("connect"))
-   {
-      if( pmqtt[mqttClt]->cb_ref_connect!= LUA_NOREF)
-      {
-        luaL_unref(L, LUA_REGISTRYINDEX, pmqtt[mqttClt]->cb_ref_connect);
-      }
-      pmqtt[mqttClt]->cb_ref_connect = luaL_ref(L, LUA_REGISTRYINDEX);
-   }
-  else if(strcmp(method,"message")==0&&sl==strlen("message"))
-  {
-      if( pmqtt[mqttClt]->cb_ref_message!= LUA_NOREF)
-      {
-        luaL_unref(L, LUA_REGISTRYINDEX, pmqtt[mqttClt]->cb_ref_message);
-      }
-      pmqtt[mqttClt]->cb_ref_message = luaL_ref(L, LUA_REGISTRYINDEX);
-  }
-  else if(strcmp(method,"offline")==0&&sl==strlen("offline"))
-  {
-      if( pmqtt[mqttClt]->cb_ref_offline!= LUA_NOREF)
-      {
-        luaL_unref(L, LUA_REGISTRYINDEX, pmqtt[mqttClt]->cb_ref_offline);
-      }
-      pmqtt[mqttClt]->cb_ref_offline = luaL_ref(L, LUA_REGISTRYINDEX);
-  }
+  mqtt_t *m = lmqtt_get(L);
+  const char *method = luaL_checkstring( L, 2 );
+  if (lua_type(L, 3) != LUA_TFUNCTION && lua_type(L, 3) != LUA_TLIGHTFUNCTION &&
+      !lua_isnil(L, 3))
+    return luaL_error( L, "callback function needed" );
+
+  if (strcmp(method, "connect") == 0)
+    lmqtt_setref(L, &m->cb_ref_connect, 3);
+  else if (strcmp(method, "message") == 0)
+    lmqtt_setref(L, &m->cb_ref_message, 3);
+  else if (strcmp(method, "offline") == 0)
+    lmqtt_setref(L, &m->cb_ref_offline, 3);
+  else if (strcmp(method, "data") == 0)
+    lmqtt_setref(L, &m->cb_ref_data, 3);
+  else if (strcmp(method, "file") == 0)
+    lmqtt_setref(L, &m->cb_ref_file, 3);
   else
     return luaL_error( L, "wrong method" );
+  if ((strcmp(method, "message") == 0 || strcmp(method, "data") == 0) &&
+      lua_istable(L, 4)) {
+    lua_getfield(L, 4, "buffer");
+    m->rx_buffer = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
   return 0;
 }
 /*
 mqttClt = mqtt.new(clientid,keepalive,user,pass)
-mqtt.start(mqttClt, server, port)
+mqtt.start(mqttClt, server, port[, secure[, ca_cert]])
 mqtt.on(mqttClt,'connect',function())
 mqtt.on(mqttClt,'offline',function())
 //different topics with same callback
 mqtt.on(mqttClt,'message',cb_messagearrived(topic,message))
+mqtt.on(mqttClt,'data',function(topic,chunk,offset,total))
+mqtt.on(mqttClt,'file',function(topic,path,total))
+mqtt.on(mqttClt,'message'|'data',fn,{buffer=true})
+mqtt.sink(mqttClt,topic,path)
 mqtt.close(mqttClt)
-mqtt.publish(mqttClt,topic,QoS, data)
+ok = mqtt.publish(mqttClt,topic,QoS, data)
+ram, flash = mqtt.queued(mqttClt)
 mqtt.subscribe(mqttClt,topic,QoS,cb_messagearrived(topic,message))
 mqtt.unsubscribe(mqttClt,topic)
 */
 
-#endif
-
 #include "lrodefs.h"
 const LUA_REG_TYPE mqtt_map[] =
 {
-#if 0
   { LSTRKEY( "new" ), LFUNCVAL( lmqtt_new )},
   { LSTRKEY( "start" ), LFUNCVAL( lmqtt_start )},
   { LSTRKEY( "close" ), LFUNCVAL( lmqtt_close )},
@@ -499,17 +925,20 @@ const LUA_REG_TYPE mqtt_map[] =
   { LSTRKEY( "unsubscribe" ), LFUNCVAL( lmqtt_unsubscribe )},
   { LSTRKEY( "publish" ), LFUNCVAL( lmqtt_publish )},
   { LSTRKEY( "on" ), LFUNCVAL( lmqtt_on )},
-#endif
+  { LSTRKEY( "queued" ), LFUNCVAL( lmqtt_queued )},
+  { LSTRKEY( "sink" ), LFUNCVAL( lmqtt_sink )},
 #if LUA_OPTIMIZE_MEMORY > 0
-  //{ LSTRKEY( "QOS0" ), LNUMVAL( QOS0 ) },
-  //{ LSTRKEY( "QOS1" ), LNUMVAL( QOS1 ) },
-  //{ LSTRKEY( "QOS2" ), LNUMVAL( QOS2 ) },
-#endif        
+  { LSTRKEY( "QOS0" ), LNUMVAL( 0 ) },
+  { LSTRKEY( "QOS1" ), LNUMVAL( 1 ) },
+  { LSTRKEY( "QOS2" ), LNUMVAL( 2 ) },
+#endif
   {LNILKEY, LNILVAL}
 };
 
-int luaopen_mqtt(lua_State *L) 
+int luaopen_mqtt(lua_State *L)
 {
-	return 0;
+  mqtt_event = task_get_id(mqtt_dispatch);
+  mqtt_replay_task = task_get_id(mqtt_replay);
+  mqtt_rx_lock = xSemaphoreCreateMutex();
+  return 0;
 }
-
@@ -0,0 +1,423 @@
+// Module for MessagePack, a binary counterpart to cjson
+//
+// Tables are laid out the way cjson.encode does it, arrays or maps by the
+// same test and within the same depth limit, so a value can go out either
+// way. Integers take one to nine bytes and floats four or eight, with no
+// number formatting at all; buffers go out as bin. Decoding creates
+// tables at their final size, and nil comes back as cjson.null.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "buffer.h"
+#include "cjson.h"
+#include <math.h>
+#include <string.h>
+
+#define MSGPACK_CHUNK       512     // default for pack_to
+#define MSGPACK_SEGMENT     256     // strings are added this much at a time
+
+typedef struct {
+  lua_State *L;
+  strbuf_t sb;            // pack and pack_to
+  uint8_t *out;           // pack_into writes straight here instead
+  size_t size, pos;
+} msgpack_enc_t;
+
+typedef struct {
+  lua_State *L;
+  const uint8_t *data;
+  size_t len, pos;
+  int depth;
+} msgpack_dec_t;
+
+// Frees what the encoder holds before raising the error
+static void msgpack_enc_error( msgpack_enc_t *e, const char *msg )
+{
+  if (!e->out)
+    strbuf_free( &e->sb );
+  luaL_error( e->L, "cannot pack: %s", msg );
+}
+
+static void msgpack_write( msgpack_enc_t *e, const void *p, size_t n )
+{
+  if (e->out) {
+    if (e->size - e->pos < n)
+      msgpack_enc_error( e, "buffer too small" );
+    memcpy( e->out + e->pos, p, n );
+    e->pos += n;
+    return;
+  }
+  // a piece at a time, so a sink gets chunks of its size however long
+  // the string
+  while (n) {
+    size_t k = n < MSGPACK_SEGMENT ? n : MSGPACK_SEGMENT;
+    strbuf_append_mem( &e->sb, (const char *)p, k );
+    p = (const uint8_t *)p + k;
+    n -= k;
+  }
+}
+
+// A type byte followed by n bytes of v, big-endian
+static void msgpack_put( msgpack_enc_t *e, uint8_t type, uint64_t v, int n )
+{
+  uint8_t b[9];
+  b[0] = type;
+  for (int i = n; i > 0; i--) {
+    b[i] = (uint8_t)v;
+    v >>= 8;
+  }
+  msgpack_write( e, b, n + 1 );
+}
+
+// The shortest of the header forms for a length: fix (if fix is not 0,
+// fixmax and under), then 8 (if t8 is not 0), 16 and 32 bits
+static void msgpack_put_len( msgpack_enc_t *e, uint8_t fix, size_t fixmax,
+                             uint8_t t8, uint8_t t16, uint8_t t32, size_t len )
+{
+  if (fix && len <= fixmax)
+    msgpack_put( e, fix | len, 0, 0 );
+  else if (t8 && len <= 0xff)
+    msgpack_put( e, t8, len, 1 );
+  else if (len <= 0xffff)
+    msgpack_put( e, t16, len, 2 );
+  else
+    msgpack_put( e, t32, len, 4 );
+}
+
+static void msgpack_pack_number( msgpack_enc_t *e, lua_Number n )
+{
+  double d = (double)n;
+  if (d == floor( d ) && d >= -9223372036854775808.0 && d < 9223372036854775808.0) {
+    int64_t i = (int64_t)d;
+    if (i >= 0) {
+      uint64_t u = (uint64_t)i;
+      if (u <= 0x7f)            msgpack_put( e, (uint8_t)u, 0, 0 );
+      else if (u <= 0xff)       msgpack_put( e, 0xcc, u, 1 );
+      else if (u <= 0xffff)     msgpack_put( e, 0xcd, u, 2 );
+      else if (u <= 0xffffffff) msgpack_put( e, 0xce, u, 4 );
+      else                      msgpack_put( e, 0xcf, u, 8 );
+    } else {
+      if (i >= -32)             msgpack_put( e, (uint8_t)i, 0, 0 );
+      else if (i >= -128)       msgpack_put( e, 0xd0, (uint64_t)i, 1 );
+      else if (i >= -32768)     msgpack_put( e, 0xd1, (uint64_t)i, 2 );
+      else if (i >= INT32_MIN)  msgpack_put( e, 0xd2, (uint64_t)i, 4 );
+      else                      msgpack_put( e, 0xd3, (uint64_t)i, 8 );
+    }
+    return;
+  }
+  // float32 whenever it holds the value exactly, NaN and the infinities too
+  float f = (float)d;
+  if ((double)f == d || d != d) {
+    uint32_t u;
+    memcpy( &u, &f, 4 );
+    msgpack_put( e, 0xca, u, 4 );
+  } else {
+    uint64_t u;
+    memcpy( &u, &d, 8 );
+    msgpack_put( e, 0xcb, u, 8 );
+  }
+}
+
+static void msgpack_pack_value( msgpack_enc_t *e, int depth );
+
+// The table on top of the stack
+static void msgpack_pack_table( msgpack_enc_t *e, int depth )
+{
+  lua_State *L = e->L;
+  if (depth > cjson_encode_max_depth() || !lua_checkstack( L, 3 ))
+    msgpack_enc_error( e, "excessive nesting" );
+
+  int len = cjson_array_length( L );
+  if (len == -2)
+    msgpack_enc_error( e, "excessively sparse array" );
+  if (len > 0) {
+    msgpack_put_len( e, 0x90, 15, 0, 0xdc, 0xdd, len );
+    for (int i = 1; i <= len; i++) {
+      lua_rawgeti( L, -1, i );
+      msgpack_pack_value( e, depth );
+      lua_pop( L, 1 );
+    }
+    return;
+  }
+
+  size_t count = 0;
+  lua_pushnil( L );
+  while (lua_next( L, -2 )) {
+    count++;
+    lua_pop( L, 1 );
+  }
+  msgpack_put_len( e, 0x80, 15, 0, 0xde, 0xdf, count );
+  lua_pushnil( L );
+  while (lua_next( L, -2 )) {
+    // table, key, value
+    lua_pushvalue( L, -2 );
+    msgpack_pack_value( e, depth );
+    lua_pop( L, 1 );
+    msgpack_pack_value( e, depth );
+    lua_pop( L, 1 );
+  }
+}
+
+// The value on top of the stack
+static void msgpack_pack_value( msgpack_enc_t *e, int depth )
+{
+  lua_State *L = e->L;
+  size_t len;
+  const char *s;
+
+  switch (lua_type( L, -1 )) {
+  case LUA_TNIL:
+    msgpack_put( e, 0xc0, 0, 0 );
+    break;
+  case LUA_TBOOLEAN:
+    msgpack_put( e, lua_toboolean( L, -1 ) ? 0xc3 : 0xc2, 0, 0 );
+    break;
+  case LUA_TNUMBER:
+    msgpack_pack_number( e, lua_tonumber( L, -1 ) );
+    break;
+  case LUA_TSTRING:
+    s = lua_tolstring( L, -1, &len );
+    msgpack_put_len( e, 0xa0, 31, 0xd9, 0xda, 0xdb, len );
+    msgpack_write( e, s, len );
+    break;
+  case LUA_TTABLE:
+    msgpack_pack_table( e, depth + 1 );
+    break;
+  case LUA_TLIGHTUSERDATA:
+    if (lua_touserdata( L, -1 ) == NULL) {
+      msgpack_put( e, 0xc0, 0, 0 );
+      break;
+    }
+    msgpack_enc_error( e, "type not supported" );
+    break;
+  case LUA_TUSERDATA:
+    s = buffer_tolstring( L, -1, &len );
+    if (s) {
+      msgpack_put_len( e, 0, 0, 0xc4, 0xc5, 0xc6, len );
+      msgpack_write( e, s, len );
+      break;
+    }
+    // fall through
+  default:
+    msgpack_enc_error( e, "type not supported" );
+  }
+}
+
+// Lua: str = msgpack.pack( value )
+static int msgpack_pack( lua_State *L )
+{
+  msgpack_enc_t e = { .L = L };
+  luaL_checkany( L, 1 );
+  lua_settop( L, 1 );
+  if (strbuf_init( &e.sb, 0 ))
+    return luaL_error( L, "out of memory" );
+  msgpack_pack_value( &e, 0 );
+  lua_pushlstring( L, e.sb.buf, strbuf_length( &e.sb ) );
+  strbuf_free( &e.sb );
+  return 1;
+}
+
+// Lua: nextpos = msgpack.pack_into( buf, pos, value )
+// Packs value into the buffer from pos on, without allocating anything,
+// and returns the position after it. If it doesn't fit an error is
+// raised, and what was written from pos on is left as it is.
+static int msgpack_pack_into( lua_State *L )
+{
+  lbuffer_t *b = (lbuffer_t *)luaL_checkudata( L, 1, BUFFER_TABLE );
+  int pos = luaL_checkinteger( L, 2 );
+  luaL_argcheck( L, pos >= 1 && (size_t)pos <= b->len + 1, 2, "out of range" );
+  luaL_checkany( L, 3 );
+  lua_settop( L, 3 );
+  msgpack_enc_t e = { .L = L, .out = b->data, .size = b->len, .pos = pos - 1 };
+  msgpack_pack_value( &e, 0 );
+  lua_pushinteger( L, e.pos + 1 );
+  return 1;
+}
+
+// Lua: written = msgpack.pack_to( sink, value[, chunk] )
+// Like cjson.encode_to: the bytes go to sink, a function, file or socket,
+// chunk bytes at a time (512 by default) as the value is walked.
+static int msgpack_pack_to( lua_State *L )
+{
+  msgpack_enc_t e = { .L = L };
+  cjson_sink_t sink;
+  luaL_checkany( L, 2 );
+  int chunk = luaL_optinteger( L, 3, MSGPACK_CHUNK );
+  luaL_argcheck( L, chunk >= MSGPACK_SEGMENT, 3, "chunk too small" );
+  lua_settop( L, 2 );
+  cjson_sink_init( L, 1, &sink, &e.sb );
+  lua_pushvalue( L, 2 );
+  if (strbuf_init( &e.sb, chunk ))
+    return luaL_error( L, "out of memory" );
+  strbuf_set_flush( &e.sb, cjson_sink_flush, &sink );
+  msgpack_pack_value( &e, 0 );
+  strbuf_flush( &e.sb );
+  strbuf_free( &e.sb );
+  lua_pushinteger( L, sink.written );
+  return 1;
+}
+
+static void msgpack_dec_error( msgpack_dec_t *d, const char *msg )
+{
+  luaL_error( d->L, "cannot unpack: %s at byte %d", msg, (int)d->pos + 1 );
+}
+
+static const uint8_t *msgpack_take( msgpack_dec_t *d, size_t n )
+{
+  if (d->len - d->pos < n)
+    msgpack_dec_error( d, "truncated data" );
+  const uint8_t *p = d->data + d->pos;
+  d->pos += n;
+  return p;
+}
+
+// n bytes, big-endian
+static uint64_t msgpack_get( msgpack_dec_t *d, int n )
+{
+  const uint8_t *p = msgpack_take( d, n );
+  uint64_t v = 0;
+  for (int i = 0; i < n; i++)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static void msgpack_unpack_value( msgpack_dec_t *d );
+
+// An array or map of n elements, pushed as a table made at its full size
+static void msgpack_unpack_table( msgpack_dec_t *d, uint64_t n, bool map )
+{
+  lua_State *L = d->L;
+  // every element takes a byte at least, which bounds what bad data can
+  // make us allocate
+  if (n > (d->len - d->pos) / (map ? 2 : 1))
+    msgpack_dec_error( d, "truncated data" );
+  if (++d->depth > cjson_decode_max_depth() || !lua_checkstack( L, 3 ))
+    msgpack_dec_error( d, "excessive nesting" );
+
+  if (map) {
+    lua_createtable( L, 0, (int)n );
+    for (uint64_t i = 0; i < n; i++) {
+      size_t at = d->pos;
+      msgpack_unpack_value( d );
+      if (lua_type( L, -1 ) == LUA_TNUMBER && lua_tonumber( L, -1 ) != lua_tonumber( L, -1 )) {
+        d->pos = at;
+        msgpack_dec_error( d, "NaN table key" );
+      }
+      msgpack_unpack_value( d );
+      lua_rawset( L, -3 );
+    }
+  } else {
+    lua_createtable( L, (int)n, 0 );
+    for (uint64_t i = 0; i < n; i++) {
+      msgpack_unpack_value( d );
+      lua_rawseti( L, -2, (int)i + 1 );
+    }
+  }
+  d->depth--;
+}
+
+static void msgpack_unpack_str( msgpack_dec_t *d, size_t n )
+{
+  const uint8_t *p = msgpack_take( d, n );
+  lua_pushlstring( d->L, (const char *)p, n );
+}
+
+static void msgpack_unpack_value( msgpack_dec_t *d )
+{
+  lua_State *L = d->L;
+  uint8_t t = *msgpack_take( d, 1 );
+  uint64_t v;
+  float f;
+  double db;
+
+  if (t <= 0x7f) {
+    lua_pushinteger( L, t );
+  } else if (t >= 0xe0) {
+    lua_pushinteger( L, (int8_t)t );
+  } else if (t <= 0x8f) {
+    msgpack_unpack_table( d, t & 0x0f, true );
+  } else if (t <= 0x9f) {
+    msgpack_unpack_table( d, t & 0x0f, false );
+  } else if (t <= 0xbf) {
+    msgpack_unpack_str( d, t & 0x1f );
+  } else {
+    switch (t) {
+    case 0xc0: lua_pushlightuserdata( L, NULL ); break;
+    case 0xc2: lua_pushboolean( L, 0 ); break;
+    case 0xc3: lua_pushboolean( L, 1 ); break;
+    case 0xc4: case 0xd9: msgpack_unpack_str( d, msgpack_get( d, 1 ) ); break;
+    case 0xc5: case 0xda: msgpack_unpack_str( d, msgpack_get( d, 2 ) ); break;
+    case 0xc6: case 0xdb: msgpack_unpack_str( d, msgpack_get( d, 4 ) ); break;
+    case 0xca:
+      v = msgpack_get( d, 4 );
+      {
+        uint32_t u = (uint32_t)v;
+        memcpy( &f, &u, 4 );
+      }
+      lua_pushnumber( L, f );
+      break;
+    case 0xcb:
+      v = msgpack_get( d, 8 );
+      memcpy( &db, &v, 8 );
+      lua_pushnumber( L, (lua_Number)db );
+      break;
+    case 0xcc: lua_pushnumber( L, (lua_Number)msgpack_get( d, 1 ) ); break;
+    case 0xcd: lua_pushnumber( L, (lua_Number)msgpack_get( d, 2 ) ); break;
+    case 0xce: lua_pushnumber( L, (lua_Number)msgpack_get( d, 4 ) ); break;
+    case 0xcf: lua_pushnumber( L, (lua_Number)msgpack_get( d, 8 ) ); break;
+    case 0xd0: lua_pushnumber( L, (int8_t)msgpack_get( d, 1 ) ); break;
+    case 0xd1: lua_pushnumber( L, (int16_t)msgpack_get( d, 2 ) ); break;
+    case 0xd2: lua_pushnumber( L, (int32_t)msgpack_get( d, 4 ) ); break;
+    case 0xd3: lua_pushnumber( L, (lua_Number)(int64_t)msgpack_get( d, 8 ) ); break;
+    case 0xdc: msgpack_unpack_table( d, msgpack_get( d, 2 ), false ); break;
+    case 0xdd: msgpack_unpack_table( d, msgpack_get( d, 4 ), false ); break;
+    case 0xde: msgpack_unpack_table( d, msgpack_get( d, 2 ), true ); break;
+    case 0xdf: msgpack_unpack_table( d, msgpack_get( d, 4 ), true ); break;
+    default:
+      // 0xc1 is never used; the ext types have no Lua counterpart
+      d->pos--;
+      msgpack_dec_error( d, "unsupported type" );
+    }
+  }
+}
+
+// Lua: value, nextpos = msgpack.unpack( data[, pos] )
+// data is a string or buffer; the value starts at pos, 1 by default.
+// nextpos is where the one after it would start.
+static int msgpack_unpack( lua_State *L )
+{
+  msgpack_dec_t d = { .L = L };
+  d.data = (const uint8_t *)buffer_checklstring( L, 1, &d.len );
+  int pos = luaL_optinteger( L, 2, 1 );
+  luaL_argcheck( L, pos >= 1 && (size_t)pos <= d.len, 2, "out of range" );
+  d.pos = pos - 1;
+  msgpack_unpack_value( &d );
+  lua_pushinteger( L, d.pos + 1 );
+  return 2;
+}
+
+// Module function map
+const LUA_REG_TYPE msgpack_map[] = {
+  { LSTRKEY( "pack" ),      LFUNCVAL( msgpack_pack ) },
+  { LSTRKEY( "pack_into" ), LFUNCVAL( msgpack_pack_into ) },
+  { LSTRKEY( "pack_to" ),   LFUNCVAL( msgpack_pack_to ) },
+  { LSTRKEY( "unpack" ),    LFUNCVAL( msgpack_unpack ) },
+  { LSTRKEY( "null" ),      LUDATA( NULL ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_msgpack( lua_State *L )
+{
+  // the depth limit is cjson's, set up when it opens
+  luaR_getglobal( L, LUA_CJSONLIBNAME, strlen(LUA_CJSONLIBNAME) );
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_MSGPACKLIBNAME, msgpack_map );
+  return 1;
+#endif
+}
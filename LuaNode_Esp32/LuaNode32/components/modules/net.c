@@ -2,11 +2,24 @@
 
 #include "modules.h"
 #include "lauxlib.h"
+#include "buffer.h"
 #include "platform.h"
 #include "lmem.h"
 #include "ip_fmt.h"
+#include "vfs.h"
+#include "asset_store.h"
+#include "sched.h"
+#include "cbref.h"
+#include "net.h"
 #include "task/task.h"
 #include "user_config.h"
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_wifi.h"
+#include "trace.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -18,6 +31,13 @@
 #include "lwip/igmp.h"
 #include "lwip/tcp.h"
 #include "lwip/udp.h"
+#include "lwip/stats.h"
+
+#include "mbedtls/net.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "tls_session.h"
 
 // Some LWIP macros cause complaints with ptr NULL checks, so shut them off :(
 #pragma GCC diagnostic ignored "-Waddress"
@@ -44,9 +64,93 @@ static const net_table_name NET_TABLES[] = {
 #define TYPE_TCP TYPE_TCP_CLIENT
 #define TYPE_UDP TYPE_UDP_SOCKET
 
+// C-side receive buffer for sockets with receive watermarks
+typedef struct lnet_rxbuf {
+  os_timer_t timer;
+  uint32_t min;         // deliver once this many bytes are buffered
+  uint32_t max;         // never deliver more than this per callback, 0 = any
+  uint32_t timeout_ms;  // deliver whatever is buffered after this long
+  bool armed;
+  uint32_t len;
+  uint32_t cap;
+  char *data;
+} lnet_rxbuf;
+
+// One queued chunk of outgoing TCP data not yet accepted by lwIP. Chunks
+// handed to tcp_write without copying move to the in-flight list instead
+// of being freed, and stay there until the peer has acked their last byte.
+typedef struct lnet_sendbuf {
+  struct lnet_sendbuf *next;
+  enum {
+    SQ_COPY,    // data[] is copied into lwIP
+    SQ_PINNED,  // ptr points into a Lua string held by ref, or mapped flash
+    SQ_FILE,    // read from fd as lwIP has room for it
+    SQ_CHUNK    // data[] holds a block read from a file, sent in place
+  } kind;
+  uint32_t len;
+  uint32_t off;   // bytes already handed to tcp_write (or read, for SQ_FILE)
+  uint32_t end;   // in flight: tx_written after the chunk's last byte
+  int ref;
+  int fd;
+  const char *ptr;
+  char data[0];
+} lnet_sendbuf;
+
+// TLS on a TCP client, see net_tls_start. The config and CA live as long
+// as the socket; the SSL context, with its record buffers, only while
+// connected.
+typedef struct lnet_tls {
+  mbedtls_ssl_context ssl;
+  mbedtls_ssl_config conf;
+  mbedtls_x509_crt ca;
+  bool active;              // ssl is set up for the current connection
+  bool handshaken;
+  const char *in;           // ciphertext lrecv_cb is feeding in
+  size_t in_len;
+} lnet_tls;
+
+// Per socket counters, see client:stats(); also kept for all sockets
+// together in net_totals. Bytes are counted as lwIP takes or hands them
+// over, so for TLS they are the ciphertext.
+typedef struct {
+  uint32_t since;        // system_get_time() when counting started
+  uint32_t rx_bytes;
+  uint32_t tx_bytes;
+  uint32_t rx_dropped;   // lwIP data refused as no event could be posted
+  uint32_t events;       // events handled in the Lua task
+  uint32_t cb_us;        // time in their handlers, Lua callbacks included
+  uint32_t cb_max_us;
+} lnet_stats;
+
+static lnet_stats net_totals;
+
+// A connection lwIP accepted that the Lua task hasn't taken yet; its pcb
+// has the slot as its arg until then
+typedef struct lnet_pending {
+  struct tcp_pcb *pcb;          // NULL once it went away while waiting
+  struct lnet_userdata *server;
+} lnet_pending;
+
+// Accepted connections wait here, up to the server's backlog, for the Lua
+// task to take all there are on one event. lwIP adds at tail, the Lua
+// task takes from head.
+typedef struct {
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  volatile int posted;          // an ACCEPT event is on its way
+  uint32_t cap;
+  lnet_pending slot[0];
+} lnet_acceptq;
+
+#define NET_SERVER_BACKLOG 8
+#define NET_KEEPIDLE_S 7200  // keepalive idle time when setopt gives none, as lwIP
+
 typedef struct lnet_userdata {
   enum net_type type;
   int self_ref;
+  int hold_ref;             // self_ref once dropped, until queued reaches 0
+  uint32_t queued;          // events posted and not yet handled
+  lnet_stats stats;
   union {
     struct tcp_pcb *tcp_pcb;
     struct udp_pcb *udp_pcb;
@@ -55,21 +159,85 @@ typedef struct lnet_userdata {
   union {
     struct {
       int cb_accept_ref;
+      lnet_acceptq *acceptq;
+      uint16_t timeout;            // s a client may stay idle, 0 = for ever
+      uint16_t max_clients;        // 0 = no limit
+      volatile uint32_t clients;   // accepted and not yet closed
+      uint32_t rejected;           // refused for a limit or lack of memory
+      uint32_t reaped;             // closed for being idle
     } server;
     struct {
       int wait_dns;
       int cb_dns_ref;
       int cb_receive_ref;
       int cb_sent_ref;
+      int rx_zerocopy;
+      int rx_buffer;  // "receive" gets buffers rather than strings
+      int rx_batch;  // UDP: datagrams per "receive" callback, 0 = one at a time
+      struct lnet_event *rx_pending; // receive event still open for appending
+      int8_t evprio;  // node.PRIO_* all its events are posted at, -1 = default
       // Only for TCP:
+      lnet_rxbuf *rxbuf;
+      lnet_sendbuf *sq_head;
+      lnet_sendbuf *sq_tail;
+      uint32_t sq_bytes;
+      uint32_t sq_copy_bytes;  // the part of sq_bytes held in our own heap
+      lnet_sendbuf *tx_head;   // sent without copy, waiting for the ack
+      lnet_sendbuf *tx_tail;
+      uint32_t tx_written;     // bytes handed to tcp_write
+      uint32_t tx_acked;       // bytes acked, only written by net_sent_cb
+      int tx_nocopy;           // set once anything was sent without copy
+      int sq_close;  // close once the send queue has drained
+      int cb_drain_ref;
+      struct sched_task *rx_waiter;  // sched task in client:receive()
+      net_rx_hook_fn rx_hook;        // C code taking the data, see net.h
+      void *rx_hook_arg;
+      lnet_tls *tls;
       int hold;
+      char *host;          // as passed to connect(), the connection pool key
+      int pooled;          // idle in net_pool, see net.acquire()
+      TickType_t pooled_at;
       int cb_connect_ref;
       int cb_disconnect_ref;
       int cb_reconnect_ref;
+      // Only for connections accepted by a server:
+      struct lnet_userdata *server;  // until the connection is gone
+      int server_ref;                // keeps server in memory until then
+      uint16_t timeout;
+      uint16_t idle;                 // seconds without traffic
+      // Set by client:setopt(), applied to each new pcb by net_apply_opts:
+      uint8_t nodelay;
+      uint8_t prio;                  // 0 = lwIP's default
+      uint16_t keep_idle;            // s, 0 = no keepalive
+      uint16_t keep_intvl;           // s
+      uint8_t keep_cnt;
+      uint32_t sq_max;               // send queue cap, 0 = no limit
     } client;
   };
 } lnet_userdata;
 
+static void net_count_rx (lnet_userdata *ud, uint32_t n) {
+  TRACE(TRACE_NET_RECV, n, ud);
+  ud->stats.rx_bytes += n;
+  net_totals.rx_bytes += n;
+}
+
+static void net_count_tx (lnet_userdata *ud, uint32_t n) {
+  TRACE(TRACE_NET_WRITE, n, ud);
+  ud->stats.tx_bytes += n;
+  net_totals.tx_bytes += n;
+}
+
+static void net_count_event (lnet_userdata *ud, uint32_t us) {
+  lnet_stats *st[2] = { &net_totals, ud ? &ud->stats : NULL };
+  for (int i = 0; i < 2 && st[i]; i++) {
+    st[i]->events++;
+    st[i]->cb_us += us;
+    if (us > st[i]->cb_max_us)
+      st[i]->cb_max_us = us;
+  }
+}
+
 
 
 // --- Event handling
@@ -78,17 +246,33 @@ typedef struct {
   ip_addr_t src_ip;
   uint16_t src_port;
   uint16_t payload_len;
+  uint16_t payload_cap;
+  struct pbuf *pbuf;  // set instead of payload for zero-copy sockets
   char payload[0];
 } lnet_recvdata;
 
+typedef struct {
+  struct pbuf *p;
+  ip_addr_t src_ip;
+  uint16_t src_port;
+} lnet_datagram;
 
 typedef struct {
+  uint16_t count;
+  uint16_t cap;
+  lnet_datagram dgram[0];
+} lnet_recvbatch;
+
+
+typedef struct lnet_event {
   enum {
     DNSFOUND,
     DNSSTATIC,
     CONNECTED,
     ACCEPT,
     RECVDATA,
+    RECVBATCH,
+    RXFLUSH,
     SENTDATA,
     ERR
   } event;
@@ -97,8 +281,8 @@ typedef struct {
     int cb_ref;
   };
   union {
-    struct tcp_pcb *accept_newpcb;
     lnet_recvdata   recvdata;
+    lnet_recvbatch  recvbatch;
     ip_addr_t       resolved_ip;
     int             err;
   };
@@ -106,6 +290,126 @@ typedef struct {
 
 static task_handle_t net_event;
 
+// Every socket's callbacks; the sockets themselves stay in the registry
+static cbref_table_t net_cbs = CBREF_TABLE("net", false);
+
+// Guards lnet_userdata.client.rx_pending and .queued between the lwIP and
+// Lua tasks
+static portMUX_TYPE net_rx_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// --- Event pool
+//
+// Fixed-size blocks kept on a lock-free stack. The top word packs a change
+// counter in the upper half with the index + 1 of the first free block in
+// the lower half, so a pop racing with a pop and push of the same block
+// fails its compare-and-set instead of corrupting the list.
+
+typedef struct {
+  uint32_t size;
+  uint32_t in_use;
+  uint32_t hwm;
+  uint32_t pooled;     // events served from the pool
+  uint32_t heap;       // events too big for a pool block
+  uint32_t exhausted;  // events that found the pool empty
+} lnet_pool_stats;
+
+static volatile lnet_pool_stats net_pool_stats;
+
+static inline bool net_cas (volatile uint32_t *addr, uint32_t expect, uint32_t set)
+{
+  uxPortCompareSet (addr, expect, &set);
+  return set == expect;
+}
+
+static inline void net_stat_add (volatile uint32_t *counter, int32_t n)
+{
+  uint32_t v;
+  do {
+    v = *counter;
+  } while (!net_cas (counter, v, v + n));
+}
+
+#if CONFIG_NET_EVENT_POOL_SIZE > 0
+#define NET_POOL_BLOCK \
+  ((sizeof (lnet_event) + CONFIG_NET_EVENT_POOL_PAYLOAD + 3) & ~3)
+
+static uint32_t net_pool_mem[CONFIG_NET_EVENT_POOL_SIZE * NET_POOL_BLOCK / 4];
+static uint8_t net_pool_next[CONFIG_NET_EVENT_POOL_SIZE];
+static volatile uint32_t net_pool_top;
+
+#define NET_POOL_EVENT(i) ((lnet_event *)((char *)net_pool_mem + (i) * NET_POOL_BLOCK))
+
+static void net_pool_init (void)
+{
+  for (int i = 0; i < CONFIG_NET_EVENT_POOL_SIZE; i++)
+    net_pool_next[i] = i + 2 <= CONFIG_NET_EVENT_POOL_SIZE ? i + 2 : 0;
+  net_pool_top = 1;
+  net_pool_stats.size = CONFIG_NET_EVENT_POOL_SIZE;
+}
+
+static lnet_event *net_pool_get (void)
+{
+  uint32_t top, idx;
+  do {
+    top = net_pool_top;
+    idx = top & 0xffff;
+    if (!idx)
+      return NULL;
+  } while (!net_cas (&net_pool_top, top,
+                     ((top + 0x10000) & 0xffff0000) | net_pool_next[idx - 1]));
+
+  uint32_t used;
+  do {
+    used = net_pool_stats.in_use;
+  } while (!net_cas (&net_pool_stats.in_use, used, used + 1));
+  if (used + 1 > net_pool_stats.hwm)
+    net_pool_stats.hwm = used + 1;  // racy, but only ever low by one
+  return NET_POOL_EVENT (idx - 1);
+}
+
+static bool net_pool_put (lnet_event *ev)
+{
+  uint32_t offs = (char *)ev - (char *)net_pool_mem;
+  if ((char *)ev < (char *)net_pool_mem || offs >= sizeof (net_pool_mem))
+    return false;
+  uint32_t idx = offs / NET_POOL_BLOCK + 1, top;
+  do {
+    top = net_pool_top;
+    net_pool_next[idx - 1] = top & 0xffff;
+  } while (!net_cas (&net_pool_top, top,
+                     ((top + 0x10000) & 0xffff0000) | idx));
+  net_stat_add (&net_pool_stats.in_use, -1);
+  return true;
+}
+#endif
+
+// Allocate an event with room for payload bytes of received data. Safe to
+// call from any task; release with net_event_free().
+static lnet_event *net_event_alloc (size_t payload)
+{
+#if CONFIG_NET_EVENT_POOL_SIZE > 0
+  if (payload <= CONFIG_NET_EVENT_POOL_PAYLOAD) {
+    lnet_event *ev = net_pool_get ();
+    if (ev) {
+      net_stat_add (&net_pool_stats.pooled, 1);
+      return ev;
+    }
+    net_stat_add (&net_pool_stats.exhausted, 1);
+  } else
+#endif
+    net_stat_add (&net_pool_stats.heap, 1);
+  return (lnet_event *)malloc (sizeof (lnet_event) + payload);
+}
+
+static void net_event_free (lnet_event *ev)
+{
+#if CONFIG_NET_EVENT_POOL_SIZE > 0
+  if (net_pool_put (ev))
+    return;
+#endif
+  free (ev);
+}
+
 int net_mycall(lua_State *L) {
   if(myref != LUA_NOREF) {
 	lua_rawgeti(L, LUA_REGISTRYINDEX, myref);
@@ -157,7 +461,11 @@ lnet_userdata *net_create( lua_State *L, enum net_type type ) {
 
   ud->type = type;
   ud->self_ref = LUA_NOREF;
+  ud->hold_ref = LUA_NOREF;
+  ud->queued = 0;
   ud->pcb = NULL;
+  memset(&ud->stats, 0, sizeof(ud->stats));
+  ud->stats.since = system_get_time();
 
   switch (type) {
     case TYPE_TCP_CLIENT:
@@ -165,52 +473,552 @@ lnet_userdata *net_create( lua_State *L, enum net_type type ) {
       ud->client.cb_reconnect_ref = LUA_NOREF;
       ud->client.cb_disconnect_ref = LUA_NOREF;
       ud->client.hold = 0;
+      ud->client.host = NULL;
+      ud->client.pooled = 0;
+      ud->client.rxbuf = NULL;
+      ud->client.sq_head = ud->client.sq_tail = NULL;
+      ud->client.sq_bytes = 0;
+      ud->client.sq_copy_bytes = 0;
+      ud->client.tx_head = ud->client.tx_tail = NULL;
+      ud->client.tx_written = ud->client.tx_acked = 0;
+      ud->client.tx_nocopy = 0;
+      ud->client.sq_close = 0;
+      ud->client.cb_drain_ref = LUA_NOREF;
+      ud->client.rx_waiter = NULL;
+      ud->client.rx_hook = NULL;
+      ud->client.tls = NULL;
+      ud->client.server = NULL;
+      ud->client.server_ref = LUA_NOREF;
+      ud->client.timeout = 0;
+      ud->client.idle = 0;
+      ud->client.nodelay = 0;
+      ud->client.prio = 0;
+      ud->client.keep_idle = 0;
+      ud->client.keep_intvl = 0;
+      ud->client.keep_cnt = 0;
+      ud->client.sq_max = CONFIG_NET_SENDQ_MAX_BYTES;
     case TYPE_UDP_SOCKET:
       ud->client.wait_dns = 0;
+      ud->client.rx_zerocopy = 0;
+      ud->client.rx_buffer = 0;
+      ud->client.rx_batch = 0;
+      ud->client.rx_pending = NULL;
+      ud->client.evprio = -1;
       ud->client.cb_dns_ref = LUA_NOREF;
       ud->client.cb_receive_ref = LUA_NOREF;
       ud->client.cb_sent_ref = LUA_NOREF;
       break;
     case TYPE_TCP_SERVER:
       ud->server.cb_accept_ref = LUA_NOREF;
+      ud->server.acceptq = NULL;
+      ud->server.timeout = 0;
+      ud->server.max_clients = 0;
+      ud->server.clients = 0;
+      ud->server.rejected = 0;
+      ud->server.reaped = 0;
       break;
   }
   return ud;
 }
 
+static void net_sendbuf_free (lua_State *L, lnet_sendbuf *c) {
+  if (c->kind == SQ_PINNED)
+    luaL_unref(L, LUA_REGISTRYINDEX, c->ref);
+  else if (c->kind == SQ_FILE)
+    vfs_close(c->fd);
+  free (c);
+}
+
+static void net_sendq_free (lua_State *L, lnet_userdata *ud) {
+  lnet_sendbuf *c = ud->client.sq_head;
+  while (c) {
+    lnet_sendbuf *next = c->next;
+    net_sendbuf_free (L, c);
+    c = next;
+  }
+  ud->client.sq_head = ud->client.sq_tail = NULL;
+  ud->client.sq_bytes = 0;
+  ud->client.sq_copy_bytes = 0;
+}
+
+// Release the in-flight chunks the peer has acked, or all of them once
+// lwIP no longer holds any segments pointing at them.
+static void net_tx_release (lua_State *L, lnet_userdata *ud, bool all) {
+  lnet_sendbuf *c;
+  uint32_t acked = ud->client.tx_acked;
+  while ((c = ud->client.tx_head) &&
+         (all || (int32_t)(acked - c->end) >= 0)) {
+    ud->client.tx_head = c->next;
+    net_sendbuf_free (L, c);
+  }
+  if (!ud->client.tx_head)
+    ud->client.tx_tail = NULL;
+}
+
+static void net_tx_inflight (lnet_userdata *ud, lnet_sendbuf *c) {
+  c->next = NULL;
+  c->end = ud->client.tx_written;
+  if (ud->client.tx_tail)
+    ud->client.tx_tail->next = c;
+  else
+    ud->client.tx_head = c;
+  ud->client.tx_tail = c;
+}
+
+static lnet_sendbuf *net_sendq_new (lnet_userdata *ud, int kind, size_t len, size_t extra) {
+  lnet_sendbuf *c = (lnet_sendbuf *)malloc (sizeof (lnet_sendbuf) + extra);
+  if (!c)
+    return NULL;
+  c->next = NULL;
+  c->kind = kind;
+  c->len = len;
+  c->off = 0;
+  c->end = 0;
+  c->ref = LUA_NOREF;
+  c->fd = 0;
+  c->ptr = NULL;
+  if (ud->client.sq_tail)
+    ud->client.sq_tail->next = c;
+  else
+    ud->client.sq_head = c;
+  ud->client.sq_tail = c;
+  ud->client.sq_bytes += len;
+  return c;
+}
+
+static bool net_sendq_append (lnet_userdata *ud, const char *data, size_t len) {
+  if (ud->client.sq_max && ud->client.sq_copy_bytes + len > ud->client.sq_max)
+    return false;
+  lnet_sendbuf *c = net_sendq_new (ud, SQ_COPY, len, len);
+  if (!c)
+    return false;
+  memcpy (c->data, data, len);
+  ud->client.sq_copy_bytes += len;
+  return true;
+}
+
+// Hand as much queued data to lwIP as its send buffer takes, marking all
+// but the last write with TCP_WRITE_FLAG_MORE, then push it out in one go.
+static err_t net_sendq_flush (lnet_userdata *ud) {
+  struct tcp_pcb *pcb = ud->tcp_pcb;
+  err_t err = ERR_OK;
+  bool wrote = false;
+  lnet_sendbuf *c;
+  while ((c = ud->client.sq_head)) {
+    uint32_t n = c->len - c->off;
+    u16_t avail = tcp_sndbuf(pcb);
+    if (avail == 0)
+      break;
+    if (n > avail)
+      n = avail;
+    u8_t flags = 0;
+    if (c->off + n < c->len || c->next)
+      flags |= TCP_WRITE_FLAG_MORE;
+    lnet_sendbuf *chunk = NULL;
+    const char *data;
+    switch (c->kind) {
+      case SQ_COPY:
+        flags |= TCP_WRITE_FLAG_COPY;
+        data = c->data + c->off;
+        break;
+      case SQ_PINNED:
+        data = c->ptr + c->off;
+        break;
+      default: // SQ_FILE
+        chunk = (lnet_sendbuf *)malloc (sizeof (lnet_sendbuf) + n);
+        if (!chunk)
+          goto out;  // retry on the next sent callback
+        chunk->kind = SQ_CHUNK;
+        chunk->len = n;
+        if (vfs_read(c->fd, chunk->data, n) != (int32_t)n) {
+          free (chunk);
+          err = ERR_BUF;
+          goto out;
+        }
+        data = chunk->data;
+        break;
+    }
+    err = tcp_write(pcb, data, n, flags);
+    if (err == ERR_MEM) {
+      err = ERR_OK;  // out of segments, try again on the next sent callback
+      if (chunk) {
+        vfs_lseek(c->fd, -(int32_t)n, VFS_SEEK_CUR);
+        free (chunk);
+      }
+      break;
+    }
+    if (err != ERR_OK) {
+      free (chunk);
+      break;
+    }
+    wrote = true;
+    c->off += n;
+    ud->client.sq_bytes -= n;
+    ud->client.tx_written += n;
+    net_count_tx (ud, n);
+    if (c->kind == SQ_COPY)
+      ud->client.sq_copy_bytes -= n;
+    if (chunk)
+      net_tx_inflight (ud, chunk);
+    if (c->off == c->len) {
+      ud->client.sq_head = c->next;
+      if (c->kind == SQ_PINNED) {
+        net_tx_inflight (ud, c);
+      } else {
+        if (c->kind == SQ_FILE)
+          vfs_close (c->fd);
+        free (c);
+      }
+    }
+  }
+out:
+  if (!ud->client.sq_head)
+    ud->client.sq_tail = NULL;
+  if (wrote)
+    tcp_output(pcb);
+  return err;
+}
+
+// Put the options from client:setopt() on the socket's pcb
+static void net_apply_opts (lnet_userdata *ud) {
+  struct tcp_pcb *pcb = ud->tcp_pcb;
+  if (!pcb)
+    return;
+  if (ud->client.nodelay)
+    tcp_nagle_disable(pcb);
+  else
+    tcp_nagle_enable(pcb);
+  if (ud->client.keep_idle) {
+    ip_set_option(pcb, SOF_KEEPALIVE);
+    pcb->keep_idle = ud->client.keep_idle * 1000;
+    if (ud->client.keep_intvl)
+      pcb->keep_intvl = ud->client.keep_intvl * 1000;
+    if (ud->client.keep_cnt)
+      pcb->keep_cnt = ud->client.keep_cnt;
+  } else if (!ud->client.pooled) {
+    ip_reset_option(pcb, SOF_KEEPALIVE);
+  }
+  if (ud->client.prio)
+    tcp_setprio(pcb, ud->client.prio);
+}
+
+// Write straight through while nothing is queued, and queue whatever
+// lwIP can't take right now; it goes out as tcp_sent frees up space.
+// ERR_MEM means the send queue is full.
+static err_t net_tcp_send_raw (lnet_userdata *ud, const char *data, size_t datalen) {
+  size_t n = 0;
+  err_t err = ERR_OK;
+  if (!ud->client.sq_head) {
+    n = tcp_sndbuf(ud->tcp_pcb);
+    if (n > datalen)
+      n = datalen;
+    if (n) {
+      err = tcp_write(ud->tcp_pcb, data, n, TCP_WRITE_FLAG_COPY);
+      if (err == ERR_MEM) {
+        n = 0;
+        err = ERR_OK;
+      }
+      if (err == ERR_OK) {
+        ud->client.tx_written += n;
+        net_count_tx (ud, n);
+      }
+    }
+  }
+  bool wrote = err == ERR_OK && n;
+  if (err == ERR_OK && n < datalen &&
+      !net_sendq_append(ud, data + n, datalen - n))
+    err = ERR_MEM;
+  if (wrote)
+    tcp_output(ud->tcp_pcb);
+  return err;
+}
+
+static void net_rx_timer_cb (void *arg);
+
+static lnet_rxbuf *net_rxbuf_get (lnet_userdata *ud) {
+  lnet_rxbuf *b = ud->client.rxbuf;
+  if (!b) {
+    b = (lnet_rxbuf *)calloc (1, sizeof (lnet_rxbuf));
+    if (!b)
+      return NULL;
+    os_timer_setfn (&b->timer, net_rx_timer_cb, ud);
+    ud->client.rxbuf = b;
+  }
+  return b;
+}
+
+// Received data as the socket's "receive" wants it
+static void net_push_data (lua_State *L, lnet_userdata *ud, const char *data, size_t len) {
+  if (ud->client.rx_buffer)
+    memcpy(buffer_push(L, len)->data, data, len);
+  else
+    lua_pushlstring(L, data, len);
+}
+
+// Take up to max bytes (any, for 0) off the front of the buffer
+static void net_rxbuf_push (lua_State *L, lnet_userdata *ud, lnet_rxbuf *b) {
+  uint32_t n = (b->max && b->len > b->max) ? b->max : b->len;
+  net_push_data(L, ud, b->data, n);
+  b->len -= n;
+  memmove(b->data, b->data + n, b->len);
+}
+
+// A task in client:receive() gets nil once the connection is gone
+static void net_rx_cancel (lua_State *L, lnet_userdata *ud) {
+  if (ud->client.rx_waiter) {
+    lua_pushnil(L);
+    sched_wake(L, &ud->client.rx_waiter, 1);
+  }
+}
+
+static void net_rxbuf_free (lnet_userdata *ud) {
+  lnet_rxbuf *b = ud->client.rxbuf;
+  if (!b)
+    return;
+  os_timer_disarm (&b->timer);
+  free (b->data);
+  free (b);
+  ud->client.rxbuf = NULL;
+}
+
+// --- DNS cache
+//
+// Small LRU table in front of dns_gethostbyname(). lwIP doesn't pass the
+// record TTL up to its callback, so entries live for a fixed time; failed
+// lookups are remembered too, for a shorter time. Filled from the lwIP
+// callbacks and read from the Lua task, hence the spinlock. Other modules
+// fill it through net_dns_cache_put() with the TTLs they know, and can
+// take over names ending in .local.
+
+#define NET_DNS_NAME_MAX 64
+
+#if CONFIG_NET_DNS_CACHE_SIZE > 0
+typedef struct {
+  char name[NET_DNS_NAME_MAX];  // empty when unused
+  ip_addr_t addr;
+  bool negative;
+  TickType_t expires;
+  TickType_t used;
+} lnet_dns_entry;
+
+static lnet_dns_entry net_dns_cache[CONFIG_NET_DNS_CACHE_SIZE];
+static portMUX_TYPE net_dns_mux = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+static struct {
+  uint32_t hits;
+  uint32_t negative_hits;
+  uint32_t misses;
+  uint32_t evictions;
+} net_dns_stats;
+
+static net_local_resolver_fn net_local_resolver;
+
+#if CONFIG_NET_DNS_CACHE_SIZE > 0
+// ttl_s 0 drops the name. With refresh unset, a live entry for the same
+// answer keeps its expiry, so answering from the cache doesn't extend it.
+static void net_dns_cache_set (const char *name, const ip_addr_t *addr,
+                               uint32_t ttl_s, bool refresh) {
+  ip_addr_t literal;
+  if (!name || strlen (name) >= NET_DNS_NAME_MAX || ipaddr_aton (name, &literal))
+    return;
+  TickType_t now = xTaskGetTickCount ();
+  portENTER_CRITICAL (&net_dns_mux);
+  lnet_dns_entry *e = NULL, *lru = &net_dns_cache[0];
+  for (int i = 0; i < CONFIG_NET_DNS_CACHE_SIZE; i++) {
+    lnet_dns_entry *c = &net_dns_cache[i];
+    if (c->name[0] && strcasecmp (c->name, name) == 0) {
+      e = c;
+      break;
+    }
+    if (lru->name[0] && (!c->name[0] || (int32_t)(c->used - lru->used) < 0))
+      lru = c;
+  }
+  if (!ttl_s) {
+    if (e)
+      e->name[0] = 0;
+    portEXIT_CRITICAL (&net_dns_mux);
+    return;
+  }
+  bool live = !refresh && e && (int32_t)(e->expires - now) > 0 &&
+              e->negative == !addr && (!addr || ip_addr_cmp (&e->addr, addr));
+  if (!live) {
+    if (!e) {
+      e = lru;
+      if (e->name[0])
+        net_dns_stats.evictions++;
+      strcpy (e->name, name);
+    }
+    e->negative = !addr;
+    if (addr)
+      e->addr = *addr;
+    e->expires = now + ttl_s * 1000 / portTICK_PERIOD_MS;
+  }
+  e->used = now;
+  portEXIT_CRITICAL (&net_dns_mux);
+}
+#endif
+
+static void net_dns_cache_store (const char *name, const ip_addr_t *addr) {
+#if CONFIG_NET_DNS_CACHE_SIZE > 0
+#if CONFIG_NET_DNS_CACHE_NEG_TTL_S == 0
+  if (!addr)
+    return;
+#endif
+  net_dns_cache_set (name, addr, addr ? CONFIG_NET_DNS_CACHE_TTL_S :
+                                        CONFIG_NET_DNS_CACHE_NEG_TTL_S, false);
+#endif
+}
+
+void net_dns_cache_put( const char *name, const ip_addr_t *addr, uint32_t ttl_s ) {
+#if CONFIG_NET_DNS_CACHE_SIZE > 0
+  if (addr)
+    net_dns_cache_set (name, addr, ttl_s, true);
+  else
+    net_dns_cache_store (name, NULL);
+#endif
+}
+
+int net_dns_cache_get( const char *name, ip_addr_t *addr ) {
+  int hit = 0;
+#if CONFIG_NET_DNS_CACHE_SIZE > 0
+  TickType_t now = xTaskGetTickCount ();
+  portENTER_CRITICAL (&net_dns_mux);
+  for (int i = 0; i < CONFIG_NET_DNS_CACHE_SIZE; i++) {
+    lnet_dns_entry *e = &net_dns_cache[i];
+    if (!e->name[0] || strcasecmp (e->name, name) != 0)
+      continue;
+    if ((int32_t)(e->expires - now) <= 0) {
+      e->name[0] = 0;
+      break;
+    }
+    e->used = now;
+    if (e->negative) {
+      hit = -1;
+      net_dns_stats.negative_hits++;
+    } else {
+      hit = 1;
+      *addr = e->addr;
+      net_dns_stats.hits++;
+    }
+    break;
+  }
+  if (!hit)
+    net_dns_stats.misses++;
+  portEXIT_CRITICAL (&net_dns_mux);
+#endif
+  return hit;
+}
+
+void net_dns_set_local_resolver( net_local_resolver_fn fn ) {
+  net_local_resolver = fn;
+}
+
+// Whether name is in .local, which mDNS rather than the DNS server answers
+static bool net_dns_is_local (const char *name) {
+  size_t l = strlen (name);
+  if (l && name[l - 1] == '.')
+    l--;
+  return l > 6 && strncasecmp (name + l - 6, ".local", 6) == 0;
+}
+
+// dns_gethostbyname() with the cache in front. A cached failure calls
+// found with a NULL address straight away and returns ERR_INPROGRESS, so
+// callers handle it exactly like a failed lookup.
+static err_t net_gethostbyname (const char *name, ip_addr_t *addr,
+                                dns_found_callback found, void *arg) {
+  if (ipaddr_aton (name, addr))
+    return ERR_OK;
+  int hit = net_dns_cache_get (name, addr);
+  if (hit > 0)
+    return ERR_OK;
+  if (hit < 0) {
+    found (name, NULL, arg);
+    return ERR_INPROGRESS;
+  }
+  if (net_local_resolver && net_dns_is_local (name))
+    return net_local_resolver (name, addr, found, arg);
+  return dns_gethostbyname (name, addr, found, arg);
+}
+
+// Drop the registry reference that keeps the socket while it is open.
+// Events still queued for it may be handled after events posted later at
+// a higher priority, or aged ahead of them; the userdata is kept until
+// they are through, and the handlers ignore them.
+static void net_unref_self (lua_State *L, lnet_userdata *ud) {
+  lua_gc(L, LUA_GCSTOP, 0);
+  portENTER_CRITICAL (&net_rx_mux);
+  bool hold = ud->queued && ud->hold_ref == LUA_NOREF;
+  portEXIT_CRITICAL (&net_rx_mux);
+  if (hold)
+    ud->hold_ref = ud->self_ref;
+  else
+    luaL_unref(L, LUA_REGISTRYINDEX, ud->self_ref);
+  ud->self_ref = LUA_NOREF;
+  lua_gc(L, LUA_GCRESTART, 0);
+}
+
 // --- LWIP callbacks and task_post helpers
 
+// Received data goes high and the rest medium, unless the socket asked
+// for a priority of its own; then all of its events go there, keeping
+// their order
+static bool net_post (lnet_userdata *ud, task_prio_t prio, lnet_event *ev) {
+  if (ud->type != TYPE_TCP_SERVER && ud->client.evprio >= 0)
+    prio = ud->client.evprio;
+  portENTER_CRITICAL (&net_rx_mux);
+  ud->queued++;
+  portEXIT_CRITICAL (&net_rx_mux);
+  if (task_post (prio, net_event, (task_param_t)ev))
+    return true;
+  portENTER_CRITICAL (&net_rx_mux);
+  ud->queued--;
+  portEXIT_CRITICAL (&net_rx_mux);
+  return false;
+}
+
 static bool post_net_err (lnet_userdata *ud, err_t err) {
-  lnet_event *ev = (lnet_event *)malloc (sizeof (lnet_event));
+  lnet_event *ev = net_event_alloc (0);
   if (!ev)
     return false;
   ev->event = ERR;
   ev->ud = ud;
   ev->err = err;
-  if (!task_post_medium (net_event, (task_param_t)ev)) {
-    free (ev);
+  if (!net_post (ud, TASK_PRIORITY_MEDIUM, ev)) {
+    net_event_free (ev);
     return false;
   }
   return true;
 }
 
+// An accepted connection is gone, from either task; its server may take
+// another in its place
+static void net_client_gone (lnet_userdata *ud) {
+  lnet_userdata *server = ud->client.server;
+  if (server) {
+    ud->client.server = NULL;
+    net_stat_add (&server->server.clients, -1);
+  }
+}
+
 static void net_err_cb(void *arg, err_t err) {
   lnet_userdata *ud = (lnet_userdata*)arg;
   if (!ud || ud->type != TYPE_TCP_CLIENT || ud->self_ref == LUA_NOREF) return;
   ud->pcb = NULL; // Will be freed at LWIP level
+  net_client_gone (ud);
 
   post_net_err (ud, err);
 }
 
 
 static bool post_net_connected (lnet_userdata *ud) {
-  lnet_event *ev = (lnet_event *)malloc (sizeof (lnet_event));
+  lnet_event *ev = net_event_alloc (0);
   if (!ev)
     return false;
   ev->event = CONNECTED;
   ev->ud = ud;
-  if (!task_post_medium (net_event, (task_param_t)ev)) {
-    free (ev);
+  if (!net_post (ud, TASK_PRIORITY_MEDIUM, ev)) {
+    net_event_free (ev);
     return false;
   }
   return true;
@@ -230,14 +1038,14 @@ static err_t net_connected_cb(void *arg, struct tcp_pcb *tpcb, err_t err) {
 
 static bool post_net_dns (lnet_userdata *ud, const char *name, const ip_addr_t *ipaddr)
 {
-  lnet_event *ev = (lnet_event *)malloc (sizeof (lnet_event));
+  lnet_event *ev = net_event_alloc (0);
   if (!ev || !ipaddr)
     return false;
   ev->event = DNSFOUND;
   ev->ud = ud;
   ev->resolved_ip = *ipaddr;
-  if (!task_post_medium (net_event, (task_param_t)ev)) {
-    free (ev);
+  if (!net_post (ud, TASK_PRIORITY_MEDIUM, ev)) {
+    net_event_free (ev);
     return false;
   }
   return true;
@@ -250,13 +1058,59 @@ static void net_dns_cb(const char *name, const ip_addr_t *ipaddr, void *arg) {
   lnet_userdata *ud = (lnet_userdata*)arg;
   if (!ud) return;
 
+  net_dns_cache_store (name, ipaddr);
   post_net_dns (ud, name, &addr);
 }
 
 
+#if CONFIG_NET_RX_COALESCE_BYTES > 0
+// Append p to the receive event still queued for ud, if there's room.
+// Takes ownership of p on success.
+static bool coalesce_net_recv (lnet_userdata *ud, struct pbuf *p)
+{
+  bool merged = false, chained = false;
+  portENTER_CRITICAL (&net_rx_mux);
+  lnet_event *ev = ud->client.rx_pending;
+  // Only merge into an event of the current receive mode, so the TCP
+  // window accounting in net_tcp_recv_cb stays right
+  if (ev && (ev->recvdata.pbuf != NULL) == (ud->client.rx_zerocopy != 0)) {
+    lnet_recvdata *rd = &ev->recvdata;
+    if (rd->pbuf) {
+      if (rd->pbuf->tot_len + p->tot_len <= CONFIG_NET_RX_COALESCE_BYTES) {
+        pbuf_cat (rd->pbuf, p);
+        merged = chained = true;
+      }
+    } else if (rd->payload_len + p->tot_len <= rd->payload_cap) {
+      pbuf_copy_partial (p, rd->payload + rd->payload_len, p->tot_len, 0);
+      rd->payload_len += p->tot_len;
+      merged = true;
+    }
+  }
+  portEXIT_CRITICAL (&net_rx_mux);
+
+  if (merged && !chained)
+    pbuf_free (p);
+  return merged;
+}
+#endif
+
+// Takes ownership of p on success; on failure the caller still owns it.
 static bool post_net_recv (lnet_userdata *ud, struct pbuf *p, const ip_addr_t *ip, u16_t port)
 {
-  lnet_event *ev = (lnet_event *)malloc (sizeof (lnet_event) + p->len);
+  bool zerocopy = ud->client.rx_zerocopy;
+  bool coalesce = false;
+  uint16_t cap = p->tot_len;
+#if CONFIG_NET_RX_COALESCE_BYTES > 0
+  // Datagram boundaries matter for UDP, so only TCP data is merged
+  if (ud->type == TYPE_TCP_CLIENT) {
+    if (coalesce_net_recv (ud, p))
+      return true;
+    coalesce = true;
+    if (cap < CONFIG_NET_RX_COALESCE_BYTES)
+      cap = CONFIG_NET_RX_COALESCE_BYTES;
+  }
+#endif
+  lnet_event *ev = net_event_alloc (zerocopy ? 0 : cap);
   if (!ev)
     return false;
 
@@ -266,12 +1120,75 @@ static bool post_net_recv (lnet_userdata *ud, struct pbuf *p, const ip_addr_t *i
   if (ip)
     ev->recvdata.src_ip = *ip;
   ev->recvdata.src_port = port;
-  ev->recvdata.payload_len = p->len;
-  pbuf_copy_partial (p, &ev->recvdata.payload, p->len, 0);
+  ev->recvdata.payload_len = p->tot_len;
+  ev->recvdata.payload_cap = zerocopy ? 0 : cap;
+  if (zerocopy)
+    ev->recvdata.pbuf = p;
+  else
+  {
+    ev->recvdata.pbuf = NULL;
+    pbuf_copy_partial (p, &ev->recvdata.payload, p->tot_len, 0);
+  }
 
-  if (!task_post_high (net_event, (task_param_t)ev))
+  if (coalesce) {
+    portENTER_CRITICAL (&net_rx_mux);
+    ud->client.rx_pending = ev;
+    portEXIT_CRITICAL (&net_rx_mux);
+  }
+
+  if (!net_post (ud, TASK_PRIORITY_HIGH, ev))
   {
-    free (ev);
+    if (coalesce) {
+      portENTER_CRITICAL (&net_rx_mux);
+      ud->client.rx_pending = NULL;
+      portEXIT_CRITICAL (&net_rx_mux);
+    }
+    net_event_free (ev);
+    return false;
+  }
+  if (!zerocopy)
+    pbuf_free (p);
+  return true;
+}
+
+// Add a datagram to the batch still waiting for the Lua task, or start a
+// new batch. Takes ownership of p on success.
+static bool post_net_recvbatch (lnet_userdata *ud, struct pbuf *p, const ip_addr_t *ip, u16_t port)
+{
+  lnet_datagram *d = NULL;
+  portENTER_CRITICAL (&net_rx_mux);
+  lnet_event *ev = ud->client.rx_pending;
+  if (ev && ev->recvbatch.count < ev->recvbatch.cap)
+    d = &ev->recvbatch.dgram[ev->recvbatch.count++];
+  if (d) {
+    d->p = p;
+    d->src_ip = *ip;
+    d->src_port = port;
+  }
+  portEXIT_CRITICAL (&net_rx_mux);
+  if (d)
+    return true;
+
+  uint16_t cap = ud->client.rx_batch;
+  ev = net_event_alloc (cap * sizeof (lnet_datagram));
+  if (!ev)
+    return false;
+  ev->event = RECVBATCH;
+  ev->ud = ud;
+  ev->recvbatch.count = 1;
+  ev->recvbatch.cap = cap;
+  ev->recvbatch.dgram[0].p = p;
+  ev->recvbatch.dgram[0].src_ip = *ip;
+  ev->recvbatch.dgram[0].src_port = port;
+
+  portENTER_CRITICAL (&net_rx_mux);
+  ud->client.rx_pending = ev;
+  portEXIT_CRITICAL (&net_rx_mux);
+  if (!net_post (ud, TASK_PRIORITY_HIGH, ev)) {
+    portENTER_CRITICAL (&net_rx_mux);
+    ud->client.rx_pending = NULL;
+    portEXIT_CRITICAL (&net_rx_mux);
+    net_event_free (ev);
     return false;
   }
   return true;
@@ -283,7 +1200,16 @@ static void net_udp_recv_cb(void *arg, struct udp_pcb *pcb, struct pbuf *p, cons
     if (p) pbuf_free(p);
     return;
   }
-  post_net_recv (ud, p, addr, port);
+  u16_t len = p->tot_len;
+  bool posted = ud->client.rx_batch > 1 ?
+    post_net_recvbatch (ud, p, addr, port) : post_net_recv (ud, p, addr, port);
+  if (posted) {
+    net_count_rx (ud, len);
+  } else {
+    pbuf_free (p);
+    ud->stats.rx_dropped++;
+    net_totals.rx_dropped++;
+  }
 }
 
 static err_t net_tcp_recv_cb(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
@@ -295,21 +1221,45 @@ static err_t net_tcp_recv_cb(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, er
     return tcp_close(tpcb);
   }
 
-  if (post_net_recv (ud, p, 0, 0))
-    tcp_recved(tpcb, p->len);
+  ud->client.idle = 0;
+  // Acknowledge the whole chain, not just the first pbuf
+  u16_t len = p->tot_len;
+  bool zerocopy = ud->client.rx_zerocopy;
+  if (!post_net_recv (ud, p, 0, 0)) {
+    ud->stats.rx_dropped++;
+    net_totals.rx_dropped++;
+    return ERR_MEM; // lwIP holds on to the data and offers it again later
+  }
+  net_count_rx (ud, len);
+
+  // Zero-copy sockets open the window once Lua has consumed the data
+  if (!zerocopy)
+    tcp_recved(tpcb, len);
 
   return ERR_OK;
 }
 
 
+static void net_rx_timer_cb (void *arg) {
+  lnet_userdata *ud = (lnet_userdata *)arg;
+  lnet_event *ev = net_event_alloc (0);
+  if (!ev)
+    return;
+  ev->event = RXFLUSH;
+  ev->ud = ud;
+  if (!net_post (ud, TASK_PRIORITY_MEDIUM, ev))
+    net_event_free (ev);
+}
+
+
 static bool post_net_sent (lnet_userdata *ud) {
-  lnet_event *ev = (lnet_event *)malloc (sizeof (lnet_event));
+  lnet_event *ev = net_event_alloc (0);
   if (!ev)
     return false;
   ev->event = SENTDATA;
   ev->ud = ud;
-  if (!task_post_medium (net_event, (task_param_t)ev)) {
-    free (ev);
+  if (!net_post (ud, TASK_PRIORITY_MEDIUM, ev)) {
+    net_event_free (ev);
     return false;
   }
   return true;
@@ -318,7 +1268,11 @@ static bool post_net_sent (lnet_userdata *ud) {
 static err_t net_sent_cb(void *arg, struct tcp_pcb *tpcb, u16_t len) {
   lnet_userdata *ud = (lnet_userdata*)arg;
   if (!ud || !ud->pcb || ud->type != TYPE_TCP_CLIENT || ud->self_ref == LUA_NOREF) return ERR_ABRT;
-  if (ud->client.cb_sent_ref == LUA_NOREF) return ERR_OK;
+  ud->client.tx_acked += len;
+  ud->client.idle = 0;
+  if (ud->client.cb_sent_ref == LUA_NOREF && !ud->client.sq_head &&
+      !ud->client.tx_nocopy)
+    return ERR_OK;
 
   post_net_sent (ud);
   // TODO: if we can't post this, we effectively stall this socket, how to fix?
@@ -326,32 +1280,339 @@ static err_t net_sent_cb(void *arg, struct tcp_pcb *tpcb, u16_t len) {
 }
 
 
-static bool post_net_accept (lnet_userdata *ud, struct tcp_pcb *newpcb) {
-  lnet_event *ev = (lnet_event *)malloc (sizeof (lnet_event));
+static bool post_net_accept (lnet_userdata *ud) {
+  lnet_event *ev = net_event_alloc (0);
   if (!ev)
     return false;
-  ev->event = SENTDATA;
+  ev->event = ACCEPT;
   ev->ud = ud;
-  ev->accept_newpcb = newpcb;
-  if (!task_post_medium (net_event, (task_param_t)ev)) {
-    free (ev);
+  if (!net_post (ud, TASK_PRIORITY_MEDIUM, ev)) {
+    net_event_free (ev);
     return false;
   }
   return true;
 }
 
+// Data for a connection still waiting to be taken stays with lwIP, which
+// offers it again until the Lua task has set up the real callbacks
+static err_t net_pending_recv_cb(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
+  lnet_pending *slot = (lnet_pending *)arg;
+  if (p)
+    return ERR_MEM;
+  // closed by the peer before anyone saw it
+  tcp_arg(tpcb, NULL);
+  tcp_err(tpcb, NULL);
+  tcp_recv(tpcb, NULL);
+  slot->pcb = NULL;
+  net_stat_add (&slot->server->server.clients, -1);
+  if (tcp_close(tpcb) != ERR_OK) {
+    tcp_abort(tpcb);
+    return ERR_ABRT;
+  }
+  return ERR_OK;
+}
+
+static void net_pending_err_cb(void *arg, err_t err) {
+  lnet_pending *slot = (lnet_pending *)arg;
+  if (!slot)
+    return;
+  slot->pcb = NULL;
+  net_stat_add (&slot->server->server.clients, -1);
+}
 
+// Connections over the server's limits are refused here, in lwIP's task,
+// before they cost a Lua object or an event. The rest are queued for the
+// Lua task, with one event for as many as arrive before it gets to them.
 static err_t net_accept_cb(void *arg, struct tcp_pcb *newpcb, err_t err) {
   lnet_userdata *ud = (lnet_userdata*)arg;
-  if (!ud || ud->type != TYPE_TCP_SERVER || !ud->pcb) return ERR_ABRT;
-  if (ud->self_ref == LUA_NOREF || ud->server.cb_accept_ref == LUA_NOREF) return ERR_ABRT;
+  if (!newpcb || err != ERR_OK)
+    return ERR_VAL;
+  if (!ud || ud->type != TYPE_TCP_SERVER || !ud->pcb) {
+    tcp_abort(newpcb);
+    return ERR_ABRT;
+  }
+  // lwIP's backlog counts it from the SYN until now
+  tcp_accepted(ud->tcp_pcb);
+  lnet_acceptq *q = ud->server.acceptq;
+  if (ud->self_ref == LUA_NOREF || ud->server.cb_accept_ref == LUA_NOREF ||
+      !q || q->tail - q->head >= q->cap ||
+      (ud->server.max_clients && ud->server.clients >= ud->server.max_clients))
+    goto reject;
+
+  lnet_pending *slot = &q->slot[q->tail % q->cap];
+  slot->pcb = newpcb;
+  slot->server = ud;
+  if (!q->posted) {
+    q->posted = 1;
+    if (!post_net_accept (ud)) {
+      q->posted = 0;
+      goto reject;
+    }
+  }
+  net_stat_add (&ud->server.clients, 1);
+  tcp_arg(newpcb, slot);
+  tcp_err(newpcb, net_pending_err_cb);
+  tcp_recv(newpcb, net_pending_recv_cb);
+  q->tail++;
+  return ERR_OK;
 
-  return post_net_accept (ud, newpcb) ? ERR_OK : ERR_ABRT;
+reject:
+  ud->server.rejected++;
+  tcp_abort(newpcb);
+  return ERR_ABRT;
 }
 
-// --- Lua API - create
+// Drops the connections still waiting to be taken
+static void net_accept_flush (lnet_userdata *ud) {
+  lnet_acceptq *q = ud->server.acceptq;
+  if (!q)
+    return;
+  for (; q->head != q->tail; q->head++) {
+    lnet_pending *slot = &q->slot[q->head % q->cap];
+    if (slot->pcb) {
+      tcp_arg(slot->pcb, NULL);
+      tcp_abort(slot->pcb);
+      slot->pcb = NULL;
+      net_stat_add (&ud->server.clients, -1);
+    }
+  }
+}
 
-extern int tls_socket_create( lua_State *L );
+// Once a second on accepted connections with an idle timeout
+static err_t net_idle_poll_cb(void *arg, struct tcp_pcb *tpcb) {
+  lnet_userdata *ud = (lnet_userdata*)arg;
+  if (!ud || ud->type != TYPE_TCP_CLIENT || ud->pcb != tpcb || !ud->client.timeout)
+    return ERR_OK;
+  if (++ud->client.idle < ud->client.timeout)
+    return ERR_OK;
+  if (ud->client.server)
+    ud->client.server->server.reaped++;
+  tcp_arg(tpcb, NULL);
+  tcp_abort(tpcb);
+  ud->pcb = NULL;
+  net_client_gone (ud);
+  if (ud->self_ref != LUA_NOREF)
+    post_net_err (ud, ERR_TIMEOUT);
+  return ERR_ABRT;
+}
+
+// --- TLS
+//
+// Secure sockets run mbedTLS on the Lua task. Ciphertext is fed in as
+// lwIP hands it over and records go out through the send queue, so nothing
+// blocks; the handshake starts once TCP is up, and the "connection"
+// callback waits for it. Sessions are kept by tls_session for resuming on
+// the next connect. AES runs on the hardware engine. Each connection's two
+// record buffers are CONFIG_MBEDTLS_SSL_MAX_CONTENT_LEN bytes; when the
+// servers honour the fragment option that can be lowered to match.
+
+#define NET_TLS_CHUNK 1024   // plaintext handed on at a time
+
+static mbedtls_entropy_context net_tls_entropy;
+static mbedtls_ctr_drbg_context net_tls_drbg;
+static bool net_tls_seeded;
+static char net_tls_plain[NET_TLS_CHUNK];
+
+static void lconnected_cb (lua_State *L, lnet_userdata *ud);
+static bool lrx_reserve (lnet_rxbuf *b, uint32_t n);
+static void lrx_deliver (lua_State *L, lnet_userdata *ud, bool flush);
+
+static int net_tls_bio_send (void *ctx, const unsigned char *buf, size_t len) {
+  lnet_userdata *ud = (lnet_userdata *)ctx;
+  if (!ud->pcb)
+    return MBEDTLS_ERR_NET_CONN_RESET;
+  if (net_tcp_send_raw(ud, (const char *)buf, len) != ERR_OK)
+    return MBEDTLS_ERR_NET_SEND_FAILED;
+  return len;
+}
+
+static int net_tls_bio_recv (void *ctx, unsigned char *buf, size_t len) {
+  lnet_tls *t = ((lnet_userdata *)ctx)->client.tls;
+  if (!t->in_len)
+    return MBEDTLS_ERR_SSL_WANT_READ;
+  if (len > t->in_len)
+    len = t->in_len;
+  memcpy(buf, t->in, len);
+  t->in += len;
+  t->in_len -= len;
+  return len;
+}
+
+static void net_tls_new (lua_State *L, lnet_userdata *ud, int opts) {
+  if (!net_tls_seeded) {
+    mbedtls_entropy_init(&net_tls_entropy);
+    mbedtls_ctr_drbg_init(&net_tls_drbg);
+    if (mbedtls_ctr_drbg_seed(&net_tls_drbg, mbedtls_entropy_func,
+                              &net_tls_entropy, NULL, 0) != 0)
+      luaL_error(L, "cannot seed random generator");
+    net_tls_seeded = true;
+  }
+  lnet_tls *t = (lnet_tls *)calloc(1, sizeof(lnet_tls));
+  if (!t)
+    luaL_error(L, "out of memory");
+  ud->client.tls = t;  // net_delete frees it from here on
+  mbedtls_ssl_init(&t->ssl);
+  mbedtls_ssl_config_init(&t->conf);
+  mbedtls_x509_crt_init(&t->ca);
+  if (mbedtls_ssl_config_defaults(&t->conf, MBEDTLS_SSL_IS_CLIENT,
+        MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0)
+    luaL_error(L, "out of memory");
+  mbedtls_ssl_conf_rng(&t->conf, mbedtls_ctr_drbg_random, &net_tls_drbg);
+  mbedtls_ssl_conf_session_tickets(&t->conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+  mbedtls_ssl_conf_authmode(&t->conf, MBEDTLS_SSL_VERIFY_NONE);
+  if (!opts)
+    return;
+
+  lua_getfield(L, opts, "ca");
+  if (!lua_isnil(L, -1)) {
+    size_t len;
+    const char *pem = luaL_checklstring(L, -1, &len);
+    // The PEM parser wants the terminating NUL counted
+    if (mbedtls_x509_crt_parse(&t->ca, (const unsigned char *)pem, len + 1) != 0)
+      luaL_error(L, "bad CA certificate");
+    mbedtls_ssl_conf_ca_chain(&t->conf, &t->ca, NULL);
+    mbedtls_ssl_conf_authmode(&t->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+  }
+  lua_pop(L, 1);
+  lua_getfield(L, opts, "fragment");
+  if (!lua_isnil(L, -1)) {
+    unsigned char code;
+    switch (luaL_checkinteger(L, -1)) {
+      case 512:  code = MBEDTLS_SSL_MAX_FRAG_LEN_512; break;
+      case 1024: code = MBEDTLS_SSL_MAX_FRAG_LEN_1024; break;
+      case 2048: code = MBEDTLS_SSL_MAX_FRAG_LEN_2048; break;
+      case 4096: code = MBEDTLS_SSL_MAX_FRAG_LEN_4096; break;
+      default: luaL_error(L, "fragment must be 512, 1024, 2048 or 4096");
+    }
+    mbedtls_ssl_conf_max_frag_len(&t->conf, code);
+  }
+  lua_pop(L, 1);
+}
+
+// Drop the connection's SSL context, keeping the config for the next one
+static void net_tls_reset (lnet_userdata *ud) {
+  lnet_tls *t = ud->client.tls;
+  if (!t || !t->active)
+    return;
+  mbedtls_ssl_free(&t->ssl);
+  mbedtls_ssl_init(&t->ssl);
+  t->active = t->handshaken = false;
+  t->in_len = 0;
+}
+
+static void net_tls_free (lnet_userdata *ud) {
+  lnet_tls *t = ud->client.tls;
+  if (!t)
+    return;
+  mbedtls_ssl_free(&t->ssl);
+  mbedtls_ssl_config_free(&t->conf);
+  mbedtls_x509_crt_free(&t->ca);
+  free(t);
+  ud->client.tls = NULL;
+}
+
+// Give up on the connection; lerr_cb reports it like any other abort
+static void net_tls_fail (lnet_userdata *ud, int rc) {
+  NODE_ERR("net: TLS error -0x%04x\n", -rc);
+  if (ud->pcb && !ud->client.tls->handshaken)
+    tls_session_forget(ud->client.host, ud->tcp_pcb->remote_port);
+  net_tls_reset(ud);
+  if (ud->pcb)
+    tcp_abort(ud->tcp_pcb);  // net_err_cb clears ud->pcb
+}
+
+// Decrypted data goes where lrecv_cb sends plain data
+static void net_tls_deliver (lua_State *L, lnet_userdata *ud, char *data, size_t len) {
+  if (ud->client.rx_hook) {
+    ud->client.rx_hook(L, ud->client.rx_hook_arg, data, len);
+  } else if (ud->client.rxbuf) {
+    lnet_rxbuf *b = ud->client.rxbuf;
+    if (lrx_reserve(b, len)) {
+      memcpy(b->data + b->len, data, len);
+      b->len += len;
+    } else {
+      NODE_ERR("net: receive buffer full, dropping %d bytes\n", (int)len);
+    }
+    lrx_deliver(L, ud, false);
+  } else if (ud->client.cb_receive_ref != LUA_NOREF) {
+    cbref_get(L, &net_cbs, ud->client.cb_receive_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+    net_push_data(L, ud, data, len);
+    lua_call(L, 2, 0);
+  }
+}
+
+// Run the handshake, then decrypt, as far as the ciphertext fed in goes
+static void net_tls_pump (lua_State *L, lnet_userdata *ud) {
+  lnet_tls *t = ud->client.tls;
+  int rc = 0;
+  if (!t->handshaken) {
+    rc = mbedtls_ssl_handshake(&t->ssl);
+    if (rc == MBEDTLS_ERR_SSL_WANT_READ || rc == MBEDTLS_ERR_SSL_WANT_WRITE)
+      return;
+    if (rc != 0) {
+      net_tls_fail(ud, rc);
+      return;
+    }
+    t->handshaken = true;
+    tls_session_save(&t->ssl, ud->client.host, ud->tcp_pcb->remote_port);
+    lconnected_cb(L, ud);
+  }
+  while (t->active &&
+         (rc = mbedtls_ssl_read(&t->ssl, (unsigned char *)net_tls_plain, NET_TLS_CHUNK)) > 0)
+    net_tls_deliver(L, ud, net_tls_plain, rc);
+  if (t->active && rc < 0 && rc != MBEDTLS_ERR_SSL_WANT_READ &&
+      rc != MBEDTLS_ERR_SSL_WANT_WRITE && rc != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
+    net_tls_fail(ud, rc);
+}
+
+// TCP is up: say hello
+static void net_tls_start (lua_State *L, lnet_userdata *ud) {
+  lnet_tls *t = ud->client.tls;
+  net_tls_reset(ud);
+  int rc = mbedtls_ssl_setup(&t->ssl, &t->conf);
+  if (rc == 0)
+    rc = mbedtls_ssl_set_hostname(&t->ssl, ud->client.host);
+  if (rc != 0) {
+    mbedtls_ssl_free(&t->ssl);
+    mbedtls_ssl_init(&t->ssl);
+    net_tls_fail(ud, rc);
+    return;
+  }
+  t->active = true;
+  mbedtls_ssl_set_bio(&t->ssl, ud, net_tls_bio_send, net_tls_bio_recv, NULL);
+  tls_session_load(&t->ssl, ud->client.host, ud->tcp_pcb->remote_port);
+  net_tls_pump(L, ud);
+}
+
+// Ciphertext for a secure socket, from lrecv_cb
+static void net_tls_input (lua_State *L, lnet_userdata *ud, const char *data, size_t len) {
+  lnet_tls *t = ud->client.tls;
+  if (!t->active)
+    return;
+  t->in = data;
+  t->in_len = len;
+  net_tls_pump(L, ud);
+  t->in_len = 0;
+}
+
+// Encrypt and queue, as net_tcp_send_copy does plain data
+static void net_tls_write (lua_State *L, lnet_userdata *ud, const char *data, size_t len) {
+  lnet_tls *t = ud->client.tls;
+  if (!t->handshaken)
+    luaL_error(L, "handshake not done");
+  while (len) {
+    int n = mbedtls_ssl_write(&t->ssl, (const unsigned char *)data, len);
+    if (n < 0) {
+      net_tls_fail(ud, n);
+      luaL_error(L, "TLS write failed");
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+// --- Lua API - create
 
 // Lua: net.createUDPSocket()
 int net_createUDPSocket( lua_State *L ) {
@@ -359,39 +1620,79 @@ int net_createUDPSocket( lua_State *L ) {
   return 1;
 }
 
-// Lua: net.createServer(type, timeout)
+// Lua: net.createServer(type[, timeout | options])
+// timeout is how many seconds a client may go without sending or having
+// its data acked before it is dropped, which its callbacks see as an error
+// of ERR_TIMEOUT; by default it may idle for ever. options is a table:
+//   timeout = s
+//   maxclients = n    connections at a time, those not yet taken
+//                     included; more are refused
+//   backlog = n       connections waiting, for the handshake or for the
+//                     Lua task to take them, 8 by default; more are refused
+// Connections that come in together are taken on one event.
 int net_createServer( lua_State *L ) {
-  int type, timeout;
+  int type, timeout = 0, maxclients = 0, backlog = NET_SERVER_BACKLOG;
 
   type = luaL_optlong(L, 1, TYPE_TCP);
-  timeout = luaL_optlong(L, 2, 30);
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "timeout");
+    timeout = luaL_optint(L, -1, timeout);
+    lua_getfield(L, 2, "maxclients");
+    maxclients = luaL_optint(L, -1, maxclients);
+    lua_getfield(L, 2, "backlog");
+    backlog = luaL_optint(L, -1, backlog);
+    lua_pop(L, 3);
+  } else {
+    timeout = luaL_optlong(L, 2, timeout);
+  }
 
   if (type == TYPE_UDP) return net_createUDPSocket( L );
   if (type != TYPE_TCP) return luaL_error(L, "invalid type");
-
-  net_create(L, TYPE_TCP_SERVER);
-  // TODO: timeout
-  (void)timeout;
+  luaL_argcheck(L, timeout >= 0 && timeout <= 0xffff, 2, "timeout out of range");
+  luaL_argcheck(L, maxclients >= 0 && maxclients <= 0xffff, 2, "maxclients out of range");
+  luaL_argcheck(L, backlog >= 1 && backlog <= 255, 2, "backlog out of range");
+
+  lnet_userdata *ud = net_create(L, TYPE_TCP_SERVER);
+  ud->server.timeout = timeout;
+  ud->server.max_clients = maxclients;
+  lnet_acceptq *q = (lnet_acceptq *)malloc(sizeof(lnet_acceptq) + backlog * sizeof(lnet_pending));
+  if (!q)
+    return luaL_error(L, "out of memory");
+  q->head = q->tail = 0;
+  q->posted = 0;
+  q->cap = backlog;
+  ud->server.acceptq = q;
   return 1;
 }
 
-// Lua: net.createConnection(type, secure)
+// Lua: net.createConnection(type[, secure])
+// secure is true (or 1) for TLS with the defaults, or a table:
+//   secure = true
+//   ca = pem          verify the server against this CA; without one the
+//                     certificate isn't checked
+//   fragment = n      ask the server for records of at most n bytes: 512,
+//                     1024, 2048 or 4096
 int net_createConnection( lua_State *L ) {
-  int type, secure;
+  int type, opts = 0;
+  bool secure;
 
   type = luaL_optlong(L, 1, TYPE_TCP);
-  secure = luaL_optlong(L, 2, 0);
+  if (lua_istable(L, 2)) {
+    opts = 2;
+    lua_getfield(L, 2, "secure");
+    secure = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  } else if (lua_isnumber(L, 2)) {
+    secure = lua_tointeger(L, 2) != 0;
+  } else {
+    secure = lua_toboolean(L, 2);
+  }
 
   if (type == TYPE_UDP) return net_createUDPSocket( L );
   if (type != TYPE_TCP) return luaL_error(L, "invalid type");
-  if (secure) {
-#ifdef CLIENT_SSL_ENABLE
-    return tls_socket_create( L );
-#else
-    return luaL_error(L, "secure connections not enabled");
-#endif
-  }
-  net_create(L, TYPE_TCP_CLIENT);
+  lnet_userdata *ud = net_create(L, TYPE_TCP_CLIENT);
+  if (secure)
+    net_tls_new(L, ud, opts);
   return 1;
 }
 
@@ -413,6 +1714,16 @@ lnet_userdata *net_get_udata_s( lua_State *L, int stack ) {
 }
 #define net_get_udata(L) net_get_udata_s(L, 1)
 
+void *net_tcp_check( lua_State *L, int idx ) {
+  return luaL_checkudata(L, idx, NET_TABLE_TCP_CLIENT);
+}
+
+void net_tcp_set_rx_hook( void *sock, net_rx_hook_fn fn, void *arg ) {
+  lnet_userdata *ud = (lnet_userdata *)sock;
+  ud->client.rx_hook = fn;
+  ud->client.rx_hook_arg = arg;
+}
+
 // --- Lua API
 
 // Lua: server:listen(port, addr, function(c)), socket:listen(port, addr)
@@ -437,8 +1748,8 @@ int net_listen( lua_State *L ) {
   if (ud->type == TYPE_TCP_SERVER) {
     if (lua_isfunction(L, stack) || lua_islightfunction(L, stack)) {
       lua_pushvalue(L, stack++);
-      luaL_unref(L, LUA_REGISTRYINDEX, ud->server.cb_accept_ref);
-      ud->server.cb_accept_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      cbref_unref(L, &net_cbs, ud->server.cb_accept_ref);
+      ud->server.cb_accept_ref = cbref_ref(L, &net_cbs);
     } else {
       return luaL_error(L, "need callback");
     }
@@ -452,7 +1763,7 @@ int net_listen( lua_State *L ) {
       err = tcp_bind(ud->tcp_pcb, &addr, port);
       if (err == ERR_OK) {
         tcp_arg(ud->tcp_pcb, ud);
-        struct tcp_pcb *pcb = tcp_listen(ud->tcp_pcb);
+        struct tcp_pcb *pcb = tcp_listen_with_backlog(ud->tcp_pcb, ud->server.acceptq->cap);
         if (!pcb) {
           err = ERR_MEM;
         } else {
@@ -506,9 +1817,12 @@ int net_connect( lua_State *L ) {
     size_t dl = 0;
     domain = luaL_checklstring(L, 3, &dl);
   }
+  free(ud->client.host);
+  ud->client.host = strdup(domain);
   ud->tcp_pcb = tcp_new();
   if (!ud->tcp_pcb)
     return luaL_error(L, "cannot allocate PCB");
+  net_apply_opts(ud);
   tcp_arg(ud->tcp_pcb, ud);
   tcp_err(ud->tcp_pcb, net_err_cb);
   tcp_recv(ud->tcp_pcb, net_tcp_recv_cb);
@@ -522,14 +1836,13 @@ int net_connect( lua_State *L ) {
     lua_pushvalue(L, 1);
     ud->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
   }
-  err_t err = dns_gethostbyname(domain, &addr, net_dns_cb, ud);
+  err_t err = net_gethostbyname(domain, &addr, net_dns_cb, ud);
   if (err == ERR_OK) {
     net_dns_cb(domain, &addr, ud);
   } else if (err != ERR_INPROGRESS) {
     ud->client.wait_dns --;
     if (unref) {
-      luaL_unref(L, LUA_REGISTRYINDEX, ud->self_ref);
-      ud->self_ref = LUA_NOREF;
+      net_unref_self(L, ud);
     }
     tcp_abort(ud->tcp_pcb);
     ud->tcp_pcb = NULL;
@@ -538,7 +1851,21 @@ int net_connect( lua_State *L ) {
   return 0;
 }
 
-// Lua: client/socket:on(name, callback)
+// Lua: client/socket:on(name, callback[, options])
+// options for "receive":
+//   zerocopy = true   build the Lua string straight from the lwIP pbuf
+//                     instead of copying it into the event first
+//   buffer = true     get the data in a buffer, which can be sliced and
+//                     passed on to send, file or mqtt without a string
+//                     being made of it
+//   min = n           (TCP) buffer in C until at least n bytes are available
+//   max = n           (TCP) deliver at most n bytes per callback
+//   timeout_ms = t    (TCP) deliver whatever is buffered after t ms
+// and for any callback:
+//   prio = p          node.PRIO_* every event of the socket is queued at,
+//                     instead of receive high and the rest medium
+// Data still buffered when the connection drops is delivered before the
+// "disconnection" callback runs.
 int net_on( lua_State *L ) {
   lnet_userdata *ud = net_get_udata(L);
   if (!ud || ud->type == TYPE_TCP_SERVER)
@@ -554,6 +1881,8 @@ int net_on( lua_State *L ) {
         { refptr = &ud->client.cb_disconnect_ref; break; }
       if (strcmp("reconnection",name)==0)
         { refptr = &ud->client.cb_reconnect_ref; break; }
+      if (strcmp("drain",name)==0)
+        { refptr = &ud->client.cb_drain_ref; break; }
     case TYPE_UDP_SOCKET:
       if (strcmp("dns",name)==0)
         { refptr = &ud->client.cb_dns_ref; break; }
@@ -564,22 +1893,124 @@ int net_on( lua_State *L ) {
       break;
     default: return luaL_error(L, "invalid user data");
   }
-  if (refptr == NULL)
-    return luaL_error(L, "invalid callback name");
-  if (lua_isfunction(L, 3) || lua_islightfunction(L, 3)) {
-    lua_pushvalue(L, 3);
-    luaL_unref(L, LUA_REGISTRYINDEX, *refptr);
-    *refptr = luaL_ref(L, LUA_REGISTRYINDEX);
-  } else if (lua_isnil(L, 3)) {
-    luaL_unref(L, LUA_REGISTRYINDEX, *refptr);
-    *refptr = LUA_NOREF;
-  } else {
-    return luaL_error(L, "invalid callback function");
+  if (refptr == NULL)
+    return luaL_error(L, "invalid callback name");
+  if (lua_istable(L, 4)) {
+    lua_getfield(L, 4, "prio");
+    if (!lua_isnil(L, -1))
+      ud->client.evprio = mod_optprio(L, -1, TASK_PRIORITY_MEDIUM);
+    lua_pop(L, 1);
+  }
+  if (refptr == &ud->client.cb_receive_ref && lua_istable(L, 4)) {
+    lua_getfield(L, 4, "zerocopy");
+    ud->client.rx_zerocopy = lua_toboolean(L, -1);
+    lua_getfield(L, 4, "buffer");
+    ud->client.rx_buffer = lua_toboolean(L, -1);
+    lua_getfield(L, 4, "min");
+    int rx_min = luaL_optint(L, -1, 0);
+    lua_getfield(L, 4, "max");
+    int rx_max = luaL_optint(L, -1, 0);
+    lua_getfield(L, 4, "timeout_ms");
+    int rx_timeout = luaL_optint(L, -1, 0);
+    lua_getfield(L, 4, "batch");
+    int rx_batch = luaL_optint(L, -1, 0);
+    lua_pop(L, 6);
+    if (rx_batch < 0 || rx_batch > UINT16_MAX)
+      return luaL_error(L, "invalid batch size");
+    if (rx_batch && ud->type != TYPE_UDP_SOCKET)
+      return luaL_error(L, "batch needs a UDP socket");
+    ud->client.rx_batch = rx_batch;
+    if (rx_min < 0 || rx_max < 0 || rx_timeout < 0 ||
+        (rx_max && rx_min > rx_max))
+      return luaL_error(L, "invalid receive watermarks");
+    if (rx_min || rx_max || rx_timeout) {
+      if (ud->type != TYPE_TCP_CLIENT)
+        return luaL_error(L, "receive watermarks need a TCP socket");
+      lnet_rxbuf *b = net_rxbuf_get(ud);
+      if (!b)
+        return luaL_error(L, "out of memory");
+      b->min = rx_min;
+      b->max = rx_max;
+      b->timeout_ms = rx_timeout;
+    } else if (ud->client.rxbuf && !ud->client.rx_waiter) {
+      net_rxbuf_free (ud);
+    }
+  }
+  if (lua_isfunction(L, 3) || lua_islightfunction(L, 3)) {
+    lua_pushvalue(L, 3);
+    cbref_unref(L, &net_cbs, *refptr);
+    *refptr = cbref_ref(L, &net_cbs);
+  } else if (lua_isnil(L, 3)) {
+    cbref_unref(L, &net_cbs, *refptr);
+    *refptr = LUA_NOREF;
+  } else {
+    return luaL_error(L, "invalid callback function");
+  }
+  return 0;
+}
+
+// Lua: data = client:receive()
+// In a sched task, the next data to arrive, or what is already buffered;
+// nil once the connection is closed. Watermarks and buffer set with on("receive")
+// apply, and a "receive" callback only gets what no task is waiting for.
+int net_receive( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud || ud->type != TYPE_TCP_CLIENT)
+    return luaL_error(L, "invalid user data");
+  if (!sched_can_wait(L))
+    return luaL_error(L, "receive needs a sched task");
+  if (ud->client.rx_waiter)
+    return luaL_error(L, "already receiving");
+  lnet_rxbuf *b = net_rxbuf_get(ud);
+  if (!b)
+    return luaL_error(L, "out of memory");
+  if (b->len && b->len >= b->min) {
+    net_rxbuf_push(L, ud, b);
+    return 1;
+  }
+  if (ud->self_ref == LUA_NOREF) {
+    if (b->len) {
+      net_rxbuf_push(L, ud, b);
+      return 1;
+    }
+    lua_pushnil(L);
+    return 1;
+  }
+  return sched_wait(L, &ud->client.rx_waiter);
+}
+
+// Bind an unbound UDP socket to an ephemeral port so it can send
+static void net_udp_ensure_pcb( lua_State *L, lnet_userdata *ud ) {
+  if (ud->pcb)
+    return;
+  ud->udp_pcb = udp_new();
+  if (!ud->udp_pcb)
+    luaL_error(L, "cannot allocate PCB");
+  udp_recv(ud->udp_pcb, net_udp_recv_cb, ud);
+  ip_addr_t laddr = IPADDR_ANY_TYPE_INIT;
+  err_t err = udp_bind(ud->udp_pcb, &laddr, 0);
+  if (err != ERR_OK) {
+    udp_remove(ud->udp_pcb);
+    ud->udp_pcb = NULL;
+    lwip_lua_checkerr(L, err);
+  }
+  if (ud->self_ref == LUA_NOREF) {
+    lua_pushvalue(L, 1);
+    ud->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
   }
-  return 0;
 }
 
-// Lua: client:send(data, function(c)), socket:send(port, ip, data, function(s))
+static void net_tcp_send_copy (lua_State *L, lnet_userdata *ud, const char *data, size_t datalen) {
+  err_t err = net_tcp_send_raw(ud, data, datalen);
+  if (err == ERR_MEM)
+    luaL_error(L, "send queue full");
+  lwip_lua_checkerr(L, err);
+}
+
+// Lua: client:send(data[, function(c)][, options]), socket:send(port, ip, data, function(s))
+// options for TCP:
+//   copy = false      don't copy data into lwIP; the string is kept referenced
+//                     until the peer has acked it
 int net_send( lua_State *L ) {
   lnet_userdata *ud = net_get_udata(L);
   if (!ud || ud->type == TYPE_TCP_SERVER)
@@ -597,30 +2028,22 @@ int net_send( lua_State *L ) {
     if (!domain) return luaL_error(L, "need IP address");
     if (!ipaddr_aton(domain, &addr)) return luaL_error(L, "invalid IP address");
   }
-  data = luaL_checklstring(L, stack++, &datalen);
+  int data_idx = stack;
+  data = buffer_checklstring(L, stack++, &datalen);
   if (!data || datalen == 0) return luaL_error(L, "no data to send");
   if (lua_isfunction(L, stack) || lua_islightfunction(L, stack)) {
     lua_pushvalue(L, stack++);
-    luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_sent_ref);
-    ud->client.cb_sent_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-  }
-  if (ud->type == TYPE_UDP_SOCKET && !ud->pcb) {
-    ud->udp_pcb = udp_new();
-    if (!ud->udp_pcb)
-      return luaL_error(L, "cannot allocate PCB");
-    udp_recv(ud->udp_pcb, net_udp_recv_cb, ud);
-    ip_addr_t laddr = IPADDR_ANY_TYPE_INIT;
-    err_t err = udp_bind(ud->udp_pcb, &laddr, 0);
-    if (err != ERR_OK) {
-      udp_remove(ud->udp_pcb);
-      ud->udp_pcb = NULL;
-      return lwip_lua_checkerr(L, err);
-    }
-    if (ud->self_ref == LUA_NOREF) {
-      lua_pushvalue(L, 1);
-      ud->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    }
+    cbref_unref(L, &net_cbs, ud->client.cb_sent_ref);
+    ud->client.cb_sent_ref = cbref_ref(L, &net_cbs);
+  }
+  bool copy = true;
+  if (lua_istable(L, stack)) {
+    lua_getfield(L, stack, "copy");
+    copy = lua_isnil(L, -1) || lua_toboolean(L, -1);
+    lua_pop(L, 1);
   }
+  if (ud->type == TYPE_UDP_SOCKET)
+    net_udp_ensure_pcb(L, ud);
   if (!ud->pcb || ud->self_ref == LUA_NOREF)
     return luaL_error(L, "not connected");
   err_t err;
@@ -631,13 +2054,30 @@ int net_send( lua_State *L ) {
     pbuf_take(pb, data, datalen);
     err = udp_sendto(ud->udp_pcb, pb, &addr, port);
     pbuf_free(pb);
+    if (err == ERR_OK)
+      net_count_tx (ud, datalen);
     if (ud->client.cb_sent_ref != LUA_NOREF) {
-      lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_sent_ref);
+      cbref_get(L, &net_cbs, ud->client.cb_sent_ref);
       lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
       lua_call(L, 1, 0);
     }
+  } else if (ud->type == TYPE_TCP_CLIENT && ud->client.tls) {
+    net_tls_write(L, ud, data, datalen);
+    return 0;
+  } else if (ud->type == TYPE_TCP_CLIENT && !copy) {
+    // Queue a reference to the string itself; net_sendq_flush writes it
+    // in place and lsent_cb drops the reference once it has been acked
+    lnet_sendbuf *c = net_sendq_new(ud, SQ_PINNED, datalen, 0);
+    if (!c)
+      return luaL_error(L, "out of memory");
+    lua_pushvalue(L, data_idx);
+    c->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    c->ptr = data;
+    ud->client.tx_nocopy = 1;
+    err = net_sendq_flush(ud);
   } else if (ud->type == TYPE_TCP_CLIENT) {
-    err = tcp_write(ud->tcp_pcb, data, datalen, TCP_WRITE_FLAG_COPY);
+    net_tcp_send_copy(L, ud, data, datalen);
+    return 0;
   }
   else {
     err = ERR_VAL;
@@ -645,6 +2085,427 @@ int net_send( lua_State *L ) {
   return lwip_lua_checkerr(L, err);
 }
 
+void net_tcp_write( lua_State *L, void *sock, const char *data, size_t len ) {
+  lnet_userdata *ud = (lnet_userdata *)sock;
+  if (!ud->pcb || ud->self_ref == LUA_NOREF)
+    luaL_error(L, "not connected");
+  if (ud->client.tls)
+    net_tls_write(L, ud, data, len);
+  else
+    net_tcp_send_copy(L, ud, data, len);
+}
+
+bool net_tcp_connected( void *sock ) {
+  lnet_userdata *ud = (lnet_userdata *)sock;
+  return ud->pcb && ud->self_ref != LUA_NOREF;
+}
+
+// Lua: client:sendfile(path[, offset[, len]][, function(c)])
+// Streams the file from the file system as lwIP has room for it. Each block
+// is read once into a buffer that lwIP sends from directly. A path under
+// ASSET_STORE_PREFIX is sent straight from the mapped asset partition.
+// Not for secure sockets, where everything goes through the cipher.
+int net_sendfile( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud || ud->type != TYPE_TCP_CLIENT)
+    return luaL_error(L, "invalid user data");
+  if (ud->client.tls)
+    return luaL_error(L, "not on secure sockets");
+  const char *path = luaL_checkstring(L, 2);
+  int stack = 3;
+  int32_t offset = 0, len = -1;
+  if (lua_isnumber(L, stack))
+    offset = lua_tointeger(L, stack++);
+  if (lua_isnumber(L, stack))
+    len = lua_tointeger(L, stack++);
+  if (lua_isfunction(L, stack) || lua_islightfunction(L, stack)) {
+    lua_pushvalue(L, stack);
+    cbref_unref(L, &net_cbs, ud->client.cb_sent_ref);
+    ud->client.cb_sent_ref = cbref_ref(L, &net_cbs);
+  }
+  if (!ud->pcb || ud->self_ref == LUA_NOREF)
+    return luaL_error(L, "not connected");
+  if (offset < 0)
+    return luaL_error(L, "invalid offset");
+
+  uint32_t asize;
+  const char *asset = (const char *)asset_store_path(path, &asize);
+  if (asset) {
+    if ((uint32_t)offset > asize)
+      return luaL_error(L, "invalid offset");
+    if (len < 0 || (uint32_t)len > asize - offset)
+      len = asize - offset;
+    if (len == 0)
+      return 0;
+    lnet_sendbuf *c = net_sendq_new(ud, SQ_PINNED, len, 0);
+    if (!c)
+      return luaL_error(L, "out of memory");
+    c->ptr = asset + offset;
+    ud->client.tx_nocopy = 1;
+    return lwip_lua_checkerr(L, net_sendq_flush(ud));
+  }
+
+  int fd = vfs_open(path, "r");
+  if (!fd)
+    return luaL_error(L, "cannot open %s", path);
+  int32_t size = vfs_lseek(fd, 0, VFS_SEEK_END);
+  if (size < 0 || offset > size || vfs_lseek(fd, offset, VFS_SEEK_SET) < 0) {
+    vfs_close(fd);
+    return luaL_error(L, "invalid offset");
+  }
+  if (len < 0 || len > size - offset)
+    len = size - offset;
+  if (len == 0) {
+    vfs_close(fd);
+    return 0;
+  }
+  lnet_sendbuf *c = net_sendq_new(ud, SQ_FILE, len, 0);
+  if (!c) {
+    vfs_close(fd);
+    return luaL_error(L, "out of memory");
+  }
+  c->fd = fd;
+  ud->client.tx_nocopy = 1;
+  return lwip_lua_checkerr(L, net_sendq_flush(ud));
+}
+
+// Lua: sent[, err] = socket:sendmany({ {port, ip, data}, ... }[, function(s)])
+// Sends every datagram in one call and runs the sent callback once at the
+// end. Stops at the first datagram lwIP refuses and returns how many went
+// out before it along with the lwIP error code.
+int net_sendmany( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud || ud->type != TYPE_UDP_SOCKET)
+    return luaL_error(L, "invalid user data");
+  luaL_checktype(L, 2, LUA_TTABLE);
+  if (lua_isfunction(L, 3) || lua_islightfunction(L, 3)) {
+    lua_pushvalue(L, 3);
+    cbref_unref(L, &net_cbs, ud->client.cb_sent_ref);
+    ud->client.cb_sent_ref = cbref_ref(L, &net_cbs);
+  }
+  net_udp_ensure_pcb(L, ud);
+  if (!ud->pcb || ud->self_ref == LUA_NOREF)
+    return luaL_error(L, "not connected");
+
+  int n = lua_objlen(L, 2), sent = 0;
+  char last_ip[IP_STR_SZ] = "";
+  ip_addr_t addr;
+  err_t err = ERR_OK;
+  for (int i = 1; i <= n && err == ERR_OK; i++) {
+    lua_rawgeti(L, 2, i);
+    if (!lua_istable(L, -1))
+      return luaL_error(L, "datagram %d is not a table", i);
+    lua_rawgeti(L, -1, 1);
+    lua_rawgeti(L, -2, 2);
+    lua_rawgeti(L, -3, 3);
+    int port = lua_tointeger(L, -3);
+    const char *ip = lua_tostring(L, -2);
+    size_t datalen = 0;
+    const char *data = buffer_tolstring(L, -1, &datalen);
+    if (port <= 0 || port > 0xffff || !ip || !data)
+      return luaL_error(L, "datagram %d needs {port, ip, data}", i);
+    // Batches usually go to one peer, so only parse the address on change
+    if (strcmp(ip, last_ip) != 0) {
+      if (!ipaddr_aton(ip, &addr))
+        return luaL_error(L, "invalid IP address in datagram %d", i);
+      strncpy(last_ip, ip, sizeof(last_ip) - 1);
+    }
+    struct pbuf *pb = pbuf_alloc(PBUF_TRANSPORT, datalen, PBUF_RAM);
+    if (pb) {
+      pbuf_take(pb, data, datalen);
+      err = udp_sendto(ud->udp_pcb, pb, &addr, port);
+      pbuf_free(pb);
+    } else {
+      err = ERR_MEM;
+    }
+    if (err == ERR_OK) {
+      sent++;
+      net_count_tx (ud, datalen);
+    }
+    lua_pop(L, 4);
+  }
+  if (sent && ud->client.cb_sent_ref != LUA_NOREF) {
+    cbref_get(L, &net_cbs, ud->client.cb_sent_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+    lua_call(L, 1, 0);
+  }
+  lua_pushinteger(L, sent);
+  if (err == ERR_OK)
+    return 1;
+  lua_pushinteger(L, err);
+  return 2;
+}
+
+// Lua: bytes = client:queued()
+int net_queued( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud || ud->type != TYPE_TCP_CLIENT)
+    return luaL_error(L, "invalid user data");
+  lua_pushinteger(L, ud->client.sq_bytes);
+  return 1;
+}
+
+// Lua: client:setopt({nodelay=b, keepalive=b|{idle=s, intvl=s, cnt=n},
+//                     sndbuf=bytes, prio=n})
+// nodelay turns off Nagle's algorithm, so small writes go out at once
+// instead of waiting for the previous segment's ack. keepalive probes an
+// idle connection, after idle seconds (lwIP's default when only true is
+// given) and then every intvl seconds, giving up after cnt probes.
+// sndbuf caps what send() queues beyond lwIP's own send buffer, whose
+// size is fixed when the firmware is built; 0 lifts the cap. prio is
+// lwIP's priority for the connection, 1 to 127, used when it has to drop
+// one to make room for another. Options left out keep their value and
+// hold for later connects too.
+int net_setopt( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud || ud->type != TYPE_TCP_CLIENT)
+    return luaL_error(L, "invalid user data");
+  luaL_checktype(L, 2, LUA_TTABLE);
+
+  lua_getfield(L, 2, "nodelay");
+  if (!lua_isnil(L, -1))
+    ud->client.nodelay = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, 2, "keepalive");
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, "idle");
+    lua_getfield(L, -2, "intvl");
+    lua_getfield(L, -3, "cnt");
+    int idle = luaL_optinteger(L, -3, NET_KEEPIDLE_S);
+    int intvl = luaL_optinteger(L, -2, 0);
+    int cnt = luaL_optinteger(L, -1, 0);
+    if (idle < 1 || idle > 0xffff || intvl < 0 || intvl > 0xffff ||
+        cnt < 0 || cnt > 0xff)
+      return luaL_error(L, "keepalive out of range");
+    ud->client.keep_idle = idle;
+    ud->client.keep_intvl = intvl;
+    ud->client.keep_cnt = cnt;
+    lua_pop(L, 3);
+  } else if (!lua_isnil(L, -1)) {
+    ud->client.keep_idle = lua_toboolean(L, -1) ? NET_KEEPIDLE_S : 0;
+    ud->client.keep_intvl = 0;
+    ud->client.keep_cnt = 0;
+  }
+  lua_pop(L, 1);
+
+  lua_getfield(L, 2, "sndbuf");
+  if (!lua_isnil(L, -1)) {
+    int n = luaL_checkinteger(L, -1);
+    luaL_argcheck(L, n >= 0, 2, "sndbuf out of range");
+    ud->client.sq_max = n;
+  }
+  lua_pop(L, 1);
+
+  lua_getfield(L, 2, "prio");
+  if (!lua_isnil(L, -1)) {
+    int prio = luaL_checkinteger(L, -1);
+    luaL_argcheck(L, prio >= 1 && prio <= TCP_PRIO_MAX, 2, "prio out of range");
+    ud->client.prio = prio;
+  }
+  lua_pop(L, 1);
+
+  net_apply_opts(ud);
+  return 0;
+}
+
+// Lua: bytes = client:flush()
+// Writes what lwIP's send buffer takes from the send queue and has it go
+// out now rather than with the next ack or timer; returns what is still
+// queued.
+int net_flush( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud || ud->type != TYPE_TCP_CLIENT)
+    return luaL_error(L, "invalid user data");
+  if (!ud->pcb || ud->self_ref == LUA_NOREF)
+    return luaL_error(L, "not connected");
+  err_t err = net_sendq_flush(ud);
+  if (err == ERR_OK)
+    err = tcp_output(ud->tcp_pcb);
+  if (err != ERR_OK)
+    return lwip_lua_checkerr(L, err);
+  lua_pushinteger(L, ud->client.sq_bytes);
+  return 1;
+}
+
+// Pushes a table of the counters, then zeroes them if reset
+static void net_push_stats (lua_State *L, lnet_stats *st, bool reset) {
+  uint32_t now = system_get_time();
+  lua_createtable(L, 0, 8);
+  lua_pushinteger(L, now - st->since);
+  lua_setfield(L, -2, "us");
+  lua_pushinteger(L, st->rx_bytes);
+  lua_setfield(L, -2, "rx_bytes");
+  lua_pushinteger(L, st->tx_bytes);
+  lua_setfield(L, -2, "tx_bytes");
+  lua_pushinteger(L, st->rx_dropped);
+  lua_setfield(L, -2, "rx_dropped");
+  lua_pushinteger(L, st->events);
+  lua_setfield(L, -2, "events");
+  lua_pushinteger(L, st->cb_us);
+  lua_setfield(L, -2, "cb_us");
+  lua_pushinteger(L, st->cb_max_us);
+  lua_setfield(L, -2, "cb_max_us");
+  if (reset) {
+    memset(st, 0, sizeof(*st));
+    st->since = now;
+  }
+}
+
+// Lua: stats = socket:stats([reset])
+// Counters of this socket since it was created or last reset, { us=,
+// rx_bytes=, tx_bytes=, rx_dropped=, events=, cb_us=, cb_max_us= }, and
+// for TCP sendq=, the bytes not yet handed to lwIP. A server has clients=,
+// connected now, and counts rejected= and reaped= (for being idle) instead.
+int net_sockstats( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud)
+    return luaL_error(L, "invalid user data");
+  bool reset = lua_toboolean(L, 2);
+  net_push_stats(L, &ud->stats, reset);
+  if (ud->type == TYPE_TCP_CLIENT) {
+    lua_pushinteger(L, ud->client.sq_bytes);
+    lua_setfield(L, -2, "sendq");
+  } else if (ud->type == TYPE_TCP_SERVER) {
+    lua_pushinteger(L, ud->server.clients);
+    lua_setfield(L, -2, "clients");
+    lua_pushinteger(L, ud->server.rejected);
+    lua_setfield(L, -2, "rejected");
+    lua_pushinteger(L, ud->server.reaped);
+    lua_setfield(L, -2, "reaped");
+    if (reset)
+      ud->server.rejected = ud->server.reaped = 0;
+  }
+  return 1;
+}
+
+int net_close( lua_State *L );
+
+// --- Connection pool
+//
+// Connected sockets handed back with socket:release() wait here, with TCP
+// keepalive on, until net.acquire() asks for the same host and port again.
+
+#if CONFIG_NET_POOL_SIZE > 0
+static lnet_userdata *net_pool[CONFIG_NET_POOL_SIZE];
+
+static void net_pool_remove (lnet_userdata *ud) {
+  for (int i = 0; i < CONFIG_NET_POOL_SIZE; i++)
+    if (net_pool[i] == ud)
+      net_pool[i] = NULL;
+  ud->client.pooled = 0;
+}
+
+static void net_pool_close (lua_State *L, lnet_userdata *ud) {
+  net_pool_remove(ud);
+  lua_pushcfunction(L, net_close);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+  lua_call(L, 1, 0);
+}
+
+static void net_pool_expire (lua_State *L) {
+  TickType_t now = xTaskGetTickCount();
+  for (int i = 0; i < CONFIG_NET_POOL_SIZE; i++) {
+    lnet_userdata *ud = net_pool[i];
+    if (ud && now - ud->client.pooled_at >=
+              CONFIG_NET_POOL_IDLE_S * 1000 / portTICK_PERIOD_MS)
+      net_pool_close(L, ud);
+  }
+}
+#endif
+
+// Lua: socket, reused = net.acquire(host, port)
+// Returns an idle pooled connection to host:port if there is one, otherwise
+// a new socket which starts connecting (its "connection" callback fires
+// as usual).
+int net_acquire( lua_State *L ) {
+  const char *host = luaL_checkstring(L, 1);
+  uint16_t port = luaL_checkinteger(L, 2);
+#if CONFIG_NET_POOL_SIZE > 0
+  net_pool_expire(L);
+  for (int i = 0; i < CONFIG_NET_POOL_SIZE; i++) {
+    lnet_userdata *ud = net_pool[i];
+    if (ud && ud->pcb && ud->tcp_pcb->state == ESTABLISHED &&
+        ud->tcp_pcb->remote_port == port && strcmp(ud->client.host, host) == 0) {
+      net_pool_remove(ud);
+      lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+      lua_pushboolean(L, 1);
+      return 2;
+    }
+  }
+#endif
+  net_create(L, TYPE_TCP_CLIENT);
+  lua_pushcfunction(L, net_connect);
+  lua_pushvalue(L, -2);
+  lua_pushinteger(L, port);
+  lua_pushstring(L, host);
+  lua_call(L, 3, 0);
+  lua_pushboolean(L, 0);
+  return 2;
+}
+
+// Lua: pooled = client:release()
+// Hands a connected, idle socket to the connection pool instead of closing
+// it; its callbacks are cleared. Sockets that can't be pooled are closed.
+int net_release( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud || ud->type != TYPE_TCP_CLIENT)
+    return luaL_error(L, "invalid user data");
+  if (ud->client.pooled) {
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+#if CONFIG_NET_POOL_SIZE > 0
+  if (ud->pcb && ud->self_ref != LUA_NOREF && ud->client.host &&
+      !ud->client.tls && ud->tcp_pcb->state == ESTABLISHED && !ud->client.sq_head &&
+      !ud->client.tx_head && !ud->client.sq_close &&
+      !(ud->client.rxbuf && ud->client.rxbuf->len)) {
+    net_pool_expire(L);
+    // Take a free slot, or make room by closing the longest idle socket
+    int slot = 0;
+    for (int i = 0; i < CONFIG_NET_POOL_SIZE; i++) {
+      if (!net_pool[i]) {
+        slot = i;
+        break;
+      }
+      if ((int32_t)(net_pool[i]->client.pooled_at -
+                    net_pool[slot]->client.pooled_at) < 0)
+        slot = i;
+    }
+    if (net_pool[slot])
+      net_pool_close(L, net_pool[slot]);
+
+    int *refs[] = {
+      &ud->client.cb_receive_ref, &ud->client.cb_sent_ref,
+      &ud->client.cb_drain_ref, &ud->client.cb_connect_ref,
+      &ud->client.cb_disconnect_ref, &ud->client.cb_reconnect_ref
+    };
+    for (int i = 0; i < sizeof(refs) / sizeof(refs[0]); i++) {
+      cbref_unref(L, &net_cbs, *refs[i]);
+      *refs[i] = LUA_NOREF;
+    }
+    net_rx_cancel(L, ud);
+    net_rxbuf_free(ud);
+    ud->client.rx_zerocopy = 0;
+    ud->client.rx_buffer = 0;
+    ud->client.evprio = -1;
+    ud->client.hold = 0;
+
+    ip_set_option(ud->tcp_pcb, SOF_KEEPALIVE);
+    ud->tcp_pcb->keep_idle = CONFIG_NET_POOL_KEEPIDLE_S * 1000;
+    ud->client.pooled = 1;
+    ud->client.pooled_at = xTaskGetTickCount();
+    net_pool[slot] = ud;
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+#endif
+  if (ud->pcb)
+    net_close(L);
+  lua_pushboolean(L, 0);
+  return 1;
+}
+
 // Lua: client:hold()
 int net_hold( lua_State *L ) {
   lnet_userdata *ud = net_get_udata(L);
@@ -673,9 +2534,9 @@ int net_dns( lua_State *L ) {
   if (!domain)
     return luaL_error(L, "no domain specified");
   if (lua_isfunction(L, 3) || lua_islightfunction(L, 3)) {
-    luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_dns_ref);
+    cbref_unref(L, &net_cbs, ud->client.cb_dns_ref);
     lua_pushvalue(L, 3);
-    ud->client.cb_dns_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    ud->client.cb_dns_ref = cbref_ref(L, &net_cbs);
   }
   if (ud->client.cb_dns_ref == LUA_NOREF)
     return luaL_error(L, "no callback specified");
@@ -687,14 +2548,13 @@ int net_dns( lua_State *L ) {
     ud->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
   }
   ip_addr_t addr;
-  err_t err = dns_gethostbyname(domain, &addr, net_dns_cb, ud);
+  err_t err = net_gethostbyname(domain, &addr, net_dns_cb, ud);
   if (err == ERR_OK) {
     net_dns_cb(domain, &addr, ud);
   } else if (err != ERR_INPROGRESS) {
     ud->client.wait_dns --;
     if (unref) {
-      luaL_unref(L, LUA_REGISTRYINDEX, ud->self_ref);
-      ud->self_ref = LUA_NOREF;
+      net_unref_self(L, ud);
     }
     return lwip_lua_checkerr(L, err);
   }
@@ -766,15 +2626,28 @@ int net_close( lua_State *L ) {
   if (ud->pcb) {
     switch (ud->type) {
       case TYPE_TCP_CLIENT:
+#if CONFIG_NET_POOL_SIZE > 0
+        if (ud->client.pooled)
+          net_pool_remove(ud);
+#endif
+        if (ud->client.tls && ud->client.tls->handshaken)
+          mbedtls_ssl_close_notify(&ud->client.tls->ssl);
+        net_tls_reset(ud);
+        if (ud->client.sq_head || ud->client.tx_head) {
+          ud->client.sq_close = 1;  // finish sending first, see lsent_cb
+          return 0;
+        }
         if (ERR_OK != tcp_close(ud->tcp_pcb)) {
           tcp_arg(ud->tcp_pcb, NULL);
           tcp_abort(ud->tcp_pcb);
         }
         ud->tcp_pcb = NULL;
+        net_client_gone(ud);
         break;
       case TYPE_TCP_SERVER:
         tcp_close(ud->tcp_pcb);
         ud->tcp_pcb = NULL;
+        net_accept_flush(ud);
         break;
       case TYPE_UDP_SOCKET:
         udp_remove(ud->udp_pcb);
@@ -786,10 +2659,7 @@ int net_close( lua_State *L ) {
   }
   if (ud->type == TYPE_TCP_SERVER ||
      (ud->pcb == NULL && ud->client.wait_dns == 0)) {
-    lua_gc(L, LUA_GCSTOP, 0);
-    luaL_unref(L, LUA_REGISTRYINDEX, ud->self_ref);
-    ud->self_ref = LUA_NOREF;
-    lua_gc(L, LUA_GCRESTART, 0);
+    net_unref_self(L, ud);
   }
   return 0;
 }
@@ -803,10 +2673,12 @@ int net_delete( lua_State *L ) {
         tcp_arg(ud->tcp_pcb, NULL);
         tcp_abort(ud->tcp_pcb);
         ud->tcp_pcb = NULL;
+        net_client_gone(ud);
         break;
       case TYPE_TCP_SERVER:
         tcp_close(ud->tcp_pcb);
         ud->tcp_pcb = NULL;
+        net_accept_flush(ud);
         break;
       case TYPE_UDP_SOCKET:
         udp_remove(ud->udp_pcb);
@@ -816,23 +2688,36 @@ int net_delete( lua_State *L ) {
   }
   switch (ud->type) {
     case TYPE_TCP_CLIENT:
-      luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_connect_ref);
+      net_rx_cancel(L, ud);
+      net_rxbuf_free(ud);
+      net_sendq_free(L, ud);
+      net_tx_release(L, ud, true);
+      net_tls_free(ud);
+      free(ud->client.host);
+      ud->client.host = NULL;
+      cbref_unref(L, &net_cbs, ud->client.cb_drain_ref);
+      ud->client.cb_drain_ref = LUA_NOREF;
+      cbref_unref(L, &net_cbs, ud->client.cb_connect_ref);
       ud->client.cb_connect_ref = LUA_NOREF;
-      luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_disconnect_ref);
+      cbref_unref(L, &net_cbs, ud->client.cb_disconnect_ref);
       ud->client.cb_disconnect_ref = LUA_NOREF;
-      luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_reconnect_ref);
+      cbref_unref(L, &net_cbs, ud->client.cb_reconnect_ref);
       ud->client.cb_reconnect_ref = LUA_NOREF;
+      luaL_unref(L, LUA_REGISTRYINDEX, ud->client.server_ref);
+      ud->client.server_ref = LUA_NOREF;
     case TYPE_UDP_SOCKET:
-      luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_dns_ref);
+      cbref_unref(L, &net_cbs, ud->client.cb_dns_ref);
       ud->client.cb_dns_ref = LUA_NOREF;
-      luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_receive_ref);
+      cbref_unref(L, &net_cbs, ud->client.cb_receive_ref);
       ud->client.cb_receive_ref = LUA_NOREF;
-      luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_sent_ref);
+      cbref_unref(L, &net_cbs, ud->client.cb_sent_ref);
       ud->client.cb_sent_ref = LUA_NOREF;
       break;
     case TYPE_TCP_SERVER:
-      luaL_unref(L, LUA_REGISTRYINDEX, ud->server.cb_accept_ref);
+      cbref_unref(L, &net_cbs, ud->server.cb_accept_ref);
       ud->server.cb_accept_ref = LUA_NOREF;
+      free(ud->server.acceptq);
+      ud->server.acceptq = NULL;
       break;
   }
   lua_gc(L, LUA_GCSTOP, 0);
@@ -895,10 +2780,11 @@ static int net_multicastLeave( lua_State* L ) {
 static void net_dns_static_cb(const char *name, const ip_addr_t *ipaddr, void *callback_arg) {
   lnet_event *ev = (lnet_event *)callback_arg;
 
+  net_dns_cache_store (name, ipaddr);
   ev->resolved_ip = ipaddr ? *ipaddr : ip_addr_any;
 
   if (!task_post_medium (net_event, (task_param_t)ev))
-    free (ev);
+    net_event_free (ev);
 }
 
 // Lua: net.dns.resolve( domain, function(ip) )
@@ -909,8 +2795,7 @@ static int net_dns_static( lua_State* L ) {
     return luaL_error(L, "wrong domain");
   }
 
-  // Note: this will be free'd using regular free(), so can't luaM_malloc()
-  lnet_event *ev = (lnet_event *)malloc (sizeof (lnet_event));
+  lnet_event *ev = net_event_alloc (0);
   if (!ev)
     return luaL_error (L, "out of memory");
 
@@ -918,9 +2803,9 @@ static int net_dns_static( lua_State* L ) {
 
   luaL_checkanyfunction(L, 2);
   lua_pushvalue(L, 2);  // copy argument (func) to the top of stack
-  ev->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  ev->cb_ref = cbref_ref(L, &net_cbs);
 
-  err_t err = dns_gethostbyname(
+  err_t err = net_gethostbyname(
     domain, &ev->resolved_ip, net_dns_static_cb, ev);
   if (err == ERR_OK) {
     net_dns_static_cb(domain, &ev->resolved_ip, ev);
@@ -929,7 +2814,7 @@ static int net_dns_static( lua_State* L ) {
     return 0;
   } else {
     int e = lwip_lua_checkerr(L, err);
-    free(ev);
+    net_event_free (ev);
     return e;
   }
   return 0;
@@ -976,11 +2861,153 @@ static int net_getdnsserver( lua_State* L ) {
   return 1;
 }
 
+// Lua: stats = net.eventpool()
+static int net_eventpool( lua_State* L ) {
+  lua_createtable(L, 0, 6);
+  lua_pushinteger(L, net_pool_stats.size);
+  lua_setfield(L, -2, "size");
+  lua_pushinteger(L, net_pool_stats.in_use);
+  lua_setfield(L, -2, "in_use");
+  lua_pushinteger(L, net_pool_stats.hwm);
+  lua_setfield(L, -2, "hwm");
+  lua_pushinteger(L, net_pool_stats.pooled);
+  lua_setfield(L, -2, "pooled");
+  lua_pushinteger(L, net_pool_stats.heap);
+  lua_setfield(L, -2, "heap");
+  lua_pushinteger(L, net_pool_stats.exhausted);
+  lua_setfield(L, -2, "exhausted");
+  return 1;
+}
+
+#if LWIP_STATS
+static void net_push_proto (lua_State *L, const char *name, struct stats_proto *p, bool reset) {
+  static const char * const fields[] = {
+    "xmit", "recv", "fw", "drop", "chkerr", "lenerr", "memerr", "rterr",
+    "proterr", "opterr", "err", "cachehit", "rexmit"
+  };
+  // the struct is nothing but STAT_COUNTERs, in the order above
+  STAT_COUNTER *c = (STAT_COUNTER *)p;
+  lua_createtable(L, 0, sizeof(fields) / sizeof(fields[0]));
+  for (int i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    lua_pushinteger(L, c[i]);
+    lua_setfield(L, -2, fields[i]);
+  }
+  lua_setfield(L, -2, name);
+  if (reset)
+    memset(p, 0, sizeof(*p));
+}
+
+#if MEMP_STATS
+static const char * const net_memp_names[] = {
+#define LWIP_MEMPOOL(name,num,size,desc) #name,
+#include "lwip/priv/memp_std.h"
+};
+#endif
+#endif
+
+// Lua: stats = net.stats([reset])
+// Counters of all sockets together as socket:stats() has them, and under
+// lwip= those of the stack: link=, etharp=, ip=, icmp=, udp= and tcp=
+// { xmit=, recv=, drop=, chkerr=, memerr=, ..., rexmit= } and the memory
+// pools by name { used=, max=, err= } in memp=, if built with
+// CONFIG_LWIP_STATS; wifi= { rssi=, channel= } while associated. reset
+// zeroes the counters after reading them, and pool maxima start over from
+// what is in use. lwIP counts from its own task, so a reset may lose an
+// increment or two.
+static int net_stats( lua_State* L ) {
+  bool reset = lua_toboolean(L, 1);
+  net_push_stats(L, &net_totals, reset);
+
+#if LWIP_STATS
+  lua_createtable(L, 0, 7);
+#if LINK_STATS
+  net_push_proto(L, "link", &lwip_stats.link, reset);
+#endif
+#if ETHARP_STATS
+  net_push_proto(L, "etharp", &lwip_stats.etharp, reset);
+#endif
+#if IP_STATS
+  net_push_proto(L, "ip", &lwip_stats.ip, reset);
+#endif
+#if ICMP_STATS
+  net_push_proto(L, "icmp", &lwip_stats.icmp, reset);
+#endif
+#if UDP_STATS
+  net_push_proto(L, "udp", &lwip_stats.udp, reset);
+#endif
+#if TCP_STATS
+  net_push_proto(L, "tcp", &lwip_stats.tcp, reset);
+#endif
+#if MEMP_STATS
+  lua_createtable(L, 0, MEMP_MAX);
+  for (int i = 0; i < MEMP_MAX; i++) {
+    struct stats_mem *m = &lwip_stats.memp[i];
+    lua_createtable(L, 0, 3);
+    lua_pushinteger(L, m->used);
+    lua_setfield(L, -2, "used");
+    lua_pushinteger(L, m->max);
+    lua_setfield(L, -2, "max");
+    lua_pushinteger(L, m->err);
+    lua_setfield(L, -2, "err");
+    lua_setfield(L, -2, net_memp_names[i]);
+    if (reset) {
+      m->max = m->used;
+      m->err = 0;
+    }
+  }
+  lua_setfield(L, -2, "memp");
+#endif
+  lua_setfield(L, -2, "lwip");
+#endif
+
+  wifi_ap_record_t ap;
+  if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+    lua_createtable(L, 0, 2);
+    lua_pushinteger(L, ap.rssi);
+    lua_setfield(L, -2, "rssi");
+    lua_pushinteger(L, ap.primary);
+    lua_setfield(L, -2, "channel");
+    lua_setfield(L, -2, "wifi");
+  }
+  return 1;
+}
+
+// Lua: stats = net.dns.cache([flush])
+// Returns the cache counters; with flush = true the cache is emptied too.
+static int net_dns_cache_info( lua_State* L ) {
+  int entries = 0;
+#if CONFIG_NET_DNS_CACHE_SIZE > 0
+  bool flush = lua_toboolean(L, 1);
+  portENTER_CRITICAL (&net_dns_mux);
+  for (int i = 0; i < CONFIG_NET_DNS_CACHE_SIZE; i++) {
+    if (net_dns_cache[i].name[0])
+      entries++;
+    if (flush)
+      net_dns_cache[i].name[0] = 0;
+  }
+  portEXIT_CRITICAL (&net_dns_mux);
+#endif
+  lua_createtable(L, 0, 6);
+  lua_pushinteger(L, CONFIG_NET_DNS_CACHE_SIZE);
+  lua_setfield(L, -2, "size");
+  lua_pushinteger(L, entries);
+  lua_setfield(L, -2, "entries");
+  lua_pushinteger(L, net_dns_stats.hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushinteger(L, net_dns_stats.negative_hits);
+  lua_setfield(L, -2, "negative_hits");
+  lua_pushinteger(L, net_dns_stats.misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushinteger(L, net_dns_stats.evictions);
+  lua_setfield(L, -2, "evictions");
+  return 1;
+}
+
 // --- Lua event dispatch
 
 static void ldnsfound_cb (lua_State *L, lnet_userdata *ud, ip_addr_t *addr) {
   if (ud->self_ref != LUA_NOREF && ud->client.cb_dns_ref != LUA_NOREF) {
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_dns_ref);
+    cbref_get(L, &net_cbs, ud->client.cb_dns_ref);
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
     if (!ip_addr_isany (addr)) {
       char iptmp[IP_STR_SZ];
@@ -995,10 +3022,7 @@ static void ldnsfound_cb (lua_State *L, lnet_userdata *ud, ip_addr_t *addr) {
   if (ud->pcb && ud->type == TYPE_TCP_CLIENT && ud->tcp_pcb->state == CLOSED) {
     tcp_connect(ud->tcp_pcb, addr, ud->tcp_pcb->remote_port, net_connected_cb);
   } else if (!ud->pcb && ud->client.wait_dns == 0) {
-    lua_gc(L, LUA_GCSTOP, 0);
-    luaL_unref(L, LUA_REGISTRYINDEX, ud->self_ref);
-    ud->self_ref = LUA_NOREF;
-    lua_gc(L, LUA_GCRESTART, 0);
+    net_unref_self(L, ud);
   }
 }
 
@@ -1006,8 +3030,8 @@ static void ldnsstatic_cb (lua_State *L, int cb_ref, ip_addr_t *addr) {
   if (cb_ref == LUA_NOREF)
     return;
 
-  lua_rawgeti(L, LUA_REGISTRYINDEX, cb_ref);
-  luaL_unref (L, LUA_REGISTRYINDEX, cb_ref);
+  cbref_get(L, &net_cbs, cb_ref);
+  cbref_unref(L, &net_cbs, cb_ref);
 
   if (!ip_addr_isany (addr)) {
     char iptmp[IP_STR_SZ];
@@ -1020,36 +3044,216 @@ static void ldnsstatic_cb (lua_State *L, int cb_ref, ip_addr_t *addr) {
 }
 
 static void lconnected_cb (lua_State *L, lnet_userdata *ud) {
+  if (ud->self_ref == LUA_NOREF)
+    return;
+  if (ud->client.tls && !ud->client.tls->handshaken) {
+    if (ud->pcb)
+      net_tls_start(L, ud);  // which comes back here once it's through
+    return;
+  }
   if (ud->self_ref != LUA_NOREF && ud->client.cb_connect_ref != LUA_NOREF) {
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_connect_ref);
+    cbref_get(L, &net_cbs, ud->client.cb_connect_ref);
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
     lua_call(L, 1, 0);
   }
 }
 
-static void laccept_cb (lua_State *L, lnet_userdata *ud, struct tcp_pcb *newpcb) {
-  lua_rawgeti(L, LUA_REGISTRYINDEX, ud->server.cb_accept_ref);
+// Takes all the connections waiting on the server, calling back for each
+static void laccept_cb (lua_State *L, lnet_userdata *ud) {
+  lnet_acceptq *q = ud->server.acceptq;
+  q->posted = 0;
+  if (ud->self_ref == LUA_NOREF || ud->server.cb_accept_ref == LUA_NOREF) {
+    net_accept_flush(ud);
+    return;
+  }
+  // Keep the server while its callbacks run; a callback may close it
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+  while (q->head != q->tail) {
+    lnet_pending *slot = &q->slot[q->head % q->cap];
+    struct tcp_pcb *newpcb = slot->pcb;
+    if (!newpcb) {
+      q->head++;  // went away while it waited
+      continue;
+    }
+    if (ud->server.cb_accept_ref == LUA_NOREF) {
+      net_accept_flush(ud);
+      break;
+    }
+    cbref_get(L, &net_cbs, ud->server.cb_accept_ref);
+    lnet_userdata *nud = net_create(L, TYPE_TCP_CLIENT);
+    lua_pushvalue(L, -1);
+    nud->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, -3);
+    nud->client.server_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    nud->client.server = ud;
+    nud->client.timeout = ud->server.timeout;
+    nud->tcp_pcb = newpcb;
+    tcp_arg(nud->tcp_pcb, nud);
+    tcp_err(nud->tcp_pcb, net_err_cb);
+    tcp_recv(nud->tcp_pcb, net_tcp_recv_cb);
+    tcp_sent(nud->tcp_pcb, net_sent_cb);
+    net_apply_opts(nud);
+    if (nud->client.timeout)
+      tcp_poll(nud->tcp_pcb, net_idle_poll_cb, 2);
+    q->head++;
 
-  lnet_userdata *nud = net_create(L, TYPE_TCP_CLIENT);
-  lua_pushvalue(L, 2);
-  nud->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-  nud->tcp_pcb = newpcb;
-  tcp_arg(nud->tcp_pcb, nud);
-  tcp_err(nud->tcp_pcb, net_err_cb);
-  tcp_recv(nud->tcp_pcb, net_tcp_recv_cb);
-  tcp_sent(nud->tcp_pcb, net_sent_cb);
+    lua_call(L, 1, 0);
+  }
+  lua_pop(L, 1);
+}
 
-  tcp_accepted(ud->tcp_pcb);
+// Hand buffered data to the "receive" callback in chunks of at most max
+// bytes, for as long as at least min bytes are buffered (or at all, when
+// flushing). The socket is kept on the stack so the callbacks can't have
+// it collected from under us.
+static void lrx_deliver (lua_State *L, lnet_userdata *ud, bool flush) {
+  if (ud->self_ref == LUA_NOREF)
+    return;
+  lnet_rxbuf *b = ud->client.rxbuf;
+  if (b && b->len && (flush || b->len >= b->min) && ud->client.rx_waiter) {
+    net_rxbuf_push(L, ud, b);
+    sched_wake(L, &ud->client.rx_waiter, 1);
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+  while ((b = ud->client.rxbuf) && b->len &&
+         (flush || b->len >= b->min) &&
+         ud->client.cb_receive_ref != LUA_NOREF) {
+    cbref_get(L, &net_cbs, ud->client.cb_receive_ref);
+    lua_pushvalue(L, -2);
+    net_rxbuf_push(L, ud, b);
+    lua_call(L, 2, 0);
+  }
+  lua_pop(L, 1);
 
-  lua_call(L, 1, 0);
+  b = ud->client.rxbuf;
+  if (!b)
+    return;
+  if (b->len && b->timeout_ms && !b->armed) {
+    os_timer_arm(&b->timer, b->timeout_ms, 0);
+    b->armed = true;
+  } else if (!b->len && b->armed) {
+    os_timer_disarm(&b->timer);
+    b->armed = false;
+  }
+}
+
+static bool lrx_reserve (lnet_rxbuf *b, uint32_t n) {
+  if (b->len + n > b->cap) {
+    uint32_t cap = b->cap ? b->cap * 2 : 256;
+    while (cap < b->len + n)
+      cap *= 2;
+    char *data = (char *)realloc(b->data, cap);
+    if (!data)
+      return false;
+    b->data = data;
+    b->cap = cap;
+  }
+  return true;
+}
+
+static bool lrx_append (lnet_rxbuf *b, const lnet_recvdata *rd) {
+  uint32_t n = rd->pbuf ? rd->pbuf->tot_len : rd->payload_len;
+  if (!lrx_reserve(b, n))
+    return false;
+  if (rd->pbuf)
+    pbuf_copy_partial(rd->pbuf, b->data + b->len, n, 0);
+  else
+    memcpy(b->data + b->len, rd->payload, n);
+  b->len += n;
+  return true;
+}
+
+static void net_push_pbuf (lua_State *L, lnet_userdata *ud, struct pbuf *p)
+{
+  if (ud->client.rx_buffer) {
+    pbuf_copy_partial(p, buffer_push(L, p->tot_len)->data, p->tot_len, 0);
+    return;
+  }
+  if (!p->next) {
+    lua_pushlstring(L, p->payload, p->len);
+    return;
+  }
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  for (; p; p = p->next)
+    luaL_addlstring(&b, p->payload, p->len);
+  luaL_pushresult(&b);
 }
 
-static void lrecv_cb (lua_State *L, lnet_userdata *ud, const lnet_recvdata *rd) {
+static void lrecv_cb (lua_State *L, lnet_userdata *ud, lnet_event *ev) {
+  const lnet_recvdata *rd = &ev->recvdata;
+  if (ud->type == TYPE_TCP_CLIENT) {
+    // No more data may be merged into this event once we start on it
+    portENTER_CRITICAL (&net_rx_mux);
+    if (ud->client.rx_pending == ev)
+      ud->client.rx_pending = NULL;
+    portEXIT_CRITICAL (&net_rx_mux);
+  }
+  if (ud->self_ref == LUA_NOREF) {
+    // closed, or its disconnection was handled first
+    if (rd->pbuf)
+      pbuf_free(rd->pbuf);
+    return;
+  }
+#if CONFIG_NET_POOL_SIZE > 0
+  if (ud->client.pooled && ud->type == TYPE_TCP_CLIENT) {
+    // Nobody is listening on an idle connection; don't hand it out again
+    if (rd->pbuf)
+      pbuf_free(rd->pbuf);
+    net_pool_close(L, ud);
+    return;
+  }
+#endif
+  if (ud->type == TYPE_TCP_CLIENT && ud->client.tls) {
+    // Keep the socket while callbacks run from the middle of this
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+    if (rd->pbuf) {
+      u16_t len = rd->pbuf->tot_len;
+      for (struct pbuf *p = rd->pbuf; p; p = p->next)
+        net_tls_input(L, ud, p->payload, p->len);
+      if (ud->pcb)
+        tcp_recved(ud->tcp_pcb, len);
+      pbuf_free(rd->pbuf);
+    } else {
+      net_tls_input(L, ud, rd->payload, rd->payload_len);
+    }
+    lua_pop(L, 1);
+    return;
+  }
+  if (ud->type == TYPE_TCP_CLIENT && ud->client.rx_hook) {
+    if (rd->pbuf) {
+      u16_t len = rd->pbuf->tot_len;
+      // The hook may let go of the socket part way through
+      for (struct pbuf *p = rd->pbuf; p && ud->client.rx_hook; p = p->next)
+        ud->client.rx_hook(L, ud->client.rx_hook_arg, p->payload, p->len);
+      if (ud->pcb)
+        tcp_recved(ud->tcp_pcb, len);
+      pbuf_free(rd->pbuf);
+    } else {
+      ud->client.rx_hook(L, ud->client.rx_hook_arg, (char *)rd->payload, rd->payload_len);
+    }
+    return;
+  }
+  if (ud->type == TYPE_TCP_CLIENT && ud->client.rxbuf) {
+    if (!lrx_append(ud->client.rxbuf, rd))
+      NODE_ERR("net: receive buffer full, dropping %d bytes\n",
+        rd->pbuf ? rd->pbuf->tot_len : rd->payload_len);
+    if (rd->pbuf) {
+      if (ud->pcb)
+        tcp_recved(ud->tcp_pcb, rd->pbuf->tot_len);
+      pbuf_free(rd->pbuf);
+    }
+    lrx_deliver(L, ud, false);
+    return;
+  }
   if (ud->client.cb_receive_ref != LUA_NOREF) {
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_receive_ref);
+    cbref_get(L, &net_cbs, ud->client.cb_receive_ref);
     int num_args = 2;
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
-    lua_pushlstring(L, rd->payload, rd->payload_len);
+    if (rd->pbuf)
+      net_push_pbuf(L, ud, rd->pbuf);
+    else
+      net_push_data(L, ud, rd->payload, rd->payload_len);
     if (ud->type == TYPE_UDP_SOCKET) {
       num_args += 2;
       char iptmp[IP_STR_SZ];
@@ -1059,11 +3263,71 @@ static void lrecv_cb (lua_State *L, lnet_userdata *ud, const lnet_recvdata *rd)
     }
     lua_call(L, num_args, 0);
   }
+  if (rd->pbuf) {
+    if (ud->type == TYPE_TCP_CLIENT && ud->pcb)
+      tcp_recved(ud->tcp_pcb, rd->pbuf->tot_len);
+    pbuf_free(rd->pbuf);
+  }
+}
+
+static void lrecvbatch_cb (lua_State *L, lnet_userdata *ud, lnet_event *ev) {
+  lnet_recvbatch *rb = &ev->recvbatch;
+  portENTER_CRITICAL (&net_rx_mux);
+  if (ud->client.rx_pending == ev)
+    ud->client.rx_pending = NULL;
+  portEXIT_CRITICAL (&net_rx_mux);
+  if (ud->self_ref != LUA_NOREF && ud->client.cb_receive_ref != LUA_NOREF) {
+    cbref_get(L, &net_cbs, ud->client.cb_receive_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+    lua_createtable(L, rb->count, 0);
+    for (int i = 0; i < rb->count; i++) {
+      char iptmp[IP_STR_SZ];
+      lua_createtable(L, 0, 3);
+      net_push_pbuf(L, ud, rb->dgram[i].p);
+      lua_setfield(L, -2, "data");
+      lua_pushinteger(L, rb->dgram[i].src_port);
+      lua_setfield(L, -2, "port");
+      ipstr (iptmp, &rb->dgram[i].src_ip);
+      lua_pushstring(L, iptmp);
+      lua_setfield(L, -2, "ip");
+      lua_rawseti(L, -2, i + 1);
+    }
+    lua_call(L, 2, 0);
+  }
+  for (int i = 0; i < rb->count; i++)
+    pbuf_free(rb->dgram[i].p);
+}
+
+static void lrxflush_cb (lua_State *L, lnet_userdata *ud) {
+  if (ud->self_ref == LUA_NOREF || !ud->client.rxbuf)
+    return;
+  ud->client.rxbuf->armed = false;
+  lrx_deliver(L, ud, true);
 }
 
 static void lsent_cb (lua_State *L, lnet_userdata *ud) {
+  if (ud->self_ref == LUA_NOREF)
+    return;
+  bool drained = false;
+  net_tx_release(L, ud, false);
+  if (ud->client.sq_head && ud->pcb) {
+    if (net_sendq_flush(ud) != ERR_OK)
+      net_sendq_free(L, ud);
+    drained = !ud->client.sq_head;
+  }
   if (ud->client.cb_sent_ref != LUA_NOREF) {
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_sent_ref);
+    cbref_get(L, &net_cbs, ud->client.cb_sent_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+    lua_call(L, 1, 0);
+  }
+  if (ud->client.sq_close && !ud->client.sq_head && !ud->client.tx_head) {
+    ud->client.sq_close = 0;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+    lua_pushcfunction(L, net_close);
+    lua_insert(L, -2);
+    lua_call(L, 1, 0);
+  } else if (drained && ud->client.cb_drain_ref != LUA_NOREF) {
+    cbref_get(L, &net_cbs, ud->client.cb_drain_ref);
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
     lua_call(L, 1, 0);
   }
@@ -1072,20 +3336,32 @@ static void lsent_cb (lua_State *L, lnet_userdata *ud) {
 static void lerr_cb (lua_State *L, lnet_userdata *ud, err_t err)
 {
   int ref;
+  if (ud->self_ref == LUA_NOREF)
+    return;
+#if CONFIG_NET_POOL_SIZE > 0
+  if (ud->client.pooled)
+    net_pool_remove(ud);
+#endif
+  if (ud->client.rxbuf)
+    lrx_deliver(L, ud, true);
+  net_rx_cancel(L, ud);
+  net_sendq_free(L, ud);
+  net_tx_release(L, ud, true);
+  net_tls_reset(ud);
+  ud->client.sq_close = 0;
+  if (ud->client.rx_hook)
+    ud->client.rx_hook(L, ud->client.rx_hook_arg, NULL, 0);
   if (err != ERR_OK && ud->client.cb_reconnect_ref != LUA_NOREF)
     ref = ud->client.cb_reconnect_ref;
   else ref = ud->client.cb_disconnect_ref;
   if (ref != LUA_NOREF) {
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    cbref_get(L, &net_cbs, ref);
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
     lua_pushinteger(L, err);
     lua_call(L, 2, 0);
   }
   if (ud->client.wait_dns == 0) {
-    lua_gc(L, LUA_GCSTOP, 0);
-    luaL_unref(L, LUA_REGISTRYINDEX, ud->self_ref);
-    ud->self_ref = LUA_NOREF;
-    lua_gc(L, LUA_GCRESTART, 0);
+    net_unref_self(L, ud);
   }
 }
 
@@ -1095,29 +3371,45 @@ static void handle_net_event (task_param_t param, task_prio_t prio)
   (void)prio;
 
   lua_State *L = lua_getstate();
+  uint32_t t0 = system_get_time();
+  TRACE(TRACE_NET_EVENT_B, ev->event, ev->ud);
   switch (ev->event)
   {
     case DNSFOUND:  ldnsfound_cb (L, ev->ud, &ev->resolved_ip);      break;
     case DNSSTATIC: ldnsstatic_cb (L, ev->cb_ref, &ev->resolved_ip); break;
     case CONNECTED: lconnected_cb (L, ev->ud);                       break;
-    case ACCEPT:    laccept_cb (L, ev->ud, ev->accept_newpcb);       break;
-    case RECVDATA:  lrecv_cb (L, ev->ud, &ev->recvdata);             break;
+    case ACCEPT:    laccept_cb (L, ev->ud);                          break;
+    case RECVDATA:  lrecv_cb (L, ev->ud, ev);                        break;
+    case RECVBATCH: lrecvbatch_cb (L, ev->ud, ev);                   break;
+    case RXFLUSH:   lrxflush_cb (L, ev->ud);                         break;
     case SENTDATA:  lsent_cb (L, ev->ud);                            break;
     case ERR:       lerr_cb (L, ev->ud, ev->err);                    break;
   }
+  // ud outlives its events, see net_unref_self
+  net_count_event (ev->event == DNSSTATIC ? NULL : ev->ud, system_get_time() - t0);
+  TRACE(TRACE_NET_EVENT_E, ev->event, ev->ud);
+  if (ev->event != DNSSTATIC) {
+    lnet_userdata *ud = ev->ud;
+    portENTER_CRITICAL (&net_rx_mux);
+    bool last = --ud->queued == 0;
+    portEXIT_CRITICAL (&net_rx_mux);
+    if (last && ud->hold_ref != LUA_NOREF) {
+      luaL_unref(L, LUA_REGISTRYINDEX, ud->hold_ref);
+      ud->hold_ref = LUA_NOREF;
+    }
+  }
 
-  free (ev);
+  net_event_free (ev);
 }
 
 // --- Tables
 
-extern const LUA_REG_TYPE tls_cert_map[];
-
 // Module function map
 static const LUA_REG_TYPE net_tcpserver_map[] = {
   { LSTRKEY( "listen" ),  LFUNCVAL( net_listen ) },
   { LSTRKEY( "getaddr" ), LFUNCVAL( net_getaddr ) },
   { LSTRKEY( "close" ),   LFUNCVAL( net_close ) },
+  { LSTRKEY( "stats" ),   LFUNCVAL( net_sockstats ) },
   { LSTRKEY( "__gc" ),    LFUNCVAL( net_delete ) },
   { LSTRKEY( "__index" ), LROVAL( net_tcpserver_map ) },
   { LNILKEY, LNILVAL }
@@ -1127,7 +3419,14 @@ static const LUA_REG_TYPE net_tcpsocket_map[] = {
   { LSTRKEY( "connect" ), LFUNCVAL( net_connect ) },
   { LSTRKEY( "close" ),   LFUNCVAL( net_close ) },
   { LSTRKEY( "on" ),      LFUNCVAL( net_on ) },
+  { LSTRKEY( "receive" ), LFUNCVAL( net_receive ) },
   { LSTRKEY( "send" ),    LFUNCVAL( net_send ) },
+  { LSTRKEY( "sendfile" ), LFUNCVAL( net_sendfile ) },
+  { LSTRKEY( "queued" ),  LFUNCVAL( net_queued ) },
+  { LSTRKEY( "setopt" ),  LFUNCVAL( net_setopt ) },
+  { LSTRKEY( "flush" ),   LFUNCVAL( net_flush ) },
+  { LSTRKEY( "stats" ),   LFUNCVAL( net_sockstats ) },
+  { LSTRKEY( "release" ), LFUNCVAL( net_release ) },
   { LSTRKEY( "hold" ),    LFUNCVAL( net_hold ) },
   { LSTRKEY( "unhold" ),  LFUNCVAL( net_unhold ) },
   { LSTRKEY( "dns" ),     LFUNCVAL( net_dns ) },
@@ -1143,6 +3442,8 @@ static const LUA_REG_TYPE net_udpsocket_map[] = {
   { LSTRKEY( "close" ),   LFUNCVAL( net_close ) },
   { LSTRKEY( "on" ),      LFUNCVAL( net_on ) },
   { LSTRKEY( "send" ),    LFUNCVAL( net_send ) },
+  { LSTRKEY( "sendmany" ), LFUNCVAL( net_sendmany ) },
+  { LSTRKEY( "stats" ),   LFUNCVAL( net_sockstats ) },
   { LSTRKEY( "dns" ),     LFUNCVAL( net_dns ) },
   { LSTRKEY( "getaddr" ), LFUNCVAL( net_getaddr ) },
   { LSTRKEY( "__gc" ),    LFUNCVAL( net_delete ) },
@@ -1154,6 +3455,7 @@ static const LUA_REG_TYPE net_dns_map[] = {
   { LSTRKEY( "setdnsserver" ), LFUNCVAL( net_setdnsserver ) },
   { LSTRKEY( "getdnsserver" ), LFUNCVAL( net_getdnsserver ) },
   { LSTRKEY( "resolve" ),      LFUNCVAL( net_dns_static ) },
+  { LSTRKEY( "cache" ),        LFUNCVAL( net_dns_cache_info ) },
   { LNILKEY, LNILVAL }
 };
 
@@ -1161,15 +3463,15 @@ const LUA_REG_TYPE net_map[] = {
   { LSTRKEY( "createServer" ),     LFUNCVAL( net_createServer ) },
   { LSTRKEY( "createConnection" ), LFUNCVAL( net_createConnection ) },
   { LSTRKEY( "createUDPSocket" ),  LFUNCVAL( net_createUDPSocket ) },
+  { LSTRKEY( "acquire" ),          LFUNCVAL( net_acquire ) },
   { LSTRKEY( "multicastJoin"),     LFUNCVAL( net_multicastJoin ) },
   { LSTRKEY( "multicastLeave"),    LFUNCVAL( net_multicastLeave ) },
+  { LSTRKEY( "eventpool" ),        LFUNCVAL( net_eventpool ) },
+  { LSTRKEY( "stats" ),            LFUNCVAL( net_stats ) },
   { LSTRKEY( "mycall" ), LFUNCVAL( net_mycall ) },
   { LSTRKEY( "myregister" ), LFUNCVAL( net_myregistrer ) },
 
   { LSTRKEY( "dns" ),              LROVAL( net_dns_map ) },
-#ifdef CLIENT_SSL_ENABLE
-  { LSTRKEY( "cert" ),             LROVAL( tls_cert_map ) },
-#endif
   { LSTRKEY( "TCP" ),              LNUMVAL( TYPE_TCP ) },
   { LSTRKEY( "UDP" ),              LNUMVAL( TYPE_UDP ) },
   { LSTRKEY( "__metatable" ),      LROVAL( net_map ) },
@@ -1179,12 +3481,16 @@ const LUA_REG_TYPE net_map[] = {
 int luaopen_net( lua_State *L ) {
   //printf("net init\n");
   igmp_init();
+#if CONFIG_NET_EVENT_POOL_SIZE > 0
+  net_pool_init();
+#endif
 
   luaL_rometatable(L, NET_TABLE_TCP_SERVER, (void *)net_tcpserver_map);
   luaL_rometatable(L, NET_TABLE_TCP_CLIENT, (void *)net_tcpsocket_map);
   luaL_rometatable(L, NET_TABLE_UDP_SOCKET, (void *)net_udpsocket_map);
 
   net_event = task_get_id (handle_net_event);
+  task_set_name (net_event, "net");
 
   return 0;
 }
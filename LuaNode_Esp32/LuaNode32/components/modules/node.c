@@ -6,6 +6,7 @@
 #include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
+#include "lgc.h"
 #include "lmem.h"
 #include "lobject.h"
 #include "lstate.h"
@@ -29,10 +30,27 @@
 #include "user_version.h"
 #include "esp_misc.h"
 #include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_heap_alloc_caps.h"
+#include "esp_timer.h"
 #include "vfs.h"
+#include "lc_store.h"
+#include "lslab.h"
+#include "task/task.h"
+#include "platform_power.h"
+#include "platform_boot.h"
+#include "node_ota.h"
+#include "net.h"
+#include "cbref.h"
+#include "rom/ets_sys.h"
+
+#include <stdio.h>
 
 #define CPU80MHZ 80
 #define CPU160MHZ 160
+#define CPU240MHZ 240
+#define CPUAUTO PLATFORM_CPU_AUTO
 
 // Lua: restart()
 static int node_restart( lua_State* L )
@@ -167,18 +185,90 @@ static int node_flashsize( lua_State* L )
   return 0;
 }
 
-// Lua: heap()
+// Lua: free, lowest = heap([quiet])
+// Prints the free heap unless quiet. lowest is the least there has been
+// since boot
 static int node_heap( lua_State* L )
 {
   uint32_t sz = system_get_free_heap_size();
-  lua_getglobal(L, "print");
+  if (!lua_toboolean(L, 1)) {
+    lua_getglobal(L, "print");
+    lua_pushinteger(L, sz);
+    int err = lua_pcall(L, 1, 1, 0);
+    if (err != 0) { os_printf("lua_pcall failed:%s", lua_tostring(L, -1)); }
+    lua_pop(L, 1) ;
+  }
   lua_pushinteger(L, sz);
-  int err = lua_pcall(L, 1, 1, 0);
-  if (err != 0) { os_printf("lua_pcall failed:%s", lua_tostring(L, -1)); }
-  lua_pop(L, 1) ;
-  return 0;
+  lua_pushinteger(L, xPortGetMinimumEverFreeHeapSize());
+  return 2;
 }
 
+// Heap regions heapinfo() breaks the totals down into
+static const struct {
+  const char *name;
+  uint32_t caps;
+} heap_kinds[] = {
+  { "internal", MALLOC_CAP_8BIT | MALLOC_CAP_DMA },
+  { "dma", MALLOC_CAP_DMA },
+  { "psram", MALLOC_CAP_SPISRAM },
+};
+
+static os_timer_t heaplog_timer;
+static uint32_t heaplog_alert;
+
+static void heaplog_tick( void *arg )
+{
+  size_t largest, free = xPortGetFreeHeapSizeCaps(MALLOC_CAP_8BIT, &largest);
+  lua_State *L = lua_getstate();
+  os_printf("heap: free %u largest %u min %u lua %u%s\n", (unsigned)free,
+            (unsigned)largest, (unsigned)xPortGetMinimumEverFreeHeapSize(),
+            L ? (unsigned)G(L)->totalbytes : 0,
+            largest < heaplog_alert ? " LOW" : "");
+}
+
+// Lua: t = heapinfo() -- { free=, largest=, minfree=, lua=,
+//   internal={free=, largest=}, dma={...}, psram={...} }
+// largest is the biggest block malloc() can still return; once it is
+// small, allocations fail however much is free in total.
+// Lua: heapinfo(ms[, low]) -- print a line every ms (0 stops), marked LOW
+// while the largest block is under low bytes
+static int node_heapinfo( lua_State* L )
+{
+  size_t largest, free;
+  if (lua_isnumber(L, 1)) {
+    uint32_t ms = luaL_checkinteger(L, 1);
+    heaplog_alert = luaL_optinteger(L, 2, 0);
+    os_timer_disarm(&heaplog_timer);
+    if (ms > 0) {
+      os_timer_setfn(&heaplog_timer, heaplog_tick, NULL);
+      os_timer_arm(&heaplog_timer, ms, 1);
+    }
+    return 0;
+  }
+  lua_createtable(L, 0, 7);
+  free = xPortGetFreeHeapSizeCaps(MALLOC_CAP_8BIT, &largest);
+  lua_pushinteger(L, free);
+  lua_setfield(L, -2, "free");
+  lua_pushinteger(L, largest);
+  lua_setfield(L, -2, "largest");
+  lua_pushinteger(L, xPortGetMinimumEverFreeHeapSize());
+  lua_setfield(L, -2, "minfree");
+  lua_pushinteger(L, G(L)->totalbytes);
+  lua_setfield(L, -2, "lua");
+  for (int i = 0; i < sizeof(heap_kinds) / sizeof(heap_kinds[0]); i++) {
+    free = xPortGetFreeHeapSizeCaps(heap_kinds[i].caps, &largest);
+    lua_createtable(L, 0, 2);
+    lua_pushinteger(L, free);
+    lua_setfield(L, -2, "free");
+    lua_pushinteger(L, largest);
+    lua_setfield(L, -2, "largest");
+    lua_setfield(L, -2, heap_kinds[i].name);
+  }
+  return 1;
+}
+
+// Lua: slabs = memusage() -- prints the Lua heap in KB
+// With the slab allocator also returns { {size=, pages=, slots=, used=}, ... }
 static int node_memusage( lua_State* L )
 {
   uint32_t usage = lua_gc(L, LUA_GCCOUNT, 0);
@@ -187,9 +277,171 @@ static int node_memusage( lua_State* L )
   int err = lua_pcall(L, 1, 1, 0);
   if (err != 0) { os_printf("lua_pcall failed:%s", lua_tostring(L, -1)); }
   lua_pop(L, 1) ;
+#if LUAI_SLAB
+  lslab_info_t info;
+  lua_createtable(L, LSLAB_CLASSES, 0);
+  for (int i = 0; lslab_info(i, &info); i++) {
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, info.size);
+    lua_setfield(L, -2, "size");
+    lua_pushinteger(L, info.pages);
+    lua_setfield(L, -2, "pages");
+    lua_pushinteger(L, info.slots);
+    lua_setfield(L, -2, "slots");
+    lua_pushinteger(L, info.used);
+    lua_setfield(L, -2, "used");
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+#if LUAI_MEMTRACE
+// Lua: memtrace(on) -- count Lua heap use per function and line
+// Turning it on again clears the counts.
+static int node_memtrace( lua_State* L )
+{
+  luaL_checkany(L, 1);
+  luaM_tracestop(L);
+  if (lua_toboolean(L, 1))
+    luaM_tracestart(L);
   return 0;
 }
 
+// Lua: t = memtop([n]) -- the n (10) sites that allocated the most bytes
+// t = { {src=, line=, bytes=, allocs=, freed=}, ..., lost= }, nil when
+// memtrace is off. freed counts bytes freed while the site was running,
+// which is mostly collector work it triggered.
+static int node_memtop( lua_State* L )
+{
+  MemTrace *t = G(L)->memtrace;
+  int n = luaL_optint(L, 1, 10);
+  bool taken[LUAI_MEMTRACE];
+  if (t == NULL)
+    return 0;
+  memset(taken, 0, sizeof(taken));
+  lua_createtable(L, n, 1);
+  for (int k = 1; k <= n; k++) {
+    int best = -1;
+    for (int i = 0; i < LUAI_MEMTRACE; i++) {
+      const MemSite *s = &t->site[i];
+      if (!taken[i] && s->allocs > 0 && (best < 0 || s->bytes > t->site[best].bytes))
+        best = i;
+    }
+    if (best < 0)
+      break;
+    taken[best] = true;
+    const MemSite *s = &t->site[best];
+    lua_createtable(L, 0, 5);
+    lua_pushstring(L, s->src);
+    lua_setfield(L, -2, "src");
+    lua_pushinteger(L, s->line);
+    lua_setfield(L, -2, "line");
+    lua_pushinteger(L, s->bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, s->allocs);
+    lua_setfield(L, -2, "allocs");
+    lua_pushinteger(L, s->freed);
+    lua_setfield(L, -2, "freed");
+    lua_rawseti(L, -2, k);
+  }
+  lua_pushinteger(L, t->lost);
+  lua_setfield(L, -2, "lost");
+  return 1;
+}
+
+// Lua: t = memobjects() -- live objects by type
+// t = { string = {count=, bytes=}, table = ..., ... }
+static int node_memobjects( lua_State* L )
+{
+  static const char *const names[LUA_TUPVAL+1] = {
+    [LUA_TSTRING] = "string", [LUA_TTABLE] = "table",
+    [LUA_TFUNCTION] = "function", [LUA_TUSERDATA] = "userdata",
+    [LUA_TTHREAD] = "thread", [LUA_TPROTO] = "proto", [LUA_TUPVAL] = "upvalue"
+  };
+  lu_mem count[LUA_TUPVAL+1], bytes[LUA_TUPVAL+1];
+  luaC_census(L, count, bytes);
+  lua_createtable(L, 0, 7);
+  for (int i = 0; i <= LUA_TUPVAL; i++) {
+    if (names[i] == NULL)
+      continue;
+    lua_createtable(L, 0, 2);
+    lua_pushinteger(L, count[i]);
+    lua_setfield(L, -2, "count");
+    lua_pushinteger(L, bytes[i]);
+    lua_setfield(L, -2, "bytes");
+    lua_setfield(L, -2, names[i]);
+  }
+  return 1;
+}
+#endif
+
+// Lua: t = cbrefs() -- { net = {live=, hwm=, slots=, weak=}, tmr = ... }
+// Lua: list = cbrefs(name) -- that module's live refs, {ref=, type=, where=}
+// Callbacks a module holds on to; live counts that only grow point at a
+// leak, and where says which function it is
+static int node_cbrefs( lua_State* L )
+{
+  cbref_table_t *t = NULL;
+  if (!lua_isnoneornil(L, 1)) {
+    const char *name = luaL_checkstring(L, 1);
+    while ((t = cbref_next(t)) != NULL && c_strcmp(t->name, name) != 0)
+      ;
+    if (t == NULL)
+      return luaL_error(L, "no refs held by %s", name);
+    cbref_push_live(L, t);
+    return 1;
+  }
+  lua_newtable(L);
+  while ((t = cbref_next(t)) != NULL) {
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, t->live);
+    lua_setfield(L, -2, "live");
+    lua_pushinteger(L, t->hwm);
+    lua_setfield(L, -2, "hwm");
+    lua_pushinteger(L, t->ref == LUA_NOREF ? 0 : t->slots);
+    lua_setfield(L, -2, "slots");
+    lua_pushboolean(L, t->weak);
+    lua_setfield(L, -2, "weak");
+    lua_setfield(L, -2, t->name);
+  }
+  return 1;
+}
+
+// Lua: cold, big = psram([cold][, big]) -- SPI RAM placement limits in bytes
+// Heap blocks of big bytes and more, or cold bytes and more for long strings,
+// table arrays and function code, go to SPI RAM. Returns the limits in use.
+static int node_psram( lua_State* L )
+{
+  global_State *g = G(L);
+  if (!lua_isnoneornil(L, 1))
+    g->psramcold = luaL_checkinteger(L, 1);
+  if (!lua_isnoneornil(L, 2))
+    g->psrambig = luaL_checkinteger(L, 2);
+  lua_pushinteger(L, g->psramcold);
+  lua_pushinteger(L, g->psrambig);
+  return 2;
+}
+
+// Lua: t = strstats() -- string table size, strings, empty buckets, longest chain
+static int node_strstats( lua_State* L )
+{
+  int empty, maxchain;
+  luaS_chainstats(L, &empty, &maxchain);
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, G(L)->strt.size);
+  lua_setfield(L, -2, "size");
+  lua_pushinteger(L, G(L)->strt.nuse);
+  lua_setfield(L, -2, "nuse");
+  lua_pushinteger(L, empty);
+  lua_setfield(L, -2, "empty");
+  lua_pushinteger(L, maxchain);
+  lua_setfield(L, -2, "maxchain");
+  return 1;
+}
+
 static lua_State *gL = NULL;
 
 #ifdef DEVKIT_VERSION_0_9
@@ -372,150 +624,484 @@ static int node_input( lua_State* L )
   return 0;
 }
 
-static int output_redir_ref = LUA_NOREF;
-static int serial_debug = 1;
-void output_redirect(const char *str) {
-  // if(c_strlen(str)>=TX_BUFF_SIZE){
-  //   NODE_ERR("output too long.\n");
-  //   return;
-  // }
+// Output redirection. Writes go into a ring buffer, which the Lua task
+// drains into the sink in chunks, so printing never calls into Lua or the
+// network by itself and can come from any task.
+enum { OUT_NONE, OUT_FUNC, OUT_SOCK, OUT_FILE };
+
+#define OUT_RING_DEFAULT  1024
+#define OUT_BLOCK_MS      1000    // block gives up and drops after this
+#define OUT_RETRY_MS      50      // socket send queue full: try again
+
+static portMUX_TYPE out_mux = portMUX_INITIALIZER_UNLOCKED;
+static int out_sink = OUT_NONE;
+static int out_ref = LUA_NOREF;   // function or socket
+static int out_fd;
+static bool out_serial = true;
+static bool out_block;
+static bool out_flushing;
+static char *out_ring;
+static uint32_t out_size, out_head, out_tail;   // head == tail: empty
+static uint32_t out_dropped;
+static task_handle_t out_task_id;
+static TaskHandle_t out_task;
+static os_timer_t out_retry_timer;
+
+static uint32_t out_used( void )
+{
+  return (out_head + out_size - out_tail) % out_size;
+}
+
+static void out_flush( void );
+
+static void out_task_cb( task_param_t param, task_prio_t prio )
+{
+  out_flush();
+}
+
+static void out_retry( void *arg )
+{
+  task_post_coalesced_low(out_task_id, 0);
+}
+
+// Takes as much of str as fits, or all of it dropping the oldest output
+// first. Returns the bytes taken.
+static size_t out_put( const char *str, size_t len, bool drop )
+{
+  size_t n;
+  taskENTER_CRITICAL(&out_mux);
+  uint32_t room = out_size - 1 - out_used();
+  if (drop && len > room) {
+    if (len > out_size - 1) {
+      out_dropped += len - (out_size - 1);
+      str += len - (out_size - 1);
+      len = out_size - 1;
+    }
+    out_dropped += len - room;
+    out_tail = (out_tail + len - room) % out_size;
+    room = len;
+  }
+  n = len < room ? len : room;
+  for (size_t i = 0; i < n; i++) {
+    out_ring[out_head] = str[i];
+    out_head = (out_head + 1) % out_size;
+  }
+  taskEXIT_CRITICAL(&out_mux);
+  return n;
+}
 
-  if (output_redir_ref == LUA_NOREF || !gL) {
+void output_redirect(const char *str) {
+  // Output from the sink itself goes to serial only
+  if (out_sink == OUT_NONE ||
+      (out_flushing && xTaskGetCurrentTaskHandle() == out_task)) {
     os_printf(str);
     return;
   }
-
-  if (serial_debug != 0) {
+  if (out_serial)
     os_printf(str);
+
+  size_t len = c_strlen(str);
+  if (!out_block) {
+    out_put(str, len, true);
+  } else {
+    TickType_t start = xTaskGetTickCount();
+    bool self = xTaskGetCurrentTaskHandle() == out_task;
+    for (;;) {
+      size_t n = out_put(str, len, false);
+      str += n;
+      len -= n;
+      if (len == 0)
+        break;
+      // The Lua task drains the ring itself; anyone else waits for it
+      if (self)
+        out_flush();
+      else
+        task_post_coalesced_low(out_task_id, 0);
+      if ((xTaskGetTickCount() - start) * portTICK_PERIOD_MS > OUT_BLOCK_MS) {
+        out_put(str, len, true);
+        break;
+      }
+      if (!self || out_used() == out_size - 1)
+        vTaskDelay(1);
+    }
+  }
+  task_post_coalesced_low(out_task_id, 0);
+}
+
+static void out_stop( lua_State *L )
+{
+  out_sink = OUT_NONE;
+  os_timer_disarm(&out_retry_timer);
+  luaL_unref(L, LUA_REGISTRYINDEX, out_ref);
+  out_ref = LUA_NOREF;
+  if (out_fd) {
+    vfs_close(out_fd);
+    out_fd = 0;
   }
+  out_serial = true;
+}
 
-  lua_rawgeti(gL, LUA_REGISTRYINDEX, output_redir_ref);
-  lua_pushstring(gL, str);
-  lua_call(gL, 1, 0);   // this call back function should never user output.
+static int out_send( lua_State *L )
+{
+  size_t len;
+  const char *data = lua_tolstring(L, 2, &len);
+  net_tcp_write(L, net_tcp_check(L, 1), data, len);
+  return 0;
+}
+
+// Hand one contiguous piece of the ring to the sink. False to stop for
+// now with the data kept.
+static bool out_deliver( lua_State *L, const char *data, uint32_t len )
+{
+  if (out_sink == OUT_FILE) {
+    if (vfs_write(out_fd, data, len) != len) {
+      out_stop(L);
+      os_printf("output: write failed, back to serial\n");
+    }
+    return true;
+  }
+  if (out_sink == OUT_SOCK) {
+    lua_pushcfunction(L, out_send);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, out_ref);
+    if (!net_tcp_connected(lua_touserdata(L, -1))) {
+      lua_pop(L, 2);
+      out_stop(L);
+      os_printf("output: socket closed, back to serial\n");
+      return true;
+    }
+  } else {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, out_ref);
+  }
+  lua_pushlstring(L, data, len);
+  int err = lua_pcall(L, out_sink == OUT_SOCK ? 2 : 1, 0, 0);
+  if (err == 0)
+    return true;
+  os_printf("output: %s\n", lua_tostring(L, -1));
+  lua_pop(L, 1);
+  if (out_sink == OUT_SOCK) {   // send queue full
+    os_timer_arm(&out_retry_timer, OUT_RETRY_MS, 0);
+    return false;
+  }
+  return true;
+}
+
+static void out_flush( void )
+{
+  lua_State *L = lua_getstate();
+  if (out_flushing || out_sink == OUT_NONE || !L)
+    return;
+  out_flushing = true;
+  taskENTER_CRITICAL(&out_mux);
+  uint32_t dropped = out_dropped;
+  out_dropped = 0;
+  taskEXIT_CRITICAL(&out_mux);
+  if (dropped) {
+    char note[40];
+    int n = snprintf(note, sizeof(note), "\n[output: %u bytes dropped]\n", dropped);
+    out_deliver(L, note, n);
+  }
+  while (out_sink != OUT_NONE && out_used() > 0) {
+    // Only this task moves tail, so the piece stays put while it's sent
+    uint32_t tail = out_tail, head = out_head;
+    uint32_t len = (head >= tail ? head : out_size) - tail;
+    if (!out_deliver(L, out_ring + tail, len))
+      break;
+    taskENTER_CRITICAL(&out_mux);
+    if (out_tail == tail)     // unless a drop moved it meanwhile
+      out_tail = (tail + len) % out_size;
+    taskEXIT_CRITICAL(&out_mux);
+  }
+  out_flushing = false;
 }
 
-// Lua: output(function(c), debug)
+// Lua: output(sink[, serial[, { size = bytes, overflow = "drop" | "block" }]])
+// Sends console output to sink: a function(str), a net TCP socket, or the
+// name of a file to append to; nil goes back to serial only. Output is
+// buffered (size 1024) and delivered in chunks from the Lua task. When the
+// buffer is full "drop" loses the oldest output, "block" makes the writer
+// wait. serial (1) also keeps printing to the serial port; 0 doesn't.
 static int node_output( lua_State* L )
 {
-  gL = L;
-  // luaL_checkanyfunction(L, 1);
-  if (lua_type(L, 1) == LUA_TFUNCTION || lua_type(L, 1) == LUA_TLIGHTFUNCTION) {
-    lua_pushvalue(L, 1);  // copy argument (func) to the top of stack
-    if (output_redir_ref != LUA_NOREF)
-      luaL_unref(L, LUA_REGISTRYINDEX, output_redir_ref);
-    output_redir_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-  } else {    // unref the key press function
-    if (output_redir_ref != LUA_NOREF)
-      luaL_unref(L, LUA_REGISTRYINDEX, output_redir_ref);
-    output_redir_ref = LUA_NOREF;
-    serial_debug = 1;
-    return 0;
+  static const char * const overflow[] = { "drop", "block", NULL };
+  uint32_t size = OUT_RING_DEFAULT;
+  bool block = false;
+  if (lua_istable(L, 3)) {
+    lua_getfield(L, 3, "size");
+    size = luaL_optinteger(L, -1, OUT_RING_DEFAULT);
+    lua_getfield(L, 3, "overflow");
+    block = luaL_checkoption(L, -1, "drop", overflow) == 1;
+    lua_pop(L, 2);
+    luaL_argcheck(L, size >= 64, 3, "size too small");
   }
 
-  if ( lua_isnumber(L, 2) )
-  {
-    serial_debug = lua_tointeger(L, 2);
-    if (serial_debug != 0)
-      serial_debug = 1;
+  out_flush();
+  out_stop(L);
+  if (lua_isnoneornil(L, 1))
+    return 0;
+
+  int sink;
+  if (lua_isfunction(L, 1) || lua_islightfunction(L, 1)) {
+    sink = OUT_FUNC;
+  } else if (lua_isstring(L, 1)) {
+    sink = OUT_FILE;
+    out_fd = vfs_open(lua_tostring(L, 1), "a");
+    if (!out_fd)
+      return luaL_error(L, "can't open %s", lua_tostring(L, 1));
   } else {
-    serial_debug = 1; // default to 1
+    net_tcp_check(L, 1);
+    sink = OUT_SOCK;
   }
 
+  if (size != out_size) {
+    char *ring = (char *)malloc(size);
+    if (!ring) {
+      out_stop(L);
+      return luaL_error(L, "out of memory");
+    }
+    taskENTER_CRITICAL(&out_mux);
+    char *old = out_ring;
+    out_ring = ring;
+    out_size = size;
+    out_head = out_tail = 0;
+    taskEXIT_CRITICAL(&out_mux);
+    free(old);
+  }
+  if (!out_task_id) {
+    out_task_id = task_get_id(out_task_cb);
+    os_timer_setfn(&out_retry_timer, out_retry, NULL);
+  }
+  out_task = xTaskGetCurrentTaskHandle();
+  if (sink != OUT_FILE) {
+    lua_pushvalue(L, 1);
+    out_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  out_block = block;
+  out_serial = !lua_isnumber(L, 2) || lua_tointeger(L, 2) != 0;
+  out_dropped = 0;
+  out_sink = sink;
   return 0;
 }
 
-static int writer(lua_State* L, const void* p, size_t size, void* u)
+// reads back the spool of a low-memory compile
+static int spool_reader(void* u, uint32_t off, void* b, size_t size)
 {
-  UNUSED(L);
-  int file_fd = *( (int *)u );
-  if ((FS_OPEN_OK - 1) == file_fd)
-    return 1;
-  NODE_DBG("get fd:%d,size:%d\n", file_fd, size);
-
-  if (size != 0 && (size != vfs_write(file_fd, (const char *)p, size)) )
+  luaL_FsWriter *spool = (luaL_FsWriter *)u;
+  if (luaL_fswriterflush(spool) || vfs_lseek(spool->f, off, VFS_SEEK_SET) < 0)
     return 1;
-  NODE_DBG("write fd:%d,size:%d\n", file_fd, size);
-  return 0;
+  return (size != vfs_read(spool->f, b, size));
 }
 
 #define toproto(L,i) (clvalue(L->top+(i))->l.p)
-// Lua: compile(filename) -- compile lua file into lua bytecode, and save to .lc
-static int node_compile( lua_State* L )
+
+// Compiles one file; out and spool come with their buffers. Raises an error
+// naming the file if it fails.
+static void compile_file( lua_State* L, const char *fname, luaL_FsWriter *out, luaL_FsWriter *spool )
 {
   Proto* f;
-  int file_fd = FS_OPEN_OK - 1;
-  size_t len;
-  const char *fname = luaL_checklstring( L, 1, &len );
-  if ( len > FS_NAME_MAX_LENGTH )
-    return luaL_error(L, "filename too long");
+  size_t len = c_strlen(fname);
+  if ( len >= FS_NAME_MAX_LENGTH )
+    luaL_error(L, "%s: filename too long", fname);
 
   char output[FS_NAME_MAX_LENGTH];
+  char spoolname[FS_NAME_MAX_LENGTH];
   c_strcpy(output, fname);
   // check here that filename end with ".lua".
   if (len < 4 || (c_strcmp( output + len - 4, ".lua") != 0) )
-    return luaL_error(L, "not a .lua file");
+    luaL_error(L, "%s: not a .lua file", fname);
 
-  output[c_strlen(output) - 2] = 'c';
-  output[c_strlen(output) - 1] = '\0';
+  output[len - 2] = 'c';
+  output[len - 1] = '\0';
+  c_strcpy(spoolname, output);
+  c_strcat(spoolname, "~");
   NODE_DBG(output);
   NODE_DBG("\n");
-  if (luaL_loadfsfile(L, fname) != 0) {
-    return luaL_error(L, lua_tostring(L, -1));
+
+  int spool_fd = vfs_open(spoolname, "w+");
+  if (spool_fd < FS_OPEN_OK)
+    luaL_error(L, "%s: cannot open/write to file", spoolname);
+  luaL_fswriterinit(spool, spool_fd, spool->buff, spool->size);
+  CompileSink sink;
+  luaU_sinkinit(&sink, luaL_fswrite, spool_reader, spool);
+  G(L)->compilesink = &sink;
+  int status = luaL_loadfsfile(L, fname);
+  G(L)->compilesink = NULL;   // not claimed if the file was a binary chunk
+  if (status != 0) {
+    luaU_sinkfree(L, &sink);
+    vfs_close(spool_fd);
+    vfs_remove(spoolname);
+    lua_error(L);
   }
 
   f = toproto(L, -1);
 
   int stripping = 1;      /* strip debug information? */
 
-  file_fd = vfs_open(output, "w+");
+  int file_fd = vfs_open(output, "w+");
   if (file_fd < FS_OPEN_OK)
   {
-    return luaL_error(L, "cannot open/write to file");
+    luaU_sinkfree(L, &sink);
+    vfs_close(spool_fd);
+    vfs_remove(spoolname);
+    luaL_error(L, "%s: cannot open/write to file", output);
   }
+  luaL_fswriterinit(out, file_fd, out->buff, out->size);
 
+  int result;
   lua_lock(L);
-  int result = luaU_dump(L, f, writer, &file_fd, stripping);
+  if (sink.nf > 0)
+    result = (luaL_fswriterflush(spool) || vfs_flush(spool_fd) < 0) ?
+        1 : luaU_sinkdump(L, &sink, luaL_fswrite, out);
+  else
+    result = luaU_dump(L, f, luaL_fswrite, out, stripping);
   lua_unlock(L);
+  luaU_sinkfree(L, &sink);
+  vfs_close(spool_fd);
+  vfs_remove(spoolname);
+  lua_pop(L, 1);
+
+  // stamp it with its source so that loadfile and require use it as cache
+  if (luaL_fswriterflush(out))
+    result = 1;
+  if (result == 0 && !luaL_fscachestamp(fname, file_fd))
+    result = 1;
 
   if (vfs_flush(file_fd) < 0) {   // result codes aren't propagated by flash_fs.h
-    // overwrite Lua error, like writer() does in case of a file io error
+    // overwrite Lua error, like the writer does in case of a file io error
     result = 1;
   }
   vfs_close(file_fd);
-  file_fd = FS_OPEN_OK - 1;
 
   if (result == LUA_ERR_CC_INTOVERFLOW) {
-    return luaL_error(L, "value too big or small for target integer type");
+    luaL_error(L, "%s: value too big or small for target integer type", fname);
   }
   if (result == LUA_ERR_CC_NOTINTEGER) {
-    return luaL_error(L, "target lua_Number is integral but fractional value found");
+    luaL_error(L, "%s: target lua_Number is integral but fractional value found", fname);
   }
-  if (result == 1) {    // result status generated by writer() or fs_flush() fail
-    return luaL_error(L, "writing to file failed");
+  if (result == 1) {    // result status generated by the writer or fs_flush() fail
+    luaL_error(L, "%s: writing to file failed", output);
   }
+}
 
+// Lua: compile(filename, ...) -- compile lua files into lua bytecode, and save to .lc
+// Functions are spooled to <name>.lc~ as soon as they are parsed and dropped
+// from the heap, so a script that would not fit in memory whole still
+// compiles; the spool needs about the size of the .lc free on the filesystem.
+// The bytecode and the spool are written through RAM buffers, a block at a
+// time, not piece by piece as ldump.c hands them out. With several files
+// they are compiled in turn with the same buffers; the first that fails
+// stops the rest with an error naming it.
+static int node_compile( lua_State* L )
+{
+  int i, n = lua_gettop(L);
+  luaL_checkstring(L, 1);
+  for (i = 2; i <= n; i++)
+    luaL_checkstring(L, i);
+
+  // a userdata, so that the buffers go if a file fails
+  char *buf = (char *)lua_newuserdata(L, 2 * LUAL_BUFFERSIZE);
+  luaL_FsWriter out, spool;
+  luaL_fswriterinit(&out, 0, buf, LUAL_BUFFERSIZE);
+  luaL_fswriterinit(&spool, 0, buf + LUAL_BUFFERSIZE, LUAL_BUFFERSIZE);
+  for (i = 1; i <= n; i++)
+    compile_file(L, lua_tostring(L, i), &out, &spool);
   return 0;
 }
 
-#if 0
+// Lua: f = flashload(filename) -- load a .lc file to run in place from flash
+// The file is copied into the lcstore partition unless an identical copy is
+// already there; its code and constant strings then never take up heap.
+static int node_flashload( lua_State* L )
+{
+  size_t len;
+  const char *fname = luaL_checklstring( L, 1, &len );
+  if ( len >= LC_STORE_NAME_LEN )
+    return luaL_error(L, "filename too long");
+  uint32_t used, total;
+  if (!lc_store_info(LC_STORE_FLASH, &used, &total))
+    return luaL_error(L, "no flash store partition");
+
+  int fd = vfs_open(fname, "r");
+  if (fd < FS_OPEN_OK)
+    return luaL_error(L, "cannot open %s", fname);
+  uint32_t size = vfs_size(fd);
+  // a userdata so that the copy is collected if anything below throws
+  char *buf = size ? (char *)lua_newuserdata(L, size) : NULL;
+  int32_t got = buf ? vfs_read(fd, buf, size) : 0;
+  vfs_close(fd);
+  if (!buf || got != size || buf[0] != LUA_SIGNATURE[0])
+    return luaL_error(L, "%s is not a compiled file", fname);
+
+  const char *image = lc_store_find(LC_STORE_FLASH, fname, size, lc_store_sum(buf, size));
+  if (!image)
+    image = lc_store_add(LC_STORE_FLASH, fname, buf, size);
+  if (!image)
+    return luaL_error(L, "flash store full, see node.flashreset()");
+  lua_pop(L, 1);
+
+  lua_pushfstring(L, "@%s", fname);
+  if (luaL_loadmapped(L, image, size, lua_tostring(L, -1)) != 0)
+    return lua_error(L);
+  return 1;
+}
+
+// Lua: flashreset() -- erase the flash store and restart
+// Functions loaded from the store point into it, so they can't outlive it.
+static int node_flashreset( lua_State* L )
+{
+  if (!lc_store_erase(LC_STORE_FLASH))
+    return luaL_error(L, "no flash store partition");
+  system_restart();
+  return 0;
+}
+
+// Lua: used, total = flashinfo() -- bytes of the flash store in use
+static int node_flashinfo( lua_State* L )
+{
+  uint32_t used, total;
+  if (!lc_store_info(LC_STORE_FLASH, &used, &total))
+    return 0;
+  lua_pushinteger(L, used);
+  lua_pushinteger(L, total);
+  return 2;
+}
+
 // Lua: setcpufreq(mhz)
-// mhz is either CPU80MHZ od CPU160MHZ
+// mhz is CPU80MHZ, CPU160MHZ, CPU240MHZ or CPUAUTO, which runs at the
+// default clock while busy and at 80 MHz while idle
 static int node_setcpufreq(lua_State* L)
 {
-  // http://www.esp8266.com/viewtopic.php?f=21&t=1369
   uint32_t new_freq = luaL_checkinteger(L, 1);
-  if (new_freq == CPU160MHZ){
-    REG_SET_BIT(0x3ff00014, BIT(0));
-    ets_update_cpu_frequency(CPU160MHZ);
+  if (new_freq != CPUAUTO && new_freq != CPU80MHZ &&
+      new_freq != CPU160MHZ && new_freq != CPU240MHZ)
+    return luaL_argerror(L, 1, "must be 80, 160, 240 or CPUAUTO");
+  if (!platform_cpu_freq(new_freq))
+    return luaL_error(L, "cpu frequency scaling not supported");
+  lua_pushinteger(L, ets_get_cpu_frequency());
+  return 1;
+}
+
+// Lua: mhz, setting = getcpufreq()
+static int node_getcpufreq(lua_State* L)
+{
+  lua_pushinteger(L, ets_get_cpu_frequency());
+  lua_pushinteger(L, platform_cpu_freq_get());
+  return 2;
+}
+
+// Lua: cpuboost(on)
+// Full clock from cpuboost(true) up to the matching cpuboost(false)
+static int node_cpuboost(lua_State* L)
+{
+  if (lua_toboolean(L, 1)) {
+    if (!platform_cpu_boost())
+      return luaL_error(L, "cpu frequency scaling not supported");
   } else {
-    REG_CLR_BIT(0x3ff00014,  BIT(0));
-    ets_update_cpu_frequency(CPU80MHZ);
+    platform_cpu_unboost();
   }
-  new_freq = ets_get_cpu_frequency();
-  lua_pushinteger(L, new_freq);
-  return 1;
+  return 0;
 }
 
+#if 0
 // Lua: code = bootreason()
 static int node_bootreason (lua_State *L)
 {
@@ -533,6 +1119,469 @@ static int node_restore (lua_State *L)
   return 0;
 }
 
+static const task_prio_t node_task_prio_order[] =
+  { TASK_PRIORITY_HIGH, TASK_PRIORITY_MEDIUM, TASK_PRIORITY_LOW };
+static const char *const node_task_prio_names[] =
+  { "high", "medium", "low" };
+
+// Lua: stats = taskstats()
+static int node_taskstats (lua_State *L)
+{
+  task_pump_stats_t ps;
+  task_get_pump_stats (&ps);
+
+  lua_newtable (L);
+  lua_pushinteger (L, ps.events);
+  lua_setfield (L, -2, "events");
+  lua_pushinteger (L, ps.passes);
+  lua_setfield (L, -2, "passes");
+  lua_pushnumber (L, (lua_Number)ps.avg_batch_x100 / 100);
+  lua_setfield (L, -2, "avg_batch");
+  lua_pushinteger (L, ps.events_per_sec);
+  lua_setfield (L, -2, "events_per_sec");
+  lua_pushinteger (L, task_get_coalesced_count ());
+  lua_setfield (L, -2, "coalesced");
+  lua_pushinteger (L, ps.sleeps);
+  lua_setfield (L, -2, "sleeps");
+  lua_pushinteger (L, ps.wake_avg_us);
+  lua_setfield (L, -2, "wake_avg_us");
+  lua_pushinteger (L, ps.wake_max_us);
+  lua_setfield (L, -2, "wake_max_us");
+
+  for (int i = 0; i < 3; ++i)
+  {
+    task_queue_stats_t qs;
+    if (!task_get_queue_stats (node_task_prio_order[i], &qs))
+      continue;
+    lua_newtable (L);
+    lua_pushinteger (L, qs.qlen);
+    lua_setfield (L, -2, "qlen");
+    lua_pushinteger (L, qs.waiting);
+    lua_setfield (L, -2, "waiting");
+    lua_pushinteger (L, qs.hwm);
+    lua_setfield (L, -2, "hwm");
+    lua_pushinteger (L, qs.posted);
+    lua_setfield (L, -2, "posted");
+    lua_pushinteger (L, qs.failed);
+    lua_setfield (L, -2, "failed");
+    lua_pushinteger (L, qs.aged);
+    lua_setfield (L, -2, "aged");
+    lua_setfield (L, -2, node_task_prio_names[i]);
+  }
+  return 1;
+}
+
+// Lua: high, medium, low = taskqlen([high, medium, low])
+static int node_taskqlen (lua_State *L)
+{
+  for (int i = 0; i < 3; ++i)
+  {
+    if (lua_isnoneornil (L, i + 1))
+      continue;
+    int qlen = luaL_checkinteger (L, i + 1);
+    if (qlen < 1 || qlen > 255)
+      return luaL_argerror (L, i + 1, "must be in range 1-255");
+    if (!task_resize_queue (node_task_prio_order[i], qlen))
+      return luaL_error (L, "cannot resize %s queue", node_task_prio_names[i]);
+  }
+  for (int i = 0; i < 3; ++i)
+  {
+    task_queue_stats_t qs;
+    task_get_queue_stats (node_task_prio_order[i], &qs);
+    lua_pushinteger (L, qs.qlen);
+  }
+  return 3;
+}
+
+static void node_push_hist (lua_State *L, const uint32_t *hist, int n)
+{
+  lua_createtable (L, n, 0);
+  for (int i = 0; i < n; ++i)
+  {
+    lua_pushinteger (L, hist[i]);
+    lua_rawseti (L, -2, i + 1);
+  }
+}
+
+// Lua: list = tasktiming([reset])
+static int node_tasktiming (lua_State *L)
+{
+  bool reset = lua_toboolean (L, 1);
+  int n = task_get_handle_count ();
+  lua_createtable (L, n, 0);
+  for (int i = 0; i < n; ++i)
+  {
+    task_timing_t t;
+    const char *name = NULL;
+    if (!task_get_timing (i, &t, &name, reset))
+      return luaL_error (L, "task latency stats not enabled");
+
+    lua_newtable (L);
+    lua_pushinteger (L, i);
+    lua_setfield (L, -2, "handle");
+    if (name)
+    {
+      lua_pushstring (L, name);
+      lua_setfield (L, -2, "name");
+    }
+    lua_pushinteger (L, t.count);
+    lua_setfield (L, -2, "count");
+    lua_pushinteger (L, t.count ? (uint32_t)(t.queue_total_us / t.count) : 0);
+    lua_setfield (L, -2, "queue_avg_us");
+    lua_pushinteger (L, t.queue_max_us);
+    lua_setfield (L, -2, "queue_max_us");
+    lua_pushinteger (L, t.count ? (uint32_t)(t.run_total_us / t.count) : 0);
+    lua_setfield (L, -2, "run_avg_us");
+    lua_pushinteger (L, t.run_max_us);
+    lua_setfield (L, -2, "run_max_us");
+    node_push_hist (L, t.queue_hist, TASK_HIST_BUCKETS);
+    lua_setfield (L, -2, "queue_hist");
+    node_push_hist (L, t.run_hist, TASK_HIST_BUCKETS);
+    lua_setfield (L, -2, "run_hist");
+    lua_rawseti (L, -2, i + 1);
+  }
+  return 1;
+}
+
+// Lua: phases, total_us = bootprofile()
+// Each phase of app_main in the order they began, as {name=, start_us=,
+// us=}, start_us counting from reset. total_us is when the message pump
+// started, and so when the first Lua callback could run.
+static int node_bootprofile (lua_State *L)
+{
+  const char *name;
+  uint32_t start, end;
+  lua_newtable (L);
+  for (int i = 0; platform_boot_phase (i, &name, &start, &end); ++i)
+  {
+    lua_createtable (L, 0, 3);
+    lua_pushstring (L, name);
+    lua_setfield (L, -2, "name");
+    lua_pushinteger (L, start);
+    lua_setfield (L, -2, "start_us");
+    if (end)
+    {
+      lua_pushinteger (L, end - start);
+      lua_setfield (L, -2, "us");
+    }
+    lua_rawseti (L, -2, i + 1);
+  }
+  lua_pushinteger (L, platform_boot_total_us ());
+  return 2;
+}
+
+// Lua: us = gcbudget([us]) -- caps each incremental GC step at us
+// microseconds, 0 for no cap
+static int node_gcbudget (lua_State *L)
+{
+  global_State *g = G(L);
+  if (!lua_isnoneornil (L, 1))
+  {
+    int us = luaL_checkinteger (L, 1);
+    if (us < 0)
+      return luaL_argerror (L, 1, "must not be negative");
+    g->gcstepus = us;
+  }
+  lua_pushinteger (L, g->gcstepus);
+  return 1;
+}
+
+static int gcidle_kb = -1;
+
+static bool node_gc_idle (void)
+{
+  return lua_gc (lua_getstate (), LUA_GCIDLE, gcidle_kb);
+}
+
+// Lua: kb = gcidle([kb]) -- collect garbage while no events are waiting
+// Each pass of the task pump with empty queues does kb Kbytes worth of GC
+// steps (0 for a single step) until the cycle is done; false turns it off.
+static int node_gcidle (lua_State *L)
+{
+  if (!lua_isnone (L, 1))
+  {
+    if (lua_isboolean (L, 1) && !lua_toboolean (L, 1))
+      gcidle_kb = -1;
+    else
+    {
+      gcidle_kb = luaL_checkinteger (L, 1);
+      if (gcidle_kb < 0)
+        return luaL_argerror (L, 1, "must not be negative");
+    }
+    if (gcidle_kb < 0)
+      task_remove_idle_hook (node_gc_idle);
+    else if (!task_add_idle_hook (node_gc_idle))
+    {
+      gcidle_kb = -1;
+      return luaL_error (L, "no free idle hook");
+    }
+  }
+  if (gcidle_kb < 0)
+    lua_pushboolean (L, false);
+  else
+    lua_pushinteger (L, gcidle_kb);
+  return 1;
+}
+
+// Lua: t = gcstats([reset]) -- { steps=, max_us=, hist={...} }
+// hist counts GC step pauses in log2 microsecond buckets
+static int node_gcstats (lua_State *L)
+{
+  global_State *g = G(L);
+  lua_createtable (L, 0, 3);
+  lua_pushinteger (L, g->gcsteps);
+  lua_setfield (L, -2, "steps");
+  lua_pushinteger (L, g->gcpausemax);
+  lua_setfield (L, -2, "max_us");
+  node_push_hist (L, g->gcpausehist, LUAI_GCHIST);
+  lua_setfield (L, -2, "hist");
+  if (lua_toboolean (L, 1))
+  {
+    g->gcsteps = 0;
+    g->gcpausemax = 0;
+    memset (g->gcpausehist, 0, sizeof (g->gcpausehist));
+  }
+  return 1;
+}
+
+// Instruction budget for the callbacks the task pump runs. A count hook
+// on the Lua state adds up instructions in steps; while a handler runs,
+// going over the budget gets the Lua code warned about, yielded or
+// aborted. The counts are kept per handle, for finding the slow ones.
+#define LB_STEP   1000    // instructions between hook calls at most
+#define LB_DEPTH  8       // frames in a warning's traceback
+
+enum { LB_WARN, LB_YIELD, LB_ABORT };
+static const char *const lb_actions[] = { "warn", "yield", "abort", NULL };
+
+typedef struct {
+  uint32_t runs;          // handler runs in which Lua code ran
+  uint32_t max;           // most instructions in one of them
+  uint32_t over;          // runs that went over the budget
+} lb_stats_t;
+
+static uint32_t lb_budget;          // 0 for off
+static uint32_t lb_step;
+static uint8_t lb_action;
+static int lb_index = -1;           // handle being run, -1 between handlers
+static uint32_t lb_used;
+static bool lb_over;
+static lb_stats_t *lb_stats;
+static int lb_nstats;
+
+static void lb_warn (lua_State *L)
+{
+  lua_Debug ar;
+  os_printf ("budget: handle %d over %u instructions\n", lb_index, (unsigned)lb_budget);
+  for (int level = 0; level < LB_DEPTH && lua_getstack (L, level, &ar); ++level)
+  {
+    lua_getinfo (L, "Sln", &ar);
+    if (ar.currentline > 0)
+      os_printf ("  %s:%d: in %s\n", ar.short_src, ar.currentline, ar.name ? ar.name : "?");
+    else
+      os_printf ("  %s: in %s\n", ar.short_src, ar.name ? ar.name : "?");
+  }
+}
+
+static void lb_hook (lua_State *L, lua_Debug *ar)
+{
+  (void)ar;
+  if (lb_budget == 0)
+  {
+    // a coroutine made while the budget was on
+    lua_sethook (L, NULL, 0, 0);
+    return;
+  }
+  if (lb_index < 0)
+    return;
+  lb_used += lb_step;
+  if (lb_used < lb_budget)
+    return;
+  bool first = !lb_over;
+  lb_over = true;
+  switch (lb_action)
+  {
+    case LB_ABORT:
+      // at every step from here on, so a pcall in the callback doesn't
+      // get it going again
+      luaL_error (L, "callback over budget of %d instructions", (int)lb_budget);
+      break;
+    case LB_YIELD:
+      if (L != G(L)->mainthread && L->nCcalls <= L->baseCcalls)
+      {
+        lua_yield (L, 0);
+        return;
+      }
+      // not in a coroutine, or not where it can yield: fall through
+    default:
+      if (first)
+        lb_warn (L);
+      break;
+  }
+}
+
+static void lb_dispatch (int index, bool begin)
+{
+  lua_State *L = lua_getstate ();
+  if (begin)
+  {
+    lb_index = index;
+    lb_used = 0;
+    lb_over = false;
+    // restarts the count
+    if (lua_gethook (L) == lb_hook)
+      lua_sethook (L, lb_hook, LUA_MASKCOUNT, lb_step);
+    return;
+  }
+  lb_index = -1;
+  if (lb_used == 0 && !lb_over)
+    return;
+  if (index >= lb_nstats)
+  {
+    int n = task_get_handle_count ();
+    lb_stats_t *s = (lb_stats_t *)realloc (lb_stats, n * sizeof (lb_stats_t));
+    if (!s)
+      return;
+    memset (s + lb_nstats, 0, (n - lb_nstats) * sizeof (lb_stats_t));
+    lb_stats = s;
+    lb_nstats = n;
+  }
+  lb_stats_t *s = &lb_stats[index];
+  ++s->runs;
+  if (lb_used > s->max)
+    s->max = lb_used;
+  if (lb_over)
+    ++s->over;
+}
+
+// Lua: instructions, action = luabudget([instructions[, action]])
+// Caps the Lua instructions each callback run by the task pump may take;
+// 0 turns the cap off. action is what going over does: "warn" (the
+// default) prints a traceback once, "yield" yields when in a coroutine
+// and warns otherwise, "abort" raises an error, which like any other in
+// a callback ends in a panic unless the callback catches it. Counting
+// goes in steps of up to 1000 instructions. Coroutines made before the
+// cap was set aren't counted; the profiler can't run alongside.
+static int node_luabudget (lua_State *L)
+{
+  if (!lua_isnoneornil (L, 1))
+  {
+    int budget = luaL_checkinteger (L, 1);
+    if (budget < 0)
+      return luaL_argerror (L, 1, "must not be negative");
+    int action = luaL_checkoption (L, 2, "warn", lb_actions);
+    lua_Hook hook = lua_gethook (L);
+    if (budget && hook != NULL && hook != lb_hook)
+      return luaL_error (L, "another hook is set");
+    lb_budget = budget;
+    lb_action = action;
+    if (budget)
+    {
+      lb_step = budget < LB_STEP ? budget : LB_STEP;
+      lua_sethook (L, lb_hook, LUA_MASKCOUNT, lb_step);
+      task_set_dispatch_hook (lb_dispatch);
+    }
+    else
+    {
+      task_set_dispatch_hook (NULL);
+      if (hook == lb_hook)
+        lua_sethook (L, NULL, 0, 0);
+    }
+  }
+  lua_pushinteger (L, lb_budget);
+  lua_pushstring (L, lb_actions[lb_action]);
+  return 2;
+}
+
+// Lua: list = luastats([reset])
+// For each handle whose handler ran Lua code under luabudget(), {handle=,
+// runs=, max=, over=}: max is the most instructions in one run and over
+// the runs that went over. handle is as tasktiming() has it.
+static int node_luastats (lua_State *L)
+{
+  bool reset = lua_toboolean (L, 1);
+  int n = 0;
+  lua_newtable (L);
+  for (int i = 0; i < lb_nstats; ++i)
+  {
+    lb_stats_t *s = &lb_stats[i];
+    if (!s->runs)
+      continue;
+    lua_createtable (L, 0, 4);
+    lua_pushinteger (L, i);
+    lua_setfield (L, -2, "handle");
+    lua_pushinteger (L, s->runs);
+    lua_setfield (L, -2, "runs");
+    lua_pushinteger (L, s->max);
+    lua_setfield (L, -2, "max");
+    lua_pushinteger (L, s->over);
+    lua_setfield (L, -2, "over");
+    lua_rawseti (L, -2, ++n);
+    if (reset)
+      memset (s, 0, sizeof (*s));
+  }
+  return 1;
+}
+
+// Lua: core0[, core1] = cpuload()
+// Busy percentage of each core since the previous call
+static int node_cpuload (lua_State *L)
+{
+  uint8_t busy[portNUM_PROCESSORS];
+  int n = task_get_cpuload (busy, portNUM_PROCESSORS);
+  if (!n)
+    return luaL_error (L, "cpu load measurement not enabled");
+  for (int i = 0; i < n; ++i)
+    lua_pushinteger (L, busy[i]);
+  return n;
+}
+
+// Lua: on = idlesleep([on[, { [pin] = level, ... }]])
+// Light sleep while nothing runs, until the next tmr deadline, WiFi
+// traffic, UART0 input or one of the pins being at its level. A level of
+// -1 stops waking on that pin. Returns whether it's on.
+static int node_idlesleep (lua_State *L)
+{
+  if (!lua_isnoneornil (L, 1))
+  {
+    bool on = lua_toboolean (L, 1);
+    if (!platform_idle_sleep (on))
+      return luaL_error (L, "idle sleep not supported");
+    if (lua_istable (L, 2))
+    {
+      lua_pushnil (L);
+      while (lua_next (L, 2))
+      {
+        unsigned pin = luaL_checkinteger (L, -2);
+        int level = luaL_checkinteger (L, -1);
+        if (!platform_idle_sleep_gpio (pin, level))
+          return luaL_error (L, "can't wake on pin %d", pin);
+        lua_pop (L, 1);
+      }
+    }
+  }
+  lua_pushboolean (L, platform_idle_sleep_enabled ());
+  return 1;
+}
+
+// Lua: high, medium, low = taskbudget([high, medium, low])
+static int node_taskbudget (lua_State *L)
+{
+  for (int i = 0; i < 3; ++i)
+  {
+    if (lua_isnoneornil (L, i + 1))
+      continue;
+    int budget = luaL_checkinteger (L, i + 1);
+    if (budget < 0 || budget > 255)
+      return luaL_argerror (L, i + 1, "must be in range 0-255");
+    if (!task_set_budget (node_task_prio_order[i], budget))
+      return luaL_error (L, "batch drain not enabled");
+  }
+  for (int i = 0; i < 3; ++i)
+    lua_pushinteger (L, task_get_budget (node_task_prio_order[i]));
+  return 3;
+}
+
 #ifdef LUA_OPTIMIZE_DEBUG
 /* node.stripdebug([level[, function]]). 
  * level:    1 don't discard debug
@@ -606,7 +1655,15 @@ const LUA_REG_TYPE node_map[] =
   { LSTRKEY( "flashid" ), LFUNCVAL( node_flashid ) },
   { LSTRKEY( "flashsize" ), LFUNCVAL( node_flashsize) },
   { LSTRKEY( "heap" ), LFUNCVAL( node_heap ) },
+  { LSTRKEY( "heapinfo" ), LFUNCVAL( node_heapinfo ) },
   { LSTRKEY( "memusage" ), LFUNCVAL( node_memusage ) },
+#if LUAI_MEMTRACE
+  { LSTRKEY( "memtrace" ), LFUNCVAL( node_memtrace ) },
+  { LSTRKEY( "memtop" ), LFUNCVAL( node_memtop ) },
+  { LSTRKEY( "memobjects" ), LFUNCVAL( node_memobjects ) },
+#endif
+  { LSTRKEY( "strstats" ), LFUNCVAL( node_strstats ) },
+  { LSTRKEY( "psram" ), LFUNCVAL( node_psram ) },
 #ifdef DEVKIT_VERSION_0_9
   { LSTRKEY( "key" ), LFUNCVAL( node_key ) },
   { LSTRKEY( "led" ), LFUNCVAL( node_led ) },
@@ -616,11 +1673,35 @@ const LUA_REG_TYPE node_map[] =
 // Moved to adc module, use adc.readvdd33()
 // { LSTRKEY( "readvdd33" ), LFUNCVAL( node_readvdd33) },
   { LSTRKEY( "compile" ), LFUNCVAL( node_compile) },
-  //{ LSTRKEY( "CPU80MHZ" ), LNUMVAL( CPU80MHZ ) },
-  //{ LSTRKEY( "CPU160MHZ" ), LNUMVAL( CPU160MHZ ) },
-  //{ LSTRKEY( "setcpufreq" ), LFUNCVAL( node_setcpufreq) },
+  { LSTRKEY( "flashload" ), LFUNCVAL( node_flashload ) },
+  { LSTRKEY( "flashreset" ), LFUNCVAL( node_flashreset ) },
+  { LSTRKEY( "flashinfo" ), LFUNCVAL( node_flashinfo ) },
+  { LSTRKEY( "ota" ), LROVAL( node_ota_map ) },
+  { LSTRKEY( "CPU80MHZ" ), LNUMVAL( CPU80MHZ ) },
+  { LSTRKEY( "CPU160MHZ" ), LNUMVAL( CPU160MHZ ) },
+  { LSTRKEY( "CPU240MHZ" ), LNUMVAL( CPU240MHZ ) },
+  { LSTRKEY( "CPUAUTO" ), LNUMVAL( CPUAUTO ) },
+  { LSTRKEY( "PRIO_LOW" ), LNUMVAL( TASK_PRIORITY_LOW ) },
+  { LSTRKEY( "PRIO_MEDIUM" ), LNUMVAL( TASK_PRIORITY_MEDIUM ) },
+  { LSTRKEY( "PRIO_HIGH" ), LNUMVAL( TASK_PRIORITY_HIGH ) },
+  { LSTRKEY( "setcpufreq" ), LFUNCVAL( node_setcpufreq) },
+  { LSTRKEY( "getcpufreq" ), LFUNCVAL( node_getcpufreq) },
+  { LSTRKEY( "cpuboost" ), LFUNCVAL( node_cpuboost) },
   //{ LSTRKEY( "bootreason" ), LFUNCVAL( node_bootreason) },
   { LSTRKEY( "restore" ), LFUNCVAL( node_restore) },
+  { LSTRKEY( "taskstats" ), LFUNCVAL( node_taskstats ) },
+  { LSTRKEY( "taskbudget" ), LFUNCVAL( node_taskbudget ) },
+  { LSTRKEY( "taskqlen" ), LFUNCVAL( node_taskqlen ) },
+  { LSTRKEY( "tasktiming" ), LFUNCVAL( node_tasktiming ) },
+  { LSTRKEY( "bootprofile" ), LFUNCVAL( node_bootprofile ) },
+  { LSTRKEY( "cpuload" ), LFUNCVAL( node_cpuload ) },
+  { LSTRKEY( "idlesleep" ), LFUNCVAL( node_idlesleep ) },
+  { LSTRKEY( "gcbudget" ), LFUNCVAL( node_gcbudget ) },
+  { LSTRKEY( "gcidle" ), LFUNCVAL( node_gcidle ) },
+  { LSTRKEY( "gcstats" ), LFUNCVAL( node_gcstats ) },
+  { LSTRKEY( "luabudget" ), LFUNCVAL( node_luabudget ) },
+  { LSTRKEY( "luastats" ), LFUNCVAL( node_luastats ) },
+  { LSTRKEY( "cbrefs" ), LFUNCVAL( node_cbrefs ) },
 #ifdef LUA_OPTIMIZE_DEBUG
   { LSTRKEY( "stripdebug" ), LFUNCVAL( node_stripdebug ) },
 #endif
@@ -632,6 +1713,7 @@ const LUA_REG_TYPE node_map[] =
 
 LUALIB_API int luaopen_node(lua_State *L)
 {
+  node_ota_open(L);
 #if LUA_OPTIMIZE_MEMORY > 0
     return 0;
 #else  
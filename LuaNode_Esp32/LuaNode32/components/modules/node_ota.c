@@ -0,0 +1,495 @@
+// node.ota: firmware and Lua Flash Store updates streamed into flash
+//
+// An update goes into the app slot that isn't running, through an
+// erase-ahead flash stream, with SHA-256 taken as the data passes. Only
+// the stream's page buffer and the hash state are held in RAM, whatever
+// the size of the image. Data comes from u:write(), or straight from a
+// TCP socket's receive path with u:attach(). An LFS image is staged in the
+// free app slot the same way and copied into the lfs partition on commit.
+// A patch made by tools/mkpatch.py updates a single file instead, see
+// vfs_patch.h.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "buffer.h"
+#include "net.h"
+#include "node_ota.h"
+#include "platform.h"
+#include "platform_ota.h"
+#include "flash_stream.h"
+#include "lc_store.h"
+#include "vfs_patch.h"
+#include "esp_system.h"
+#include "esp_image_format.h"
+#include "mbedtls/sha256.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define OTA_OBJ       "node.ota"
+#define OTA_LINE      64      // longest HTTP header line looked at
+#define OTA_SHA_LEN   32
+
+enum { OTA_APP, OTA_LFS, OTA_PATCH };
+enum { OTA_WRITING, OTA_VERIFIED, OTA_FAILED };
+enum { HTTP_NONE, HTTP_STATUS, HTTP_HEADERS, HTTP_BODY };
+
+typedef struct {
+  flash_stream_t fs;
+  mbedtls_sha256_context sha;
+  platform_partition_t slot;  // where the data goes, for LFS as well
+  vfs_patch_t *patch;         // instead, for a patch
+  int target;
+  uint32_t fed;               // bytes of the image or patch so far
+  int state;
+  const char *err;
+  uint32_t expect;            // 0 until known
+  bool check;
+  uint8_t want[OTA_SHA_LEN];
+  uint8_t got[OTA_SHA_LEN];
+  // While attached to a socket
+  void *sock;
+  int sock_ref;
+  int cb_ref;
+  int self_ref;
+  int http;
+  uint8_t line_len;
+  char line[OTA_LINE];
+} ota_state_t;
+
+// The state is malloc'd rather than part of the userdata, so the page
+// buffer flash is programmed from is never in SPI RAM
+typedef struct {
+  ota_state_t *st;
+} ota_ud_t;
+
+static bool ota_busy;
+
+static ota_state_t *ota_check( lua_State *L )
+{
+  ota_ud_t *u = (ota_ud_t *)luaL_checkudata( L, 1, OTA_OBJ );
+  if (!u->st)
+    luaL_error( L, "update is closed" );
+  return u->st;
+}
+
+static void ota_fail( ota_state_t *st, const char *err )
+{
+  if (st->state == OTA_WRITING) {
+    st->state = OTA_FAILED;
+    st->err = err;
+  }
+}
+
+static void ota_feed( ota_state_t *st, const char *data, size_t len )
+{
+  if (st->expect && len > st->expect - st->fed)
+    return ota_fail( st, "more data than size" );
+  if (st->patch) {
+    if (!vfs_patch_write( st->patch, data, len ))
+      return ota_fail( st, vfs_patch_error( st->patch ) );
+  } else if (!flash_stream_write( &st->fs, data, len ))
+    return ota_fail( st, st->fed + len > st->fs.size ?
+                     "image too big" : "flash write failed" );
+  mbedtls_sha256_update( &st->sha, (const unsigned char *)data, len );
+  st->fed += len;
+}
+
+// Everything is in: check size, digest and what the image starts with
+static void ota_verify( ota_state_t *st )
+{
+  if (st->state != OTA_WRITING)
+    return;
+  if (!st->patch && !flash_stream_flush( &st->fs ))
+    return ota_fail( st, "flash write failed" );
+  uint32_t len = st->fed;
+  mbedtls_sha256_finish( &st->sha, st->got );
+  if (len == 0 || (st->expect && len != st->expect))
+    return ota_fail( st, "image incomplete" );
+  if (st->check && memcmp( st->got, st->want, OTA_SHA_LEN ) != 0)
+    return ota_fail( st, "sha256 mismatch" );
+  if (st->patch) {
+    if (!vfs_patch_finish( st->patch ))
+      return ota_fail( st, vfs_patch_error( st->patch ) );
+    st->state = OTA_VERIFIED;
+    return;
+  }
+
+  uint32_t head PLATFORM_ALIGNMENT;
+  platform_flash_read( &head, st->slot.offs, sizeof(head) );
+  if (st->target == OTA_APP) {
+    if ((head & 0xff) != ESP_IMAGE_HEADER_MAGIC)
+      return ota_fail( st, "not an app image" );
+  } else {
+    uint32_t used, total;
+    if (head != LC_STORE_MAGIC)
+      return ota_fail( st, "not an LFS image" );
+    if (!lc_store_info( LC_STORE_LFS, &used, &total ) || len > total)
+      return ota_fail( st, "LFS image too big" );
+  }
+  st->state = OTA_VERIFIED;
+}
+
+// Parse the HTTP response head; returns how much of data it took
+static size_t ota_http( ota_state_t *st, const char *data, size_t len )
+{
+  size_t i = 0;
+  while (i < len && st->http != HTTP_BODY && st->state == OTA_WRITING) {
+    char c = data[i++];
+    if (c == '\r')
+      continue;
+    if (c != '\n') {
+      if (st->line_len < OTA_LINE - 1)
+        st->line[st->line_len++] = c;
+      continue;
+    }
+    st->line[st->line_len] = 0;
+    if (st->http == HTTP_STATUS) {
+      const char *sp = strchr( st->line, ' ' );
+      if (strncmp( st->line, "HTTP/", 5 ) != 0 || !sp || atoi( sp + 1 ) != 200)
+        ota_fail( st, "HTTP status not 200" );
+      st->http = HTTP_HEADERS;
+    } else if (st->line_len == 0)
+      st->http = HTTP_BODY;
+    else if (strncasecmp( st->line, "content-length:", 15 ) == 0 && !st->expect)
+      st->expect = strtoul( st->line + 15, NULL, 10 );
+    else if (strncasecmp( st->line, "transfer-encoding:", 18 ) == 0)
+      ota_fail( st, "chunked encoding not supported" );
+    st->line_len = 0;
+  }
+  return i;
+}
+
+// Stop taking the socket's data and tell Lua how it went. The callback
+// may abort and free the update, so st isn't touched after it.
+static void ota_detach( lua_State *L, ota_state_t *st, bool report )
+{
+  if (!st->sock)
+    return;
+  net_tcp_set_rx_hook( st->sock, NULL, NULL );
+  st->sock = NULL;
+  int sock_ref = st->sock_ref, cb_ref = st->cb_ref, self_ref = st->self_ref;
+  st->sock_ref = st->cb_ref = st->self_ref = LUA_NOREF;
+  if (report) {
+    lua_rawgeti( L, LUA_REGISTRYINDEX, cb_ref );
+    lua_rawgeti( L, LUA_REGISTRYINDEX, self_ref );
+    lua_pushboolean( L, st->state == OTA_VERIFIED );
+    if (st->err)
+      lua_pushstring( L, st->err );
+    else
+      lua_pushnil( L );
+  }
+  luaL_unref( L, LUA_REGISTRYINDEX, sock_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, cb_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, self_ref );
+  if (report)
+    lua_call( L, 3, 0 );
+}
+
+// The socket's receive path; data is NULL once the connection is gone
+static void ota_rx( lua_State *L, void *arg, char *data, size_t len )
+{
+  ota_state_t *st = (ota_state_t *)arg;
+  if (!data) {
+    if (st->http != HTTP_NONE && st->http != HTTP_BODY)
+      ota_fail( st, "connection closed" );
+    ota_verify( st );
+  } else {
+    if (st->http != HTTP_NONE && st->http != HTTP_BODY) {
+      size_t n = ota_http( st, data, len );
+      data += n;
+      len -= n;
+    }
+    if (st->state == OTA_WRITING && len)
+      ota_feed( st, data, len );
+    if (st->state == OTA_WRITING && st->expect && st->fed == st->expect)
+      ota_verify( st );
+  }
+  if (st->state != OTA_WRITING)
+    ota_detach( L, st, true );
+}
+
+static bool ota_parse_sha( const char *s, size_t len, uint8_t *out )
+{
+  if (len == OTA_SHA_LEN) {
+    memcpy( out, s, OTA_SHA_LEN );
+    return true;
+  }
+  if (len != OTA_SHA_LEN * 2)
+    return false;
+  for (int i = 0; i < OTA_SHA_LEN * 2; i++) {
+    char c = s[i] | 0x20;
+    int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+    if (v < 0)
+      return false;
+    out[i / 2] = (out[i / 2] << 4) | v;
+  }
+  return true;
+}
+
+// Lua: u = node.ota.begin{ target = "app" | "lfs" | "patch", file = name,
+//                          size = n, sha256 = hex }
+// All fields but file, which a patch needs, are optional; without size the
+// data ends when the socket closes or u:finish() is called. sha256 is of
+// the data as sent, for a patch that's the patch itself.
+static int ota_begin( lua_State *L )
+{
+  static const char * const targets[] = { "app", "lfs", "patch", NULL };
+  int target = OTA_APP;
+  lua_Integer size = 0;
+  size_t shalen = 0;
+  const char *sha = NULL, *file = NULL;
+  if (!lua_isnoneornil( L, 1 )) {
+    luaL_checktype( L, 1, LUA_TTABLE );
+    lua_getfield( L, 1, "target" );
+    target = luaL_checkoption( L, -1, "app", targets );
+    lua_getfield( L, 1, "size" );
+    size = luaL_optinteger( L, -1, 0 );
+    lua_getfield( L, 1, "sha256" );
+    sha = luaL_optlstring( L, -1, NULL, &shalen );
+    lua_getfield( L, 1, "file" );
+    file = luaL_optstring( L, -1, NULL );
+    lua_pop( L, 4 );  // file stays referenced by the table
+  }
+
+  platform_partition_t slot;
+  if (target == OTA_PATCH) {
+    if (!file)
+      return luaL_error( L, "patch needs a file" );
+    memset( &slot, 0, sizeof(slot) );
+  } else if (!platform_ota_next( &slot ))
+    return luaL_error( L, "no OTA partitions" );
+  uint32_t used, total;
+  if (target == OTA_LFS && !lc_store_info( LC_STORE_LFS, &used, &total ))
+    return luaL_error( L, "no lfs partition" );
+  if (size < 0 || (target != OTA_PATCH && size > slot.size))
+    return luaL_error( L, "image too big" );
+  if (ota_busy)
+    return luaL_error( L, "update already in progress" );
+
+  ota_ud_t *u = (ota_ud_t *)lua_newuserdata( L, sizeof(ota_ud_t) );
+  u->st = NULL;
+  luaL_getmetatable( L, OTA_OBJ );
+  lua_setmetatable( L, -2 );
+  ota_state_t *st = (ota_state_t *)calloc( 1, sizeof(ota_state_t) );
+  if (!st)
+    return luaL_error( L, "out of memory" );
+  u->st = st;
+  ota_busy = true;
+
+  if (sha && !ota_parse_sha( sha, shalen, st->want ))
+    return luaL_error( L, "sha256 must be 32 bytes or 64 hex digits" );
+  st->check = sha != NULL;
+  st->slot = slot;
+  st->target = target;
+  st->state = OTA_WRITING;
+  st->expect = size;
+  st->sock_ref = st->cb_ref = st->self_ref = LUA_NOREF;
+  if (target == OTA_PATCH) {
+    st->patch = vfs_patch_open( file );
+    if (!st->patch)
+      return luaL_error( L, "out of memory" );
+  } else
+    flash_stream_init( &st->fs, slot.offs, slot.size );
+  mbedtls_sha256_init( &st->sha );
+  mbedtls_sha256_starts( &st->sha, 0 );
+  return 1;
+}
+
+// Lua: u:write(data)
+static int ota_write( lua_State *L )
+{
+  ota_state_t *st = ota_check( L );
+  size_t len;
+  const char *data = buffer_checklstring( L, 2, &len );
+  if (st->sock)
+    return luaL_error( L, "attached to a socket" );
+  if (st->state == OTA_WRITING)
+    ota_feed( st, data, len );
+  if (st->state == OTA_FAILED)
+    return luaL_error( L, st->err );
+  if (st->state != OTA_WRITING)
+    return luaL_error( L, "update is finished" );
+  return 0;
+}
+
+// Lua: u:attach(sock, function(u, ok, err) end[, http])
+// Takes the socket's incoming data from now on, without it passing through
+// Lua. With http true, the data is an HTTP response: the status must be 200
+// and Content-Length gives the size if begin() didn't. The callback gets
+// the result of u:finish() once size bytes are in or the connection closes.
+static int ota_attach( lua_State *L )
+{
+  ota_state_t *st = ota_check( L );
+  void *sock = net_tcp_check( L, 2 );
+  luaL_checkanyfunction( L, 3 );
+  bool http = lua_toboolean( L, 4 );
+  if (st->sock)
+    return luaL_error( L, "already attached" );
+  if (st->state != OTA_WRITING || st->fed != 0)
+    return luaL_error( L, "attach before writing" );
+
+  lua_pushvalue( L, 2 );
+  st->sock_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  lua_pushvalue( L, 3 );
+  st->cb_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  lua_pushvalue( L, 1 );
+  st->self_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  st->http = http ? HTTP_STATUS : HTTP_NONE;
+  st->line_len = 0;
+  st->sock = sock;
+  net_tcp_set_rx_hook( sock, ota_rx, st );
+  return 0;
+}
+
+// Lua: ok, digest_or_err = u:finish()
+// Ends the image and checks it; digest is the SHA-256 in hex
+static int ota_finish( lua_State *L )
+{
+  ota_state_t *st = ota_check( L );
+  ota_detach( L, st, false );
+  ota_verify( st );
+  if (st->state != OTA_VERIFIED) {
+    lua_pushnil( L );
+    lua_pushstring( L, st->err );
+    return 2;
+  }
+  char hex[OTA_SHA_LEN * 2];
+  for (int i = 0; i < OTA_SHA_LEN; i++) {
+    hex[i * 2] = "0123456789abcdef"[st->got[i] >> 4];
+    hex[i * 2 + 1] = "0123456789abcdef"[st->got[i] & 15];
+  }
+  lua_pushboolean( L, 1 );
+  lua_pushlstring( L, hex, sizeof(hex) );
+  return 2;
+}
+
+// Copy the staged image into the lfs partition. Nothing mapped from the
+// old image may run after this, so the caller restarts.
+static bool ota_copy_lfs( ota_state_t *st )
+{
+  platform_partition_t lfs;
+  uint8_t buf[FLASH_STREAM_PAGE] PLATFORM_ALIGNMENT;
+  uint32_t len = flash_stream_len( &st->fs );
+  uint8_t i = 0;
+  bool found = false;
+  while (!found && platform_partition_info( i++, &lfs ))
+    found = lfs.type == PLATFORM_PARTITION_TYPE_NODEMCU &&
+            lfs.subtype == PLATFORM_PARTITION_SUBTYPE_NODEMCU_LFS;
+  if (!found)
+    return false;
+  flash_stream_init( &st->fs, lfs.offs, lfs.size );
+  for (uint32_t offs = 0; offs < len; offs += sizeof(buf)) {
+    uint32_t n = len - offs < sizeof(buf) ? len - offs : sizeof(buf);
+    if (platform_flash_read( buf, st->slot.offs + offs, n ) != n ||
+        !flash_stream_write( &st->fs, buf, n ))
+      return false;
+  }
+  return flash_stream_flush( &st->fs );
+}
+
+// Lua: u:commit()
+// For an app image, boots the new slot from the next restart on. For an
+// LFS image, replaces the lfs partition and restarts at once. For a patch,
+// replaces the file with the patched one.
+static int ota_commit( lua_State *L )
+{
+  ota_state_t *st = ota_check( L );
+  if (st->state != OTA_VERIFIED)
+    return luaL_error( L, "update not finished" );
+  if (st->target == OTA_PATCH) {
+    if (!vfs_patch_commit( st->patch ))
+      return luaL_error( L, vfs_patch_error( st->patch ) );
+    return 0;
+  }
+  if (st->target == OTA_APP) {
+    if (!platform_ota_set_boot( &st->slot ))
+      return luaL_error( L, "can't write otadata" );
+    return 0;
+  }
+  if (!ota_copy_lfs( st ))
+    return luaL_error( L, "LFS write failed, old image lost" );
+  system_restart();
+  return 0;
+}
+
+static void ota_free( lua_State *L, ota_ud_t *u )
+{
+  if (!u->st)
+    return;
+  ota_detach( L, u->st, false );
+  if (u->st->patch)
+    vfs_patch_close( u->st->patch );
+  mbedtls_sha256_free( &u->st->sha );
+  free( u->st );
+  u->st = NULL;
+  ota_busy = false;
+}
+
+// Lua: u:abort()
+// Drops the update; the slot it was going to is left as it is
+static int ota_abort( lua_State *L )
+{
+  ota_free( L, (ota_ud_t *)luaL_checkudata( L, 1, OTA_OBJ ) );
+  return 0;
+}
+
+// Lua: written, size, state = u:status()
+// size is nil while unknown; state is "writing", "verified" or the error
+static int ota_status( lua_State *L )
+{
+  ota_state_t *st = ota_check( L );
+  lua_pushinteger( L, st->fed );
+  if (st->expect)
+    lua_pushinteger( L, st->expect );
+  else
+    lua_pushnil( L );
+  lua_pushstring( L, st->state == OTA_WRITING ? "writing" :
+                     st->state == OTA_VERIFIED ? "verified" : st->err );
+  return 3;
+}
+
+static int ota_gc( lua_State *L )
+{
+  ota_free( L, (ota_ud_t *)luaL_checkudata( L, 1, OTA_OBJ ) );
+  return 0;
+}
+
+// Lua: running, next = node.ota.info()
+// Labels of the app slot running and the one an update would go to
+static int ota_info( lua_State *L )
+{
+  platform_partition_t run, next;
+  if (!platform_ota_running( &run ) || !platform_ota_next( &next ))
+    return 0;
+  lua_pushlstring( L, (const char *)run.label, strnlen( (const char *)run.label, sizeof(run.label) ) );
+  lua_pushlstring( L, (const char *)next.label, strnlen( (const char *)next.label, sizeof(next.label) ) );
+  return 2;
+}
+
+static const LUA_REG_TYPE ota_obj_map[] = {
+  { LSTRKEY( "write" ),   LFUNCVAL( ota_write ) },
+  { LSTRKEY( "attach" ),  LFUNCVAL( ota_attach ) },
+  { LSTRKEY( "finish" ),  LFUNCVAL( ota_finish ) },
+  { LSTRKEY( "commit" ),  LFUNCVAL( ota_commit ) },
+  { LSTRKEY( "abort" ),   LFUNCVAL( ota_abort ) },
+  { LSTRKEY( "status" ),  LFUNCVAL( ota_status ) },
+  { LSTRKEY( "__gc" ),    LFUNCVAL( ota_gc ) },
+  { LSTRKEY( "__index" ), LROVAL( ota_obj_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+const LUA_REG_TYPE node_ota_map[] = {
+  { LSTRKEY( "begin" ), LFUNCVAL( ota_begin ) },
+  { LSTRKEY( "info" ),  LFUNCVAL( ota_info ) },
+  { LNILKEY, LNILVAL }
+};
+
+void node_ota_open( lua_State *L )
+{
+  luaL_rometatable( L, OTA_OBJ, (void *)ota_obj_map );
+}
@@ -0,0 +1,368 @@
+// Module for counting pulses with the pulse counter peripheral
+//
+// Edges are counted, filtered and steered in hardware, so the CPU sees
+// nothing of them until a watch point is reached or a frequency window
+// ends. Both come to Lua through the task layer. The hardware count is
+// 16 bits; the driver carries it over into a 64 bit total.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "platform.h"
+#include "c_types.h"
+#include "rom/gpio.h"
+#include "pcnt_hw.h"
+#include "task/task.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_attr.h"
+
+#define PCNT_OBJ        "pcnt.unit"
+#define PCNT_APB_MHZ    80      // the filter counts APB cycles
+
+typedef struct {
+  bool used;
+  volatile bool hit;      // a watch point was reached, set in the interrupt
+  uint8_t freq_gen;       // tells a window of a stopped measurement from a live one
+  uint16_t watch;         // 0 for none
+  int self_ref;           // held while a function is set, so it gets called
+  int watch_ref, freq_ref;
+  os_timer_t timer;
+  uint32_t window_ms;     // 0 when not measuring
+  uint32_t last_us;
+  int64_t last_count;
+  double hz;
+} pcnt_unit_t;
+
+typedef struct {
+  uint8_t unit;
+  bool closed;
+} pcnt_ud_t;
+
+static pcnt_unit_t units[PCNT_HW_UNITS];
+static task_handle_t watch_task, freq_task;
+
+static const char * const edge_names[] = { "none", "up", "down", NULL };
+static const char * const ctrl_names[] = { "keep", "reverse", "hold", NULL };
+
+static pcnt_ud_t *check_open( lua_State *L )
+{
+  pcnt_ud_t *p = (pcnt_ud_t *)luaL_checkudata( L, 1, PCNT_OBJ );
+  if (p->closed)
+    luaL_error( L, "closed" );
+  return p;
+}
+
+static void push_count( lua_State *L, int64_t n )
+{
+  lua_pushnumber( L, (lua_Number)n );
+}
+
+// The object is kept from the collector while it has a function to call
+static void hold_self( lua_State *L, pcnt_unit_t *u )
+{
+  bool want = u->watch_ref != LUA_NOREF || u->freq_ref != LUA_NOREF;
+  if (want && u->self_ref == LUA_NOREF) {
+    lua_pushvalue( L, 1 );
+    u->self_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  } else if (!want && u->self_ref != LUA_NOREF) {
+    luaL_unref( L, LUA_REGISTRYINDEX, u->self_ref );
+    u->self_ref = LUA_NOREF;
+  }
+}
+
+static void set_ref( lua_State *L, int *ref, int idx )
+{
+  luaL_unref( L, LUA_REGISTRYINDEX, *ref );
+  *ref = LUA_NOREF;
+  if (idx) {
+    lua_pushvalue( L, idx );
+    *ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+}
+
+static bool is_function( lua_State *L, int idx )
+{
+  return lua_type( L, idx ) == LUA_TFUNCTION || lua_type( L, idx ) == LUA_TLIGHTFUNCTION;
+}
+
+// Interrupt: a watch point, or the default limit, was reached
+static void IRAM_ATTR pcnt_limit_cb( unsigned unit, int64_t total, void *arg )
+{
+  pcnt_unit_t *u = &units[unit];
+  if (!u->watch)
+    return;
+  u->hit = true;
+  task_post_coalesced_low( watch_task, 0 );
+}
+
+// Lua task: fn(p, count) once for each unit whose watch point was reached
+// since the last time round
+static void pcnt_watch_handler( task_param_t param, task_prio_t prio )
+{
+  (void)param; (void)prio;
+  lua_State *L = lua_getstate();
+  for (unsigned unit = 0; unit < PCNT_HW_UNITS; unit++) {
+    pcnt_unit_t *u = &units[unit];
+    if (!u->hit)
+      continue;
+    u->hit = false;
+    if (!u->used || u->watch_ref == LUA_NOREF)
+      continue;
+    lua_rawgeti( L, LUA_REGISTRYINDEX, u->watch_ref );
+    lua_rawgeti( L, LUA_REGISTRYINDEX, u->self_ref );
+    push_count( L, pcnt_hw_count( unit ) );
+    lua_call( L, 2, 0 );
+  }
+}
+
+static void pcnt_timer_cb( void *arg )
+{
+  unsigned unit = (pcnt_unit_t *)arg - units;
+  task_post_low( freq_task, (task_param_t)(unit | units[unit].freq_gen << 8) );
+}
+
+// Lua task: a frequency window is over
+static void pcnt_freq_handler( task_param_t param, task_prio_t prio )
+{
+  (void)prio;
+  unsigned unit = param & 0xff;
+  pcnt_unit_t *u = &units[unit];
+  if (!u->used || !u->window_ms || u->freq_gen != ((param >> 8) & 0xff))
+    return;               // stopped since
+  uint32_t now = system_get_time();
+  int64_t count = pcnt_hw_count( unit );
+  uint32_t dt = now - u->last_us;
+  // A late event makes for a longer window, not a wrong rate
+  if (dt)
+    u->hz = (double)(count - u->last_count) * 1000000.0 / dt;
+  u->last_us = now;
+  u->last_count = count;
+  if (u->freq_ref == LUA_NOREF)
+    return;
+  lua_State *L = lua_getstate();
+  lua_rawgeti( L, LUA_REGISTRYINDEX, u->freq_ref );
+  lua_rawgeti( L, LUA_REGISTRYINDEX, u->self_ref );
+  lua_pushnumber( L, u->hz );
+  lua_call( L, 2, 0 );
+}
+
+static void freq_stop( pcnt_unit_t *u )
+{
+  os_timer_disarm( &u->timer );
+  u->window_ms = 0;
+  u->freq_gen++;
+}
+
+static int opt_option( lua_State *L, const char *name, const char * const names[], int dflt )
+{
+  lua_getfield( L, 3, name );
+  int v = lua_isnil( L, -1 ) ? dflt : luaL_checkoption( L, -1, NULL, names );
+  lua_pop( L, 1 );
+  return v;
+}
+
+// Lua: p = pcnt.setup( unit, pin[, { ctrl=pin, rising="up", falling="none", ctrl_high="keep", ctrl_low="keep", filter=ns }] )
+// Count the edges of pin on unit 0-7, from 0. rising and falling are
+// "up", "down" or "none"; while the ctrl pin (if any) is high or low the
+// edges count as set ("keep"), the other way round ("reverse") or not at
+// all ("hold"). Pulses shorter than filter ns, up to 12787, are ignored.
+static int pcnt_setup( lua_State *L )
+{
+  unsigned unit = luaL_checkinteger( L, 1 );
+  int pin = luaL_checkinteger( L, 2 );
+  luaL_argcheck( L, unit < PCNT_HW_UNITS, 1, "wrong unit" );
+  luaL_argcheck( L, pin >= 0 && pin < GPIO_PIN_COUNT, 2, "wrong pin" );
+  luaL_argcheck( L, !units[unit].used, 1, "unit in use" );
+
+  pcnt_hw_config_t c = {
+    .pulse_pin = pin, .ctrl_pin = -1,
+    .pos_mode = PCNT_HW_INC, .neg_mode = PCNT_HW_KEEP,
+    .ctrl_high = PCNT_HW_CTRL_KEEP, .ctrl_low = PCNT_HW_CTRL_KEEP,
+    .limit = PCNT_HW_MAX_LIMIT,
+  };
+  if (!lua_isnoneornil( L, 3 )) {
+    luaL_checktype( L, 3, LUA_TTABLE );
+    lua_getfield( L, 3, "ctrl" );
+    c.ctrl_pin = luaL_optinteger( L, -1, -1 );
+    lua_pop( L, 1 );
+    luaL_argcheck( L, c.ctrl_pin >= -1 && c.ctrl_pin < GPIO_PIN_COUNT, 3, "wrong ctrl pin" );
+    c.pos_mode = opt_option( L, "rising", edge_names, PCNT_HW_INC );
+    c.neg_mode = opt_option( L, "falling", edge_names, PCNT_HW_KEEP );
+    c.ctrl_high = opt_option( L, "ctrl_high", ctrl_names, PCNT_HW_CTRL_KEEP );
+    c.ctrl_low = opt_option( L, "ctrl_low", ctrl_names, PCNT_HW_CTRL_KEEP );
+    lua_getfield( L, 3, "filter" );
+    int ns = luaL_optinteger( L, -1, 0 );
+    lua_pop( L, 1 );
+    int cycles = (ns * PCNT_APB_MHZ + 999) / 1000;
+    luaL_argcheck( L, ns >= 0 && cycles <= PCNT_HW_MAX_FILTER, 3, "wrong filter" );
+    c.filter = cycles;
+  }
+
+  pcnt_ud_t *p = (pcnt_ud_t *)lua_newuserdata( L, sizeof(pcnt_ud_t) );
+  p->unit = unit;
+  p->closed = true;       // until it's set up, for __gc
+  luaL_getmetatable( L, PCNT_OBJ );
+  lua_setmetatable( L, -2 );
+
+  pcnt_unit_t *u = &units[unit];
+  u->hit = false;
+  u->watch = 0;
+  u->self_ref = u->watch_ref = u->freq_ref = LUA_NOREF;
+  u->window_ms = 0;
+  u->hz = 0;
+  os_timer_setfn( &u->timer, pcnt_timer_cb, u );
+  if (pcnt_hw_setup( unit, &c, pcnt_limit_cb, NULL ) < 0)
+    return luaL_error( L, "wrong config" );
+  u->used = true;
+  p->closed = false;
+  return 1;
+}
+
+// Lua: n = p:count()
+static int pcnt_count( lua_State *L )
+{
+  pcnt_ud_t *p = check_open( L );
+  push_count( L, pcnt_hw_count( p->unit ) );
+  return 1;
+}
+
+// Lua: p:clear()
+// Back to 0. A running frequency measurement starts its window over.
+static int pcnt_clear( lua_State *L )
+{
+  pcnt_ud_t *p = check_open( L );
+  pcnt_unit_t *u = &units[p->unit];
+  pcnt_hw_clear( p->unit );
+  u->last_count = 0;
+  u->last_us = system_get_time();
+  return 0;
+}
+
+// Lua: p:pause()
+static int pcnt_pause( lua_State *L )
+{
+  pcnt_ud_t *p = check_open( L );
+  pcnt_hw_pause( p->unit, true );
+  return 0;
+}
+
+// Lua: p:resume()
+static int pcnt_resume( lua_State *L )
+{
+  pcnt_ud_t *p = check_open( L );
+  pcnt_hw_pause( p->unit, false );
+  return 0;
+}
+
+// Lua: p:watch( n, function(p, count) )
+// Call the function each time the count moves n, 1 to 32767, either way
+// from where it last did, or from where it is now. Only the hardware
+// looks at the edges in between; calls the Lua task is too busy for
+// come as one. p:watch() stops it.
+static int pcnt_watch( lua_State *L )
+{
+  pcnt_ud_t *p = check_open( L );
+  pcnt_unit_t *u = &units[p->unit];
+  int n = luaL_optinteger( L, 2, 0 );
+  if (n) {
+    luaL_argcheck( L, n > 0 && n <= PCNT_HW_MAX_LIMIT, 2, "wrong count" );
+    luaL_argcheck( L, is_function( L, 3 ), 3, "function expected" );
+  }
+  u->watch = 0;
+  u->hit = false;
+  set_ref( L, &u->watch_ref, n ? 3 : 0 );
+  hold_self( L, u );
+  pcnt_hw_set_limit( p->unit, n ? n : PCNT_HW_MAX_LIMIT );
+  u->watch = n;
+  return 0;
+}
+
+// Lua: p:freq( ms[, function(p, hz)] )
+// Measure the pulse rate over windows of ms, each handed to the function
+// if given. p:freq(0) stops it.
+// Lua: hz = p:freq()
+// The rate over the last window, 0 before one has ended.
+static int pcnt_freq( lua_State *L )
+{
+  pcnt_ud_t *p = check_open( L );
+  pcnt_unit_t *u = &units[p->unit];
+  if (lua_isnoneornil( L, 2 )) {
+    lua_pushnumber( L, u->hz );
+    return 1;
+  }
+  int ms = luaL_checkinteger( L, 2 );
+  luaL_argcheck( L, ms >= 0, 2, "wrong window" );
+  bool has_fn = !lua_isnoneornil( L, 3 );
+  if (has_fn)
+    luaL_argcheck( L, is_function( L, 3 ), 3, "function expected" );
+
+  freq_stop( u );
+  set_ref( L, &u->freq_ref, ms && has_fn ? 3 : 0 );
+  hold_self( L, u );
+  if (!ms)
+    return 0;
+  u->hz = 0;
+  u->window_ms = ms;
+  u->last_count = pcnt_hw_count( p->unit );
+  u->last_us = system_get_time();
+  os_timer_arm( &u->timer, ms, 1 );
+  return 0;
+}
+
+// Lua: p:close()
+// Stop counting and let go of the unit and its pins.
+static int pcnt_close( lua_State *L )
+{
+  pcnt_ud_t *p = (pcnt_ud_t *)luaL_checkudata( L, 1, PCNT_OBJ );
+  if (p->closed)
+    return 0;
+  p->closed = true;
+  pcnt_unit_t *u = &units[p->unit];
+  freq_stop( u );
+  pcnt_hw_release( p->unit );
+  u->used = false;
+  u->watch = 0;
+  set_ref( L, &u->watch_ref, 0 );
+  set_ref( L, &u->freq_ref, 0 );
+  hold_self( L, u );
+  return 0;
+}
+
+static const LUA_REG_TYPE pcnt_unit_map[] = {
+  { LSTRKEY( "count" ),   LFUNCVAL( pcnt_count ) },
+  { LSTRKEY( "clear" ),   LFUNCVAL( pcnt_clear ) },
+  { LSTRKEY( "pause" ),   LFUNCVAL( pcnt_pause ) },
+  { LSTRKEY( "resume" ),  LFUNCVAL( pcnt_resume ) },
+  { LSTRKEY( "watch" ),   LFUNCVAL( pcnt_watch ) },
+  { LSTRKEY( "freq" ),    LFUNCVAL( pcnt_freq ) },
+  { LSTRKEY( "close" ),   LFUNCVAL( pcnt_close ) },
+  { LNILKEY, LNILVAL }
+};
+
+static const LUA_REG_TYPE pcnt_unit_meta[] = {
+  { LSTRKEY( "__gc" ),    LFUNCVAL( pcnt_close ) },
+  { LSTRKEY( "__index" ), LROVAL( pcnt_unit_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+// Module function map
+const LUA_REG_TYPE pcnt_map[] = {
+  { LSTRKEY( "setup" ),   LFUNCVAL( pcnt_setup ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_pcnt( lua_State *L )
+{
+  luaL_rometatable( L, PCNT_OBJ, (void *)pcnt_unit_meta );
+  watch_task = task_get_id( pcnt_watch_handler );
+  freq_task = task_get_id( pcnt_freq_handler );
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_PCNTLIBNAME, pcnt_map );
+  return 1;
+#endif
+}
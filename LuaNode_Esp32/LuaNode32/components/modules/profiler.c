@@ -0,0 +1,252 @@
+// Module for sampling where Lua time goes, with folded stack output
+//
+// A timer marks a sample due every period. A count hook on the Lua state
+// checks the mark every few hundred VM instructions and, when it is set,
+// walks the stack with lua_getstack()/lua_getinfo(). Samples are counted
+// per folded stack ("outer;inner;leaf") in a registry table, which is the
+// input format of flamegraph.pl and speedscope. Between samples the hook
+// only tests a flag, so profiling can stay on in production.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "c_stdio.h"
+#include "c_string.h"
+#include "esp_timer.h"
+#include "vfs.h"
+#include "sdkconfig.h"
+
+#define PROF_PERIOD_MS   10
+#define PROF_COUNT       500    // instructions between checks of the mark
+#define PROF_DEPTH       16
+#define PROF_MAX_DEPTH   64
+
+static os_timer_t prof_timer;
+static volatile uint8_t prof_due;
+static bool prof_running;
+static int prof_ref = LUA_NOREF;   // folded stack -> samples
+static int prof_depth = PROF_DEPTH;
+static bool prof_lines = true;
+static uint32_t prof_samples, prof_idle, prof_dropped, prof_stacks;
+
+// Runs in the timer task
+static void prof_tick( void *arg )
+{
+  (void)arg;
+  if (prof_due)
+    prof_idle++;    // no Lua code ran since the last tick
+  else
+    prof_due = 1;
+}
+
+static void prof_frame( luaL_Buffer *b, lua_Debug *ar )
+{
+  char num[12];
+  if (*ar->what == 'm') {
+    luaL_addstring(b, "main");
+  } else {
+    luaL_addstring(b, ar->name ? ar->name : "?");
+  }
+  luaL_addchar(b, '@');
+  luaL_addstring(b, ar->short_src);
+  if (*ar->what != 'C' && *ar->what != 'm') {
+    c_sprintf(num, ":%d", ar->linedefined);
+    luaL_addstring(b, num);
+  }
+}
+
+static void prof_hook( lua_State *L, lua_Debug *ar )
+{
+  (void)ar;
+  if (!prof_due)
+    return;
+  prof_due = 0;
+
+  lua_Debug d;
+  int n = 0;
+  while (n < prof_depth && lua_getstack(L, n, &d))
+    n++;
+  if (n == 0)
+    return;
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, prof_ref);
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  for (int level = n - 1; level >= 0; level--) {
+    lua_getstack(L, level, &d);
+    lua_getinfo(L, "Sln", &d);
+    if (level != n - 1)
+      luaL_addchar(&b, ';');
+    prof_frame(&b, &d);
+    if (level == 0 && prof_lines && d.currentline > 0) {
+      char line[24];
+      c_sprintf(line, ";line %d", d.currentline);
+      luaL_addstring(&b, line);
+    }
+  }
+  luaL_pushresult(&b);
+
+  lua_pushvalue(L, -1);
+  lua_rawget(L, -3);    // table, stack, count
+  if (lua_isnil(L, -1) && prof_stacks >= CONFIG_PROFILER_MAX_STACKS) {
+    prof_dropped++;
+    lua_pop(L, 3);
+  } else {
+    if (lua_isnil(L, -1))
+      prof_stacks++;
+    lua_Integer count = lua_tointeger(L, -1) + 1;
+    lua_pop(L, 1);
+    lua_pushinteger(L, count);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+  }
+  prof_samples++;
+}
+
+static void prof_reset( lua_State *L )
+{
+  luaL_unref(L, LUA_REGISTRYINDEX, prof_ref);
+  lua_newtable(L);
+  prof_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  prof_samples = prof_idle = prof_dropped = prof_stacks = 0;
+}
+
+// Lua: profiler.start( [{period=ms, depth=n, count=n, lines=bool}] )
+// Samples every period ms (10). Stacks keep their innermost depth frames
+// (16) and end with the line being run unless lines is false. count is
+// how many VM instructions run between checks for a due sample (500).
+// Coroutines created before start() are not sampled.
+static int profiler_start( lua_State *L )
+{
+  int period = PROF_PERIOD_MS, count = PROF_COUNT;
+  lua_Hook hook = lua_gethook(L);
+  if (hook != NULL && hook != prof_hook)
+    return luaL_error(L, "another hook is set");
+
+  prof_depth = PROF_DEPTH;
+  prof_lines = true;
+  if (lua_istable(L, 1)) {
+    lua_getfield(L, 1, "period");
+    period = luaL_optint(L, -1, period);
+    lua_getfield(L, 1, "depth");
+    prof_depth = luaL_optint(L, -1, prof_depth);
+    lua_getfield(L, 1, "count");
+    count = luaL_optint(L, -1, count);
+    lua_getfield(L, 1, "lines");
+    if (!lua_isnil(L, -1))
+      prof_lines = lua_toboolean(L, -1);
+    lua_pop(L, 4);
+  } else if (!lua_isnoneornil(L, 1)) {
+    return luaL_typerror(L, 1, "table");
+  }
+  luaL_argcheck(L, period > 0, 1, "period must be positive");
+  luaL_argcheck(L, count > 0, 1, "count must be positive");
+  luaL_argcheck(L, prof_depth > 0 && prof_depth <= PROF_MAX_DEPTH, 1, "depth out of range");
+
+  if (prof_ref == LUA_NOREF)
+    prof_reset(L);
+  if (prof_running)
+    os_timer_disarm(&prof_timer);
+  prof_due = 0;
+  lua_sethook(L, prof_hook, LUA_MASKCOUNT, count);
+  os_timer_setfn(&prof_timer, prof_tick, NULL);
+  os_timer_arm(&prof_timer, period, 1);
+  prof_running = true;
+  return 0;
+}
+
+// Lua: profiler.stop()
+// Samples taken so far are kept for dump().
+static int profiler_stop( lua_State *L )
+{
+  if (prof_running) {
+    os_timer_disarm(&prof_timer);
+    if (lua_gethook(L) == prof_hook)
+      lua_sethook(L, NULL, 0, 0);
+    prof_running = false;
+  }
+  return 0;
+}
+
+// Lua: profiler.reset()
+static int profiler_reset( lua_State *L )
+{
+  prof_reset(L);
+  return 0;
+}
+
+// Lua: lines = profiler.dump( [filename] )
+// Writes one "stack count" line per sampled stack to the file, or to the
+// console when no filename is given.
+static int profiler_dump( lua_State *L )
+{
+  const char *fname = luaL_optstring(L, 1, NULL);
+  int fd = 0, lines = 0;
+  if (fname) {
+    fd = vfs_open(fname, "w");
+    if (!fd)
+      return luaL_error(L, "cannot open %s", fname);
+  }
+  if (prof_ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, prof_ref);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      size_t len;
+      const char *stack = lua_tolstring(L, -2, &len);
+      char count[16];
+      c_sprintf(count, " %d\n", (int)lua_tointeger(L, -1));
+      if (fd) {
+        if (vfs_write(fd, stack, len) != len ||
+            vfs_write(fd, count, c_strlen(count)) != c_strlen(count)) {
+          vfs_close(fd);
+          return luaL_error(L, "writing to file failed");
+        }
+      } else {
+        output_redirect(stack);
+        output_redirect(count);
+      }
+      lines++;
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+  if (fd)
+    vfs_close(fd);
+  lua_pushinteger(L, lines);
+  return 1;
+}
+
+// Lua: samples, idle, dropped, stacks = profiler.stats()
+// idle counts periods in which no Lua code ran; dropped counts samples of
+// new stacks once PROFILER_MAX_STACKS are held.
+static int profiler_stats( lua_State *L )
+{
+  lua_pushinteger(L, prof_samples);
+  lua_pushinteger(L, prof_idle);
+  lua_pushinteger(L, prof_dropped);
+  lua_pushinteger(L, prof_stacks);
+  return 4;
+}
+
+// Module function map
+const LUA_REG_TYPE profiler_map[] = {
+  { LSTRKEY( "start" ),  LFUNCVAL( profiler_start ) },
+  { LSTRKEY( "stop" ),   LFUNCVAL( profiler_stop ) },
+  { LSTRKEY( "reset" ),  LFUNCVAL( profiler_reset ) },
+  { LSTRKEY( "dump" ),   LFUNCVAL( profiler_dump ) },
+  { LSTRKEY( "stats" ),  LFUNCVAL( profiler_stats ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_profiler(lua_State *L)
+{
+#if LUA_OPTIMIZE_MEMORY > 0
+    return 0;
+#else
+	luaL_register( L, LUA_PROFILERLIBNAME, profiler_map );
+	return 1;
+#endif
+}
@@ -5,6 +5,17 @@
 #include "platform.h"
 #include "c_types.h"
 #include "lualib.h"
+#include "rom.h"
+#include "task/task.h"
+
+// Callback of the fade running on each pin. The generation goes up whenever
+// a fade is started or stopped, so a completion posted for an older fade is
+// dropped.
+static int fade_ref[NUM_PWM];
+static uint8_t fade_gen[NUM_PWM];
+static task_handle_t fade_task;
+
+#define FADE_ARG(pin, gen)  ((task_param_t)((pin) | ((gen) << 8)))
 
 // Lua: realfrequency = setup( id, frequency, duty )
 static int lpwm_setup( lua_State* L )
@@ -31,6 +42,133 @@ static int lpwm_setup( lua_State* L )
   return 1;  
 }
 
+// Runs in the LEDC interrupt
+static void lpwm_fade_done( unsigned chan, void *arg )
+{
+  (void)chan;
+  task_post_low( fade_task, (task_param_t)arg );
+}
+
+static void lpwm_fade_task( task_param_t param, task_prio_t prio )
+{
+  (void)prio;
+  unsigned pin = param & 0xff;
+  if ( pin >= NUM_PWM || fade_gen[pin] != ((param >> 8) & 0xff) )
+    return;
+  int ref = fade_ref[pin];
+  fade_ref[pin] = LUA_NOREF;
+  if ( ref == LUA_NOREF )
+    return;
+  lua_State *L = lua_getstate();
+  lua_rawgeti( L, LUA_REGISTRYINDEX, ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, ref );
+  lua_pushinteger( L, pin );
+  lua_call( L, 1, 0 );
+}
+
+// Stops whatever fade pin is running and forgets its callback
+static void lpwm_fade_cancel( lua_State *L, unsigned pin )
+{
+  if ( !fade_task || pin >= NUM_PWM )
+    return;
+  platform_pwm_fade_stop( pin );
+  fade_gen[pin]++;
+  luaL_unref( L, LUA_REGISTRYINDEX, fade_ref[pin] );
+  fade_ref[pin] = LUA_NOREF;
+}
+
+// Starts the keyframes on the pin at 1, with the callback at cb_idx
+static int lpwm_fade_start( lua_State *L, const platform_pwm_key_t *keys, unsigned num, bool repeat, int cb_idx )
+{
+  unsigned id = luaL_checkinteger( L, 1 );
+  if ( id == 0 || id >= NUM_PWM )
+    return luaL_error( L, "no pwm for D%d", id );
+  bool cb = lua_type( L, cb_idx ) == LUA_TFUNCTION || lua_type( L, cb_idx ) == LUA_TLIGHTFUNCTION;
+  if ( !fade_task ) {
+    fade_task = task_get_id( lpwm_fade_task );
+    for ( unsigned i = 0; i < NUM_PWM; i++ )
+      fade_ref[i] = LUA_NOREF;
+  }
+
+  lpwm_fade_cancel( L, id );
+  if ( cb && !repeat ) {
+    lua_pushvalue( L, cb_idx );
+    fade_ref[id] = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  if ( platform_pwm_fade( id, keys, num, repeat, lpwm_fade_done, (void *)FADE_ARG( id, fade_gen[id] ) ) ) {
+    luaL_unref( L, LUA_REGISTRYINDEX, fade_ref[id] );
+    fade_ref[id] = LUA_NOREF;
+    return luaL_error( L, "pwm not set up" );
+  }
+  return 0;
+}
+
+static uint32_t lpwm_check_duty( lua_State *L, int idx )
+{
+  lua_Integer duty = luaL_checkinteger( L, idx );
+  luaL_argcheck( L, duty >= 0 && duty <= NORMAL_PWM_DEPTH, idx, "wrong duty" );
+  return duty;
+}
+
+static uint32_t lpwm_check_ms( lua_State *L, int idx )
+{
+  lua_Integer ms = luaL_checkinteger( L, idx );
+  luaL_argcheck( L, ms >= 0, idx, "wrong time" );
+  return ms;
+}
+
+// Lua: fade( id, duty, ms[, function(id)] )
+// Ramps the duty from where it is to duty over ms milliseconds, in the
+// LEDC, and calls the function once it gets there. Replaces any fade the
+// pin is already running.
+static int lpwm_fade( lua_State* L )
+{
+  platform_pwm_key_t key;
+  key.duty = lpwm_check_duty( L, 2 );
+  key.ms = lpwm_check_ms( L, 3 );
+  return lpwm_fade_start( L, &key, 1, false, 4 );
+}
+
+// Lua: sequence( id, { {duty, ms}, ... }[, repeat][, function(id)] )
+// Fades through the keyframes one after the other. With repeat true the
+// sequence starts over after the last keyframe until stopfade or another
+// fade, and the function is never called.
+static int lpwm_sequence( lua_State* L )
+{
+  platform_pwm_key_t keys[PLATFORM_PWM_MAX_KEYS];
+  luaL_checktype( L, 2, LUA_TTABLE );
+  size_t num = lua_objlen( L, 2 );
+  luaL_argcheck( L, num > 0 && num <= PLATFORM_PWM_MAX_KEYS, 2, "wrong number of keyframes" );
+  for ( size_t i = 0; i < num; i++ ) {
+    lua_rawgeti( L, 2, i + 1 );
+    luaL_checktype( L, -1, LUA_TTABLE );
+    lua_rawgeti( L, -1, 1 );
+    lua_rawgeti( L, -2, 2 );
+    keys[i].duty = lpwm_check_duty( L, -2 );
+    keys[i].ms = lpwm_check_ms( L, -1 );
+    lua_pop( L, 3 );
+  }
+  bool repeat = false;
+  int cb_idx = 3;
+  if ( lua_isboolean( L, 3 ) ) {
+    repeat = lua_toboolean( L, 3 );
+    cb_idx = 4;
+  }
+  return lpwm_fade_start( L, keys, num, repeat, cb_idx );
+}
+
+// Lua: duty = stopfade( id )
+// Stops the pin's fade where it is, without calling its function.
+static int lpwm_stopfade( lua_State* L )
+{
+  unsigned id = luaL_checkinteger( L, 1 );
+  if ( id >= NUM_PWM )
+    return luaL_error( L, "wrong arg range" );
+  lpwm_fade_cancel( L, id );
+  lua_pushinteger( L, platform_pwm_get_duty( id ) );
+  return 1;
+}
+
 // Lua: close( id )
 static int lpwm_close( lua_State* L )
 {
@@ -38,6 +176,7 @@ static int lpwm_close( lua_State* L )
   
   id = luaL_checkinteger( L, 1 );
   //MOD_CHECK_ID( pwm, id );
+  lpwm_fade_cancel( L, id );
   platform_pwm_close( id );
   return 0;  
 }
@@ -57,6 +196,7 @@ static int lpwm_stop( lua_State* L )
   
   id = luaL_checkinteger( L, 1 );
   //MOD_CHECK_ID( pwm, id );
+  lpwm_fade_cancel( L, id );
   platform_pwm_stop( id );
   return 0;  
 }
@@ -101,6 +241,7 @@ static int lpwm_setduty( lua_State* L )
   duty = luaL_checkinteger( L, 2 );
   if ( duty > NORMAL_PWM_DEPTH )
     return luaL_error( L, "wrong arg range" );
+  lpwm_fade_cancel( L, id );
   duty = platform_pwm_set_duty( id, (u32)duty );
   lua_pushinteger( L, duty );
   return 1;
@@ -129,6 +270,9 @@ const LUA_REG_TYPE pwm_map[] = {
   { LSTRKEY( "getclock" ), LFUNCVAL( lpwm_getclock ) },
   { LSTRKEY( "setduty" ),  LFUNCVAL( lpwm_setduty ) },
   { LSTRKEY( "getduty" ),  LFUNCVAL( lpwm_getduty ) },
+  { LSTRKEY( "fade" ),     LFUNCVAL( lpwm_fade ) },
+  { LSTRKEY( "sequence" ), LFUNCVAL( lpwm_sequence ) },
+  { LSTRKEY( "stopfade" ), LFUNCVAL( lpwm_stopfade ) },
   { LNILKEY, LNILVAL }
 };
 
@@ -0,0 +1,412 @@
+// Module for RTC memory, which deep sleep keeps, and a wake stub
+//
+// node.dsleep() wakes into a full boot: SPIFFS, a new Lua state, init.lua
+// and WiFi again. Values Lua wants to carry across that go in integer
+// slots or in one small flat table, both in RTC slow memory; a reset or
+// power cycle clears them.
+//
+// For sensors that only matter when a reading changes, the wake stub
+// skips the boot instead. It runs from RTC fast memory as the chip wakes,
+// before flash is even mapped, takes one ADC1 reading and goes straight
+// back to sleep while it stays between two thresholds. Only a reading
+// outside them, or a set number of wakes, lets the boot go on, and Lua
+// finds out why, and the readings taken, from rtcmem.stubinfo().
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "adc_hw.h"
+#include "sdkconfig.h"
+#include "esp_attr.h"
+#include "esp_deepsleep.h"
+#include "freertos/FreeRTOS.h"
+#include "rom/ets_sys.h"
+#include "rom/rtc.h"
+#include "soc/soc.h"
+#include "soc/rtc_cntl_reg.h"
+#include "soc/rtc_io_reg.h"
+#include "soc/saradc_reg.h"
+#include <string.h>
+
+#define RTCMEM_SLOTS        32
+#define RTCMEM_SAMPLES      32      // stub readings kept, the latest ones
+#define RTCMEM_MAGIC        0x4d435452
+#define RTCMEM_CAL_US       10000   // spent counting slow clock ticks
+#define RTCMEM_ADC_SPINS    1000    // us a conversion may take
+#define RTCMEM_STR_MAX      255
+
+// Items of a saved table, a type byte and then the value
+#define RTCMEM_T_NUMBER     'n'     // lua_Number as it is in memory
+#define RTCMEM_T_STRING     's'     // length byte, then the bytes
+#define RTCMEM_T_TRUE       't'
+#define RTCMEM_T_FALSE      'f'
+
+// Why the stub let the chip boot
+enum { RTCMEM_BOOT_NONE, RTCMEM_BOOT_THRESHOLD, RTCMEM_BOOT_COUNT, RTCMEM_BOOT_ADC };
+
+typedef struct {
+  uint32_t armed;
+  adc_hw_pad_t pad;               // copied here, the stub can't reach adc_hw's table
+  uint32_t chan, atten;
+  uint32_t low, high;
+  uint64_t ticks;                 // slow clock ticks between wakes
+  uint32_t boot_after;            // wakes, 0 for no limit
+  uint32_t wakes;
+  uint32_t reason;
+  uint32_t nsamples;              // taken since arming, the ring index wraps
+  uint16_t samples[RTCMEM_SAMPLES];
+} rtcmem_stub_t;
+
+static RTC_DATA_ATTR int32_t rtcmem_slots[RTCMEM_SLOTS];
+static RTC_DATA_ATTR struct {
+  uint32_t magic;
+  uint32_t len;
+  uint8_t data[CONFIG_RTCMEM_TABLE_BYTES];
+} rtcmem_table;
+static RTC_DATA_ATTR rtcmem_stub_t rtcmem_stub;
+
+// Inlined, so the stub and Lua on either core each have their own copy;
+// only the PRO CPU can run code from RTC fast memory
+static inline __attribute__((always_inline)) uint64_t rtcmem_rtc_time( void )
+{
+  SET_PERI_REG_MASK( RTC_CNTL_TIME_UPDATE_REG, RTC_CNTL_TIME_UPDATE );
+  while (!GET_PERI_REG_MASK( RTC_CNTL_TIME_UPDATE_REG, RTC_CNTL_TIME_VALID ))
+    ets_delay_us( 1 );
+  SET_PERI_REG_MASK( RTC_CNTL_INT_CLR_REG, RTC_CNTL_TIME_VALID_INT_CLR );
+  return READ_PERI_REG( RTC_CNTL_TIME0_REG ) |
+         ((uint64_t)READ_PERI_REG( RTC_CNTL_TIME1_REG ) << 32);
+}
+
+// adc_hw_read(), for the stub: the RTC controller reads the one pad
+static int RTC_IRAM_ATTR rtcmem_stub_adc( const rtcmem_stub_t *s )
+{
+  SET_PERI_REG_MASK( s->pad.reg, s->pad.mux_sel );
+  CLEAR_PERI_REG_MASK( s->pad.reg, s->pad.fun_ie );
+  SET_PERI_REG_BITS( s->pad.reg, 3, 0, s->pad.fun_sel_s );
+  SET_PERI_REG_BITS( SARADC_SAR_ATTEN1_REG, 3, s->atten, s->chan * 2 );
+  SET_PERI_REG_BITS( SARADC_SAR_START_FORCE_REG, SARADC_SAR1_BIT_WIDTH, 3, SARADC_SAR1_BIT_WIDTH_S );
+  SET_PERI_REG_BITS( SARADC_SAR_READ_CTRL_REG, SARADC_SAR1_SAMPLE_BIT, 3, SARADC_SAR1_SAMPLE_BIT_S );
+  SET_PERI_REG_BITS( SARADC_SAR_MEAS_WAIT2_REG, SARADC_FORCE_XPD_SAR, 3, SARADC_FORCE_XPD_SAR_S );
+  SET_PERI_REG_MASK( SARADC_SAR_TOUCH_CTRL1_REG, SARADC_XPD_HALL_FORCE | SARADC_HALL_PHASE_FORCE );
+  CLEAR_PERI_REG_MASK( RTC_IO_HALL_SENS_REG, RTC_IO_XPD_HALL );
+
+  SET_PERI_REG_MASK( SARADC_SAR_READ_CTRL_REG, SARADC_SAR1_DATA_INV );
+  CLEAR_PERI_REG_MASK( SARADC_SAR_READ_CTRL_REG, SARADC_SAR1_DIG_FORCE );
+  SET_PERI_REG_MASK( SARADC_SAR_MEAS_START1_REG, SARADC_MEAS1_START_FORCE | SARADC_SAR1_EN_PAD_FORCE );
+  SET_PERI_REG_BITS( SARADC_SAR_MEAS_START1_REG, SARADC_SAR1_EN_PAD, 1 << s->chan, SARADC_SAR1_EN_PAD_S );
+  CLEAR_PERI_REG_MASK( SARADC_SAR_MEAS_START1_REG, SARADC_MEAS1_START_SAR );
+  SET_PERI_REG_MASK( SARADC_SAR_MEAS_START1_REG, SARADC_MEAS1_START_SAR );
+  int v = -1;
+  for (int i = 0; i < RTCMEM_ADC_SPINS; i++) {
+    if (GET_PERI_REG_MASK( SARADC_SAR_MEAS_START1_REG, SARADC_MEAS1_DONE_SAR )) {
+      v = GET_PERI_REG_BITS2( SARADC_SAR_MEAS_START1_REG, SARADC_MEAS1_DATA_SAR, SARADC_MEAS1_DATA_SAR_S );
+      break;
+    }
+    ets_delay_us( 1 );
+  }
+  // powered up for good it would stay on through the sleep
+  SET_PERI_REG_BITS( SARADC_SAR_MEAS_WAIT2_REG, SARADC_FORCE_XPD_SAR, 0, SARADC_FORCE_XPD_SAR_S );
+  return v;
+}
+
+// Replaces the SDK's weak default, which system_deep_sleep() installs.
+// Returning boots as usual.
+void RTC_IRAM_ATTR esp_wake_deep_sleep( void )
+{
+  esp_default_wake_deep_sleep();
+
+  rtcmem_stub_t *s = &rtcmem_stub;
+  if (!s->armed)
+    return;
+  int v = rtcmem_stub_adc( s );
+  if (v < 0) {
+    s->reason = RTCMEM_BOOT_ADC;
+    return;
+  }
+  s->samples[s->nsamples++ % RTCMEM_SAMPLES] = v;
+  s->wakes++;
+  if (v < s->low || v > s->high) {
+    s->reason = RTCMEM_BOOT_THRESHOLD;
+    return;
+  }
+  if (s->boot_after && s->wakes >= s->boot_after) {
+    s->reason = RTCMEM_BOOT_COUNT;
+    return;
+  }
+
+  // Back to sleep: the timer and the other wake sources system_deep_sleep()
+  // set up are still there, only the alarm needs moving on
+  uint64_t alarm = rtcmem_rtc_time() + s->ticks;
+  WRITE_PERI_REG( RTC_CNTL_SLP_TIMER0_REG, (uint32_t)alarm );
+  WRITE_PERI_REG( RTC_CNTL_SLP_TIMER1_REG, ((uint32_t)(alarm >> 32) & 0xffff) | RTC_CNTL_MAIN_TIMER_ALARM_EN );
+  REG_WRITE( RTC_ENTRY_ADDR_REG, (uint32_t)&esp_wake_deep_sleep );
+  set_rtc_memory_crc();
+  CLEAR_PERI_REG_MASK( RTC_CNTL_STATE0_REG, RTC_CNTL_SLEEP_EN );
+  SET_PERI_REG_MASK( RTC_CNTL_STATE0_REG, RTC_CNTL_SLEEP_EN );
+  while (1)
+    ;
+}
+
+// Slow clock ticks in RTCMEM_CAL_US. The clock is a ~150 kHz RC one and
+// drifts, so this is measured each time the stub is armed.
+static uint32_t rtcmem_slow_ticks( void )
+{
+  static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+  portENTER_CRITICAL( &mux );
+  uint64_t t0 = rtcmem_rtc_time();
+  ets_delay_us( RTCMEM_CAL_US );
+  uint64_t t1 = rtcmem_rtc_time();
+  portEXIT_CRITICAL( &mux );
+  return (uint32_t)(t1 - t0);
+}
+
+// Lua: rtcmem.set( slot, value )
+static int rtcmem_set( lua_State *L )
+{
+  int slot = luaL_checkinteger( L, 1 );
+  luaL_argcheck( L, slot >= 0 && slot < RTCMEM_SLOTS, 1, "wrong slot" );
+  rtcmem_slots[slot] = luaL_checkinteger( L, 2 );
+  return 0;
+}
+
+// Lua: value = rtcmem.get( slot )
+// 0 for slots not set since power on
+static int rtcmem_get( lua_State *L )
+{
+  int slot = luaL_checkinteger( L, 1 );
+  luaL_argcheck( L, slot >= 0 && slot < RTCMEM_SLOTS, 1, "wrong slot" );
+  lua_pushinteger( L, rtcmem_slots[slot] );
+  return 1;
+}
+
+typedef struct {
+  uint8_t *p, *end;
+} rtcmem_writer_t;
+
+static void rtcmem_put( lua_State *L, rtcmem_writer_t *w, const void *data, size_t len )
+{
+  if (w->end - w->p < len)
+    luaL_error( L, "table too big, the limit is %d bytes", CONFIG_RTCMEM_TABLE_BYTES );
+  memcpy( w->p, data, len );
+  w->p += len;
+}
+
+static void rtcmem_put_item( lua_State *L, rtcmem_writer_t *w, int idx )
+{
+  uint8_t t;
+  switch (lua_type( L, idx )) {
+    case LUA_TNUMBER: {
+      lua_Number n = lua_tonumber( L, idx );
+      t = RTCMEM_T_NUMBER;
+      rtcmem_put( L, w, &t, 1 );
+      rtcmem_put( L, w, &n, sizeof( n ) );
+      break;
+    }
+    case LUA_TSTRING: {
+      size_t len;
+      const char *str = lua_tolstring( L, idx, &len );
+      if (len > RTCMEM_STR_MAX)
+        luaL_error( L, "string too long" );
+      uint8_t hdr[2] = { RTCMEM_T_STRING, len };
+      rtcmem_put( L, w, hdr, 2 );
+      rtcmem_put( L, w, str, len );
+      break;
+    }
+    case LUA_TBOOLEAN:
+      t = lua_toboolean( L, idx ) ? RTCMEM_T_TRUE : RTCMEM_T_FALSE;
+      rtcmem_put( L, w, &t, 1 );
+      break;
+    default:
+      luaL_error( L, "can't save a %s", luaL_typename( L, idx ) );
+  }
+}
+
+// Lua: rtcmem.save( tbl )
+// tbl is flat: numbers, strings of up to 255 bytes and booleans, under
+// number or string keys. nil forgets the saved table. On an error the
+// table saved before is kept.
+static int rtcmem_save( lua_State *L )
+{
+  if (lua_isnoneornil( L, 1 )) {
+    rtcmem_table.magic = 0;
+    return 0;
+  }
+  luaL_checktype( L, 1, LUA_TTABLE );
+  // encoded in a scratch copy first
+  rtcmem_writer_t w;
+  w.p = (uint8_t *)lua_newuserdata( L, sizeof( rtcmem_table.data ) );
+  w.end = w.p + sizeof( rtcmem_table.data );
+  uint8_t *data = w.p;
+  lua_pushnil( L );
+  while (lua_next( L, 1 )) {
+    rtcmem_put_item( L, &w, -2 );
+    rtcmem_put_item( L, &w, -1 );
+    lua_pop( L, 1 );
+  }
+  rtcmem_table.magic = 0;
+  memcpy( rtcmem_table.data, data, w.p - data );
+  rtcmem_table.len = w.p - data;
+  rtcmem_table.magic = RTCMEM_MAGIC;
+  return 0;
+}
+
+// Pushes the item at *p, or returns false if it runs past end
+static bool rtcmem_get_item( lua_State *L, const uint8_t **p, const uint8_t *end )
+{
+  const uint8_t *q = *p;
+  if (q >= end)
+    return false;
+  switch (*q++) {
+    case RTCMEM_T_NUMBER: {
+      lua_Number n;
+      if (end - q < sizeof( n ))
+        return false;
+      memcpy( &n, q, sizeof( n ) );
+      lua_pushnumber( L, n );
+      q += sizeof( n );
+      break;
+    }
+    case RTCMEM_T_STRING: {
+      if (q >= end || end - q - 1 < *q)
+        return false;
+      lua_pushlstring( L, (const char *)q + 1, *q );
+      q += 1 + *q;
+      break;
+    }
+    case RTCMEM_T_TRUE:
+    case RTCMEM_T_FALSE:
+      lua_pushboolean( L, q[-1] == RTCMEM_T_TRUE );
+      break;
+    default:
+      return false;
+  }
+  *p = q;
+  return true;
+}
+
+// Lua: tbl = rtcmem.load()
+// nil if nothing was saved since power on
+static int rtcmem_load( lua_State *L )
+{
+  if (rtcmem_table.magic != RTCMEM_MAGIC || rtcmem_table.len > sizeof( rtcmem_table.data )) {
+    lua_pushnil( L );
+    return 1;
+  }
+  const uint8_t *p = rtcmem_table.data, *end = p + rtcmem_table.len;
+  lua_newtable( L );
+  while (p < end) {
+    if (!rtcmem_get_item( L, &p, end ))
+      return luaL_error( L, "saved table is corrupt" );
+    if (!rtcmem_get_item( L, &p, end ))
+      return luaL_error( L, "saved table is corrupt" );
+    lua_rawset( L, -3 );
+  }
+  return 1;
+}
+
+static int opt_field( lua_State *L, const char *name, int dflt )
+{
+  lua_getfield( L, 1, name );
+  int v = luaL_optinteger( L, -1, dflt );
+  lua_pop( L, 1 );
+  return v;
+}
+
+// Lua: rtcmem.stub( { chan=, every=, low=0, high=4095, atten=adc.ATTEN_11DB, boot_after=0 } )
+// Arms the wake stub for the next node.dsleep(): it reads chan on each
+// wake and sleeps every more microseconds while the reading is within
+// low-high, for at most boot_after wakes if that isn't 0.
+// Lua: rtcmem.stub( nil ) disarms it, deep sleep wakes boot again.
+static int rtcmem_stub_arm( lua_State *L )
+{
+  rtcmem_stub_t *s = &rtcmem_stub;
+  if (lua_isnoneornil( L, 1 )) {
+    s->armed = 0;
+    s->reason = RTCMEM_BOOT_NONE;
+    return 0;
+  }
+  luaL_checktype( L, 1, LUA_TTABLE );
+  int chan = opt_field( L, "chan", -1 );
+  int every = opt_field( L, "every", 0 );
+  int low = opt_field( L, "low", 0 );
+  int high = opt_field( L, "high", 4095 );
+  int atten = opt_field( L, "atten", ADC_HW_ATTEN_11DB );
+  int boot_after = opt_field( L, "boot_after", 0 );
+  const adc_hw_pad_t *pad = adc_hw_pad( chan );
+  luaL_argcheck( L, pad != NULL, 1, "wrong chan" );
+  luaL_argcheck( L, every > 0, 1, "every must be positive" );
+  luaL_argcheck( L, low >= 0 && low <= high && high <= 4095, 1, "wrong low, high" );
+  luaL_argcheck( L, atten >= ADC_HW_ATTEN_0DB && atten <= ADC_HW_ATTEN_11DB, 1, "wrong atten" );
+  luaL_argcheck( L, boot_after >= 0, 1, "wrong boot_after" );
+
+  s->armed = 0;
+  s->pad = *pad;
+  s->chan = chan;
+  s->atten = atten;
+  s->low = low;
+  s->high = high;
+  s->ticks = (uint64_t)every * rtcmem_slow_ticks() / RTCMEM_CAL_US;
+  s->boot_after = boot_after;
+  s->wakes = 0;
+  s->reason = RTCMEM_BOOT_NONE;
+  s->nsamples = 0;
+  s->armed = 1;
+  return 0;
+}
+
+// Lua: info = rtcmem.stubinfo()
+// { armed=, wakes=, reason=, last=, samples={...} }, where reason is why
+// the stub let this boot happen: "threshold", "count" or "adc" if the
+// conversion timed out, nil for any other boot. samples are the latest
+// readings, oldest first, and last the latest.
+static int rtcmem_stubinfo( lua_State *L )
+{
+  static const char *const reasons[] = { NULL, "threshold", "count", "adc" };
+  const rtcmem_stub_t *s = &rtcmem_stub;
+  lua_createtable( L, 0, 5 );
+  lua_pushboolean( L, s->armed );
+  lua_setfield( L, -2, "armed" );
+  lua_pushinteger( L, s->wakes );
+  lua_setfield( L, -2, "wakes" );
+  if (s->reason < sizeof( reasons ) / sizeof( reasons[0] ) && reasons[s->reason]) {
+    lua_pushstring( L, reasons[s->reason] );
+    lua_setfield( L, -2, "reason" );
+  }
+  uint32_t n = s->nsamples < RTCMEM_SAMPLES ? s->nsamples : RTCMEM_SAMPLES;
+  lua_createtable( L, n, 0 );
+  for (uint32_t i = 0; i < n; i++) {
+    lua_pushinteger( L, s->samples[(s->nsamples - n + i) % RTCMEM_SAMPLES] );
+    lua_rawseti( L, -2, i + 1 );
+  }
+  lua_setfield( L, -2, "samples" );
+  if (n) {
+    lua_pushinteger( L, s->samples[(s->nsamples - 1) % RTCMEM_SAMPLES] );
+    lua_setfield( L, -2, "last" );
+  }
+  return 1;
+}
+
+// Module function map
+const LUA_REG_TYPE rtcmem_map[] = {
+  { LSTRKEY( "set" ),      LFUNCVAL( rtcmem_set ) },
+  { LSTRKEY( "get" ),      LFUNCVAL( rtcmem_get ) },
+  { LSTRKEY( "save" ),     LFUNCVAL( rtcmem_save ) },
+  { LSTRKEY( "load" ),     LFUNCVAL( rtcmem_load ) },
+  { LSTRKEY( "stub" ),     LFUNCVAL( rtcmem_stub_arm ) },
+  { LSTRKEY( "stubinfo" ), LFUNCVAL( rtcmem_stubinfo ) },
+  { LSTRKEY( "SLOTS" ),    LNUMVAL( RTCMEM_SLOTS ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_rtcmem( lua_State *L )
+{
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_RTCMEMLIBNAME, rtcmem_map );
+  return 1;
+#endif
+}
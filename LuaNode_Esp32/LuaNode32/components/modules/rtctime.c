@@ -0,0 +1,168 @@
+// Module for the wall clock: SNTP, a time zone and date formatting
+//
+// The clock is the C library's, which the SNTP client sets as replies
+// come in. Formatting goes through utils/datetime.c; the module keeps its
+// day cache, so formatting many times on the same day, one per log line
+// say, only splits the time of day.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "os_time.h"
+#include "datetime.h"
+#include "apps/sntp/sntp.h"
+#include <sys/time.h>
+#include <string.h>
+
+#define RTCTIME_FMT_BUFSIZE     128
+#define RTCTIME_SERVER_LEN      64
+
+// Clocks that were never set count from 1970 at boot; anything past this
+// (Sep 2001) has been set
+#define RTCTIME_SET_AFTER       1000000000
+
+static struct os_timezone rtctime_zone;
+static struct datetime_cache rtctime_cache = { .days = -1 };
+
+// sntp keeps the pointer, not the name
+static char rtctime_server[RTCTIME_SERVER_LEN] = "pool.ntp.org";
+
+// Lua: sec, usec = rtctime.get()
+static int rtctime_get( lua_State *L )
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  lua_pushnumber( L, tv.tv_sec );
+  lua_pushinteger( L, tv.tv_usec );
+  return 2;
+}
+
+// Lua: rtctime.set( sec[, usec] )
+static int rtctime_set( lua_State *L )
+{
+  struct timeval tv;
+  tv.tv_sec = luaL_checknumber( L, 1 );
+  tv.tv_usec = luaL_optinteger( L, 2, 0 );
+  luaL_argcheck( L, tv.tv_sec >= 0, 1, "negative time" );
+  luaL_argcheck( L, tv.tv_usec >= 0 && tv.tv_usec < 1000000, 2, "out of range" );
+  settimeofday( &tv, NULL );
+  return 0;
+}
+
+// Lua: set = rtctime.synced()
+static int rtctime_synced( lua_State *L )
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  lua_pushboolean( L, tv.tv_sec > RTCTIME_SET_AFTER );
+  return 1;
+}
+
+// Lua: rtctime.sntp_sync( [server] )
+// Starts the SNTP client, which sets the clock from the first reply and
+// keeps it in step after that. pool.ntp.org by default.
+static int rtctime_sntp_sync( lua_State *L )
+{
+  size_t len;
+  const char *server = luaL_optlstring( L, 1, NULL, &len );
+  if (server)
+    luaL_argcheck( L, len < RTCTIME_SERVER_LEN, 1, "name too long" );
+
+  if (sntp_enabled())
+    sntp_stop();
+  if (server)
+    memcpy( rtctime_server, server, len + 1 );
+  sntp_setoperatingmode( SNTP_OPMODE_POLL );
+  sntp_setservername( 0, rtctime_server );
+  sntp_init();
+  return 0;
+}
+
+// Lua: minuteswest, dst = rtctime.tz( [minuteswest[, dst]] )
+// Sets the zone local times are given in, as minutes west of UTC (so
+// -60 for CET) and whether daylight saving adds an hour. Returns the
+// zone in force.
+static int rtctime_tz( lua_State *L )
+{
+  if (!lua_isnoneornil( L, 1 )) {
+    int west = luaL_checkinteger( L, 1 );
+    luaL_argcheck( L, west >= -18 * 60 && west <= 18 * 60, 1, "out of range" );
+    rtctime_zone.tz_minuteswest = west;
+    rtctime_zone.tz_dsttime = lua_toboolean( L, 2 );
+    rtctime_cache.days = -1;
+  }
+  lua_pushinteger( L, rtctime_zone.tz_minuteswest );
+  lua_pushboolean( L, rtctime_zone.tz_dsttime );
+  return 2;
+}
+
+// Lua: text = rtctime.format( [fmt[, sec[, usec]]] )
+// Local time, now unless sec is given. Without fmt, RFC 3339
+// ("2017-03-02T22:44:00.250000+01:00"); fmt takes strftime() conversions
+// and %f for microseconds.
+static int rtctime_format( lua_State *L )
+{
+  const char *fmt = luaL_optstring( L, 1, NULL );
+  struct os_timeval tv;
+  if (lua_isnoneornil( L, 2 )) {
+    struct timeval now;
+    gettimeofday( &now, NULL );
+    tv.tv_sec = now.tv_sec;
+    tv.tv_usec = now.tv_usec;
+  } else {
+    tv.tv_sec = luaL_checknumber( L, 2 );
+    tv.tv_usec = luaL_optinteger( L, 3, 0 );
+  }
+
+  char buf[RTCTIME_FMT_BUFSIZE];
+  int rc;
+  if (fmt)
+    rc = format_datetime_fmt( fmt, &tv, &rtctime_zone, &rtctime_cache, buf, sizeof(buf) );
+  else
+    rc = format_datetime( &tv, &rtctime_zone, buf, sizeof(buf) );
+  if (rc < 0)
+    return luaL_error( L, "bad format or time" );
+  lua_pushstring( L, buf );
+  return 1;
+}
+
+// Lua: sec, usec, minuteswest = rtctime.parse( text )
+// Reads an RFC 3339 time, UTC if it has no offset. nil if it isn't one.
+static int rtctime_parse( lua_State *L )
+{
+  struct os_timeval tv;
+  struct os_timezone tz;
+  if (parse_datetime( luaL_checkstring( L, 1 ), &tv, &tz ) != 0) {
+    lua_pushnil( L );
+    return 1;
+  }
+  lua_pushnumber( L, tv.tv_sec );
+  lua_pushinteger( L, tv.tv_usec );
+  lua_pushinteger( L, tz.tz_minuteswest );
+  return 3;
+}
+
+// Module function map
+const LUA_REG_TYPE rtctime_map[] = {
+  { LSTRKEY( "get" ),       LFUNCVAL( rtctime_get ) },
+  { LSTRKEY( "set" ),       LFUNCVAL( rtctime_set ) },
+  { LSTRKEY( "synced" ),    LFUNCVAL( rtctime_synced ) },
+  { LSTRKEY( "sntp_sync" ), LFUNCVAL( rtctime_sntp_sync ) },
+  { LSTRKEY( "tz" ),        LFUNCVAL( rtctime_tz ) },
+  { LSTRKEY( "format" ),    LFUNCVAL( rtctime_format ) },
+  { LSTRKEY( "parse" ),     LFUNCVAL( rtctime_parse ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_rtctime( lua_State *L )
+{
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_RTCTIMELIBNAME, rtctime_map );
+  return 1;
+#endif
+}
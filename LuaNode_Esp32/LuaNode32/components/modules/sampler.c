@@ -0,0 +1,338 @@
+// Module for reading I2C and SPI devices at a fixed rate without Lua in the loop
+//
+// Jobs run in a task of their own, scheduled on the FreeRTOS tick, and
+// fill blocks of records that are handed to the Lua task once full.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "platform.h"
+#include "c_types.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "task/task.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SAMPLER_JOBS      4
+#define SAMPLER_BLOCKS    4     // per job: one filling, the rest with Lua
+#define SAMPLER_MAX_BLOCK 256   // records per block
+#define SAMPLER_MAX_LEN   32    // bytes per record
+#define SAMPLER_STACK     2048
+#define SAMPLER_PRIO      12    // above the Lua and uart tasks
+
+enum { BUS_I2C, BUS_SPI };
+
+typedef struct {
+  uint8_t *data;          // len bytes per record
+  uint32_t *times;        // system_get_time() of each record
+  uint16_t n;
+  volatile bool full;     // posted to Lua, left alone until delivered
+} sampler_block_t;
+
+typedef struct {
+  bool used;
+  uint8_t gen;            // tells a delivery for a stopped job from a live one
+  uint8_t bus, id, addr, len;
+  int16_t reg;            // -1 for none
+  uint16_t block;         // records per block
+  TickType_t period, due;
+  uint32_t lost;          // records that couldn't be taken or kept
+  uint8_t fill;           // block being filled
+  sampler_block_t b[SAMPLER_BLOCKS];
+  uint8_t *spi_tx, *spi_rx;
+  int cb_ref;
+} sampler_job_t;
+
+static sampler_job_t jobs[SAMPLER_JOBS];
+static SemaphoreHandle_t jobs_lock;     // jobs[] between the sampler and the Lua task
+static SemaphoreHandle_t bus_done;      // given from the I2C and SPI interrupts
+static volatile int bus_err;
+static portMUX_TYPE lost_mux = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t sampler_handle;
+static task_handle_t deliver_task;
+
+static void add_lost( sampler_job_t *j, uint32_t n )
+{
+  portENTER_CRITICAL( &lost_mux );
+  j->lost += n;
+  portEXIT_CRITICAL( &lost_mux );
+}
+
+// Both run in the bus interrupt
+static void i2c_done( int err, void *arg )
+{
+  bus_err = err;
+  xSemaphoreGiveFromISR( bus_done, NULL );
+}
+
+static void spi_done( void *arg )
+{
+  bus_err = 0;
+  xSemaphoreGiveFromISR( bus_done, NULL );
+}
+
+// Take one record for j into its filling block
+static void sample( sampler_job_t *j )
+{
+  sampler_block_t *b = &j->b[j->fill];
+  if (b->full) {
+    add_lost( j, 1 );     // Lua is behind on every block
+    return;
+  }
+  uint8_t *rec = b->data + b->n * j->len;
+  uint32_t t = 0x7FFFFFFF & system_get_time();
+  bool has_reg = j->reg >= 0;
+  int res;
+  if (j->bus == BUS_I2C) {
+    uint8_t reg = j->reg;
+    res = platform_i2c_transfer( j->id, j->addr, &reg, has_reg, rec, j->len, i2c_done, NULL );
+  } else {
+    res = platform_spi_transfer( j->id, j->spi_tx, j->spi_rx, j->len + has_reg, spi_done, NULL );
+  }
+  if (res == 0)
+    xSemaphoreTake( bus_done, portMAX_DELAY );
+  if (res || bus_err) {
+    add_lost( j, 1 );
+    return;
+  }
+  if (j->bus == BUS_SPI)
+    memcpy( rec, j->spi_rx + has_reg, j->len );
+
+  b->times[b->n] = t;
+  if (++b->n < j->block)
+    return;
+  unsigned bi = j->fill;
+  b->full = true;
+  j->fill = (bi + 1) % SAMPLER_BLOCKS;
+  if (!task_post_low( deliver_task, (task_param_t)((j - jobs) | j->gen << 8 | bi << 16) )) {
+    add_lost( j, b->n );
+    b->n = 0;
+    b->full = false;
+  }
+}
+
+static void sampler_task( void *arg )
+{
+  for (;;) {
+    TickType_t now = xTaskGetTickCount(), wait = portMAX_DELAY;
+    xSemaphoreTake( jobs_lock, portMAX_DELAY );
+    for (int i = 0; i < SAMPLER_JOBS; i++) {
+      sampler_job_t *j = &jobs[i];
+      if (!j->used)
+        continue;
+      if ((int32_t)(now - j->due) >= 0) {
+        sample( j );
+        j->due += j->period;
+        if ((int32_t)(now - j->due) >= 0) {
+          // fell behind by whole periods, skip them rather than bunch up
+          uint32_t missed = (now - j->due) / j->period + 1;
+          add_lost( j, missed );
+          j->due += missed * j->period;
+        }
+      }
+      if (j->due - now < wait)
+        wait = j->due - now;
+    }
+    xSemaphoreGive( jobs_lock );
+    ulTaskNotifyTake( pdTRUE, wait );
+  }
+}
+
+// Lua task: hand a full block to the job's function
+static void sampler_deliver( task_param_t param, task_prio_t prio )
+{
+  (void)prio;
+  sampler_job_t *j = &jobs[param & 0xff];
+  if (!j->used || j->gen != ((param >> 8) & 0xff))
+    return;               // stopped since
+  sampler_block_t *b = &j->b[param >> 16];
+  lua_State *L = lua_getstate();
+
+  lua_rawgeti( L, LUA_REGISTRYINDEX, j->cb_ref );
+  lua_pushlstring( L, (const char *)b->data, b->n * j->len );
+  lua_createtable( L, b->n, 0 );
+  for (int i = 0; i < b->n; i++) {
+    lua_pushinteger( L, b->times[i] );
+    lua_rawseti( L, -2, i + 1 );
+  }
+  portENTER_CRITICAL( &lost_mux );
+  uint32_t lost = j->lost;
+  j->lost = 0;
+  portEXIT_CRITICAL( &lost_mux );
+  lua_pushinteger( L, lost );
+  b->n = 0;
+  b->full = false;
+  lua_call( L, 3, 0 );
+}
+
+static void job_free( sampler_job_t *j )
+{
+  for (int i = 0; i < SAMPLER_BLOCKS; i++) {
+    free( j->b[i].data );
+    free( j->b[i].times );
+    j->b[i].data = NULL;
+    j->b[i].times = NULL;
+  }
+  free( j->spi_tx );
+  free( j->spi_rx );
+  j->spi_tx = j->spi_rx = NULL;
+}
+
+static int opt_field( lua_State *L, const char *name, int dflt )
+{
+  lua_getfield( L, 1, name );
+  int v = luaL_optinteger( L, -1, dflt );
+  lua_pop( L, 1 );
+  return v;
+}
+
+static int check_field( lua_State *L, const char *name )
+{
+  lua_getfield( L, 1, name );
+  if (lua_isnil( L, -1 ))
+    return luaL_error( L, "%s expected", name );
+  int v = luaL_checkinteger( L, -1 );
+  lua_pop( L, 1 );
+  return v;
+}
+
+static int sampler_start( lua_State *L, int bus )
+{
+  luaL_checktype( L, 1, LUA_TTABLE );
+  luaL_argcheck( L, lua_type( L, 2 ) == LUA_TFUNCTION || lua_type( L, 2 ) == LUA_TLIGHTFUNCTION, 2, "function expected" );
+  int id, addr = 0;
+  if (bus == BUS_I2C) {
+    id = opt_field( L, "id", 0 );
+    MOD_CHECK_ID( i2c, id );
+    addr = check_field( L, "addr" );
+    luaL_argcheck( L, addr >= 0 && addr <= 127, 1, "wrong address" );
+  } else {
+    id = check_field( L, "bus" );
+    luaL_argcheck( L, id == 2 || id == 3, 1, "wrong bus" );   // spi.HSPI, spi.VSPI
+  }
+  int reg = opt_field( L, "reg", -1 );
+  int len = check_field( L, "len" );
+  int period = check_field( L, "period" );
+  int block = opt_field( L, "block", 10 );
+  luaL_argcheck( L, reg >= -1 && reg <= 255, 1, "wrong reg" );
+  luaL_argcheck( L, len > 0 && len <= SAMPLER_MAX_LEN, 1, "wrong len" );
+  luaL_argcheck( L, period >= portTICK_PERIOD_MS, 1, "wrong period" );
+  luaL_argcheck( L, block > 0 && block <= SAMPLER_MAX_BLOCK, 1, "wrong block" );
+
+  int slot;
+  for (slot = 0; slot < SAMPLER_JOBS && jobs[slot].used; slot++)
+    ;
+  if (slot == SAMPLER_JOBS)
+    return luaL_error( L, "too many jobs" );
+
+  if (!sampler_handle) {
+    jobs_lock = xSemaphoreCreateMutex();
+    bus_done = xSemaphoreCreateBinary();
+    deliver_task = task_get_id( sampler_deliver );
+    if (!jobs_lock || !bus_done ||
+        xTaskCreate( sampler_task, "sampler", SAMPLER_STACK, NULL, SAMPLER_PRIO, &sampler_handle ) != pdPASS)
+      return luaL_error( L, "out of memory" );
+  }
+
+  sampler_job_t *j = &jobs[slot];
+  bool oom = false;
+  for (int i = 0; i < SAMPLER_BLOCKS; i++) {
+    j->b[i].data = (uint8_t *)malloc( block * len );
+    j->b[i].times = (uint32_t *)malloc( block * sizeof(uint32_t) );
+    j->b[i].n = 0;
+    j->b[i].full = false;
+    oom |= !j->b[i].data || !j->b[i].times;
+  }
+  if (bus == BUS_SPI) {
+    // DMA wants word aligned receive buffers rounded up to 4 bytes
+    j->spi_tx = (uint8_t *)calloc( 1, len + 1 );
+    j->spi_rx = (uint8_t *)malloc( (len + 1 + 3) & ~3 );
+    oom |= !j->spi_tx || !j->spi_rx;
+    if (j->spi_tx && reg >= 0)
+      j->spi_tx[0] = reg;
+  }
+  if (oom) {
+    job_free( j );
+    return luaL_error( L, "out of memory" );
+  }
+
+  lua_pushvalue( L, 2 );
+  j->cb_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  j->bus = bus;
+  j->id = id;
+  j->addr = addr;
+  j->reg = reg;
+  j->len = len;
+  j->block = block;
+  j->period = period / portTICK_PERIOD_MS;
+  j->lost = 0;
+  j->fill = 0;
+
+  xSemaphoreTake( jobs_lock, portMAX_DELAY );
+  j->due = xTaskGetTickCount() + j->period;
+  j->used = true;
+  xSemaphoreGive( jobs_lock );
+  xTaskNotifyGive( sampler_handle );
+
+  lua_pushinteger( L, slot );
+  return 1;
+}
+
+// Lua: job = sampler.i2c( { id=0, addr=, reg=, len=, period=, block=10 }, function(data, times, lost) )
+// Every period ms, write reg (if given) to addr and read len bytes after a
+// repeated start. Once block records are in, the function gets them
+// back to back in data, their system_get_time() stamps in times, and the
+// number of records lost since the last call.
+static int sampler_i2c( lua_State *L )
+{
+  return sampler_start( L, BUS_I2C );
+}
+
+// Lua: job = sampler.spi( { bus=, reg=, len=, period=, block=10 }, function(data, times, lost) )
+// Like sampler.i2c(), sending reg (if given) as the first byte of a full
+// duplex transfer of len more bytes, which are kept.
+static int sampler_spi( lua_State *L )
+{
+  return sampler_start( L, BUS_SPI );
+}
+
+// Lua: sampler.stop( job )
+// Records not yet delivered are dropped.
+static int sampler_stop( lua_State *L )
+{
+  unsigned slot = luaL_checkinteger( L, 1 );
+  luaL_argcheck( L, slot < SAMPLER_JOBS && jobs[slot].used, 1, "no such job" );
+  sampler_job_t *j = &jobs[slot];
+
+  xSemaphoreTake( jobs_lock, portMAX_DELAY );
+  j->used = false;
+  j->gen++;
+  xSemaphoreGive( jobs_lock );
+  luaL_unref( L, LUA_REGISTRYINDEX, j->cb_ref );
+  j->cb_ref = LUA_NOREF;
+  job_free( j );
+  return 0;
+}
+
+// Module function map
+const LUA_REG_TYPE sampler_map[] = {
+  { LSTRKEY( "i2c" ),   LFUNCVAL( sampler_i2c ) },
+  { LSTRKEY( "spi" ),   LFUNCVAL( sampler_spi ) },
+  { LSTRKEY( "stop" ),  LFUNCVAL( sampler_stop ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_sampler(lua_State *L)
+{
+#if LUA_OPTIMIZE_MEMORY > 0
+    return 0;
+#else
+	luaL_register( L, LUA_SAMPLERLIBNAME, sampler_map );
+	return 1;
+#endif
+}
@@ -0,0 +1,314 @@
+// Module for cooperative scheduling of Lua coroutines
+//
+// A task is a coroutine resumed from the Lua task's message pump. Where it
+// would block, on a sleep or on data it is waiting for, it yields instead,
+// so hundreds of tasks cost their coroutines' memory and not a FreeRTOS
+// stack each. C functions suspend the running task with sched_wait() or
+// sched_sleep(), and the callback that gets what it waits for passes that
+// on with sched_wake(). A plain coroutine.yield() in a task lets the other
+// ready tasks run first.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "sched.h"
+#include "task/task.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <stdio.h>
+
+#define SCHED_RETRY_MS 10     // when the task queue was full
+
+enum { SCHED_READY, SCHED_RUNNING, SCHED_SLEEPING, SCHED_WAITING };
+
+// Lives in a userdata the registry's task table maps the coroutine to,
+// which keeps both alive until the task ends
+typedef struct sched_task {
+  struct sched_task *next;    // in the ready or the sleeping list
+  lua_State *co;
+  int state;
+  int nargs;                  // values on co's stack for the next resume
+  bool lua_wait;              // in sched.wait(), so sched.wake() may end it
+  TickType_t wake;
+} sched_task_t;
+
+static sched_task_t *sched_ready_head, *sched_ready_tail;
+static sched_task_t *sched_sleepers;    // soonest first
+static sched_task_t *sched_current;
+static bool sched_parked;               // the running task waits for something
+static uint32_t sched_count;
+static int sched_tasks_ref = LUA_NOREF;
+static task_handle_t sched_event;
+static os_timer_t sched_timer;
+
+static void sched_post( void )
+{
+  if (!task_post_coalesced_low( sched_event, 0 )) {
+    os_timer_disarm( &sched_timer );
+    os_timer_arm( &sched_timer, SCHED_RETRY_MS, 0 );
+  }
+}
+
+static void sched_tick( void *arg )
+{
+  (void)arg;
+  sched_post();
+}
+
+static void sched_ready( sched_task_t *t )
+{
+  t->state = SCHED_READY;
+  t->next = NULL;
+  if (sched_ready_tail)
+    sched_ready_tail->next = t;
+  else
+    sched_ready_head = t;
+  sched_ready_tail = t;
+  sched_post();
+}
+
+// Arm the timer for the soonest sleeper
+static void sched_arm( void )
+{
+  os_timer_disarm( &sched_timer );
+  if (!sched_sleepers)
+    return;
+  int32_t ticks = (int32_t)(sched_sleepers->wake - xTaskGetTickCount());
+  if (ticks <= 0)
+    sched_post();
+  else
+    os_timer_arm( &sched_timer, ticks * portTICK_PERIOD_MS, 0 );
+}
+
+static void sched_expire( void )
+{
+  TickType_t now = xTaskGetTickCount();
+  while (sched_sleepers && (int32_t)(sched_sleepers->wake - now) <= 0) {
+    sched_task_t *t = sched_sleepers;
+    sched_sleepers = t->next;
+    sched_ready( t );
+  }
+  sched_arm();
+}
+
+static void sched_resume( lua_State *L, sched_task_t *t )
+{
+  lua_State *co = t->co;
+  int nargs = t->nargs;
+  t->nargs = 0;
+  t->state = SCHED_RUNNING;
+  sched_parked = false;
+  sched_current = t;
+  int status = lua_resume( co, nargs );
+  sched_current = NULL;
+
+  if (status == LUA_YIELD) {
+    lua_settop( co, 0 );    // what a plain yield passes goes nowhere
+    if (!sched_parked)
+      sched_ready( t );
+    return;
+  }
+  if (status != 0) {
+    const char *msg = lua_tostring( co, -1 );
+    printf( "sched: %s\n", msg ? msg : "error object is not a string" );
+  }
+
+  // Done, let it be collected
+  lua_rawgeti( L, LUA_REGISTRYINDEX, sched_tasks_ref );
+  lua_pushthread( co );
+  lua_xmove( co, L, 1 );
+  lua_pushnil( L );
+  lua_rawset( L, -3 );
+  lua_pop( L, 1 );
+  sched_count--;
+}
+
+static void sched_run( task_param_t param, task_prio_t prio )
+{
+  (void)param; (void)prio;
+  lua_State *L = lua_getstate();
+  sched_expire();
+
+  // Only the tasks ready now; ones readied meanwhile wait for the next
+  // event, so the others in the queue get their turn in between
+  sched_task_t *last = sched_ready_tail;
+  sched_task_t *t;
+  while ((t = sched_ready_head)) {
+    bool final = t == last;
+    sched_ready_head = t->next;
+    if (!sched_ready_head)
+      sched_ready_tail = NULL;
+    sched_resume( L, t );
+    if (final)
+      break;
+  }
+  if (sched_ready_head)
+    sched_post();
+}
+
+bool sched_can_wait( lua_State *L )
+{
+  return sched_current && sched_current->co == L;
+}
+
+int sched_wait( lua_State *L, struct sched_task **waiter )
+{
+  if (!sched_can_wait( L ))
+    return luaL_error( L, "not in a sched task" );
+  sched_current->state = SCHED_WAITING;
+  sched_current->lua_wait = waiter == NULL;
+  if (waiter)
+    *waiter = sched_current;
+  sched_parked = true;
+  return lua_yield( L, 0 );
+}
+
+int sched_sleep( lua_State *L, uint32_t ms )
+{
+  if (!sched_can_wait( L ))
+    return luaL_error( L, "not in a sched task" );
+  sched_task_t *t = sched_current;
+  t->state = SCHED_SLEEPING;
+  t->wake = xTaskGetTickCount() + (ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;
+  sched_task_t **p = &sched_sleepers;
+  while (*p && (int32_t)((*p)->wake - t->wake) <= 0)
+    p = &(*p)->next;
+  t->next = *p;
+  *p = t;
+  if (sched_sleepers == t)
+    sched_arm();
+  sched_parked = true;
+  return lua_yield( L, 0 );
+}
+
+void sched_wake( lua_State *L, struct sched_task **waiter, int n )
+{
+  sched_task_t *t = *waiter;
+  if (!t) {
+    lua_pop( L, n );
+    return;
+  }
+  *waiter = NULL;
+  lua_xmove( L, t->co, n );
+  t->nargs = n;
+  sched_ready( t );
+}
+
+// Lua: co = sched.spawn(f, ...)
+// Runs f with the arguments as a task, from the next pass of the pump on
+static int sched_spawn( lua_State *L )
+{
+  int n = lua_gettop( L );
+  luaL_argcheck( L, lua_isfunction( L, 1 ) || lua_islightfunction( L, 1 ), 1,
+                 "function expected" );
+  if (sched_tasks_ref == LUA_NOREF)
+    return luaL_error( L, "sched not initialised" );
+
+  lua_State *co = lua_newthread( L );
+  sched_task_t *t = (sched_task_t *)lua_newuserdata( L, sizeof(sched_task_t) );
+  t->co = co;
+  t->nargs = n - 1;
+  t->lua_wait = false;
+  lua_rawgeti( L, LUA_REGISTRYINDEX, sched_tasks_ref );
+  lua_pushvalue( L, -3 );
+  lua_pushvalue( L, -3 );
+  lua_rawset( L, -3 );
+  lua_pop( L, 2 );
+
+  // Function and arguments go over to the coroutine, leaving it on top
+  lua_insert( L, 1 );
+  lua_xmove( L, co, n );
+  sched_count++;
+  sched_ready( t );
+  return 1;
+}
+
+// Lua: sched.sleep(ms)
+static int sched_lsleep( lua_State *L )
+{
+  lua_Integer ms = luaL_checkinteger( L, 1 );
+  luaL_argcheck( L, ms >= 0, 1, "negative time" );
+  return sched_sleep( L, ms );
+}
+
+// Lua: sched.yield()
+// Lets the other ready tasks run
+static int sched_yield( lua_State *L )
+{
+  if (!sched_can_wait( L ))
+    return luaL_error( L, "not in a sched task" );
+  return lua_yield( L, 0 );
+}
+
+// Lua: ... = sched.wait()
+// Suspends the running task until sched.wake() passes it values
+static int sched_lwait( lua_State *L )
+{
+  return sched_wait( L, NULL );
+}
+
+// Lua: woken = sched.wake(co, ...)
+// false unless co is a task in sched.wait()
+static int sched_lwake( lua_State *L )
+{
+  luaL_checktype( L, 1, LUA_TTHREAD );
+  lua_rawgeti( L, LUA_REGISTRYINDEX, sched_tasks_ref );
+  lua_pushvalue( L, 1 );
+  lua_rawget( L, -2 );
+  sched_task_t *t = (sched_task_t *)lua_touserdata( L, -1 );
+  lua_pop( L, 2 );
+  if (!t || t->state != SCHED_WAITING || !t->lua_wait) {
+    lua_pushboolean( L, 0 );
+    return 1;
+  }
+  sched_wake( L, &t, lua_gettop( L ) - 1 );
+  lua_pushboolean( L, 1 );
+  return 1;
+}
+
+// Lua: co = sched.current()
+// The task calling it, or nil outside one
+static int sched_lcurrent( lua_State *L )
+{
+  if (sched_can_wait( L ))
+    lua_pushthread( L );
+  else
+    lua_pushnil( L );
+  return 1;
+}
+
+// Lua: n = sched.count()
+static int sched_lcount( lua_State *L )
+{
+  lua_pushinteger( L, sched_count );
+  return 1;
+}
+
+// Module function map
+const LUA_REG_TYPE sched_map[] = {
+  { LSTRKEY( "spawn" ),   LFUNCVAL( sched_spawn ) },
+  { LSTRKEY( "sleep" ),   LFUNCVAL( sched_lsleep ) },
+  { LSTRKEY( "yield" ),   LFUNCVAL( sched_yield ) },
+  { LSTRKEY( "wait" ),    LFUNCVAL( sched_lwait ) },
+  { LSTRKEY( "wake" ),    LFUNCVAL( sched_lwake ) },
+  { LSTRKEY( "current" ), LFUNCVAL( sched_lcurrent ) },
+  { LSTRKEY( "count" ),   LFUNCVAL( sched_lcount ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_sched( lua_State *L )
+{
+  lua_newtable( L );
+  sched_tasks_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  sched_event = task_get_id( sched_run );
+  os_timer_setfn( &sched_timer, sched_tick, NULL );
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_SCHEDLIBNAME, sched_map );
+  return 1;
+#endif
+}
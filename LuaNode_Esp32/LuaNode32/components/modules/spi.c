@@ -0,0 +1,363 @@
+// Module for SPI master transfers through the DMA engine
+//
+// command() and blit() drive TFT controllers that take a data/command
+// line next to SPI, so a whole rectangle of pixels goes out as a few DMA
+// transfers rather than a Lua call per pixel.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "buffer.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "platform.h"
+#include "c_types.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "task/task.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SPI_HSPI 2
+#define SPI_VSPI 3
+
+typedef struct {
+  int tx_ref;             // keeps the string being sent alive
+  int cb_ref;
+  uint8_t *tx_copy;       // only when the string was not word aligned
+  uint8_t *rx;
+  size_t len;
+  SemaphoreHandle_t wait; // set for a blocking transfer
+} spi_job_t;
+
+static task_handle_t spi_task;
+static int dc_pins[2] = { -1, -1 };     // per bus, for command() and blit()
+static SemaphoreHandle_t lcd_done;      // given as each piece of a display write goes out
+
+#define DC_PIN(bus) dc_pins[(bus) - SPI_HSPI]
+
+// MIPI DCS commands, which ILI9341, ST7735, ST7789 and most others take
+#define LCD_CASET 0x2a
+#define LCD_RASET 0x2b
+#define LCD_RAMWR 0x2c
+
+// Runs in the SPI interrupt
+static void spi_done( void *arg )
+{
+  spi_job_t *job = (spi_job_t *)arg;
+  if (job->wait)
+    xSemaphoreGiveFromISR( job->wait, NULL );
+  else
+    task_post_low( spi_task, (task_param_t)job );
+}
+
+static void spi_job_free( lua_State *L, spi_job_t *job )
+{
+  luaL_unref( L, LUA_REGISTRYINDEX, job->tx_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, job->cb_ref );
+  free( job->tx_copy );
+  free( job->rx );
+  free( job );
+}
+
+static void spi_task_handler( task_param_t param, task_prio_t prio )
+{
+  (void)prio;
+  spi_job_t *job = (spi_job_t *)param;
+  lua_State *L = lua_getstate();
+  int nargs = 0;
+  lua_rawgeti( L, LUA_REGISTRYINDEX, job->cb_ref );
+  if (job->rx) {
+    lua_pushlstring( L, (const char *)job->rx, job->len );
+    nargs = 1;
+  }
+  spi_job_free( L, job );
+  lua_call( L, nargs, 0 );
+}
+
+static unsigned spi_checkbus( lua_State *L, int idx )
+{
+  unsigned bus = luaL_checkinteger( L, idx );
+  if (bus != SPI_HSPI && bus != SPI_VSPI)
+    luaL_error( L, "wrong bus" );
+  return bus;
+}
+
+static int spi_getpin( lua_State *L, int idx, const char *name )
+{
+  lua_getfield( L, idx, name );
+  int pin = luaL_optinteger( L, -1, -1 );
+  lua_pop( L, 1 );
+  return pin;
+}
+
+// Lua: clock = spi.setup( bus, { sclk=, mosi=, miso=, cs=, dc=, mode=0, clock=1000000 } )
+// Pins left out are not routed; dc is the data/command line of a display,
+// for spi.command() and spi.blit(). Returns the clock the bus actually
+// runs at.
+static int lspi_setup( lua_State *L )
+{
+  unsigned bus = spi_checkbus( L, 1 );
+  luaL_checktype( L, 2, LUA_TTABLE );
+  int sclk = spi_getpin( L, 2, "sclk" );
+  int mosi = spi_getpin( L, 2, "mosi" );
+  int miso = spi_getpin( L, 2, "miso" );
+  int cs = spi_getpin( L, 2, "cs" );
+  int dc = spi_getpin( L, 2, "dc" );
+  lua_getfield( L, 2, "mode" );
+  int mode = luaL_optinteger( L, -1, 0 );
+  lua_getfield( L, 2, "clock" );
+  lua_Integer hz = luaL_optinteger( L, -1, 1000000 );
+  lua_pop( L, 2 );
+  if (mode < 0 || mode > 3)
+    return luaL_error( L, "wrong mode" );
+  if (hz <= 0)
+    return luaL_error( L, "wrong clock" );
+
+  uint32_t actual = platform_spi_dma_setup( bus, sclk, mosi, miso, cs, mode, hz );
+  if (!actual)
+    return luaL_error( L, "bus busy" );
+  if (dc >= 0)
+    platform_spi_dc_setup( dc );
+  DC_PIN( bus ) = dc;
+  lua_pushinteger( L, actual );
+  return 1;
+}
+
+// Sends the string at idx (or clocks in that many bytes if it is a number)
+// and either calls back with fn(data) or waits for the transfer.
+static int spi_start( lua_State *L, bool read )
+{
+  unsigned bus = spi_checkbus( L, 1 );
+  size_t len;
+  const char *data = NULL;
+  if (lua_type( L, 2 ) == LUA_TNUMBER && read)
+    len = luaL_checkinteger( L, 2 );
+  else
+    data = buffer_checklstring( L, 2, &len );
+  if (len == 0)
+    return luaL_error( L, "nothing to transfer" );
+  if (len > PLATFORM_SPI_DMA_MAX)
+    return luaL_error( L, "transfer too long" );
+  bool async = lua_type( L, 3 ) == LUA_TFUNCTION || lua_type( L, 3 ) == LUA_TLIGHTFUNCTION;
+
+  spi_job_t *job = (spi_job_t *)calloc( 1, sizeof(spi_job_t) );
+  if (!job)
+    return luaL_error( L, "out of memory" );
+  job->tx_ref = job->cb_ref = LUA_NOREF;
+  job->len = len;
+  bool oom = false;
+  if (data && ((uint32_t)data & 3)) {
+    job->tx_copy = (uint8_t *)malloc( len );
+    if (job->tx_copy)
+      memcpy( job->tx_copy, data, len );
+    else
+      oom = true;
+  }
+  if (read && !(job->rx = (uint8_t *)malloc( (len + 3) & ~3 )))
+    oom = true;
+  if (oom) {
+    spi_job_free( L, job );
+    return luaL_error( L, "out of memory" );
+  }
+  const uint8_t *tx = job->tx_copy ? job->tx_copy : (const uint8_t *)data;
+
+  if (async) {
+    if (data && !job->tx_copy) {
+      lua_pushvalue( L, 2 );
+      job->tx_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+    }
+    lua_pushvalue( L, 3 );
+    job->cb_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+    if (!spi_task)
+      spi_task = task_get_id( spi_task_handler );
+  } else {
+    job->wait = xSemaphoreCreateBinary();
+    if (!job->wait) {
+      spi_job_free( L, job );
+      return luaL_error( L, "out of memory" );
+    }
+  }
+
+  int res = platform_spi_transfer( bus, tx, job->rx, len, spi_done, job );
+  if (res) {
+    if (job->wait)
+      vSemaphoreDelete( job->wait );
+    spi_job_free( L, job );
+    return luaL_error( L, res == -2 ? "spi queue full" : "bus not set up" );
+  }
+  if (async)
+    return 0;
+
+  // data stays on the Lua stack, so it can't be collected while we wait
+  xSemaphoreTake( job->wait, portMAX_DELAY );
+  vSemaphoreDelete( job->wait );
+  int nres = 0;
+  if (job->rx) {
+    lua_pushlstring( L, (const char *)job->rx, len );
+    nres = 1;
+  }
+  spi_job_free( L, job );
+  return nres;
+}
+
+// Lua: received = spi.transfer( bus, data[, function(received)] )
+// data is a string to send, or a byte count to only read. With a function
+// the transfer is queued and the call returns at once.
+static int lspi_transfer( lua_State *L )
+{
+  return spi_start( L, true );
+}
+
+// Lua: spi.write( bus, data[, function()] ), or spi.send()
+// Like transfer() without keeping what comes back on MISO.
+static int lspi_write( lua_State *L )
+{
+  return spi_start( L, false );
+}
+
+// Lua: received = spi.recv( bus, n[, function(received)] )
+// Clocks in n bytes without sending anything.
+static int lspi_recv( lua_State *L )
+{
+  luaL_checkinteger( L, 2 );
+  return spi_start( L, true );
+}
+
+// Runs in the SPI interrupt
+static void lcd_piece_done( void *arg )
+{
+  xSemaphoreGiveFromISR( lcd_done, NULL );
+}
+
+// Send len bytes with the dc line at level and wait until they are out.
+// Anything queued before goes out first, with the level it was meant for.
+static void lcd_send( lua_State *L, unsigned bus, int level, const uint8_t *data, size_t len )
+{
+  while (platform_spi_busy( bus ))
+    vTaskDelay( 1 );
+  platform_gpio_write( DC_PIN( bus ), level );
+
+  uint8_t *copy = NULL;
+  if ((uint32_t)data & 3) {
+    copy = (uint8_t *)malloc( len );
+    if (!copy)
+      luaL_error( L, "out of memory" );
+    memcpy( copy, data, len );
+    data = copy;
+  }
+  unsigned pending = 0;
+  int res = 0;
+  size_t off = 0;
+  while (off < len) {
+    size_t n = len - off > PLATFORM_SPI_DMA_MAX ? PLATFORM_SPI_DMA_MAX : len - off;
+    res = platform_spi_transfer( bus, data + off, NULL, n, lcd_piece_done, NULL );
+    if (res == -2 && pending) {
+      // queue full, wait for a piece to make room
+      xSemaphoreTake( lcd_done, portMAX_DELAY );
+      pending--;
+      continue;
+    }
+    if (res)
+      break;
+    pending++;
+    off += n;
+  }
+  for (; pending; pending--)
+    xSemaphoreTake( lcd_done, portMAX_DELAY );
+  free( copy );
+  if (res)
+    luaL_error( L, "bus not set up" );
+}
+
+static void lcd_command( lua_State *L, unsigned bus, uint8_t cmd, const uint8_t *params, size_t len )
+{
+  uint32_t word = cmd;    // word aligned for the DMA
+  lcd_send( L, bus, 0, (const uint8_t *)&word, 1 );
+  if (len)
+    lcd_send( L, bus, 1, params, len );
+}
+
+static unsigned lcd_checkbus( lua_State *L )
+{
+  unsigned bus = spi_checkbus( L, 1 );
+  if (DC_PIN( bus ) < 0)
+    luaL_error( L, "no dc pin set up" );
+  if (!lcd_done && !(lcd_done = xSemaphoreCreateCounting( 64, 0 )))
+    luaL_error( L, "out of memory" );
+  return bus;
+}
+
+// Lua: spi.command( bus, cmd[, params] )
+// Sends the command byte cmd with dc low, then the string or buffer params
+// with dc high, and waits until they are out. For the init sequence of a
+// display.
+static int lspi_command( lua_State *L )
+{
+  unsigned bus = lcd_checkbus( L );
+  int cmd = luaL_checkinteger( L, 2 );
+  luaL_argcheck( L, cmd >= 0 && cmd <= 255, 2, "wrong command" );
+  size_t len = 0;
+  const char *params = NULL;
+  if (!lua_isnoneornil( L, 3 ))
+    params = buffer_checklstring( L, 3, &len );
+  lcd_command( L, bus, cmd, (const uint8_t *)params, len );
+  return 0;
+}
+
+// Lua: spi.blit( bus, x, y, w, h, data )
+// Sets the display's window to w by h pixels at x, y and writes data, a
+// string or buffer holding the rectangle row by row in whatever pixel
+// format the display is set to, 2 bytes a pixel for RGB565. Waits until
+// it is out.
+static int lspi_blit( lua_State *L )
+{
+  unsigned bus = lcd_checkbus( L );
+  int x = luaL_checkinteger( L, 2 );
+  int y = luaL_checkinteger( L, 3 );
+  int w = luaL_checkinteger( L, 4 );
+  int h = luaL_checkinteger( L, 5 );
+  size_t len;
+  const char *data = buffer_checklstring( L, 6, &len );
+  luaL_argcheck( L, x >= 0 && x <= 0xffff, 2, "wrong x" );
+  luaL_argcheck( L, y >= 0 && y <= 0xffff, 3, "wrong y" );
+  luaL_argcheck( L, w > 0 && x + w - 1 <= 0xffff, 4, "wrong width" );
+  luaL_argcheck( L, h > 0 && y + h - 1 <= 0xffff, 5, "wrong height" );
+  size_t pixels = (size_t)w * h;
+  luaL_argcheck( L, len > 0 && len % pixels == 0 && len / pixels <= 4, 6, "data doesn't fit the rectangle" );
+
+  uint32_t word;          // word aligned for the DMA
+  uint8_t *win = (uint8_t *)&word;
+  int x1 = x + w - 1, y1 = y + h - 1;
+  win[0] = x >> 8; win[1] = x; win[2] = x1 >> 8; win[3] = x1;
+  lcd_command( L, bus, LCD_CASET, win, 4 );
+  win[0] = y >> 8; win[1] = y; win[2] = y1 >> 8; win[3] = y1;
+  lcd_command( L, bus, LCD_RASET, win, 4 );
+  lcd_command( L, bus, LCD_RAMWR, (const uint8_t *)data, len );
+  return 0;
+}
+
+// Module function map
+const LUA_REG_TYPE spi_map[] = {
+  { LSTRKEY( "setup" ),    LFUNCVAL( lspi_setup ) },
+  { LSTRKEY( "transfer" ), LFUNCVAL( lspi_transfer ) },
+  { LSTRKEY( "write" ),    LFUNCVAL( lspi_write ) },
+  { LSTRKEY( "send" ),     LFUNCVAL( lspi_write ) },
+  { LSTRKEY( "recv" ),     LFUNCVAL( lspi_recv ) },
+  { LSTRKEY( "command" ),  LFUNCVAL( lspi_command ) },
+  { LSTRKEY( "blit" ),     LFUNCVAL( lspi_blit ) },
+  { LSTRKEY( "HSPI" ),     LNUMVAL( SPI_HSPI ) },
+  { LSTRKEY( "VSPI" ),     LNUMVAL( SPI_VSPI ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_spi(lua_State *L)
+{
+#if LUA_OPTIMIZE_MEMORY > 0
+    return 0;
+#else
+	luaL_register( L, LUA_SPILIBNAME, spi_map );
+	return 1;
+#endif
+}
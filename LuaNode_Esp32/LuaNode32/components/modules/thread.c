@@ -31,11 +31,15 @@
 #include "lua.h"
 #include "lapi.h"
 #include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
 #include "lgc.h"
 #include "lmem.h"
 #include "ldo.h"
 #include "thread.h"
 #include "modules.h"
+#include "sched.h"
+#include "cbref.h"
 
 #include <unistd.h>
 #include <stdlib.h>
@@ -45,14 +49,36 @@
 #include <errno.h>
 
 #include "list.h"
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
 
 #define LTHREAD_STATUS_RUNNING   1
 #define LTHREAD_STATUS_SUSPENDED 2
 
 #define LUA_OK		0
 
+#define THREAD_MSG_DEPTH         16   // tables nested in a message
+#define THREAD_CHANNEL_CAPACITY  8    // messages, when none is given
+#define THREAD_SEMAPHORE_MAX     0x7fff
+
+static const char THREAD_TABLE_CHANNEL[] = "thread.channel";
+
 // List of threads
 static struct list lthread_list;
+static cbref_table_t thread_cbs = CBREF_TABLE("thread", false);
+
+static uint32_t thread_atomic_add(volatile uint32_t *counter, int32_t n) {
+    uint32_t v, set;
+    do {
+        v = *counter;
+        set = v + n;
+        uxPortCompareSet(counter, v, &set);
+    } while (set != v);
+    return v + n;
+}
 
 void thread_terminated(void *args) {
     struct lthread *thread;
@@ -60,7 +86,7 @@ void thread_terminated(void *args) {
     int *thid = (void *)args;
     int res = list_get(&lthread_list, *thid, (void **)&thread);
     if (!res) {  
-        luaL_unref(thread->PL, LUA_REGISTRYINDEX, thread->function_ref);
+        cbref_unref(thread->PL, &thread_cbs, thread->function_ref);
         luaL_unref(thread->PL, LUA_REGISTRYINDEX, thread->thread_ref);
             
         list_remove(&lthread_list, *thid);
@@ -184,8 +210,15 @@ static int thread_stop_pthreads(lua_State *L, int thid) {
             _pthread_stop(thread->thread);            
             _pthread_free(thread->thread);
 
-            luaL_unref(L, LUA_REGISTRYINDEX, thread->function_ref);
-            luaL_unref(L, LUA_REGISTRYINDEX, thread->thread_ref);
+            if (thread->isolated) {
+                if (thread->L) {
+                    lua_close(thread->L);
+                    thread_atomic_add((volatile uint32_t *)&luaR_workers, -1);
+                }
+            } else {
+                cbref_unref(L, &thread_cbs, thread->function_ref);
+                luaL_unref(L, LUA_REGISTRYINDEX, thread->thread_ref);
+            }
 
             list_remove(&lthread_list, idx);
         }
@@ -218,9 +251,62 @@ static int thread_stop_pthreads(lua_State *L, int thid) {
     return 0;
 }
 
+// Where a thread stands: the least stack it has had left, in bytes, and
+// what its state holds if it has one of its own, or -1
+typedef struct {
+    int free;
+    int mem;
+    int time;
+} thread_usage_t;
+
+#if (configUSE_TRACE_FACILITY == 1) && (configGENERATE_RUN_TIME_STATS == 1)
+// CPU time comes from the run time stats, taken once for the whole list
+static TaskStatus_t *thread_stats;
+static UBaseType_t thread_nstats;
+
+static void thread_stats_take(void) {
+    UBaseType_t n = uxTaskGetNumberOfTasks() + 2;
+
+    thread_stats = (TaskStatus_t *)malloc(n * sizeof(TaskStatus_t));
+    thread_nstats = thread_stats ? uxTaskGetSystemState(thread_stats, n, NULL) : 0;
+}
+
+static void thread_stats_drop(void) {
+    free(thread_stats);
+    thread_stats = NULL;
+}
+
+static int thread_stats_time(TaskHandle_t task) {
+    UBaseType_t i;
+
+    for (i = 0; i < thread_nstats; i++) {
+        if (thread_stats[i].xHandle == task) {
+            return thread_stats[i].ulRunTimeCounter;
+        }
+    }
+    return -1;
+}
+#else
+#define thread_stats_take()
+#define thread_stats_drop()
+#define thread_stats_time(task) -1
+#endif
+
+static void thread_usage(struct lthread *thread, thread_usage_t *u) {
+    TaskHandle_t task = _pthread_task(thread->thread);
+    lua_State *L = thread->L;
+
+    u->free = task ? uxTaskGetStackHighWaterMark(task) : -1;
+    u->time = task ? thread_stats_time(task) : -1;
+
+    // A worker's state goes once it's done, read it as it is
+    u->mem = (thread->isolated && L) ? G(L)->totalbytes : -1;
+}
+
 static int thread_list(lua_State *L) {
     struct lthread *thread;
-    int idx;
+    thread_usage_t u;
+    int idx, n;
     char status[5];
 
     const char *format = luaL_optstring(L, 1, "");
@@ -237,8 +323,48 @@ static int thread_list(lua_State *L) {
         
         lua_pushinteger(L, n);
         return 1;
+    } else if (strcmp(format,"*t") == 0) {
+        // As a table, one entry each
+        lua_newtable(L);
+        thread_stats_take();
+        n = 0;
+        idx = list_first(&lthread_list);
+        while (idx >= 0) {
+            list_get(&lthread_list, idx, (void **)&thread);
+            thread_usage(thread, &u);
+
+            lua_createtable(L, 0, 8);
+            lua_pushinteger(L, idx);
+            lua_setfield(L, -2, "thid");
+            lua_pushstring(L, (thread->status == LTHREAD_STATUS_SUSPENDED) ? "suspended" : "running");
+            lua_setfield(L, -2, "status");
+            lua_pushboolean(L, thread->isolated);
+            lua_setfield(L, -2, "worker");
+            lua_pushinteger(L, _pthread_core(thread->thread));
+            lua_setfield(L, -2, "core");
+            lua_pushinteger(L, thread->stack);
+            lua_setfield(L, -2, "stack");
+            if (u.free >= 0) {
+                lua_pushinteger(L, u.free);
+                lua_setfield(L, -2, "stack_free");
+            }
+            if (u.mem >= 0) {
+                lua_pushinteger(L, u.mem);
+                lua_setfield(L, -2, "mem");
+            }
+            if (u.time >= 0) {
+                lua_pushinteger(L, u.time);
+                lua_setfield(L, -2, "time");
+            }
+            lua_rawseti(L, -2, ++n);
+
+            idx = list_next(&lthread_list, idx);
+        }
+        thread_stats_drop();
+        return 1;
     } else {
-        printf("THID\tNAME\t\tSTATUS\tCORE\tTIME\n");
+        printf("THID\tNAME\t\tSTATUS\tCORE\tTIME\tSTACK\tFREE\tMEM\n");
+        thread_stats_take();
 
         // For each lthread in list ...
         idx = list_first(&lthread_list);
@@ -254,21 +380,44 @@ static int thread_list(lua_State *L) {
 
             }
 
-            printf("%d\t%s\t\t%s\t%d\t%d\n", idx, "", status, _pthread_core(thread->thread),0);
+            thread_usage(thread, &u);
+            printf("%d\t%s\t\t%s\t%d\t%d\t%d\t%d\t%d\n", idx, thread->isolated ? "worker" : "",
+                   status, _pthread_core(thread->thread), u.time, thread->stack, u.free, u.mem);
 
             idx = list_next(&lthread_list, idx);
         }        
+        thread_stats_drop();
     }
     
     return 0;
 }
 
+#if defined(CONFIG_LUA_THREAD_CORE) && !defined(CONFIG_FREERTOS_UNICORE)
+#define LUA_THREAD_CORE CONFIG_LUA_THREAD_CORE
+#else
+#define LUA_THREAD_CORE -1
+#endif
+
+// thread.start(function[, core[, stack]]), core -1 lets the scheduler pick.
+// stack is in bytes; what thread.list() shows as free tells how far it can
+// come down.
 static int new_thread(lua_State* L, int run) {
     struct lthread *thread;
     pthread_attr_t attr;
     int res, idx;
     pthread_t id;
     int retries;
+    int core;
+    int stack;
+    
+    // Check the optional core and stack before anything is allocated
+    core = luaL_optinteger(L, 2, LUA_THREAD_CORE);
+    if ((core < -1) || (core >= portNUM_PROCESSORS)) {
+        return luaL_error(L, "invalid core");
+    }
+    stack = luaL_optinteger(L, 3, defaultThreadStack);
+    luaL_argcheck(L, stack >= PTHREAD_STACK_MIN, 3, "stack too small");
+    lua_settop(L, 1);
     
     // Allocate space for lthread info
     thread = (struct lthread *)malloc(sizeof(struct lthread));
@@ -278,15 +427,18 @@ static int new_thread(lua_State* L, int run) {
     
     // Check for argument is a function, and store it's reference
     luaL_checktype(L, 1, LUA_TFUNCTION);
-    thread->function_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    thread->function_ref = cbref_ref(L, &thread_cbs);
     
     // Create a new state, move function to it and store thread reference
     thread->PL = L;
     thread->L = lua_newthread(L);
     thread->thread_ref = luaL_ref(L, LUA_REGISTRYINDEX);
     thread->status = LTHREAD_STATUS_SUSPENDED;
+    thread->nargs = 0;
+    thread->isolated = 0;
+    thread->stack = stack;
     
-    lua_rawgeti(L, LUA_REGISTRYINDEX, thread->function_ref);                
+    cbref_get(L, &thread_cbs, thread->function_ref);                
     lua_xmove(L, thread->L, 1);
 
     // Add lthread to list
@@ -298,7 +450,7 @@ static int new_thread(lua_State* L, int run) {
 	
     // Create pthread
     pthread_attr_init(&attr);
-    pthread_attr_setstacksize(&attr, defaultThreadStack);
+    pthread_attr_setstacksize(&attr, stack);
 
     if (run)  {
         pthread_attr_setinitialstate(&attr, PTHREAD_INITIAL_STATE_RUN);
@@ -306,6 +458,8 @@ static int new_thread(lua_State* L, int run) {
         pthread_attr_setinitialstate(&attr, PTHREAD_INITIAL_STATE_SUSPEND);        
     }
     
+    pthread_attr_setcore(&attr, (core < 0) ? tskNO_AFFINITY : core);
+    
     thread->thid = idx;
     
     retries = 0;
@@ -347,12 +501,1242 @@ static int thread_create(lua_State* L) {
     return new_thread(L, 0);
 }    
 
+// Workers run in a global state of their own, so they can run in parallel
+// with the main state and each other. States share nothing: values go from
+// one to another as copies, through channels.
+//
+// A message is a sequence of tagged values: n(il), T(rue), F(alse),
+// d lua_Number, s size_t len then the bytes, t key value pairs up to e, and
+// c channel pointer, y pointer to a mutex, semaphore, event or atomic. Each
+// copy of a channel or of one of those in a message holds a reference.
+
+typedef struct {
+    QueueHandle_t queue;            // of thread_msg_t
+    volatile uint32_t refs;         // userdata and messages holding it
+} thread_chan_t;
+
+typedef struct {
+    char *data;
+    size_t len;
+} thread_msg_t;
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t size;
+    const char *err;                // why encoding failed, or
+    int badtype;                    // the type it couldn't copy
+} thread_buf_t;
+
+enum { THREAD_SYNC_MUTEX, THREAD_SYNC_SEMAPHORE, THREAD_SYNC_EVENT, THREAD_SYNC_ATOMIC };
+
+static const char *const thread_sync_tables[] = {
+    "thread.mutex", "thread.semaphore", "thread.event", "thread.atomic"
+};
+
+typedef struct {
+    int kind;
+    int recursive;                  // mutex
+    volatile uint32_t refs;
+    union {
+        SemaphoreHandle_t sem;      // mutex and semaphore
+        EventGroupHandle_t event;
+        volatile uint32_t value;    // atomic
+    } u;
+} thread_sync_t;
+
+static void thread_chan_unref(thread_chan_t *ch);
+static thread_sync_t *thread_tosync(lua_State *L, int idx);
+static thread_sync_t **thread_pushsync(lua_State *L, thread_sync_t *s, int kind);
+static void thread_sync_unref(thread_sync_t *s);
+
+static int thread_buf_add(thread_buf_t *b, const void *p, size_t n) {
+    if (b->len + n > b->size) {
+        size_t size = b->size ? b->size : 64;
+        char *data;
+
+        while (size < b->len + n) {
+            size *= 2;
+        }
+        data = (char *)realloc(b->data, size);
+        if (!data) {
+            b->err = "not enough memory";
+            return 0;
+        }
+        b->data = data;
+        b->size = size;
+    }
+
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+    return 1;
+}
+
+static int thread_writer(lua_State *L, const void *p, size_t sz, void *ud) {
+    return !thread_buf_add((thread_buf_t *)ud, p, sz);
+}
+
+static thread_chan_t **thread_pushchan(lua_State *L, thread_chan_t *ch) {
+    thread_chan_t **p = (thread_chan_t **)lua_newuserdata(L, sizeof(thread_chan_t *));
+    *p = ch;
+    luaL_getmetatable(L, THREAD_TABLE_CHANNEL);
+    lua_setmetatable(L, -2);
+    return p;
+}
+
+// The channel at idx, or NULL if it isn't one
+static thread_chan_t *thread_tochan(lua_State *L, int idx) {
+    thread_chan_t **p = (thread_chan_t **)lua_touserdata(L, idx);
+    int same;
+
+    if (!p || !lua_getmetatable(L, idx)) {
+        return NULL;
+    }
+    luaL_getmetatable(L, THREAD_TABLE_CHANNEL);
+    same = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    return same ? *p : NULL;
+}
+
+static int thread_encode(lua_State *L, int idx, thread_buf_t *b, int depth) {
+    int type = lua_type(L, idx);
+    char tag;
+
+    switch (type) {
+        case LUA_TNIL:
+            tag = 'n';
+            return thread_buf_add(b, &tag, 1);
+
+        case LUA_TBOOLEAN:
+            tag = lua_toboolean(L, idx) ? 'T' : 'F';
+            return thread_buf_add(b, &tag, 1);
+
+        case LUA_TNUMBER: {
+            lua_Number n = lua_tonumber(L, idx);
+            tag = 'd';
+            return thread_buf_add(b, &tag, 1) && thread_buf_add(b, &n, sizeof(n));
+        }
+
+        case LUA_TSTRING: {
+            size_t len;
+            const char *str = lua_tolstring(L, idx, &len);
+            tag = 's';
+            return thread_buf_add(b, &tag, 1) && thread_buf_add(b, &len, sizeof(len)) &&
+                   thread_buf_add(b, str, len);
+        }
+
+        case LUA_TTABLE:
+            // Also what stops a table that holds itself
+            if ((depth >= THREAD_MSG_DEPTH) || !lua_checkstack(L, 4)) {
+                b->err = "table nested too deep";
+                return 0;
+            }
+            if (idx < 0) {
+                idx = lua_gettop(L) + idx + 1;
+            }
+            tag = 't';
+            if (!thread_buf_add(b, &tag, 1)) {
+                return 0;
+            }
+            lua_pushnil(L);
+            while (lua_next(L, idx)) {
+                if (!thread_encode(L, -2, b, depth + 1) || !thread_encode(L, -1, b, depth + 1)) {
+                    lua_pop(L, 2);
+                    return 0;
+                }
+                lua_pop(L, 1);
+            }
+            tag = 'e';
+            return thread_buf_add(b, &tag, 1);
+
+        case LUA_TUSERDATA: {
+            thread_chan_t *ch = thread_tochan(L, idx);
+            thread_sync_t *s;
+            if (ch) {
+                tag = 'c';
+                return thread_buf_add(b, &tag, 1) && thread_buf_add(b, &ch, sizeof(ch));
+            }
+            s = thread_tosync(L, idx);
+            if (s) {
+                tag = 'y';
+                return thread_buf_add(b, &tag, 1) && thread_buf_add(b, &s, sizeof(s));
+            }
+            break;
+        }
+    }
+
+    b->badtype = type;
+    return 0;
+}
+
+// Push the value at *p on L and step past it. With L NULL, only step past
+// it and add delta to the references of the channels in it.
+static void thread_decode(lua_State *L, const char **p, int delta) {
+    char tag = *(*p)++;
+
+    switch (tag) {
+        case 'n':
+            if (L) lua_pushnil(L);
+            break;
+
+        case 'T':
+        case 'F':
+            if (L) lua_pushboolean(L, tag == 'T');
+            break;
+
+        case 'd': {
+            lua_Number n;
+            memcpy(&n, *p, sizeof(n));
+            *p += sizeof(n);
+            if (L) lua_pushnumber(L, n);
+            break;
+        }
+
+        case 's': {
+            size_t len;
+            memcpy(&len, *p, sizeof(len));
+            *p += sizeof(len);
+            if (L) lua_pushlstring(L, *p, len);
+            *p += len;
+            break;
+        }
+
+        case 't':
+            if (L) {
+                luaL_checkstack(L, 3, "table nested too deep");
+                lua_newtable(L);
+            }
+            while (**p != 'e') {
+                thread_decode(L, p, delta);
+                thread_decode(L, p, delta);
+                if (L) lua_rawset(L, -3);
+            }
+            (*p)++;
+            break;
+
+        case 'c': {
+            thread_chan_t *ch;
+            memcpy(&ch, *p, sizeof(ch));
+            *p += sizeof(ch);
+            if (L) {
+                // The userdata takes over the message's reference
+                thread_pushchan(L, ch);
+            } else if (delta > 0) {
+                thread_atomic_add(&ch->refs, delta);
+            } else {
+                thread_chan_unref(ch);
+            }
+            break;
+        }
+
+        case 'y': {
+            thread_sync_t *s;
+            memcpy(&s, *p, sizeof(s));
+            *p += sizeof(s);
+            if (L) {
+                thread_pushsync(L, s, s->kind);
+            } else if (delta > 0) {
+                thread_atomic_add(&s->refs, delta);
+            } else {
+                thread_sync_unref(s);
+            }
+            break;
+        }
+    }
+}
+
+// Copy the values from idx to the top of L's stack into a message
+static void thread_msg_make(lua_State *L, int idx, thread_msg_t *m) {
+    thread_buf_t b = {NULL, 0, 0, NULL, LUA_TNONE};
+    int top = lua_gettop(L);
+    const char *p;
+
+    for (; idx <= top; idx++) {
+        if (!thread_encode(L, idx, &b, 0)) {
+            free(b.data);
+            if (b.err) {
+                luaL_error(L, "%s", b.err);
+            }
+            luaL_error(L, "can't copy a %s", lua_typename(L, b.badtype));
+        }
+    }
+
+    m->data = b.data;
+    m->len = b.len;
+    for (p = m->data; p < m->data + m->len;) {
+        thread_decode(NULL, &p, 1);
+    }
+}
+
+// Push the values of a message and free it, returning how many there are
+static int thread_msg_push(lua_State *L, thread_msg_t *m) {
+    char *data = m->data;
+    const char *p = data;
+    int n = 0;
+
+    m->data = NULL;
+    while (p < data + m->len) {
+        luaL_checkstack(L, 1, "too many values");
+        thread_decode(L, &p, 0);
+        n++;
+    }
+    free(data);
+    return n;
+}
+
+// Free a message that won't be received
+static void thread_msg_free(thread_msg_t *m) {
+    const char *p;
+
+    for (p = m->data; p < m->data + m->len;) {
+        thread_decode(NULL, &p, -1);
+    }
+    free(m->data);
+    m->data = NULL;
+}
+
+static void thread_chan_unref(thread_chan_t *ch) {
+    thread_msg_t m;
+
+    if (thread_atomic_add(&ch->refs, -1)) {
+        return;
+    }
+    while (xQueueReceive(ch->queue, &m, 0) == pdTRUE) {
+        thread_msg_free(&m);
+    }
+    vQueueDelete(ch->queue);
+    free(ch);
+}
+
+static thread_chan_t *thread_chan_new(int capacity) {
+    thread_chan_t *ch = (thread_chan_t *)malloc(sizeof(thread_chan_t));
+
+    if (!ch) {
+        return NULL;
+    }
+    ch->queue = xQueueCreate(capacity, sizeof(thread_msg_t));
+    if (!ch->queue) {
+        free(ch);
+        return NULL;
+    }
+    ch->refs = 1;
+    return ch;
+}
+
+// A timeout in milliseconds, waiting forever when there is none or it's negative
+static TickType_t thread_ticks(lua_State *L, int idx) {
+    lua_Integer ms = luaL_optinteger(L, idx, -1);
+
+    return (ms < 0) ? portMAX_DELAY : ms / portTICK_PERIOD_MS;
+}
+
+static thread_chan_t *thread_checkchan(lua_State *L) {
+    return *(thread_chan_t **)luaL_checkudata(L, 1, THREAD_TABLE_CHANNEL);
+}
+
+// Lua: ch = thread.channel([capacity])
+static int thread_channel(lua_State *L) {
+    lua_Integer capacity = luaL_optinteger(L, 1, THREAD_CHANNEL_CAPACITY);
+    thread_chan_t **p;
+    thread_chan_t *ch;
+
+    luaL_argcheck(L, capacity > 0, 1, "capacity must be positive");
+
+    // The userdata first, so that nothing leaks if it can't be had
+    p = thread_pushchan(L, NULL);
+    ch = thread_chan_new(capacity);
+    if (!ch) {
+        return luaL_error(L, "not enough memory");
+    }
+    *p = ch;
+    return 1;
+}
+
+// Lua: sent = ch:send(value[, timeout_ms])
+// false if the channel stayed full for timeout_ms
+static int thread_chan_send(lua_State *L) {
+    thread_chan_t *ch = thread_checkchan(L);
+    TickType_t ticks = thread_ticks(L, 3);
+    thread_msg_t m;
+
+    if (lua_isnoneornil(L, 2)) {
+        return luaL_error(L, "can't send nil");
+    }
+    lua_settop(L, 2);
+    thread_msg_make(L, 2, &m);
+
+    if (xQueueSend(ch->queue, &m, ticks) != pdTRUE) {
+        thread_msg_free(&m);
+        lua_pushboolean(L, 0);
+    } else {
+        lua_pushboolean(L, 1);
+    }
+    return 1;
+}
+
+// Lua: value = ch:receive([timeout_ms])
+// nil if nothing came within timeout_ms
+static int thread_chan_receive(lua_State *L) {
+    thread_chan_t *ch = thread_checkchan(L);
+    TickType_t ticks = thread_ticks(L, 2);
+    thread_msg_t m;
+
+    if (xQueueReceive(ch->queue, &m, ticks) != pdTRUE) {
+        lua_pushnil(L);
+        return 1;
+    }
+    return thread_msg_push(L, &m);
+}
+
+// Lua: n = ch:count()
+static int thread_chan_count(lua_State *L) {
+    thread_chan_t *ch = thread_checkchan(L);
+
+    lua_pushinteger(L, uxQueueMessagesWaiting(ch->queue));
+    return 1;
+}
+
+static int thread_chan_gc(lua_State *L) {
+    thread_chan_t **p = (thread_chan_t **)luaL_checkudata(L, 1, THREAD_TABLE_CHANNEL);
+
+    if (*p) {
+        thread_chan_unref(*p);
+        *p = NULL;
+    }
+    return 0;
+}
+
+static const LUA_REG_TYPE thread_chan_map[] = {
+    { LSTRKEY( "send" ),			LFUNCVAL( thread_chan_send ) },
+    { LSTRKEY( "receive" ),			LFUNCVAL( thread_chan_receive ) },
+    { LSTRKEY( "count" ),			LFUNCVAL( thread_chan_count ) },
+    { LSTRKEY( "__gc" ),			LFUNCVAL( thread_chan_gc ) },
+    { LSTRKEY( "__index" ),			LROVAL( thread_chan_map ) },
+    { LNILKEY, LNILVAL }
+};
+
+// Mutexes, semaphores, events and atomic counters, to share between
+// threads and workers like channels
+
+static thread_sync_t **thread_pushsync(lua_State *L, thread_sync_t *s, int kind) {
+    thread_sync_t **p = (thread_sync_t **)lua_newuserdata(L, sizeof(thread_sync_t *));
+    *p = s;
+    luaL_getmetatable(L, thread_sync_tables[kind]);
+    lua_setmetatable(L, -2);
+    return p;
+}
+
+// The object at idx, or NULL if it isn't one
+static thread_sync_t *thread_tosync(lua_State *L, int idx) {
+    thread_sync_t **p = (thread_sync_t **)lua_touserdata(L, idx);
+    int kind;
+
+    if (!p || !lua_getmetatable(L, idx)) {
+        return NULL;
+    }
+    for (kind = THREAD_SYNC_MUTEX; kind <= THREAD_SYNC_ATOMIC; kind++) {
+        luaL_getmetatable(L, thread_sync_tables[kind]);
+        if (lua_rawequal(L, -1, -2)) {
+            lua_pop(L, 2);
+            return *p;
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    return NULL;
+}
+
+static void thread_sync_unref(thread_sync_t *s) {
+    if (thread_atomic_add(&s->refs, -1)) {
+        return;
+    }
+    switch (s->kind) {
+        case THREAD_SYNC_MUTEX:
+        case THREAD_SYNC_SEMAPHORE:
+            if (s->u.sem) {
+                vSemaphoreDelete(s->u.sem);
+            }
+            break;
+
+        case THREAD_SYNC_EVENT:
+            if (s->u.event) {
+                vEventGroupDelete(s->u.event);
+            }
+            break;
+    }
+    free(s);
+}
+
+// A new object on the stack, the caller sets up its handle
+static thread_sync_t *thread_sync_new(lua_State *L, int kind) {
+    thread_sync_t **p = thread_pushsync(L, NULL, kind);
+    thread_sync_t *s = (thread_sync_t *)calloc(1, sizeof(thread_sync_t));
+
+    if (!s) {
+        luaL_error(L, "not enough memory");
+    }
+    s->kind = kind;
+    s->refs = 1;
+    *p = s;
+    return s;
+}
+
+static thread_sync_t *thread_checksync(lua_State *L, int kind) {
+    return *(thread_sync_t **)luaL_checkudata(L, 1, thread_sync_tables[kind]);
+}
+
+static int thread_sync_gc(lua_State *L) {
+    thread_sync_t **p = (thread_sync_t **)lua_touserdata(L, 1);
+
+    if (*p) {
+        thread_sync_unref(*p);
+        *p = NULL;
+    }
+    return 0;
+}
+
+// Lua: m = thread.mutex([recursive])
+// The holder runs at the priority of the highest thread waiting for it, so
+// a low priority thread holding it doesn't hold up the Lua, lwIP or MQTT
+// tasks. A recursive mutex can be locked again by the thread holding it,
+// and is released by as many unlocks.
+static int thread_mutex(lua_State *L) {
+    int recursive = lua_toboolean(L, 1);
+    thread_sync_t *s = thread_sync_new(L, THREAD_SYNC_MUTEX);
+
+    s->recursive = recursive;
+    s->u.sem = recursive ? xSemaphoreCreateRecursiveMutex() : xSemaphoreCreateMutex();
+    if (!s->u.sem) {
+        return luaL_error(L, "not enough memory");
+    }
+    return 1;
+}
+
+// Lua: locked = m:lock([timeout_ms])
+// false if another thread held it for timeout_ms
+static int thread_mutex_lock(lua_State *L) {
+    thread_sync_t *s = thread_checksync(L, THREAD_SYNC_MUTEX);
+    TickType_t ticks = thread_ticks(L, 2);
+
+    if (s->recursive) {
+        lua_pushboolean(L, xSemaphoreTakeRecursive(s->u.sem, ticks) == pdTRUE);
+    } else {
+        lua_pushboolean(L, xSemaphoreTake(s->u.sem, ticks) == pdTRUE);
+    }
+    return 1;
+}
+
+// Lua: m:unlock()
+static int thread_mutex_unlock(lua_State *L) {
+    thread_sync_t *s = thread_checksync(L, THREAD_SYNC_MUTEX);
+    BaseType_t given = s->recursive ? xSemaphoreGiveRecursive(s->u.sem) : xSemaphoreGive(s->u.sem);
+
+    if (given != pdTRUE) {
+        return luaL_error(L, "mutex not held by this thread");
+    }
+    return 0;
+}
+
+static const LUA_REG_TYPE thread_mutex_map[] = {
+    { LSTRKEY( "lock" ),			LFUNCVAL( thread_mutex_lock ) },
+    { LSTRKEY( "unlock" ),			LFUNCVAL( thread_mutex_unlock ) },
+    { LSTRKEY( "__gc" ),			LFUNCVAL( thread_sync_gc ) },
+    { LSTRKEY( "__index" ),			LROVAL( thread_mutex_map ) },
+    { LNILKEY, LNILVAL }
+};
+
+// Lua: sem = thread.semaphore([count[, max]])
+static int thread_semaphore(lua_State *L) {
+    lua_Integer count = luaL_optinteger(L, 1, 0);
+    lua_Integer max = luaL_optinteger(L, 2, THREAD_SEMAPHORE_MAX);
+    thread_sync_t *s;
+
+    luaL_argcheck(L, max > 0, 2, "max must be positive");
+    luaL_argcheck(L, (count >= 0) && (count <= max), 1, "count out of range");
+    s = thread_sync_new(L, THREAD_SYNC_SEMAPHORE);
+    s->u.sem = xSemaphoreCreateCounting(max, count);
+    if (!s->u.sem) {
+        return luaL_error(L, "not enough memory");
+    }
+    return 1;
+}
+
+// Lua: taken = sem:take([timeout_ms])
+// false if the count stayed 0 for timeout_ms
+static int thread_semaphore_take(lua_State *L) {
+    thread_sync_t *s = thread_checksync(L, THREAD_SYNC_SEMAPHORE);
+
+    lua_pushboolean(L, xSemaphoreTake(s->u.sem, thread_ticks(L, 2)) == pdTRUE);
+    return 1;
+}
+
+// Lua: given = sem:give()
+// false if the count is at its max already
+static int thread_semaphore_give(lua_State *L) {
+    thread_sync_t *s = thread_checksync(L, THREAD_SYNC_SEMAPHORE);
+
+    lua_pushboolean(L, xSemaphoreGive(s->u.sem) == pdTRUE);
+    return 1;
+}
+
+// Lua: n = sem:count()
+static int thread_semaphore_count(lua_State *L) {
+    thread_sync_t *s = thread_checksync(L, THREAD_SYNC_SEMAPHORE);
+
+    // What uxSemaphoreGetCount() is, in FreeRTOS versions that have it
+    lua_pushinteger(L, uxQueueMessagesWaiting((QueueHandle_t)s->u.sem));
+    return 1;
+}
+
+static const LUA_REG_TYPE thread_semaphore_map[] = {
+    { LSTRKEY( "take" ),			LFUNCVAL( thread_semaphore_take ) },
+    { LSTRKEY( "give" ),			LFUNCVAL( thread_semaphore_give ) },
+    { LSTRKEY( "count" ),			LFUNCVAL( thread_semaphore_count ) },
+    { LSTRKEY( "__gc" ),			LFUNCVAL( thread_sync_gc ) },
+    { LSTRKEY( "__index" ),			LROVAL( thread_semaphore_map ) },
+    { LNILKEY, LNILVAL }
+};
+
+// Lua: ev = thread.event()
+// Stays set until cleared, and while set every wait returns at once
+static int thread_event(lua_State *L) {
+    thread_sync_t *s = thread_sync_new(L, THREAD_SYNC_EVENT);
+
+    s->u.event = xEventGroupCreate();
+    if (!s->u.event) {
+        return luaL_error(L, "not enough memory");
+    }
+    return 1;
+}
+
+// Lua: ev:set()
+static int thread_event_set(lua_State *L) {
+    thread_sync_t *s = thread_checksync(L, THREAD_SYNC_EVENT);
+
+    xEventGroupSetBits(s->u.event, 1);
+    return 0;
+}
+
+// Lua: ev:clear()
+static int thread_event_clear(lua_State *L) {
+    thread_sync_t *s = thread_checksync(L, THREAD_SYNC_EVENT);
+
+    xEventGroupClearBits(s->u.event, 1);
+    return 0;
+}
+
+// Lua: set = ev:wait([timeout_ms])
+// false if it wasn't set within timeout_ms
+static int thread_event_wait(lua_State *L) {
+    thread_sync_t *s = thread_checksync(L, THREAD_SYNC_EVENT);
+    EventBits_t bits = xEventGroupWaitBits(s->u.event, 1, pdFALSE, pdTRUE, thread_ticks(L, 2));
+
+    lua_pushboolean(L, bits & 1);
+    return 1;
+}
+
+// Lua: set = ev:isset()
+static int thread_event_isset(lua_State *L) {
+    thread_sync_t *s = thread_checksync(L, THREAD_SYNC_EVENT);
+
+    lua_pushboolean(L, xEventGroupGetBits(s->u.event) & 1);
+    return 1;
+}
+
+static const LUA_REG_TYPE thread_event_map[] = {
+    { LSTRKEY( "set" ),				LFUNCVAL( thread_event_set ) },
+    { LSTRKEY( "clear" ),			LFUNCVAL( thread_event_clear ) },
+    { LSTRKEY( "wait" ),			LFUNCVAL( thread_event_wait ) },
+    { LSTRKEY( "isset" ),			LFUNCVAL( thread_event_isset ) },
+    { LSTRKEY( "__gc" ),			LFUNCVAL( thread_sync_gc ) },
+    { LSTRKEY( "__index" ),			LROVAL( thread_event_map ) },
+    { LNILKEY, LNILVAL }
+};
+
+// Lua: a = thread.atomic([value])
+// A 32 bit integer, changed without taking any lock
+static int thread_atomic(lua_State *L) {
+    lua_Integer value = luaL_optinteger(L, 1, 0);
+    thread_sync_t *s = thread_sync_new(L, THREAD_SYNC_ATOMIC);
+
+    s->u.value = (uint32_t)value;
+    return 1;
+}
+
+// Lua: value = a:add([n])
+// Adds n, 1 if none is given, and returns the result
+static int thread_atomic_ladd(lua_State *L) {
+    thread_sync_t *s = thread_checksync(L, THREAD_SYNC_ATOMIC);
+    lua_Integer n = luaL_optinteger(L, 2, 1);
+
+    lua_pushinteger(L, (int32_t)thread_atomic_add(&s->u.value, n));
+    return 1;
+}
+
+// Lua: value = a:get()
+static int thread_atomic_get(lua_State *L) {
+    thread_sync_t *s = thread_checksync(L, THREAD_SYNC_ATOMIC);
+
+    lua_pushinteger(L, (int32_t)s->u.value);
+    return 1;
+}
+
+// Lua: old = a:set(value)
+static int thread_atomic_set(lua_State *L) {
+    thread_sync_t *s = thread_checksync(L, THREAD_SYNC_ATOMIC);
+    uint32_t value = (uint32_t)luaL_checkinteger(L, 2);
+    uint32_t v, set;
+
+    do {
+        v = s->u.value;
+        set = value;
+        uxPortCompareSet(&s->u.value, v, &set);
+    } while (set != v);
+    lua_pushinteger(L, (int32_t)v);
+    return 1;
+}
+
+// Lua: swapped = a:cas(expected, value)
+// Sets value only if a still holds expected
+static int thread_atomic_cas(lua_State *L) {
+    thread_sync_t *s = thread_checksync(L, THREAD_SYNC_ATOMIC);
+    uint32_t expected = (uint32_t)luaL_checkinteger(L, 2);
+    uint32_t set = (uint32_t)luaL_checkinteger(L, 3);
+
+    uxPortCompareSet(&s->u.value, expected, &set);
+    lua_pushboolean(L, set == expected);
+    return 1;
+}
+
+static const LUA_REG_TYPE thread_atomic_map[] = {
+    { LSTRKEY( "add" ),				LFUNCVAL( thread_atomic_ladd ) },
+    { LSTRKEY( "get" ),				LFUNCVAL( thread_atomic_get ) },
+    { LSTRKEY( "set" ),				LFUNCVAL( thread_atomic_set ) },
+    { LSTRKEY( "cas" ),				LFUNCVAL( thread_atomic_cas ) },
+    { LSTRKEY( "__gc" ),			LFUNCVAL( thread_sync_gc ) },
+    { LSTRKEY( "__index" ),			LROVAL( thread_atomic_map ) },
+    { LNILKEY, LNILVAL }
+};
+
+// Every state that can hold them needs the metatables
+static void thread_sync_tables_open(lua_State *L) {
+    luaL_rometatable(L, thread_sync_tables[THREAD_SYNC_MUTEX], (void *)thread_mutex_map);
+    luaL_rometatable(L, thread_sync_tables[THREAD_SYNC_SEMAPHORE], (void *)thread_semaphore_map);
+    luaL_rometatable(L, thread_sync_tables[THREAD_SYNC_EVENT], (void *)thread_event_map);
+    luaL_rometatable(L, thread_sync_tables[THREAD_SYNC_ATOMIC], (void *)thread_atomic_map);
+}
+
+typedef struct {
+    const char *code;               // source, or a dumped function
+    size_t len;
+    thread_msg_t args;
+} thread_worker_init_t;
+
+// The modules a worker's state can look up
+static const char *const thread_worker_modules[] = {
+    LUA_TABLIBNAME, LUA_STRLIBNAME, LUA_COLIBNAME, LUA_BUFFERLIBNAME,
+    LUA_CRCLIBNAME, LUA_DSPLIBNAME, LUA_ZLIBLIBNAME, LUA_COMPRESSLIBNAME
+};
+
+// The libraries a worker's state gets
+static void thread_worker_libs(lua_State *L) {
+    static const lua_CFunction libs[] = {luaopen_base, luaopen_table, luaopen_string};
+    static const char *const names[] = {"base", "table", "string"};
+    unsigned i;
+
+    for (i = 0; i < 3; i++) {
+        lua_pushcfunction(L, libs[i]);
+        lua_pushstring(L, names[i]);
+        lua_call(L, 1, 0);
+    }
+    luaL_rometatable(L, THREAD_TABLE_CHANNEL, (void *)thread_chan_map);
+    thread_sync_tables_open(L);
+    // Only modules that keep no state outside the Lua state they run in
+    // are safe here; everything else (drivers, sockets, timers, and cjson's
+    // shared config) is not found in a worker
+    for (i = 0; i < sizeof(thread_worker_modules) / sizeof(thread_worker_modules[0]); i++) {
+        luaR_getglobal(L, thread_worker_modules[i], strlen(thread_worker_modules[i]));
+    }
+    G(L)->rsealed = 1;
+}
+
+// Set up a worker's state: libraries, its function and its arguments
+static int thread_worker_init(lua_State *L) {
+    thread_worker_init_t *w = (thread_worker_init_t *)lua_touserdata(L, 1);
+
+    lua_settop(L, 0);
+    thread_worker_libs(L);
+
+    if (luaL_loadbuffer(L, w->code, w->len, "=worker")) {
+        return lua_error(L);
+    }
+    thread_msg_push(L, &w->args);
+    return lua_gettop(L);
+}
+
+void *thread_worker_task(void *arg) {
+    struct lthread *thread = (struct lthread *)arg;
+    lua_State *L;
+    int *thid;
+
+    thid = malloc(sizeof(int));
+    *thid = thread->thid;
+    pthread_cleanup_push(thread_terminated, thid);
+
+    if (lua_pcall(thread->L, thread->nargs, 0, 0) != LUA_OK) {
+        printf("worker %d: %s\n", thread->thid, lua_tostring(thread->L, -1));
+    }
+
+    // Gone from the list first, thread.list() may look at it meanwhile
+    L = thread->L;
+    thread->L = NULL;
+    lua_close(L);
+    thread_atomic_add((volatile uint32_t *)&luaR_workers, -1);
+    return NULL;
+}
+
+// Check that idx holds what a worker can run: Lua source, or a function
+// without upvalues
+static void thread_checkcode(lua_State *L, int idx) {
+    if (lua_type(L, idx) != LUA_TSTRING) {
+        luaL_checktype(L, idx, LUA_TFUNCTION);
+        if (lua_iscfunction(L, idx)) {
+            luaL_error(L, "can't run a C function in a worker");
+        }
+        if (lua_getupvalue(L, idx, 1)) {
+            luaL_error(L, "worker function can't have upvalues");
+        }
+    }
+}
+
+// Copy the source or the dumped function at idx into code
+static int thread_getcode(lua_State *L, int idx, thread_buf_t *code) {
+    size_t len;
+    int res;
+
+    if (lua_type(L, idx) == LUA_TSTRING) {
+        const char *src = lua_tolstring(L, idx, &len);
+        res = thread_buf_add(code, src, len);
+    } else {
+        lua_pushvalue(L, idx);
+        res = !lua_dump(L, thread_writer, code);
+        lua_pop(L, 1);
+    }
+    if (!res) {
+        free(code->data);
+        code->data = NULL;
+    }
+    return res;
+}
+
+#ifdef CONFIG_LUA_WORKER_STACK
+#define LUA_WORKER_STACK CONFIG_LUA_WORKER_STACK
+#else
+#define LUA_WORKER_STACK 8192
+#endif
+
+// Lua: thid = thread.worker(f[, core], ...)
+// Runs f with the arguments in a state of its own. f is Lua source, or a
+// function without upvalues. Arguments are copied, and channels are all
+// it can share with other states. Functions of the libraries and of modules
+// that only compute are fine to call; ones behind the event loop or a driver
+// (net, tmr, wifi, file, ...) belong to the main state.
+static int thread_worker(lua_State* L) {
+    thread_worker_init_t w;
+    thread_buf_t code = {NULL, 0, 0, NULL, LUA_TNONE};
+    struct lthread *thread;
+    pthread_attr_t attr;
+    lua_State *NL;
+    int res, idx;
+    int core;
+
+    core = luaL_optinteger(L, 2, LUA_THREAD_CORE);
+    if ((core < -1) || (core >= portNUM_PROCESSORS)) {
+        return luaL_error(L, "invalid core");
+    }
+    thread_checkcode(L, 1);
+
+    thread_msg_make(L, 3, &w.args);
+
+    if (!thread_getcode(L, 1, &code)) {
+        thread_msg_free(&w.args);
+        return luaL_error(L, "not enough memory");
+    }
+    w.code = code.data;
+    w.len = code.len;
+
+    NL = luaL_newheapstate();
+    if (NL) {
+        lua_pushcfunction(NL, thread_worker_init);
+        lua_pushlightuserdata(NL, &w);
+        res = lua_pcall(NL, 1, LUA_MULTRET, 0);
+    }
+    free(code.data);
+    if (w.args.data) {
+        thread_msg_free(&w.args);
+    }
+    if (!NL) {
+        return luaL_error(L, "not enough memory");
+    }
+    if (res) {
+        lua_pushstring(L, lua_tostring(NL, -1));
+        lua_close(NL);
+        return lua_error(L);
+    }
+
+    thread = (struct lthread *)malloc(sizeof(struct lthread));
+    if (!thread) {
+        lua_close(NL);
+        return luaL_error(L, "not enough memory");
+    }
+    thread->PL = L;
+    thread->L = NL;
+    thread->function_ref = LUA_NOREF;
+    thread->thread_ref = LUA_NOREF;
+    thread->status = LTHREAD_STATUS_RUNNING;
+    thread->nargs = lua_gettop(NL) - 1;
+    thread->isolated = 1;
+    thread->stack = LUA_WORKER_STACK;
+
+    res = list_add(&lthread_list, thread, &idx);
+    if (res) {
+        free(thread);
+        lua_close(NL);
+        return luaL_error(L, "not enough memory");
+    }
+    thread->thid = idx;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, LUA_WORKER_STACK);
+    pthread_attr_setinitialstate(&attr, PTHREAD_INITIAL_STATE_RUN);
+    pthread_attr_setcore(&attr, (core < 0) ? tskNO_AFFINITY : core);
+
+    // Before it runs, the main state must stop using the shared caches; and
+    // the id has to be in place, the worker may be done before pthread_create()
+    thread_atomic_add((volatile uint32_t *)&luaR_workers, 1);
+    res = pthread_create(&thread->thread, &attr, thread_worker_task, thread);
+    if (res) {
+        thread_atomic_add((volatile uint32_t *)&luaR_workers, -1);
+        lua_close(NL);
+        list_remove(&lthread_list, idx);
+        return luaL_error(L, "can't start pthread (%s)", strerror(errno));
+    }
+
+    lua_pushinteger(L, idx);
+    return 1;
+}
+
+// The pool behind thread.submit(): workers that stay, each in a state of
+// its own, taking jobs from one queue. A job's results go back through a
+// channel holding one message, true and the values returned, or false and
+// the error. Globals a job sets stay behind for the next ones on its worker.
+
+#ifdef CONFIG_LUA_POOL_SIZE
+#define LUA_POOL_SIZE CONFIG_LUA_POOL_SIZE
+#else
+#define LUA_POOL_SIZE 2
+#endif
+
+#ifdef CONFIG_LUA_POOL_STACK
+#define LUA_POOL_STACK CONFIG_LUA_POOL_STACK
+#else
+#define LUA_POOL_STACK 8192
+#endif
+
+#define THREAD_POOL_QUEUE        16   // jobs before thread.submit() blocks
+
+static const char THREAD_TABLE_FUTURE[] = "thread.future";
+
+typedef struct {
+    thread_buf_t code;
+    thread_msg_t args;
+    thread_chan_t *result;
+} thread_job_t;
+
+typedef struct {
+    thread_chan_t *result;          // until the results are in
+    int ref;                        // then the table holding them
+    int n;
+} thread_future_t;
+
+static QueueHandle_t thread_pool_jobs;
+static int thread_pool_workers;
+
+static int thread_pool_init(lua_State *L) {
+    lua_settop(L, 0);
+    thread_worker_libs(L);
+    return 0;
+}
+
+// Run a job, leaving its results in a message
+static int thread_pool_run(lua_State *L) {
+    thread_job_t *job = (thread_job_t *)lua_touserdata(L, 1);
+    thread_msg_t *m = (thread_msg_t *)lua_touserdata(L, 2);
+
+    lua_settop(L, 0);
+    lua_pushboolean(L, 1);
+    if (luaL_loadbuffer(L, job->code.data, job->code.len, "=job")) {
+        return lua_error(L);
+    }
+    lua_call(L, thread_msg_push(L, &job->args), LUA_MULTRET);
+    thread_msg_make(L, 1, m);
+    return 0;
+}
+
+static int thread_pool_fail(lua_State *L) {
+    thread_msg_t *m = (thread_msg_t *)lua_touserdata(L, 1);
+
+    lua_settop(L, 2);
+    lua_pushboolean(L, 0);
+    lua_replace(L, 1);
+    thread_msg_make(L, 1, m);
+    return 0;
+}
+
+void *thread_pool_task(void *arg) {
+    lua_State *L = (lua_State *)arg;
+    thread_job_t *job;
+    thread_msg_t m;
+
+    for (;;) {
+        xQueueReceive(thread_pool_jobs, &job, portMAX_DELAY);
+
+        m.data = NULL;
+        m.len = 0;
+        lua_settop(L, 0);
+        lua_pushcfunction(L, thread_pool_run);
+        lua_pushlightuserdata(L, job);
+        lua_pushlightuserdata(L, &m);
+        if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+            if (!lua_isstring(L, -1)) {
+                lua_pushstring(L, "error object is not a string");
+            }
+            lua_pushcfunction(L, thread_pool_fail);
+            lua_insert(L, -2);
+            lua_pushlightuserdata(L, &m);
+            lua_insert(L, -2);
+            // Out of memory even for this, the message stays empty
+            lua_pcall(L, 2, 0, 0);
+        }
+        lua_settop(L, 0);
+
+        // The channel has room for exactly this message
+        xQueueSend(job->result->queue, &m, 0);
+        thread_chan_unref(job->result);
+        free(job->code.data);
+        if (job->args.data) {
+            thread_msg_free(&job->args);
+        }
+        free(job);
+    }
+    return NULL;
+}
+
+// The workers start with the first job, so that the pool costs nothing
+// until it's used
+static void thread_pool_start(lua_State *L) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    lua_State *NL;
+    int i;
+
+    thread_pool_jobs = xQueueCreate(THREAD_POOL_QUEUE, sizeof(thread_job_t *));
+    if (!thread_pool_jobs) {
+        luaL_error(L, "not enough memory");
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, LUA_POOL_STACK);
+    pthread_attr_setinitialstate(&attr, PTHREAD_INITIAL_STATE_RUN);
+    pthread_attr_setcore(&attr, tskNO_AFFINITY);
+
+    for (i = 0; i < LUA_POOL_SIZE; i++) {
+        NL = luaL_newheapstate();
+        if (!NL) {
+            break;
+        }
+        lua_pushcfunction(NL, thread_pool_init);
+        if (lua_pcall(NL, 0, 0, 0) != LUA_OK) {
+            lua_close(NL);
+            break;
+        }
+        // For good, the main state won't use the shared caches again
+        thread_atomic_add((volatile uint32_t *)&luaR_workers, 1);
+        if (pthread_create(&thread, &attr, thread_pool_task, NL)) {
+            thread_atomic_add((volatile uint32_t *)&luaR_workers, -1);
+            lua_close(NL);
+            break;
+        }
+        thread_pool_workers++;
+    }
+
+    if (!thread_pool_workers) {
+        vQueueDelete(thread_pool_jobs);
+        thread_pool_jobs = NULL;
+        luaL_error(L, "can't start pthread (%s)", strerror(errno));
+    }
+}
+
+// Lua: future = thread.submit(f, ...)
+// Runs f with the arguments on a worker of the pool, as soon as one is
+// free. What f can be and do is as for thread.worker(), and the values it
+// returns are copied the same way as its arguments.
+static int thread_submit(lua_State *L) {
+    thread_buf_t code = {NULL, 0, 0, NULL, LUA_TNONE};
+    thread_future_t *f;
+    thread_job_t *job;
+    thread_msg_t args;
+    thread_chan_t *ch;
+
+    thread_checkcode(L, 1);
+    if (!thread_pool_jobs) {
+        thread_pool_start(L);
+    }
+
+    // The userdata first, so that nothing leaks if it can't be had
+    f = (thread_future_t *)lua_newuserdata(L, sizeof(thread_future_t));
+    f->result = NULL;
+    f->ref = LUA_NOREF;
+    f->n = 0;
+    luaL_getmetatable(L, THREAD_TABLE_FUTURE);
+    lua_setmetatable(L, -2);
+    lua_insert(L, 1);
+
+    thread_msg_make(L, 3, &args);
+    if (!thread_getcode(L, 2, &code)) {
+        thread_msg_free(&args);
+        return luaL_error(L, "not enough memory");
+    }
+    job = (thread_job_t *)malloc(sizeof(thread_job_t));
+    ch = thread_chan_new(1);
+    if (!job || !ch) {
+        free(job);
+        if (ch) {
+            thread_chan_unref(ch);
+        }
+        free(code.data);
+        thread_msg_free(&args);
+        return luaL_error(L, "not enough memory");
+    }
+
+    // One reference for the future, one for the job
+    ch->refs = 2;
+    f->result = ch;
+    job->code = code;
+    job->args = args;
+    job->result = ch;
+    xQueueSend(thread_pool_jobs, &job, portMAX_DELAY);
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+static thread_future_t *thread_checkfuture(lua_State *L) {
+    return (thread_future_t *)luaL_checkudata(L, 1, THREAD_TABLE_FUTURE);
+}
+
+// Take the results if they're in by then
+static int thread_future_fetch(lua_State *L, thread_future_t *f, TickType_t ticks) {
+    thread_msg_t m;
+    int top, i;
+
+    if (f->ref != LUA_NOREF) {
+        return 1;
+    }
+    if (xQueueReceive(f->result->queue, &m, ticks) != pdTRUE) {
+        return 0;
+    }
+    thread_chan_unref(f->result);
+    f->result = NULL;
+
+    top = lua_gettop(L);
+    f->n = thread_msg_push(L, &m);
+    luaL_checkstack(L, 1, "too many results");
+    lua_createtable(L, f->n, 0);
+    lua_insert(L, top + 1);
+    for (i = f->n; i > 0; i--) {
+        lua_rawseti(L, top + 1, i);
+    }
+    f->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    return 1;
+}
+
+// Lua: ... = future:get([timeout_ms])
+// Waits for the job and returns what it did, raising its error if it failed
+static int thread_future_get(lua_State *L) {
+    thread_future_t *f = thread_checkfuture(L);
+    int i;
+
+    if (!thread_future_fetch(L, f, thread_ticks(L, 2))) {
+        return luaL_error(L, "timeout");
+    }
+    lua_settop(L, 0);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, f->ref);
+    lua_rawgeti(L, 1, 1);
+    if (!lua_toboolean(L, 2)) {
+        if (f->n < 2) {
+            return luaL_error(L, "not enough memory");
+        }
+        lua_rawgeti(L, 1, 2);
+        return lua_error(L);
+    }
+    luaL_checkstack(L, f->n, "too many results");
+    for (i = 2; i <= f->n; i++) {
+        lua_rawgeti(L, 1, i);
+    }
+    return f->n - 1;
+}
+
+// Lua: done = future:wait([timeout_ms])
+// false if the job wasn't done within timeout_ms
+static int thread_future_wait(lua_State *L) {
+    thread_future_t *f = thread_checkfuture(L);
+
+    lua_pushboolean(L, thread_future_fetch(L, f, thread_ticks(L, 2)));
+    return 1;
+}
+
+// Lua: done = future:done()
+static int thread_future_done(lua_State *L) {
+    thread_future_t *f = thread_checkfuture(L);
+
+    lua_pushboolean(L, thread_future_fetch(L, f, 0));
+    return 1;
+}
+
+static int thread_future_gc(lua_State *L) {
+    thread_future_t *f = thread_checkfuture(L);
+
+    // A job still running drops its results once it's done
+    if (f->result) {
+        thread_chan_unref(f->result);
+        f->result = NULL;
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, f->ref);
+    f->ref = LUA_NOREF;
+    return 0;
+}
+
+static const LUA_REG_TYPE thread_future_map[] = {
+    { LSTRKEY( "get" ),				LFUNCVAL( thread_future_get ) },
+    { LSTRKEY( "wait" ),			LFUNCVAL( thread_future_wait ) },
+    { LSTRKEY( "done" ),			LFUNCVAL( thread_future_done ) },
+    { LSTRKEY( "__gc" ),			LFUNCVAL( thread_future_gc ) },
+    { LSTRKEY( "__index" ),			LROVAL( thread_future_map ) },
+    { LNILKEY, LNILVAL }
+};
+
 static int thread_sleep(lua_State* L) {
     int seconds;
     
     // Check argument (seconds)
     seconds = luaL_checkinteger(L, 1);
     
+    // A sched task yields instead of holding up the Lua task
+    if (sched_can_wait(L) && (seconds >= 0)) {
+        return sched_sleep(L, seconds * 1000);
+    }
+
     sleep(seconds);
     
     return 0;
@@ -364,6 +1748,10 @@ static int thread_sleepms(lua_State* L) {
     // Check argument (seconds)
     milliseconds = luaL_checkinteger(L, 1);
     
+    if (sched_can_wait(L) && (milliseconds >= 0)) {
+        return sched_sleep(L, milliseconds);
+    }
+
     usleep(milliseconds * 1000);
     
     return 0;
@@ -424,6 +1812,13 @@ const LUA_REG_TYPE thread_map[] = {
     { LSTRKEY( "suspend" ),			LFUNCVAL( thread_suspend ) },
     { LSTRKEY( "resume" ),			LFUNCVAL( thread_resume ) },
     { LSTRKEY( "stop" ),			LFUNCVAL( thread_stop ) },
+    { LSTRKEY( "worker" ),			LFUNCVAL( thread_worker ) },
+    { LSTRKEY( "channel" ),			LFUNCVAL( thread_channel ) },
+    { LSTRKEY( "submit" ),			LFUNCVAL( thread_submit ) },
+    { LSTRKEY( "mutex" ),			LFUNCVAL( thread_mutex ) },
+    { LSTRKEY( "semaphore" ),		LFUNCVAL( thread_semaphore ) },
+    { LSTRKEY( "event" ),			LFUNCVAL( thread_event ) },
+    { LSTRKEY( "atomic" ),			LFUNCVAL( thread_atomic ) },
     { LSTRKEY( "list" ),			LFUNCVAL( thread_list ) },
     { LSTRKEY( "sleep" ),			LFUNCVAL( thread_sleep ) },
     { LSTRKEY( "sleepms" ),			LFUNCVAL( thread_sleepms ) },
@@ -435,6 +1830,9 @@ const LUA_REG_TYPE thread_map[] = {
 int luaopen_thread(lua_State* L) {
 	//printf("pthread init\n");
 	list_init(&lthread_list, 1);
+	luaL_rometatable(L, THREAD_TABLE_CHANNEL, (void *)thread_chan_map);
+	luaL_rometatable(L, THREAD_TABLE_FUTURE, (void *)thread_future_map);
+	thread_sync_tables_open(L);
 	return 0;
 } 
  
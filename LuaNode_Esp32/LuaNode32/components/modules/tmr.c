@@ -16,7 +16,7 @@ tmr.delay() -- not changed
 tmr.alarm() -- not changed
 tmr.stop()  -- changed, see below. use tmr.unregister for old functionality
 
-tmr.register(id, interval, mode, function)
+tmr.register(id, interval, mode, function[, prio])
 	bind function with timer and set the interval in ms
 	the mode can be:
 		tmr.ALARM_SINGLE for a single run alarm
@@ -24,6 +24,9 @@ tmr.register(id, interval, mode, function)
 		tmr.ALARM_AUTO for a repating alarm
 	tmr.register does NOT start the timer
 	tmr.alarm is a tmr.register & tmr.start macro
+	prio, node.PRIO_LOW by default, is the queue the Lua task gets the
+	wakeup for due alarms in; one at node.PRIO_HIGH runs ahead of a
+	flood of network events, say
 tmr.unregister(id)
 	stop alarm, unbind function and clean up memory
 	not needed for ALARM_SINGLE, as it unregisters itself
@@ -46,6 +49,20 @@ tmr.softwd(int)
 	any other value starts the timer, when the
 	countdown reaches zero, the device restarts
 	the timer units are seconds
+tmr.hw(period_us, function)
+	ret: int
+	calls function every period_us microseconds, timed by a hardware
+	timer; returns its id. the function gets how many periods went by
+	since it was last called, more than 1 when Lua fell behind
+	there are two hardware timers, tmr.delayus uses them too
+tmr.hwstop(id)
+	stops a tmr.hw timer
+tmr.delayus(us)
+	like tmr.delay_us, but sleeps in a hardware timer instead of spinning.
+	a sched task yields, anything else blocks only the Lua task
+tmr.ccount()
+	ret: (int, int)
+	CPU cycle counter, wrapping at 2^31 like tmr.now, and the CPU MHz
 */
 
 
@@ -59,6 +76,20 @@ tmr.softwd(int)
 #include "esp_timer.h"
 #include "esp_misc.h"
 #include "modules.h"
+#include "sched.h"
+#include "cbref.h"
+#include "timer_wheel.h"
+#include "trace.h"
+#include "hwtimer.h"
+#include "platform_power.h"
+#include "task/task.h"
+#include "esp_attr.h"
+#include "rom/ets_sys.h"
+#include "xtensa/hal.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include <string.h>
 
 #define NUM_TMR	7
 
@@ -68,6 +99,9 @@ tmr.softwd(int)
 #define TIMER_MODE_AUTO 1
 #define TIMER_IDLE_FLAG (1<<7) 
 
+#define TIMER_MAX_ARM 0x41893	//longest os_timer_arm(), in ms
+#define TIMER_RETRY_MS 10	//when the task queue was full
+
 //well, the following are my assumptions
 //why, oh why is there no good documentation
 //chinese companies should learn from Atmel
@@ -80,12 +114,16 @@ extern void system_soft_wdt_feed();
 
 //in fact lua_State is constant, it's pointless to pass it around
 //but hey, whatever, I'll just pass it, still we waste 28B here
-typedef struct{
-	os_timer_t os;
+typedef struct timer_struct{
+	timer_wheel_node_t node;	//first, the wheel hands these back
+	struct timer_struct* batch;	//next one due in this batch
 	lua_State* L;
 	sint32_t lua_ref;
+	sint32_t self_ref;	//tmr.create() objects, kept while armed
 	uint32_t interval;
 	uint8_t mode;
+	uint8_t due;	//expired, its callback is next
+	uint8_t prio;	//task priority its wakeups want
 }timer_struct_t;
 typedef timer_struct_t* my_timer_t;
 
@@ -97,21 +135,245 @@ static union {
 static sint32_t soft_watchdog  = -1;
 static timer_struct_t alarm_timers[NUM_TMR];
 static os_timer_t rtc_timer;
+static cbref_table_t tmr_cbs = CBREF_TABLE("tmr", false); //alarm and hw timer callbacks
+
+static const char TIMER_TABLE[] = "tmr.timer";
+
+//alarms don't get an os_timer each: the armed ones, the fixed ones and
+//any number of tmr.create() objects, wait in a timer wheel by deadline,
+//and one os_timer goes off when the wheel has something to do. all it
+//does is wake the Lua task, which runs every alarm due by then in one go.
+//deadlines move on by the interval, not from when the callback ran, so
+//alarms don't drift and don't push each other's times back
+static timer_wheel_t timer_wheel;
+static os_timer_t timer_os;
+static TickType_t timer_wake;	//when timer_os goes off
+static bool timer_armed;
+static task_handle_t timer_event;
+//alarms in the wheel at each priority. the wakeup goes in at the highest
+//one there is, it runs whatever is due of every priority
+static uint16_t timer_nprio[TASK_PRIORITY_COUNT];
+
+//tmr.hw() timers and tmr.delayus() sleeps, one per hardware timer. the
+//interrupt only counts, the Lua task calls back or wakes the sleeper
+#define HW_FREE 0
+#define HW_PERIODIC 1
+#define HW_SLEEP 2	//blocking the Lua task on hw_done
+#define HW_WAKE 3	//a sched task waiting in waiter
+
+typedef struct{
+	uint8_t kind;
+	sint32_t lua_ref;
+	volatile uint32_t fired;	//periods gone by, counted by the interrupt
+	uint32_t seen;	//of those, handed to Lua
+	struct sched_task* waiter;
+}hw_timer_struct_t;
+
+static hw_timer_struct_t hw_timers[HWTIMER_NUM];
+static task_handle_t hw_event;
+static SemaphoreHandle_t hw_done;
+static void hw_free(hw_timer_struct_t* hw);
+
+static TickType_t timer_ticks(uint32_t ms){
+	TickType_t ticks = (ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;
+	return ticks ? ticks : 1;
+}
+
+static task_prio_t timer_prio(void){
+	task_prio_t p = TASK_PRIORITY_HIGH;
+	while(p != TASK_PRIORITY_LOW && !timer_nprio[p])
+		p--;
+	return p;
+}
+
+static void timer_post(void){
+	if(!task_post_coalesced(timer_prio(), timer_event, 0)){
+		os_timer_disarm(&timer_os);
+		os_timer_arm(&timer_os, TIMER_RETRY_MS, 0);
+	}
+}
+
+//os_timer context, leave everything else to the Lua task
+static void timer_tick(void* arg){
+	(void)arg;
+	timer_post();
+}
+
+static void timer_arm(void){
+	TickType_t now = xTaskGetTickCount();
+	int32_t ticks = timer_wheel_next(&timer_wheel, now);
+	os_timer_disarm(&timer_os);
+	timer_armed = ticks >= 0;
+	if(!timer_armed)
+		return;
+	timer_wake = now + ticks;
+	if(ticks == 0){
+		timer_post();
+		return;
+	}
+	//a longer wait is done in steps, dispatch rearms when nothing's due
+	uint32_t ms = ticks * portTICK_PERIOD_MS;
+	os_timer_arm(&timer_os, ms > TIMER_MAX_ARM ? TIMER_MAX_ARM : ms, 0);
+}
+
+static void timer_unqueue(my_timer_t tmr){
+	tmr->due = 0;
+	if(timer_wheel_pending(&tmr->node))
+		timer_nprio[tmr->prio]--;
+	timer_wheel_remove(&timer_wheel, &tmr->node);
+}
+
+static void timer_enqueue(my_timer_t tmr, TickType_t deadline){
+	timer_unqueue(tmr);
+	timer_wheel_add(&timer_wheel, &tmr->node, deadline);
+	timer_nprio[tmr->prio]++;
+}
 
-static void alarm_timer_common(void* arg){
-	my_timer_t tmr = &alarm_timers[(uint32_t)arg];
+//arm an alarm for interval from now, and the os_timer if that's sooner.
+//cancelling leaves it be, going off for nothing costs less than rearming
+static void timer_schedule(my_timer_t tmr){
+	TickType_t deadline = xTaskGetTickCount() + timer_ticks(tmr->interval);
+	timer_enqueue(tmr, deadline);
+	if(!timer_armed || (int32_t)(deadline - timer_wake) < 0)
+		timer_arm();
+}
+
+static void timer_cancel(my_timer_t tmr){
+	timer_unqueue(tmr);
+}
+
+//an object that won't go off any more can be collected
+static void timer_release(lua_State* L, my_timer_t tmr){
+	if(tmr->self_ref != LUA_NOREF && !timer_wheel_pending(&tmr->node)){
+		luaL_unref(L, LUA_REGISTRYINDEX, tmr->self_ref);
+		tmr->self_ref = LUA_NOREF;
+	}
+}
+
+static void alarm_timer_common(my_timer_t tmr){
 	if(tmr->lua_ref == LUA_NOREF || tmr->L == NULL)
 		return;
-	lua_rawgeti(tmr->L, LUA_REGISTRYINDEX, tmr->lua_ref);
+	cbref_get(tmr->L, &tmr_cbs, tmr->lua_ref);
 	//if the timer was set to single run we clean up after it
 	if(tmr->mode == TIMER_MODE_SINGLE){
-		luaL_unref(tmr->L, LUA_REGISTRYINDEX, tmr->lua_ref);
+		cbref_unref(tmr->L, &tmr_cbs, tmr->lua_ref);
 		tmr->lua_ref = LUA_NOREF;
 		tmr->mode = TIMER_MODE_OFF;
 	}else if(tmr->mode == TIMER_MODE_SEMI){
 		tmr->mode |= TIMER_IDLE_FLAG;
 	}
+	TRACE(TRACE_TMR_B, tmr, tmr->mode);
 	lua_call(tmr->L, 0, 0);
+	TRACE(TRACE_TMR_E, tmr, 0);
+}
+
+static void timer_dispatch(task_param_t param, task_prio_t prio){
+	(void)param; (void)prio;
+	lua_State* L = lua_getstate();
+	TickType_t now = xTaskGetTickCount();
+	timer_wheel_node_t* node = timer_wheel_advance(&timer_wheel, now);
+	my_timer_t batch = NULL, *tail = &batch, tmr;
+	int top = lua_gettop(L);
+
+	//take all that are due first, so that what their callbacks take
+	//doesn't hold up the others' deadlines
+	while(node){
+		timer_wheel_node_t* next = node->next;
+		tmr = (my_timer_t)node;
+		timer_nprio[tmr->prio]--;
+		if(tmr->mode == TIMER_MODE_AUTO){
+			TickType_t at = node->expires + timer_ticks(tmr->interval);
+			//fell behind by whole intervals: skip those rather than catch up
+			if((int32_t)(at - now) <= 0)
+				at = now + timer_ticks(tmr->interval);
+			timer_enqueue(tmr, at);
+		}
+		tmr->due = 1;
+		tmr->batch = NULL;
+		*tail = tmr;
+		tail = &tmr->batch;
+		//objects stay on the stack until the batch is done, whatever the
+		//callbacks do to them
+		if(tmr->self_ref != LUA_NOREF){
+			luaL_checkstack(L, 1, "too many timers");
+			lua_rawgeti(L, LUA_REGISTRYINDEX, tmr->self_ref);
+		}
+		node = next;
+	}
+	timer_arm();
+
+	//a callback stopping or changing one due after it takes it out
+	for(tmr = batch; tmr; tmr = tmr->batch){
+		if(tmr->due){
+			tmr->due = 0;
+			alarm_timer_common(tmr);
+		}
+		timer_release(L, tmr);
+	}
+	lua_settop(L, top);
+}
+
+static void IRAM_ATTR hw_tick(unsigned id, void* arg){
+	hw_timer_struct_t* hw = &hw_timers[id];
+	hw->fired++;
+	if(hw->kind == HW_SLEEP){
+		BaseType_t woken = pdFALSE;
+		xSemaphoreGiveFromISR(hw_done, &woken);
+		if(woken)
+			portYIELD_FROM_ISR();
+	}else{
+		task_post_coalesced_low(hw_event, 0);
+	}
+}
+
+static void hw_dispatch(task_param_t param, task_prio_t prio){
+	(void)param; (void)prio;
+	lua_State* L = lua_getstate();
+	for(unsigned id = 0; id < HWTIMER_NUM; id++){
+		hw_timer_struct_t* hw = &hw_timers[id];
+		uint32_t n = hw->fired - hw->seen;
+		if(n == 0)
+			continue;
+		hw->seen += n;
+		if(hw->kind == HW_WAKE){
+			hw_free(hw);
+			sched_wake(L, &hw->waiter, 0);
+		}else if(hw->kind == HW_PERIODIC){
+			cbref_get(L, &tmr_cbs, hw->lua_ref);
+			lua_pushinteger(L, n);
+			lua_call(L, 1, 0);
+		}
+	}
+}
+
+//a one-shot timer is stopped before its sleeper's been woken, so what's
+//free goes by kind rather than by the hardware
+//the timer group stops in light sleep, so none while one is taken
+static int hw_alloc(uint8_t kind){
+	for(unsigned id = 0; id < HWTIMER_NUM; id++){
+		hw_timer_struct_t* hw = &hw_timers[id];
+		if(hw->kind == HW_FREE){
+			hw->kind = kind;
+			hw->seen = hw->fired;
+			platform_sleep_block();
+			return id;
+		}
+	}
+	return -1;
+}
+
+static void hw_free(hw_timer_struct_t* hw){
+	hw->kind = HW_FREE;
+	platform_sleep_unblock();
+}
+
+//the fixed alarm with the id at 1, or the object there
+static my_timer_t tmr_get(lua_State* L){
+	if(lua_type(L, 1) == LUA_TUSERDATA)
+		return (my_timer_t)luaL_checkudata(L, 1, TIMER_TABLE);
+	uint32_t id = luaL_checkinteger(L, 1);
+	luaL_argcheck(L, id < NUM_TMR, 1, "invalid timer id");
+	return &alarm_timers[id];
 }
 
 void tmr_delay_msec(int ms) {
@@ -121,6 +383,9 @@ void tmr_delay_msec(int ms) {
 // Lua: tmr.delay( s )	delay seconds
 static int tmr_delay_s( lua_State *L ) {
 	uint32_t period = luaL_checkinteger(L, 1);
+	//a sched task yields instead of holding up everything else
+	if(sched_can_wait(L))
+		return sched_sleep(L, period*1000);
 	vTaskDelay(period*(1000/portTICK_RATE_MS));
 	return 0;
 }
@@ -128,6 +393,8 @@ static int tmr_delay_s( lua_State *L ) {
 // Lua: tmr.delay_ms( ms )
 static int tmr_delay_ms( lua_State *L ) {
 	uint32_t period = luaL_checkinteger(L, 1);
+	if(sched_can_wait(L))
+		return sched_sleep(L, period);
 	tmr_delay_msec(period);
 	return 0;
 }
@@ -152,6 +419,62 @@ static int tmr_delay( lua_State* L ){
 	return 0; 
 }
 
+// Lua: tmr.delayus( us )
+static int tmr_delayus( lua_State* L ){
+	sint32_t us = luaL_checkinteger(L, 1);
+	if(us <= 0)
+		return luaL_error(L, "wrong arg range");
+	uint8_t kind = sched_can_wait(L) ? HW_WAKE : HW_SLEEP;
+	//too short to be worth a sleep, or both timers taken: spin after all
+	int id = us < HWTIMER_MIN_US ? -1 : hw_alloc(kind);
+	if(id < 0)
+		return tmr_delay(L);
+	hw_timer_struct_t* hw = &hw_timers[id];
+	hwtimer_start(id, us, false, hw_tick, NULL);
+	if(kind == HW_WAKE)
+		return sched_wait(L, &hw->waiter);
+	xSemaphoreTake(hw_done, portMAX_DELAY);
+	hw->seen = hw->fired;
+	hw_free(hw);
+	return 0;
+}
+
+// Lua: tmr.hw( period_us, function )
+static int tmr_hw( lua_State* L ){
+	sint32_t period = luaL_checkinteger(L, 1);
+	if(period < HWTIMER_MIN_US)
+		return luaL_error(L, "wrong arg range");
+	luaL_argcheck(L, lua_type(L, 2) == LUA_TFUNCTION || lua_type(L, 2) == LUA_TLIGHTFUNCTION, 2, "function expected");
+	int id = hw_alloc(HW_PERIODIC);
+	if(id < 0)
+		return luaL_error(L, "no free hardware timer");
+	hw_timer_struct_t* hw = &hw_timers[id];
+	lua_pushvalue(L, 2);
+	hw->lua_ref = cbref_ref(L, &tmr_cbs);
+	hwtimer_start(id, period, true, hw_tick, NULL);
+	lua_pushinteger(L, id);
+	return 1;
+}
+
+// Lua: tmr.hwstop( id )
+static int tmr_hwstop( lua_State* L ){
+	uint32_t id = luaL_checkinteger(L, 1);
+	luaL_argcheck(L, id < HWTIMER_NUM && hw_timers[id].kind == HW_PERIODIC, 1, "invalid timer id");
+	hw_timer_struct_t* hw = &hw_timers[id];
+	hwtimer_stop(id);
+	cbref_unref(L, &tmr_cbs, hw->lua_ref);
+	hw->lua_ref = LUA_NOREF;
+	hw_free(hw);
+	return 0;
+}
+
+// Lua: tmr.ccount() , return CPU cycles and MHz
+static int tmr_ccount( lua_State* L ){
+	lua_pushinteger(L, 0x7FFFFFFF & xthal_get_ccount());
+	lua_pushinteger(L, ets_get_cpu_frequency());
+	return 2;
+}
+
 // Lua: tmr.now() , return system timer in us
 static int tmr_now(lua_State* L){
 	uint32_t now = 0x7FFFFFFF & system_get_time();
@@ -159,12 +482,13 @@ static int tmr_now(lua_State* L){
 	return 1; 
 }
 
-// Lua: tmr.register( id, interval, mode, function )
+// Lua: tmr.register( id, interval, mode, function[, prio] )
+// Lua: t:register( interval, mode, function[, prio] ), and so on for the others
 static int tmr_register(lua_State* L){
-	uint32_t id = luaL_checkinteger(L, 1);
-	//MOD_CHECK_ID(tmr, id);
+	my_timer_t tmr = tmr_get(L);
 	sint32_t interval = luaL_checkinteger(L, 2);
 	uint8_t mode = luaL_checkinteger(L, 3);
+	task_prio_t prio = mod_optprio(L, 5, TASK_PRIORITY_LOW);
 	//validate arguments
 	uint8_t args_valid = interval <= 0
 		|| (mode != TIMER_MODE_SINGLE && mode != TIMER_MODE_SEMI && mode != TIMER_MODE_AUTO)
@@ -173,32 +497,36 @@ static int tmr_register(lua_State* L){
 		return luaL_error(L, "wrong arg range");
 	//get the lua function reference
 	lua_pushvalue(L, 4);
-	sint32_t ref = luaL_ref(L, LUA_REGISTRYINDEX);
-	my_timer_t tmr = &alarm_timers[id];
+	sint32_t ref = cbref_ref(L, &tmr_cbs);
 	if(!(tmr->mode & TIMER_IDLE_FLAG) && tmr->mode != TIMER_MODE_OFF)
-		os_timer_disarm(&tmr->os);
+		timer_cancel(tmr);
+	tmr->due = 0;
+	timer_release(L, tmr);
 	//there was a bug in this part, the second part of the following condition was missing
 	if(tmr->lua_ref != LUA_NOREF && tmr->lua_ref != ref)
-		luaL_unref(L, LUA_REGISTRYINDEX, tmr->lua_ref);
+		cbref_unref(L, &tmr_cbs, tmr->lua_ref);
 	tmr->lua_ref = ref;
+	tmr->prio = prio;
 	tmr->mode = mode|TIMER_IDLE_FLAG;
 	tmr->interval = interval;
 	tmr->L = L; 
-	os_timer_setfn(&tmr->os, alarm_timer_common, (void*)id);
 	return 0;  
 }
 
 // Lua: tmr.start( id )
 static int tmr_start(lua_State* L){
-	uint8_t id = luaL_checkinteger(L, 1);
-	//MOD_CHECK_ID(tmr,id);
-	my_timer_t tmr = &alarm_timers[id];
+	my_timer_t tmr = tmr_get(L);
 	//we return false if the timer is not idle
 	if(!(tmr->mode&TIMER_IDLE_FLAG)){
 		lua_pushboolean(L, 0);
 	}else{
 		tmr->mode &= ~TIMER_IDLE_FLAG;
-		os_timer_arm(&tmr->os, tmr->interval, tmr->mode==TIMER_MODE_AUTO);
+		timer_schedule(tmr);
+		//an object that's armed can't go away
+		if(lua_type(L, 1) == LUA_TUSERDATA && tmr->self_ref == LUA_NOREF){
+			lua_pushvalue(L, 1);
+			tmr->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		}
 		lua_pushboolean(L, 1);
 	}
 	return 1;
@@ -212,13 +540,12 @@ static int tmr_alarm(lua_State* L){
 
 // Lua: tmr.stop( id )
 static int tmr_stop(lua_State* L){
-	uint8_t id = luaL_checkinteger(L, 1);
-	//MOD_CHECK_ID(tmr,id);
-	my_timer_t tmr = &alarm_timers[id];
+	my_timer_t tmr = tmr_get(L);
 	//we return false if the timer is idle (of not registered)
 	if(!(tmr->mode & TIMER_IDLE_FLAG) && tmr->mode != TIMER_MODE_OFF){
 		tmr->mode |= TIMER_IDLE_FLAG;
-		os_timer_disarm(&tmr->os);
+		timer_cancel(tmr);
+		timer_release(L, tmr);
 		lua_pushboolean(L, 1);
 	}else{
 		lua_pushboolean(L, 0);
@@ -228,13 +555,13 @@ static int tmr_stop(lua_State* L){
 
 // Lua: tmr.unregister( id )
 static int tmr_unregister(lua_State* L){
-	uint8_t id = luaL_checkinteger(L, 1);
-	//MOD_CHECK_ID(tmr,id);
-	my_timer_t tmr = &alarm_timers[id];
+	my_timer_t tmr = tmr_get(L);
 	if(!(tmr->mode & TIMER_IDLE_FLAG) && tmr->mode != TIMER_MODE_OFF)
-		os_timer_disarm(&tmr->os);
+		timer_cancel(tmr);
+	tmr->due = 0;
+	timer_release(L, tmr);
 	if(tmr->lua_ref != LUA_NOREF)
-		luaL_unref(L, LUA_REGISTRYINDEX, tmr->lua_ref);
+		cbref_unref(L, &tmr_cbs, tmr->lua_ref);
 	tmr->lua_ref = LUA_NOREF;
 	tmr->mode = TIMER_MODE_OFF; 
 	return 0;
@@ -242,27 +569,21 @@ static int tmr_unregister(lua_State* L){
 
 // Lua: tmr.interval( id, interval )
 static int tmr_interval(lua_State* L){
-	uint8_t id = luaL_checkinteger(L, 1);
-	//MOD_CHECK_ID(tmr,id);
-	my_timer_t tmr = &alarm_timers[id];
+	my_timer_t tmr = tmr_get(L);
 	sint32_t interval = luaL_checkinteger(L, 2);
 	if(interval <= 0)
 		return luaL_error(L, "wrong arg range");
 	if(tmr->mode != TIMER_MODE_OFF){	
 		tmr->interval = interval;
-		if(!(tmr->mode&TIMER_IDLE_FLAG)){
-			os_timer_disarm(&tmr->os);
-			os_timer_arm(&tmr->os, tmr->interval, tmr->mode==TIMER_MODE_AUTO);
-		}
+		if(!(tmr->mode&TIMER_IDLE_FLAG))
+			timer_schedule(tmr);
 	}
 	return 0;
 }
 
 // Lua: tmr.state( id )
 static int tmr_state(lua_State* L){
-	uint8_t id = luaL_checkinteger(L, 1);
-	//MOD_CHECK_ID(tmr,id);
-	my_timer_t tmr = &alarm_timers[id];
+	my_timer_t tmr = tmr_get(L);
 	if(tmr->mode == TIMER_MODE_OFF){
 		lua_pushnil(L);
 		return 1;
@@ -330,12 +651,52 @@ static int tmr_softwd( lua_State* L ){
 	return 0; 
 }
 
+// Lua: t = tmr.create()
+// A timer of its own, with the functions above as methods. There can be
+// as many as memory allows.
+static int tmr_create(lua_State* L){
+	my_timer_t tmr = (my_timer_t)lua_newuserdata(L, sizeof(timer_struct_t));
+	memset(tmr, 0, sizeof(timer_struct_t));
+	tmr->lua_ref = LUA_NOREF;
+	tmr->self_ref = LUA_NOREF;
+	tmr->mode = TIMER_MODE_OFF;
+	luaL_getmetatable(L, TIMER_TABLE);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static int tmr_timer_gc(lua_State* L){
+	my_timer_t tmr = (my_timer_t)luaL_checkudata(L, 1, TIMER_TABLE);
+	timer_cancel(tmr);
+	if(tmr->lua_ref != LUA_NOREF)
+		cbref_unref(L, &tmr_cbs, tmr->lua_ref);
+	tmr->lua_ref = LUA_NOREF;
+	return 0;
+}
+
+static const LUA_REG_TYPE tmr_timer_map[] = {
+	{ LSTRKEY( "register" ), LFUNCVAL( tmr_register ) },
+	{ LSTRKEY( "alarm" ), LFUNCVAL( tmr_alarm ) },
+	{ LSTRKEY( "start" ), LFUNCVAL( tmr_start ) },
+	{ LSTRKEY( "stop" ), LFUNCVAL( tmr_stop ) },
+	{ LSTRKEY( "unregister" ), LFUNCVAL( tmr_unregister ) },
+	{ LSTRKEY( "state" ), LFUNCVAL( tmr_state ) },
+	{ LSTRKEY( "interval" ), LFUNCVAL( tmr_interval ) },
+	{ LSTRKEY( "__gc" ), LFUNCVAL( tmr_timer_gc ) },
+	{ LSTRKEY( "__index" ), LROVAL( tmr_timer_map ) },
+	{ LNILKEY, LNILVAL }
+};
+
 // Module function map
 
 const LUA_REG_TYPE tmr_map[] = {
 	{ LSTRKEY( "delay_us" ), LFUNCVAL( tmr_delay ) },
 	{ LSTRKEY( "delay_ms" ), LFUNCVAL( tmr_delay_ms ) },
 	{ LSTRKEY( "delay" ), LFUNCVAL( tmr_delay_s ) },
+	{ LSTRKEY( "delayus" ), LFUNCVAL( tmr_delayus ) },
+	{ LSTRKEY( "hw" ), LFUNCVAL( tmr_hw ) },
+	{ LSTRKEY( "hwstop" ), LFUNCVAL( tmr_hwstop ) },
+	{ LSTRKEY( "ccount" ), LFUNCVAL( tmr_ccount ) },
 	{ LSTRKEY( "now" ), LFUNCVAL( tmr_now ) },
 	{ LSTRKEY( "wdclr" ), LFUNCVAL( tmr_wdclr ) },
 	{ LSTRKEY( "softwd" ), LFUNCVAL( tmr_softwd ) },
@@ -347,6 +708,7 @@ const LUA_REG_TYPE tmr_map[] = {
 	{ LSTRKEY( "unregister" ), LFUNCVAL ( tmr_unregister ) },
 	{ LSTRKEY( "state" ), LFUNCVAL ( tmr_state ) },
 	{ LSTRKEY( "interval" ), LFUNCVAL ( tmr_interval) }, 
+	{ LSTRKEY( "create" ), LFUNCVAL ( tmr_create ) },
 #if LUA_OPTIMIZE_MEMORY > 0
 	{ LSTRKEY( "ALARM_SINGLE" ), LNUMVAL( TIMER_MODE_SINGLE ) },
 	{ LSTRKEY( "ALARM_SEMI" ), LNUMVAL( TIMER_MODE_SEMI ) },
@@ -358,6 +720,19 @@ const LUA_REG_TYPE tmr_map[] = {
 
 LUALIB_API int luaopen_tmr(lua_State *L)
 {
+  for (int i = 0; i < NUM_TMR; i++) {
+    alarm_timers[i].lua_ref = LUA_NOREF;
+    alarm_timers[i].self_ref = LUA_NOREF;
+    alarm_timers[i].mode = TIMER_MODE_OFF;
+  }
+  for (int i = 0; i < HWTIMER_NUM; i++)
+    hw_timers[i].lua_ref = LUA_NOREF;
+  hw_done = xSemaphoreCreateBinary();
+  hw_event = task_get_id(hw_dispatch);
+  timer_wheel_init(&timer_wheel, xTaskGetTickCount());
+  timer_event = task_get_id(timer_dispatch);
+  os_timer_setfn(&timer_os, timer_tick, NULL);
+  luaL_rometatable(L, TIMER_TABLE, (void *)tmr_timer_map);
 #if LUA_OPTIMIZE_MEMORY > 0
     return 0;
 #else  
@@ -0,0 +1,186 @@
+// Module for the trace ring of utils/trace_ring.c
+//
+// Trace points in the task layer, net, tmr, mqtt, the Lua GC and the VFS
+// record into a ring while tracing is on; Lua can add its own with mark()
+// and enter()/leave(). dump() writes the ring out as text to the console,
+// a file or a TCP connection, which tools/trace2chrome.py turns into a
+// Chrome trace for chrome://tracing or Perfetto.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "c_stdio.h"
+#include "c_string.h"
+#include "vfs.h"
+#include "trace.h"
+#include "lwip/sockets.h"
+
+typedef struct {
+  int fd;               // file, or 0
+  int sock;             // connection, or -1
+  bool failed;
+  char buf[512];        // for the connection
+  size_t len;
+} trace_sink_t;
+
+static void sink_flush( trace_sink_t *s )
+{
+  if (s->len && !s->failed && write(s->sock, s->buf, s->len) != s->len)
+    s->failed = true;
+  s->len = 0;
+}
+
+static void sink_out( const char *line, size_t len, void *arg )
+{
+  trace_sink_t *s = (trace_sink_t *)arg;
+  if (s->failed)
+    return;
+  if (s->sock >= 0) {
+    if (s->len + len > sizeof(s->buf))
+      sink_flush(s);
+    memcpy(s->buf + s->len, line, len);
+    s->len += len;
+  } else if (s->fd) {
+    if (vfs_write(s->fd, line, len) != len)
+      s->failed = true;
+  } else {
+    output_redirect(line);
+  }
+}
+
+// Lua: trace.start( [groups] )
+// Empties the ring and traces the groups given, trace.TASK + trace.NET
+// and so on, or all of them.
+static int trace_lstart( lua_State *L )
+{
+  uint32_t groups = luaL_optinteger(L, 1, TRACE_ALL);
+  luaL_argcheck(L, groups && !(groups & ~TRACE_ALL), 1, "wrong groups");
+#ifndef CONFIG_TRACE_ENABLE
+  return luaL_error(L, "trace points not built in");
+#endif
+  if (!trace_start(groups))
+    return luaL_error(L, "out of memory");
+  return 0;
+}
+
+// Lua: trace.stop()
+// What was traced stays in the ring for dump().
+static int trace_lstop( lua_State *L )
+{
+  trace_groups = 0;
+  return 0;
+}
+
+static int trace_lua_event( lua_State *L, uint8_t id )
+{
+  TRACE(id, luaL_optinteger(L, 1, 0), luaL_optinteger(L, 2, 0));
+  return 0;
+}
+
+// Lua: trace.mark( [a[, b]] )
+// An instant event of Lua's own, with two numbers to tell them apart.
+static int trace_lmark( lua_State *L )
+{
+  return trace_lua_event(L, TRACE_LUA_MARK);
+}
+
+// Lua: trace.enter( [a[, b]] ) ... trace.leave( [a[, b]] )
+// Opens and closes a span; spans nest.
+static int trace_lenter( lua_State *L )
+{
+  return trace_lua_event(L, TRACE_LUA_B);
+}
+
+static int trace_lleave( lua_State *L )
+{
+  return trace_lua_event(L, TRACE_LUA_E);
+}
+
+// Lua: records, lost, on = trace.info()
+// lost counts the records that fell out of the ring since start().
+static int trace_linfo( lua_State *L )
+{
+  uint32_t records, lost;
+  trace_count(&records, &lost);
+  lua_pushinteger(L, records);
+  lua_pushinteger(L, lost);
+  lua_pushboolean(L, trace_groups != 0);
+  return 3;
+}
+
+// Lua: records = trace.dump( [filename] )
+// Lua: records = trace.dump( host, port )
+// Stops tracing and writes the ring to the console, to the file or to a
+// TCP connection to host, an IP address; nc -l <port> > trace.txt takes
+// it on the other end. See trace.h for the format.
+static int trace_ldump( lua_State *L )
+{
+  trace_sink_t s = { 0, -1, false };
+
+  trace_groups = 0;
+  if (lua_gettop(L) >= 2) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(luaL_checkinteger(L, 2));
+    if (!inet_aton(luaL_checkstring(L, 1), &addr.sin_addr))
+      return luaL_error(L, "invalid ip");
+    s.sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (s.sock < 0)
+      return luaL_error(L, "out of sockets");
+    if (connect(s.sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+      close(s.sock);
+      return luaL_error(L, "cannot connect");
+    }
+  } else if (!lua_isnoneornil(L, 1)) {
+    const char *fname = luaL_checkstring(L, 1);
+    s.fd = vfs_open(fname, "w");
+    if (!s.fd)
+      return luaL_error(L, "cannot open %s", fname);
+  }
+
+  uint32_t records = trace_dump(sink_out, &s);
+  if (s.sock >= 0) {
+    sink_flush(&s);
+    close(s.sock);
+  }
+  if (s.fd)
+    vfs_close(s.fd);
+  if (s.failed)
+    return luaL_error(L, "writing the trace failed");
+  lua_pushinteger(L, records);
+  return 1;
+}
+
+// Module function map
+const LUA_REG_TYPE trace_map[] = {
+  { LSTRKEY( "start" ), LFUNCVAL( trace_lstart ) },
+  { LSTRKEY( "stop" ),  LFUNCVAL( trace_lstop ) },
+  { LSTRKEY( "mark" ),  LFUNCVAL( trace_lmark ) },
+  { LSTRKEY( "enter" ), LFUNCVAL( trace_lenter ) },
+  { LSTRKEY( "leave" ), LFUNCVAL( trace_lleave ) },
+  { LSTRKEY( "info" ),  LFUNCVAL( trace_linfo ) },
+  { LSTRKEY( "dump" ),  LFUNCVAL( trace_ldump ) },
+  { LSTRKEY( "TASK" ),  LNUMVAL( 1 << TRACE_GROUP_TASK ) },
+  { LSTRKEY( "NET" ),   LNUMVAL( 1 << TRACE_GROUP_NET ) },
+  { LSTRKEY( "TMR" ),   LNUMVAL( 1 << TRACE_GROUP_TMR ) },
+  { LSTRKEY( "MQTT" ),  LNUMVAL( 1 << TRACE_GROUP_MQTT ) },
+  { LSTRKEY( "GC" ),    LNUMVAL( 1 << TRACE_GROUP_GC ) },
+  { LSTRKEY( "VFS" ),   LNUMVAL( 1 << TRACE_GROUP_VFS ) },
+  { LSTRKEY( "LUA" ),   LNUMVAL( 1 << TRACE_GROUP_LUA ) },
+  { LSTRKEY( "ALL" ),   LNUMVAL( TRACE_ALL ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_trace( lua_State *L )
+{
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_TRACELIBNAME, trace_map );
+  return 1;
+#endif
+}
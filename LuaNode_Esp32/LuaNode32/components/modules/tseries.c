@@ -0,0 +1,453 @@
+// Module for time series: sensor samples in rings, with rollups
+//
+// A series keeps its last samples as float32 values with a timestamp in
+// seconds, 8 bytes each, in a ring of fixed size. As samples come in they
+// are also rolled up into the min, max and average of each minute and of
+// each hour, kept in rings of their own, so hours or days of history fit
+// where the samples don't. A series can write each finished rollup to the
+// flash log as well and read them back after a reboot.
+//
+// encode() packs samples or rollups into a buffer for upload, as a header
+//   'T' 'S' 'r'|'m'|'h' 0, uint32 count
+// and then count records, all little endian,
+//   raw:            uint32 t, float v
+//   minute, hour:   uint32 t, float min, float max, float avg, uint32 n
+// where t is the start of the minute or hour.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "buffer.h"
+#include "flashlog.h"
+#include <sys/time.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TSERIES_TABLE      "tseries.series"
+#define TSERIES_NAME_MAX   15
+#define TSERIES_MINUTES    60      // rollups kept by default
+#define TSERIES_HOURS      24
+
+enum { TS_RAW, TS_MINUTE, TS_HOUR };
+
+static const char * const ts_levels[] = { "raw", "minute", "hour", NULL };
+static const uint32_t ts_period[] = { 0, 60, 3600 };
+
+typedef struct {
+  uint32_t t;
+  float v;
+} ts_sample_t;
+
+typedef struct {
+  uint32_t t;
+  float min, max, avg;
+  uint32_t n;
+} ts_rollup_t;
+
+// The rollup under way
+typedef struct {
+  uint32_t t;
+  float min, max;
+  double sum;
+  uint32_t n;
+} ts_acc_t;
+
+typedef struct {
+  uint8_t *data;
+  uint32_t cap, head, count;    // head is where the next one goes
+  uint16_t size;
+} ts_ring_t;
+
+typedef struct {
+  ts_ring_t ring[3];
+  ts_acc_t acc[3];              // for TS_MINUTE and TS_HOUR
+  char name[TSERIES_NAME_MAX + 1];   // for the flash log, "" for none
+} tseries_t;
+
+// Flash log records: "TS", the level's letter, the name's length and the
+// name, then a ts_rollup_t
+#define TS_REC_HEAD  4
+
+static void *ring_push( ts_ring_t *r )
+{
+  void *p = r->data + r->head * r->size;
+  r->head = r->head + 1 == r->cap ? 0 : r->head + 1;
+  if (r->count < r->cap)
+    r->count++;
+  return p;
+}
+
+// The i-th entry, oldest first
+static void *ring_at( const ts_ring_t *r, uint32_t i )
+{
+  uint32_t k = r->head + r->cap - r->count + i;
+  return r->data + (k % r->cap) * r->size;
+}
+
+static uint32_t ts_now( void )
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return tv.tv_sec;
+}
+
+static void ts_persist( tseries_t *s, int level, const ts_rollup_t *r )
+{
+  uint8_t rec[TS_REC_HEAD + TSERIES_NAME_MAX + sizeof(ts_rollup_t)];
+  size_t nlen = strlen( s->name );
+  rec[0] = 'T';
+  rec[1] = 'S';
+  rec[2] = ts_levels[level][0];
+  rec[3] = nlen;
+  memcpy( rec + TS_REC_HEAD, s->name, nlen );
+  memcpy( rec + TS_REC_HEAD + nlen, r, sizeof(*r) );
+  log_store_append( &flashlog_store, rec, TS_REC_HEAD + nlen + sizeof(*r) );
+}
+
+// Moves the rollup under way into its ring
+static void ts_close( tseries_t *s, int level )
+{
+  ts_acc_t *a = &s->acc[level];
+  ts_rollup_t *r = (ts_rollup_t *)ring_push( &s->ring[level] );
+  r->t = a->t;
+  r->min = a->min;
+  r->max = a->max;
+  r->avg = a->sum / a->n;
+  r->n = a->n;
+  a->n = 0;
+  if (s->name[0])
+    ts_persist( s, level, r );
+}
+
+static void ts_add( tseries_t *s, float v, uint32_t t )
+{
+  ts_sample_t *p = (ts_sample_t *)ring_push( &s->ring[TS_RAW] );
+  p->t = t;
+  p->v = v;
+  for (int level = TS_MINUTE; level <= TS_HOUR; level++) {
+    ts_acc_t *a = &s->acc[level];
+    uint32_t start = t - t % ts_period[level];
+    if (a->n && a->t != start)
+      ts_close( s, level );
+    if (a->n == 0) {
+      a->t = start;
+      a->min = a->max = v;
+      a->sum = 0;
+    }
+    if (v < a->min)
+      a->min = v;
+    if (v > a->max)
+      a->max = v;
+    a->sum += v;
+    a->n++;
+  }
+}
+
+static tseries_t *ts_check( lua_State *L )
+{
+  return (tseries_t *)luaL_checkudata( L, 1, TSERIES_TABLE );
+}
+
+static uint32_t ts_optfield( lua_State *L, int idx, const char *name, uint32_t def )
+{
+  uint32_t v = def;
+  if (lua_istable( L, idx )) {
+    lua_getfield( L, idx, name );
+    if (!lua_isnil( L, -1 ))
+      v = luaL_checkinteger( L, -1 );
+    lua_pop( L, 1 );
+  }
+  return v;
+}
+
+// Lua: s = tseries.new( capacity[, { minutes=, hours=, persist= }] )
+// capacity samples are kept, and minutes and hours rollups, 60 and 24 by
+// default. persist names the series in the flash log, up to 15 chars;
+// each finished rollup is then appended to it.
+static int tseries_new( lua_State *L )
+{
+  uint32_t cap[3];
+  const char *name = "";
+  cap[TS_RAW] = luaL_checkinteger( L, 1 );
+  cap[TS_MINUTE] = ts_optfield( L, 2, "minutes", TSERIES_MINUTES );
+  cap[TS_HOUR] = ts_optfield( L, 2, "hours", TSERIES_HOURS );
+  if (lua_istable( L, 2 )) {
+    lua_getfield( L, 2, "persist" );
+    if (!lua_isnil( L, -1 ))
+      name = luaL_checkstring( L, -1 );
+    luaL_argcheck( L, strlen( name ) <= TSERIES_NAME_MAX, 2, "persist name too long" );
+  }
+  for (int i = 0; i < 3; i++)
+    luaL_argcheck( L, cap[i] >= 1 && cap[i] <= 0x100000, i ? 2 : 1, "size out of range" );
+
+  size_t bytes = cap[TS_RAW] * sizeof(ts_sample_t) +
+                 (cap[TS_MINUTE] + cap[TS_HOUR]) * sizeof(ts_rollup_t);
+  tseries_t *s = (tseries_t *)lua_newuserdata( L, sizeof(tseries_t) + bytes );
+  memset( s, 0, sizeof(*s) );
+  strcpy( s->name, name );
+  uint8_t *p = (uint8_t *)(s + 1);
+  for (int i = 0; i < 3; i++) {
+    s->ring[i].data = p;
+    s->ring[i].cap = cap[i];
+    s->ring[i].size = i == TS_RAW ? sizeof(ts_sample_t) : sizeof(ts_rollup_t);
+    p += cap[i] * s->ring[i].size;
+  }
+  luaL_getmetatable( L, TSERIES_TABLE );
+  lua_setmetatable( L, -2 );
+  return 1;
+}
+
+// Lua: s:add( value[, t] )
+// t is in seconds, the clock's time by default. Samples are expected in
+// order; one from an earlier minute or hour starts a new rollup.
+static int tseries_add( lua_State *L )
+{
+  tseries_t *s = ts_check( L );
+  float v = luaL_checknumber( L, 2 );
+  uint32_t t = lua_isnoneornil( L, 3 ) ? ts_now() : (uint32_t)luaL_checknumber( L, 3 );
+  ts_add( s, v, t );
+  return 0;
+}
+
+// Lua: value, t = s:last()
+static int tseries_last( lua_State *L )
+{
+  tseries_t *s = ts_check( L );
+  ts_ring_t *r = &s->ring[TS_RAW];
+  if (r->count == 0)
+    return 0;
+  ts_sample_t *p = (ts_sample_t *)ring_at( r, r->count - 1 );
+  lua_pushnumber( L, p->v );
+  lua_pushnumber( L, p->t );
+  return 2;
+}
+
+// The first sample at or after t
+static uint32_t ts_find( const ts_ring_t *r, uint32_t t )
+{
+  uint32_t lo = 0, hi = r->count;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if (*(const uint32_t *)ring_at( r, mid ) < t)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Lua: min, max, avg, n = s:stats( [seconds] )
+// Over the samples of the last seconds before the newest one, or all
+static int tseries_stats( lua_State *L )
+{
+  tseries_t *s = ts_check( L );
+  ts_ring_t *r = &s->ring[TS_RAW];
+  if (r->count == 0)
+    return 0;
+  uint32_t i = 0;
+  if (!lua_isnoneornil( L, 2 )) {
+    uint32_t newest = ((ts_sample_t *)ring_at( r, r->count - 1 ))->t;
+    uint32_t secs = luaL_checkinteger( L, 2 );
+    i = ts_find( r, secs < newest ? newest - secs : 0 );
+  }
+  float mn = 0, mx = 0;
+  double sum = 0;
+  uint32_t n = 0;
+  for (; i < r->count; i++, n++) {
+    float v = ((ts_sample_t *)ring_at( r, i ))->v;
+    if (n == 0 || v < mn)
+      mn = v;
+    if (n == 0 || v > mx)
+      mx = v;
+    sum += v;
+  }
+  lua_pushnumber( L, mn );
+  lua_pushnumber( L, mx );
+  lua_pushnumber( L, n ? sum / n : 0 );
+  lua_pushinteger( L, n );
+  return 4;
+}
+
+static int tseries_samples_iter( lua_State *L )
+{
+  tseries_t *s = (tseries_t *)lua_touserdata( L, lua_upvalueindex( 1 ) );
+  uint32_t i = lua_tointeger( L, lua_upvalueindex( 2 ) );
+  uint32_t t = lua_tointeger( L, lua_upvalueindex( 3 ) );
+  ts_ring_t *r = &s->ring[TS_RAW];
+  // samples added since the last step moved the ring under us; find our
+  // place again by time
+  if (i < r->count && ((ts_sample_t *)ring_at( r, i ))->t < t)
+    i = ts_find( r, t );
+  if (i >= r->count)
+    return 0;
+  ts_sample_t *p = (ts_sample_t *)ring_at( r, i );
+  lua_pushinteger( L, i + 1 );
+  lua_replace( L, lua_upvalueindex( 2 ) );
+  lua_pushnumber( L, p->t );
+  lua_replace( L, lua_upvalueindex( 3 ) );
+  lua_pushnumber( L, p->t );
+  lua_pushnumber( L, p->v );
+  return 2;
+}
+
+// Lua: for t, value in s:samples( [since] ) do ... end
+// Oldest first, from time since on
+static int tseries_samples( lua_State *L )
+{
+  tseries_t *s = ts_check( L );
+  uint32_t since = luaL_optnumber( L, 2, 0 );
+  lua_settop( L, 1 );
+  lua_pushinteger( L, ts_find( &s->ring[TS_RAW], since ) );
+  lua_pushnumber( L, since );
+  lua_pushcclosure( L, tseries_samples_iter, 3 );
+  return 1;
+}
+
+static void ts_push_rollup( lua_State *L, const ts_rollup_t *r )
+{
+  lua_createtable( L, 0, 5 );
+  lua_pushnumber( L, r->t );
+  lua_setfield( L, -2, "t" );
+  lua_pushnumber( L, r->min );
+  lua_setfield( L, -2, "min" );
+  lua_pushnumber( L, r->max );
+  lua_setfield( L, -2, "max" );
+  lua_pushnumber( L, r->avg );
+  lua_setfield( L, -2, "avg" );
+  lua_pushinteger( L, r->n );
+  lua_setfield( L, -2, "n" );
+}
+
+// Lua: list = s:rollups( "minute" | "hour"[, n] )
+// The last n finished rollups, all by default, oldest first, as tables
+// { t=, min=, max=, avg=, n= }
+static int tseries_rollups( lua_State *L )
+{
+  tseries_t *s = ts_check( L );
+  int level = luaL_checkoption( L, 2, NULL, ts_levels );
+  luaL_argcheck( L, level != TS_RAW, 2, "minute or hour expected" );
+  ts_ring_t *r = &s->ring[level];
+  uint32_t n = luaL_optinteger( L, 3, r->count );
+  if (n > r->count)
+    n = r->count;
+  lua_createtable( L, n, 0 );
+  for (uint32_t i = 0; i < n; i++) {
+    ts_push_rollup( L, (ts_rollup_t *)ring_at( r, r->count - n + i ) );
+    lua_rawseti( L, -2, i + 1 );
+  }
+  return 1;
+}
+
+// Lua: rollup = s:current( "minute" | "hour" )
+// The one under way, or nil
+static int tseries_current( lua_State *L )
+{
+  tseries_t *s = ts_check( L );
+  int level = luaL_checkoption( L, 2, NULL, ts_levels );
+  luaL_argcheck( L, level != TS_RAW, 2, "minute or hour expected" );
+  ts_acc_t *a = &s->acc[level];
+  if (a->n == 0)
+    return 0;
+  ts_rollup_t r = { a->t, a->min, a->max, a->sum / a->n, a->n };
+  ts_push_rollup( L, &r );
+  return 1;
+}
+
+// Lua: buf = s:encode( [level[, since]] )
+// level is "raw" (the default), "minute" or "hour"; the records are those
+// from time since on. See the top of this file for the format.
+static int tseries_encode( lua_State *L )
+{
+  tseries_t *s = ts_check( L );
+  int level = luaL_checkoption( L, 2, "raw", ts_levels );
+  ts_ring_t *r = &s->ring[level];
+  uint32_t first = ts_find( r, luaL_optnumber( L, 3, 0 ) );
+  uint32_t n = r->count - first;
+  lbuffer_t *b = buffer_push( L, 8 + n * r->size );
+  uint8_t *p = b->data;
+  p[0] = 'T';
+  p[1] = 'S';
+  p[2] = ts_levels[level][0];
+  p[3] = 0;
+  memcpy( p + 4, &n, 4 );
+  p += 8;
+  for (uint32_t i = first; i < r->count; i++, p += r->size)
+    memcpy( p, ring_at( r, i ), r->size );
+  return 1;
+}
+
+// Lua: n = s:restore()
+// Reads the series' rollups back from the flash log, e.g. after a reboot,
+// in place of any it holds. Returns how many were found.
+static int tseries_restore( lua_State *L )
+{
+  tseries_t *s = ts_check( L );
+  size_t nlen = strlen( s->name );
+  log_store_pos_t pos;
+  uint8_t *rec;
+  int32_t len;
+  int found = 0;
+  if (nlen == 0)
+    return luaL_error( L, "series has no persist name" );
+  if (!log_store_first( &flashlog_store, &pos ))
+    return luaL_error( L, "no log partition" );
+  if ((rec = (uint8_t *)malloc( LOG_STORE_MAX_RECORD )) == NULL)
+    return luaL_error( L, "out of memory" );
+  s->ring[TS_MINUTE].count = s->ring[TS_MINUTE].head = 0;
+  s->ring[TS_HOUR].count = s->ring[TS_HOUR].head = 0;
+  while ((len = log_store_next( &flashlog_store, &pos, rec )) >= 0) {
+    if (len != TS_REC_HEAD + nlen + sizeof(ts_rollup_t) || rec[0] != 'T' || rec[1] != 'S' ||
+        rec[3] != nlen || memcmp( rec + TS_REC_HEAD, s->name, nlen ))
+      continue;
+    int level = rec[2] == 'm' ? TS_MINUTE : rec[2] == 'h' ? TS_HOUR : TS_RAW;
+    if (level != TS_RAW) {
+      memcpy( ring_push( &s->ring[level] ), rec + TS_REC_HEAD + nlen, sizeof(ts_rollup_t) );
+      found++;
+    }
+  }
+  free( rec );
+  lua_pushinteger( L, found );
+  return 1;
+}
+
+static int tseries_len( lua_State *L )
+{
+  lua_pushinteger( L, ts_check( L )->ring[TS_RAW].count );
+  return 1;
+}
+
+static const LUA_REG_TYPE tseries_series_map[] = {
+  { LSTRKEY( "add" ),     LFUNCVAL( tseries_add ) },
+  { LSTRKEY( "last" ),    LFUNCVAL( tseries_last ) },
+  { LSTRKEY( "stats" ),   LFUNCVAL( tseries_stats ) },
+  { LSTRKEY( "samples" ), LFUNCVAL( tseries_samples ) },
+  { LSTRKEY( "rollups" ), LFUNCVAL( tseries_rollups ) },
+  { LSTRKEY( "current" ), LFUNCVAL( tseries_current ) },
+  { LSTRKEY( "encode" ),  LFUNCVAL( tseries_encode ) },
+  { LSTRKEY( "restore" ), LFUNCVAL( tseries_restore ) },
+  { LSTRKEY( "__len" ),   LFUNCVAL( tseries_len ) },
+  { LSTRKEY( "__index" ), LROVAL( tseries_series_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+// Module function map
+const LUA_REG_TYPE tseries_map[] = {
+  { LSTRKEY( "new" ), LFUNCVAL( tseries_new ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_tseries( lua_State *L )
+{
+  // encode() returns buffers, which need their metatable set up
+  luaR_getglobal( L, LUA_BUFFERLIBNAME, strlen(LUA_BUFFERLIBNAME) );
+  luaL_rometatable( L, TSERIES_TABLE, (void *)tseries_series_map );
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_TSERIESLIBNAME, tseries_map );
+  return 1;
+#endif
+}
@@ -2,6 +2,7 @@
 
 #include "modules.h"
 #include "lauxlib.h"
+#include "buffer.h"
 #include "lualib.h"
 #include "platform.h"
 #include "lrotable.h"
@@ -9,31 +10,154 @@
 
 #include "c_types.h"
 #include "c_string.h"
+#include "task/task.h"
+#include "uart_claim.h"
+#include "sdkconfig.h"
 
 static lua_State *gL = NULL;
-static int uart_receive_rf = LUA_NOREF;
-bool run_input = true;
-bool uart_on_data_cb(const char *buf, size_t len){
+static task_handle_t uart_sent_task;
+static task_handle_t uart_data_task;
+bool run_input = true;        // UART0 input also goes to the interpreter
+
+// Callbacks and framing of each port
+typedef struct {
+  int receive_rf;
+  int sent_rf;
+  uint8_t receive_prio;   // task priorities the callbacks run at
+  uint8_t sent_prio;
+  bool as_buffer;         // "data" gets a buffer rather than a string
+  uint16_t need_len;
+  int16_t end_char;
+  // Bytes of the "data" callback's next piece, until need_len or end_char
+  size_t piece_len;
+  char piece[256];
+} lua_uart_t;
+
+static lua_uart_t uarts[NUM_UART] = {
+  [0 ... NUM_UART - 1] = { LUA_NOREF, LUA_NOREF, TASK_PRIORITY_LOW, TASK_PRIORITY_LOW, false, 0, -1 }
+};
+
+// Ports taken over by C code, see uart_claim.h
+static const uart_claim_t *volatile claims[NUM_UART];
+
+bool uart_claim( unsigned id, const uart_claim_t *c )
+{
+  if( id >= NUM_UART || ( c && claims[id] && claims[id] != c ) )
+    return false;
+  claims[id] = c;
+  return true;
+}
+
+// In the TX interrupt
+static void uart_sent_isr( unsigned id )
+{
+  const uart_claim_t *c = claims[id];
+  if( c )
+    c->tx_done( id, c->arg );
+  else if( uarts[id].sent_rf != LUA_NOREF )
+    task_post( uarts[id].sent_prio, uart_sent_task, id );
+}
+
+static void uart_sent( task_param_t param, task_prio_t prio )
+{
+  lua_uart_t *u = &uarts[param];
+  // more may have been queued since it ran empty
+  if( u->sent_rf == LUA_NOREF || platform_uart_pending( param ) )
+    return;
+  lua_State *L = lua_getstate();
+  lua_rawgeti( L, LUA_REGISTRYINDEX, u->sent_rf );
+  lua_call( L, 0, 0 );
+}
+
+static void uart_deliver(lua_uart_t *u, const char *buf, size_t len){
+  lua_rawgeti(gL, LUA_REGISTRYINDEX, u->receive_rf);
+  if(u->as_buffer)
+    memcpy(buffer_push(gL, len)->data, buf, len);
+  else
+    lua_pushlstring(gL, buf, len);
+  lua_call(gL, 1, 0);
+}
+
+// Hand a block of port id's input to its "data" callback, in pieces of
+// need_len bytes or ending in end_char when it asked for them
+static bool uart_feed(unsigned id, const char *buf, size_t len){
+  lua_uart_t *u = &uarts[id];
+  size_t i;
   if(!buf || len==0)
     return false;
-  if(uart_receive_rf == LUA_NOREF)
+  if(u->receive_rf == LUA_NOREF)
     return false;
   if(!gL)
     return false;
-  lua_rawgeti(gL, LUA_REGISTRYINDEX, uart_receive_rf);
-  lua_pushlstring(gL, buf, len);
-  lua_call(gL, 1, 0);
-  return !run_input;
+  if(u->need_len == 0 && u->end_char < 0){
+    uart_deliver(u, buf, len);
+    return true;
+  }
+  for(i = 0; i < len && u->receive_rf != LUA_NOREF; i++){
+    u->piece[u->piece_len++] = buf[i];
+    if((u->need_len && u->piece_len == u->need_len) ||
+       (u->end_char >= 0 && (uint8_t)buf[i] == u->end_char) ||
+       u->piece_len == sizeof(u->piece)){
+      size_t n = u->piece_len;
+      u->piece_len = 0;   // first, the callback may raise an error
+      uart_deliver(u, u->piece, n);
+    }
+  }
+  return true;
 }
 
-uint16_t need_len = 0;
-int16_t end_char = -1;
-// Lua: uart.on("method", [number/char], function, [run_input])
+// Called by the console with each block UART0 buffered. True keeps it
+// from the interpreter
+bool uart_on_data_cb(const char *buf, size_t len){
+  return uart_feed(0, buf, len) && !run_input;
+}
+
+// On the Lua task: whatever UART1 and UART2 have buffered. One post
+// covers both ports, so each is read whichever of them asked
+static void uart_data( task_param_t param, task_prio_t prio )
+{
+  char block[64];
+  size_t n;
+  unsigned id;
+  for( id = 1; id < NUM_UART; id++ )
+    if( !claims[id] )
+      while( ( n = platform_uart_read( id, ( uint8_t * )block, sizeof( block ) ) ) > 0 )
+        uart_feed( id, block, n );
+}
+
+// In uart_task, when UART1 or UART2 has bytes
+static void uart_rx_ready( unsigned id )
+{
+  const uart_claim_t *c = claims[id];
+  if( c )
+    c->rx_ready( id, c->arg );
+  else
+    task_post_coalesced( uarts[id].receive_prio, uart_data_task, 0 );
+}
+
+// Lua: uart.on([id,] "method", [number/char], function, [run_input[, prio]])
+// Lua: uart.on([id,] "method", [number/char], function, {run_input=, prio=, buffer=})
+// "data" gets what port id (default 0) receives, "sent" is called once
+// everything written to it has gone to the FIFO. run_input only applies
+// to UART0, which the interpreter reads. prio is the node.PRIO_* the
+// callback is queued at, medium for UART0's data and low otherwise. With
+// buffer "data" gets each piece in a buffer, which isn't interned the
+// way a string is and goes on to net, file or mqtt as it is
 static int uart_on( lua_State* L )
 {
   size_t sl, el;
   int32_t run = 1;
+  bool as_buffer = false;
+  task_prio_t prio;
   uint8_t stack = 1;
+  unsigned id = 0;
+  if( lua_type( L, stack ) == LUA_TNUMBER )
+  {
+    id = luaL_checkinteger( L, stack );
+    MOD_CHECK_ID( uart, id );
+    stack++;
+  }
+  lua_uart_t *u = &uarts[id];
   const char *method = luaL_checklstring( L, stack, &sl );
   stack++;
   if (method == NULL)
@@ -41,11 +165,11 @@ static int uart_on( lua_State* L )
 
   if( lua_type( L, stack ) == LUA_TNUMBER )
   {
-    need_len = ( uint16_t )luaL_checkinteger( L, stack );
+    u->need_len = ( uint16_t )luaL_checkinteger( L, stack );
     stack++;
-    end_char = -1;
-    if( need_len > 255 ){
-      need_len = 255;
+    u->end_char = -1;
+    if( u->need_len > 255 ){
+      u->need_len = 255;
       return luaL_error( L, "wrong arg range" );
     }
   }
@@ -56,8 +180,8 @@ static int uart_on( lua_State* L )
     if(el!=1){
       return luaL_error( L, "wrong arg range" );
     }
-    end_char = (int16_t)end[0];
-    need_len = 0;
+    u->end_char = (uint8_t)end[0];
+    u->need_len = 0;
   }
 
   // luaL_checkanyfunction(L, stack);
@@ -65,24 +189,58 @@ static int uart_on( lua_State* L )
     if ( lua_isnumber(L, stack+1) ){
       run = lua_tointeger(L, stack+1);
     }
+    task_prio_t def = id == 0 && sl == 4 && c_strcmp(method, "data") == 0 ?
+                      TASK_PRIORITY_MEDIUM : TASK_PRIORITY_LOW;
+    if ( lua_istable(L, stack+1) ){
+      lua_getfield(L, stack+1, "run_input");
+      if (!lua_isnil(L, -1))
+        run = lua_toboolean(L, -1);
+      lua_getfield(L, stack+1, "prio");
+      prio = mod_optprio(L, -1, def);
+      lua_getfield(L, stack+1, "buffer");
+      as_buffer = lua_toboolean(L, -1);
+      lua_pop(L, 3);
+    } else {
+      prio = mod_optprio(L, stack+2, def);
+    }
     lua_pushvalue(L, stack);  // copy argument (func) to the top of stack
   } else {
+    prio = TASK_PRIORITY_LOW;
     lua_pushnil(L);
   }
   if(sl == 4 && c_strcmp(method, "data") == 0){
-    run_input = true;
-    if(uart_receive_rf != LUA_NOREF){
-      luaL_unref(L, LUA_REGISTRYINDEX, uart_receive_rf);
-      uart_receive_rf = LUA_NOREF;
+    if(id == 0){
+      run_input = true;
+      lua_input_priority(TASK_PRIORITY_MEDIUM);
+    }
+    u->piece_len = 0;
+    if(u->receive_rf != LUA_NOREF){
+      luaL_unref(L, LUA_REGISTRYINDEX, u->receive_rf);
+      u->receive_rf = LUA_NOREF;
     }
     if(!lua_isnil(L, -1)){
-      uart_receive_rf = luaL_ref(L, LUA_REGISTRYINDEX);
+      u->receive_rf = luaL_ref(L, LUA_REGISTRYINDEX);
+      u->receive_prio = prio;
+      u->as_buffer = as_buffer;
+      if(id == 0)
+        lua_input_priority(prio);
       gL = L;
-      if(run==0)
+      if(run==0 && id == 0)
         run_input = false;
     } else {
       lua_pop(L, 1);
     }
+  }else if(sl == 4 && c_strcmp(method, "sent") == 0){
+    if(u->sent_rf != LUA_NOREF){
+      luaL_unref(L, LUA_REGISTRYINDEX, u->sent_rf);
+      u->sent_rf = LUA_NOREF;
+    }
+    if(!lua_isnil(L, -1)){
+      u->sent_rf = luaL_ref(L, LUA_REGISTRYINDEX);
+      u->sent_prio = prio;
+    } else {
+      lua_pop(L, 1);
+    }
   }else{
     lua_pop(L, 1);
     return luaL_error( L, "method not supported" );
@@ -91,12 +249,16 @@ static int uart_on( lua_State* L )
 }
 
 bool uart0_echo = true;
-// Lua: actualbaud = setup( id, baud, databits, parity, stopbits, echo )
+// Lua: actualbaud = setup( id, baud, databits, parity, stopbits[, echo | pins] )
+// pins is a table { tx = gpio, rx = gpio, de = gpio }, each optional. UART0
+// keeps its console pins; UART1 and UART2 need tx and rx routed. With de
+// the port drives an RS-485 transceiver: DE is raised while bytes go out
+// and dropped when the last one has left, without Lua toggling it
 static int uart_setup( lua_State* L )
 {
-#if 0
-  unsigned id, databits, parity, stopbits, echo = 1;
+  unsigned id, databits, parity, stopbits;
   u32 baud, res;
+  int tx = -1, rx = -1, de = -1;
   
   id = luaL_checkinteger( L, 1 );
   MOD_CHECK_ID( uart, id );
@@ -105,18 +267,24 @@ static int uart_setup( lua_State* L )
   parity = luaL_checkinteger( L, 4 );
   stopbits = luaL_checkinteger( L, 5 );
   if(lua_isnumber(L,6)){
-    echo = lua_tointeger(L,6);
-    if(echo!=0)
-      uart0_echo = true;
-    else
-      uart0_echo = false;
+    uart0_echo = lua_tointeger(L,6) != 0;
+  } else if(lua_istable(L,6)){
+    lua_getfield(L, 6, "tx");
+    tx = luaL_optinteger(L, -1, -1);
+    lua_getfield(L, 6, "rx");
+    rx = luaL_optinteger(L, -1, -1);
+    lua_getfield(L, 6, "de");
+    de = luaL_optinteger(L, -1, -1);
+    lua_pop(L, 3);
   }
+  if( id != 0 && ( tx < 0 || rx < 0 ) )
+    return luaL_error( L, "uart %d needs tx and rx pins", id );
 
-  res = platform_uart_setup( id, baud, databits, parity, stopbits );
+  res = platform_uart_setup( id, baud, databits, parity, stopbits, tx, rx, de );
+  if( res == 0 )
+    return luaL_error( L, "wrong arg range" );
   lua_pushinteger( L, res );
   return 1;
-#endif
-	return 0;
 }
 
 // Lua: alt( set )
@@ -130,16 +298,19 @@ static int uart_alt( lua_State* L )
   return 0;
 }
 
-// Lua: write( id, string1, [string2], ..., [stringn] )
+// Lua: below = write( id, string1, [string2], ..., [stringn] )
+// Queued for the TX interrupt, so it returns before the bytes are out.
+// below is false once the queue passes its high-water mark, more should
+// wait for the "sent" callback
 static int uart_write( lua_State* L )
 {
   int id;
   const char* buf;
-  size_t len, i;
+  size_t len;
   int total = lua_gettop( L ), s;
   
   id = luaL_checkinteger( L, 1 );
-  //MOD_CHECK_ID( uart, id );
+  MOD_CHECK_ID( uart, id );
   for( s = 2; s <= total; s ++ )
   {
     if( lua_type( L, s ) == LUA_TNUMBER )
@@ -151,13 +322,12 @@ static int uart_write( lua_State* L )
     }
     else
     {
-      luaL_checktype( L, s, LUA_TSTRING );
-      buf = lua_tolstring( L, s, &len );
-      for( i = 0; i < len; i ++ )
-        platform_uart_send( id, buf[ i ] );
+      buf = buffer_checklstring( L, s, &len );
+      platform_uart_queue( id, ( const uint8_t * )buf, len );
     }
   }
-  return 0;
+  lua_pushboolean( L, platform_uart_pending( id ) < CONFIG_UART_TX_HIGH_WATER );
+  return 1;
 }
 
 // Module function map
@@ -177,6 +347,10 @@ const LUA_REG_TYPE uart_map[] =  {
 
 LUALIB_API int luaopen_uart(lua_State *L)
 {
+  uart_sent_task = task_get_id( uart_sent );
+  uart_data_task = task_get_id( uart_data );
+  platform_uart_on_sent( uart_sent_isr );
+  platform_uart_on_data( uart_rx_ready );
 #if LUA_OPTIMIZE_MEMORY > 0
     return 0;
 #else  
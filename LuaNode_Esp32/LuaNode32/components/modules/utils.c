@@ -7,6 +7,18 @@
 #include "datetime.h"
 //#include "md5.h"
 #include "lualib.h"
+#include "lrotable.h"
+#include "buffer.h"
+
+#define BASE64_OBJ "utils.base64"
+
+typedef struct {
+	bool decode;
+	union {
+		base64_enc_t enc;
+		base64_dec_t dec;
+	} st;
+} base64_stream_t;
 
 /**
  * translate Hex to String
@@ -31,25 +43,125 @@ void HexToStr(unsigned char *pbDest, unsigned char *pbSrc, int nLen)
     pbDest[nLen*2] = '\0';
 }
 
-// return the lenght of encoding string
-static int base64_encode0( lua_State* L ) {
-	int argc = lua_gettop(L);
-	const char *str = lua_tostring(L, 1);
-	char *buff = malloc(strlen(str) * 2);
-	memset(buff, 0, strlen(str)*2);
-	int num = base64_encode(str, strlen(str), buff, 1);
-	lua_pushstring(L, buff);
+// Characters of input encoded per luaL_Buffer block
+#define BASE64_ENC_STEP (LUAL_BUFFERSIZE / 4 * 3)
+// Characters of input decoded per block, leaving room for what is pending
+#define BASE64_DEC_STEP (LUAL_BUFFERSIZE / 3 * 4 - 4)
+
+// Adds the conversion of data to b, a block at a time
+static void base64_stream_add( lua_State *L, luaL_Buffer *b, base64_stream_t *s, const char *data, size_t len )
+{
+	while (len) {
+		size_t k = len;
+		int n;
+		char *out = luaL_prepbuffer(b);
+		if (s->decode) {
+			if (k > BASE64_DEC_STEP)
+				k = BASE64_DEC_STEP;
+			n = base64_decode_update(&s->st.dec, data, k, out);
+			if (n < 0)
+				luaL_error(L, "invalid base64 data");
+		} else {
+			if (k > BASE64_ENC_STEP)
+				k = BASE64_ENC_STEP;
+			n = base64_encode_update(&s->st.enc, data, k, out);
+		}
+		luaL_addsize(b, n);
+		data += k;
+		len -= k;
+	}
+}
+
+// Adds what is left over to b and resets the state
+static void base64_stream_end( lua_State *L, luaL_Buffer *b, base64_stream_t *s )
+{
+	char *out = luaL_prepbuffer(b);
+	int n;
+	if (s->decode) {
+		n = base64_decode_final(&s->st.dec, out);
+		if (n < 0)
+			luaL_error(L, "invalid base64 data");
+	} else {
+		n = base64_encode_final(&s->st.enc, out, 1);
+	}
+	luaL_addsize(b, n);
+}
+
+static int base64_convert( lua_State* L, bool decode ) {
+	size_t len;
+	const char *data = buffer_checklstring(L, 1, &len);
+	base64_stream_t s;
+	luaL_Buffer b;
+	s.decode = decode;
+	if (decode)
+		base64_decode_init(&s.st.dec);
+	else
+		base64_encode_init(&s.st.enc);
+	luaL_buffinit(L, &b);
+	base64_stream_add(L, &b, &s, data, len);
+	base64_stream_end(L, &b, &s);
+	luaL_pushresult(&b);
 	return 1;
 }
 
-// return the length of decoding string
+// Lua: text = utils.base64_encode(data)
+static int base64_encode0( lua_State* L ) {
+	return base64_convert(L, false);
+}
+
+// Lua: data = utils.base64_decode(text)
+// Whitespace is skipped and padding is optional; other characters raise
+// an error.
 static int base64_decode0( lua_State* L ) {
-	int argc = lua_gettop(L);
-	const char *str = lua_tostring(L, 1);
-	char *buff = malloc(strlen(str) * 2);
-	memset(buff, 0, strlen(str)*2);
-	int num = base64_decode(str, buff);
-	lua_pushstring(L, buff);
+	return base64_convert(L, true);
+}
+
+static int base64_stream_new( lua_State* L, bool decode ) {
+	base64_stream_t *s = (base64_stream_t *)lua_newuserdata(L, sizeof(base64_stream_t));
+	s->decode = decode;
+	if (decode)
+		base64_decode_init(&s->st.dec);
+	else
+		base64_encode_init(&s->st.enc);
+	luaL_getmetatable(L, BASE64_OBJ);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+// Lua: enc = utils.base64_encoder()
+// enc:update(data) returns the text for as much of data as makes whole
+// groups, keeping the rest for the next call; enc:finish() returns the
+// end of the text and readies enc for new data. So a file or an HTTP body
+// can be converted a chunk at a time.
+static int base64_encoder( lua_State* L ) {
+	return base64_stream_new(L, false);
+}
+
+// Lua: dec = utils.base64_decoder()
+// The same for decoding; update and finish raise an error for bad input.
+static int base64_decoder( lua_State* L ) {
+	return base64_stream_new(L, true);
+}
+
+// Lua: out = stream:update(chunk)
+static int base64_stream_update( lua_State* L ) {
+	base64_stream_t *s = (base64_stream_t *)luaL_checkudata(L, 1, BASE64_OBJ);
+	size_t len;
+	const char *data = buffer_checklstring(L, 2, &len);
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	base64_stream_add(L, &b, s, data, len);
+	luaL_pushresult(&b);
+	return 1;
+}
+
+// Lua: out = stream:finish()
+static int base64_stream_finish( lua_State* L ) {
+	base64_stream_t *s = (base64_stream_t *)luaL_checkudata(L, 1, BASE64_OBJ);
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	base64_stream_end(L, &b, s);
+	luaL_pushresult(&b);
 	return 1;
 }
 
@@ -76,10 +188,19 @@ static int leapyear0( lua_State* L ) {
 	return 1;
 }*/
 
+static const LUA_REG_TYPE base64_stream_map[] = {
+	{ LSTRKEY( "update" ), LFUNCVAL( base64_stream_update ) },
+	{ LSTRKEY( "finish" ), LFUNCVAL( base64_stream_finish ) },
+	{ LSTRKEY( "__index" ), LROVAL( base64_stream_map ) },
+	{ LNILKEY, LNILVAL }
+};
+
 // Module function map
 const LUA_REG_TYPE utils_map[] = {
 	{ LSTRKEY( "base64_encode" ), LFUNCVAL( base64_encode0 ) },
 	{ LSTRKEY( "base64_decode" ), LFUNCVAL( base64_decode0 ) },
+	{ LSTRKEY( "base64_encoder" ), LFUNCVAL( base64_encoder ) },
+	{ LSTRKEY( "base64_decoder" ), LFUNCVAL( base64_decoder ) },
 	//{ LSTRKEY( "md5_encode" ), LFUNCVAL( md5_encode ) },
 	{ LSTRKEY( "leapyear" ), LFUNCVAL( leapyear0 ) },
 	{ LNILKEY, LNILVAL }
@@ -87,6 +208,7 @@ const LUA_REG_TYPE utils_map[] = {
 
 LUALIB_API int luaopen_utils(lua_State *L)
 {
+	luaL_rometatable(L, BASE64_OBJ, (void *)base64_stream_map);
 #if LUA_OPTIMIZE_MEMORY > 0
     return 0;
 #else  
@@ -0,0 +1,653 @@
+// Module for WebSocket connections (RFC 6455) over net TCP sockets
+//
+// A websocket takes over a connected socket: the upgrade handshake,
+// framing, masking, fragments and ping/pong are all dealt with here, and
+// Lua only sees whole messages. Frames are unmasked in lwIP's own
+// buffers, so a message that arrives in one piece goes to Lua without
+// being copied first; fragmented ones are put together in a buffer sized
+// from the frame headers.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "buffer.h"
+#include "net.h"
+#include "base64.h"
+#include "esp_misc.h"
+#include "hwcrypto/sha.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define WS_OBJ              "websocket.ws"
+#define WS_GUID             "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_KEY_MAX          32      // clients send 24 characters
+#define WS_ACCEPT_LEN       28
+#define WS_HANDSHAKE_MAX    2048    // longest upgrade request or response
+#define WS_MAX_MESSAGE      16384   // default limit on a message
+
+enum {
+  WS_OP_CONT = 0, WS_OP_TEXT = 1, WS_OP_BINARY = 2,
+  WS_OP_CLOSE = 8, WS_OP_PING = 9, WS_OP_PONG = 10
+};
+
+enum { WS_HANDSHAKE, WS_OPEN, WS_CLOSING, WS_CLOSED };
+
+typedef struct {
+  void *sock;
+  int sock_ref;
+  int self_ref;           // held until closed
+  int cb_open_ref;
+  int cb_message_ref;
+  int cb_close_ref;
+  uint8_t state;
+  bool client;            // we mask what we send, the peer doesn't
+  bool open_told;         // the "open" callback has run
+  char accept[WS_ACCEPT_LEN + 1];  // client: what the server must answer
+  char *hs;               // handshake so far
+  uint16_t hs_len;
+  // frame being read
+  uint8_t hdr[14];
+  uint8_t hdr_len;
+  uint8_t op;
+  bool fin;
+  bool masked;
+  uint8_t mask[4];
+  uint32_t off;           // payload bytes read, for the mask position
+  uint32_t remain;        // payload bytes still to come
+  // message being put together from fragments
+  uint8_t msg_op;         // of its first frame, 0 while there is none
+  char *msg;
+  uint32_t msg_len;
+  uint32_t msg_cap;
+  uint32_t msg_max;
+  uint8_t ctrl[125];      // ping and close payload
+  uint8_t ctrl_len;
+} ws_conn;
+
+// XOR n bytes of src with the mask, starting at mask byte off, into dst
+// (which may be src). Whole words at a time where both line up.
+static void ws_mask( uint8_t *dst, const uint8_t *src, size_t n, const uint8_t mask[4], uint32_t off )
+{
+  size_t i = 0;
+  for (; i < n && ((uintptr_t)(dst + i) & 3); i++)
+    dst[i] = src[i] ^ mask[(off + i) & 3];
+  if (!((uintptr_t)(src + i) & 3)) {
+    uint8_t m[4];
+    uint32_t mw;
+    for (int k = 0; k < 4; k++)
+      m[k] = mask[(off + i + k) & 3];
+    memcpy( &mw, m, 4 );
+    for (; i + 4 <= n; i += 4)
+      *(uint32_t *)(dst + i) = *(const uint32_t *)(src + i) ^ mw;
+  }
+  for (; i < n; i++)
+    dst[i] = src[i] ^ mask[(off + i) & 3];
+}
+
+static void ws_accept_key( const char *key, size_t len, char out[WS_ACCEPT_LEN + 1] )
+{
+  unsigned char buf[WS_KEY_MAX + sizeof(WS_GUID) - 1];
+  unsigned char sha[20];
+  memcpy( buf, key, len );
+  memcpy( buf + len, WS_GUID, sizeof(WS_GUID) - 1 );
+  esp_sha1( buf, len + sizeof(WS_GUID) - 1, sha );
+  base64_encode( sha, sizeof(sha), out, 1 );
+}
+
+// The value of header name in the handshake, trimmed, or NULL
+static const char *ws_header( const char *hs, const char *name, size_t *len )
+{
+  size_t nlen = strlen( name );
+  for (const char *line = strstr( hs, "\r\n" ); line; line = strstr( line, "\r\n" )) {
+    line += 2;
+    if (strncasecmp( line, name, nlen ) == 0 && line[nlen] == ':') {
+      const char *v = line + nlen + 1;
+      while (*v == ' ' || *v == '\t')
+        v++;
+      const char *e = strstr( v, "\r\n" );
+      while (e > v && (e[-1] == ' ' || e[-1] == '\t'))
+        e--;
+      *len = e - v;
+      return v;
+    }
+  }
+  return NULL;
+}
+
+static void ws_push_self( lua_State *L, ws_conn *c )
+{
+  lua_rawgeti( L, LUA_REGISTRYINDEX, c->self_ref );
+}
+
+static void ws_send_frame( lua_State *L, ws_conn *c, uint8_t op, const void *data, size_t len )
+{
+  uint8_t hdr[14];
+  size_t n = 0;
+  uint8_t maskbit = c->client ? 0x80 : 0;
+  hdr[n++] = 0x80 | op;
+  if (len < 126) {
+    hdr[n++] = maskbit | len;
+  } else if (len <= 0xffff) {
+    hdr[n++] = maskbit | 126;
+    hdr[n++] = len >> 8;
+    hdr[n++] = len;
+  } else {
+    hdr[n++] = maskbit | 127;
+    memset( hdr + n, 0, 4 );
+    n += 4;
+    for (int s = 24; s >= 0; s -= 8)
+      hdr[n++] = len >> s;
+  }
+  if (c->client) {
+    uint32_t key = os_random();
+    memcpy( hdr + n, &key, 4 );
+    n += 4;
+  }
+  // One write, so a full send queue can't leave half a frame behind
+  uint8_t *frame = (uint8_t *)lua_newuserdata( L, n + len );
+  memcpy( frame, hdr, n );
+  if (c->client)
+    ws_mask( frame + n, data, len, hdr + n - 4, 0 );
+  else
+    memcpy( frame + n, data, len );
+  net_tcp_write( L, c->sock, (const char *)frame, n + len );
+  lua_pop( L, 1 );
+}
+
+// Done with the connection: stop taking the socket's data, close it if
+// asked to, and tell Lua
+static void ws_finish( lua_State *L, ws_conn *c, int code, const char *reason, size_t rlen, bool close_sock )
+{
+  if (c->state == WS_CLOSED)
+    return;
+  c->state = WS_CLOSED;
+  net_tcp_set_rx_hook( c->sock, NULL, NULL );
+  free( c->hs );
+  c->hs = NULL;
+  free( c->msg );
+  c->msg = NULL;
+  c->msg_len = c->msg_cap = 0;
+
+  if (close_sock) {
+    lua_rawgeti( L, LUA_REGISTRYINDEX, c->sock_ref );
+    lua_getfield( L, -1, "close" );
+    lua_insert( L, -2 );
+    lua_call( L, 1, 0 );
+  }
+  if (c->cb_close_ref != LUA_NOREF) {
+    lua_rawgeti( L, LUA_REGISTRYINDEX, c->cb_close_ref );
+    ws_push_self( L, c );
+    lua_pushinteger( L, code );
+    lua_pushlstring( L, reason, rlen );
+    lua_call( L, 3, 0 );
+  }
+  luaL_unref( L, LUA_REGISTRYINDEX, c->self_ref );
+  c->self_ref = LUA_NOREF;
+}
+
+// The peer broke the protocol: say why and hang up. Returns false.
+static bool ws_fail( lua_State *L, ws_conn *c, int code, const char *reason )
+{
+  size_t rlen = strlen( reason );
+  if (c->state == WS_OPEN) {
+    uint8_t buf[2 + 32];
+    buf[0] = code >> 8;
+    buf[1] = code;
+    memcpy( buf + 2, reason, rlen );
+    ws_send_frame( L, c, WS_OP_CLOSE, buf, 2 + rlen );
+  }
+  ws_finish( L, c, code, reason, rlen, true );
+  return false;
+}
+
+static void ws_opened( lua_State *L, ws_conn *c )
+{
+  if (c->cb_open_ref == LUA_NOREF)
+    return;   // ws:on("open") runs it when it comes
+  c->open_told = true;
+  lua_rawgeti( L, LUA_REGISTRYINDEX, c->cb_open_ref );
+  ws_push_self( L, c );
+  lua_call( L, 1, 0 );
+}
+
+static void ws_deliver( lua_State *L, ws_conn *c, uint8_t op, const char *data, size_t len )
+{
+  if (c->cb_message_ref == LUA_NOREF)
+    return;
+  lua_rawgeti( L, LUA_REGISTRYINDEX, c->cb_message_ref );
+  ws_push_self( L, c );
+  lua_pushlstring( L, data, len );
+  lua_pushboolean( L, op == WS_OP_BINARY );
+  lua_call( L, 3, 0 );
+}
+
+// Checks the request or response once it is all here. Servers answer it.
+static bool ws_handshake_done( lua_State *L, ws_conn *c )
+{
+  size_t len;
+  const char *v;
+  if (c->client) {
+    bool ok = strncmp( c->hs, "HTTP/1.1 101", 12 ) == 0 &&
+              (v = ws_header( c->hs, "Sec-WebSocket-Accept", &len )) &&
+              len == WS_ACCEPT_LEN && memcmp( v, c->accept, len ) == 0;
+    free( c->hs );
+    c->hs = NULL;
+    return ok;
+  }
+
+  char accept[WS_ACCEPT_LEN + 1];
+  bool ok = strncmp( c->hs, "GET ", 4 ) == 0 &&
+            (v = ws_header( c->hs, "Upgrade", &len )) &&
+            len == 9 && strncasecmp( v, "websocket", 9 ) == 0 &&
+            (v = ws_header( c->hs, "Sec-WebSocket-Key", &len )) &&
+            len <= WS_KEY_MAX;
+  if (ok)
+    ws_accept_key( v, len, accept );
+  free( c->hs );
+  c->hs = NULL;
+  if (!ok) {
+    net_tcp_write( L, c->sock, "HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n", 47 );
+    return false;
+  }
+  lua_pushfstring( L, "HTTP/1.1 101 Switching Protocols\r\n"
+                      "Upgrade: websocket\r\n"
+                      "Connection: Upgrade\r\n"
+                      "Sec-WebSocket-Accept: %s\r\n\r\n", accept );
+  net_tcp_write( L, c->sock, lua_tostring( L, -1 ), lua_strlen( L, -1 ) );
+  lua_pop( L, 1 );
+  return true;
+}
+
+// Takes handshake bytes up to the blank line ending it and returns how
+// many it used, or -1 if the handshake failed
+static int ws_handshake( lua_State *L, ws_conn *c, const char *data, size_t len )
+{
+  if (!c->hs && !(c->hs = (char *)malloc( WS_HANDSHAKE_MAX + 1 ))) {
+    ws_finish( L, c, 1006, "out of memory", 13, true );
+    return -1;
+  }
+  size_t old = c->hs_len;
+  size_t take = len < WS_HANDSHAKE_MAX - old ? len : WS_HANDSHAKE_MAX - old;
+  memcpy( c->hs + old, data, take );
+  c->hs_len += take;
+  c->hs[c->hs_len] = 0;
+
+  char *end = strstr( c->hs + (old > 3 ? old - 3 : 0), "\r\n\r\n" );
+  if (!end && c->hs_len < WS_HANDSHAKE_MAX)
+    return take;
+  size_t used = end ? end + 4 - c->hs - old : 0;
+  if (!end || !ws_handshake_done( L, c )) {
+    ws_finish( L, c, 1006, "handshake failed", 16, true );
+    return -1;
+  }
+  c->state = WS_OPEN;
+  ws_opened( L, c );
+  return used;
+}
+
+static size_t ws_header_size( const ws_conn *c )
+{
+  if (c->hdr_len < 2)
+    return 2;
+  uint8_t n = c->hdr[1] & 0x7f;
+  return 2 + (n == 126 ? 2 : n == 127 ? 8 : 0) + (c->hdr[1] & 0x80 ? 4 : 0);
+}
+
+static bool ws_frame_begin( lua_State *L, ws_conn *c )
+{
+  const uint8_t *q = c->hdr + 2;
+  uint64_t n = c->hdr[1] & 0x7f;
+  if (n == 126) {
+    n = q[0] << 8 | q[1];
+    q += 2;
+  } else if (n == 127) {
+    n = 0;
+    for (int i = 0; i < 8; i++)
+      n = n << 8 | q[i];
+    q += 8;
+  }
+  c->fin = c->hdr[0] & 0x80;
+  c->op = c->hdr[0] & 0x0f;
+  c->masked = c->hdr[1] & 0x80;
+  if (c->masked)
+    memcpy( c->mask, q, 4 );
+  c->off = 0;
+
+  if (c->hdr[0] & 0x70)
+    return ws_fail( L, c, 1002, "reserved bits set" );
+  if (c->masked == c->client)
+    return ws_fail( L, c, 1002, c->client ? "masked frame" : "unmasked frame" );
+  if (c->op >= 8) {
+    if (!c->fin || n > sizeof(c->ctrl) || c->op > WS_OP_PONG)
+      return ws_fail( L, c, 1002, "bad control frame" );
+    c->ctrl_len = 0;
+  } else {
+    if (c->op > WS_OP_BINARY)
+      return ws_fail( L, c, 1002, "bad opcode" );
+    if ((c->op == WS_OP_CONT) != (c->msg_op != 0))
+      return ws_fail( L, c, 1002, "bad fragment" );
+    if (c->op != WS_OP_CONT) {
+      c->msg_op = c->op;
+      c->msg_len = 0;
+    }
+    if (n > c->msg_max - c->msg_len)
+      return ws_fail( L, c, 1009, "message too big" );
+  }
+  c->remain = n;
+  return true;
+}
+
+// Takes k bytes of the payload, which may be changed in place
+static bool ws_payload( lua_State *L, ws_conn *c, uint8_t *p, size_t k )
+{
+  if (c->op >= 8) {
+    if (c->masked)
+      ws_mask( c->ctrl + c->ctrl_len, p, k, c->mask, c->off );
+    else
+      memcpy( c->ctrl + c->ctrl_len, p, k );
+    c->ctrl_len += k;
+  } else if (c->op != WS_OP_CONT && c->fin && c->off == 0 && k == c->remain) {
+    // The whole message is here: straight from lwIP's buffer to Lua
+    if (c->masked)
+      ws_mask( p, p, k, c->mask, 0 );
+    c->msg_op = 0;
+    ws_deliver( L, c, c->op, (const char *)p, k );
+  } else {
+    if (c->msg_len + c->remain > c->msg_cap) {
+      char *m = (char *)realloc( c->msg, c->msg_len + c->remain );
+      if (!m)
+        return ws_fail( L, c, 1011, "out of memory" );
+      c->msg = m;
+      c->msg_cap = c->msg_len + c->remain;
+    }
+    if (c->masked)
+      ws_mask( (uint8_t *)c->msg + c->msg_len, p, k, c->mask, c->off );
+    else
+      memcpy( c->msg + c->msg_len, p, k );
+    c->msg_len += k;
+  }
+  c->off += k;
+  c->remain -= k;
+  return true;
+}
+
+static void ws_frame_end( lua_State *L, ws_conn *c )
+{
+  c->hdr_len = 0;
+  switch (c->op) {
+  case WS_OP_PING:
+    if (c->state == WS_OPEN)
+      ws_send_frame( L, c, WS_OP_PONG, c->ctrl, c->ctrl_len );
+    break;
+  case WS_OP_PONG:
+    break;
+  case WS_OP_CLOSE: {
+    int code = c->ctrl_len >= 2 ? c->ctrl[0] << 8 | c->ctrl[1] : 1005;
+    size_t rlen = c->ctrl_len >= 2 ? c->ctrl_len - 2 : 0;
+    if (c->state == WS_OPEN)   // answer with the same code
+      ws_send_frame( L, c, WS_OP_CLOSE, c->ctrl, c->ctrl_len >= 2 ? 2 : 0 );
+    ws_finish( L, c, code, (const char *)c->ctrl + 2, rlen, true );
+    break;
+  }
+  default:
+    if (c->fin && c->msg_op) {
+      uint8_t op = c->msg_op;
+      c->msg_op = 0;
+      ws_deliver( L, c, op, c->msg, c->msg_len );
+    }
+    if (c->fin) {
+      // Only keep a buffer while a message is being put together
+      free( c->msg );
+      c->msg = NULL;
+      c->msg_len = c->msg_cap = 0;
+    }
+    break;
+  }
+}
+
+static void ws_input( lua_State *L, ws_conn *c, uint8_t *p, size_t len )
+{
+  while (len && c->state != WS_CLOSED) {
+    if (c->state == WS_HANDSHAKE) {
+      int n = ws_handshake( L, c, (const char *)p, len );
+      if (n < 0)
+        return;
+      p += n;
+      len -= n;
+      continue;
+    }
+    if (c->hdr_len < ws_header_size( c )) {
+      c->hdr[c->hdr_len++] = *p++;
+      len--;
+      if (c->hdr_len < ws_header_size( c ))
+        continue;
+      if (!ws_frame_begin( L, c ))
+        return;
+    } else {
+      size_t k = len < c->remain ? len : c->remain;
+      if (!ws_payload( L, c, p, k ))
+        return;
+      p += k;
+      len -= k;
+    }
+    if (c->remain == 0 && c->state != WS_CLOSED)
+      ws_frame_end( L, c );
+  }
+}
+
+static void ws_rx( lua_State *L, void *arg, char *data, size_t len )
+{
+  ws_conn *c = (ws_conn *)arg;
+  if (c->self_ref == LUA_NOREF)
+    return;
+  ws_push_self( L, c );   // keeps c while callbacks run
+  if (data)
+    ws_input( L, c, (uint8_t *)data, len );
+  else
+    ws_finish( L, c, 1006, "", 0, false );
+  lua_pop( L, 1 );
+}
+
+static ws_conn *ws_new( lua_State *L, bool client )
+{
+  void *sock = net_tcp_check( L, 1 );
+  ws_conn *c = (ws_conn *)lua_newuserdata( L, sizeof(ws_conn) );
+  memset( c, 0, sizeof(ws_conn) );
+  luaL_getmetatable( L, WS_OBJ );
+  lua_setmetatable( L, -2 );
+  c->sock = sock;
+  c->client = client;
+  c->state = WS_HANDSHAKE;
+  c->msg_max = WS_MAX_MESSAGE;
+  c->cb_open_ref = c->cb_message_ref = c->cb_close_ref = LUA_NOREF;
+  lua_pushvalue( L, 1 );
+  c->sock_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  lua_pushvalue( L, -1 );
+  c->self_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  net_tcp_set_rx_hook( sock, ws_rx, c );
+  return c;
+}
+
+// Lua: ws = websocket.server( socket[, request[, maxsize]] )
+// socket is one a net server accepted. request is what it has received
+// so far, if anything; the rest of the upgrade request is read here, and
+// the socket's own "receive" callback sees nothing from now on. maxsize
+// (16 KB by default) limits the messages taken.
+static int websocket_server( lua_State *L )
+{
+  size_t len = 0;
+  const char *req = lua_isnoneornil( L, 2 ) ? NULL : buffer_checklstring( L, 2, &len );
+  uint32_t max = luaL_optinteger( L, 3, WS_MAX_MESSAGE );
+  ws_conn *c = ws_new( L, false );
+  c->msg_max = max;
+  if (len) {
+    // Anything after the request has to be changeable, unlike the string
+    int n = ws_handshake( L, c, req, len );
+    if (n >= 0 && (size_t)n < len) {
+      uint8_t *rest = (uint8_t *)lua_newuserdata( L, len - n );
+      memcpy( rest, req + n, len - n );
+      ws_input( L, c, rest, len - n );
+      lua_pop( L, 1 );
+    }
+  }
+  return 1;
+}
+
+// Lua: ws = websocket.client( socket, host, path[, maxsize] )
+// Sends the upgrade request for path over the connected socket; the
+// "open" callback runs once the server has agreed.
+static int websocket_client( lua_State *L )
+{
+  const char *host = luaL_checkstring( L, 2 );
+  const char *path = luaL_checkstring( L, 3 );
+  uint32_t max = luaL_optinteger( L, 4, WS_MAX_MESSAGE );
+  ws_conn *c = ws_new( L, true );
+  c->msg_max = max;
+
+  uint32_t nonce[4];
+  char key[BASE64_ENCODE_SIZE(sizeof(nonce))];
+  for (int i = 0; i < 4; i++)
+    nonce[i] = os_random();
+  size_t klen = base64_encode( nonce, sizeof(nonce), key, 1 );
+  ws_accept_key( key, klen, c->accept );
+
+  lua_pushfstring( L, "GET %s HTTP/1.1\r\n"
+                      "Host: %s\r\n"
+                      "Upgrade: websocket\r\n"
+                      "Connection: Upgrade\r\n"
+                      "Sec-WebSocket-Key: %s\r\n"
+                      "Sec-WebSocket-Version: 13\r\n\r\n", path, host, key );
+  net_tcp_write( L, c->sock, lua_tostring( L, -1 ), lua_strlen( L, -1 ) );
+  lua_pop( L, 1 );
+  return 1;
+}
+
+// Lua: ws:on( "open" | "message" | "close", function )
+//   open: function( ws ), right away if the websocket already is
+//   message: function( ws, data, binary )
+//   close: function( ws, code, reason ), 1006 if the connection dropped
+static int websocket_on( lua_State *L )
+{
+  static const char * const events[] = { "open", "message", "close", NULL };
+  ws_conn *c = (ws_conn *)luaL_checkudata( L, 1, WS_OBJ );
+  int ev = luaL_checkoption( L, 2, NULL, events );
+  int *ref = ev == 0 ? &c->cb_open_ref : ev == 1 ? &c->cb_message_ref : &c->cb_close_ref;
+  luaL_unref( L, LUA_REGISTRYINDEX, *ref );
+  *ref = LUA_NOREF;
+  if (!lua_isnoneornil( L, 3 )) {
+    luaL_checkanyfunction( L, 3 );
+    lua_pushvalue( L, 3 );
+    *ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  if (ev == 0 && c->state == WS_OPEN && !c->open_told)
+    ws_opened( L, c );
+  return 0;
+}
+
+static ws_conn *ws_check_open( lua_State *L )
+{
+  ws_conn *c = (ws_conn *)luaL_checkudata( L, 1, WS_OBJ );
+  if (c->state != WS_OPEN)
+    luaL_error( L, "not open" );
+  return c;
+}
+
+// Lua: ws:send( data[, binary] )
+static int websocket_send( lua_State *L )
+{
+  ws_conn *c = ws_check_open( L );
+  size_t len;
+  const char *data = buffer_checklstring( L, 2, &len );
+  ws_send_frame( L, c, lua_toboolean( L, 3 ) ? WS_OP_BINARY : WS_OP_TEXT, data, len );
+  return 0;
+}
+
+// Lua: ws:ping( [data] )
+// Pongs aren't reported; pings from the peer are answered here.
+static int websocket_ping( lua_State *L )
+{
+  ws_conn *c = ws_check_open( L );
+  size_t len = 0;
+  const char *data = luaL_optlstring( L, 2, "", &len );
+  luaL_argcheck( L, len <= 125, 2, "too long" );
+  ws_send_frame( L, c, WS_OP_PING, data, len );
+  return 0;
+}
+
+// Lua: ws:close( [code[, reason]] )
+// Starts the closing handshake, 1000 by default; the socket is closed and
+// the "close" callback runs when the peer answers.
+static int websocket_close( lua_State *L )
+{
+  ws_conn *c = (ws_conn *)luaL_checkudata( L, 1, WS_OBJ );
+  int code = luaL_optinteger( L, 2, 1000 );
+  size_t rlen = 0;
+  const char *reason = luaL_optlstring( L, 3, "", &rlen );
+  luaL_argcheck( L, rlen <= 123, 3, "too long" );
+  if (c->state == WS_HANDSHAKE) {
+    ws_finish( L, c, 1006, "", 0, true );
+  } else if (c->state == WS_OPEN) {
+    uint8_t buf[125];
+    buf[0] = code >> 8;
+    buf[1] = code;
+    memcpy( buf + 2, reason, rlen );
+    ws_send_frame( L, c, WS_OP_CLOSE, buf, 2 + rlen );
+    c->state = WS_CLOSING;
+  }
+  return 0;
+}
+
+// Lua: socket = ws:socket()
+static int websocket_socket( lua_State *L )
+{
+  ws_conn *c = (ws_conn *)luaL_checkudata( L, 1, WS_OBJ );
+  lua_rawgeti( L, LUA_REGISTRYINDEX, c->sock_ref );
+  return 1;
+}
+
+static int websocket_gc( lua_State *L )
+{
+  ws_conn *c = (ws_conn *)luaL_checkudata( L, 1, WS_OBJ );
+  if (c->state != WS_CLOSED)
+    net_tcp_set_rx_hook( c->sock, NULL, NULL );
+  free( c->hs );
+  free( c->msg );
+  luaL_unref( L, LUA_REGISTRYINDEX, c->cb_open_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, c->cb_message_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, c->cb_close_ref );
+  luaL_unref( L, LUA_REGISTRYINDEX, c->sock_ref );
+  return 0;
+}
+
+static const LUA_REG_TYPE websocket_ws_map[] = {
+  { LSTRKEY( "on" ),       LFUNCVAL( websocket_on ) },
+  { LSTRKEY( "send" ),     LFUNCVAL( websocket_send ) },
+  { LSTRKEY( "ping" ),     LFUNCVAL( websocket_ping ) },
+  { LSTRKEY( "close" ),    LFUNCVAL( websocket_close ) },
+  { LSTRKEY( "socket" ),   LFUNCVAL( websocket_socket ) },
+  { LSTRKEY( "__gc" ),     LFUNCVAL( websocket_gc ) },
+  { LSTRKEY( "__index" ),  LROVAL( websocket_ws_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+// Module function map
+const LUA_REG_TYPE websocket_map[] = {
+  { LSTRKEY( "server" ),  LFUNCVAL( websocket_server ) },
+  { LSTRKEY( "client" ),  LFUNCVAL( websocket_client ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_websocket( lua_State *L )
+{
+  luaL_rometatable( L, WS_OBJ, (void *)websocket_ws_map );
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_WEBSOCKETLIBNAME, websocket_map );
+  return 1;
+#endif
+}
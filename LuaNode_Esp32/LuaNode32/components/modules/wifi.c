@@ -24,6 +24,12 @@
 //#include "smartconfig.h"
 #include "c_stdio.h"
 #include "ip_fmt.h"
+#include "esp_attr.h"
+#include "tcpip_adapter.h"
+#include "lwip/dns.h"
+#include "sdkconfig.h"
+#include "task/task.h"
+#include "freertos/FreeRTOS.h"
 
 struct ip_addr {
     uint32 addr;
@@ -88,6 +94,7 @@ static uint8 prev_wifi_status=0;
 
 // Forward declarations
 static void on_event (const system_event_t *evt);
+static void scan_done (const system_event_t *evt);
 
 static void sta_conn (lua_State *L, const system_event_t *evt);
 static void sta_disconn (lua_State *L, const system_event_t *evt);
@@ -119,6 +126,7 @@ static const event_desc_t events[] =
 static int event_cb[ARRAY_LEN(events)];
 
 nodemcu_esp_event_reg_t esp_event_cb_table[] = {
+  {SYSTEM_EVENT_SCAN_DONE,           scan_done},
   {SYSTEM_EVENT_STA_START,           on_event},
   {SYSTEM_EVENT_STA_STOP,            on_event},
   {SYSTEM_EVENT_STA_CONNECTED,       on_event},
@@ -155,6 +163,140 @@ bool luaL_optbool (lua_State *L, int idx, bool def)
 static lua_State* gL = NULL;
 static int scan_cb_ref = LUA_NOREF;
 
+// A wifi.sta.scan() in progress. Records are filtered here, so Lua only
+// gets tables for the APs it asked for. A set of channels takes one
+// driver scan per channel, skipping the rest of the band.
+#define SCAN_ALL_DONE 0xff
+
+static struct
+{
+  bool stream;            // each AP to the callback as it is found
+  int list_ref;           // otherwise collected here
+  int n;
+  int8_t min_rssi;
+  uint8_t prefix_len;
+  char prefix[32];
+  char ssid[33];
+  uint8_t bssid[6];
+  bool ssid_set, bssid_set, hidden;
+  uint16_t channels;      // bit per channel 1-14, 0 for one scan of them all
+  uint8_t channel;        // being scanned, SCAN_ALL_DONE after the last
+} scan_state = { .list_ref = LUA_NOREF };
+
+// Fast reconnect. The AP and DHCP lease of the last connection are kept
+// in RTC memory, which deep sleep retains, and the next connect to the
+// same SSID takes the lease as a static IP: the IDF reports the address
+// as soon as the station associates, without a DHCP exchange. The channel
+// is handed to the driver as a hint. A lease is reused at most
+// CONFIG_WIFI_FAST_RECONNECT times before DHCP is asked again, and is
+// dropped if the connect fails or lands on a different AP.
+#define WIFI_FAST_MAGIC 0x46535457
+
+typedef struct
+{
+  uint32_t magic;         // set once the lease below belongs to the AP
+  char ssid[32];
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint8_t uses;           // connects on this lease since DHCP gave it
+  tcpip_adapter_ip_info_t ip;
+  ip_addr_t dns;
+} wifi_fast_t;
+
+static RTC_DATA_ATTR wifi_fast_t wifi_fast;
+
+static enum {
+  FAST_OFF,               // DHCP as usual
+  FAST_TRYING,            // connecting on the cached lease
+  FAST_ON,                // connected on it
+  FAST_ABORTED            // wrong AP, DHCP is running again
+} wifi_fast_state;
+
+// Before a connect to ssid
+static void wifi_fast_begin (const char *ssid)
+{
+  wifi_fast_state = FAST_OFF;
+#if CONFIG_WIFI_FAST_RECONNECT > 0
+  if (wifi_fast.magic == WIFI_FAST_MAGIC &&
+      wifi_fast.uses < CONFIG_WIFI_FAST_RECONNECT &&
+      strncmp (wifi_fast.ssid, ssid, sizeof (wifi_fast.ssid)) == 0)
+  {
+    tcpip_adapter_dhcpc_stop (TCPIP_ADAPTER_IF_STA);
+    if (tcpip_adapter_set_ip_info (TCPIP_ADAPTER_IF_STA, &wifi_fast.ip) == ESP_OK)
+    {
+      esp_wifi_set_channel (wifi_fast.channel, WIFI_SECOND_CHAN_NONE);
+      dns_setserver (0, &wifi_fast.dns);
+      wifi_fast.uses++;
+      wifi_fast_state = FAST_TRYING;
+      return;
+    }
+    wifi_fast.magic = 0;
+  }
+#endif
+  // the last connect may have left DHCP stopped
+  tcpip_adapter_dhcpc_start (TCPIP_ADAPTER_IF_STA);
+}
+
+// Runs on each station event ahead of the Lua callbacks; false drops the
+// event, for a GOT_IP of a lease that turned out stale
+static bool wifi_fast_event (const system_event_t *evt)
+{
+  switch (evt->event_id)
+  {
+    case SYSTEM_EVENT_STA_CONNECTED:
+    {
+      const system_event_sta_connected_t *c = &evt->event_info.connected;
+      if (wifi_fast_state == FAST_TRYING &&
+          memcmp (c->bssid, wifi_fast.bssid, sizeof (c->bssid)) != 0)
+      {
+        wifi_fast.magic = 0;
+        wifi_fast_state = FAST_ABORTED;
+        tcpip_adapter_dhcpc_start (TCPIP_ADAPTER_IF_STA);
+      }
+      if (wifi_fast_state != FAST_TRYING)
+      {
+        // remembered now, valid once DHCP has given an address
+        size_t len = c->ssid_len < sizeof (wifi_fast.ssid) ? c->ssid_len : sizeof (wifi_fast.ssid);
+        wifi_fast.magic = 0;
+        memset (wifi_fast.ssid, 0, sizeof (wifi_fast.ssid));
+        memcpy (wifi_fast.ssid, c->ssid, len);
+        memcpy (wifi_fast.bssid, c->bssid, sizeof (wifi_fast.bssid));
+      }
+      wifi_fast.channel = c->channel;
+      return true;
+    }
+    case SYSTEM_EVENT_STA_GOT_IP:
+      if (wifi_fast_state == FAST_TRYING)
+      {
+        wifi_fast_state = FAST_ON;
+        return true;
+      }
+      if (wifi_fast_state == FAST_ABORTED)
+      {
+        // the IDF queued this one on associating, ahead of DHCP's
+        wifi_fast_state = FAST_OFF;
+        return false;
+      }
+      wifi_fast_state = FAST_OFF;
+      wifi_fast.ip = evt->event_info.got_ip.ip_info;
+      wifi_fast.dns = dns_getserver (0);
+      wifi_fast.uses = 0;
+      wifi_fast.magic = WIFI_FAST_MAGIC;
+      return true;
+    case SYSTEM_EVENT_STA_DISCONNECTED:
+      if (wifi_fast_state == FAST_TRYING)
+      {
+        // never got on with it; the next connect does it the long way
+        wifi_fast.magic = 0;
+        tcpip_adapter_dhcpc_start (TCPIP_ADAPTER_IF_STA);
+      }
+      wifi_fast_state = FAST_OFF;
+      return true;
+    default:
+      return true;
+  }
+}
+
 // Lua: realmode = getmode()
 
 static int wifi_getmode( lua_State* L )
@@ -242,6 +384,9 @@ static void sta_got_ip (lua_State *L, const system_event_t *evt)
   ip4str (ipstr, &evt->event_info.got_ip.ip_info.gw);
   lua_pushstring (L, ipstr);
   lua_setfield (L, -2, "gw");
+
+  lua_pushboolean (L, wifi_fast_state == FAST_ON);
+  lua_setfield (L, -2, "cached");
 }
 
 static void ap_staconn (lua_State *L, const system_event_t *evt)
@@ -279,6 +424,8 @@ static void ap_probe_req (lua_State *L, const system_event_t *evt)
 
 static void on_event (const system_event_t *evt)
 {
+  if (!wifi_fast_event (evt))
+    return;
   int idx = event_idx_by_id (evt->event_id);
   if (idx < 0 || event_cb[idx] == LUA_NOREF)
     return;
@@ -348,6 +495,24 @@ static int wifi_stop (lua_State *L)
 }
 
 
+static bool parse_bssid (const char *str, uint8_t *bssid)
+{
+  const char *fmts[] = {
+    "%hhx%hhx%hhx%hhx%hhx%hhx",
+    "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+    "%hhx-%hhx-%hhx-%hhx-%hhx-%hhx",
+    "%hhx %hhx %hhx %hhx %hhx %hhx",
+    NULL
+  };
+  for (unsigned i = 0; fmts[i]; ++i)
+  {
+    if (sscanf (str, fmts[i],
+      &bssid[0], &bssid[1], &bssid[2], &bssid[3], &bssid[4], &bssid[5]) == 6)
+      return true;
+  }
+  return false;
+}
+
 static int wifi_sta_config (lua_State *L)
 {
   luaL_checkanytable (L, 1);
@@ -375,23 +540,7 @@ static int wifi_sta_config (lua_State *L)
   if (lua_isstring (L, -1))
   {
     const char *bssid = luaL_checklstring (L, -1, &len);
-    const char *fmts[] = {
-      "%hhx%hhx%hhx%hhx%hhx%hhx",
-      "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
-      "%hhx-%hhx-%hhx-%hhx-%hhx-%hhx",
-      "%hhx %hhx %hhx %hhx %hhx %hhx",
-      NULL
-    };
-    for (unsigned i = 0; fmts[i]; ++i)
-    {
-      if (sscanf (bssid, fmts[i],
-        &cfg.sta.bssid[0], &cfg.sta.bssid[1], &cfg.sta.bssid[2],
-        &cfg.sta.bssid[3], &cfg.sta.bssid[4], &cfg.sta.bssid[5]) == 6)
-      {
-        cfg.sta.bssid_set = true;
-        break;
-      }
-    }
+    cfg.sta.bssid_set = parse_bssid (bssid, cfg.sta.bssid);
     if (!cfg.sta.bssid_set)
       return luaL_error (L, "invalid BSSID: %s", bssid);
   }
@@ -405,7 +554,10 @@ static int wifi_sta_config (lua_State *L)
     return luaL_error (L, "failed to set wifi config, code %d", err);
 
   if (auto_conn)
+  {
+    wifi_fast_begin (cfg.sta.ssid);
     err = esp_wifi_connect ();
+  }
   if (err != ESP_OK)
     return luaL_error (L, "failed to begin connect, code %d", err);
 
@@ -416,6 +568,9 @@ static int wifi_sta_config (lua_State *L)
 
 static int wifi_sta_connect (lua_State *L)
 {
+  wifi_config_t cfg;
+  if (esp_wifi_get_config (WIFI_IF_STA, &cfg) == ESP_OK)
+    wifi_fast_begin (cfg.sta.ssid);
   esp_err_t err = esp_wifi_connect ();
   return (err == ESP_OK) ? 0 : luaL_error (L, "connect failed, code %d", err);
 }
@@ -462,27 +617,263 @@ static int wifi_sta_getconfig (lua_State *L)
   return 1;
 }
 
+// Lua: info = wifi.sta.fastcache()
+// The AP and lease the next connect would reuse, nil if none.
+// Lua: wifi.sta.fastcache( false ) forgets them.
+static int wifi_sta_fastcache (lua_State *L)
+{
+  if (lua_isboolean (L, 1) && !lua_toboolean (L, 1))
+  {
+    wifi_fast.magic = 0;
+    return 0;
+  }
+  if (wifi_fast.magic != WIFI_FAST_MAGIC)
+  {
+    lua_pushnil (L);
+    return 1;
+  }
+
+  lua_createtable (L, 0, 8);
+  lua_pushlstring (L, wifi_fast.ssid, strnlen (wifi_fast.ssid, sizeof (wifi_fast.ssid)));
+  lua_setfield (L, -2, "ssid");
+
+  char str[IP_STR_SZ];
+  macstr (str, wifi_fast.bssid);
+  lua_pushstring (L, str);
+  lua_setfield (L, -2, "bssid");
+
+  lua_pushinteger (L, wifi_fast.channel);
+  lua_setfield (L, -2, "channel");
+
+  ip4str (str, &wifi_fast.ip.ip);
+  lua_pushstring (L, str);
+  lua_setfield (L, -2, "ip");
+
+  ip4str (str, &wifi_fast.ip.netmask);
+  lua_pushstring (L, str);
+  lua_setfield (L, -2, "netmask");
+
+  ip4str (str, &wifi_fast.ip.gw);
+  lua_pushstring (L, str);
+  lua_setfield (L, -2, "gw");
+
+  ipstr (str, &wifi_fast.dns);
+  lua_pushstring (L, str);
+  lua_setfield (L, -2, "dns");
+
+  lua_pushinteger (L, wifi_fast.uses);
+  lua_setfield (L, -2, "uses");
+  return 1;
+}
+
+// Starts the driver on the next channel of the set; ESP_ERR_NOT_FOUND
+// once they have all been scanned
+static esp_err_t scan_next (void)
+{
+  wifi_scan_config_t cfg;
+  memset (&cfg, 0, sizeof (cfg));
+  if (scan_state.channel == SCAN_ALL_DONE)
+    return ESP_ERR_NOT_FOUND;
+  if (scan_state.channels)
+  {
+    uint8_t ch = scan_state.channel + 1;
+    while (ch <= 14 && !(scan_state.channels & (1 << ch)))
+      ch++;
+    if (ch > 14)
+      return ESP_ERR_NOT_FOUND;
+    scan_state.channel = cfg.channel = ch;
+  }
+  else
+    scan_state.channel = SCAN_ALL_DONE;
+
+  cfg.ssid = scan_state.ssid_set ? scan_state.ssid : NULL;
+  cfg.bssid = scan_state.bssid_set ? scan_state.bssid : NULL;
+  cfg.show_hidden = scan_state.hidden;
+  return esp_wifi_scan_start (&cfg, false);
+}
+
+static bool scan_match (const wifi_ap_record_t *ap)
+{
+  if (ap->rssi < scan_state.min_rssi)
+    return false;
+  if (scan_state.channels && !(scan_state.channels & (1 << ap->primary)))
+    return false;
+  return strncmp ((const char *)ap->ssid, scan_state.prefix, scan_state.prefix_len) == 0;
+}
+
+static void push_ap (lua_State *L, const wifi_ap_record_t *ap)
+{
+  lua_createtable (L, 0, 5);
+  lua_pushlstring (L, (const char *)ap->ssid, strnlen ((const char *)ap->ssid, sizeof (ap->ssid)));
+  lua_setfield (L, -2, "ssid");
+
+  char bssid_str[MAC_STR_SZ];
+  macstr (bssid_str, ap->bssid);
+  lua_pushstring (L, bssid_str);
+  lua_setfield (L, -2, "bssid");
+
+  lua_pushinteger (L, ap->primary);
+  lua_setfield (L, -2, "channel");
+
+  lua_pushinteger (L, ap->rssi);
+  lua_setfield (L, -2, "rssi");
+
+  lua_pushinteger (L, ap->authmode);
+  lua_setfield (L, -2, "auth");
+}
+
+// The driver's records of one scan, to Lua, then on to the next channel
+// or the end of the scan
+static void scan_done (const system_event_t *evt)
+{
+  if (scan_cb_ref == LUA_NOREF)
+    return;
+
+  lua_State *L = lua_getstate ();
+  uint16_t n = 0;
+  esp_wifi_scan_get_ap_num (&n);
+  // a userdata, so a callback raising an error doesn't leak it
+  wifi_ap_record_t *aps = n ? lua_newuserdata (L, n * sizeof (wifi_ap_record_t)) : NULL;
+  if (!aps || esp_wifi_scan_get_ap_records (&n, aps) != ESP_OK)
+    n = 0;
+  for (unsigned i = 0; i < n; ++i)
+  {
+    if (!scan_match (&aps[i]))
+      continue;
+    if (scan_state.stream)
+    {
+      lua_rawgeti (L, LUA_REGISTRYINDEX, scan_cb_ref);
+      push_ap (L, &aps[i]);
+      lua_call (L, 1, 0);
+    }
+    else
+    {
+      lua_rawgeti (L, LUA_REGISTRYINDEX, scan_state.list_ref);
+      push_ap (L, &aps[i]);
+      lua_rawseti (L, -2, ++scan_state.n);
+      lua_pop (L, 1);
+    }
+  }
+  if (aps)
+    lua_pop (L, 1);
+
+  if (scan_next () == ESP_OK)
+    return;
+
+  // done: the callback gets the list, or nil after the last AP streamed
+  int cb_ref = scan_cb_ref, list_ref = scan_state.list_ref;
+  scan_cb_ref = scan_state.list_ref = LUA_NOREF;
+  lua_rawgeti (L, LUA_REGISTRYINDEX, cb_ref);
+  luaL_unref (L, LUA_REGISTRYINDEX, cb_ref);
+  if (scan_state.stream)
+    lua_pushnil (L);
+  else
+  {
+    lua_rawgeti (L, LUA_REGISTRYINDEX, list_ref);
+    luaL_unref (L, LUA_REGISTRYINDEX, list_ref);
+  }
+  lua_call (L, 1, 0);
+}
+
+static uint16_t scan_channel_bit (lua_State *L, int idx)
+{
+  int ch = luaL_checkinteger (L, idx);
+  if (ch < 1 || ch > 14)
+    luaL_error (L, "invalid channel %d", ch);
+  return 1 << ch;
+}
+
+// Lua: wifi.sta.scan( { ssid=, bssid=, channel=, channels={...}, hidden=false,
+//                       rssi=-127, prefix=, stream=false }, function(aps) )
+// ssid and bssid only look for that AP. channels scans just those, one at
+// a time. APs weaker than rssi dBm, or whose SSID doesn't start with
+// prefix, are dropped before Lua sees them. The callback gets an array of
+// { ssid, bssid, channel, rssi, auth } once the scan is over; with stream
+// set it is called with each AP instead, and with nil at the end.
 static int wifi_sta_scan (lua_State *L)
 {
   if (scan_cb_ref != LUA_NOREF)
     return luaL_error (L, "scan already in progress");
 
   luaL_checkanytable (L, 1);
+  luaL_checkanyfunction (L, 2);
+  lua_settop (L, 2);
 
-  wifi_scan_config_t scan_cfg;
-  memset (&scan_cfg, 0, sizeof (scan_cfg));
+  memset (&scan_state, 0, sizeof (scan_state));
+  size_t len;
 
-  // TODO: support ssid/bssid/channel/hidden features of wifi_scan_config_t
+  lua_getfield (L, 1, "ssid");
+  if (!lua_isnil (L, -1))
+  {
+    const char *str = luaL_checklstring (L, -1, &len);
+    if (len >= sizeof (scan_state.ssid))
+      return luaL_error (L, "ssid too long");
+    memcpy (scan_state.ssid, str, len);
+    scan_state.ssid_set = true;
+  }
+
+  lua_getfield (L, 1, "bssid");
+  if (!lua_isnil (L, -1))
+  {
+    const char *str = luaL_checkstring (L, -1);
+    if (!parse_bssid (str, scan_state.bssid))
+      return luaL_error (L, "invalid BSSID: %s", str);
+    scan_state.bssid_set = true;
+  }
+
+  lua_getfield (L, 1, "channel");
+  if (!lua_isnil (L, -1))
+    scan_state.channels |= scan_channel_bit (L, -1);
+
+  lua_getfield (L, 1, "channels");
+  if (!lua_isnil (L, -1))
+  {
+    luaL_checkanytable (L, -1);
+    for (int i = 1; ; ++i)
+    {
+      lua_rawgeti (L, -1, i);
+      if (lua_isnil (L, -1))
+        break;
+      scan_state.channels |= scan_channel_bit (L, -1);
+      lua_pop (L, 1);
+    }
+  }
+
+  lua_getfield (L, 1, "prefix");
+  if (!lua_isnil (L, -1))
+  {
+    const char *str = luaL_checklstring (L, -1, &len);
+    if (len > sizeof (scan_state.prefix))
+      return luaL_error (L, "prefix too long");
+    memcpy (scan_state.prefix, str, len);
+    scan_state.prefix_len = len;
+  }
+
+  lua_getfield (L, 1, "rssi");
+  int rssi = luaL_optint (L, -1, -127);
+  scan_state.min_rssi = rssi < -127 ? -127 : rssi > 0 ? 0 : rssi;
+
+  lua_getfield (L, 1, "hidden");
+  scan_state.hidden = luaL_optbool (L, -1, false);
+
+  lua_getfield (L, 1, "stream");
+  scan_state.stream = luaL_optbool (L, -1, false);
 
-  luaL_checkanyfunction (L, 2);
   lua_settop (L, 2);
   scan_cb_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+  scan_state.list_ref = LUA_NOREF;
+  if (!scan_state.stream)
+  {
+    lua_newtable (L);
+    scan_state.list_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+  }
 
-  esp_err_t err = esp_wifi_scan_start (&scan_cfg, false);
+  esp_err_t err = scan_next ();
   if (err != ESP_OK)
   {
     luaL_unref (L, LUA_REGISTRYINDEX, scan_cb_ref);
-    scan_cb_ref = LUA_NOREF;
+    luaL_unref (L, LUA_REGISTRYINDEX, scan_state.list_ref);
+    scan_cb_ref = scan_state.list_ref = LUA_NOREF;
     return luaL_error (L, "failed to start scan, code %d", err);
   }
   else
@@ -546,6 +937,435 @@ static int wifi_init (lua_State *L)
     0 : luaL_error (L, "failed to init wifi, code %d", err);
 }
 
+// Sniffing. The promiscuous callback runs in the WiFi task at whatever
+// rate frames arrive; it filters each one here and only adds it to the
+// counters and, if asked, a ring of the latest frames. Every interval a
+// timer has the Lua task swap in a fresh set and hand the full one to Lua
+// as a single summary.
+#define SNIFF_MACS        32      // transmitters counted one by one
+#define SNIFF_RING_MAX    64
+#define SNIFF_SNAP_MAX    128     // bytes of a frame kept in the ring
+#define SNIFF_MIN_MS      100
+
+enum { SNIFF_MGMT, SNIFF_CTRL, SNIFF_DATA, SNIFF_TYPES };
+static const char *const sniff_type_names[SNIFF_TYPES] = { "mgmt", "ctrl", "data" };
+
+// What the driver puts ahead of each frame
+typedef struct
+{
+  signed rssi:8;
+  unsigned rate:5;
+  unsigned :1;
+  unsigned sig_mode:2;
+  unsigned :16;
+  unsigned mcs:7;
+  unsigned cwb:1;
+  unsigned :16;
+  unsigned smoothing:1;
+  unsigned not_sounding:1;
+  unsigned :1;
+  unsigned aggregation:1;
+  unsigned stbc:2;
+  unsigned fec_coding:1;
+  unsigned sgi:1;
+  unsigned noise_floor:8;
+  unsigned ampdu_cnt:8;
+  unsigned channel:4;
+  unsigned :12;
+  unsigned timestamp:32;
+  unsigned :32;
+  unsigned :32;
+  unsigned sig_len:12;    // of the frame, FCS included
+  unsigned :12;
+  unsigned rx_state:8;
+} sniff_rx_ctrl_t;
+
+typedef struct
+{
+  uint8_t mac[6];
+  int8_t rssi;            // of the latest frame
+  uint32_t frames;
+} sniff_mac_t;
+
+typedef struct
+{
+  int8_t rssi;
+  uint8_t channel;
+  uint16_t len;
+  uint8_t snap_len;
+  uint8_t data[SNIFF_SNAP_MAX];
+} sniff_frame_t;
+
+typedef struct
+{
+  uint32_t seen, frames, bytes;
+  uint32_t types[SNIFF_TYPES];
+  int32_t rssi_sum;
+  int8_t rssi_min, rssi_max;
+  uint16_t nmacs;
+  uint32_t other_macs;    // frames from transmitters past SNIFF_MACS
+  sniff_mac_t macs[SNIFF_MACS];
+  uint16_t nring, ring_head;
+  uint32_t ring_lost;     // overwritten before Lua got them
+  sniff_frame_t *ring;
+} sniff_stats_t;
+
+static struct
+{
+  bool on;
+  uint8_t types;          // bit per frame type
+  uint16_t subtypes;      // bit per subtype
+  bool mac_set;
+  uint8_t mac[6];         // as any of the addresses
+  int8_t min_rssi;
+  uint8_t snap;
+  uint16_t ring;
+  sniff_stats_t *cur, *out;
+  int cb_ref;
+  bool posted;
+} sniff = { .cb_ref = LUA_NOREF };
+
+static portMUX_TYPE sniff_mux = portMUX_INITIALIZER_UNLOCKED;
+static os_timer_t sniff_timer;
+static task_handle_t sniff_task;
+
+static void sniff_reset (sniff_stats_t *st)
+{
+  sniff_frame_t *ring = st->ring;
+  memset (st, 0, sizeof (*st));
+  st->ring = ring;
+  st->rssi_min = 127;
+  st->rssi_max = -128;
+}
+
+static void sniff_count_mac (sniff_stats_t *st, const uint8_t *mac, int8_t rssi)
+{
+  for (unsigned i = 0; i < st->nmacs; ++i)
+  {
+    if (memcmp (st->macs[i].mac, mac, 6) == 0)
+    {
+      st->macs[i].frames++;
+      st->macs[i].rssi = rssi;
+      return;
+    }
+  }
+  if (st->nmacs == SNIFF_MACS)
+  {
+    st->other_macs++;
+    return;
+  }
+  sniff_mac_t *m = &st->macs[st->nmacs++];
+  memcpy (m->mac, mac, 6);
+  m->rssi = rssi;
+  m->frames = 1;
+}
+
+// WiFi task
+static void sniff_rx (void *buf, uint16_t len)
+{
+  if (len < sizeof (sniff_rx_ctrl_t) + 10)
+    return;
+  const sniff_rx_ctrl_t *rx = (const sniff_rx_ctrl_t *)buf;
+  const uint8_t *f = (const uint8_t *)buf + sizeof (sniff_rx_ctrl_t);
+  size_t flen = len - sizeof (sniff_rx_ctrl_t);
+  if (rx->sig_len && rx->sig_len < flen)
+    flen = rx->sig_len;
+  unsigned type = (f[0] >> 2) & 3, subtype = f[0] >> 4;
+  // control frames may only have the receiver's address
+  const uint8_t *addr2 = flen >= 16 ? f + 10 : NULL;
+  const uint8_t *addr3 = flen >= 22 ? f + 16 : NULL;
+
+  portENTER_CRITICAL (&sniff_mux);
+  sniff_stats_t *st = sniff.cur;
+  if (!sniff.on)
+    goto out;
+  st->seen++;
+  if (type >= SNIFF_TYPES || !(sniff.types & (1 << type)) ||
+      !(sniff.subtypes & (1 << subtype)) || rx->rssi < sniff.min_rssi)
+    goto out;
+  if (sniff.mac_set && memcmp (f + 4, sniff.mac, 6) != 0 &&
+      !(addr2 && memcmp (addr2, sniff.mac, 6) == 0) &&
+      !(addr3 && memcmp (addr3, sniff.mac, 6) == 0))
+    goto out;
+
+  st->frames++;
+  st->bytes += flen;
+  st->types[type]++;
+  st->rssi_sum += rx->rssi;
+  if (rx->rssi < st->rssi_min)
+    st->rssi_min = rx->rssi;
+  if (rx->rssi > st->rssi_max)
+    st->rssi_max = rx->rssi;
+  if (addr2)
+    sniff_count_mac (st, addr2, rx->rssi);
+  if (sniff.ring)
+  {
+    sniff_frame_t *fr = &st->ring[st->ring_head];
+    st->ring_head = (st->ring_head + 1) % sniff.ring;
+    if (st->nring < sniff.ring)
+      st->nring++;
+    else
+      st->ring_lost++;
+    fr->rssi = rx->rssi;
+    fr->channel = rx->channel;
+    fr->len = flen;
+    fr->snap_len = flen < sniff.snap ? flen : sniff.snap;
+    memcpy (fr->data, f, fr->snap_len);
+  }
+out:
+  portEXIT_CRITICAL (&sniff_mux);
+}
+
+static void sniff_tick (void *arg)
+{
+  (void)arg;
+  if (!sniff.posted)
+  {
+    sniff.posted = true;
+    if (!task_post_low (sniff_task, 0))
+      sniff.posted = false;
+  }
+}
+
+// Lua task: swap the stats and hand the full set to Lua
+static void sniff_deliver (task_param_t param, task_prio_t prio)
+{
+  (void)param; (void)prio;
+  sniff.posted = false;
+  if (!sniff.on)
+    return;
+
+  sniff_stats_t *st = sniff.out;
+  sniff_reset (st);
+  portENTER_CRITICAL (&sniff_mux);
+  sniff.out = sniff.cur;
+  sniff.cur = st;
+  portEXIT_CRITICAL (&sniff_mux);
+  st = sniff.out;
+
+  lua_State *L = lua_getstate ();
+  lua_rawgeti (L, LUA_REGISTRYINDEX, sniff.cb_ref);
+  lua_createtable (L, 0, 10);
+  lua_pushinteger (L, st->seen);
+  lua_setfield (L, -2, "seen");
+  lua_pushinteger (L, st->frames);
+  lua_setfield (L, -2, "frames");
+  lua_pushinteger (L, st->bytes);
+  lua_setfield (L, -2, "bytes");
+  for (unsigned i = 0; i < SNIFF_TYPES; ++i)
+  {
+    lua_pushinteger (L, st->types[i]);
+    lua_setfield (L, -2, sniff_type_names[i]);
+  }
+  if (st->frames)
+  {
+    lua_pushinteger (L, st->rssi_sum / (int32_t)st->frames);
+    lua_setfield (L, -2, "rssi");
+    lua_pushinteger (L, st->rssi_min);
+    lua_setfield (L, -2, "rssi_min");
+    lua_pushinteger (L, st->rssi_max);
+    lua_setfield (L, -2, "rssi_max");
+  }
+
+  char mac[MAC_STR_SZ];
+  lua_createtable (L, 0, st->nmacs);
+  for (unsigned i = 0; i < st->nmacs; ++i)
+  {
+    macstr (mac, st->macs[i].mac);
+    lua_createtable (L, 0, 2);
+    lua_pushinteger (L, st->macs[i].frames);
+    lua_setfield (L, -2, "frames");
+    lua_pushinteger (L, st->macs[i].rssi);
+    lua_setfield (L, -2, "rssi");
+    lua_setfield (L, -2, mac);
+  }
+  lua_setfield (L, -2, "macs");
+  lua_pushinteger (L, st->other_macs);
+  lua_setfield (L, -2, "other_macs");
+
+  if (sniff.ring)
+  {
+    lua_createtable (L, st->nring, 0);
+    // oldest first
+    unsigned first = (st->ring_head + sniff.ring - st->nring) % sniff.ring;
+    for (unsigned i = 0; i < st->nring; ++i)
+    {
+      const sniff_frame_t *fr = &st->ring[(first + i) % sniff.ring];
+      lua_createtable (L, 0, 4);
+      lua_pushinteger (L, fr->rssi);
+      lua_setfield (L, -2, "rssi");
+      lua_pushinteger (L, fr->channel);
+      lua_setfield (L, -2, "channel");
+      lua_pushinteger (L, fr->len);
+      lua_setfield (L, -2, "len");
+      lua_pushlstring (L, (const char *)fr->data, fr->snap_len);
+      lua_setfield (L, -2, "data");
+      lua_rawseti (L, -2, i + 1);
+    }
+    lua_setfield (L, -2, "ring");
+    lua_pushinteger (L, st->ring_lost);
+    lua_setfield (L, -2, "ring_lost");
+  }
+  lua_call (L, 1, 0);
+}
+
+static void sniff_stop (lua_State *L)
+{
+  os_timer_disarm (&sniff_timer);
+  esp_wifi_set_promiscuous (false);
+  esp_wifi_set_promiscuous_rx_cb (NULL);
+  portENTER_CRITICAL (&sniff_mux);
+  sniff.on = false;
+  portEXIT_CRITICAL (&sniff_mux);
+  for (int i = 0; i < 2; ++i)
+  {
+    sniff_stats_t *st = i ? sniff.out : sniff.cur;
+    if (st)
+      free (st->ring);
+    free (st);
+  }
+  sniff.cur = sniff.out = NULL;
+  luaL_unref (L, LUA_REGISTRYINDEX, sniff.cb_ref);
+  sniff.cb_ref = LUA_NOREF;
+}
+
+static int sniff_mask (lua_State *L, const char *field, const char *const *names, int n, int all)
+{
+  lua_getfield (L, 1, field);
+  if (lua_isnil (L, -1))
+  {
+    lua_pop (L, 1);
+    return all;
+  }
+  luaL_checkanytable (L, -1);
+  int mask = 0;
+  for (int i = 1; ; ++i)
+  {
+    lua_rawgeti (L, -1, i);
+    if (lua_isnil (L, -1))
+      break;
+    int bit = -1;
+    if (names)
+    {
+      const char *name = luaL_checkstring (L, -1);
+      for (int j = 0; j < n; ++j)
+        if (strcmp (name, names[j]) == 0)
+          bit = j;
+    }
+    else
+      bit = luaL_checkinteger (L, -1);
+    if (bit < 0 || bit >= n)
+      luaL_error (L, "invalid %s entry", field);
+    mask |= 1 << bit;
+    lua_pop (L, 1);
+  }
+  lua_pop (L, 2);
+  return mask;
+}
+
+// Lua: wifi.sniff( { channel=, types={"mgmt","ctrl","data"}, subtypes={...},
+//                    mac=, rssi=-127, interval=1000, ring=0, snap=64 }, function(summary) )
+// Puts the radio in promiscuous mode on channel. Frames of the given
+// types and subtypes, at least rssi dBm and with mac as one of their
+// addresses, are counted; every interval ms the function gets
+// { seen, frames, bytes, mgmt, ctrl, data, rssi, rssi_min, rssi_max,
+//   macs = { [transmitter] = { frames, rssi } }, other_macs }
+// and with ring set also ring, the latest that many frames, oldest first,
+// as { rssi, channel, len, data } with the first snap bytes, and
+// ring_lost.
+// Lua: wifi.sniff( nil ) stops.
+static int wifi_sniff (lua_State *L)
+{
+  if (sniff.on)
+    sniff_stop (L);
+  if (lua_isnoneornil (L, 1))
+    return 0;
+
+  luaL_checkanytable (L, 1);
+  luaL_checkanyfunction (L, 2);
+  lua_settop (L, 2);
+
+  lua_getfield (L, 1, "channel");
+  int channel = luaL_checkinteger (L, -1);
+  if (channel < 1 || channel > 14)
+    return luaL_error (L, "invalid channel %d", channel);
+  lua_getfield (L, 1, "rssi");
+  int rssi = luaL_optint (L, -1, -127);
+  lua_getfield (L, 1, "interval");
+  int interval = luaL_optint (L, -1, 1000);
+  if (interval < SNIFF_MIN_MS)
+    return luaL_error (L, "interval under %d ms", SNIFF_MIN_MS);
+  lua_getfield (L, 1, "ring");
+  int ring = luaL_optint (L, -1, 0);
+  if (ring < 0 || ring > SNIFF_RING_MAX)
+    return luaL_error (L, "ring holds up to %d frames", SNIFF_RING_MAX);
+  lua_getfield (L, 1, "snap");
+  int snap = luaL_optint (L, -1, 64);
+  if (snap < 0 || snap > SNIFF_SNAP_MAX)
+    return luaL_error (L, "snap is up to %d bytes", SNIFF_SNAP_MAX);
+  bool mac_set = false;
+  uint8_t mac[6];
+  lua_getfield (L, 1, "mac");
+  if (!lua_isnil (L, -1))
+  {
+    const char *str = luaL_checkstring (L, -1);
+    if (!parse_bssid (str, mac))
+      return luaL_error (L, "invalid MAC: %s", str);
+    mac_set = true;
+  }
+  lua_settop (L, 2);
+  int types = sniff_mask (L, "types", sniff_type_names, SNIFF_TYPES, 0x7);
+  int subtypes = sniff_mask (L, "subtypes", NULL, 16, 0xffff);
+
+  sniff_stats_t *st[2];
+  for (int i = 0; i < 2; ++i)
+  {
+    st[i] = (sniff_stats_t *)calloc (1, sizeof (sniff_stats_t));
+    if (st[i] && ring)
+      st[i]->ring = (sniff_frame_t *)calloc (ring, sizeof (sniff_frame_t));
+    if (!st[i] || (ring && !st[i]->ring))
+    {
+      for (int j = 0; j <= i; ++j)
+      {
+        if (st[j])
+          free (st[j]->ring);
+        free (st[j]);
+      }
+      return luaL_error (L, "out of memory");
+    }
+    sniff_reset (st[i]);
+  }
+
+  if (!sniff_task)
+    sniff_task = task_get_id (sniff_deliver);
+  sniff.types = types;
+  sniff.subtypes = subtypes;
+  sniff.mac_set = mac_set;
+  memcpy (sniff.mac, mac, sizeof (mac));
+  sniff.min_rssi = rssi < -127 ? -127 : rssi > 0 ? 0 : rssi;
+  sniff.ring = ring;
+  sniff.snap = snap;
+  sniff.cur = st[0];
+  sniff.out = st[1];
+  sniff.cb_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+  sniff.posted = false;
+  sniff.on = true;
+
+  esp_err_t err = esp_wifi_set_promiscuous_rx_cb (sniff_rx);
+  if (err == ESP_OK)
+    err = esp_wifi_set_promiscuous (true);
+  if (err == ESP_OK)
+    err = esp_wifi_set_channel (channel, WIFI_SECOND_CHAN_NONE);
+  if (err != ESP_OK)
+  {
+    sniff_stop (L);
+    return luaL_error (L, "failed to start sniffing, code %d", err);
+  }
+  os_timer_setfn (&sniff_timer, sniff_tick, NULL);
+  os_timer_arm (&sniff_timer, interval, 1);
+  return 0;
+}
+
 
 const LUA_REG_TYPE wifi_sta_map[] = {
   { LSTRKEY( "config" ),      LFUNCVAL( wifi_sta_config )     },
@@ -553,6 +1373,7 @@ const LUA_REG_TYPE wifi_sta_map[] = {
   { LSTRKEY( "disconnect" ),  LFUNCVAL( wifi_sta_disconnect ) },
   { LSTRKEY( "getconfig" ),   LFUNCVAL( wifi_sta_getconfig )  },
   { LSTRKEY( "scan" ),        LFUNCVAL( wifi_sta_scan )       },
+  { LSTRKEY( "fastcache" ),   LFUNCVAL( wifi_sta_fastcache )  },
 
   { LNILKEY, LNILVAL }
 };
@@ -576,6 +1397,7 @@ const LUA_REG_TYPE wifi_map[] =  {
 	{ LSTRKEY( "setmode" ),     LFUNCVAL( wifi_setmode )        },
 	{ LSTRKEY( "start" ),       LFUNCVAL( wifi_start )          },
 	{ LSTRKEY( "stop" ),        LFUNCVAL( wifi_stop )           },
+	{ LSTRKEY( "sniff" ),       LFUNCVAL( wifi_sniff )          },
 
 	{ LSTRKEY( "sta" ),         LROVAL( wifi_sta_map )          },
 	{ LSTRKEY( "ap" ),          LROVAL( wifi_ap_map )           },
@@ -0,0 +1,233 @@
+// Module for WS2812 LED strips, sent by the RMT
+//
+// Frames are copied into one of two buffers and sent from the RMT
+// interrupt, so Lua can go on to build the next frame while one is going
+// out. fill, shift and fade work on buffer.new() buffers in C, to keep
+// per-pixel loops out of Lua.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "buffer.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "ws2812.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "task/task.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define WS2812_MAX_PIN 33       // the higher GPIOs are inputs only
+
+typedef struct {
+  uint8_t *data;
+  size_t size;            // allocated, grows to the longest frame
+  int cb_ref;
+  volatile bool busy;     // with the driver, left alone until it is done
+} ws2812_slot_t;
+
+static ws2812_slot_t slots[2];
+static SemaphoreHandle_t slot_free;
+static task_handle_t ws2812_task;
+static unsigned pixel_size;   // 0 until init
+
+// Runs in the RMT interrupt
+static void ws2812_done( void *arg )
+{
+  ws2812_slot_t *s = (ws2812_slot_t *)arg;
+  int ref = s->cb_ref;
+  s->busy = false;
+  xSemaphoreGiveFromISR( slot_free, NULL );
+  if (ref != LUA_NOREF)
+    task_post_low( ws2812_task, (task_param_t)ref );
+}
+
+static void ws2812_task_handler( task_param_t param, task_prio_t prio )
+{
+  (void)prio;
+  lua_State *L = lua_getstate();
+  lua_rawgeti( L, LUA_REGISTRYINDEX, (int)param );
+  luaL_unref( L, LUA_REGISTRYINDEX, (int)param );
+  lua_call( L, 0, 0 );
+}
+
+// A slot the driver isn't using, waiting for the oldest frame if need be
+static ws2812_slot_t *ws2812_get_slot( void )
+{
+  for (;;) {
+    for (int i = 0; i < 2; i++)
+      if (!slots[i].busy)
+        return &slots[i];
+    xSemaphoreTake( slot_free, portMAX_DELAY );
+  }
+}
+
+static lbuffer_t *ws2812_checkbuffer( lua_State *L, int idx )
+{
+  if (!pixel_size)
+    luaL_error( L, "ws2812 not initialised" );
+  return (lbuffer_t *)luaL_checkudata( L, idx, BUFFER_TABLE );
+}
+
+// Lua: ws2812.init( pin[, pixel_size] )
+// pixel_size is 3 for GRB strips, 4 for RGBW ones; fill and shift go by it.
+static int lws2812_init( lua_State *L )
+{
+  int pin = luaL_checkinteger( L, 1 );
+  luaL_argcheck( L, pin >= 0 && pin <= WS2812_MAX_PIN, 1, "wrong pin" );
+  int size = luaL_optinteger( L, 2, 3 );
+  luaL_argcheck( L, size == 3 || size == 4, 2, "wrong pixel size" );
+
+  if (!slot_free) {
+    slot_free = xSemaphoreCreateBinary();
+    if (!slot_free)
+      return luaL_error( L, "out of memory" );
+    ws2812_task = task_get_id( ws2812_task_handler );
+    for (int i = 0; i < 2; i++)
+      slots[i].cb_ref = LUA_NOREF;
+  }
+  pixel_size = size;
+  ws2812_init( pin );
+  return 0;
+}
+
+// Lua: ws2812.write( data[, function()] )
+// Queues data, a string or a buffer, to be sent once the frame going out
+// now is done, and returns; it only waits if another frame is already
+// queued. The function is called when the frame has gone out.
+static int lws2812_write( lua_State *L )
+{
+  size_t len;
+  const char *data = buffer_checklstring( L, 1, &len );
+  luaL_argcheck( L, len > 0, 1, "empty frame" );
+  if (!pixel_size)
+    return luaL_error( L, "ws2812 not initialised" );
+  bool cb = lua_type( L, 2 ) == LUA_TFUNCTION || lua_type( L, 2 ) == LUA_TLIGHTFUNCTION;
+
+  ws2812_slot_t *s = ws2812_get_slot();
+  if (s->size < len) {
+    uint8_t *p = (uint8_t *)realloc( s->data, len );
+    if (!p)
+      return luaL_error( L, "out of memory" );
+    s->data = p;
+    s->size = len;
+  }
+  memcpy( s->data, data, len );
+  if (cb) {
+    lua_pushvalue( L, 2 );
+    s->cb_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  } else {
+    s->cb_ref = LUA_NOREF;
+  }
+  s->busy = true;
+  if (ws2812_write( s->data, len, ws2812_done, s )) {
+    s->busy = false;
+    luaL_unref( L, LUA_REGISTRYINDEX, s->cb_ref );
+    s->cb_ref = LUA_NOREF;
+    return luaL_error( L, "ws2812 busy" );
+  }
+  return 0;
+}
+
+// Lua: ws2812.fill( buf, c1, c2, c3[, c4] )
+// Sets every pixel of buf to the given bytes, one per colour.
+static int lws2812_fill( lua_State *L )
+{
+  lbuffer_t *b = ws2812_checkbuffer( L, 1 );
+  uint8_t px[4];
+  for (unsigned i = 0; i < pixel_size; i++) {
+    int c = luaL_checkinteger( L, i + 2 );
+    luaL_argcheck( L, c >= 0 && c <= 255, i + 2, "wrong colour" );
+    px[i] = c;
+  }
+  for (size_t off = 0; off + pixel_size <= b->len; off += pixel_size)
+    memcpy( b->data + off, px, pixel_size );
+  return 0;
+}
+
+static void ws2812_reverse( uint8_t *p, size_t len )
+{
+  if (len < 2)
+    return;
+  for (size_t i = 0, j = len - 1; i < j; i++, j--) {
+    uint8_t t = p[i];
+    p[i] = p[j];
+    p[j] = t;
+  }
+}
+
+// Lua: ws2812.shift( buf, n[, circular] )
+// Moves the pixels of buf n places towards its end, or towards its start
+// for a negative n. Pixels pushed off one end come back at the other with
+// circular, otherwise the ones left behind are cleared.
+static int lws2812_shift( lua_State *L )
+{
+  lbuffer_t *b = ws2812_checkbuffer( L, 1 );
+  lua_Integer n = luaL_checkinteger( L, 2 );
+  bool circular = lua_toboolean( L, 3 );
+  size_t pixels = b->len / pixel_size;
+  size_t len = pixels * pixel_size;
+  if (!pixels || !n)
+    return 0;
+
+  size_t k = (size_t)(n < 0 ? -n : n);
+  if (circular) {
+    k %= pixels;
+    if (n < 0)
+      k = pixels - k;
+    // rotating right by k is three reversals
+    k *= pixel_size;
+    ws2812_reverse( b->data, len );
+    ws2812_reverse( b->data, k );
+    ws2812_reverse( b->data + k, len - k );
+  } else if (k >= pixels) {
+    memset( b->data, 0, len );
+  } else {
+    k *= pixel_size;
+    if (n > 0) {
+      memmove( b->data + k, b->data, len - k );
+      memset( b->data, 0, k );
+    } else {
+      memmove( b->data, b->data + k, len - k );
+      memset( b->data + len - k, 0, k );
+    }
+  }
+  return 0;
+}
+
+// Lua: ws2812.fade( buf, scale )
+// Multiplies every byte of buf by scale/256, so 128 halves the brightness
+// and 512 doubles it, up to 255.
+static int lws2812_fade( lua_State *L )
+{
+  lbuffer_t *b = ws2812_checkbuffer( L, 1 );
+  lua_Integer scale = luaL_checkinteger( L, 2 );
+  luaL_argcheck( L, scale >= 0 && scale <= 0xffff, 2, "wrong scale" );
+  for (size_t i = 0; i < b->len; i++) {
+    uint32_t v = ((uint32_t)b->data[i] * scale) >> 8;
+    b->data[i] = v > 255 ? 255 : v;
+  }
+  return 0;
+}
+
+// Module function map
+const LUA_REG_TYPE ws2812_map[] = {
+  { LSTRKEY( "init" ),        LFUNCVAL( lws2812_init ) },
+  { LSTRKEY( "write" ),       LFUNCVAL( lws2812_write ) },
+  { LSTRKEY( "fill" ),        LFUNCVAL( lws2812_fill ) },
+  { LSTRKEY( "shift" ),       LFUNCVAL( lws2812_shift ) },
+  { LSTRKEY( "fade" ),        LFUNCVAL( lws2812_fade ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_ws2812(lua_State *L)
+{
+#if LUA_OPTIMIZE_MEMORY > 0
+    return 0;
+#else
+	luaL_register( L, LUA_WS2812LIBNAME, ws2812_map );
+	return 1;
+#endif
+}
@@ -0,0 +1,540 @@
+// Module for deflate and inflate, in zlib, gzip or raw format
+//
+// Both directions stream: a stream object takes its input a chunk at a
+// time, from net receive callbacks, file reads or log records, and hands
+// back what output is ready, so neither side of a transfer is ever held
+// in RAM whole. Inflating uses miniz's tinfl in ROM with a window of the
+// stream's own size, 32 KB at most; deflating uses utils/deflate.c, whose
+// window is set by the caller. compressfile and decompressfile do a whole
+// file without the data passing through Lua.
+
+#include "modules.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "c_types.h"
+#include "buffer.h"
+#include "vfs.h"
+#include "deflate.h"
+#include "rom/miniz.h"
+#include "rom/crc.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ZLIB_DEFLATE_TABLE "zlib.deflate"
+#define ZLIB_INFLATE_TABLE "zlib.inflate"
+
+#define ZLIB_DEFAULT_LEVEL  6
+#define ZLIB_DEFAULT_WBITS  12      // a 4 KB window, some 20 KB of RAM
+#define ZLIB_FILE_CHUNK     1024
+
+enum { ZFMT_ZLIB, ZFMT_GZIP, ZFMT_RAW, ZFMT_AUTO };
+
+static const char * const zlib_formats[] = { "zlib", "gzip", "raw", "auto", NULL };
+static const uint8_t deflate_formats[] = { DEFLATE_ZLIB, DEFLATE_GZIP, DEFLATE_RAW };
+
+static const char * const flush_names[] = { "none", "sync", "finish", NULL };
+
+enum { IN_START, IN_GZHEAD, IN_BODY, IN_TRAILER, IN_DONE };
+
+// gzip header flags and fields
+#define GZ_FHCRC     0x02
+#define GZ_FEXTRA    0x04
+#define GZ_FNAME     0x08
+#define GZ_FCOMMENT  0x10
+
+enum { GZ_FIXED, GZ_XLEN, GZ_EXTRA, GZ_NAME, GZ_COMMENT, GZ_HCRC, GZ_END };
+
+typedef struct {
+  tinfl_decompressor inf;
+  uint8_t *dict;            // the window, which the output is written into
+  uint32_t dict_size;       // a power of 2
+  uint32_t ofs;             // next byte of dict to fill
+  uint8_t format;
+  uint8_t state;
+  bool more_out;            // tinfl has output waiting for room
+  uint8_t gzphase;
+  uint8_t gzflags;
+  uint16_t xlen;
+  uint16_t count;           // bytes into the current header field or trailer
+  uint8_t trailer[8];
+  uint32_t crc, size;       // of the output, for gzip
+} zlib_inflater_t;
+
+typedef struct {
+  deflate_state_t *d;
+} zlib_deflater_t;
+
+/*
+** Output to a luaL_Buffer or a file
+*/
+
+static void out_buffer( void *arg, const uint8_t *data, size_t len )
+{
+  luaL_addlstring( (luaL_Buffer *)arg, (const char *)data, len );
+}
+
+typedef struct {
+  int fd;
+  bool failed;
+  uint32_t bytes;
+} zlib_file_out_t;
+
+static void out_file( void *arg, const uint8_t *data, size_t len )
+{
+  zlib_file_out_t *f = (zlib_file_out_t *)arg;
+  if (!f->failed && vfs_write( f->fd, data, len ) != len)
+    f->failed = true;
+  f->bytes += len;
+}
+
+/*
+** Inflating
+*/
+
+// Go on to the next field of the gzip header that its flags say is there
+static void gz_next( zlib_inflater_t *z )
+{
+  for (;;) {
+    z->gzphase++;
+    z->count = 0;
+    switch (z->gzphase) {
+    case GZ_XLEN:    if (z->gzflags & GZ_FEXTRA) return; break;
+    case GZ_EXTRA:   if ((z->gzflags & GZ_FEXTRA) && z->xlen) return; break;
+    case GZ_NAME:    if (z->gzflags & GZ_FNAME) return; break;
+    case GZ_COMMENT: if (z->gzflags & GZ_FCOMMENT) return; break;
+    case GZ_HCRC:    if (z->gzflags & GZ_FHCRC) return; break;
+    default:         return;
+    }
+  }
+}
+
+// One byte of a gzip header; false if it can't be one
+static bool gz_header_byte( zlib_inflater_t *z, uint8_t b )
+{
+  switch (z->gzphase) {
+  case GZ_FIXED:
+    if ((z->count == 0 && b != 0x1f) || (z->count == 1 && b != 0x8b) ||
+        (z->count == 2 && b != 8) || (z->count == 3 && (b & 0xe0)))
+      return false;
+    if (z->count == 3)
+      z->gzflags = b;
+    if (++z->count == 10)
+      gz_next( z );
+    break;
+  case GZ_XLEN:
+    z->xlen |= b << (8 * z->count);
+    if (++z->count == 2)
+      gz_next( z );
+    break;
+  case GZ_EXTRA:
+    if (++z->count == z->xlen)
+      gz_next( z );
+    break;
+  case GZ_NAME:
+  case GZ_COMMENT:
+    if (b == 0)
+      gz_next( z );
+    break;
+  case GZ_HCRC:
+    if (++z->count == 2)
+      gz_next( z );
+    break;
+  }
+  return true;
+}
+
+static const char *gz_trailer_byte( zlib_inflater_t *z, uint8_t b )
+{
+  z->trailer[z->count++] = b;
+  if (z->count < 8)
+    return NULL;
+  z->state = IN_DONE;
+  uint32_t crc = z->trailer[0] | z->trailer[1] << 8 | z->trailer[2] << 16 | (uint32_t)z->trailer[3] << 24;
+  uint32_t size = z->trailer[4] | z->trailer[5] << 8 | z->trailer[6] << 16 | (uint32_t)z->trailer[7] << 24;
+  return crc == z->crc && size == z->size ? NULL : "checksum mismatch";
+}
+
+// Inflate len bytes of input, handing out the output as it comes. Returns
+// what is wrong with the stream, or NULL. Input after its end is ignored.
+static const char *inflater_feed( zlib_inflater_t *z, const uint8_t *p, size_t len,
+                                  deflate_out_fn out, void *arg )
+{
+  const char *err;
+
+  while ((len || z->more_out) && z->state != IN_DONE) {
+    switch (z->state) {
+    case IN_START:
+      if (z->format == ZFMT_AUTO)
+        z->format = p[0] == 0x1f ? ZFMT_GZIP : ZFMT_ZLIB;
+      if (z->format == ZFMT_ZLIB) {
+        // the window the header gives is all the stream can refer back to
+        if ((p[0] & 0x0f) != 8 || (p[0] >> 4) > 7)
+          return "not a zlib stream";
+        z->dict_size = 256u << (p[0] >> 4);
+      }
+      z->dict = (uint8_t *)malloc( z->dict_size );
+      if (!z->dict)
+        return "out of memory";
+      z->state = z->format == ZFMT_GZIP ? IN_GZHEAD : IN_BODY;
+      break;
+
+    case IN_GZHEAD:
+      if (!gz_header_byte( z, *p ))
+        return "not a gzip stream";
+      p++;
+      len--;
+      if (z->gzphase == GZ_END)
+        z->state = IN_BODY;
+      break;
+
+    case IN_BODY: {
+      size_t in = len, avail = z->dict_size - z->ofs;
+      int status = tinfl_decompress( &z->inf, p, &in, z->dict, z->dict + z->ofs, &avail,
+          TINFL_FLAG_HAS_MORE_INPUT | (z->format == ZFMT_ZLIB ? TINFL_FLAG_PARSE_ZLIB_HEADER : 0) );
+      p += in;
+      len -= in;
+      if (avail) {
+        out( arg, z->dict + z->ofs, avail );
+        if (z->format == ZFMT_GZIP)
+          z->crc = crc32_le( z->crc, z->dict + z->ofs, avail );
+        z->size += avail;
+        z->ofs = (z->ofs + avail) & (z->dict_size - 1);
+      }
+      z->more_out = status == TINFL_STATUS_HAS_MORE_OUTPUT;
+      if (status == TINFL_STATUS_ADLER32_MISMATCH)
+        return "checksum mismatch";
+      if (status < TINFL_STATUS_DONE)
+        return "corrupt stream";
+      if (status == TINFL_STATUS_DONE) {
+        z->state = IN_DONE;
+        if (z->format == ZFMT_GZIP) {
+          // tinfl reads ahead; whole bytes left in its bit buffer are
+          // the start of the trailer
+          tinfl_bit_buf_t bits = z->inf.m_bit_buf >> (z->inf.m_num_bits & 7);
+          z->state = IN_TRAILER;
+          for (uint32_t i = 0; i < z->inf.m_num_bits / 8; i++, bits >>= 8)
+            if ((err = gz_trailer_byte( z, (uint8_t)bits )) != NULL)
+              return err;
+        }
+      }
+      break;
+    }
+
+    case IN_TRAILER:
+      if ((err = gz_trailer_byte( z, *p )) != NULL)
+        return err;
+      p++;
+      len--;
+      break;
+    }
+  }
+  return NULL;
+}
+
+static void inflater_init( zlib_inflater_t *z, int format, int window_bits )
+{
+  memset( z, 0, sizeof(*z) );
+  tinfl_init( &z->inf );
+  z->format = format;
+  z->dict_size = 1u << window_bits;
+}
+
+static void inflater_free( zlib_inflater_t *z )
+{
+  free( z->dict );
+  z->dict = NULL;
+}
+
+// Lua: z = zlib.inflate( [format[, window_bits]] )
+// format is "auto" (the default) for zlib or gzip, or "zlib", "gzip" or
+// "raw". A zlib stream gives its window in its header; for the others it
+// is 2^window_bits, 15 by default, as senders rarely use less.
+static zlib_inflater_t *inflater_push( lua_State *L, int arg )
+{
+  int format = luaL_checkoption( L, arg, "auto", zlib_formats );
+  int wbits = luaL_optinteger( L, arg + 1, 15 );
+  luaL_argcheck( L, wbits >= 8 && wbits <= 15, arg + 1, "out of range" );
+  zlib_inflater_t *z = (zlib_inflater_t *)lua_newuserdata( L, sizeof(zlib_inflater_t) );
+  inflater_init( z, format, wbits );
+  luaL_getmetatable( L, ZLIB_INFLATE_TABLE );
+  lua_setmetatable( L, -2 );
+  return z;
+}
+
+static int zlib_inflate( lua_State *L )
+{
+  inflater_push( L, 1 );
+  return 1;
+}
+
+// Lua: out, done = z:write( data )
+// Inflates data, a string or buffer, giving back the output it makes and
+// whether the stream has ended. A corrupt stream is an error.
+static int zlib_inflate_write( lua_State *L )
+{
+  zlib_inflater_t *z = (zlib_inflater_t *)luaL_checkudata( L, 1, ZLIB_INFLATE_TABLE );
+  size_t len;
+  const char *data = buffer_checklstring( L, 2, &len );
+  luaL_Buffer b;
+  luaL_buffinit( L, &b );
+  const char *err = inflater_feed( z, (const uint8_t *)data, len, out_buffer, &b );
+  if (err)
+    return luaL_error( L, "%s", err );
+  luaL_pushresult( &b );
+  lua_pushboolean( L, z->state == IN_DONE );
+  return 2;
+}
+
+static int zlib_inflate_gc( lua_State *L )
+{
+  inflater_free( (zlib_inflater_t *)luaL_checkudata( L, 1, ZLIB_INFLATE_TABLE ) );
+  return 0;
+}
+
+/*
+** Deflating
+*/
+
+static deflate_state_t *deflater_new( lua_State *L, int arg )
+{
+  int format = luaL_checkoption( L, arg, "zlib", zlib_formats );
+  int level = luaL_optinteger( L, arg + 1, ZLIB_DEFAULT_LEVEL );
+  int wbits = luaL_optinteger( L, arg + 2, ZLIB_DEFAULT_WBITS );
+  luaL_argcheck( L, format != ZFMT_AUTO, arg, "not for deflate" );
+  luaL_argcheck( L, level >= 0 && level <= 9, arg + 1, "out of range" );
+  luaL_argcheck( L, wbits >= 9 && wbits <= 15, arg + 2, "out of range" );
+  deflate_state_t *d = deflate_new( deflate_formats[format], level, wbits );
+  if (!d)
+    luaL_error( L, "out of memory" );
+  return d;
+}
+
+// Lua: z = zlib.deflate( [format[, level[, window_bits]]] )
+// format is "zlib" (the default), "gzip" or "raw". level goes from 0,
+// literals only, to 9; 6 by default. The window is 2^window_bits bytes,
+// 12 by default, and takes about five times that in RAM.
+static zlib_deflater_t *deflater_push( lua_State *L, int arg )
+{
+  lua_settop( L, arg + 2 );   // the options stay below the new object
+  zlib_deflater_t *z = (zlib_deflater_t *)lua_newuserdata( L, sizeof(zlib_deflater_t) );
+  z->d = NULL;
+  luaL_getmetatable( L, ZLIB_DEFLATE_TABLE );
+  lua_setmetatable( L, -2 );
+  z->d = deflater_new( L, arg );
+  return z;
+}
+
+static int zlib_deflate( lua_State *L )
+{
+  deflater_push( L, 1 );
+  return 1;
+}
+
+static int zlib_deflate_run( lua_State *L, int flush )
+{
+  zlib_deflater_t *z = (zlib_deflater_t *)luaL_checkudata( L, 1, ZLIB_DEFLATE_TABLE );
+  size_t len = 0;
+  const char *data = lua_isnoneornil( L, 2 ) ? "" : buffer_checklstring( L, 2, &len );
+  if (!z->d || deflate_finished( z->d ))
+    return luaL_error( L, "stream finished" );
+  luaL_Buffer b;
+  luaL_buffinit( L, &b );
+  deflate_write( z->d, data, len, flush, out_buffer, &b );
+  luaL_pushresult( &b );
+  return 1;
+}
+
+// Lua: out = z:write( data[, flush] )
+// Deflates data, a string or buffer, giving back the output that is
+// ready. flush "sync" brings out all of it, e.g. to end a message on a
+// connection, at a cost of a few bytes; "finish" ends the stream.
+static int zlib_deflate_write( lua_State *L )
+{
+  static const int flushes[] = { DEFLATE_NO_FLUSH, DEFLATE_SYNC_FLUSH, DEFLATE_FINISH };
+  return zlib_deflate_run( L, flushes[luaL_checkoption( L, 3, "none", flush_names )] );
+}
+
+// Lua: out = z:finish( [data] )
+static int zlib_deflate_finish( lua_State *L )
+{
+  return zlib_deflate_run( L, DEFLATE_FINISH );
+}
+
+static int zlib_deflate_gc( lua_State *L )
+{
+  zlib_deflater_t *z = (zlib_deflater_t *)luaL_checkudata( L, 1, ZLIB_DEFLATE_TABLE );
+  deflate_free( z->d );
+  z->d = NULL;
+  return 0;
+}
+
+/*
+** One shot and files
+*/
+
+// Lua: out = zlib.compress( data[, format[, level[, window_bits]]] )
+static int zlib_compress( lua_State *L )
+{
+  size_t len;
+  const char *data = buffer_checklstring( L, 1, &len );
+  zlib_deflater_t *z = deflater_push( L, 2 );
+  luaL_Buffer b;
+  luaL_buffinit( L, &b );
+  deflate_write( z->d, data, len, DEFLATE_FINISH, out_buffer, &b );
+  luaL_pushresult( &b );
+  return 1;
+}
+
+// Lua: out = zlib.decompress( data[, format] )
+// A corrupt or incomplete stream is an error.
+static int zlib_decompress( lua_State *L )
+{
+  size_t len;
+  const char *data = buffer_checklstring( L, 1, &len );
+  zlib_inflater_t *z = inflater_push( L, 2 );
+  luaL_Buffer b;
+  luaL_buffinit( L, &b );
+  const char *err = inflater_feed( z, (const uint8_t *)data, len, out_buffer, &b );
+  if (!err && z->state != IN_DONE)
+    err = "stream incomplete";
+  if (err)
+    return luaL_error( L, "%s", err );
+  luaL_pushresult( &b );
+  return 1;
+}
+
+typedef struct {
+  int in, out;
+  uint8_t *buf;
+  deflate_state_t *d;
+  zlib_inflater_t *z;
+} zlib_files_t;
+
+static void files_close( zlib_files_t *f )
+{
+  if (f->in)
+    vfs_close( f->in );
+  if (f->out)
+    vfs_close( f->out );
+  free( f->buf );
+  deflate_free( f->d );
+  if (f->z) {
+    inflater_free( f->z );
+    free( f->z );
+  }
+}
+
+static bool files_open( zlib_files_t *f, const char *src, const char *dst )
+{
+  memset( f, 0, sizeof(*f) );
+  f->in = vfs_open( src, "r" );
+  if (f->in)
+    f->out = vfs_open( dst, "w" );
+  f->buf = (uint8_t *)malloc( ZLIB_FILE_CHUNK );
+  return f->in && f->out && f->buf;
+}
+
+// Lua: in, out = zlib.compressfile( src, dst[, format[, level[, window_bits]]] )
+// Returns the sizes of both files, or nil if one can't be opened or
+// written.
+static int zlib_compressfile( lua_State *L )
+{
+  const char *src = luaL_checkstring( L, 1 );
+  const char *dst = luaL_checkstring( L, 2 );
+  zlib_files_t f;
+  zlib_file_out_t out = { 0, false, 0 };
+  uint32_t total = 0;
+  int32_t n;
+
+  deflate_state_t *d = deflater_new( L, 3 );
+  bool ok = files_open( &f, src, dst );
+  f.d = d;
+  out.fd = f.out;
+  while (ok && (n = vfs_read( f.in, f.buf, ZLIB_FILE_CHUNK )) > 0) {
+    deflate_write( f.d, f.buf, n, DEFLATE_NO_FLUSH, out_file, &out );
+    total += n;
+  }
+  if (ok)
+    deflate_write( f.d, NULL, 0, DEFLATE_FINISH, out_file, &out );
+  files_close( &f );
+  if (!ok || out.failed)
+    return 0;
+  lua_pushinteger( L, total );
+  lua_pushinteger( L, out.bytes );
+  return 2;
+}
+
+// Lua: in, out = zlib.decompressfile( src, dst[, format] )
+// As compressfile; a corrupt or incomplete stream is an error.
+static int zlib_decompressfile( lua_State *L )
+{
+  const char *src = luaL_checkstring( L, 1 );
+  const char *dst = luaL_checkstring( L, 2 );
+  int format = luaL_checkoption( L, 3, "auto", zlib_formats );
+  zlib_files_t f;
+  zlib_file_out_t out = { 0, false, 0 };
+  uint32_t total = 0;
+  const char *err = NULL;
+  int32_t n;
+
+  bool ok = files_open( &f, src, dst );
+  if (ok && (f.z = (zlib_inflater_t *)malloc( sizeof(zlib_inflater_t) )) == NULL)
+    err = "out of memory";
+  else if (ok)
+    inflater_init( f.z, format, 15 );
+  out.fd = f.out;
+  while (ok && !err && (n = vfs_read( f.in, f.buf, ZLIB_FILE_CHUNK )) > 0) {
+    err = inflater_feed( f.z, f.buf, n, out_file, &out );
+    total += n;
+  }
+  if (ok && !err && f.z->state != IN_DONE)
+    err = "stream incomplete";
+  files_close( &f );
+  if (err)
+    return luaL_error( L, "%s", err );
+  if (!ok || out.failed)
+    return 0;
+  lua_pushinteger( L, total );
+  lua_pushinteger( L, out.bytes );
+  return 2;
+}
+
+static const LUA_REG_TYPE zlib_deflate_map[] = {
+  { LSTRKEY( "write" ),   LFUNCVAL( zlib_deflate_write ) },
+  { LSTRKEY( "finish" ),  LFUNCVAL( zlib_deflate_finish ) },
+  { LSTRKEY( "__gc" ),    LFUNCVAL( zlib_deflate_gc ) },
+  { LSTRKEY( "__index" ), LROVAL( zlib_deflate_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+static const LUA_REG_TYPE zlib_inflate_map[] = {
+  { LSTRKEY( "write" ),   LFUNCVAL( zlib_inflate_write ) },
+  { LSTRKEY( "__gc" ),    LFUNCVAL( zlib_inflate_gc ) },
+  { LSTRKEY( "__index" ), LROVAL( zlib_inflate_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+// Module function map
+const LUA_REG_TYPE zlib_map[] = {
+  { LSTRKEY( "deflate" ),        LFUNCVAL( zlib_deflate ) },
+  { LSTRKEY( "inflate" ),        LFUNCVAL( zlib_inflate ) },
+  { LSTRKEY( "compress" ),       LFUNCVAL( zlib_compress ) },
+  { LSTRKEY( "decompress" ),     LFUNCVAL( zlib_decompress ) },
+  { LSTRKEY( "compressfile" ),   LFUNCVAL( zlib_compressfile ) },
+  { LSTRKEY( "decompressfile" ), LFUNCVAL( zlib_decompressfile ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUALIB_API int luaopen_zlib( lua_State *L )
+{
+  luaL_rometatable( L, ZLIB_DEFLATE_TABLE, (void *)zlib_deflate_map );
+  luaL_rometatable( L, ZLIB_INFLATE_TABLE, (void *)zlib_inflate_map );
+#if LUA_OPTIMIZE_MEMORY > 0
+  return 0;
+#else
+  luaL_register( L, LUA_ZLIBLIBNAME, zlib_map );
+  return 1;
+#endif
+}
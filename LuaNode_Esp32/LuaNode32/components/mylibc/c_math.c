@@ -7,6 +7,16 @@ double floor(double x)
     return (double) (x < 0.f ? (((int) x) - 1) : ((int) x));
 }
 
+// Single precision floor for LUA_NUMBER_FLOAT, kept in the FPU registers
+float floorf(float x)
+{
+    int i;
+    if (!(x > -8388608.f && x < 8388608.f))
+        return x;   // no fraction bits left, or inf or nan
+    i = (int) x;
+    return (float) (i > x ? i - 1 : i);
+}
+
 #define MAXEXP 2031     /* (MAX_EXP * 16) - 1           */
 #define MINEXP -2047        /* (MIN_EXP * 16) - 1           */
 #define HUGE MAXFLOAT
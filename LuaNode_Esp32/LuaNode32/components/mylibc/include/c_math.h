@@ -3,6 +3,7 @@
 #include <math.h>
 
 double floor(double);
+float floorf(float);
 double pow(double, double);
 
 #if 0
@@ -0,0 +1,132 @@
+// Read-only asset image served in place from mapped flash
+
+#include "asset_store.h"
+#include "platform.h"
+#include "platform_partition.h"
+#include "esp_spi_flash.h"
+#include <string.h>
+
+#define ASSET_STORE_MAGIC 0x3141534c    // "LSA1"
+
+// Image layout, all little endian: the header, count entries sorted by
+// name, then the NUL terminated names and blobs they point to.
+typedef struct {
+  uint32_t magic;
+  uint32_t count;
+  uint32_t size;                        // bytes in the whole image
+} asset_store_hdr_t;
+
+typedef struct {
+  uint32_t name;                        // offsets from the image start
+  uint32_t data;
+  uint32_t size;
+} asset_store_ent_t;
+
+static const uint8_t *asset_map;
+static const asset_store_ent_t *asset_ents;
+static uint32_t asset_count;
+static uint32_t asset_used;
+static uint32_t asset_total;
+static bool asset_opened;
+
+// An image that doesn't check out is treated as an empty store, so that no
+// lookup ever reads past the partition
+static bool asset_store_valid( const uint8_t *map, uint32_t total )
+{
+  const asset_store_hdr_t *hdr = (const asset_store_hdr_t *)map;
+  if (hdr->magic != ASSET_STORE_MAGIC || hdr->size > total ||
+      hdr->count > (hdr->size - sizeof(*hdr)) / sizeof(asset_store_ent_t))
+    return false;
+  const asset_store_ent_t *ent = (const asset_store_ent_t *)(hdr + 1);
+  for (uint32_t i = 0; i < hdr->count; i++) {
+    if (ent[i].name >= hdr->size || ent[i].data > hdr->size ||
+        ent[i].size >= hdr->size - ent[i].data ||
+        map[ent[i].data + ent[i].size] != 0 ||
+        !memchr( map + ent[i].name, 0, hdr->size - ent[i].name ))
+      return false;
+    if (i && strcmp( (const char *)map + ent[i - 1].name,
+                     (const char *)map + ent[i].name ) >= 0)
+      return false;
+  }
+  return true;
+}
+
+static bool asset_store_open( void )
+{
+  if (asset_opened)
+    return asset_map != NULL;
+  asset_opened = true;
+
+  platform_partition_t info;
+  uint8_t i = 0;
+  bool found = false;
+  while (!found && platform_partition_info( i++, &info ))
+    found = info.type == PLATFORM_PARTITION_TYPE_NODEMCU &&
+            info.subtype == PLATFORM_PARTITION_SUBTYPE_NODEMCU_ASSETS;
+  if (!found || info.size < sizeof(asset_store_hdr_t))
+    return false;
+
+  // The mapping is never released, strings handed to Lua point into it
+  uint32_t base = info.offs & ~0xffff;
+  const void *ptr;
+  spi_flash_mmap_handle_t handle;
+  if (spi_flash_mmap( base, info.offs - base + info.size, SPI_FLASH_MMAP_DATA,
+                      &ptr, &handle ) != ESP_OK)
+    return false;
+  asset_map = (const uint8_t *)ptr + (info.offs - base);
+  asset_total = info.size;
+  if (asset_store_valid( asset_map, asset_total )) {
+    const asset_store_hdr_t *hdr = (const asset_store_hdr_t *)asset_map;
+    asset_ents = (const asset_store_ent_t *)(hdr + 1);
+    asset_count = hdr->count;
+    asset_used = hdr->size;
+  }
+  return true;
+}
+
+const void *asset_store_get( const char *name, uint32_t *size )
+{
+  if (!asset_store_open())
+    return NULL;
+  uint32_t lo = 0, hi = asset_count;
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    int cmp = strcmp( name, (const char *)asset_map + asset_ents[mid].name );
+    if (cmp == 0) {
+      *size = asset_ents[mid].size;
+      return asset_map + asset_ents[mid].data;
+    }
+    if (cmp < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return NULL;
+}
+
+const void *asset_store_path( const char *path, uint32_t *size )
+{
+  size_t n = sizeof(ASSET_STORE_PREFIX) - 1;
+  if (strncmp( path, ASSET_STORE_PREFIX, n ) != 0)
+    return NULL;
+  return asset_store_get( path + n, size );
+}
+
+bool asset_store_entry( uint32_t idx, const char **name, uint32_t *size )
+{
+  if (!asset_store_open() || idx >= asset_count)
+    return false;
+  *name = (const char *)asset_map + asset_ents[idx].name;
+  *size = asset_ents[idx].size;
+  return true;
+}
+
+bool asset_store_info( uint32_t *count, uint32_t *used, uint32_t *total )
+{
+  if (!asset_store_open())
+    return false;
+  *count = asset_count;
+  *used = asset_used;
+  *total = asset_total;
+  return true;
+}
@@ -0,0 +1,70 @@
+// Streaming writes into a flash region, erasing ahead of the data
+
+#include "flash_stream.h"
+#include "platform.h"
+#include "esp_spi_flash.h"
+#include <string.h>
+
+void flash_stream_init( flash_stream_t *fs, uint32_t offs, uint32_t size )
+{
+  fs->offs = offs;
+  fs->size = size;
+  fs->pos = 0;
+  fs->erased = 0;
+  fs->fill = 0;
+}
+
+// Make sure the next n bytes from pos are blank. Erases from the end of
+// what's blank up to the next 64K boundary, so after the first step every
+// erase is a whole block.
+static bool flash_stream_erase( flash_stream_t *fs, uint32_t n )
+{
+  while (fs->erased < fs->pos + n) {
+    uint32_t addr = fs->offs + fs->erased;
+    uint32_t len = FLASH_STREAM_ERASE_AHEAD - (addr & (FLASH_STREAM_ERASE_AHEAD - 1));
+    if (len > fs->size - fs->erased)
+      len = (fs->size - fs->erased + INTERNAL_FLASH_SECTOR_SIZE - 1) &
+            ~(INTERNAL_FLASH_SECTOR_SIZE - 1);
+    if (spi_flash_erase_range( addr, len ) != ESP_OK)
+      return false;
+    fs->erased += len;
+  }
+  return true;
+}
+
+static bool flash_stream_program( flash_stream_t *fs )
+{
+  uint32_t n = (fs->fill + INTERNAL_FLASH_WRITE_UNIT_SIZE - 1) &
+               ~(INTERNAL_FLASH_WRITE_UNIT_SIZE - 1);
+  memset( fs->page + fs->fill, 0xff, n - fs->fill );
+  if (!flash_stream_erase( fs, n ) ||
+      spi_flash_write( fs->offs + fs->pos, fs->page, n ) != ESP_OK)
+    return false;
+  fs->pos += fs->fill;
+  fs->fill = 0;
+  return true;
+}
+
+bool flash_stream_write( flash_stream_t *fs, const void *data, uint32_t len )
+{
+  const uint8_t *p = (const uint8_t *)data;
+  if (len > fs->size - flash_stream_len( fs ))
+    return false;
+  while (len) {
+    uint32_t n = FLASH_STREAM_PAGE - fs->fill;
+    if (n > len)
+      n = len;
+    memcpy( fs->page + fs->fill, p, n );
+    fs->fill += n;
+    p += n;
+    len -= n;
+    if (fs->fill == FLASH_STREAM_PAGE && !flash_stream_program( fs ))
+      return false;
+  }
+  return true;
+}
+
+bool flash_stream_flush( flash_stream_t *fs )
+{
+  return fs->fill == 0 || flash_stream_program( fs );
+}
@@ -0,0 +1,32 @@
+#ifndef __ASSET_STORE_H__
+#define __ASSET_STORE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Read-only store of named blobs in the "assets" partition, built on the
+ * host by tools/mkassets.py. The partition stays memory mapped, so a blob
+ * is handed out as a pointer into flash and never copied: asset.get()
+ * turns it into a read-only Lua string, and net and http send it as is.
+ *
+ * Every blob is followed by a NUL byte, which lets a text asset be used
+ * as a C string. Pointers remain valid until restart.
+ */
+
+/* Paths starting with this name an asset for client:sendfile() and http */
+#define ASSET_STORE_PREFIX "/ASSET/"
+
+/* Mapped address and size of the asset called name, or NULL */
+const void *asset_store_get(const char *name, uint32_t *size);
+
+/* Same, for a path of the form ASSET_STORE_PREFIX "name" */
+const void *asset_store_path(const char *path, uint32_t *size);
+
+/* Name and size of asset number idx, in name order; false past the end */
+bool asset_store_entry(uint32_t idx, const char **name, uint32_t *size);
+
+/* Number of assets, bytes used by the image and partition size */
+bool asset_store_info(uint32_t *count, uint32_t *used, uint32_t *total);
+
+#endif
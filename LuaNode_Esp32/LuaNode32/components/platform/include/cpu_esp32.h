@@ -4,6 +4,7 @@
 #include "sdkconfig.h"
 
 #define NUM_UART 3
+#define NUM_I2C 2
 
 #define INTERNAL_FLASH_SECTOR_SIZE      SPI_FLASH_SEC_SIZE
 #define INTERNAL_FLASH_WRITE_UNIT_SIZE  4
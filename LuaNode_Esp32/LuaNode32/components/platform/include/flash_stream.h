@@ -0,0 +1,42 @@
+#ifndef __FLASH_STREAM_H__
+#define __FLASH_STREAM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Writes a stream of unknown length into a region of flash, front to back,
+ * in constant RAM. Data is programmed a page at a time as it comes in;
+ * the region is erased a 64K block ahead of the page being programmed,
+ * so there is no sector buffer and erasing happens in a few large steps
+ * rather than before every sector.
+ */
+
+#define FLASH_STREAM_PAGE         256
+#define FLASH_STREAM_ERASE_AHEAD  0x10000
+
+typedef struct {
+  uint32_t offs;                        // region, physical flash address
+  uint32_t size;
+  uint32_t pos;                         // bytes programmed so far
+  uint32_t erased;                      // bytes from offs known blank
+  uint32_t fill;
+  uint8_t page[FLASH_STREAM_PAGE] __attribute__((aligned(4)));
+} flash_stream_t;
+
+/* offs must be sector aligned */
+void flash_stream_init(flash_stream_t *fs, uint32_t offs, uint32_t size);
+
+/* False on a flash error or once len would run past the region */
+bool flash_stream_write(flash_stream_t *fs, const void *data, uint32_t len);
+
+/* Programs the last partial page; the stream can't be written to after */
+bool flash_stream_flush(flash_stream_t *fs);
+
+/* Bytes taken so far, including those still in the page buffer */
+static inline uint32_t flash_stream_len(const flash_stream_t *fs)
+{
+  return fs->pos + fs->fill;
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef __LC_STORE_H__
+#define __LC_STORE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Append-only stores of compiled Lua chunks in flash partitions. Each
+ * partition stays memory mapped, so a chunk in it can be loaded in place
+ * (luaL_loadmapped) and run straight from flash.
+ *
+ * LC_STORE_FLASH is the "lcstore" partition that node.flashload() copies
+ * files into. LC_STORE_LFS is the "lfs" partition holding the Lua Flash
+ * Store image built on the host by tools/mklfs.py; require() looks there
+ * first. Both use the same record layout. Only partitions-LuaNode-stores.csv
+ * has the two partitions; without them every call here fails.
+ *
+ * Records are never rewritten; a newer copy of a name shadows older ones
+ * and the space only comes back with lc_store_erase(), which must be
+ * followed by a restart since loaded functions point into the store.
+ */
+
+#define LC_STORE_FLASH    0
+#define LC_STORE_LFS      1
+
+#define LC_STORE_NAME_LEN 36
+
+/* Every record starts with this, so an image starts with it too */
+#define LC_STORE_MAGIC    0x3158434c    // "LCX1"
+
+/* Checksum used to tell whether a stored copy still matches a file */
+uint32_t lc_store_sum(const void *data, uint32_t size);
+
+/*
+ * Mapped address of the newest record called name, if it holds exactly
+ * size bytes summing to sum. NULL if there is no such record or no store.
+ */
+const void *lc_store_find(int store, const char *name, uint32_t size, uint32_t sum);
+
+/* Mapped address and size of the newest record called name, or NULL */
+const void *lc_store_get(int store, const char *name, uint32_t *size);
+
+/*
+ * Append a record and return its mapped address, or NULL if the store is
+ * missing, full or was left damaged by an interrupted write.
+ */
+const void *lc_store_add(int store, const char *name, const void *data, uint32_t size);
+
+/* Erase every record; false if there is no such partition */
+bool lc_store_erase(int store);
+
+/* Bytes used and total size of a store, false if there is none */
+bool lc_store_info(int store, uint32_t *used, uint32_t *total);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef __LOG_STORE_H__
+#define __LOG_STORE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+
+/*
+ * Circular log in a NodeMCU partition of its own. Every sector starts with a header
+ * carrying its sequence number, which also fixes its place in the ring
+ * (seq % number of sectors), followed by records of
+ *
+ *   uint16 len, uint16 crc16_ccitt over len and data, data padded to 4.
+ *
+ * Appending writes one record at the end of the newest sector; when that
+ * is full the next sector is erased, dropping the oldest records. A record
+ * torn by a reset fails its CRC and ends its sector.
+ */
+
+#define LOG_STORE_MAX_RECORD CONFIG_LOG_STORE_MAX_RECORD
+
+/* One log, found by its partition subtype the first time it's used */
+typedef struct {
+  uint8_t subtype;
+  uint32_t offs;                        // partition, physical flash address
+  uint32_t nsec;
+  uint32_t head;                        // seq of the newest sector
+  uint32_t oldest;                      // seq of the oldest one still there
+  uint32_t end;                         // free space in the head sector
+  uint32_t next;                        // seq the next sector gets
+  bool empty;
+  bool opened;
+  bool found;
+} log_store_t;
+
+#define LOG_STORE_INIT(sub) { .subtype = (sub) }
+
+/* A place in the log, between two records */
+typedef struct {
+  uint32_t seq;
+  uint32_t offs;
+} log_store_pos_t;
+
+/* False if there is no log partition, len is 0 or too long, or on a flash error */
+bool log_store_append(log_store_t *ls, const void *data, uint32_t len);
+
+/* Position of the oldest record, or n records before the end */
+bool log_store_first(log_store_t *ls, log_store_pos_t *pos);
+bool log_store_tail(log_store_t *ls, uint32_t n, log_store_pos_t *pos);
+
+/*
+ * Copy the record at pos into buf, which must hold LOG_STORE_MAX_RECORD
+ * bytes, and step past it. Returns its length, or -1 at the end of the
+ * log. Records overwritten since pos was taken are skipped.
+ */
+int32_t log_store_next(log_store_t *ls, log_store_pos_t *pos, void *buf);
+
+/* Erase the whole log */
+bool log_store_clear(log_store_t *ls);
+
+/* Bytes in sectors holding records, and the partition size */
+bool log_store_info(log_store_t *ls, uint32_t *used, uint32_t *total);
+
+#endif
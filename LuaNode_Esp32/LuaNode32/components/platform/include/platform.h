@@ -4,6 +4,7 @@
 #define __PLATFORM_H__
 
 //#include "cpu_esp8266.h"
+#include "cpu_esp32.h"
 #include "mygpio.h"
 #include "c_types.h"
 #include "pwm.h"
@@ -41,8 +42,12 @@ typedef void (* platform_gpio_intr_handler_fn_t)( unsigned pin, unsigned level )
 int platform_gpio_mode( unsigned pin, unsigned mode );
 int platform_gpio_write( unsigned pin, unsigned level );
 int platform_gpio_read( unsigned pin );
+// Bit n of mask/values/the result is GPIOn, for GPIO0-39
+void platform_gpio_write_mask( uint64_t mask, uint64_t values );
+uint64_t platform_gpio_read_all( void );
 void platform_gpio_init( platform_gpio_intr_handler_fn_t cb );
 int platform_gpio_intr_init( unsigned pin, GPIO_INT_TYPE type );
+void platform_gpio_intr_set( unsigned pin, GPIO_INT_TYPE type );
 // *****************************************************************************
 // Timer subsection
 
@@ -107,6 +112,17 @@ int platform_spi_transaction( uint8_t id, uint8_t cmd_bitlen, spi_data_type cmd_
                               uint8_t addr_bitlen, spi_data_type addr_data,
                               uint16_t mosi_bitlen, uint8_t dummy_bitlen, int16_t miso_bitlen );
 
+// DMA transfers of any length up to PLATFORM_SPI_DMA_MAX on HSPI (2) or VSPI (3)
+#define PLATFORM_SPI_DMA_MAX                  (16 * 4092)
+typedef void (* platform_spi_done_fn_t)( void *arg );
+uint32_t platform_spi_dma_setup( uint8_t id, int sclk, int mosi, int miso, int cs, int mode, uint32_t hz );
+// Queues the transfer and returns at once; done runs in the SPI interrupt
+int platform_spi_transfer( uint8_t id, const uint8_t *tx, uint8_t *rx, size_t len,
+                           platform_spi_done_fn_t done, void *arg );
+int platform_spi_busy( uint8_t id );
+// Drives pin high as an output, for the data/command line of a display
+void platform_spi_dc_setup( unsigned pin );
+
 
 // *****************************************************************************
 // UART subsection
@@ -141,9 +157,18 @@ enum
 
 // The platform UART functions
 int platform_uart_exists( unsigned id );
-//uint32_t platform_uart_setup( unsigned id, uint32_t baud, int databits, int parity, int stopbits );
+void platform_uart_alt( int set );
+uint32_t platform_uart_setup( unsigned id, uint32_t baud, int databits, int parity, int stopbits,
+                              int tx_pin, int rx_pin, int de_pin );
 int platform_uart_set_buffer( unsigned id, unsigned size );
 void platform_uart_send( unsigned id, uint8_t data );
+void platform_uart_queue( unsigned id, const uint8_t *data, size_t len );
+size_t platform_uart_pending( unsigned id );
+size_t platform_uart_read( unsigned id, uint8_t *buf, size_t len );
+// cb runs in interrupt context whenever a TX queue runs empty
+void platform_uart_on_sent( void ( *cb )( unsigned id ) );
+// cb runs in the console task when UART1 or UART2 has bytes to read
+void platform_uart_on_data( void ( *cb )( unsigned id ) );
 void platform_s_uart_send( unsigned id, uint8_t data );
 int platform_uart_recv( unsigned id, unsigned timer_id, timer_data_type timeout );
 int platform_s_uart_recv( unsigned id, timer_data_type timeout );
@@ -172,6 +197,23 @@ uint32_t platform_pwm_get_clock( void );
 uint32_t platform_pwm_set_duty( unsigned id, uint32_t data );
 uint32_t platform_pwm_get_duty( unsigned id );
 
+// Fades run by the LEDC; each keyframe ramps to duty (0 to NORMAL_PWM_DEPTH)
+// over ms milliseconds
+#define PLATFORM_PWM_MAX_KEYS 16
+
+typedef struct {
+  uint32_t duty;
+  uint32_t ms;
+} platform_pwm_key_t;
+
+typedef void (* platform_pwm_done_fn_t)( unsigned chan, void *arg );
+// returns at once; done runs in the LEDC interrupt after the last keyframe,
+// never with repeat
+int platform_pwm_fade( unsigned id, const platform_pwm_key_t *keys, unsigned num,
+                       bool repeat, platform_pwm_done_fn_t done, void *arg );
+// arg of the fade it stopped, or NULL
+void *platform_pwm_fade_stop( unsigned id );
+
 
 // *****************************************************************************
 // The platform ADC functions
@@ -199,26 +241,23 @@ void platform_adc_set_timer( unsigned id, uint32_t timer );
 enum
 {
   PLATFORM_I2C_SPEED_SLOW = 100000,
-  PLATFORM_I2C_SPEED_FAST = 400000
+  PLATFORM_I2C_SPEED_FAST = 400000,
+  PLATFORM_I2C_SPEED_FASTPLUS = 1000000
 };
 
-// I2C direction
-enum
-{
-  PLATFORM_I2C_DIRECTION_TRANSMITTER,
-  PLATFORM_I2C_DIRECTION_RECEIVER
-};
-
-// The platform UART functions
-uint32_t platform_i2c_setup( uint8_t i2c_num, uint16_t slave_addr, bool addr_10bit_en );
-void platform_uart_alt( int set );
+// Results of a transaction
+#define PLATFORM_I2C_OK       0
+#define PLATFORM_I2C_NACK     -1
+#define PLATFORM_I2C_TIMEOUT  -3
+#define PLATFORM_I2C_ARB_LOST -4
 
+typedef void (* platform_i2c_done_fn_t)( int err, void *arg );
 int platform_i2c_exists( unsigned id );
-//void platform_i2c_send_start( unsigned id );
-//void platform_i2c_send_stop( unsigned id );
-//int platform_i2c_send_address( unsigned id, uint16_t address, int direction );
-//int platform_i2c_send_byte( unsigned id, uint8_t data );
-int platform_i2c_recv_byte( uint16_t address, bool addr_10bit, uint8_t * data, uint8_t len, bool sendStop );
+uint32_t platform_i2c_setup( unsigned id, int sda, int scl, uint32_t speed );
+// Queues a write of tx, then a read into rx after a repeated start, and
+// returns at once; done runs in the I2C interrupt
+int platform_i2c_transfer( unsigned id, uint8_t addr, const uint8_t *tx, size_t tx_len,
+                           uint8_t *rx, size_t rx_len, platform_i2c_done_fn_t done, void *arg );
 
 // *****************************************************************************
 // Ethernet specific functions
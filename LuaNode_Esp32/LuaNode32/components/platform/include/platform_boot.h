@@ -0,0 +1,32 @@
+#ifndef __PLATFORM_BOOT_H__
+#define __PLATFORM_BOOT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+
+/*
+ * Boot phase timing. app_main times each step it takes, and the steps
+ * CONFIG_BOOT_FAST runs in a task of their own overlap the others, so
+ * each phase has its own start and end, in microseconds since boot.
+ */
+#define PLATFORM_BOOT_PHASES 12
+
+/* Starts timing a phase; the name must be a literal. Returns the handle
+ * for platform_boot_end(), or -1 once the table is full. */
+int platform_boot_begin(const char *name);
+void platform_boot_end(int phase);
+
+/* Boot is over when the message pump starts */
+void platform_boot_done(void);
+/* 0 while still booting */
+uint32_t platform_boot_total_us(void);
+
+/* Phase i in the order they began, false past the last one. end_us is 0
+ * for a phase that hasn't finished. */
+bool platform_boot_phase(int i, const char **name, uint32_t *start_us, uint32_t *end_us);
+
+/* Blinks the LED on GPIO2 twice from a timer, so nothing waits on it */
+void platform_boot_led(void);
+
+#endif
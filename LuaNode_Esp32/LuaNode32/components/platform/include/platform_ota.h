@@ -0,0 +1,25 @@
+#ifndef __PLATFORM_OTA_H__
+#define __PLATFORM_OTA_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "platform_partition.h"
+
+/*
+ * Two app slots, ota_0 and ota_1, and the otadata partition the bootloader
+ * picks one of them by. otadata holds two copies of a sequence number,
+ * a sector each; the bootloader starts slot (seq - 1) % 2 for the highest
+ * valid one. With both copies blank it starts ota_0, so an image flashed
+ * over serial to ota_0 still boots once otadata has been erased.
+ */
+
+/* The slot this image was started from; false without OTA partitions */
+bool platform_ota_running(platform_partition_t *info);
+
+/* The other slot, the one an update goes to */
+bool platform_ota_next(platform_partition_t *info);
+
+/* Start slot on the next boot */
+bool platform_ota_set_boot(const platform_partition_t *slot);
+
+#endif
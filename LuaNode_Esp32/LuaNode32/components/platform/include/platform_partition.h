@@ -1,5 +1,10 @@
+#ifndef __PLATFORM_PARTITION_H__
+#define __PLATFORM_PARTITION_H__
+
 //#define INTERNAL_FLASH_SECTOR_SIZE	SPI_FLASH_SEC_SIZE
+#ifndef INTERNAL_FLASH_SECTOR_SIZE   // cpu_esp32.h has it as well
 #define INTERNAL_FLASH_SECTOR_SIZE	4096
+#endif
 #define INTERNAL_FLASH_WRITE_UNIT_SIZE  4
 #define INTERNAL_FLASH_READ_UNIT_SIZE	  4
 
@@ -23,6 +28,11 @@ static inline bool is_cache_flash_addr (uint32_t addr)
 #define PLATFORM_PARTITION_SUBTYPE_DATA_WIFI   0x02
 
 #define PLATFORM_PARTITION_SUBTYPE_NODEMCU_SPIFFS 0x00
+#define PLATFORM_PARTITION_SUBTYPE_NODEMCU_LCSTORE 0x01
+#define PLATFORM_PARTITION_SUBTYPE_NODEMCU_LFS     0x02
+#define PLATFORM_PARTITION_SUBTYPE_NODEMCU_ASSETS  0x03
+#define PLATFORM_PARTITION_SUBTYPE_NODEMCU_LOG     0x04
+#define PLATFORM_PARTITION_SUBTYPE_NODEMCU_MQTTQ   0x05
 
 typedef struct {
   uint8_t  label[16];
@@ -41,6 +51,14 @@ typedef struct {
  */
 bool platform_partition_info (uint8_t idx, platform_partition_t *info);
 
+/**
+ * Look up a partition by its label.
+ * @param label Name as given in the partition table.
+ * @param info Buffer to store the info in.
+ * @returns True if the partition was found.
+ */
+bool platform_partition_find (const char *label, platform_partition_t *info);
+
 /**
  * Appends a partition entry to the partition table, if possible.
  * Intended for auto-creation of a SPIFFS partition.
@@ -48,3 +66,5 @@ bool platform_partition_info (uint8_t idx, platform_partition_t *info);
  * @returns True if the partition could be added, false if not.
  */
 bool platform_partition_add (const platform_partition_t *info);
+
+#endif
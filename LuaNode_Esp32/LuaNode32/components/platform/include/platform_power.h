@@ -0,0 +1,57 @@
+#ifndef __PLATFORM_POWER_H__
+#define __PLATFORM_POWER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+
+/*
+ * Light sleep whenever every task is blocked. FreeRTOS tickless idle works
+ * out the next timer itself, and for Lua that is the one timer the tmr
+ * wheel keeps armed for its next deadline, so the chip sleeps right up to
+ * it. WiFi goes to modem sleep and keeps the connection by waking for
+ * beacons, and incoming traffic, UART0 and the chosen GPIOs wake it early.
+ *
+ * Needs CONFIG_PM_ENABLE and CONFIG_FREERTOS_USE_TICKLESS_IDLE in the SDK
+ * configuration, the functions fail without them. Clock scaling only
+ * needs CONFIG_PM_ENABLE.
+ */
+#if defined(CONFIG_PM_ENABLE) && defined(CONFIG_FREERTOS_USE_TICKLESS_IDLE)
+#define PLATFORM_IDLE_SLEEP 1
+#endif
+
+/* Returns false if the build can't sleep or the SDK refused */
+bool platform_idle_sleep(bool enable);
+bool platform_idle_sleep_enabled(void);
+
+/* Wake on pin being at level, or stop waking on it for level < 0 */
+bool platform_idle_sleep_gpio(unsigned pin, int level);
+
+/*
+ * CPU clock: one of 80, 160 or 240 MHz, or PLATFORM_CPU_AUTO to run at the
+ * default clock while busy and drop to 80 MHz while idle. Below 80 MHz the
+ * APB clock would slow down with the CPU, and the UART and the timer group
+ * with it. Returns false if the build can't scale or the SDK refused.
+ */
+#define PLATFORM_CPU_AUTO 0
+bool platform_cpu_freq(uint32_t mhz);
+/* The setting, PLATFORM_CPU_AUTO or MHz; ets_get_cpu_frequency() has the
+ * clock right now */
+uint32_t platform_cpu_freq_get(void);
+
+/*
+ * Run at the default clock whatever the setting, around bursts of work
+ * such as a TLS handshake. Calls nest. Like the rest of the clock and
+ * sleep settings these are for the Lua task only.
+ */
+bool platform_cpu_boost(void);
+void platform_cpu_unboost(void);
+
+/*
+ * Keep out of light sleep, for as long as something counts on clocks that
+ * stop in it, such as the timer group timers. Calls nest.
+ */
+void platform_sleep_block(void);
+void platform_sleep_unblock(void);
+
+#endif
@@ -5,11 +5,24 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "vfs_int.h"
+#include "trace.h"
 
 // DEPRECATED, DON'T USE
 // Check for fd != 0 instead
 #define FS_OPEN_OK 1
 
+// A file descriptor is the vfs_file pointer itself, which an int holds on
+// the ESP32. The host build has 64 bit pointers and numbers them instead.
+#ifdef LUANODE_HOST
+vfs_file *vfs_file_of( int fd );
+int vfs_fd_of( vfs_file *f );
+void vfs_fd_free( int fd );
+#else
+#define vfs_file_of( fd ) ((vfs_file *)(fd))
+#define vfs_fd_of( f )    ((int)(f))
+#define vfs_fd_free( fd ) ((void)0)
+#endif
+
 // ---------------------------------------------------------------------------
 // file functions
 //
@@ -18,7 +31,8 @@
 //   fd: file descriptor
 //   Returns: VFS_RES_OK or negative value in case of error
 inline int32_t vfs_close( int fd ) {
-  vfs_file *f = (vfs_file *)fd;
+  vfs_file *f = vfs_file_of( fd );
+  vfs_fd_free( fd );
   return f ? f->fns->close( f ) : VFS_RES_ERR;
 }
 
@@ -28,8 +42,11 @@ inline int32_t vfs_close( int fd ) {
 //   len: requested length
 //   Returns: Number of bytes read, or VFS_RES_ERR in case of error
 inline int32_t vfs_read( int fd, void *ptr, size_t len ) {
-  vfs_file *f = (vfs_file *)fd;
-  return f ? f->fns->read( f, ptr, len ) : VFS_RES_ERR;
+  vfs_file *f = vfs_file_of( fd );
+  TRACE( TRACE_VFS_READ_B, fd, len );
+  int32_t res = f ? f->fns->read( f, ptr, len ) : VFS_RES_ERR;
+  TRACE( TRACE_VFS_READ_E, fd, res );
+  return res;
 }
 
 // vfs_write - write data to file
@@ -38,8 +55,11 @@ inline int32_t vfs_read( int fd, void *ptr, size_t len ) {
 //   len: requested length
 //   Returns: Number of bytes written, or VFS_RES_ERR in case of error
 inline int32_t vfs_write( int fd, const void *ptr, size_t len ) {
-  vfs_file *f = (vfs_file *)fd;
-  return f ? f->fns->write( f, ptr, len ) : VFS_RES_ERR;
+  vfs_file *f = vfs_file_of( fd );
+  TRACE( TRACE_VFS_WRITE_B, fd, len );
+  int32_t res = f ? f->fns->write( f, ptr, len ) : VFS_RES_ERR;
+  TRACE( TRACE_VFS_WRITE_E, fd, res );
+  return res;
 }
 
 int vfs_getc( int fd );
@@ -54,7 +74,7 @@ int vfs_ungetc( int c, int fd );
 //           VFS_SEEK_END - set pointer to end of file + off
 //   Returns: New position, or VFS_RES_ERR in case of error
 inline int32_t vfs_lseek( int fd, int32_t off, int whence ) {
-  vfs_file *f = (vfs_file *)fd;
+  vfs_file *f = vfs_file_of( fd );
   return f ? f->fns->lseek( f, off, whence ) : VFS_RES_ERR;
 }
 
@@ -62,7 +82,7 @@ inline int32_t vfs_lseek( int fd, int32_t off, int whence ) {
 //   fd: file descriptor
 //   Returns: 0 if not at end, != 0 if end of file
 inline int32_t vfs_eof( int fd ) {
-  vfs_file *f = (vfs_file *)fd;
+  vfs_file *f = vfs_file_of( fd );
   return f ? f->fns->eof( f ) : VFS_RES_ERR;
 }
 
@@ -70,7 +90,7 @@ inline int32_t vfs_eof( int fd ) {
 //   fd: file descriptor
 //   Returns: Current position
 inline int32_t vfs_tell( int fd ) {
-  vfs_file *f = (vfs_file *)fd;
+  vfs_file *f = vfs_file_of( fd );
   return f ? f->fns->tell( f ) : VFS_RES_ERR;
 }
 
@@ -78,7 +98,7 @@ inline int32_t vfs_tell( int fd ) {
 //   fd: file descriptor
 //   Returns: VFS_RES_OK, or VFS_RES_ERR in case of error
 inline int32_t vfs_flush( int fd ) {
-  vfs_file *f = (vfs_file *)fd;
+  vfs_file *f = vfs_file_of( fd );
   return f ? f->fns->flush( f ) : VFS_RES_ERR;
 }
 
@@ -86,7 +106,7 @@ inline int32_t vfs_flush( int fd ) {
 //   fd: file descriptor
 //   Returns: File size
 inline uint32_t vfs_size( int fd ) {
-  vfs_file *f = (vfs_file *)fd;
+  vfs_file *f = vfs_file_of( fd );
   return f && f->fns->size ? f->fns->size( f ) : 0;
 }
 
@@ -247,4 +267,8 @@ void vfs_register_rtc_cb( int32_t (*cb)( vfs_time *tm ) );
 //   Returns: pointer to basename within path string
 const char *vfs_basename( const char *path );
 
+// vfs_generation - changes whenever a file may have been created, removed
+//   or renamed, or the current drive changed; for caches of where files are
+extern volatile uint32_t vfs_generation;
+
 #endif
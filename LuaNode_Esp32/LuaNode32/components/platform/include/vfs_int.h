@@ -5,6 +5,7 @@
 
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #if 0
 #include "spiffs.h"
@@ -131,6 +132,23 @@ typedef const struct vfs_fs_fns vfs_fs_fns;
 vfs_fs_fns *myspiffs_realm( const char *inname, char **outname, int set_current_drive );
 vfs_fs_fns *myfatfs_realm( const char *inname, char **outname, int set_current_drive );
 
+typedef struct {
+  uint32_t cache_pages;
+  uint32_t cache_hits;
+  uint32_t cache_misses;
+  uint32_t cache_evictions;   // pages dropped to make room for another
+  uint32_t gc_runs;
+  uint32_t writes;            // SPIFFS_write calls through the vfs
+  uint32_t write_avg_us;
+  uint32_t write_max_us;
+  uint32_t blocks;
+} myspiffs_stats_t;
+
+// Counters since mount or the last reset, false without CONFIG_SPIFFS_STATS
+bool myspiffs_stats( myspiffs_stats_t *st, bool reset );
+// Erase count of a block, -1 if never erased, < -1 on error
+int32_t myspiffs_erase_count( uint32_t block );
+
 int32_t vfs_get_rtc( vfs_time *tm );
 
 #endif
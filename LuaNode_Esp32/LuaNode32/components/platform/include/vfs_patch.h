@@ -0,0 +1,47 @@
+#ifndef __VFS_PATCH_H__
+#define __VFS_PATCH_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Applies a binary patch made by tools/mkpatch.py to a file, as the patch
+ * streams in. The result is written to name.new and only replaces the file
+ * on commit. Patches are little-endian:
+ *
+ *   "LNP1", uint32 old size, uint32 old crc32, uint32 new size,
+ *   uint8 new sha256[32], then ops until END:
+ *
+ *   COPY  0x01 uint32 offset, uint32 len    bytes of the old file
+ *   ADD   0x02 uint32 len, len bytes        literal bytes
+ *   END   0x00
+ *
+ * A patch whose old size and crc32 are 0 creates the file. Files can't be
+ * renamed over one another, so commit moves the old file to name.old
+ * first; if that's all a reset left behind, the next vfs_patch_open()
+ * puts it back.
+ */
+
+#define VFS_PATCH_MAGIC   0x31504e4c    // "LNP1"
+
+typedef struct vfs_patch vfs_patch_t;
+
+/* NULL only when out of memory; other errors show at the first write */
+vfs_patch_t *vfs_patch_open(const char *name);
+
+/* False once anything went wrong, see vfs_patch_error() */
+bool vfs_patch_write(vfs_patch_t *p, const void *data, size_t len);
+
+/* True if the patch was complete and the new file checks out */
+bool vfs_patch_finish(vfs_patch_t *p);
+
+/* Replace the file with the finished new one */
+bool vfs_patch_commit(vfs_patch_t *p);
+
+const char *vfs_patch_error(const vfs_patch_t *p);
+
+/* Frees p; an uncommitted name.new is removed */
+void vfs_patch_close(vfs_patch_t *p);
+
+#endif
@@ -0,0 +1,197 @@
+// Store of compiled Lua chunks that run in place from mapped flash
+
+#include "lc_store.h"
+#include "platform.h"
+#include "platform_partition.h"
+#include "esp_spi_flash.h"
+#include <string.h>
+
+#define LC_STORE_BLANK  0xffffffff
+#define LC_STORE_ALIGN  32              // flash cache line
+
+typedef struct {
+  uint32_t magic;
+  uint32_t size;
+  uint32_t sum;
+  char name[LC_STORE_NAME_LEN];
+} lc_store_hdr_t;
+
+typedef struct {
+  uint8_t subtype;
+  uint32_t offs;                        // partition, physical flash address
+  uint32_t size;
+  const uint8_t *map;
+  uint32_t end;                         // offset of the first free record
+  bool damaged;
+} lc_store_part_t;
+
+static lc_store_part_t lc_stores[] = {
+  [LC_STORE_FLASH] = { PLATFORM_PARTITION_SUBTYPE_NODEMCU_LCSTORE },
+  [LC_STORE_LFS]   = { PLATFORM_PARTITION_SUBTYPE_NODEMCU_LFS },
+};
+
+#define LC_STORE_NEXT(offs, size) \
+  (((offs) + sizeof(lc_store_hdr_t) + (size) + LC_STORE_ALIGN - 1) & ~(LC_STORE_ALIGN - 1))
+
+// Headers are read through the flash API rather than the mapping, so that
+// no cache line ever holds the blank flash a later record is written to.
+static bool lc_store_read_hdr( lc_store_part_t *st, uint32_t offs, lc_store_hdr_t *hdr )
+{
+  if (offs + sizeof(lc_store_hdr_t) > st->size)
+    return false;
+  platform_flash_read( hdr, st->offs + offs, sizeof(lc_store_hdr_t) );
+  return true;
+}
+
+static lc_store_part_t *lc_store_open( int store )
+{
+  if (store < 0 || store >= sizeof(lc_stores) / sizeof(lc_stores[0]))
+    return NULL;
+  lc_store_part_t *st = &lc_stores[store];
+  if (st->map)
+    return st;
+
+  platform_partition_t info;
+  uint8_t i = 0;
+  bool found = false;
+  while (!found && platform_partition_info( i++, &info ))
+    found = info.type == PLATFORM_PARTITION_TYPE_NODEMCU &&
+            info.subtype == st->subtype;
+  if (!found)
+    return NULL;
+
+  // The mapping is never released, loaded chunks keep pointing into it
+  uint32_t base = info.offs & ~0xffff;
+  const void *ptr;
+  spi_flash_mmap_handle_t handle;
+  if (spi_flash_mmap( base, info.offs - base + info.size, SPI_FLASH_MMAP_DATA,
+                      &ptr, &handle ) != ESP_OK)
+    return NULL;
+  st->offs = info.offs;
+  st->size = info.size;
+  st->map = (const uint8_t *)ptr + (info.offs - base);
+
+  lc_store_hdr_t hdr;
+  uint32_t offs = 0;
+  while (lc_store_read_hdr( st, offs, &hdr ) && hdr.magic == LC_STORE_MAGIC &&
+         hdr.size <= st->size)
+    offs = LC_STORE_NEXT( offs, hdr.size );
+  st->end = offs < st->size ? offs : st->size;
+  // Anything but blank flash here is a record whose write never finished
+  st->damaged = st->end < st->size && hdr.magic != LC_STORE_BLANK;
+  return st;
+}
+
+uint32_t lc_store_sum( const void *data, uint32_t size )
+{
+  const uint8_t *p = (const uint8_t *)data;
+  uint32_t h = 2166136261u;
+  while (size--)
+    h = (h ^ *p++) * 16777619u;
+  return h;
+}
+
+// Newest record called name, or -1
+static int32_t lc_store_lookup( lc_store_part_t *st, const char *name, lc_store_hdr_t *found )
+{
+  int32_t at = -1;
+  lc_store_hdr_t hdr;
+  for (uint32_t offs = 0; offs < st->end; offs = LC_STORE_NEXT( offs, hdr.size )) {
+    lc_store_read_hdr( st, offs, &hdr );
+    if (strncmp( hdr.name, name, LC_STORE_NAME_LEN ) == 0) {
+      *found = hdr;
+      at = offs;
+    }
+  }
+  return at;
+}
+
+const void *lc_store_find( int store, const char *name, uint32_t size, uint32_t sum )
+{
+  lc_store_part_t *st = lc_store_open( store );
+  lc_store_hdr_t hdr;
+  int32_t offs = st ? lc_store_lookup( st, name, &hdr ) : -1;
+  if (offs < 0 || hdr.size != size || hdr.sum != sum)
+    return NULL;
+  return st->map + offs + sizeof(lc_store_hdr_t);
+}
+
+const void *lc_store_get( int store, const char *name, uint32_t *size )
+{
+  lc_store_part_t *st = lc_store_open( store );
+  lc_store_hdr_t hdr;
+  int32_t offs = st ? lc_store_lookup( st, name, &hdr ) : -1;
+  if (offs < 0)
+    return NULL;
+  *size = hdr.size;
+  return st->map + offs + sizeof(lc_store_hdr_t);
+}
+
+static bool lc_store_blank( lc_store_part_t *st, uint32_t offs, uint32_t size )
+{
+  uint32_t buf[16];
+  while (size) {
+    uint32_t n = size < sizeof(buf) ? size : sizeof(buf);
+    platform_flash_read( buf, st->offs + offs, n );
+    for (uint32_t i = 0; i < n / 4; i++)
+      if (buf[i] != LC_STORE_BLANK)
+        return false;
+    offs += n;
+    size -= n;
+  }
+  return true;
+}
+
+const void *lc_store_add( int store, const char *name, const void *data, uint32_t size )
+{
+  lc_store_part_t *st = lc_store_open( store );
+  if (!st || st->damaged)
+    return NULL;
+  uint32_t offs = st->end;
+  uint32_t next = LC_STORE_NEXT( offs, size );
+  if (next > st->size || next < offs)
+    return NULL;
+  if (!lc_store_blank( st, offs, next - offs )) {
+    st->damaged = true;
+    return NULL;
+  }
+
+  lc_store_hdr_t hdr;
+  memset( &hdr, 0, sizeof(hdr) );
+  hdr.magic = LC_STORE_MAGIC;
+  hdr.size = size;
+  hdr.sum = lc_store_sum( data, size );
+  strncpy( hdr.name, name, LC_STORE_NAME_LEN - 1 );
+
+  // Data first, so a record only counts once its header is in place
+  uint32_t dst = st->offs + offs + sizeof(lc_store_hdr_t);
+  if (platform_flash_write( data, dst, size ) != size ||
+      platform_flash_write( &hdr, st->offs + offs, sizeof(hdr) ) != sizeof(hdr))
+    return NULL;
+  st->end = next;
+  return st->map + offs + sizeof(lc_store_hdr_t);
+}
+
+bool lc_store_erase( int store )
+{
+  lc_store_part_t *st = lc_store_open( store );
+  if (!st)
+    return false;
+  uint32_t first = platform_flash_get_sector_of_address( st->offs );
+  uint32_t last = platform_flash_get_sector_of_address( st->offs + st->size - 1 );
+  for (uint32_t s = first; s <= last; s++)
+    platform_flash_erase_sector( s );
+  st->end = 0;
+  st->damaged = false;
+  return true;
+}
+
+bool lc_store_info( int store, uint32_t *used, uint32_t *total )
+{
+  lc_store_part_t *st = lc_store_open( store );
+  if (!st)
+    return false;
+  *used = st->end;
+  *total = st->size;
+  return true;
+}
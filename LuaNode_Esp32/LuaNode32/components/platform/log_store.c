@@ -0,0 +1,241 @@
+// Circular log of CRC framed records in a raw flash partition
+
+#include "log_store.h"
+#include "platform.h"
+#include "platform_partition.h"
+#include "crc16.h"
+#include <string.h>
+
+#define LOG_STORE_MAGIC  0x3147524c     // "LRG1"
+#define LOG_STORE_SECTOR INTERNAL_FLASH_SECTOR_SIZE
+
+typedef struct {
+  uint32_t magic;
+  uint32_t seq;
+} log_store_sec_t;
+
+typedef struct {
+  uint16_t len;
+  uint16_t crc;
+} log_store_rec_t;
+
+#define LOG_STORE_REC_SIZE(len) ((sizeof(log_store_rec_t) + (len) + 3) & ~3)
+#define LOG_STORE_FIRST         sizeof(log_store_sec_t)
+
+static inline uint32_t log_store_addr( log_store_t *ls, uint32_t seq, uint32_t offs )
+{
+  return ls->offs + (seq % ls->nsec) * LOG_STORE_SECTOR + offs;
+}
+
+static uint16_t log_store_crc( const void *data, uint16_t len )
+{
+  uint16_t crc = crc16_ccitt( CRC16_INITIAL_CRC, &len, sizeof(len) );
+  return crc16_ccitt( crc, data, len );
+}
+
+// Whether the sector for seq holds seq, rather than an older round or blank
+static bool log_store_has( log_store_t *ls, uint32_t seq )
+{
+  log_store_sec_t hdr;
+  platform_flash_read( &hdr, log_store_addr( ls, seq, 0 ), sizeof(hdr) );
+  return hdr.magic == LOG_STORE_MAGIC && hdr.seq == seq;
+}
+
+// Copy the record at offs into buf and return its length, or -1 if there
+// is blank flash, a torn record or the end of the sector
+static int32_t log_store_read( log_store_t *ls, uint32_t seq, uint32_t offs, uint8_t *buf )
+{
+  log_store_rec_t rec;
+  if (offs + sizeof(rec) > LOG_STORE_SECTOR)
+    return -1;
+  uint32_t addr = log_store_addr( ls, seq, offs );
+  platform_flash_read( &rec, addr, sizeof(rec) );
+  if (rec.len == 0 || rec.len > LOG_STORE_MAX_RECORD ||
+      offs + LOG_STORE_REC_SIZE(rec.len) > LOG_STORE_SECTOR)
+    return -1;
+  platform_flash_read( buf, addr + sizeof(rec), rec.len );
+  if (log_store_crc( buf, rec.len ) != rec.crc)
+    return -1;
+  return rec.len;
+}
+
+// Offset after the last good record of a sector, and how many there are
+static uint32_t log_store_scan( log_store_t *ls, uint32_t seq, uint32_t *count )
+{
+  uint8_t buf[LOG_STORE_MAX_RECORD];
+  uint32_t offs = LOG_STORE_FIRST;
+  int32_t len;
+  *count = 0;
+  while ((len = log_store_read( ls, seq, offs, buf )) >= 0) {
+    offs += LOG_STORE_REC_SIZE(len);
+    (*count)++;
+  }
+  return offs;
+}
+
+static bool log_store_open( log_store_t *ls )
+{
+  if (ls->opened)
+    return ls->found;
+  ls->opened = true;
+
+  platform_partition_t info;
+  uint8_t i = 0;
+  bool found = false;
+  while (!found && platform_partition_info( i++, &info ))
+    found = info.type == PLATFORM_PARTITION_TYPE_NODEMCU &&
+            info.subtype == ls->subtype;
+  if (!found || info.size / LOG_STORE_SECTOR < 2)
+    return false;
+  ls->offs = info.offs;
+  ls->nsec = info.size / LOG_STORE_SECTOR;
+  ls->empty = true;
+
+  for (uint32_t s = 0; s < ls->nsec; s++) {
+    log_store_sec_t hdr;
+    platform_flash_read( &hdr, ls->offs + s * LOG_STORE_SECTOR, sizeof(hdr) );
+    if (hdr.magic == LOG_STORE_MAGIC && hdr.seq % ls->nsec == s &&
+        (ls->empty || hdr.seq > ls->head)) {
+      ls->head = hdr.seq;
+      ls->empty = false;
+    }
+  }
+  if (!ls->empty) {
+    ls->oldest = ls->head;
+    while (ls->oldest > 0 && ls->head - ls->oldest + 1 < ls->nsec &&
+           log_store_has( ls, ls->oldest - 1 ))
+      ls->oldest--;
+    uint32_t count, blank;
+    ls->end = log_store_scan( ls, ls->head, &count );
+    // Past a torn record nothing can be written safely, start afresh
+    if (ls->end + sizeof(blank) <= LOG_STORE_SECTOR) {
+      platform_flash_read( &blank, log_store_addr( ls, ls->head, ls->end ), sizeof(blank) );
+      if (blank != 0xffffffff)
+        ls->end = LOG_STORE_SECTOR;
+    }
+    ls->next = ls->head + 1;
+  }
+  ls->found = true;
+  return true;
+}
+
+// Erase the next sector of the ring and make it the head
+static bool log_store_advance( log_store_t *ls )
+{
+  uint32_t seq = ls->next;
+  log_store_sec_t hdr = { LOG_STORE_MAGIC, seq };
+  uint32_t addr = log_store_addr( ls, seq, 0 );
+  if (platform_flash_erase_sector( platform_flash_get_sector_of_address( addr ) ) != PLATFORM_OK ||
+      platform_flash_write( &hdr, addr, sizeof(hdr) ) != sizeof(hdr))
+    return false;
+  if (ls->empty)
+    ls->oldest = seq;
+  else if (seq - ls->oldest >= ls->nsec)
+    ls->oldest = seq - ls->nsec + 1;
+  ls->head = seq;
+  ls->next = seq + 1;
+  ls->end = LOG_STORE_FIRST;
+  ls->empty = false;
+  return true;
+}
+
+bool log_store_append( log_store_t *ls, const void *data, uint32_t len )
+{
+  if (!log_store_open( ls ) || len == 0 || len > LOG_STORE_MAX_RECORD)
+    return false;
+  uint32_t size = LOG_STORE_REC_SIZE(len);
+  if ((ls->empty || ls->end + size > LOG_STORE_SECTOR) && !log_store_advance( ls ))
+    return false;
+
+  // Header and data go out in one write, so a reset can't separate them
+  uint8_t buf[LOG_STORE_REC_SIZE(LOG_STORE_MAX_RECORD)] PLATFORM_ALIGNMENT;
+  log_store_rec_t *rec = (log_store_rec_t *)buf;
+  rec->len = len;
+  rec->crc = log_store_crc( data, len );
+  memcpy( buf + sizeof(*rec), data, len );
+  memset( buf + sizeof(*rec) + len, 0xff, size - sizeof(*rec) - len );
+  uint32_t addr = log_store_addr( ls, ls->head, ls->end );
+  bool ok = platform_flash_write( buf, addr, size ) == size;
+  ls->end = ok ? ls->end + size : LOG_STORE_SECTOR;
+  return ok;
+}
+
+bool log_store_first( log_store_t *ls, log_store_pos_t *pos )
+{
+  if (!log_store_open( ls ))
+    return false;
+  pos->seq = ls->empty ? ls->next : ls->oldest;
+  pos->offs = LOG_STORE_FIRST;
+  return true;
+}
+
+bool log_store_tail( log_store_t *ls, uint32_t n, log_store_pos_t *pos )
+{
+  if (!log_store_open( ls ))
+    return false;
+  if (ls->empty)
+    return log_store_first( ls, pos );
+  // Count back sector by sector until there are enough records
+  uint32_t seq = ls->head, have = 0, count;
+  for (;;) {
+    log_store_scan( ls, seq, &count );
+    if (have + count >= n || seq == ls->oldest)
+      break;
+    have += count;
+    seq--;
+  }
+  pos->seq = seq;
+  pos->offs = LOG_STORE_FIRST;
+  uint8_t buf[LOG_STORE_MAX_RECORD];
+  for (uint32_t skip = have + count > n ? have + count - n : 0; skip; skip--)
+    log_store_next( ls, pos, buf );
+  return true;
+}
+
+int32_t log_store_next( log_store_t *ls, log_store_pos_t *pos, void *buf )
+{
+  if (!log_store_open( ls ))
+    return -1;
+  for (;;) {
+    if (ls->empty || pos->seq > ls->head)
+      return -1;
+    if (pos->seq < ls->oldest) {
+      pos->seq = ls->oldest;
+      pos->offs = LOG_STORE_FIRST;
+    }
+    // Stay at the end of the head, so that later appends are picked up
+    int32_t len = -1;
+    if (pos->seq != ls->head || pos->offs < ls->end)
+      len = log_store_read( ls, pos->seq, pos->offs, (uint8_t *)buf );
+    if (len >= 0) {
+      pos->offs += LOG_STORE_REC_SIZE(len);
+      return len;
+    }
+    if (pos->seq == ls->head)
+      return -1;
+    pos->seq++;
+    pos->offs = LOG_STORE_FIRST;
+  }
+}
+
+bool log_store_clear( log_store_t *ls )
+{
+  if (!log_store_open( ls ))
+    return false;
+  uint32_t first = platform_flash_get_sector_of_address( ls->offs );
+  for (uint32_t s = first; s < first + ls->nsec; s++)
+    if (platform_flash_erase_sector( s ) != PLATFORM_OK)
+      return false;
+  // Sequence numbers carry on, positions taken before move to the new records
+  ls->empty = true;
+  return true;
+}
+
+bool log_store_info( log_store_t *ls, uint32_t *used, uint32_t *total )
+{
+  if (!log_store_open( ls ))
+    return false;
+  *used = ls->empty ? 0 : (ls->head - ls->oldest) * LOG_STORE_SECTOR + ls->end;
+  *total = ls->nsec * LOG_STORE_SECTOR;
+  return true;
+}
@@ -0,0 +1,705 @@
+// vfs backend for FAT volumes, on top of the FatFS of ESP-IDF
+//
+// Two logical drives are known: /FAT is a wear-levelled FAT partition in
+// the internal flash, /SD0 an SD card on the SDMMC host or on SPI. Each is
+// mounted on first use and maps to the FatFS drive "N:" of its diskio
+// driver, so "/SD0/log/a.txt" reaches FatFS as "1:/log/a.txt".
+
+#include "sdkconfig.h"
+
+#ifdef CONFIG_BUILD_FATFS
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "vfs_int.h"
+#include "user_config.h"
+#include "ff.h"
+#include "diskio.h"
+#ifdef CONFIG_FATFS_FLASH
+#include "esp_partition.h"
+#include "wear_levelling.h"
+#endif
+#ifdef CONFIG_FATFS_SDCARD
+#include "driver/sdmmc_host.h"
+#include "driver/sdspi_host.h"
+#include "sdmmc_cmd.h"
+#endif
+
+enum { LDRV_FLASH, LDRV_SD, LDRV_COUNT };
+
+static const char *const ldrv_names[LDRV_COUNT] = { "FAT", "SD0" };
+
+typedef struct {
+  FATFS fs;
+  BYTE pdrv;      // FatFS drive number
+  bool mounted;
+#ifdef CONFIG_FATFS_FLASH
+  wl_handle_t wl;
+#endif
+#ifdef CONFIG_FATFS_SDCARD
+  sdmmc_card_t card;
+#endif
+} myfatfs_vol_t;
+
+static myfatfs_vol_t *vols[LDRV_COUNT];
+
+// current logical drive, -1 while another file system is current
+static int current_drive = -1;
+
+// drive of the path the realm resolved last, which fsinfo reports on
+static int realm_drive = -1;
+
+static FRESULT last_result = FR_OK;
+
+#define FATFS_MKFS_WORK  4096
+
+
+// ---------------------------------------------------------------------------
+// volumes
+//
+#ifdef CONFIG_FATFS_FLASH
+static bool attach_flash( myfatfs_vol_t *v ) {
+  const esp_partition_t *part = esp_partition_find_first(
+      ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_FAT, CONFIG_FATFS_FLASH_LABEL );
+  if (!part) {
+    NODE_ERR("No FAT partition labelled %s\n", CONFIG_FATFS_FLASH_LABEL);
+    return false;
+  }
+  if (wl_mount( part, &v->wl ) != ESP_OK)
+    return false;
+  if (ff_diskio_register_wl_partition( v->pdrv, v->wl ) != ESP_OK) {
+    wl_unmount( v->wl );
+    return false;
+  }
+  return true;
+}
+#endif
+
+#ifdef CONFIG_FATFS_SDCARD
+static bool attach_sdcard( myfatfs_vol_t *v ) {
+#ifdef CONFIG_FATFS_SDCARD_SPI
+  sdmmc_host_t host = SDSPI_HOST_DEFAULT();
+  sdspi_slot_config_t slot = SDSPI_SLOT_CONFIG_DEFAULT();
+  slot.gpio_miso = CONFIG_FATFS_SDSPI_MISO;
+  slot.gpio_mosi = CONFIG_FATFS_SDSPI_MOSI;
+  slot.gpio_sck  = CONFIG_FATFS_SDSPI_CLK;
+  slot.gpio_cs   = CONFIG_FATFS_SDSPI_CS;
+  if (host.init() != ESP_OK)
+    return false;
+  if (sdspi_host_init_slot( host.slot, &slot ) != ESP_OK)
+    goto fail;
+#else
+  sdmmc_host_t host = SDMMC_HOST_DEFAULT();
+  sdmmc_slot_config_t slot = SDMMC_SLOT_CONFIG_DEFAULT();
+  slot.width = CONFIG_FATFS_SDMMC_WIDTH;
+  if (host.init() != ESP_OK)
+    return false;
+  if (sdmmc_host_init_slot( host.slot, &slot ) != ESP_OK)
+    goto fail;
+#endif
+  if (sdmmc_card_init( &host, &v->card ) != ESP_OK) {
+    NODE_ERR("No SD card\n");
+    goto fail;
+  }
+  ff_diskio_register_sdmmc( v->pdrv, &v->card );
+  return true;
+
+fail:
+  host.deinit();
+  return false;
+}
+#endif
+
+static void detach( int ldrv, myfatfs_vol_t *v ) {
+  ff_diskio_register( v->pdrv, NULL );
+#ifdef CONFIG_FATFS_FLASH
+  if (ldrv == LDRV_FLASH)
+    wl_unmount( v->wl );
+#endif
+}
+
+static bool mount_drive( int ldrv ) {
+  myfatfs_vol_t *v = vols[ldrv];
+  char path[3] = "0:";
+
+  if (v && v->mounted)
+    return true;
+  if (!v) {
+    if (!(v = (myfatfs_vol_t *)calloc( 1, sizeof( myfatfs_vol_t ) )))
+      return false;
+    vols[ldrv] = v;
+  }
+  if (ff_diskio_get_drive( &v->pdrv ) != ESP_OK)
+    return false;
+
+  bool attached = false;
+#ifdef CONFIG_FATFS_FLASH
+  if (ldrv == LDRV_FLASH)
+    attached = attach_flash( v );
+#endif
+#ifdef CONFIG_FATFS_SDCARD
+  if (ldrv == LDRV_SD)
+    attached = attach_sdcard( v );
+#endif
+  if (!attached)
+    return false;
+
+  path[0] += v->pdrv;
+  last_result = f_mount( &v->fs, path, 1 );
+#ifdef CONFIG_FATFS_FLASH
+  // a fresh partition gets formatted, a card is left alone
+  if (last_result == FR_NO_FILESYSTEM && ldrv == LDRV_FLASH) {
+    void *work = malloc( FATFS_MKFS_WORK );
+    if (work) {
+      NODE_ERR("Formatting FAT partition...\n");
+      last_result = f_mkfs( path, FM_ANY | FM_SFD, FATFS_MKFS_WORK, work, FATFS_MKFS_WORK );
+      free( work );
+      if (last_result == FR_OK)
+        last_result = f_mount( &v->fs, path, 1 );
+    }
+  }
+#endif
+  if (last_result != FR_OK) {
+    f_mount( NULL, path, 0 );
+    detach( ldrv, v );
+    return false;
+  }
+  v->mounted = true;
+  return true;
+}
+
+static int32_t umount_drive( int ldrv ) {
+  myfatfs_vol_t *v = vols[ldrv];
+  char path[3] = "0:";
+
+  if (!v || !v->mounted)
+    return VFS_RES_ERR;
+  path[0] += v->pdrv;
+  f_mount( NULL, path, 0 );
+  detach( ldrv, v );
+  v->mounted = false;
+  if (current_drive == ldrv)
+    current_drive = -1;
+  if (realm_drive == ldrv)
+    realm_drive = -1;
+  return VFS_RES_OK;
+}
+
+
+// ---------------------------------------------------------------------------
+// forward declarations and function tables
+//
+static int32_t myfatfs_close( const struct vfs_file *fd );
+static int32_t myfatfs_read( const struct vfs_file *fd, void *ptr, size_t len );
+static int32_t myfatfs_write( const struct vfs_file *fd, const void *ptr, size_t len );
+static int32_t myfatfs_lseek( const struct vfs_file *fd, int32_t off, int whence );
+static int32_t myfatfs_eof( const struct vfs_file *fd );
+static int32_t myfatfs_tell( const struct vfs_file *fd );
+static int32_t myfatfs_flush( const struct vfs_file *fd );
+static uint32_t myfatfs_fsize( const struct vfs_file *fd );
+static int32_t myfatfs_ferrno( const struct vfs_file *fd );
+
+static int32_t  myfatfs_closedir( const struct vfs_dir *dd );
+static vfs_item *myfatfs_readdir( const struct vfs_dir *dd );
+
+static void        myfatfs_iclose( const struct vfs_item *di );
+static uint32_t    myfatfs_isize( const struct vfs_item *di );
+static int32_t     myfatfs_time( const struct vfs_item *di, struct vfs_time *tm );
+static const char *myfatfs_name( const struct vfs_item *di );
+static int32_t     myfatfs_is_dir( const struct vfs_item *di );
+static int32_t     myfatfs_is_rdonly( const struct vfs_item *di );
+static int32_t     myfatfs_is_hidden( const struct vfs_item *di );
+static int32_t     myfatfs_is_sys( const struct vfs_item *di );
+static int32_t     myfatfs_is_arch( const struct vfs_item *di );
+
+static vfs_vol  *myfatfs_mount( const char *name, int num );
+static vfs_file *myfatfs_open( const char *name, const char *mode );
+static vfs_dir  *myfatfs_opendir( const char *name );
+static vfs_item *myfatfs_stat( const char *name );
+static int32_t  myfatfs_remove( const char *name );
+static int32_t  myfatfs_rename( const char *oldname, const char *newname );
+static int32_t  myfatfs_mkdir( const char *name );
+static int32_t  myfatfs_fsinfo( uint32_t *total, uint32_t *used );
+static int32_t  myfatfs_chdrive( const char *ldrv );
+static int32_t  myfatfs_chdir( const char *path );
+static int32_t  myfatfs_errno( void );
+static void     myfatfs_clearerr( void );
+
+static int32_t myfatfs_umount( const struct vfs_vol *vol );
+
+static vfs_fs_fns myfatfs_fs_fns = {
+  .mount    = myfatfs_mount,
+  .open     = myfatfs_open,
+  .opendir  = myfatfs_opendir,
+  .stat     = myfatfs_stat,
+  .remove   = myfatfs_remove,
+  .rename   = myfatfs_rename,
+  .mkdir    = myfatfs_mkdir,
+  .fsinfo   = myfatfs_fsinfo,
+  .fscfg    = NULL,
+  .format   = NULL,
+  .chdrive  = myfatfs_chdrive,
+  .chdir    = myfatfs_chdir,
+  .ferrno   = myfatfs_errno,
+  .clearerr = myfatfs_clearerr
+};
+
+static vfs_file_fns myfatfs_file_fns = {
+  .close     = myfatfs_close,
+  .read      = myfatfs_read,
+  .write     = myfatfs_write,
+  .lseek     = myfatfs_lseek,
+  .eof       = myfatfs_eof,
+  .tell      = myfatfs_tell,
+  .flush     = myfatfs_flush,
+  .size      = myfatfs_fsize,
+  .ferrno    = myfatfs_ferrno
+};
+
+static vfs_item_fns myfatfs_item_fns = {
+  .close     = myfatfs_iclose,
+  .size      = myfatfs_isize,
+  .time      = myfatfs_time,
+  .name      = myfatfs_name,
+  .is_dir    = myfatfs_is_dir,
+  .is_rdonly = myfatfs_is_rdonly,
+  .is_hidden = myfatfs_is_hidden,
+  .is_sys    = myfatfs_is_sys,
+  .is_arch   = myfatfs_is_arch
+};
+
+static vfs_dir_fns myfatfs_dd_fns = {
+  .close     = myfatfs_closedir,
+  .readdir   = myfatfs_readdir
+};
+
+static vfs_vol_fns myfatfs_vol_fns = {
+  .umount    = myfatfs_umount
+};
+
+
+// ---------------------------------------------------------------------------
+// specific struct extensions
+//
+struct myvfs_vol {
+  struct vfs_vol vfs_vol;
+  int ldrv;
+};
+
+struct myvfs_file {
+  struct vfs_file vfs_file;
+  FIL fp;
+};
+
+struct myvfs_dir {
+  struct vfs_dir vfs_dir;
+  DIR dp;
+};
+
+struct myvfs_stat {
+  struct vfs_item vfs_item;
+  FILINFO fno;
+};
+
+#define CHECK_RES(r) ((last_result = (r)) == FR_OK ? VFS_RES_OK : VFS_RES_ERR)
+
+
+// ---------------------------------------------------------------------------
+// volume functions
+//
+static int32_t myfatfs_umount( const struct vfs_vol *vol ) {
+  const struct myvfs_vol *myvol = (const struct myvfs_vol *)vol;
+  int32_t res = umount_drive( myvol->ldrv );
+
+  free( (void *)vol );
+  return res;
+}
+
+
+// ---------------------------------------------------------------------------
+// file functions
+//
+#define GET_FIL_FP(descr) \
+  const struct myvfs_file *myfd = (const struct myvfs_file *)descr; \
+  FIL *fp = (FIL *)&(myfd->fp);
+
+static int32_t myfatfs_close( const struct vfs_file *fd ) {
+  GET_FIL_FP(fd);
+
+  int32_t res = CHECK_RES( f_close( fp ) );
+
+  // free descriptor memory
+  free( (void *)fd );
+
+  return res;
+}
+
+static int32_t myfatfs_read( const struct vfs_file *fd, void *ptr, size_t len ) {
+  GET_FIL_FP(fd);
+  UINT done;
+
+  if (CHECK_RES( f_read( fp, ptr, len, &done ) ) != VFS_RES_OK)
+    return VFS_RES_ERR;
+  return done;
+}
+
+static int32_t myfatfs_write( const struct vfs_file *fd, const void *ptr, size_t len ) {
+  GET_FIL_FP(fd);
+  UINT done;
+
+  if (CHECK_RES( f_write( fp, ptr, len, &done ) ) != VFS_RES_OK)
+    return VFS_RES_ERR;
+  return done;
+}
+
+static int32_t myfatfs_lseek( const struct vfs_file *fd, int32_t off, int whence ) {
+  GET_FIL_FP(fd);
+  FSIZE_t pos;
+
+  switch (whence) {
+  default:
+  case VFS_SEEK_SET:
+    pos = off;
+    break;
+  case VFS_SEEK_CUR:
+    pos = f_tell( fp ) + off;
+    break;
+  case VFS_SEEK_END:
+    pos = f_size( fp ) + off;
+    break;
+  }
+
+  // FatFS would extend a writable file when seeking past its end
+  if (pos > f_size( fp ))
+    return VFS_RES_ERR;
+  if (CHECK_RES( f_lseek( fp, pos ) ) != VFS_RES_OK)
+    return VFS_RES_ERR;
+  return f_tell( fp );
+}
+
+static int32_t myfatfs_eof( const struct vfs_file *fd ) {
+  GET_FIL_FP(fd);
+
+  return f_eof( fp );
+}
+
+static int32_t myfatfs_tell( const struct vfs_file *fd ) {
+  GET_FIL_FP(fd);
+
+  return f_tell( fp );
+}
+
+static int32_t myfatfs_flush( const struct vfs_file *fd ) {
+  GET_FIL_FP(fd);
+
+  return CHECK_RES( f_sync( fp ) );
+}
+
+static uint32_t myfatfs_fsize( const struct vfs_file *fd ) {
+  GET_FIL_FP(fd);
+
+  return f_size( fp );
+}
+
+static int32_t myfatfs_ferrno( const struct vfs_file *fd ) {
+  GET_FIL_FP(fd);
+
+  return f_error( fp ) ? last_result : 0;
+}
+
+
+// ---------------------------------------------------------------------------
+// dir functions
+//
+#define GET_DIR_DP(descr) \
+  const struct myvfs_dir *mydd = (const struct myvfs_dir *)descr; \
+  DIR *dp = (DIR *)&(mydd->dp);
+
+static int32_t myfatfs_closedir( const struct vfs_dir *dd ) {
+  GET_DIR_DP(dd);
+
+  int32_t res = CHECK_RES( f_closedir( dp ) );
+
+  // free descriptor memory
+  free( (void *)dd );
+
+  return res;
+}
+
+static vfs_item *myfatfs_readdir( const struct vfs_dir *dd ) {
+  GET_DIR_DP(dd);
+  struct myvfs_stat *stat;
+
+  if ((stat = malloc( sizeof( struct myvfs_stat ) ))) {
+    if (CHECK_RES( f_readdir( dp, &(stat->fno) ) ) == VFS_RES_OK &&
+        stat->fno.fname[0] != '\0') {
+      stat->vfs_item.fs_type = VFS_FS_FATFS;
+      stat->vfs_item.fns     = &myfatfs_item_fns;
+      return (vfs_item *)stat;
+    }
+    free( stat );
+  }
+
+  return NULL;
+}
+
+
+// ---------------------------------------------------------------------------
+// dir item functions
+//
+#define GET_FILINFO_FNO(descr) \
+  const struct myvfs_stat *mystat = (const struct myvfs_stat *)descr; \
+  const FILINFO *fno = &(mystat->fno);
+
+static void myfatfs_iclose( const struct vfs_item *di ) {
+  // free descriptor memory
+  free( (void *)di );
+}
+
+static uint32_t myfatfs_isize( const struct vfs_item *di ) {
+  GET_FILINFO_FNO(di);
+
+  return fno->fsize;
+}
+
+static int32_t myfatfs_time( const struct vfs_item *di, struct vfs_time *tm ) {
+  GET_FILINFO_FNO(di);
+
+  tm->year = (fno->fdate >> 9) + 1980;
+  tm->mon  = (fno->fdate >> 5) & 0x0f;
+  tm->day  = fno->fdate & 0x1f;
+  tm->hour = (fno->ftime >> 11);
+  tm->min  = (fno->ftime >> 5) & 0x3f;
+  tm->sec  = (fno->ftime & 0x1f) * 2;
+
+  return VFS_RES_OK;
+}
+
+static const char *myfatfs_name( const struct vfs_item *di ) {
+  GET_FILINFO_FNO(di);
+
+  return fno->fname;
+}
+
+static int32_t myfatfs_is_dir( const struct vfs_item *di ) {
+  GET_FILINFO_FNO(di);
+
+  return fno->fattrib & AM_DIR ? 1 : 0;
+}
+
+static int32_t myfatfs_is_rdonly( const struct vfs_item *di ) {
+  GET_FILINFO_FNO(di);
+
+  return fno->fattrib & AM_RDO ? 1 : 0;
+}
+
+static int32_t myfatfs_is_hidden( const struct vfs_item *di ) {
+  GET_FILINFO_FNO(di);
+
+  return fno->fattrib & AM_HID ? 1 : 0;
+}
+
+static int32_t myfatfs_is_sys( const struct vfs_item *di ) {
+  GET_FILINFO_FNO(di);
+
+  return fno->fattrib & AM_SYS ? 1 : 0;
+}
+
+static int32_t myfatfs_is_arch( const struct vfs_item *di ) {
+  GET_FILINFO_FNO(di);
+
+  return fno->fattrib & AM_ARC ? 1 : 0;
+}
+
+
+// ---------------------------------------------------------------------------
+// filesystem functions
+//
+static BYTE fatfs_mode2flag( const char *mode ) {
+  if (strcmp( mode, "w" ) == 0)
+    return FA_WRITE | FA_CREATE_ALWAYS;
+  else if (strcmp( mode, "a" ) == 0)
+    return FA_WRITE | FA_OPEN_APPEND;
+  else if (strcmp( mode, "r+" ) == 0)
+    return FA_READ | FA_WRITE | FA_OPEN_EXISTING;
+  else if (strcmp( mode, "w+" ) == 0)
+    return FA_READ | FA_WRITE | FA_CREATE_ALWAYS;
+  else if (strcmp( mode, "a+" ) == 0)
+    return FA_READ | FA_WRITE | FA_OPEN_APPEND;
+  else
+    return FA_READ | FA_OPEN_EXISTING;
+}
+
+static vfs_vol *myfatfs_mount( const char *name, int num ) {
+  struct myvfs_vol *vol;
+  int ldrv;
+
+  (void)num;
+  // the realm has mounted the drive already, name is "N:/"
+  for (ldrv = 0; ldrv < LDRV_COUNT; ldrv++)
+    if (vols[ldrv] && vols[ldrv]->mounted && vols[ldrv]->pdrv == name[0] - '0')
+      break;
+  if (ldrv == LDRV_COUNT)
+    return NULL;
+  if ((vol = malloc( sizeof( struct myvfs_vol ) ))) {
+    vol->vfs_vol.fs_type = VFS_FS_FATFS;
+    vol->vfs_vol.fns     = &myfatfs_vol_fns;
+    vol->ldrv            = ldrv;
+  }
+  return (vfs_vol *)vol;
+}
+
+static vfs_file *myfatfs_open( const char *name, const char *mode ) {
+  struct myvfs_file *fd;
+
+  if ((fd = (struct myvfs_file *)malloc( sizeof( struct myvfs_file ) ))) {
+    if (CHECK_RES( f_open( &(fd->fp), name, fatfs_mode2flag( mode ) ) ) == VFS_RES_OK) {
+      fd->vfs_file.fs_type = VFS_FS_FATFS;
+      fd->vfs_file.fns     = &myfatfs_file_fns;
+      return (vfs_file *)fd;
+    }
+    free( fd );
+  }
+
+  return NULL;
+}
+
+static vfs_dir *myfatfs_opendir( const char *name ) {
+  struct myvfs_dir *dd;
+
+  if ((dd = (struct myvfs_dir *)malloc( sizeof( struct myvfs_dir ) ))) {
+    if (CHECK_RES( f_opendir( &(dd->dp), name ) ) == VFS_RES_OK) {
+      dd->vfs_dir.fs_type = VFS_FS_FATFS;
+      dd->vfs_dir.fns     = &myfatfs_dd_fns;
+      return (vfs_dir *)dd;
+    }
+    free( dd );
+  }
+
+  return NULL;
+}
+
+static vfs_item *myfatfs_stat( const char *name ) {
+  struct myvfs_stat *s;
+
+  if ((s = (struct myvfs_stat *)malloc( sizeof( struct myvfs_stat ) ))) {
+    if (CHECK_RES( f_stat( name, &(s->fno) ) ) == VFS_RES_OK) {
+      s->vfs_item.fs_type = VFS_FS_FATFS;
+      s->vfs_item.fns     = &myfatfs_item_fns;
+      return (vfs_item *)s;
+    }
+    free( s );
+  }
+
+  return NULL;
+}
+
+static int32_t myfatfs_remove( const char *name ) {
+  return CHECK_RES( f_unlink( name ) );
+}
+
+static int32_t myfatfs_rename( const char *oldname, const char *newname ) {
+  // FatFS wants the new name without its drive
+  const char *colon = strchr( newname, ':' );
+  return CHECK_RES( f_rename( oldname, colon ? colon + 1 : newname ) );
+}
+
+static int32_t myfatfs_mkdir( const char *name ) {
+  return CHECK_RES( f_mkdir( name ) );
+}
+
+static int32_t myfatfs_fsinfo( uint32_t *total, uint32_t *used ) {
+  FATFS *fs;
+  DWORD free_clusters;
+  WORD sector = 512;
+  char path[3] = "0:";
+
+  if (realm_drive < 0 || !vols[realm_drive] || !vols[realm_drive]->mounted)
+    return VFS_RES_ERR;
+  path[0] += vols[realm_drive]->pdrv;
+  if (CHECK_RES( f_getfree( path, &free_clusters, &fs ) ) != VFS_RES_OK)
+    return VFS_RES_ERR;
+  disk_ioctl( vols[realm_drive]->pdrv, GET_SECTOR_SIZE, &sector );
+
+  uint64_t cluster = (uint64_t)fs->csize * sector;
+  uint64_t t = (fs->n_fatent - 2) * cluster;
+  uint64_t u = t - free_clusters * cluster;
+  // the vfs reports 32 bits, a card beyond 4 GB shows as 4 GB
+  *total = t > UINT32_MAX ? UINT32_MAX : t;
+  *used  = u > UINT32_MAX ? UINT32_MAX : u;
+  return VFS_RES_OK;
+}
+
+static int32_t myfatfs_chdrive( const char *ldrv ) {
+  return CHECK_RES( f_chdrive( ldrv ) );
+}
+
+static int32_t myfatfs_chdir( const char *path ) {
+  return CHECK_RES( f_chdir( path ) );
+}
+
+static int32_t myfatfs_errno( void ) {
+  return last_result;
+}
+
+static void myfatfs_clearerr( void ) {
+  last_result = FR_OK;
+}
+
+
+// ---------------------------------------------------------------------------
+// VFS interface functions
+//
+
+// Translates "/<ldrv>/path" (or "path" while a FAT drive is current) to
+// "N:/path" for FatFS, mounting the drive on first use. *outname is
+// allocated and must be freed by the caller.
+vfs_fs_fns *myfatfs_realm( const char *inname, char **outname, int set_current_drive ) {
+  int ldrv = -1;
+  const char *path = inname;
+
+  if (inname[0] == '/') {
+    for (int i = 0; i < LDRV_COUNT; i++) {
+      size_t len = strlen( ldrv_names[i] );
+      if (strncmp( &(inname[1]), ldrv_names[i], len ) == 0 &&
+          (inname[1 + len] == '/' || inname[1 + len] == '\0')) {
+        ldrv = i;
+        path = &(inname[1 + len]);
+        break;
+      }
+    }
+#ifndef CONFIG_FATFS_FLASH
+    if (ldrv == LDRV_FLASH) ldrv = -1;
+#endif
+#ifndef CONFIG_FATFS_SDCARD
+    if (ldrv == LDRV_SD) ldrv = -1;
+#endif
+    if (ldrv < 0) {
+      if (set_current_drive) current_drive = -1;
+      return NULL;
+    }
+  } else if (current_drive >= 0) {
+    ldrv = current_drive;
+  } else {
+    return NULL;
+  }
+
+  if (!mount_drive( ldrv ))
+    return NULL;
+
+  if (!(*outname = malloc( strlen( path ) + 4 )))
+    return NULL;
+  if (path == inname) {
+    // relative to FatFS' current directory of the current drive
+    strcpy( *outname, path );
+  } else {
+    sprintf( *outname, "%d:%s", vols[ldrv]->pdrv, path[0] ? path : "/" );
+  }
+
+  realm_drive = ldrv;
+  if (set_current_drive) current_drive = ldrv;
+  return &myfatfs_fs_fns;
+}
+
+#endif // CONFIG_BUILD_FATFS
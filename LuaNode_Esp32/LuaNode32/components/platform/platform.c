@@ -11,20 +11,24 @@
 #include "rom/spi_flash.h"
 #include "rom/ets_sys.h"
 #include "soc/soc.h"
+#include "soc/gpio_reg.h"
 #include "esp32-hal-gpio.h"
-#include "esp32-hal-i2c.h"
 // Platform specific includes
 
 #include "rom.h"
 #include "gpio16.h"
-#include "i2c_master.h"
+#include "i2c_hw.h"
+#include "ledc_fade.h"
+#include "esp32-hal-matrix.h"
 #include "spi_api.h"
+#include "spi_dma.h"
 #include "pin_map.h"
+#include "my_uart.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include <stdio.h>
 #include <stdlib.h>
 
-i2c_t *i2c;
-
 //static void pwms_init();
 
 /*int platform_init()
@@ -51,10 +55,6 @@ uint8_t platform_key_led( uint8_t level){
 
 // ****************************************************************************
 // GPIO functions
-#ifdef GPIO_INTERRUPT_ENABLE
-extern void lua_gpio_unref(unsigned pin);
-#endif
-
 
 int platform_gpio_mode( unsigned pin, unsigned mode )
 {
@@ -96,42 +96,60 @@ int platform_gpio_read( unsigned pin )
   return digitalRead(pin);
 }
 
-#ifdef GPIO_INTERRUPT_ENABLE
-static void platform_gpio_intr_dispatcher( platform_gpio_intr_handler_fn_t cb){
-  uint8 i, level;
-  uint32 gpio_status = GPIO_REG_READ(GPIO_STATUS_ADDRESS);
-  for (i = 0; i < GPIO_PIN_NUM; i++) {
-    if (pin_int_type[i] && (gpio_status & BIT(pin_num[i])) ) {
-      //disable interrupt
-      gpio_pin_intr_state_set(GPIO_ID_PIN(pin_num[i]), GPIO_PIN_INTR_DISABLE);
-      //clear interrupt status
-      GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, gpio_status & BIT(pin_num[i]));
-      level = 0x1 & GPIO_INPUT_GET(GPIO_ID_PIN(pin_num[i]));
-      if(cb){
-        cb(i, level);
-      }
-      gpio_pin_intr_state_set(GPIO_ID_PIN(pin_num[i]), pin_int_type[i]);
-    }
+// Set and clear every pin in mask with one register write each per bank,
+// instead of a read-modify-write per pin
+void platform_gpio_write_mask( uint64_t mask, uint64_t values )
+{
+  uint32_t lo = (uint32_t)mask, hi = (uint32_t)(mask >> 32) & 0xff;
+  uint32_t vlo = (uint32_t)values, vhi = (uint32_t)(values >> 32);
+  if (lo) {
+    REG_WRITE(GPIO_OUT_W1TS_REG, lo & vlo);
+    REG_WRITE(GPIO_OUT_W1TC_REG, lo & ~vlo);
   }
+  if (hi) {
+    REG_WRITE(GPIO_OUT1_W1TS_REG, hi & vhi);
+    REG_WRITE(GPIO_OUT1_W1TC_REG, hi & ~vhi);
+  }
+}
+
+uint64_t platform_gpio_read_all( void )
+{
+  uint32_t lo = REG_READ(GPIO_IN_REG);
+  uint32_t hi = REG_READ(GPIO_IN1_REG) & 0xff;
+  return ((uint64_t)hi << 32) | lo;
+}
+
+#ifdef GPIO_INTERRUPT_ENABLE
+static platform_gpio_intr_handler_fn_t platform_gpio_cb;
+
+static void IRAM_ATTR platform_gpio_isr( void *arg )
+{
+  unsigned pin = (unsigned)arg;
+  if (platform_gpio_cb)
+    platform_gpio_cb(pin, digitalRead(pin));
 }
 
+// cb runs in the GPIO interrupt, so must live in IRAM
 void platform_gpio_init( platform_gpio_intr_handler_fn_t cb )
 {
-  //ETS_GPIO_INTR_ATTACH(platform_gpio_intr_dispatcher, cb);
-  //ETS_GPIO_INTR_ATTACH(cb, NULL);
+  platform_gpio_cb = cb;
 }
 
 int platform_gpio_intr_init( unsigned pin, GPIO_INT_TYPE type )
 {
-  if (pin >= NUM_GPIO)
+  if (pin >= GPIO_PIN_COUNT)
     return -1;
-  ETS_GPIO_INTR_DISABLE();
-  //clear interrupt status
-  GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, BIT(pin_num[pin]));
-  pin_int_type[pin] = type;
-  //enable interrupt
-  gpio_pin_intr_state_set(GPIO_ID_PIN(pin_num[pin]), type);
-  ETS_GPIO_INTR_ENABLE();
+  if (type == GPIO_PIN_INTR_DISABLE)
+    detachInterrupt(pin);
+  else
+    attachInterruptArg(pin, platform_gpio_isr, (void *)pin, type);
+  return 1;
+}
+
+// Re-arm or mask an attached pin without detaching it; safe from cb
+void IRAM_ATTR platform_gpio_intr_set( unsigned pin, GPIO_INT_TYPE type )
+{
+  setInterruptType(pin, type);
 }
 #endif
 
@@ -139,76 +157,44 @@ int platform_gpio_intr_init( unsigned pin, GPIO_INT_TYPE type )
 // UART
 // TODO: Support timeouts.
 
-// UartDev is defined and initialized in rom code.
-//extern UartDevice UartDev;
-uint32_t platform_uart_setup( unsigned id, uint32_t baud, int databits, int parity, int stopbits )
+int platform_uart_exists( unsigned id )
 {
-	UartDevice UartDev;
-  switch( baud )
-  {
-    case BIT_RATE_9600:
-    case BIT_RATE_19200:
-    case BIT_RATE_38400:
-    case BIT_RATE_57600:
-    case BIT_RATE_115200:
-    case BIT_RATE_230400:
-    case BIT_RATE_460800:
-    case BIT_RATE_921600:
-      UartDev.baut_rate = baud;
-      break;
-    default:
-      UartDev.baut_rate = BIT_RATE_9600;
-      break;
-  }
+  return id < NUM_UART;
+}
 
-  switch( databits )
-  {
-    case 5:
-      UartDev.data_bits = FIVE_BITS;
-      break;
-    case 6:
-      UartDev.data_bits = SIX_BITS;
-      break;
-    case 7:
-      UartDev.data_bits = SEVEN_BITS;
-      break;
-    case 8:
-      UartDev.data_bits = EIGHT_BITS;
-      break;
-    default:
-      UartDev.data_bits = EIGHT_BITS;
-      break;
-  }
+// Pins of -1 keep the current routing; a de_pin makes it RS-485 half duplex
+uint32_t platform_uart_setup( unsigned id, uint32_t baud, int databits, int parity, int stopbits,
+                              int tx_pin, int rx_pin, int de_pin )
+{
+  int p, s;
 
-  switch (stopbits)
+  switch( parity )
   {
-    case ONE_STOP_BIT:
-      UartDev.stop_bits = ONE_STOP_BIT;
+    case PLATFORM_UART_PARITY_EVEN:
+      p = EVEN_BITS;
       break;
-    case TWO_STOP_BIT:
-      UartDev.stop_bits = TWO_STOP_BIT;
+    case PLATFORM_UART_PARITY_ODD:
+      p = ODD_BITS;
       break;
     default:
-      UartDev.stop_bits = ONE_STOP_BIT;
+      p = NONE_BITS;
       break;
   }
 
-  switch (parity)
+  switch( stopbits )
   {
-    case EVEN_BITS:
-      UartDev.parity = EVEN_BITS;
+    case PLATFORM_UART_STOPBITS_1_5:
+      s = ONE_HALF_STOP_BIT;
       break;
-    case ODD_BITS:
-      UartDev.parity = ODD_BITS;
+    case PLATFORM_UART_STOPBITS_2:
+      s = TWO_STOP_BIT;
       break;
     default:
-      UartDev.parity = NONE_BITS;
+      s = ONE_STOP_BIT;
       break;
   }
 
-  //uart_config(id, &UartDev);
-
-  return baud;
+  return uart_port_setup( id, baud, databits, p, s, tx_pin, rx_pin, de_pin );
 }
 
 // if set=1, then alternate serial output pins are used. (15=rx, 13=tx)
@@ -222,8 +208,39 @@ void platform_uart_alt( int set )
 // Send: version with and without mux
 void platform_uart_send( unsigned id, u8 data ) 
 {
-  uart_tx_one_char(data);
-  //printf("%c", data);
+  platform_uart_queue( id, &data, 1 );
+}
+
+// Queue len bytes for the TX interrupt, waiting only for what doesn't fit
+void platform_uart_queue( unsigned id, const uint8_t *data, size_t len )
+{
+  size_t n;
+  while( ( n = uart_tx_write( id, data, len ) ) < len )
+  {
+    data += n;
+    len -= n;
+    vTaskDelay( 1 );
+  }
+}
+
+size_t platform_uart_pending( unsigned id )
+{
+  return uart_tx_pending( id );
+}
+
+size_t platform_uart_read( unsigned id, uint8_t *buf, size_t len )
+{
+  return uart_rx_read( id, buf, len );
+}
+
+void platform_uart_on_sent( void ( *cb )( unsigned id ) )
+{
+  uart_tx_on_done( cb );
+}
+
+void platform_uart_on_data( void ( *cb )( unsigned id ) )
+{
+  uart_rx_on_ready( cb );
 }
 
 // ****************************************************************************
@@ -321,6 +338,7 @@ void platform_pwm_close( unsigned pin )
   // NODE_DBG("Function platform_pwm_stop() is called.\n");
   if ( pin < NUM_PWM)
   {
+    platform_pwm_fade_stop(pin);
     pwm_delete(pin);
     pwm_start();
   }
@@ -344,45 +362,62 @@ void platform_pwm_stop( unsigned pin )
   }
 }
 
-// *****************************************************************************
-// I2C platform interface
-uint32_t platform_i2c_setup( uint8_t i2c_num, uint16_t slave_addr, bool addr_10bit_en ){
-  i2c = i2cInit(i2c_num, slave_addr, addr_10bit_en);
-  if (i2c == NULL) {return 1;}
-  return 0;
-}
-#if 0
-void platform_i2c_send_start( unsigned id ){
-  i2c_master_start();
-}
-
-void platform_i2c_send_stop( unsigned id ){
-  i2c_master_stop();
-}
+int platform_pwm_fade( unsigned pin, const platform_pwm_key_t *keys, unsigned num,
+                       bool repeat, platform_pwm_done_fn_t done, void *arg )
+{
+  if ( pin >= NUM_PWM || num > PLATFORM_PWM_MAX_KEYS || !pwm_add(pin) )
+    return -1;
+  int chan = pwm_get_channel(pin);
+  if ( chan < 0 )
+    return -1;
+  unsigned bits = ledc_fade_bits(chan);
+  if ( bits == 0 )
+    return -1;
 
+  // The channel's signal may not be on the pin yet
+  pinMode(pin_num[pin], OUTPUT);
+  pinMatrixOutAttach(pin_num[pin], LEDC_HS_SIG_OUT0_IDX + chan, false, false);
 
-int platform_i2c_send_address( unsigned id, uint16_t address, int direction ){
-  // Convert enum codes to R/w bit value.
-  // If TX == 0 and RX == 1, this test will be removed by the compiler
-  if ( ! ( PLATFORM_I2C_DIRECTION_TRANSMITTER == 0 &&
-           PLATFORM_I2C_DIRECTION_RECEIVER == 1 ) ) {
-    direction = ( direction == PLATFORM_I2C_DIRECTION_TRANSMITTER ) ? 0 : 1;
+  ledc_fade_key_t ticks[PLATFORM_PWM_MAX_KEYS];
+  for (unsigned i = 0; i < num; i++) {
+    ticks[i].duty = ((uint64_t)keys[i].duty << bits) / NORMAL_PWM_DEPTH;
+    ticks[i].ms = keys[i].ms;
   }
+  int res = ledc_fade_start(chan, ticks, num, repeat, done, arg);
+  if (res == 0 && !repeat)
+    pwms_duty[pin] = keys[num - 1].duty;
+  return res;
+}
 
-  i2c_master_writeByte( (uint8_t) ((address << 1) | direction ));
-  // Low-level returns nack (0=acked); we return ack (1=acked).
-  return ! i2c_master_getAck();
+void *platform_pwm_fade_stop( unsigned pin )
+{
+  if ( pin >= NUM_PWM )
+    return NULL;
+  int chan = pwm_get_channel(pin);
+  if ( chan < 0 || !ledc_fade_busy(chan) )
+    return NULL;
+  void *arg = ledc_fade_stop(chan);
+  pwms_duty[pin] = ((uint64_t)ledc_fade_get_duty(chan) * NORMAL_PWM_DEPTH) >> ledc_fade_bits(chan);
+  return arg;
 }
 
-int platform_i2c_send_byte( unsigned id, uint8_t data ){
-  i2c_master_writeByte(data);
-  // Low-level returns nack (0=acked); we return ack (1=acked).
-  return ! i2c_master_getAck();
+// *****************************************************************************
+// I2C platform interface
+int platform_i2c_exists( unsigned id )
+{
+  return id < NUM_I2C;
 }
-#endif
-int platform_i2c_recv_byte( uint16_t address, bool addr_10bit, uint8_t * data, uint8_t len, bool sendStop ){
-  uint8_t r = i2cRead(i2c, address, addr_10bit, data, len, sendStop);
-  return r;
+
+uint32_t platform_i2c_setup( unsigned id, int sda, int scl, uint32_t speed )
+{
+  return i2c_hw_setup( id, sda, scl, speed );
+}
+
+int platform_i2c_transfer( unsigned id, uint8_t addr, const uint8_t *tx, size_t tx_len,
+                           uint8_t *rx, size_t rx_len, platform_i2c_done_fn_t done, void *arg )
+{
+  i2c_hw_trans_t t = { addr, tx, tx_len, rx, rx_len, done, arg };
+  return i2c_hw_queue( id, &t );
 }
 
 
@@ -447,6 +482,29 @@ int platform_spi_transaction( uint8_t id, uint8_t cmd_bitlen, spi_data_type cmd_
   return PLATFORM_OK;
 }
 
+uint32_t platform_spi_dma_setup( uint8_t id, int sclk, int mosi, int miso, int cs, int mode, uint32_t hz )
+{
+  return spi_dma_setup( id, sclk, mosi, miso, cs, mode, hz );
+}
+
+int platform_spi_transfer( uint8_t id, const uint8_t *tx, uint8_t *rx, size_t len,
+                           platform_spi_done_fn_t done, void *arg )
+{
+  spi_dma_trans_t t = { tx, rx, len, done, arg };
+  return spi_dma_queue( id, &t );
+}
+
+int platform_spi_busy( uint8_t id )
+{
+  return spi_dma_busy( id );
+}
+
+void platform_spi_dc_setup( unsigned pin )
+{
+  pinMode( pin, OUTPUT );
+  digitalWrite( pin, 1 );
+}
+
 // ****************************************************************************
 // Flash access functions
 
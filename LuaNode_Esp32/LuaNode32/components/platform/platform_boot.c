@@ -0,0 +1,96 @@
+// Boot phase timing, and the boot LED
+
+#include "platform_boot.h"
+#include "platform.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include <stdio.h>
+
+#define BOOT_LED_PIN        2
+#define BOOT_LED_MS         250
+#define BOOT_LED_STEPS      4       // after on: off, on, off, on
+
+typedef struct
+{
+  const char *name;
+  uint32_t start_us;
+  uint32_t end_us;
+} boot_phase_t;
+
+static boot_phase_t boot_phases[PLATFORM_BOOT_PHASES];
+static int boot_nphases;
+static uint32_t boot_total_us;
+// phases begin and end in app_main and in the task it starts alongside
+static portMUX_TYPE boot_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static os_timer_t boot_led_timer;
+static int boot_led_step;
+
+int platform_boot_begin(const char *name)
+{
+  uint32_t now = system_get_time ();
+  int i = -1;
+  portENTER_CRITICAL (&boot_mux);
+  if (boot_nphases < PLATFORM_BOOT_PHASES)
+  {
+    i = boot_nphases++;
+    boot_phases[i].name = name;
+    boot_phases[i].start_us = now;
+    boot_phases[i].end_us = 0;
+  }
+  portEXIT_CRITICAL (&boot_mux);
+  return i;
+}
+
+void platform_boot_end(int phase)
+{
+  if (phase >= 0)
+    boot_phases[phase].end_us = system_get_time ();
+}
+
+void platform_boot_done(void)
+{
+  boot_total_us = system_get_time ();
+}
+
+uint32_t platform_boot_total_us(void)
+{
+  return boot_total_us;
+}
+
+bool platform_boot_phase(int i, const char **name, uint32_t *start_us, uint32_t *end_us)
+{
+  bool ok;
+  portENTER_CRITICAL (&boot_mux);
+  ok = i >= 0 && i < boot_nphases;
+  if (ok)
+  {
+    *name = boot_phases[i].name;
+    *start_us = boot_phases[i].start_us;
+    *end_us = boot_phases[i].end_us;
+  }
+  portEXIT_CRITICAL (&boot_mux);
+  return ok;
+}
+
+static void boot_led_tick(void *arg)
+{
+  (void)arg;
+  platform_gpio_write (BOOT_LED_PIN, boot_led_step & 1);
+  if (++boot_led_step >= BOOT_LED_STEPS)
+    os_timer_disarm (&boot_led_timer);
+}
+
+void platform_boot_led(void)
+{
+  if (platform_gpio_mode (BOOT_LED_PIN, 2) < 0)   // pin mode: OUTPUT
+  {
+    printf ("Led lightup failed\n");
+    return;
+  }
+  platform_gpio_write (BOOT_LED_PIN, 1);
+  boot_led_step = 0;
+  os_timer_setfn (&boot_led_timer, boot_led_tick, NULL);
+  os_timer_arm (&boot_led_timer, BOOT_LED_MS, 1);
+}
@@ -0,0 +1,127 @@
+// App slot selection through the bootloader's otadata partition
+
+#include "platform_ota.h"
+#include "platform.h"
+#include "esp_spi_flash.h"
+#include "esp_flash_data_types.h"
+#include "rom/crc.h"
+#include <string.h>
+
+#define OTA_SLOTS 2
+
+static struct {
+  bool probed;
+  bool found;
+  platform_partition_t slot[OTA_SLOTS];
+  uint32_t data_offs;
+  int running;
+} ota;
+
+static uint32_t ota_crc( const esp_ota_select_entry_t *e )
+{
+  return crc32_le( UINT32_MAX, (const uint8_t *)&e->ota_seq, 4 );
+}
+
+// Same test the bootloader makes
+static bool ota_valid( const esp_ota_select_entry_t *e )
+{
+  return e->ota_seq != UINT32_MAX && e->crc == ota_crc( e );
+}
+
+static void ota_read( esp_ota_select_entry_t e[2] )
+{
+  for (int i = 0; i < 2; i++)
+    platform_flash_read( &e[i], ota.data_offs + i * INTERNAL_FLASH_SECTOR_SIZE, sizeof(e[i]) );
+}
+
+// Highest valid sequence number, 0 for none
+static uint32_t ota_seq( const esp_ota_select_entry_t e[2], int *at )
+{
+  uint32_t seq = 0;
+  *at = -1;
+  for (int i = 0; i < 2; i++)
+    if (ota_valid( &e[i] ) && e[i].ota_seq >= seq) {
+      seq = e[i].ota_seq;
+      *at = i;
+    }
+  return seq;
+}
+
+static bool ota_probe( void )
+{
+  if (ota.probed)
+    return ota.found;
+  ota.probed = true;
+
+  platform_partition_t info;
+  bool data = false, slot[OTA_SLOTS] = { false };
+  uint8_t i = 0;
+  while (platform_partition_info( i++, &info )) {
+    if (info.type == PLATFORM_PARTITION_TYPE_DATA &&
+        info.subtype == PLATFORM_PARTITION_SUBTYPE_DATA_OTA) {
+      ota.data_offs = info.offs;
+      data = true;
+    }
+    for (int s = 0; s < OTA_SLOTS; s++)
+      if (info.type == PLATFORM_PARTITION_TYPE_APP &&
+          info.subtype == PLATFORM_PARTITION_SUBTYPE_APP_OTA( s )) {
+        ota.slot[s] = info;
+        slot[s] = true;
+      }
+  }
+  ota.found = data && slot[0] && slot[1];
+  if (!ota.found)
+    return false;
+
+  // Read before anything here can change otadata, so this is what booted
+  esp_ota_select_entry_t e[2];
+  int at;
+  ota_read( e );
+  uint32_t seq = ota_seq( e, &at );
+  ota.running = seq ? (seq - 1) % OTA_SLOTS : 0;
+  return true;
+}
+
+bool platform_ota_running( platform_partition_t *info )
+{
+  if (!ota_probe())
+    return false;
+  *info = ota.slot[ota.running];
+  return true;
+}
+
+bool platform_ota_next( platform_partition_t *info )
+{
+  if (!ota_probe())
+    return false;
+  *info = ota.slot[(ota.running + 1) % OTA_SLOTS];
+  return true;
+}
+
+bool platform_ota_set_boot( const platform_partition_t *slot )
+{
+  if (!ota_probe())
+    return false;
+  int want = -1;
+  for (int s = 0; s < OTA_SLOTS; s++)
+    if (ota.slot[s].offs == slot->offs)
+      want = s;
+  if (want < 0)
+    return false;
+
+  esp_ota_select_entry_t e[2];
+  int at;
+  ota_read( e );
+  uint32_t seq = ota_seq( e, &at ) + 1;
+  if ((seq - 1) % OTA_SLOTS != want)
+    seq++;
+
+  // Overwrite the older copy, so a reset halfway leaves the newer one
+  esp_ota_select_entry_t entry PLATFORM_ALIGNMENT;
+  memset( &entry, 0xff, sizeof(entry) );
+  entry.ota_seq = seq;
+  entry.crc = ota_crc( &entry );
+  uint32_t addr = ota.data_offs + (at == 0 ? 1 : 0) * INTERNAL_FLASH_SECTOR_SIZE;
+  return platform_flash_erase_sector( platform_flash_get_sector_of_address( addr ) ) == PLATFORM_OK &&
+         platform_flash_write( &entry, addr, sizeof(entry) ) == sizeof(entry);
+}
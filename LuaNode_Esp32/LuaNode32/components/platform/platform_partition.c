@@ -78,6 +78,16 @@ bool platform_partition_info (uint8_t idx, platform_partition_t *info)
 }
 
 
+bool platform_partition_find (const char *label, platform_partition_t *info)
+{
+  uint8_t idx = 0;
+  while (platform_partition_info (idx++, info))
+    if (strncmp ((const char *)info->label, label, sizeof (info->label)) == 0)
+      return true;
+  return false;
+}
+
+
 bool platform_partition_add (const platform_partition_t *info)
 {
   partition_info_t *part_table = (partition_info_t *)malloc(SPI_FLASH_SEC_SIZE);
@@ -0,0 +1,164 @@
+// CPU clock scaling, and automatic light sleep when the system is idle
+
+#include "platform_power.h"
+#include "platform.h"
+
+#ifdef CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#include "esp_wifi.h"
+#include "driver/gpio.h"
+#include "driver/uart.h"
+
+#define POWER_MAX_MHZ       CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ
+#define POWER_MIN_MHZ       80
+// RX edges on UART0 which wake it up; the characters themselves are lost
+#define POWER_UART_WAKE     3
+
+static bool sleep_enabled;
+static uint32_t cpu_mhz = POWER_MAX_MHZ;
+static uint32_t cpu_boosts;
+static esp_pm_lock_handle_t sleep_lock;
+
+// All the settings go into one SDK configuration. Whatever the clock is
+// set to, it only drops below it while idle, when the SDK runs the idle
+// task at the minimum.
+static bool power_apply(bool sleep, uint32_t mhz, uint32_t boosts)
+{
+  uint32_t max = (mhz == PLATFORM_CPU_AUTO || boosts) ? POWER_MAX_MHZ : mhz;
+  uint32_t min = (mhz == PLATFORM_CPU_AUTO || sleep) ? POWER_MIN_MHZ : max;
+  esp_pm_config_esp32_t cfg = {
+    .max_freq_mhz = max,
+    .min_freq_mhz = min,
+#ifdef CONFIG_FREERTOS_USE_TICKLESS_IDLE
+    .light_sleep_enable = sleep
+#endif
+  };
+  if (esp_pm_configure (&cfg) != ESP_OK)
+    return false;
+  sleep_enabled = sleep;
+  cpu_mhz = mhz;
+  cpu_boosts = boosts;
+  return true;
+}
+
+bool platform_cpu_freq(uint32_t mhz)
+{
+  if (mhz != PLATFORM_CPU_AUTO && mhz != 80 && mhz != 160 && mhz != 240)
+    return false;
+  return power_apply (sleep_enabled, mhz, cpu_boosts);
+}
+
+bool platform_cpu_boost(void)
+{
+  // the first one raises the clock, the others only count
+  if (cpu_boosts)
+  {
+    ++cpu_boosts;
+    return true;
+  }
+  return power_apply (sleep_enabled, cpu_mhz, 1);
+}
+
+void platform_cpu_unboost(void)
+{
+  if (cpu_boosts > 1)
+    --cpu_boosts;
+  else if (cpu_boosts == 1)
+    power_apply (sleep_enabled, cpu_mhz, 0);
+}
+
+void platform_sleep_block(void)
+{
+  if (!sleep_lock &&
+      esp_pm_lock_create (ESP_PM_NO_LIGHT_SLEEP, 0, "platform", &sleep_lock) != ESP_OK)
+    return;
+  esp_pm_lock_acquire (sleep_lock);
+}
+
+void platform_sleep_unblock(void)
+{
+  if (sleep_lock)
+    esp_pm_lock_release (sleep_lock);
+}
+
+#else
+
+static bool sleep_enabled;
+static uint32_t cpu_mhz = CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ;
+
+bool platform_cpu_freq(uint32_t mhz)
+{
+  return mhz == cpu_mhz;
+}
+
+bool platform_cpu_boost(void)
+{
+  return false;
+}
+
+void platform_cpu_unboost(void)
+{
+}
+
+void platform_sleep_block(void)
+{
+}
+
+void platform_sleep_unblock(void)
+{
+}
+
+#endif
+
+#ifdef PLATFORM_IDLE_SLEEP
+
+bool platform_idle_sleep(bool enable)
+{
+  if (enable)
+  {
+    esp_sleep_enable_gpio_wakeup ();
+    uart_set_wakeup_threshold (0, POWER_UART_WAKE);
+    esp_sleep_enable_uart_wakeup (0);
+  }
+  if (!power_apply (enable, cpu_mhz, cpu_boosts))
+    return false;
+  // fails while WiFi isn't started, it then starts without power saving
+  esp_wifi_set_ps (enable ? WIFI_PS_MIN_MODEM : WIFI_PS_NONE);
+  return true;
+}
+
+bool platform_idle_sleep_gpio(unsigned pin, int level)
+{
+  if (!GPIO_IS_VALID_GPIO (pin))
+    return false;
+  if (level < 0)
+    return gpio_wakeup_disable (pin) == ESP_OK;
+  return gpio_wakeup_enable (pin,
+    level ? GPIO_INTR_HIGH_LEVEL : GPIO_INTR_LOW_LEVEL) == ESP_OK;
+}
+
+#else
+
+bool platform_idle_sleep(bool enable)
+{
+  return !enable;
+}
+
+bool platform_idle_sleep_gpio(unsigned pin, int level)
+{
+  (void)pin; (void)level;
+  return false;
+}
+
+#endif
+
+bool platform_idle_sleep_enabled(void)
+{
+  return sleep_enabled;
+}
+
+uint32_t platform_cpu_freq_get(void)
+{
+  return cpu_mhz;
+}
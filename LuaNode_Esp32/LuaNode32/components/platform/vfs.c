@@ -3,6 +3,7 @@
 #include "vfs.h"
 #include "platform.h"
 #include "user_config.h"
+#include "sdkconfig.h"
 
 #define LDRV_TRAVERSAL 0
 
@@ -12,6 +13,8 @@
 //
 static int32_t (*rtc_cb)( vfs_time *tm ) = NULL;
 
+volatile uint32_t vfs_generation;
+
 // called by operating system
 void vfs_register_rtc_cb( int32_t (*cb)( vfs_time *tm ) )
 {
@@ -77,9 +80,21 @@ vfs_vol *vfs_mount( const char *name, int num )
   const char *normname = normalize_path( name );
   char *outname;
 
+  vfs_generation++;
+
+#ifdef CONFIG_BUILD_SPIFFS
   if ((fs_fns = myspiffs_realm( normname, &outname, false ))) {
     return fs_fns->mount( outname, num );
   }
+#endif
+
+#ifdef CONFIG_BUILD_FATFS
+  if ((fs_fns = myfatfs_realm( normname, &outname, false ))) {
+    vfs_vol *r = fs_fns->mount( outname, num );
+    free( outname );
+    return r;
+  }
+#endif
 
   return NULL;
 }
@@ -90,9 +105,22 @@ int vfs_open( const char *name, const char *mode )
   const char *normname = normalize_path( name );
   char *outname;
 
+  if (mode[0] != 'r')
+    vfs_generation++;  // may create the file
+
+#ifdef CONFIG_BUILD_SPIFFS
   if ((fs_fns = myspiffs_realm( normname, &outname, false ))) {
-    return (int)fs_fns->open( outname, mode );
+    return vfs_fd_of( fs_fns->open( outname, mode ) );
   }
+#endif
+
+#ifdef CONFIG_BUILD_FATFS
+  if ((fs_fns = myfatfs_realm( normname, &outname, false ))) {
+    int r = vfs_fd_of( fs_fns->open( outname, mode ) );
+    free( outname );
+    return r;
+  }
+#endif
 
   return 0;
 }
@@ -149,6 +177,8 @@ int32_t vfs_remove( const char *name )
   const char *normname = normalize_path( name );
   char *outname;
 
+  vfs_generation++;
+
 #ifdef CONFIG_BUILD_SPIFFS
   if ((fs_fns = myspiffs_realm( normname, &outname, false ))) {
     return fs_fns->remove( outname );
@@ -173,6 +203,8 @@ int32_t vfs_rename( const char *oldname, const char *newname )
   const char *normnewname = normalize_path( newname );
   char *oldoutname, *newoutname;
 
+  vfs_generation++;
+
 #ifdef CONFIG_BUILD_SPIFFS
   if (myspiffs_realm( normoldname, &oldoutname, false )) {
     if ((fs_fns = myspiffs_realm( normnewname, &newoutname, false ))) {
@@ -266,6 +298,8 @@ int32_t vfs_format( void )
   vfs_fs_fns *fs_fns;
   char *outname;
 
+  vfs_generation++;
+
 #ifdef CONFIG_BUILD_SPIFFS
   if ((fs_fns = myspiffs_realm( "/FLASH", &outname, false ))) {
     return fs_fns->format();
@@ -287,6 +321,8 @@ int32_t vfs_chdir( const char *path )
   char *outname;
   int ok = VFS_RES_ERR;
 
+  vfs_generation++;
+
 #if LDRV_TRAVERSAL
   const char *level;
   // track dir level
@@ -360,7 +396,7 @@ int32_t vfs_errno( const char *name )
 
 int32_t vfs_ferrno( int fd )
 {
-  vfs_file *f = (vfs_file *)fd;
+  vfs_file *f = vfs_file_of( fd );
 
   if (f) {
     return f->fns->ferrno ? f->fns->ferrno( f ) : 0;
@@ -0,0 +1,260 @@
+// Streaming application of file patches from tools/mkpatch.py
+
+#include "vfs_patch.h"
+#include "vfs.h"
+#include "rom/crc.h"
+#include "mbedtls/sha256.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define PATCH_HDR_LEN   48
+#define PATCH_SHA_LEN   32
+#define PATCH_NAME_MAX  64
+#define PATCH_BUF       256
+
+enum { OP_END, OP_COPY, OP_ADD };
+enum { P_HEADER, P_OP, P_ADD, P_DONE, P_FINISHED, P_FAILED };
+
+struct vfs_patch {
+  int state;
+  const char *err;
+  char name[PATCH_NAME_MAX];
+  char tmp[PATCH_NAME_MAX + 4];         // name.new
+  char old[PATCH_NAME_MAX + 4];         // name.old, only during commit
+  int fd_old;
+  int fd_new;
+  uint32_t old_size;
+  uint32_t new_size;
+  uint32_t written;
+  uint32_t add_left;
+  uint8_t want[PATCH_SHA_LEN];
+  mbedtls_sha256_context sha;
+  uint32_t fill;                        // of hdr, for the header or an op
+  uint8_t hdr[PATCH_HDR_LEN];
+  uint8_t buf[PATCH_BUF];
+};
+
+static uint32_t patch_u32( const uint8_t *b )
+{
+  return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static bool patch_fail( vfs_patch_t *p, const char *err )
+{
+  if (p->state != P_FAILED) {
+    p->state = P_FAILED;
+    p->err = err;
+  }
+  return false;
+}
+
+static bool patch_exists( const char *name )
+{
+  vfs_item *item = vfs_stat( name );
+  if (item)
+    vfs_closeitem( item );
+  return item != NULL;
+}
+
+vfs_patch_t *vfs_patch_open( const char *name )
+{
+  vfs_patch_t *p = (vfs_patch_t *)calloc( 1, sizeof(vfs_patch_t) );
+  if (!p)
+    return NULL;
+  mbedtls_sha256_init( &p->sha );
+  p->state = P_HEADER;
+  if (strlen( name ) >= PATCH_NAME_MAX) {
+    patch_fail( p, "file name too long" );
+    return p;
+  }
+  strcpy( p->name, name );
+  strcpy( p->tmp, name );
+  strcat( p->tmp, ".new" );
+  strcpy( p->old, name );
+  strcat( p->old, ".old" );
+  // A commit cut short between its two renames
+  if (!patch_exists( p->name ) && patch_exists( p->old ))
+    vfs_rename( p->old, p->name );
+  return p;
+}
+
+// The header is in: check the old file is the one the patch was made for
+static bool patch_start( vfs_patch_t *p )
+{
+  if (patch_u32( p->hdr ) != VFS_PATCH_MAGIC)
+    return patch_fail( p, "not a patch" );
+  p->old_size = patch_u32( p->hdr + 4 );
+  uint32_t old_crc = patch_u32( p->hdr + 8 );
+  p->new_size = patch_u32( p->hdr + 12 );
+  memcpy( p->want, p->hdr + 16, PATCH_SHA_LEN );
+
+  uint32_t size = 0, crc = 0;
+  p->fd_old = vfs_open( p->name, "r" );
+  if (p->fd_old) {
+    int32_t n;
+    while ((n = vfs_read( p->fd_old, p->buf, PATCH_BUF )) > 0) {
+      crc = crc32_le( crc, p->buf, n );
+      size += n;
+    }
+  }
+  if (size != p->old_size || crc != old_crc)
+    return patch_fail( p, "patch is for another version" );
+
+  vfs_remove( p->tmp );
+  p->fd_new = vfs_open( p->tmp, "w" );
+  if (!p->fd_new)
+    return patch_fail( p, "can't create new file" );
+  mbedtls_sha256_starts( &p->sha, 0 );
+  p->state = P_OP;
+  return true;
+}
+
+static bool patch_out( vfs_patch_t *p, const void *data, uint32_t len )
+{
+  if (len > p->new_size - p->written)
+    return patch_fail( p, "patch makes file too long" );
+  if (vfs_write( p->fd_new, data, len ) != len)
+    return patch_fail( p, "write failed" );
+  mbedtls_sha256_update( &p->sha, (const unsigned char *)data, len );
+  p->written += len;
+  return true;
+}
+
+static bool patch_copy( vfs_patch_t *p, uint32_t offs, uint32_t len )
+{
+  if (offs > p->old_size || len > p->old_size - offs)
+    return patch_fail( p, "copy outside old file" );
+  if (len && vfs_lseek( p->fd_old, offs, VFS_SEEK_SET ) != offs)
+    return patch_fail( p, "read failed" );
+  while (len) {
+    uint32_t n = len < PATCH_BUF ? len : PATCH_BUF;
+    if (vfs_read( p->fd_old, p->buf, n ) != n)
+      return patch_fail( p, "read failed" );
+    if (!patch_out( p, p->buf, n ))
+      return false;
+    len -= n;
+  }
+  return true;
+}
+
+// Bytes of the header or op still to come before it can be acted on
+static uint32_t patch_need( vfs_patch_t *p )
+{
+  if (p->state == P_HEADER)
+    return PATCH_HDR_LEN;
+  if (p->fill == 0)
+    return 1;
+  return p->hdr[0] == OP_COPY ? 9 : p->hdr[0] == OP_ADD ? 5 : 1;
+}
+
+static bool patch_op( vfs_patch_t *p )
+{
+  switch (p->hdr[0]) {
+  case OP_END:
+    p->state = P_DONE;
+    return true;
+  case OP_COPY:
+    return patch_copy( p, patch_u32( p->hdr + 1 ), patch_u32( p->hdr + 5 ) );
+  case OP_ADD:
+    p->add_left = patch_u32( p->hdr + 1 );
+    if (p->add_left)
+      p->state = P_ADD;
+    return true;
+  default:
+    return patch_fail( p, "bad patch op" );
+  }
+}
+
+bool vfs_patch_write( vfs_patch_t *p, const void *data, size_t len )
+{
+  const uint8_t *d = (const uint8_t *)data;
+  while (len && p->state != P_FAILED) {
+    if (p->state == P_DONE || p->state == P_FINISHED)
+      return patch_fail( p, "data after end of patch" );
+    if (p->state == P_ADD) {
+      uint32_t n = len < p->add_left ? len : p->add_left;
+      if (!patch_out( p, d, n ))
+        break;
+      d += n;
+      len -= n;
+      p->add_left -= n;
+      if (p->add_left == 0)
+        p->state = P_OP;
+      continue;
+    }
+    // Header or op: collect it, the first byte of an op says how long it is
+    uint32_t need = patch_need( p );
+    while (len && p->fill < need) {
+      p->hdr[p->fill++] = *d++;
+      len--;
+      need = patch_need( p );
+    }
+    if (p->fill < need)
+      break;
+    p->fill = 0;
+    if (p->state == P_HEADER)
+      patch_start( p );
+    else
+      patch_op( p );
+  }
+  return p->state != P_FAILED;
+}
+
+bool vfs_patch_finish( vfs_patch_t *p )
+{
+  if (p->state == P_FINISHED)
+    return true;
+  if (p->state == P_FAILED)
+    return false;
+  if (p->state != P_DONE)
+    return patch_fail( p, "patch incomplete" );
+  uint8_t got[PATCH_SHA_LEN];
+  mbedtls_sha256_finish( &p->sha, got );
+  if (p->written != p->new_size || memcmp( got, p->want, PATCH_SHA_LEN ) != 0)
+    return patch_fail( p, "patched file doesn't match" );
+  if (vfs_close( p->fd_new ) != VFS_RES_OK)
+    return patch_fail( p, "write failed" );
+  p->fd_new = 0;
+  p->state = P_FINISHED;
+  return true;
+}
+
+bool vfs_patch_commit( vfs_patch_t *p )
+{
+  if (p->state != P_FINISHED)
+    return patch_fail( p, "patch not finished" );
+  if (p->fd_old) {
+    vfs_close( p->fd_old );
+    p->fd_old = 0;
+  }
+  vfs_remove( p->old );
+  bool had_old = patch_exists( p->name );
+  if (had_old && vfs_rename( p->name, p->old ) != VFS_RES_OK)
+    return patch_fail( p, "rename failed" );
+  if (vfs_rename( p->tmp, p->name ) != VFS_RES_OK) {
+    if (had_old)
+      vfs_rename( p->old, p->name );
+    return patch_fail( p, "rename failed" );
+  }
+  if (had_old)
+    vfs_remove( p->old );
+  p->tmp[0] = 0;
+  return true;
+}
+
+const char *vfs_patch_error( const vfs_patch_t *p )
+{
+  return p->err;
+}
+
+void vfs_patch_close( vfs_patch_t *p )
+{
+  if (p->fd_old)
+    vfs_close( p->fd_old );
+  if (p->fd_new)
+    vfs_close( p->fd_new );
+  if (p->tmp[0])
+    vfs_remove( p->tmp );
+  mbedtls_sha256_free( &p->sha );
+  free( p );
+}
@@ -33,6 +33,7 @@
 int pthread_attr_init(pthread_attr_t *attr) {
     attr->stack_size = PTHREAD_STACK_MIN;
     attr->initial_state = PTHREAD_INITIAL_STATE_RUN;
+    attr->core = tskNO_AFFINITY;
     
     return 0;
 }
@@ -64,6 +65,18 @@ int pthread_attr_setinitialstate(pthread_attr_t *attr, int initial_state) {
     return 0;
 }
 
+// Pin the thread to a CPU core, or let it run on any (tskNO_AFFINITY)
+int pthread_attr_setcore(pthread_attr_t *attr, int core) {
+    if ((core != tskNO_AFFINITY) && ((core < 0) || (core >= portNUM_PROCESSORS))) {
+        errno = EINVAL;
+        return EINVAL;
+    }
+    
+    attr->core = core;
+    
+    return 0;
+}
+
 int pthread_attr_getstacksize(const pthread_attr_t *attr, size_t *stacksize) {
     *stacksize = attr->stack_size;
     
@@ -35,6 +35,7 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
     
     int stacksize; // Stack size
     int initial_state; // Initial state
+    int core; // CPU core
     int res;
 
     // Get some arguments need for the thread creation
@@ -45,13 +46,15 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
             return EINVAL;
         }
         initial_state = attr->initial_state;
+        core = attr->core;
     } else {
         stacksize = PTHREAD_STACK_MIN;
         initial_state = PTHREAD_INITIAL_STATE_RUN;
+        core = tskNO_AFFINITY;
     }
      
     // Create a new pthread
-    res = _pthread_create(thread, stacksize, initial_state, start_routine, args);
+    res = _pthread_create(thread, stacksize, initial_state, core, start_routine, args);
     if (res) {
         errno = res;
         return res;
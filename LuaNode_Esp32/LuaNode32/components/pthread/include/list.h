@@ -33,19 +33,25 @@
 #include <stdint.h>
 #include "mutex.h"
 
-struct list {
-    struct mtx mutex;
-    struct list_index *index;
-    struct list_index *free;
-    uint8_t indexes;
-    uint8_t first_index;
+// Items live in slots that never move once allocated: slot chunks double
+// in size as the list grows, and chunk k holds slots LIST_CHUNK << (k - 1)
+// up to LIST_CHUNK << k (chunk 0 holds the first LIST_CHUNK). Adding and
+// removing take the mutex; list_get, list_first and list_next don't.
+#define LIST_CHUNK  8
+#define LIST_CHUNKS 8
+#define LIST_MAX    (LIST_CHUNK << (LIST_CHUNKS - 1))
+
+struct list_slot {
+    void *item;     // NULL if free
+    int next;       // next free slot, -1 for none
 };
 
-struct list_index {
-    void *item;
-    uint8_t index;
-    uint8_t deleted;
-    struct list_index *next;
+struct list {
+    struct mtx mutex;
+    struct list_slot *chunk[LIST_CHUNKS];
+    int free;                   // first free slot, -1 for none
+    volatile int slots;         // slots in use or on the free list
+    int first_index;
 };
 
 void list_init(struct list *list, int first_index);
@@ -45,11 +45,15 @@
 
 #define PTHREAD_MTX_DEBUG 0
 
+// How long pthread_mutex_lock() waits, forever unless debugging or set
+// by the build; pthread_mutex_timedlock() takes its own
 #if PTHREAD_MTX_DEBUG
 #define PTHREAD_MTX_LOCK_TIMEOUT (3000 / portTICK_PERIOD_MS)
 #define PTHREAD_MTX_DEBUG_LOCK() printf("phread can't lock\n");
 #else
+#ifndef PTHREAD_MTX_LOCK_TIMEOUT
 #define PTHREAD_MTX_LOCK_TIMEOUT portMAX_DELAY
+#endif
 #define PTHREAD_MTX_DEBUG_LOCK() 
 #endif
 
@@ -57,14 +61,17 @@
 
 #define PTHREAD_CANCEL_DISABLE 1
 
+// Threads, mutexes and keys are allocated as they are made, up to what
+// their list holds
 #define PTHREAD_MIN       1
-#define PTHREAD_MAX       PTHREAD_MIN + 10
+#define PTHREAD_MAX       (PTHREAD_MIN + LIST_MAX - 1)
 
 #define PTHREAD_MUTEX_MIN 1
-#define PTHREAD_MUTEX_MAX PTHREAD_MUTEX_MIN + 10
+#define PTHREAD_MUTEX_MAX (PTHREAD_MUTEX_MIN + LIST_MAX - 1)
 
 struct pthread_mutex_attr {
     int type;
+    int protocol;
 };
 
 typedef struct pthread_mutex_attr pthread_mutexattr_t;
@@ -124,6 +131,7 @@ struct pthread {
 struct pthread_attr {
     int stack_size;
     int initial_state;
+    int core;       // CPU core to pin the task to, or tskNO_AFFINITY
 };
 
 typedef struct pthread_attr pthread_attr_t;
@@ -135,7 +143,7 @@ typedef struct pthread_attr pthread_attr_t;
 #define PTHREAD_CREATE_JOINABLE 2
 
 void _pthread_init();
-int _pthread_create(pthread_t *id, int stacksize, int initial_state, void *(*start_routine)(void *), void *args);
+int _pthread_create(pthread_t *id, int stacksize, int initial_state, int core, void *(*start_routine)(void *), void *args);
 int _pthread_join(pthread_t id);
 int _pthread_free(pthread_t id);
 sig_t _pthread_signal(int s, sig_t h);
@@ -147,6 +155,7 @@ int _pthread_suspend(pthread_t id);
 int _pthread_resume(pthread_t id);
 void _pthread_mutex_free();
 int _pthread_core(pthread_t id);
+TaskHandle_t _pthread_task(pthread_t id);
 
 int pthread_attr_init(pthread_attr_t *attr);
 int pthread_attr_destroy(pthread_attr_t *attr);
@@ -155,6 +164,7 @@ int pthread_attr_getstacksize(const pthread_attr_t *attr, size_t *stacksize);
 int pthread_attr_setdetachstate(pthread_attr_t *attr, int detachstate);
 int pthread_setcancelstate(int state, int *oldstate);
 int pthread_attr_setinitialstate(pthread_attr_t *attr, int initial_state);
+int pthread_attr_setcore(pthread_attr_t *attr, int core);
 
 int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
                           void *(*start_routine) (void *), void *args);
@@ -170,7 +180,10 @@ int pthread_mutex_init(pthread_mutex_t *mut, const pthread_mutexattr_t *attr);
 int pthread_mutex_lock(pthread_mutex_t *mut);
 int pthread_mutex_unlock(pthread_mutex_t *mut);
 int pthread_mutex_trylock(pthread_mutex_t *mut);
+int pthread_mutex_timedlock(pthread_mutex_t *mut, const struct timespec *abstime);
 int pthread_mutexattr_settype(pthread_mutexattr_t *attr, int type);
+int pthread_mutexattr_setprotocol(pthread_mutexattr_t *attr, int protocol);
+int pthread_mutexattr_getprotocol(const pthread_mutexattr_t *attr, int *protocol);
 int pthread_mutexattr_init(pthread_mutexattr_t *attr);
 int pthread_mutex_destroy(pthread_mutex_t *mutex);
 
@@ -191,6 +204,12 @@ void pthread_cleanup_push(void (*routine)(void *), void *arg);
 #define PTHREAD_MUTEX_RECURSIVE     3
 #define PTHREAD_MUTEX_DEFAULT       4
 
+// Mutex protocols. A FreeRTOS mutex raises its holder to the priority of
+// the highest task waiting for it, so PTHREAD_PRIO_INHERIT is the default;
+// PTHREAD_PRIO_NONE gives a plain binary semaphore instead
+#define PTHREAD_PRIO_NONE           0
+#define PTHREAD_PRIO_INHERIT        1
+
 // Initializers
 #define PTHREAD_MUTEX_INITIALIZER  0
 #define PTHREAD_ONCE_INIT          {NULL}
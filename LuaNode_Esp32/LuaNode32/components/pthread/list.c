@@ -34,209 +34,174 @@
 #include "list.h"
 #include "mutex.h"
 
+// Chunk and position within it of a slot
+static inline struct list_slot *list_slot(struct list *list, int slot) {
+    int k;
+
+    if (slot < LIST_CHUNK) {
+        k = 0;
+    } else {
+        k = 32 - __builtin_clz(slot / LIST_CHUNK);
+        slot -= LIST_CHUNK << (k - 1);
+    }
+
+    if ((k >= LIST_CHUNKS) || !list->chunk[k]) {
+        return NULL;
+    }
+
+    return &list->chunk[k][slot];
+}
+
 void list_init(struct list *list, int first_index) {
-    // Create the mutex
     mtx_init(&list->mutex, NULL, NULL, 0);
-    
-    mtx_lock(&list->mutex);
-    
-    list->indexes =  0;
-    list->free = NULL;
-    list->index = NULL;
+
+    memset(list->chunk, 0, sizeof(list->chunk));
+    list->free = -1;
+    list->slots = 0;
     list->first_index = first_index;
-    
-    mtx_unlock(&list->mutex);    
 }
 
 int list_add(struct list *list, void *item, int *item_index) {
-    struct list_index *index = NULL;
-    struct list_index *indexa = NULL;
-    int grow = 0;
-        
+    struct list_slot *cslot;
+    int slot, k;
+
     mtx_lock(&list->mutex);
-    
-    // Get an index
-    if (list->free) {
-        // Get first free element
-        index = list->free;
-        list->free = index->next;
+
+    if (list->free >= 0) {
+        // Reuse the last freed slot
+        slot = list->free;
+        cslot = list_slot(list, slot);
+        list->free = cslot->next;
     } else {
-        // Must grow index array
-        grow = 1;
-    }
-    
-    if (grow) {        
-        // Increment index count
-        list->indexes++;
-
-        // Create a new index array for allocate new index
-        indexa = (struct list_index *)malloc(sizeof(struct list_index) * list->indexes);     
-        if (!indexa) {
-            mtx_unlock(&list->mutex);
-            return ENOMEM;            
-        }
-        
-        if (list->index) {
-            // Copy current index array to new created
-            bcopy(list->index, indexa, sizeof(struct list_index) * (list->indexes - 1));
+        slot = list->slots;
+        cslot = list_slot(list, slot);
+        if (!cslot) {
+            // Add the next chunk
+            k = (slot < LIST_CHUNK) ? 0 : 32 - __builtin_clz(slot / LIST_CHUNK);
+            if (k >= LIST_CHUNKS) {
+                mtx_unlock(&list->mutex);
+                return ENOMEM;
+            }
 
-            // Free current index array
-            free(list->index);
+            list->chunk[k] = calloc(k ? LIST_CHUNK << (k - 1) : LIST_CHUNK, sizeof(struct list_slot));
+            if (!list->chunk[k]) {
+                mtx_unlock(&list->mutex);
+                return ENOMEM;
+            }
+
+            cslot = list_slot(list, slot);
         }
+    }
 
-        // Store new index array
-        list->index = indexa;
+    cslot->next = -1;
+    cslot->item = item;
 
-        // Current index
-        index = list->index + list->indexes - 1;
-        
-        // Initialize new index
-        index->index = list->indexes - 1;
-        
+    // Readers go up to list->slots without the mutex, so the slot must be
+    // in memory before they can see it
+    __sync_synchronize();
+    if (slot == list->slots) {
+        list->slots = slot + 1;
     }
-    
-    index->next = NULL;
-    index->item = item;        
-    index->deleted = 0;
-    
-    // Return index
-    *item_index = index->index + list->first_index;
-            
+
+    *item_index = slot + list->first_index;
+
     mtx_unlock(&list->mutex);
-    
+
     return 0;
 }
 
 int list_get(struct list *list, int index, void **item) {
-    struct list_index *cindex = NULL;
-    int iindex;
-
-    mtx_lock(&list->mutex);
+    struct list_slot *cslot;
+    void *citem;
+    int slot = index - list->first_index;
 
-    // Check index
-    if (index < list->first_index) {
-        mtx_unlock(&list->mutex);
+    if ((slot < 0) || (slot >= list->slots)) {
         return EINVAL;
     }
 
-    // Get new internal index
-    iindex = index - list->first_index;
-    
-    // Test for a valid index
-    if (iindex > list->indexes) {
-        mtx_unlock(&list->mutex);
+    cslot = list_slot(list, slot);
+    if (!cslot || !(citem = cslot->item)) {
         return EINVAL;
     }
 
-    cindex = list->index + iindex;
-
-    if (cindex->deleted) {
-        mtx_unlock(&list->mutex);
-        return EINVAL;
-    }
-    
-    *item = cindex->item;
-    
-    mtx_unlock(&list->mutex);
+    *item = citem;
 
     return 0;
 }
 
 int list_remove(struct list *list, int index) {
-    struct list_index *cindex = NULL;
-    int iindex;
+    struct list_slot *cslot;
+    int slot = index - list->first_index;
 
     mtx_lock(&list->mutex);
 
-    // Check index
-    if (index < list->first_index) {
-        mtx_unlock(&list->mutex);
-        return EINVAL;
-    }
-    
-    // Get new internal index
-    iindex = index - list->first_index;
-    
-    // Test for a valid index
-    if ((iindex < 0) || (iindex > list->indexes)) {
+    if ((slot < 0) || (slot >= list->slots) ||
+        !(cslot = list_slot(list, slot)) || !cslot->item) {
         mtx_unlock(&list->mutex);
         return EINVAL;
     }
-    
-    cindex = &list->index[iindex];
-    
-    free(cindex->item);
-    
-    cindex->next = list->free;
-    cindex->deleted = 1;
-    list->free = cindex;
-    
+
+    free(cslot->item);
+
+    cslot->item = NULL;
+    cslot->next = list->free;
+    list->free = slot;
+
     mtx_unlock(&list->mutex);
-    
+
     return 0;
 }
 
-int list_first(struct list *list) {
-    int index;
-    int res = -1;
-    
-    mtx_lock(&list->mutex);
-    
-    for(index=0;index < list->indexes;index++) {
-        if (!list->index[index].deleted) {
-            res = index + list->first_index;
-            break;
+// Slots are scanned in index order, so an item removed while iterating
+// doesn't end the iteration
+static int list_scan(struct list *list, int slot) {
+    struct list_slot *cslot;
+    int slots = list->slots;
+
+    for(;slot < slots;slot++) {
+        cslot = list_slot(list, slot);
+        if (cslot && cslot->item) {
+            return slot + list->first_index;
         }
     }
-    
-    mtx_unlock(&list->mutex);
 
-    return res;
+    return -1;
 }
 
-int list_next(struct list *list, int index) {
-    int res = -1;
-    int iindex;
-    
-    mtx_lock(&list->mutex);
+int list_first(struct list *list) {
+    return list_scan(list, 0);
+}
 
-    // Check index
+int list_next(struct list *list, int index) {
     if (index < list->first_index) {
-        mtx_unlock(&list->mutex);    
         return -1;
     }
-    
-    // Get new internal index
-    iindex = index - list->first_index + 1;
-
-    // Get next non deleted item on list
-    for(;iindex < list->indexes;iindex++) {
-        if (!list->index[iindex].deleted) {
-           res = iindex + list->first_index;
-           break;
-        }
-    }
-    
-    mtx_unlock(&list->mutex);
-    
-    return res;
+
+    return list_scan(list, index - list->first_index + 1);
 }
 
 void list_destroy(struct list *list, int items) {
-    int index;
-    
+    struct list_slot *cslot;
+    int slot, k;
+
     mtx_lock(&list->mutex);
-    
+
     if (items) {
-        for(index=0;index < list->indexes;index++) {
-            if (!list->index[index].deleted) {
-                free(list->index[index].item);
+        for(slot = 0;slot < list->slots;slot++) {
+            cslot = list_slot(list, slot);
+            if (cslot && cslot->item) {
+                free(cslot->item);
             }
-        }        
+        }
     }
-    
-    free(list->index);
-    
-    mtx_unlock(&list->mutex);    
+
+    for(k = 0;k < LIST_CHUNKS;k++) {
+        free(list->chunk[k]);
+        list->chunk[k] = NULL;
+    }
+    list->slots = 0;
+    list->free = -1;
+
+    mtx_unlock(&list->mutex);
     mtx_destroy(&list->mutex);
 }
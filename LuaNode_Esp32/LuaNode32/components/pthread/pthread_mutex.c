@@ -29,6 +29,7 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <sys/time.h>
 #include "pthreadx.h"
 
 extern struct list mutex_list;
@@ -40,6 +41,13 @@ static int _check_attr(const pthread_mutexattr_t *attr) {
         errno = EINVAL;
         return EINVAL;
     }
+
+    // Recursive mutexes are always FreeRTOS mutexes, so they inherit
+    if ((attr->protocol != PTHREAD_PRIO_INHERIT) &&
+        ((attr->protocol != PTHREAD_PRIO_NONE) || (type == PTHREAD_MUTEX_RECURSIVE))) {
+        errno = EINVAL;
+        return EINVAL;
+    }
    
    return 0;
 }
@@ -79,12 +87,17 @@ int pthread_mutex_init(pthread_mutex_t *mut, const pthread_mutexattr_t *attr) {
     // Create semaphore
     if (mutex->type == PTHREAD_MUTEX_RECURSIVE) {
         mutex->sem = xSemaphoreCreateRecursiveMutex();    
+    } else if (attr->protocol == PTHREAD_PRIO_NONE) {
+        mutex->sem = xSemaphoreCreateBinary();
+        if (mutex->sem) {
+            xSemaphoreGive(mutex->sem);
+        }
     } else {
         mutex->sem = xSemaphoreCreateMutex();
     }
     if(!mutex->sem){
         *mut = 0;
-        free(mutex->sem);
+        free(mutex);
         errno = ENOMEM;
         return ENOMEM;
     }
@@ -104,8 +117,10 @@ int pthread_mutex_init(pthread_mutex_t *mut, const pthread_mutexattr_t *attr) {
     return 0;    
 }
 
-int pthread_mutex_lock(pthread_mutex_t *mut) {
+// Take the mutex, waiting up to ticks
+static int _mutex_take(pthread_mutex_t *mut, TickType_t ticks, int err) {
     struct pthread_mutex *mutex;
+    BaseType_t taken;
     int res;
 
     // Get mutex
@@ -114,25 +129,51 @@ int pthread_mutex_lock(pthread_mutex_t *mut) {
         errno = res;
         return res;
     }
-    
+
     // Lock
     if (mutex->type == PTHREAD_MUTEX_RECURSIVE) {
-        if (xSemaphoreTakeRecursive(mutex->sem, PTHREAD_MTX_LOCK_TIMEOUT) != pdPASS) {
-            PTHREAD_MTX_DEBUG_LOCK();
-            errno = EINVAL;
-            return EINVAL;
-        }
+        taken = xSemaphoreTakeRecursive(mutex->sem, ticks);
     } else {
-        if (xSemaphoreTake(mutex->sem, PTHREAD_MTX_LOCK_TIMEOUT) != pdPASS) {
-            PTHREAD_MTX_DEBUG_LOCK();
-            errno = EINVAL;
-            return EINVAL;
-        }        
+        taken = xSemaphoreTake(mutex->sem, ticks);
     }
-    
+    if (taken != pdTRUE) {
+        errno = err;
+        return err;
+    }
+
     return 0;
 }
 
+int pthread_mutex_lock(pthread_mutex_t *mut) {
+    int res = _mutex_take(mut, PTHREAD_MTX_LOCK_TIMEOUT, EINVAL);
+
+    if (res == EINVAL) {
+        PTHREAD_MTX_DEBUG_LOCK();
+    }
+
+    return res;
+}
+
+int pthread_mutex_timedlock(pthread_mutex_t *mut, const struct timespec *abstime) {
+    struct timeval now;
+    int64_t ms;
+
+    if (!abstime || (abstime->tv_nsec < 0) || (abstime->tv_nsec >= 1000000000)) {
+        errno = EINVAL;
+        return EINVAL;
+    }
+
+    // abstime is on the gettimeofday() clock
+    gettimeofday(&now, NULL);
+    ms = ((int64_t)abstime->tv_sec - now.tv_sec) * 1000 +
+         (abstime->tv_nsec / 1000000) - (now.tv_usec / 1000);
+    if (ms < 0) {
+        ms = 0;
+    }
+
+    return _mutex_take(mut, ms / portTICK_PERIOD_MS, ETIMEDOUT);
+}
+
 int pthread_mutex_unlock(pthread_mutex_t *mut) {
     struct pthread_mutex *mutex;
     int res;
@@ -155,30 +196,7 @@ int pthread_mutex_unlock(pthread_mutex_t *mut) {
 }
 
 int pthread_mutex_trylock(pthread_mutex_t *mut) {
-    struct pthread_mutex *mutex;
-    int res;
-    
-    // Get mutex
-    res = list_get(&mutex_list, *mut, (void **)&mutex);
-    if (res) {
-        errno = res;
-        return res;
-    }
-    
-    // Try lock
-    if (mutex->type == PTHREAD_MUTEX_RECURSIVE) {
-        if (xSemaphoreTakeRecursive(mutex->sem,0 ) != pdTRUE) {
-            errno = EBUSY;
-            return EBUSY;
-        }
-    } else {
-        if (xSemaphoreTake(mutex->sem,0 ) != pdTRUE) {
-            errno = EBUSY;
-            return EBUSY;
-        }
-    }
-    
-    return 0;
+    return _mutex_take(mut, 0, EBUSY);
 }
 
 int pthread_mutex_destroy(pthread_mutex_t *mut) {
@@ -214,6 +232,7 @@ int pthread_mutexattr_settype(pthread_mutexattr_t *attr, int type) {
     }
 
     temp_attr.type = type;
+    temp_attr.protocol = attr->protocol;
     
     res = _check_attr(&temp_attr);
     if (res) {
@@ -226,8 +245,44 @@ int pthread_mutexattr_settype(pthread_mutexattr_t *attr, int type) {
     return 0;
 }
 
+int pthread_mutexattr_setprotocol(pthread_mutexattr_t *attr, int protocol) {
+    pthread_mutexattr_t temp_attr;
+    int res;
+
+    // Check attr
+    if (!attr) {
+        errno = EINVAL;
+        return EINVAL;
+    }
+
+    temp_attr.type = attr->type;
+    temp_attr.protocol = protocol;
+
+    res = _check_attr(&temp_attr);
+    if (res) {
+        errno = res;
+        return res;
+    }
+
+    attr->protocol = protocol;
+
+    return 0;
+}
+
+int pthread_mutexattr_getprotocol(const pthread_mutexattr_t *attr, int *protocol) {
+    if (!attr || !protocol) {
+        errno = EINVAL;
+        return EINVAL;
+    }
+
+    *protocol = attr->protocol;
+
+    return 0;
+}
+
 int pthread_mutexattr_init(pthread_mutexattr_t *attr) {
     attr->type = PTHREAD_MUTEX_NORMAL;
+    attr->protocol = PTHREAD_PRIO_INHERIT;
     
     return 0;
 }
@@ -71,7 +71,7 @@ void _pthread_init() {
     list_init(&key_list, 1);
 }
 
-int _pthread_create(pthread_t *id, int stacksize, int initial_state,
+int _pthread_create(pthread_t *id, int stacksize, int initial_state, int core,
                     void *(*start_routine)(void *), void *args
 ) {
     xTaskHandle xCreatedTask;              // Related task
@@ -148,9 +148,9 @@ int _pthread_create(pthread_t *id, int stacksize, int initial_state,
     mtx_lock(&thread->init_mtx);
 
     // Create related task
-    res = xTaskCreate(
+    res = xTaskCreatePinnedToCore(
             pthreadTask, "lthread", stacksize, taskArgs,
-            tskDEF_PRIORITY, &xCreatedTask
+            tskDEF_PRIORITY, &xCreatedTask, core
     );
 	
     if(res != pdPASS) {
@@ -361,6 +361,17 @@ int _pthread_core(pthread_t id) {
     return (int)uxGetCoreID(thread->task);
 }
 
+// The FreeRTOS task behind a thread, or NULL if there is no such thread
+TaskHandle_t _pthread_task(pthread_t id) {
+    struct pthread *thread;
+
+    if (list_get(&thread_list, id, (void **)&thread)) {
+        return NULL;
+    }
+
+    return thread->task;
+}
+
 int _pthread_suspend(pthread_t id) {
     struct pthread *thread;
     int res;
@@ -271,9 +271,19 @@ typedef struct spiffs_t {
 #if SPIFFS_CACHE_STATS
   u32_t cache_hits;
   u32_t cache_misses;
+  u32_t cache_evictions;
 #endif
 #endif
 
+#if SPIFFS_NAME_CACHE
+  // name hash -> object index header page, see SPIFFS_NAME_SLOT
+  struct {
+    u32_t hash;               // 0 if the slot is empty
+    spiffs_obj_id obj_id;
+    spiffs_page_ix pix;
+  } name_cache[SPIFFS_NAME_CACHE];
+#endif
+
   // check callback function
   spiffs_check_callback check_cb_f;
   // file callback function
@@ -628,6 +638,29 @@ s32_t SPIFFS_gc_quick(spiffs *fs, u16_t max_free_pages);
  */
 s32_t SPIFFS_gc(spiffs *fs, u32_t size);
 
+/**
+ * Reclaims at most one block. A block with only deleted pages is erased if
+ * there is one, else the live pages of the block with the best garbage
+ * collection score are moved out and that block is erased. Calling this
+ * while the system is idle keeps free blocks in stock, so that writes need
+ * not collect garbage themselves.
+ *
+ * Will set err_no to SPIFFS_ERR_NO_DELETED_BLOCKS if no block has any
+ * deleted pages.
+ *
+ * @param fs            the file system struct
+ */
+s32_t SPIFFS_gc_step(spiffs *fs);
+
+/**
+ * Returns the erase count of a block, -1 if the block has never been
+ * erased by spiffs, or an error if bix is out of range.
+ *
+ * @param fs            the file system struct
+ * @param bix           the block index, 0 to number of blocks - 1
+ */
+s32_t SPIFFS_erase_count(spiffs *fs, u32_t bix);
+
 /**
  * Check if EOF reached.
  * @param fs            the file system struct
@@ -16,9 +16,14 @@
 #include <stddef.h>
 #include <stdio.h>
 
-// Turn off stats
-#define SPIFFS_CACHE_STATS 	    0
+// Cache and gc counters for file.stats()
+#ifdef CONFIG_SPIFFS_STATS
+#define SPIFFS_CACHE_STATS          1
+#define SPIFFS_GC_STATS             1
+#else
+#define SPIFFS_CACHE_STATS          0
 #define SPIFFS_GC_STATS             0
+#endif
 
 // Needs to align stuff
 #define SPIFFS_ALIGNED_OBJECT_INDEX_TABLES	1
@@ -30,6 +35,9 @@
 // Reduce the chance of returning disk full
 #define SPIFFS_GC_MAX_RUNS          256
 
+// Remember where known files are, see SPIFFS_NAME_CACHE
+#define SPIFFS_NAME_CACHE           CONFIG_SPIFFS_NAME_CACHE
+
 
 // compile time switches
 
@@ -119,6 +127,15 @@
 #define SPIFFS_OBJ_NAME_LEN             (32)
 #endif
 
+// Number of entries in a RAM cache from object name to the page of its
+// object index header. Finding a file by name checks the cached page and
+// only scans the object lookup pages of all blocks when that page no
+// longer holds the name. Each entry takes 8 bytes in the spiffs struct.
+// 0 disables the cache.
+#ifndef SPIFFS_NAME_CACHE
+#define SPIFFS_NAME_CACHE               0
+#endif
+
 // Size of buffer allocated on stack used when copying data.
 // Lower value generates more read/writes. No meaning having it bigger
 // than logical page size.
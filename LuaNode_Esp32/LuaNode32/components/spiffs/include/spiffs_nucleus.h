@@ -677,6 +677,14 @@ s32_t spiffs_object_find_object_index_header_by_name(
     const u8_t name[SPIFFS_OBJ_NAME_LEN],
     spiffs_page_ix *pix);
 
+#if SPIFFS_NAME_CACHE
+void spiffs_name_cache_fill(
+    spiffs *fs,
+    const u8_t *name,
+    spiffs_obj_id obj_id,
+    spiffs_page_ix pix);
+#endif
+
 // ---------------
 
 s32_t spiffs_gc_check(
@@ -700,6 +708,9 @@ s32_t spiffs_gc_clean(
 s32_t spiffs_gc_quick(
     spiffs *fs, u16_t max_free_pages);
 
+s32_t spiffs_gc_step(
+    spiffs *fs);
+
 // ---------------
 
 s32_t spiffs_fd_find_new(
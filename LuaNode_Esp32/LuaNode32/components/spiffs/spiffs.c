@@ -6,6 +6,8 @@
 #include "flash_api.h"
 #include "spiffs.h"
 #include "user_config.h"
+#include "task/task.h"
+#include "esp_system.h"
 
 static spiffs fs;
 
@@ -15,9 +17,17 @@ static spiffs fs;
 #define MIN_BLOCKS_FS		4
   
 static u8_t spiffs_work_buf[LOG_PAGE_SIZE*2];
-static u8_t spiffs_fds[32*4];
+#define FD_BYTES		48	/* at least sizeof(spiffs_fd), private to the nucleus */
+
+// One descriptor more than the file module may hold, for the Lua loader
+static u32_t spiffs_fds[FD_BYTES * (CONFIG_SPIFFS_MAX_OPEN_FILES + 1) / 4];
 #if SPIFFS_CACHE
-static u8_t spiffs_cache[(LOG_PAGE_SIZE+32)*2];
+static u8_t spiffs_cache[(LOG_PAGE_SIZE+32)*CONFIG_SPIFFS_CACHE_PAGES];
+#endif
+
+#ifdef CONFIG_SPIFFS_STATS
+static uint32_t write_count, write_max_us;
+static uint64_t write_total_us;
 #endif
 
 static s32_t my_spiffs_read(u32_t addr, u32_t size, u8_t *dst) {
@@ -124,7 +134,7 @@ static bool myspiffs_mount_internal(bool force_mount)
   int res = SPIFFS_mount(&fs,
     &cfg,
     spiffs_work_buf,
-    spiffs_fds,
+    (u8_t *)spiffs_fds,
     sizeof(spiffs_fds),
     spiffs_cache,
     sizeof(spiffs_cache),
@@ -134,8 +144,39 @@ static bool myspiffs_mount_internal(bool force_mount)
   return res == SPIFFS_OK;
 }
 
+#if CONFIG_SPIFFS_GC_RESERVE > 0
+// Set when a step didn't gain a free block, until more pages get deleted
+static bool gc_idle_stuck;
+static u32_t gc_idle_deleted;
+
+// Idle hook of the Lua task, tops up the free blocks one block at a time
+// so that writes rarely have to collect garbage themselves
+static bool myspiffs_gc_idle(void) {
+  if (!SPIFFS_mounted(&fs) || fs.free_blocks >= CONFIG_SPIFFS_GC_RESERVE)
+    return false;
+  if (gc_idle_stuck && fs.stats_p_deleted <= gc_idle_deleted)
+    return false;
+
+  u32_t free_blocks = fs.free_blocks;
+  if (SPIFFS_gc_step(&fs) < 0 || fs.free_blocks <= free_blocks) {
+    SPIFFS_clearerr(&fs);
+    gc_idle_stuck = true;
+    gc_idle_deleted = fs.stats_p_deleted;
+    return false;
+  }
+  gc_idle_stuck = false;
+  return true;
+}
+#endif
+
 bool myspiffs_mount() {
-  return myspiffs_mount_internal(false);
+  if (!myspiffs_mount_internal(false))
+    return false;
+#if CONFIG_SPIFFS_GC_RESERVE > 0
+  gc_idle_stuck = false;
+  task_add_idle_hook(myspiffs_gc_idle);
+#endif
+  return true;
 }
 
 void myspiffs_unmount() {
@@ -356,7 +397,7 @@ static vfs_item *myspiffs_vfs_readdir( const struct vfs_dir *dd ) {
 
   if ((stat = malloc( sizeof( struct myvfs_stat ) ))) {
     if (SPIFFS_readdir( d, &dirent )) {
-      stat->vfs_item.fs_type = VFS_FS_FATFS;
+      stat->vfs_item.fs_type = VFS_FS_SPIFFS;
       stat->vfs_item.fns     = &myspiffs_item_fns;
       // copy entries to vfs' directory item
       stat->s.size = dirent.size;
@@ -398,7 +439,18 @@ static int32_t myspiffs_vfs_read( const struct vfs_file *fd, void *ptr, size_t l
 static int32_t myspiffs_vfs_write( const struct vfs_file *fd, const void *ptr, size_t len ) {
   GET_FILE_FH(fd);
 
+#ifdef CONFIG_SPIFFS_STATS
+  uint32_t start = system_get_time();
+  int32_t res = SPIFFS_write( &fs, fh, (void *)ptr, len );
+  uint32_t us = system_get_time() - start;
+  write_count++;
+  write_total_us += us;
+  if (us > write_max_us)
+    write_max_us = us;
+  return res;
+#else
   return SPIFFS_write( &fs, fh, (void *)ptr, len );
+#endif
 }
 
 static int32_t myspiffs_vfs_lseek( const struct vfs_file *fd, int32_t off, int whence ) {
@@ -484,8 +536,6 @@ static vfs_file *myspiffs_vfs_open( const char *name, const char *mode ) {
     }
   }
 
-  test_spiffs();
-
   return NULL;
 }
 
@@ -557,6 +607,40 @@ static void myspiffs_vfs_clearerr( void ) {
 }
 
 
+// ---------------------------------------------------------------------------
+// statistics
+//
+bool myspiffs_stats( myspiffs_stats_t *st, bool reset ) {
+#ifdef CONFIG_SPIFFS_STATS
+  if (!SPIFFS_mounted(&fs))
+    return false;
+  st->cache_pages = CONFIG_SPIFFS_CACHE_PAGES;
+  st->cache_hits = fs.cache_hits;
+  st->cache_misses = fs.cache_misses;
+  st->cache_evictions = fs.cache_evictions;
+  st->gc_runs = fs.stats_gc_runs;
+  st->writes = write_count;
+  st->write_avg_us = write_count ? (uint32_t)(write_total_us / write_count) : 0;
+  st->write_max_us = write_max_us;
+  st->blocks = fs.block_count;
+  if (reset) {
+    fs.cache_hits = fs.cache_misses = fs.cache_evictions = 0;
+    fs.stats_gc_runs = 0;
+    write_count = write_max_us = 0;
+    write_total_us = 0;
+  }
+  return true;
+#else
+  (void)st; (void)reset;
+  return false;
+#endif
+}
+
+int32_t myspiffs_erase_count( uint32_t block ) {
+  return SPIFFS_erase_count(&fs, block);
+}
+
+
 // ---------------------------------------------------------------------------
 // VFS interface functions
 //
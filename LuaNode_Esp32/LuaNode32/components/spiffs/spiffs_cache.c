@@ -80,6 +80,9 @@ static s32_t spiffs_cache_page_remove_oldest(spiffs *fs, u8_t flag_mask, u8_t fl
   }
 
   if (cand_ix >= 0) {
+#if SPIFFS_CACHE_STATS
+    fs->cache_evictions++;
+#endif
     res = spiffs_cache_page_free(fs, cand_ix, 1);
   }
 
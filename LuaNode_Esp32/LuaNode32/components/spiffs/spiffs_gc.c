@@ -197,6 +197,46 @@ s32_t spiffs_gc_check(
 }
 
 // Updates page statistics for a block that is about to be erased
+// Reclaims at most one block, for callers collecting ahead of time.
+// A block holding nothing but deleted pages is simply erased, otherwise
+// the best candidate is cleaned as spiffs_gc_check would do it.
+// Returns SPIFFS_ERR_NO_DELETED_BLOCKS if no block has deleted pages.
+s32_t spiffs_gc_step(
+    spiffs *fs) {
+  s32_t res;
+  s32_t free_pages =
+      (SPIFFS_PAGES_PER_BLOCK(fs) - SPIFFS_OBJ_LOOKUP_PAGES(fs)) * (fs->block_count-2)
+      - fs->stats_p_allocated - fs->stats_p_deleted;
+  spiffs_block_ix *cands;
+  int count;
+  spiffs_block_ix cand;
+
+  res = spiffs_gc_quick(fs, 0);
+  if (res != SPIFFS_ERR_NO_DELETED_BLOCKS) {
+    return res;
+  }
+
+  res = spiffs_gc_find_candidate(fs, &cands, &count, free_pages <= 0);
+  SPIFFS_CHECK_RES(res);
+  if (count == 0) {
+    return SPIFFS_ERR_NO_DELETED_BLOCKS;
+  }
+#if SPIFFS_GC_STATS
+  fs->stats_gc_runs++;
+#endif
+  cand = cands[0];
+  SPIFFS_GC_DBG("gc_step: cleaning block %i\n", cand);
+  fs->cleaning = 1;
+  res = spiffs_gc_clean(fs, cand);
+  fs->cleaning = 0;
+  SPIFFS_CHECK_RES(res);
+
+  res = spiffs_gc_erase_page_stats(fs, cand);
+  SPIFFS_CHECK_RES(res);
+
+  return spiffs_gc_erase_block(fs, cand);
+}
+
 s32_t spiffs_gc_erase_page_stats(
     spiffs *fs,
     spiffs_block_ix bix) {
@@ -922,6 +922,9 @@ static s32_t spiffs_read_dir_v(
     e->type = objix_hdr.type;
     e->size = objix_hdr.size == SPIFFS_UNDEFINED_LEN ? 0 : objix_hdr.size;
     e->pix = pix;
+#if SPIFFS_NAME_CACHE
+    spiffs_name_cache_fill(fs, objix_hdr.name, obj_id, pix);
+#endif
     return SPIFFS_OK;
   }
 
@@ -1051,6 +1054,44 @@ s32_t SPIFFS_gc(spiffs *fs, u32_t size) {
 #endif // SPIFFS_READ_ONLY
 }
 
+s32_t SPIFFS_gc_step(spiffs *fs) {
+#if SPIFFS_READ_ONLY
+  (void)fs;
+  return SPIFFS_ERR_RO_NOT_IMPL;
+#else
+  s32_t res;
+  SPIFFS_API_CHECK_CFG(fs);
+  SPIFFS_API_CHECK_MOUNT(fs);
+  SPIFFS_LOCK(fs);
+
+  res = spiffs_gc_step(fs);
+
+  SPIFFS_API_CHECK_RES_UNLOCK(fs, res);
+  SPIFFS_UNLOCK(fs);
+  return 0;
+#endif // SPIFFS_READ_ONLY
+}
+
+s32_t SPIFFS_erase_count(spiffs *fs, u32_t bix) {
+  s32_t res;
+  spiffs_obj_id erase_count;
+  SPIFFS_API_CHECK_CFG(fs);
+  SPIFFS_API_CHECK_MOUNT(fs);
+  if (bix >= fs->block_count) {
+    fs->err_code = SPIFFS_ERR_INTERNAL;
+    return SPIFFS_ERR_INTERNAL;
+  }
+  SPIFFS_LOCK(fs);
+
+  res = _spiffs_rd(fs, SPIFFS_OP_C_READ | SPIFFS_OP_T_OBJ_LU2, 0,
+      SPIFFS_ERASE_COUNT_PADDR(fs, bix),
+      sizeof(spiffs_obj_id), (u8_t *)&erase_count);
+  SPIFFS_API_CHECK_RES_UNLOCK(fs, res);
+
+  SPIFFS_UNLOCK(fs);
+  return erase_count == (spiffs_obj_id)-1 ? -1 : (s32_t)erase_count;
+}
+
 s32_t SPIFFS_eof(spiffs *fs, spiffs_file fh) {
   s32_t res;
   SPIFFS_API_CHECK_CFG(fs);
@@ -759,6 +759,79 @@ s32_t spiffs_page_delete(
 }
 #endif // !SPIFFS_READ_ONLY
 
+#if SPIFFS_NAME_CACHE
+static u32_t spiffs_name_hash(const u8_t *name) {
+  u32_t h = 2166136261u;  // FNV-1a
+  while (*name) {
+    h = (h ^ *name++) * 16777619u;
+  }
+  return h ? h : 1;
+}
+
+// FNV's low bits mix poorly, fold the high half in before taking the slot
+#define SPIFFS_NAME_SLOT(hash)  (((hash) ^ ((hash) >> 16)) % SPIFFS_NAME_CACHE)
+
+static void spiffs_name_cache_put(spiffs *fs, const u8_t *name, spiffs_obj_id obj_id, spiffs_page_ix pix) {
+  u32_t hash = spiffs_name_hash(name);
+  u32_t slot = SPIFFS_NAME_SLOT(hash);
+  fs->name_cache[slot].hash = hash;
+  fs->name_cache[slot].obj_id = obj_id & ~SPIFFS_OBJ_ID_IX_FLAG;
+  fs->name_cache[slot].pix = pix;
+}
+
+// Only takes an empty slot, for files a listing comes across: a stat or
+// open of each as it is listed then finds it without a scan, while files
+// in use keep their slots
+void spiffs_name_cache_fill(spiffs *fs, const u8_t *name, spiffs_obj_id obj_id, spiffs_page_ix pix) {
+  u32_t hash = spiffs_name_hash(name);
+  u32_t slot = SPIFFS_NAME_SLOT(hash);
+  if (fs->name_cache[slot].hash == 0) {
+    fs->name_cache[slot].hash = hash;
+    fs->name_cache[slot].obj_id = obj_id & ~SPIFFS_OBJ_ID_IX_FLAG;
+    fs->name_cache[slot].pix = pix;
+  }
+}
+
+// Follows index header pages as they are rewritten or moved, and forgets
+// deleted objects
+static void spiffs_name_cache_event(spiffs *fs, int ev, spiffs_obj_id obj_id, spiffs_page_ix new_pix) {
+  u32_t i;
+  for (i = 0; i < SPIFFS_NAME_CACHE; i++) {
+    if (fs->name_cache[i].hash == 0 || fs->name_cache[i].obj_id != obj_id) continue;
+    if (ev == SPIFFS_EV_IX_DEL) {
+      fs->name_cache[i].hash = 0;
+    } else {
+      fs->name_cache[i].pix = new_pix;
+    }
+  }
+}
+
+// The cached page for name, if it still is a live index header by that
+// name. A rename or a page moved behind the cache's back just misses.
+static s32_t spiffs_name_cache_get(spiffs *fs, const u8_t *name, spiffs_page_ix *pix) {
+  u32_t hash = spiffs_name_hash(name);
+  u32_t slot = SPIFFS_NAME_SLOT(hash);
+  spiffs_page_object_ix_header objix_hdr;
+  s32_t res;
+  if (fs->name_cache[slot].hash != hash) {
+    return SPIFFS_ERR_NOT_FOUND;
+  }
+  res = _spiffs_rd(fs, SPIFFS_OP_T_OBJ_LU2 | SPIFFS_OP_C_READ,
+      0, SPIFFS_PAGE_TO_PADDR(fs, fs->name_cache[slot].pix), sizeof(spiffs_page_object_ix_header), (u8_t *)&objix_hdr);
+  SPIFFS_CHECK_RES(res);
+  if (objix_hdr.p_hdr.obj_id == (fs->name_cache[slot].obj_id | SPIFFS_OBJ_ID_IX_FLAG) &&
+      objix_hdr.p_hdr.span_ix == 0 &&
+      (objix_hdr.p_hdr.flags & (SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_FINAL | SPIFFS_PH_FLAG_IXDELE)) ==
+          (SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_IXDELE) &&
+      strcmp((const char*)name, (char*)objix_hdr.name) == 0) {
+    *pix = fs->name_cache[slot].pix;
+    return SPIFFS_OK;
+  }
+  fs->name_cache[slot].hash = 0;
+  return SPIFFS_ERR_NOT_FOUND;
+}
+#endif
+
 #if !SPIFFS_READ_ONLY
 // Create an object index header page with empty index and undefined length
 s32_t spiffs_object_create(
@@ -808,6 +881,9 @@ s32_t spiffs_object_create(
   if (objix_hdr_pix) {
     *objix_hdr_pix = SPIFFS_OBJ_LOOKUP_ENTRY_TO_PIX(fs, bix, entry);
   }
+#if SPIFFS_NAME_CACHE
+  spiffs_name_cache_put(fs, name, obj_id, SPIFFS_OBJ_LOOKUP_ENTRY_TO_PIX(fs, bix, entry));
+#endif
 
   return res;
 }
@@ -908,6 +984,12 @@ void spiffs_cb_object_event(
     }
   }
 
+#if SPIFFS_NAME_CACHE
+  if (spix == 0) {
+    spiffs_name_cache_event(fs, ev, obj_id, new_pix);
+  }
+#endif
+
   // callback to user if object index header
   if (fs->file_cb_f && spix == 0 && (obj_id_raw & SPIFFS_OBJ_ID_IX_FLAG)) {
     spiffs_fileop_type op;
@@ -1434,7 +1516,6 @@ static s32_t spiffs_object_find_object_index_header_by_name_v(
     int ix_entry,
     const void *user_const_p,
     void *user_var_p) {
-  (void)user_var_p;
   s32_t res;
   spiffs_page_object_ix_header objix_hdr;
   spiffs_page_ix pix = SPIFFS_OBJ_LOOKUP_ENTRY_TO_PIX(fs, bix, ix_entry);
@@ -1449,6 +1530,9 @@ static s32_t spiffs_object_find_object_index_header_by_name_v(
       (objix_hdr.p_hdr.flags & (SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_FINAL | SPIFFS_PH_FLAG_IXDELE)) ==
           (SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_IXDELE)) {
     if (strcmp((const char*)user_const_p, (char*)objix_hdr.name) == 0) {
+      if (user_var_p) {
+        *(spiffs_obj_id *)user_var_p = obj_id;
+      }
       return SPIFFS_OK;
     }
   }
@@ -1464,6 +1548,19 @@ s32_t spiffs_object_find_object_index_header_by_name(
   s32_t res;
   spiffs_block_ix bix;
   int entry;
+  spiffs_obj_id obj_id = SPIFFS_OBJ_ID_FREE;
+
+#if SPIFFS_NAME_CACHE
+  spiffs_page_ix cached_pix;
+  res = spiffs_name_cache_get(fs, name, &cached_pix);
+  if (res != SPIFFS_ERR_NOT_FOUND) {
+    SPIFFS_CHECK_RES(res);
+    if (pix) {
+      *pix = cached_pix;
+    }
+    return res;
+  }
+#endif
 
   res = spiffs_obj_lu_find_entry_visitor(fs,
       fs->cursor_block_ix,
@@ -1472,7 +1569,7 @@ s32_t spiffs_object_find_object_index_header_by_name(
       0,
       spiffs_object_find_object_index_header_by_name_v,
       name,
-      0,
+      &obj_id,
       &bix,
       &entry);
 
@@ -1484,6 +1581,11 @@ s32_t spiffs_object_find_object_index_header_by_name(
   if (pix) {
     *pix = SPIFFS_OBJ_LOOKUP_ENTRY_TO_PIX(fs, bix, entry);
   }
+#if SPIFFS_NAME_CACHE
+  spiffs_name_cache_put(fs, name, obj_id, SPIFFS_OBJ_LOOKUP_ENTRY_TO_PIX(fs, bix, entry));
+#else
+  (void)obj_id;
+#endif
 
   fs->cursor_block_ix = bix;
   fs->cursor_obj_lu_entry = entry;
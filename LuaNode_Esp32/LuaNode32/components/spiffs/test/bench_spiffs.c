@@ -0,0 +1,295 @@
+/*
+ * bench_spiffs.c
+ *
+ * Throughput of SPIFFS for each page size, block size, fill level and
+ * number of cache pages, on the same kind of RAM flash test_spiffs.c
+ * emulates. Built by "make -C host spiffs-bench", once per combination
+ * of the compile time SPIFFS_CACHE and SPIFFS_CACHE_WR settings.
+ *
+ * The host is far faster than the device at everything but the flash,
+ * so times are not measured but modelled: every flash access of a phase
+ * is costed with the FLASH_*_US figures, typical of the SPI NOR chips
+ * on ESP32 modules. That is what the settings actually change. Each
+ * combination prints one CSV line, after a header line.
+ *
+ *   spiffs-bench [-s kbytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spiffs.h"
+#include "spiffs_nucleus.h"
+
+// Cost of a flash access in us: per call, then per byte. An erase is per
+// physical sector.
+#ifndef FLASH_READ_US
+#define FLASH_READ_US       8
+#define FLASH_READ_BYTE_US  0.2
+#define FLASH_WRITE_US      10
+#define FLASH_WRITE_BYTE_US 2.8
+#define FLASH_ERASE_US      45000
+#endif
+
+#define SECTOR_SIZE     4096
+#define FLASH_DEFAULT   (96*1024)   // the spiffs partition of the device
+#define FILE_SIZE       4096
+#define CHUNK           64          // a line of a log, say
+#define MAX_FILES       8
+#define OPEN_ROUNDS     8
+#define CHURN_FACTOR    1           // rewrite this many times the fs size
+
+static const u32_t page_sizes[] = { 128, 256, 512 };
+static const u32_t block_sizes[] = { 4096, 8192, 16384 };
+static const u32_t fill_pcts[] = { 0, 50, 75, 90 };
+#if SPIFFS_CACHE
+static const u32_t cache_pages[] = { 1, 2, 4, 8 };
+#else
+static const u32_t cache_pages[] = { 0 };
+#endif
+
+#if SPIFFS_CACHE && SPIFFS_CACHE_WR
+#define CACHE_WR 1
+#else
+#define CACHE_WR 0
+#endif
+
+#define ELEMS(a) (sizeof(a) / sizeof((a)[0]))
+
+static u8_t *area;
+static u32_t area_size;
+
+static struct {
+  u32_t reads, read_bytes;
+  u32_t writes, write_bytes;
+  u32_t erases;
+} ops;
+
+static spiffs fs;
+static u8_t *work;
+static u8_t fds[64*8];
+static u8_t *cache;
+
+static s32_t _read(u32_t addr, u32_t size, u8_t *dst) {
+  ops.reads++;
+  ops.read_bytes += size;
+  memcpy(dst, &area[addr], size);
+  return SPIFFS_OK;
+}
+
+static s32_t _write(u32_t addr, u32_t size, u8_t *src) {
+  u32_t i;
+  ops.writes++;
+  ops.write_bytes += size;
+  for (i = 0; i < size; i++) {
+    area[addr + i] &= src[i];
+  }
+  return SPIFFS_OK;
+}
+
+static s32_t _erase(u32_t addr, u32_t size) {
+  ops.erases += size / SECTOR_SIZE;
+  memset(&area[addr], 0xff, size);
+  return SPIFFS_OK;
+}
+
+// modelled time of the flash accesses since the last call
+static double take_us(void) {
+  double us = ops.reads * FLASH_READ_US + ops.read_bytes * FLASH_READ_BYTE_US +
+      ops.writes * FLASH_WRITE_US + ops.write_bytes * FLASH_WRITE_BYTE_US +
+      ops.erases * (double)FLASH_ERASE_US;
+  memset(&ops, 0, sizeof(ops));
+  return us;
+}
+
+static int setup(u32_t page, u32_t block, u32_t npages) {
+  spiffs_config cfg;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.hal_read_f = _read;
+  cfg.hal_write_f = _write;
+  cfg.hal_erase_f = _erase;
+  cfg.phys_size = area_size - area_size % block;
+  cfg.phys_addr = 0;
+  cfg.phys_erase_block = SECTOR_SIZE;
+  cfg.log_block_size = block;
+  cfg.log_page_size = page;
+
+  memset(&fs, 0, sizeof(fs));
+  free(work);
+  free(cache);
+  work = malloc(page * 2);
+  u32_t cache_size = 0;
+  cache = NULL;
+#if SPIFFS_CACHE
+  // plus what mounting may cut off to align it
+  cache_size = sizeof(spiffs_cache) + npages * (sizeof(spiffs_cache_page) + page) + 2 * sizeof(void *);
+  cache = malloc(cache_size);
+#endif
+  memset(area, 0xff, area_size);
+
+  // a first mount fails on blank flash, but leaves fs configured to format
+  SPIFFS_mount(&fs, &cfg, work, fds, sizeof(fds), cache, cache_size, 0);
+  SPIFFS_unmount(&fs);
+  if (SPIFFS_format(&fs) != SPIFFS_OK) return -1;
+  return SPIFFS_mount(&fs, &cfg, work, fds, sizeof(fds), cache, cache_size, 0);
+}
+
+static int write_file(const char *name, const u8_t *data, u32_t size) {
+  spiffs_file fd = SPIFFS_open(&fs, name, SPIFFS_CREAT | SPIFFS_TRUNC | SPIFFS_RDWR, 0);
+  if (fd < 0) return -1;
+  u32_t done;
+  for (done = 0; done < size; done += CHUNK) {
+    if (SPIFFS_write(&fs, fd, (void *)(data + done), CHUNK) != CHUNK) {
+      SPIFFS_close(&fs, fd);
+      return -1;
+    }
+  }
+  return SPIFFS_close(&fs, fd);
+}
+
+static int read_file(const char *name, u8_t *buf, u32_t size) {
+  spiffs_file fd = SPIFFS_open(&fs, name, SPIFFS_RDONLY, 0);
+  if (fd < 0) return -1;
+  u32_t done;
+  for (done = 0; done < size; done += CHUNK) {
+    if (SPIFFS_read(&fs, fd, buf + done, CHUNK) != CHUNK) {
+      SPIFFS_close(&fs, fd);
+      return -1;
+    }
+  }
+  return SPIFFS_close(&fs, fd);
+}
+
+#define NOT_USABLE    -1
+#define NO_ROOM       -2
+#define FAILED        -3
+
+// One combination; NOT_USABLE if the sizes don't make a file system,
+// NO_ROOM if the fill leaves none for the test files, FAILED if spiffs
+// returns an error, usually SPIFFS_ERR_FULL as gc can't keep up
+static int run(u32_t page, u32_t block, u32_t fill, u32_t npages) {
+  static u8_t data[FILE_SIZE], buf[FILE_SIZE];
+  char name[32];
+  u32_t total, used;
+  int i, files, round;
+
+  if (area_size / block < 4 || block / page < 8) return NOT_USABLE;
+  if (setup(page, block, npages) != SPIFFS_OK) return NOT_USABLE;
+  SPIFFS_info(&fs, &total, &used);
+
+  // static data up to the fill level, not measured
+  for (i = 0; used < (unsigned long long)total * fill / 100; i++) {
+    sprintf(name, "fill%d", i);
+    if (write_file(name, data, FILE_SIZE) != SPIFFS_OK) break;
+    SPIFFS_info(&fs, &total, &used);
+  }
+  // the measured files take half of what is left, less two blocks, so
+  // that gc has room to work
+  files = used + 2 * block < total ? (total - used - 2 * block) / 2 / FILE_SIZE : 0;
+  if (files > MAX_FILES) files = MAX_FILES;
+  if (files < 1) return NO_ROOM;
+#if SPIFFS_CACHE && SPIFFS_CACHE_STATS
+  fs.cache_hits = fs.cache_misses = 0;
+#endif
+#if SPIFFS_GC_STATS
+  fs.stats_gc_runs = 0;
+#endif
+  take_us();
+
+  for (i = 0; i < files; i++) {
+    sprintf(name, "f%d", i);
+    memset(data, i, sizeof(data));
+    if (write_file(name, data, FILE_SIZE) != SPIFFS_OK) return FAILED;
+  }
+  double write_us = take_us();
+
+  for (i = 0; i < files; i++) {
+    sprintf(name, "f%d", i);
+    if (read_file(name, buf, FILE_SIZE) != SPIFFS_OK) return FAILED;
+  }
+  double read_us = take_us();
+
+  for (round = 0; round < OPEN_ROUNDS; round++) {
+    for (i = 0; i < files; i++) {
+      sprintf(name, "f%d", i);
+      spiffs_file fd = SPIFFS_open(&fs, name, SPIFFS_RDONLY, 0);
+      if (fd < 0) return FAILED;
+      SPIFFS_close(&fs, fd);
+    }
+  }
+  double open_us = take_us();
+
+  // rewriting over and over leaves deleted pages for gc to reclaim
+  u32_t churned = 0;
+  for (i = 0; churned < total * CHURN_FACTOR; i = (i + 1) % files) {
+    sprintf(name, "f%d", i);
+    if (write_file(name, data, FILE_SIZE) != SPIFFS_OK) return FAILED;
+    churned += FILE_SIZE;
+  }
+  u32_t churn_erases = ops.erases;
+  double churn_us = take_us();
+
+  for (i = 0; i < files; i++) {
+    sprintf(name, "f%d", i);
+    if (SPIFFS_remove(&fs, name) != SPIFFS_OK) return FAILED;
+  }
+  double remove_us = take_us();
+
+  u32_t hits = 0, misses = 0, gc_runs = 0;
+#if SPIFFS_CACHE && SPIFFS_CACHE_STATS
+  hits = fs.cache_hits;
+  misses = fs.cache_misses;
+#endif
+#if SPIFFS_GC_STATS
+  gc_runs = fs.stats_gc_runs;
+#endif
+  u32_t bytes = files * FILE_SIZE;
+  printf("%u,%u,%u,%u,%u,%u,%.1f,%.1f,%.0f,%.0f,%.1f,%u,%u,%.1f\n",
+      page, block, fill, npages, SPIFFS_CACHE, CACHE_WR,
+      bytes / 1024.0 / (write_us / 1e6),
+      bytes / 1024.0 / (read_us / 1e6),
+      files * OPEN_ROUNDS / (open_us / 1e6),
+      files / (remove_us / 1e6),
+      churned / 1024.0 / (churn_us / 1e6),
+      gc_runs, churn_erases,
+      hits + misses ? hits * 100.0 / (hits + misses) : 0.0);
+  SPIFFS_unmount(&fs);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  unsigned p, b, f, c;
+  int res;
+  area_size = FLASH_DEFAULT;
+  if (argc == 3 && !strcmp(argv[1], "-s")) {
+    area_size = strtoul(argv[2], NULL, 0) * 1024;
+  } else if (argc != 1) {
+    fprintf(stderr, "usage: %s [-s kbytes]\n", argv[0]);
+    return 2;
+  }
+  area = malloc(area_size);
+  if (!area) return 1;
+
+  printf("page,block,fill_pct,cache_pages,cache,cache_wr,write_kbs,read_kbs,"
+      "open_per_s,remove_per_s,churn_kbs,gc_runs,churn_erases,cache_hit_pct\n");
+  for (p = 0; p < ELEMS(page_sizes); p++) {
+    for (b = 0; b < ELEMS(block_sizes); b++) {
+      for (f = 0; f < ELEMS(fill_pcts); f++) {
+        for (c = 0; c < ELEMS(cache_pages); c++) {
+          res = run(page_sizes[p], block_sizes[b], fill_pcts[f], cache_pages[c]);
+          if (res == NOT_USABLE) {
+            fprintf(stderr, "page %u block %u: not a usable fs\n", page_sizes[p], block_sizes[b]);
+          } else if (res == NO_ROOM) {
+            fprintf(stderr, "page %u block %u fill %u%%: no room left\n", page_sizes[p],
+                block_sizes[b], fill_pcts[f]);
+          } else if (res == FAILED) {
+            fprintf(stderr, "page %u block %u fill %u%% cache %u: error %d\n", page_sizes[p],
+                block_sizes[b], fill_pcts[f], cache_pages[c], SPIFFS_errno(&fs));
+          }
+        }
+      }
+    }
+  }
+  return 0;
+}
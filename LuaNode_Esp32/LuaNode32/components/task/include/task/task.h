@@ -28,11 +28,107 @@ bool task_post(task_prio_t priority, task_handle_t handle, task_param_t param);
 #define task_post_medium(handle,param) task_post(TASK_PRIORITY_MEDIUM, handle, param)
 #define task_post_high(handle,param)   task_post(TASK_PRIORITY_HIGH,   handle, param)
 
+/*
+* Post only if no coalesced event for this handle is already queued at this
+* priority or a higher one. Meant for handlers which drain their own
+* backlog, so a single queued wakeup is as good as many. When skipped, the
+* param of the queued event is the one delivered. A post at a higher
+* priority than the queued event goes ahead, so the handler may then run
+* once more with nothing to do. Returns true if an event is queued when
+* the call returns.
+*/
+bool task_post_coalesced(task_prio_t priority, task_handle_t handle, task_param_t param);
+
+#define task_post_coalesced_low(handle,param)    task_post_coalesced(TASK_PRIORITY_LOW,    handle, param)
+#define task_post_coalesced_medium(handle,param) task_post_coalesced(TASK_PRIORITY_MEDIUM, handle, param)
+#define task_post_coalesced_high(handle,param)   task_post_coalesced(TASK_PRIORITY_HIGH,   handle, param)
+
+/* Number of posts skipped by task_post_coalesced() since boot */
+uint32_t task_get_coalesced_count(void);
+
 typedef void (*task_callback_t)(task_param_t param, task_prio_t prio);
 
 bool task_init_handler(task_prio_t priority, uint8 qlen);
 task_handle_t task_get_id(task_callback_t t);
 
+/* Resize a priority queue; fails unless the queue is currently empty */
+bool task_resize_queue(task_prio_t priority, uint8 qlen);
+
+typedef struct {
+  uint32_t qlen;     /* queue capacity */
+  uint32_t waiting;  /* events currently queued */
+  uint32_t hwm;      /* most events ever queued at once */
+  uint32_t posted;   /* successful posts */
+  uint32_t failed;   /* posts dropped because the queue was full */
+  uint32_t aged;     /* events run ahead of higher priorities, having
+                        waited past CONFIG_TASK_AGING_MS */
+} task_queue_stats_t;
+
+bool task_get_queue_stats(task_prio_t priority, task_queue_stats_t *stats);
+
+/* Per-priority batch budget for the message pump, 0 drains until empty.
+ * Without CONFIG_TASK_BATCH_DRAIN the pump handles one event per pass and
+ * task_set_budget() returns false. */
+bool task_set_budget (task_prio_t priority, uint8_t budget);
+uint8_t task_get_budget (task_prio_t priority);
+
+typedef struct {
+  uint32_t events;          /* events dispatched since boot */
+  uint32_t passes;          /* pump passes which dispatched anything */
+  uint32_t avg_batch_x100;  /* events per pass, scaled by 100 */
+  uint32_t events_per_sec;  /* rate since the previous stats read */
+  uint32_t sleeps;          /* times the pump blocked with nothing to do */
+  uint32_t wake_avg_us;     /* from the post that woke it to running again */
+  uint32_t wake_max_us;
+} task_pump_stats_t;
+
+/* Snapshot the pump counters; also restarts the events/sec window */
+void task_get_pump_stats (task_pump_stats_t *stats);
+
+/* Optional label for a handle, reported alongside its timing stats. The
+ * string must outlive the handle (i.e. be a literal). */
+void task_set_name (task_handle_t handle, const char *name);
+
+#define TASK_HIST_BUCKETS 16
+
+typedef struct {
+  uint32_t count;
+  uint64_t queue_total_us;     /* time between task_post and dispatch */
+  uint64_t run_total_us;       /* time spent in the handler */
+  uint32_t queue_max_us;
+  uint32_t run_max_us;
+  uint32_t queue_hist[TASK_HIST_BUCKETS];  /* log2 microsecond buckets */
+  uint32_t run_hist[TASK_HIST_BUCKETS];
+} task_timing_t;
+
+int task_get_handle_count (void);
+
+/* Fetch (and optionally clear) the timing of the index'th handle allocated
+ * by task_get_id(). Fails unless built with CONFIG_TASK_LATENCY_STATS. */
+bool task_get_timing (int index, task_timing_t *timing, const char **name, bool reset);
+
+/* Busy percentage of each core since the previous call (or boot), for up
+ * to max_cores cores. Returns the number of cores filled in, 0 unless built
+ * with CONFIG_TASK_CPULOAD. */
+int task_get_cpuload (uint8_t *busy_pct, int max_cores);
+
+/* Work for the pump to do when no events are waiting, such as garbage
+ * collection in small steps. A hook returns true while it has more to do;
+ * the pump checks for events between calls and only sleeps once all hooks
+ * returned false. A hook which returned false isn't called again until
+ * the next event has been dispatched. Up to TASK_IDLE_HOOKS hooks can be
+ * added; task_add_idle_hook() fails when they are all taken. */
+#define TASK_IDLE_HOOKS 4
+typedef bool (*task_idle_hook_t) (void);
+bool task_add_idle_hook (task_idle_hook_t hook);
+void task_remove_idle_hook (task_idle_hook_t hook);
+
+/* Called by the pump before (begin true) and after each handler it runs,
+ * with the index of its handle as task_get_timing() takes it. One hook at
+ * a time; NULL removes it. */
+typedef void (*task_dispatch_hook_t) (int index, bool begin);
+void task_set_dispatch_hook (task_dispatch_hook_t hook);
+
 /* RTOS loop to pump task messages until infinity */
 void task_pump_messages (void);
 
@@ -5,18 +5,29 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "sdkconfig.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "freertos/queue.h"
 #include "freertos/semphr.h"
+#include "esp_system.h"
+#include "trace.h"
+#ifdef CONFIG_TASK_CPULOAD
+#include "rom/ets_sys.h"
+#include "xtensa/hal.h"
+#endif
 
 #define TASK_HANDLE_MONIKER 0x68680000
 #define TASK_HANDLE_MASK    0xFFF80000
 #define TASK_HANDLE_UNMASK  (~TASK_HANDLE_MASK)
 #define TASK_HANDLE_ALLOCATION_BRICK 4   // must be a power of 2
-#define TASK_DEFAULT_QUEUE_LEN 8
 
 #define CHECK(p,v,msg) if (!(p)) { NODE_DBG ( msg ); return (v); }
 
+#if defined(CONFIG_TASK_LATENCY_STATS) || CONFIG_TASK_AGING_MS > 0
+#define TASK_STAMP 1
+#endif
+
 #ifndef NODE_DBG
 # define NODE_DBG(...) do{}while(0)
 #endif
@@ -25,12 +36,136 @@ typedef struct
 {
   task_handle_t sig;
   task_param_t par;
+#ifdef TASK_STAMP
+  uint32_t posted_us;
+#endif
 } task_event_t;
 
+static inline bool task_cas (volatile uint32_t *addr, uint32_t expect, uint32_t set)
+{
+  uxPortCompareSet (addr, expect, &set);
+  return set == expect;
+}
+
+#ifdef CONFIG_TASK_LOCKFREE_RING
+/*
+ * Bounded multi-producer/single-consumer ring. Each slot carries a sequence
+ * number which tells a producer whether the slot is free for position pos
+ * (seq == pos) and tells the consumer whether it has been published
+ * (seq == pos + 1). Producers claim a position with compare-and-set on
+ * head; only the pump task ever advances tail.
+ */
+typedef struct
+{
+  volatile uint32_t seq;
+  task_event_t ev;
+} task_slot_t;
+
+typedef struct
+{
+  volatile uint32_t head;
+  uint32_t tail;
+  uint32_t mask;
+  task_slot_t slot[0];
+} task_ring_t;
+
+typedef task_ring_t *task_q_t;
+
+static task_q_t q_create (uint32_t len)
+{
+  uint32_t cap = 1;
+  while (cap < len)
+    cap <<= 1;
+  task_ring_t *r = (task_ring_t *)malloc (sizeof (task_ring_t) + cap * sizeof (task_slot_t));
+  if (!r)
+    return NULL;
+  r->head = r->tail = 0;
+  r->mask = cap - 1;
+  for (uint32_t i = 0; i < cap; ++i)
+    r->slot[i].seq = i;
+  return r;
+}
+
+static inline void q_delete (task_q_t q) { free (q); }
+
+static inline uint32_t q_capacity (task_q_t q) { return q->mask + 1; }
+
+static bool q_send (task_q_t q, const task_event_t *ev)
+{
+  uint32_t pos = q->head;
+  task_slot_t *slot;
+  for (;;)
+  {
+    slot = &q->slot[pos & q->mask];
+    int32_t dif = (int32_t)(slot->seq - pos);
+    if (dif == 0)
+    {
+      if (task_cas (&q->head, pos, pos + 1))
+        break;
+      pos = q->head;
+    }
+    else if (dif < 0)
+      return false; /* full */
+    else
+      pos = q->head;
+  }
+  slot->ev = *ev;
+  __sync_synchronize ();
+  slot->seq = pos + 1;
+  return true;
+}
+
+static bool q_receive (task_q_t q, task_event_t *ev)
+{
+  task_slot_t *slot = &q->slot[q->tail & q->mask];
+  if (slot->seq != q->tail + 1)
+    return false; /* empty, or the next producer hasn't published yet */
+  *ev = slot->ev;
+  __sync_synchronize ();
+  slot->seq = q->tail + q->mask + 1;
+  ++q->tail;
+  return true;
+}
+
+static bool q_peek (task_q_t q, task_event_t *ev)
+{
+  task_slot_t *slot = &q->slot[q->tail & q->mask];
+  if (slot->seq != q->tail + 1)
+    return false;
+  *ev = slot->ev;
+  return true;
+}
+
+static inline uint32_t q_waiting (task_q_t q) { return q->head - q->tail; }
+#define q_waiting_isr q_waiting
+
+/* Set by the pump just before it blocks; a producer that clears it owns
+ * the wakeup, so the semaphore is only given on the idle-to-busy edge. */
+static volatile uint32_t pump_idle;
+#else
+typedef xQueueHandle task_q_t;
+
+static inline task_q_t q_create (uint32_t len)
+{ return xQueueCreate (len, sizeof (task_event_t)); }
+static inline void q_delete (task_q_t q) { vQueueDelete (q); }
+static inline uint32_t q_capacity (task_q_t q)
+{ return uxQueueMessagesWaiting (q) + uxQueueSpacesAvailable (q); }
+static inline bool q_send (task_q_t q, const task_event_t *ev)
+{ return pdPASS == xQueueSendToBackFromISR (q, ev, NULL); }
+static inline bool q_receive (task_q_t q, task_event_t *ev)
+{ return pdTRUE == xQueueReceive (q, ev, 0); }
+static inline bool q_peek (task_q_t q, task_event_t *ev)
+{ return pdTRUE == xQueuePeek (q, ev, 0); }
+static inline uint32_t q_waiting (task_q_t q)
+{ return uxQueueMessagesWaiting (q); }
+static inline uint32_t q_waiting_isr (task_q_t q)
+{ return uxQueueMessagesWaitingFromISR (q); }
+#endif
+
 /*
  * Private arrays to hold the 3 event task queues and the dispatch callbacks
  */
-static xQueueHandle task_Q[TASK_PRIORITY_COUNT];
+static task_q_t task_Q[TASK_PRIORITY_COUNT];
 
 /* Rather than using a QueueSet (which requires queues to be empty when created)
  * we use a binary semaphore to unblock the pump whenever something is posted */
@@ -39,6 +174,64 @@ static xSemaphoreHandle pending;
 static task_callback_t *task_func;
 static int task_count;
 
+/* Per-handle bit mask of the priorities a coalesced post for that handle is
+ * queued at. Fixed, as posters on other tasks and ISRs CAS on it while
+ * handles are still being added. */
+static volatile uint32_t task_coalesce[CONFIG_TASK_HANDLES_MAX];
+static volatile uint32_t task_coalesced_count;
+
+#ifdef CONFIG_TASK_LATENCY_STATS
+/* Per-handle queue latency and handler run time, only touched by the pump */
+static task_timing_t *task_timing;
+static const char **task_name;
+#endif
+
+/* Queue lengths used when task_get_id() lazily creates the queues */
+static const uint8_t task_default_qlen[TASK_PRIORITY_COUNT] = {
+  CONFIG_TASK_QUEUE_LEN_LOW,
+  CONFIG_TASK_QUEUE_LEN_MEDIUM,
+  CONFIG_TASK_QUEUE_LEN_HIGH
+};
+
+static uint16_t task_qlen[TASK_PRIORITY_COUNT];
+
+/* Per-priority post accounting, updated by the producers */
+static volatile uint32_t task_posted[TASK_PRIORITY_COUNT];
+static volatile uint32_t task_post_fail[TASK_PRIORITY_COUNT];
+static volatile uint32_t task_hwm[TASK_PRIORITY_COUNT];
+
+#if CONFIG_TASK_AGING_MS > 0
+/* Events run ahead of higher priorities for having waited too long */
+static uint32_t task_aged[TASK_PRIORITY_COUNT];
+#endif
+
+#ifdef CONFIG_TASK_BATCH_DRAIN
+/* Per-priority number of events drained in a single pump pass, 0 = no limit */
+static uint8_t task_budget[TASK_PRIORITY_COUNT] = {
+  CONFIG_TASK_BUDGET_LOW,
+  CONFIG_TASK_BUDGET_MEDIUM,
+  CONFIG_TASK_BUDGET_HIGH
+};
+#endif
+
+/* Pump counters; only ever written from the pump task itself */
+static uint32_t pump_events;
+static uint32_t pump_passes;
+static uint32_t pump_window_events;
+static TickType_t pump_window_start;
+
+/* Set while the pump is blocked waiting for events. The post which clears
+ * it stamps the time, so the pump can tell how long it took to wake up,
+ * which with idle light sleep includes bringing the clocks back. */
+static volatile uint32_t pump_waiting;
+static volatile uint32_t pump_wake_us;
+static uint32_t pump_sleeps;
+static uint32_t pump_wakes;
+static uint64_t pump_wake_total_us;
+static uint32_t pump_wake_max_us;
+
+static task_dispatch_hook_t dispatch_hook;
+
 
 /*
  * Initialise the task handle callback for a given priority.  This doesn't need
@@ -50,7 +243,9 @@ bool task_init_handler(task_prio_t priority, uint8 qlen) {
 
   if (task_Q[priority] == NULL)
   {
-    task_Q[priority] = xQueueCreate (qlen, sizeof (task_event_t));
+    task_Q[priority] = q_create (qlen);
+    if (task_Q[priority])
+      task_qlen[priority] = q_capacity (task_Q[priority]);
     return task_Q[priority] != NULL;
   }
   else
@@ -58,15 +253,45 @@ bool task_init_handler(task_prio_t priority, uint8 qlen) {
 }
 
 
+/*
+ * Replace the queue for a given priority with one of a different length.
+ * Only permitted while the queue is empty, i.e. before traffic starts; the
+ * old queue is kept if the new one can't be allocated.
+ */
+bool task_resize_queue (task_prio_t priority, uint8 qlen)
+{
+  if (priority >= TASK_PRIORITY_COUNT || qlen == 0)
+    return false;
+
+  if (task_Q[priority] == NULL)
+    return task_init_handler (priority, qlen);
+
+  if (q_waiting (task_Q[priority]) != 0)
+    return false;
+
+  task_q_t q = q_create (qlen);
+  CHECK(q, false, "Malloc failure in task_resize_queue");
+
+  task_q_t old = task_Q[priority];
+  task_Q[priority] = q;
+  task_qlen[priority] = q_capacity (q);
+  task_hwm[priority] = 0;
+  q_delete (old);
+  return true;
+}
+
+
 task_handle_t task_get_id(task_callback_t t) {
   /* Initialise any uninitialised Qs with the default Q len */
   for (task_prio_t p = TASK_PRIORITY_LOW; p != TASK_PRIORITY_COUNT; ++p)
   {
     if (!task_Q[p]) {
-      CHECK(task_init_handler( p, TASK_DEFAULT_QUEUE_LEN ), 0, "Task initialisation failed");
+      CHECK(task_init_handler( p, task_default_qlen[p] ), 0, "Task initialisation failed");
     }
   }
 
+  CHECK(task_count < CONFIG_TASK_HANDLES_MAX, 0, "Out of task handles in task_get_id");
+
   if ( (task_count & (TASK_HANDLE_ALLOCATION_BRICK - 1)) == 0 ) {
     /* With a brick size of 4 this branch is taken at 0, 4, 8 ... and the new size is +4 */
     task_func =(task_callback_t *)realloc(
@@ -75,6 +300,22 @@ task_handle_t task_get_id(task_callback_t t) {
 
     CHECK(task_func, 0 , "Malloc failure in task_get_id");
     memset (task_func+task_count, 0, sizeof(task_callback_t)*TASK_HANDLE_ALLOCATION_BRICK);
+
+#ifdef CONFIG_TASK_LATENCY_STATS
+    task_timing_t *tt = (task_timing_t *)realloc(
+      task_timing,
+      sizeof(task_timing_t)*(task_count+TASK_HANDLE_ALLOCATION_BRICK));
+    CHECK(tt, 0 , "Malloc failure in task_get_id");
+    memset (tt+task_count, 0, sizeof(task_timing_t)*TASK_HANDLE_ALLOCATION_BRICK);
+    task_timing = tt;
+
+    const char **names = (const char **)realloc(
+      task_name,
+      sizeof(const char *)*(task_count+TASK_HANDLE_ALLOCATION_BRICK));
+    CHECK(names, 0 , "Malloc failure in task_get_id");
+    memset (names+task_count, 0, sizeof(const char *)*TASK_HANDLE_ALLOCATION_BRICK);
+    task_name = names;
+#endif
   }
 
   task_func[task_count] = t;
@@ -90,21 +331,123 @@ bool task_post (task_prio_t priority, task_handle_t handle, task_param_t param)
     return false;
 
   task_event_t ev = { handle, param };
-  bool res = pdPASS == xQueueSendToBackFromISR (task_Q[priority], &ev, NULL);
+#ifdef TASK_STAMP
+  ev.posted_us = system_get_time ();
+#endif
+  bool res = q_send (task_Q[priority], &ev);
 
+  if (res)
+  {
+    ++task_posted[priority];
+    uint32_t waiting = q_waiting_isr (task_Q[priority]);
+    if (waiting > task_hwm[priority])
+      task_hwm[priority] = waiting;
+  }
+  else
+    ++task_post_fail[priority];
+  TRACE (TRACE_TASK_POST, handle, priority | (!res << 8));
+
+  if (res && pump_waiting && task_cas (&pump_waiting, 1, 0))
+    pump_wake_us = system_get_time ();
+
+#ifdef CONFIG_TASK_LOCKFREE_RING
+  /* only wake the pump if it has gone (or is about to go) idle */
+  if (res && pending && pump_idle && task_cas (&pump_idle, 1, 0))
+    xSemaphoreGiveFromISR (pending, NULL);
+#else
   if (pending) /* only need to raise semaphore if it's been initialised */
     xSemaphoreGiveFromISR (pending, NULL);
+#endif
 
   return res;
 }
 
 
+static void task_coalesce_clear (uint16_t entry, uint32_t bit)
+{
+  uint32_t mask;
+  do
+    mask = task_coalesce[entry];
+  while ((mask & bit) && !task_cas (&task_coalesce[entry], mask, mask & ~bit));
+}
+
+
+bool task_post_coalesced (task_prio_t priority, task_handle_t handle, task_param_t param)
+{
+  if ((handle & TASK_HANDLE_MASK) != TASK_HANDLE_MONIKER)
+    return false;
+  uint16_t entry = (handle & TASK_HANDLE_UNMASK);
+  if (entry >= task_count || priority >= TASK_PRIORITY_COUNT)
+    return false;
+
+  /* Skipped only for an event queued at this priority or above, so a post
+   * at a higher one overtakes one still waiting lower down */
+  uint32_t bit = 1u << priority, mask;
+  do
+  {
+    mask = task_coalesce[entry];
+    if (mask & ~(bit - 1))
+    {
+      /* already queued, the pending event will pick up this work too */
+      ++task_coalesced_count;
+      return true;
+    }
+  } while (!task_cas (&task_coalesce[entry], mask, mask | bit));
+
+  if (!task_post (priority, handle, param))
+  {
+    task_coalesce_clear (entry, bit);
+    return false;
+  }
+  return true;
+}
+
+
+uint32_t task_get_coalesced_count (void)
+{
+  return task_coalesced_count;
+}
+
+
+#if CONFIG_TASK_AGING_MS > 0
+/* The event which has waited longest at a priority below HIGH, once that
+ * is past CONFIG_TASK_AGING_MS, to be run before anything of a higher
+ * priority. So a flood at one priority delays the others by a bounded
+ * time rather than holding them off. */
+static bool aged_event (task_event_t *ev, task_prio_t *prio)
+{
+  uint32_t now = system_get_time ();
+  uint32_t oldest = CONFIG_TASK_AGING_MS * 1000;
+  task_prio_t from = TASK_PRIORITY_COUNT;
+  for (task_prio_t p = TASK_PRIORITY_LOW; p != TASK_PRIORITY_HIGH; ++p)
+  {
+    task_event_t head;
+    if (task_Q[p] && q_peek (task_Q[p], &head) && now - head.posted_us >= oldest)
+    {
+      oldest = now - head.posted_us;
+      from = p;
+    }
+  }
+  if (from == TASK_PRIORITY_COUNT || !q_receive (task_Q[from], ev))
+    return false;
+  ++task_aged[from];
+  *prio = from;
+  return true;
+}
+#endif
+
+
+#ifndef CONFIG_TASK_BATCH_DRAIN
 static bool next_event (task_event_t *ev, task_prio_t *prio)
 {
+#if CONFIG_TASK_AGING_MS > 0
+  if (aged_event (ev, prio))
+    return true;
+#endif
   for (task_prio_t pr = TASK_PRIORITY_COUNT; pr != TASK_PRIORITY_LOW; --pr)
   {
     task_prio_t p = pr -1;
-    if (task_Q[p] && xQueueReceive (task_Q[p], ev, 0) == pdTRUE)
+    if (task_Q[p] && q_receive (task_Q[p], ev))
     {
       *prio = p;
       return true;
@@ -112,6 +455,37 @@ static bool next_event (task_event_t *ev, task_prio_t *prio)
   }
   return false; // no events queued
 }
+#endif
+
+
+#ifdef CONFIG_TASK_LATENCY_STATS
+/* Bucket i holds samples in [2^(i-1), 2^i) us, bucket 0 is < 1 us and
+ * the last bucket collects everything beyond the range */
+static inline unsigned hist_bucket (uint32_t us)
+{
+  unsigned b = 0;
+  while (us && b < TASK_HIST_BUCKETS - 1)
+  {
+    us >>= 1;
+    ++b;
+  }
+  return b;
+}
+
+static void record_timing (uint16_t entry, uint32_t queued_us, uint32_t run_us)
+{
+  task_timing_t *t = &task_timing[entry];
+  ++t->count;
+  t->queue_total_us += queued_us;
+  t->run_total_us += run_us;
+  if (queued_us > t->queue_max_us)
+    t->queue_max_us = queued_us;
+  if (run_us > t->run_max_us)
+    t->run_max_us = run_us;
+  ++t->queue_hist[hist_bucket (queued_us)];
+  ++t->run_hist[hist_bucket (run_us)];
+}
+#endif
 
 
 static void dispatch (task_event_t *e, uint8_t prio) {
@@ -119,8 +493,24 @@ static void dispatch (task_event_t *e, uint8_t prio) {
   if ( (handle & TASK_HANDLE_MASK) == TASK_HANDLE_MONIKER) {
     uint16_t entry = (handle & TASK_HANDLE_UNMASK);
     if ( task_func && entry < task_count ){
+      /* clear before calling, so a post made while handling is not lost */
+      if (task_coalesce[entry])
+        task_coalesce_clear (entry, 1u << prio);
       /* call the registered task handler with the specified parameter and priority */
+      TRACE (TRACE_TASK_RUN_B, handle, prio);
+      task_dispatch_hook_t hook = dispatch_hook;
+      if (hook)
+        hook (entry, true);
+#ifdef CONFIG_TASK_LATENCY_STATS
+      uint32_t start = system_get_time ();
       task_func[entry](e->par, prio);
+      record_timing (entry, start - e->posted_us, system_get_time () - start);
+#else
+      task_func[entry](e->par, prio);
+#endif
+      if (hook)
+        hook (entry, false);
+      TRACE (TRACE_TASK_RUN_E, handle, prio);
       return;
     }
   }
@@ -129,16 +519,355 @@ static void dispatch (task_event_t *e, uint8_t prio) {
 }
 
 
+#ifdef CONFIG_TASK_BATCH_DRAIN
+/* Drain up to the configured budget from every queue, highest priority
+ * first, and return the number of events dispatched. A priority with a
+ * budget of 0 is drained until empty. */
+static uint32_t drain_pass (void)
+{
+  uint32_t n = 0;
+  for (task_prio_t pr = TASK_PRIORITY_COUNT; pr != TASK_PRIORITY_LOW; --pr)
+  {
+    task_prio_t p = pr -1;
+    if (!task_Q[p])
+      continue;
+    task_event_t ev;
+    for (uint32_t i = 0; task_budget[p] == 0 || i < task_budget[p]; ++i)
+    {
+#if CONFIG_TASK_AGING_MS > 0
+      /* checked between events, a budget of 0 may never see the end */
+      task_prio_t aged_prio;
+      if (aged_event (&ev, &aged_prio))
+      {
+        dispatch (&ev, aged_prio);
+        ++n;
+      }
+#endif
+      if (!q_receive (task_Q[p], &ev))
+        break;
+      dispatch (&ev, p);
+      ++n;
+    }
+  }
+  return n;
+}
+#endif
+
+
+bool task_set_budget (task_prio_t priority, uint8_t budget)
+{
+#ifdef CONFIG_TASK_BATCH_DRAIN
+  if (priority >= TASK_PRIORITY_COUNT)
+    return false;
+  task_budget[priority] = budget;
+  return true;
+#else
+  (void)priority; (void)budget;
+  return false;
+#endif
+}
+
+
+uint8_t task_get_budget (task_prio_t priority)
+{
+#ifdef CONFIG_TASK_BATCH_DRAIN
+  if (priority < TASK_PRIORITY_COUNT)
+    return task_budget[priority];
+#endif
+  (void)priority;
+  return 1;
+}
+
+
+bool task_get_queue_stats (task_prio_t priority, task_queue_stats_t *stats)
+{
+  if (priority >= TASK_PRIORITY_COUNT)
+    return false;
+
+  task_q_t q = task_Q[priority];
+  stats->qlen = task_qlen[priority];
+  stats->waiting = q ? q_waiting (q) : 0;
+  stats->hwm = task_hwm[priority];
+  stats->posted = task_posted[priority];
+  stats->failed = task_post_fail[priority];
+#if CONFIG_TASK_AGING_MS > 0
+  stats->aged = task_aged[priority];
+#else
+  stats->aged = 0;
+#endif
+  return true;
+}
+
+
+void task_set_name (task_handle_t handle, const char *name)
+{
+#ifdef CONFIG_TASK_LATENCY_STATS
+  uint16_t entry = (handle & TASK_HANDLE_UNMASK);
+  if ((handle & TASK_HANDLE_MASK) == TASK_HANDLE_MONIKER && entry < task_count)
+    task_name[entry] = name;
+#else
+  (void)handle; (void)name;
+#endif
+}
+
+
+void task_set_dispatch_hook (task_dispatch_hook_t hook)
+{
+  dispatch_hook = hook;
+}
+
+
+int task_get_handle_count (void)
+{
+  return task_count;
+}
+
+
+bool task_get_timing (int index, task_timing_t *timing, const char **name, bool reset)
+{
+#ifdef CONFIG_TASK_LATENCY_STATS
+  if (index < 0 || index >= task_count || !task_timing)
+    return false;
+  *timing = task_timing[index];
+  if (name)
+    *name = task_name[index];
+  if (reset)
+    memset (&task_timing[index], 0, sizeof (task_timing_t));
+  return true;
+#else
+  (void)index; (void)timing; (void)name; (void)reset;
+  return false;
+#endif
+}
+
+
+void task_get_pump_stats (task_pump_stats_t *stats)
+{
+  TickType_t now = xTaskGetTickCount ();
+  TickType_t elapsed = now - pump_window_start;
+
+  stats->events = pump_events;
+  stats->passes = pump_passes;
+  stats->avg_batch_x100 = pump_passes ?
+    (uint32_t)(((uint64_t)pump_events * 100) / pump_passes) : 0;
+  stats->events_per_sec = elapsed ?
+    (uint32_t)(((uint64_t)pump_window_events * configTICK_RATE_HZ) / elapsed) : 0;
+  stats->sleeps = pump_sleeps;
+  stats->wake_avg_us = pump_wakes ?
+    (uint32_t)(pump_wake_total_us / pump_wakes) : 0;
+  stats->wake_max_us = pump_wake_max_us;
+
+  /* each read starts a new rate window */
+  pump_window_events = 0;
+  pump_window_start = now;
+}
+
+
+#ifdef CONFIG_TASK_CPULOAD
+/* A run of the idle counter longer than this means something preempted it */
+#define CPULOAD_GAP_US 20
+
+static volatile uint32_t cpuload_idle_us[portNUM_PROCESSORS];
+static uint32_t cpuload_last_idle[portNUM_PROCESSORS];
+static uint32_t cpuload_last_time;
+
+/* Spins at idle priority, adding up the cycles it gets to run back to back.
+ * It shares its priority with the FreeRTOS idle task and the two take turns
+ * each tick, so it only sees about half of the idle time. */
+static void cpuload_task (void *arg)
+{
+  unsigned core = xPortGetCoreID ();
+  uint32_t mhz = ets_get_cpu_frequency ();
+  uint32_t last = xthal_get_ccount (), cycles = 0;
+  (void)arg;
+  for (;;)
+  {
+    uint32_t now = xthal_get_ccount ();
+    uint32_t d = now - last;
+    last = now;
+    if (d < CPULOAD_GAP_US * mhz)
+      cycles += d;
+    if (cycles >= 1000 * mhz)
+    {
+      cpuload_idle_us[core] += cycles / mhz;
+      cycles %= mhz;
+      mhz = ets_get_cpu_frequency ();
+    }
+  }
+}
+
+static void cpuload_start (void)
+{
+  cpuload_last_time = system_get_time ();
+  for (int i = 0; i < portNUM_PROCESSORS; ++i)
+    xTaskCreatePinnedToCore (cpuload_task, "cpuload", 1024, NULL,
+                             tskIDLE_PRIORITY, NULL, i);
+}
+#endif
+
+
+int task_get_cpuload (uint8_t *busy_pct, int max_cores)
+{
+#ifdef CONFIG_TASK_CPULOAD
+  uint32_t now = system_get_time ();
+  uint32_t elapsed = now - cpuload_last_time;
+  int n = max_cores < portNUM_PROCESSORS ? max_cores : portNUM_PROCESSORS;
+  cpuload_last_time = now;
+  for (int i = 0; i < n; ++i)
+  {
+    uint32_t idle = cpuload_idle_us[i];
+    uint64_t est = 2 * (uint64_t)(idle - cpuload_last_idle[i]);
+    cpuload_last_idle[i] = idle;
+    busy_pct[i] = (!elapsed || est >= elapsed) ?
+      0 : 100 - (uint8_t)((est * 100) / elapsed);
+  }
+  return n;
+#else
+  (void)busy_pct; (void)max_cores;
+  return 0;
+#endif
+}
+
+
+#ifdef CONFIG_TASK_LOCKFREE_RING
+static bool any_queued (void)
+{
+  for (task_prio_t p = TASK_PRIORITY_LOW; p != TASK_PRIORITY_COUNT; ++p)
+    if (task_Q[p] && q_waiting (task_Q[p]))
+      return true;
+  return false;
+}
+
+/* Whether a queue has an event published at its tail, which q_receive
+ * would take, as opposed to a slot claimed and not yet written */
+static bool any_ready (void)
+{
+  task_event_t ev;
+  for (task_prio_t p = TASK_PRIORITY_LOW; p != TASK_PRIORITY_COUNT; ++p)
+    if (task_Q[p] && q_peek (task_Q[p], &ev))
+      return true;
+  return false;
+}
+#endif
+
+
+static task_idle_hook_t idle_hooks[TASK_IDLE_HOOKS];
+
+/* Hooks which have returned false since the last event was dispatched */
+static uint32_t idle_done;
+
+bool task_add_idle_hook (task_idle_hook_t hook)
+{
+  int free_slot = -1;
+  for (int i = 0; i < TASK_IDLE_HOOKS; ++i)
+  {
+    if (idle_hooks[i] == hook)
+      return true;
+    if (!idle_hooks[i] && free_slot < 0)
+      free_slot = i;
+  }
+  if (free_slot < 0)
+    return false;
+  idle_done &= ~(1u << free_slot);
+  idle_hooks[free_slot] = hook;
+  return true;
+}
+
+void task_remove_idle_hook (task_idle_hook_t hook)
+{
+  for (int i = 0; i < TASK_IDLE_HOOKS; ++i)
+    if (idle_hooks[i] == hook)
+      idle_hooks[i] = NULL;
+}
+
+/* Runs each idle hook with work left once, false if none has any */
+static inline bool run_idle (void)
+{
+  bool more = false;
+  for (int i = 0; i < TASK_IDLE_HOOKS; ++i)
+  {
+    if (!idle_hooks[i] || (idle_done & (1u << i)))
+      continue;
+    if (idle_hooks[i] ())
+      more = true;
+    else
+      idle_done |= 1u << i;
+  }
+  return more;
+}
+
+
+static void wait_for_events (void)
+{
+#ifdef CONFIG_TASK_LOCKFREE_RING
+  /* Announce we're going idle, then re-check so a post which raced with
+   * us doesn't go unnoticed. If a producer already claimed the wakeup the
+   * semaphore is left given and the next take returns immediately. */
+  pump_idle = 1;
+  __sync_synchronize ();
+  if (any_queued ())
+  {
+    task_cas (&pump_idle, 1, 0);
+    /* A producer preempted between claiming its slot and publishing it
+     * holds up the queue; it may be of lower priority on this core, so
+     * give it a tick to finish instead of spinning on the slot */
+    if (!any_ready ())
+      vTaskDelay (1);
+    return;
+  }
+#endif
+  pump_wake_us = 0;
+  pump_waiting = 1;
+  ++pump_sleeps;
+  xSemaphoreTake (pending, portMAX_DELAY);
+  /* Still set if a stale give woke us, and then there's nothing to time */
+  if (task_cas (&pump_waiting, 1, 0))
+    return;
+  uint32_t posted = pump_wake_us;
+  if (posted)
+  {
+    uint32_t us = system_get_time () - posted;
+    ++pump_wakes;
+    pump_wake_total_us += us;
+    if (us > pump_wake_max_us)
+      pump_wake_max_us = us;
+  }
+}
+
+
 void task_pump_messages (void)
 {
   vSemaphoreCreateBinary (pending);
+  pump_window_start = xTaskGetTickCount ();
+#ifdef CONFIG_TASK_CPULOAD
+  cpuload_start ();
+#endif
   for (;;)
   {
+#ifdef CONFIG_TASK_BATCH_DRAIN
+    uint32_t n = drain_pass ();
+    if (n)
+    {
+      pump_events += n;
+      pump_window_events += n;
+      ++pump_passes;
+      idle_done = 0;
+    }
+    else if (!run_idle ())
+      wait_for_events ();
+#else
     task_event_t ev;
     task_prio_t prio;
     if (next_event (&ev, &prio))
+    {
       dispatch (&ev, prio);
-    else
-      xSemaphoreTake (pending, portMAX_DELAY);
+      ++pump_events;
+      ++pump_window_events;
+      ++pump_passes;
+      idle_done = 0;
+    }
+    else if (!run_idle ())
+      wait_for_events ();
+#endif
   }
 }
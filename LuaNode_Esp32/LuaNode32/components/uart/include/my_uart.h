@@ -2,6 +2,7 @@
 #define MY_UART_H
 
 #include "c_types.h"
+#include <stddef.h>
 
 //#define REG_UART_BASE( i )  (0x60000000+(i)*0x10000)
 #define UART_INT_ST( i )                        (REG_UART_BASE( i ) + 0x8)
@@ -11,4 +12,32 @@ void uart_init(void);
 void uart_sendStr(const char *str);
 void uart_putc(uint8_t TxChar);
 
+// Set up UART id: 5 to 8 data bits, parity NONE_BITS, ODD_BITS or
+// EVEN_BITS, stopbits ONE_STOP_BIT, ONE_HALF_STOP_BIT or TWO_STOP_BIT.
+// Pins are routed through the GPIO matrix, -1 leaves one as it is. With a
+// de_pin the port drives an RS-485 transceiver's DE while it sends.
+// Returns the baud rate set, or 0
+uint32_t uart_port_setup(unsigned id, uint32_t baud, int databits, int parity, int stopbits,
+                         int tx_pin, int rx_pin, int de_pin);
+
+// Copy out up to len bytes received on UART id, returning how many there were
+size_t uart_rx_read(unsigned id, uint8_t *buf, size_t len);
+// Bytes lost because the RX buffer was full, since boot
+uint32_t uart_rx_dropped(unsigned id);
+
+typedef void (*uart_rx_ready_t)(unsigned id);
+// cb runs in uart_task when UART1 or UART2 has bytes to read, UART0's go
+// to the console
+void uart_rx_on_ready(uart_rx_ready_t cb);
+
+typedef void (*uart_tx_done_t)(unsigned id);
+
+// Queue bytes for UART id, sent from the TX interrupt. Returns how many
+// fit, the rest has to wait for room
+size_t uart_tx_write(unsigned id, const uint8_t *data, size_t len);
+// Bytes queued and not yet in the FIFO
+size_t uart_tx_pending(unsigned id);
+// cb runs in the interrupt each time a queue runs empty
+void uart_tx_on_done(uart_tx_done_t cb);
+
 #endif
\ No newline at end of file
@@ -2,13 +2,20 @@
 #include "esp_intr.h"
 #include "c_types.h"
 #include "rom/uart.h"
+#include "rom/ets_sys.h"
 #include "soc/uart_register.h"
+#include "soc/dport_reg.h"
+#include "soc/gpio_sig_map.h"
+#include "esp32-hal-gpio.h"
+#include "esp32-hal-matrix.h"
 #include "c_string.h"
 #include "lua.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "freertos/xtensa_api.h"
+#include "sdkconfig.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -38,9 +45,86 @@ typedef struct _os_event_ {
     uint32 param;
 } os_event_t;
 
+#define UART_FIFO_LEN 128
+// RX interrupt once this many bytes wait in the FIFO, or after this many
+// idle symbol times with fewer
+#define UART_RX_FULL_AT 64
+#define UART_RX_IDLE_SYMBOLS 2
+
+#define UART_PORTS 3
+#define UART_EXT_INUM 12	// level 1 CPU interrupt for UART1 and UART2, unused by the SDK
+
 xTaskHandle xUartTaskHandle;
 xQueueHandle xQueueUart;
-RcvMsgBuff rcvMsgBuff;
+
+typedef struct {
+	// Bytes received and not yet read, filled a FIFO at a time by the RX
+	// interrupt. One event is queued for uart_task until they are read
+	uint8_t *rx_buf;
+	size_t rx_head, rx_tail;
+	volatile bool rx_posted;
+	volatile uint32_t rx_dropped;
+	// Bytes waiting for room in the TX FIFO, moved there by the
+	// TXFIFO_EMPTY interrupt so writers don't wait on the line
+	uint8_t *tx_buf;
+	size_t tx_tail, tx_count;
+	// RS-485: RTS drives the transceiver's DE from the first byte queued
+	// until TX_DONE says the last one has left the shifter
+	bool rs485;
+	portMUX_TYPE mux;
+} uart_port_state_t;
+
+static uart_port_state_t ports[UART_PORTS] = {
+	[0 ... UART_PORTS - 1] = { .mux = portMUX_INITIALIZER_UNLOCKED }
+};
+static uart_tx_done_t tx_done;
+static uart_rx_ready_t rx_ready;
+
+static const struct {
+	uint32_t clk_en, rst;
+	uint32_t source;
+	uint8_t tx_sig, rx_sig, rts_sig;
+} uart_hw[UART_PORTS] = {
+	{ DPORT_UART_CLK_EN, DPORT_UART_RST, ETS_UART0_INTR_SOURCE, U0TXD_OUT_IDX, U0RXD_IN_IDX, U0RTS_OUT_IDX },
+	{ DPORT_UART1_CLK_EN, DPORT_UART1_RST, ETS_UART1_INTR_SOURCE, U1TXD_OUT_IDX, U1RXD_IN_IDX, U1RTS_OUT_IDX },
+	{ DPORT_UART2_CLK_EN, DPORT_UART2_RST, ETS_UART2_INTR_SOURCE, U2TXD_OUT_IDX, U2RXD_IN_IDX, U2RTS_OUT_IDX },
+};
+
+// Top up the FIFO of port id from its tx_buf, under its mux
+static void tx_fill(unsigned id)
+{
+	uart_port_state_t *p = &ports[id];
+	uint32 fifo_cnt = (READ_PERI_REG(UART_STATUS_REG(id)) >> UART_TXFIFO_CNT_S) & UART_TXFIFO_CNT;
+	uint32 room = fifo_cnt < UART_FIFO_LEN ? UART_FIFO_LEN - fifo_cnt : 0;
+
+	while (room-- && p->tx_count) {
+		WRITE_PERI_REG(UART_FIFO(id), p->tx_buf[p->tx_tail]);
+		p->tx_tail = (p->tx_tail + 1) % CONFIG_UART_TX_BUFFER;
+		p->tx_count--;
+	}
+}
+
+// Empty the RX FIFO of port id into its rx_buf. Returns whether anything came
+static bool rx_drain(unsigned id)
+{
+	uart_port_state_t *p = &ports[id];
+	uint32 cnt = (READ_PERI_REG(UART_STATUS_REG(id)) >> UART_RXFIFO_CNT_S) & UART_RXFIFO_CNT;
+	bool got = cnt != 0;
+
+	portENTER_CRITICAL_ISR(&p->mux);
+	while (cnt--) {
+		uint8_t c = READ_PERI_REG(UART_FIFO(id)) & 0xFF;
+		size_t next = (p->rx_head + 1) % CONFIG_UART_RX_BUFFER;
+		if (next == p->rx_tail) {
+			p->rx_dropped++;	// the reader is behind, keep what it hasn't seen
+			continue;
+		}
+		p->rx_buf[p->rx_head] = c;
+		p->rx_head = next;
+	}
+	portEXIT_CRITICAL_ISR(&p->mux);
+	return got;
+}
 
 static void fs_init0(void)
 {
@@ -67,7 +151,13 @@ void uart_task(void *pvParameters)
             switch (e.event) {
                 case UART_EVENT_RX_CHAR:
 				{
-					lua_handle_input(false);
+					// bytes arriving from here on need another event
+					ports[e.param].rx_posted = false;
+					if (e.param == 0) {
+						lua_input_ready();
+					} else if (rx_ready) {
+						rx_ready(e.param);
+					}
 				}
                     break;
 
@@ -85,66 +175,85 @@ void uart_task(void *pvParameters)
     vTaskDelete(NULL);
 }
 
-void uart0_rx_intr_handler(void *para)
+static void uart_port_intr(unsigned id, BaseType_t *woken)
 {
-	uint8 RcvChar;
-	BaseType_t xHigherPriorityTaskWoken;
-	uint32 uart_intr_status = READ_PERI_REG(UART_INT_ST(0)) ;
+	uart_port_state_t *p = &ports[id];
+	uint32 uart_intr_status = READ_PERI_REG(UART_INT_ST(id)) ;
 
     while (uart_intr_status != 0x0) {
         if (UART_FRM_ERR_INT_ST == (uart_intr_status & UART_FRM_ERR_INT_ST)) {
             //uart_tx_one_char('!');
-            WRITE_PERI_REG(UART_INT_CLR(0), UART_FRM_ERR_INT_CLR);
-        } else if (UART_RXFIFO_FULL_INT_ST == (uart_intr_status & UART_RXFIFO_FULL_INT_ST)) {
-			//uart_tx_one_char('$');
-			RcvChar = READ_PERI_REG(UART_FIFO(0)) & 0xFF;
-            WRITE_PERI_REG(UART_INT_CLR(0), UART_RXFIFO_FULL_INT_CLR);
-
-			*(rcvMsgBuff.pWritePos) = RcvChar;
-
-			if (RcvChar == '\r' || RcvChar == '\n' ) {
-				rcvMsgBuff.BuffState = WRITE_OVER;
-			}
+            WRITE_PERI_REG(UART_INT_CLR(id), UART_FRM_ERR_INT_CLR);
+        } else if ((uart_intr_status & (UART_RXFIFO_FULL_INT_ST | UART_RXFIFO_TOUT_INT_ST)) != 0) {
+			bool got = rx_drain(id);
+            WRITE_PERI_REG(UART_INT_CLR(id), UART_RXFIFO_FULL_INT_CLR | UART_RXFIFO_TOUT_INT_CLR);
 
-			if (rcvMsgBuff.pWritePos == (rcvMsgBuff.pRcvMsgBuff + RX_BUFF_SIZE)) {
-				// overflow ...we may need more error handle here.
-				rcvMsgBuff.pWritePos = rcvMsgBuff.pRcvMsgBuff ;
-			} else {
-				rcvMsgBuff.pWritePos++;
-			}
-
-			if (rcvMsgBuff.pWritePos == rcvMsgBuff.pReadPos){   // overflow one byte, need push pReadPos one byte ahead
-				if (rcvMsgBuff.pReadPos == (rcvMsgBuff.pRcvMsgBuff + RX_BUFF_SIZE)) {
-					rcvMsgBuff.pReadPos = rcvMsgBuff.pRcvMsgBuff ; 
-				} else {
-					rcvMsgBuff.pReadPos++;
+			if (got && !p->rx_posted) {
+				os_event_t e;
+				e.event = UART_EVENT_RX_CHAR;
+				e.param = id;
+				p->rx_posted = true;
+				if (xQueueSendFromISR(xQueueUart, &e, woken) != pdTRUE) {
+					p->rx_posted = false;
 				}
 			}
-
-			os_event_t e;
-			e.event = UART_EVENT_RX_CHAR;
-			e.param = '+';
-			xQueueSendFromISR(xQueueUart, &e, &xHigherPriorityTaskWoken);
-			if( xHigherPriorityTaskWoken ) {
-				// Actual macro used here is port specific.
-				portYIELD_FROM_ISR ();
-			}
-		} else if (UART_RXFIFO_TOUT_INT_ST == (uart_intr_status & UART_RXFIFO_TOUT_INT_ST)) {
-            //uart_tx_one_char('%');
-			RcvChar = READ_PERI_REG(UART_FIFO(0)) & 0xFF;
-            WRITE_PERI_REG(UART_INT_CLR(0), UART_RXFIFO_TOUT_INT_CLR);
         } else if (UART_TXFIFO_EMPTY_INT_ST == (uart_intr_status & UART_TXFIFO_EMPTY_INT_ST)) {
-            //uart_tx_one_char('^');
-            WRITE_PERI_REG(UART_INT_CLR(0), UART_TXFIFO_EMPTY_INT_CLR);
-            CLEAR_PERI_REG_MASK(UART_INT_ENA(0), UART_TXFIFO_EMPTY_INT_ENA);
-        } else if (UART_RXFIFO_OVF_INT_ST  == (READ_PERI_REG(UART_INT_ST(0)) & UART_RXFIFO_OVF_INT_ST)) {
-            WRITE_PERI_REG(UART_INT_CLR(0), UART_RXFIFO_OVF_INT_CLR);
+            bool drained;
+            portENTER_CRITICAL_ISR(&p->mux);
+            tx_fill(id);
+            drained = p->tx_count == 0;
+            if (drained) {
+                CLEAR_PERI_REG_MASK(UART_INT_ENA(id), UART_TXFIFO_EMPTY_INT_ENA);
+            }
+            WRITE_PERI_REG(UART_INT_CLR(id), UART_TXFIFO_EMPTY_INT_CLR);
+            portEXIT_CRITICAL_ISR(&p->mux);
+            if (drained && tx_done) {
+                tx_done(id);
+            }
+        } else if (UART_TX_DONE_INT_ST == (uart_intr_status & UART_TX_DONE_INT_ST)) {
+            portENTER_CRITICAL_ISR(&p->mux);
+            WRITE_PERI_REG(UART_INT_CLR(id), UART_TX_DONE_INT_CLR);
+            if (p->tx_count == 0) {
+                // the line is quiet, let the other end talk
+                SET_PERI_REG_MASK(UART_CONF0_REG(id), UART_SW_RTS);
+                CLEAR_PERI_REG_MASK(UART_INT_ENA(id), UART_TX_DONE_INT_ENA);
+            }
+            portEXIT_CRITICAL_ISR(&p->mux);
+        } else if (UART_RXFIFO_OVF_INT_ST  == (READ_PERI_REG(UART_INT_ST(id)) & UART_RXFIFO_OVF_INT_ST)) {
+            rx_drain(id);
+            WRITE_PERI_REG(UART_INT_CLR(id), UART_RXFIFO_OVF_INT_CLR);
             printf("RX OVF!!\r\n");
         } else {
             //skip
         }
 
-        uart_intr_status = READ_PERI_REG(UART_INT_ST(0)) ;
+        uart_intr_status = READ_PERI_REG(UART_INT_ST(id)) ;
+	}
+}
+
+void uart0_rx_intr_handler(void *para)
+{
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+
+	uart_port_intr(0, &xHigherPriorityTaskWoken);
+	if( xHigherPriorityTaskWoken ) {
+		// Actual macro used here is port specific.
+		portYIELD_FROM_ISR ();
+	}
+}
+
+// UART1 and UART2 share a CPU interrupt
+static void uart_ext_intr_handler(void *para)
+{
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+
+	for (unsigned id = 1; id < UART_PORTS; id++) {
+		if (ports[id].rx_buf) {
+			uart_port_intr(id, &xHigherPriorityTaskWoken);
+		}
+	}
+	if( xHigherPriorityTaskWoken ) {
+		portYIELD_FROM_ISR ();
 	}
 }
 
@@ -168,15 +277,183 @@ void uart_putc(uint8_t TxChar)
     WRITE_PERI_REG(UART_FIFO(0) , TxChar);
 }
 
+size_t uart_tx_write(unsigned id, const uint8_t *data, size_t len)
+{
+	uart_port_state_t *p = &ports[id];
+	size_t n = 0;
+
+	if (p->tx_buf == NULL) {
+		if (id != 0) {
+			return len;			// not set up, as if the line were unconnected
+		}
+		// before uart_init()
+		while (n < len) {
+			uart_tx_one_char(data[n++]);
+		}
+		return n;
+	}
+	portENTER_CRITICAL(&p->mux);
+	while (n < len && p->tx_count < CONFIG_UART_TX_BUFFER) {
+		size_t head = (p->tx_tail + p->tx_count) % CONFIG_UART_TX_BUFFER;
+		size_t span;
+		if (head < p->tx_tail) {
+			span = p->tx_tail - head;
+		} else {
+			span = CONFIG_UART_TX_BUFFER - head;
+		}
+		if (span > len - n) {
+			span = len - n;
+		}
+		memcpy(p->tx_buf + head, data + n, span);
+		p->tx_count += span;
+		n += span;
+	}
+	if (p->tx_count) {
+		if (p->rs485) {
+			CLEAR_PERI_REG_MASK(UART_CONF0_REG(id), UART_SW_RTS);
+			WRITE_PERI_REG(UART_INT_CLR(id), UART_TX_DONE_INT_CLR);
+			SET_PERI_REG_MASK(UART_INT_ENA(id), UART_TX_DONE_INT_ENA);
+		}
+		// fires straight away while the FIFO is below its threshold
+		SET_PERI_REG_MASK(UART_INT_ENA(id), UART_TXFIFO_EMPTY_INT_ENA);
+	}
+	portEXIT_CRITICAL(&p->mux);
+	return n;
+}
+
+size_t uart_rx_read(unsigned id, uint8_t *buf, size_t len)
+{
+	uart_port_state_t *p = &ports[id];
+	size_t n = 0;
+
+	if (p->rx_buf == NULL) {
+		return 0;
+	}
+	portENTER_CRITICAL(&p->mux);
+	while (n < len && p->rx_tail != p->rx_head) {
+		size_t span = (p->rx_head > p->rx_tail ? p->rx_head : CONFIG_UART_RX_BUFFER) - p->rx_tail;
+		if (span > len - n) {
+			span = len - n;
+		}
+		memcpy(buf + n, p->rx_buf + p->rx_tail, span);
+		p->rx_tail = (p->rx_tail + span) % CONFIG_UART_RX_BUFFER;
+		n += span;
+	}
+	portEXIT_CRITICAL(&p->mux);
+	return n;
+}
+
+uint32_t uart_rx_dropped(unsigned id)
+{
+	return ports[id].rx_dropped;
+}
+
+size_t uart_tx_pending(unsigned id)
+{
+	return ports[id].tx_count;
+}
+
+void uart_tx_on_done(uart_tx_done_t cb)
+{
+	tx_done = cb;
+}
+
+void uart_rx_on_ready(uart_rx_ready_t cb)
+{
+	rx_ready = cb;
+}
+
+static void uart_port_intr_enable(unsigned id)
+{
+	SET_PERI_REG_BITS(UART_CONF1_REG(id), UART_RXFIFO_FULL_THRHD_V, UART_RX_FULL_AT, UART_RXFIFO_FULL_THRHD_S);
+	SET_PERI_REG_BITS(UART_CONF1_REG(id), UART_RX_TOUT_THRHD_V, UART_RX_IDLE_SYMBOLS, UART_RX_TOUT_THRHD_S);
+	SET_PERI_REG_MASK(UART_CONF1_REG(id), UART_RX_TOUT_EN);
+	WRITE_PERI_REG(UART_INT_CLR(id), 0xffffffff);
+	SET_PERI_REG_MASK(UART_INT_ENA(id), UART_RXFIFO_FULL_INT_ENA | UART_RXFIFO_TOUT_INT_ENA | UART_RXFIFO_OVF_INT_ENA);
+}
+
+uint32_t uart_port_setup(unsigned id, uint32_t baud, int databits, int parity, int stopbits,
+                         int tx_pin, int rx_pin, int de_pin)
+{
+	uart_port_state_t *p = &ports[id];
+	uint32_t conf0, clk_div;
+
+	if (id >= UART_PORTS || baud == 0 || databits < 5 || databits > 8) {
+		return 0;
+	}
+	if (p->rx_buf == NULL) {
+		uint8_t *rx = malloc(CONFIG_UART_RX_BUFFER), *tx = malloc(CONFIG_UART_TX_BUFFER);
+		if (rx == NULL || tx == NULL) {
+			free(rx);
+			free(tx);
+			return 0;
+		}
+		SET_PERI_REG_MASK(DPORT_PERIP_CLK_EN_REG, uart_hw[id].clk_en);
+		CLEAR_PERI_REG_MASK(DPORT_PERIP_RST_EN_REG, uart_hw[id].rst);
+		p->tx_buf = tx;
+		p->rx_buf = rx;
+	}
+
+	// wait for what is on its way out to leave at the old settings
+	while (p->tx_count || ((READ_PERI_REG(UART_STATUS_REG(id)) >> UART_TXFIFO_CNT_S) & UART_TXFIFO_CNT)) {
+		vTaskDelay(1);
+	}
+
+	clk_div = (UART_CLK_FREQ << 4) / baud;
+	WRITE_PERI_REG(UART_CLKDIV_REG(id), (clk_div >> 4) | ((clk_div & 0xf) << UART_CLKDIV_FRAG_S));
+	conf0 = READ_PERI_REG(UART_CONF0_REG(id));
+	conf0 &= ~((UART_BIT_NUM_V << UART_BIT_NUM_S) | (UART_STOP_BIT_NUM_V << UART_STOP_BIT_NUM_S) |
+	           UART_PARITY_EN | UART_PARITY);
+	conf0 |= (databits - 5) << UART_BIT_NUM_S;
+	conf0 |= stopbits << UART_STOP_BIT_NUM_S;
+	if (parity == EVEN_BITS) {
+		conf0 |= UART_PARITY_EN;
+	} else if (parity == ODD_BITS) {
+		conf0 |= UART_PARITY_EN | UART_PARITY;
+	}
+	conf0 |= UART_SW_RTS;		// DE low, receiving
+	WRITE_PERI_REG(UART_CONF0_REG(id), conf0);
+
+	if (tx_pin >= 0) {
+		pinMode(tx_pin, OUTPUT);
+		pinMatrixOutAttach(tx_pin, uart_hw[id].tx_sig, false, false);
+	}
+	if (rx_pin >= 0) {
+		pinMode(rx_pin, INPUT);
+		pinMatrixInAttach(rx_pin, uart_hw[id].rx_sig, false);
+	}
+	p->rs485 = de_pin >= 0;
+	if (p->rs485) {
+		pinMode(de_pin, OUTPUT);
+		pinMatrixOutAttach(de_pin, uart_hw[id].rts_sig, false, false);
+		// don't hear our own bytes while driving the bus
+		WRITE_PERI_REG(UART_RS485_CONF_REG(id), UART_RS485_EN | UART_RS485RXBY_TX_EN);
+	} else {
+		WRITE_PERI_REG(UART_RS485_CONF_REG(id), 0);
+	}
+
+	if (id != 0) {
+		static bool attached;
+		uart_port_intr_enable(id);
+		if (!attached) {
+			attached = true;
+			ESP_INTR_DISABLE(UART_EXT_INUM);
+			intr_matrix_set(xPortGetCoreID(), uart_hw[1].source, UART_EXT_INUM);
+			intr_matrix_set(xPortGetCoreID(), uart_hw[2].source, UART_EXT_INUM);
+			xt_set_interrupt_handler(UART_EXT_INUM, uart_ext_intr_handler, NULL);
+			ESP_INTR_ENABLE(UART_EXT_INUM);
+		}
+	}
+	return (UART_CLK_FREQ << 4) / clk_div;
+}
 
 void uart_init(void)
 {
-	rcvMsgBuff.pRcvMsgBuff = malloc(RX_BUFF_SIZE);
-	memset(rcvMsgBuff.pRcvMsgBuff, 0, RX_BUFF_SIZE);
-	rcvMsgBuff.pWritePos = rcvMsgBuff.pRcvMsgBuff;
-	rcvMsgBuff.pReadPos = rcvMsgBuff.pRcvMsgBuff;
+	ports[0].rx_buf = malloc(CONFIG_UART_RX_BUFFER);
+	ports[0].tx_buf = malloc(CONFIG_UART_TX_BUFFER);
 
 	ESP_UART0_INTR_DISABLE();
+	uart_port_intr_enable(0);
 	ESP_UART0_INTR_ATTACH(uart0_rx_intr_handler, NULL);
 	ESP_UART0_INTR_ENABLE();
 	xQueueUart = xQueueCreate(32, sizeof(os_event_t));
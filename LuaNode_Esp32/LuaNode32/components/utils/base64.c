@@ -48,59 +48,67 @@
 static const char base64_chars[] = 
     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-static int 
-pos(char c)
+#define B64_BAD     -1
+#define B64_SPACE   -2
+#define B64_PAD     -3
+
+/* Value of each character, or one of the negative codes above */
+static const int8_t base64_rev[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -2, -2, -1, -1, -2, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -3, -1, -1,
+    -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+    -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+/* Three bytes to four characters, stored as one word */
+static inline void
+encode_triple(const unsigned char *q, char *p)
 {
-    const char *p;
-    for (p = base64_chars; *p; p++)
-        if (*p == c)
-            return p - base64_chars;
-    return -1;
+    uint32_t c = (q[0] << 16) | (q[1] << 8) | q[2];
+    uint32_t w = base64_chars[c >> 18]
+        | (base64_chars[(c >> 12) & 0x3f] << 8)
+        | (base64_chars[(c >> 6) & 0x3f] << 16)
+        | ((uint32_t)base64_chars[c & 0x3f] << 24);
+    memcpy(p, &w, 4);
+}
+
+/* The last one or two bytes, padded or not; returns the characters written */
+static int
+encode_tail(const unsigned char *q, int n, char *p, uint8_t should_pad)
+{
+    unsigned char t[3] = { q[0], n > 1 ? q[1] : 0, 0 };
+
+    encode_triple(t, p);
+    if (should_pad) {
+        memset(p + n + 1, '=', 3 - n);
+        return 4;
+    }
+    return n + 1;
 }
 
 int 
 base64_encode(const void *data, int size, char *s, uint8_t should_pad)
 {
-    char *p;
+    const unsigned char *q = (const unsigned char *) data;
+    char *p = s;
     int i;
-    int c;
-    const unsigned char *q;
-    char *last;
-    int diff;
-
-    p = s;
-
-    q = (const unsigned char *) data;
-    last = NULL;
-    i = 0;
-    while (i < size) {
-        c = q[i++];
-        c *= 256;
-        if (i < size)
-            c += q[i];
-        i++;
-        c *= 256;
-        if (i < size)
-            c += q[i];
-        i++;
-        p[0] = base64_chars[(c & 0x00fc0000) >> 18];
-        p[1] = base64_chars[(c & 0x0003f000) >> 12];
-        p[2] = base64_chars[(c & 0x00000fc0) >> 6];
-        p[3] = base64_chars[(c & 0x0000003f) >> 0];
-        last = p;
-        p += 4;
-    }
 
-    if (last) {
-        diff = i - size;
-        if (diff > 0) {
-            if (should_pad) {
-                memset(last + (4 - diff), '=', diff);
-            } else {
-                p = last + (4 - diff);
-            }
-        }
-    } 
+    for (i = 0; i + 3 <= size; i += 3, p += 4)
+        encode_triple(q + i, p);
+    if (i < size)
+        p += encode_tail(q + i, size - i, p, should_pad);
 
     *p = 0;
 
@@ -130,16 +138,15 @@ token_decode(const char *token)
     int i;
     unsigned int val = 0;
     int marker = 0;
-    if (strlen(token) < 4)
-        return DECODE_ERROR;
     for (i = 0; i < 4; i++) {
+        int v = base64_rev[(unsigned char)token[i]];
         val *= 64;
-        if (token[i] == '=')
+        if (v == B64_PAD)
             marker++;
-        else if (marker > 0)
+        else if (marker > 0 || v < 0)   /* also catches the end of the string */
             return DECODE_ERROR;
         else
-            val += pos(token[i]);
+            val += v;
     }
     if (marker > 2)
         return DECODE_ERROR;
@@ -153,7 +160,8 @@ base64_decode(const char *str, void *data)
     unsigned char *q;
 
     q = data;
-    for (p = str; *p && (*p == '=' || strchr(base64_chars, *p)); p += 4) {
+    for (p = str; *p && base64_rev[(unsigned char)*p] != B64_BAD &&
+            base64_rev[(unsigned char)*p] != B64_SPACE; p += 4) {
         unsigned int val = token_decode(p);
         unsigned int marker = (val >> 24) & 0xff;
         if (val == DECODE_ERROR)
@@ -179,3 +187,124 @@ base64_decode_len(const char *str)
     }
     return len * 3 / 4;
 }
+
+void
+base64_encode_init(base64_enc_t *st)
+{
+    st->n = 0;
+}
+
+int
+base64_encode_update(base64_enc_t *st, const void *data, int size, char *s)
+{
+    const unsigned char *q = (const unsigned char *) data;
+    char *p = s;
+
+    /* Complete the bytes left over from the last call first */
+    while (st->n && size) {
+        st->buf[st->n++] = *q++;
+        size--;
+        if (st->n == 3) {
+            encode_triple(st->buf, p);
+            p += 4;
+            st->n = 0;
+        }
+    }
+    for (; size >= 3; q += 3, size -= 3, p += 4)
+        encode_triple(q, p);
+    while (size--)
+        st->buf[st->n++] = *q++;
+
+    return (p - s);
+}
+
+int
+base64_encode_final(base64_enc_t *st, char *s, uint8_t should_pad)
+{
+    int n = st->n;
+
+    st->n = 0;
+    return n ? encode_tail(st->buf, n, s, should_pad) : 0;
+}
+
+void
+base64_decode_init(base64_dec_t *st)
+{
+    st->acc = 0;
+    st->n = 0;
+    st->pad = 0;
+}
+
+int
+base64_decode_update(base64_dec_t *st, const char *str, int len, void *data)
+{
+    const unsigned char *s = (const unsigned char *) str;
+    unsigned char *q = data;
+    int i = 0;
+
+    while (i < len) {
+        /* Whole groups of four straight through while nothing is pending */
+        if (st->n == 0 && st->pad == 0) {
+            for (; i + 4 <= len; i += 4) {
+                int a = base64_rev[s[i]], b = base64_rev[s[i + 1]];
+                int c = base64_rev[s[i + 2]], d = base64_rev[s[i + 3]];
+                uint32_t v;
+                if ((a | b | c | d) < 0)
+                    break;
+                v = (a << 18) | (b << 12) | (c << 6) | d;
+                q[0] = v >> 16;
+                q[1] = v >> 8;
+                q[2] = v;
+                q += 3;
+            }
+            if (i == len)
+                break;
+        }
+
+        /* Otherwise a character at a time */
+        int v = base64_rev[s[i++]];
+        if (v == B64_SPACE)
+            continue;
+        if (v == B64_PAD) {
+            /* '=' completes a group of two or three characters */
+            if (st->n < 2 || st->n + st->pad >= 4)
+                return -1;
+            if (st->n + ++st->pad == 4) {
+                q += base64_decode_final(st, (char *) q);
+                st->pad = 1;        /* nothing but padding may follow */
+            }
+            continue;
+        }
+        if (v < 0 || st->pad)
+            return -1;
+        st->acc = (st->acc << 6) | v;
+        if (++st->n == 4) {
+            q[0] = st->acc >> 16;
+            q[1] = st->acc >> 8;
+            q[2] = st->acc;
+            q += 3;
+            st->acc = 0;
+            st->n = 0;
+        }
+    }
+    return q - (unsigned char *) data;
+}
+
+int
+base64_decode_final(base64_dec_t *st, void *data)
+{
+    unsigned char *q = data;
+    int n = st->n;
+    uint32_t acc = st->acc;
+
+    base64_decode_init(st);
+    if (n == 1)
+        return -1;
+    if (n >= 2) {
+        acc <<= 6 * (4 - n);
+        *q++ = acc >> 16;
+        if (n == 3)
+            *q++ = acc >> 8;
+    }
+    return q - (unsigned char *) data;
+}
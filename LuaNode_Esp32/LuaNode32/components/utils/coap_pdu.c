@@ -0,0 +1,196 @@
+// CoAP message reading and writing, see coap_pdu.h
+
+#include "coap_pdu.h"
+#include <string.h>
+
+// An option delta or length nibble, and its extended bytes
+static int read_ext(const uint8_t **p, const uint8_t *end, unsigned nibble, uint32_t *v)
+{
+  if (nibble < 13) {
+    *v = nibble;
+  } else if (nibble == 13) {
+    if (*p + 1 > end)
+      return -1;
+    *v = 13 + (*p)[0];
+    *p += 1;
+  } else if (nibble == 14) {
+    if (*p + 2 > end)
+      return -1;
+    *v = 269 + ((*p)[0] << 8 | (*p)[1]);
+    *p += 2;
+  } else {
+    return -1;                // 15 is reserved for the payload marker
+  }
+  return 0;
+}
+
+int coap_parse(coap_msg_t *m, const uint8_t *buf, size_t len)
+{
+  const uint8_t *p = buf + 4, *end = buf + len;
+  uint32_t num = 0;
+
+  if (len < 4 || (buf[0] >> 6) != 1)
+    return -1;
+  m->type = (buf[0] >> 4) & 3;
+  m->token_len = buf[0] & 15;
+  m->code = buf[1];
+  m->id = buf[2] << 8 | buf[3];
+  m->nopt = 0;
+  m->payload = NULL;
+  m->payload_len = 0;
+  if (m->token_len > COAP_MAX_TOKEN || p + m->token_len > end)
+    return -1;
+  memcpy(m->token, p, m->token_len);
+  p += m->token_len;
+
+  while (p < end) {
+    if (*p == 0xff) {
+      if (++p == end)
+        return -1;            // a marker with no payload
+      m->payload = p;
+      m->payload_len = end - p;
+      break;
+    }
+    uint32_t delta, olen;
+    unsigned head = *p++;
+    if (read_ext(&p, end, head >> 4, &delta) < 0 ||
+        read_ext(&p, end, head & 15, &olen) < 0 || p + olen > end)
+      return -1;
+    num += delta;
+    if (m->nopt == COAP_MAX_OPTIONS || num > UINT16_MAX)
+      return -1;
+    m->opt[m->nopt].num = num;
+    m->opt[m->nopt].len = olen;
+    m->opt[m->nopt].val = p;
+    m->nopt++;
+    p += olen;
+  }
+  return 0;
+}
+
+const coap_opt_t *coap_opt(const coap_msg_t *m, uint16_t num, int idx)
+{
+  for (int i = 0; i < m->nopt; i++)
+    if (m->opt[i].num == num && idx-- == 0)
+      return &m->opt[i];
+  return NULL;
+}
+
+uint32_t coap_opt_uint(const coap_msg_t *m, uint16_t num, uint32_t dflt)
+{
+  const coap_opt_t *o = coap_opt(m, num, 0);
+  if (o == NULL || o->len > 4)
+    return dflt;
+  uint32_t v = 0;
+  for (int i = 0; i < o->len; i++)
+    v = v << 8 | o->val[i];
+  return v;
+}
+
+static void put(coap_writer_t *w, const void *data, size_t len)
+{
+  if (w->len + len > w->cap) {
+    w->over = true;
+    return;
+  }
+  memcpy(w->buf + w->len, data, len);
+  w->len += len;
+}
+
+void coap_begin(coap_writer_t *w, uint8_t *buf, size_t cap, uint8_t type,
+                uint8_t code, uint16_t id, const uint8_t *token, uint8_t token_len)
+{
+  uint8_t head[4] = { 0x40 | type << 4 | token_len, code, id >> 8, id & 0xff };
+  w->buf = buf;
+  w->cap = cap;
+  w->len = 0;
+  w->last = 0;
+  w->over = false;
+  put(w, head, 4);
+  put(w, token, token_len);
+}
+
+// The nibble for v, and the extended bytes it needs in ext
+static unsigned ext_nibble(uint32_t v, uint8_t *ext, size_t *n)
+{
+  if (v < 13) {
+    *n = 0;
+    return v;
+  }
+  if (v < 269) {
+    ext[0] = v - 13;
+    *n = 1;
+    return 13;
+  }
+  ext[0] = (v - 269) >> 8;
+  ext[1] = (v - 269) & 0xff;
+  *n = 2;
+  return 14;
+}
+
+void coap_add_opt(coap_writer_t *w, uint16_t num, const void *val, size_t len)
+{
+  uint8_t head[5];
+  size_t dn, ln;
+  if (num < w->last) {
+    w->over = true;           // out of order, a bug in the caller
+    return;
+  }
+  unsigned d = ext_nibble(num - w->last, head + 1, &dn);
+  unsigned l = ext_nibble(len, head + 1 + dn, &ln);
+  head[0] = d << 4 | l;
+  put(w, head, 1 + dn + ln);
+  put(w, val, len);
+  w->last = num;
+}
+
+void coap_add_uint(coap_writer_t *w, uint16_t num, uint32_t val)
+{
+  uint8_t b[4];
+  size_t n = 0;
+  for (int shift = 24; shift >= 0; shift -= 8)
+    if (n || (val >> shift) & 0xff)
+      b[n++] = val >> shift;
+  coap_add_opt(w, num, b, n);
+}
+
+void coap_add_path(coap_writer_t *w, const char *path)
+{
+  while (*path == '/')
+    path++;
+  while (*path && *path != '?') {
+    size_t n = strcspn(path, "/?");
+    coap_add_opt(w, COAP_OPT_URI_PATH, path, n);
+    path += n;
+    if (*path == '/')
+      path++;
+  }
+}
+
+void coap_add_query(coap_writer_t *w, const char *path)
+{
+  const char *q = strchr(path, '?');
+  if (q == NULL)
+    return;
+  for (q++; *q; ) {
+    size_t n = strcspn(q, "&");
+    if (n)
+      coap_add_opt(w, COAP_OPT_URI_QUERY, q, n);
+    q += n;
+    if (*q == '&')
+      q++;
+  }
+}
+
+void coap_add_payload(coap_writer_t *w, const void *data, size_t len)
+{
+  if (len == 0)
+    return;
+  put(w, "\xff", 1);
+  put(w, data, len);
+}
+
+int coap_end(coap_writer_t *w)
+{
+  return w->over ? -1 : (int)w->len;
+}
@@ -75,8 +75,6 @@ struct clocktime {
     int usec;   /* micro seconds */
 };
 
-#define days_in_year(y)     (leapyear(y) ? 366 : 365)
-
 #define    FEBRUARY    2
 #define days_in_month(y, m) \
     (month_days[(m) - 1] + (m == FEBRUARY ? leapyear(y) : 0))
@@ -121,10 +119,45 @@ isLeapyear(int year)
 	return leapyear(year);
 }
 
+/*
+ * Days from 1/1/1970 to the given date and back, without walking the
+ * years and months in between. Years are counted from March so the leap
+ * day comes last, in 400 year eras of 146097 days; the month lengths from
+ * March on follow (153 * m + 2) / 5. Only valid for dates from 1970 on.
+ */
+static int
+days_from_civil(int year, int mon, int day)
+{
+    int era, yoe, doy, doe;
+
+    year -= mon <= FEBRUARY;
+    era = year / 400;
+    yoe = year - era * 400;
+    doy = (153 * (mon > FEBRUARY ? mon - 3 : mon + 9) + 2) / 5 + day - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+static void
+civil_from_days(int days, int *year, int *mon, int *day)
+{
+    int era, doe, yoe, doy, mp;
+
+    days += 719468;
+    era = days / 146097;
+    doe = days - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    *day = doy - (153 * mp + 2) / 5 + 1;
+    *mon = mp < 10 ? mp + 3 : mp - 9;
+    *year = yoe + era * 400 + (*mon <= FEBRUARY);
+}
+
 static int
 clocktime_to_timeval(const struct clocktime *ct, struct os_timeval *tv)
 {
-    int i, year, days;
+    int year, days;
 
     year = ct->year;
 
@@ -139,18 +172,7 @@ clocktime_to_timeval(const struct clocktime *ct, struct os_timeval *tv)
         return (-1);
     }
 
-    /*
-     * Compute days since start of time
-     * First from years, then from months.
-     */
-    days = 0;
-    for (i = POSIX_BASE_YEAR; i < year; i++)
-        days += days_in_year(i);
-
-    /* Months */
-    for (i = 1; i < ct->mon; i++)
-          days += days_in_month(year, i);
-    days += (ct->day - 1);
+    days = days_from_civil(year, ct->mon, ct->day);
 
     tv->tv_sec = (((int64_t)days * 24 + ct->hour) * 60 + ct->min) * 60 +
         ct->sec;
@@ -161,9 +183,9 @@ clocktime_to_timeval(const struct clocktime *ct, struct os_timeval *tv)
 
 static int
 timeval_to_clocktime(const struct os_timeval *tv, const struct os_timezone *tz,
-    struct clocktime *ct)
+    struct datetime_cache *cache, struct clocktime *ct)
 {
-    int i, year, days;
+    int days;
     int64_t rsec;           /* remainder seconds */
     int64_t secs;
 
@@ -183,18 +205,19 @@ timeval_to_clocktime(const struct os_timeval *tv, const struct os_timezone *tz,
 
     ct->dow = day_of_week(days);
 
-    /* Subtract out whole years, counting them in i. */
-    for (year = POSIX_BASE_YEAR; days >= days_in_year(year); year++)
-        days -= days_in_year(year);
-    ct->year = year;
-
-    /* Subtract out whole months, counting them in i. */
-    for (i = 1; days >= days_in_month(year, i); i++)
-        days -= days_in_month(year, i);
-    ct->mon = i;
-
-    /* Days are what is left over (+1) from all that. */
-    ct->day = days + 1;
+    if (cache != NULL && cache->days == days) {
+        ct->year = cache->year;
+        ct->mon = cache->mon;
+        ct->day = cache->day;
+    } else {
+        civil_from_days(days, &ct->year, &ct->mon, &ct->day);
+        if (cache != NULL) {
+            cache->days = days;
+            cache->year = ct->year;
+            cache->mon = ct->mon;
+            cache->day = ct->day;
+        }
+    }
 
     /* Hours, minutes, seconds are easy */
     ct->hour = rsec / 3600;
@@ -377,7 +400,7 @@ format_datetime(const struct os_timeval *tv, const struct os_timezone *tz,
     int off_hour, off_min, sign;
     struct clocktime ct;
 
-    rc = timeval_to_clocktime(tv, tz, &ct);
+    rc = timeval_to_clocktime(tv, tz, NULL, &ct);
     if (rc != 0) {
         goto err;
     }
@@ -433,3 +456,199 @@ format_datetime(const struct os_timeval *tv, const struct os_timezone *tz,
 err:
     return (-1);
 }
+
+static const char * const day_names[7] = {
+    "Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday",
+    "Saturday"
+};
+
+static const char * const month_names[12] = {
+    "January", "February", "March", "April", "May", "June", "July",
+    "August", "September", "October", "November", "December"
+};
+
+/* 'val' in 'width' digits, zero padded; NULL if it doesn't fit */
+static char *
+put_number(char *cp, const char *end, int64_t val, int width)
+{
+    char digits[20];
+    int n = 0;
+
+    if (val < 0) {
+        if (cp >= end) {
+            return (NULL);
+        }
+        *cp++ = '-';
+        val = -val;
+    }
+    do {
+        digits[n++] = '0' + val % 10;
+        val /= 10;
+    } while (val != 0);
+    while (n < width) {
+        digits[n++] = '0';
+    }
+    if (end - cp < n) {
+        return (NULL);
+    }
+    while (n > 0) {
+        *cp++ = digits[--n];
+    }
+    return (cp);
+}
+
+static char *
+put_string(char *cp, const char *end, const char *str, int len)
+{
+    if (end - cp < len) {
+        return (NULL);
+    }
+    memcpy(cp, str, len);
+    return (cp + len);
+}
+
+int
+format_datetime_fmt(const char *fmt, const struct os_timeval *tv,
+    const struct os_timezone *tz, struct datetime_cache *cache,
+    char *ostr, int olen)
+{
+    char *cp;
+    const char *end;
+    int minswest, hour12;
+    struct clocktime ct;
+
+    if (olen <= 0 || timeval_to_clocktime(tv, tz, cache, &ct) != 0) {
+        return (-1);
+    }
+
+    cp = ostr;
+    end = ostr + olen - 1;      /* room for the terminating NUL */
+    for (; *fmt != '\0' && cp != NULL; fmt++) {
+        if (*fmt != '%') {
+            cp = put_string(cp, end, fmt, 1);
+            continue;
+        }
+        hour12 = ct.hour % 12 ? ct.hour % 12 : 12;
+        switch (*++fmt) {
+        case 'Y':
+            cp = put_number(cp, end, ct.year, 4);
+            break;
+        case 'y':
+            cp = put_number(cp, end, ct.year % 100, 2);
+            break;
+        case 'm':
+            cp = put_number(cp, end, ct.mon, 2);
+            break;
+        case 'd':
+            cp = put_number(cp, end, ct.day, 2);
+            break;
+        case 'e':
+            if (ct.day < 10) {
+                cp = put_string(cp, end, " ", 1);
+            }
+            if (cp != NULL) {
+                cp = put_number(cp, end, ct.day, 1);
+            }
+            break;
+        case 'j':
+            cp = put_number(cp, end, days_from_civil(ct.year, ct.mon, ct.day) -
+                days_from_civil(ct.year, 1, 1) + 1, 3);
+            break;
+        case 'H':
+            cp = put_number(cp, end, ct.hour, 2);
+            break;
+        case 'I':
+            cp = put_number(cp, end, hour12, 2);
+            break;
+        case 'M':
+            cp = put_number(cp, end, ct.min, 2);
+            break;
+        case 'S':
+            cp = put_number(cp, end, ct.sec, 2);
+            break;
+        case 'f':
+            cp = put_number(cp, end, ct.usec, 6);
+            break;
+        case 'p':
+            cp = put_string(cp, end, ct.hour < 12 ? "AM" : "PM", 2);
+            break;
+        case 'a':
+            cp = put_string(cp, end, day_names[ct.dow], 3);
+            break;
+        case 'A':
+            cp = put_string(cp, end, day_names[ct.dow],
+                strlen(day_names[ct.dow]));
+            break;
+        case 'b':
+            cp = put_string(cp, end, month_names[ct.mon - 1], 3);
+            break;
+        case 'B':
+            cp = put_string(cp, end, month_names[ct.mon - 1],
+                strlen(month_names[ct.mon - 1]));
+            break;
+        case 'u':
+            cp = put_number(cp, end, ct.dow ? ct.dow : 7, 1);
+            break;
+        case 'w':
+            cp = put_number(cp, end, ct.dow, 1);
+            break;
+        case 's':
+            cp = put_number(cp, end, tv->tv_sec, 1);
+            break;
+        case 'F':
+            cp = put_number(cp, end, ct.year, 4);
+            if (cp != NULL) {
+                cp = put_string(cp, end, "-", 1);
+            }
+            if (cp != NULL) {
+                cp = put_number(cp, end, ct.mon, 2);
+            }
+            if (cp != NULL) {
+                cp = put_string(cp, end, "-", 1);
+            }
+            if (cp != NULL) {
+                cp = put_number(cp, end, ct.day, 2);
+            }
+            break;
+        case 'T':
+            cp = put_number(cp, end, ct.hour, 2);
+            if (cp != NULL) {
+                cp = put_string(cp, end, ":", 1);
+            }
+            if (cp != NULL) {
+                cp = put_number(cp, end, ct.min, 2);
+            }
+            if (cp != NULL) {
+                cp = put_string(cp, end, ":", 1);
+            }
+            if (cp != NULL) {
+                cp = put_number(cp, end, ct.sec, 2);
+            }
+            break;
+        case 'z':
+            minswest = 0;
+            if (tz != NULL) {
+                minswest = tz->tz_minuteswest - (tz->tz_dsttime ? 60 : 0);
+            }
+            cp = put_string(cp, end, minswest <= 0 ? "+" : "-", 1);
+            if (minswest < 0) {
+                minswest = -minswest;
+            }
+            if (cp != NULL) {
+                cp = put_number(cp, end, minswest / 60 * 100 + minswest % 60, 4);
+            }
+            break;
+        case '%':
+            cp = put_string(cp, end, "%", 1);
+            break;
+        default:
+            /* unknown conversions, and a '%' at the end, are an error */
+            return (-1);
+        }
+    }
+    if (cp == NULL) {
+        return (-1);
+    }
+    *cp = '\0';
+    return (cp - ostr);
+}
@@ -0,0 +1,355 @@
+// Streaming deflate compressor, see deflate.h
+
+#include "deflate.h"
+#include "rom/crc.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_MATCH   3
+#define MAX_MATCH   258
+#define OUT_SIZE    64      // output gathered before it goes to out()
+
+struct deflate_state {
+  uint8_t format;
+  bool block_open;          // a fixed Huffman block has been started
+  bool header_done;
+  bool finished;
+  uint16_t chain;           // hash chain entries to try for a match
+  uint8_t hash_bits;
+  uint32_t wsize;           // the window; the buffer holds twice that
+  uint32_t start;           // next byte of the buffer to code
+  uint32_t end;             // bytes in the buffer
+  uint32_t check;           // adler-32 or crc-32 of the input
+  uint32_t total;           // input bytes, for gzip
+  uint32_t bits;            // output bits not yet a whole byte
+  uint8_t nbits;
+  uint16_t olen;
+  uint8_t obuf[OUT_SIZE];
+  uint16_t *head;           // newest position of each hash
+  uint16_t *prev;           // position before it with the same hash
+  uint8_t *win;
+};
+
+static const uint16_t len_base[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t len_extra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t dist_base[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t dist_extra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static const uint16_t chain_for_level[10] = { 0, 4, 8, 16, 32, 64, 128, 256, 1024, 4096 };
+
+static uint32_t hash_size(int window_bits)
+{
+  return 1u << (window_bits - 1);
+}
+
+size_t deflate_size(int window_bits)
+{
+  uint32_t w = 1u << window_bits;
+  return sizeof(deflate_state_t) + 2 * w +
+         (hash_size(window_bits) + w) * sizeof(uint16_t);
+}
+
+deflate_state_t *deflate_new(int format, int level, int window_bits)
+{
+  if (window_bits < 9 || window_bits > 15 || level < 0 || level > 9)
+    return NULL;
+  deflate_state_t *d = (deflate_state_t *)calloc(1, deflate_size(window_bits));
+  if (!d)
+    return NULL;
+  d->format = format;
+  d->chain = chain_for_level[level];
+  d->hash_bits = window_bits - 1;
+  d->wsize = 1u << window_bits;
+  d->head = (uint16_t *)(d + 1);
+  d->prev = d->head + hash_size(window_bits);
+  d->win = (uint8_t *)(d->prev + d->wsize);
+  d->check = format == DEFLATE_ZLIB ? 1 : 0;
+  return d;
+}
+
+void deflate_free(deflate_state_t *d)
+{
+  free(d);
+}
+
+bool deflate_finished(const deflate_state_t *d)
+{
+  return d->finished;
+}
+
+/*
+ * Output
+ */
+
+static void out_flush(deflate_state_t *d, deflate_out_fn out, void *arg)
+{
+  if (d->olen) {
+    out(arg, d->obuf, d->olen);
+    d->olen = 0;
+  }
+}
+
+static void out_byte(deflate_state_t *d, uint8_t b, deflate_out_fn out, void *arg)
+{
+  d->obuf[d->olen++] = b;
+  if (d->olen == OUT_SIZE)
+    out_flush(d, out, arg);
+}
+
+// n bits of v, least significant first, as deflate packs them
+static void put_bits(deflate_state_t *d, uint32_t v, int n, deflate_out_fn out, void *arg)
+{
+  d->bits |= v << d->nbits;
+  d->nbits += n;
+  while (d->nbits >= 8) {
+    out_byte(d, d->bits, out, arg);
+    d->bits >>= 8;
+    d->nbits -= 8;
+  }
+}
+
+static void put_align(deflate_state_t *d, deflate_out_fn out, void *arg)
+{
+  if (d->nbits)
+    put_bits(d, 0, 8 - d->nbits, out, arg);
+}
+
+// Huffman codes go most significant bit first
+static void put_code(deflate_state_t *d, uint32_t code, int n, deflate_out_fn out, void *arg)
+{
+  uint32_t r = 0;
+  for (int i = 0; i < n; i++, code >>= 1)
+    r = (r << 1) | (code & 1);
+  put_bits(d, r, n, out, arg);
+}
+
+// A literal/length symbol in the fixed code
+static void put_symbol(deflate_state_t *d, uint32_t s, deflate_out_fn out, void *arg)
+{
+  if (s < 144)
+    put_code(d, 0x30 + s, 8, out, arg);
+  else if (s < 256)
+    put_code(d, 0x190 + s - 144, 9, out, arg);
+  else if (s < 280)
+    put_code(d, s - 256, 7, out, arg);
+  else
+    put_code(d, 0xc0 + s - 280, 8, out, arg);
+}
+
+static void put_match(deflate_state_t *d, uint32_t len, uint32_t dist, deflate_out_fn out, void *arg)
+{
+  int i;
+  for (i = 28; len_base[i] > len; i--)
+    ;
+  put_symbol(d, 257 + i, out, arg);
+  put_bits(d, len - len_base[i], len_extra[i], out, arg);
+  for (i = 29; dist_base[i] > dist; i--)
+    ;
+  put_code(d, i, 5, out, arg);
+  put_bits(d, dist - dist_base[i], dist_extra[i], out, arg);
+}
+
+static void put_be32(deflate_state_t *d, uint32_t v, deflate_out_fn out, void *arg)
+{
+  for (int i = 24; i >= 0; i -= 8)
+    out_byte(d, v >> i, out, arg);
+}
+
+static void put_le32(deflate_state_t *d, uint32_t v, deflate_out_fn out, void *arg)
+{
+  for (int i = 0; i < 32; i += 8)
+    out_byte(d, v >> i, out, arg);
+}
+
+static void put_header(deflate_state_t *d, deflate_out_fn out, void *arg)
+{
+  if (d->format == DEFLATE_ZLIB) {
+    // CINFO gives the window, so that an inflater can allocate less
+    uint32_t cmf = 0x08 | (d->hash_bits + 1 - 8) << 4;
+    uint32_t flg = 0x80;    // "fast" compression level, no dictionary
+    flg += 31 - (cmf << 8 | flg) % 31;
+    out_byte(d, cmf, out, arg);
+    out_byte(d, flg, out, arg);
+  } else if (d->format == DEFLATE_GZIP) {
+    static const uint8_t gz[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff };
+    for (int i = 0; i < 10; i++)
+      out_byte(d, gz[i], out, arg);
+  }
+  d->header_done = true;
+}
+
+/*
+ * Matching
+ */
+
+static uint32_t hash3(const deflate_state_t *d, const uint8_t *p)
+{
+  uint32_t v = p[0] | p[1] << 8 | p[2] << 16;
+  return (v * 2654435761u) >> (32 - d->hash_bits);
+}
+
+static void insert(deflate_state_t *d, uint32_t pos)
+{
+  uint32_t h = hash3(d, d->win + pos);
+  d->prev[pos & (d->wsize - 1)] = d->head[h];
+  d->head[h] = pos;
+}
+
+// Longest match for the bytes at start among the earlier positions with
+// the same hash. Stale entries are harmless, as every candidate is
+// compared byte by byte.
+static uint32_t longest_match(deflate_state_t *d, uint32_t *dist)
+{
+  uint32_t pos = d->start, best = 0;
+  uint32_t limit = d->end - pos < MAX_MATCH ? d->end - pos : MAX_MATCH;
+  uint32_t cand = d->head[hash3(d, d->win + pos)];
+  const uint8_t *p = d->win + pos;
+
+  for (int n = d->chain; n > 0 && cand < pos && pos - cand <= d->wsize; n--) {
+    const uint8_t *q = d->win + cand;
+    if (q[best] == p[best] && q[0] == p[0]) {
+      uint32_t len = 0;
+      while (len < limit && q[len] == p[len])
+        len++;
+      if (len > best) {
+        best = len;
+        *dist = pos - cand;
+        if (len == limit)
+          break;
+      }
+    }
+    uint32_t next = d->prev[cand & (d->wsize - 1)];
+    if (next >= cand)
+      break;
+    cand = next;
+  }
+  return best;
+}
+
+// Code the buffered input, all of it if flushing, else as much as leaves
+// enough after it to find a longest match
+static void code_input(deflate_state_t *d, bool all, deflate_out_fn out, void *arg)
+{
+  while (d->start < d->end) {
+    uint32_t avail = d->end - d->start, len = 0, dist = 0;
+    if (!all && avail < MAX_MATCH)
+      break;
+    if (!d->block_open) {
+      put_bits(d, 0, 1, out, arg);          // not the last block
+      put_bits(d, 1, 2, out, arg);          // fixed codes
+      d->block_open = true;
+    }
+    if (avail >= MIN_MATCH) {
+      if (d->chain)
+        len = longest_match(d, &dist);
+      insert(d, d->start);
+    }
+    if (len >= MIN_MATCH) {
+      put_match(d, len, dist, out, arg);
+      for (uint32_t i = 1; i < len; i++)
+        if (d->start + i + MIN_MATCH <= d->end)
+          insert(d, d->start + i);
+      d->start += len;
+    } else {
+      put_symbol(d, d->win[d->start], out, arg);
+      d->start++;
+    }
+  }
+}
+
+static uint32_t adler32(uint32_t adler, const uint8_t *p, size_t len)
+{
+  uint32_t a = adler & 0xffff, b = adler >> 16;
+  while (len) {
+    size_t n = len < 5552 ? len : 5552;     // no overflow before the modulo
+    len -= n;
+    while (n--) {
+      a += *p++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return b << 16 | a;
+}
+
+// Move the newer half of the buffer down over the older one
+static void slide(deflate_state_t *d)
+{
+  uint32_t w = d->wsize, i, n = hash_size(d->hash_bits + 1);
+  memcpy(d->win, d->win + w, w);
+  d->start -= w;
+  d->end -= w;
+  for (i = 0; i < n; i++)
+    d->head[i] = d->head[i] >= w ? d->head[i] - w : 0;
+  for (i = 0; i < w; i++)
+    d->prev[i] = d->prev[i] >= w ? d->prev[i] - w : 0;
+}
+
+void deflate_write(deflate_state_t *d, const void *data, size_t len, int flush,
+                   deflate_out_fn out, void *arg)
+{
+  const uint8_t *p = (const uint8_t *)data;
+
+  if (d->finished)
+    return;
+  if (!d->header_done)
+    put_header(d, out, arg);
+  if (d->format == DEFLATE_ZLIB)
+    d->check = adler32(d->check, p, len);
+  else if (d->format == DEFLATE_GZIP)
+    d->check = crc32_le(d->check, p, len);
+  d->total += len;
+
+  while (len) {
+    if (d->end == 2 * d->wsize)
+      slide(d);
+    size_t n = 2 * d->wsize - d->end;
+    if (n > len)
+      n = len;
+    memcpy(d->win + d->end, p, n);
+    d->end += n;
+    p += n;
+    len -= n;
+    code_input(d, false, out, arg);
+  }
+
+  if (flush != DEFLATE_NO_FLUSH) {
+    code_input(d, true, out, arg);
+    if (d->block_open) {
+      put_symbol(d, 256, out, arg);         // end of block
+      d->block_open = false;
+    }
+    if (flush == DEFLATE_SYNC_FLUSH) {
+      // an empty stored block brings the output to a byte boundary
+      put_bits(d, 0, 3, out, arg);
+      put_align(d, out, arg);
+      put_le32(d, 0xffff0000, out, arg);
+    } else {
+      put_bits(d, 1, 1, out, arg);          // an empty last block
+      put_bits(d, 1, 2, out, arg);
+      put_symbol(d, 256, out, arg);
+      put_align(d, out, arg);
+      if (d->format == DEFLATE_ZLIB) {
+        put_be32(d, d->check, out, arg);
+      } else if (d->format == DEFLATE_GZIP) {
+        put_le32(d, d->check, out, arg);
+        put_le32(d, d->total, out, arg);
+      }
+      d->finished = true;
+    }
+  }
+  out_flush(d, out, arg);
+}
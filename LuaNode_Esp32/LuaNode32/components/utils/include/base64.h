@@ -29,4 +29,40 @@ int base64_decode_len(const char *str);
 
 #define BASE64_ENCODE_SIZE(__size) ((((__size) * 4) / 3) + 4)
 
+/*
+ * Streaming conversion, for data that comes and goes in chunks. Each
+ * update converts what it can and carries the rest over to the next call;
+ * final converts what is left and readies the state for new data.
+ * Nothing is NUL terminated.
+ */
+typedef struct {
+    uint8_t buf[3];
+    uint8_t n;
+} base64_enc_t;
+
+typedef struct {
+    uint32_t acc;
+    uint8_t n;
+    uint8_t pad;
+} base64_dec_t;
+
+/* Room update needs for size bytes; final needs 4 */
+#define BASE64_ENCODE_UPDATE_SIZE(__size) ((((__size) + 2) / 3) * 4)
+
+void base64_encode_init(base64_enc_t *st);
+int base64_encode_update(base64_enc_t *st, const void *data, int size, char *s);
+int base64_encode_final(base64_enc_t *st, char *s, uint8_t should_pad);
+
+/* Room update needs for len characters; final needs 2 */
+#define BASE64_DECODE_UPDATE_SIZE(__len) ((((__len) + 3) / 4) * 3)
+
+/*
+ * Whitespace is skipped and padding is optional. Both return the bytes
+ * written, or -1 for characters that aren't base64 (update) or a dangling
+ * single character (final).
+ */
+void base64_decode_init(base64_dec_t *st);
+int base64_decode_update(base64_dec_t *st, const char *str, int len, void *data);
+int base64_decode_final(base64_dec_t *st, void *data);
+
 #endif /* __UTIL_BASE64_H__ */
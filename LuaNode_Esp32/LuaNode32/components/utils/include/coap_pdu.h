@@ -0,0 +1,109 @@
+#ifndef _COAP_PDU_H_
+#define _COAP_PDU_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * CoAP messages (RFC 7252) read in place and written into a caller's
+ * buffer. Nothing is allocated: a parsed message points into the datagram
+ * it came from.
+ */
+
+enum {
+  COAP_CON = 0,
+  COAP_NON = 1,
+  COAP_ACK = 2,
+  COAP_RST = 3
+};
+
+/* Codes are class << 5 | detail, 2.05 being COAP_CODE(2, 5) */
+#define COAP_CODE(c, d)   (((c) << 5) | (d))
+#define COAP_CODE_CLASS(code) ((code) >> 5)
+#define COAP_CODE_DETAIL(code) ((code) & 0x1f)
+
+#define COAP_EMPTY        0
+#define COAP_GET          1
+#define COAP_POST         2
+#define COAP_PUT          3
+#define COAP_DELETE       4
+
+#define COAP_CREATED      COAP_CODE(2, 1)
+#define COAP_CHANGED      COAP_CODE(2, 4)
+#define COAP_CONTENT      COAP_CODE(2, 5)
+#define COAP_CONTINUE     COAP_CODE(2, 31)
+#define COAP_BAD_REQUEST  COAP_CODE(4, 0)
+#define COAP_NOT_FOUND    COAP_CODE(4, 4)
+#define COAP_NOT_ALLOWED  COAP_CODE(4, 5)
+#define COAP_INCOMPLETE   COAP_CODE(4, 8)
+#define COAP_TOO_LARGE    COAP_CODE(4, 13)
+#define COAP_SERVER_ERROR COAP_CODE(5, 0)
+
+#define COAP_OPT_OBSERVE        6
+#define COAP_OPT_URI_PATH       11
+#define COAP_OPT_CONTENT_FORMAT 12
+#define COAP_OPT_URI_QUERY      15
+#define COAP_OPT_BLOCK2         23
+#define COAP_OPT_BLOCK1         27
+
+#define COAP_MAX_OPTIONS  16
+#define COAP_MAX_TOKEN    8
+
+/* Block1 and Block2 values: block number, more flag, size 16 << szx */
+#define COAP_BLOCK(num, more, szx) (((uint32_t)(num) << 4) | ((more) ? 8 : 0) | (szx))
+#define COAP_BLOCK_NUM(v)   ((v) >> 4)
+#define COAP_BLOCK_MORE(v)  (((v) >> 3) & 1)
+#define COAP_BLOCK_SZX(v)   ((v) & 7)
+#define COAP_BLOCK_SIZE(szx) (16u << (szx))
+
+typedef struct {
+  uint16_t num;
+  uint16_t len;
+  const uint8_t *val;
+} coap_opt_t;
+
+typedef struct {
+  uint8_t type;
+  uint8_t code;
+  uint16_t id;
+  uint8_t token_len;
+  uint8_t token[COAP_MAX_TOKEN];
+  uint8_t nopt;
+  coap_opt_t opt[COAP_MAX_OPTIONS];     /* in ascending order */
+  const uint8_t *payload;
+  size_t payload_len;
+} coap_msg_t;
+
+/* 0, or -1 if buf isn't a CoAP message or has too many options */
+int coap_parse(coap_msg_t *m, const uint8_t *buf, size_t len);
+
+/* The idx'th option num of m, NULL if there isn't one */
+const coap_opt_t *coap_opt(const coap_msg_t *m, uint16_t num, int idx);
+
+/* The value of an unsigned integer option, dflt if m doesn't have it */
+uint32_t coap_opt_uint(const coap_msg_t *m, uint16_t num, uint32_t dflt);
+
+typedef struct {
+  uint8_t *buf;
+  size_t cap;
+  size_t len;
+  uint16_t last;            /* option number, they must come in order */
+  bool over;                /* ran out of room */
+} coap_writer_t;
+
+void coap_begin(coap_writer_t *w, uint8_t *buf, size_t cap, uint8_t type,
+                uint8_t code, uint16_t id, const uint8_t *token, uint8_t token_len);
+void coap_add_opt(coap_writer_t *w, uint16_t num, const void *val, size_t len);
+/* In the fewest bytes, none for 0 */
+void coap_add_uint(coap_writer_t *w, uint16_t num, uint32_t val);
+/* The levels of path up to any '?' as Uri-Path options */
+void coap_add_path(coap_writer_t *w, const char *path);
+/* The '&' separated parts after the '?' of path as Uri-Query options */
+void coap_add_query(coap_writer_t *w, const char *path);
+/* Last, after all options */
+void coap_add_payload(coap_writer_t *w, const void *data, size_t len);
+/* Bytes written, or -1 if they didn't fit */
+int coap_end(coap_writer_t *w);
+
+#endif /* _COAP_PDU_H_ */
@@ -33,4 +33,7 @@
 #define CRC16_INITIAL_CRC       0       /* what to seed crc16 with */
 unsigned short crc16_ccitt(uint16_t initial_crc, const void *buf, int len);
 
+#define CRC16_MODBUS_INITIAL_CRC 0xffff
+uint16_t crc16_modbus(uint16_t initial_crc, const void *buf, int len);
+
 #endif /* _CRC16_H_ */
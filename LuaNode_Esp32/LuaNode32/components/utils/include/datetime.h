@@ -47,6 +47,31 @@ int format_datetime(const struct os_timeval *utctime,
 int parse_datetime(const char *input, struct os_timeval *utctime,
     struct os_timezone *tz);
 
+/*
+ * Remembers the date of the last day a conversion was for, so times on
+ * the same day skip the calendar arithmetic. Owned by the caller; one per
+ * thread of use. Set 'days' to -1 before the first call.
+ */
+struct datetime_cache {
+    int days;           /* days since 1/1/1970, local time */
+    int year;
+    int mon;
+    int day;
+};
+
+/*
+ * Format the time specified by 'utctime' and 'tz' as 'fmt' says, in the
+ * manner of strftime(): %Y %y %m %d %e %j %H %I %M %S %p %a %A %b %B %u
+ * %w %s %F %T %z and %%, plus %f for the microseconds (6 digits). 'cache'
+ * may be NULL.
+ *
+ * Returns the length of the output, or -1 if 'fmt' has an unknown
+ * conversion or the output doesn't fit in 'olen' bytes.
+ */
+int format_datetime_fmt(const char *fmt, const struct os_timeval *utctime,
+    const struct os_timezone *tz, struct datetime_cache *cache,
+    char *output, int olen);
+
 int isLeapyear(int year);
 
 #endif  /* __UTIL_DATETIME_H */
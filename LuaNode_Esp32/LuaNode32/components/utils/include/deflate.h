@@ -0,0 +1,49 @@
+#ifndef _DEFLATE_H_
+#define _DEFLATE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A streaming deflate compressor for small RAM. miniz's tdefl is in ROM,
+ * but its state alone takes some 160 KB. This one finds matches in a
+ * window of 2^window_bits bytes (9 to 15), by hash chains as deep as the
+ * level asks, and codes them with the fixed Huffman codes, so it needs
+ * no block buffer: about five times the window in RAM, all told.
+ * The output is raw deflate or a zlib or gzip stream, which any inflater
+ * reads; text and JSON typically shrink to a third to a half.
+ */
+
+enum { DEFLATE_RAW, DEFLATE_ZLIB, DEFLATE_GZIP };
+
+enum {
+  DEFLATE_NO_FLUSH,
+  DEFLATE_SYNC_FLUSH,   /* all output so far, on a byte boundary */
+  DEFLATE_FINISH        /* end the stream */
+};
+
+typedef struct deflate_state deflate_state_t;
+
+/* Called with the output as it is made */
+typedef void (*deflate_out_fn)(void *arg, const uint8_t *data, size_t len);
+
+/* NULL if out of memory. level 0 codes literals only, 9 searches most. */
+deflate_state_t *deflate_new(int format, int level, int window_bits);
+
+/* Bytes of RAM deflate_new takes for a window */
+size_t deflate_size(int window_bits);
+
+/*
+ * Compress len bytes, handing out what becomes ready. Input is held back
+ * until later bytes show whether it starts a match, unless flush says
+ * otherwise; after DEFLATE_FINISH the state takes no more input.
+ */
+void deflate_write(deflate_state_t *d, const void *data, size_t len, int flush,
+                   deflate_out_fn out, void *arg);
+
+bool deflate_finished(const deflate_state_t *d);
+
+void deflate_free(deflate_state_t *d);
+
+#endif /* _DEFLATE_H_ */
@@ -0,0 +1,71 @@
+#ifndef _LZSS_H_
+#define _LZSS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A small LZSS codec in the manner of heatshrink, for compressing logs
+ * and files where deflate takes too much RAM. The encoder holds twice its
+ * window, the decoder once, plus a few bytes each: with the default 2^8
+ * window that is some 550 and 290 bytes.
+ *
+ * The output is a bit stream, most significant bit first, of
+ *   1 + 8 bits        a literal byte
+ *   0 + w + l bits    a copy of count + 2 bytes from dist bytes back,
+ *                     dist 1 to 2^w - 1
+ *   0 + w + l zeros   the end of a segment; the stream goes on at the
+ *                     next byte boundary
+ * in segments that each start with the three bytes 'L' 'Z' (w << 4 | l).
+ * Segments can follow one another, so appending to a compressed file
+ * starts a new one. A segment cut short, say by a reset before it was
+ * ended, decodes as far as it got.
+ */
+
+#define LZSS_WINDOW_BITS     8
+#define LZSS_LOOKAHEAD_BITS  4
+#define LZSS_MIN_WINDOW_BITS 6
+#define LZSS_MAX_WINDOW_BITS 12
+
+#define LZSS_HEADER_SIZE     3
+
+typedef struct lzss_enc lzss_enc_t;
+typedef struct lzss_dec lzss_dec_t;
+
+/* Called with the encoder's output as it is made */
+typedef void (*lzss_out_fn)(void *arg, const uint8_t *data, size_t len);
+
+/* NULL if out of memory or the sizes are out of range; lookahead_bits
+   goes from 2 up to window_bits - 2 */
+lzss_enc_t *lzss_enc_new(int window_bits, int lookahead_bits);
+
+/*
+ * Compress len bytes, handing out what becomes ready. Up to a match's
+ * worth of input is held back until later bytes show whether it starts
+ * one. With finish set, the segment is ended and everything put out; the
+ * next write starts a new segment.
+ */
+void lzss_enc_write(lzss_enc_t *e, const void *data, size_t len, bool finish,
+                    lzss_out_fn out, void *arg);
+
+/* Whether bytes have been written since the segment was ended */
+bool lzss_enc_pending(const lzss_enc_t *e);
+
+void lzss_enc_free(lzss_enc_t *e);
+
+/* NULL if out of memory; the window is allocated by the first header */
+lzss_dec_t *lzss_dec_new(void);
+
+/*
+ * Decode from *in, *in_len bytes of it, into out, up to out_len bytes.
+ * Returns the bytes decoded and advances *in and *in_len past the input
+ * used; it stops when out is full or the input is used up, and goes on
+ * from there on the next call. -1 if the input is not an LZSS stream.
+ */
+int lzss_dec_read(lzss_dec_t *d, const uint8_t **in, size_t *in_len,
+                  uint8_t *out, size_t out_len);
+
+void lzss_dec_free(lzss_dec_t *d);
+
+#endif /* _LZSS_H_ */
@@ -0,0 +1,60 @@
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Hierarchical timer wheel, in ticks of whatever clock the caller uses.
+ * Each level has 64 slots, each slot of a level spanning a whole turn of
+ * the level below, so adding and removing a timer takes constant time
+ * however many there are. Levels above the first are spread out over the
+ * lower ones as time gets to them. Deadlines past the top level wait in
+ * its last slot and are placed again from there.
+ */
+
+#define TIMER_WHEEL_BITS   6
+#define TIMER_WHEEL_SLOTS  (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+typedef struct timer_wheel_node {
+  struct timer_wheel_node *next;
+  struct timer_wheel_node **pprev;      /* NULL unless in the wheel */
+  uint32_t expires;
+  uint8_t level;
+  uint8_t slot;
+} timer_wheel_node_t;
+
+typedef struct {
+  uint32_t time;                        /* next tick to look at */
+  uint32_t count;
+  uint64_t occupied[TIMER_WHEEL_LEVELS];
+  timer_wheel_node_t *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+  timer_wheel_node_t *late;             /* added when already expired */
+} timer_wheel_t;
+
+void timer_wheel_init(timer_wheel_t *w, uint32_t now);
+
+/* A deadline already passed expires with the next advance */
+void timer_wheel_add(timer_wheel_t *w, timer_wheel_node_t *n, uint32_t expires);
+void timer_wheel_remove(timer_wheel_t *w, timer_wheel_node_t *n);
+
+static inline bool timer_wheel_pending(const timer_wheel_node_t *n)
+{
+  return n->pprev != 0;
+}
+
+/*
+ * Move time on to now and take out everything expired by then. Returns
+ * them linked through next, soonest first; ones of the same tick come in
+ * no particular order.
+ */
+timer_wheel_node_t *timer_wheel_advance(timer_wheel_t *w, uint32_t now);
+
+/*
+ * Ticks from now until the next advance has anything to do, which may be
+ * before the next deadline. -1 if the wheel is empty.
+ */
+int32_t timer_wheel_next(const timer_wheel_t *w, uint32_t now);
+
+#endif /* _TIMER_WHEEL_H_ */
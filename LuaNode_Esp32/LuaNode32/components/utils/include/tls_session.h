@@ -0,0 +1,28 @@
+#ifndef _TLS_SESSION_H_
+#define _TLS_SESSION_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "mbedtls/ssl.h"
+
+/*
+ * TLS client sessions by server, so a reconnect can resume one with a
+ * session ticket or ID instead of doing a full handshake. The cache holds
+ * CONFIG_TLS_SESSION_CACHE servers, the least recently used going first;
+ * with CONFIG_TLS_SESSION_RTC it is in RTC memory and survives deep
+ * sleep. Servers are told apart by a hash of host and port: one taken for
+ * another only costs the full handshake it would have done anyway.
+ * Safe to use from any task.
+ */
+
+/* Offer the session last saved for host:port, if there is one, in the next
+ * handshake of ssl. A server that won't resume it does a full handshake. */
+bool tls_session_load(mbedtls_ssl_context *ssl, const char *host, uint16_t port);
+
+/* Keep the session of ssl, after its handshake, for host:port */
+void tls_session_save(mbedtls_ssl_context *ssl, const char *host, uint16_t port);
+
+/* Drop what there is for host:port, after a handshake failed with it */
+void tls_session_forget(const char *host, uint16_t port);
+
+#endif /* _TLS_SESSION_H_ */
@@ -0,0 +1,59 @@
+#ifndef _TOPIC_TRIE_H_
+#define _TOPIC_TRIE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * MQTT topic filters, one trie node per topic level, each holding an int
+ * for the filter that ends there. Matching a topic walks its levels once,
+ * following the literal level and the "+" and "#" branches of each node,
+ * so it costs the same however many filters don't match. As in MQTT,
+ * "a/#" also matches "a", and wildcards at the first level don't match
+ * topics starting with '$'.
+ */
+
+typedef struct topic_trie_node {
+  struct topic_trie_node *next;         /* sibling */
+  struct topic_trie_node *child;        /* literal levels below */
+  struct topic_trie_node *plus;         /* "+" below */
+  struct topic_trie_node *hash;         /* "#" below, always a leaf */
+  int value;
+  bool set;                             /* a filter ends here */
+  uint16_t len;
+  char level[];
+} topic_trie_node_t;
+
+typedef struct {
+  topic_trie_node_t *root;
+  uint32_t count;
+} topic_trie_t;
+
+typedef void (*topic_trie_fn)(int value, void *arg);
+
+void topic_trie_init(topic_trie_t *t);
+
+/* '+' and '#' must be whole levels, '#' only the last one */
+bool topic_trie_valid(const char *filter);
+
+/*
+ * Set the value of filter. Returns 0 if it is new, 1 if it replaced a
+ * value, which is put in *old, -1 for a bad filter and -2 out of memory.
+ */
+int topic_trie_insert(topic_trie_t *t, const char *filter, int value, int *old);
+
+/* Returns whether filter was there, putting its value in *old */
+bool topic_trie_remove(topic_trie_t *t, const char *filter, int *old);
+
+/*
+ * Call fn with the value of every filter matching the topic of len bytes,
+ * and return how many there were. fn must leave the trie alone.
+ */
+int topic_trie_match(const topic_trie_t *t, const char *topic, size_t len,
+                     topic_trie_fn fn, void *arg);
+
+/* Empty the trie, handing each value to fn if it isn't NULL */
+void topic_trie_clear(topic_trie_t *t, topic_trie_fn fn, void *arg);
+
+#endif /* _TOPIC_TRIE_H_ */
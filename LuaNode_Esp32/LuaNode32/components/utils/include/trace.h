@@ -0,0 +1,107 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+
+/*
+ * Binary trace of what the firmware does, for following latency from the
+ * lwIP callback through task_post() and the Lua task to tcp_write()
+ * without a printf in the way. Each record is the CPU cycle counter, the
+ * core, an event id and two arguments, taken in a ring of
+ * CONFIG_TRACE_RECORDS that the oldest records fall out of. Writers claim
+ * a slot with one compare-and-set, so trace points are safe in any task
+ * and in ISRs on either core. With tracing off a trace point only tests a
+ * mask; without CONFIG_TRACE_ENABLE it compiles to nothing.
+ *
+ * Events come in groups that are switched on together; _B and _E events
+ * open and close a span, the others are instants.
+ */
+
+enum {
+  TRACE_GROUP_TASK,
+  TRACE_GROUP_NET,
+  TRACE_GROUP_TMR,
+  TRACE_GROUP_MQTT,
+  TRACE_GROUP_GC,
+  TRACE_GROUP_VFS,
+  TRACE_GROUP_LUA,
+  TRACE_GROUPS
+};
+
+#define TRACE_ID(group, n)  (((group) << 4) | (n))
+#define TRACE_GROUP(id)     ((id) >> 4)
+#define TRACE_ALL           ((1u << TRACE_GROUPS) - 1)
+
+enum {
+  TRACE_TASK_POST     = TRACE_ID(TRACE_GROUP_TASK, 0),  /* handle, prio | failed << 8 */
+  TRACE_TASK_RUN_B    = TRACE_ID(TRACE_GROUP_TASK, 1),  /* handle, prio */
+  TRACE_TASK_RUN_E    = TRACE_ID(TRACE_GROUP_TASK, 2),
+  TRACE_NET_EVENT_B   = TRACE_ID(TRACE_GROUP_NET, 0),   /* event, socket */
+  TRACE_NET_EVENT_E   = TRACE_ID(TRACE_GROUP_NET, 1),
+  TRACE_NET_RECV      = TRACE_ID(TRACE_GROUP_NET, 2),   /* bytes, socket; lwIP task */
+  TRACE_NET_WRITE     = TRACE_ID(TRACE_GROUP_NET, 3),   /* bytes, socket; tcp_write() */
+  TRACE_TMR_B         = TRACE_ID(TRACE_GROUP_TMR, 0),   /* timer, mode */
+  TRACE_TMR_E         = TRACE_ID(TRACE_GROUP_TMR, 1),
+  TRACE_MQTT_SEND     = TRACE_ID(TRACE_GROUP_MQTT, 0),  /* bytes, result */
+  TRACE_MQTT_RECV     = TRACE_ID(TRACE_GROUP_MQTT, 1),  /* bytes */
+  TRACE_MQTT_DELIVER_B = TRACE_ID(TRACE_GROUP_MQTT, 2), /* message type, bytes */
+  TRACE_MQTT_DELIVER_E = TRACE_ID(TRACE_GROUP_MQTT, 3),
+  TRACE_GC_STEP_B     = TRACE_ID(TRACE_GROUP_GC, 0),    /* gc state, bytes in use */
+  TRACE_GC_STEP_E     = TRACE_ID(TRACE_GROUP_GC, 1),
+  TRACE_GC_FULL_B     = TRACE_ID(TRACE_GROUP_GC, 2),
+  TRACE_GC_FULL_E     = TRACE_ID(TRACE_GROUP_GC, 3),
+  TRACE_VFS_READ_B    = TRACE_ID(TRACE_GROUP_VFS, 0),   /* fd, bytes asked for */
+  TRACE_VFS_READ_E    = TRACE_ID(TRACE_GROUP_VFS, 1),   /* fd, result */
+  TRACE_VFS_WRITE_B   = TRACE_ID(TRACE_GROUP_VFS, 2),
+  TRACE_VFS_WRITE_E   = TRACE_ID(TRACE_GROUP_VFS, 3),
+  TRACE_LUA_MARK      = TRACE_ID(TRACE_GROUP_LUA, 0),   /* trace.mark(a, b) */
+  TRACE_LUA_B         = TRACE_ID(TRACE_GROUP_LUA, 1),   /* trace.enter(a, b) */
+  TRACE_LUA_E         = TRACE_ID(TRACE_GROUP_LUA, 2),
+};
+
+typedef struct {
+  uint32_t cycles;
+  uint8_t id;
+  uint8_t core;
+  uint16_t turn;        /* low bits of the pass over the ring it was written in */
+  uint32_t a, b;
+} trace_record_t;
+
+/* Groups being traced, a bit each; 0 when tracing is off */
+extern volatile uint32_t trace_groups;
+
+#ifdef CONFIG_TRACE_ENABLE
+
+void trace_record(uint8_t id, uint32_t a, uint32_t b);
+
+#define TRACE(id, a, b) do { \
+    if (trace_groups & (1u << TRACE_GROUP(id))) \
+      trace_record((id), (uint32_t)(a), (uint32_t)(b)); \
+  } while (0)
+
+#else
+
+#define TRACE(id, a, b) ((void)sizeof(a), (void)sizeof(b))
+
+#endif
+
+/* Empty the ring and trace the groups set, a bit each.
+ * False if the ring can't be allocated, or there are no trace points. */
+bool trace_start(uint32_t groups);
+
+/* Records in the ring, and how many fell out of it since trace_start() */
+void trace_count(uint32_t *records, uint32_t *lost);
+
+/* Write the ring out as text, oldest record first, a line at a time, to
+ * out(), 0 terminated. Tracing must be stopped. The format is
+ *   TRACE <records> <lost> <cycles per us>
+ *   <us> <core> <B|E|i> <event> <a> <b>
+ *   TRACE end
+ * us counting from the first record; see tools/trace2chrome.py. Returns
+ * the records written. */
+uint32_t trace_dump(void (*out)(const char *line, size_t len, void *arg), void *arg);
+
+#endif /* _TRACE_H_ */
@@ -0,0 +1,281 @@
+// LZSS encoder and decoder, see lzss.h
+
+#include "lzss.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_MATCH   2
+#define OUT_SIZE    16      // output gathered before it goes to out()
+
+static const uint8_t magic[2] = { 'L', 'Z' };
+
+static bool sizes_ok(int window_bits, int lookahead_bits)
+{
+  return window_bits >= LZSS_MIN_WINDOW_BITS && window_bits <= LZSS_MAX_WINDOW_BITS &&
+         lookahead_bits >= 2 && lookahead_bits <= window_bits - 2;
+}
+
+/*
+ * Encoder
+ */
+
+struct lzss_enc {
+  uint8_t wbits, lbits;
+  bool open;                // the segment's header has gone out
+  uint8_t nbits;
+  uint32_t bits;            // output bits not yet a whole byte
+  uint16_t start;           // next byte of buf to code
+  uint16_t end;             // bytes in buf
+  uint8_t olen;
+  uint8_t obuf[OUT_SIZE];
+  uint8_t buf[];            // the window, then the input still to code
+};
+
+lzss_enc_t *lzss_enc_new(int window_bits, int lookahead_bits)
+{
+  if (!sizes_ok(window_bits, lookahead_bits))
+    return NULL;
+  lzss_enc_t *e = (lzss_enc_t *)calloc(1, sizeof(lzss_enc_t) + (2u << window_bits));
+  if (e) {
+    e->wbits = window_bits;
+    e->lbits = lookahead_bits;
+  }
+  return e;
+}
+
+void lzss_enc_free(lzss_enc_t *e)
+{
+  free(e);
+}
+
+bool lzss_enc_pending(const lzss_enc_t *e)
+{
+  return e->open;
+}
+
+static void out_flush(lzss_enc_t *e, lzss_out_fn out, void *arg)
+{
+  if (e->olen) {
+    out(arg, e->obuf, e->olen);
+    e->olen = 0;
+  }
+}
+
+static void put_bits(lzss_enc_t *e, uint32_t v, int n, lzss_out_fn out, void *arg)
+{
+  e->bits = e->bits << n | v;
+  e->nbits += n;
+  while (e->nbits >= 8) {
+    e->nbits -= 8;
+    e->obuf[e->olen++] = e->bits >> e->nbits;
+    if (e->olen == OUT_SIZE)
+      out_flush(e, out, arg);
+  }
+}
+
+// Longest earlier match for the bytes at start, of at most limit bytes
+static uint32_t longest_match(const lzss_enc_t *e, uint32_t limit, uint32_t *dist)
+{
+  const uint8_t *p = e->buf + e->start;
+  uint32_t best = 0, maxdist = (1u << e->wbits) - 1;
+
+  if (maxdist > e->start)
+    maxdist = e->start;
+  for (uint32_t d = 1; d <= maxdist; d++) {
+    const uint8_t *q = p - d;
+    if (q[0] != p[0] || q[1] != p[1] || q[best] != p[best])
+      continue;
+    uint32_t len = 2;
+    while (len < limit && q[len] == p[len])
+      len++;
+    if (len > best) {
+      best = len;
+      *dist = d;
+      if (len == limit)
+        break;
+    }
+  }
+  return best;
+}
+
+static void code_input(lzss_enc_t *e, bool all, lzss_out_fn out, void *arg)
+{
+  uint32_t max_len = (1u << e->lbits) + MIN_MATCH - 1;
+
+  while (e->start < e->end) {
+    uint32_t avail = e->end - e->start, len = 0, dist = 0;
+    if (!all && avail < max_len)
+      break;
+    if (avail >= MIN_MATCH)
+      len = longest_match(e, avail < max_len ? avail : max_len, &dist);
+    if (len >= MIN_MATCH) {
+      put_bits(e, dist << e->lbits | (len - MIN_MATCH), 1 + e->wbits + e->lbits, out, arg);
+      e->start += len;
+    } else {
+      put_bits(e, 0x100 | e->buf[e->start], 9, out, arg);
+      e->start++;
+    }
+  }
+}
+
+void lzss_enc_write(lzss_enc_t *e, const void *data, size_t len, bool finish,
+                    lzss_out_fn out, void *arg)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  uint32_t w = 1u << e->wbits;
+
+  if (!e->open && (len || !finish)) {
+    put_bits(e, magic[0], 8, out, arg);
+    put_bits(e, magic[1], 8, out, arg);
+    put_bits(e, e->wbits << 4 | e->lbits, 8, out, arg);
+    e->open = true;
+  }
+  while (len) {
+    if (e->end == 2 * w) {
+      // keep the newer half as the window
+      memcpy(e->buf, e->buf + w, w);
+      e->start -= w;
+      e->end -= w;
+    }
+    size_t n = 2 * w - e->end;
+    if (n > len)
+      n = len;
+    memcpy(e->buf + e->end, p, n);
+    e->end += n;
+    p += n;
+    len -= n;
+    code_input(e, false, out, arg);
+  }
+  if (finish && e->open) {
+    code_input(e, true, out, arg);
+    put_bits(e, 0, 1 + e->wbits + e->lbits, out, arg);
+    if (e->nbits)
+      put_bits(e, 0, 8 - e->nbits, out, arg);
+    e->open = false;
+    e->start = e->end = 0;
+  }
+  out_flush(e, out, arg);
+}
+
+/*
+ * Decoder
+ */
+
+enum { D_HEADER, D_TAG, D_LITERAL, D_REF, D_COPY, D_ERROR };
+
+struct lzss_dec {
+  uint8_t *win;
+  uint16_t wsize;           // allocated
+  uint8_t wbits, lbits;
+  uint8_t state;
+  uint8_t nhdr;
+  uint8_t hdr[LZSS_HEADER_SIZE];
+  uint8_t nbits;
+  uint32_t bits;            // input bits not yet used
+  uint16_t pos;             // next byte of win to fill
+  uint16_t dist, count;     // of the copy under way
+};
+
+lzss_dec_t *lzss_dec_new(void)
+{
+  return (lzss_dec_t *)calloc(1, sizeof(lzss_dec_t));
+}
+
+void lzss_dec_free(lzss_dec_t *d)
+{
+  if (d) {
+    free(d->win);
+    free(d);
+  }
+}
+
+// n bits of input, or -1 if the input ran out first
+static int32_t get_bits(lzss_dec_t *d, int n, const uint8_t **in, size_t *in_len)
+{
+  while (d->nbits < n) {
+    if (*in_len == 0)
+      return -1;
+    d->bits = d->bits << 8 | *(*in)++;
+    (*in_len)--;
+    d->nbits += 8;
+  }
+  d->nbits -= n;
+  return (d->bits >> d->nbits) & ((1u << n) - 1);
+}
+
+static bool start_segment(lzss_dec_t *d)
+{
+  int wbits = d->hdr[2] >> 4, lbits = d->hdr[2] & 15;
+  if (memcmp(d->hdr, magic, 2) || !sizes_ok(wbits, lbits))
+    return false;
+  if (d->wsize < (1u << wbits)) {
+    free(d->win);
+    d->win = (uint8_t *)calloc(1, 1u << wbits);
+    d->wsize = d->win ? 1u << wbits : 0;
+    if (!d->win)
+      return false;
+  }
+  d->wbits = wbits;
+  d->lbits = lbits;
+  d->pos = 0;
+  return true;
+}
+
+int lzss_dec_read(lzss_dec_t *d, const uint8_t **in, size_t *in_len,
+                  uint8_t *out, size_t out_len)
+{
+  size_t n = 0;
+  int32_t v;
+
+  while (n < out_len) {
+    uint32_t mask = (1u << d->wbits) - 1;
+    switch (d->state) {
+    case D_HEADER:
+      if ((v = get_bits(d, 8, in, in_len)) < 0)
+        return n;
+      d->hdr[d->nhdr++] = v;
+      if (d->nhdr == LZSS_HEADER_SIZE) {
+        d->nhdr = 0;
+        d->state = start_segment(d) ? D_TAG : D_ERROR;
+      }
+      break;
+    case D_TAG:
+      if ((v = get_bits(d, 1, in, in_len)) < 0)
+        return n;
+      d->state = v ? D_LITERAL : D_REF;
+      break;
+    case D_LITERAL:
+      if ((v = get_bits(d, 8, in, in_len)) < 0)
+        return n;
+      out[n++] = d->win[d->pos] = v;
+      d->pos = (d->pos + 1) & mask;
+      d->state = D_TAG;
+      break;
+    case D_REF:
+      if ((v = get_bits(d, d->wbits + d->lbits, in, in_len)) < 0)
+        return n;
+      d->dist = v >> d->lbits;
+      d->count = (v & ((1u << d->lbits) - 1)) + MIN_MATCH;
+      if (d->dist == 0) {
+        // the end of the segment: the rest of this byte is padding
+        d->nbits = 0;
+        d->state = D_HEADER;
+      } else {
+        d->state = D_COPY;
+      }
+      break;
+    case D_COPY:
+      while (d->count && n < out_len) {
+        out[n++] = d->win[d->pos] = d->win[(d->pos - d->dist) & mask];
+        d->pos = (d->pos + 1) & mask;
+        d->count--;
+      }
+      if (d->count == 0)
+        d->state = D_TAG;
+      break;
+    default:
+      return -1;
+    }
+  }
+  return n;
+}
@@ -0,0 +1,152 @@
+// Hierarchical timer wheel, see timer_wheel.h
+
+#include "timer_wheel.h"
+#include <string.h>
+
+#define MASK (TIMER_WHEEL_SLOTS - 1)
+#define SPAN(level) (1UL << ((level) * TIMER_WHEEL_BITS))
+
+void timer_wheel_init(timer_wheel_t *w, uint32_t now)
+{
+  memset(w, 0, sizeof(*w));
+  w->time = now;
+}
+
+void timer_wheel_add(timer_wheel_t *w, timer_wheel_node_t *n, uint32_t expires)
+{
+  uint32_t delta = expires - w->time;
+  uint32_t at = expires;
+  timer_wheel_node_t **head;
+  int level;
+  unsigned slot = 0;
+
+  if ((int32_t)delta < 0) {
+    // Time has been past it, only the next advance can take it out
+    level = TIMER_WHEEL_LEVELS;
+    head = &w->late;
+  } else {
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++)
+      if (delta < SPAN(level + 1))
+        break;
+    if (delta >= SPAN(TIMER_WHEEL_LEVELS))
+      at = w->time + SPAN(TIMER_WHEEL_LEVELS) - 1;
+    slot = (at >> (level * TIMER_WHEEL_BITS)) & MASK;
+    head = &w->slots[level][slot];
+    w->occupied[level] |= 1ULL << slot;
+  }
+
+  n->expires = expires;
+  n->level = level;
+  n->slot = slot;
+  n->next = *head;
+  if (n->next)
+    n->next->pprev = &n->next;
+  n->pprev = head;
+  *head = n;
+  w->count++;
+}
+
+void timer_wheel_remove(timer_wheel_t *w, timer_wheel_node_t *n)
+{
+  if (!n->pprev)
+    return;
+  *n->pprev = n->next;
+  if (n->next)
+    n->next->pprev = n->pprev;
+  if (n->level < TIMER_WHEEL_LEVELS && !w->slots[n->level][n->slot])
+    w->occupied[n->level] &= ~(1ULL << n->slot);
+  n->pprev = 0;
+  n->next = 0;
+  w->count--;
+}
+
+// Take a whole list out of the wheel
+static timer_wheel_node_t *timer_wheel_detach(timer_wheel_t *w, timer_wheel_node_t **head)
+{
+  timer_wheel_node_t *list = *head;
+  timer_wheel_node_t *n;
+
+  *head = 0;
+  for (n = list; n; n = n->next) {
+    n->pprev = 0;
+    w->count--;
+  }
+  return list;
+}
+
+static timer_wheel_node_t *timer_wheel_take(timer_wheel_t *w, int level, unsigned slot)
+{
+  w->occupied[level] &= ~(1ULL << slot);
+  return timer_wheel_detach(w, &w->slots[level][slot]);
+}
+
+// Spread a slot out over the levels below
+static void timer_wheel_cascade(timer_wheel_t *w, int level, unsigned slot)
+{
+  timer_wheel_node_t *n = timer_wheel_take(w, level, slot);
+
+  while (n) {
+    timer_wheel_node_t *next = n->next;
+    timer_wheel_add(w, n, n->expires);
+    n = next;
+  }
+}
+
+timer_wheel_node_t *timer_wheel_advance(timer_wheel_t *w, uint32_t now)
+{
+  timer_wheel_node_t *due = timer_wheel_detach(w, &w->late), **tail = &due;
+
+  while (*tail)
+    tail = &(*tail)->next;
+  while ((int32_t)(now - w->time) >= 0) {
+    unsigned idx = w->time & MASK;
+
+    if (idx == 0) {
+      int level;
+      for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        unsigned slot = (w->time >> (level * TIMER_WHEEL_BITS)) & MASK;
+        timer_wheel_cascade(w, level, slot);
+        if (slot)
+          break;
+      }
+    }
+
+    if (w->occupied[0] & (1ULL << idx)) {
+      *tail = timer_wheel_take(w, 0, idx);
+      while (*tail)
+        tail = &(*tail)->next;
+    }
+
+    // Straight on to the next slot with something in it, or the end of
+    // the turn, where the next cascade is
+    uint64_t rest = (idx == MASK) ? 0 : w->occupied[0] >> (idx + 1);
+    uint32_t step = rest ? __builtin_ctzll(rest) + 1 : TIMER_WHEEL_SLOTS - idx;
+    if (step > now - w->time) {
+      w->time = now + 1;
+      break;
+    }
+    w->time += step;
+  }
+  return due;
+}
+
+int32_t timer_wheel_next(const timer_wheel_t *w, uint32_t now)
+{
+  if (!w->count)
+    return -1;
+  if (w->late)
+    return 0;
+
+  unsigned idx = w->time & MASK;
+  uint64_t rest = w->occupied[0] >> idx;
+  uint32_t step = rest ? __builtin_ctzll(rest) : TIMER_WHEEL_SLOTS - idx;
+  int level;
+
+  // At the start of a turn, its cascade comes first
+  if (idx == 0)
+    for (level = 1; level < TIMER_WHEEL_LEVELS; level++)
+      if (w->occupied[level])
+        step = 0;
+  int32_t ticks = (int32_t)(w->time + step - now);
+  return ticks < 0 ? 0 : ticks;
+}
@@ -0,0 +1,178 @@
+// TLS session cache, see tls_session.h
+
+#include "tls_session.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_attr.h"
+#include "sdkconfig.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define TLS_SESSION_MAGIC 0x544c5331      // "TLS1"
+
+/*
+ * What resuming needs of an mbedtls_ssl_session, without its pointers. The
+ * server certificate isn't kept, a resumed session doesn't show it again.
+ */
+typedef struct {
+  uint32_t key;             // hash of host and port, 0 if free
+  uint32_t used;            // age, for eviction
+  int32_t ciphersuite;
+  int32_t compression;
+  uint32_t verify_result;
+  uint32_t ticket_lifetime;
+  uint8_t id_len;
+  uint8_t mfl_code;
+  uint8_t trunc_hmac;
+  uint8_t encrypt_then_mac;
+  uint16_t ticket_len;
+  uint8_t id[32];
+  uint8_t master[48];
+  uint8_t ticket[CONFIG_TLS_SESSION_TICKET_MAX];
+} tls_saved_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t clock;
+  tls_saved_t saved[CONFIG_TLS_SESSION_CACHE];
+} tls_cache_t;
+
+#if CONFIG_TLS_SESSION_RTC
+static RTC_DATA_ATTR tls_cache_t cache;
+#else
+static tls_cache_t cache;
+#endif
+static portMUX_TYPE cache_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static uint32_t session_key(const char *host, uint16_t port)
+{
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (; *host; host++)
+    h = (h ^ (uint8_t)*host) * 16777619u;
+  h = (h ^ (port & 0xff)) * 16777619u;
+  h = (h ^ (port >> 8)) * 16777619u;
+  return h ? h : 1;
+}
+
+// With cache_mux held
+static tls_saved_t *session_find(uint32_t key)
+{
+  if (cache.magic != TLS_SESSION_MAGIC) {
+    memset(&cache, 0, sizeof(cache));
+    cache.magic = TLS_SESSION_MAGIC;
+  }
+  for (int i = 0; i < CONFIG_TLS_SESSION_CACHE; i++)
+    if (cache.saved[i].key == key)
+      return &cache.saved[i];
+  return NULL;
+}
+
+bool tls_session_load(mbedtls_ssl_context *ssl, const char *host, uint16_t port)
+{
+  uint32_t key = session_key(host, port);
+  tls_saved_t s;
+  bool found = false;
+
+  // copied out, mbedtls allocates and mustn't do it in here
+  portENTER_CRITICAL(&cache_mux);
+  tls_saved_t *p = session_find(key);
+  if (p) {
+    p->used = ++cache.clock;
+    s = *p;
+    found = true;
+  }
+  portEXIT_CRITICAL(&cache_mux);
+  if (!found)
+    return false;
+
+  mbedtls_ssl_session session;
+  mbedtls_ssl_session_init(&session);
+  session.ciphersuite = s.ciphersuite;
+  session.compression = s.compression;
+  session.verify_result = s.verify_result;
+  session.id_len = s.id_len;
+  memcpy(session.id, s.id, sizeof(s.id));
+  memcpy(session.master, s.master, sizeof(s.master));
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+  session.mfl_code = s.mfl_code;
+#endif
+#if defined(MBEDTLS_SSL_TRUNCATED_HMAC)
+  session.trunc_hmac = s.trunc_hmac;
+#endif
+#if defined(MBEDTLS_SSL_ENCRYPT_THEN_MAC)
+  session.encrypt_then_mac = s.encrypt_then_mac;
+#endif
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+  // set_session copies it, and session_free frees this one
+  if (s.ticket_len && (session.ticket = malloc(s.ticket_len)) != NULL) {
+    memcpy(session.ticket, s.ticket, s.ticket_len);
+    session.ticket_len = s.ticket_len;
+    session.ticket_lifetime = s.ticket_lifetime;
+  }
+#endif
+  bool ok = mbedtls_ssl_set_session(ssl, &session) == 0;
+  mbedtls_ssl_session_free(&session);
+  return ok;
+}
+
+void tls_session_save(mbedtls_ssl_context *ssl, const char *host, uint16_t port)
+{
+  mbedtls_ssl_session session;
+  tls_saved_t s;
+
+  mbedtls_ssl_session_init(&session);
+  if (mbedtls_ssl_get_session(ssl, &session) != 0) {
+    mbedtls_ssl_session_free(&session);
+    return;
+  }
+  memset(&s, 0, sizeof(s));
+  s.key = session_key(host, port);
+  s.ciphersuite = session.ciphersuite;
+  s.compression = session.compression;
+  s.verify_result = session.verify_result;
+  s.id_len = session.id_len;
+  memcpy(s.id, session.id, sizeof(s.id));
+  memcpy(s.master, session.master, sizeof(s.master));
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+  s.mfl_code = session.mfl_code;
+#endif
+#if defined(MBEDTLS_SSL_TRUNCATED_HMAC)
+  s.trunc_hmac = session.trunc_hmac;
+#endif
+#if defined(MBEDTLS_SSL_ENCRYPT_THEN_MAC)
+  s.encrypt_then_mac = session.encrypt_then_mac;
+#endif
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+  // one too big to keep leaves the session ID to resume by
+  if (session.ticket && session.ticket_len <= sizeof(s.ticket)) {
+    memcpy(s.ticket, session.ticket, session.ticket_len);
+    s.ticket_len = session.ticket_len;
+    s.ticket_lifetime = session.ticket_lifetime;
+  }
+#endif
+  mbedtls_ssl_session_free(&session);
+  if (s.id_len == 0 && s.ticket_len == 0)
+    return;                   // nothing to resume by
+
+  portENTER_CRITICAL(&cache_mux);
+  tls_saved_t *p = session_find(s.key);
+  if (p == NULL) {
+    p = &cache.saved[0];
+    for (int i = 1; i < CONFIG_TLS_SESSION_CACHE; i++)
+      if (cache.saved[i].used < p->used)
+        p = &cache.saved[i];
+  }
+  s.used = ++cache.clock;
+  *p = s;
+  portEXIT_CRITICAL(&cache_mux);
+}
+
+void tls_session_forget(const char *host, uint16_t port)
+{
+  uint32_t key = session_key(host, port);
+  portENTER_CRITICAL(&cache_mux);
+  tls_saved_t *p = session_find(key);
+  if (p)
+    memset(p, 0, sizeof(*p));
+  portEXIT_CRITICAL(&cache_mux);
+}
@@ -0,0 +1,207 @@
+// MQTT topic filter trie, see topic_trie.h
+
+#include "topic_trie.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const char *level_end(const char *s, const char *end)
+{
+  const char *e = memchr(s, '/', end - s);
+  return e ? e : end;
+}
+
+static bool is_wild(const char *s, size_t len, char c)
+{
+  return len == 1 && s[0] == c;
+}
+
+// Where the node for this level below n is, or would go
+static topic_trie_node_t **node_slot(topic_trie_node_t *n, const char *s, size_t len)
+{
+  if (is_wild(s, len, '+'))
+    return &n->plus;
+  if (is_wild(s, len, '#'))
+    return &n->hash;
+  topic_trie_node_t **p = &n->child;
+  while (*p && !((*p)->len == len && memcmp((*p)->level, s, len) == 0))
+    p = &(*p)->next;
+  return p;
+}
+
+static topic_trie_node_t *node_new(const char *s, size_t len)
+{
+  topic_trie_node_t *n = (topic_trie_node_t *)calloc(1, sizeof(*n) + len);
+  if (n) {
+    n->len = len;
+    memcpy(n->level, s, len);
+  }
+  return n;
+}
+
+static bool node_empty(const topic_trie_node_t *n)
+{
+  return !n->set && !n->child && !n->plus && !n->hash;
+}
+
+void topic_trie_init(topic_trie_t *t)
+{
+  memset(t, 0, sizeof(*t));
+}
+
+bool topic_trie_valid(const char *filter)
+{
+  const char *s = filter, *end = filter + strlen(filter);
+  if (s == end)
+    return false;
+  for (;;) {
+    const char *e = level_end(s, end);
+    size_t len = e - s;
+    if (len > UINT16_MAX)
+      return false;
+    if (is_wild(s, len, '#'))
+      return e == end;
+    if (!is_wild(s, len, '+') && (memchr(s, '+', len) || memchr(s, '#', len)))
+      return false;
+    if (e == end)
+      return true;
+    s = e + 1;
+  }
+}
+
+int topic_trie_insert(topic_trie_t *t, const char *filter, int value, int *old)
+{
+  if (!topic_trie_valid(filter))
+    return -1;
+  if (!t->root && !(t->root = node_new("", 0)))
+    return -2;
+
+  const char *s = filter, *end = filter + strlen(filter);
+  topic_trie_node_t *n = t->root;
+  for (;;) {
+    const char *e = level_end(s, end);
+    topic_trie_node_t **p = node_slot(n, s, e - s);
+    // Nodes made for a filter that runs out of memory halfway stay
+    // behind empty, and go once something is removed below them
+    if (!*p && !(*p = node_new(s, e - s)))
+      return -2;
+    n = *p;
+    if (e == end)
+      break;
+    s = e + 1;
+  }
+  if (n->set) {
+    if (old)
+      *old = n->value;
+    n->value = value;
+    return 1;
+  }
+  n->value = value;
+  n->set = true;
+  t->count++;
+  return 0;
+}
+
+static bool node_remove(topic_trie_t *t, topic_trie_node_t *n, const char *s,
+                        const char *end, int *old)
+{
+  const char *e = level_end(s, end);
+  topic_trie_node_t **p = node_slot(n, s, e - s);
+  topic_trie_node_t *c = *p;
+  bool found;
+
+  if (!c)
+    return false;
+  if (e == end) {
+    found = c->set;
+    if (found) {
+      if (old)
+        *old = c->value;
+      c->set = false;
+      t->count--;
+    }
+  } else {
+    found = node_remove(t, c, e + 1, end, old);
+  }
+  if (node_empty(c)) {
+    *p = c->next;
+    free(c);
+  }
+  return found;
+}
+
+bool topic_trie_remove(topic_trie_t *t, const char *filter, int *old)
+{
+  if (!t->root || !*filter)
+    return false;
+  return node_remove(t, t->root, filter, filter + strlen(filter), old);
+}
+
+static int node_report(const topic_trie_node_t *n, topic_trie_fn fn, void *arg)
+{
+  if (!n || !n->set)
+    return 0;
+  fn(n->value, arg);
+  return 1;
+}
+
+static int node_match(const topic_trie_node_t *n, const char *s, const char *end,
+                      bool wild, topic_trie_fn fn, void *arg);
+
+// c matched the level ending at e
+static int node_match_below(const topic_trie_node_t *c, const char *e, const char *end,
+                            topic_trie_fn fn, void *arg)
+{
+  if (!c)
+    return 0;
+  if (e == end)
+    // "a/#" matches "a" too
+    return node_report(c, fn, arg) + node_report(c->hash, fn, arg);
+  return node_match(c, e + 1, end, true, fn, arg);
+}
+
+static int node_match(const topic_trie_node_t *n, const char *s, const char *end,
+                      bool wild, topic_trie_fn fn, void *arg)
+{
+  const char *e = level_end(s, end);
+  size_t len = e - s;
+  int found = 0;
+
+  const topic_trie_node_t *c = n->child;
+  while (c && !(c->len == len && memcmp(c->level, s, len) == 0))
+    c = c->next;
+  found += node_match_below(c, e, end, fn, arg);
+  if (wild) {
+    found += node_match_below(n->plus, e, end, fn, arg);
+    // "#" takes this level and everything after it
+    found += node_report(n->hash, fn, arg);
+  }
+  return found;
+}
+
+int topic_trie_match(const topic_trie_t *t, const char *topic, size_t len,
+                     topic_trie_fn fn, void *arg)
+{
+  if (!t->root || t->count == 0)
+    return 0;
+  return node_match(t->root, topic, topic + len, !(len && topic[0] == '$'), fn, arg);
+}
+
+static void node_free(topic_trie_node_t *n, topic_trie_fn fn, void *arg)
+{
+  while (n) {
+    topic_trie_node_t *next = n->next;
+    if (n->set && fn)
+      fn(n->value, arg);
+    node_free(n->child, fn, arg);
+    node_free(n->plus, fn, arg);
+    node_free(n->hash, fn, arg);
+    free(n);
+    n = next;
+  }
+}
+
+void topic_trie_clear(topic_trie_t *t, topic_trie_fn fn, void *arg)
+{
+  node_free(t->root, fn, arg);
+  topic_trie_init(t);
+}
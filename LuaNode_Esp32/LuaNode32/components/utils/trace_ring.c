@@ -0,0 +1,164 @@
+// Trace ring, see trace.h
+
+#include "trace.h"
+#include "freertos/FreeRTOS.h"
+#include "xtensa/hal.h"
+#include "rom/ets_sys.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+volatile uint32_t trace_groups;
+
+static trace_record_t *ring;
+static uint32_t ring_mask;
+static volatile uint32_t ring_head;   // slots ever claimed
+static uint32_t ring_bits;
+
+static const struct {
+  uint8_t id;
+  char phase;
+  const char *name;
+} trace_names[] = {
+  { TRACE_TASK_POST,      'i', "task.post" },
+  { TRACE_TASK_RUN_B,     'B', "task.run" },
+  { TRACE_TASK_RUN_E,     'E', "task.run" },
+  { TRACE_NET_EVENT_B,    'B', "net.event" },
+  { TRACE_NET_EVENT_E,    'E', "net.event" },
+  { TRACE_NET_RECV,       'i', "net.recv" },
+  { TRACE_NET_WRITE,      'i', "net.write" },
+  { TRACE_TMR_B,          'B', "tmr.alarm" },
+  { TRACE_TMR_E,          'E', "tmr.alarm" },
+  { TRACE_MQTT_SEND,      'i', "mqtt.send" },
+  { TRACE_MQTT_RECV,      'i', "mqtt.recv" },
+  { TRACE_MQTT_DELIVER_B, 'B', "mqtt.deliver" },
+  { TRACE_MQTT_DELIVER_E, 'E', "mqtt.deliver" },
+  { TRACE_GC_STEP_B,      'B', "gc.step" },
+  { TRACE_GC_STEP_E,      'E', "gc.step" },
+  { TRACE_GC_FULL_B,      'B', "gc.full" },
+  { TRACE_GC_FULL_E,      'E', "gc.full" },
+  { TRACE_VFS_READ_B,     'B', "vfs.read" },
+  { TRACE_VFS_READ_E,     'E', "vfs.read" },
+  { TRACE_VFS_WRITE_B,    'B', "vfs.write" },
+  { TRACE_VFS_WRITE_E,    'E', "vfs.write" },
+  { TRACE_LUA_MARK,       'i', "lua.mark" },
+  { TRACE_LUA_B,          'B', "lua" },
+  { TRACE_LUA_E,          'E', "lua" },
+};
+
+#ifdef CONFIG_TRACE_ENABLE
+void trace_record(uint8_t id, uint32_t a, uint32_t b)
+{
+  uint32_t cycles = xthal_get_ccount();
+  uint32_t n, set;
+  do {
+    n = ring_head;
+    set = n + 1;
+    uxPortCompareSet(&ring_head, n, &set);
+  } while (set != n);
+
+  trace_record_t *r = &ring[n & ring_mask];
+  r->cycles = cycles;
+  r->id = id;
+  r->core = xPortGetCoreID();
+  r->a = a;
+  r->b = b;
+  // the turn goes in last, so a dump can tell a slot still being written
+  __sync_synchronize();
+  r->turn = (uint16_t)(n >> ring_bits);
+}
+#endif
+
+bool trace_start(uint32_t groups)
+{
+  trace_groups = 0;
+#ifndef CONFIG_TRACE_ENABLE
+  return false;
+#else
+  if (!ring) {
+    uint32_t size = 1;
+    while (size < CONFIG_TRACE_RECORDS)
+      size <<= 1;
+    ring = (trace_record_t *)malloc(size * sizeof(trace_record_t));
+    if (!ring)
+      return false;
+    ring_mask = size - 1;
+    while ((1u << ring_bits) < size)
+      ring_bits++;
+  }
+  // no slot of the first turn may look written already
+  memset(ring, 0xff, (ring_mask + 1) * sizeof(trace_record_t));
+  ring_head = 0;
+  trace_groups = groups;
+  return true;
+#endif
+}
+
+void trace_count(uint32_t *records, uint32_t *lost)
+{
+  uint32_t n = ring_head;
+  *records = n > ring_mask ? ring_mask + 1 : n;
+  *lost = n - *records;
+}
+
+static const char *event_name(uint8_t id, char *phase)
+{
+  for (int i = 0; i < sizeof(trace_names) / sizeof(trace_names[0]); i++) {
+    if (trace_names[i].id == id) {
+      *phase = trace_names[i].phase;
+      return trace_names[i].name;
+    }
+  }
+  *phase = 'i';
+  return "?";
+}
+
+uint32_t trace_dump(void (*out)(const char *line, size_t len, void *arg), void *arg)
+{
+  char line[96];
+  uint32_t records, lost, done = 0;
+  uint32_t mhz = ets_get_cpu_frequency();
+  if (!mhz)
+    mhz = 1;    // the host counts in us
+
+  if (!ring)
+    records = lost = 0;
+  else
+    trace_count(&records, &lost);
+  int len = snprintf(line, sizeof(line), "TRACE %u %u %u\n",
+                     (unsigned)records, (unsigned)lost, (unsigned)mhz);
+  out(line, len, arg);
+
+  // Cycle counters wrap every 2^32 cycles and differ a little between the
+  // cores. Time is carried forward from record to record: backwards only
+  // when the core changed, and a gap of more than a wrap on one core is
+  // taken for less.
+  int64_t t = 0;
+  uint32_t prev_cycles = 0;
+  uint8_t prev_core = 0;
+  for (uint32_t n = ring_head - records; n != ring_head; n++) {
+    trace_record_t *r = &ring[n & ring_mask];
+    if (r->turn != (uint16_t)(n >> ring_bits))
+      continue;   // claimed as tracing stopped, never finished
+    if (done) {
+      uint32_t delta = r->cycles - prev_cycles;
+      if (r->core != prev_core && (int32_t)delta < 0)
+        t += (int32_t)delta;
+      else
+        t += delta;
+    }
+    prev_cycles = r->cycles;
+    prev_core = r->core;
+
+    char phase;
+    const char *name = event_name(r->id, &phase);
+    uint64_t at = t < 0 ? -t : t;
+    len = snprintf(line, sizeof(line), "%s%u.%03u %u %c %s %u %u\n", t < 0 ? "-" : "",
+                   (unsigned)(at / mhz), (unsigned)(at % mhz * 1000 / mhz),
+                   r->core, phase, name, (unsigned)r->a, (unsigned)r->b);
+    out(line, len, arg);
+    done++;
+  }
+  out("TRACE end\n", 10, arg);
+  return done;
+}
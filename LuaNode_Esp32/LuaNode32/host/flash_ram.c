@@ -0,0 +1,109 @@
+// Flash in RAM, for SPIFFS on the host
+//
+// A chip holding nothing but the SPIFFS partition, with NOR semantics:
+// erasing sets a sector to 0xff and writing can only clear bits, so the
+// file system does the same work it does on the board.
+
+#include "platform.h"
+#include "platform_partition.h"
+#include "flash_api.h"
+#include "lc_store.h"
+#include "port.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The size of the spiffs partition in partitions-LuaNode.csv
+#define FLASH_RAM_DEFAULT (448 * 1024)
+
+static uint8_t *flash;
+static uint32_t flash_size;
+
+bool flash_ram_init( uint32_t size )
+{
+  if (size == 0)
+    size = FLASH_RAM_DEFAULT;
+  size = (size + INTERNAL_FLASH_SECTOR_SIZE - 1) & ~(INTERNAL_FLASH_SECTOR_SIZE - 1);
+  free( flash );
+  flash = (uint8_t *)malloc( size );
+  if (!flash)
+    return false;
+  memset( flash, 0xff, size );
+  flash_size = size;
+  return true;
+}
+
+static bool in_flash( uint32_t addr, uint32_t size )
+{
+  return addr <= flash_size && size <= flash_size - addr;
+}
+
+uint32_t platform_flash_read( void *to, uint32_t fromaddr, uint32_t size )
+{
+  if (!in_flash( fromaddr, size ))
+    return 0;
+  memcpy( to, flash + fromaddr, size );
+  return size;
+}
+
+uint32_t platform_flash_write( const void *from, uint32_t toaddr, uint32_t size )
+{
+  if (!in_flash( toaddr, size ))
+    return 0;
+  const uint8_t *src = (const uint8_t *)from;
+  for (uint32_t i = 0; i < size; i++)
+    flash[toaddr + i] &= src[i];
+  return size;
+}
+
+uint32_t platform_flash_get_sector_of_address( uint32_t addr )
+{
+  return addr / INTERNAL_FLASH_SECTOR_SIZE;
+}
+
+uint32_t platform_flash_get_num_sectors( void )
+{
+  return flash_size / INTERNAL_FLASH_SECTOR_SIZE;
+}
+
+int platform_flash_erase_sector( uint32_t sector_id )
+{
+  if (sector_id >= platform_flash_get_num_sectors())
+    return PLATFORM_ERR;
+  memset( flash + sector_id * INTERNAL_FLASH_SECTOR_SIZE, 0xff, INTERNAL_FLASH_SECTOR_SIZE );
+  return PLATFORM_OK;
+}
+
+uint32_t flash_safe_get_size_byte( void )
+{
+  return flash_size;
+}
+
+uint16_t flash_safe_get_sec_num( void )
+{
+  return platform_flash_get_num_sectors();
+}
+
+bool platform_partition_info( uint8_t idx, platform_partition_t *info )
+{
+  if (idx != 0 || !flash)
+    return false;
+  memset( info, 0, sizeof(*info) );
+  strcpy( (char *)info->label, "spiffs" );
+  info->offs = 0;
+  info->size = flash_size;
+  info->type = PLATFORM_PARTITION_TYPE_NODEMCU;
+  info->subtype = PLATFORM_PARTITION_SUBTYPE_NODEMCU_SPIFFS;
+  return true;
+}
+
+bool platform_partition_add( const platform_partition_t *info )
+{
+  return false;
+}
+
+// No compiled chunk stores on the host, require() falls back to files
+const void *lc_store_get( int store, const char *name, uint32_t *size )
+{
+  return NULL;
+}
@@ -0,0 +1,7 @@
+#ifndef __c_stddef_h
+#define __c_stddef_h
+
+// The device header defines ptrdiff_t and size_t as 32-bit ints
+#include <stddef.h>
+
+#endif
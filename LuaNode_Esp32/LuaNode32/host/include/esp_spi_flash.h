@@ -0,0 +1,6 @@
+#ifndef __ESP_SPI_FLASH_H__
+#define __ESP_SPI_FLASH_H__
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+#endif
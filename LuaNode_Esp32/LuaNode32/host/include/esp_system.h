@@ -0,0 +1,12 @@
+#ifndef __ESP_SYSTEM_H__
+#define __ESP_SYSTEM_H__
+
+#include <stdint.h>
+
+// Microseconds since the program started, wrapping like the device clock
+uint32_t system_get_time(void);
+
+// There is no telling on the host, both are 0
+uint32_t system_get_free_heap_size(void);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef INC_FREERTOS_H
+#define INC_FREERTOS_H
+
+// Just enough FreeRTOS for the task layer, on one host thread; see port.c
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sdkconfig.h"
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE  0
+#define pdTRUE   1
+#define pdFAIL   pdFALSE
+#define pdPASS   pdTRUE
+
+#define portMAX_DELAY       ((TickType_t)0xffffffff)
+#define portNUM_PROCESSORS  1
+#define configTICK_RATE_HZ  CONFIG_FREERTOS_HZ
+
+// *addr = *set if *addr == compare; *set gets the old value either way
+void uxPortCompareSet(volatile uint32_t *addr, uint32_t compare, uint32_t *set);
+
+static inline uint32_t xPortGetCoreID(void) { return 0; }
+
+#endif
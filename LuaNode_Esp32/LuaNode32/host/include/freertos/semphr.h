@@ -0,0 +1,18 @@
+#ifndef SEMAPHORE_H
+#define SEMAPHORE_H
+
+#include "queue.h"
+
+typedef QueueHandle_t SemaphoreHandle_t;
+typedef SemaphoreHandle_t xSemaphoreHandle;
+
+// A binary semaphore is a queue of one empty item, as in FreeRTOS
+#define vSemaphoreCreateBinary(s) do { \
+    (s) = xQueueCreate(1, 0); \
+    if (s) xQueueSendToBack((s), NULL, 0); \
+  } while (0)
+#define xSemaphoreTake(s, wait) xQueueReceive((s), NULL, (wait))
+#define xSemaphoreGive(s) xQueueSendToBack((s), NULL, 0)
+#define xSemaphoreGiveFromISR(s, woken) xSemaphoreGive(s)
+
+#endif
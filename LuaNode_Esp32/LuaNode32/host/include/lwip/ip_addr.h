@@ -0,0 +1,7 @@
+#ifndef __LWIP_IP_ADDR_H__
+#define __LWIP_IP_ADDR_H__
+
+// Only for esp_misc.h; there is no network stack in the host build
+#include <stdint.h>
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef __MYGPIO_H__
+#define __MYGPIO_H__
+
+// No GPIO on the host; platform.h only wants the flash functions
+typedef int GPIO_INT_TYPE;
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef __PWM_H__
+#define __PWM_H__
+
+// No GPIO on the host; platform.h only wants the flash functions
+
+#endif
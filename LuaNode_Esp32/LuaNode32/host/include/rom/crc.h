@@ -0,0 +1,9 @@
+#ifndef __ROM_CRC_H__
+#define __ROM_CRC_H__
+
+#include <stdint.h>
+
+// The ROM routine, done in C in port.c
+uint32_t crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len);
+
+#endif
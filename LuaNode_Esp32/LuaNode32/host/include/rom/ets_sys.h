@@ -0,0 +1,11 @@
+#ifndef __ROM_ETS_SYS_H__
+#define __ROM_ETS_SYS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define ets_printf printf
+void ets_delay_us(uint32_t us);
+uint32_t ets_get_cpu_frequency(void);
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef __ROM_MINIZ_H__
+#define __ROM_MINIZ_H__
+
+// The ROM has miniz 1.15 built the way esptool's flasher stub builds it
+#include <miniz.h>   // from the -isystem path, see the Makefile
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef XTENSA_HAL_H
+#define XTENSA_HAL_H
+
+// The cycle counter, which counts microseconds here; see port.c
+
+unsigned xthal_get_ccount(void);
+
+#endif
@@ -0,0 +1,120 @@
+// The libraries of the host build, as components/modules/linit.c opens
+// them on the board, less the modules that need the hardware: the core at
+// start, the rest when first looked up. tmr has only now() and delay()
+// here, so benchmarks time themselves the same way.
+
+#define linit_c
+#define LUA_LIB
+
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+#include "lrotable.h"
+#include "lrodefs.h"
+#include "esp_system.h"
+#include "rom/ets_sys.h"
+#include <string.h>
+
+extern const LUA_REG_TYPE co_funcs[];
+extern const LUA_REG_TYPE file_map[];
+extern const LUA_REG_TYPE utils_map[];
+extern const LUA_REG_TYPE buffer_map[];
+extern const LUA_REG_TYPE cjson_map[];
+extern const LUA_REG_TYPE crc_map[];
+extern const LUA_REG_TYPE dsp_map[];
+extern const LUA_REG_TYPE zlib_map[];
+extern const LUA_REG_TYPE compress_map[];
+extern const LUA_REG_TYPE cache_map[];
+extern const LUA_REG_TYPE bench_map[];
+extern const LUA_REG_TYPE strlib[];
+extern const LUA_REG_TYPE tab_funcs[];
+
+// Lua: tmr.now() -- microseconds, wrapping
+static int tmr_now( lua_State *L )
+{
+  lua_pushinteger( L, system_get_time() & 0x7FFFFFFF );
+  return 1;
+}
+
+// Lua: tmr.delay(us)
+static int tmr_delay( lua_State *L )
+{
+  int us = luaL_checkinteger( L, 1 );
+  luaL_argcheck( L, us >= 0, 1, "wrong arg range" );
+  ets_delay_us( us );
+  return 0;
+}
+
+static const LUA_REG_TYPE tmr_map[] = {
+  { LSTRKEY( "now" ),   LFUNCVAL( tmr_now ) },
+  { LSTRKEY( "delay" ), LFUNCVAL( tmr_delay ) },
+  { LNILKEY, LNILVAL }
+};
+
+static int luaopen_tmr_host( lua_State *L )
+{
+  return 0;
+}
+
+static const luaL_Reg lua_core_libs[] = {
+  {"base", luaopen_base},
+  {"package", luaopen_package},
+  {"table", luaopen_table},
+  {"string", luaopen_string},
+  {LUA_LPEGLIBNAME, luaopen_lpeg},
+  {NULL, NULL},
+};
+
+static const luaL_Reg lua_libs[] = {
+  {LUA_FILELIBNAME, luaopen_file},
+  {LUA_TMRLIBNAME, luaopen_tmr_host},
+  {LUA_UTILSLIBNAME, luaopen_utils},
+  {LUA_BUFFERLIBNAME, luaopen_buffer},
+  {LUA_CJSONLIBNAME, luaopen_cjson},
+  {LUA_CRCLIBNAME, luaopen_crc},
+  {LUA_DSPLIBNAME, luaopen_dsp},
+  {LUA_ZLIBLIBNAME, luaopen_zlib},
+  {LUA_COMPRESSLIBNAME, luaopen_compress},
+  {LUA_CACHELIBNAME, luaopen_cache},
+  {LUA_BENCHLIBNAME, luaopen_bench},
+  {NULL, NULL},
+};
+
+const luaR_table lua_rotable[] = {
+  {LUA_TABLIBNAME, tab_funcs},
+  {LUA_STRLIBNAME, strlib},
+  {LUA_COLIBNAME, co_funcs},
+  {LUA_FILELIBNAME, file_map},
+  {LUA_TMRLIBNAME, tmr_map},
+  {LUA_UTILSLIBNAME, utils_map},
+  {LUA_BUFFERLIBNAME, buffer_map},
+  {LUA_CJSONLIBNAME, cjson_map},
+  {LUA_CRCLIBNAME, crc_map},
+  {LUA_DSPLIBNAME, dsp_map},
+  {LUA_ZLIBLIBNAME, zlib_map},
+  {LUA_COMPRESSLIBNAME, compress_map},
+  {LUA_CACHELIBNAME, cache_map},
+  {LUA_BENCHLIBNAME, bench_map},
+  {NULL, NULL}
+};
+
+void luaL_openlibs( lua_State *L )
+{
+  for (const luaL_Reg *lib = lua_core_libs; lib->name; lib++) {
+    lua_pushcfunction( L, lib->func );
+    lua_pushstring( L, lib->name );
+    lua_call( L, 1, 0 );
+  }
+}
+
+int luaL_openlazy( lua_State *L, const char *name )
+{
+  for (const luaL_Reg *lib = lua_libs; lib->name; lib++) {
+    if (!strcmp( lib->name, name )) {
+      lua_pushcfunction( L, lib->func );
+      lua_pushstring( L, lib->name );
+      return lua_pcall( L, 1, 0, 0 );
+    }
+  }
+  return 0;
+}
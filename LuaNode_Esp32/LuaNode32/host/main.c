@@ -0,0 +1,121 @@
+// luanode-host [-s kbytes] [-f file]... script.lua
+//
+// Boots the way app_main() does, minus the hardware: mounts SPIFFS on the
+// RAM flash (formatting it, as it always starts blank), copies in the -f
+// files, runs the script, then pumps the task queues until the Lua task
+// would wait for good. -s sets the size of the flash, 448K by default.
+
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+#include "vfs.h"
+#include "task/task.h"
+#include "port.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static lua_State *L;
+static int status;
+
+void host_idle( void )
+{
+  lua_close( L );
+  exit( status );
+}
+
+static char *read_file( const char *name, size_t *size )
+{
+  FILE *f = fopen( name, "rb" );
+  if (!f)
+    return NULL;
+  fseek( f, 0, SEEK_END );
+  long n = ftell( f );
+  fseek( f, 0, SEEK_SET );
+  char *buf = n >= 0 ? (char *)malloc( n + 1 ) : NULL;
+  if (buf && fread( buf, 1, n, f ) != (size_t)n) {
+    free( buf );
+    buf = NULL;
+  }
+  fclose( f );
+  *size = n;
+  return buf;
+}
+
+// Copy a host file into the file system, under its base name
+static bool copy_in( const char *name )
+{
+  size_t size;
+  char *buf = read_file( name, &size );
+  if (!buf)
+    return false;
+  const char *base = strrchr( name, '/' );
+  int fd = vfs_open( base ? base + 1 : name, "w" );
+  bool ok = fd && vfs_write( fd, buf, size ) == (int32_t)size;
+  if (fd)
+    vfs_close( fd );
+  free( buf );
+  return ok;
+}
+
+static void usage( const char *prog )
+{
+  fprintf( stderr, "usage: %s [-s kbytes] [-f file]... script.lua\n", prog );
+  exit( 2 );
+}
+
+int main( int argc, char **argv )
+{
+  uint32_t flash_kb = 0;
+  int i;
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (!strcmp( argv[i], "-s" ) && i + 1 < argc)
+      flash_kb = strtoul( argv[++i], NULL, 0 );
+    else if (!strcmp( argv[i], "-f" ) && i + 1 < argc)
+      ++i;   // once the file system is up
+    else
+      usage( argv[0] );
+  }
+  if (i != argc - 1)
+    usage( argv[0] );
+  const char *script = argv[i];
+
+  if (!flash_ram_init( flash_kb * 1024 )) {
+    fprintf( stderr, "no memory for the flash\n" );
+    return 1;
+  }
+  if (!vfs_mount( "/FLASH", 0 ) && !vfs_format()) {
+    fprintf( stderr, "unable to format the flash\n" );
+    return 1;
+  }
+  for (i = 1; i < argc - 1; i++) {
+    if (!strcmp( argv[i], "-f" ) && !copy_in( argv[++i] )) {
+      fprintf( stderr, "cannot copy %s to the flash\n", argv[i] );
+      return 1;
+    }
+    else if (!strcmp( argv[i], "-s" ))
+      ++i;
+  }
+
+  size_t size;
+  char *buf = read_file( script, &size );
+  if (!buf) {
+    fprintf( stderr, "cannot open %s\n", script );
+    return 1;
+  }
+
+  L = lua_open();
+  luaL_openlibs( L );
+  lua_pushfstring( L, "@%s", script );
+  if (luaL_loadbuffer( L, buf, size, lua_tostring( L, -1 ) ) ||
+      lua_pcall( L, 0, 0, 0 )) {
+    fprintf( stderr, "%s\n", lua_tostring( L, -1 ) );
+    lua_pop( L, 1 );
+    status = 1;
+  }
+  lua_pop( L, 1 );
+  free( buf );
+
+  task_pump_messages();
+  return status;
+}
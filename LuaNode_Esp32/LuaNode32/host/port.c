@@ -0,0 +1,238 @@
+// The SDK and FreeRTOS calls the host build needs, on one POSIX thread
+//
+// Queues are plain rings. There are no other tasks and no interrupts, so
+// a queue can only fill up while the Lua task waits on it if an os_timer
+// fires: a blocking receive runs the armed timers as they fall due, and
+// calls host_idle() once there are none left to wait for.
+
+#include "c_types.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "rom/crc.h"
+#include "rom/ets_sys.h"
+#include "xtensa/hal.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "port.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t now_us( void )
+{
+  static uint64_t start;
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  uint64_t us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  if (!start)
+    start = us - 1;
+  return us - start;
+}
+
+static void sleep_us( uint64_t us )
+{
+  struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+  while (nanosleep( &ts, &ts ) != 0)
+    ;
+}
+
+uint32_t system_get_time( void )
+{
+  return (uint32_t)now_us();
+}
+
+void ets_delay_us( uint32_t us )
+{
+  uint64_t end = now_us() + us;
+  while (now_us() < end)
+    ;
+}
+
+uint32_t system_get_free_heap_size( void )
+{
+  return 0;
+}
+
+uint32_t ets_get_cpu_frequency( void )
+{
+  return 0;
+}
+
+// With no clock rate to go by, a cycle is taken for a microsecond
+unsigned xthal_get_ccount( void )
+{
+  return (unsigned)now_us();
+}
+
+TickType_t xTaskGetTickCount( void )
+{
+  return (TickType_t)(now_us() / (1000000 / configTICK_RATE_HZ));
+}
+
+// Nothing else could run meanwhile, so this only passes the time
+void vTaskDelay( const TickType_t ticks )
+{
+  sleep_us( (uint64_t)ticks * (1000000 / configTICK_RATE_HZ) );
+}
+
+void uxPortCompareSet( volatile uint32_t *addr, uint32_t compare, uint32_t *set )
+{
+  *set = __sync_val_compare_and_swap( addr, compare, *set );
+}
+
+char *c_getenv( const char *name )
+{
+  return getenv( name );
+}
+
+// The zlib/Ethernet CRC-32, as the ROM computes it
+uint32_t crc32_le( uint32_t crc, const uint8_t *buf, uint32_t len )
+{
+  crc = ~crc;
+  while (len--) {
+    crc ^= *buf++;
+    for (int i = 0; i < 8; i++)
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+
+// ---------------------------------------------------------------------------
+// os_timer, run by whoever blocks on a queue
+//
+// Armed ones, unordered; timer_expire is in ms of system_get_time()
+static os_timer_t *timers;
+
+void os_timer_setfn( os_timer_t *t, os_timer_func_t *fn, void *arg )
+{
+  t->timer_func = fn;
+  t->timer_arg = arg;
+}
+
+void os_timer_disarm( os_timer_t *t )
+{
+  for (os_timer_t **p = &timers; *p; p = &(*p)->timer_next) {
+    if (*p == t) {
+      *p = t->timer_next;
+      break;
+    }
+  }
+  t->timer_next = NULL;
+}
+
+void os_timer_arm( os_timer_t *t, uint32 ms, bool repeat )
+{
+  os_timer_disarm( t );
+  t->timer_period = ms;
+  t->timer_repeat_flag = repeat;
+  t->timer_expire = (uint32)(now_us() / 1000) + ms;
+  t->timer_next = timers;
+  timers = t;
+}
+
+// Wait for the next timer due before the deadline and run it; false if
+// there is none
+static bool run_next_timer( uint64_t deadline_us )
+{
+  os_timer_t *next = NULL;
+  for (os_timer_t *t = timers; t; t = t->timer_next)
+    if (!next || (int32_t)(t->timer_expire - next->timer_expire) < 0)
+      next = t;
+  if (!next)
+    return false;
+
+  uint64_t due = (uint64_t)next->timer_expire * 1000;
+  if (due > deadline_us)
+    return false;
+  uint64_t now = now_us();
+  if (due > now)
+    sleep_us( due - now );
+
+  if (next->timer_repeat_flag && next->timer_period) {
+    next->timer_expire += next->timer_period;
+  } else {
+    os_timer_disarm( next );
+  }
+  next->timer_func( next->timer_arg );
+  return true;
+}
+
+
+// ---------------------------------------------------------------------------
+// Queues
+//
+struct QueueDefinition {
+  UBaseType_t len, item_size;
+  UBaseType_t head, count;
+  uint8_t items[];
+};
+
+QueueHandle_t xQueueCreate( UBaseType_t len, UBaseType_t item_size )
+{
+  QueueHandle_t q = (QueueHandle_t)malloc( sizeof(*q) + len * item_size );
+  if (q) {
+    q->len = len;
+    q->item_size = item_size;
+    q->head = q->count = 0;
+  }
+  return q;
+}
+
+void vQueueDelete( QueueHandle_t q )
+{
+  free( q );
+}
+
+BaseType_t xQueueSendToBack( QueueHandle_t q, const void *item, TickType_t wait )
+{
+  if (q->count == q->len)
+    return pdFAIL;   // nobody else could make room
+  UBaseType_t i = (q->head + q->count++) % q->len;
+  if (q->item_size)
+    memcpy( q->items + i * q->item_size, item, q->item_size );
+  return pdPASS;
+}
+
+BaseType_t xQueueReceive( QueueHandle_t q, void *item, TickType_t wait )
+{
+  uint64_t deadline = wait == portMAX_DELAY ? UINT64_MAX :
+    now_us() + (uint64_t)wait * (1000000 / configTICK_RATE_HZ);
+  while (q->count == 0) {
+    if (wait == 0)
+      return pdFALSE;
+    if (!run_next_timer( deadline )) {
+      if (wait == portMAX_DELAY)
+        host_idle();
+      else if (deadline > now_us())
+        sleep_us( deadline - now_us() );
+      return pdFALSE;
+    }
+  }
+  if (q->item_size)
+    memcpy( item, q->items + q->head * q->item_size, q->item_size );
+  q->head = (q->head + 1) % q->len;
+  q->count--;
+  return pdTRUE;
+}
+
+// Only ever asked not to wait
+BaseType_t xQueuePeek( QueueHandle_t q, void *item, TickType_t wait )
+{
+  if (q->count == 0)
+    return pdFALSE;
+  if (q->item_size)
+    memcpy( item, q->items + q->head * q->item_size, q->item_size );
+  return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting( QueueHandle_t q )
+{
+  return q->count;
+}
+
+UBaseType_t uxQueueSpacesAvailable( QueueHandle_t q )
+{
+  return q->len - q->count;
+}
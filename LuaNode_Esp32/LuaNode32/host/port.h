@@ -0,0 +1,11 @@
+#ifndef __HOST_PORT_H__
+#define __HOST_PORT_H__
+
+// Called when the Lua task would block for good: nothing is queued and
+// no os_timer is armed, so on the host the program is done
+void host_idle( void );
+
+// RAM flash of flash_ram.c, the whole chip; 0 picks the default size
+bool flash_ram_init( uint32_t size );
+
+#endif
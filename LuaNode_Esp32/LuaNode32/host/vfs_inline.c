@@ -0,0 +1,44 @@
+// One external definition of each inline function in vfs.h, for when
+// the compiler doesn't inline them, at -O0 for instance; and the table
+// of open files the host build's descriptors index, as a pointer doesn't
+// fit the int of a descriptor here
+
+#define inline extern inline
+#include "vfs.h"
+#include <stdlib.h>
+
+static vfs_file **vfs_fds;    // descriptor - 1 to file, NULL when free
+static int vfs_nfds;
+
+vfs_file *vfs_file_of( int fd )
+{
+  return fd > 0 && fd <= vfs_nfds ? vfs_fds[fd - 1] : NULL;
+}
+
+int vfs_fd_of( vfs_file *f )
+{
+  if (!f)
+    return 0;
+  for (int i = 0; i < vfs_nfds; i++)
+    if (!vfs_fds[i]) {
+      vfs_fds[i] = f;
+      return i + 1;
+    }
+  vfs_file **fds = (vfs_file **)realloc( vfs_fds, (vfs_nfds + 8) * sizeof( *fds ) );
+  if (!fds) {
+    f->fns->close( f );
+    return 0;
+  }
+  for (int i = vfs_nfds; i < vfs_nfds + 8; i++)
+    fds[i] = NULL;
+  vfs_fds = fds;
+  fds[vfs_nfds] = f;
+  vfs_nfds += 8;
+  return vfs_nfds - 7;
+}
+
+void vfs_fd_free( int fd )
+{
+  if (fd > 0 && fd <= vfs_nfds)
+    vfs_fds[fd - 1] = NULL;
+}
@@ -45,7 +45,10 @@
 
 
 #define NODE_ERROR
+// host/ runs print what the script prints and nothing else
+#ifndef LUANODE_HOST
 #define NODE_DEBUG
+#endif
 
 #ifdef NODE_DEBUG
 #define NODE_DBG os_printf
@@ -59,7 +62,9 @@
 #define NODE_ERR
 #endif	/* NODE_ERROR */
 
+#ifndef LUANODE_HOST
 #define SHOW_WRITE_PROGRESS
+#endif
 
 #endif
 
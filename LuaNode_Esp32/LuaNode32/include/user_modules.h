@@ -1,6 +1,8 @@
 #ifndef __USER_MODULES_H__
 #define __USER_MODULES_H__
 
+#include "sdkconfig.h"
+
 #define LUA_USE_BUILTIN_STRING		// for string.xxx()
 #define LUA_USE_BUILTIN_TABLE		// for table.xxx()
 #define LUA_USE_BUILTIN_COROUTINE	// for coroutine.xxx()
@@ -14,15 +16,52 @@
 #define USE_NODE_MODULE
 #define USE_LPEG_MODULE
 #define USE_FILE_MODULE
-//#define USE_UART_MODULE
+#define USE_UART_MODULE
 #define USE_UTILS_MODULE
 #define USE_MQTT_MODULE
 #define USE_TMR_MODULE
 #define USE_GPIO_MODULE
 #define USE_PWM_MODULE
-//#define USE_I2C_MODULE
+#define USE_I2C_MODULE
 #define USE_WIFI_MODULE
 #define USE_NET_MODULE
+#define USE_HTTP_MODULE
 #define USE_THREAD_MODULE
+#define USE_SPI_MODULE
+#define USE_PROFILER_MODULE
+#define USE_BUFFER_MODULE
+#define USE_ASSET_MODULE
+#define USE_FLASH_MODULE
+#define USE_FLASHLOG_MODULE
+#define USE_SCHED_MODULE
+#define USE_COAP_MODULE
+#define USE_SAMPLER_MODULE
+#define USE_WS2812_MODULE
+#define USE_ADC_MODULE
+#define USE_CJSON_MODULE
+#define USE_MSGPACK_MODULE
+#define USE_CRYPTO_MODULE
+#define USE_CRC_MODULE
+#define USE_DSP_MODULE
+#define USE_ZLIB_MODULE
+#define USE_COMPRESS_MODULE
+#define USE_KV_MODULE
+#define USE_CACHE_MODULE
+#define USE_TSERIES_MODULE
+#define USE_BENCH_MODULE
+#define USE_RTCTIME_MODULE
+#define USE_WEBSOCKET_MODULE
+#define USE_RTCMEM_MODULE
+#define USE_TRACE_MODULE
+#define USE_BRIDGE_MODULE
+#define USE_MODBUS_MODULE
+#define USE_PCNT_MODULE
+#define USE_I2S_MODULE
+#define USE_MDNS_MODULE
+#define USE_CONSOLE_MODULE
+// The SDK runs either the WiFi or the BT stack, not both
+#ifdef CONFIG_BT_ENABLED
+#define USE_BLE_MODULE
+#endif
 
 #endif	/* __USER_MODULES_H__ */
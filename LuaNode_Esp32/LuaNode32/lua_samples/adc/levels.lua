@@ -0,0 +1,26 @@
+-- Sample GPIO34 (ADC1 channel 6) at 20 kHz, averaged down to 1 kHz, and
+-- print the min, max and mean of every 500 values. A crossing of 3000
+-- (back below 2500) is reported as it happens.
+
+print("one reading: " .. adc.read(6))
+
+adc.threshold(2500, 3000, function(value, above)
+  print(above and "high" or "low", value)
+end)
+
+local rate = adc.start({chan = 6, rate = 20000, decimate = 20, block = 500},
+  function(data, lost)
+    local lo, hi, sum = 4095, 0, 0
+    for i = 1, #data, 2 do
+      local a, b = data:byte(i, i + 1)
+      local v = a + b * 256
+      if v < lo then lo = v end
+      if v > hi then hi = v end
+      sum = sum + v
+    end
+    local n = #data / 2
+    print(string.format("min %d max %d mean %d (%d lost)", lo, hi, sum / n, lost))
+  end)
+print("sampling at " .. rate .. " Hz")
+
+-- adc.stop() ends it, adc.threshold() stops looking for crossings
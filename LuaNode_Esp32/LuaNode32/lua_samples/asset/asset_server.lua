@@ -0,0 +1,29 @@
+-- serve web pages from the asset partition
+-- Build and flash the image on the host first:
+--   python tools/mkassets.py -o assets.img www/
+--   esptool.py write_flash 0x1C0000 assets.img
+-- with the partition table in partitions-LuaNode-stores.csv
+-- Connect to an AP first, see wifi/wifi_sta.lua
+
+for name, size in pairs(asset.list()) do
+  print(name, size);
+end
+
+-- the string points into flash, only its header takes RAM
+local page = asset.get("index.html");
+print(page and #page);
+
+srv = http.createServer(function(req, res)
+  if req.path == "/about" then
+    res:sendfile("/ASSET/about.html");
+  else
+    res:status(404);
+    res:finish("not found");
+  end
+end);
+
+-- GET /site/css/site.css is sent straight from the asset "css/site.css"
+srv:static("/site/", "/ASSET/");
+srv:static("/", "/ASSET/");
+
+srv:listen(80);
@@ -18,3 +18,19 @@ foo = function()
   print("This is a function");
 end
 foo();	-- function test
+
+
+-- plain text helpers, no patterns involved
+fields = string.split("21.5,,48,ok", ",");	-- {"21.5", "", "48", "ok"}
+print(#fields, fields[1], fields[4]);
+key, value = unpack(("Host: example.com"):split(": ", 2));
+print(key, value);
+print(string.join("/", {"a", "b", 3}));		-- a/b/3
+print(("topic/sensor/1"):startswith("topic/"), ("init.lua"):endswith(".lua"));
+print("[" .. string.trim("  \tvalue\r\n") .. "]");
+
+-- coroutine.create(f [, stack slots [, call depth]]) sizes the first
+-- stack of a coroutine; it still grows on demand
+co = coroutine.create(function(a, b) coroutine.yield(a + b); return "done" end, 24, 4);
+print(coroutine.resume(co, 1, 2));
+print(coroutine.resume(co));
@@ -0,0 +1,64 @@
+-- interpreter benchmark
+-- runs a few typical workloads and prints the time each one takes in ms
+-- also runs on the ESP8266: compare a default build with one made with
+-- LUA_IRAM=1, which moves the VM hot path out of the flash cache
+
+local now = tmr and tmr.now or function() return os.clock() * 1000000 end
+
+local function run(name, f, n)
+  collectgarbage()
+  local t0 = now()
+  f(n)
+  print(string.format("%-8s %6d ms", name, (now() - t0) / 1000))
+end
+
+-- integer loops and array access
+local function loops(n)
+  local t = {}
+  for i = 1, n do t[i] = i % 13 end
+  local s = 0
+  for j = 1, 10 do
+    for i = 1, n do if t[i] > 7 then s = s + t[i] * 2 - 1 end end
+  end
+  return s
+end
+
+-- field access and method calls on tables
+local function fields(n)
+  local p = { x = 0, y = 0 }
+  function p:move(dx, dy) self.x = self.x + dx; self.y = self.y + dy end
+  for i = 1, n do p:move(1, 2) end
+  return p.x + p.y
+end
+
+-- comparisons against constants, as in a state machine
+local function states(n)
+  local st, c = "idle", 0
+  for i = 1, n do
+    if st == "idle" then st = "run"
+    elseif st == "run" then st = "stop"; c = c + 1
+    else st = "idle" end
+  end
+  return c
+end
+
+-- floating point filter
+local function filter(n)
+  local y, a = 0.0, 0.125
+  for i = 1, n do y = y + a * ((i % 100) * 0.5 - y) end
+  return y
+end
+
+-- string building
+local function strings(n)
+  local t = {}
+  for i = 1, n do t[#t + 1] = "k" .. i end
+  return #table.concat(t, ",")
+end
+
+local n = 20000
+run("loops", loops, n)
+run("fields", fields, n)
+run("states", states, n)
+run("filter", filter, n)
+run("strings", strings, n / 10)
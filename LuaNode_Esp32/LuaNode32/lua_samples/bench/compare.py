@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+# Compares the BENCH lines of two logs of suite.lua/net.lua, a baseline
+# and a candidate build run on the same board.
+#
+#   python3 compare.py before.log after.log
+
+import json
+import sys
+
+# smaller is better for these units, bigger for the rest
+LOWER_BETTER = ("us", "steps", "pkt")
+
+
+def parse(lines):
+    build, results = None, {}
+    for line in lines:
+        at = line.find("BENCH ")
+        if at < 0:
+            continue
+        try:
+            rec = json.loads(line[at + 6:])
+        except ValueError:
+            continue
+        if "build" in rec:
+            build = rec["build"]
+        elif "name" in rec:
+            results[rec["name"]] = (rec["value"], rec["unit"])
+    return build, results
+
+
+def load(path):
+    with open(path, errors="replace") as f:
+        return parse(f)
+
+
+def main(a, b):
+    build_a, res_a = load(a)
+    build_b, res_b = load(b)
+    for tag, build in (("A", build_a), ("B", build_b)):
+        if build:
+            print("%s: %s %s, %s MHz" % (tag, build.get("version"),
+                                         build.get("build_date"), build.get("cpu_mhz")))
+    print("%-20s %12s %12s %8s  %s" % ("bench", "A", "B", "change", "unit"))
+    for name in sorted(set(res_a) | set(res_b)):
+        va, unit = res_a.get(name, (None, None))
+        vb, unit = res_b.get(name, (None, unit))
+        if va is None or vb is None:
+            print("%-20s %12s %12s %8s  %s" % (name, va, vb, "", unit))
+            continue
+        change = ""
+        if va:
+            pct = (vb - va) * 100.0 / va
+            if unit in LOWER_BETTER:
+                pct = -pct
+            change = "%+.1f%%" % pct
+        print("%-20s %12.6g %12.6g %8s  %s" % (name, va, vb, change, unit))
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        sys.exit("usage: compare.py before.log after.log")
+    main(sys.argv[1], sys.argv[2])
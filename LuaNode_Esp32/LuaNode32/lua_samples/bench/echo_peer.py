@@ -0,0 +1,40 @@
+#!/usr/bin/env python3
+# Echo peer for net.lua: sends back whatever arrives on the TCP and UDP
+# port given, 8181 by default.
+#
+#   python3 echo_peer.py [port]
+
+import socket
+import sys
+import threading
+
+
+def tcp_echo(port):
+    srv = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    srv.bind(("", port))
+    srv.listen(1)
+    while True:
+        conn, addr = srv.accept()
+        conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        with conn:
+            while True:
+                data = conn.recv(4096)
+                if not data:
+                    break
+                conn.sendall(data)
+
+
+def udp_echo(port):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("", port))
+    while True:
+        data, addr = sock.recvfrom(2048)
+        sock.sendto(data, addr)
+
+
+if __name__ == "__main__":
+    port = int(sys.argv[1]) if len(sys.argv) > 1 else 8181
+    threading.Thread(target=udp_echo, args=(port,), daemon=True).start()
+    print("echoing on port %d" % port)
+    tcp_echo(port)
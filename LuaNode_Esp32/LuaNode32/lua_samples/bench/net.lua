@@ -0,0 +1,85 @@
+-- network benchmarks, reported the way suite.lua does
+-- needs WiFi up and echo_peer.py running on PEER:
+--   python3 echo_peer.py 8181
+-- TCP throughput is echoed data back per second, UDP the datagrams a
+-- second that made the round trip, and how many did not.
+
+PEER = PEER or "192.168.1.100"
+PORT = PORT or 8181
+
+local now = tmr.now
+local TCP_CHUNK, TCP_TOTAL = 1024, 64 * 1024
+local UDP_SIZE, UDP_COUNT = 64, 500
+
+local function elapsed(t0)
+  return (now() - t0) % 0x80000000 / 1000000
+end
+
+local function report(name, value, unit)
+  print(string.format('BENCH {"name":"%s","value":%.6g,"unit":"%s"}', name, value, unit))
+end
+
+local function udp(done)
+  local sock = net.createUDPSocket()
+  local got, sent, t0, secs = 0, 0
+  local timer = tmr.create()
+  local function finish()
+    if not sock then return end
+    timer:unregister()
+    sock:close()
+    sock = nil
+    report("net.udp_pps", got > 0 and got / secs or 0, "pkt/s")
+    report("net.udp_lost", sent - got, "pkt")
+    done()
+  end
+  sock:on("receive", function(s, data)
+    got = got + 1
+    secs = elapsed(t0)
+    if got == UDP_COUNT then finish() end
+  end)
+  sock:listen(0)
+  local payload = string.rep("u", UDP_SIZE)
+  -- a datagram each time the previous one has left, give up on lost
+  -- replies one second after the last one
+  local function send()
+    if not sock then return end
+    if sent == UDP_COUNT then
+      timer:alarm(1000, tmr.ALARM_SINGLE, finish)
+      return
+    end
+    sent = sent + 1
+    sock:send(PORT, PEER, payload, send)
+  end
+  t0 = now()
+  send()
+end
+
+local function tcp(done)
+  local conn = net.createConnection(net.TCP, 0)
+  local block = string.rep("t", TCP_CHUNK)
+  local sent, got, t0 = 0, 0
+  conn:on("connection", function(c)
+    t0 = now()
+    sent = TCP_CHUNK
+    c:send(block)
+  end)
+  conn:on("sent", function(c)
+    if sent < TCP_TOTAL then
+      sent = sent + TCP_CHUNK
+      c:send(block)
+    end
+  end)
+  conn:on("receive", function(c, data)
+    got = got + #data
+    if got >= TCP_TOTAL then
+      report("net.tcp_echo", got / 1024 / elapsed(t0), "KB/s")
+      c:close()
+      done()
+    end
+  end)
+  conn:connect(PORT, PEER)
+end
+
+tcp(function()
+  udp(function() print('BENCH {"done":true}') end)
+end)
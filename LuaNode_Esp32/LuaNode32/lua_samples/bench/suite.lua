@@ -0,0 +1,203 @@
+-- benchmark suite for comparing firmware builds
+-- every result is one line of the form
+--   BENCH {"name":"vm.loop","value":123456,"unit":"ops/s"}
+-- after a first BENCH {"build":{...}} line from bench.info(), so a log of
+-- two runs on the same board can be diffed with compare.py. Run net.lua
+-- as well for the network numbers, it needs a peer.
+-- also runs on the host build: host/luanode-host lua_samples/bench/suite.lua
+-- and on the ESP8266, which has no bench module: what needs it is left out
+-- and the build line only names the target. tools/perfcheck.py runs it
+-- against a stored baseline.
+
+local now = tmr.now
+local SCALE = SCALE or 1   -- set it before running for longer runs
+
+local function elapsed(t0)
+  return (now() - t0) % 0x80000000 / 1000000
+end
+
+local function report(name, value, unit)
+  print(string.format('BENCH {"name":"%s","value":%.6g,"unit":"%s"}', name, value, unit))
+end
+
+-- n runs of f per second, f being given n, or n * per units of something
+local function rate(name, f, n, unit, per)
+  n = n * SCALE
+  collectgarbage()
+  local t0 = now()
+  f(n)
+  report(name, n * (per or 1) / elapsed(t0), unit or "ops/s")
+end
+
+-- upper bound in us of the bucket holding the p-th fraction of a log2
+-- histogram whose bucket i tops out at 2^(i + shift)
+local function percentile(hist, p, shift)
+  local total = 0
+  for i = 1, #hist do total = total + hist[i] end
+  local want, seen = total * p, 0
+  for i = 1, #hist do
+    seen = seen + hist[i]
+    if seen >= want then return 2 ^ (i + shift) end
+  end
+  return 2 ^ (#hist + shift)
+end
+
+local build = bench and bench.info() or { target = "esp8266" }
+print('BENCH {"build":' .. cjson.encode(build) .. '}')
+
+-- boot: app_main to the message pump, when init.lua has run and the
+-- prompt is up
+if node and node.bootprofile then
+  local _, total = node.bootprofile()
+  report("boot.ready", total, "us")
+end
+
+-- the ESP8266's file module has one open file and no file objects
+local function fopen(name, mode)
+  local f = file.open(name, mode)
+  if type(f) ~= "boolean" then return f end
+  return f and {
+    write = function(_, s) return file.write(s) end,
+    read = function(_, n) return file.read(n) end,
+    close = function() file.close() end,
+  }
+end
+
+-- VM: arithmetic loop and calls
+rate("vm.loop", function(n)
+  local s = 0
+  for i = 1, n do s = s + i % 7 end
+  return s
+end, 200000)
+
+rate("vm.call", function(n)
+  local function add(a, b) return a + b end
+  local s = 0
+  for i = 1, n do s = add(s, i) end
+  return s
+end, 100000)
+
+-- tables: array appends, hash inserts and lookups
+rate("table.append", function(n)
+  local t = {}
+  for i = 1, n do t[i] = i end
+end, 50000)
+
+local keys = {}
+for i = 1, 1000 do keys[i] = "key" .. i end
+
+rate("table.insert", function(n)
+  local t = {}
+  for i = 1, n do t[keys[i % 1000 + 1]] = i end
+end, 50000)
+
+rate("table.lookup", function(n)
+  local t, s = {}, 0
+  for i = 1, 1000 do t[keys[i]] = i end
+  for i = 1, n do s = s + t[keys[i % 1000 + 1]] end
+  return s
+end, 100000)
+
+-- strings: new strings to intern, existing ones found again, building
+rate("string.intern", function(n)
+  local t = {}
+  for i = 1, n do t[i % 100 + 1] = "s" .. i end
+end, 20000)
+
+rate("string.reintern", function(n)
+  local t = {}
+  for i = 1, n do t[i % 100 + 1] = "key" .. (i % 1000 + 1) end
+end, 20000)
+
+rate("string.concat", function(n)
+  local t = {}
+  for i = 1, n do t[i] = "item" end
+  return #table.concat(t, ",")
+end, 20000, "parts/s")
+
+-- GC: pauses while churning through short lived tables
+if node and node.gcstats then
+  collectgarbage()
+  node.gcstats(true)
+  local t0 = now()
+  local keep = {}
+  for i = 1, 20000 * SCALE do
+    keep[i % 64 + 1] = { i, tostring(i) }
+  end
+  local secs = elapsed(t0)
+  local gc = node.gcstats()
+  report("gc.churn", 20000 * SCALE / secs, "ops/s")
+  report("gc.steps", gc.steps, "steps")
+  report("gc.pause_p50", percentile(gc.hist, 0.5, -1), "us")
+  report("gc.pause_p99", percentile(gc.hist, 0.99, -1), "us")
+  report("gc.pause_max", gc.max_us, "us")
+end
+
+-- JSON: the same document encoded and decoded over and over
+local doc = { id = 42, name = "sensor", ok = true, values = {}, tags = { "a", "b", "c" } }
+for i = 1, 32 do doc.values[i] = i * 1.5 end
+local text = cjson.encode(doc)
+
+rate("json.encode", function(n)
+  for i = 1, n do cjson.encode(doc) end
+end, 500, "MB/s", #text / 1000000)
+
+rate("json.decode", function(n)
+  for i = 1, n do cjson.decode(text) end
+end, 500, "MB/s", #text / 1000000)
+
+-- files: 1K writes then reads of a 32K file
+local FILE, CHUNK, SIZE = "bench.tmp", 1024, 32 * 1024
+local block = string.rep("x", CHUNK)
+
+collectgarbage()
+local t0 = now()
+local f = fopen(FILE, "w")
+for i = 1, SIZE / CHUNK do f:write(block) end
+f:close()
+report("file.write", SIZE / 1024 / elapsed(t0), "KB/s")
+
+t0 = now()
+f = fopen(FILE, "r")
+while f:read(CHUNK) do end
+f:close()
+report("file.read", SIZE / 1024 / elapsed(t0), "KB/s")
+file.remove(FILE)
+
+-- bytecode: loading a dumped chunk of many small functions, each with a
+-- few string and number constants, the way a .lc module looks
+local src = {}
+for i = 1, 200 do
+  src[#src + 1] = string.format(
+    "function f%d(t) t.name%d = 'value %d' return t.count + %d.5, 'key%d' end", i, i, i, i, i)
+end
+local LC = "bench.lc"
+local lc = string.dump(loadstring(table.concat(src, "\n")))
+local lcsize = #lc
+f = fopen(LC, "w")
+f:write(lc)
+f:close()
+lc = nil
+
+rate("load.lc", function(n)
+  for i = 1, n do loadfile(LC) end
+end, 20, "KB/s", lcsize / 1024)
+file.remove(LC)
+
+-- heap: the least free since boot, what the runs above pushed it down to
+if node and node.heap then
+  local free, lowest = node.heap(true)
+  report("heap.min_free", lowest or free, "bytes")
+end
+
+-- task queue: wait of an event posted by Lua until it runs
+if not bench then
+  print('BENCH {"done":true}')
+  return
+end
+bench.post(1000, function(s)
+  report("task.post_avg", s.avg_us, "us")
+  report("task.post_p99", percentile(s.hist, 0.99, 0), "us")
+  report("task.post_max", s.max_us, "us")
+  print('BENCH {"done":true}')
+end)
@@ -0,0 +1,27 @@
+-- Needs a build with Bluetooth instead of WiFi (make menuconfig,
+-- Component config). Watches for iBeacons near by and prints each one
+-- at most every 10 seconds; everything else is turned away before it
+-- gets to Lua.
+
+-- Apple's company ID, then the iBeacon type and length
+local ibeacon = string.char(0x4c, 0x00, 0x02, 0x15)
+
+local function hex(s)
+  return (s:gsub(".", function(c) return string.format("%02x", c:byte()) end))
+end
+
+ble.scan({interval = 100, window = 100, rssi = -90, mfr = ibeacon,
+          dedup = 10000, batch = 8, flush = 2000}, function(list, dropped)
+  for _, b in ipairs(list) do
+    -- The manufacturer data follows its length and type bytes; the UUID
+    -- comes after the four prefix bytes
+    local at = b.data:find(ibeacon, 1, true)
+    if at then
+      local uuid = hex(b.data:sub(at + 4, at + 19))
+      local major = b.data:byte(at + 20) * 256 + b.data:byte(at + 21)
+      local minor = b.data:byte(at + 22) * 256 + b.data:byte(at + 23)
+      print(b.addr, b.rssi, uuid, major, minor)
+    end
+  end
+  if dropped > 0 then print("ble: dropped " .. dropped) end
+end)
@@ -0,0 +1,21 @@
+-- A serial device on UART2 reachable over TCP, like a serial server:
+-- `nc <ip> 2323` talks to it directly. The bytes don't go through Lua.
+
+uart.setup(2, 115200, 8, uart.PARITY_NONE, uart.STOPBITS_1, {tx = 17, rx = 16})
+
+local b = bridge.uart_tcp(2, 2323, {timeout = 300})
+
+b:on("connection", function(b, ip, port)
+  print("bridge: client", ip, port)
+end)
+
+b:on("disconnection", function(b, reason)
+  local s = b:stats()
+  print("bridge: gone,", reason, "to tcp", s.to_tcp, "to uart", s.to_uart)
+end)
+
+tmr.alarm(0, 60000, tmr.ALARM_AUTO, function()
+  local s = b:stats()
+  print("bridge:", s.connected and "in use" or "idle",
+        "dropped", s.dropped, "refused", s.rejected)
+end)
@@ -0,0 +1,16 @@
+-- buffer
+-- Build a binary packet in place instead of concatenating strings.
+
+-- header: magic, type and length, big endian
+local pkt = buffer.new(8 + 4);
+pkt:pack(1, ">HBBI", 0xCAFE, 1, 0, 4);
+pkt:setfloat(9, 21.5, true);     -- payload: a temperature
+
+-- buffers go to net, file, uart, i2c and spi like strings do
+-- sock:send(pkt);
+print(pkt:getu16(1, true), pkt:getfloat(9, true), #pkt);
+
+-- build one in a single call, and read it back
+local hello = buffer.pack("<Hs1", 7, "hello");
+local id, text, nextpos = buffer.unpack("<Hs1", hello);
+print(id, text, nextpos);
@@ -0,0 +1,31 @@
+-- buffer pipeline
+-- Data passed from a receiver to a sender as buffers: none of it becomes
+-- a Lua string, so nothing is hashed or interned on the way, and a slice
+-- shares the bytes of the buffer it was cut from.
+
+local m = mqtt.new("pipe", 60);
+mqtt.start(m, "192.168.1.10", 1883);
+
+-- readings from a sensor on UART2, one line each, straight to the broker
+uart.on(2, "data", "\n", function(line)
+  mqtt.publish(m, "sensor/raw", 0, line:slice(1, #line - 1));
+end, { buffer = true });
+
+-- a TCP upload to a file, written as it comes
+local f;
+local srv = net.createServer(net.TCP, 30);
+srv:listen(8080, function(c)
+  f = file.open("upload.bin", "w");
+  c:on("receive", function(c, data)
+    file.write(data);
+  end, { buffer = true, min = 512 });
+  c:on("disconnection", function() file.close(); end);
+end);
+
+-- messages only looked at in part: the header is cut out, not copied
+mqtt.on(m, "message", function(topic, msg)
+  local kind = msg:getu8(1);
+  if kind == 1 then
+    mqtt.publish(m, "sensor/body", 0, msg:slice(5));
+  end
+end, { buffer = true });
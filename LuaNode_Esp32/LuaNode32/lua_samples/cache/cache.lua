@@ -0,0 +1,34 @@
+-- LRU caches that evict for themselves
+
+-- Calibration records read from files, at most 16 of them in RAM; the
+-- least recently used one goes first
+local calib = cache.lru(16)
+
+local function calibration(sensor)
+  local c = calib:get(sensor)
+  if not c then
+    local f = file.open("cal_" .. sensor .. ".json", "r")
+    c = f and cjson.decode(f:read(1024)) or { gain = 1, offset = 0 }
+    if f then f:close() end
+    calib:put(sensor, c)
+  end
+  return c
+end
+
+print(calibration("t1").gain)
+
+-- Rendered pages, capped by size instead: 8 KB of keys and strings
+local pages = cache.lru(0, 8 * 1024)
+
+local function render(path)
+  local html = pages:get(path)
+  if not html then
+    html = "<h1>" .. path .. "</h1>"    -- the expensive part
+    pages:put(path, html)
+  end
+  return html
+end
+
+for i = 1, 3 do render("/index") end
+local s = pages:stats()
+print("hits", s.hits, "misses", s.misses, "entries", #pages, "bytes", s.bytes)
@@ -0,0 +1,31 @@
+-- Encode a reading as JSON, decode it back, then feed a document to the
+-- streaming decoder a few bytes at a time, the way it comes off a socket.
+
+local msg = cjson.encode({
+  id = node.chipid(),
+  temp = 21.5,
+  samples = {512, 498, 530},
+  ok = true,
+  note = cjson.null,
+})
+print(msg)
+
+local t = cjson.decode(msg)
+print(t.temp, #t.samples, t.ok, t.note == cjson.null)
+
+-- Only items.*.name is picked out; everything else is skipped as it goes
+local doc = '{"count":2,"items":[{"name":"a","v":1},{"name":"b","v":2}]}'
+local d = cjson.decoder(function(path, value)
+  print(path, value)
+end, {select = {"items.*.name"}})
+for i = 1, #doc, 7 do
+  d:write(doc:sub(i, i + 6))
+end
+d:finish()
+
+-- A large table goes to a file 512 bytes at a time instead of as one string
+local log = {}
+for i = 1, 200 do log[i] = {t = i, v = i * 3} end
+local f = file.open("log.json", "w")
+print("wrote " .. cjson.encode_to(f, log) .. " bytes")
+f:close()
@@ -0,0 +1,33 @@
+-- CoAP telemetry
+-- Readings go to a server as non-confirmable POSTs, one datagram each.
+-- The node also serves its state, which a client can observe:
+--   coap-client -m get -s 60 coap://<node ip>/state
+
+local srv = coap.server()
+local count = 0
+
+srv:on("state", function(method, payload, ip, port)
+  if method == coap.PUT and payload then
+    count = tonumber(payload) or count
+    return 204
+  end
+  return 205, tostring(count), 0    -- text/plain
+end, true)
+
+-- the address of the collector, resolve a name with net.dns first
+local clt = coap.client("192.168.1.10")
+
+tmr.alarm(0, 5000, tmr.ALARM_AUTO, function()
+  count = count + 1
+  clt:send("telemetry?node=1", tostring(count))
+  srv:notify("state")
+end)
+
+-- a confirmable request: sent again until acknowledged
+clt:get("config", function(code, payload)
+  if code then
+    print("config", code, payload)
+  else
+    print("no config:", payload)
+  end
+end)
@@ -0,0 +1,26 @@
+-- LZSS compression, for logs and files, in a few hundred bytes of RAM
+
+-- A log kept compressed on flash: "az" appends a compressed segment,
+-- and reading with "rz" gives back the text of all of them. Each segment
+-- starts with an empty window, so keep the file open over many lines
+-- rather than opening it for each; f:flush() ends a segment early.
+local f = file.open("sensor.log", "az")
+for i = 1, 100 do
+  f:writeline(string.format('{"t":%d,"temp":21.%d,"hum":40}', i, i % 10))
+end
+f:close()
+print("on flash", file.list()["sensor.log"])
+local f = file.open("sensor.log", "rz")
+print(f:readline())
+f:close()
+
+-- Strings, e.g. to pack a reply before it goes out
+local text = string.rep("the quick brown fox ", 20)
+local z = compress.encode(text)
+print(#text, "->", #z, compress.decode(z) == text)
+
+-- Streams: the encoder holds back the end of its input until told to
+-- finish, so each write gives back what is ready
+local enc, dec = compress.encoder(), compress.decoder()
+local part = enc:write("first part, ") .. enc:write("second part", true)
+print(dec:write(part))
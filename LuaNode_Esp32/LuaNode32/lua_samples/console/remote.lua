@@ -0,0 +1,20 @@
+-- The Lua prompt on port 23, so a node can be looked at and redeployed
+-- without a serial cable:
+--
+--   telnet kitchen.local        (password, then the usual prompt)
+--   python tools/upload.py -p kitchen.local:23 --password s3cret init.lua
+--
+-- Idle sessions are dropped after ten minutes.
+
+console.on("connection", function(ip, port)
+  print("console: " .. ip .. ":" .. port)
+end)
+console.on("disconnection", function(reason)
+  print("console: gone, " .. reason)
+end)
+
+console.listen(23, {password = "s3cret", timeout = 600})
+
+wifi.on("sta_got_ip", function(ev, info)
+  mdns.start("kitchen")
+end)
@@ -0,0 +1,16 @@
+-- Checksums of strings, of data arriving in pieces, and of a file.
+
+print(string.format("%08x", crc.crc32("123456789")))   -- cbf43926
+print(string.format("%04x", crc.crc16("123456789")))   -- 31c3
+print(string.format("%02x", crc.crc8("123456789")))
+
+-- The same, a piece at a time
+local c = crc.crc32("1234")
+c = crc.crc32("56789", c)
+print(string.format("%08x", c))
+
+-- A whole file, or part of it, without reading it into Lua
+local f = crc.file("crc32", "init.lua")
+if f then
+  print("init.lua", string.format("%08x", f))
+end
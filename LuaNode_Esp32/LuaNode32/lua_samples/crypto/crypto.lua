@@ -0,0 +1,28 @@
+-- Hash a file in pieces, sign a message and encrypt a payload with AES-GCM.
+
+print(crypto.tohex(crypto.digest("sha256", "abc")))
+
+-- Incremental: the file never has to fit in memory
+local h = crypto.hash("sha256")
+if file.open("init.lua", "r") then
+  local s = file.read(512)
+  while s do
+    h:update(s)
+    s = file.read(512)
+  end
+  file.close()
+end
+print("init.lua", crypto.tohex(h:finalize()))
+
+local key = "0123456789abcdef"
+print("hmac", crypto.tohex(crypto.hmac("sha1", key, "hello")))
+
+-- The iv must never repeat for the same key; here a counter would do
+local iv = "unique-nonce"
+local ct, tag = crypto.encrypt("aes-gcm", key, iv, "temperature=21.5", "device-7")
+print(#ct, crypto.tohex(tag))
+print(crypto.decrypt("aes-gcm", key, iv, ct, tag, "device-7"))
+print(crypto.decrypt("aes-gcm", key, iv, ct, tag, "device-8"))   -- nil, authentication failed
+
+local cbc = crypto.encrypt("aes-cbc", key, key, "padded to a whole block")
+print(#cbc, crypto.decrypt("aes-cbc", key, key, cbc))
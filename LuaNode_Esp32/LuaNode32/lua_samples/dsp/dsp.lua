@@ -0,0 +1,37 @@
+-- Statistics, a filter and the spectrum of a block of samples.
+
+local N = 64
+
+-- sin(2 pi k / N), turning a unit vector by 2 pi / N at each step, as
+-- the firmware has no math library
+local sin, c, s = {}, 1, 0
+for k = 0, N - 1 do
+  sin[k] = s
+  c, s = c * 0.9951847267 - s * 0.0980171403, s * 0.9951847267 + c * 0.0980171403
+end
+
+-- A test signal: a tone in bin 4 plus a little of bin 20
+local x = dsp.new(N)
+for i = 0, N - 1 do
+  x:setfloat(i * 4 + 1, sin[4 * i % N] + 0.2 * sin[20 * i % N])
+end
+print("mean", dsp.mean(x), "rms", dsp.rms(x))
+print("max", dsp.max(x))
+
+-- Samples from a sensor arrive as 16 bit integers; dsp.from converts a
+-- whole block, e.g. the data a sampler job delivers
+local raw = buffer.pack("<hhhh", 100, -100, 200, -200)
+print("converted", dsp.sum(dsp.from(raw, "i16", 1 / 32768)))
+
+-- A low pass biquad (b0 b1 b2 a1 a2), keeping its state between blocks
+local lp = dsp.iir({ 0.0675, 0.1349, 0.0675, -1.1430, 0.4128 })
+local y = lp:process(x, dsp.new(N))
+print("filtered rms", dsp.rms(y))
+
+-- The spectrum; the tone shows up in bins 5 and 21 (1-based)
+local re, im = buffer.new(x), dsp.new(N)
+dsp.window(re)
+dsp.fft(re, im)
+local mag = dsp.mag(re, im)
+local _, peak = dsp.max(mag)
+print("peak in bin", peak)
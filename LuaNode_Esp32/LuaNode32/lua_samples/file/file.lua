@@ -10,6 +10,19 @@ for k,v in pairs(detail) do
 end
 
 
+-- or one at a time, without a table of every file; here the .lua ones
+for name, size in file.dir() do
+  if name:sub(-4) == ".lua" then
+    print(name, size);
+  end
+end
+
+-- only names starting with "log", e.g. log001.txt
+for name, size in file.dir("log") do
+  print(name, size);
+end
+
+
 -- format FS, remove all content in FS
 file.format();
 detail = file.list();
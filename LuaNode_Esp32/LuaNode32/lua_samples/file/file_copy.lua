@@ -0,0 +1,20 @@
+-- Copy a file while appending to a log, with two files open at once
+
+local src = file.open("test.lua", "r")
+local dst = file.open("test_copy.lua", "w")
+local log = file.open("copy.log", "a")
+
+if src and dst and log then
+  local total = 0
+  while true do
+    local chunk = src:read(1024)
+    if not chunk then break end
+    dst:write(chunk)
+    total = total + #chunk
+  end
+  log:writeline("copied " .. total .. " bytes")
+end
+
+if src then src:close() end
+if dst then dst:close() end
+if log then log:close() end
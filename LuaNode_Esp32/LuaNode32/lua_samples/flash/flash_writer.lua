@@ -0,0 +1,23 @@
+-- raw flash partition access
+-- Needs a data partition of its own in partitions-LuaNode.csv, e.g.
+--   rawdata, data, 0x80, , 64K
+
+local p = flash.partition("rawdata");
+if not p then
+  print("no partition called rawdata");
+  return;
+end
+print("size, type, subtype:", p:info());
+
+-- a writer buffers one sector, then erases and programs it in one go
+local w = p:writer();
+for i = 1, 1000 do
+  w:write(string.format("line %d\n", i));
+end
+print("written:", w:close());
+print(p:read(0, 16));
+
+-- single writes need the range erased first
+p:erase_range(0, flash.SECTOR_SIZE);
+p:write(0, "hello");
+print(p:read(0, 5));
@@ -0,0 +1,18 @@
+-- circular log in the "log" partition
+-- Once the partition is full, the oldest sector of records goes.
+
+for i = 1, 200 do
+  flashlog.append(string.format("%d boot step %d", tmr.now(), i));
+end
+
+-- the last few records, oldest first
+for _, rec in ipairs(flashlog.tail(5)) do
+  print(rec);
+end
+
+-- walk the whole log without building a table
+local n = 0;
+for rec in flashlog.iterate() do
+  n = n + 1;
+end
+print(n .. " records", flashlog.info());
@@ -0,0 +1,42 @@
+-- HTTP requests from C: a small JSON API call, a download straight into a
+-- file, and a firmware image streamed into an OTA update. Assumes wifi is
+-- already connected.
+
+SERVER = "http://192.168.1.100:8000"
+
+http.request({url = SERVER .. "/api/status",
+              headers = {Accept = "application/json"}},
+  function(status, body, headers)
+    if not status then
+      print("request failed", body)
+      return
+    end
+    print(status, headers["content-type"])
+    print(cjson.decode(body).uptime)
+  end)
+
+-- The body goes to the file as it arrives, never all in RAM
+http.request({url = SERVER .. "/www/index.html", save = "index.html"},
+  function(status, err)
+    print("download", status or err)
+  end)
+
+-- Posting a file, then a reading as a string
+http.request({url = SERVER .. "/upload", method = "PUT", file = "log.txt"},
+  function(status) print("upload", status) end)
+http.request({url = SERVER .. "/readings", body = cjson.encode({t = 21.5})},
+  function(status) print("post", status) end)
+
+-- A firmware update, written to flash as it comes in
+local u = node.ota.begin()
+http.request({url = SERVER .. "/firmware.bin", sink = u},
+  function(status, err)
+    local ok, digest = status == 200 and u:finish()
+    if ok then
+      print("image", digest)
+      u:commit()
+    else
+      print("update failed", err or status)
+      u:abort()
+    end
+  end)
@@ -0,0 +1,31 @@
+-- http server
+-- Connect to an AP first, see wifi/wifi_sta.lua
+
+-- Requests the static route can't serve end up in this callback.
+-- req has method, path, query, version, headers (lower-case names) and body.
+handler = function(req, res)
+  if req.path == "/hello" then
+    res:header("Content-Type", "text/plain");
+    res:finish("hello " .. (req.query or "world"));
+  elseif req.path == "/stream" then
+    -- without a Content-Length the response is sent chunked
+    res:send("one ");
+    res:send("two ");
+    res:finish("three");
+  else
+    res:status(404);
+    res:finish("not found");
+  end
+end
+
+srv = http.createServer(handler);
+
+-- serve files from the file system without calling into Lua:
+-- GET /www/style.css sends the file "www/style.css", GET / sends index.html
+srv:static("/www/", "www/");
+srv:static("/", "");
+
+srv:listen(80);
+
+-- to stop the server, run the following command
+-- srv:close();
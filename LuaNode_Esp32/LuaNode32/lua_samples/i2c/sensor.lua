@@ -0,0 +1,31 @@
+-- Poll a BMP280 on I2C0 at 400 kHz without holding up the Lua task
+-- SDA on GPIO 21, SCL on GPIO 22
+
+local ADDR = 0x76
+
+print("i2c at " .. i2c.setup(0, 21, 22, i2c.FAST) .. " Hz")
+
+-- chip id, a register write and a read in one transaction
+local id, err = i2c.transfer(0, ADDR, 0xD0, 1)
+if not id then
+  print("no sensor: " .. err)
+  return
+end
+print(string.format("chip id 0x%02x", id:byte()))
+
+-- normal mode, x1 oversampling of temperature and pressure
+i2c.write(0, ADDR, {0xF4, 0x27})
+
+-- raw pressure and temperature, 6 bytes from 0xF7; the transaction is
+-- queued and the callback runs once it is done
+tmr.alarm(0, 1000, tmr.ALARM_AUTO, function()
+  i2c.transfer(0, ADDR, 0xF7, 6, function(data, err)
+    if not data then
+      print("read failed: " .. err)
+      return
+    end
+    local p = data:byte(1) * 4096 + data:byte(2) * 16 + data:byte(3) / 16
+    local t = data:byte(4) * 4096 + data:byte(5) * 16 + data:byte(6) / 16
+    print("raw pressure", p, "raw temperature", t)
+  end)
+end)
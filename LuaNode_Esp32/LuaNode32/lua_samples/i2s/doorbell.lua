@@ -0,0 +1,24 @@
+-- A MAX98357A amplifier on GPIO 26 (BCLK), 25 (LRC) and 22 (DIN): a
+-- chime from flash when the button on GPIO 0 is pressed, and whatever a
+-- client sends to port 5000 in between.
+
+i2s.setup({bck = 26, ws = 25, data = 22})
+
+local function ended(reason)
+  local _, frames, underruns = i2s.stats()
+  print("i2s: " .. reason .. ", " .. frames .. " frames, " .. underruns .. " underruns")
+end
+
+gpio.mode(0, gpio.INPUT, gpio.PULLUP)
+gpio.trig(0, "down", function()
+  i2s.volume(0.5)
+  i2s.playfile("chime.wav", ended)
+end, {debounce_us = 50000})
+
+-- e.g. ffmpeg -re -i song.mp3 -f wav -ar 22050 -ac 1 tcp://<ip>:5000
+-- (-re so it's sent no faster than it plays)
+local srv = net.createServer(net.TCP)
+srv:listen(5000, function(c)
+  i2s.volume(1)
+  i2s.stream(c, ended)
+end)
@@ -0,0 +1,25 @@
+-- Settings in NVS instead of small files on SPIFFS
+
+-- Opening reads the whole namespace into RAM; gets are table lookups
+local cfg = kv.open("config")
+local ssid = cfg:get("ssid", "LuaNode")
+local port = cfg:get("port", 1883)
+print(ssid, port)
+
+-- Sets are gathered and written together 2 s after the first one, so a
+-- burst of them costs one commit
+cfg:set("ssid", "home")
+cfg:set("port", 8883)
+cfg:set("tls", true)
+cfg:set("boots", cfg:get("boots", 0) + 1)
+
+for k, v in cfg:pairs() do
+  print(k, v)
+end
+
+-- commit() writes now, e.g. before a deep sleep; close() does too
+print(cfg:commit())
+
+-- A store that writes each set at once
+local state = kv.open("state", 0)
+state:set("last_error", nil)
@@ -0,0 +1,36 @@
+-- Build a grammar once, keep its compiled form, and load that at boot
+-- instead of building it again.
+
+local P, R, C, Ct = lpeg.P, lpeg.R, lpeg.C, lpeg.Ct
+
+local function build()
+  local digit = R"09"
+  local num = C(digit^1)
+  return Ct(num * (P"," * num)^0) * -1
+end
+
+-- Once: write the image to a file (or pack it into the asset partition
+-- with tools/mkassets.py)
+local f = file.open("csv.lpg", "w")
+f:write(lpeg.dump(build()))
+f:close()
+
+-- At boot: from the asset partition the code runs straight from flash;
+-- from a file it runs from the string read
+local img = asset and asset.get("csv.lpg")
+if not img then
+  f = file.open("csv.lpg", "r")
+  img = f:read(4096)
+  f:close()
+end
+local csv = lpeg.load(img)
+print(#csv:match("12,7,300"))
+
+-- Patterns built at run time from a spec, built once per spec
+local function field(name)
+  return lpeg.cache("field:" .. name, function()
+    return P(name .. "=") * C((1 - P";")^0)
+  end)
+end
+print(field("temp"):match("temp=21.5"))
+print(field("temp") == field("temp"))   -- true, the same pattern
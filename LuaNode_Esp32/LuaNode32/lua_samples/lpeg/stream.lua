@@ -0,0 +1,22 @@
+-- Parse "key=value" lines as they arrive, in chunks that split lines
+-- anywhere, holding at most 256 bytes at a time.
+
+local P, C = lpeg.P, lpeg.C
+local line = C((1 - P"=")^1) * "=" * C((1 - P"\n")^0) * "\n"
+
+local st = lpeg.stream(line, 256)
+local chunks = {"temp=21", ".5\nhum", "=48\nvolt=3.3\n"}
+
+for _, chunk in ipairs(chunks) do
+  assert(st:feed(chunk))
+  while true do
+    local k, v = st:match()
+    if not k then break end      -- v is "more" here: wait for the next chunk
+    print(k, v)
+  end
+end
+st:finish()
+print(st:match())                -- nil  end
+
+-- The capture list is capped as the backtrack stack is
+lpeg.setmaxcaptures(1024)
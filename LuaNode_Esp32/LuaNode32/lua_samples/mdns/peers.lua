@@ -0,0 +1,26 @@
+-- Each node advertises its sensor service as <hostname>._sensor._tcp and
+-- polls its peers every minute. Only the first browse goes out on the
+-- network; later ones come from the cache until the records expire, and
+-- peers joining or leaving announce it themselves.
+
+local name = "kitchen"    -- different on each node
+
+mdns.start(name)
+mdns.advertise("_sensor._tcp", 8080, {txt = {v = "1", kind = "temp"}})
+
+local function poll()
+  mdns.browse("_sensor._tcp", function(peers)
+    for _, p in ipairs(peers) do
+      if p.name ~= name and p.ip then
+        -- p.host resolves from net's DNS cache too, no query needed
+        http.request({url = "http://" .. p.host .. ":" .. p.port .. "/reading"},
+          function(status, body) print(p.name, status, body) end)
+      end
+    end
+    local s = mdns.cache()
+    print("mdns: " .. s.hits .. " cached, " .. s.misses .. " asked")
+  end)
+end
+
+tmr.alarm(0, 60000, tmr.ALARM_AUTO, poll)
+poll()
@@ -0,0 +1,40 @@
+-- Polling two energy meters on an RS-485 bus (UART2, DE on GPIO 4) and
+-- serving a summary to Modbus TCP clients on port 502.
+
+uart.setup(2, 9600, 8, uart.PARITY_EVEN, uart.STOPBITS_1, {tx = 17, rx = 16, de = 4})
+
+local m = modbus.master(2, {timeout = 300})
+local slave = modbus.slave(1, {input = 1, holding = 1})
+
+-- Voltage, current and power of each meter, read every 2 s. Registers 0
+-- to 2 and 6 of a unit go in one request.
+m:poll({
+  {unit = 1, kind = "input", addr = 0, count = 3},
+  {unit = 1, kind = "input", addr = 6},
+  {unit = 2, kind = "input", addr = 0, count = 3},
+  {unit = 2, kind = "input", addr = 6},
+}, 2000, function(m, failed)
+  local total = 0
+  for unit = 1, 2 do
+    local w = m:get(unit, "input", 6)
+    if w then
+      total = total + w
+    end
+  end
+  slave:set("input", 0, total)
+  if failed > 0 then
+    print("modbus: " .. failed .. " requests failed")
+  end
+end)
+
+-- A relay on meter 2, switched from a holding register clients write
+slave:on("write", function(s, kind, addr, count)
+  m:write(2, "coils", 0, s:get("holding", 0), function(ok, err)
+    print("relay", ok, err)
+  end)
+end)
+
+srv = net.createServer(net.TCP, 300)
+srv:listen(502, function(sock)
+  slave:serve(sock)
+end)
@@ -0,0 +1,119 @@
+-- MQTT benchmark and soak test
+-- Publishes to a topic it is subscribed to, so every message makes the
+-- round trip through the broker, and reports every REPORT seconds:
+-- messages a second each way, round trip p50/p99, messages lost, the
+-- lowest free heap since boot and how long reconnecting took. Runs for
+-- DURATION seconds, or until reset with 0.
+
+local BROKER   = "test.mosquitto.org"
+local PORT     = 1883
+local QOS      = mqtt.QOS1
+local SIZE     = 64        -- payload bytes, 24 at least
+local RATE     = 50        -- messages a second
+local DURATION = 60        -- seconds, 0 to soak
+local REPORT   = 10        -- seconds between reports
+local SAMPLES  = 1000      -- round trips kept for each report
+
+local WRAP = 0x80000000    -- tmr.now() wraps at 31 bits
+local id = tostring(tmr.now())   -- apart from other boards on the broker
+local topic = "luanode/bench/" .. id
+local clt = mqtt.new("luanode-bench-" .. id, 60, "", "")
+
+local seq, expect = 0, 1
+local sent, refused, got, lost = 0, 0, 0, 0
+local rtt, nrtt = {}, 0
+local t_off, reconnects, reconnect_ms, reconnect_max = nil, 0, 0, 0
+local started = tmr.now()
+local total_sent, total_got, total_lost = 0, 0, 0
+
+-- the firmware has no math library
+local function floor(x)
+  return x - x % 1
+end
+
+local function us_since(t)
+  return (tmr.now() - t) % WRAP
+end
+
+local function pct(sorted, p)
+  if #sorted == 0 then return 0 end
+  local i = -floor(-#sorted * p / 100)   -- rounded up
+  return sorted[i > 1 and i or 1]
+end
+
+local function report(secs)
+  table.sort(rtt)
+  local _, lowest = node.heap(true)
+  print(string.format("bench %4ds: out %5.1f/s in %5.1f/s refused %d lost %d"
+    .. " rtt p50 %d ms p99 %d ms heap low %d reconnects %d (last %d ms, max %d ms)",
+    us_since(started) / 1000000,
+    sent / secs, got / secs, refused, lost,
+    pct(rtt, 50) / 1000, pct(rtt, 99) / 1000, lowest,
+    reconnects, reconnect_ms, reconnect_max))
+  total_sent, total_got, total_lost = total_sent + sent, total_got + got, total_lost + lost
+  sent, refused, got, lost = 0, 0, 0, 0
+  rtt, nrtt = {}, 0
+end
+
+local pad = string.rep("x", SIZE - 24)
+local function publish()
+  seq = seq + 1
+  -- sequence number and send time, then padding
+  local msg = string.format("%12d%12d", seq, tmr.now()) .. pad
+  if mqtt.publish(clt, topic, QOS, msg) then
+    sent = sent + 1
+  else
+    refused = refused + 1
+  end
+end
+
+local function arrived(t, msg)
+  local n, at = tonumber(msg:sub(1, 12)), tonumber(msg:sub(13, 24))
+  if not n then return end
+  got = got + 1
+  if n > expect then lost = lost + n - expect end
+  if n >= expect then expect = n + 1 end
+  nrtt = nrtt + 1
+  if nrtt <= SAMPLES then rtt[nrtt] = us_since(at) end
+end
+
+-- the timer runs at 100 Hz at most, higher rates go in bursts
+local period = floor(1000 / RATE)
+if period < 10 then period = 10 end
+local burst = floor(RATE * period / 1000)
+if burst < 1 then burst = 1 end
+local sender = tmr.create()
+local reporter = tmr.create()
+
+mqtt.on(clt, "offline", function()
+  t_off = tmr.now()
+  print("bench: offline")
+end)
+
+mqtt.on(clt, "connect", function()
+  if t_off then
+    reconnects = reconnects + 1
+    reconnect_ms = us_since(t_off) / 1000
+    if reconnect_ms > reconnect_max then reconnect_max = reconnect_ms end
+    t_off = nil
+  end
+  mqtt.subscribe(clt, topic, QOS, arrived)
+end)
+
+sender:alarm(period, tmr.ALARM_AUTO, function()
+  for i = 1, burst do publish() end
+end)
+
+local elapsed = 0
+reporter:alarm(REPORT * 1000, tmr.ALARM_AUTO, function()
+  elapsed = elapsed + REPORT
+  report(REPORT)
+  if DURATION > 0 and elapsed >= DURATION then
+    sender:unregister()
+    reporter:unregister()
+    print(string.format("total: %d sent, %d received, %d lost, %.1f/s",
+      total_sent, total_got, total_lost, total_got / elapsed))
+  end
+end)
+
+mqtt.start(clt, BROKER, PORT)
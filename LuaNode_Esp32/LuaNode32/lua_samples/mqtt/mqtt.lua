@@ -0,0 +1,32 @@
+-- MQTT client
+-- Callbacks run on the Lua task like every other event, so they can touch
+-- any Lua state. A burst of messages is delivered a few at a time, letting
+-- timers and sockets run in between. Connect to the AP first.
+
+local clt = mqtt.new("luanode", 60, "", "")
+
+mqtt.on(clt, "connect", function()
+  print("connected")
+  mqtt.subscribe(clt, "luanode/in", mqtt.QOS0)
+  -- matched in C, so no if/elseif chain on the topic in Lua
+  mqtt.subscribe(clt, "luanode/sensor/+/temp", mqtt.QOS0, function(topic, data)
+    print("temperature", topic:match("sensor/([^/]+)/"), data)
+  end)
+  mqtt.subscribe(clt, "luanode/cmd/#", mqtt.QOS1, function(topic, data)
+    print("command", topic, data)
+  end)
+  mqtt.publish(clt, "luanode/out", mqtt.QOS0, "hello")
+end)
+
+mqtt.on(clt, "offline", function()
+  print("offline, espmqtt reconnects by itself")
+end)
+
+-- everything the subscriptions above don't take a callback for
+local count = 0
+mqtt.on(clt, "message", function(topic, data)
+  count = count + 1
+  print(count, topic, #data)
+end)
+
+mqtt.start(clt, "test.mosquitto.org", 1883)
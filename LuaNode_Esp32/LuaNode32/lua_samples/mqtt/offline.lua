@@ -0,0 +1,23 @@
+-- Publishing through outages
+-- Readings taken while the broker can't be reached are queued, in RAM
+-- first and then in the mqttq flash partition, and go out in order once
+-- the client is back. Nothing here has to know whether it is online.
+
+local clt = mqtt.new("luanode-sensor", 60, "", "")
+
+mqtt.on(clt, "connect", function()
+  local ram, flash = mqtt.queued(clt)
+  print("connected, sending " .. ram .. " queued in RAM, " .. flash .. " in flash")
+end)
+
+mqtt.on(clt, "offline", function() print("offline, queueing") end)
+
+local n = 0
+tmr.create():alarm(200, tmr.ALARM_AUTO, function()
+  n = n + 1
+  if not mqtt.publish(clt, "luanode/sensor/adc", mqtt.QOS1, tostring(n)) then
+    print("queue full, reading " .. n .. " lost")
+  end
+end)
+
+mqtt.start(clt, "test.mosquitto.org", 1883)
@@ -0,0 +1,30 @@
+-- Large payloads without holding them in RAM
+-- Firmware images go straight to a file as they come in, and everything
+-- else is handed over a network buffer at a time.
+
+local clt = mqtt.new("luanode-stream", 60, "", "")
+
+mqtt.sink(clt, "luanode/ota/+", "ota.bin")
+
+mqtt.on(clt, "file", function(topic, path, total)
+  if total then
+    print(topic .. ": " .. total .. " bytes in " .. path)
+  else
+    print(topic .. ": couldn't write " .. path)
+  end
+end)
+
+local got = 0
+mqtt.on(clt, "data", function(topic, chunk, offset, total)
+  got = got + #chunk
+  if offset + #chunk == total then
+    print(topic .. ": " .. got .. " bytes")
+    got = 0
+  end
+end)
+
+mqtt.on(clt, "connect", function()
+  mqtt.subscribe(clt, "luanode/#", mqtt.QOS1)
+end)
+
+mqtt.start(clt, "test.mosquitto.org", 1883)
@@ -0,0 +1,12 @@
+-- MQTT over TLS
+-- Needs "Enable MQTT over SSL" in menuconfig. The first connect does a
+-- full handshake; reconnects resume the session, which takes a fraction
+-- of the time and heap.
+
+local clt = mqtt.new("luanode-tls", 60, "", "")
+
+mqtt.on(clt, "connect", function() print("connected") end)
+mqtt.on(clt, "offline", function() print("offline") end)
+
+-- without a CA certificate the broker isn't checked
+mqtt.start(clt, "test.mosquitto.org", 8883, true)
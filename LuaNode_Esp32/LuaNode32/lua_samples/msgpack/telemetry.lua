@@ -0,0 +1,23 @@
+-- Pack a reading into a buffer that is reused for every message, compare
+-- its size with the JSON text, and unpack it again.
+
+local reading = {id = 7, t = 21.5, rh = 48, v = {512, 498, 530}, ok = true}
+
+local buf = buffer.new(64)
+local n = msgpack.pack_into(buf, 1, reading) - 1
+print("msgpack " .. n .. " bytes, json " .. #cjson.encode(reading) .. " bytes")
+
+local back = msgpack.unpack(buf)
+print(back.id, back.t, back.rh, #back.v, back.ok)
+
+-- Several values one after another in one string
+local s = msgpack.pack(1) .. msgpack.pack("two") .. msgpack.pack({3})
+local pos = 1
+while pos <= #s do
+  local v
+  v, pos = msgpack.unpack(s, pos)
+  print(type(v), v)
+end
+
+-- To a socket, as the table is walked:
+--   msgpack.pack_to(sock, reading)
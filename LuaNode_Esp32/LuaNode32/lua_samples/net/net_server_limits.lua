@@ -0,0 +1,21 @@
+-- A TCP server that holds up under connection storms: at most 6 clients
+-- at a time, 4 more waiting at most, and clients idle for 20 s dropped.
+-- Those over the limits are refused before they take any Lua memory.
+
+PORT = 8181;
+
+srv = net.createServer(net.TCP, { timeout = 20, maxclients = 6, backlog = 4 });
+srv:listen(PORT, function(sock)
+  sock:on("receive", function(sock, data)
+    sock:send("echo: " .. data);
+  end)
+  sock:on("reconnection", function(sock, err)
+    print("client dropped, error " .. err);
+  end)
+end)
+
+tmr.alarm(0, 10000, tmr.ALARM_AUTO, function()
+  local s = srv:stats(true);
+  print("clients " .. s.clients .. ", rejected " .. s.rejected ..
+        ", reaped " .. s.reaped);
+end)
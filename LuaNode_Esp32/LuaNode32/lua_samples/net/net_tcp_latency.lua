@@ -0,0 +1,23 @@
+-- Latency controls for TCP sockets
+-- Sends small control messages without waiting on Nagle's algorithm and
+-- keeps an idle link checked with keepalive probes. Assumes wifi is
+-- already connected and a server listens on ADDR:PORT.
+
+PORT = 8181
+ADDR = "192.168.99.218"
+
+conn = net.createConnection(net.TCP, 0)
+conn:setopt({nodelay = true,
+             keepalive = {idle = 30, intvl = 5, cnt = 3},
+             sndbuf = 4096})
+conn:on("connection", function(sock)
+  for i = 1, 10 do
+    sock:send("tick " .. i .. "\n")
+  end
+  -- push whatever is queued out now instead of on the next ack
+  print("still queued", sock:flush())
+end)
+conn:on("receive", function(sock, c)
+  print(c)
+end)
+conn:connect(PORT, ADDR)
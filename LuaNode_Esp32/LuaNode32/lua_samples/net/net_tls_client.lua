@@ -0,0 +1,18 @@
+-- An HTTPS request over a secure net socket. Without a ca the server's
+-- certificate isn't checked; fragment asks for small records, where the
+-- server supports that.
+
+HOST = "example.com";
+
+local sock = net.createConnection(net.TCP, {secure = true, fragment = 2048})
+sock:on("connection", function(sock)
+  -- Runs once the TLS handshake is through
+  sock:send("GET / HTTP/1.1\r\nHost: " .. HOST .. "\r\nConnection: close\r\n\r\n")
+end)
+sock:on("receive", function(sock, data)
+  print(data)
+end)
+sock:on("disconnection", function(sock)
+  print("done")
+end)
+sock:connect(443, HOST)
@@ -0,0 +1,11 @@
+-- Where boot time goes
+-- Prints each phase of app_main, from reset. With CONFIG_BOOT_FAST the
+-- nvs and tcpip phases run alongside fs and lua, and "wait" is how long
+-- the message pump still had to wait for them.
+
+local phases, total = node.bootprofile()
+for _, p in ipairs(phases) do
+  print(string.format("%-8s at %7d us, took %s", p.name, p.start_us,
+    p.us and (p.us .. " us") or "(running)"))
+end
+print(string.format("message pump started at %d us", total))
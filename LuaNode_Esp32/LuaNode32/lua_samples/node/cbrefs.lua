@@ -0,0 +1,18 @@
+-- Callback references held by modules
+-- Every 30 s, how many callbacks net, tmr, mqtt and thread hold. A live
+-- count that keeps growing is a leak, most often sockets that are never
+-- closed; the functions still held then show where they were defined.
+
+local last = {};
+
+tmr.alarm(3, 30000, tmr.ALARM_AUTO, function()
+  for name, t in pairs(node.cbrefs()) do
+    print(name, "live", t.live, "hwm", t.hwm, "slots", t.slots);
+    if last[name] and t.live > last[name] + 20 then
+      for _, r in ipairs(node.cbrefs(name)) do
+        print("", r.ref, r.type, r.where or "");
+      end
+    end
+    last[name] = t.live;
+  end
+end);
@@ -0,0 +1,37 @@
+-- CPU clock scaling
+-- Measures the same work at each clock, then shows a boost around a burst
+-- with the clock otherwise left low. Needs CONFIG_PM_ENABLE.
+
+-- string building and hashing, roughly what encoding a JSON reply costs
+local function work()
+  local t = {}
+  for i = 1, 2000 do
+    t[#t + 1] = string.format('{"id":%d,"v":%q}', i, tostring(i * 7))
+  end
+  return #table.concat(t, ",")
+end
+
+local function measure()
+  local t0 = tmr.now()
+  local bytes = 0
+  for i = 1, 5 do bytes = bytes + work() end
+  local us = tmr.now() - t0
+  return bytes * 1000 / us, us
+end
+
+for _, mhz in ipairs({ node.CPU80MHZ, node.CPU160MHZ, node.CPU240MHZ }) do
+  node.setcpufreq(mhz)
+  collectgarbage()
+  local kbps, us = measure()
+  print(string.format("%3d MHz: %6d us, %5d KB/s", node.getcpufreq(), us, kbps))
+end
+
+-- low clock for the rest of the time, full clock only for the burst
+node.setcpufreq(node.CPU80MHZ)
+node.cpuboost(true)
+local kbps = measure()
+node.cpuboost(false)
+print(string.format("boosted: %5d KB/s, back at %d MHz", kbps, node.getcpufreq()))
+
+-- or let the SDK drop the clock whenever nothing runs
+node.setcpufreq(node.CPUAUTO)
@@ -0,0 +1,12 @@
+-- Heap fragmentation check
+-- free says how much is left, largest whether a buffer of a given size
+-- can still be had.
+
+local h = node.heapinfo()
+print("free", h.free, "largest", h.largest, "min ever", h.minfree, "lua", h.lua)
+for _, k in ipairs({"internal", "dma", "psram"}) do
+  print(k, h[k].free, h[k].largest)
+end
+
+-- A line every 10 s, marked LOW once no 4 KB block is left
+node.heapinfo(10000, 4096)
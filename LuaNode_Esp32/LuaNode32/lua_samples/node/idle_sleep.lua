@@ -0,0 +1,13 @@
+-- Idle light sleep
+-- Between tmr deadlines the chip sleeps, with WiFi in modem sleep. A
+-- button on GPIO 0, pulling it low, and UART0 input wake it early too.
+-- Needs CONFIG_PM_ENABLE and CONFIG_FREERTOS_USE_TICKLESS_IDLE.
+
+node.idlesleep(true, { [0] = 0 });
+
+-- the same periodic work as without sleep, drawing far less in between
+tmr.alarm(0, 5000, tmr.ALARM_AUTO, function()
+  local s = node.taskstats();
+  print("slept " .. s.sleeps .. " times, woke in " .. s.wake_avg_us ..
+        " us on average, " .. s.wake_max_us .. " us at most");
+end);
@@ -0,0 +1,25 @@
+-- Instruction budget for callbacks
+-- Each callback the event loop runs gets 50000 Lua instructions; one that
+-- goes over prints a traceback. Once a minute, the handlers that went
+-- over are listed along with their run times from tasktiming().
+
+node.luabudget(50000, "warn");
+
+-- a callback that takes too long now and then, as the time makes it
+tmr.alarm(1, 2000, tmr.ALARM_AUTO, function()
+  local s = 0;
+  for i = 1, 1000 + tmr.now() % 29000 do s = s + i end
+end);
+
+tmr.alarm(2, 60000, tmr.ALARM_AUTO, function()
+  local timing = {};
+  for _, t in ipairs(node.tasktiming()) do timing[t.handle] = t end
+  for _, s in ipairs(node.luastats(true)) do
+    if s.over > 0 then
+      local t = timing[s.handle];
+      print((t and t.name or s.handle) .. ": " .. s.over .. " of " .. s.runs ..
+            " runs over, at most " .. s.max .. " instructions" ..
+            (t and (", " .. t.run_max_us .. " us") or ""));
+    end
+  end
+end);
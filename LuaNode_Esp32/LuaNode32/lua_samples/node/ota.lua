@@ -0,0 +1,29 @@
+-- Firmware update over HTTP
+-- The image goes from the socket straight into the free app slot; Lua
+-- never sees the data. With target = "lfs" the same thing replaces the
+-- Lua Flash Store instead, and commit() restarts by itself.
+
+HOST = "192.168.1.100";
+PORT = 8000;
+PATH = "/LuaNode32.bin";
+SHA256 = nil;   -- hex digest of the image, from sha256sum
+
+print("running from", node.ota.info())
+
+local u = node.ota.begin{ target = "app", sha256 = SHA256 }
+local sock = net.createConnection(net.TCP, 0)
+sock:on("connection", function(sock)
+  u:attach(sock, function(u, ok, err)
+    sock:close()
+    if not ok then
+      print("update failed:", err)
+      u:abort()
+      return
+    end
+    print("image verified, sha256", select(2, u:finish()))
+    u:commit()
+    node.restart()
+  end, true)
+  sock:send("GET " .. PATH .. " HTTP/1.0\r\nHost: " .. HOST .. "\r\n\r\n")
+end)
+sock:connect(PORT, HOST)
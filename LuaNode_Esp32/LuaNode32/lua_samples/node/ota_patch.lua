@@ -0,0 +1,26 @@
+-- Script update by patch over HTTP
+-- Make the patch on the host against the init.lua the device has now:
+--   python tools/mkpatch.py -o init.patch old/init.lua init.lua
+-- A device with any other init.lua refuses it, and the file is only
+-- replaced once the patched result matches the new version.
+
+HOST = "192.168.1.100";
+PORT = 8000;
+PATH = "/init.patch";
+
+local u = node.ota.begin{ target = "patch", file = "init.lua" }
+local sock = net.createConnection(net.TCP, 0)
+sock:on("connection", function(sock)
+  u:attach(sock, function(u, ok, err)
+    sock:close()
+    if not ok or not u:finish() then
+      print("patch failed:", err or select(2, u:finish()))
+      u:abort()
+      return
+    end
+    u:commit()
+    print("init.lua updated")
+  end, true)
+  sock:send("GET " .. PATH .. " HTTP/1.0\r\nHost: " .. HOST .. "\r\n\r\n")
+end)
+sock:connect(PORT, HOST)
@@ -0,0 +1,14 @@
+-- Console output to a telnet client
+-- Output is buffered and sent in chunks; with overflow = "drop" a slow
+-- client loses the oldest lines instead of slowing everything down.
+
+srv = net.createServer(net.TCP)
+srv:listen(23, function(c)
+  node.output(c, 0, { size = 4096, overflow = "drop" })
+  c:on("receive", function(c, l) node.input(l) end)
+  c:on("disconnection", function(c) node.output(nil) end)
+  print("Welcome to LuaNode")
+end)
+
+-- Or keep a log on flash as well as on serial:
+-- node.output("console.log", 1)
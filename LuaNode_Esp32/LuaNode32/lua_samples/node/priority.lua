@@ -0,0 +1,31 @@
+-- Callback priorities
+-- A control loop's timer and its sensor's edges go through the high
+-- queue, so they run ahead of a busy log upload going through low. With
+-- CONFIG_TASK_AGING_MS set, what waits in low for longer than that still
+-- runs then; "aged" counts how often that happened.
+
+local SENSOR = 4
+
+-- the control loop, every 10 ms
+tmr.alarm(1, 10, tmr.ALARM_AUTO, function()
+  -- read, compute, drive the output
+end, node.PRIO_HIGH);
+
+gpio.mode(SENSOR, gpio.INPUT);
+gpio.trig(SENSOR, "up", function(level, when)
+  -- timestamp the edge
+end, { prio = node.PRIO_HIGH });
+
+-- everything of this socket, connection to disconnection, goes low
+local sk = net.createConnection(net.TCP, 0);
+sk:on("connection", function(s)
+  s:send(string.rep("log line\n", 500));
+end, { prio = node.PRIO_LOW });
+sk:connect(8080, "192.168.1.10");
+
+tmr.alarm(2, 10000, tmr.ALARM_AUTO, function()
+  local s = node.taskstats();
+  for _, q in ipairs({"high", "medium", "low"}) do
+    print(q, "waiting", s[q].waiting, "hwm", s[q].hwm, "aged", s[q].aged);
+  end
+end);
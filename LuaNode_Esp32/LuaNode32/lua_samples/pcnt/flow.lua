@@ -0,0 +1,25 @@
+-- A flow meter on GPIO 34 giving 450 pulses a litre, and a quadrature
+-- encoder on GPIO 25 (A) and 26 (B).
+
+local PULSES_PER_LITRE = 450
+
+-- The meter's reed contact bounces, so anything under 5 us is dropped
+local flow = pcnt.setup(0, 34, {filter = 5000})
+
+-- Litres a minute, from the pulses of each second
+flow:freq(1000, function(p, hz)
+  print(string.format("flow: %.2f l/min", hz * 60 / PULSES_PER_LITRE))
+end)
+
+-- A word every 10 litres
+flow:watch(10 * PULSES_PER_LITRE, function(p, count)
+  print(string.format("flow: %d l in all", count / PULSES_PER_LITRE))
+end)
+
+-- Rising edges of A count up, falling ones down, and B being low turns
+-- that round: one count per edge of A in the direction turned
+local enc = pcnt.setup(1, 25, {ctrl = 26, rising = "up", falling = "down", ctrl_low = "reverse", filter = 1000})
+
+tmr.alarm(0, 200, tmr.ALARM_AUTO, function()
+  print("encoder: " .. enc:count())
+end)
@@ -0,0 +1,14 @@
+-- profiler
+-- Samples the Lua stack every 10 ms and writes folded stacks, one
+-- "frame;frame;frame count" line each, for flamegraph.pl or speedscope.
+
+profiler.start({period = 10, depth = 16});
+
+-- ... run the application for a while, then:
+tmr.alarm(0, 30000, tmr.ALARM_SINGLE, function()
+  profiler.stop();
+  local samples, idle, dropped = profiler.stats();
+  print("samples", samples, "idle", idle, "dropped", dropped);
+  profiler.dump("profile.folded");
+  profiler.reset();
+end)
@@ -0,0 +1,27 @@
+-- Fades run by the LEDC, no timers or Lua code while the duty ramps
+-- An RGB LED on D5, D6 and D7
+
+local R, G, B = 5, 6, 7
+
+for _, pin in ipairs({R, G, B}) do
+  pwm.setup(pin, 1000, 0)
+end
+pwm.start()
+
+-- red up over a second, then back down, then hand over to the loop below
+pwm.fade(R, 1023, 1000, function(pin)
+  pwm.fade(pin, 0, 500, function()
+    print("red done")
+
+    -- green breathes for ever: up, hold, down, hold
+    pwm.sequence(G, {{1023, 1500}, {1023, 200}, {0, 1500}, {0, 800}}, true)
+
+    -- blue blinks three times and reports back
+    pwm.sequence(B, {{1023, 0}, {1023, 200}, {0, 0}, {0, 200},
+                     {1023, 0}, {1023, 200}, {0, 0}, {0, 200},
+                     {1023, 0}, {1023, 200}, {0, 0}},
+      function() print("blue done") end)
+  end)
+end)
+
+-- pwm.stopfade(G) leaves green wherever it has got to
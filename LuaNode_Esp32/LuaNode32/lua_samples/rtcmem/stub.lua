@@ -0,0 +1,20 @@
+-- Battery sensor that only boots when the reading moves
+-- The wake stub reads ADC1 channel 0 (GPIO36) every 10 s without booting,
+-- and lets the chip boot once the reading leaves 1800-2300, or every 360
+-- wakes (an hour) regardless, to report in. init.lua runs on those boots.
+
+local info = rtcmem.stubinfo()
+local state = rtcmem.load() or { boots = 0 }
+state.boots = state.boots + 1
+
+if info.reason then
+  print(string.format("boot %d: %s after %d wakes, last reading %d",
+    state.boots, info.reason, info.wakes, info.last or -1))
+  -- send info.samples somewhere here
+else
+  print("cold boot")
+end
+
+rtcmem.save(state)
+rtcmem.stub({ chan = 0, low = 1800, high = 2300, every = 10000000, boot_after = 360 })
+node.dsleep(10000000)
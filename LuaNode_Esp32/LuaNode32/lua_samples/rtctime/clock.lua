@@ -0,0 +1,19 @@
+-- Set the clock over SNTP once WiFi is up, then stamp log lines with
+-- local time.
+
+rtctime.tz(-60, false)          -- CET, one hour east of UTC
+rtctime.sntp_sync()
+
+local function log(msg)
+  print(rtctime.format("%F %T.%f ") .. msg)
+end
+
+local t = tmr.create()
+t:alarm(1000, tmr.ALARM_AUTO, function()
+  if rtctime.synced() then
+    t:unregister()
+    log("clock set")
+    print(rtctime.format())     -- RFC 3339, e.g. 2017-03-02T22:44:00.250000+01:00
+    print(rtctime.parse("2017-03-02T22:44:00Z"))
+  end
+end)
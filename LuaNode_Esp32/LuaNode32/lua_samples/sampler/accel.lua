@@ -0,0 +1,30 @@
+-- Read an MPU6050 accelerometer at 200 Hz and print one average per
+-- block of 50 readings. The reads happen in C; Lua only sees the blocks.
+-- SDA on GPIO 21, SCL on GPIO 22
+
+local ADDR = 0x68
+
+i2c.setup(0, 21, 22, i2c.FAST)
+i2c.write(0, ADDR, {0x6B, 0})           -- wake up
+
+local function s16(hi, lo)
+  local v = hi * 256 + lo
+  return v >= 32768 and v - 65536 or v
+end
+
+local job = sampler.i2c({addr = ADDR, reg = 0x3B, len = 6, period = 5, block = 50},
+  function(data, times, lost)
+    local x, y, z = 0, 0, 0
+    for i = 1, #times do
+      local o = (i - 1) * 6
+      local b1, b2, b3, b4, b5, b6 = data:byte(o + 1, o + 6)
+      x = x + s16(b1, b2)
+      y = y + s16(b3, b4)
+      z = z + s16(b5, b6)
+    end
+    local n = #times
+    print(string.format("%d us: %d %d %d (%d lost)",
+      times[n] - times[1], x / n, y / n, z / n, lost))
+  end)
+
+-- sampler.stop(job) ends it
@@ -0,0 +1,40 @@
+-- Scheduler test
+-- Every task is a coroutine run from the event loop. Sleeping or waiting
+-- for data yields, so the other tasks and the callbacks keep running,
+-- and a blinker costs a coroutine rather than a FreeRTOS task.
+
+PORT = 8181
+ADDR = "192.168.99.218"
+
+for i = 1, 3 do
+  sched.spawn(function(n)
+    for k = 1, 5 do
+      tmr.delay_ms(n * 200);   -- yields inside a task
+      print("task " .. n .. " tick " .. k);
+    end
+  end, i);
+end
+
+-- Reads run like blocking code, but only this task waits for the data
+sched.spawn(function()
+  local conn = net.createConnection(net.TCP, 0);
+  conn:connect(PORT, ADDR);
+  sched.sleep(1000);
+  conn:send("hello\n");
+  while true do
+    local data = conn:receive();
+    if data == nil then break end   -- closed
+    print("got " .. data);
+  end
+  print("connection closed");
+end);
+
+-- Any callback can hand values to a task waiting in sched.wait()
+waiter = sched.spawn(function()
+  print("button", sched.wait());
+end);
+tmr.alarm(0, 3000, tmr.ALARM_SINGLE, function()
+  sched.wake(waiter, "pressed");
+end);
+
+print(sched.count() .. " tasks");
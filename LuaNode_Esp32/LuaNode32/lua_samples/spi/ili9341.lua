@@ -0,0 +1,22 @@
+-- Bring up an ILI9341 320x240 display on VSPI and draw colour bars.
+-- SCLK on GPIO 18, MOSI on GPIO 23, CS on GPIO 5, DC on GPIO 2;
+-- tie RESET high.
+
+local W, H = 240, 320
+
+spi.setup(spi.VSPI, {sclk = 18, mosi = 23, cs = 5, dc = 2, clock = 40000000})
+
+spi.command(spi.VSPI, 0x01)                     -- software reset
+tmr.delay_us(150000)
+spi.command(spi.VSPI, 0x11)                     -- out of sleep
+tmr.delay_us(120000)
+spi.command(spi.VSPI, 0x3A, string.char(0x55))  -- 16 bit pixels
+spi.command(spi.VSPI, 0x36, string.char(0x48))  -- BGR, portrait
+spi.command(spi.VSPI, 0x29)                     -- display on
+
+-- One band of 40 rows per blit, big endian RGB565
+local colours = {0xF800, 0x07E0, 0x001F, 0xFFE0, 0x07FF, 0xF81F, 0xFFFF, 0x0000}
+for i, c in ipairs(colours) do
+  local band = string.rep(string.char((c - c % 256) / 256, c % 256), W * 40)
+  spi.blit(spi.VSPI, 0, (i - 1) * 40, W, 40, band)
+end
@@ -0,0 +1,36 @@
+-- Pool test
+-- thread.submit() hands a job to one of the pool's workers, which are
+-- started once and then stay. Jobs follow the rules of thread.worker():
+-- no upvalues, arguments and results are copies.
+
+count_primes = function(from, to)
+  local count = 0;
+  for i = from < 2 and 2 or from, to do
+    local prime = true;
+    local j = 2;
+    while j * j <= i do    -- up to the root, without math.sqrt
+      if i % j == 0 then prime = false; break end
+      j = j + 1;
+    end
+    if prime then count = count + 1 end
+  end
+  return count;
+end
+
+-- Split the range, the pool runs the parts side by side
+futures = {};
+for i = 0, 7 do
+  futures[#futures + 1] = thread.submit(count_primes, i * 5000 + 1, (i + 1) * 5000);
+end
+
+total = 0;
+for _, f in ipairs(futures) do
+  total = total + f:get();
+end
+print("primes below 40000: " .. total);
+
+-- Errors come back through get()
+bad = thread.submit("error('no luck')");
+if bad:wait(1000) then
+  print(pcall(bad.get, bad));
+end
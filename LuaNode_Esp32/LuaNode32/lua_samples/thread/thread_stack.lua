@@ -0,0 +1,22 @@
+-- Stack sizing test
+-- thread.list() shows the least stack each thread has had left (FREE).
+-- Threads that never come close to their stack can be started with a
+-- smaller one, as thread.start()'s third argument.
+
+blink = function()
+  while true do
+    gpio.write(2, 0);
+    tmr.delay(1);
+    gpio.write(2, 1);
+    tmr.delay(1);
+  end
+end
+
+th1 = thread.start(blink, -1, 4096);
+tmr.delay(5);
+thread.list();
+
+for _, t in ipairs(thread.list("*t")) do
+  print(t.thid, t.status, "stack " .. t.stack, "free " .. (t.stack_free or "?"),
+        "mem " .. (t.mem or "shared"));
+end
@@ -0,0 +1,41 @@
+-- Synchronisation test
+-- Mutexes, semaphores, events and atomic counters block in FreeRTOS
+-- instead of polling with thread.sleepms(). Like channels, they can be
+-- passed to workers and pool jobs.
+
+hits = thread.atomic();
+ready = thread.event();
+slots = thread.semaphore(2);   -- two jobs in the critical part at a time
+lock = thread.mutex();
+log = thread.channel(32);
+
+job = function(n, hits, ready, slots, lock, log)
+  ready:wait();                -- all start together
+  for i = 1, 100 do hits:add() end
+  slots:take();
+  lock:lock();
+  log:send("job " .. n .. " has the lock");
+  lock:unlock();
+  slots:give();
+  return n;
+end
+
+futures = {};
+for n = 1, 4 do
+  futures[n] = thread.submit(job, n, hits, ready, slots, lock, log);
+end
+ready:set();
+
+for n = 1, 4 do futures[n]:get() end
+print("hits: " .. hits:get());   -- 400
+while log:count() > 0 do print(log:receive()) end
+
+-- A recursive mutex can be taken again by its holder; lock() with a
+-- timeout gives up instead of waiting forever
+rlock = thread.mutex(true);
+rlock:lock();
+rlock:lock();
+held = thread.submit(function(rlock) return rlock:lock(100) end, rlock);
+print("other thread got it: " .. tostring(held:get()));   -- false
+rlock:unlock();
+rlock:unlock();
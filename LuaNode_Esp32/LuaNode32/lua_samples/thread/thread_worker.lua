@@ -0,0 +1,42 @@
+-- Worker test
+-- A worker runs in a Lua state of its own, so it can use the other core
+-- while the main state carries on. It gets copies of its arguments, and
+-- channels to talk back through.
+
+jobs = thread.channel();
+results = thread.channel(16);
+
+-- no upvalues: everything the worker needs comes in as arguments
+sum_primes = function(jobs, results)
+  while true do
+    local n = jobs:receive();
+    if n == 0 then break end
+    local count = 0;
+    for i = 2, n do
+      local prime = true;
+      local j = 2;
+      while j * j <= i do    -- worker states open no math library
+        if i % j == 0 then prime = false; break end
+        j = j + 1;
+      end
+      if prime then count = count + 1 end
+    end
+    results:send({n = n, primes = count});
+  end
+end
+
+th1 = thread.worker(sum_primes, 1, jobs, results);
+
+for _, n in ipairs({1000, 5000, 20000}) do
+  jobs:send(n);
+end
+jobs:send(0);
+
+-- poll from a timer, a receive without timeout would hold up the main state
+tmr.register(0, 100, tmr.ALARM_AUTO, function()
+  local r = results:receive(0);
+  if r then
+    print(r.primes .. " primes up to " .. r.n);
+  end
+end);
+tmr.start(0);
@@ -0,0 +1,23 @@
+-- Hardware timer test
+-- tmr.hw() runs off a timer group timer rather than the FreeRTOS tick, so
+-- its period can be well under a millisecond. The interrupt only counts;
+-- the callback runs on the Lua task and gets how many periods went by.
+
+total = 0;
+calls = 0;
+id = tmr.hw(250, function(n)
+  total = total + n;
+  calls = calls + 1;
+end);
+
+-- stop it after a second: total should be about 4000
+tmr.alarm(0, 1000, tmr.ALARM_SINGLE, function()
+  tmr.hwstop(id);
+  print("periods " .. total .. " in " .. calls .. " calls");
+end);
+
+-- time a short sleep with the cycle counter
+local c0, mhz = tmr.ccount();
+tmr.delayus(500);
+local c1 = tmr.ccount();
+print("delayus(500) took " .. ((c1 - c0) % 0x80000000) / mhz .. " us");
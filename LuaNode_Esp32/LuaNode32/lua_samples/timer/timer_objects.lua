@@ -0,0 +1,37 @@
+-- Timer object test
+-- tmr.create() timers have no fixed limit: they all wait in one timer
+-- wheel behind a single os_timer. An armed timer stays alive without a
+-- reference; once it's stopped or has gone off for good it's collected.
+
+-- one timeout per request, most of them cancelled when the reply comes
+pending = {};
+function request(id)
+  local t = tmr.create();
+  t:alarm(2000, tmr.ALARM_SINGLE, function()
+    print("request " .. id .. " timed out");
+    pending[id] = nil;
+  end);
+  pending[id] = t;
+end
+
+function reply(id)
+  if pending[id] then
+    pending[id]:unregister();
+    pending[id] = nil;
+  end
+end
+
+for id = 1, 200 do request(id) end
+for id = 1, 200 do
+  if id % 10 ~= 0 then reply(id) end   -- every tenth one times out
+end
+
+-- a repeating one that stops itself
+ticks = 0;
+heartbeat = tmr.create();
+heartbeat:register(500, tmr.ALARM_AUTO, function(t)
+  ticks = ticks + 1;
+  if ticks == 10 then heartbeat:unregister() end
+end);
+heartbeat:start();
+print(heartbeat:state());
@@ -0,0 +1,28 @@
+-- A temperature series: ten minutes of samples, a day of hourly rollups,
+-- the rollups kept in the flash log across reboots. Samples take the
+-- clock's time, so set it first (see the rtctime samples).
+
+local temp = tseries.new(60, { minutes = 120, hours = 24, persist = "temp" })
+print("restored", temp:restore())
+
+local n = 0
+local t = tmr.create()
+t:register(10000, tmr.ALARM_AUTO, function()
+  temp:add(adc.read(0) * 0.1)
+  n = n + 1
+
+  local lo, hi, avg = temp:stats(60)
+  print(string.format("last minute %.1f .. %.1f, avg %.1f", lo, hi, avg))
+
+  -- every ten minutes, send what came in since the last upload
+  if n % 60 == 0 then
+    local buf = temp:encode("minute", rtctime.get() - 600)
+    -- socket:send(buf)
+    print("upload", #buf, "bytes")
+  end
+end)
+t:start()
+
+for _, r in ipairs(temp:rollups("hour", 6)) do
+  print(rtctime.format("%H:%M", r.t), r.min, r.max, r.avg)
+end
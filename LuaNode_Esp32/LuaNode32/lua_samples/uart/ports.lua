@@ -0,0 +1,21 @@
+-- GPS on UART1 and an RS-485 bus on UART2, next to the console on UART0
+-- Each port has its own buffers and callbacks.
+
+-- NMEA sentences, one line at a time
+uart.setup(1, 9600, 8, uart.PARITY_NONE, uart.STOPBITS_1, {tx = 17, rx = 16})
+uart.on(1, "data", "\n", function(line)
+  if line:sub(1, 6) == "$GPGGA" then
+    print(line)
+  end
+end)
+
+-- Modbus-style frames of 8 bytes; DE on GPIO 4 is raised while sending
+-- and dropped by the driver once the last byte has left
+uart.setup(2, 19200, 8, uart.PARITY_EVEN, uart.STOPBITS_1, {tx = 25, rx = 26, de = 4})
+uart.on(2, "data", 8, function(frame)
+  print("rs485", frame:byte(1, -1))
+end)
+
+tmr.alarm(0, 1000, tmr.ALARM_AUTO, function()
+  uart.write(2, "\1\3\0\0\0\1\132\10")
+end)
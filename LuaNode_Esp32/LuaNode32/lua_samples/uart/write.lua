@@ -0,0 +1,20 @@
+-- Streaming over the UART without stalling the event loop
+-- uart.write() queues and returns; it returns false once the queue is
+-- past its high-water mark, and "sent" says when it has drained.
+
+local line = string.rep("x", 63) .. "\n"
+local left = 200
+
+local function pump()
+  while left > 0 do
+    left = left - 1
+    if not uart.write(0, line) then
+      return              -- carried on from "sent"
+    end
+  end
+  uart.on("sent", nil)
+  print("done")
+end
+
+uart.on("sent", pump)
+pump()
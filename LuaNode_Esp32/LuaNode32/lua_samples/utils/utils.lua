@@ -3,4 +3,16 @@ print(utils.leapyear(2016))	-- is the input year leap year?
 
 str = "hello"
 encodeStr = utils.base64_encode(str)
-decodeStr = utils.base64_decode(encodeStr)
\ No newline at end of file
+decodeStr = utils.base64_decode(encodeStr)
+-- Encode a file a chunk at a time, writing the text to another file
+enc = utils.base64_encoder()
+src = file.open("image.jpg", "r")
+dst = file.open("image.b64", "w")
+while true do
+  chunk = src:read(1024)
+  if not chunk then break end
+  dst:write(enc:update(chunk))
+end
+dst:write(enc:finish())
+src:close()
+dst:close()
@@ -0,0 +1,21 @@
+-- Connects to a WebSocket server, sends a message and closes once the
+-- echo is back.
+
+HOST = "192.168.1.100";
+PORT = 8080;
+
+local sock = net.createConnection(net.TCP, 0)
+sock:on("connection", function(sock)
+  local ws = websocket.client(sock, HOST, "/echo")
+  ws:on("open", function(ws)
+    ws:send("ping from the esp32")
+  end)
+  ws:on("message", function(ws, msg)
+    print("got", msg)
+    ws:close()
+  end)
+  ws:on("close", function(ws, code)
+    print("closed", code)
+  end)
+end)
+sock:connect(PORT, HOST)
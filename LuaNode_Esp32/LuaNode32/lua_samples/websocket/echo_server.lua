@@ -0,0 +1,26 @@
+-- A WebSocket echo server. The socket's first data is the upgrade
+-- request; from then on the websocket has the connection and only
+-- whole messages come through.
+
+PORT = 8080;
+ADDR = "192.168.4.1";
+
+wifi.setmode(wifi.SOFTAP);
+wifi.start();
+
+tmr.delay(2);
+srv = net.createServer(net.TCP, 30);
+srv:listen(PORT, ADDR, function(sock)
+  sock:on("receive", function(sock, request)
+    local ws = websocket.server(sock, request)
+    ws:on("open", function(ws)
+      ws:send("hello")
+    end)
+    ws:on("message", function(ws, msg, binary)
+      ws:send(msg, binary)
+    end)
+    ws:on("close", function(ws, code, reason)
+      print("closed", code, reason)
+    end)
+  end)
+end)
@@ -0,0 +1,27 @@
+-- Reconnect quickly after deep sleep
+-- The first connect goes through DHCP and the lease is kept in RTC memory.
+-- Connects after waking reuse it, so sta_got_ip comes with the
+-- association and cached is true. Run from init.lua.
+
+local t0 = tmr.now()
+
+wifi.on("sta_got_ip", function(ev, info)
+  print(string.format("got %s in %d ms%s", info.ip, (tmr.now() - t0) / 1000,
+    info.cached and " (cached lease)" or ""))
+  -- do the work here, then sleep for a minute
+  node.dsleep(60000000)
+end)
+
+wifi.on("sta_disconnected", function(ev, info)
+  print("disconnected, reason " .. info.reason)
+end)
+
+local c = wifi.sta.fastcache()
+if c then
+  print(string.format("reusing %s from %s on channel %d, use %d",
+    c.ip, c.bssid, c.channel, c.uses + 1))
+end
+
+wifi.setmode(wifi.STATION)
+wifi.start()
+wifi.sta.config({ssid="newifi_doit3305", pwd="doit3305"})
@@ -0,0 +1,23 @@
+-- Scanning for APs
+-- The first scan lists the strong APs on the usual channels. The second
+-- streams the APs whose SSID starts with "office-" to the callback one at
+-- a time, with nil at the end.
+
+wifi.setmode(wifi.STATION)
+wifi.start()
+
+wifi.sta.scan({ channels = {1, 6, 11}, rssi = -75 }, function(aps)
+  for _, ap in ipairs(aps) do
+    print(string.format("%-32s %s ch %2d %d dBm", ap.ssid, ap.bssid, ap.channel, ap.rssi))
+  end
+
+  local n = 0
+  wifi.sta.scan({ prefix = "office-", stream = true }, function(ap)
+    if ap then
+      n = n + 1
+      print("found " .. ap.ssid .. " at " .. ap.rssi .. " dBm")
+    else
+      print(n .. " office APs")
+    end
+  end)
+end)
@@ -0,0 +1,23 @@
+-- Site survey on one channel
+-- Counts management and data frames on channel 6 every 2 s and lists the
+-- busiest transmitters. Beacons (subtype 8) and probe requests (4) of the
+-- last interval could be kept too, with ring = 16 and subtypes = {4, 8}.
+
+wifi.setmode(wifi.STATION)
+wifi.start()
+
+wifi.sniff({ channel = 6, types = {"mgmt", "data"}, rssi = -85, interval = 2000 },
+  function(s)
+    print(string.format("%d of %d frames, %d bytes, mgmt %d data %d, rssi %s",
+      s.frames, s.seen, s.bytes, s.mgmt, s.data, s.rssi or "-"))
+    local macs = {}
+    for mac, m in pairs(s.macs) do
+      macs[#macs + 1] = { mac = mac, frames = m.frames, rssi = m.rssi }
+    end
+    table.sort(macs, function(a, b) return a.frames > b.frames end)
+    for i = 1, #macs < 5 and #macs or 5 do
+      print(string.format("  %s %5d frames %d dBm", macs[i].mac, macs[i].frames, macs[i].rssi))
+    end
+  end)
+
+-- wifi.sniff(nil) stops
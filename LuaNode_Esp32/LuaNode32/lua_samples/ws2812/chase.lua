@@ -0,0 +1,24 @@
+-- A comet running round a 60 LED strip on GPIO 18
+-- Each frame is built in C while the previous one is still going out
+
+local LEDS = 60
+
+ws2812.init(18)
+local buf = buffer.new(LEDS * 3)
+
+-- a white head, and a tail that gets dimmer each frame
+local function frame()
+  ws2812.fade(buf, 160)
+  ws2812.shift(buf, 1, true)
+  buf:setu8(1, 255)   -- G
+  buf:setu8(2, 255)   -- R
+  buf:setu8(3, 255)   -- B
+  ws2812.write(buf)
+end
+
+tmr.alarm(0, 20, tmr.ALARM_AUTO, frame)
+
+-- all green, and say when it is actually lit
+-- tmr.stop(0)
+-- ws2812.fill(buf, 255, 0, 0)
+-- ws2812.write(buf, function() print("green") end)
@@ -0,0 +1,27 @@
+-- Compressing and decompressing, in one go or a chunk at a time
+
+local text = string.rep('{"sensor":"t1","value":21.5}\n', 50)
+
+-- In one go; decompress tells zlib from gzip by itself
+local z = zlib.compress(text)
+print(#text, "->", #z)
+assert(zlib.decompress(z) == text)
+
+-- A whole file, without the data passing through Lua; gzip output can be
+-- served as is with "Content-Encoding: gzip"
+local f = file.open("log.txt", "w")
+f:write(text)
+f:close()
+print(zlib.compressfile("log.txt", "log.txt.gz", "gzip"))
+print(zlib.decompressfile("log.txt.gz", "log2.txt"))
+
+-- Streaming: the deflater keeps a 1 KB window here, about 5 KB of RAM.
+-- "sync" sends everything so far, e.g. at the end of a message on a
+-- connection; the receiver's inflater picks up where it left off.
+local d = zlib.deflate("zlib", 6, 10)
+local i = zlib.inflate()
+for n = 1, 3 do
+  local out, done = i:write(d:write("message " .. n .. "\n", "sync"))
+  print(out, done)
+end
+print(i:write(d:finish()))
@@ -3,6 +3,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "my_uart.h"
 #include "lua.h"
 #include "flash_fs.h"
@@ -15,10 +16,26 @@
 #include "task/task.h"
 #include "nodemcu_esp_event.h"
 #include "pthreadx.h"
-#include "tmr.h"
+#include "platform_boot.h"
 
 extern nodemcu_esp_event_reg_t esp_event_cb_table;
 
+// app_main runs in the "main" task, which is pinned to core 0. When the
+// Lua task belongs elsewhere, the message pump gets a task of its own.
+#if defined(CONFIG_TASK_PUMP_CORE) && CONFIG_TASK_PUMP_CORE != 0 && !defined(CONFIG_FREERTOS_UNICORE)
+#define LUA_TASK_OWN 1
+#if CONFIG_TASK_PUMP_CORE < 0
+#define LUA_TASK_CORE tskNO_AFFINITY
+#else
+#define LUA_TASK_CORE CONFIG_TASK_PUMP_CORE
+#endif
+
+static void lua_task(void *pvParameters)
+{
+	task_pump_messages();
+}
+#endif
+
 static task_handle_t esp_event_task;
 static QueueHandle_t esp_event_queue;
 static task_handle_t input_task;
@@ -34,24 +51,30 @@ void init_task(void *pvParameters)
     vTaskDelete(NULL);
 }
 
-void led_blink(void) 
+static void boot_net_init(void)
 {
-	int res = platform_gpio_mode(2, 2);		// pin mode: OUTPUT
-	if(res < 0) {
-		printf("Led lightup failed\n");
-		return;
- 	}
-	platform_gpio_write(2, 1);	// led on
-	vTaskDelay(250/portTICK_RATE_MS);
-	platform_gpio_write(2, 0);	// led off
-	tmr_delay_msec(250);
-	platform_gpio_write(2, 1);
-	tmr_delay_msec(250);
-	platform_gpio_write(2, 0);
-	tmr_delay_msec(250);
-	platform_gpio_write(2, 1);
+	int phase = platform_boot_begin("nvs");
+	nvs_flash_init();
+	platform_boot_end(phase);
+
+	phase = platform_boot_begin("tcpip");
+	tcpip_adapter_init();
+	platform_boot_end(phase);
 }
 
+#ifdef CONFIG_BOOT_FAST
+// NVS goes through the flash driver's lock like the file system does, so
+// the two can start together. Lua needs both before it runs anything.
+static SemaphoreHandle_t boot_net_done;
+
+static void boot_net_task(void *pvParameters)
+{
+	boot_net_init();
+	xSemaphoreGive(boot_net_done);
+	vTaskDelete(NULL);
+}
+#endif
+
 esp_err_t esp_event_send (system_event_t *event)
 {
   if (!event)
@@ -69,7 +92,7 @@ esp_err_t esp_event_send (system_event_t *event)
 
   // If the task_post() fails, it only means the event gets delayed, hence
   // we claim OK regardless.
-  task_post_medium (esp_event_task, 0);
+  task_post_coalesced_medium (esp_event_task, 0);
   return ESP_OK;
 }
 
@@ -102,6 +125,7 @@ void app_main()
 	esp_event_queue =
     xQueueCreate (CONFIG_SYSTEM_EVENT_QUEUE_SIZE, sizeof (system_event_t));
   	esp_event_task = task_get_id (handle_esp_event);
+  	task_set_name (esp_event_task, "esp_event");
 
 	if(flash_safe_get_size_byte() != flash_rom_get_size_byte()) {
 		printf("Incorrect flash size reported, adjusting...\n");
@@ -110,6 +134,13 @@ void app_main()
 		return;
 	}
 
+#ifdef CONFIG_BOOT_FAST
+	boot_net_done = xSemaphoreCreateBinary();
+	xTaskCreatePinnedToCore(boot_net_task, "boot_net", 3072, NULL,
+		uxTaskPriorityGet(NULL), NULL, tskNO_AFFINITY);
+#endif
+
+	int phase = platform_boot_begin("fs");
 	printf ("Mounting flash filesystem...\n");
     if (!vfs_mount("/FLASH", 0)) {
         // Failed to mount -- try reformat
@@ -120,15 +151,34 @@ void app_main()
         }
         // Note that fs_format leaves the file system mounted
     }
-	
-	nvs_flash_init();
-	tcpip_adapter_init();
+	platform_boot_end(phase);
+
+#ifndef CONFIG_BOOT_FAST
+	boot_net_init();
+#endif
 
+	phase = platform_boot_begin("lua");
 	char *lua_argv[] = {(char *)"lua", (char *)"-i", NULL};
     lua_main(2, lua_argv);
+	platform_boot_end(phase);
 
 	_pthread_init();
-	led_blink();	// led flashing
+#ifdef CONFIG_BOOT_LED
+	platform_boot_led();	// led flashing
+#endif
+
+#ifdef CONFIG_BOOT_FAST
+	phase = platform_boot_begin("wait");
+	xSemaphoreTake(boot_net_done, portMAX_DELAY);
+	vSemaphoreDelete(boot_net_done);
+	platform_boot_end(phase);
+#endif
+	platform_boot_done();
+#ifdef LUA_TASK_OWN
+	xTaskCreatePinnedToCore(lua_task, "lua", CONFIG_MAIN_TASK_STACK_SIZE, NULL,
+		uxTaskPriorityGet(NULL), NULL, LUA_TASK_CORE);
+#else
 	task_pump_messages();
+#endif
 }
 
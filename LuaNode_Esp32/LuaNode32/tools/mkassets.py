@@ -0,0 +1,97 @@
+#!/usr/bin/env python
+#
+# Build a read-only asset image for the "assets" partition.
+#
+# The layout is the one components/platform/asset_store.c maps, all
+# numbers little endian uint32:
+#
+#   magic "LSA1", count, image size,
+#   count entries of { name offset, data offset, data size } sorted by name,
+#   then the NUL terminated names and the blobs, each blob followed by a
+#   NUL byte and padded to a 4 byte boundary.
+#
+# Inputs are files, named after their file name, or directories, whose
+# files are named by their path below the directory ("css/site.css"). A
+# name can also be given explicitly as name=path.
+#
+#   python tools/mkassets.py -o assets.img www/
+#   esptool.py write_flash 0x1C0000 assets.img
+#
+# The offset is that of partitions-LuaNode-stores.csv; the default table
+# has no assets partition.
+
+import argparse
+import os
+import struct
+import sys
+
+MAGIC = 0x3141534c
+HDR_FORMAT = '<III'
+ENT_FORMAT = '<III'
+ALIGN = 4
+DEFAULT_SIZE = 64 * 1024
+
+
+def collect(arg):
+    if '=' in arg:
+        name, path = arg.split('=', 1)
+        return [(name, path)]
+    if not os.path.isdir(arg):
+        return [(os.path.basename(arg), arg)]
+    found = []
+    for root, dirs, files in os.walk(arg):
+        dirs.sort()
+        for f in sorted(files):
+            path = os.path.join(root, f)
+            name = os.path.relpath(path, arg).replace(os.sep, '/')
+            found.append((name, path))
+    return found
+
+
+def pad(data):
+    return data + b'\0' * (-len(data) % ALIGN)
+
+
+def build(assets):
+    names = sorted(assets)
+    table_end = struct.calcsize(HDR_FORMAT) + len(names) * struct.calcsize(ENT_FORMAT)
+    blob = b''
+    entries = b''
+    for name in names:
+        name_at = table_end + len(blob)
+        blob = pad(blob + name + b'\0')
+        data = assets[name]
+        data_at = table_end + len(blob)
+        blob = pad(blob + data + b'\0')
+        entries += struct.pack(ENT_FORMAT, name_at, data_at, len(data))
+    size = table_end + len(blob)
+    return struct.pack(HDR_FORMAT, MAGIC, len(names), size) + entries + blob
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Build a read-only asset image')
+    parser.add_argument('inputs', nargs='+', help='[name=]file or directory')
+    parser.add_argument('-o', '--output', default='assets.img')
+    parser.add_argument('--size', type=lambda s: int(s, 0), default=DEFAULT_SIZE,
+                        help='partition size, the image is padded to it')
+    args = parser.parse_args()
+
+    assets = {}
+    for arg in args.inputs:
+        for name, path in collect(arg):
+            key = name.encode('utf-8')
+            if key in assets:
+                sys.exit('%s: asset given twice' % name)
+            with open(path, 'rb') as f:
+                assets[key] = f.read()
+
+    image = build(assets)
+    if len(image) > args.size:
+        sys.exit('image is %d bytes, the partition only holds %d' % (len(image), args.size))
+    with open(args.output, 'wb') as f:
+        f.write(image + b'\xff' * (args.size - len(image)))
+    print('%s: %d assets, %d of %d bytes' % (args.output, len(assets), len(image), args.size))
+
+
+if __name__ == '__main__':
+    main()
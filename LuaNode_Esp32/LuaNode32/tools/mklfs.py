@@ -0,0 +1,108 @@
+#!/usr/bin/env python
+#
+# Build a Lua Flash Store image for the "lfs" partition.
+#
+# Every input becomes one record named after the module require() asks
+# for, in the layout components/platform/lc_store.c reads:
+#
+#   uint32 magic "LCX1", uint32 size, uint32 checksum, char name[36],
+#   followed by the compiled chunk, padded to a 32 byte boundary.
+#
+# Inputs are compiled chunks, either .lc files saved by node.compile() or
+# .lua files run through a luac.cross built from components/lua with
+# LUA_CROSS_COMPILER (so that number type and sizes match the firmware).
+# A module can be named explicitly as name=path, otherwise the file name
+# without extension is used.
+#
+#   python tools/mklfs.py -o lfs.img --luac ./luac.cross lib/*.lua
+#   esptool.py write_flash 0x1A0000 lfs.img
+#
+# The offset is that of partitions-LuaNode-stores.csv; the default table
+# has no lfs partition.
+
+import argparse
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+MAGIC = 0x3158434c
+NAME_LEN = 36
+ALIGN = 32
+HDR_FORMAT = '<III%ds' % NAME_LEN
+LUA_SIGNATURE = b'\x1bLua'
+DEFAULT_SIZE = 128 * 1024
+
+
+def checksum(data):
+    h = 2166136261
+    for b in bytearray(data):
+        h = ((h ^ b) * 16777619) & 0xffffffff
+    return h
+
+
+def compile_lua(luac, path):
+    fd, out = tempfile.mkstemp(suffix='.lc')
+    os.close(fd)
+    try:
+        subprocess.check_call([luac, '-s', '-o', out, path])
+        with open(out, 'rb') as f:
+            return f.read()
+    finally:
+        os.remove(out)
+
+
+def load_chunk(path, luac):
+    if path.endswith('.lua'):
+        if not luac:
+            sys.exit('%s: .lua input needs --luac' % path)
+        return compile_lua(luac, path)
+    with open(path, 'rb') as f:
+        data = f.read()
+    if not data.startswith(LUA_SIGNATURE):
+        sys.exit('%s: not a compiled Lua chunk' % path)
+    return data
+
+
+def record(name, data):
+    hdr = struct.pack(HDR_FORMAT, MAGIC, len(data), checksum(data),
+                      name.encode('ascii'))
+    rec = hdr + data
+    pad = -len(rec) % ALIGN
+    return rec + b'\xff' * pad
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Build a Lua Flash Store image')
+    parser.add_argument('inputs', nargs='+', help='[module=]file.lc or file.lua')
+    parser.add_argument('-o', '--output', default='lfs.img')
+    parser.add_argument('--luac', help='luac.cross used to compile .lua inputs')
+    parser.add_argument('--size', type=lambda s: int(s, 0), default=DEFAULT_SIZE,
+                        help='partition size, the image is padded to it')
+    args = parser.parse_args()
+
+    image = b''
+    names = set()
+    for arg in args.inputs:
+        if '=' in arg:
+            name, path = arg.split('=', 1)
+        else:
+            path = arg
+            name = os.path.splitext(os.path.basename(path))[0]
+        if len(name) >= NAME_LEN:
+            sys.exit('%s: module name longer than %d characters' % (name, NAME_LEN - 1))
+        if name in names:
+            sys.exit('%s: module given twice' % name)
+        names.add(name)
+        image += record(name, load_chunk(path, args.luac))
+
+    if len(image) > args.size:
+        sys.exit('image is %d bytes, the partition only holds %d' % (len(image), args.size))
+    with open(args.output, 'wb') as f:
+        f.write(image + b'\xff' * (args.size - len(image)))
+    print('%s: %d modules, %d of %d bytes' % (args.output, len(names), len(image), args.size))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,128 @@
+#!/usr/bin/env python
+#
+# Make a patch that turns one version of a file into another, for
+# node.ota.begin{ target = "patch", file = name } to apply on the device
+# (components/platform/vfs_patch.c). The patch names the old version by
+# size and crc32, so it is refused by a device holding anything else, and
+# carries the sha256 of the new version, checked before the file is
+# replaced.
+#
+#   uint32 magic "LNP1", uint32 old size, uint32 old crc32,
+#   uint32 new size, uint8 new sha256[32], then ops:
+#
+#   0x01 uint32 offset, uint32 len   copy from the old file
+#   0x02 uint32 len, bytes           add literal bytes
+#   0x00                             end
+#
+# Matching is greedy against every offset of the old file, which suits
+# scripts and other files of up to a few hundred kilobytes.
+#
+#   python tools/mkpatch.py -o init.patch old/init.lua new/init.lua
+#   python tools/mkpatch.py -o init.patch /dev/null init.lua   (new file)
+
+import argparse
+import hashlib
+import struct
+import sys
+import zlib
+
+MAGIC = 0x31504e4c
+OP_END, OP_COPY, OP_ADD = 0, 1, 2
+KEY = 8             # bytes that must match to consider a copy
+MIN_COPY = 12       # shorter matches cost more than adding the bytes
+MAX_CANDIDATES = 32
+
+
+def index(old):
+    table = {}
+    for i in range(len(old) - KEY + 1):
+        table.setdefault(bytes(old[i:i + KEY]), []).append(i)
+    return table
+
+
+def diff(old, new):
+    table = index(old)
+    ops = []
+    lit = bytearray()
+    i = 0
+    while i < len(new):
+        best_len, best_at = 0, 0
+        for at in table.get(bytes(new[i:i + KEY]), [])[-MAX_CANDIDATES:]:
+            n = KEY
+            while i + n < len(new) and at + n < len(old) and new[i + n] == old[at + n]:
+                n += 1
+            if n > best_len:
+                best_len, best_at = n, at
+        if best_len >= MIN_COPY:
+            if lit:
+                ops.append((OP_ADD, bytes(lit)))
+                lit = bytearray()
+            ops.append((OP_COPY, best_at, best_len))
+            i += best_len
+        else:
+            lit.append(new[i])
+            i += 1
+    if lit:
+        ops.append((OP_ADD, bytes(lit)))
+    return ops
+
+
+def encode(old, new, ops):
+    out = [struct.pack('<IIII', MAGIC, len(old), zlib.crc32(old) & 0xffffffff, len(new)),
+           hashlib.sha256(new).digest()]
+    for op in ops:
+        if op[0] == OP_COPY:
+            out.append(struct.pack('<BII', OP_COPY, op[1], op[2]))
+        else:
+            out.append(struct.pack('<BI', OP_ADD, len(op[1])) + op[1])
+    out.append(struct.pack('<B', OP_END))
+    return b''.join(out)
+
+
+def apply(old, patch):
+    # What the device does, to check the patch before it goes anywhere
+    magic, old_size, old_crc, new_size = struct.unpack_from('<IIII', patch)
+    assert magic == MAGIC and old_size == len(old)
+    assert old_crc == zlib.crc32(old) & 0xffffffff
+    want = patch[16:48]
+    pos, new = 48, bytearray()
+    while True:
+        op = bytearray(patch[pos:pos + 1])[0]
+        pos += 1
+        if op == OP_END:
+            break
+        if op == OP_COPY:
+            at, n = struct.unpack_from('<II', patch, pos)
+            pos += 8
+            new += old[at:at + n]
+        else:
+            n, = struct.unpack_from('<I', patch, pos)
+            pos += 4
+            new += patch[pos:pos + n]
+            pos += n
+    assert len(new) == new_size and hashlib.sha256(bytes(new)).digest() == want
+    return bytes(new)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Make a file patch for node.ota')
+    parser.add_argument('old', help='version on the device, /dev/null for none')
+    parser.add_argument('new', help='version to turn it into')
+    parser.add_argument('-o', '--output', required=True)
+    args = parser.parse_args()
+
+    with open(args.old, 'rb') as f:
+        old = f.read()
+    with open(args.new, 'rb') as f:
+        new = f.read()
+    patch = encode(old, new, diff(bytearray(old), bytearray(new)))
+    if apply(old, patch) != new:
+        sys.exit('patch does not reproduce %s' % args.new)
+    with open(args.output, 'wb') as f:
+        f.write(patch)
+    print('%s: %d bytes for %d, sha256 %s' % (args.output, len(patch), len(new),
+                                               hashlib.sha256(patch).hexdigest()))
+
+
+if __name__ == '__main__':
+    main()
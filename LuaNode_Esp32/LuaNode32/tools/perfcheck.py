@@ -0,0 +1,295 @@
+#!/usr/bin/env python3
+#
+# Tells whether a firmware build got slower: flashes it, runs the
+# benchmarks of lua_samples/bench on the board and compares the results
+# with the baseline stored for that target.
+#
+# suite.lua covers the VM, tables, strings, GC pauses, JSON, SPIFFS, .lc
+# loading, task queue waits, the least free heap and the boot time to the
+# prompt; with --peer, net.lua adds TCP and UDP throughput, echoed by this
+# script from the address the board reaches it at. Both are copied to the
+# board and run with dofile(): through the console's upload mode (see
+# upload.py) on the ESP32, as file.writeline() calls typed into the REPL
+# with --target esp8266, which has no upload mode.
+#
+# Baselines are JSON, one per target as the build line of the run names it
+# (esp32, esp8266, host), in --baselines. Every result carries a tolerance
+# in percent, and being worse than the baseline by more than that is a
+# regression. --update makes the run the new baseline, keeping tolerances
+# edited by hand.
+#
+#   python3 tools/perfcheck.py -p /dev/ttyUSB0 --flash "make flash"
+#   python3 tools/perfcheck.py -p /dev/ttyUSB0 --peer 192.168.1.100 --update
+#   python3 tools/perfcheck.py -p /dev/ttyUSB1 --target esp8266
+#   python3 tools/perfcheck.py --host           # host/luanode-host
+#   python3 tools/perfcheck.py --log run.log    # results saved with --save
+#
+# Exits 0 if nothing regressed, 1 if something did and 2 if the run failed.
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import threading
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+BENCH = os.path.join(ROOT, 'lua_samples', 'bench')
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, BENCH)
+
+import compare      # noqa: E402
+import upload       # noqa: E402
+
+DONE = 'BENCH {"done":true}'
+PROMPT = b'> '
+BOOT_WAIT = 15      # s from flashing to the prompt
+IDLE_WAIT = 120     # s without output before a run is given up
+
+# tolerance in percent by name prefix or suffix; the worst cases of noisy
+# measurements move more than averages do
+DEFAULT_TOLERANCE = 5
+TOLERANCES = (
+    ('_max', 50),
+    ('_p99', 25),
+    ('net.', 15),
+    ('gc.', 15),
+    ('boot.', 10),
+    ('file.', 10),
+)
+
+
+class RunFailed(Exception):
+    pass
+
+
+def tolerance_for(name):
+    for part, tol in TOLERANCES:
+        if name.startswith(part) or name.endswith(part):
+            return tol
+    return DEFAULT_TOLERANCE
+
+
+def read_until(port, marker, idle):
+    """What the board prints up to and including marker"""
+    out = b''
+    last = time.time()
+    while marker not in out:
+        data = port.read(256)
+        if data:
+            out += data
+            last = time.time()
+        elif time.time() - last > idle:
+            raise RunFailed('no %r from the board after %d s' % (marker, idle))
+    return out
+
+
+def command(port, line, idle=IDLE_WAIT):
+    upload.empty_line(port)
+    port.write(line.encode('ascii') + b'\r')
+    return read_until(port, PROMPT, idle)
+
+
+def long_string(line):
+    level = 0
+    while ']' + '=' * level + ']' in line:
+        level += 1
+    return '[' + '=' * level + '[' + line + ']' + '=' * level + ']'
+
+
+def copy_by_repl(port, path, name):
+    """The file as one file.writeline() per line, for a console without
+    the upload mode"""
+    with open(path) as f:
+        lines = f.read().splitlines()
+    command(port, 'file.open(%s, "w")' % long_string(name))
+    for line in lines:
+        command(port, 'file.writeline(%s)' % long_string(line))
+    command(port, 'file.close()')
+    print('%s -> %s: %d lines' % (path, name, len(lines)))
+
+
+def copy(port, args, name):
+    path = os.path.join(BENCH, name)
+    if args.target == 'esp8266':
+        copy_by_repl(port, path, name)
+    else:
+        upload.upload(port, path, name, upload.FRAME - 1)
+
+
+def run_script(port, line):
+    upload.empty_line(port)
+    port.write(line.encode('ascii') + b'\r')
+    out = read_until(port, DONE.encode('ascii'), IDLE_WAIT)
+    text = out.decode('ascii', 'replace')
+    sys.stdout.write(text)
+    return text.splitlines()
+
+
+def start_peer(port):
+    import echo_peer
+    for fn in (echo_peer.tcp_echo, echo_peer.udp_echo):
+        threading.Thread(target=fn, args=(port,), daemon=True).start()
+
+
+def run_board(args):
+    if args.flash:
+        print('flashing: %s' % args.flash)
+        if subprocess.call(args.flash, shell=True) != 0:
+            raise RunFailed('flashing failed')
+    port = upload.open_port(args)
+    if args.flash:
+        try:
+            read_until(port, PROMPT, BOOT_WAIT)
+        except RunFailed:
+            raise RunFailed('no prompt %d s after flashing' % BOOT_WAIT)
+    copy(port, args, 'suite.lua')
+    lines = run_script(port, 'dofile("suite.lua")')
+    if args.peer:
+        start_peer(args.peer_port)
+        copy(port, args, 'net.lua')
+        lines += run_script(port, 'PEER = "%s" PORT = %d dofile("net.lua")'
+                            % (args.peer, args.peer_port))
+    return lines
+
+
+def run_host(args):
+    exe = os.path.join(ROOT, 'host', 'luanode-host')
+    try:
+        out = subprocess.check_output([exe, 'suite.lua'], cwd=BENCH)
+    except (OSError, subprocess.CalledProcessError) as e:
+        raise RunFailed('%s: %s' % (exe, e))
+    text = out.decode('ascii', 'replace')
+    sys.stdout.write(text)
+    return text.splitlines()
+
+
+def check(baseline, results):
+    """Names that regressed, printing each result against the baseline"""
+    failed = []
+    print('%-20s %12s %12s %8s %6s  %s' % ('bench', 'baseline', 'now', 'worse', 'limit', 'unit'))
+    for name in sorted(set(baseline) | set(results)):
+        if name not in baseline:
+            print('%-20s %12s %12.6g %8s %6s  %s  (new)' % (name, '', results[name][0], '', '',
+                                                          results[name][1]))
+            continue
+        base = baseline[name]
+        if name not in results:
+            print('%-20s %12.6g %12s %8s %6s  %s  MISSING' % (name, base['value'], '', '', '',
+                                                            base['unit']))
+            failed.append(name)
+            continue
+        value, unit = results[name]
+        worse = ''
+        flag = ''
+        if base['value']:
+            pct = (base['value'] - value) * 100.0 / base['value']
+            if unit in compare.LOWER_BETTER:
+                pct = -pct
+            worse = '%+.1f%%' % pct
+            if pct > base['tolerance']:
+                flag = '  REGRESSED'
+                failed.append(name)
+        print('%-20s %12.6g %12.6g %8s %5d%%  %s%s' % (name, base['value'], value, worse,
+                                                      base['tolerance'], unit, flag))
+    return failed
+
+
+def baseline_path(args, target):
+    return os.path.join(args.baselines, '%s.json' % target)
+
+
+def load_baseline(path):
+    if not os.path.exists(path):
+        return None
+    with open(path) as f:
+        return json.load(f)
+
+
+def save_baseline(path, old, build, results):
+    tolerances = {}
+    if old:
+        tolerances = {n: r['tolerance'] for n, r in old['results'].items()}
+    data = {
+        'build': build,
+        'results': {
+            name: {'value': value, 'unit': unit,
+                   'tolerance': tolerances.get(name, tolerance_for(name))}
+            for name, (value, unit) in results.items()
+        },
+    }
+    if not os.path.isdir(os.path.dirname(path)):
+        os.makedirs(os.path.dirname(path))
+    with open(path, 'w') as f:
+        json.dump(data, f, indent=2, sort_keys=True)
+        f.write('\n')
+    print('baseline written to %s' % path)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Check a build against its benchmark baseline')
+    parser.add_argument('-p', '--port', help='serial port or host:port of console.listen()')
+    parser.add_argument('--password', help="for a console.listen() that has one")
+    parser.add_argument('-b', '--baud', type=int, default=115200)
+    parser.add_argument('--target', choices=('esp32', 'esp8266'), default='esp32',
+                        help='how scripts get onto the board')
+    parser.add_argument('--flash', metavar='CMD', help='shell command flashing the build first')
+    parser.add_argument('--peer', metavar='ADDR',
+                        help='address of this machine as the board reaches it, runs net.lua')
+    parser.add_argument('--peer-port', type=int, default=8181)
+    parser.add_argument('--host', action='store_true', help='run the host build instead')
+    parser.add_argument('--log', help='check the BENCH lines of a saved log instead')
+    parser.add_argument('--save', metavar='FILE', help='keep the BENCH lines of the run')
+    parser.add_argument('--baselines', default=os.path.join(ROOT, 'tools', 'perf'),
+                        help='directory of the baselines, one per target')
+    parser.add_argument('--update', action='store_true', help='make this run the baseline')
+    args = parser.parse_args()
+
+    if sum(map(bool, (args.port, args.host, args.log))) != 1:
+        parser.error('one of -p, --host and --log')
+    try:
+        if args.log:
+            with open(args.log, errors='replace') as f:
+                lines = f.read().splitlines()
+        elif args.host:
+            lines = run_host(args)
+        else:
+            lines = run_board(args)
+    except (RunFailed, SystemExit, OSError) as e:
+        # upload.py gives up with sys.exit(), pyserial's errors are OSErrors
+        print('run failed: %s' % e)
+        return 2
+
+    build, results = compare.parse(lines)
+    if not build or not results:
+        print('run failed: no results')
+        return 2
+    if args.save:
+        with open(args.save, 'w') as f:
+            f.write('\n'.join(l for l in lines if 'BENCH ' in l) + '\n')
+
+    target = build.get('target', 'esp32')
+    path = baseline_path(args, target)
+    old = load_baseline(path)
+    if args.update:
+        save_baseline(path, old, build, results)
+        return 0
+    if old is None:
+        print('no baseline for %s at %s, run with --update first' % (target, path))
+        return 2
+    base = old['build']
+    print('baseline: %s %s, %s MHz' % (base.get('version'), base.get('build_date'),
+                                       base.get('cpu_mhz')))
+    print('now:      %s %s, %s MHz' % (build.get('version'), build.get('build_date'),
+                                       build.get('cpu_mhz')))
+    failed = check(old['results'], results)
+    if failed:
+        print('%d regressed: %s' % (len(failed), ', '.join(failed)))
+        return 1
+    print('no regressions')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
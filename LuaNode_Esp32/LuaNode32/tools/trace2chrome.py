@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+#
+# Turn the text of trace.dump() into the Chrome trace event format, for
+# chrome://tracing or https://ui.perfetto.dev. The input may be a console
+# log with other output around the dump; the last dump in it is taken.
+# Each core is a thread of its own; spans that were still open when the
+# ring began, or closed after it ended, are dropped.
+#
+#   nc -l 9000 > trace.txt      (trace.dump("192.168.1.10", 9000) on the device)
+#   python3 tools/trace2chrome.py trace.txt > trace.json
+
+import json
+import sys
+
+
+def read_dump(f):
+    records, inside = None, False
+    for line in f:
+        line = line.strip()
+        if line.startswith("TRACE "):
+            if line == "TRACE end":
+                inside = False
+            else:
+                records, inside = [], True
+            continue
+        if inside:
+            parts = line.split()
+            if len(parts) == 6:
+                records.append(parts)
+    return records
+
+
+def convert(records):
+    events, open_spans = [], {}
+    for us, core, phase, name, a, b in records:
+        ev = {"name": name, "ph": phase, "ts": float(us), "pid": 0,
+              "tid": int(core), "args": {"a": int(a), "b": int(b)}}
+        key = (core, name)
+        if phase == "B":
+            open_spans[key] = open_spans.get(key, 0) + 1
+        elif phase == "E":
+            if not open_spans.get(key):
+                continue
+            open_spans[key] -= 1
+        else:
+            ev["s"] = "t"
+        events.append(ev)
+    # close what the dump ended inside of, at its end
+    end = events[-1]["ts"] if events else 0
+    for (core, name), n in open_spans.items():
+        for _ in range(n):
+            events.append({"name": name, "ph": "E", "ts": end, "pid": 0, "tid": int(core)})
+    for core in sorted({e["tid"] for e in events}):
+        events.append({"name": "thread_name", "ph": "M", "pid": 0, "tid": core,
+                       "args": {"name": "core %d" % core}})
+    return events
+
+
+def main():
+    if len(sys.argv) > 2:
+        sys.exit("usage: trace2chrome.py [dump.txt] > trace.json")
+    f = open(sys.argv[1], errors="replace") if len(sys.argv) == 2 else sys.stdin
+    records = read_dump(f)
+    if records is None:
+        sys.exit("no TRACE dump found")
+    json.dump({"traceEvents": convert(records), "displayTimeUnit": "ns"}, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
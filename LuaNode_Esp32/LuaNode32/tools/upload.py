@@ -0,0 +1,152 @@
+#!/usr/bin/env python
+#
+# Copy files to the board, or run a script on it, over the console UART
+# or the console module's TCP port.
+#
+# Files go in the console's upload mode (see components/lua/lua.c): ^A,
+# then frames of uint16 length, data and uint32 CRC-32, all little endian.
+# The first frame names the file, an empty one closes it. The board answers
+# every frame with ACK, NAK (send it again) or CAN (give up).
+#
+# --run sends a script in paste mode instead, ^E ... ^D, which compiles
+# it in one piece on the board and prints whatever it prints.
+#
+#   python tools/upload.py -p /dev/ttyUSB0 init.lua lib/util.lua=util.lua
+#   python tools/upload.py -p /dev/ttyUSB0 --run test.lua
+#   python tools/upload.py -p 192.168.1.50:23 --password secret init.lua
+#
+# A port of host:port connects to console.listen() instead; 0xff is
+# doubled there, as telnet has it. Needs pyserial for serial ports.
+
+import argparse
+import os
+import select
+import socket
+import struct
+import sys
+import time
+import zlib
+
+
+ACK = b'\x06'
+NAK = b'\x15'
+CAN = b'\x18'
+KEY_UPLOAD = b'\x01'
+KEY_RUN = b'\x04'
+KEY_PASTE = b'\x05'
+FRAME = 1024        # CONFIG_LUA_UPLOAD_FRAME, frames are shorter than this
+NAME_LEN = 32
+RETRIES = 5
+
+
+class TcpPort(object):
+    """The few pyserial calls used here, over a console.listen() socket"""
+
+    def __init__(self, addr, password, timeout):
+        host, port = addr.rsplit(':', 1)
+        self.sock = socket.create_connection((host, int(port)), timeout)
+        self.timeout = timeout
+        if password is not None:
+            self.read(256)      # the telnet offers and the prompt
+            self.sock.sendall(password.encode('ascii') + b'\r')
+
+    def write(self, data):
+        self.sock.sendall(data.replace(b'\xff', b'\xff\xff'))
+
+    def read(self, n):
+        if not select.select([self.sock], [], [], self.timeout)[0]:
+            return b''
+        return self.sock.recv(n)
+
+    def reset_input_buffer(self):
+        while select.select([self.sock], [], [], 0)[0]:
+            if not self.sock.recv(4096):
+                break
+
+
+def open_port(args):
+    if ':' in args.port and not args.port.startswith('/'):
+        return TcpPort(args.port, args.password, 1)
+    import serial
+    return serial.Serial(args.port, args.baud, timeout=1)
+
+
+def empty_line(port):
+    # the modes are only entered at the start of a line
+    port.write(b'\r')
+    time.sleep(0.1)
+    port.reset_input_buffer()
+
+
+def send_frame(port, data):
+    frame = struct.pack('<H', len(data)) + data + struct.pack('<I', zlib.crc32(data) & 0xffffffff)
+    for _ in range(RETRIES):
+        port.write(frame)
+        reply = port.read(1)
+        if reply == ACK:
+            return
+        if reply == CAN:
+            sys.exit('board refused the upload')
+        # NAK, or nothing before the timeout
+    sys.exit('no ACK after %d tries' % RETRIES)
+
+
+def upload(port, path, name, size):
+    with open(path, 'rb') as f:
+        data = f.read()
+    empty_line(port)
+    port.write(KEY_UPLOAD)
+    send_frame(port, name.encode('ascii'))
+    start = time.time()
+    for i in range(0, len(data), size):
+        send_frame(port, data[i:i + size])
+    send_frame(port, b'')
+    took = time.time() - start
+    print('%s -> %s: %d bytes in %.2f s' % (path, name, len(data), took))
+
+
+def run(port, path):
+    with open(path, 'rb') as f:
+        data = f.read()
+    if KEY_RUN in data or b'\x03' in data:
+        sys.exit('%s: ^C and ^D cannot be pasted' % path)
+    empty_line(port)
+    port.write(KEY_PASTE + data + KEY_RUN)
+    # echo what the script prints until the console is idle again
+    while True:
+        out = port.read(256)
+        if not out:
+            break
+        sys.stdout.write(out.decode('ascii', 'replace'))
+        sys.stdout.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Upload files to the board')
+    parser.add_argument('files', nargs='*', help='local[=remote] files to copy')
+    parser.add_argument('-p', '--port', required=True, help='serial port or host:port')
+    parser.add_argument('--password', help="for a console.listen() that has one")
+    parser.add_argument('-b', '--baud', type=int, default=115200)
+    parser.add_argument('--frame', type=int, default=FRAME - 1,
+                        help='bytes of file per frame, less than CONFIG_LUA_UPLOAD_FRAME')
+    parser.add_argument('--run', metavar='FILE', help='paste FILE and run it afterwards')
+    args = parser.parse_args()
+
+    if not args.files and not args.run:
+        parser.error('nothing to do')
+    port = open_port(args)
+    for arg in args.files:
+        if '=' in arg:
+            path, name = arg.split('=', 1)
+        else:
+            path = arg
+            name = os.path.basename(path)
+        if len(name) > NAME_LEN:
+            sys.exit('%s: file name longer than %d characters' % (name, NAME_LEN))
+        upload(port, path, name, args.frame)
+    if args.run:
+        run(port, args.run)
+
+
+if __name__ == '__main__':
+    main()
@@ -230,35 +230,62 @@ void *pvPortMalloc( size_t xWantedSize )
     return pvPortMallocCaps( xWantedSize, MALLOC_CAP_8BIT );
 }
 
+/*
+Does the tag, looked up from priority prio on, have all the capabilities in caps?
+*/
+static bool tag_has_caps(int tag, int prio, uint32_t caps)
+{
+    uint32_t remCaps;
+    int j;
+    if ((tagDesc[tag][prio]&caps)==0) return false;
+    //Tag has at least one of the caps requested. If caps has other bits set that this prio
+    //doesn't cover, see if they're available in other prios.
+    remCaps=caps&(~tagDesc[tag][prio]); //Remaining caps to be fulfilled
+    j=prio+1;
+    while (remCaps!=0 && j<NO_PRIOS) {
+        remCaps=remCaps&(~tagDesc[tag][j]);
+        j++;
+    }
+    return remCaps==0;
+}
+
 /*
 Routine to allocate a bit of memory with certain capabilities. caps is a bitfield of MALLOC_CAP_* bits.
 */
 void *pvPortMallocCaps( size_t xWantedSize, uint32_t caps ) 
 {
     int prio;
-    int tag, j;
+    int tag;
     void *ret=NULL;
-    uint32_t remCaps;
     for (prio=0; prio<NO_PRIOS; prio++) {
         //Iterate over tag descriptors for this priority
         for (tag=0; tagDesc[tag][prio]!=MALLOC_CAP_INVALID; tag++) {
-            if ((tagDesc[tag][prio]&caps)!=0) {
-                //Tag has at least one of the caps requested. If caps has other bits set that this prio
-                //doesn't cover, see if they're available in other prios.
-                remCaps=caps&(~tagDesc[tag][prio]); //Remaining caps to be fulfilled
-                j=prio+1;
-                while (remCaps!=0 && j<NO_PRIOS) {
-                    remCaps=remCaps&(~tagDesc[tag][j]);
-                    j++;
-                }
-                if (remCaps==0) {
-                    //This tag can satisfy all the requested capabilities. See if we can grab some memory using it.
-                    ret=pvPortMallocTagged(xWantedSize, tag);
-                    if (ret!=NULL) return ret;
-                }
+            if (tag_has_caps(tag, prio, caps)) {
+                //This tag can satisfy all the requested capabilities. See if we can grab some memory using it.
+                ret=pvPortMallocTagged(xWantedSize, tag);
+                if (ret!=NULL) return ret;
             }
         }
     }
     //Nothing usable found.
     return NULL;
 }
+
+/*
+Free bytes pvPortMallocCaps() could hand out for caps, and the largest single block of them (if
+largest isn't NULL). A request bigger than that fails however much is free in total.
+*/
+size_t xPortGetFreeHeapSizeCaps( uint32_t caps, size_t *largest )
+{
+    int tag, prio;
+    size_t total=0, big=0, free, blk;
+    for (tag=0; tagDesc[tag][0]!=MALLOC_CAP_INVALID; tag++) {
+        for (prio=0; prio<NO_PRIOS && !tag_has_caps(tag, prio, caps); prio++) ;
+        if (prio==NO_PRIOS) continue;
+        vPortGetHeapStatsTagged(tag, &free, &blk);
+        total+=free;
+        if (blk>big) big=blk;
+    }
+    if (largest) *largest=big;
+    return total;
+}
@@ -423,6 +423,32 @@ size_t xPortGetMinimumEverFreeHeapSize( void )
 }
 /*-----------------------------------------------------------*/
 
+void vPortGetHeapStatsTagged( BaseType_t tag, size_t *pxFreeBytes, size_t *pxLargestFreeBlock )
+{
+BlockLink_t *pxBlock;
+size_t xFree = 0, xLargest = 0, xUsable;
+
+	/* Walk the free list, reporting sizes as they could be allocated, so
+	without the block header. */
+	taskENTER_CRITICAL(&xMallocMutex);
+	for( pxBlock = xStart.pxNextFreeBlock; pxBlock != NULL && pxBlock != pxEnd; pxBlock = pxBlock->pxNextFreeBlock )
+	{
+		if( pxBlock->xTag == tag && pxBlock->xBlockSize > uxHeapStructSize )
+		{
+			xUsable = pxBlock->xBlockSize - uxHeapStructSize;
+			xFree += xUsable;
+			if( xUsable > xLargest )
+			{
+				xLargest = xUsable;
+			}
+		}
+	}
+	taskEXIT_CRITICAL(&xMallocMutex);
+	*pxFreeBytes = xFree;
+	*pxLargestFreeBlock = xLargest;
+}
+/*-----------------------------------------------------------*/
+
 static void prvInsertBlockIntoFreeList( BlockLink_t *pxBlockToInsert )
 {
 BlockLink_t *pxIterator;
@@ -28,6 +28,7 @@ typedef struct HeapRegionTagged
 
 void vPortDefineHeapRegionsTagged( const HeapRegionTagged_t * const pxHeapRegions );
 void *pvPortMallocTagged( size_t xWantedSize, BaseType_t tag );
+void vPortGetHeapStatsTagged( BaseType_t tag, size_t *pxFreeBytes, size_t *pxLargestFreeBlock );
 
 
 
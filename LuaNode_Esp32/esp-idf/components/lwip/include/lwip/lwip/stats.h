@@ -68,6 +68,7 @@ struct stats_proto {
   STAT_COUNTER opterr;           /* Error in options. */
   STAT_COUNTER err;              /* Misc error. */
   STAT_COUNTER cachehit;
+  STAT_COUNTER rexmit;           /* Retransmissions (TCP). */
 };
 
 struct stats_igmp {
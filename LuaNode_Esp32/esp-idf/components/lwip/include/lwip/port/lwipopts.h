@@ -421,8 +421,15 @@ extern unsigned long os_random(void);
 */
 /**
  * LWIP_STATS==1: Enable statistics collection in lwip_stats.
+ * The pools come from the heap, but the memp counters still work.
  */
+#ifdef CONFIG_LWIP_STATS
+#define LWIP_STATS                      1
+#define LWIP_STATS_LARGE                1
+#define MEMP_STATS                      1
+#else
 #define LWIP_STATS                      0
+#endif
 
 /*
    ---------------------------------
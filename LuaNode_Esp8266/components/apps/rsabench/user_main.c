@@ -0,0 +1,173 @@
+/*
+ * RSA benchmark for the axTLS bigint code
+ *
+ * Times the three modular exponentiations a TLS handshake does with a
+ * 2048 bit key: the public operation (e = 65537) as when encrypting the
+ * premaster secret, the same through bi_mod_power2() as when checking a
+ * certificate signature, and the private one through the CRT as a server
+ * signs with. Each result is checked, and the free heap is printed around
+ * every run so that leaks show up.
+ *
+ * Build with APP_NAME=rsabench (the SDK's libssl.a needs to have been
+ * replaced with third_party/ssl, see make_lib.sh) and watch the UART at
+ * 115200 baud.
+ */
+
+#include "esp_common.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include "uart.h"
+#include "ssl/ssl_crypto.h"
+
+#define BENCH_RUNS      5
+#define BENCH_KEY_LEN   256         // bytes in the modulus
+
+// A throwaway key, generated for this and used nowhere else
+static const char bench_n[] =
+    "b63e627be179ab67a633da5958fbb8868bf140e2b50d6b3311408353c92d2394"
+    "3900b6cd9d52bd97b31412dba070e95d7acf8750ce04758bb59191a3be5efc6d"
+    "df34fcb74d49eff360e62cd584cb8bb295128be84c583c71177c39950064ca67"
+    "40bc0f99f711b26d8c7f953526e4b0cd225a10a0aa1d839d8871dbf3cee17f5e"
+    "16fc7b19261a7a6c4bbdff75e7bcf157a7d186baf0e34e0b6374e72760084ab6"
+    "4ede2160e332c4ea34afc901a0bdf6f75026bfc7e321abf23ccf1938ec9e748b"
+    "6b70a2a7b966f08b0055f88b4a0cf85aa7afe1a93876980f99607095c8fc631e"
+    "5c5b0fd615c49a23317330b496dde4ea356c5caed340f68132593ff91629b4f1";
+static const char bench_p[] =
+    "ef25d0dda606b545ae99d9c46e28c64c933a55ab49ddf2270f33f85dab9952e3"
+    "34d488075c22f052cd34967b87dd79c075632959564d16dc86d46237d680c312"
+    "df0af6ab227467cdb8c45f66fdaa8191358e8bd6e6f884efc36def5fef958e1d"
+    "f11b99cc4b9a043ce39572625ce512b85404fdeae0bd07ca6fbcaa0740549e81";
+static const char bench_q[] =
+    "c31607a3d97d7214c1d2ef2f7a1db75ee0a732f6c8339642313dba78d0772326"
+    "6240598008a3917fc6d171e797d042a03d2ac2e82311e67deb3be2ae2adf0b92"
+    "54e9262711a7ff5a92e2a2fb191e0d81f42d0bb064657fbce1baca36b8533650"
+    "d2283518e9e4e48bb486129e3ee6ff8f1fc074eb90adef5af133c413252cbe71";
+static const char bench_dp[] =
+    "57a581662a9a1cc79c1530d5a815f38f4f0a3b299ad9e80cdeaa8a653225f055"
+    "eb1fd576f512ad077bc3c13f26ed49d8fa6ccc53bca8662f8e8eba2c82c61038"
+    "935c3e493c48735ed74fc93342d6c1c3c96023ea301e7702349acef7572475c0"
+    "8d84331ac7be7bbd211fbd9b45368364e10e2f4d6cee7ab37bbe26869fd22381";
+static const char bench_dq[] =
+    "6c3b219bf682913310e13c8fa3792f0d75276dafda1c3ca59679ffa51d4aab76"
+    "9515cc51aaf94c348e920e56853426728ddcd66b4161a1f583f72268ac223862"
+    "43b761d2550a5631e2c1d7d7e4f4765bfda2ac147d6e8e32b52d1318cea463c2"
+    "ed051f8825e3362487cfc62e83095709097d95a047112874d4d27a5a80ca5511";
+static const char bench_qinv[] =
+    "4df8b73a014dae9e6c90a94a6ef93a366f61499359def0bbd7f306824559f956"
+    "bd2e902d43ed7d7aa5b3aeef1d5cdbad41386a54367752a33e23b089992be565"
+    "bfcc430e50f31479eb02b6a176611c9e22153f5a77da0965f1cb7be5978aa5c8"
+    "d22c5be850e7207a3fe98a6a9d2e68241cdb058b98f9c0ca54d82ce6be6b7c59";
+
+static uint8_t bench_buf[BENCH_KEY_LEN];
+
+static bigint *bench_import(BI_CTX *ctx, const char *hex)
+{
+    int len = strlen(hex) / 2, i;
+
+    for (i = 0; i < len; i++) {
+        char c[3] = { hex[2*i], hex[2*i+1], 0 };
+        bench_buf[i] = (uint8_t)strtol(c, NULL, 16);
+    }
+    return bi_import(ctx, bench_buf, len);
+}
+
+static bigint *bench_keep(bigint *bi)
+{
+    bi_permanent(bi);
+    return bi;
+}
+
+static void bench_release(BI_CTX *ctx, bigint *bi)
+{
+    bi_depermanent(bi);
+    bi_free(ctx, bi);
+}
+
+static void bench_run(int run)
+{
+    uint32 heap = system_get_free_heap_size();
+    BI_CTX *ctx = bi_initialize();
+    bigint *n, *p, *q, *dp, *dq, *qinv, *msg, *c, *r;
+    uint32 t0, t_pub, t_sig, t_priv;
+    int i, ok;
+
+    n = bench_import(ctx, bench_n);
+    p = bench_import(ctx, bench_p);
+    q = bench_import(ctx, bench_q);
+    bi_set_mod(ctx, bi_clone(ctx, n), BIGINT_M_OFFSET);
+    bi_set_mod(ctx, bi_clone(ctx, p), BIGINT_P_OFFSET);
+    bi_set_mod(ctx, bi_clone(ctx, q), BIGINT_Q_OFFSET);
+    bench_keep(n);
+    bench_keep(p);
+    bench_keep(q);
+    dp = bench_keep(bench_import(ctx, bench_dp));
+    dq = bench_keep(bench_import(ctx, bench_dq));
+    qinv = bench_keep(bench_import(ctx, bench_qinv));
+
+    // something below n that changes from run to run
+    for (i = 0; i < BENCH_KEY_LEN; i++)
+        bench_buf[i] = (uint8_t)(i * 13 + run * 7 + 1);
+    bench_buf[0] &= 0x7f;
+    msg = bench_keep(bi_import(ctx, bench_buf, BENCH_KEY_LEN));
+
+    ctx->mod_offset = BIGINT_M_OFFSET;
+    t0 = system_get_time();
+    c = bi_mod_power(ctx, bi_copy(msg), int_to_bi(ctx, 65537));
+    t_pub = system_get_time() - t0;
+
+    t0 = system_get_time();
+    r = bi_mod_power2(ctx, bi_copy(c), bi_clone(ctx, n), int_to_bi(ctx, 65537));
+    t_sig = system_get_time() - t0;
+    ok = bi_compare(r, c) == 0;
+    bi_free(ctx, r);
+
+    t0 = system_get_time();
+    r = bi_crt(ctx, c, dp, dq, p, q, qinv);
+    t_priv = system_get_time() - t0;
+    ok = ok && bi_compare(r, msg) == 0;
+    bi_free(ctx, r);
+
+    bench_release(ctx, msg);
+    bench_release(ctx, qinv);
+    bench_release(ctx, dq);
+    bench_release(ctx, dp);
+    bench_release(ctx, q);
+    bench_release(ctx, p);
+    bench_release(ctx, n);
+    bi_free_mod(ctx, BIGINT_Q_OFFSET);
+    bi_free_mod(ctx, BIGINT_P_OFFSET);
+    bi_free_mod(ctx, BIGINT_M_OFFSET);
+    bi_terminate(ctx);
+
+    printf("run %d: public %u us, signature %u us, private (CRT) %u us, %s, "
+           "heap %u -> %u\n", run, t_pub, t_sig, t_priv, ok ? "ok" : "WRONG",
+           heap, system_get_free_heap_size());
+}
+
+static void bench_task(void *pvParameters)
+{
+    int run;
+
+    printf("RSA-%d, %d runs\n", BENCH_KEY_LEN * 8, BENCH_RUNS);
+    for (run = 0; run < BENCH_RUNS; run++) {
+        bench_run(run);
+        vTaskDelay(10);     // let the idle task feed the watchdog
+    }
+    printf("done\n");
+    vTaskDelete(NULL);
+}
+
+/******************************************************************************
+ * FunctionName : user_init
+ * Description  : entry of user application, init user function here
+ * Parameters   : none
+ * Returns      : none
+*******************************************************************************/
+void user_init(void)
+{
+    printf("SDK version:%s\n", system_get_sdk_version());
+
+    uart_init_new();
+
+    xTaskCreate(bench_task, "rsabench", 512, NULL, 2, NULL);
+}
@@ -34,6 +34,7 @@
 
 enum {
     UART_EVENT_RX_CHAR,
+    UART_EVENT_LUA_TASK,
     UART_EVENT_MAX
 };
 
@@ -198,6 +199,10 @@ uart_task(void *pvParameters)
 				}
                     break;
 
+                case UART_EVENT_LUA_TASK:
+                    ((uart_lua_task_t)e.param)();
+                    break;
+
                 default:
                     break;
             }
@@ -212,6 +217,16 @@ uart_task(void *pvParameters)
     vTaskDelete(NULL);
 }
 
+// Lua runs on the uart task, so work for Lua from other tasks goes through its queue
+bool
+uart_post_lua_task(uart_lua_task_t fn)
+{
+    os_event_t e;
+    e.event = UART_EVENT_LUA_TASK;
+    e.param = (uint32)fn;
+    return xQueueSend(xQueueUart, (void *)&e, 0) == pdPASS;
+}
+
 LOCAL void 
 uart0_rx_intr_handler(void *para)
 {
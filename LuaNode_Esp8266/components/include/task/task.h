@@ -0,0 +1,54 @@
+#ifndef _TASK_H_
+#define _TASK_H_
+
+#include "c_types.h"
+
+/* The same event loop as on the ESP32: callbacks posted from the lwIP,
+ * timer and wifi tasks are queued here and run one by one on the Lua
+ * task, highest priority first. The Lua task is the uart task on this
+ * port; it runs the pump whenever something has been posted. */
+
+/* use LOW / MEDIUM / HIGH since it isn't clear from the docs which is higher */
+
+typedef enum {
+  TASK_PRIORITY_LOW,
+  TASK_PRIORITY_MEDIUM,
+  TASK_PRIORITY_HIGH,
+  TASK_PRIORITY_COUNT
+} task_prio_t;
+
+typedef uint32 task_handle_t;
+typedef uint32 task_param_t;
+
+/*
+* Signals are a 32-bit number of the form header:14; count:18. The header
+* is just a fixed fingerprint and the count is allocated serially by the
+* task_get_id() function.
+*/
+bool task_post(task_prio_t priority, task_handle_t handle, task_param_t param);
+
+#define task_post_low(handle,param)    task_post(TASK_PRIORITY_LOW,    handle, param)
+#define task_post_medium(handle,param) task_post(TASK_PRIORITY_MEDIUM, handle, param)
+#define task_post_high(handle,param)   task_post(TASK_PRIORITY_HIGH,   handle, param)
+
+/*
+* Post only if no coalesced event for this handle is already queued. Meant
+* for handlers which drain their own backlog, so a single queued wakeup is
+* as good as many. When skipped, the param of the queued event is the one
+* delivered. Returns true if an event is queued when the call returns.
+*/
+bool task_post_coalesced(task_prio_t priority, task_handle_t handle, task_param_t param);
+
+#define task_post_coalesced_low(handle,param)    task_post_coalesced(TASK_PRIORITY_LOW,    handle, param)
+#define task_post_coalesced_medium(handle,param) task_post_coalesced(TASK_PRIORITY_MEDIUM, handle, param)
+#define task_post_coalesced_high(handle,param)   task_post_coalesced(TASK_PRIORITY_HIGH,   handle, param)
+
+typedef void (*task_callback_t)(task_param_t param, task_prio_t prio);
+
+bool task_init_handler(task_prio_t priority, uint8 qlen);
+task_handle_t task_get_id(task_callback_t t);
+
+/* Run everything queued, on the Lua task */
+void task_pump_messages(void);
+
+#endif
@@ -303,6 +303,18 @@ void uart_init_new(void);
 
 void ICACHE_FLASH_ATTR uart0_sendStr(const char *str);
 
+typedef void (*uart_lua_task_t)(void);
+
+/**
+  * @brief   Run fn on the uart task, where the Lua interpreter runs.
+  *          Must not be called from an ISR.
+  *
+  * @param   uart_lua_task_t fn : function to run
+  *
+  * @return  false if the uart queue is full
+  */
+bool uart_post_lua_task(uart_lua_task_t fn);
+
 STATUS uart_tx_one_char(uint8 uart, uint8 TxChar);
 
 /**
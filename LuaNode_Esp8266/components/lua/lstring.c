@@ -81,7 +81,7 @@ static TString *newlstr (lua_State *L, const char *str, size_t l,
 }
 
 
-static TString *luaS_newlstr_helper (lua_State *L, const char *str, size_t l, int readonly) {
+static LUAI_HOT TString *luaS_newlstr_helper (lua_State *L, const char *str, size_t l, int readonly) {
   GCObject *o;
   unsigned int h = cast(unsigned int, l);  /* seed */
   size_t step = (l>>5)+1;  /* if string is too long, don't hash all its chars */
@@ -101,7 +101,7 @@ static TString *luaS_newlstr_helper (lua_State *L, const char *str, size_t l, in
   return newlstr(L, str, l, h, readonly);  /* not found */
 }
 
-static int lua_is_ptr_in_ro_area(const char *p) {
+static LUAI_HOT int lua_is_ptr_in_ro_area(const char *p) {
 #ifdef LUA_CROSS_COMPILER
   return 0;
 #else
@@ -112,7 +112,7 @@ static int lua_is_ptr_in_ro_area(const char *p) {
 #endif
 }
 
-TString *luaS_newlstr (lua_State *L, const char *str, size_t l) {
+LUAI_HOT TString *luaS_newlstr (lua_State *L, const char *str, size_t l) {
   // If the pointer is in a read-only memory and the string is at least 4 chars in length,
   // create it as a read-only string instead
   if(lua_is_ptr_in_ro_area(str) && l+1 > sizeof(char**) && l == c_strlen(str))
@@ -223,6 +223,20 @@
 #endif
 
 
+/*
+@@ LUAI_HOT marks the functions the VM runs for nearly every instruction.
+** Built with LUA_IRAM_HOTPATH (make LUA_IRAM=1) they are placed in IRAM
+** instead of running from flash through the instruction cache, where a
+** miss costs a SPI read. IRAM is 32K, most of it taken by the SDK, so
+** keep this list short and check it with "make iram_report".
+*/
+#if defined(LUA_IRAM_HOTPATH) && !defined(LUA_CROSS_COMPILER)
+#define LUAI_HOT	__attribute__((section(".text")))
+#else
+#define LUAI_HOT	/* empty */
+#endif
+
+
 
 /*
 @@ LUA_QL describes how error messages quote program elements.
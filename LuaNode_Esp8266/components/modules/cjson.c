@@ -1480,6 +1480,522 @@ static int json_decode(lua_State *l)
     return 1;
 }
 
+/* ===== STREAMING DECODER =====
+ *
+ * cjson.decoder() takes a document in chunks of any size, as they come
+ * from a socket, and runs them through a byte at a time state machine.
+ * Only the token being read, the path to it and the values picked for
+ * materialising are kept, so memory doesn't grow with the document.
+ *
+ * The callback gets (path, value) with paths like "items.3.name", array
+ * elements counting from 1. Without a selection every string, number,
+ * boolean and null is reported; with one, only values at the selected
+ * paths, built into tables when they are objects or arrays.
+ *
+ * The decoder's environment table holds the callback at "fn", the
+ * selection at "select", and the tables being built at 1..nbuild.
+ */
+
+#define JSON_STREAM_META        "cjson.decoder"
+#define JSON_STREAM_MAX_DEPTH   20
+#define JSON_STREAM_MAX_PATH    128
+#define JSON_STREAM_TOKEN       256     /* default for the longest string or number */
+#define JSON_STREAM_ENV         3       /* stack index of the environment in methods */
+
+typedef enum {
+    EXP_VALUE,
+    EXP_VALUE_OR_END,
+    EXP_KEY,
+    EXP_KEY_OR_END,
+    EXP_COLON,
+    EXP_COMMA_OR_END,
+    EXP_NOTHING
+} json_expect_t;
+
+typedef enum {
+    LEX_NONE,
+    LEX_STRING,
+    LEX_ESCAPE,
+    LEX_UNICODE,
+    LEX_SURROGATE,          /* after a high surrogate, wants '\' */
+    LEX_SURROGATE_U,        /* then 'u' */
+    LEX_NUMBER,
+    LEX_WORD
+} json_lex_t;
+
+typedef struct {
+    uint8_t is_object;
+    uint8_t expect;
+    uint8_t building;       /* its table is env[nbuild] while it is innermost */
+    uint16_t path_len;      /* path up to and including its own key */
+    uint32_t count;         /* array elements so far */
+} json_stream_level_t;
+
+typedef struct {
+    json_stream_level_t level[JSON_STREAM_MAX_DEPTH];
+    int depth;
+    int nbuild;
+    uint8_t top_expect;
+    uint8_t lex;
+    uint8_t is_key;         /* the string being read is an object key */
+    uint8_t report;         /* the scalar being read is wanted */
+    uint8_t selective;
+    uint8_t failed;
+    int hex_digits;
+    int codepoint;
+    int surrogate;
+    uint32_t offset;        /* bytes taken, for error messages */
+    uint16_t path_len;
+    char path[JSON_STREAM_MAX_PATH];
+    size_t tok_len;
+    size_t tok_max;
+    char tok[1];            /* tok_max bytes and a terminator */
+} json_stream_t;
+
+static void json_stream_error(lua_State *l, json_stream_t *s, const char *msg)
+{
+    s->failed = 1;
+    luaL_error(l, "%s at byte %d", msg, s->offset + 1);
+}
+
+static void json_stream_put(lua_State *l, json_stream_t *s, const char *p, size_t len)
+{
+    if (s->tok_len + len > s->tok_max)
+        json_stream_error(l, s, "string or number too long");
+    c_memcpy(s->tok + s->tok_len, p, len);
+    s->tok_len += len;
+}
+
+static void json_stream_putc(lua_State *l, json_stream_t *s, char c)
+{
+    json_stream_put(l, s, &c, 1);
+}
+
+/* Make the path base, then seg as the last part of it */
+static void json_stream_set_path(lua_State *l, json_stream_t *s, uint16_t base,
+                                 const char *seg, size_t len)
+{
+    if (base + 1 + len >= JSON_STREAM_MAX_PATH)
+        json_stream_error(l, s, "path too long");
+    s->path_len = base;
+    if (base)
+        s->path[s->path_len++] = '.';
+    c_memcpy(s->path + s->path_len, seg, len);
+    s->path_len += len;
+}
+
+/* Whether path matches pat part by part, '*' standing for any one part */
+static int json_stream_match(const char *pat, size_t plen, const char *path, size_t len)
+{
+    size_t i = 0, j = 0;
+
+    while (1) {
+        size_t pe = i, e = j;
+        while (pe < plen && pat[pe] != '.')
+            pe++;
+        while (e < len && path[e] != '.')
+            e++;
+        if (!(pe - i == 1 && pat[i] == '*') &&
+            (pe - i != e - j || c_memcmp(pat + i, path + j, e - j)))
+            return 0;
+        if (pe == plen || e == len)
+            return pe == plen && e == len;
+        i = pe + 1;
+        j = e + 1;
+    }
+}
+
+static int json_stream_selected(lua_State *l, json_stream_t *s)
+{
+    int i, found = 0;
+
+    lua_getfield(l, JSON_STREAM_ENV, "select");
+    for (i = 1; !found; i++) {
+        size_t plen;
+        lua_rawgeti(l, -1, i);
+        if (lua_isnil(l, -1)) {
+            lua_pop(l, 1);
+            break;
+        }
+        const char *pat = lua_tolstring(l, -1, &plen);
+        found = json_stream_match(pat, plen, s->path, s->path_len);
+        lua_pop(l, 1);
+    }
+    lua_pop(l, 1);
+    return found;
+}
+
+/* A value starts here: give it its path and tell whether to build it */
+static int json_stream_value_start(lua_State *l, json_stream_t *s)
+{
+    if (s->depth) {
+        json_stream_level_t *p = &s->level[s->depth - 1];
+        if (!p->is_object) {
+            char num[10];
+            int n = sizeof(num);
+            uint32_t v = ++p->count;
+            do {
+                num[--n] = '0' + v % 10;
+                v /= 10;
+            } while (v);
+            json_stream_set_path(l, s, p->path_len, num + n, sizeof(num) - n);
+        }
+        p->expect = EXP_COMMA_OR_END;
+    } else {
+        s->top_expect = EXP_NOTHING;
+    }
+    if (s->nbuild)
+        return 1;
+    return s->selective && json_stream_selected(l, s);
+}
+
+/* The value on top of the stack is complete: put it in the table being
+ * built around it, or hand it to the callback, and pop it */
+static void json_stream_value_done(lua_State *l, json_stream_t *s)
+{
+    if (s->nbuild) {
+        json_stream_level_t *p = &s->level[s->depth - 1];
+        lua_rawgeti(l, JSON_STREAM_ENV, s->nbuild);
+        if (p->is_object) {
+            uint16_t key = p->path_len ? p->path_len + 1 : 0;
+            lua_pushlstring(l, s->path + key, s->path_len - key);
+            lua_pushvalue(l, -3);
+            lua_rawset(l, -3);
+        } else {
+            lua_pushvalue(l, -2);
+            lua_rawseti(l, -2, p->count);
+        }
+        lua_pop(l, 2);
+        return;
+    }
+    /* an error in fn leaves the rest of the chunk unread */
+    s->failed = 1;
+    lua_getfield(l, JSON_STREAM_ENV, "fn");
+    lua_pushlstring(l, s->path, s->path_len);
+    lua_pushvalue(l, -3);
+    lua_call(l, 2, 0);
+    lua_pop(l, 1);
+    s->failed = 0;
+}
+
+static void json_stream_scalar_done(lua_State *l, json_stream_t *s)
+{
+    s->tok[s->tok_len] = '\0';
+
+    if (s->lex == LEX_STRING && s->is_key) {
+        json_stream_level_t *p = &s->level[s->depth - 1];
+        json_stream_set_path(l, s, p->path_len, s->tok, s->tok_len);
+        p->expect = EXP_COLON;
+        s->lex = LEX_NONE;
+        return;
+    }
+
+    if (s->lex == LEX_NUMBER) {
+        char *end;
+        double n = fpconv_strtod(s->tok, &end);
+        if (end != s->tok + s->tok_len)
+            json_stream_error(l, s, "invalid number");
+        if (s->report)
+            lua_pushnumber(l, n);
+    } else if (s->lex == LEX_WORD) {
+        if (!c_strcmp(s->tok, "true") || !c_strcmp(s->tok, "false")) {
+            if (s->report)
+                lua_pushboolean(l, s->tok[0] == 't');
+        } else if (!c_strcmp(s->tok, "null")) {
+            if (s->report)
+                lua_pushlightuserdata(l, NULL);
+        } else {
+            json_stream_error(l, s, "invalid token");
+        }
+    } else if (s->report) {
+        lua_pushlstring(l, s->tok, s->tok_len);
+    }
+    s->lex = LEX_NONE;
+    if (s->report)
+        json_stream_value_done(l, s);
+}
+
+static void json_stream_push_level(lua_State *l, json_stream_t *s, int is_object, int build)
+{
+    if (s->depth == JSON_STREAM_MAX_DEPTH)
+        json_stream_error(l, s, "too many nested data structures");
+    json_stream_level_t *lev = &s->level[s->depth++];
+    lev->is_object = is_object;
+    lev->expect = is_object ? EXP_KEY_OR_END : EXP_VALUE_OR_END;
+    lev->building = build;
+    lev->path_len = s->path_len;
+    lev->count = 0;
+    if (build) {
+        lua_newtable(l);
+        lua_rawseti(l, JSON_STREAM_ENV, ++s->nbuild);
+    }
+}
+
+static void json_stream_pop_level(lua_State *l, json_stream_t *s)
+{
+    json_stream_level_t *lev = &s->level[--s->depth];
+    s->path_len = lev->path_len;
+    if (lev->building) {
+        lua_rawgeti(l, JSON_STREAM_ENV, s->nbuild);
+        lua_pushnil(l);
+        lua_rawseti(l, JSON_STREAM_ENV, s->nbuild--);
+        json_stream_value_done(l, s);
+    }
+}
+
+/* A byte outside any string, number or word */
+static void json_stream_structure(lua_State *l, json_stream_t *s, int c)
+{
+    json_stream_level_t *lev = s->depth ? &s->level[s->depth - 1] : NULL;
+    int expect = lev ? lev->expect : s->top_expect;
+    int want_value = expect == EXP_VALUE || expect == EXP_VALUE_OR_END;
+
+    switch (c) {
+    case ' ': case '\t': case '\n': case '\r':
+        return;
+    case '"':
+        if (expect == EXP_KEY || expect == EXP_KEY_OR_END) {
+            s->is_key = 1;
+        } else if (want_value) {
+            s->is_key = 0;
+            s->report = json_stream_value_start(l, s) || !s->selective;
+        } else {
+            break;
+        }
+        s->tok_len = 0;
+        s->lex = LEX_STRING;
+        return;
+    case '{': case '[':
+        if (!want_value)
+            break;
+        json_stream_push_level(l, s, c == '{', json_stream_value_start(l, s));
+        return;
+    case '}': case ']':
+        if (!lev || lev->is_object != (c == '}') ||
+            (expect != EXP_COMMA_OR_END &&
+             expect != (lev->is_object ? EXP_KEY_OR_END : EXP_VALUE_OR_END)))
+            break;
+        json_stream_pop_level(l, s);
+        return;
+    case ':':
+        if (expect != EXP_COLON)
+            break;
+        lev->expect = EXP_VALUE;
+        return;
+    case ',':
+        if (expect != EXP_COMMA_OR_END || !lev)
+            break;
+        lev->expect = lev->is_object ? EXP_KEY : EXP_VALUE;
+        return;
+    default:
+        if (!want_value)
+            break;
+        if (c == '-' || ('0' <= c && c <= '9'))
+            s->lex = LEX_NUMBER;
+        else if ('a' <= c && c <= 'z')
+            s->lex = LEX_WORD;
+        else
+            break;
+        s->report = json_stream_value_start(l, s) || !s->selective;
+        s->tok_len = 0;
+        s->tok[s->tok_len++] = c;
+        return;
+    }
+    json_stream_error(l, s, expect == EXP_NOTHING ? "data after the end" : "unexpected character");
+}
+
+static void json_stream_byte(lua_State *l, json_stream_t *s, int c)
+{
+    char utf8[4];
+    int d;
+
+    switch (s->lex) {
+    case LEX_STRING:
+        if (c == '"')
+            json_stream_scalar_done(l, s);
+        else if (c == '\\')
+            s->lex = LEX_ESCAPE;
+        else if (c < 0x20)
+            json_stream_error(l, s, "control character in string");
+        else
+            json_stream_putc(l, s, c);
+        return;
+    case LEX_ESCAPE:
+        if (c == 'u') {
+            s->lex = LEX_UNICODE;
+            s->hex_digits = 0;
+            s->codepoint = 0;
+            return;
+        }
+        c = escape2char((unsigned char)c);
+        if (!c)
+            json_stream_error(l, s, "invalid escape code");
+        json_stream_putc(l, s, c);
+        s->lex = LEX_STRING;
+        return;
+    case LEX_UNICODE:
+        d = hexdigit2int(c);
+        if (d < 0)
+            json_stream_error(l, s, "invalid unicode escape code");
+        s->codepoint = (s->codepoint << 4) | d;
+        if (++s->hex_digits < 4)
+            return;
+        if (s->surrogate) {
+            if ((s->codepoint & 0xFC00) != 0xDC00)
+                json_stream_error(l, s, "invalid unicode escape code");
+            s->codepoint = (((s->surrogate & 0x3FF) << 10) | (s->codepoint & 0x3FF)) + 0x10000;
+            s->surrogate = 0;
+        } else if ((s->codepoint & 0xFC00) == 0xD800) {
+            s->surrogate = s->codepoint;
+            s->lex = LEX_SURROGATE;
+            return;
+        } else if ((s->codepoint & 0xFC00) == 0xDC00) {
+            json_stream_error(l, s, "invalid unicode escape code");
+        }
+        json_stream_put(l, s, utf8, codepoint_to_utf8(utf8, s->codepoint));
+        s->lex = LEX_STRING;
+        return;
+    case LEX_SURROGATE:
+    case LEX_SURROGATE_U:
+        if (c != (s->lex == LEX_SURROGATE ? '\\' : 'u'))
+            json_stream_error(l, s, "invalid unicode escape code");
+        if (s->lex == LEX_SURROGATE_U) {
+            s->lex = LEX_UNICODE;
+            s->hex_digits = 0;
+            s->codepoint = 0;
+        } else {
+            s->lex = LEX_SURROGATE_U;
+        }
+        return;
+    case LEX_NUMBER:
+        if (('0' <= c && c <= '9') || c == '.' || c == 'e' || c == 'E' ||
+            c == '+' || c == '-') {
+            json_stream_putc(l, s, c);
+            return;
+        }
+        json_stream_scalar_done(l, s);
+        break;
+    case LEX_WORD:
+        if ('a' <= c && c <= 'z') {
+            json_stream_putc(l, s, c);
+            return;
+        }
+        json_stream_scalar_done(l, s);
+        break;
+    }
+    json_stream_structure(l, s, c);
+}
+
+/* Back to the start of a document, dropping anything half built */
+static void json_stream_reset(lua_State *l, json_stream_t *s)
+{
+    for (; s->nbuild; s->nbuild--) {
+        lua_pushnil(l);
+        lua_rawseti(l, JSON_STREAM_ENV, s->nbuild);
+    }
+    s->depth = 0;
+    s->top_expect = EXP_VALUE;
+    s->lex = LEX_NONE;
+    s->surrogate = 0;
+    s->failed = 0;
+    s->offset = 0;
+    s->path_len = 0;
+}
+
+static json_stream_t *json_stream_check(lua_State *l)
+{
+    json_stream_t *s = (json_stream_t *)luaL_checkudata(l, 1, JSON_STREAM_META);
+    lua_settop(l, JSON_STREAM_ENV - 1);
+    lua_getfenv(l, 1);
+    return s;
+}
+
+/* Lua: decoder:write(chunk)
+ * Parses chunk, calling back for each value it completes. After an error,
+ * including one raised by the callback, only finish() is accepted. */
+static int json_stream_write(lua_State *l)
+{
+    json_stream_t *s = json_stream_check(l);
+    size_t len, i;
+    const char *p = luaL_checklstring(l, 2, &len);
+
+    if (s->failed)
+        return luaL_error(l, "decoder failed, finish() it first");
+    for (i = 0; i < len; i++, s->offset++)
+        json_stream_byte(l, s, (unsigned char)p[i]);
+    return 0;
+}
+
+/* Lua: decoder:finish()
+ * Ends the document, raising an error if it is incomplete, and readies
+ * the decoder for the next one. */
+static int json_stream_finish(lua_State *l)
+{
+    json_stream_t *s = json_stream_check(l);
+
+    if (!s->failed && (s->lex == LEX_NUMBER || s->lex == LEX_WORD))
+        json_stream_scalar_done(l, s);
+    int complete = !s->failed && s->lex == LEX_NONE && s->top_expect == EXP_NOTHING;
+    json_stream_reset(l, s);
+    if (!complete)
+        return luaL_error(l, "unexpected end of JSON document");
+    return 0;
+}
+
+/* Lua: decoder = cjson.decoder(function(path, value) end[, {select = {...}, maxtoken = 256}])
+ * select lists paths to materialise, with '*' for any one key or index;
+ * maxtoken bounds the strings and numbers held while they are read. */
+static int json_decoder(lua_State *l)
+{
+    int maxtoken = JSON_STREAM_TOKEN;
+    int selective = 0;
+    json_stream_t *s;
+
+    luaL_checktype(l, 1, LUA_TFUNCTION);
+    lua_settop(l, 2);
+    if (!lua_isnil(l, 2)) {
+        luaL_checktype(l, 2, LUA_TTABLE);
+        lua_getfield(l, 2, "maxtoken");
+        maxtoken = luaL_optinteger(l, -1, JSON_STREAM_TOKEN);
+        luaL_argcheck(l, maxtoken > 0, 2, "wrong maxtoken");
+        lua_pop(l, 1);
+    }
+
+    lua_createtable(l, 4, 2);                       /* 3: environment */
+    lua_pushvalue(l, 1);
+    lua_setfield(l, 3, "fn");
+    if (!lua_isnil(l, 2)) {
+        lua_getfield(l, 2, "select");
+        if (!lua_isnil(l, -1)) {
+            int i;
+            luaL_checktype(l, -1, LUA_TTABLE);
+            for (i = 1; ; i++) {
+                lua_rawgeti(l, -1, i);
+                if (lua_isnil(l, -1))
+                    break;
+                luaL_argcheck(l, lua_type(l, -1) == LUA_TSTRING, 2, "select paths must be strings");
+                lua_pop(l, 1);
+            }
+            lua_pop(l, 1);
+            selective = i > 1;
+            lua_setfield(l, 3, "select");
+        } else {
+            lua_pop(l, 1);
+        }
+    }
+
+    s = (json_stream_t *)lua_newuserdata(l, sizeof(json_stream_t) + maxtoken);
+    c_memset(s, 0, sizeof(json_stream_t));
+    s->tok_max = maxtoken;
+    s->selective = selective;
+    s->top_expect = EXP_VALUE;
+    luaL_getmetatable(l, JSON_STREAM_META);
+    lua_setmetatable(l, -2);
+    lua_pushvalue(l, 3);
+    lua_setfenv(l, -2);
+    return 1;
+}
+
 /* ===== INITIALISATION ===== */
 #if 0
 #if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM < 502
@@ -1534,10 +2050,19 @@ static int json_protect_conversion(lua_State *l)
 // Module function map
 #define MIN_OPT_LEVEL 2
 #include "lrodefs.h"
+const LUA_REG_TYPE cjson_decoder_map[] =
+{
+  { LSTRKEY( "write" ), LFUNCVAL( json_stream_write ) },
+  { LSTRKEY( "finish" ), LFUNCVAL( json_stream_finish ) },
+  { LSTRKEY( "__index" ), LROVAL( cjson_decoder_map ) },
+  { LNILKEY, LNILVAL }
+};
+
 const LUA_REG_TYPE cjson_map[] = 
 {
   { LSTRKEY( "encode" ), LFUNCVAL( json_encode ) },
   { LSTRKEY( "decode" ), LFUNCVAL( json_decode ) },
+  { LSTRKEY( "decoder" ), LFUNCVAL( json_decoder ) },
   // { LSTRKEY( "encode_sparse_array" ), LFUNCVAL( json_cfg_encode_sparse_array ) },
   // { LSTRKEY( "encode_max_depth" ), LFUNCVAL( json_cfg_encode_max_depth ) },
   // { LSTRKEY( "decode_max_depth" ), LFUNCVAL( json_cfg_decode_max_depth ) },
@@ -1555,6 +2080,7 @@ const LUA_REG_TYPE cjson_map[] =
 LUALIB_API int luaopen_cjson( lua_State *L )
 {
   cjson_mem_setlua (L);
+  luaL_rometatable(L, JSON_STREAM_META, (void *)cjson_decoder_map);
 
   /* Initialise number conversions */
   // fpconv_init();         // not needed for a specific cpu.
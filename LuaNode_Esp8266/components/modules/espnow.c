@@ -0,0 +1,368 @@
+// Module for ESP-NOW: connectionless frames straight between stations
+
+#include "module.h"
+#include "lauxlib.h"
+
+#include "c_types.h"
+#include "c_string.h"
+#include "c_stdio.h"
+
+#include "esp_common.h"
+#include "espnow.h"
+#include "freertos/FreeRTOS.h"
+#include "uart.h"
+
+#define ESPNOW_MAX_DATA   250
+#define ESPNOW_KEY_LEN    16
+#define ESPNOW_RX_SLOTS   8
+#define ESPNOW_SENT_SLOTS 8
+
+typedef struct {
+  uint8 mac[6];
+  uint8 len;
+  uint8 data[ESPNOW_MAX_DATA];
+} espnow_rx_t;
+
+typedef struct {
+  uint8 mac[6];
+  uint8 status;
+} espnow_sent_t;
+
+// Filled on the wifi task and drained on the Lua task. Each side only
+// moves its own end of a ring, so the lock covers just the counts.
+static espnow_rx_t espnow_rx[ESPNOW_RX_SLOTS];
+static unsigned espnow_rx_tail, espnow_rx_count;
+static uint32 espnow_rx_dropped;
+static espnow_sent_t espnow_sent[ESPNOW_SENT_SLOTS];
+static unsigned espnow_sent_tail, espnow_sent_count;
+static bool espnow_posted;
+
+static bool espnow_running = false;
+static int espnow_recv_ref = LUA_NOREF;
+static int espnow_sent_ref = LUA_NOREF;
+
+static void espnow_task( void );
+
+// Called with the lock held; one post covers everything queued before it runs
+static void espnow_post( void )
+{
+  if (!espnow_posted)
+    espnow_posted = uart_post_lua_task(espnow_task);
+}
+
+static void espnow_recv_cb( uint8 *mac, uint8 *data, uint8 len )
+{
+  unsigned slot;
+
+  if (len > ESPNOW_MAX_DATA)
+    len = ESPNOW_MAX_DATA;
+  portENTER_CRITICAL();
+  if (espnow_rx_count == ESPNOW_RX_SLOTS) {
+    espnow_rx_dropped++;
+    portEXIT_CRITICAL();
+    return;
+  }
+  slot = (espnow_rx_tail + espnow_rx_count) % ESPNOW_RX_SLOTS;
+  portEXIT_CRITICAL();
+
+  c_memcpy(espnow_rx[slot].mac, mac, 6);
+  espnow_rx[slot].len = len;
+  c_memcpy(espnow_rx[slot].data, data, len);
+
+  portENTER_CRITICAL();
+  espnow_rx_count++;
+  espnow_post();
+  portEXIT_CRITICAL();
+}
+
+static void espnow_send_cb( uint8 *mac, uint8 status )
+{
+  portENTER_CRITICAL();
+  if (espnow_sent_count < ESPNOW_SENT_SLOTS) {
+    espnow_sent_t *s = &espnow_sent[(espnow_sent_tail + espnow_sent_count) % ESPNOW_SENT_SLOTS];
+    c_memcpy(s->mac, mac, 6);
+    s->status = status;
+    espnow_sent_count++;
+    espnow_post();
+  }
+  portEXIT_CRITICAL();
+}
+
+static void espnow_push_mac( lua_State *L, const uint8 *mac )
+{
+  char buf[18];
+  c_sprintf(buf, MACSTR, MAC2STR(mac));
+  lua_pushstring( L, buf );
+}
+
+static void espnow_deliver_sent( lua_State *L )
+{
+  espnow_sent_t s;
+
+  for (;;) {
+    portENTER_CRITICAL();
+    if (espnow_sent_count == 0) {
+      portEXIT_CRITICAL();
+      return;
+    }
+    s = espnow_sent[espnow_sent_tail];
+    espnow_sent_tail = (espnow_sent_tail + 1) % ESPNOW_SENT_SLOTS;
+    espnow_sent_count--;
+    portEXIT_CRITICAL();
+
+    if (espnow_sent_ref == LUA_NOREF)
+      continue;
+    lua_rawgeti( L, LUA_REGISTRYINDEX, espnow_sent_ref );
+    espnow_push_mac( L, s.mac );
+    lua_pushboolean( L, s.status == 0 );
+    lua_call( L, 2, 0 );
+  }
+}
+
+// Everything received since the last run goes to the callback as one list
+static void espnow_deliver_recv( lua_State *L )
+{
+  unsigned n, i;
+  uint32 dropped;
+
+  portENTER_CRITICAL();
+  n = espnow_rx_count;
+  dropped = espnow_rx_dropped;
+  espnow_rx_dropped = 0;
+  portEXIT_CRITICAL();
+  if (n == 0 && dropped == 0)
+    return;
+
+  if (espnow_recv_ref != LUA_NOREF) {
+    lua_rawgeti( L, LUA_REGISTRYINDEX, espnow_recv_ref );
+    lua_createtable( L, n, 0 );
+  }
+  for (i = 0; i < n; i++) {
+    espnow_rx_t *r = &espnow_rx[espnow_rx_tail];
+    if (espnow_recv_ref != LUA_NOREF) {
+      lua_createtable( L, 0, 2 );
+      espnow_push_mac( L, r->mac );
+      lua_setfield( L, -2, "mac" );
+      lua_pushlstring( L, (const char *)r->data, r->len );
+      lua_setfield( L, -2, "data" );
+      lua_rawseti( L, -2, i + 1 );
+    }
+    portENTER_CRITICAL();
+    espnow_rx_tail = (espnow_rx_tail + 1) % ESPNOW_RX_SLOTS;
+    espnow_rx_count--;
+    portEXIT_CRITICAL();
+  }
+  if (espnow_recv_ref != LUA_NOREF) {
+    lua_pushinteger( L, dropped );
+    lua_call( L, 2, 0 );
+  }
+}
+
+static void espnow_task( void )
+{
+  lua_State *L = lua_getstate();
+
+  // anything arriving from here on needs a post of its own
+  portENTER_CRITICAL();
+  espnow_posted = false;
+  portEXIT_CRITICAL();
+
+  if (!espnow_running)
+    return;
+  espnow_deliver_sent( L );
+  espnow_deliver_recv( L );
+}
+
+static int espnow_hex( char c )
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+static void espnow_check_mac( lua_State *L, int idx, uint8 *mac )
+{
+  size_t len;
+  int i, hi, lo;
+  const char *s = luaL_checklstring( L, idx, &len );
+
+  for (i = 0; len == 17 && i < 6; i++) {
+    hi = espnow_hex(s[i * 3]);
+    lo = espnow_hex(s[i * 3 + 1]);
+    if (hi < 0 || lo < 0 || (i < 5 && s[i * 3 + 2] != ':'))
+      break;
+    mac[i] = (hi << 4) | lo;
+  }
+  if (i != 6)
+    luaL_argerror( L, idx, "mac must be xx:xx:xx:xx:xx:xx" );
+}
+
+static int espnow_check_role( lua_State *L, int idx, int def )
+{
+  int role = luaL_optinteger( L, idx, def );
+  if (role < ESP_NOW_ROLE_IDLE || role >= ESP_NOW_ROLE_MAX)
+    return luaL_argerror( L, idx, "wrong role" );
+  return role;
+}
+
+static void espnow_unref( lua_State *L, int *ref )
+{
+  if (*ref != LUA_NOREF)
+    luaL_unref( L, LUA_REGISTRYINDEX, *ref );
+  *ref = LUA_NOREF;
+}
+
+// Lua: init( [role] )
+static int espnow_init( lua_State *L )
+{
+  int role = espnow_check_role( L, 1, ESP_NOW_ROLE_CONTROLLER );
+
+  if (espnow_running)
+    return luaL_error( L, "already running" );
+  // ESP-NOW needs the radio up, though not an association
+  if (wifi_get_opmode() == NULL_MODE && !wifi_set_opmode_current(STATION_MODE))
+    return luaL_error( L, "wifi mode" );
+  if (esp_now_init() != 0)
+    return luaL_error( L, "init failed" );
+
+  portENTER_CRITICAL();
+  espnow_rx_tail = espnow_rx_count = 0;
+  espnow_rx_dropped = 0;
+  espnow_sent_tail = espnow_sent_count = 0;
+  portEXIT_CRITICAL();
+
+  esp_now_set_self_role(role);
+  esp_now_register_recv_cb(espnow_recv_cb);
+  esp_now_register_send_cb(espnow_send_cb);
+  espnow_running = true;
+  return 0;
+}
+
+// Lua: deinit()
+static int espnow_deinit( lua_State *L )
+{
+  if (!espnow_running)
+    return 0;
+  esp_now_unregister_recv_cb();
+  esp_now_unregister_send_cb();
+  esp_now_deinit();
+  espnow_running = false;
+  return 0;
+}
+
+// Lua: addpeer( mac, [role], [channel], [key] )
+static int espnow_addpeer( lua_State *L )
+{
+  uint8 mac[6];
+  size_t klen = 0;
+  const char *key;
+  int role, channel;
+
+  espnow_check_mac( L, 1, mac );
+  role = espnow_check_role( L, 2, ESP_NOW_ROLE_SLAVE );
+  channel = luaL_optinteger( L, 3, 0 );
+  luaL_argcheck( L, channel >= 0 && channel <= 14, 3, "wrong channel" );
+  key = luaL_optlstring( L, 4, NULL, &klen );
+  luaL_argcheck( L, key == NULL || klen == ESPNOW_KEY_LEN, 4, "key must be 16 bytes" );
+  if (!espnow_running)
+    return luaL_error( L, "not running" );
+
+  if (esp_now_is_peer_exist(mac) > 0)
+    esp_now_del_peer(mac);
+  if (esp_now_add_peer(mac, role, channel, (uint8 *)key, klen) != 0)
+    return luaL_error( L, "peer table full" );
+  return 0;
+}
+
+// Lua: delpeer( mac )
+static int espnow_delpeer( lua_State *L )
+{
+  uint8 mac[6];
+
+  espnow_check_mac( L, 1, mac );
+  if (!espnow_running)
+    return luaL_error( L, "not running" );
+  lua_pushboolean( L, esp_now_del_peer(mac) == 0 );
+  return 1;
+}
+
+// Lua: list, encrypted = peers()
+static int espnow_peers( lua_State *L )
+{
+  uint8 all = 0, enc = 0;
+  uint8 *mac;
+  int i = 0;
+
+  if (!espnow_running)
+    return luaL_error( L, "not running" );
+  esp_now_get_cnt_info(&all, &enc);
+  lua_createtable( L, all, 0 );
+  for (mac = esp_now_fetch_peer(true); mac != NULL; mac = esp_now_fetch_peer(false)) {
+    espnow_push_mac( L, mac );
+    lua_rawseti( L, -2, ++i );
+  }
+  lua_pushinteger( L, enc );
+  return 2;
+}
+
+// Lua: ok = send( mac or nil, data )
+// With nil for mac the frame goes to every peer
+static int espnow_send( lua_State *L )
+{
+  uint8 mac[6];
+  size_t len;
+  const char *data;
+  bool all = lua_isnoneornil( L, 1 );
+
+  if (!all)
+    espnow_check_mac( L, 1, mac );
+  data = luaL_checklstring( L, 2, &len );
+  luaL_argcheck( L, len > 0 && len <= ESPNOW_MAX_DATA, 2, "1 to 250 bytes" );
+  if (!espnow_running)
+    return luaL_error( L, "not running" );
+  lua_pushboolean( L, esp_now_send(all ? NULL : mac, (uint8 *)data, len) == 0 );
+  return 1;
+}
+
+// Lua: on( "receive", function(list, dropped) ) or on( "sent", function(mac, ok) )
+// Pass nil instead of a function to remove it.
+static int espnow_on( lua_State *L )
+{
+  int *ref;
+  const char *what = luaL_checkstring( L, 1 );
+
+  if (c_strcmp(what, "receive") == 0)
+    ref = &espnow_recv_ref;
+  else if (c_strcmp(what, "sent") == 0)
+    ref = &espnow_sent_ref;
+  else
+    return luaL_argerror( L, 1, "receive or sent" );
+
+  espnow_unref( L, ref );
+  if (lua_type(L, 2) == LUA_TFUNCTION || lua_type(L, 2) == LUA_TLIGHTFUNCTION) {
+    lua_pushvalue( L, 2 );
+    *ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  return 0;
+}
+
+// Module function map
+static const LUA_REG_TYPE espnow_map[] = {
+  { LSTRKEY( "init" ), LFUNCVAL( espnow_init ) },
+  { LSTRKEY( "deinit" ), LFUNCVAL( espnow_deinit ) },
+  { LSTRKEY( "addpeer" ), LFUNCVAL( espnow_addpeer ) },
+  { LSTRKEY( "delpeer" ), LFUNCVAL( espnow_delpeer ) },
+  { LSTRKEY( "peers" ), LFUNCVAL( espnow_peers ) },
+  { LSTRKEY( "send" ), LFUNCVAL( espnow_send ) },
+  { LSTRKEY( "on" ), LFUNCVAL( espnow_on ) },
+  { LSTRKEY( "IDLE" ), LNUMVAL( ESP_NOW_ROLE_IDLE ) },
+  { LSTRKEY( "CONTROLLER" ), LNUMVAL( ESP_NOW_ROLE_CONTROLLER ) },
+  { LSTRKEY( "SLAVE" ), LNUMVAL( ESP_NOW_ROLE_SLAVE ) },
+  { LSTRKEY( "MAX_DATA" ), LNUMVAL( ESPNOW_MAX_DATA ) },
+  { LNILKEY, LNILVAL }
+};
+
+LUANODE_MODULE(ESPNOW, "espnow", espnow_map, NULL);
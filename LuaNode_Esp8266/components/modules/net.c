@@ -0,0 +1,923 @@
+// Module for TCP and UDP over the lwIP raw API, ported from the ESP32 tree
+//
+// lwIP calls back on its own task; each callback copies what it needs into
+// an event and posts it to the Lua task (task/task.h), which runs the Lua
+// callbacks. The Lua API is the ESP32 one without TLS, connection pooling
+// and receive watermarks.
+
+#include "module.h"
+#include "lauxlib.h"
+
+#include "c_types.h"
+#include "c_string.h"
+#include "c_stdlib.h"
+
+#include "esp_common.h"
+#include "task/task.h"
+
+#include "lwip/err.h"
+#include "lwip/ip_addr.h"
+#include "lwip/dns.h"
+#include "lwip/tcp.h"
+#include "lwip/udp.h"
+
+// Some LWIP macros cause complaints with ptr NULL checks, so shut them off :(
+#pragma GCC diagnostic ignored "-Waddress"
+
+typedef enum net_type {
+  TYPE_TCP_SERVER = 0,
+  TYPE_TCP_CLIENT,
+  TYPE_UDP_SOCKET
+} net_type;
+
+typedef const char net_table_name[14];
+
+static const net_table_name NET_TABLES[] = {
+  "net.tcpserver",
+  "net.tcpsocket",
+  "net.udpsocket"
+};
+#define NET_TABLE_TCP_SERVER NET_TABLES[0]
+#define NET_TABLE_TCP_CLIENT NET_TABLES[1]
+#define NET_TABLE_UDP_SOCKET NET_TABLES[2]
+
+#define TYPE_TCP TYPE_TCP_CLIENT
+#define TYPE_UDP TYPE_UDP_SOCKET
+
+#define IP_STR_SZ 16
+
+// Outgoing TCP data lwIP had no room for yet, sent from the "sent" event
+typedef struct lnet_sendbuf {
+  struct lnet_sendbuf *next;
+  uint32 len;
+  uint32 off;
+  char data[0];
+} lnet_sendbuf;
+
+typedef struct lnet_userdata {
+  enum net_type type;
+  int self_ref;
+  union {
+    struct tcp_pcb *tcp_pcb;
+    struct udp_pcb *udp_pcb;
+    void *pcb;
+  };
+  union {
+    struct {
+      int cb_accept_ref;
+    } server;
+    struct {
+      int wait_dns;
+      int cb_dns_ref;
+      int cb_receive_ref;
+      int cb_sent_ref;
+      // Only for TCP:
+      lnet_sendbuf *sq_head;
+      lnet_sendbuf *sq_tail;
+      int sq_close;  // close once the send queue has drained
+      int cb_connect_ref;
+      int cb_disconnect_ref;
+      int cb_reconnect_ref;
+    } client;
+  };
+} lnet_userdata;
+
+
+// --- Event handling
+
+typedef struct {
+  ip_addr_t src_ip;
+  uint16 src_port;
+  uint16 payload_len;
+  char payload[0];
+} lnet_recvdata;
+
+typedef struct lnet_event {
+  enum {
+    DNSFOUND,
+    CONNECTED,
+    ACCEPT,
+    RECVDATA,
+    SENTDATA,
+    ERR
+  } event;
+  lnet_userdata *ud;
+  union {
+    struct tcp_pcb *accept_newpcb;
+    err_t err;
+    ip_addr_t resolved_ip;
+    lnet_recvdata recvdata;
+  };
+} lnet_event;
+
+static task_handle_t net_event;
+
+static lnet_event *net_event_alloc (lnet_userdata *ud, int event, size_t payload)
+{
+  lnet_event *ev = (lnet_event *)c_malloc (sizeof (lnet_event) + payload);
+  if (ev) {
+    ev->event = event;
+    ev->ud = ud;
+  }
+  return ev;
+}
+
+static bool net_event_post (lnet_event *ev, task_prio_t prio)
+{
+  if (!ev)
+    return false;
+  if (!task_post (prio, net_event, (task_param_t)ev)) {
+    c_free (ev);
+    return false;
+  }
+  return true;
+}
+
+static int lwip_lua_checkerr (lua_State *L, err_t err) {
+  switch (err) {
+    case ERR_OK: return 0;
+    case ERR_MEM: return luaL_error(L, "out of memory");
+    case ERR_BUF: return luaL_error(L, "buffer error");
+    case ERR_TIMEOUT: return luaL_error(L, "timeout");
+    case ERR_RTE: return luaL_error(L, "routing problem");
+    case ERR_INPROGRESS: return luaL_error(L, "in progress");
+    case ERR_VAL: return luaL_error(L, "illegal value");
+    case ERR_WOULDBLOCK: return luaL_error(L, "would block");
+    case ERR_ABRT: return luaL_error(L, "connection aborted");
+    case ERR_RST: return luaL_error(L, "connection reset");
+    case ERR_CLSD: return luaL_error(L, "connection closed");
+    case ERR_CONN: return luaL_error(L, "not connected");
+    case ERR_ARG: return luaL_error(L, "illegal argument");
+    case ERR_USE: return luaL_error(L, "address in use");
+    case ERR_IF: return luaL_error(L, "netif error");
+    case ERR_ISCONN: return luaL_error(L, "already connected");
+    default: return luaL_error(L, "unknown error");
+  }
+}
+
+static void ipstr (char *out, const ip_addr_t *addr) {
+  ipaddr_ntoa_r(addr, out, IP_STR_SZ);
+}
+
+// --- Create
+
+static lnet_userdata *net_create( lua_State *L, enum net_type type ) {
+  const char *mt = NET_TABLES[type];
+  lnet_userdata *ud = (lnet_userdata *)lua_newuserdata(L, sizeof(lnet_userdata));
+  if (!ud) return NULL;
+  luaL_getmetatable(L, mt);
+  lua_setmetatable(L, -2);
+
+  ud->type = type;
+  ud->self_ref = LUA_NOREF;
+  ud->pcb = NULL;
+
+  switch (type) {
+    case TYPE_TCP_CLIENT:
+      ud->client.cb_connect_ref = LUA_NOREF;
+      ud->client.cb_reconnect_ref = LUA_NOREF;
+      ud->client.cb_disconnect_ref = LUA_NOREF;
+      ud->client.sq_head = ud->client.sq_tail = NULL;
+      ud->client.sq_close = 0;
+    case TYPE_UDP_SOCKET:
+      ud->client.wait_dns = 0;
+      ud->client.cb_dns_ref = LUA_NOREF;
+      ud->client.cb_receive_ref = LUA_NOREF;
+      ud->client.cb_sent_ref = LUA_NOREF;
+      break;
+    case TYPE_TCP_SERVER:
+      ud->server.cb_accept_ref = LUA_NOREF;
+      break;
+  }
+  return ud;
+}
+
+static void net_sendq_free (lnet_userdata *ud) {
+  while (ud->client.sq_head) {
+    lnet_sendbuf *c = ud->client.sq_head;
+    ud->client.sq_head = c->next;
+    c_free(c);
+  }
+  ud->client.sq_tail = NULL;
+}
+
+// Hand as much queued data to lwIP as its send buffer takes
+static err_t net_sendq_flush (lnet_userdata *ud) {
+  struct tcp_pcb *pcb = ud->tcp_pcb;
+  err_t err = ERR_OK;
+  bool wrote = false;
+  lnet_sendbuf *c;
+  while ((c = ud->client.sq_head)) {
+    uint32 n = c->len - c->off;
+    u16_t avail = tcp_sndbuf(pcb);
+    if (avail == 0)
+      break;
+    if (n > avail)
+      n = avail;
+    err = tcp_write(pcb, c->data + c->off, n, TCP_WRITE_FLAG_COPY);
+    if (err == ERR_MEM) {   // out of segments; the next ack frees some
+      err = ERR_OK;
+      break;
+    }
+    if (err != ERR_OK)
+      break;
+    wrote = true;
+    c->off += n;
+    if (c->off < c->len)
+      break;
+    ud->client.sq_head = c->next;
+    if (!c->next)
+      ud->client.sq_tail = NULL;
+    c_free(c);
+  }
+  if (wrote)
+    tcp_output(pcb);
+  return err;
+}
+
+// --- lwIP callbacks, on the lwIP task
+
+static void net_err_cb(void *arg, err_t err) {
+  lnet_userdata *ud = (lnet_userdata*)arg;
+  if (!ud || ud->type != TYPE_TCP_CLIENT || ud->self_ref == LUA_NOREF) return;
+  ud->pcb = NULL; // Will be freed at LWIP level
+
+  lnet_event *ev = net_event_alloc (ud, ERR, 0);
+  if (ev)
+    ev->err = err;
+  net_event_post (ev, TASK_PRIORITY_MEDIUM);
+}
+
+static err_t net_connected_cb(void *arg, struct tcp_pcb *tpcb, err_t err) {
+  lnet_userdata *ud = (lnet_userdata*)arg;
+  if (!ud || ud->pcb != tpcb) return ERR_ABRT;
+  if (err != ERR_OK) {
+    net_err_cb(arg, err);
+    return ERR_ABRT;
+  }
+  net_event_post (net_event_alloc (ud, CONNECTED, 0), TASK_PRIORITY_MEDIUM);
+  return ERR_OK;
+}
+
+static void net_dns_cb(const char *name, ip_addr_t *ipaddr, void *arg) {
+  lnet_userdata *ud = (lnet_userdata*)arg;
+  if (!ud) return;
+  lnet_event *ev = net_event_alloc (ud, DNSFOUND, 0);
+  if (ev)
+    ev->resolved_ip = ipaddr ? *ipaddr : ip_addr_any;
+  net_event_post (ev, TASK_PRIORITY_MEDIUM);
+}
+
+static bool post_net_recv (lnet_userdata *ud, struct pbuf *p, ip_addr_t *ip, u16_t port)
+{
+  lnet_event *ev = net_event_alloc (ud, RECVDATA, p->tot_len);
+  if (!ev)
+    return false;
+  if (ip)
+    ev->recvdata.src_ip = *ip;
+  ev->recvdata.src_port = port;
+  ev->recvdata.payload_len = p->tot_len;
+  pbuf_copy_partial (p, ev->recvdata.payload, p->tot_len, 0);
+  return net_event_post (ev, TASK_PRIORITY_HIGH);
+}
+
+static void net_udp_recv_cb(void *arg, struct udp_pcb *pcb, struct pbuf *p, ip_addr_t *addr, u16_t port) {
+  lnet_userdata *ud = (lnet_userdata*)arg;
+  if (ud && ud->pcb && ud->type == TYPE_UDP_SOCKET && ud->self_ref != LUA_NOREF)
+    post_net_recv (ud, p, addr, port);
+  if (p)
+    pbuf_free(p);
+}
+
+static err_t net_tcp_recv_cb(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
+  lnet_userdata *ud = (lnet_userdata*)arg;
+  if (!ud || !ud->pcb || ud->type != TYPE_TCP_CLIENT || ud->self_ref == LUA_NOREF)
+    return ERR_ABRT;
+  if (!p) {
+    net_err_cb(arg, err);
+    return tcp_close(tpcb);
+  }
+  if (!post_net_recv (ud, p, 0, 0))
+    return ERR_MEM; // lwIP holds on to the data and offers it again later
+  tcp_recved(tpcb, p->tot_len);
+  pbuf_free(p);
+  return ERR_OK;
+}
+
+static err_t net_sent_cb(void *arg, struct tcp_pcb *tpcb, u16_t len) {
+  lnet_userdata *ud = (lnet_userdata*)arg;
+  if (!ud || !ud->pcb || ud->type != TYPE_TCP_CLIENT || ud->self_ref == LUA_NOREF) return ERR_ABRT;
+  if (ud->client.cb_sent_ref == LUA_NOREF && !ud->client.sq_head && !ud->client.sq_close)
+    return ERR_OK;
+  net_event_post (net_event_alloc (ud, SENTDATA, 0), TASK_PRIORITY_MEDIUM);
+  return ERR_OK;
+}
+
+static err_t net_accept_cb(void *arg, struct tcp_pcb *newpcb, err_t err) {
+  lnet_userdata *ud = (lnet_userdata*)arg;
+  if (!ud || ud->type != TYPE_TCP_SERVER || !ud->pcb) return ERR_ABRT;
+  if (ud->self_ref == LUA_NOREF || ud->server.cb_accept_ref == LUA_NOREF) return ERR_ABRT;
+
+  lnet_event *ev = net_event_alloc (ud, ACCEPT, 0);
+  if (ev)
+    ev->accept_newpcb = newpcb;
+  return net_event_post (ev, TASK_PRIORITY_MEDIUM) ? ERR_OK : ERR_ABRT;
+}
+
+// --- Lua API - create
+
+// Lua: net.createUDPSocket()
+static int net_createUDPSocket( lua_State *L ) {
+  net_create(L, TYPE_UDP_SOCKET);
+  return 1;
+}
+
+// Lua: net.createServer(type)
+static int net_createServer( lua_State *L ) {
+  int type = luaL_optlong(L, 1, TYPE_TCP);
+  if (type == TYPE_UDP) return net_createUDPSocket( L );
+  if (type != TYPE_TCP) return luaL_error(L, "invalid type");
+  net_create(L, TYPE_TCP_SERVER);
+  return 1;
+}
+
+// Lua: net.createConnection(type)
+static int net_createConnection( lua_State *L ) {
+  int type = luaL_optlong(L, 1, TYPE_TCP);
+  if (type == TYPE_UDP) return net_createUDPSocket( L );
+  if (type != TYPE_TCP) return luaL_error(L, "invalid type");
+  net_create(L, TYPE_TCP_CLIENT);
+  return 1;
+}
+
+// --- Get & check userdata
+
+static lnet_userdata *net_get_udata_s( lua_State *L, int stack ) {
+  if (!lua_isuserdata(L, stack)) return NULL;
+  lnet_userdata *ud = (lnet_userdata *)lua_touserdata(L, stack);
+  switch (ud->type) {
+    case TYPE_TCP_CLIENT:
+    case TYPE_TCP_SERVER:
+    case TYPE_UDP_SOCKET:
+      break;
+    default: return NULL;
+  }
+  const char *mt = NET_TABLES[ud->type];
+  ud = luaL_checkudata(L, stack, mt);
+  return ud;
+}
+#define net_get_udata(L) net_get_udata_s(L, 1)
+
+// --- Lua API
+
+// Lua: server:listen(port, addr, function(c)), socket:listen(port, addr)
+static int net_listen( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud || ud->type == TYPE_TCP_CLIENT)
+    return luaL_error(L, "invalid user data");
+  if (ud->pcb)
+    return luaL_error(L, "already listening");
+  int stack = 2;
+  uint16 port = 0;
+  const char *domain = "0.0.0.0";
+  if (lua_isnumber(L, stack))
+    port = lua_tointeger(L, stack++);
+  if (lua_isstring(L, stack))
+    domain = lua_tostring(L, stack++);
+  ip_addr_t addr;
+  if (!ipaddr_aton(domain, &addr))
+    return luaL_error(L, "invalid IP address");
+  if (ud->type == TYPE_TCP_SERVER) {
+    if (lua_isfunction(L, stack) || lua_islightfunction(L, stack)) {
+      lua_pushvalue(L, stack++);
+      luaL_unref(L, LUA_REGISTRYINDEX, ud->server.cb_accept_ref);
+      ud->server.cb_accept_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    } else {
+      return luaL_error(L, "need callback");
+    }
+  }
+  err_t err = ERR_OK;
+  switch (ud->type) {
+    case TYPE_TCP_SERVER:
+      ud->tcp_pcb = tcp_new();
+      if (!ud->tcp_pcb)
+        return luaL_error(L, "cannot allocate PCB");
+      err = tcp_bind(ud->tcp_pcb, &addr, port);
+      if (err == ERR_OK) {
+        tcp_arg(ud->tcp_pcb, ud);
+        struct tcp_pcb *pcb = tcp_listen(ud->tcp_pcb);
+        if (!pcb) {
+          err = ERR_MEM;
+        } else {
+          ud->tcp_pcb = pcb;
+          tcp_accept(ud->tcp_pcb, net_accept_cb);
+        }
+      }
+      break;
+    case TYPE_UDP_SOCKET:
+      ud->udp_pcb = udp_new();
+      if (!ud->udp_pcb)
+        return luaL_error(L, "cannot allocate PCB");
+      udp_recv(ud->udp_pcb, net_udp_recv_cb, ud);
+      err = udp_bind(ud->udp_pcb, &addr, port);
+      break;
+    default: break;
+  }
+  if (err != ERR_OK) {
+    switch (ud->type) {
+      case TYPE_TCP_SERVER:
+        tcp_close(ud->tcp_pcb);
+        ud->tcp_pcb = NULL;
+        break;
+      case TYPE_UDP_SOCKET:
+        udp_remove(ud->udp_pcb);
+        ud->udp_pcb = NULL;
+        break;
+      default: break;
+    }
+    return lwip_lua_checkerr(L, err);
+  }
+  if (ud->self_ref == LUA_NOREF) {
+    lua_pushvalue(L, 1);
+    ud->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  return 0;
+}
+
+// Lua: client:connect(port, addr)
+static int net_connect( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud || ud->type != TYPE_TCP_CLIENT)
+    return luaL_error(L, "invalid user data");
+  if (ud->pcb)
+    return luaL_error(L, "already connected");
+  uint16 port = luaL_checkinteger(L, 2);
+  if (port == 0)
+    return luaL_error(L, "specify port");
+  const char *domain = "127.0.0.1";
+  if (lua_isstring(L, 3))
+    domain = lua_tostring(L, 3);
+  ud->tcp_pcb = tcp_new();
+  if (!ud->tcp_pcb)
+    return luaL_error(L, "cannot allocate PCB");
+  tcp_arg(ud->tcp_pcb, ud);
+  tcp_err(ud->tcp_pcb, net_err_cb);
+  tcp_recv(ud->tcp_pcb, net_tcp_recv_cb);
+  tcp_sent(ud->tcp_pcb, net_sent_cb);
+  ud->tcp_pcb->remote_port = port;
+  ip_addr_t addr;
+  ud->client.wait_dns ++;
+  int unref = 0;
+  if (ud->self_ref == LUA_NOREF) {
+    unref = 1;
+    lua_pushvalue(L, 1);
+    ud->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  err_t err = dns_gethostbyname(domain, &addr, net_dns_cb, ud);
+  if (err == ERR_OK) {
+    net_dns_cb(domain, &addr, ud);
+  } else if (err != ERR_INPROGRESS) {
+    ud->client.wait_dns --;
+    if (unref) {
+      luaL_unref(L, LUA_REGISTRYINDEX, ud->self_ref);
+      ud->self_ref = LUA_NOREF;
+    }
+    tcp_abort(ud->tcp_pcb);
+    ud->tcp_pcb = NULL;
+    return lwip_lua_checkerr(L, err);
+  }
+  return 0;
+}
+
+// Lua: client/socket:on(name, callback)
+static int net_on( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud || ud->type == TYPE_TCP_SERVER)
+    return luaL_error(L, "invalid user data");
+  int *refptr = NULL;
+  const char *name = luaL_checkstring(L, 2);
+  switch (ud->type) {
+    case TYPE_TCP_CLIENT:
+      if (c_strcmp("connection",name)==0)
+        { refptr = &ud->client.cb_connect_ref; break; }
+      if (c_strcmp("disconnection",name)==0)
+        { refptr = &ud->client.cb_disconnect_ref; break; }
+      if (c_strcmp("reconnection",name)==0)
+        { refptr = &ud->client.cb_reconnect_ref; break; }
+    case TYPE_UDP_SOCKET:
+      if (c_strcmp("dns",name)==0)
+        { refptr = &ud->client.cb_dns_ref; break; }
+      if (c_strcmp("receive",name)==0)
+        { refptr = &ud->client.cb_receive_ref; break; }
+      if (c_strcmp("sent",name)==0)
+        { refptr = &ud->client.cb_sent_ref; break; }
+      break;
+    default: return luaL_error(L, "invalid user data");
+  }
+  if (refptr == NULL)
+    return luaL_error(L, "invalid callback name");
+  if (lua_isfunction(L, 3) || lua_islightfunction(L, 3)) {
+    lua_pushvalue(L, 3);
+    luaL_unref(L, LUA_REGISTRYINDEX, *refptr);
+    *refptr = luaL_ref(L, LUA_REGISTRYINDEX);
+  } else if (lua_isnil(L, 3)) {
+    luaL_unref(L, LUA_REGISTRYINDEX, *refptr);
+    *refptr = LUA_NOREF;
+  } else {
+    return luaL_error(L, "invalid callback function");
+  }
+  return 0;
+}
+
+// Lua: client:send(data[, function(c)]), socket:send(port, ip, data[, function(s)])
+// TCP data lwIP can't take yet is queued and sent as acks come in.
+static int net_send( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud || ud->type == TYPE_TCP_SERVER)
+    return luaL_error(L, "invalid user data");
+  ip_addr_t addr;
+  uint16 port = 0;
+  size_t datalen = 0;
+  int stack = 2;
+  if (ud->type == TYPE_UDP_SOCKET) {
+    port = luaL_checkinteger(L, stack++);
+    if (port == 0) return luaL_error(L, "need port");
+    const char *domain = luaL_checkstring(L, stack++);
+    if (!ipaddr_aton(domain, &addr))
+      return luaL_error(L, "invalid IP address");
+  }
+  const char *data = luaL_checklstring(L, stack++, &datalen);
+  if (!data || datalen == 0) return luaL_error(L, "no data to send");
+  if (lua_isfunction(L, stack) || lua_islightfunction(L, stack)) {
+    lua_pushvalue(L, stack);
+    luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_sent_ref);
+    ud->client.cb_sent_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  if (ud->type == TYPE_UDP_SOCKET) {
+    if (!ud->pcb) {
+      ud->udp_pcb = udp_new();
+      if (!ud->udp_pcb)
+        return luaL_error(L, "cannot allocate PCB");
+      udp_recv(ud->udp_pcb, net_udp_recv_cb, ud);
+      if (ud->self_ref == LUA_NOREF) {
+        lua_pushvalue(L, 1);
+        ud->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      }
+    }
+    struct pbuf *pb = pbuf_alloc(PBUF_TRANSPORT, datalen, PBUF_RAM);
+    if (!pb)
+      return luaL_error(L, "cannot allocate message buffer");
+    pbuf_take(pb, data, datalen);
+    err_t err = udp_sendto(ud->udp_pcb, pb, &addr, port);
+    pbuf_free(pb);
+    if (ud->client.cb_sent_ref != LUA_NOREF) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_sent_ref);
+      lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+      lua_call(L, 1, 0);
+    }
+    return lwip_lua_checkerr(L, err);
+  }
+  if (!ud->pcb || ud->self_ref == LUA_NOREF)
+    return luaL_error(L, "not connected");
+  lnet_sendbuf *c = (lnet_sendbuf *)c_malloc(sizeof(lnet_sendbuf) + datalen);
+  if (!c)
+    return luaL_error(L, "out of memory");
+  c->next = NULL;
+  c->len = datalen;
+  c->off = 0;
+  c_memcpy(c->data, data, datalen);
+  if (ud->client.sq_tail)
+    ud->client.sq_tail->next = c;
+  else
+    ud->client.sq_head = c;
+  ud->client.sq_tail = c;
+  err_t err = net_sendq_flush(ud);
+  if (err != ERR_OK)
+    net_sendq_free(ud);
+  return lwip_lua_checkerr(L, err);
+}
+
+// Lua: client:getpeer()
+static int net_getpeer( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud || ud->type != TYPE_TCP_CLIENT)
+    return luaL_error(L, "invalid user data");
+  if (!ud->pcb || ud->tcp_pcb->remote_port == 0) {
+    lua_pushnil(L);
+    lua_pushnil(L);
+    return 2;
+  }
+  char addr_str[IP_STR_SZ];
+  ipstr (addr_str, &ud->tcp_pcb->remote_ip);
+  lua_pushinteger(L, ud->tcp_pcb->remote_port);
+  lua_pushstring(L, addr_str);
+  return 2;
+}
+
+// Lua: client/server/socket:getaddr()
+static int net_getaddr( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud) return luaL_error(L, "invalid user data");
+  uint16 port = 0;
+  ip_addr_t addr;
+  if (ud->pcb) {
+    if (ud->type == TYPE_UDP_SOCKET) {
+      addr = ud->udp_pcb->local_ip;
+      port = ud->udp_pcb->local_port;
+    } else {
+      addr = ud->tcp_pcb->local_ip;
+      port = ud->tcp_pcb->local_port;
+    }
+  }
+  if (port == 0) {
+    lua_pushnil(L);
+    lua_pushnil(L);
+    return 2;
+  }
+  char addr_str[IP_STR_SZ];
+  ipstr (addr_str, &addr);
+  lua_pushinteger(L, port);
+  lua_pushstring(L, addr_str);
+  return 2;
+}
+
+// Lua: client/server/socket:close()
+static int net_close( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud) return luaL_error(L, "invalid user data");
+  if (ud->pcb) {
+    switch (ud->type) {
+      case TYPE_TCP_CLIENT:
+        if (ud->client.sq_head) {
+          ud->client.sq_close = 1;  // finish sending first, see lsent_cb
+          return 0;
+        }
+        if (ERR_OK != tcp_close(ud->tcp_pcb)) {
+          tcp_arg(ud->tcp_pcb, NULL);
+          tcp_abort(ud->tcp_pcb);
+        }
+        ud->tcp_pcb = NULL;
+        break;
+      case TYPE_TCP_SERVER:
+        tcp_close(ud->tcp_pcb);
+        ud->tcp_pcb = NULL;
+        break;
+      case TYPE_UDP_SOCKET:
+        udp_remove(ud->udp_pcb);
+        ud->udp_pcb = NULL;
+        break;
+    }
+  } else {
+    return luaL_error(L, "not connected");
+  }
+  if (ud->type == TYPE_TCP_SERVER ||
+     (ud->pcb == NULL && ud->client.wait_dns == 0)) {
+    lua_gc(L, LUA_GCSTOP, 0);
+    luaL_unref(L, LUA_REGISTRYINDEX, ud->self_ref);
+    ud->self_ref = LUA_NOREF;
+    lua_gc(L, LUA_GCRESTART, 0);
+  }
+  return 0;
+}
+
+static int net_delete( lua_State *L ) {
+  lnet_userdata *ud = net_get_udata(L);
+  if (!ud) return luaL_error(L, "no user data");
+  if (ud->pcb) {
+    switch (ud->type) {
+      case TYPE_TCP_CLIENT:
+        tcp_arg(ud->tcp_pcb, NULL);
+        tcp_abort(ud->tcp_pcb);
+        ud->tcp_pcb = NULL;
+        break;
+      case TYPE_TCP_SERVER:
+        tcp_close(ud->tcp_pcb);
+        ud->tcp_pcb = NULL;
+        break;
+      case TYPE_UDP_SOCKET:
+        udp_remove(ud->udp_pcb);
+        ud->udp_pcb = NULL;
+        break;
+    }
+  }
+  switch (ud->type) {
+    case TYPE_TCP_CLIENT:
+      net_sendq_free(ud);
+      luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_connect_ref);
+      ud->client.cb_connect_ref = LUA_NOREF;
+      luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_disconnect_ref);
+      ud->client.cb_disconnect_ref = LUA_NOREF;
+      luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_reconnect_ref);
+      ud->client.cb_reconnect_ref = LUA_NOREF;
+    case TYPE_UDP_SOCKET:
+      luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_dns_ref);
+      ud->client.cb_dns_ref = LUA_NOREF;
+      luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_receive_ref);
+      ud->client.cb_receive_ref = LUA_NOREF;
+      luaL_unref(L, LUA_REGISTRYINDEX, ud->client.cb_sent_ref);
+      ud->client.cb_sent_ref = LUA_NOREF;
+      break;
+    case TYPE_TCP_SERVER:
+      luaL_unref(L, LUA_REGISTRYINDEX, ud->server.cb_accept_ref);
+      ud->server.cb_accept_ref = LUA_NOREF;
+      break;
+  }
+  lua_gc(L, LUA_GCSTOP, 0);
+  luaL_unref(L, LUA_REGISTRYINDEX, ud->self_ref);
+  ud->self_ref = LUA_NOREF;
+  lua_gc(L, LUA_GCRESTART, 0);
+  return 0;
+}
+
+// --- Event handlers, on the Lua task
+
+static void ldnsfound_cb (lua_State *L, lnet_userdata *ud, ip_addr_t *addr) {
+  if (ud->self_ref != LUA_NOREF && ud->client.cb_dns_ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_dns_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+    if (!ip_addr_isany (addr)) {
+      char iptmp[IP_STR_SZ];
+      ipstr (iptmp, addr);
+      lua_pushstring(L, iptmp);
+    } else {
+      lua_pushnil(L);
+    }
+    lua_call(L, 2, 0);
+  }
+  ud->client.wait_dns --;
+  if (ud->pcb && ud->type == TYPE_TCP_CLIENT && ud->tcp_pcb->state == CLOSED) {
+    tcp_connect(ud->tcp_pcb, addr, ud->tcp_pcb->remote_port, net_connected_cb);
+  } else if (!ud->pcb && ud->client.wait_dns == 0) {
+    lua_gc(L, LUA_GCSTOP, 0);
+    luaL_unref(L, LUA_REGISTRYINDEX, ud->self_ref);
+    ud->self_ref = LUA_NOREF;
+    lua_gc(L, LUA_GCRESTART, 0);
+  }
+}
+
+static void lconnected_cb (lua_State *L, lnet_userdata *ud) {
+  if (ud->self_ref != LUA_NOREF && ud->client.cb_connect_ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_connect_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+    lua_call(L, 1, 0);
+  }
+}
+
+static void laccept_cb (lua_State *L, lnet_userdata *ud, struct tcp_pcb *newpcb) {
+  if (ud->self_ref == LUA_NOREF || ud->server.cb_accept_ref == LUA_NOREF) {
+    tcp_abort(newpcb);
+    return;
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ud->server.cb_accept_ref);
+
+  lnet_userdata *nud = net_create(L, TYPE_TCP_CLIENT);
+  lua_pushvalue(L, -1);
+  nud->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  nud->tcp_pcb = newpcb;
+  tcp_arg(nud->tcp_pcb, nud);
+  tcp_err(nud->tcp_pcb, net_err_cb);
+  tcp_recv(nud->tcp_pcb, net_tcp_recv_cb);
+  tcp_sent(nud->tcp_pcb, net_sent_cb);
+
+  tcp_accepted(ud->tcp_pcb);
+
+  lua_call(L, 1, 0);
+}
+
+static void lrecv_cb (lua_State *L, lnet_userdata *ud, lnet_event *ev) {
+  const lnet_recvdata *rd = &ev->recvdata;
+  if (ud->self_ref == LUA_NOREF || ud->client.cb_receive_ref == LUA_NOREF)
+    return;
+  int num_args = 2;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_receive_ref);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+  lua_pushlstring(L, rd->payload, rd->payload_len);
+  if (ud->type == TYPE_UDP_SOCKET) {
+    num_args += 2;
+    char iptmp[IP_STR_SZ];
+    ipstr (iptmp, &rd->src_ip);
+    lua_pushinteger(L, rd->src_port);
+    lua_pushstring(L, iptmp);
+  }
+  lua_call(L, num_args, 0);
+}
+
+static void lsent_cb (lua_State *L, lnet_userdata *ud) {
+  if (ud->self_ref == LUA_NOREF)
+    return;
+  if (ud->client.sq_head && ud->pcb) {
+    if (net_sendq_flush(ud) != ERR_OK)
+      net_sendq_free(ud);
+    if (ud->client.sq_head)
+      return;   // the "sent" callback waits for all of it
+  }
+  if (ud->client.cb_sent_ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_sent_ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+    lua_call(L, 1, 0);
+  }
+  if (ud->client.sq_close && !ud->client.sq_head && ud->pcb) {
+    ud->client.sq_close = 0;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+    lua_pushcfunction(L, net_close);
+    lua_insert(L, -2);
+    lua_call(L, 1, 0);
+  }
+}
+
+static void lerr_cb (lua_State *L, lnet_userdata *ud, err_t err)
+{
+  int ref;
+  net_sendq_free(ud);
+  ud->client.sq_close = 0;
+  if (err != ERR_OK && ud->client.cb_reconnect_ref != LUA_NOREF)
+    ref = ud->client.cb_reconnect_ref;
+  else ref = ud->client.cb_disconnect_ref;
+  if (ref != LUA_NOREF) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
+    lua_pushinteger(L, err);
+    lua_call(L, 2, 0);
+  }
+  if (ud->client.wait_dns == 0) {
+    lua_gc(L, LUA_GCSTOP, 0);
+    luaL_unref(L, LUA_REGISTRYINDEX, ud->self_ref);
+    ud->self_ref = LUA_NOREF;
+    lua_gc(L, LUA_GCRESTART, 0);
+  }
+}
+
+static void handle_net_event (task_param_t param, task_prio_t prio)
+{
+  lnet_event *ev = (lnet_event *)param;
+  (void)prio;
+
+  lua_State *L = lua_getstate();
+  switch (ev->event)
+  {
+    case DNSFOUND:  ldnsfound_cb (L, ev->ud, &ev->resolved_ip);      break;
+    case CONNECTED: lconnected_cb (L, ev->ud);                       break;
+    case ACCEPT:    laccept_cb (L, ev->ud, ev->accept_newpcb);       break;
+    case RECVDATA:  lrecv_cb (L, ev->ud, ev);                        break;
+    case SENTDATA:  lsent_cb (L, ev->ud);                            break;
+    case ERR:       lerr_cb (L, ev->ud, ev->err);                    break;
+  }
+
+  c_free (ev);
+}
+
+// --- Tables
+
+// Module function map
+static const LUA_REG_TYPE net_tcpserver_map[] = {
+  { LSTRKEY( "listen" ),  LFUNCVAL( net_listen ) },
+  { LSTRKEY( "getaddr" ), LFUNCVAL( net_getaddr ) },
+  { LSTRKEY( "close" ),   LFUNCVAL( net_close ) },
+  { LSTRKEY( "__gc" ),    LFUNCVAL( net_delete ) },
+  { LSTRKEY( "__index" ), LROVAL( net_tcpserver_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+static const LUA_REG_TYPE net_tcpsocket_map[] = {
+  { LSTRKEY( "connect" ), LFUNCVAL( net_connect ) },
+  { LSTRKEY( "close" ),   LFUNCVAL( net_close ) },
+  { LSTRKEY( "on" ),      LFUNCVAL( net_on ) },
+  { LSTRKEY( "send" ),    LFUNCVAL( net_send ) },
+  { LSTRKEY( "getpeer" ), LFUNCVAL( net_getpeer ) },
+  { LSTRKEY( "getaddr" ), LFUNCVAL( net_getaddr ) },
+  { LSTRKEY( "__gc" ),    LFUNCVAL( net_delete ) },
+  { LSTRKEY( "__index" ), LROVAL( net_tcpsocket_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+static const LUA_REG_TYPE net_udpsocket_map[] = {
+  { LSTRKEY( "listen" ),  LFUNCVAL( net_listen ) },
+  { LSTRKEY( "close" ),   LFUNCVAL( net_close ) },
+  { LSTRKEY( "on" ),      LFUNCVAL( net_on ) },
+  { LSTRKEY( "send" ),    LFUNCVAL( net_send ) },
+  { LSTRKEY( "getaddr" ), LFUNCVAL( net_getaddr ) },
+  { LSTRKEY( "__gc" ),    LFUNCVAL( net_delete ) },
+  { LSTRKEY( "__index" ), LROVAL( net_udpsocket_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+static const LUA_REG_TYPE net_map[] = {
+  { LSTRKEY( "createServer" ),     LFUNCVAL( net_createServer ) },
+  { LSTRKEY( "createConnection" ), LFUNCVAL( net_createConnection ) },
+  { LSTRKEY( "createUDPSocket" ),  LFUNCVAL( net_createUDPSocket ) },
+  { LSTRKEY( "TCP" ),              LNUMVAL( TYPE_TCP ) },
+  { LSTRKEY( "UDP" ),              LNUMVAL( TYPE_UDP ) },
+  { LSTRKEY( "__metatable" ),      LROVAL( net_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+int luaopen_net( lua_State *L ) {
+  luaL_rometatable(L, NET_TABLE_TCP_SERVER, (void *)net_tcpserver_map);
+  luaL_rometatable(L, NET_TABLE_TCP_CLIENT, (void *)net_tcpsocket_map);
+  luaL_rometatable(L, NET_TABLE_UDP_SOCKET, (void *)net_udpsocket_map);
+
+  net_event = task_get_id (handle_net_event);
+  return 0;
+}
+
+LUANODE_MODULE(NET, "net", net_map, luaopen_net);
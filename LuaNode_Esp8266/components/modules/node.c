@@ -32,6 +32,7 @@
 // Lua: restart()
 static int node_restart( lua_State* L )
 {
+  platform_flash_flush();
   system_restart();
   return 0;
 }
@@ -58,7 +59,10 @@ static int node_deepsleep( lua_State* L )
     if ( us < 0 )
       return luaL_error( L, "wrong arg range" );
     else
+    {
+      platform_flash_flush();
       system_deep_sleep( us );
+    }
   }
   return 0;
 }
@@ -143,6 +147,27 @@ static int node_heap( lua_State* L )
   return 1;
 }
 
+// Lua: flashstats([reset]), counters of platform_flash_write()
+static int node_flashstats( lua_State* L )
+{
+  platform_flash_stats_t st;
+  platform_flash_get_stats(&st, lua_toboolean(L, 1));
+  lua_createtable(L, 0, 6);
+  lua_pushinteger(L, st.writes);
+  lua_setfield(L, -2, "writes");
+  lua_pushinteger(L, st.bytes);
+  lua_setfield(L, -2, "bytes");
+  lua_pushinteger(L, st.spi_writes);
+  lua_setfield(L, -2, "spi_writes");
+  lua_pushinteger(L, st.spi_bytes);
+  lua_setfield(L, -2, "spi_bytes");
+  lua_pushinteger(L, st.us);
+  lua_setfield(L, -2, "us");
+  lua_pushinteger(L, st.errors);
+  lua_setfield(L, -2, "errors");
+  return 1;
+}
+
 static lua_State *gL = NULL;
 
 #ifdef DEVKIT_VERSION_0_9
@@ -559,6 +584,7 @@ static const LUA_REG_TYPE node_map[] =
   { LSTRKEY( "flashid" ), LFUNCVAL( node_flashid ) },
   { LSTRKEY( "flashsize" ), LFUNCVAL( node_flashsize) },
   { LSTRKEY( "heap" ), LFUNCVAL( node_heap ) },
+  { LSTRKEY( "flashstats" ), LFUNCVAL( node_flashstats ) },
 #ifdef DEVKIT_VERSION_0_9
   { LSTRKEY( "key" ), LFUNCVAL( node_key ) },
   { LSTRKEY( "led" ), LFUNCVAL( node_led ) },
@@ -0,0 +1,305 @@
+// Module for timers, the ESP32 tmr API on the ESP8266 task queues
+//
+// Each alarm is an os_timer. Its callback only queues the alarm for the
+// Lua task, at most once until that has run, so a slow script delays an
+// auto-repeating alarm instead of piling up events.
+//
+//   tmr.alarm(id, ms, mode, function)    tmr.register() plus tmr.start()
+//   tmr.register(id, ms, mode, function) mode: ALARM_SINGLE, ALARM_SEMI
+//                                        (rearm with start()), ALARM_AUTO
+//   tmr.start(id), tmr.stop(id)          true if the state changed
+//   tmr.unregister(id)                   stop and forget the function
+//   tmr.interval(id, ms)                 restarts a running alarm
+//   tmr.state(id)                        running, mode; nil if unregistered
+//   t = tmr.create()                     the same as t:alarm(...) etc.,
+//                                        the function gets t
+//   tmr.now(), tmr.delay(us)
+//
+// id is 0 to 6, or a tmr.create() object in its place.
+
+#include "module.h"
+#include "lauxlib.h"
+
+#include "c_types.h"
+#include "c_string.h"
+
+#include "esp_common.h"
+#include "freertos/FreeRTOS.h"
+#include "task/task.h"
+
+#define NUM_TMR 7
+
+#define TIMER_MODE_SINGLE 0
+#define TIMER_MODE_AUTO   1
+#define TIMER_MODE_SEMI   2
+#define TIMER_MODE_OFF    3
+
+#define TIMER_MAX_ARM 0x41893   // longest os_timer_arm(), in ms
+
+typedef struct {
+  os_timer_t os;
+  int lua_ref;
+  int self_ref;     // tmr.create() objects, kept while armed or queued
+  uint32 interval;
+  uint8 mode;
+  bool armed;
+  volatile bool pending;    // queued for the Lua task
+  bool object;
+} tmr_t;
+
+static tmr_t alarm_timers[NUM_TMR];
+static task_handle_t tmr_task_id;
+
+static const char TIMER_TABLE[] = "tmr.timer";
+
+static void tmr_expired( void *arg )
+{
+  tmr_t *t = (tmr_t *)arg;
+  if (t->pending)
+    return;
+  t->pending = true;
+  if (!task_post_low(tmr_task_id, (task_param_t)t))
+    t->pending = false;   // lost this tick; an auto alarm has the next
+}
+
+// Let a created timer be collected once nothing can call it any more
+static void tmr_release( lua_State *L, tmr_t *t )
+{
+  if (t->object && !t->armed && !t->pending && t->self_ref != LUA_NOREF) {
+    luaL_unref(L, LUA_REGISTRYINDEX, t->self_ref);
+    t->self_ref = LUA_NOREF;
+  }
+}
+
+static void tmr_disarm( lua_State *L, tmr_t *t )
+{
+  if (t->armed) {
+    os_timer_disarm(&t->os);
+    t->armed = false;
+  }
+  tmr_release(L, t);
+}
+
+static void tmr_unregister( lua_State *L, tmr_t *t )
+{
+  tmr_disarm(L, t);
+  luaL_unref(L, LUA_REGISTRYINDEX, t->lua_ref);
+  t->lua_ref = LUA_NOREF;
+  t->mode = TIMER_MODE_OFF;
+}
+
+static void tmr_dispatch( task_param_t param, task_prio_t prio )
+{
+  tmr_t *t = (tmr_t *)param;
+  lua_State *L = lua_getstate();
+  t->pending = false;
+  if (t->lua_ref == LUA_NOREF || !t->armed) {
+    tmr_release(L, t);
+    return;
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, t->lua_ref);
+  int nargs = 0;
+  if (t->object) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, t->self_ref);
+    nargs = 1;
+  }
+  if (t->mode == TIMER_MODE_SINGLE) {
+    // The function and timer are on the stack, so they outlive this
+    tmr_unregister(L, t);
+  } else if (t->mode == TIMER_MODE_SEMI) {
+    t->armed = false;
+    tmr_release(L, t);
+  }
+  lua_call(L, nargs, 0);
+}
+
+static tmr_t *tmr_get( lua_State *L, int idx )
+{
+  if (lua_isuserdata(L, idx))
+    return (tmr_t *)luaL_checkudata(L, idx, TIMER_TABLE);
+  unsigned id = luaL_checkinteger(L, idx);
+  luaL_argcheck(L, id < NUM_TMR, idx, "invalid timer index");
+  return &alarm_timers[id];
+}
+
+static void tmr_arm( lua_State *L, tmr_t *t, int idx )
+{
+  os_timer_arm(&t->os, t->interval, t->mode == TIMER_MODE_AUTO);
+  t->armed = true;
+  if (t->object && t->self_ref == LUA_NOREF) {
+    lua_pushvalue(L, idx);
+    t->self_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+}
+
+// Lua: tmr.register(id / ref, interval, mode, function)
+static int tmr_register( lua_State *L )
+{
+  tmr_t *t = tmr_get(L, 1);
+  uint32 interval = luaL_checkinteger(L, 2);
+  int mode = luaL_checkinteger(L, 3);
+  luaL_argcheck(L, interval > 0 && interval <= TIMER_MAX_ARM, 2, "invalid interval");
+  luaL_argcheck(L, mode == TIMER_MODE_SINGLE || mode == TIMER_MODE_SEMI ||
+                   mode == TIMER_MODE_AUTO, 3, "invalid mode");
+  luaL_argcheck(L, lua_isfunction(L, 4) || lua_islightfunction(L, 4), 4,
+                "must be function");
+  tmr_disarm(L, t);
+  lua_pushvalue(L, 4);
+  luaL_unref(L, LUA_REGISTRYINDEX, t->lua_ref);
+  t->lua_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  t->interval = interval;
+  t->mode = mode;
+  return 0;
+}
+
+// Lua: tmr.start(id / ref)
+static int tmr_start( lua_State *L )
+{
+  tmr_t *t = tmr_get(L, 1);
+  if (t->lua_ref == LUA_NOREF)
+    return luaL_error(L, "timer not registered");
+  bool started = !t->armed;
+  if (started)
+    tmr_arm(L, t, 1);
+  lua_pushboolean(L, started);
+  return 1;
+}
+
+// Lua: tmr.alarm(id / ref, interval, mode, function)
+static int tmr_alarm( lua_State *L )
+{
+  tmr_register(L);
+  lua_settop(L, 1);
+  return tmr_start(L);
+}
+
+// Lua: tmr.stop(id / ref)
+static int tmr_stop( lua_State *L )
+{
+  tmr_t *t = tmr_get(L, 1);
+  lua_pushboolean(L, t->armed);
+  tmr_disarm(L, t);
+  return 1;
+}
+
+// Lua: tmr.unregister(id / ref)
+static int tmr_unreg( lua_State *L )
+{
+  tmr_unregister(L, tmr_get(L, 1));
+  return 0;
+}
+
+// Lua: tmr.interval(id / ref, interval)
+static int tmr_interval( lua_State *L )
+{
+  tmr_t *t = tmr_get(L, 1);
+  uint32 interval = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, interval > 0 && interval <= TIMER_MAX_ARM, 2, "invalid interval");
+  t->interval = interval;
+  if (t->armed) {
+    os_timer_disarm(&t->os);
+    os_timer_arm(&t->os, t->interval, t->mode == TIMER_MODE_AUTO);
+  }
+  return 0;
+}
+
+// Lua: tmr.state(id / ref)
+static int tmr_state( lua_State *L )
+{
+  tmr_t *t = tmr_get(L, 1);
+  if (t->mode == TIMER_MODE_OFF)
+    return 0;
+  lua_pushboolean(L, t->armed);
+  lua_pushinteger(L, t->mode);
+  return 2;
+}
+
+static void tmr_init( tmr_t *t, bool object )
+{
+  c_memset(t, 0, sizeof(*t));
+  t->lua_ref = LUA_NOREF;
+  t->self_ref = LUA_NOREF;
+  t->mode = TIMER_MODE_OFF;
+  t->object = object;
+  os_timer_setfn(&t->os, tmr_expired, t);
+}
+
+// Lua: tmr.create()
+static int tmr_create( lua_State *L )
+{
+  tmr_t *t = (tmr_t *)lua_newuserdata(L, sizeof(tmr_t));
+  tmr_init(t, true);
+  luaL_getmetatable(L, TIMER_TABLE);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+static int tmr_gc( lua_State *L )
+{
+  tmr_t *t = (tmr_t *)luaL_checkudata(L, 1, TIMER_TABLE);
+  os_timer_disarm(&t->os);
+  luaL_unref(L, LUA_REGISTRYINDEX, t->lua_ref);
+  t->lua_ref = LUA_NOREF;
+  return 0;
+}
+
+// Lua: tmr.now() -- microseconds, wrapping
+static int tmr_now( lua_State *L )
+{
+  lua_pushinteger(L, system_get_time() & 0x7FFFFFFF);
+  return 1;
+}
+
+// Lua: tmr.delay(us) -- busy wait, keep it short
+static int tmr_delay( lua_State *L )
+{
+  int32 us = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, us >= 0, 1, "wrong arg range");
+  while (us > 0) {
+    uint16 n = us > 10000 ? 10000 : us;
+    os_delay_us(n);
+    us -= n;
+  }
+  return 0;
+}
+
+static const LUA_REG_TYPE tmr_dyn_map[] = {
+  { LSTRKEY( "register" ),   LFUNCVAL( tmr_register ) },
+  { LSTRKEY( "alarm" ),      LFUNCVAL( tmr_alarm ) },
+  { LSTRKEY( "start" ),      LFUNCVAL( tmr_start ) },
+  { LSTRKEY( "stop" ),       LFUNCVAL( tmr_stop ) },
+  { LSTRKEY( "unregister" ), LFUNCVAL( tmr_unreg ) },
+  { LSTRKEY( "state" ),      LFUNCVAL( tmr_state ) },
+  { LSTRKEY( "interval" ),   LFUNCVAL( tmr_interval ) },
+  { LSTRKEY( "__gc" ),       LFUNCVAL( tmr_gc ) },
+  { LSTRKEY( "__index" ),    LROVAL( tmr_dyn_map ) },
+  { LNILKEY, LNILVAL }
+};
+
+static const LUA_REG_TYPE tmr_map[] = {
+  { LSTRKEY( "delay" ),        LFUNCVAL( tmr_delay ) },
+  { LSTRKEY( "now" ),          LFUNCVAL( tmr_now ) },
+  { LSTRKEY( "register" ),     LFUNCVAL( tmr_register ) },
+  { LSTRKEY( "alarm" ),        LFUNCVAL( tmr_alarm ) },
+  { LSTRKEY( "start" ),        LFUNCVAL( tmr_start ) },
+  { LSTRKEY( "stop" ),         LFUNCVAL( tmr_stop ) },
+  { LSTRKEY( "unregister" ),   LFUNCVAL( tmr_unreg ) },
+  { LSTRKEY( "state" ),        LFUNCVAL( tmr_state ) },
+  { LSTRKEY( "interval" ),     LFUNCVAL( tmr_interval ) },
+  { LSTRKEY( "create" ),       LFUNCVAL( tmr_create ) },
+  { LSTRKEY( "ALARM_SINGLE" ), LNUMVAL( TIMER_MODE_SINGLE ) },
+  { LSTRKEY( "ALARM_SEMI" ),   LNUMVAL( TIMER_MODE_SEMI ) },
+  { LSTRKEY( "ALARM_AUTO" ),   LNUMVAL( TIMER_MODE_AUTO ) },
+  { LNILKEY, LNILVAL }
+};
+
+int luaopen_tmr( lua_State *L )
+{
+  for (int i = 0; i < NUM_TMR; i++)
+    tmr_init(&alarm_timers[i], false);
+  luaL_rometatable(L, TIMER_TABLE, (void *)tmr_dyn_map);
+  tmr_task_id = task_get_id(tmr_dispatch);
+  return 0;
+}
+
+LUANODE_MODULE(TMR, "tmr", tmr_map, luaopen_tmr);
@@ -1,4 +1,162 @@
 #include "c_string.h"
+#include "c_stdint.h"
+
+// Memory and string functions for the LX106, which has no unaligned loads
+// or stores and fetches flash (Lua's read-only strings) only as words.
+// They move 32 bit words, four to a loop, and fall back to bytes for the
+// ends; a source that isn't aligned like the destination is read in
+// aligned words and shifted into place. apps/membench compares them with
+// the SDK's.
+
+#define ALIGNED(p)    (((uint32_t)(p) & 3) == 0)
+#define HAS_ZERO(w)   (((w) - 0x01010101) & ~(w) & 0x80808080)
+
+void *c_memcpy(void *dst, const void *src, size_t n)
+{
+  uint8_t *d = (uint8_t *)dst;
+  const uint8_t *s = (const uint8_t *)src;
+
+  if (n >= 8) {
+    while (!ALIGNED(d)) {
+      *d++ = *s++;
+      n--;
+    }
+    if (ALIGNED(s)) {
+      uint32_t *dw = (uint32_t *)d;
+      const uint32_t *sw = (const uint32_t *)s;
+      for (; n >= 16; n -= 16, dw += 4, sw += 4) {
+        dw[0] = sw[0];
+        dw[1] = sw[1];
+        dw[2] = sw[2];
+        dw[3] = sw[3];
+      }
+      for (; n >= 4; n -= 4)
+        *dw++ = *sw++;
+      d = (uint8_t *)dw;
+      s = (const uint8_t *)sw;
+    } else {
+      // The last word read holds the last byte used, so this never reads
+      // past the aligned word the source ends in
+      uint32_t *dw = (uint32_t *)d;
+      const uint32_t *sw = (const uint32_t *)((uint32_t)s & ~3);
+      unsigned lo = ((uint32_t)s & 3) * 8, hi = 32 - lo;
+      uint32_t w0 = *sw++, w1;
+      for (; n >= 4; n -= 4, s += 4) {
+        w1 = *sw++;
+        *dw++ = (w0 >> lo) | (w1 << hi);
+        w0 = w1;
+      }
+      d = (uint8_t *)dw;
+    }
+  }
+  while (n--)
+    *d++ = *s++;
+  return dst;
+}
+
+void *c_memmove(void *dst, const void *src, size_t n)
+{
+  uint8_t *d = (uint8_t *)dst;
+  const uint8_t *s = (const uint8_t *)src;
+
+  if (d <= s || d >= s + n)
+    return c_memcpy(dst, src, n);
+
+  // Overlapping with the destination above: copy from the end
+  d += n;
+  s += n;
+  if (n >= 8 && ((uint32_t)d & 3) == ((uint32_t)s & 3)) {
+    while (!ALIGNED(d)) {
+      *--d = *--s;
+      n--;
+    }
+    uint32_t *dw = (uint32_t *)d;
+    const uint32_t *sw = (const uint32_t *)s;
+    for (; n >= 4; n -= 4)
+      *--dw = *--sw;
+    d = (uint8_t *)dw;
+    s = (const uint8_t *)sw;
+  }
+  while (n--)
+    *--d = *--s;
+  return dst;
+}
+
+void *c_memset(void *dst, int c, size_t n)
+{
+  uint8_t *d = (uint8_t *)dst;
+
+  if (n >= 8) {
+    uint32_t w = (uint8_t)c;
+    w |= w << 8;
+    w |= w << 16;
+    while (!ALIGNED(d)) {
+      *d++ = (uint8_t)c;
+      n--;
+    }
+    uint32_t *dw = (uint32_t *)d;
+    for (; n >= 16; n -= 16, dw += 4) {
+      dw[0] = w;
+      dw[1] = w;
+      dw[2] = w;
+      dw[3] = w;
+    }
+    for (; n >= 4; n -= 4)
+      *dw++ = w;
+    d = (uint8_t *)dw;
+  }
+  while (n--)
+    *d++ = (uint8_t)c;
+  return dst;
+}
+
+int c_memcmp(const void *a, const void *b, size_t n)
+{
+  const uint8_t *p = (const uint8_t *)a;
+  const uint8_t *q = (const uint8_t *)b;
+
+  // Words while they are equal, bytes to find where they differ
+  if (n >= 8 && ((uint32_t)p & 3) == ((uint32_t)q & 3)) {
+    while (!ALIGNED(p)) {
+      if (*p != *q)
+        return *p - *q;
+      p++;
+      q++;
+      n--;
+    }
+    const uint32_t *pw = (const uint32_t *)p;
+    const uint32_t *qw = (const uint32_t *)q;
+    for (; n >= 4 && *pw == *qw; n -= 4) {
+      pw++;
+      qw++;
+    }
+    p = (const uint8_t *)pw;
+    q = (const uint8_t *)qw;
+  }
+  for (; n; n--, p++, q++) {
+    if (*p != *q)
+      return *p - *q;
+  }
+  return 0;
+}
+
+size_t c_strlen(const char *s)
+{
+  const char *p = s;
+  const uint32_t *w;
+
+  while (!ALIGNED(p)) {
+    if (!*p)
+      return p - s;
+    p++;
+  }
+  // An aligned word never crosses into memory the string isn't in
+  for (w = (const uint32_t *)p; !HAS_ZERO(*w); w++)
+    ;
+  for (p = (const char *)w; *p; p++)
+    ;
+  return p - s;
+}
 
 // const char *c_strstr(const char * __s1, const char * __s2){
 // }
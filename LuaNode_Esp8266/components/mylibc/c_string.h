@@ -15,9 +15,12 @@
 #define NULL 0
 #endif
 
-#define c_memcmp memcmp
-#define c_memcpy memcpy
-#define c_memset memset
+// Word at a time versions, see c_string.c
+void *c_memcpy(void *dst, const void *src, size_t n);
+void *c_memmove(void *dst, const void *src, size_t n);
+void *c_memset(void *dst, int c, size_t n);
+int c_memcmp(const void *a, const void *b, size_t n);
+size_t c_strlen(const char *s);
 
 #define os_memcpy memcpy
 #define os_memcmp memcmp
@@ -27,7 +30,6 @@
 #define c_strchr strchr
 #define c_strcmp strcmp
 #define c_strcpy strcpy
-#define c_strlen strlen
 #define c_strncmp strncmp
 #define c_strncpy strncpy
 // #define c_strstr os_strstr
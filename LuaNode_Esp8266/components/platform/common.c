@@ -4,6 +4,8 @@
 #include "common.h"
 #include "c_string.h"
 #include "c_stdio.h"
+#include "esp_common.h"
+#include "task/task.h"
 
 void cmn_platform_init(void)
 {
@@ -161,58 +163,163 @@ uint32_t platform_flash_get_first_free_block_address( uint32_t *psect )
   }
 }
 
+#ifdef INTERNAL_FLASH_WRITE_UNIT_SIZE
+// Write combining: every SPI program operation stops the caches, so small
+// writes are gathered per 256 byte flash page and programmed together.
+// Bytes around a write are padded with 0xFF, which programming leaves
+// untouched, so nothing has to be read back to align a write; for the
+// same reason bytes written twice are ANDed, as the flash would.
+// Writes reach the flash in the order they were made. The pending page is
+// programmed when a write goes elsewhere, before reads of it and before
+// any erase, on platform_flash_flush(), and from the Lua task shortly
+// after the last write.
+
+#define FLASH_PAGE_SIZE   256
+#define FLASH_NO_PAGE     0xFFFFFFFF
+#define FLASH_IDLE_MS     20
+
+static struct
+{
+  uint32_t page;      // flash address of the buffered page
+  uint16_t lo, hi;    // dirty bytes in data[], lo <= i < hi
+  uint8_t data[ FLASH_PAGE_SIZE ] __attribute__ ((aligned(4)));
+} wbuf = { FLASH_NO_PAGE };
+
+static platform_flash_stats_t wstats;
+static os_timer_t wbuf_timer;
+static task_handle_t wbuf_task;
+
+static int flashh_program( const void *from, uint32_t toaddr, uint32_t size )
+{
+  uint32_t t0 = system_get_time();
+  uint32_t r = platform_s_flash_write( from, toaddr, size );
+  wstats.us += system_get_time() - t0;
+  wstats.spi_writes ++;
+  wstats.spi_bytes += size;
+  if( r != size )
+  {
+    wstats.errors ++;
+    return PLATFORM_ERR;
+  }
+  return PLATFORM_OK;
+}
+
+int platform_flash_flush( void )
+{
+  const uint32_t blkmask = INTERNAL_FLASH_WRITE_UNIT_SIZE - 1;
+  uint32_t page = wbuf.page, lo, hi;
+
+  if( page == FLASH_NO_PAGE )
+    return PLATFORM_OK;
+  os_timer_disarm( &wbuf_timer );
+  wbuf.page = FLASH_NO_PAGE;
+  lo = wbuf.lo & ~blkmask;
+  hi = ( wbuf.hi + blkmask ) & ~blkmask;
+  return flashh_program( wbuf.data + lo, page + lo, hi - lo );
+}
+
+static void flashh_flush_task( task_param_t param, task_prio_t prio )
+{
+  platform_flash_flush();
+}
+
+static void flashh_idle( void *arg )
+{
+  // Timer context: the write itself belongs to the Lua task
+  task_post_low( wbuf_task, 0 );
+}
+
+void platform_flash_get_stats( platform_flash_stats_t *stats, bool reset )
+{
+  *stats = wstats;
+  if( reset )
+    c_memset( &wstats, 0, sizeof( wstats ) );
+}
+
 uint32_t platform_flash_write( const void *from, uint32_t toaddr, uint32_t size )
 {
-#ifndef INTERNAL_FLASH_WRITE_UNIT_SIZE
-  return platform_s_flash_write( from, toaddr, size );
-#else // #ifindef INTERNAL_FLASH_WRITE_UNIT_SIZE
-  uint32_t temp, rest, ssize = size;
-  unsigned i;
-  char tmpdata[ INTERNAL_FLASH_WRITE_UNIT_SIZE ];
+  uint32_t ssize = size, page, off, n, i;
   const uint8_t *pfrom = ( const uint8_t* )from;
-  const uint32_t blksize = INTERNAL_FLASH_WRITE_UNIT_SIZE;
-  const uint32_t blkmask = INTERNAL_FLASH_WRITE_UNIT_SIZE - 1;
+  int res = PLATFORM_OK;
 
-  // Align the start
-  if( toaddr & blkmask )
+  if( !wbuf_task )
   {
-    rest = toaddr & blkmask;
-    temp = toaddr & ~blkmask; // this is the actual aligned address
-    // c_memcpy( tmpdata, ( const void* )temp, blksize );
-    platform_s_flash_read( tmpdata, temp, blksize );
-    for( i = rest; size && ( i < blksize ); i ++, size --, pfrom ++ )
-      tmpdata[ i ] = *pfrom;
-    platform_s_flash_write( tmpdata, temp, blksize );
-    if( size == 0 )
-      return ssize;
-    toaddr = temp + blksize;
+    wbuf_task = task_get_id( flashh_flush_task );
+    os_timer_setfn( &wbuf_timer, flashh_idle, NULL );
   }
-  // The start address is now a multiple of blksize
-  // Compute how many bytes we can write as multiples of blksize
-  rest = size & blkmask;
-  temp = size & ~blkmask;
-  // Program the blocks now
-  if( temp )
+  wstats.writes ++;
+  wstats.bytes += size;
+  while( size )
   {
-    platform_s_flash_write( pfrom, toaddr, temp );
-    toaddr += temp;
-    pfrom += temp;
+    page = toaddr & ~( FLASH_PAGE_SIZE - 1 );
+    off = toaddr - page;
+    // Whole pages go straight to the flash, in one operation
+    if( off == 0 && size >= FLASH_PAGE_SIZE && wbuf.page != page )
+    {
+      n = size & ~( FLASH_PAGE_SIZE - 1 );
+      if( platform_flash_flush() != PLATFORM_OK || flashh_program( pfrom, toaddr, n ) != PLATFORM_OK )
+        res = PLATFORM_ERR;
+    }
+    else
+    {
+      n = FLASH_PAGE_SIZE - off;
+      if( n > size )
+        n = size;
+      if( wbuf.page != page )
+      {
+        if( platform_flash_flush() != PLATFORM_OK )
+          res = PLATFORM_ERR;
+        c_memset( wbuf.data, 0xFF, FLASH_PAGE_SIZE );
+        wbuf.page = page;
+        wbuf.lo = off;
+        wbuf.hi = off + n;
+      }
+      for( i = 0; i < n; i ++ )
+        wbuf.data[ off + i ] &= pfrom[ i ];
+      if( off < wbuf.lo )
+        wbuf.lo = off;
+      if( off + n > wbuf.hi )
+        wbuf.hi = off + n;
+      if( wbuf.lo == 0 && wbuf.hi == FLASH_PAGE_SIZE && platform_flash_flush() != PLATFORM_OK )
+        res = PLATFORM_ERR;
+    }
+    toaddr += n;
+    pfrom += n;
+    size -= n;
   }
-  // And the final part of a block if needed
-  if( rest )
+  if( wbuf.page != FLASH_NO_PAGE )
   {
-    // c_memcpy( tmpdata, ( const void* )toaddr, blksize );
-    platform_s_flash_read( tmpdata, toaddr, blksize );
-    for( i = 0; size && ( i < rest ); i ++, size --, pfrom ++ )
-      tmpdata[ i ] = *pfrom;
-    platform_s_flash_write( tmpdata, toaddr, blksize );
+    os_timer_disarm( &wbuf_timer );
+    os_timer_arm( &wbuf_timer, FLASH_IDLE_MS, 0 );
   }
-  return ssize;
-#endif // #ifndef INTERNAL_FLASH_WRITE_UNIT_SIZE
+  return res == PLATFORM_OK ? ssize : 0;
 }
 
+#else // #ifdef INTERNAL_FLASH_WRITE_UNIT_SIZE
+
+int platform_flash_flush( void )
+{
+  return PLATFORM_OK;
+}
+
+void platform_flash_get_stats( platform_flash_stats_t *stats, bool reset )
+{
+  c_memset( stats, 0, sizeof( *stats ) );
+}
+
+uint32_t platform_flash_write( const void *from, uint32_t toaddr, uint32_t size )
+{
+  return platform_s_flash_write( from, toaddr, size );
+}
+
+#endif // #ifdef INTERNAL_FLASH_WRITE_UNIT_SIZE
+
 uint32_t platform_flash_read( void *to, uint32_t fromaddr, uint32_t size )
 {
+#ifdef INTERNAL_FLASH_WRITE_UNIT_SIZE
+  if( wbuf.page != FLASH_NO_PAGE && fromaddr < wbuf.page + FLASH_PAGE_SIZE && fromaddr + size > wbuf.page )
+    platform_flash_flush();
+#endif
 #ifndef INTERNAL_FLASH_READ_UNIT_SIZE
   return platform_s_flash_read( to, fromaddr, size );
 #else // #ifindef INTERNAL_FLASH_READ_UNIT_SIZE
@@ -237,6 +237,20 @@ uint32_t platform_s_flash_read( void *to, uint32_t fromaddr, uint32_t size );
 uint32_t platform_flash_get_num_sectors(void);
 int platform_flash_erase_sector( uint32_t sector_id );
 
+// platform_flash_write() combines small writes into whole flash pages
+typedef struct
+{
+  uint32_t writes;      // platform_flash_write() calls
+  uint32_t bytes;       // bytes passed to it
+  uint32_t spi_writes;  // program operations sent to the flash
+  uint32_t spi_bytes;   // bytes programmed, alignment padding included
+  uint32_t us;          // time spent programming
+  uint32_t errors;      // failed program operations
+} platform_flash_stats_t;
+
+int platform_flash_flush( void );
+void platform_flash_get_stats( platform_flash_stats_t *stats, bool reset );
+
 // *****************************************************************************
 // Allocator support
 
@@ -15,59 +15,22 @@ static u8_t *spiffs_work_buf;
 static u8_t *spiffs_fd_buf;
 static u8_t *spiffs_cache_buf;
 
-#define FLASH_UNIT_SIZE 4
-
-static s32_t esp_spiffs_readwrite(u32_t addr, u32_t size, u8_t *p, int write)
+// Reads and writes go through the platform layer, which aligns them and
+// combines small writes into whole flash pages
+static s32_t esp_spiffs_read(u32_t addr, u32_t size, u8_t *dst)
 {
-    /*
-     * With proper configurarion spiffs never reads or writes more than
-     * LOG_PAGE_SIZE
-     */
-
-    if (size > fs.cfg.log_page_size) {
-        printf("Invalid size provided to read/write (%d)\n\r", (int) size);
-        return SPIFFS_ERR_NOT_CONFIGURED;
-    }
-
-    char tmp_buf[fs.cfg.log_page_size + FLASH_UNIT_SIZE * 2];
-    u32_t aligned_addr = addr & (-FLASH_UNIT_SIZE);
-    u32_t aligned_size =
-        ((size + (FLASH_UNIT_SIZE - 1)) & -FLASH_UNIT_SIZE) + FLASH_UNIT_SIZE;
-
-    int res = spi_flash_read(aligned_addr, (u32_t *) tmp_buf, aligned_size);
-
-    if (res != 0) {
-        printf("spi_flash_read failed: %d (%d, %d)\n\r", res, (int) aligned_addr,
-               (int) aligned_size);
-        return res;
-    }
-
-    if (!write) {
-        memcpy(p, tmp_buf + (addr - aligned_addr), size);
-        return SPIFFS_OK;
-    }
-
-    memcpy(tmp_buf + (addr - aligned_addr), p, size);
-
-    res = spi_flash_write(aligned_addr, (u32_t *) tmp_buf, aligned_size);
-
-    if (res != 0) {
-//	    printf("spi_flash_write failed: %d (%d, %d)\n\r", res,
-//	              (int) aligned_addr, (int) aligned_size);
-        return res;
+    if (platform_flash_read(dst, addr, size) != size) {
+        return SPIFFS_ERR_INTERNAL;
     }
-
     return SPIFFS_OK;
 }
 
-static s32_t esp_spiffs_read(u32_t addr, u32_t size, u8_t *dst)
-{
-    return esp_spiffs_readwrite(addr, size, dst, 0);
-}
-
 static s32_t esp_spiffs_write(u32_t addr, u32_t size, u8_t *src)
 {
-    return esp_spiffs_readwrite(addr, size, src, 1);
+    if (platform_flash_write(src, addr, size) != size) {
+        return SPIFFS_ERR_INTERNAL;
+    }
+    return SPIFFS_OK;
 }
 
 static s32_t esp_spiffs_erase(u32_t addr, u32_t size)
@@ -82,7 +45,10 @@ static s32_t esp_spiffs_erase(u32_t addr, u32_t size)
         return SPIFFS_ERR_NOT_CONFIGURED;
     }
 
-    return spi_flash_erase_sector(addr / fs.cfg.phys_erase_block);
+    if (platform_flash_erase_sector(addr / fs.cfg.phys_erase_block) != PLATFORM_OK) {
+        return SPIFFS_ERR_INTERNAL;
+    }
+    return SPIFFS_OK;
 }
 
 s32_t esp_spiffs_init(struct esp_spiffs_config *config)
@@ -240,6 +206,7 @@ int myspiffs_open(const char *name, int flags){
 
 int myspiffs_close( int fd ){
   SPIFFS_close(&fs, (spiffs_file)fd);
+  platform_flash_flush();
   return 0;
 }
 
@@ -276,7 +243,9 @@ int myspiffs_ungetc( int c, int fd ){
 }
 
 int myspiffs_flush( int fd ){
-  return 0;
+  if (SPIFFS_fflush(&fs, (spiffs_file)fd) < 0)
+    return -1;
+  return platform_flash_flush() == PLATFORM_OK ? 0 : -1;
 }
 int myspiffs_error( int fd ){
   return 0;
@@ -0,0 +1,177 @@
+/**
+  Task queues for the Lua task, ported from the ESP32 tree. There the Lua
+  task blocks on a semaphore of its own; here it is the uart task, so a
+  post wakes it through the uart queue, once per batch.
+ */
+#include "task/task.h"
+#include "c_stdlib.h"
+#include "c_string.h"
+
+#include "esp_common.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "uart.h"
+
+#define TASK_HANDLE_MONIKER 0x68680000
+#define TASK_HANDLE_MASK    0xFFF80000
+#define TASK_HANDLE_UNMASK  (~TASK_HANDLE_MASK)
+#define TASK_HANDLE_ALLOCATION_BRICK 4   // must be a power of 2
+
+#define TASK_DEFAULT_QUEUE_LEN 8
+
+#define CHECK(p,v,msg) if (!(p)) { NODE_DBG ( msg ); return (v); }
+
+#ifndef NODE_DBG
+# define NODE_DBG(...) do{}while(0)
+#endif
+
+// The dispatcher runs for every event, so it goes with the VM hot path
+#ifdef LUA_IRAM_HOTPATH
+# define TASK_HOT IRAM_ATTR
+#else
+# define TASK_HOT
+#endif
+
+typedef struct
+{
+  task_handle_t sig;
+  task_param_t par;
+} task_event_t;
+
+/*
+ * Private arrays to hold the 3 event task queues and the dispatch callbacks
+ */
+static xQueueHandle task_Q[TASK_PRIORITY_COUNT];
+
+static task_callback_t *task_func;
+static int task_count;
+
+/* Per-handle flag set while a coalesced post for that handle is queued */
+static volatile uint8 *task_coalesce;
+
+/* Set while a wakeup for the pump sits in the uart queue */
+static volatile bool pump_posted;
+
+
+/*
+ * Initialise the task handle callback for a given priority.  This doesn't need
+ * to be called explicitly as the get_id function will call this lazily.
+ */
+bool task_init_handler(task_prio_t priority, uint8 qlen) {
+  if (priority >= TASK_PRIORITY_COUNT || task_Q[priority] != NULL)
+    return false;
+  task_Q[priority] = xQueueCreate (qlen, sizeof (task_event_t));
+  return task_Q[priority] != NULL;
+}
+
+
+task_handle_t task_get_id(task_callback_t t) {
+  /* Initialise any uninitialised Qs with the default Q len */
+  for (task_prio_t p = TASK_PRIORITY_LOW; p != TASK_PRIORITY_COUNT; ++p)
+  {
+    if (!task_Q[p]) {
+      CHECK(task_init_handler( p, TASK_DEFAULT_QUEUE_LEN ), 0, "Task initialisation failed");
+    }
+  }
+
+  if ( (task_count & (TASK_HANDLE_ALLOCATION_BRICK - 1)) == 0 ) {
+    /* With a brick size of 4 this branch is taken at 0, 4, 8 ... and the new size is +4 */
+    task_callback_t *func = (task_callback_t *)c_realloc(
+      task_func,
+      sizeof(task_callback_t)*(task_count+TASK_HANDLE_ALLOCATION_BRICK));
+    CHECK(func, 0 , "Malloc failure in task_get_id");
+    c_memset (func+task_count, 0, sizeof(task_callback_t)*TASK_HANDLE_ALLOCATION_BRICK);
+    task_func = func;
+
+    uint8 *flags = (uint8 *)c_realloc(
+      (void *)task_coalesce,
+      sizeof(uint8)*(task_count+TASK_HANDLE_ALLOCATION_BRICK));
+    CHECK(flags, 0 , "Malloc failure in task_get_id");
+    c_memset (flags+task_count, 0, sizeof(uint8)*TASK_HANDLE_ALLOCATION_BRICK);
+    task_coalesce = flags;
+  }
+
+  task_func[task_count] = t;
+  return TASK_HANDLE_MONIKER | task_count++;
+}
+
+
+bool task_post (task_prio_t priority, task_handle_t handle, task_param_t param)
+{
+  if (priority >= TASK_PRIORITY_COUNT ||
+      !task_Q[priority] ||
+      (handle & TASK_HANDLE_MASK) != TASK_HANDLE_MONIKER)
+    return false;
+
+  task_event_t ev = { handle, param };
+  if (xQueueSendToBack (task_Q[priority], &ev, 0) != pdPASS)
+    return false;
+
+  /* One wakeup covers every event queued before the pump gets to run */
+  bool wake = false;
+  portENTER_CRITICAL ();
+  if (!pump_posted)
+    wake = pump_posted = true;
+  portEXIT_CRITICAL ();
+  if (wake && !uart_post_lua_task (task_pump_messages))
+    pump_posted = false;  /* the next post tries again */
+  return true;
+}
+
+
+bool task_post_coalesced (task_prio_t priority, task_handle_t handle, task_param_t param)
+{
+  if ((handle & TASK_HANDLE_MASK) != TASK_HANDLE_MONIKER)
+    return false;
+  uint16 entry = (handle & TASK_HANDLE_UNMASK);
+  if (!task_coalesce || entry >= task_count)
+    return false;
+
+  bool queued;
+  portENTER_CRITICAL ();
+  queued = task_coalesce[entry];
+  task_coalesce[entry] = 1;
+  portEXIT_CRITICAL ();
+  if (queued)
+    return true;  /* the pending event will pick up this work too */
+
+  if (!task_post (priority, handle, param))
+  {
+    task_coalesce[entry] = 0;
+    return false;
+  }
+  return true;
+}
+
+
+static TASK_HOT bool next_event (task_event_t *ev, task_prio_t *prio)
+{
+  for (task_prio_t pr = TASK_PRIORITY_COUNT; pr != TASK_PRIORITY_LOW; --pr)
+  {
+    task_prio_t p = pr -1;
+    if (task_Q[p] && xQueueReceive (task_Q[p], ev, 0) == pdTRUE)
+    {
+      *prio = p;
+      return true;
+    }
+  }
+  return false; // no events queued
+}
+
+
+TASK_HOT void task_pump_messages (void)
+{
+  task_event_t ev;
+  task_prio_t prio;
+
+  /* Cleared first, so a post from here on wakes us again */
+  pump_posted = false;
+  while (next_event (&ev, &prio))
+  {
+    uint16 entry = (ev.sig & TASK_HANDLE_UNMASK);
+    if (entry >= task_count || !task_func[entry])
+      continue;
+    task_coalesce[entry] = 0;
+    task_func[entry] (ev.par, prio);
+  }
+}
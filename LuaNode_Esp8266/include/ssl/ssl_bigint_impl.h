@@ -36,9 +36,11 @@
 #ifdef CONFIG_BIGINT_CRT
 #define BIGINT_P_OFFSET     1    /**< p modulo offset. */
 #define BIGINT_Q_OFFSET     2    /**< q module offset. */
-#define BIGINT_NUM_MODS     3    /**< The number of modulus constants used. */
+#define BIGINT_T_OFFSET     3    /**< Temporary modulo offset. */
+#define BIGINT_NUM_MODS     4    /**< The number of modulus constants used. */
 #else
-#define BIGINT_NUM_MODS     1    
+#define BIGINT_T_OFFSET     1    
+#define BIGINT_NUM_MODS     2    
 #endif
 
 /* Architecture specific functions for big ints */
@@ -115,9 +117,6 @@ typedef struct /**< A big integer "session" context. */
     int active_count;           /**< Number of active bigints. */
     int free_count;             /**< Number of free bigints. */
 
-#ifdef CONFIG_BIGINT_MONTGOMERY
-    uint8_t use_classical;      /**< Use classical reduction. */
-#endif
     uint8_t mod_offset;         /**< The mod offset we are using */
 } BI_CTX;
 
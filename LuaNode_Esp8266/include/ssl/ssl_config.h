@@ -116,15 +116,15 @@
  * BigInt Options
  */
 #undef CONFIG_BIGINT_CLASSICAL
-#undef CONFIG_BIGINT_MONTGOMERY
-#define CONFIG_BIGINT_BARRETT 1
+#define CONFIG_BIGINT_MONTGOMERY 1
+#undef CONFIG_BIGINT_BARRETT
 #define CONFIG_BIGINT_CRT 1
-#undef CONFIG_BIGINT_KARATSUBA
-#define MUL_KARATSUBA_THRESH 
-#define SQU_KARATSUBA_THRESH 
+#define CONFIG_BIGINT_KARATSUBA 1
+#define MUL_KARATSUBA_THRESH 20
+#define SQU_KARATSUBA_THRESH 40
 #define CONFIG_BIGINT_SLIDING_WINDOW 1
 #define CONFIG_BIGINT_SQUARE 1
-#define CONFIG_BIGINT_CHECK_ON 1
+#undef CONFIG_BIGINT_CHECK_ON
 #define CONFIG_INTEGER_32BIT 1
 #undef CONFIG_INTEGER_16BIT
 #undef CONFIG_INTEGER_8BIT
@@ -747,6 +747,7 @@ void ICACHE_FLASH_ATTR bi_set_mod(BI_CTX *ctx, bigint *bim, int mod_offset)
     comp d = (comp)((long_comp)COMP_RADIX/(bim->comps[k-1]+1));
 #ifdef CONFIG_BIGINT_MONTGOMERY
     bigint *R, *R2;
+    uint8_t old_offset = ctx->mod_offset;
 #endif
 
     ctx->bi_mod[mod_offset] = bim;
@@ -755,11 +756,14 @@ void ICACHE_FLASH_ATTR bi_set_mod(BI_CTX *ctx, bigint *bim, int mod_offset)
     bi_permanent(ctx->bi_normalised_mod[mod_offset]);
 
 #if defined(CONFIG_BIGINT_MONTGOMERY)
-    /* set montgomery variables */
+    /* set montgomery variables, reducing by this modulus and not whichever
+     * one is in use */
+    ctx->mod_offset = mod_offset;
     R = comp_left_shift(bi_clone(ctx, ctx->bi_radix), k-1);     /* R */
     R2 = comp_left_shift(bi_clone(ctx, ctx->bi_radix), k*2-1);  /* R^2 */
     ctx->bi_RR_mod_m[mod_offset] = bi_mod(ctx, R2);             /* R^2 mod m */
     ctx->bi_R_mod_m[mod_offset] = bi_mod(ctx, R);               /* R mod m */
+    ctx->mod_offset = old_offset;
 
     bi_permanent(ctx->bi_RR_mod_m[mod_offset]);
     bi_permanent(ctx->bi_R_mod_m[mod_offset]);
@@ -1214,11 +1218,6 @@ bigint * ICACHE_FLASH_ATTR bi_mont(BI_CTX *ctx, bigint *bixy)
 
     check(bixy);
 
-    if (ctx->use_classical)     /* just use classical instead */
-    {
-        return bi_mod(ctx, bixy);
-    }
-
     n = bim->size;
 
     do
@@ -1297,7 +1296,7 @@ bigint * ICACHE_FLASH_ATTR bi_barrett(BI_CTX *ctx, bigint *bi)
 }
 #endif /* CONFIG_BIGINT_BARRETT */
 
-#ifdef CONFIG_BIGINT_SLIDING_WINDOW
+#if defined(CONFIG_BIGINT_SLIDING_WINDOW) && !defined(CONFIG_BIGINT_MONTGOMERY)
 /*
  * Work out g1, g3, g5, g7... etc for the sliding-window algorithm 
  */
@@ -1327,6 +1326,109 @@ static void ICACHE_FLASH_ATTR precompute_slide_window(BI_CTX *ctx, int window, b
 }
 #endif
 
+#if defined(CONFIG_BIGINT_MONTGOMERY)
+/*
+ * The exponentiation works on plain arrays of half components. The LX106
+ * only multiplies 16x16->32 in hardware (a 32x32->64 product is a libgcc
+ * call), so with 16 bit digits every step of the inner loops is a single
+ * MUL16U, and a[j]*b + t + c can never overflow 32 bits. The comps of a
+ * bigint are little endian words, so they are read as twice as many half
+ * components in place.
+ */
+typedef uint16_t hcomp;
+
+/*
+ * r = a*b*R^-1 mod m, where a, b < m, all n half components long and m odd.
+ * This is the CIOS method: each digit of b is multiplied in and reduced
+ * straight away, so the running total t only ever needs n+2 half components
+ * and nothing is allocated. r may be a or b. It's the innermost loop of
+ * every RSA operation, so it lives in IRAM rather than going through the
+ * flash cache.
+ */
+static void IRAM_ATTR mont_mul(hcomp *r, const hcomp *a, const hcomp *b,
+        const hcomp *m, int n, hcomp minv, hcomp *t)
+{
+    int i, j;
+    uint32_t s, c;
+    hcomp q;
+
+    memset(t, 0, (n+2)*sizeof(hcomp));
+
+    for (i = 0; i < n; i++)
+    {
+        uint32_t bi = b[i];
+
+        c = 0;
+        for (j = 0; j < n; j++)
+        {
+            s = a[j]*bi + t[j] + c;
+            t[j] = (hcomp)s;
+            c = s >> 16;
+        }
+
+        s = t[n] + c;
+        t[n] = (hcomp)s;
+        t[n+1] = (hcomp)(s >> 16);
+
+        /* add the multiple of m that clears the bottom digit, and shift */
+        q = (hcomp)((uint32_t)t[0]*minv);
+        s = (uint32_t)m[0]*q + t[0];
+        c = s >> 16;
+
+        for (j = 1; j < n; j++)
+        {
+            s = (uint32_t)m[j]*q + t[j] + c;
+            t[j-1] = (hcomp)s;
+            c = s >> 16;
+        }
+
+        s = t[n] + c;
+        t[n-1] = (hcomp)s;
+        t[n] = t[n+1] + (hcomp)(s >> 16);
+    }
+
+    /* t < 2m: one subtraction at most brings it into range */
+    if (t[n] == 0)
+    {
+        for (j = n-1; j >= 0 && t[j] == m[j]; j--)
+            ;
+
+        if (j >= 0 && t[j] < m[j])
+        {
+            memcpy(r, t, n*sizeof(hcomp));
+            return;
+        }
+    }
+
+    c = 0;
+    for (j = 0; j < n; j++)
+    {
+        s = (uint32_t)t[j] - m[j] - c;
+        r[j] = (hcomp)s;
+        c = (s >> 16) & 1;
+    }
+}
+
+/*
+ * The window that makes the fewest multiplications for an exponent of this
+ * many bits, counting the table. Kept to 5 (16 entries) as beyond that the
+ * table for a 2048 bit modulus gets too big for the heap.
+ */
+static int ICACHE_FLASH_ATTR mont_window_size(int bits)
+{
+#ifdef CONFIG_BIGINT_SLIDING_WINDOW
+    if (bits > 239)
+        return 5;
+    else if (bits > 79)
+        return 4;
+    else if (bits > 23)
+        return 3;
+    else if (bits > 7)
+        return 2;
+#endif
+    return 1;
+}
+
 /**
  * @brief Perform a modular exponentiation.
  *
@@ -1340,20 +1442,130 @@ static void ICACHE_FLASH_ATTR precompute_slide_window(BI_CTX *ctx, int window, b
  */
 bigint * ICACHE_FLASH_ATTR bi_mod_power(BI_CTX *ctx, bigint *bi, bigint *biexp)
 {
-    int i = find_max_exp_index(biexp), j, window_size = 1;
-    bigint *biR = int_to_bi(ctx, 1);
-
-#if defined(CONFIG_BIGINT_MONTGOMERY)
     uint8_t mod_offset = ctx->mod_offset;
-    if (!ctx->use_classical)
+    bigint *bim = ctx->bi_mod[mod_offset];
+    int k = bim->size, n = k*2;
+    int i = find_max_exp_index(biexp), j, l, window_size, window;
+    hcomp minv = (hcomp)ctx->N0_dash[mod_offset];
+    comp *mem;
+    hcomp *g, *acc, *tmp, *t, *m = (hcomp *)bim->comps;
+    bigint *biR;
+    int started = 0;
+
+    check(bi);
+    check(biexp);
+
+    /* Montgomery needs x < m, which isn't so for the CRT halves. bi_divide()
+     * can work in place, and bi_crt() passes the same x for both. */
+    if (bi_compare(bi, bim) >= 0)
     {
-        /* preconvert */
-        bi = bi_mont(ctx, 
-                bi_multiply(ctx, bi, ctx->bi_RR_mod_m[mod_offset]));    /* x' */
-        bi_free(ctx, biR);
-        biR = ctx->bi_R_mod_m[mod_offset];                              /* A */
+        bigint *x = bi_clone(ctx, bi);
+        bi_free(ctx, bi);
+        bi = bi_mod(ctx, x);
     }
-#endif
+
+    window_size = mont_window_size(i+1);
+    window = 1 << (window_size-1);
+
+    /* g1, g3, g5... then a temporary, the accumulator and the product, as
+     * one block */
+    mem = (comp *)malloc((window*k + 2*k + k+1)*COMP_BYTE_SIZE);
+    g = (hcomp *)mem;
+    tmp = g + window*n;
+    acc = tmp + n;
+    t = acc + n;
+
+    /* x' = x*R mod m, from x and R^2 mod m padded out to the modulus */
+    memset(tmp, 0, 2*n*sizeof(hcomp));
+    memcpy(tmp, bi->comps, bi->size*COMP_BYTE_SIZE);
+    memcpy(acc, ctx->bi_RR_mod_m[mod_offset]->comps, 
+            ctx->bi_RR_mod_m[mod_offset]->size*COMP_BYTE_SIZE);
+    mont_mul(g, tmp, acc, m, n, minv, t);
+
+    if (window > 1)
+    {
+        mont_mul(tmp, g, g, m, n, minv, t);     /* x'^2 */
+
+        for (j = 1; j < window; j++)
+        {
+            mont_mul(g + j*n, g + (j-1)*n, tmp, m, n, minv, t);
+        }
+    }
+
+    /* the accumulator starts at 1, which is R mod m */
+    memset(acc, 0, n*sizeof(hcomp));
+    memcpy(acc, ctx->bi_R_mod_m[mod_offset]->comps, 
+            ctx->bi_R_mod_m[mod_offset]->size*COMP_BYTE_SIZE);
+
+    while (i >= 0)
+    {
+        if (exp_bit_is_one(biexp, i))
+        {
+            int part_exp = 0;
+
+            l = i-window_size+1;
+
+            if (l < 0)
+                l = 0;
+
+            while (exp_bit_is_one(biexp, l) == 0)
+                l++;
+
+            /* build up the section of the exponent */
+            for (j = i; j >= l; j--)
+            {
+                if (started)
+                    mont_mul(acc, acc, acc, m, n, minv, t);
+
+                part_exp = (part_exp << 1) | exp_bit_is_one(biexp, j);
+            }
+
+            part_exp = (part_exp-1)/2;  /* adjust for array */
+
+            /* the first window needs no squarings of 1 and no multiply */
+            if (started)
+                mont_mul(acc, acc, g + part_exp*n, m, n, minv, t);
+            else
+                memcpy(acc, g + part_exp*n, n*sizeof(hcomp));
+
+            started = 1;
+            i = l-1;
+        }
+        else    /* square it */
+        {
+            mont_mul(acc, acc, acc, m, n, minv, t);
+            i--;
+        }
+    }
+
+    /* convert back: multiplying by 1 divides by R */
+    memset(tmp, 0, n*sizeof(hcomp));
+    tmp[0] = 1;
+    biR = alloc(ctx, k);
+    mont_mul((hcomp *)biR->comps, acc, tmp, m, n, minv, t);
+
+    free(mem);
+    bi_free(ctx, bi);
+    bi_free(ctx, biexp);
+    return trim(biR);
+}
+
+#else /* CONFIG_BIGINT_CLASSICAL or CONFIG_BIGINT_BARRETT */
+/**
+ * @brief Perform a modular exponentiation.
+ *
+ * This function requires bi_set_mod() to have been called previously. This is 
+ * one of the optimisations used for performance.
+ * @param ctx [in]  The bigint session context.
+ * @param bi  [in]  The bigint on which to perform the mod power operation.
+ * @param biexp [in] The bigint exponent.
+ * @return The result of the mod exponentiation operation
+ * @see bi_set_mod().
+ */
+bigint * ICACHE_FLASH_ATTR bi_mod_power(BI_CTX *ctx, bigint *bi, bigint *biexp)
+{
+    int i = find_max_exp_index(biexp), j, window_size = 1;
+    bigint *biR = int_to_bi(ctx, 1);
 
     check(bi);
     check(biexp);
@@ -1420,12 +1632,9 @@ bigint * ICACHE_FLASH_ATTR bi_mod_power(BI_CTX *ctx, bigint *bi, bigint *biexp)
     free(ctx->g);
     bi_free(ctx, bi);
     bi_free(ctx, biexp);
-#if defined CONFIG_BIGINT_MONTGOMERY
-    return ctx->use_classical ? biR : bi_mont(ctx, biR); /* convert back */
-#else /* CONFIG_BIGINT_CLASSICAL or CONFIG_BIGINT_BARRETT */
     return biR;
-#endif
 }
+#endif
 
 #ifdef CONFIG_SSL_CERT_VERIFICATION
 /**
@@ -1442,25 +1651,17 @@ bigint * ICACHE_FLASH_ATTR bi_mod_power(BI_CTX *ctx, bigint *bi, bigint *biexp)
  */
 bigint * ICACHE_FLASH_ATTR bi_mod_power2(BI_CTX *ctx, bigint *bi, bigint *bim, bigint *biexp)
 {
-    bigint *biR, *tmp_biR;
-
-    /* Set up a temporary bigint context and transfer what we need between
-     * them. We need to do this since we want to keep the original modulus
-     * which is already in this context. This operation is only called when
-     * doing peer verification, and so is not expensive :-) */
-    BI_CTX *tmp_ctx = bi_initialize();
-    bi_set_mod(tmp_ctx, bi_clone(tmp_ctx, bim), BIGINT_M_OFFSET);
-    tmp_biR = bi_mod_power(tmp_ctx, 
-                bi_clone(tmp_ctx, bi), 
-                bi_clone(tmp_ctx, biexp));
-    biR = bi_clone(ctx, tmp_biR);
-    bi_free(tmp_ctx, tmp_biR);
-    bi_free_mod(tmp_ctx, BIGINT_M_OFFSET);
-    bi_terminate(tmp_ctx);
+    bigint *biR;
+    uint8_t mod_offset = ctx->mod_offset;
 
-    bi_free(ctx, bi);
-    bi_free(ctx, bim);
-    bi_free(ctx, biexp);
+    /* The modulus goes in a slot of its own for the length of the call, so
+     * the one already in this context is kept, and its free list is reused
+     * rather than setting up a new context for every certificate. */
+    bi_set_mod(ctx, bim, BIGINT_T_OFFSET);
+    ctx->mod_offset = BIGINT_T_OFFSET;
+    biR = bi_mod_power(ctx, bi, biexp);
+    ctx->mod_offset = mod_offset;
+    bi_free_mod(ctx, BIGINT_T_OFFSET);
     return biR;
 }
 #endif
@@ -1484,11 +1685,7 @@ bigint * ICACHE_FLASH_ATTR bi_crt(BI_CTX *ctx, bigint *bi,
 {
     bigint *m1, *m2, *h;
 
-    /* Montgomery has a condition the 0 < x, y < m and these products violate
-     * that condition. So disable Montgomery when using CRT */
-#if defined(CONFIG_BIGINT_MONTGOMERY)
-    ctx->use_classical = 1;
-#endif
+    /* bi_mod_power() reduces x mod p and q first, as Montgomery needs */
     ctx->mod_offset = BIGINT_P_OFFSET;
     m1 = bi_mod_power(ctx, bi_copy(bi), dP);
 
@@ -1498,9 +1695,10 @@ bigint * ICACHE_FLASH_ATTR bi_crt(BI_CTX *ctx, bigint *bi,
     h = bi_subtract(ctx, bi_add(ctx, m1, p), bi_copy(m2), NULL);
     h = bi_multiply(ctx, h, qInv);
     ctx->mod_offset = BIGINT_P_OFFSET;
-    h = bi_residue(ctx, h);
 #if defined(CONFIG_BIGINT_MONTGOMERY)
-    ctx->use_classical = 0;         /* reset for any further operation */
+    h = bi_mod(ctx, h);             /* a Montgomery reduction would leave R^-1 */
+#else
+    h = bi_residue(ctx, h);
 #endif
     return bi_add(ctx, m2, bi_multiply(ctx, q, h));
 }
@@ -0,0 +1,132 @@
+#!/usr/bin/env python
+#
+# IRAM budget of an ESP8266 image, and where the functions the Lua VM
+# runs all the time ended up. Code in flash runs through the 32K
+# instruction cache; IRAM is 32K too, shared with the SDK.
+#
+#   cd components && make iram_report
+#   python ../tools/iram_report.py --nm xtensa-lx106-elf-nm \
+#       --map .output/eagle/debug/image/eagle.app.v6.map \
+#       .output/eagle/debug/image/eagle.app.v6.out
+#
+# The map comes from the -Map option in components/Makefile. Build once
+# with and once without LUA_IRAM=1 to see what the hot path costs.
+
+import argparse
+import re
+import subprocess
+import sys
+
+# Called for nearly every Lua instruction, table access or string made;
+# the first group is what LUA_IRAM=1 moves, the rest are worth watching
+HOT = [
+    'luaV_execute', 'luaH_get', 'luaH_getnum', 'luaH_getstr', 'hashnum',
+    'mainposition', 'luaS_newlstr', 'luaS_newlstr_helper', 'luaM_realloc_',
+    'task_pump_messages', 'next_event',
+    None,
+    'luaV_gettable', 'luaV_settable', 'luaV_lessthan', 'luaV_equalval',
+    'luaV_tonumber', 'luaD_precall', 'luaD_poscall', 'luaH_set',
+    'luaH_setnum', 'luaH_setstr', 'luaC_step', 'luaF_close',
+    'luaR_findentry', 'luaT_gettmbyobj',
+]
+
+REGIONS = [
+    ('rom',   0x40000000, 0x40070000),
+    ('iram',  0x40100000, 0x40108000),
+    ('flash', 0x40200000, 0x40300000),
+]
+
+
+def region(addr):
+    for name, lo, hi in REGIONS:
+        if lo <= addr < hi:
+            return name
+    return '?'
+
+
+def read_map(path):
+    with open(path) as f:
+        text = f.read()
+    m = re.search(r'^iram1_0_seg\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)', text, re.M)
+    budget = int(m.group(2), 16) if m else 0x8000
+
+    # Input sections placed in the .text output section, i.e. in IRAM.
+    # ld puts a long section name on a line of its own.
+    per_lib = {}
+    used = 0
+    in_text = False
+    pending = None
+    for line in text.splitlines():
+        if re.match(r'^\.text\s', line) or line == '.text':
+            in_text = True
+            continue
+        if in_text and re.match(r'^\.\S', line):
+            break
+        if not in_text:
+            continue
+        m = re.match(r'^ (\S+)$', line)
+        if m:
+            pending = m.group(1)
+            continue
+        m = re.match(r'^ (\S+)?\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S+)', line)
+        if m and (m.group(1) or pending):
+            size = int(m.group(3), 16)
+            src = m.group(4)
+            lib = re.sub(r'\(.*\)$', '', src).split('/')[-1]
+            per_lib[lib] = per_lib.get(lib, 0) + size
+            used += size
+        pending = None
+    return budget, used, per_lib
+
+
+def read_syms(nm, elf):
+    out = subprocess.check_output([nm, '-S', elf]).decode()
+    syms = {}
+    for line in out.splitlines():
+        f = line.split()
+        if len(f) == 4 and f[2] in 'tTwW':
+            syms[f[3]] = (int(f[0], 16), int(f[1], 16))
+    return syms
+
+
+def main():
+    parser = argparse.ArgumentParser(description='ESP8266 IRAM report')
+    parser.add_argument('elf')
+    parser.add_argument('--map', required=True)
+    parser.add_argument('--nm', default='xtensa-lx106-elf-nm')
+    parser.add_argument('--top', type=int, default=20)
+    args = parser.parse_args()
+
+    budget, used, per_lib = read_map(args.map)
+    syms = read_syms(args.nm, args.elf)
+
+    print('IRAM: %d of %d bytes used, %d free' % (used, budget, budget - used))
+    for lib, size in sorted(per_lib.items(), key=lambda x: -x[1]):
+        print('  %6d  %s' % (size, lib))
+
+    print('\nLargest functions in IRAM:')
+    iram = [(s, n) for n, (a, s) in syms.items() if region(a) == 'iram']
+    for size, name in sorted(iram, reverse=True)[:args.top]:
+        print('  %6d  %s' % (size, name))
+
+    print('\nHot path:')
+    flash = 0
+    for name in HOT:
+        if name is None:
+            print('  --')
+            continue
+        if name not in syms:
+            print('  %-22s  (inlined or not linked)' % name)
+            continue
+        addr, size = syms[name]
+        where = region(addr)
+        if where == 'flash':
+            flash += size
+        print('  %-22s  %-5s %6d' % (name, where, size))
+    print('\n%d bytes of the hot path run from flash' % flash)
+    if used > budget:
+        sys.exit('IRAM overflow by %d bytes' % (used - budget))
+
+
+if __name__ == '__main__':
+    main()